@@ -37,6 +37,9 @@ Window {
     property string cloudinitwrite
     property string cloudinitnetwork
     property string savedPasswordCrypt6: ""
+    /* Number of prepareSecrets() calls secretsPrepared() has not come for yet */
+    property int secretsPending: 0
+    property bool savePending: false
 
     signal saveSettingsSignal(var settings)
 
@@ -220,6 +223,7 @@ Window {
                                     indicateError = false
                                 }
                             }
+                            onEditingFinished: prepareSecrets()
                         }
                     }
 
@@ -279,6 +283,7 @@ Window {
                             onTextEdited: {
                                 indicateError = false
                             }
+                            onEditingFinished: prepareSecrets()
                         }
                     }
 
@@ -555,7 +560,6 @@ Window {
                             onClicked: {
                                 enabled = false
                                 imageWriter.generatePubKey()
-                                publicKeyModel.append({publicKeyField: imageWriter.getDefaultPubKey()})
                             }
                         }
                         ImButton {
@@ -688,15 +692,16 @@ Window {
                                 topPadding: 0
                                 Layout.minimumHeight: 30
                                 Layout.preferredWidth: 120
-                                model: imageWriter.getSerialPortList()
+                                model: imageWriter.serialPorts
                                 onCurrentIndexChanged: onSerialPortSelected(model[currentIndex])
+                                // The list is filled in the background and changes as ports come and go
+                                onModelChanged: Qt.callLater(function () { onSerialPortSelected(model[currentIndex]) })
                             }
 
                             ImButton {
                                 text: "⟲"
                                 onClicked: function () {
-                                    serialPortSel.model = imageWriter.getSerialPortList()
-                                    serialPortSel.currentIndexChanged()
+                                    imageWriter.refreshPortList()
                                 }
                                 Layout.preferredWidth: 30
                             }
@@ -722,8 +727,9 @@ Window {
                                 Layout.minimumHeight: 30
                                 Layout.preferredWidth: 120
 
-                                model: imageWriter.getEthPortList()
+                                model: imageWriter.ethPorts
                                 onCurrentIndexChanged: onEthPortSelected(model[currentIndex])
+                                onModelChanged: Qt.callLater(function () { onEthPortSelected(model[currentIndex]) })
                             }
 
                             // ImButton {
@@ -750,6 +756,7 @@ Window {
 
             ImButtonRed {
                 text: qsTr("SAVE")
+                enabled: !savePending
                 onClicked: {
                     if (chkSetUser.checked && fieldUserPassword.text.length == 0)
                     {
@@ -805,9 +812,9 @@ Window {
                         }
                     }
 
-                    applySettings()
-                    saveSettings()
-                    popup.close()
+                    /* Continued by onSecretsPrepared() */
+                    savePending = true
+                    prepareSecrets()
                 }
             }
 
@@ -983,6 +990,29 @@ Window {
         initialized = true
     }
 
+    /* Passwords are hashed in the background as soon as they are entered, saving only waits for what is left */
+    function prepareSecrets() {
+        var password = chkSetUser.checked && !fieldUserPassword.alreadyCrypted ? fieldUserPassword.text : ""
+        const isPassphrase = chkWifi.checked && fieldWifiPassword.text.length >= 8 &&
+            fieldWifiPassword.text.length < 64
+        secretsPending++
+        imageWriter.prepareSecrets(password, isPassphrase ? fieldWifiPassword.text : "", fieldWifiSSID.text)
+    }
+
+    function onSecretsPrepared() {
+        secretsPending--
+        if (savePending && !secretsPending) {
+            savePending = false
+            applySettings()
+            saveSettings()
+            popup.close()
+        }
+    }
+
+    function onPubKeyGenerated() {
+        publicKeyModel.append({publicKeyField: imageWriter.getDefaultPubKey()})
+    }
+
     function openPopup() {
         if (!initialized) {
             initialize()
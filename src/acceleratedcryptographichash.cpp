@@ -0,0 +1,44 @@
+/*
+ * Backend independent part of AcceleratedCryptographicHash
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "acceleratedcryptographichash.h"
+#include "sha256native.h"
+
+bool AcceleratedCryptographicHash::_nativeEnabled = true;
+
+void AcceleratedCryptographicHash::addData(AcceleratedCryptographicHash *const *hashes, const char *const *data, const size_t *lengths, size_t count)
+{
+    const size_t maxStreams = 8;
+    Sha256Native *native[maxStreams];
+    bool allNative = count <= maxStreams;
+
+    for (size_t i = 0; i < count && allNative; i++)
+    {
+        native[i] = hashes[i]->p_Native.get();
+        allNative = native[i] != nullptr;
+    }
+
+    if (allNative)
+    {
+        Sha256Native::addData(native, data, lengths, count);
+    }
+    else
+    {
+        for (size_t i = 0; i < count; i++)
+            hashes[i]->addData(data[i], lengths[i]);
+    }
+}
+
+const char *AcceleratedCryptographicHash::nativeImplementation()
+{
+    return _nativeEnabled ? Sha256Native::implementation() : nullptr;
+}
+
+void AcceleratedCryptographicHash::setNativeEnabled(bool enabled)
+{
+    _nativeEnabled = enabled;
+}
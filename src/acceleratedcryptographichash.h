@@ -9,18 +9,38 @@
 #include <QCryptographicHash>
 #include <memory>
 
+class Sha256Native;
+
+/*
+ * SHA256 using the CPU's SHA instructions if available (see sha256native.h),
+ * and the platform's crypto library otherwise
+ */
 struct AcceleratedCryptographicHash
 {
 private:
     struct impl;
     std::unique_ptr<impl> p_Impl;
+    std::unique_ptr<Sha256Native> p_Native;
+
+    static bool _nativeEnabled;
 
 public:
     explicit AcceleratedCryptographicHash(QCryptographicHash::Algorithm method);
     ~AcceleratedCryptographicHash();
-    void addData(const char *data, int length);
+    void addData(const char *data, size_t length);
     void addData(const QByteArray &data);
+    /* Can be called multiple times, returns the same value */
     QByteArray result();
+
+    /* Add data to several independent hashes in one call, e.g. the cache and image stream.
+       On the native path the streams are processed interleaved */
+    static void addData(AcceleratedCryptographicHash *const *hashes, const char *const *data, const size_t *lengths, size_t count);
+
+    /* Name of the CPU instructions used by hashes created from now on, or nullptr
+       if the crypto library is used */
+    static const char *nativeImplementation();
+    /* Allows forcing the crypto library backend, for benchmarking */
+    static void setNativeEnabled(bool enabled);
 };
 
 #endif // ACCELERATEDCRYPTOGRAPHICHASH_H
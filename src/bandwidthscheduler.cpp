@@ -0,0 +1,129 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bandwidthscheduler.h"
+#include "config.h"
+#include <QThread>
+
+std::mutex BandwidthScheduler::_mutex;
+quint64 BandwidthScheduler::_limit = 0;
+int BandwidthScheduler::_running[BandwidthScheduler::PriorityCount] = {0};
+
+namespace
+{
+    const int weights[BandwidthScheduler::PriorityCount] = {1, 8, 64};
+}
+
+void BandwidthScheduler::setLimit(quint64 bytesPerSecond)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _limit = bytesPerSecond;
+}
+
+quint64 BandwidthScheduler::limit()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _limit;
+}
+
+double BandwidthScheduler::_rate(Priority priority)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    if (!_limit)
+    {
+        if (priority == PriorityBackground && (_running[PriorityNormal] || _running[PriorityUrgent]))
+            return IMAGEWRITER_BANDWIDTH_BACKGROUND_RATE;
+        return 0;
+    }
+
+    int total = 0;
+    for (int i = 0; i < PriorityCount; i++)
+        total += _running[i] * weights[i];
+    /* Asked by a job that did not begin() */
+    if (!total)
+        return _limit;
+
+    return (double) _limit * weights[priority] / total;
+}
+
+BandwidthScheduler::Job::Job(Priority priority)
+    : _priority(priority), _cancelled(false), _begun(false), _tokens(0)
+{
+}
+
+BandwidthScheduler::Job::~Job()
+{
+    end();
+}
+
+void BandwidthScheduler::Job::setPriority(Priority priority)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_begun)
+    {
+        _running[_priority]--;
+        _running[priority]++;
+    }
+    _priority = priority;
+}
+
+BandwidthScheduler::Priority BandwidthScheduler::Job::priority() const
+{
+    return (Priority) _priority.load();
+}
+
+void BandwidthScheduler::Job::begin()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_begun)
+    {
+        _running[_priority]++;
+        _begun = true;
+        _tokens = 0;
+        _lastRefill = std::chrono::steady_clock::now();
+    }
+}
+
+void BandwidthScheduler::Job::end()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_begun)
+    {
+        _running[_priority]--;
+        _begun = false;
+    }
+}
+
+void BandwidthScheduler::Job::cancel()
+{
+    _cancelled = true;
+}
+
+void BandwidthScheduler::Job::acquire(size_t len)
+{
+    _tokens -= len;
+
+    while (!_cancelled)
+    {
+        /* Looked up again after every nap, so a job gets more as soon as another ends */
+        double rate = _rate(priority());
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - _lastRefill).count();
+        _lastRefill = now;
+        if (!rate)
+        {
+            _tokens = 0;
+            return;
+        }
+
+        /* Saves up for bursts of at most 100 ms, so an idle job cannot take the link for long afterwards */
+        _tokens = qMin(_tokens + elapsed * rate, rate / 10);
+        if (_tokens >= 0)
+            return;
+
+        QThread::msleep(qBound(1, (int) (-_tokens * 1000 / rate), 100));
+    }
+}
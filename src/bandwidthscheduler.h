@@ -0,0 +1,89 @@
+#ifndef BANDWIDTHSCHEDULER_H
+#define BANDWIDTHSCHEDULER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+
+/*
+ * Process-wide sharing of download bandwidth between jobs of different priority
+ *
+ * Every download is a job that asks for the bytes it received before passing
+ * them on, and is held back by sleeping in the curl write callback. TCP then
+ * slows the sender down. With a limit set, running jobs share it by weight,
+ * background jobs getting 1/8 of what a normal job gets and normal ones 1/8
+ * of an urgent one. Without a limit only background jobs are held back, to a
+ * trickle while any other download runs.
+ *
+ * The image of the card being written is a normal job, the boot files it
+ * cannot start without are urgent. Speculative downloads like the prefetch
+ * are background jobs.
+ */
+class BandwidthScheduler
+{
+public:
+    enum Priority
+    {
+        PriorityBackground,
+        PriorityNormal,
+        PriorityUrgent,
+        PriorityCount
+    };
+
+    /* Total bytes per second all downloads may receive. 0 for no limit */
+    static void setLimit(quint64 bytesPerSecond);
+    static quint64 limit();
+
+    class Job
+    {
+    public:
+        Job(Priority priority = PriorityNormal);
+        ~Job();
+
+        /* Can be changed while the job runs */
+        void setPriority(Priority priority);
+        Priority priority() const;
+
+        /* The job only takes its share, and holds others back, between begin() and end() */
+        void begin();
+        void end();
+        /* Wait until len more bytes may be received */
+        void acquire(size_t len);
+        /* Stop waiting in acquire(), for good */
+        void cancel();
+
+    protected:
+        std::atomic<int> _priority;
+        std::atomic<bool> _cancelled;
+        bool _begun;
+        /* Bytes that may be received without waiting, negative if more were than the share allows */
+        double _tokens;
+        std::chrono::steady_clock::time_point _lastRefill;
+    };
+
+    /* Runs job for as long as it exists */
+    class Running
+    {
+    public:
+        Running(Job &job) : _job(job) { _job.begin(); }
+        ~Running() { _job.end(); }
+    protected:
+        Job &_job;
+    };
+
+protected:
+    static std::mutex _mutex;
+    static quint64 _limit;
+    static int _running[PriorityCount];
+
+    /* Bytes per second a job of priority gets at the moment, 0 if it is not held back */
+    static double _rate(Priority priority);
+};
+
+#endif // BANDWIDTHSCHEDULER_H
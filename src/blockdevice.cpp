@@ -0,0 +1,110 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "blockdevice.h"
+#include <string.h>
+
+#ifdef Q_OS_WIN
+#include "windows/winblockdevice.h"
+#else
+#include "posixblockdevice.h"
+#endif
+
+BlockDevice::BlockDevice()
+    : _capabilities(0)
+{
+}
+
+BlockDevice::~BlockDevice()
+{
+}
+
+BlockDevice *BlockDevice::create(BlockDeviceFile *file)
+{
+#ifdef Q_OS_WIN
+    return new WinBlockDevice(file);
+#else
+    return new PosixBlockDevice(file->handle());
+#endif
+}
+
+bool BlockDevice::readv(const IoVec *iov, int count, quint64 offset)
+{
+    if (count == 1)
+        return pread(iov[0].data, iov[0].len, offset) == (qint64) iov[0].len;
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++)
+        len += iov[i].len;
+
+    char *buf = (char *) qMallocAligned(len, 4096);
+    if (!buf)
+    {
+        _error = "Out of memory";
+        return false;
+    }
+    bool ok = pread(buf, len, offset) == (qint64) len;
+    if (ok)
+    {
+        char *p = buf;
+        for (int i = 0; i < count; i++)
+        {
+            memcpy(iov[i].data, p, iov[i].len);
+            p += iov[i].len;
+        }
+    }
+    qFreeAligned(buf);
+
+    return ok;
+}
+
+bool BlockDevice::writev(const IoVec *iov, int count, quint64 offset)
+{
+    if (count == 1)
+        return pwrite(iov[0].data, iov[0].len, offset) == (qint64) iov[0].len;
+
+    size_t len = 0;
+    for (int i = 0; i < count; i++)
+        len += iov[i].len;
+
+    char *buf = (char *) qMallocAligned(len, 4096);
+    if (!buf)
+    {
+        _error = "Out of memory";
+        return false;
+    }
+    char *p = buf;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(p, iov[i].data, iov[i].len);
+        p += iov[i].len;
+    }
+    bool ok = pwrite(buf, len, offset) == (qint64) len;
+    qFreeAligned(buf);
+
+    return ok;
+}
+
+bool BlockDevice::discard(quint64, quint64)
+{
+    _error = "Discarding is not supported";
+    return false;
+}
+
+bool BlockDevice::zeroOut(quint64, quint64)
+{
+    _error = "Zeroing out is not supported";
+    return false;
+}
+
+int BlockDevice::capabilities() const
+{
+    return _capabilities;
+}
+
+QString BlockDevice::errorString() const
+{
+    return _error;
+}
@@ -0,0 +1,85 @@
+#ifndef BLOCKDEVICE_H
+#define BLOCKDEVICE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QString>
+
+#ifdef Q_OS_WIN
+#include "windows/winfile.h"
+typedef WinFile BlockDeviceFile;
+#elif defined(Q_OS_DARWIN)
+#include "mac/macfile.h"
+typedef MacFile BlockDeviceFile;
+#else
+#include <QFile>
+typedef QFile BlockDeviceFile;
+#endif
+
+/*
+ * Positional I/O on the storage device written to, or the image file
+ * written instead
+ *
+ * Wraps an open BlockDeviceFile, which stays in charge of opening,
+ * locking and the sequential writes. create() picks the backend of the
+ * platform, and the backend finds out at runtime what it can do with the
+ * file: discarding ranges and having the device write zeroes itself on
+ * storage devices, punching holes and allocating zeroed ranges in
+ * regular files. capabilities() tells which, callers fall back to
+ * writing the data otherwise.
+ *
+ * Offsets are absolute and the file position is left alone, so no seek
+ * is needed. Calls return false or -1 on errors, errorString() says why.
+ */
+class BlockDevice
+{
+public:
+    enum Capability
+    {
+        /* discard() drops the data of a range */
+        CanDiscard = 1,
+        /* zeroOut() makes a range read back as zeroes without sending them */
+        CanZeroOut = 2,
+        /* A regular file rather than a storage device */
+        IsRegularFile = 4
+    };
+
+    struct IoVec
+    {
+        char *data;
+        size_t len;
+    };
+
+    virtual ~BlockDevice();
+    /* Backend for file, which must be open. Owned by the caller, and used only while file is open */
+    static BlockDevice *create(BlockDeviceFile *file);
+
+    virtual qint64 pread(char *buf, size_t len, quint64 offset) = 0;
+    virtual qint64 pwrite(const char *buf, size_t len, quint64 offset) = 0;
+    /* Transfer all of the count buffers of iov, one after another starting at offset. Backends
+       without vectored I/O go through a bounce buffer, aligned for unbuffered handles */
+    virtual bool readv(const IoVec *iov, int count, quint64 offset);
+    virtual bool writev(const IoVec *iov, int count, quint64 offset);
+    /* Only if capabilities() has CanDiscard/CanZeroOut. A backend finding out it cannot do it
+       after all clears the capability */
+    virtual bool discard(quint64 offset, quint64 len);
+    virtual bool zeroOut(quint64 offset, quint64 len);
+    /* Everything written is on the device */
+    virtual bool flush() = 0;
+    /* In bytes, 0 if unknown */
+    virtual quint64 size() = 0;
+
+    int capabilities() const;
+    QString errorString() const;
+
+protected:
+    int _capabilities;
+    QString _error;
+
+    BlockDevice();
+};
+
+#endif // BLOCKDEVICE_H
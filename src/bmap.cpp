@@ -0,0 +1,189 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bmap.h"
+#include <QCryptographicHash>
+#include <QXmlStreamReader>
+#include <QDebug>
+#include <algorithm>
+
+BlockMap::BlockMap()
+    : _imageSize(0), _mappedBytes(0), _blockSize(0), _hasChecksums(false)
+{
+}
+
+void BlockMap::clear()
+{
+    _imageSize = _mappedBytes = 0;
+    _blockSize = 0;
+    _hasChecksums = false;
+    _ranges.clear();
+}
+
+bool BlockMap::parse(const QByteArray &xml)
+{
+    QXmlStreamReader xr(xml);
+    QByteArray checksumType;
+    /* Ranges are in blocks until we know the block size */
+    QVector<QPair<quint64,quint64>> blockRanges;
+    QVector<QByteArray> checksums;
+    bool ok = true;
+
+    clear();
+
+    while (!xr.atEnd() && ok)
+    {
+        if (xr.readNext() != QXmlStreamReader::StartElement)
+            continue;
+
+        if (xr.name() == QLatin1String("ImageSize"))
+        {
+            _imageSize = xr.readElementText().trimmed().toULongLong(&ok);
+        }
+        else if (xr.name() == QLatin1String("BlockSize"))
+        {
+            _blockSize = xr.readElementText().trimmed().toUInt(&ok);
+        }
+        else if (xr.name() == QLatin1String("ChecksumType"))
+        {
+            checksumType = xr.readElementText().trimmed().toLatin1().toLower();
+        }
+        else if (xr.name() == QLatin1String("Range"))
+        {
+            QByteArray chksum = xr.attributes().value("chksum").toLatin1().toLower();
+            QString r = xr.readElementText().trimmed();
+            int dash = r.indexOf('-');
+            quint64 first, last;
+            bool ok2 = true;
+
+            if (dash == -1)
+            {
+                first = last = r.toULongLong(&ok);
+            }
+            else
+            {
+                first = r.left(dash).trimmed().toULongLong(&ok);
+                last = r.mid(dash+1).trimmed().toULongLong(&ok2);
+            }
+            ok = ok && ok2 && last >= first;
+            blockRanges.append(qMakePair(first, last));
+            checksums.append(chksum);
+        }
+    }
+
+    if (xr.hasError())
+    {
+        qDebug() << "Error parsing bmap:" << xr.errorString();
+        ok = false;
+    }
+    if (!ok || !_blockSize || !_imageSize)
+    {
+        qDebug() << "Invalid bmap file";
+        clear();
+        return false;
+    }
+
+    /* Version 1.x of the format used SHA1, which we cannot compare against */
+    _hasChecksums = (checksumType == "sha256");
+    for (int i = 0; i < blockRanges.size(); i++)
+    {
+        Range r;
+        r.offset = blockRanges[i].first * _blockSize;
+        if (r.offset >= _imageSize)
+            continue;
+        r.length = qMin((blockRanges[i].second+1) * _blockSize, _imageSize) - r.offset;
+        r.sha256 = _hasChecksums ? checksums[i] : QByteArray();
+        if (r.sha256.isEmpty())
+            _hasChecksums = false;
+        _ranges.append(r);
+        _mappedBytes += r.length;
+    }
+    std::sort(_ranges.begin(), _ranges.end(), [](const Range &a, const Range &b) {
+        return a.offset < b.offset;
+    });
+
+    qDebug() << "bmap:" << _ranges.size() << "ranges," << _mappedBytes << "of" << _imageSize << "bytes mapped";
+
+    return true;
+}
+
+QByteArray BlockMap::toXml(quint64 imageSize, quint32 blockSize, const QVector<Range> &ranges)
+{
+    quint64 mappedBlocks = 0;
+    QByteArray rangeXml;
+    for (const Range &r : ranges)
+    {
+        quint64 first = r.offset / blockSize, last = (r.offset + r.length - 1) / blockSize;
+        mappedBlocks += last - first + 1;
+        rangeXml += "        <Range chksum=\""+r.sha256+"\"> "
+                + (first == last ? QByteArray::number(first) : QByteArray::number(first)+"-"+QByteArray::number(last))
+                + " </Range>\n";
+    }
+
+    /* The checksum of the file is taken with its own value all zeroes */
+    const QByteArray placeholder(64, '0');
+    QByteArray xml = "<?xml version=\"1.0\" ?>\n"
+            "<bmap version=\"2.0\">\n"
+            "    <ImageSize> "+QByteArray::number(imageSize)+" </ImageSize>\n"
+            "    <BlockSize> "+QByteArray::number(blockSize)+" </BlockSize>\n"
+            "    <BlocksCount> "+QByteArray::number((imageSize + blockSize - 1) / blockSize)+" </BlocksCount>\n"
+            "    <MappedBlocksCount> "+QByteArray::number(mappedBlocks)+" </MappedBlocksCount>\n"
+            "    <ChecksumType> sha256 </ChecksumType>\n"
+            "    <BmapFileChecksum> "+placeholder+" </BmapFileChecksum>\n"
+            "    <BlockMap>\n"
+            + rangeXml +
+            "    </BlockMap>\n"
+            "</bmap>\n";
+    xml.replace(placeholder, QCryptographicHash::hash(xml, QCryptographicHash::Sha256).toHex());
+
+    return xml;
+}
+
+bool BlockMap::isEmpty() const
+{
+    return !_imageSize;
+}
+
+quint64 BlockMap::imageSize() const
+{
+    return _imageSize;
+}
+
+quint32 BlockMap::blockSize() const
+{
+    return _blockSize;
+}
+
+quint64 BlockMap::mappedBytes() const
+{
+    return _mappedBytes;
+}
+
+const QVector<BlockMap::Range> &BlockMap::ranges() const
+{
+    return _ranges;
+}
+
+bool BlockMap::hasChecksums() const
+{
+    return _hasChecksums;
+}
+
+bool BlockMap::isMapped(quint64 offset, quint64 len) const
+{
+    /* Anything past the image size is not described by the map, so must be written */
+    if (offset+len > _imageSize)
+        return true;
+
+    /* Last range starting before the end of the region */
+    auto it = std::lower_bound(_ranges.cbegin(), _ranges.cend(), offset+len, [](const Range &r, quint64 end) {
+        return r.offset < end;
+    });
+    if (it == _ranges.cbegin())
+        return false;
+    --it;
+
+    return it->offset + it->length > offset;
+}
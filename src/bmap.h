@@ -0,0 +1,56 @@
+#ifndef BMAP_H
+#define BMAP_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QVector>
+
+/*
+ * Block map of an image, in the XML format used by bmaptool
+ *
+ * Lists the ranges of the image that contain data, optionally with a
+ * checksum per range. Anything outside those ranges does not need to be
+ * written or verified.
+ */
+class BlockMap
+{
+public:
+    struct Range {
+        quint64 offset, length;
+        /* Hex encoded SHA256 of the range, or empty if not available */
+        QByteArray sha256;
+    };
+
+    BlockMap();
+
+    /* Parse bmap XML. Leaves the map empty and returns false on error */
+    bool parse(const QByteArray &xml);
+    /* bmap XML (version 2.0) for an image of imageSize bytes. ranges are in bytes,
+       and must start at a multiple of blockSize. Each range needs its SHA256 */
+    static QByteArray toXml(quint64 imageSize, quint32 blockSize, const QVector<Range> &ranges);
+    void clear();
+    bool isEmpty() const;
+
+    quint64 imageSize() const;
+    quint32 blockSize() const;
+    /* Total number of bytes covered by ranges */
+    quint64 mappedBytes() const;
+    /* Ranges sorted by offset, with the last one clamped to the image size */
+    const QVector<Range> &ranges() const;
+    /* True if every range has a SHA256 we can verify against */
+    bool hasChecksums() const;
+    /* True if [offset, offset+len) overlaps with at least one range */
+    bool isMapped(quint64 offset, quint64 len) const;
+
+protected:
+    quint64 _imageSize, _mappedBytes;
+    quint32 _blockSize;
+    bool _hasChecksums;
+    QVector<Range> _ranges;
+};
+
+#endif // BMAP_H
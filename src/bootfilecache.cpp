@@ -0,0 +1,287 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bootfilecache.h"
+#include "config.h"
+#include "downloadthread.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPair>
+#include <QStandardPaths>
+
+BootFileCache::BootFileCache(const QString &board, const QString &subdir)
+    : _board(board), _listRefresh(nullptr)
+{
+    _dir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QDir::separator() + "bootloaders" + QDir::separator() + board;
+    if (!subdir.isEmpty())
+        _dir += QDir::separator() + subdir;
+    QDir().mkpath(_dir);
+}
+
+BootFileCache::~BootFileCache()
+{
+    for (auto &download : std::as_const(_downloads))
+    {
+        download.second->cancelDownload();
+        download.second->wait();
+        QFile::remove(path(download.first.localName) + ".part");
+        delete download.second;
+    }
+    _finishListRefresh();
+}
+
+QString BootFileCache::directory() const
+{
+    return _dir;
+}
+
+QString BootFileCache::path(const QString &localName) const
+{
+    return _dir + QDir::separator() + localName;
+}
+
+QString BootFileCache::errorString() const
+{
+    return _errorString;
+}
+
+QMap<QString, QByteArray> BootFileCache::hashes()
+{
+    QString listPath = path("list.json");
+
+    if (QFileInfo(listPath).size() > 0)
+    {
+        /* Files that still have the hashes of the cached list need no network at all.
+           Whether the list changed only matters for the next run */
+        if (!_listRefresh)
+        {
+            QByteArray url = QString(BOOTIMG_URL).arg(_board, "list.json").toUtf8();
+            QByteArray etag = _loadEtag(listPath, url);
+            _listRefresh = new DownloadThread(url, (listPath + ".refresh").toUtf8(), QByteArray(), true);
+            _listRefresh->setBandwidthPriority(BandwidthScheduler::PriorityBackground);
+            if (!etag.isEmpty())
+                _listRefresh->setIfNoneMatch(etag);
+            _listRefresh->start();
+        }
+        return _readList(listPath);
+    }
+
+    if (!fetch({{"list.json", "list.json", QByteArray()}}))
+    {
+        qDebug() << "No list of boot files for" << _board;
+        return QMap<QString, QByteArray>();
+    }
+
+    return _readList(listPath);
+}
+
+void BootFileCache::_finishListRefresh()
+{
+    if (!_listRefresh)
+        return;
+
+    QString listPath = path("list.json");
+    DownloadThread *dt = _listRefresh;
+    _listRefresh = nullptr;
+
+    dt->wait();
+    if (dt->successfull() && !dt->notModified())
+    {
+        if (_readList(listPath + ".refresh") != _readList(listPath))
+            qDebug() << "Boot files of" << _board << "changed on the server, the new ones are used from the next run on";
+
+        QFile::remove(listPath);
+        if (QFile::rename(listPath + ".refresh", listPath))
+            _saveEtag(listPath, QString(BOOTIMG_URL).arg(_board, "list.json").toUtf8(), dt->etag());
+    }
+    else if (!dt->successfull())
+    {
+        qDebug() << "Could not revalidate list of boot files of" << _board << ", server not reachable";
+    }
+    QFile::remove(listPath + ".refresh");
+    delete dt;
+}
+
+QMap<QString, QByteArray> BootFileCache::_readList(const QString &filename)
+{
+    QMap<QString, QByteArray> result;
+
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly))
+        return result;
+
+    const QJsonArray files = QJsonDocument::fromJson(f.readAll()).object()["files"].toArray();
+    for (const QJsonValue &file : files)
+    {
+        QJsonObject obj = file.toObject();
+        result.insert(obj["name"].toString(), obj["sha256"].toString().toUtf8());
+    }
+
+    return result;
+}
+
+bool BootFileCache::fetch(const QList<File> &files)
+{
+    startFetch(files);
+
+    bool ok = true;
+    for (const File &file : files)
+        ok = waitFor(file.localName) && ok;
+
+    return ok;
+}
+
+void BootFileCache::startFetch(const QList<File> &files)
+{
+    for (const File &file : files)
+    {
+        QString localPath = path(file.localName);
+        QByteArray url = QString(BOOTIMG_URL).arg(_board, file.remoteName).toUtf8();
+        QByteArray etag;
+
+        if (QFileInfo(localPath).size() <= 0 && _fromBundle(file, localPath))
+        {
+            qDebug() << "Using compiled in" << file.localName;
+            continue;
+        }
+
+        if (QFileInfo(localPath).size() > 0)
+        {
+            if (!file.sha256.isEmpty())
+            {
+                if (_hashFile(localPath) == file.sha256)
+                {
+                    qDebug() << "Using cached" << file.localName;
+                    continue;
+                }
+                qDebug() << "Cache hash mismatch for" << file.localName;
+                QFile::remove(localPath);
+                if (_fromBundle(file, localPath))
+                {
+                    qDebug() << "Using compiled in" << file.localName;
+                    continue;
+                }
+            }
+            else
+            {
+                etag = _loadEtag(localPath, url);
+            }
+        }
+
+        DownloadThread *dt = new DownloadThread(url, (localPath + ".part").toUtf8(), file.sha256, true);
+        /* Small, and writing cannot start without them */
+        dt->setBandwidthPriority(BandwidthScheduler::PriorityUrgent);
+        if (!etag.isEmpty())
+            dt->setIfNoneMatch(etag);
+        dt->start();
+        _downloads.insert(file.localName, qMakePair(file, dt));
+    }
+}
+
+bool BootFileCache::waitFor(const QString &localName)
+{
+    QString localPath = path(localName);
+    auto it = _downloads.find(localName);
+    if (it == _downloads.end())
+        return QFileInfo(localPath).size() > 0;
+
+    const File file = it->first;
+    DownloadThread *dt = it->second;
+    _downloads.erase(it);
+
+    bool ok = true;
+    dt->wait();
+    if (dt->notModified())
+    {
+        qDebug() << "Cached" << file.localName << "is current";
+        QFile::remove(localPath + ".part");
+    }
+    else if (dt->successfull())
+    {
+        QFile::remove(localPath);
+        if (QFile::rename(localPath + ".part", localPath))
+        {
+            _saveEtag(localPath, QString(BOOTIMG_URL).arg(_board, file.remoteName).toUtf8(), dt->etag());
+        }
+        else
+        {
+            _errorString = QObject::tr("Error storing boot file %1").arg(file.localName);
+            ok = false;
+        }
+    }
+    else
+    {
+        QFile::remove(localPath + ".part");
+        if (file.sha256.isEmpty() && QFileInfo(localPath).size() > 0)
+        {
+            qDebug() << "Server not reachable, using cached" << file.localName;
+        }
+        else
+        {
+            _errorString = QObject::tr("Failed to download boot file: %1").arg(file.remoteName);
+            ok = false;
+        }
+    }
+    delete dt;
+
+    return ok;
+}
+
+bool BootFileCache::_fromBundle(const File &file, const QString &localPath)
+{
+    QString bundled = ":/bootfiles/" + file.remoteName;
+
+    if (file.sha256.isEmpty() || !QFile::exists(bundled) || _hashFile(bundled) != file.sha256)
+        return false;
+
+    QFile::remove(localPath + ".part");
+    if (!QFile::copy(bundled, localPath + ".part"))
+        return false;
+    /* Copies of resources are read-only */
+    QFile::setPermissions(localPath + ".part", QFile::ReadOwner | QFile::WriteOwner | QFile::ReadGroup | QFile::ReadOther);
+    QFile::remove(localPath + ".etag");
+    return QFile::rename(localPath + ".part", localPath);
+}
+
+QByteArray BootFileCache::_hashFile(const QString &filename)
+{
+    QFile f(filename);
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+
+    if (!f.open(QIODevice::ReadOnly) || !hash.addData(&f))
+        return QByteArray();
+    return hash.result().toHex();
+}
+
+QByteArray BootFileCache::_loadEtag(const QString &filename, const QByteArray &url)
+{
+    QFile f(filename + ".etag");
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    /* URL on the first line, ETag on the second */
+    if (f.readLine().trimmed() != url)
+        return QByteArray();
+    return f.readLine().trimmed();
+}
+
+void BootFileCache::_saveEtag(const QString &filename, const QByteArray &url, const QByteArray &etag)
+{
+    if (etag.isEmpty())
+    {
+        QFile::remove(filename + ".etag");
+        return;
+    }
+
+    QFile f(filename + ".etag");
+    if (f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        f.write(url + "\n" + etag + "\n");
+}
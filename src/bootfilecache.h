@@ -0,0 +1,81 @@
+#ifndef BOOTFILECACHE_H
+#define BOOTFILECACHE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QString>
+
+class DownloadThread;
+
+/*
+ * Boot files of a board, kept in bootloaders/<board> of the cache
+ * directory across runs
+ *
+ * A cached file with a known SHA256 is used if it still has that hash,
+ * without asking the server. Other files are revalidated with the ETag
+ * they were downloaded with (If-None-Match), and only downloaded again
+ * if they changed. If the server cannot be reached, such a file is
+ * used as cached.
+ *
+ * Files missing from the cache are taken from the copies compiled in
+ * (bootfiles.qrc) if those have the expected hash, so a first run works
+ * offline too. A cached list.json is used right away, and revalidated
+ * in the background for the next run.
+ */
+class BootFileCache
+{
+public:
+    struct File
+    {
+        /* Name below BOOTIMG_URL */
+        QString remoteName;
+        /* Name in the cache directory */
+        QString localName;
+        /* Hex encoded SHA256, empty if not known */
+        QByteArray sha256;
+    };
+
+    /* subdir separates files of different boot methods that share names */
+    explicit BootFileCache(const QString &board, const QString &subdir = QString());
+    /* Waits for the list.json revalidation */
+    ~BootFileCache();
+
+    QString directory() const;
+    QString path(const QString &localName) const;
+
+    /* SHA256 of the files of the board by remote name, from its list.json. Empty if not available.
+       Only waits for the server if there is no cached list.json */
+    QMap<QString, QByteArray> hashes();
+
+    /* Makes sure there are current copies of files, downloading those needed at the same time */
+    bool fetch(const QList<File> &files);
+    /* Starts downloading those of files that need it, and returns. For waiting on each file
+       only when it is needed, with waitFor() */
+    void startFetch(const QList<File> &files);
+    /* Waits until there is a current copy of the file of startFetch(). False if there is none */
+    bool waitFor(const QString &localName);
+    QString errorString() const;
+
+protected:
+    QString _board, _dir, _errorString;
+    DownloadThread *_listRefresh;
+    /* Downloads of startFetch() not waited for yet, by local name */
+    QMap<QString, QPair<File, DownloadThread *> > _downloads;
+
+    void _finishListRefresh();
+    static QMap<QString, QByteArray> _readList(const QString &filename);
+    /* Copies the compiled in file, if it has the expected hash */
+    static bool _fromBundle(const File &file, const QString &localPath);
+    static QByteArray _hashFile(const QString &filename);
+    /* ETag the file was downloaded from url with */
+    static QByteArray _loadEtag(const QString &filename, const QByteArray &url);
+    static void _saveEtag(const QString &filename, const QByteArray &url, const QByteArray &etag);
+};
+
+#endif // BOOTFILECACHE_H
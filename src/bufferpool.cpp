@@ -0,0 +1,146 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bufferpool.h"
+#include "pipelinememory.h"
+#include <utility>
+
+PooledBuffer::PooledBuffer() : _header(nullptr)
+{
+}
+
+PooledBuffer::PooledBuffer(Header *header) : _header(header)
+{
+}
+
+PooledBuffer::PooledBuffer(const PooledBuffer &other) : _header(other._header)
+{
+    if (_header)
+        _header->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+PooledBuffer::PooledBuffer(PooledBuffer &&other) noexcept : _header(other._header)
+{
+    other._header = nullptr;
+}
+
+PooledBuffer &PooledBuffer::operator=(PooledBuffer other) noexcept
+{
+    std::swap(_header, other._header);
+    return *this;
+}
+
+PooledBuffer::~PooledBuffer()
+{
+    if (!_header || _header->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+
+    if (_header->pool)
+    {
+        _header->pool->_recycle(_header);
+    }
+    else
+    {
+        PipelineMemory::free(_header->data, _header->size);
+        delete _header;
+    }
+}
+
+char *PooledBuffer::get() const
+{
+    return _header ? _header->data : nullptr;
+}
+
+size_t PooledBuffer::capacity() const
+{
+    return _header ? _header->size : 0;
+}
+
+PooledBuffer::operator bool() const
+{
+    return _header != nullptr;
+}
+
+BufferPool::BufferPool(size_t bufferSize)
+    : _bufferSize(bufferSize), _free(nullptr), _refs(1), _allocated(0)
+{
+}
+
+BufferPool::~BufferPool()
+{
+    while (_free)
+    {
+        PooledBuffer::Header *h = _free;
+        _free = h->next;
+        PipelineMemory::free(h->data, h->size);
+        delete h;
+    }
+}
+
+PooledBuffer BufferPool::acquire(size_t len)
+{
+    PooledBuffer::Header *h = nullptr;
+
+    if (len > _bufferSize)
+    {
+        h = new PooledBuffer::Header;
+        h->pool = nullptr;
+        h->data = (char *) PipelineMemory::allocate(len);
+        h->size = len;
+    }
+    else
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            h = _free;
+            if (h)
+                _free = h->next;
+        }
+        if (!h)
+        {
+            h = new PooledBuffer::Header;
+            h->pool = this;
+            h->data = (char *) PipelineMemory::allocate(_bufferSize);
+            h->size = _bufferSize;
+            _allocated++;
+        }
+        _refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    h->refs.store(1, std::memory_order_relaxed);
+    h->next = nullptr;
+
+    return PooledBuffer(h);
+}
+
+void BufferPool::_recycle(PooledBuffer::Header *header)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        header->next = _free;
+        _free = header;
+    }
+    _unref();
+}
+
+size_t BufferPool::bufferSize() const
+{
+    return _bufferSize;
+}
+
+size_t BufferPool::allocated() const
+{
+    return _allocated;
+}
+
+void BufferPool::release()
+{
+    _unref();
+}
+
+void BufferPool::_unref()
+{
+    if (_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+}
@@ -0,0 +1,85 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <atomic>
+#include <mutex>
+
+class BufferPool;
+
+/*
+ * Reference to a buffer of a BufferPool
+ *
+ * Copies share the buffer. It goes back to the pool when the last copy is
+ * destroyed, by whichever thread that happens on. Takes no locks and
+ * allocates nothing, other than an atomic reference count update.
+ */
+class PooledBuffer
+{
+public:
+    PooledBuffer();
+    PooledBuffer(const PooledBuffer &other);
+    PooledBuffer(PooledBuffer &&other) noexcept;
+    PooledBuffer &operator=(PooledBuffer other) noexcept;
+    ~PooledBuffer();
+
+    char *get() const;
+    size_t capacity() const;
+    explicit operator bool() const;
+
+protected:
+    friend class BufferPool;
+    struct Header
+    {
+        /* nullptr for a buffer too large for the pool, which is freed instead */
+        BufferPool *pool;
+        std::atomic<int> refs;
+        char *data;
+        size_t size;
+        Header *next;
+    };
+    explicit PooledBuffer(Header *header);
+    Header *_header;
+};
+
+/*
+ * Free list of 4k aligned buffers of a fixed size
+ *
+ * Buffers are allocated when the free list is empty, so after the first
+ * few blocks, steady state hands out recycled buffers only. The pool is
+ * freed once release() was called and every buffer has come back, so
+ * buffers may outlive the object that created the pool.
+ */
+class BufferPool
+{
+public:
+    explicit BufferPool(size_t bufferSize);
+
+    /* Buffer of at least len bytes. Only lengths over bufferSize() are allocated every time */
+    PooledBuffer acquire(size_t len);
+    size_t bufferSize() const;
+    /* Buffers allocated so far */
+    size_t allocated() const;
+    /* Give up the creator's reference */
+    void release();
+
+protected:
+    friend class PooledBuffer;
+    ~BufferPool();
+    void _recycle(PooledBuffer::Header *header);
+    void _unref();
+
+    size_t _bufferSize;
+    std::mutex _mutex;
+    PooledBuffer::Header *_free;
+    /* The creator, and every buffer handed out */
+    std::atomic<int> _refs;
+    std::atomic<size_t> _allocated;
+};
+
+#endif // BUFFERPOOL_H
@@ -0,0 +1,87 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachejournal.h"
+#include "metadataindex.h"
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#define CACHEJOURNAL_TABLE  "cachejournal"
+
+static QByteArray journalKey(const QString &cacheFile)
+{
+    return QFileInfo(cacheFile).absoluteFilePath().toUtf8();
+}
+
+CacheJournal::CacheJournal()
+    : offset(0)
+{
+}
+
+QString CacheJournal::fileName(const QString &cacheFile)
+{
+    return cacheFile+".journal";
+}
+
+bool CacheJournal::load(const QString &cacheFile)
+{
+    if (!QFile::exists(cacheFile))
+        return false;
+
+    QJsonObject obj = MetadataIndex::instance().value(CACHEJOURNAL_TABLE, journalKey(cacheFile));
+    QFile f(fileName(cacheFile));
+    if (obj.isEmpty() && f.open(QIODevice::ReadOnly))
+    {
+        /* Moved into the index once it is saved again */
+        obj = QJsonDocument::fromJson(f.readAll()).object();
+        f.close();
+    }
+    url = obj.value("url").toString().toLatin1();
+    etag = obj.value("etag").toString().toLatin1();
+    lastModified = obj.value("last_modified").toString().toLatin1();
+    offset = obj.value("offset").toString().toULongLong();
+
+    return !url.isEmpty() && offset;
+}
+
+bool CacheJournal::save(const QString &cacheFile) const
+{
+    /* 64-bit values are stored as strings, as JSON numbers are doubles */
+    QJsonObject obj;
+    obj["url"] = QString::fromLatin1(url);
+    obj["etag"] = QString::fromLatin1(etag);
+    obj["last_modified"] = QString::fromLatin1(lastModified);
+    obj["offset"] = QString::number(offset);
+
+    /* A crash leaves either the old or the new journal */
+    if (!MetadataIndex::instance().put(CACHEJOURNAL_TABLE, journalKey(cacheFile), obj))
+    {
+        qDebug() << "Error writing cache journal of" << cacheFile;
+        return false;
+    }
+    QFile::remove(fileName(cacheFile));
+
+    return true;
+}
+
+bool CacheJournal::exists(const QString &cacheFile)
+{
+    return MetadataIndex::instance().contains(CACHEJOURNAL_TABLE, journalKey(cacheFile)) || QFile::exists(fileName(cacheFile));
+}
+
+void CacheJournal::remove(const QString &cacheFile)
+{
+    if (MetadataIndex::instance().contains(CACHEJOURNAL_TABLE, journalKey(cacheFile)))
+        MetadataIndex::instance().remove(CACHEJOURNAL_TABLE, journalKey(cacheFile));
+    QFile::remove(fileName(cacheFile));
+}
+
+bool CacheJournal::hasValidator() const
+{
+    return !etag.isEmpty() || !lastModified.isEmpty();
+}
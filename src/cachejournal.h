@@ -0,0 +1,41 @@
+#ifndef CACHEJOURNAL_H
+#define CACHEJOURNAL_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+
+/*
+ * Progress record of a cache file that is still being downloaded
+ *
+ * Kept in the MetadataIndex while downloading, by cache file, so a download
+ * that was interrupted (even by quitting or crashing) can be resumed with an
+ * HTTP range request the next time. The ETag and Last-Modified validators of
+ * the server make sure the remainder comes from the same file.
+ */
+class CacheJournal
+{
+public:
+    CacheJournal();
+
+    /* Journal file next to the cache file, of older versions */
+    static QString fileName(const QString &cacheFile);
+
+    bool load(const QString &cacheFile);
+    bool save(const QString &cacheFile) const;
+    static bool exists(const QString &cacheFile);
+    static void remove(const QString &cacheFile);
+
+    /* Can only resume if the server gave us something to check the file against */
+    bool hasValidator() const;
+
+    QByteArray url, etag, lastModified;
+    /* Number of bytes at the start of the cache file that are on disk */
+    quint64 offset;
+};
+
+#endif // CACHEJOURNAL_H
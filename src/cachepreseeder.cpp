@@ -0,0 +1,313 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachepreseeder.h"
+#include "imagewriter.h"
+#include "config.h"
+#include <QDebug>
+#include <QFile>
+#include <QJsonDocument>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+
+CachePreseeder::CachePreseeder(ImageWriter *writer, QObject *parent)
+    : QObject(parent), _writer(writer), _nam(nullptr), _pendingLists(0),
+      _hasWindow(false), _downloading(false), _windowEnded(false), _failures(false)
+{
+    _windowTimer.setSingleShot(true);
+    connect(&_windowTimer, &QTimer::timeout, this, &CachePreseeder::onWindowTimer);
+    connect(_writer, &ImageWriter::precacheFinished, this, &CachePreseeder::onPrecacheFinished);
+}
+
+CachePreseeder::~CachePreseeder()
+{
+    if (_downloading)
+        _writer->cancelPrecache();
+}
+
+bool CachePreseeder::loadManifest(const QString &filename, QString &errorMsg)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        errorMsg = tr("Cannot open manifest %1").arg(filename);
+        return false;
+    }
+
+    QJsonParseError parseError;
+    QJsonDocument doc = QJsonDocument::fromJson(f.readAll(), &parseError);
+    if (!doc.isObject())
+    {
+        errorMsg = tr("Manifest is not a JSON object: %1").arg(parseError.errorString());
+        return false;
+    }
+
+    const QJsonArray osLists = doc.object()["os_lists"].toArray();
+    for (const auto &url : osLists)
+    {
+        QUrl u(url.toString());
+        if (!u.isValid() || u.isRelative())
+        {
+            errorMsg = tr("Invalid OS list URL in manifest: %1").arg(url.toString());
+            return false;
+        }
+        _osLists.append(u);
+    }
+
+    const QJsonArray images = doc.object()["images"].toArray();
+    for (const auto &image : images)
+    {
+        QJsonObject o = image.toObject();
+        QUrl url(o["url"].toString());
+        QByteArray sha256 = o["sha256"].toString().toLatin1().toLower();
+        if (!(url.scheme() == "http" || url.scheme() == "https") || sha256.length() != 64)
+        {
+            errorMsg = tr("Images in the manifest need a HTTP(S) url and the sha256 of the extracted image");
+            return false;
+        }
+        _addImage(url, sha256, o["size"].toInteger());
+    }
+
+    if (_osLists.isEmpty() && _queue.isEmpty())
+    {
+        errorMsg = tr("Manifest lists no OS lists or images");
+        return false;
+    }
+
+    return true;
+}
+
+bool CachePreseeder::setWindow(const QString &window)
+{
+    QTime start = QTime::fromString(window.section('-', 0, 0), "HH:mm");
+    QTime end = QTime::fromString(window.section('-', 1, 1), "HH:mm");
+    if (!start.isValid() || !end.isValid() || start == end)
+        return false;
+
+    _windowStart = start;
+    _windowEnd = end;
+    _hasWindow = true;
+    return true;
+}
+
+void CachePreseeder::start()
+{
+    for (const QUrl &url : std::as_const(_osLists))
+        _requestOsList(url);
+    next();
+}
+
+void CachePreseeder::_addImage(const QUrl &url, const QByteArray &sha256, quint64 size)
+{
+    /* The same image is often in several categories */
+    if (_queued.contains(sha256))
+        return;
+
+    _queued.insert(sha256);
+    _queue.append({url, sha256, size, 0});
+}
+
+void CachePreseeder::_addOsList(const QJsonArray &list)
+{
+    for (const auto &item : list)
+    {
+        QJsonObject o = item.toObject();
+
+        if (o.contains("subitems"))
+        {
+            _addOsList(o["subitems"].toArray());
+        }
+        else if (o.contains("subitems_url"))
+        {
+            _requestOsList(QUrl(o["subitems_url"].toString()));
+        }
+        else
+        {
+            QUrl url(o["url"].toString());
+            QByteArray sha256 = o["extract_sha256"].toString().toLatin1();
+            /* Erase, local files and entries without a hash cannot be cached */
+            if ((url.scheme() == "http" || url.scheme() == "https") && !sha256.isEmpty())
+                _addImage(url, sha256, o["image_download_size"].toInteger());
+        }
+    }
+}
+
+void CachePreseeder::_requestOsList(const QUrl &url)
+{
+    if (_requestedLists.contains(url))
+        return;
+    if (_requestedLists.size() >= IMAGEWRITER_PRECACHE_MAX_SUBLISTS)
+    {
+        qDebug() << "Too many OS lists in manifest. Not fetching" << url;
+        _failures = true;
+        return;
+    }
+
+    if (!_nam)
+    {
+        _nam = new QNetworkAccessManager(this);
+        connect(_nam, &QNetworkAccessManager::finished, this, &CachePreseeder::onOsListReceived);
+    }
+    _requestedLists.insert(url);
+    _pendingLists++;
+
+    QNetworkRequest request(url);
+    request.setAttribute(QNetworkRequest::RedirectPolicyAttribute, QNetworkRequest::NoLessSafeRedirectPolicy);
+    _nam->get(request);
+}
+
+void CachePreseeder::onOsListReceived(QNetworkReply *reply)
+{
+    reply->deleteLater();
+    _pendingLists--;
+
+    QJsonObject response = QJsonDocument::fromJson(reply->readAll()).object();
+    if (reply->error() != QNetworkReply::NoError || !response.contains("os_list"))
+    {
+        qDebug() << "Error fetching OS list" << reply->request().url() << ":" << reply->errorString();
+        _failures = true;
+        emit status({
+            {"event", "oslist"},
+            {"url", reply->request().url().toString()},
+            {"status", "failed"}
+        });
+    }
+    else
+    {
+        _addOsList(response["os_list"].toArray());
+    }
+
+    next();
+}
+
+bool CachePreseeder::_inWindow() const
+{
+    if (!_hasWindow)
+        return true;
+
+    QTime now = QTime::currentTime();
+    if (_windowStart < _windowEnd)
+        return now >= _windowStart && now < _windowEnd;
+    else
+        return now >= _windowStart || now < _windowEnd;
+}
+
+qint64 CachePreseeder::_msecsUntil(const QTime &time)
+{
+    qint64 msecs = QTime::currentTime().msecsTo(time);
+    if (msecs <= 0)
+        msecs += 24*3600*1000;
+
+    return msecs;
+}
+
+/* Start downloading the next image, if nothing else is going on and it is time to */
+void CachePreseeder::next()
+{
+    if (_downloading || _pendingLists)
+        return;
+
+    if (_queue.isEmpty())
+    {
+        emit finished(_failures ? 1 : 0);
+        return;
+    }
+
+    if (!_inWindow())
+    {
+        qint64 msecs = _msecsUntil(_windowStart);
+        emit status({
+            {"event", "waiting"},
+            {"seconds", msecs / 1000}
+        });
+        _windowTimer.start(msecs);
+        return;
+    }
+
+    while (!_queue.isEmpty())
+    {
+        const Image &image = _queue.first();
+
+        if (_writer->isCached(image.url, image.sha256))
+        {
+            _sendStatus(image, "cached");
+        }
+        else if (_writer->precacheImage(image.url, image.sha256, image.size))
+        {
+            _downloading = true;
+            if (_hasWindow)
+                _windowTimer.start(_msecsUntil(_windowEnd));
+            return;
+        }
+        else
+        {
+            /* In the extracted image cache, or does not fit in the cache */
+            _sendStatus(image, "skipped");
+        }
+        _queue.removeFirst();
+    }
+
+    emit finished(_failures ? 1 : 0);
+}
+
+void CachePreseeder::onPrecacheFinished(QByteArray sha256, quint64 bytes, bool complete)
+{
+    if (!_downloading || _queue.isEmpty() || _queue.first().sha256 != sha256)
+        return;
+
+    _downloading = false;
+    _windowTimer.stop();
+    Image image = _queue.takeFirst();
+
+    if (complete)
+    {
+        _sendStatus(image, "complete", bytes);
+    }
+    else if (_windowEnded)
+    {
+        /* Picked up where it stopped next time */
+        _sendStatus(image, "interrupted", bytes);
+        _queue.prepend(image);
+    }
+    else if (++image.attempts < IMAGEWRITER_PRECACHE_ATTEMPTS)
+    {
+        _sendStatus(image, "retrying", bytes);
+        _queue.append(image);
+    }
+    else
+    {
+        _failures = true;
+        _sendStatus(image, "failed", bytes);
+    }
+    _windowEnded = false;
+
+    QTimer::singleShot(0, this, &CachePreseeder::next);
+}
+
+void CachePreseeder::onWindowTimer()
+{
+    if (_downloading)
+    {
+        qDebug() << "End of the pre-seeding window. Stopping download";
+        _windowEnded = true;
+        _writer->cancelPrecache();
+    }
+    else
+    {
+        next();
+    }
+}
+
+void CachePreseeder::_sendStatus(const Image &image, const QString &status, quint64 bytes)
+{
+    emit this->status({
+        {"event", "precache"},
+        {"url", image.url.toString()},
+        {"sha256", QString::fromLatin1(image.sha256)},
+        {"status", status},
+        {"bytes", (qint64) bytes}
+    });
+}
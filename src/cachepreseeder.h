@@ -0,0 +1,98 @@
+#ifndef CACHEPRESEEDER_H
+#define CACHEPRESEEDER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QObject>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QList>
+#include <QSet>
+#include <QTime>
+#include <QTimer>
+#include <QUrl>
+
+class ImageWriter;
+class QNetworkAccessManager;
+class QNetworkReply;
+
+/*
+ * Fills the download cache from a manifest ahead of time, e.g. overnight
+ * when the WAN link is not needed for anything else
+ *
+ * The manifest is a JSON file listing OS lists, all images of which are
+ * cached, and/or single images:
+ *
+ *   {"os_lists": ["<OS list URL>", ...],
+ *    "images": [{"url": "<image URL>", "sha256": "<extract hash>", "size": <download size>}, ...]}
+ *
+ * Images are downloaded one at a time by ImageWriter::precacheImage(), as
+ * background downloads (see BandwidthScheduler), so --max-bandwidth and any
+ * write going on take precedence. With a window set, downloads only run
+ * between its start and end time of day. At the end of the window the one
+ * in progress is stopped, and resumed from where it got to in the next
+ * window, or by a write of the image before that. finished() is emitted
+ * once every image is cached or has failed too often.
+ */
+class CachePreseeder : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CachePreseeder(ImageWriter *writer, QObject *parent = nullptr);
+    virtual ~CachePreseeder();
+
+    /* Returns false with errorMsg set if the manifest cannot be read */
+    bool loadManifest(const QString &filename, QString &errorMsg);
+    /* Local time of day to download in, as "HH:mm-HH:mm". May span midnight */
+    bool setWindow(const QString &window);
+
+public slots:
+    void start();
+
+signals:
+    /* JSON object with "event": "precache", "url", "sha256", "status" (cached, skipped, complete,
+       interrupted, retrying or failed) and "bytes". "event": "waiting" with "seconds" until the
+       window, or "event": "oslist" with the "url" of an OS list that could not be fetched */
+    void status(QJsonObject event);
+    /* exitCode is 1 if an image or OS list failed */
+    void finished(int exitCode);
+
+protected:
+    struct Image
+    {
+        QUrl url;
+        QByteArray sha256;
+        quint64 size;
+        int attempts;
+    };
+
+    ImageWriter *_writer;
+    QNetworkAccessManager *_nam;
+    QList<QUrl> _osLists;
+    QList<Image> _queue;
+    QSet<QByteArray> _queued;
+    QSet<QUrl> _requestedLists;
+    int _pendingLists;
+    bool _hasWindow, _downloading, _windowEnded, _failures;
+    QTime _windowStart, _windowEnd;
+    QTimer _windowTimer;
+
+    void _addImage(const QUrl &url, const QByteArray &sha256, quint64 size);
+    void _addOsList(const QJsonArray &list);
+    void _requestOsList(const QUrl &url);
+    bool _inWindow() const;
+    /* Until the next time the clock shows time */
+    static qint64 _msecsUntil(const QTime &time);
+    void _sendStatus(const Image &image, const QString &status, quint64 bytes = 0);
+
+protected slots:
+    void onOsListReceived(QNetworkReply *reply);
+    void onPrecacheFinished(QByteArray sha256, quint64 bytes, bool complete);
+    void onWindowTimer();
+    void next();
+};
+
+#endif // CACHEPRESEEDER_H
@@ -0,0 +1,163 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachescrubber.h"
+#include "acceleratedcryptographichash.h"
+#include "cachesidecar.h"
+#include "chunkedhash.h"
+#include "config.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+
+/* Read size while hashing files without chunk hashes */
+#define CACHESCRUBBER_READ_SIZE  (1024*1024)
+
+CacheScrubber::CacheScrubber(QObject *parent)
+    : QThread(parent), _threads(IMAGEWRITER_CACHE_SCRUB_THREADS), _cancelled(false)
+{
+}
+
+CacheScrubber::~CacheScrubber()
+{
+    cancel();
+    wait();
+}
+
+void CacheScrubber::setEntries(const QList<Entry> &entries)
+{
+    QMutexLocker lock(&_mutex);
+    _entries = entries;
+}
+
+void CacheScrubber::setThreads(int threads)
+{
+    QMutexLocker lock(&_mutex);
+    _threads = qMax(1, threads);
+}
+
+void CacheScrubber::cancel()
+{
+    _cancelled = true;
+}
+
+void CacheScrubber::run()
+{
+    _cancelled = false;
+    QList<Entry> entries;
+    {
+        QMutexLocker lock(&_mutex);
+        entries = _entries;
+    }
+    QElapsedTimer t;
+    int checked = 0;
+    t.start();
+
+    for (const Entry &entry : std::as_const(entries))
+    {
+        Result result = _check(entry);
+        if (_cancelled)
+            return;
+
+        if (result == Valid)
+        {
+            checked++;
+            emit validated(entry.sha256);
+        }
+        else if (result == Corrupt)
+        {
+            checked++;
+            qDebug() << "Cache file" << entry.fileName << "does not match its hash anymore";
+            emit corrupt(entry.sha256);
+        }
+    }
+
+    qDebug() << "Scrubbed" << checked << "of" << entries.size() << "cache files in" << t.elapsed() / 1000 << "seconds";
+}
+
+CacheScrubber::Result CacheScrubber::_check(const Entry &entry)
+{
+    CacheSidecar sidecar;
+    if (!sidecar.load(entry.fileName) || sidecar.extractHash != entry.sha256)
+        return Unchecked;
+
+    QFile f(entry.fileName);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Cannot open cache file" << entry.fileName << "for scrubbing:" << f.errorString();
+        return Unchecked;
+    }
+    const quint64 size = f.size();
+
+    if (sidecar.chunkSize && (quint64) sidecar.chunks.size() == (size + sidecar.chunkSize - 1) / sidecar.chunkSize)
+    {
+        /* Leaves are independent of each other, so each worker reads the file at its own position */
+        const ChunkedHash chunkhash(sidecar.chunkSize, sidecar.chunkAlgorithm);
+        std::atomic<int> nextLeaf(0);
+        std::atomic<bool> mismatch(false), readError(false);
+
+        auto worker = [&]() {
+            QFile in(entry.fileName);
+            if (!in.open(QIODevice::ReadOnly))
+            {
+                readError = true;
+                return;
+            }
+            QByteArray buf(sidecar.chunkSize, Qt::Uninitialized);
+            int i;
+
+            while (!_cancelled && !mismatch && !readError && (i = nextLeaf++) < sidecar.chunks.size())
+            {
+                quint64 offset = i * sidecar.chunkSize;
+                qint64 len = qMin(sidecar.chunkSize, size-offset);
+
+                if (!in.seek(offset) || in.read(buf.data(), len) != len)
+                    readError = true;
+                else if (chunkhash.hashLeaf(buf.constData(), len) != sidecar.chunks[i])
+                    mismatch = true;
+            }
+        };
+
+        int threads;
+        {
+            QMutexLocker lock(&_mutex);
+            threads = qMin(_threads, (int) sidecar.chunks.size());
+        }
+        QThreadPool pool;
+        pool.setMaxThreadCount(threads);
+        QVector<QFuture<void>> futures;
+        for (int i = 0; i < threads; i++)
+            futures.append(QtConcurrent::run(&pool, worker));
+        for (QFuture<void> &future : futures)
+            future.waitForFinished();
+
+        if (_cancelled)
+            return Unchecked;
+        if (readError)
+            qDebug() << "Error reading cache file" << entry.fileName;
+        return (mismatch || readError) ? Corrupt : Valid;
+    }
+
+    AcceleratedCryptographicHash hash(QCryptographicHash::Sha256);
+    QByteArray buf(CACHESCRUBBER_READ_SIZE, Qt::Uninitialized);
+    qint64 n;
+
+    while ((n = f.read(buf.data(), buf.size())) > 0)
+    {
+        if (_cancelled)
+            return Unchecked;
+        hash.addData(buf.constData(), n);
+    }
+    if (n < 0)
+    {
+        qDebug() << "Error reading cache file" << entry.fileName << ":" << f.errorString();
+        return Corrupt;
+    }
+
+    return hash.result().toHex() == entry.sha256 ? Valid : Corrupt;
+}
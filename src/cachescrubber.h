@@ -0,0 +1,69 @@
+#ifndef CACHESCRUBBER_H
+#define CACHESCRUBBER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <atomic>
+
+/*
+ * Background check of extracted images in the cache
+ *
+ * Writes trust a cache file whose sidecar vouches for it (see CacheSidecar),
+ * so a file that went bad on disk since would otherwise only be noticed
+ * by the write hash mismatching, after it got most of the way through.
+ *
+ * Once started, the thread reads the files given to setEntries() and
+ * checks the chunk hashes of their sidecar, several chunks in parallel,
+ * or the SHA256 of the whole file if the sidecar has none. Files without
+ * a sidecar for the extracted image they are named after are skipped.
+ * What to do with the results is left to the owner of the cache, on its
+ * own thread.
+ */
+class CacheScrubber : public QThread
+{
+    Q_OBJECT
+public:
+    struct Entry
+    {
+        /* Hex SHA256 of the extracted image */
+        QByteArray sha256;
+        QString fileName;
+    };
+
+    explicit CacheScrubber(QObject *parent = nullptr);
+    virtual ~CacheScrubber();
+
+    /* Entries to check on the next start() */
+    void setEntries(const QList<Entry> &entries);
+    void setThreads(int threads);
+    void cancel();
+
+signals:
+    void validated(QByteArray sha256);
+    void corrupt(QByteArray sha256);
+
+protected:
+    enum Result {
+        Valid,
+        Corrupt,
+        Unchecked
+    };
+
+    mutable QMutex _mutex;
+    QList<Entry> _entries;
+    int _threads;
+    std::atomic<bool> _cancelled;
+
+    virtual void run();
+    Result _check(const Entry &entry);
+};
+
+#endif // CACHESCRUBBER_H
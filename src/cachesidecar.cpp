@@ -0,0 +1,123 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachesidecar.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+CacheSidecar::CacheSidecar()
+    : imageSize(0), chunkSize(0), chunkAlgorithm(ChunkedHash::Sha256), transcoded(false)
+{
+}
+
+QString CacheSidecar::fileName(const QString &cacheFile)
+{
+    return cacheFile+".sidecar";
+}
+
+bool CacheSidecar::load(const QString &cacheFile)
+{
+    extractHash.clear();
+    imageSize = 0;
+    chunks.clear();
+    chunkSize = 0;
+    chunkAlgorithm = ChunkedHash::Sha256;
+    transcoded = false;
+
+    QFile f(fileName(cacheFile));
+    QFileInfo fi(cacheFile);
+    if (!fi.exists() || !f.open(QIODevice::ReadOnly))
+        return false;
+
+    QJsonObject obj = QJsonDocument::fromJson(f.readAll()).object();
+    if (obj.value("cache_size").toString().toULongLong() != (quint64) fi.size()
+            || obj.value("cache_mtime").toString().toLongLong() != fi.lastModified().toMSecsSinceEpoch())
+    {
+        qDebug() << "Cache sidecar does not match cache file. Ignoring";
+        return false;
+    }
+
+    /* Anything beyond the image, like zeroes the file was extended with, is not covered by the hash */
+    imageSize = obj.value("image_size").toString().toULongLong();
+    if (imageSize && imageSize != (quint64) fi.size())
+    {
+        qDebug() << "Cache file is" << fi.size() << "bytes, but the image is" << imageSize << ". Ignoring";
+        return false;
+    }
+
+    extractHash = obj.value("extract_sha256").toString().toLatin1();
+    if (extractHash.size() != 64)
+    {
+        extractHash.clear();
+        return false;
+    }
+
+    transcoded = obj.value("transcoded").toBool();
+    chunkSize = obj.value("chunk_size").toString().toULongLong();
+    /* Sidecars from before the algorithm was recorded have SHA256 leaves */
+    if (obj.contains("chunk_algorithm")
+            && !ChunkedHash::algorithmFromName(obj.value("chunk_algorithm").toString().toLatin1(), &chunkAlgorithm))
+        chunkSize = 0;
+    for (const QJsonValue &v : obj.value("chunks").toArray())
+    {
+        QByteArray chunk = QByteArray::fromHex(v.toString().toLatin1());
+        if (!chunkSize || chunk.size() != ChunkedHash::leafSize(chunkAlgorithm))
+        {
+            chunks.clear();
+            break;
+        }
+        chunks.append(chunk);
+    }
+    if (chunks.isEmpty())
+        chunkSize = 0;
+
+    return true;
+}
+
+bool CacheSidecar::save(const QString &cacheFile) const
+{
+    QFileInfo fi(cacheFile);
+    if (!fi.exists())
+        return false;
+
+    /* 64-bit values are stored as strings, as JSON numbers are doubles */
+    QJsonObject obj;
+    obj["cache_size"] = QString::number(fi.size());
+    obj["cache_mtime"] = QString::number(fi.lastModified().toMSecsSinceEpoch());
+    obj["extract_sha256"] = QString::fromLatin1(extractHash);
+    if (imageSize)
+        obj["image_size"] = QString::number(imageSize);
+    if (transcoded)
+        obj["transcoded"] = true;
+    if (chunkSize && !chunks.isEmpty())
+    {
+        QJsonArray a;
+        for (const QByteArray &chunk : chunks)
+            a.append(QString::fromLatin1(chunk.toHex()));
+        obj["chunk_size"] = QString::number(chunkSize);
+        obj["chunk_algorithm"] = ChunkedHash::algorithmName(chunkAlgorithm);
+        obj["chunks"] = a;
+    }
+
+    QFile f(fileName(cacheFile));
+    if (!f.open(QIODevice::WriteOnly) || f.write(QJsonDocument(obj).toJson(QJsonDocument::Compact)) == -1)
+    {
+        qDebug() << "Error writing cache sidecar" << f.fileName();
+        f.remove();
+        return false;
+    }
+
+    return true;
+}
+
+void CacheSidecar::remove(const QString &cacheFile)
+{
+    QFile::remove(fileName(cacheFile));
+}
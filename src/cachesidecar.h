@@ -0,0 +1,49 @@
+#ifndef CACHESIDECAR_H
+#define CACHESIDECAR_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "chunkedhash.h"
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+/*
+ * Small JSON file stored next to a cache file, recording the hashes of
+ * the extracted image that were verified when the cache was written
+ *
+ * The sidecar also records size and modification time of the cache file,
+ * and is only accepted if those still match. Writes from a cache file
+ * with a valid sidecar do not have to hash the extracted image again,
+ * the device verify is done against the recorded hashes instead.
+ */
+class CacheSidecar
+{
+public:
+    CacheSidecar();
+
+    static QString fileName(const QString &cacheFile);
+
+    /* Returns false if there is no sidecar, or it does not belong to cacheFile as it is now */
+    bool load(const QString &cacheFile);
+    /* Call after the cache file is closed */
+    bool save(const QString &cacheFile) const;
+    static void remove(const QString &cacheFile);
+
+    /* Hex encoded SHA256 of the extracted image */
+    QByteArray extractHash;
+    /* Length of the image extractHash covers, if the cache file is the extracted
+       image. The file must have exactly that length. 0 for downloaded files */
+    quint64 imageSize;
+    /* Binary chunk hashes, see ChunkedHash. Empty if not available */
+    quint64 chunkSize;
+    ChunkedHash::Algorithm chunkAlgorithm;
+    QVector<QByteArray> chunks;
+    /* Cache file was recompressed by CacheTranscoder, it is not the file as downloaded */
+    bool transcoded;
+};
+
+#endif // CACHESIDECAR_H
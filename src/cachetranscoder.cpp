@@ -0,0 +1,246 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachetranscoder.h"
+#include "acceleratedcryptographichash.h"
+#include "cachesidecar.h"
+#include "chunkindex.h"
+#include "config.h"
+#include "imageprobe.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+#include <QtEndian>
+#include <archive.h>
+#include <archive_entry.h>
+#include <deque>
+#include <memory>
+#include <zstd.h>
+
+/* Footer of the zstd seekable format */
+#define ZSTD_SEEKABLE_MAGIC     0x8F92EAB1
+
+namespace {
+
+/* A chunk of the image, compressed on the pool */
+struct Frame
+{
+    QByteArray frame;
+    quint32 size = 0;
+};
+
+Frame compressFrame(QByteArray data)
+{
+    Frame f;
+    f.size = data.size();
+    f.frame.resize(ZSTD_compressBound(data.size()));
+    size_t n = ZSTD_compress(f.frame.data(), f.frame.size(), data.constData(), data.size(), IMAGEWRITER_CACHE_TRANSCODE_ZSTD_LEVEL);
+    if (ZSTD_isError(n))
+        f.frame.clear();
+    else
+        f.frame.resize(n);
+
+    return f;
+}
+
+} // namespace
+
+CacheTranscoder::CacheTranscoder(QObject *parent)
+    : QThread(parent), _cancelled(false)
+{
+}
+
+CacheTranscoder::~CacheTranscoder()
+{
+    cancel();
+    wait();
+}
+
+void CacheTranscoder::setEntries(const QList<Entry> &entries)
+{
+    QMutexLocker lock(&_mutex);
+    _entries = entries;
+}
+
+void CacheTranscoder::cancel()
+{
+    _cancelled = true;
+}
+
+QString CacheTranscoder::fileName(const QString &cacheFile)
+{
+    return cacheFile+".transcode";
+}
+
+/* lz4 decodes about as fast as zstd already, zip and 7z may hold several files */
+bool CacheTranscoder::isCandidate(const QString &cacheFile)
+{
+    ImageProbe::Format format = ImageProbe::sniffFile(cacheFile);
+    return (format == ImageProbe::FormatXz || format == ImageProbe::FormatBzip2 || format == ImageProbe::FormatGzip)
+            && !QFile::exists(ChunkIndex::fileName(cacheFile));
+}
+
+void CacheTranscoder::run()
+{
+    _cancelled = false;
+    QList<Entry> entries;
+    {
+        QMutexLocker lock(&_mutex);
+        entries = _entries;
+    }
+    QElapsedTimer t;
+    int done = 0;
+    t.start();
+
+    for (const Entry &entry : std::as_const(entries))
+    {
+        bool ok = _transcode(entry);
+        if (_cancelled)
+            return;
+
+        if (ok)
+        {
+            done++;
+            emit transcoded(entry.sha256, fileName(entry.fileName));
+        }
+    }
+
+    qDebug() << "Transcoded" << done << "of" << entries.size() << "cache files to zstd in" << t.elapsed() / 1000 << "seconds";
+}
+
+bool CacheTranscoder::_transcode(const Entry &entry)
+{
+    const QString outName = fileName(entry.fileName);
+    std::unique_ptr<struct archive, decltype(&archive_read_free)> a(archive_read_new(), &archive_read_free);
+    struct archive_entry *ae;
+    archive_read_support_filter_all(a.get());
+    archive_read_support_format_raw(a.get());
+    if (archive_read_open_filename(a.get(), QFile::encodeName(entry.fileName).constData(), IMAGEWRITER_BLOCKSIZE) != ARCHIVE_OK
+            || archive_read_next_header(a.get(), &ae) != ARCHIVE_OK)
+    {
+        qDebug() << "Cannot decode cache file" << entry.fileName << "for transcoding:" << archive_error_string(a.get());
+        return false;
+    }
+
+    QFile out(outName);
+    if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        qDebug() << "Cannot create" << outName << ":" << out.errorString();
+        return false;
+    }
+    const qint64 maxSize = QFileInfo(entry.fileName).size() * IMAGEWRITER_CACHE_TRANSCODE_MAX_GROWTH / 100;
+
+    /* The image is decoded in order here, while the pool compresses the chunks decoded before */
+    const int threads = qMax(1, QThread::idealThreadCount());
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    std::deque<QFuture<Frame>> pending;
+    QVector<QPair<quint32, quint32>> frames;
+    AcceleratedCryptographicHash hash(QCryptographicHash::Sha256);
+    bool eof = false, ok = true;
+
+    while (ok && !_cancelled && (!eof || !pending.empty()))
+    {
+        if (!eof && pending.size() < (size_t) threads*2)
+        {
+            QByteArray data(IMAGEWRITER_HASH_CHUNKSIZE, Qt::Uninitialized);
+            qint64 len = 0;
+            while (len < data.size())
+            {
+                la_ssize_t n = archive_read_data(a.get(), data.data()+len, data.size()-len);
+                if (n < 0)
+                {
+                    qDebug() << "Error decoding cache file" << entry.fileName << ":" << archive_error_string(a.get());
+                    ok = false;
+                    break;
+                }
+                if (n == 0)
+                {
+                    eof = true;
+                    break;
+                }
+                len += n;
+            }
+            if (ok && len)
+            {
+                data.resize(len);
+                hash.addData(data.constData(), len);
+                pending.push_back(QtConcurrent::run(&pool, compressFrame, data));
+            }
+            continue;
+        }
+
+        Frame f = pending.front().result();
+        pending.pop_front();
+        if (f.frame.isEmpty() || out.write(f.frame) != f.frame.size())
+        {
+            qDebug() << "Error writing" << outName;
+            ok = false;
+            continue;
+        }
+        frames.append(qMakePair((quint32) f.frame.size(), f.size));
+        if (out.pos() > maxSize)
+        {
+            qDebug() << "Not transcoding" << entry.fileName << "as it compresses much better than zstd does";
+            ok = false;
+        }
+    }
+    for (QFuture<Frame> &f : pending)
+        f.waitForFinished();
+
+    ok = ok && !_cancelled && !frames.isEmpty();
+    if (ok && hash.result().toHex() != entry.sha256)
+    {
+        /* Left to the write from it to find, as it would with the original file */
+        qDebug() << "Cache file" << entry.fileName << "does not decode to its hash. Not transcoding";
+        ok = false;
+    }
+    if (ok)
+    {
+        /* Seek table in a skippable frame, as in zstd's contrib/seekable_format */
+        QByteArray table(8 + frames.size()*8 + 9, Qt::Uninitialized);
+        char *p = table.data();
+        qToLittleEndian<quint32>(ZSTD_MAGIC_SKIPPABLE_START+0xE, p);
+        qToLittleEndian<quint32>(table.size()-8, p+4);
+        p += 8;
+        for (const auto &frame : std::as_const(frames))
+        {
+            qToLittleEndian<quint32>(frame.first, p);
+            qToLittleEndian<quint32>(frame.second, p+4);
+            p += 8;
+        }
+        qToLittleEndian<quint32>(frames.size(), p);
+        p[4] = 0;
+        qToLittleEndian<quint32>(ZSTD_SEEKABLE_MAGIC, p+5);
+        ok = out.write(table) == table.size() && out.flush();
+    }
+    out.close();
+
+    /* Chunk hashes are of the extracted image, so they hold for the new file as well */
+    CacheSidecar sidecar;
+    if (ok)
+    {
+        if (!sidecar.load(entry.fileName) || sidecar.extractHash != entry.sha256)
+        {
+            sidecar = CacheSidecar();
+            sidecar.extractHash = entry.sha256;
+        }
+        sidecar.transcoded = true;
+        ok = sidecar.save(outName);
+    }
+    if (!ok)
+    {
+        out.remove();
+        CacheSidecar::remove(outName);
+        return false;
+    }
+
+    qDebug() << "Transcoded" << entry.fileName << "from" << QFileInfo(entry.fileName).size() << "to" << out.size() << "bytes in"
+             << frames.size() << "zstd frames";
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef CACHETRANSCODER_H
+#define CACHETRANSCODER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QMutex>
+#include <QString>
+#include <QThread>
+#include <atomic>
+
+/*
+ * Background recompression of download cache entries into seekable zstd
+ *
+ * xz, bzip2 and gzip images decode on a single core, every time they are
+ * written from the cache. Once started, the thread decodes the files given
+ * to setEntries() and compresses them again, a zstd frame per
+ * IMAGEWRITER_HASH_CHUNKSIZE on all cores, with a seek table at the end
+ * like DeviceCaptureThread writes. Writes from those decode the frames in
+ * parallel, without a decompressed copy of the image on disk.
+ *
+ * The decoded image has to match the SHA256 the entry is named after. The
+ * result is written next to the entry, with a sidecar for the same
+ * extracted image marked as transcoded, and handed to the owner of the
+ * cache to swap in on its own thread. Entries in other formats, used as
+ * chunk pack (see ChunkIndex) or growing past
+ * IMAGEWRITER_CACHE_TRANSCODE_MAX_GROWTH percent are left as they are.
+ */
+class CacheTranscoder : public QThread
+{
+    Q_OBJECT
+public:
+    struct Entry
+    {
+        /* Hex SHA256 of the extracted image */
+        QByteArray sha256;
+        QString fileName;
+    };
+
+    explicit CacheTranscoder(QObject *parent = nullptr);
+    virtual ~CacheTranscoder();
+
+    /* Entries to transcode on the next start() */
+    void setEntries(const QList<Entry> &entries);
+    void cancel();
+    /* Name the transcoded file of cacheFile is written to */
+    static QString fileName(const QString &cacheFile);
+    /* Entry can be transcoded, judging by its format */
+    static bool isCandidate(const QString &cacheFile);
+
+signals:
+    /* Transcoded file with its sidecar is at fileName(). Removing it is up to the receiver */
+    void transcoded(QByteArray sha256, QString fileName);
+
+protected:
+    mutable QMutex _mutex;
+    QList<Entry> _entries;
+    std::atomic<bool> _cancelled;
+
+    virtual void run();
+    bool _transcode(const Entry &entry);
+};
+
+#endif // CACHETRANSCODER_H
@@ -0,0 +1,121 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachevolumes.h"
+#include "config.h"
+#include "metadataindex.h"
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonObject>
+#include <QRandomGenerator>
+#include <QStorageInfo>
+
+#ifdef Q_OS_LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+void CacheVolumes::setRoots(const QStringList &roots)
+{
+    _volumes.clear();
+    MetadataIndex &index = MetadataIndex::instance();
+
+    for (const QString &r : roots)
+    {
+        QString root = QDir::cleanPath(r);
+        QDir().mkpath(root);
+        QStorageInfo si(root);
+        if (!QFileInfo(root).isDir() || !si.isValid() || si.isReadOnly())
+        {
+            qDebug() << "Cache root" << root << "is not usable, leaving it out";
+            continue;
+        }
+
+        /* Speeds are stored as strings, as JSON numbers are doubles */
+        QJsonObject record = index.value("cachevolumes", root.toUtf8());
+        quint64 speed = 0;
+        if (record.value("device").toString() == QString::fromUtf8(si.device()))
+            speed = record.value("read_speed").toString().toULongLong();
+        if (!speed)
+        {
+            speed = _measureReadSpeed(root);
+            if (speed)
+                index.put("cachevolumes", root.toUtf8(), {{"device", QString::fromUtf8(si.device())}, {"read_speed", QString::number(speed)}});
+        }
+
+        qDebug() << "Cache root" << root << "on" << si.device() << ":" << si.bytesTotal()/1024/1024/1024 << "GB,"
+                 << speed/1024/1024 << "MB/s";
+        _volumes.append({root, (quint64) si.bytesTotal(), speed});
+    }
+}
+
+QList<CacheVolumes::Volume> CacheVolumes::volumes() const
+{
+    return _volumes;
+}
+
+QString CacheVolumes::fastest() const
+{
+    const Volume *best = nullptr;
+    for (const Volume &v : _volumes)
+    {
+        if (!best || v.readSpeed > best->readSpeed)
+            best = &v;
+    }
+
+    return best ? best->root : QString();
+}
+
+QString CacheVolumes::largest() const
+{
+    const Volume *best = nullptr;
+    for (const Volume &v : _volumes)
+    {
+        if (!best || v.capacity > best->capacity)
+            best = &v;
+    }
+
+    return best ? best->root : QString();
+}
+
+/* Random data, so file systems that compress cannot make it smaller */
+quint64 CacheVolumes::_measureReadSpeed(const QString &root)
+{
+    QFile f(root+QDir::separator()+"volumeprobe.tmp");
+    if (!f.open(QIODevice::WriteOnly))
+        return 0;
+
+    QByteArray buf(IMAGEWRITER_CACHE_WRITER_BUFFER, Qt::Uninitialized);
+    QRandomGenerator::global()->fillRange(reinterpret_cast<quint32 *>(buf.data()), buf.size()/sizeof(quint32));
+    qint64 written = 0;
+    while (written < IMAGEWRITER_CACHE_VOLUME_PROBE_SIZE && f.write(buf) == buf.size())
+        written += buf.size();
+    bool ok = written >= IMAGEWRITER_CACHE_VOLUME_PROBE_SIZE && f.flush();
+#ifdef Q_OS_LINUX
+    /* Read it from the disk rather than the page cache. Elsewhere some of it may come from memory */
+    ok = ok && fdatasync(f.handle()) == 0;
+    if (ok)
+        posix_fadvise(f.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    f.close();
+
+    quint64 speed = 0;
+    if (ok && f.open(QIODevice::ReadOnly))
+    {
+        QElapsedTimer timer;
+        timer.start();
+        qint64 n, total = 0;
+        while ((n = f.read(buf.data(), buf.size())) > 0)
+            total += n;
+        speed = total * 1000 / qMax((qint64) 1, timer.elapsed());
+        f.close();
+    }
+    f.remove();
+
+    return speed;
+}
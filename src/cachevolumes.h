@@ -0,0 +1,55 @@
+#ifndef CACHEVOLUMES_H
+#define CACHEVOLUMES_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+/*
+ * Directories the cache can be spread over, e.g. on a small fast SSD and
+ * a large hard disk
+ *
+ * The capacity of each comes from its file system, the read throughput is
+ * measured once by writing a probe file of IMAGEWRITER_CACHE_VOLUME_PROBE_SIZE
+ * and reading it back. Measurements are kept in the MetadataIndex, and
+ * taken again if a different file system is mounted at the directory.
+ *
+ * Decompressed images are read at the speed they are written to the
+ * device, so they go to the fastest volume, together with what is staged
+ * in memory once it is copied to disk. Compressed downloads are only read
+ * as fast as they decompress, and go to the largest. An image evicted
+ * from the fast volume stays on the large one compressed, and is
+ * decompressed to the fast one again when it is next written.
+ */
+class CacheVolumes
+{
+public:
+    struct Volume
+    {
+        QString root;
+        /* Size of the file system in bytes */
+        quint64 capacity;
+        /* Measured in bytes per second, 0 if not measured */
+        quint64 readSpeed;
+    };
+
+    /* Roots that cannot be created or written to are left out */
+    void setRoots(const QStringList &roots);
+    QList<Volume> volumes() const;
+    /* Root with the highest read throughput, empty if there is none */
+    QString fastest() const;
+    /* Root on the largest file system, empty if there is none */
+    QString largest() const;
+
+protected:
+    QList<Volume> _volumes;
+
+    static quint64 _measureReadSpeed(const QString &root);
+};
+
+#endif // CACHEVOLUMES_H
@@ -0,0 +1,203 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "cachewriter.h"
+#include "config.h"
+#include "threadplacement.h"
+#include <QDebug>
+#include <QFile>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+CacheWriter::CacheWriter()
+    : _file(nullptr), _pool(nullptr), _currentLen(0), _busy(false), _stopping(false), _failed(false)
+{
+}
+
+CacheWriter::~CacheWriter()
+{
+    stop();
+    _current = PooledBuffer();
+    if (_pool)
+        _pool->release();
+}
+
+void CacheWriter::open(QFile *file)
+{
+    stop();
+    _file = file;
+    _failed = false;
+    _stopping = false;
+    if (!_pool)
+        _pool = new BufferPool(IMAGEWRITER_CACHE_WRITER_BUFFER);
+    start();
+}
+
+bool CacheWriter::isOpen() const
+{
+    return _file != nullptr;
+}
+
+bool CacheWriter::write(const char *buf, size_t len)
+{
+    while (len && !_failed)
+    {
+        if (!_current)
+        {
+            _current = _pool->acquire(IMAGEWRITER_CACHE_WRITER_BUFFER);
+            _currentLen = 0;
+        }
+
+        size_t n = qMin(len, _current.capacity()-_currentLen);
+        ::memcpy(_current.get()+_currentLen, buf, n);
+        _currentLen += n;
+        buf += n;
+        len -= n;
+
+        if (_currentLen == _current.capacity())
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _queueCurrent(lock);
+        }
+    }
+
+    return !_failed;
+}
+
+void CacheWriter::_queueCurrent(std::unique_lock<std::mutex> &lock)
+{
+    if (!_current || !_currentLen)
+        return;
+
+    _cv.wait(lock, [this]() { return _queue.size() < IMAGEWRITER_CACHE_WRITER_QUEUE || _failed; });
+    _queue.push_back({_current, _currentLen, false, CacheJournal()});
+    _current = PooledBuffer();
+    _currentLen = 0;
+    _cv.notify_all();
+}
+
+void CacheWriter::writeJournal(const CacheJournal &journal)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _queueCurrent(lock);
+    _queue.push_back({PooledBuffer(), 0, true, journal});
+    _cv.notify_all();
+}
+
+void CacheWriter::setWrittenCallback(std::function<void(quint64)> callback)
+{
+    _written = callback;
+}
+
+bool CacheWriter::flush()
+{
+    if (!isRunning())
+        return !_failed;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _queueCurrent(lock);
+    _cv.wait(lock, [this]() { return _queue.empty() && !_busy; });
+
+    return !_failed;
+}
+
+bool CacheWriter::stop(bool discard)
+{
+    if (isRunning())
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (discard)
+            {
+                _queue.clear();
+                _current = PooledBuffer();
+                _currentLen = 0;
+            }
+            else
+            {
+                _queueCurrent(lock);
+            }
+            _stopping = true;
+            _cv.notify_all();
+        }
+        wait();
+    }
+    _file = nullptr;
+
+    return !_failed;
+}
+
+void CacheWriter::run()
+{
+    ThreadPlacement::apply(ThreadPlacement::StageCache);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _cv.wait(lock, [this]() { return !_queue.empty() || _stopping; });
+        if (_queue.empty())
+            break;
+
+        Item item = std::move(_queue.front());
+        _queue.pop_front();
+        _busy = true;
+        _cv.notify_all();
+        lock.unlock();
+
+        if (_failed)
+        {
+            /* Nothing more is written once something went missing */
+        }
+        else if (item.isJournal)
+        {
+            /* Data has to be on disk before the journal says it is */
+            _file->flush();
+#ifndef Q_OS_WIN
+            ::fsync(_file->handle());
+#endif
+            if (!item.journal.save(_file->fileName()))
+                qDebug() << "Error saving cache journal";
+        }
+        else if (_file->write(item.data.get(), item.len) != (qint64) item.len)
+        {
+            qDebug() << "Error writing to cache file:" << _file->errorString();
+            _failed = true;
+        }
+        else if (_written && _file->flush())
+        {
+            /* Readers of the file see it once it is out of the QFile buffer */
+            _written(_file->pos());
+        }
+        item.data = PooledBuffer();
+
+        lock.lock();
+        _busy = false;
+        _cv.notify_all();
+    }
+}
+
+void CacheWriter::preallocate(QFile &file, qint64 size)
+{
+    /* QFile::resize() alone may leave a sparse file that fragments as it fills, or have zeroes written */
+#ifdef Q_OS_LINUX
+    if (size > file.size() && ::fallocate(file.handle(), 0, 0, size) == -1)
+        qDebug() << "Cannot preallocate cache file:" << strerror(errno);
+#elif defined(Q_OS_DARWIN)
+    if (size > file.size())
+    {
+        /* Contiguous if possible */
+        fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, size - file.size(), 0};
+        if (::fcntl(file.handle(), F_PREALLOCATE, &store) == -1)
+        {
+            store.fst_flags = F_ALLOCATEALL;
+            if (::fcntl(file.handle(), F_PREALLOCATE, &store) == -1)
+                qDebug() << "Cannot preallocate cache file:" << strerror(errno);
+        }
+    }
+#endif
+    file.resize(size);
+}
@@ -0,0 +1,83 @@
+#ifndef CACHEWRITER_H
+#define CACHEWRITER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bufferpool.h"
+#include "cachejournal.h"
+#include <QThread>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+class QFile;
+
+/*
+ * Appends the download to the cache file from a thread of its own
+ *
+ * Data handed to write() is copied into pooled buffers and written in
+ * order, so a slow cache disk does not hold up receiving. The thread runs
+ * with the lowest I/O priority the OS has, unless ThreadPlacement says
+ * otherwise: writing the image to the device comes first. Only once
+ * IMAGEWRITER_CACHE_WRITER_QUEUE buffers are waiting does write() block.
+ *
+ * Nobody else may use the file while there is something queued, call
+ * flush() or stop() before reading, seeking or closing it.
+ */
+class CacheWriter : public QThread
+{
+public:
+    CacheWriter();
+    virtual ~CacheWriter();
+
+    /* Write to file, from its current position on. Starts the thread */
+    void open(QFile *file);
+    bool isOpen() const;
+
+    /* Queue len bytes. Returns false if an earlier write failed */
+    bool write(const char *buf, size_t len);
+    /* Save journal next to the file once all data queued so far is on disk */
+    void writeJournal(const CacheJournal &journal);
+    /* Wait until everything queued is written. Returns false if a write failed */
+    bool flush();
+    /* Stop the thread. What is queued is written first, unless discard is set.
+       Returns false if a write failed */
+    bool stop(bool discard = false);
+
+    /* Called from the thread with the size of the file written so far, after each write */
+    void setWrittenCallback(std::function<void(quint64)> callback);
+
+    /* Reserve space for the file without writing anything, and set its size */
+    static void preallocate(QFile &file, qint64 size);
+
+protected:
+    struct Item
+    {
+        PooledBuffer data;
+        size_t len;
+        bool isJournal;
+        CacheJournal journal;
+    };
+
+    virtual void run();
+    /* Queue the buffer being filled */
+    void _queueCurrent(std::unique_lock<std::mutex> &lock);
+
+    QFile *_file;
+    BufferPool *_pool;
+    PooledBuffer _current;
+    size_t _currentLen;
+    std::deque<Item> _queue;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _busy, _stopping;
+    std::atomic<bool> _failed;
+    std::function<void(quint64)> _written;
+};
+
+#endif // CACHEWRITER_H
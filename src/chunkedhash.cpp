@@ -0,0 +1,147 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "chunkedhash.h"
+
+ChunkedHash::ChunkedHash(size_t chunkSize, Algorithm algorithm)
+    : _chunkSize(chunkSize), _fill(0), _algorithm(algorithm)
+{
+}
+
+void ChunkedHash::addData(const char *data, size_t len)
+{
+    while (len)
+    {
+        if (!_fill)
+        {
+            if (_algorithm == Sha256)
+                _current.reset(new AcceleratedCryptographicHash(QCryptographicHash::Sha256));
+            else
+                _crc = ::Crc32c();
+        }
+
+        size_t n = qMin(len, _chunkSize-_fill);
+        if (_algorithm == Sha256)
+            _current->addData(data, n);
+        else
+            _crc.addData(data, n);
+        _fill += n;
+        data += n;
+        len -= n;
+
+        if (_fill == _chunkSize)
+        {
+            _leaves.append(_leafResult());
+            _fill = 0;
+        }
+    }
+}
+
+void ChunkedHash::finalize()
+{
+    if (_fill)
+    {
+        _leaves.append(_leafResult());
+        _fill = 0;
+    }
+}
+
+void ChunkedHash::reset()
+{
+    _current.reset();
+    _fill = 0;
+    _leaves.clear();
+}
+
+void ChunkedHash::setLeaves(const QVector<QByteArray> &leaves)
+{
+    reset();
+    _leaves = leaves;
+}
+
+void ChunkedHash::setAlgorithm(Algorithm algorithm)
+{
+    reset();
+    _algorithm = algorithm;
+}
+
+size_t ChunkedHash::chunkSize() const
+{
+    return _chunkSize;
+}
+
+ChunkedHash::Algorithm ChunkedHash::algorithm() const
+{
+    return _algorithm;
+}
+
+const QVector<QByteArray> &ChunkedHash::leaves() const
+{
+    return _leaves;
+}
+
+QByteArray ChunkedHash::rootHash() const
+{
+    AcceleratedCryptographicHash root(QCryptographicHash::Sha256);
+
+    for (const QByteArray &leaf : _leaves)
+        root.addData(leaf);
+
+    return root.result();
+}
+
+QByteArray ChunkedHash::hashLeaf(const char *data, size_t len) const
+{
+    return hash(data, len, _algorithm);
+}
+
+QByteArray ChunkedHash::_leafResult()
+{
+    if (_algorithm == Sha256)
+    {
+        QByteArray result = _current->result();
+        _current.reset();
+        return result;
+    }
+
+    return _crc.result();
+}
+
+QByteArray ChunkedHash::hash(const char *data, size_t len, Algorithm algorithm)
+{
+    if (algorithm == Crc32c)
+    {
+        ::Crc32c crc;
+        crc.addData(data, len);
+        return crc.result();
+    }
+
+    AcceleratedCryptographicHash h(QCryptographicHash::Sha256);
+    h.addData(data, len);
+
+    return h.result();
+}
+
+const char *ChunkedHash::algorithmName(Algorithm algorithm)
+{
+    return algorithm == Crc32c ? "crc32c" : "sha256";
+}
+
+bool ChunkedHash::algorithmFromName(const QByteArray &name, Algorithm *algorithm)
+{
+    if (name == "sha256")
+        *algorithm = Sha256;
+    else if (name == "crc32c")
+        *algorithm = Crc32c;
+    else
+        return false;
+
+    return true;
+}
+
+int ChunkedHash::leafSize(Algorithm algorithm)
+{
+    return algorithm == Crc32c ? 4 : 32;
+}
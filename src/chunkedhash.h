@@ -0,0 +1,70 @@
+#ifndef CHUNKEDHASH_H
+#define CHUNKEDHASH_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "acceleratedcryptographichash.h"
+#include "crc32c.h"
+#include <QByteArray>
+#include <QVector>
+#include <memory>
+
+/*
+ * Merkle style hash of an image: a leaf for every chunkSize bytes,
+ * and a SHA256 root hash over the concatenated leaves
+ *
+ * Leaves can be checked independently of each other, so verification can
+ * run on all cores and tell which region of the storage does not match.
+ * Leaves are SHA256 by default. CRC32C leaves are much cheaper to compute
+ * on CPUs with CRC instructions, and are good enough for catching storage
+ * that does not return what was written. They are not for checking
+ * downloaded data, which is always done with SHA256.
+ */
+class ChunkedHash
+{
+public:
+    enum Algorithm {
+        Sha256,
+        Crc32c
+    };
+
+    explicit ChunkedHash(size_t chunkSize, Algorithm algorithm = Sha256);
+
+    /* Add image data, in order */
+    void addData(const char *data, size_t len);
+    /* Finish the last (partial) leaf */
+    void finalize();
+    void reset();
+    /* Use leaves computed earlier, instead of hashing the data again */
+    void setLeaves(const QVector<QByteArray> &leaves);
+    /* Also resets */
+    void setAlgorithm(Algorithm algorithm);
+
+    size_t chunkSize() const;
+    Algorithm algorithm() const;
+    const QVector<QByteArray> &leaves() const;
+    QByteArray rootHash() const;
+    /* Hash a single chunk the same way leaves are */
+    QByteArray hashLeaf(const char *data, size_t len) const;
+
+    static QByteArray hash(const char *data, size_t len, Algorithm algorithm = Sha256);
+    /* "sha256" or "crc32c", as used on the command line and in cache sidecars */
+    static const char *algorithmName(Algorithm algorithm);
+    static bool algorithmFromName(const QByteArray &name, Algorithm *algorithm);
+    /* Bytes per leaf */
+    static int leafSize(Algorithm algorithm);
+
+protected:
+    size_t _chunkSize, _fill;
+    Algorithm _algorithm;
+    std::unique_ptr<AcceleratedCryptographicHash> _current;
+    ::Crc32c _crc;
+    QVector<QByteArray> _leaves;
+
+    QByteArray _leafResult();
+};
+
+#endif // CHUNKEDHASH_H
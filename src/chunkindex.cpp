@@ -0,0 +1,137 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "chunkindex.h"
+#include "config.h"
+#include <QDebug>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+ChunkIndex::ChunkIndex()
+    : imageSize(0)
+{
+}
+
+QString ChunkIndex::fileName(const QString &cacheFile)
+{
+    return cacheFile+".chunks";
+}
+
+bool ChunkIndex::parse(const QByteArray &json)
+{
+    imageHash.clear();
+    imageSize = 0;
+    packUrl.clear();
+    chunks.clear();
+    _json.clear();
+
+    QJsonObject obj = QJsonDocument::fromJson(json).object();
+    if (obj.value("version").toInt() != 1)
+    {
+        qDebug() << "Unsupported chunk index version";
+        return false;
+    }
+
+    QByteArray hash = obj.value("image_sha256").toString().toLatin1().toLower();
+    quint64 size = obj.value("image_size").toInteger();
+    QString pack = obj.value("pack_url").toString();
+    const QJsonArray list = obj.value("chunks").toArray();
+    if (hash.size() != 64 || !size || pack.isEmpty() || list.isEmpty())
+        return false;
+
+    QVector<Chunk> parsed;
+    quint64 offset = 0;
+    parsed.reserve(list.size());
+    for (const QJsonValue &v : list)
+    {
+        const QJsonArray entry = v.toArray();
+        Chunk chunk;
+        chunk.sha256 = QByteArray::fromHex(entry.at(0).toString().toLatin1());
+        chunk.offset = offset;
+        chunk.size = entry.at(1).toInteger();
+        chunk.packOffset = entry.at(2).toInteger();
+        chunk.packSize = entry.at(3).toInteger();
+
+        if (chunk.sha256.size() != 32 || !chunk.size || chunk.size > IMAGEWRITER_DELTA_MAX_CHUNK_SIZE
+                || !chunk.packSize || chunk.packSize > IMAGEWRITER_DELTA_MAX_CHUNK_SIZE)
+        {
+            qDebug() << "Invalid entry in chunk index at image offset" << offset;
+            return false;
+        }
+        offset += chunk.size;
+        parsed.append(chunk);
+    }
+    if (offset != size)
+    {
+        qDebug() << "Chunks of chunk index do not add up to the image size";
+        return false;
+    }
+
+    imageHash = hash;
+    imageSize = size;
+    packUrl = pack;
+    chunks = parsed;
+    _json = json;
+
+    return true;
+}
+
+bool ChunkIndex::load(const QString &cacheFile)
+{
+    QFile f(fileName(cacheFile));
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+
+    return parse(f.readAll());
+}
+
+bool ChunkIndex::save(const QString &cacheFile) const
+{
+    QByteArray json = _json.isEmpty() ? toJson() : _json;
+    if (json.isEmpty())
+        return false;
+
+    QFile f(fileName(cacheFile));
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate) || f.write(json) != json.size())
+    {
+        qDebug() << "Error writing chunk index" << f.fileName();
+        return false;
+    }
+
+    return true;
+}
+
+QByteArray ChunkIndex::toJson() const
+{
+    if (chunks.isEmpty())
+        return QByteArray();
+
+    QJsonArray list;
+    for (const Chunk &chunk : chunks)
+    {
+        list.append(QJsonArray({QString(chunk.sha256.toHex()), (qint64) chunk.size,
+                                (qint64) chunk.packOffset, (qint64) chunk.packSize}));
+    }
+
+    return QJsonDocument(QJsonObject({
+        {"version", 1},
+        {"image_sha256", QString(imageHash)},
+        {"image_size", (qint64) imageSize},
+        {"pack_url", packUrl},
+        {"chunks", list}
+    })).toJson(QJsonDocument::Compact);
+}
+
+void ChunkIndex::remove(const QString &cacheFile)
+{
+    QFile::remove(fileName(cacheFile));
+}
+
+bool ChunkIndex::isEmpty() const
+{
+    return chunks.isEmpty();
+}
@@ -0,0 +1,68 @@
+#ifndef CHUNKINDEX_H
+#define CHUNKINDEX_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+/*
+ * Chunk index of an image, as optionally published next to it in the OS list
+ * (chunk_index_url). Images are cut into content defined chunks on the server,
+ * so successive releases share most chunks even if data moved around.
+ *
+ * JSON object:
+ *   "version":      1
+ *   "image_sha256": hex SHA256 of the extracted image
+ *   "image_size":   size of the extracted image
+ *   "pack_url":     chunk pack, absolute or relative to the index
+ *   "chunks":       [hex SHA256, size, offset in pack, length in pack] for
+ *                   every chunk, in image order
+ *
+ * The pack holds every chunk as a zstd frame of its own, so any run of
+ * them can be fetched with a single range request.
+ *
+ * A copy is kept next to an extracted cache entry, so later versions can
+ * take the chunks they share with it from there.
+ */
+class ChunkIndex
+{
+public:
+    struct Chunk
+    {
+        /* Binary SHA256 */
+        QByteArray sha256;
+        quint64 offset, size;
+        quint64 packOffset, packSize;
+    };
+
+    ChunkIndex();
+
+    static QString fileName(const QString &cacheFile);
+
+    /* Returns false if json is not a valid index */
+    bool parse(const QByteArray &json);
+    /* Index stored next to cacheFile */
+    bool load(const QString &cacheFile);
+    bool save(const QString &cacheFile) const;
+    /* JSON of the fields below, for an index built rather than parsed */
+    QByteArray toJson() const;
+    static void remove(const QString &cacheFile);
+
+    bool isEmpty() const;
+
+    /* Hex encoded, lower case */
+    QByteArray imageHash;
+    quint64 imageSize;
+    QString packUrl;
+    QVector<Chunk> chunks;
+
+protected:
+    QByteArray _json;
+};
+
+#endif // CHUNKINDEX_H
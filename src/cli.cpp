@@ -4,11 +4,28 @@
  */
 
 #include "cli.h"
+#include "clidaemon.h"
+#include "devicebenchmarkthread.h"
+#include "devicecapturethread.h"
+#include "sitediagnosticthread.h"
+#include "verifyonlythread.h"
 #include "imagewriter.h"
+#include "downloadthread.h"
+#include "pipelinememory.h"
+#include "pipelinetrace.h"
+#include "threadplacement.h"
+#include "bandwidthscheduler.h"
+#include "cachepreseeder.h"
+#include "stationmode.h"
+#ifdef Q_OS_LINUX
+#include "linux/compositewriter.h"
+#endif
 #include <iostream>
 #include <QCoreApplication>
 #include <QCommandLineParser>
 #include <QFileInfo>
+#include <QJsonDocument>
+#include <QLoggingCategory>
 #include "drivelistmodel.h"
 #include "dependencies/drivelist/src/drivelist.hpp"
 
@@ -17,7 +34,8 @@ static void devnullMsgHandler(QtMsgType, const QMessageLogContext &, const QStri
 {
 }
 
-Cli::Cli(int &argc, char *argv[]) : QObject(nullptr)
+Cli::Cli(int &argc, char *argv[]) : QObject(nullptr), _lastPercent(-1), _quiet(false), _jsonProgress(false),
+    _phaseStartBytes(0), _progressBytes(0), _phaseStartTime(0), _progressTime(0), _eta(-1)
 {
 #ifdef Q_OS_WIN
     /* Allocate console on Windows (only needed if compiled as GUI program) */
@@ -39,11 +57,17 @@ Cli::Cli(int &argc, char *argv[]) : QObject(nullptr)
     connect(_imageWriter, &ImageWriter::downloadProgress, this, &Cli::onDownloadProgress);
     connect(_imageWriter, &ImageWriter::sendProgress, this, &Cli::onSendingProgress);
     connect(_imageWriter, &ImageWriter::verifyProgress, this, &Cli::onVerifyProgress);
+    connect(_imageWriter, &ImageWriter::progressChanged, this, &Cli::onProgressChanged);
+    connect(_imageWriter, &ImageWriter::phaseStarted, this, &Cli::onPhaseStarted);
+    connect(_imageWriter, &ImageWriter::phaseFinished, this, &Cli::onPhaseFinished);
 }
 
 Cli::~Cli()
 {
     delete _imageWriter;
+    /* The write threads are gone now */
+    if (!_traceFile.isEmpty() && !PipelineTrace::writeChromeTrace(_traceFile))
+        std::cerr << "Error: cannot write trace to " << _traceFile.toStdString() << std::endl;
     delete _app;
 }
 
@@ -56,36 +80,148 @@ int Cli::run()
         {"enable-writing-system-drives", "Only use this if you know what you are doing"},
         {"sha256", "Expected hash", "sha256", ""},
         {"cache-file", "Custom cache file (requires setting sha256 as well)", "cache-file", ""},
+        {"cache-extracted", "Also cache the decompressed image, so writing it again needs no decompression"},
+        {"ram-stage", "Keep decompressed images of up to this many MB in total in memory", "ram-stage", ""},
+        {"bmap", "bmap file/URL listing the ranges of the image that contain data", "bmap", ""},
         {"first-run-script", "Add firstrun.sh to image", "first-run-script", ""},
         {"cloudinit-userdata", "Add cloud-init user-data file to image", "cloudinit-userdata", ""},
         {"cloudinit-networkconfig", "Add cloud-init network-config file to image", "cloudinit-networkconfig", ""},
         {"disable-eject", "Disable automatic ejection of storage media after verification"},
+        {"direct-io", "Bypass the OS page cache when writing and verifying"},
+        {"disable-io-uring", "Use regular reads and writes instead of io_uring (Linux)"},
+        {"sparse-write", "Skip writing all-zero blocks if the drive reads back as zeroes after discard, and free space of ext and FAT file systems in images without bmap (Linux)"},
+        {"delta-write", "Only write blocks that differ from what is on the drive, for reflashing a similar image (Linux, macOS)"},
+        {"disable-resume", "Start over instead of resuming an interrupted write of the same image to the same drive"},
+        {"disable-capacity-probe", "Do not check that the drive holds data up to the capacity it reports before writing it"},
+        {"overlapped-verify", "Start verifying written data while the rest of the image is still being written (Linux)"},
+        {"chunked-verify", "Verify using a hash per chunk of the image, on all cores"},
+        {"tune-queue", "Tune the block queue of the destination drives while writing, and restore it afterwards: no scheduler, larger requests and read-ahead, no writeback throttling. Follows --write-block-size and --write-queue-depth, e.g. from --benchmark (Linux)"},
+        {"verify-hash", "Hash per chunk of --chunked-verify and --verify-only: sha256 (default) or crc32c, faster but only meant to catch bad storage", "verify-hash", ""},
+        {"instream-customize", "Customize the boot partition while writing it, instead of afterwards"},
+        {"expand-root", "Grow the last partition of the image to the end of the drive"},
+        {"userspace-extract", "Extract multi-file archives to the FAT partition without mounting it (Linux)"},
+        {"write-queue-depth", "Number of decompressed blocks that may be queued for writing", "write-queue-depth", ""},
+        {"write-block-size", "Size of blocks written to the device in KB (default: follow the device's optimal I/O size)", "write-block-size", ""},
+        {"mirror", "Other URL the image can be downloaded from. Can be given several times, the fastest is used", "mirror", ""},
+        {"metalink", "Metalink file listing URLs the image can be downloaded from", "metalink", ""},
+        {"multi-source", "Download pieces from all mirrors that are about as fast as the best one at once (with --download-segments)"},
+        {"peer-cache", "Share the download cache with other stations on the LAN, and download images they have from them"},
+        {"download-segments", "Number of parallel connections used for downloading, if the server supports range requests", "download-segments", ""},
+        {"memory-limit", "Size all buffers of the write pipeline to stay under this many MB", "memory-limit", ""},
+        {"huge-pages", "Allocate the buffers of the write pipeline from 2 MB huge pages, for fewer TLB misses at high rates (Linux)"},
+        {"lock-memory", "Lock the buffers of the write pipeline in memory, so they are not swapped out while writing (Linux)"},
+        {"thread-placement", "Cores, nice level and I/O class of pipeline stages, e.g. write:cpus=2,3:nice=-5:io=rt/4;extract:cpus=1", "thread-placement", ""},
+        {"http-version", "HTTP version to use for downloading: auto, 1.1, 2 or 3", "http-version", ""},
+        {"download-buffer", "Size of the download receive buffer in KB", "download-buffer", ""},
+        {"socket-buffer", "Size of the socket receive buffer in KB, for sites with a high round trip time", "socket-buffer", ""},
+        {"tcp-congestion", "TCP congestion control algorithm to use for downloading, e.g. bbr (Linux)", "tcp-congestion", ""},
+        {"disable-transfer-compression", "Do not let servers compress uncompressed images for the download"},
+        {"max-bandwidth", "Most KB per second all downloads together may use. Shared by priority, prefetching gets the least", "max-bandwidth", ""},
+        {"daemon", "Keep running and accept write jobs as JSON lines on the named local socket", "daemon", ""},
+        {"jobs", "Run the write jobs listed in a JSON file and exit", "jobs", ""},
+        {"workers", "Number of jobs written at the same time with --daemon or --jobs", "workers", ""},
+        {"drives-per-hub", "Most drives on one USB hub written at the same time with --daemon or --jobs, 0 for no limit (default: 4)", "drives-per-hub", ""},
+        {"station", "Write this image to every removable drive put in, and eject it when done. Slots are freed when the card is taken out", "station", ""},
+        {"station-min-size", "Smallest drive in MB --station writes to", "station-min-size", ""},
+        {"station-max-size", "Largest drive in MB --station writes to", "station-max-size", ""},
+        {"station-match", "Pattern the vendor and model of drives --station writes to must match", "station-match", ""},
+        {"metrics", "Serve counters of all jobs for Prometheus at http://<host>:<port>/metrics with --daemon or --jobs", "metrics", ""},
+        {"metrics-bind", "Address --metrics listens on. They are not authenticated, so the default is 127.0.0.1. Use 0.0.0.0 or :: for all interfaces", "metrics-bind", ""},
+        {"precache", "Download the OS lists and images listed in a JSON manifest into the cache, in the background, and exit", "precache", ""},
+        {"precache-window", "Time of day --precache may download in, e.g. 22:00-06:00. Stopped downloads are resumed in the next window", "precache-window", ""},
+        {"benchmark", "Measure the write and read speed of the destination drive. Destroys all data on it"},
+        {"benchmark-size", "MB written by each test of --benchmark", "benchmark-size", ""},
+        {"diagnose", "Download, decompress and hash the image without writing it, with the proxy and transport settings in effect, and report the throughput of each stage and which one is the bottleneck. Benchmarks the destination drive too, if one is given, which destroys all data on it"},
+        {"verify-only", "Check that the destination drives hold the image, without writing to them. Image file may be - if --sha256 and --image-size are given"},
+        {"image-size", "Size of the extracted image in bytes, for --verify-only if it cannot be told from the image file, or bytes read by --capture and --clone", "image-size", ""},
+        {"capture", "Read the drive into an image file: .zst (seekable, with chunk index), .xz or uncompressed with holes. A bmap is written alongside", "capture", ""},
+        {"compression-level", "zstd level or xz preset of --capture", "compression-level", ""},
+        {"clone", "Copy this drive to the destination drives, each written and verified on its own", "clone", ""},
+        {"composite", "Write the images listed in a JSON file to their offsets on the destination drives, leaving ranges between them untouched (Linux)", "composite", ""},
+        {"json-progress", "Write progress and timing of each phase to stdout as JSON lines"},
+        {"trace", "Record where the time goes in each stage, and write it to a Chrome trace JSON file on exit (chrome://tracing, ui.perfetto.dev)", "trace", ""},
         {"debug", "Output debug messages to console"},
         {"quiet", "Only write to console on error"},
     });
 
     parser.addPositionalArgument("src", "Image file/URL");
-    parser.addPositionalArgument("dst", "Destination device");
+    parser.addPositionalArgument("dst", "Destination device(s) or image file(s), written sparse. The image is written to all of them at once", "<dst> [<dst>...]");
     parser.process(*_app);
 
     const QStringList args = parser.positionalArguments();
-    if (args.count() != 2)
+    bool batch = !parser.value("daemon").isEmpty() || !parser.value("jobs").isEmpty() || !parser.value("station").isEmpty();
+    bool benchmark = parser.isSet("benchmark");
+    bool diagnose = parser.isSet("diagnose");
+    bool capture = !parser.value("capture").isEmpty();
+    bool clone = !parser.value("clone").isEmpty();
+    bool precache = !parser.value("precache").isEmpty();
+    bool composite = !parser.value("composite").isEmpty();
+    bool argsOk;
+    if (benchmark || capture)
+        argsOk = args.count() == 1;
+    else if (diagnose)
+        argsOk = args.count() == 1 || args.count() == 2;
+    else
+        argsOk = args.count() >= (clone || composite ? 1 : 2);
+    if (!argsOk && !batch && !precache)
     {
-        std::cerr << "Usage: --cli [--disable-verify] [--disable-eject] [--sha256 <expected hash> [--cache-file <cache file>]] [--first-run-script <script>] [--debug] [--quiet] <image file to write> <destination drive device>" << std::endl;
+        std::cerr << "Usage: --cli [--disable-verify] [--disable-eject] [--direct-io] [--sparse-write] [--delta-write] [--disable-resume] [--disable-capacity-probe] [--overlapped-verify] [--chunked-verify] [--verify-hash <algorithm>] [--tune-queue] [--instream-customize] [--expand-root] [--userspace-extract] [--sha256 <expected hash> [--cache-file <cache file>] [--cache-extracted]] [--ram-stage <MB>] [--bmap <bmap file>] [--first-run-script <script>] [--write-queue-depth <n>] [--write-block-size <KB>] [--download-segments <n>] [--mirror <url>...] [--metalink <url>] [--multi-source] [--peer-cache] [--memory-limit <MB>] [--huge-pages] [--lock-memory] [--thread-placement <stage:setting...;...>] [--http-version <version>] [--download-buffer <KB>] [--socket-buffer <KB>] [--tcp-congestion <algorithm>] [--disable-transfer-compression] [--max-bandwidth <KB/s>] [--json-progress] [--trace <file>] [--debug] [--quiet] <image file to write> <destination drive device> [<additional destination drive device>...]" << std::endl;
+        std::cerr << "-OR- --cli [options] [--workers <n>] [--drives-per-hub <n>] [--metrics <port> [--metrics-bind <address>]] --daemon <socket name> | --jobs <JSON file>" << std::endl;
+        std::cerr << "-OR- --cli [options] [--workers <n>] [--drives-per-hub <n>] [--metrics <port> [--metrics-bind <address>]] [--station-min-size <MB>] [--station-max-size <MB>] [--station-match <pattern>] --station <image file to write>" << std::endl;
+        std::cerr << "-OR- --cli [--max-bandwidth <KB/s>] [--download-segments <n>] [--precache-window <HH:mm-HH:mm>] [--json-progress] --precache <JSON manifest>" << std::endl;
+        std::cerr << "-OR- --cli [--direct-io] [--benchmark-size <MB>] [--json-progress] --benchmark <destination drive device>" << std::endl;
+        std::cerr << "-OR- --cli [--sha256 <expected hash>] [--http-version <version>] [--download-buffer <KB>] [--socket-buffer <KB>] [--tcp-congestion <algorithm>] [--disable-transfer-compression] [--direct-io] [--benchmark-size <MB>] [--json-progress] --diagnose <image URL> [<destination drive device>]" << std::endl;
+        std::cerr << "-OR- --cli [--direct-io] [--disable-io-uring] [--sha256 <hash of extracted image>] [--image-size <bytes>] [--json-progress] --verify-only <image file>|- <destination drive device> [<additional destination drive device>...]" << std::endl;
+        std::cerr << "-OR- --cli [--image-size <bytes>] [--compression-level <n>] [--json-progress] --capture <output image file> <source drive device>" << std::endl;
+        std::cerr << "-OR- --cli [--disable-verify] [--disable-eject] [--direct-io] [--sparse-write] [--delta-write] [--image-size <bytes>] [--json-progress] --clone <source drive device> <destination drive device> [<additional destination drive device>...]" << std::endl;
+        std::cerr << "-OR- --cli [--disable-verify] [--disable-eject] [--direct-io] [--cache-extracted] [--download-segments <n>] [--json-progress] --composite <JSON part list> <destination drive device> [<additional destination drive device>...]" << std::endl;
         return 1;
     }
 
     if (!parser.isSet("debug"))
     {
         qInstallMessageHandler(devnullMsgHandler);
+        /* Categorized messages are not even formatted then */
+        QLoggingCategory::setFilterRules("*.debug=false");
     }
     _quiet = parser.isSet("quiet");
+    _jsonProgress = parser.isSet("json-progress");
+    _jsonTimer.start();
+    _traceFile = parser.value("trace");
+    if (!_traceFile.isEmpty())
+        PipelineTrace::enable(IMAGEWRITER_TRACE_EVENTS);
+    PipelineMemory::configure((parser.isSet("huge-pages") ? PipelineMemory::HugePages : 0)
+                              | (parser.isSet("lock-memory") ? PipelineMemory::Lock : 0));
+    if (batch)
+        return _runBatch(parser);
+    if (precache)
+        return _runPrecache(parser);
+    if (benchmark)
+        return _runBenchmark(parser, args[0]);
+    if (diagnose)
+        return _runDiagnose(parser, args[0], args.value(1));
+    if (capture)
+        return _runCapture(parser, parser.value("capture"), args[0]);
+    if (clone)
+        return _runClone(parser, parser.value("clone"), args);
+    if (composite)
+        return _runComposite(parser, parser.value("composite"), args);
+    if (parser.isSet("verify-only"))
+        return _runVerifyOnly(parser, args[0], args.mid(1));
+
     QByteArray initFormat = (parser.value("cloudinit-userdata").isEmpty()
                              && parser.value("cloudinit-networkconfig").isEmpty() ) ? "systemd" : "cloudinit";
+    QString bmap = parser.value("bmap");
+    QUrl bmapUrl;
+    if (bmap.startsWith("http:", Qt::CaseInsensitive) || bmap.startsWith("https:", Qt::CaseInsensitive))
+        bmapUrl = QUrl(bmap);
+    else if (!bmap.isEmpty())
+        bmapUrl = QUrl::fromLocalFile(QFileInfo(bmap).absoluteFilePath());
 
     if (args[0].startsWith("http:", Qt::CaseInsensitive) || args[0].startsWith("https:", Qt::CaseInsensitive))
     {
-        _imageWriter->setSrc(args[0], 0, 0, parser.value("sha256").toLatin1(), false, "", "", initFormat);
+        _imageWriter->setSrc(args[0], 0, 0, parser.value("sha256").toLatin1(), false, "", "", initFormat, bmapUrl);
+        _imageWriter->setMirrors(parser.values("mirror"), QUrl(parser.value("metalink")));
 
         if (!parser.value("cache-file").isEmpty())
         {
@@ -98,7 +234,7 @@ int Cli::run()
 
         if (fi.isFile())
         {
-            _imageWriter->setSrc(QUrl::fromLocalFile(args[0]), fi.size(), 0, parser.value("sha256").toLatin1(), false, "", "", initFormat);
+            _imageWriter->setSrc(QUrl::fromLocalFile(args[0]), fi.size(), 0, parser.value("sha256").toLatin1(), false, "", "", initFormat, bmapUrl);
         }
         else if (!fi.exists())
         {
@@ -112,42 +248,8 @@ int Cli::run()
         }
     }
 
-    if (parser.isSet("enable-writing-system-drives"))
-    {
-        std::cerr << "WARNING: writing to system drives is enabled." << std::endl;
-    }
-    else
-    {
-        DriveListModel dlm;
-        dlm.processDriveList(Drivelist::ListStorageDevices() );
-        bool foundDrive = false;
-        int numDrives = dlm.rowCount( QModelIndex() );
-
-        for (int i = 0; i < numDrives; i++)
-        {
-            if (dlm.index(i, 0).data(dlm.deviceRole) == args[1])
-            {
-                foundDrive = true;
-                break;
-            }
-        }
-
-        if (!foundDrive)
-        {
-            std::cerr << "Destination drive is not in list of removable volumes. Choose one of the following:" << std::endl << std::endl;
-
-            for (int i = 0; i < numDrives; i++)
-            {
-                QModelIndex idx = dlm.index(i, 0);
-                QByteArray line = idx.data(dlm.deviceRole).toByteArray()+" ("+idx.data(dlm.descriptionRole).toByteArray()+")";
-
-                std::cerr << line.constData() << std::endl;
-            }
-
-            std::cerr << std::endl << "Or use --enable-writing-system-drives to overrule." << std::endl;
-            return 1;
-        }
-    }
+    if (!_checkDrives(parser, args.mid(1)))
+        return 1;
 
     if (!parser.value("cloudinit-userdata").isEmpty())
     {
@@ -213,17 +315,847 @@ int Cli::run()
     }
 
     _imageWriter->setDst(args[1]);
-    _imageWriter->setVerifyEnabled(!parser.isSet("disable-verify"));
-    _imageWriter->setSetting("eject", !parser.isSet("disable-eject"));
+    for (int i = 2; i < args.count(); i++)
+        _imageWriter->addDst(args[i]);
+    if (_applyOptions(parser, _imageWriter))
+        return 1;
 
     /* Run startWrite() in event loop (otherwise calling _app->exit() on error does not work) */
     QTimer::singleShot(1, _imageWriter, &ImageWriter::startWrite);
     return _app->exec();
 }
 
-void Cli::onSuccess()
+/* Returns false after listing the removable drives if one of devices is not among them */
+bool Cli::_checkDrives(QCommandLineParser &parser, const QStringList &devices)
+{
+    DriveListModel dlm;
+    dlm.processDriveList(Drivelist::ListStorageDevices() );
+    int numDrives = dlm.rowCount( QModelIndex() );
+
+    if (parser.isSet("enable-writing-system-drives"))
+    {
+        std::cerr << "WARNING: writing to system drives is enabled." << std::endl;
+    }
+    else
+    {
+        bool foundDrive = false;
+
+        for (const QString &device : devices)
+        {
+            /* Image files are written as they are, they cannot be system drives */
+            foundDrive = DownloadThread::isImageFile(device.toLocal8Bit());
+            for (int i = 0; i < numDrives && !foundDrive; i++)
+            {
+                if (dlm.index(i, 0).data(dlm.deviceRole) == device)
+                {
+                    foundDrive = true;
+                    break;
+                }
+            }
+            if (!foundDrive)
+                break;
+        }
+
+        if (!foundDrive)
+        {
+            std::cerr << "Destination drive is not in list of removable volumes. Choose one of the following:" << std::endl << std::endl;
+
+            for (int i = 0; i < numDrives; i++)
+            {
+                QModelIndex idx = dlm.index(i, 0);
+                QByteArray line = idx.data(dlm.deviceRole).toByteArray()+" ("+idx.data(dlm.descriptionRole).toByteArray()+")";
+
+                std::cerr << line.constData() << std::endl;
+            }
+
+            std::cerr << std::endl << "Or use --enable-writing-system-drives to overrule." << std::endl;
+            return false;
+        }
+    }
+
+    /* A USB 3 reader on a USB 2 port or cable, or a USB 2 reader, takes several times longer */
+    for (int i = 0; i < numDrives; i++)
+    {
+        QModelIndex idx = dlm.index(i, 0);
+        uint speed = idx.data(dlm.usbSpeedRole).toUInt();
+        if (devices.contains(idx.data(dlm.deviceRole).toString()) && speed && speed < IMAGEWRITER_USB_SUPERSPEED)
+        {
+            std::cerr << "WARNING: " << idx.data(dlm.deviceRole).toString().toStdString() << " is connected at USB 2 speed ("
+                      << speed << " Mbit/s), on port " << idx.data(dlm.usbPortRole).toString().toStdString() << std::endl;
+        }
+    }
+
+    return true;
+}
+
+/* Options that apply to every write. Returns 1 after printing an error if one is invalid */
+int Cli::_applyOptions(QCommandLineParser &parser, ImageWriter *writer)
+{
+    writer->setVerifyEnabled(!parser.isSet("disable-verify"));
+    writer->setDirectIOEnabled(parser.isSet("direct-io"));
+    writer->setIoUringEnabled(!parser.isSet("disable-io-uring"));
+    writer->setSparseWriteEnabled(parser.isSet("sparse-write"));
+    writer->setDeltaWriteEnabled(parser.isSet("delta-write"));
+    writer->setResumeEnabled(!parser.isSet("disable-resume"));
+    writer->setCapacityProbeEnabled(!parser.isSet("disable-capacity-probe"));
+    writer->setOverlappedVerifyEnabled(parser.isSet("overlapped-verify"));
+    writer->setChunkedVerifyEnabled(parser.isSet("chunked-verify"));
+    if (!parser.value("verify-hash").isEmpty())
+    {
+        ChunkedHash::Algorithm algorithm;
+        if (!ChunkedHash::algorithmFromName(parser.value("verify-hash").toLatin1(), &algorithm))
+        {
+            std::cerr << "Error: verify hash must be sha256 or crc32c" << std::endl;
+            return 1;
+        }
+        writer->setChunkedVerifyAlgorithm(algorithm);
+    }
+    writer->setInStreamCustomizationEnabled(parser.isSet("instream-customize"));
+    writer->setExpandRootPartitionEnabled(parser.isSet("expand-root"));
+    writer->setUserspaceExtractionEnabled(parser.isSet("userspace-extract"));
+    writer->setQueueTuningEnabled(parser.isSet("tune-queue"));
+    if (parser.isSet("cache-extracted"))
+        writer->setExtractedCacheEnabled(true);
+    if (parser.isSet("peer-cache"))
+        writer->setPeerCacheEnabled(true);
+    if (parser.isSet("multi-source"))
+        writer->setMultiSourceEnabled(true);
+    writer->setSetting("eject", !parser.isSet("disable-eject"));
+
+    if (!parser.value("write-queue-depth").isEmpty())
+    {
+        bool ok;
+        int depth = parser.value("write-queue-depth").toInt(&ok);
+        if (!ok || depth < 2)
+        {
+            std::cerr << "Error: write queue depth must be a number of at least 2" << std::endl;
+            return 1;
+        }
+        writer->setWriteQueueDepth(depth);
+    }
+
+    if (!parser.value("write-block-size").isEmpty())
+    {
+        bool ok;
+        int kb = parser.value("write-block-size").toInt(&ok);
+        if (!ok || kb < 4 || kb % 4 || kb > IMAGEWRITER_MAX_BLOCKSIZE/1024)
+        {
+            std::cerr << "Error: write block size must be a multiple of 4 KB, up to " << IMAGEWRITER_MAX_BLOCKSIZE/1024 << " KB" << std::endl;
+            return 1;
+        }
+        writer->setWriteBlockSize((quint64) kb * 1024);
+    }
+
+    if (!parser.value("download-segments").isEmpty())
+    {
+        bool ok;
+        int segments = parser.value("download-segments").toInt(&ok);
+        if (!ok || segments < 1 || segments > 16)
+        {
+            std::cerr << "Error: number of download segments must be between 1 and 16" << std::endl;
+            return 1;
+        }
+        writer->setDownloadSegments(segments);
+    }
+
+    if (!parser.value("ram-stage").isEmpty())
+    {
+        bool ok;
+        qint64 mb = parser.value("ram-stage").toLongLong(&ok);
+        if (!ok || mb < 0)
+        {
+            std::cerr << "Error: RAM stage budget must be a number of MB" << std::endl;
+            return 1;
+        }
+        writer->setRamStageBudget((quint64) mb * 1024 * 1024);
+    }
+
+    if (!parser.value("memory-limit").isEmpty())
+    {
+        bool ok;
+        int mb = parser.value("memory-limit").toInt(&ok);
+        if (!ok || mb < IMAGEWRITER_MIN_MEMORY_LIMIT/1024/1024)
+        {
+            std::cerr << "Error: memory limit must be a number of at least " << IMAGEWRITER_MIN_MEMORY_LIMIT/1024/1024 << " MB" << std::endl;
+            return 1;
+        }
+        writer->setMemoryLimit((quint64) mb * 1024 * 1024);
+    }
+
+    DownloadTransport transport = DownloadThread::transport();
+    if (!parser.value("http-version").isEmpty() && !transport.setHttpVersion(parser.value("http-version")))
+    {
+        std::cerr << "Error: HTTP version must be auto, 1.1, 2 or 3" << std::endl;
+        return 1;
+    }
+    if (!parser.value("download-buffer").isEmpty())
+    {
+        bool ok;
+        int kb = parser.value("download-buffer").toInt(&ok);
+        /* libcurl accepts 1 KB to 10 MB */
+        if (!ok || kb < 1 || kb > 10240)
+        {
+            std::cerr << "Error: download buffer size must be between 1 and 10240 KB" << std::endl;
+            return 1;
+        }
+        transport.bufferSize = kb * 1024;
+    }
+    if (!parser.value("socket-buffer").isEmpty())
+    {
+        bool ok;
+        int kb = parser.value("socket-buffer").toInt(&ok);
+        if (!ok || kb < 1 || kb > 1048576)
+        {
+            std::cerr << "Error: socket buffer size must be between 1 and 1048576 KB" << std::endl;
+            return 1;
+        }
+        transport.socketBufferSize = kb * 1024;
+    }
+    if (!parser.value("tcp-congestion").isEmpty())
+        transport.congestionControl = parser.value("tcp-congestion").toLatin1();
+    if (parser.isSet("disable-transfer-compression"))
+        transport.transferCompression = false;
+    DownloadThread::setTransport(transport);
+
+    if (!parser.value("max-bandwidth").isEmpty())
+    {
+        bool ok;
+        int kb = parser.value("max-bandwidth").toInt(&ok);
+        if (!ok || kb < 16)
+        {
+            std::cerr << "Error: bandwidth limit must be at least 16 KB/s" << std::endl;
+            return 1;
+        }
+        BandwidthScheduler::setLimit((quint64) kb * 1024);
+    }
+
+    QString error;
+    if (!parser.value("thread-placement").isEmpty() && !ThreadPlacement::parse(parser.value("thread-placement"), &error))
+    {
+        std::cerr << "Error: " << error.toStdString() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
+
+/* Daemon or jobs file mode. Jobs get the options given on the command line */
+int Cli::_runBatch(QCommandLineParser &parser)
 {
+    /* Checked once here, so they cannot fail for a job later on */
+    if (_applyOptions(parser, _imageWriter))
+        return 1;
+
+    bool station = !parser.value("station").isEmpty();
+    int workers = station ? IMAGEWRITER_STATION_WORKERS : 1;
+    if (!parser.value("workers").isEmpty())
+    {
+        bool ok;
+        workers = parser.value("workers").toInt(&ok);
+        if (!ok || workers < 1 || workers > 16)
+        {
+            std::cerr << "Error: number of workers must be between 1 and 16" << std::endl;
+            return 1;
+        }
+    }
+
+    if (parser.isSet("enable-writing-system-drives"))
+        std::cerr << "WARNING: writing to system drives is enabled." << std::endl;
+
+    CliDaemon daemon([this, &parser](ImageWriter *writer) {
+        _applyOptions(parser, writer);
+    }, workers, parser.isSet("enable-writing-system-drives"));
+    connect(&daemon, &CliDaemon::finished, _app, &QCoreApplication::exit);
+
+    if (!parser.value("drives-per-hub").isEmpty())
+    {
+        bool ok;
+        int drives = parser.value("drives-per-hub").toInt(&ok);
+        if (!ok || drives < 0)
+        {
+            std::cerr << "Error: drives per hub must be a number of at least 0" << std::endl;
+            return 1;
+        }
+        daemon.setDrivesPerHub(drives);
+    }
+
+    if (!parser.value("metrics").isEmpty())
+    {
+        bool ok;
+        quint16 port = parser.value("metrics").toUShort(&ok);
+        QHostAddress address = QHostAddress::LocalHost;
+        if (!parser.value("metrics-bind").isEmpty() && !address.setAddress(parser.value("metrics-bind")))
+        {
+            std::cerr << "Error: invalid address for metrics " << parser.value("metrics-bind").toStdString() << std::endl;
+            return 1;
+        }
+        if (!ok || !port || !daemon.listenMetrics(port, address))
+        {
+            std::cerr << "Error: cannot serve metrics on port " << parser.value("metrics").toStdString() << std::endl;
+            return 1;
+        }
+    }
+
+    if (station)
+        return _runStation(parser, daemon);
+
+    if (!parser.value("jobs").isEmpty())
+    {
+        QString msg;
+        if (!daemon.loadJobs(parser.value("jobs"), msg))
+        {
+            std::cerr << "Error: " << msg.toStdString() << std::endl;
+            return 1;
+        }
+    }
+    else if (!daemon.listen(parser.value("daemon")))
+    {
+        std::cerr << "Error: cannot listen on local socket " << parser.value("daemon").toStdString() << std::endl;
+        return 1;
+    }
+
+    QTimer::singleShot(0, &daemon, &CliDaemon::start);
+    return _app->exec();
+}
+
+/* Writing every card put in, see StationMode */
+int Cli::_runStation(QCommandLineParser &parser, CliDaemon &daemon)
+{
+    QString src = parser.value("station");
+    if (!src.startsWith("http:", Qt::CaseInsensitive) && !src.startsWith("https:", Qt::CaseInsensitive) && !QFileInfo(src).isFile())
+    {
+        std::cerr << "Error: source file does not exist or is not a regular file" << std::endl;
+        return 1;
+    }
+    if (parser.value("sha256").isEmpty())
+        std::cerr << "WARNING: without --sha256 every card is written from the source instead of the cache" << std::endl;
+
+    quint64 sizes[2] = {0, 0};
+    const char *options[2] = {"station-min-size", "station-max-size"};
+    for (int i = 0; i < 2; i++)
+    {
+        if (parser.value(options[i]).isEmpty())
+            continue;
+
+        bool ok;
+        qint64 mb = parser.value(options[i]).toLongLong(&ok);
+        if (!ok || mb < 0)
+        {
+            std::cerr << "Error: --" << options[i] << " must be a number of MB" << std::endl;
+            return 1;
+        }
+        sizes[i] = (quint64) mb * 1024 * 1024;
+    }
+
+    StationMode station(&daemon, src, parser.value("sha256").toLatin1());
+    station.setSizeRange(sizes[0], sizes[1]);
+    station.setVerifyEnabled(!parser.isSet("disable-verify"));
+    if (!station.setMatch(parser.value("station-match")))
+    {
+        std::cerr << "Error: invalid --station-match pattern" << std::endl;
+        return 1;
+    }
+
+    QTimer::singleShot(0, &station, &StationMode::start);
+    return _app->exec();
+}
+
+/* Cache pre-seeding, see CachePreseeder */
+int Cli::_runPrecache(QCommandLineParser &parser)
+{
+    if (_applyOptions(parser, _imageWriter))
+        return 1;
+
+    CachePreseeder preseeder(_imageWriter);
+    QString msg;
+    if (!preseeder.loadManifest(parser.value("precache"), msg))
+    {
+        std::cerr << "Error: " << msg.toStdString() << std::endl;
+        return 1;
+    }
+    if (!parser.value("precache-window").isEmpty() && !preseeder.setWindow(parser.value("precache-window")))
+    {
+        std::cerr << "Error: pre-seeding window must be given as HH:mm-HH:mm" << std::endl;
+        return 1;
+    }
+
+    connect(&preseeder, &CachePreseeder::status, this, [this](QJsonObject event) {
+        if (_jsonProgress)
+        {
+            _printJson(event);
+        }
+        else if (!_quiet || event["status"] == "failed")
+        {
+            if (event["event"] == "waiting")
+                std::cout << "Waiting " << event["seconds"].toInteger() / 60 << " minutes for the pre-seeding window" << std::endl;
+            else
+                std::cout << event["url"].toString().toStdString() << ": " << event["status"].toString().toStdString() << std::endl;
+        }
+    });
+    connect(&preseeder, &CachePreseeder::finished, _app, &QCoreApplication::exit);
+
+    QTimer::singleShot(0, &preseeder, &CachePreseeder::start);
+    return _app->exec();
+}
+
+/* Size of each test of the device benchmark. 0 after printing an error if it is invalid */
+quint64 Cli::_benchmarkSize(QCommandLineParser &parser)
+{
+    if (parser.value("benchmark-size").isEmpty())
+        return IMAGEWRITER_BENCHMARK_SIZE;
+
+    bool ok;
+    int mb = parser.value("benchmark-size").toInt(&ok);
+    if (!ok || mb < 1)
+    {
+        std::cerr << "Error: benchmark size must be a number of MB" << std::endl;
+        return 0;
+    }
+    return mb * 1048576ULL;
+}
+
+/* Device benchmark. Writes the report to stdout */
+int Cli::_runBenchmark(QCommandLineParser &parser, const QString &device)
+{
+    quint64 size = _benchmarkSize(parser);
+    if (!size)
+        return 1;
+
+    if (!_checkDrives(parser, {device}))
+        return 1;
+
+    DeviceBenchmarkThread *thread = new DeviceBenchmarkThread(device.toLatin1(), size, this);
+    thread->setDirectIOEnabled(parser.isSet("direct-io"));
+    connect(thread, &DeviceBenchmarkThread::benchmarkResult, this, &Cli::onBenchmarkResult);
+    connect(thread, &DownloadThread::preparationStatusUpdate, this, [this](QString msg) {
+        onPreparationStatusUpdate(msg);
+    });
+    connect(thread, &DownloadThread::error, this, [this](QString msg) {
+        onError(msg);
+    });
+    connect(thread, &DownloadThread::success, this, [this]() {
+        if (_jsonProgress)
+            _printJson({{"event", "success"}});
+        else if (!_quiet)
+            _clearLine();
+        _app->exit(0);
+    });
+
+    thread->start();
+    return _app->exec();
+}
+
+/* Site diagnostic, see SiteDiagnosticThread, followed by the device benchmark if a
+   device is given. Writes the throughput of each stage and the slowest to stdout */
+int Cli::_runDiagnose(QCommandLineParser &parser, const QString &url, const QString &device)
+{
+    if (!url.startsWith("http:", Qt::CaseInsensitive) && !url.startsWith("https:", Qt::CaseInsensitive))
+    {
+        std::cerr << "Error: --diagnose needs the URL of an image, e.g. one from the OS list" << std::endl;
+        return 1;
+    }
+    quint64 size = _benchmarkSize(parser);
+    if (!size)
+        return 1;
+    /* Proxy and transport settings */
+    if (_applyOptions(parser, _imageWriter))
+        return 1;
+    if (!device.isEmpty() && !_checkDrives(parser, {device}))
+        return 1;
+
+    /* MB of the image per second each stage can process */
+    QList<QPair<QString, double>> rates;
+    double cardMBps = 0;
+
+    auto finish = [this, &rates]() {
+        QPair<QString, double> slowest = rates.first();
+        for (const auto &rate : std::as_const(rates))
+        {
+            if (rate.second < slowest.second)
+                slowest = rate;
+        }
+
+        if (_jsonProgress)
+        {
+            _printJson({{"event", "bottleneck"}, {"stage", slowest.first}, {"imageMBps", slowest.second}});
+        }
+        else
+        {
+            if (!_quiet)
+                _clearLine();
+            std::cout << QString("Bottleneck: %1, %2 MB/s of image").arg(slowest.first)
+                         .arg(slowest.second, 0, 'f', 1).toStdString() << std::endl;
+        }
+        _app->exit(0);
+    };
+
+    DeviceBenchmarkThread *benchmark = nullptr;
+    if (!device.isEmpty())
+    {
+        benchmark = new DeviceBenchmarkThread(device.toLatin1(), size, this);
+        benchmark->setDirectIOEnabled(parser.isSet("direct-io"));
+        connect(benchmark, &DeviceBenchmarkThread::benchmarkResult, this, [this, &cardMBps](QVariantMap result) {
+            onBenchmarkResult(result);
+            QString test = result["test"].toString();
+            if (test == "write" || test == "queuedWrite")
+                cardMBps = qMax(cardMBps, result["MBps"].toDouble());
+        });
+        connect(benchmark, &DownloadThread::preparationStatusUpdate, this, [this](QString msg) {
+            onPreparationStatusUpdate(msg);
+        });
+        connect(benchmark, &DownloadThread::error, this, [this](QString msg) {
+            onError(msg);
+        });
+        connect(benchmark, &DownloadThread::success, this, [this, &rates, &cardMBps, finish]() {
+            if (_jsonProgress)
+                _printJson({{"event", "diagnostic"}, {"stage", "card"}, {"imageMBps", cardMBps}});
+            else
+                std::cout << QString("Card: %1 MB/s of image").arg(cardMBps, 0, 'f', 1).toStdString() << std::endl;
+            rates.append({"card", cardMBps});
+            finish();
+        });
+    }
+
+    SiteDiagnosticThread *thread = new SiteDiagnosticThread(url.toLatin1(), parser.value("sha256").toLatin1(), this);
+    thread->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(_imageWriter->constantVersion()).toUtf8());
+    connect(thread, &SiteDiagnosticThread::stageResult, this, [this, &rates](QVariantMap result) {
+        rates.append({result["stage"].toString(), result["imageMBps"].toDouble()});
+        if (_jsonProgress)
+        {
+            QJsonObject event = QJsonObject::fromVariantMap(result);
+            event["event"] = "diagnostic";
+            _printJson(event);
+            return;
+        }
+
+        QString stage = result["stage"].toString();
+        QString line = QString("%1: %2 MB/s of image, busy %3 of %4 seconds").arg(stage)
+                .arg(result["imageMBps"].toDouble(), 0, 'f', 1)
+                .arg(result["busySeconds"].toDouble(), 0, 'f', 1).arg(result["seconds"].toDouble(), 0, 'f', 1);
+        if (stage == "download")
+            line += QString(", %1 MB/s from the network").arg(result["MBps"].toDouble(), 0, 'f', 1);
+        if (!_quiet)
+            _clearLine();
+        std::cout << line.toStdString() << std::endl;
+    });
+    connect(thread, &DownloadThread::progressChanged, this, [this, thread]() {
+        ProgressSnapshot p = thread->progress();
+        if (_jsonProgress)
+            _printJsonProgress("download", p.dlNow, p.dlTotal);
+        else
+            _printProgress("Downloading", p.dlNow, p.dlTotal);
+    });
+    connect(thread, &DownloadThread::preparationStatusUpdate, this, [this](QString msg) {
+        onPreparationStatusUpdate(msg);
+    });
+    connect(thread, &DownloadThread::error, this, [this](QString msg) {
+        onError(msg);
+    });
+    connect(thread, &DownloadThread::success, this, [benchmark, finish]() {
+        /* One at a time, so the benchmark does not take CPU from the pipeline */
+        if (benchmark)
+            benchmark->start();
+        else
+            finish();
+    });
+
+    thread->start();
+    return _app->exec();
+}
+
+/* Checks drives against an image without writing them. Writes a result per drive to stdout */
+int Cli::_runVerifyOnly(QCommandLineParser &parser, const QString &image, const QStringList &devices)
+{
+    quint64 imageSize = 0;
+    if (!parser.value("image-size").isEmpty())
+    {
+        bool ok;
+        imageSize = parser.value("image-size").toULongLong(&ok);
+        if (!ok || !imageSize)
+        {
+            std::cerr << "Error: image size must be a number of bytes" << std::endl;
+            return 1;
+        }
+    }
+    if (image == "-" && (parser.value("sha256").isEmpty() || !imageSize))
+    {
+        std::cerr << "Error: --verify-only without image file needs --sha256 and --image-size" << std::endl;
+        return 1;
+    }
+    if (!_checkDrives(parser, devices))
+        return 1;
+
+    VerifyOnlyThread *thread = new VerifyOnlyThread(devices[0].toLatin1(), this);
+    for (const QString &device : devices.mid(1))
+        thread->addDevice(device.toLatin1());
+    if (image != "-")
+        thread->setImageFile(image);
+    thread->setExpectedHash(parser.value("sha256").toLatin1());
+    thread->setImageSize(imageSize);
+    thread->setDirectIOEnabled(parser.isSet("direct-io"));
+    thread->setIoUringEnabled(!parser.isSet("disable-io-uring"));
+    connect(thread, &VerifyOnlyThread::verifyResult, this, &Cli::onVerifyResult);
+    connect(thread, &DownloadThread::preparationStatusUpdate, this, [this](QString msg) {
+        onPreparationStatusUpdate(msg);
+    });
+    connect(thread, &DownloadThread::progressChanged, this, [this, thread]() {
+        ProgressSnapshot p = thread->progress();
+        onVerifyProgress(p.verifyNow, p.verifyTotal);
+    });
+    connect(thread, &DownloadThread::error, this, [this](QString msg) {
+        onError(msg);
+    });
+    connect(thread, &DownloadThread::success, this, [this]() {
+        if (_jsonProgress)
+            _printJson({{"event", "success"}});
+        else if (!_quiet)
+        {
+            _clearLine();
+            std::cerr << "Verify successful." << std::endl;
+        }
+        _app->exit(0);
+    });
+
+    thread->start();
+    return _app->exec();
+}
+
+/* Reads a drive into an image file */
+int Cli::_runCapture(QCommandLineParser &parser, const QString &output, const QString &device)
+{
+    DeviceCaptureThread *thread = new DeviceCaptureThread(device.toLatin1(), output, this);
+    if (!parser.value("image-size").isEmpty())
+    {
+        bool ok;
+        quint64 size = parser.value("image-size").toULongLong(&ok);
+        if (!ok || !size)
+        {
+            std::cerr << "Error: image size must be a number of bytes" << std::endl;
+            return 1;
+        }
+        thread->setImageSize(size);
+    }
+    if (!parser.value("compression-level").isEmpty())
+    {
+        bool ok;
+        int level = parser.value("compression-level").toInt(&ok);
+        if (!ok || level < 0)
+        {
+            std::cerr << "Error: invalid compression level" << std::endl;
+            return 1;
+        }
+        thread->setCompressionLevel(level);
+    }
+
+    connect(thread, &DeviceCaptureThread::captureResult, this, &Cli::onCaptureResult);
+    connect(thread, &DownloadThread::preparationStatusUpdate, this, [this](QString msg) {
+        onPreparationStatusUpdate(msg);
+    });
+    connect(thread, &DownloadThread::progressChanged, this, [this, thread]() {
+        ProgressSnapshot p = thread->progress();
+        if (_jsonProgress)
+            _printJsonProgress("capture", p.dlNow, p.dlTotal);
+        else
+            _printProgress("Capturing", p.dlNow, p.dlTotal);
+    });
+    connect(thread, &DownloadThread::error, this, [this](QString msg) {
+        onError(msg);
+    });
+    connect(thread, &DownloadThread::success, this, [this]() {
+        if (_jsonProgress)
+            _printJson({{"event", "success"}});
+        _app->exit(0);
+    });
+
+    thread->start();
+    return _app->exec();
+}
+
+/* Copies a drive to other drives. Reports like a write */
+int Cli::_runClone(QCommandLineParser &parser, const QString &source, const QStringList &devices)
+{
+    quint64 size = 0;
+    if (!parser.value("image-size").isEmpty())
+    {
+        bool ok;
+        size = parser.value("image-size").toULongLong(&ok);
+        if (!ok || !size)
+        {
+            std::cerr << "Error: image size must be a number of bytes" << std::endl;
+            return 1;
+        }
+    }
+    if (!_checkDrives(parser, QStringList(source) + devices))
+        return 1;
+
+    /* Sizes from the drive list, so drives too small for the source are refused before writing */
+    DriveListModel dlm;
+    dlm.processDriveList(Drivelist::ListStorageDevices());
+    auto driveSize = [&dlm](const QString &device) -> quint64 {
+        for (int i = 0; i < dlm.rowCount(QModelIndex()); i++)
+        {
+            if (dlm.index(i, 0).data(dlm.deviceRole) == device)
+                return dlm.index(i, 0).data(dlm.sizeRole).toULongLong();
+        }
+        return 0;
+    };
+    if (!size)
+        size = driveSize(source);
+    for (const QString &device : devices)
+        _imageWriter->addDst(device, driveSize(device));
+    if (_applyOptions(parser, _imageWriter))
+        return 1;
+
+    QTimer::singleShot(1, _imageWriter, [this, source, size]() {
+        _imageWriter->startClone(source, size);
+    });
+    return _app->exec();
+}
+
+/* Composite image, see CompositeWriter. Reports each part like a write */
+int Cli::_runComposite(QCommandLineParser &parser, const QString &partList, const QStringList &devices)
+{
+#ifdef Q_OS_LINUX
+    if (_applyOptions(parser, _imageWriter))
+        return 1;
+    if (!_checkDrives(parser, devices))
+        return 1;
+
+    CompositeWriter composite([this, &parser](ImageWriter *writer) {
+        _applyOptions(parser, writer);
+    });
+    QString msg;
+    if (!composite.loadParts(partList, msg) || !composite.setDevices(devices, msg))
+    {
+        std::cerr << "Error: " << msg.toStdString() << std::endl;
+        return 1;
+    }
+
+    connect(&composite, &CompositeWriter::partStarted, this, [this, &composite](int index, QString src, ImageWriter *writer) {
+        if (_jsonProgress)
+            _printJson({{"event", "part"}, {"index", index}, {"src", src}});
+        else if (!_quiet)
+            std::cout << "Part " << index+1 << "/" << composite.partCount() << ": " << src.toStdString() << std::endl;
+
+        connect(writer, &ImageWriter::downloadProgress, this, &Cli::onDownloadProgress);
+        connect(writer, &ImageWriter::verifyProgress, this, &Cli::onVerifyProgress);
+        connect(writer, &ImageWriter::preparationStatusUpdate, this, &Cli::onPreparationStatusUpdate);
+        connect(writer, &ImageWriter::progressChanged, this, &Cli::onProgressChanged);
+        connect(writer, &ImageWriter::phaseStarted, this, &Cli::onPhaseStarted);
+        connect(writer, &ImageWriter::phaseFinished, this, &Cli::onPhaseFinished);
+    });
+    connect(&composite, &CompositeWriter::partFinished, this, [this](int) {
+        if (!_quiet && !_jsonProgress)
+            _clearLine();
+    });
+    connect(&composite, &CompositeWriter::error, this, [this](int index, QString msg) {
+        if (_jsonProgress)
+            _printJson({{"event", "error"}, {"index", index}, {"message", msg}});
+        if (!_quiet)
+            _clearLine();
+        std::cerr << "Error writing part " << index+1 << ": " << msg.toStdString() << std::endl;
+    });
+    connect(&composite, &CompositeWriter::finished, _app, &QCoreApplication::exit);
+
+    QTimer::singleShot(0, &composite, &CompositeWriter::start);
+    return _app->exec();
+#else
+    Q_UNUSED(parser)
+    Q_UNUSED(partList)
+    Q_UNUSED(devices)
+    std::cerr << "Error: composite images can only be written on Linux" << std::endl;
+    return 1;
+#endif
+}
+
+void Cli::onCaptureResult(QVariantMap result)
+{
+    if (_jsonProgress)
+    {
+        QJsonObject event = QJsonObject::fromVariantMap(result);
+        event["event"] = "capture";
+        _printJson(event);
+        return;
+    }
+
+    if (!_quiet)
+        _clearLine();
+    double imageSize = result["imageSize"].toDouble(), outputBytes = result["outputBytes"].toDouble();
+    std::cout << QString("Captured %1 MB (%2 MB of data) into %3: %4 MB in %5 seconds")
+                 .arg(imageSize / 1000000, 0, 'f', 0).arg(result["mappedBytes"].toDouble() / 1000000, 0, 'f', 0)
+                 .arg(result["output"].toString()).arg(outputBytes / 1000000, 0, 'f', 0)
+                 .arg(result["seconds"].toDouble(), 0, 'f', 1).toStdString() << std::endl;
+    std::cout << "SHA256 of the image: " << result["sha256"].toString().toStdString() << std::endl;
+    std::cout << "bmap: " << result["bmap"].toString().toStdString() << std::endl;
+    if (result.contains("chunkIndex"))
+        std::cout << "Chunk index: " << result["chunkIndex"].toString().toStdString() << std::endl;
+}
+
+void Cli::onVerifyResult(QVariantMap result)
+{
+    if (_jsonProgress)
+    {
+        QJsonObject event = QJsonObject::fromVariantMap(result);
+        event["event"] = "verify";
+        _printJson(event);
+        return;
+    }
+
+    QString device = result["device"].toString(), line;
+    if (result["passed"].toBool())
+        line = QString("%1: passed").arg(device);
+    else if (result.contains("mismatchOffset"))
+        line = QString("%1: FAILED, differs from the image in the %2 bytes at offset %3 (%4 MB)").arg(device)
+                .arg(result["mismatchLength"].toULongLong()).arg(result["mismatchOffset"].toULongLong())
+                .arg(result["mismatchOffset"].toULongLong() / 1048576);
+    else
+        line = QString("%1: FAILED, %2").arg(device, result["error"].toString());
+
+    if (!_quiet)
+        _clearLine();
+    std::cout << line.toStdString() << std::endl;
+}
+
+void Cli::onBenchmarkResult(QVariantMap result)
+{
+    if (_jsonProgress)
+    {
+        QJsonObject event = QJsonObject::fromVariantMap(result);
+        event["event"] = "benchmark";
+        _printJson(event);
+        return;
+    }
+
+    QString test = result["test"].toString(), line;
+    qulonglong kb = result["blockSize"].toULongLong() / 1024;
+    QString mbps = QString::number(result["MBps"].toDouble(), 'f', 1);
+
+    if (test == "write")
+        line = QString("Sequential write, %1 KB blocks: %2 MB/s").arg(kb).arg(mbps);
+    else if (test == "read")
+        line = QString("Sequential read, %1 KB blocks: %2 MB/s").arg(kb).arg(mbps);
+    else if (test == "randomWrite")
+        line = QString("Random 4 KB writes: %1 IOPS (%2 MB/s)").arg(result["iops"].toDouble(), 0, 'f', 0).arg(mbps);
+    else if (test == "fsync")
+        line = QString("fsync latency: min %1 ms, average %2 ms, max %3 ms").arg(result["minMs"].toDouble(), 0, 'f', 1)
+                .arg(result["avgMs"].toDouble(), 0, 'f', 1).arg(result["maxMs"].toDouble(), 0, 'f', 1);
+    else if (test == "queuedWrite")
+        line = QString("io_uring write, %1 KB blocks, queue depth %2: %3 MB/s").arg(kb).arg(result["queueDepth"].toInt()).arg(mbps);
+    else if (test == "recommendation")
+        line = QString("Fastest: %1 KB blocks, queue depth %2").arg(kb).arg(result["queueDepth"].toInt());
+
     if (!_quiet)
+        _clearLine();
+    std::cout << line.toStdString() << std::endl;
+}
+
+void Cli::onSuccess()
+{
+    _printWriteHealth();
+
+    if (_jsonProgress)
+        _printJson({{"event", "success"}});
+    else if (!_quiet)
     {
         _clearLine();
         std::cerr << "Write successful." << std::endl;
@@ -231,6 +1163,30 @@ void Cli::onSuccess()
     _app->exit(0);
 }
 
+/* One health event per device with --json. Otherwise only warns about suspicious cards */
+void Cli::_printWriteHealth()
+{
+    const QVariantList reports = _imageWriter->writeHealth();
+
+    for (const QVariant &v : reports)
+    {
+        QVariantMap report = v.toMap();
+        if (_jsonProgress)
+        {
+            QJsonObject event = QJsonObject::fromVariantMap(report);
+            event["event"] = "health";
+            _printJson(event);
+        }
+        else if (report["suspicious"].toBool())
+        {
+            if (!_quiet)
+                _clearLine();
+            std::cerr << "Warning: " << report["device"].toString().toStdString()
+                      << " may be counterfeit or failing: " << report["reasons"].toStringList().join(", ").toStdString() << std::endl;
+        }
+    }
+}
+
 void Cli::_clearLine()
 {
     /* Properly clearing line requires platform specific code.
@@ -242,7 +1198,11 @@ void Cli::onError(QVariant msg)
 {
     QByteArray m = msg.toByteArray();
 
-    if (!_quiet)
+    _printWriteHealth();
+
+    if (_jsonProgress)
+        _printJson({{"event", "error"}, {"message", msg.toString()}});
+    else if (!_quiet)
     {
         _clearLine();
     }
@@ -252,7 +1212,10 @@ void Cli::onError(QVariant msg)
 
 void Cli::onDownloadProgress(QVariant dlnow, QVariant dltotal)
 {
-    _printProgress("Writing",  dlnow, dltotal);
+    if (_jsonProgress)
+        _printJsonProgress("write", dlnow, dltotal);
+    else
+        _printProgress("Writing",  dlnow, dltotal);
 }
 
 void Cli::onSendingProgress(QVariant pos)
@@ -262,12 +1225,22 @@ void Cli::onSendingProgress(QVariant pos)
 
 void Cli::onVerifyProgress(QVariant now, QVariant total)
 {
-    _printProgress("Verifying", now, total);
+    if (_jsonProgress)
+        _printJsonProgress("verify", now, total);
+    else
+        _printProgress("Verifying", now, total);
+}
+
+void Cli::onProgressChanged(QVariant progress)
+{
+    _eta = progress.toMap().value("eta").toDouble();
 }
 
 void Cli::onPreparationStatusUpdate(QVariant msg)
 {
-    if (!_quiet)
+    if (_jsonProgress)
+        _printJson({{"event", "status"}, {"message", msg.toString()}});
+    else if (!_quiet)
     {
         QByteArray ascii = QByteArray("  ")+msg.toByteArray()+"\r";
         _clearLine();
@@ -300,3 +1273,65 @@ void Cli::_printProgress(const QByteArray &msg, QVariant now, QVariant total)
         _lastMsg = msg;
     }
 }
+
+void Cli::onPhaseStarted(QVariant phase)
+{
+    if (_jsonProgress)
+        _printJson({{"event", "phaseStart"}, {"phase", phase.toString()}});
+}
+
+void Cli::onPhaseFinished(QVariant phase, QVariant bytes, QVariant msecs)
+{
+    if (!_jsonProgress)
+        return;
+
+    double seconds = msecs.toLongLong() / 1000.0;
+    _printJson({
+        {"event", "phaseEnd"},
+        {"phase", phase.toString()},
+        {"bytes", bytes.toDouble()},
+        {"seconds", seconds},
+        {"averageMBps", seconds > 0 ? bytes.toDouble() / 1000000 / seconds : 0}
+    });
+}
+
+/* One JSON object per line on stdout, with the time in seconds since start */
+void Cli::_printJson(QJsonObject event)
+{
+    event["time"] = _jsonTimer.elapsed() / 1000.0;
+    std::cout << QJsonDocument(event).toJson(QJsonDocument::Compact).constData() << std::endl;
+}
+
+/* At most every 500 ms per phase, and at its end */
+void Cli::_printJsonProgress(const QString &phase, QVariant now, QVariant total)
+{
+    quint64 bytes = now.toULongLong();
+    qint64 t = _jsonTimer.elapsed();
+
+    if (phase != _progressPhase)
+    {
+        _progressPhase = phase;
+        _phaseStartBytes = _progressBytes = bytes;
+        _phaseStartTime = _progressTime = t;
+    }
+    else if (t - _progressTime < 500 && now != total)
+    {
+        return;
+    }
+
+    double instant = (t > _progressTime && bytes >= _progressBytes) ? (bytes - _progressBytes) / 1000.0 / (t - _progressTime) : 0;
+    double average = (t > _phaseStartTime && bytes >= _phaseStartBytes) ? (bytes - _phaseStartBytes) / 1000.0 / (t - _phaseStartTime) : 0;
+    _printJson({
+        {"event", "progress"},
+        {"phase", phase},
+        {"bytes", (double) bytes},
+        {"total", total.toDouble()},
+        {"elapsed", (t - _phaseStartTime) / 1000.0},
+        {"MBps", instant},
+        {"averageMBps", average},
+        {"eta", _eta},
+        {"queue", _imageWriter->queueOccupancy()}
+    });
+    _progressBytes = bytes;
+    _progressTime = t;
+}
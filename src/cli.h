@@ -2,10 +2,16 @@
 #define CLI_H
 
 #include <QObject>
+#include <QElapsedTimer>
+#include <QJsonObject>
 #include <QVariant>
+#include <QVariantMap>
+#include <QStringList>
 
+class CliDaemon;
 class ImageWriter;
 class QCoreApplication;
+class QCommandLineParser;
 
 class Cli : public QObject
 {
@@ -20,10 +26,34 @@ protected:
     ImageWriter *_imageWriter;
     int _lastPercent;
     QByteArray _lastMsg;
-    bool _quiet;
+    bool _quiet, _jsonProgress;
+    /* --json-progress state. Times in ms since start */
+    QElapsedTimer _jsonTimer;
+    QString _progressPhase;
+    quint64 _phaseStartBytes, _progressBytes;
+    qint64 _phaseStartTime, _progressTime;
+    /* Time left in the current phase, from ImageWriter::progressChanged(). Seconds, -1 if unknown */
+    double _eta;
+    /* Chrome trace JSON file written on exit with --trace */
+    QString _traceFile;
 
+    int _applyOptions(QCommandLineParser &parser, ImageWriter *writer);
+    int _runBatch(QCommandLineParser &parser);
+    int _runPrecache(QCommandLineParser &parser);
+    int _runStation(QCommandLineParser &parser, CliDaemon &daemon);
+    int _runBenchmark(QCommandLineParser &parser, const QString &device);
+    quint64 _benchmarkSize(QCommandLineParser &parser);
+    int _runDiagnose(QCommandLineParser &parser, const QString &url, const QString &device);
+    int _runVerifyOnly(QCommandLineParser &parser, const QString &image, const QStringList &devices);
+    int _runCapture(QCommandLineParser &parser, const QString &output, const QString &device);
+    int _runClone(QCommandLineParser &parser, const QString &source, const QStringList &devices);
+    int _runComposite(QCommandLineParser &parser, const QString &partList, const QStringList &devices);
+    bool _checkDrives(QCommandLineParser &parser, const QStringList &devices);
     void _printProgress(const QByteArray &msg, QVariant now, QVariant total);
     void _clearLine();
+    void _printJson(QJsonObject event);
+    void _printWriteHealth();
+    void _printJsonProgress(const QString &phase, QVariant now, QVariant total);
 
 protected slots:
     void onSuccess();
@@ -31,7 +61,13 @@ protected slots:
     void onDownloadProgress(QVariant dlnow, QVariant dltotal);
     void onSendingProgress(QVariant pos);
     void onVerifyProgress(QVariant now, QVariant total);
+    void onProgressChanged(QVariant progress);
     void onPreparationStatusUpdate(QVariant msg);
+    void onBenchmarkResult(QVariantMap result);
+    void onVerifyResult(QVariantMap result);
+    void onCaptureResult(QVariantMap result);
+    void onPhaseStarted(QVariant phase);
+    void onPhaseFinished(QVariant phase, QVariant bytes, QVariant msecs);
 
 signals:
 
@@ -0,0 +1,575 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "clidaemon.h"
+#include "config.h"
+#include "imagewriter.h"
+#include "drivelistmodel.h"
+#include "metrics.h"
+#include "downloadcoordinator.h"
+#include "downloadthread.h"
+#include "dependencies/drivelist/src/drivelist.hpp"
+#include <iostream>
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QUrl>
+
+CliDaemon::CliDaemon(std::function<void(ImageWriter *)> configure, int workers, bool allowSystemDrives, QObject *parent)
+    : QObject(parent), _configure(configure), _workers(workers), _nextId(1), _drivesPerHub(IMAGEWRITER_DRIVES_PER_USB_HUB), _allowSystemDrives(allowSystemDrives),
+      _started(false), _failures(false), _keepRunning(false)
+{
+    connect(&_server, &QLocalServer::newConnection, this, &CliDaemon::onNewConnection);
+    connect(&_metricsServer, &QTcpServer::newConnection, this, &CliDaemon::onMetricsConnection);
+}
+
+CliDaemon::~CliDaemon()
+{
+    /* ImageWriter waits for its thread when deleted */
+    for (Job *job : std::as_const(_running))
+        delete job->writer;
+    qDeleteAll(_running);
+    qDeleteAll(_queue);
+}
+
+bool CliDaemon::listen(const QString &name)
+{
+    /* Left behind if a previous daemon did not exit cleanly */
+    QLocalServer::removeServer(name);
+    return _server.listen(name);
+}
+
+bool CliDaemon::listenMetrics(quint16 port, const QHostAddress &address)
+{
+    return _metricsServer.listen(address, port);
+}
+
+bool CliDaemon::loadJobs(const QString &filename, QString &errorMsg)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        errorMsg = tr("Cannot open jobs file %1").arg(filename);
+        return false;
+    }
+    QByteArray data = f.readAll().trimmed();
+    f.close();
+
+    QList<QJsonObject> specs;
+    if (data.startsWith('['))
+    {
+        QJsonParseError err;
+        QJsonDocument doc = QJsonDocument::fromJson(data, &err);
+        if (err.error != QJsonParseError::NoError)
+        {
+            errorMsg = tr("Error parsing jobs file: %1").arg(err.errorString());
+            return false;
+        }
+        for (const QJsonValue &v : doc.array())
+            specs.append(v.toObject());
+    }
+    else
+    {
+        for (const QByteArray &line : data.split('\n'))
+        {
+            if (line.trimmed().isEmpty())
+                continue;
+
+            QJsonParseError err;
+            QJsonDocument doc = QJsonDocument::fromJson(line, &err);
+            if (!doc.isObject())
+            {
+                errorMsg = tr("Error parsing jobs file: %1").arg(err.errorString());
+                return false;
+            }
+            specs.append(doc.object());
+        }
+    }
+
+    for (int i = 0; i < specs.size(); i++)
+    {
+        QString msg;
+        if (!addJob(specs[i], msg))
+        {
+            errorMsg = tr("Job %1: %2").arg(i+1).arg(msg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool CliDaemon::addJob(const QJsonObject &spec, QString &errorMsg)
+{
+    Job *job = new Job;
+    job->id = spec["id"].toString();
+    if (job->id.isEmpty())
+        job->id = QString("job%1").arg(_nextId++);
+    job->src = spec["src"].toString();
+    job->bmap = spec["bmap"].toString();
+    job->metalink = spec["metalink"].toString();
+    for (const QJsonValue &v : spec["mirrors"].toArray())
+        job->mirrors.append(v.toString());
+    job->sha256 = spec["sha256"].toString().toLatin1();
+    job->verify = spec["verify"].toBool(true);
+    job->writer = nullptr;
+    if (spec["dst"].isArray())
+    {
+        for (const QJsonValue &v : spec["dst"].toArray())
+            job->dsts.append(v.toString());
+    }
+    else if (!spec["dst"].toString().isEmpty())
+    {
+        job->dsts.append(spec["dst"].toString());
+    }
+
+    /* Customization files are read right away, so errors in them are reported on submission */
+    const struct { const char *key; QByteArray *content; } files[] = {
+        {"firstRunScript", &job->firstrun},
+        {"cloudinitUserdata", &job->userdata},
+        {"cloudinitNetworkconfig", &job->networkconfig}
+    };
+    for (const auto &file : files)
+    {
+        QString filename = spec[file.key].toString();
+        if (filename.isEmpty())
+            continue;
+
+        QFile f(filename);
+        if (!f.open(QIODevice::ReadOnly))
+        {
+            errorMsg = tr("Cannot open %1").arg(filename);
+            delete job;
+            return false;
+        }
+        *file.content = f.readAll();
+    }
+
+    if (job->src.isEmpty() || job->dsts.isEmpty())
+    {
+        errorMsg = tr("Job needs src and dst");
+        delete job;
+        return false;
+    }
+
+    _queue.append(job);
+    _sendEvent("queued", job->id);
+    _schedule();
+
+    return true;
+}
+
+void CliDaemon::setDrivesPerHub(int drives)
+{
+    _drivesPerHub = drives;
+}
+
+void CliDaemon::setKeepRunning(bool keepRunning)
+{
+    _keepRunning = keepRunning;
+}
+
+void CliDaemon::start()
+{
+    _started = true;
+    _schedule();
+}
+
+/* Start as many queued jobs as there are free workers. Of the jobs that can start, the one
+   with its drives on the least busy USB controllers goes first, in order otherwise */
+void CliDaemon::_schedule()
+{
+    if (!_started)
+        return;
+
+    QHash<QString, UsbLocation> usb;
+    if (!_queue.isEmpty() && _running.size() < _workers)
+        usb = _usbTopology();
+
+    while (_running.size() < _workers)
+    {
+        QHash<QString, int> load = _usbLoad(usb, false);
+        int best = -1, bestLoad = 0;
+        for (int i = 0; i < _queue.size(); i++)
+        {
+            if (!_canStart(_queue[i], usb))
+                continue;
+
+            int jobLoad = 0;
+            for (const QString &dst : std::as_const(_queue[i]->dsts))
+                jobLoad += load.value(usb.value(dst).controller);
+            if (best == -1 || jobLoad < bestLoad)
+            {
+                best = i;
+                bestLoad = jobLoad;
+            }
+        }
+        if (best == -1)
+            break;
+        _startJob(_queue.takeAt(best), usb);
+    }
+
+    if (_queue.isEmpty() && _running.isEmpty() && !_server.isListening() && !_keepRunning)
+    {
+        DownloadThread::waitForEjects();
+        emit finished(_failures ? 1 : 0);
+    }
+}
+
+/* No device written by two jobs at the same time. A second job downloading the same image into the cache
+   waits until the first has begun the download, then follows it (see DownloadCoordinator).
+   Nor more than _drivesPerHub drives on a hub, unless it is idle, so jobs with more drives on one hub still run */
+bool CliDaemon::_canStart(const Job *job, const QHash<QString, UsbLocation> &usb) const
+{
+    for (const Job *running : _running)
+    {
+        if (_waitsForCacheFill(job, running))
+            return false;
+        for (const QString &dst : job->dsts)
+        {
+            if (running->dsts.contains(dst))
+                return false;
+        }
+    }
+
+    if (_drivesPerHub)
+    {
+        QHash<QString, int> load = _usbLoad(usb, true);
+        QHash<QString, int> added;
+        for (const QString &dst : job->dsts)
+        {
+            QString hub = usb.value(dst).hub;
+            if (!hub.isEmpty())
+                added[hub]++;
+        }
+        for (auto it = added.cbegin(); it != added.cend(); ++it)
+        {
+            int busy = load.value(it.key());
+            if (busy && busy + it.value() > _drivesPerHub)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+QHash<QString, int> CliDaemon::_usbLoad(const QHash<QString, UsbLocation> &usb, bool byHub) const
+{
+    QHash<QString, int> load;
+
+    for (const Job *running : _running)
+    {
+        for (const QString &dst : running->dsts)
+        {
+            const UsbLocation location = usb.value(dst);
+            QString key = byHub ? location.hub : location.controller;
+            if (!key.isEmpty())
+                load[key]++;
+        }
+    }
+
+    return load;
+}
+
+/* A job downloading the same image as a running one can follow its download into the
+   cache instead of downloading it again, once the running job has begun it. Local files,
+   and downloads that do not go through the cache, need not wait for anything */
+bool CliDaemon::_waitsForCacheFill(const Job *job, const Job *running) const
+{
+    bool isUrl = job->src.startsWith("http:", Qt::CaseInsensitive) || job->src.startsWith("https:", Qt::CaseInsensitive);
+    if (running->src != job->src || !isUrl || job->sha256.isEmpty() || running->sha256 != job->sha256
+            || !running->writer || !running->writer->cachingEnabled())
+        return false;
+
+    /* Once downloading, the running job has begun its transfer, unless it found no room in the cache */
+    return !running->downloading && !DownloadCoordinator::find(job->sha256)
+            && !running->writer->isCached(QUrl(job->src), job->sha256);
+}
+
+/* Drives that are not on USB, or on a platform that does not tell, are left out */
+QHash<QString, CliDaemon::UsbLocation> CliDaemon::_usbTopology() const
+{
+    QHash<QString, UsbLocation> usb;
+    DriveListModel dlm;
+    dlm.processDriveList(Drivelist::ListStorageDevices());
+
+    for (int i = 0; i < dlm.rowCount(QModelIndex()); i++)
+    {
+        QModelIndex idx = dlm.index(i, 0);
+        UsbLocation location;
+        location.controller = idx.data(dlm.usbControllerRole).toString();
+        location.hub = idx.data(dlm.usbHubRole).toString();
+        location.speed = idx.data(dlm.usbSpeedRole).toUInt();
+        if (!location.hub.isEmpty())
+            usb.insert(idx.data(dlm.deviceRole).toString(), location);
+    }
+
+    return usb;
+}
+
+void CliDaemon::_startJob(Job *job, const QHash<QString, UsbLocation> &usb)
+{
+    _running.append(job);
+    job->timer.start();
+    _sendEvent("started", job->id, {{"src", job->src}, {"dst", QJsonArray::fromStringList(job->dsts)}});
+    for (const QString &dst : std::as_const(job->dsts))
+    {
+        uint speed = usb.value(dst).speed;
+        if (speed && speed < IMAGEWRITER_USB_SUPERSPEED)
+            _sendEvent("warning", job->id, {{"dst", dst}, {"message", tr("%1 is connected at USB 2 speed (%2 Mbit/s)").arg(dst).arg(speed)}});
+    }
+
+    if (!_allowSystemDrives)
+    {
+        for (const QString &dst : std::as_const(job->dsts))
+        {
+            if (!_isRemovableDrive(dst))
+            {
+                _jobDone(job, false, tr("Destination drive %1 is not in list of removable volumes").arg(dst));
+                return;
+            }
+        }
+    }
+
+    QByteArray initFormat = (job->userdata.isEmpty() && job->networkconfig.isEmpty()) ? "systemd" : "cloudinit";
+    QUrl bmapUrl;
+    if (job->bmap.startsWith("http:", Qt::CaseInsensitive) || job->bmap.startsWith("https:", Qt::CaseInsensitive))
+        bmapUrl = QUrl(job->bmap);
+    else if (!job->bmap.isEmpty())
+        bmapUrl = QUrl::fromLocalFile(QFileInfo(job->bmap).absoluteFilePath());
+
+    ImageWriter *writer = new ImageWriter(this);
+    job->writer = writer;
+    _configure(writer);
+
+    if (job->src.startsWith("http:", Qt::CaseInsensitive) || job->src.startsWith("https:", Qt::CaseInsensitive))
+    {
+        writer->setSrc(QUrl(job->src), 0, 0, job->sha256, false, "", "", initFormat, bmapUrl);
+        writer->setMirrors(job->mirrors, QUrl(job->metalink));
+    }
+    else
+    {
+        QFileInfo fi(job->src);
+        if (!fi.isFile())
+        {
+            _jobDone(job, false, tr("Source file %1 does not exist or is not a regular file").arg(job->src));
+            return;
+        }
+        writer->setSrc(QUrl::fromLocalFile(fi.absoluteFilePath()), fi.size(), 0, job->sha256, false, "", "", initFormat, bmapUrl);
+    }
+
+    if (!job->userdata.isEmpty())
+        writer->setImageCustomization("", "", "", job->userdata, job->networkconfig, "");
+    else if (!job->firstrun.isEmpty())
+        writer->setImageCustomization("", "", job->firstrun, "", "", "");
+
+    writer->setDst(job->dsts.first());
+    for (int i = 1; i < job->dsts.size(); i++)
+        writer->addDst(job->dsts[i]);
+    writer->setVerifyEnabled(job->verify);
+    /* The next job need not wait for the card to be ejected */
+    writer->setAsyncEjectEnabled(true);
+
+    auto progress = [this, job](const char *phase, QVariant now, QVariant total) {
+        /* Limit output, but always report the end of a phase */
+        if (job->progressTimer.isValid() && job->progressTimer.elapsed() < 500 && now != total)
+            return;
+        job->progressTimer.start();
+        _sendEvent("progress", job->id, {{"phase", phase}, {"now", now.toDouble()}, {"total", total.toDouble()}});
+    };
+    connect(writer, &ImageWriter::downloadProgress, this, [this, job, progress](QVariant now, QVariant total) {
+        progress("write", now, total);
+        /* Queued jobs of the same image may follow the download now */
+        if (!job->downloading)
+        {
+            job->downloading = true;
+            if (!_queue.isEmpty())
+                _schedule();
+        }
+    });
+    connect(writer, &ImageWriter::verifyProgress, this, [progress](QVariant now, QVariant total) {
+        progress("verify", now, total);
+    });
+    connect(writer, &ImageWriter::preparationStatusUpdate, this, [this, job](QVariant msg) {
+        _sendEvent("status", job->id, {{"message", msg.toString()}});
+    });
+    connect(writer, &ImageWriter::finalizing, this, [this, job]() {
+        _sendEvent("status", job->id, {{"message", "finalizing"}});
+    });
+    connect(writer, &ImageWriter::success, this, [this, job]() {
+        _jobDone(job, true);
+    });
+    connect(writer, &ImageWriter::error, this, [this, job](QVariant msg) {
+        _jobDone(job, false, msg.toString());
+    });
+
+    writer->startWrite();
+}
+
+void CliDaemon::_jobDone(Job *job, bool success, const QString &msg)
+{
+    if (!_running.removeOne(job))
+        return;
+
+    QJsonObject data{{"seconds", job->timer.elapsed() / 1000.0}};
+    if (job->writer)
+        data["health"] = QJsonArray::fromVariantList(job->writer->writeHealth());
+    if (success)
+    {
+        _sendEvent("success", job->id, data);
+        Metrics::add(Metrics::JobsSucceeded);
+    }
+    else
+    {
+        data["message"] = msg;
+        _sendEvent("error", job->id, data);
+        Metrics::add(Metrics::JobsFailed);
+        _failures = true;
+    }
+
+    if (job->writer)
+    {
+        job->writer->disconnect(this);
+        job->writer->deleteLater();
+    }
+    QString id = job->id;
+    delete job;
+    emit jobFinished(id, success);
+
+    if (_queue.isEmpty() && _running.isEmpty() && (_server.isListening() || _keepRunning))
+        _sendEvent("idle", QString());
+
+    /* Not from within the signal handler of the ImageWriter that just finished */
+    QTimer::singleShot(0, this, &CliDaemon::_schedule);
+}
+
+bool CliDaemon::_isRemovableDrive(const QString &device) const
+{
+    DriveListModel dlm;
+    dlm.processDriveList(Drivelist::ListStorageDevices());
+    int numDrives = dlm.rowCount(QModelIndex());
+
+    for (int i = 0; i < numDrives; i++)
+    {
+        if (dlm.index(i, 0).data(dlm.deviceRole) == device)
+            return true;
+    }
+
+    return false;
+}
+
+void CliDaemon::sendEvent(const QString &event, const QString &jobId, QJsonObject data)
+{
+    _sendEvent(event, jobId, data);
+}
+
+/* One JSON object per line */
+void CliDaemon::_sendEvent(const QString &event, const QString &jobId, QJsonObject data)
+{
+    data["event"] = event;
+    if (!jobId.isEmpty())
+        data["job"] = jobId;
+    data["time"] = QDateTime::currentMSecsSinceEpoch();
+    QByteArray line = QJsonDocument(data).toJson(QJsonDocument::Compact)+"\n";
+
+    if (_server.isListening())
+    {
+        for (QLocalSocket *client : std::as_const(_clients))
+            client->write(line);
+    }
+    else
+    {
+        std::cout << line.constData() << std::flush;
+    }
+}
+
+void CliDaemon::onNewConnection()
+{
+    while (_server.hasPendingConnections())
+    {
+        QLocalSocket *client = _server.nextPendingConnection();
+        _clients.append(client);
+        connect(client, &QLocalSocket::readyRead, this, &CliDaemon::onClientReadyRead);
+        connect(client, &QLocalSocket::disconnected, this, [this, client]() {
+            _clients.removeOne(client);
+            client->deleteLater();
+        });
+    }
+}
+
+void CliDaemon::onClientReadyRead()
+{
+    QLocalSocket *client = qobject_cast<QLocalSocket *>(sender());
+    if (!client)
+        return;
+
+    while (client->canReadLine())
+    {
+        QByteArray line = client->readLine().trimmed();
+        if (line.isEmpty())
+            continue;
+
+        QJsonParseError err;
+        QJsonDocument doc = QJsonDocument::fromJson(line, &err);
+        QString msg;
+        if (!doc.isObject())
+            _sendEvent("rejected", QString(), {{"message", tr("Error parsing job: %1").arg(err.errorString())}});
+        else if (!addJob(doc.object(), msg))
+            _sendEvent("rejected", doc.object()["id"].toString(), {{"message", msg}});
+    }
+}
+
+/* Minimal HTTP/1.0: one request per connection, the request headers are not looked at */
+void CliDaemon::onMetricsConnection()
+{
+    while (_metricsServer.hasPendingConnections())
+    {
+        QTcpSocket *client = _metricsServer.nextPendingConnection();
+        connect(client, &QTcpSocket::disconnected, client, &QObject::deleteLater);
+        connect(client, &QTcpSocket::readyRead, this, [client]() {
+            /* Headers after the request line arrive once the answer is sent */
+            if (client->state() != QAbstractSocket::ConnectedState)
+            {
+                client->readAll();
+                return;
+            }
+            if (!client->canReadLine())
+            {
+                /* Request line should fit in a packet. Do not buffer junk forever */
+                if (client->bytesAvailable() > 8192)
+                    client->abort();
+                return;
+            }
+
+            QList<QByteArray> request = client->readLine().trimmed().split(' ');
+            QByteArray status, body, contentType = "text/plain; charset=utf-8";
+            if (request.size() < 2 || (request[0] != "GET" && request[0] != "HEAD"))
+            {
+                status = "405 Method Not Allowed";
+            }
+            else if (request[1] != "/metrics")
+            {
+                status = "404 Not Found";
+            }
+            else
+            {
+                status = "200 OK";
+                body = Metrics::openMetrics();
+                contentType = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+            }
+
+            client->write("HTTP/1.0 "+status+"\r\nContent-Type: "+contentType
+                          +"\r\nContent-Length: "+QByteArray::number(body.size())+"\r\nConnection: close\r\n\r\n");
+            if (request.value(0) != "HEAD")
+                client->write(body);
+            client->disconnectFromHost();
+        });
+    }
+}
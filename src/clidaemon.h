@@ -0,0 +1,126 @@
+#ifndef CLIDAEMON_H
+#define CLIDAEMON_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QObject>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QJsonObject>
+#include <QList>
+#include <QLocalServer>
+#include <QStringList>
+#include <QTcpServer>
+#include <functional>
+
+class ImageWriter;
+class QLocalSocket;
+
+/*
+ * Long running command line mode writing a queue of jobs
+ *
+ * Jobs are JSON objects, read from a file or as one line each from
+ * clients of a local socket:
+ *
+ *   {"id": "card1", "src": "<image file or URL>", "dst": "<device>" or ["<device>", ...],
+ *    "sha256": "<extract hash>", "bmap": "<bmap file or URL>", "verify": true,
+ *    "mirrors": ["<other URL of the image>", ...], "metalink": "<metalink URL>",
+ *    "firstRunScript": "<file>", "cloudinitUserdata": "<file>", "cloudinitNetworkconfig": "<file>"}
+ *
+ * Up to the given number of jobs are written at the same time, each by
+ * its own ImageWriter. Jobs for a device that is in use wait. The second
+ * job of an image reads it from the cache file the first one downloads it
+ * into, so it is downloaded once. Drives on one USB hub share its bandwidth, so only so many of
+ * them are written at once, and jobs on the least busy USB controllers
+ * go first. A job is done once its card is written; the card is ejected
+ * in the background while the next one starts. Progress is reported as JSON lines on stdout (jobs file) or to
+ * all socket clients (daemon).
+ *
+ * With listenMetrics(), the totals of all jobs are served over HTTP in
+ * the OpenMetrics text format, at /metrics, for Prometheus to scrape.
+ * They include device paths and job state, so they are only served on
+ * the loopback interface unless another address is given.
+ */
+class CliDaemon : public QObject
+{
+    Q_OBJECT
+public:
+    /* configure is called for every ImageWriter, to apply the command line options */
+    explicit CliDaemon(std::function<void(ImageWriter *)> configure, int workers, bool allowSystemDrives, QObject *parent = nullptr);
+    virtual ~CliDaemon();
+
+    /* Accept jobs from clients of local socket name */
+    bool listen(const QString &name);
+    /* Serve Metrics::openMetrics() over HTTP on port. Without authentication, so only on
+       the loopback interface unless address says otherwise */
+    bool listenMetrics(quint16 port, const QHostAddress &address = QHostAddress::LocalHost);
+    /* Queue the jobs in a file with a JSON array or one object per line.
+       finished() is emitted once they are all done */
+    bool loadJobs(const QString &filename, QString &errorMsg);
+    /* Returns false with errorMsg set if the job is invalid */
+    bool addJob(const QJsonObject &spec, QString &errorMsg);
+    /* Most drives on one USB hub written at the same time, 0 for no limit */
+    void setDrivesPerHub(int drives);
+    /* Keep running once the queue is empty, for jobs added later on, e.g. by StationMode */
+    void setKeepRunning(bool keepRunning);
+    /* Report an event of a job, as JSON line on stdout or to the socket clients */
+    void sendEvent(const QString &event, const QString &jobId, QJsonObject data = QJsonObject());
+
+public slots:
+    void start();
+
+signals:
+    /* Jobs file mode only. exitCode is 1 if any job failed */
+    void finished(int exitCode);
+    void jobFinished(const QString &id, bool success);
+
+protected:
+    struct Job
+    {
+        QString id, src, bmap, metalink;
+        QStringList dsts, mirrors;
+        QByteArray sha256, firstrun, userdata, networkconfig;
+        bool verify;
+        /* Progress of the download was reported, see _waitsForCacheFill() */
+        bool downloading = false;
+        ImageWriter *writer;
+        QElapsedTimer timer, progressTimer;
+    };
+
+    /* Where a USB drive is plugged in, see DriveListModel */
+    struct UsbLocation
+    {
+        QString controller, hub;
+        /* Mbit/s */
+        uint speed = 0;
+    };
+
+    std::function<void(ImageWriter *)> _configure;
+    int _workers, _nextId, _drivesPerHub;
+    bool _allowSystemDrives, _started, _failures, _keepRunning;
+    QLocalServer _server;
+    QTcpServer _metricsServer;
+    QList<QLocalSocket *> _clients;
+    QList<Job *> _queue, _running;
+
+    void _schedule();
+    bool _canStart(const Job *job, const QHash<QString, UsbLocation> &usb) const;
+    bool _waitsForCacheFill(const Job *job, const Job *running) const;
+    /* Drives of running jobs on each controller or hub */
+    QHash<QString, int> _usbLoad(const QHash<QString, UsbLocation> &usb, bool byHub) const;
+    QHash<QString, UsbLocation> _usbTopology() const;
+    void _startJob(Job *job, const QHash<QString, UsbLocation> &usb);
+    void _jobDone(Job *job, bool success, const QString &msg = QString());
+    bool _isRemovableDrive(const QString &device) const;
+    void _sendEvent(const QString &event, const QString &jobId, QJsonObject data = QJsonObject());
+
+protected slots:
+    void onNewConnection();
+    void onClientReadyRead();
+    void onMetricsConnection();
+};
+
+#endif // CLIDAEMON_H
@@ -29,19 +29,289 @@
 /* Block size used for writes (currently used when using .zip images only) */
 #define IMAGEWRITER_BLOCKSIZE             1*1024*1024
 
+/* Largest write block size used to match the optimal I/O size a device reports */
+#define IMAGEWRITER_MAX_BLOCKSIZE         8*1024*1024
+
 /* Block size used with uncompressed images */
 #define IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE 128*1024
 
+/* Size of the window of a local image file that is memory mapped at a time */
+#define IMAGEWRITER_MMAP_WINDOWSIZE       64*1024*1024
+
+/* Size of the reads of an image file on a network share, and how many are in flight.
+   Their buffers take the place of the mapped window */
+#define IMAGEWRITER_SHARE_READ_SIZE       4*1024*1024
+#define IMAGEWRITER_SHARE_READS_IN_FLIGHT 8
+
+/* Most boot partition data kept in memory to customize it while writing */
+#define IMAGEWRITER_INSTREAM_CUSTOMIZE_MAXSIZE 256*1024*1024
+
 /* Block size used when reading during verify stage */
 #define IMAGEWRITER_VERIFY_BLOCKSIZE      128*1024
 
+/* Number of IMAGEWRITER_BLOCKSIZE buffers decompression may run ahead of the device writer */
+#define IMAGEWRITER_WRITE_QUEUE_DEPTH     4
+
+/* With overlapped verify, amount of data written between syncs after which it is read back */
+#define IMAGEWRITER_VERIFY_CHECKPOINT     256*1024*1024
+
+/* Amount of data written between syncs after which the write journal records how far
+   the image got on the drive, see WriteJournal */
+#define IMAGEWRITER_WRITE_JOURNAL_INTERVAL  256*1024*1024
+
+/* Bytes before a write journal checkpoint that are read back and hashed, to tell
+   whether the drive still has them when resuming */
+#define IMAGEWRITER_WRITE_JOURNAL_TAIL      64*1024
+
+/* Linux, writes through the page cache: amount of data after which its writeback is started.
+   The writer waits for the window before, so at most two windows are dirty at any time */
+#define IMAGEWRITER_WRITEBACK_WINDOW      32*1024*1024
+
+/* Linux, with --tune-queue: read-ahead in KB of the device being written, at least */
+#define IMAGEWRITER_QUEUE_READ_AHEAD_KB   2048
+
+/* Number of power of two strides the drive is divided into by the 4 KB blocks that are
+   written and read back before writing it, to catch cards that claim more capacity
+   than they have. Blocks at each power of two below the stride are probed as well */
+#define IMAGEWRITER_CAPACITY_PROBE_STRIDES 64
+
+/* With chunked verify, amount of image data covered by each leaf hash,
+   and maximum number of threads verifying leaves */
+#define IMAGEWRITER_HASH_CHUNKSIZE        4*1024*1024
+#define IMAGEWRITER_VERIFY_THREADS        8
+
+/* Number of reads in flight while verifying, if io_uring is available */
+#define IMAGEWRITER_IOURING_VERIFY_DEPTH  4
+
+/* Size of the ring buffer between download and extraction, and of the slabs it consists of */
+#define IMAGEWRITER_RINGBUFFER_SIZE       8*1024*1024
+#define IMAGEWRITER_RINGBUFFER_SLABSIZE   64*1024
+
+/* Size of the huge pages pipeline buffers are carved from with --huge-pages */
+#define IMAGEWRITER_HUGEPAGE_SIZE         2*1024*1024
+
+/* Maximum number of threads used to decompress .xz images */
+#define IMAGEWRITER_XZ_MAX_THREADS        8
+
+/* Maximum number of threads used to decompress multi-frame .zst images, and the
+   largest frame (compressed and decompressed) that is buffered to be decoded in parallel */
+#define IMAGEWRITER_ZSTD_MAX_THREADS      8
+#define IMAGEWRITER_ZSTD_MAX_FRAMESIZE    32*1024*1024
+#define IMAGEWRITER_ZSTD_MAX_FRAME_OUTPUT 256*1024*1024
+
+/* Maximum number of threads inflating the entries of a multi-file zip archive that is on disk,
+   and most inflated data waiting to be written */
+#define IMAGEWRITER_ZIP_MAX_THREADS       8
+#define IMAGEWRITER_ZIP_MAX_BUFFERED      256*1024*1024
+
+/* Memory the write pipeline may use in embedded mode, as a fraction of RAM (see MemoryBudget),
+   and the smallest limit it can be sized for */
+#define IMAGEWRITER_EMBEDDED_MEMORY_FRACTION 4
+#define IMAGEWRITER_MIN_MEMORY_LIMIT      32*1024*1024
+
+/* Maximum size of a bmap file we are willing to download */
+#define IMAGEWRITER_BMAP_MAXSIZE          16*1024*1024
+
+/* Shortest run of file system free space kept when deriving a block map of an image without bmap */
+#define IMAGEWRITER_FSMAP_MIN_RUN         (64*1024)
+
 /* Enable caching */
 #define IMAGEWRITER_ENABLE_CACHE_DEFAULT        true
 
 /* Do not cache if it would bring free disk space under 5 GB */
 #define IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING   5*1024*1024*1024ll
 
+/* Default maximum total size of all images in the download cache */
+#define IMAGEWRITER_CACHE_BUDGET_DEFAULT        32*1024*1024*1024ll
+
+/* Keep a decompressed copy of written images as well. Costs disk space, saves decompressing on repeated writes */
+#define IMAGEWRITER_CACHE_EXTRACTED_DEFAULT     false
+
+/* Memory backed directory holding decompressed images that fit the RAM staging budget (0 by default, off).
+   tmpfs is shared memory like a memfd; mount one with huge=always and point caching/ramStageDirectory at it for huge pages */
+#define IMAGEWRITER_RAMSTAGE_DIRECTORY          "/dev/shm"
+#define IMAGEWRITER_RAMSTAGE_BUDGET_DEFAULT     0
+
+/* Read throughput of each cache root (caching/roots) is measured with a file of 64 MB */
+#define IMAGEWRITER_CACHE_VOLUME_PROBE_SIZE     64*1024*1024ll
+
+/* Recompress cached xz, bzip2 and gzip downloads into seekable zstd when idle (caching/transcode), at level 9.
+   Images that would grow past 150% of the download are left as they are */
+#define IMAGEWRITER_CACHE_TRANSCODE_DEFAULT     false
+#define IMAGEWRITER_CACHE_TRANSCODE_ZSTD_LEVEL  9
+#define IMAGEWRITER_CACHE_TRANSCODE_MAX_GROWTH  150
+
+/* Record progress of a download in the cache journal every 64 MB, for resuming after a restart */
+#define IMAGEWRITER_CACHE_JOURNAL_INTERVAL      64*1024*1024
+
+/* Cache file is written by a thread of its own, in buffers of 1 MB. The download waits once 32 are queued */
+#define IMAGEWRITER_CACHE_WRITER_BUFFER         1024*1024
+#define IMAGEWRITER_CACHE_WRITER_QUEUE          32
+
+/* Extracted images are hashed again once they were not checked for a week, 5 minutes after the last write,
+   with 2 threads at the lowest priority. Writes only skip hashing entries checked within that week */
+#define IMAGEWRITER_CACHE_SCRUB_INTERVAL        7*24*3600*1000ll
+#define IMAGEWRITER_CACHE_SCRUB_IDLE_DELAY      5*60*1000
+#define IMAGEWRITER_CACHE_SCRUB_THREADS         2
+
+/* The metadata index log is compacted once it holds this many times more records
+   than are live, and more than the minimum */
+#define IMAGEWRITER_METADATA_COMPACT_FACTOR     4
+#define IMAGEWRITER_METADATA_COMPACT_MIN        1024
+
+/* Start downloading the selected image into the cache while the user is still choosing the
+   storage device and options. Only once it stayed selected for 1.5 seconds */
+#define IMAGEWRITER_PREFETCH_DEFAULT            true
+#define IMAGEWRITER_PREFETCH_DELAY              1500
+
+/* Images of a cache pre-seeding manifest that fail to download are tried this often in total,
+   and OS lists of the manifest have at most this many sublists */
+#define IMAGEWRITER_PRECACHE_ATTEMPTS           3
+#define IMAGEWRITER_PRECACHE_MAX_SUBLISTS       256
+
+/* Largest .xz index or zstd seek table read to learn the uncompressed size of an image */
+#define IMAGEWRITER_PROBE_MAX_INDEX             1024*1024
+
+/* Limits for chunk indexes from the server, and for the chunks of the pack fetched in a single range request */
+#define IMAGEWRITER_DELTA_MAX_INDEX_SIZE        64*1024*1024
+#define IMAGEWRITER_DELTA_MAX_CHUNK_SIZE        16*1024*1024
+#define IMAGEWRITER_DELTA_MAX_RANGE             16*1024*1024
+
+/* Only assemble an image from chunks if the cache has at least 10 percent of it. Download it whole otherwise */
+#define IMAGEWRITER_DELTA_MIN_REUSE             10
+
+/* Sharing the download cache with other stations on the LAN: port of the HTTP server and of discovery,
+   multicast group queries are sent to, and milliseconds to wait for a peer to answer */
+#define IMAGEWRITER_PEER_CACHE_PORT             8574
+#define IMAGEWRITER_PEER_CACHE_GROUP            "239.255.85.74"
+#define IMAGEWRITER_PEER_CACHE_TIMEOUT          500
+
+/* Limits of the peer cache server: connections served at once, size of discovery messages and HTTP request
+   headers, and data queued per connection */
+#define IMAGEWRITER_PEER_CACHE_MAX_CONNECTIONS  8
+#define IMAGEWRITER_PEER_CACHE_MAX_MESSAGE      8192
+#define IMAGEWRITER_PEER_CACHE_SEND_BUFFER      1024*1024
+
+/* Number of extracted blocks that may be queued per device when writing to several devices at once */
+#define IMAGEWRITER_FANOUT_QUEUE_DEPTH          16
+
+/* Milliseconds a device may keep its queue full before it is served from the extracted image cache instead */
+#define IMAGEWRITER_FANOUT_SPILL_TIMEOUT        2000
+
+/* Minimum interval in milliseconds between progress reports of each device when writing to several */
+#define IMAGEWRITER_FANOUT_PROGRESS_INTERVAL    500
+
+/* Number of parallel range requests used for downloading. 1 to use a single connection */
+#define IMAGEWRITER_DOWNLOAD_SEGMENTS           1
+
+/* Segmented downloads fetch the file in pieces of 8 MB, lowest offset first, so extraction can start early */
+#define IMAGEWRITER_SEGMENT_SIZE                8*1024*1024
+
+/* Number of times a piece of a segmented download is retried after the connection fails */
+#define IMAGEWRITER_SEGMENT_RETRIES             5
+
+/* Bytes per second background downloads like the prefetch are held to while others run, if no bandwidth limit is set */
+#define IMAGEWRITER_BANDWIDTH_BACKGROUND_RATE   256*1024
+
+/* Mirrors are probed by fetching the first 256 KB from all of them at once, for at most 5 seconds */
+#define IMAGEWRITER_MIRROR_PROBE_SIZE           256*1024
+#define IMAGEWRITER_MIRROR_PROBE_TIMEOUT        5000
+
+/* Multi-source downloads use mirrors that would take at most twice as long for a piece as the best one */
+#define IMAGEWRITER_MIRROR_SPREAD               2
+
+/* Choosing between encodings of an image: sample data each decoder is timed on, and the
+   weight of the latest download in the link speed remembered per host */
+#define IMAGEWRITER_DECODE_BENCHMARK_SIZE       8*1024*1024
+#define IMAGEWRITER_LINK_RATE_WEIGHT            0.5
+
+/* Bytes written by each sequential test of the device benchmark, and area the random writes are spread over */
+#define IMAGEWRITER_BENCHMARK_SIZE              256*1024*1024
+
+/* Number of 4 KB writes of the random write test of the device benchmark */
+#define IMAGEWRITER_BENCHMARK_RANDOM_WRITES     1000
+
+/* Number of write+fsync rounds of the fsync latency test of the device benchmark */
+#define IMAGEWRITER_BENCHMARK_FSYNCS            50
+
+/* Default zstd level and xz preset of images captured from a device. Captured zstd images are
+   a frame per IMAGEWRITER_HASH_CHUNKSIZE of the device, and xz images a block per that size */
+#define IMAGEWRITER_CAPTURE_ZSTD_LEVEL          9
+#define IMAGEWRITER_CAPTURE_XZ_PRESET           6
+
+/* Granularity all-zero regions are left out of the bmap of a captured image at */
+#define IMAGEWRITER_CAPTURE_BMAP_BLOCKSIZE      4096
+
+/* Size of the reads from the source device when cloning it to other devices. A couple of
+   these are read ahead into the ring buffer while the devices write the ones before.
+   Image files copied from the extracted cache with copy_file_range() go in pieces of this size */
+#define IMAGEWRITER_CLONE_READ_SIZE             4*1024*1024
+
+/* Interval in milliseconds the I/O statistics of the device are sampled at while writing */
+#define IMAGEWRITER_HEALTH_SAMPLE_INTERVAL      1000
+
+/* Writes taking longer than this many ms are stalls. A card with as many stalls as
+   IMAGEWRITER_HEALTH_MAX_STALLS, or writing the last quarter of the image this many times
+   slower than the first, is reported as suspicious */
+#define IMAGEWRITER_HEALTH_STALL_MS             500
+#define IMAGEWRITER_HEALTH_MAX_STALLS           3
+#define IMAGEWRITER_HEALTH_SLOWDOWN_FACTOR      5
+
+/* Drives on one USB hub written at the same time with --daemon or --jobs, as they share
+   its bandwidth. Readers at less than this Mbit/s are reported as running at USB 2 speed */
+#define IMAGEWRITER_DRIVES_PER_USB_HUB          4
+#define IMAGEWRITER_USB_SUPERSPEED              5000
+
+/* Cards --station writes at the same time, unless --workers says otherwise */
+#define IMAGEWRITER_STATION_WORKERS             8
+
+/* Events kept per thread with --trace. Older ones are overwritten */
+#define IMAGEWRITER_TRACE_EVENTS                65536
+
+/* Messages that can repeat for every packet or block, like duplicates and retries, are let through at most 10 per second at each place */
+#define IMAGEWRITER_LOG_RATE_LIMIT              10
+
+/* Telemetry is sent once no image has been downloading for 30 seconds. Sending is retried every
+   10 minutes while offline, keeping at most 64 events queued */
+#define IMAGEWRITER_TELEMETRY_IDLE_DELAY        30000
+#define IMAGEWRITER_TELEMETRY_RETRY_INTERVAL    600000
+#define IMAGEWRITER_TELEMETRY_MAX_QUEUED        64
+
+/* OS list icons: memory for decoded icons, number fetched at once and largest icon downloaded */
+#define IMAGEWRITER_ICON_CACHE_MEMORY           16*1024*1024
+#define IMAGEWRITER_ICON_THREADS                4
+#define IMAGEWRITER_ICON_MAX_SIZE               1024*1024
+
+/* Icons saved on disk are fetched again after 7 days, and removed if not fetched for 30 */
+#define IMAGEWRITER_ICON_MAX_AGE                7*24*3600
+#define IMAGEWRITER_ICON_REMOVE_AGE             30*24*3600
+
+/* Embedded mode (eglfs/linuxfb kiosks) while writing: ms between progress updates of the GUI,
+   and nice level of the Qt Quick render thread, so it leaves the cores to the write pipeline */
+#define IMAGEWRITER_EMBEDDED_PROGRESS_INTERVAL  1000
+#define IMAGEWRITER_EMBEDDED_RENDER_NICE        10
+
+/* Longest wait for the eMMC of DFU booted boards to show up as USB storage, in ms */
+#define IMAGEWRITER_UMS_ENUMERATE_TIMEOUT       60000
+
+/* Fastboot flashing of DFU booted boards: longest wait for the board to come back as a
+   fastboot device in ms, largest sparse image sent at once (less if the board's download
+   buffer is smaller), and what is flashed. mmc0 is U-Boot's name for the whole eMMC */
+#define IMAGEWRITER_FASTBOOT_ENUMERATE_TIMEOUT  30000
+#define IMAGEWRITER_FASTBOOT_PIECE_SIZE         (64*1024*1024)
+#define IMAGEWRITER_FASTBOOT_PARTITION          "mmc0"
+
 /* Uniflash serial baud rate */
 #define UNIFLASH_BAUD_RATE                     921600
 
+/* A board that checks what it wrote puts uniflash<N> with this suffix over TFTP after writing
+   part N to eMMC: the binary SHA256 of every UNIFLASH_HASH_CHUNK_SIZE of the part (the last
+   one shorter) as read back, e.g. with U-Boot's hash and tftpput commands */
+#define UNIFLASH_HASH_SUFFIX                   ".sha256"
+#define UNIFLASH_HASH_CHUNK_SIZE               (4*1024*1024)
+
+/* Longest wait for the hashes of the parts the board still has to check after it got the
+   last one, in ms */
+#define UNIFLASH_VERIFY_TIMEOUT                120000
+
 #endif // CONFIG_H
@@ -0,0 +1,217 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "crc32c.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_NATIVE
+#else
+#include <cpuid.h>
+#define TARGET_NATIVE __attribute__((target("sse4.2")))
+#endif
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define CRC32C_ARM
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+#if defined(__ARM_FEATURE_CRC32) || (defined(_MSC_VER) && !defined(__clang__))
+#define TARGET_NATIVE
+#elif defined(__clang__)
+#define TARGET_NATIVE __attribute__((target("crc")))
+#else
+#define TARGET_NATIVE __attribute__((target("+crc")))
+#endif
+#endif
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82F63B78
+
+/* Slicing-by-8 tables, for CPUs without CRC instructions */
+struct Crc32cTable
+{
+    uint32_t t[8][256];
+
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t crc = i;
+            for (int j = 0; j < 8; j++)
+                crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+            t[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+            for (int k = 1; k < 8; k++)
+                t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xFF];
+    }
+};
+
+static uint32_t updateTable(uint32_t crc, const uint8_t *p, size_t len)
+{
+    static const Crc32cTable table;
+    const uint32_t (*t)[256] = table.t;
+
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p+4, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+
+TARGET_NATIVE static uint32_t updateNative(uint32_t crc, const uint8_t *p, size_t len)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64_t crc64 = crc;
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t) crc64;
+#endif
+    while (len >= 4)
+    {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+static bool detectSupport()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 1);
+    return (regs[2] & (1 << 20)) != 0;
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    return (ecx & bit_SSE4_2) != 0;
+#endif
+}
+
+static const char *implementationName = "SSE4.2";
+
+#elif defined(CRC32C_ARM)
+
+TARGET_NATIVE static uint32_t updateNative(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len >= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+
+static bool detectSupport()
+{
+#if defined(__APPLE__)
+    /* Every Apple arm64 CPU has the CRC32 extension */
+    return true;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#elif defined(_WIN32)
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRC32_INSTRUCTIONS_AVAILABLE);
+#else
+    return false;
+#endif
+}
+
+static const char *implementationName = "ARMv8 CRC32";
+
+#else
+
+/* No CRC instructions for this architecture, detectSupport() returns false,
+   so updateNative() is never called */
+static uint32_t updateNative(uint32_t crc, const uint8_t *, size_t)
+{
+    return crc;
+}
+
+static bool detectSupport()
+{
+    return false;
+}
+
+static const char *implementationName = nullptr;
+
+#endif
+
+static bool isNative()
+{
+    static const bool supported = detectSupport();
+    return supported;
+}
+
+Crc32c::Crc32c()
+    : _crc(0xFFFFFFFF)
+{
+}
+
+const char *Crc32c::implementation()
+{
+    return isNative() ? implementationName : "table";
+}
+
+void Crc32c::addData(const char *data, size_t len)
+{
+    if (isNative())
+        _crc = updateNative(_crc, (const uint8_t *) data, len);
+    else
+        _crc = updateTable(_crc, (const uint8_t *) data, len);
+}
+
+QByteArray Crc32c::result() const
+{
+    uint32_t crc = ~_crc;
+    char out[4] = {
+        (char) (crc >> 24), (char) (crc >> 16), (char) (crc >> 8), (char) crc
+    };
+
+    return QByteArray(out, sizeof(out));
+}
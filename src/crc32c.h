@@ -0,0 +1,37 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-32C (Castagnoli), using the CPU's CRC instructions if available:
+ * SSE4.2 on x86 and the ARMv8 CRC32 extension on arm64. Falls back
+ * to a slicing-by-8 table otherwise
+ *
+ * Not a cryptographic hash. Only meant to catch storage returning
+ * something else than was written to it, see ChunkedHash.
+ */
+class Crc32c
+{
+public:
+    Crc32c();
+
+    /* Name of the instructions used, or "table" */
+    static const char *implementation();
+
+    void addData(const char *data, size_t len);
+    /* 4 bytes, big endian */
+    QByteArray result() const;
+
+protected:
+    uint32_t _crc;
+};
+
+#endif // CRC32C_H
@@ -0,0 +1,60 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "curlshare.h"
+#include <QDebug>
+
+CURLSH *CurlShare::_share = nullptr;
+std::mutex CurlShare::_shareMutex;
+std::mutex CurlShare::_locks[CURL_LOCK_DATA_LAST];
+std::atomic<int> CurlShare::_bulkTransfers(0);
+
+int CurlShare::bulkTransfers()
+{
+    return _bulkTransfers;
+}
+
+void CurlShare::apply(CURL *c)
+{
+    std::lock_guard<std::mutex> lock(_shareMutex);
+
+    if (!_share)
+    {
+        _share = curl_share_init();
+        if (!_share)
+            return;
+
+        curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, &CurlShare::_lock);
+        curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, &CurlShare::_unlock);
+        curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    }
+
+    curl_easy_setopt(c, CURLOPT_SHARE, _share);
+}
+
+void CurlShare::cleanup()
+{
+    std::lock_guard<std::mutex> lock(_shareMutex);
+
+    if (_share)
+    {
+        if (curl_share_cleanup(_share) == CURLSHE_OK)
+            _share = nullptr;
+        else
+            qDebug() << "curl share still in use, not freeing it";
+    }
+}
+
+/* libcurl only takes one lock at a time, so a mutex per kind of data is enough.
+   Shared and exclusive access are not told apart */
+void CurlShare::_lock(CURL *, curl_lock_data data, curl_lock_access, void *)
+{
+    _locks[data].lock();
+}
+
+void CurlShare::_unlock(CURL *, curl_lock_data data, void *)
+{
+    _locks[data].unlock();
+}
@@ -0,0 +1,51 @@
+#ifndef CURLSHARE_H
+#define CURLSHARE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <curl/curl.h>
+#include <atomic>
+#include <mutex>
+
+/*
+ * Process-wide libcurl share of the DNS cache
+ *
+ * Transfers to the same host from different threads (boot files, image,
+ * bmap, telemetry) then skip the DNS lookup. Only the DNS cache can be
+ * shared by transfers running at the same time in different threads.
+ * libcurl does not support that for connections and TLS sessions, so
+ * transfers that should reuse connections run on one multi handle, like
+ * the range requests of a segmented download.
+ */
+class CurlShare
+{
+public:
+    /* Let transfers of easy handle c use the share. Creates it on first use */
+    static void apply(CURL *c);
+    /* Free the share if no easy handle uses it any more. Call before curl_global_cleanup() */
+    static void cleanup();
+
+    /* Marks an image download as running for as long as it exists */
+    class BulkTransfer
+    {
+    public:
+        BulkTransfer() { _bulkTransfers++; }
+        ~BulkTransfer() { _bulkTransfers--; }
+    };
+    /* Number of image downloads running. Background transfers like telemetry wait for them */
+    static int bulkTransfers();
+
+protected:
+    static CURLSH *_share;
+    static std::mutex _shareMutex;
+    static std::mutex _locks[CURL_LOCK_DATA_LAST];
+    static std::atomic<int> _bulkTransfers;
+
+    static void _lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+    static void _unlock(CURL *handle, curl_lock_data data, void *userptr);
+};
+
+#endif // CURLSHARE_H
@@ -0,0 +1,289 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "deltadownloadthread.h"
+#include "acceleratedcryptographichash.h"
+#include "cachesidecar.h"
+#include "chunkedhash.h"
+#include "config.h"
+#include "curlshare.h"
+#include "downloadthread.h"
+#include "threadplacement.h"
+#include <QDebug>
+#include <QFile>
+#include <QUrl>
+#include <zstd.h>
+
+namespace
+{
+    /* Body of the transfer in progress, limited to what was asked for */
+    struct Transfer
+    {
+        QByteArray *out;
+        quint64 maxSize;
+        BandwidthScheduler::Job *bandwidth;
+    };
+}
+
+DeltaDownloadThread::DeltaDownloadThread(const QByteArray &indexUrl, const QString &outputFile, const QByteArray &expectedHash,
+                                         const QStringList &sources, QObject *parent)
+    : QThread(parent), _indexUrl(indexUrl), _expectedHash(expectedHash.toLower()), _outputFile(outputFile),
+      _sources(sources), _cancelled(false), _c(nullptr)
+{
+}
+
+DeltaDownloadThread::~DeltaDownloadThread()
+{
+    cancel();
+    wait();
+}
+
+void DeltaDownloadThread::setUserAgent(const QByteArray &ua)
+{
+    _useragent = ua;
+}
+
+void DeltaDownloadThread::cancel()
+{
+    _cancelled = true;
+    _bandwidth.cancel();
+}
+
+bool DeltaDownloadThread::isCancelled() const
+{
+    return _cancelled;
+}
+
+ChunkIndex DeltaDownloadThread::index() const
+{
+    return _index;
+}
+
+void DeltaDownloadThread::run()
+{
+    ThreadPlacement::apply(ThreadPlacement::StageDownload);
+    CurlShare::BulkTransfer bulk;
+    BandwidthScheduler::Running bandwidth(_bandwidth);
+    _transport = DownloadThread::transport();
+    _c = curl_easy_init();
+    QString err = _c ? _assemble() : QString("Error initializing curl");
+
+    qDeleteAll(_sourceFiles);
+    _sourceFiles.clear();
+    if (_c)
+        curl_easy_cleanup(_c);
+    _c = nullptr;
+
+    if (err.isEmpty())
+    {
+        emit success();
+    }
+    else
+    {
+        QFile::remove(_outputFile);
+        CacheSidecar::remove(_outputFile);
+        ChunkIndex::remove(_outputFile);
+        emit failed(err);
+    }
+}
+
+QString DeltaDownloadThread::_assemble()
+{
+    QByteArray json;
+
+    emit preparationStatusUpdate(tr("downloading chunk index"));
+    if (!_get(_indexUrl, json, 0, 0, IMAGEWRITER_DELTA_MAX_INDEX_SIZE) || !_index.parse(json))
+        return "Could not get chunk index";
+    if (_index.imageHash != _expectedHash)
+        return "Chunk index is for another image";
+
+    /* Chunks the cache has already, by hash */
+    QHash<QByteArray, Source> cached;
+    for (const QString &file : std::as_const(_sources))
+    {
+        ChunkIndex other;
+        if (!other.load(file))
+            continue;
+        for (const ChunkIndex::Chunk &chunk : std::as_const(other.chunks))
+            cached.insert(chunk.sha256, {file, chunk.offset, chunk.size});
+    }
+
+    quint64 reusable = 0;
+    for (const ChunkIndex::Chunk &chunk : std::as_const(_index.chunks))
+    {
+        if (cached.contains(chunk.sha256))
+            reusable += chunk.size;
+    }
+    qDebug() << "Chunk index:" << _index.chunks.size() << "chunks," << reusable/1024/1024 << "of" << _index.imageSize/1024/1024 << "MB in the cache already";
+    if (reusable * 100 < _index.imageSize * IMAGEWRITER_DELTA_MIN_REUSE)
+        return "Too little of the image in the cache to assemble it from chunks";
+
+    QFile out(_outputFile);
+    if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return "Error creating " + _outputFile;
+
+    AcceleratedCryptographicHash imageHash(QCryptographicHash::Sha256);
+    QByteArray buf, packed;
+    QByteArray packUrl = QUrl(QString::fromLatin1(_indexUrl)).resolved(QUrl(_index.packUrl)).toEncoded();
+    quint64 reused = 0, downloaded = 0;
+    int lastPercent = -1;
+    const int count = _index.chunks.size();
+
+    for (int i = 0; i < count && !_cancelled; )
+    {
+        const ChunkIndex::Chunk &first = _index.chunks[i];
+        auto it = cached.constFind(first.sha256);
+
+        if (it != cached.constEnd() && _readSource(it.value(), buf) && ChunkedHash::hash(buf.constData(), buf.size()) == first.sha256)
+        {
+            if (out.write(buf) != buf.size())
+                return "Error writing " + _outputFile;
+            imageHash.addData(buf.constData(), buf.size());
+            reused += first.size;
+            i++;
+        }
+        else
+        {
+            /* Missing chunks that follow each other in the pack are fetched with one request */
+            int end = i+1;
+            quint64 packEnd = first.packOffset + first.packSize;
+            while (end < count && !cached.contains(_index.chunks[end].sha256) && _index.chunks[end].packOffset == packEnd
+                   && packEnd + _index.chunks[end].packSize - first.packOffset <= IMAGEWRITER_DELTA_MAX_RANGE)
+            {
+                packEnd += _index.chunks[end].packSize;
+                end++;
+            }
+
+            quint64 len = packEnd - first.packOffset;
+            if (!_get(packUrl, packed, first.packOffset, len, len) || (quint64) packed.size() != len)
+                return _cancelled ? "Cancelled" : "Error downloading chunks";
+
+            for (int j = i; j < end; j++)
+            {
+                const ChunkIndex::Chunk &chunk = _index.chunks[j];
+                buf.resize(chunk.size);
+                size_t res = ZSTD_decompress(buf.data(), chunk.size, packed.constData() + (chunk.packOffset - first.packOffset), chunk.packSize);
+                if (ZSTD_isError(res) || res != chunk.size || ChunkedHash::hash(buf.constData(), buf.size()) != chunk.sha256)
+                    return "Corrupt chunk in chunk pack";
+                if (out.write(buf) != buf.size())
+                    return "Error writing " + _outputFile;
+                imageHash.addData(buf.constData(), buf.size());
+            }
+            downloaded += len;
+            i = end;
+        }
+
+        int percent = out.pos() * 100 / _index.imageSize;
+        if (percent != lastPercent)
+        {
+            lastPercent = percent;
+            emit preparationStatusUpdate(tr("assembling image from cached chunks: %1%, %2 MB downloaded").arg(percent).arg(downloaded/1024/1024));
+        }
+    }
+
+    if (_cancelled)
+        return "Cancelled";
+    out.close();
+    if (imageHash.result().toHex() != _expectedHash)
+        return "Assembled image does not have the expected hash";
+
+    qDebug() << "Image assembled from chunks." << reused/1024/1024 << "MB from the cache," << downloaded/1024/1024 << "MB downloaded";
+
+    /* Hashed as a whole already, writing from it does not need to hash it again */
+    CacheSidecar sidecar;
+    sidecar.extractHash = _expectedHash;
+    sidecar.save(_outputFile);
+    _index.save(_outputFile);
+
+    return QString();
+}
+
+bool DeltaDownloadThread::_readSource(const Source &source, QByteArray &buf)
+{
+    QFile *f = _sourceFiles.value(source.file);
+    if (!f)
+    {
+        f = new QFile(source.file);
+        _sourceFiles.insert(source.file, f);
+        if (!f->open(QIODevice::ReadOnly))
+            qDebug() << "Error opening" << source.file;
+    }
+
+    buf.resize(source.size);
+    return f->isOpen() && f->seek(source.offset) && f->read(buf.data(), source.size) == (qint64) source.size;
+}
+
+bool DeltaDownloadThread::_get(const QByteArray &url, QByteArray &out, quint64 offset, quint64 len, quint64 maxSize)
+{
+    char errorBuf[CURL_ERROR_SIZE] = {0};
+    Transfer transfer{&out, maxSize, &_bandwidth};
+    QByteArray range;
+    QByteArray proxy = DownloadThread::proxy();
+
+    out.clear();
+    curl_easy_reset(_c);
+    curl_easy_setopt(_c, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(_c, CURLOPT_WRITEFUNCTION, &DeltaDownloadThread::_curl_write_callback);
+    curl_easy_setopt(_c, CURLOPT_WRITEDATA, &transfer);
+    curl_easy_setopt(_c, CURLOPT_XFERINFOFUNCTION, &DeltaDownloadThread::_curl_xferinfo_callback);
+    curl_easy_setopt(_c, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(_c, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt(_c, CURLOPT_URL, url.constData());
+    curl_easy_setopt(_c, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(_c, CURLOPT_MAXREDIRS, 10);
+    curl_easy_setopt(_c, CURLOPT_ERRORBUFFER, errorBuf);
+    curl_easy_setopt(_c, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(_c, CURLOPT_CONNECTTIMEOUT, 30);
+    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_TIME, 60);
+    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_LIMIT, 100);
+    _transport.apply(_c);
+    CurlShare::apply(_c);
+    if (!_useragent.isEmpty())
+        curl_easy_setopt(_c, CURLOPT_USERAGENT, _useragent.constData());
+    if (!proxy.isEmpty())
+        curl_easy_setopt(_c, CURLOPT_PROXY, proxy.constData());
+    if (len)
+    {
+        range = QByteArray::number(offset) + "-" + QByteArray::number(offset+len-1);
+        curl_easy_setopt(_c, CURLOPT_RANGE, range.constData());
+    }
+
+    CURLcode ret = curl_easy_perform(_c);
+    if (ret != CURLE_OK)
+    {
+        if (!_cancelled)
+            qDebug() << "Error downloading" << url << ":" << (errorBuf[0] ? errorBuf : curl_easy_strerror(ret));
+        return false;
+    }
+
+    long code = 0;
+    curl_easy_getinfo(_c, CURLINFO_RESPONSE_CODE, &code);
+    if (len && code != 206)
+    {
+        qDebug() << "Server did not honor range request for" << url << "status code:" << code;
+        return false;
+    }
+
+    return true;
+}
+
+size_t DeltaDownloadThread::_curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    Transfer *transfer = (Transfer *) userdata;
+    size_t len = size * nmemb;
+
+    /* A server that ignores the range would send everything */
+    if (transfer->out->size() + len > transfer->maxSize)
+        return 0;
+    transfer->bandwidth->acquire(len);
+    transfer->out->append(ptr, len);
+
+    return len;
+}
+
+int DeltaDownloadThread::_curl_xferinfo_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    return ((DeltaDownloadThread *) userdata)->_cancelled ? 1 : 0;
+}
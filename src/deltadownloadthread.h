@@ -0,0 +1,81 @@
+#ifndef DELTADOWNLOADTHREAD_H
+#define DELTADOWNLOADTHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "bandwidthscheduler.h"
+#include "chunkindex.h"
+#include "downloadtransport.h"
+#include <QThread>
+#include <QHash>
+#include <QStringList>
+#include <atomic>
+#include <curl/curl.h>
+
+class QFile;
+
+/*
+ * Builds the extracted image in the cache from its chunk index: chunks
+ * that extracted cache entries of other versions have already are copied
+ * from there, and only the missing ones are downloaded from the chunk pack
+ * with range requests
+ *
+ * Every chunk is checked against its hash, and the assembled image against
+ * the expected one. On success the result is a complete extracted cache
+ * entry with sidecar and chunk index, that the image is then written from.
+ */
+class DeltaDownloadThread : public QThread
+{
+    Q_OBJECT
+public:
+    /* sources are extracted cache files that have a chunk index stored next to them */
+    DeltaDownloadThread(const QByteArray &indexUrl, const QString &outputFile, const QByteArray &expectedHash,
+                        const QStringList &sources, QObject *parent = nullptr);
+    virtual ~DeltaDownloadThread();
+
+    void setUserAgent(const QByteArray &ua);
+    void cancel();
+    bool isCancelled() const;
+
+    /* Index of the image, if it could be downloaded. Worth keeping with the
+       image even if it was downloaded in full */
+    ChunkIndex index() const;
+
+signals:
+    void success();
+    void failed(QString msg);
+    void preparationStatusUpdate(QString msg);
+
+protected:
+    struct Source
+    {
+        QString file;
+        quint64 offset, size;
+    };
+
+    QByteArray _indexUrl, _expectedHash, _useragent;
+    QString _outputFile;
+    QStringList _sources;
+    ChunkIndex _index;
+    std::atomic<bool> _cancelled;
+    BandwidthScheduler::Job _bandwidth;
+    CURL *_c;
+    /* Copy of the global transport options. libcurl keeps a pointer to it */
+    DownloadTransport _transport;
+    QHash<QString, QFile *> _sourceFiles;
+
+    virtual void run();
+    /* Returns an error message, empty on success */
+    QString _assemble();
+    bool _readSource(const Source &source, QByteArray &buf);
+    /* GET url, or len bytes of it from offset on if len is not 0. Fails if there is more than maxSize */
+    bool _get(const QByteArray &url, QByteArray &out, quint64 offset, quint64 len, quint64 maxSize);
+
+    static size_t _curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    static int _curl_xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+};
+
+#endif // DELTADOWNLOADTHREAD_H
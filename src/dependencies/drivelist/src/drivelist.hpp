@@ -55,6 +55,10 @@ struct DeviceDescriptor {
   bool isUSB;  // Connected via Universal Serial Bus (USB)
   bool isUAS;  // Connected via the USB Attached SCSI (UAS)
   bool isUASNull;
+  std::string usbController;  // Host controller the device is on, if on USB
+  std::string usbHub;  // Hub it is plugged into, the root hub if none
+  std::string usbPort;  // Bus and port path, e.g. 2-1.3
+  uint32_t usbSpeed = 0;  // Negotiated link speed in Mbit/s, 0 if not known
 };
 
 std::vector<DeviceDescriptor> ListStorageDevices();
@@ -18,35 +18,20 @@
 #include <sys/mount.h>
 #include <mntent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <chrono>
+#include <thread>
 #include "../mountutils.hpp"
 
-MOUNTUTILS_RESULT unmount_disk(const char *device_path) {
-  const char *mount_path = NULL;
-  std::vector<std::string> mount_dirs = {};
-
-  // Stat the device to make sure it exists
-  struct stat stats;
-
-  if (stat(device_path, &stats) != 0) {
-    MountUtilsLog("Stat failed");
-
-    // TODO(jhermsmeier): See TODO below
-    // v8::Local<v8::Value> argv[1] = {
-    //   Nan::ErrnoException(errno, "stat", NULL, device_path)
-    // };
-    // Nan::MakeCallback(Nan::GetCurrentContext()->Global(), callback, 1, argv);
-    return MOUNTUTILS_ERROR_GENERAL;
-  } else if (S_ISDIR(stats.st_mode)) {
-    MountUtilsLog("Device is a directory");
-
-    // TODO(jhermsmeier): See TODO below
-    // v8::Local<v8::Value> argv[1] = {
-    //   Nan::Error("Invalid device, path is a directory")
-    // };
-    // Nan::MakeCallback(Nan::GetCurrentContext()->Global(), callback, 1, argv);
-    return MOUNTUTILS_ERROR_INVALID_DRIVE;
-  }
+// How long to wait for mounts that are still there after unmounting them,
+// e.g. because a desktop automounter mounted them again
+#define MOUNTUTILS_CONFIRM_TIMEOUT_MS 3000
 
+// Reads the mount points of the partitions of the device from /proc/mounts
+static bool get_mount_dirs(const char *device_path,
+                           std::vector<std::string> &mount_dirs) {
   // Get mountpaths from the device path, as `umount(device)`
   // has been removed in Linux 2.3+
   struct mntent *mnt_p, data;
@@ -59,21 +44,12 @@ MOUNTUTILS_RESULT unmount_disk(const char *device_path) {
 
   if (proc_mounts == NULL) {
     MountUtilsLog("Couldn't read /proc/mounts");
-    // TODO(jhermsmeier): Refactor MOUNTUTILS_RESULT into a struct
-    // with error_msg, errno, error_code etc. and set the respective
-    // values on the struct and move creation of proper errors with
-    // the right errno messages etc. into the AsyncWorkers (even better:
-    // create a function which creates the proper error from a
-    // MOUNTUTILS_RESULT struct).
-    // v8::Local<v8::Value> argv[1] = {
-    //   Nan::ErrnoException(errno, "setmntent", NULL, "/proc/mounts")
-    // };
-    // Nan::MakeCallback(Nan::GetCurrentContext()->Global(), callback, 1, argv);
-    return MOUNTUTILS_ERROR_GENERAL;
+    return false;
   }
 
+  mount_dirs.clear();
   while ((mnt_p = getmntent_r(proc_mounts, &data, mnt_buf, sizeof(mnt_buf)))) {
-    mount_path = mnt_p->mnt_fsname;
+    const char *mount_path = mnt_p->mnt_fsname;
     if (strncmp(mount_path, device_path, strlen(device_path)) == 0) {
       MountUtilsLog("Mount point " + std::string(mount_path) +
         " belongs to drive " + std::string(device_path));
@@ -83,62 +59,111 @@ MOUNTUTILS_RESULT unmount_disk(const char *device_path) {
 
   MountUtilsLog("Closing /proc/mounts");
   endmntent(proc_mounts);
+  return true;
+}
+
+// Use umount2() with the MNT_DETACH flag, which performs a lazy unmount;
+// making the mount point unavailable for new accesses,
+// and only actually unmounting when the mount point ceases to be busy
+static bool unmount_dir(const std::string &mount_dir) {
+  const char *mount_path = mount_dir.c_str();
+  MountUtilsLog("Unmounting " + mount_dir + "...");
+
+  if (umount2(mount_path, MNT_EXPIRE) == 0 ||
+      umount2(mount_path, MNT_EXPIRE) == 0) {
+    MountUtilsLog("Unmount " + mount_dir + ": success");
+    return true;
+  }
+  MountUtilsLog("Unmount MNT_EXPIRE " + mount_dir + " failed: " +
+    std::string(strerror(errno)));
+
+  if (umount2(mount_path, MNT_DETACH) == 0) {
+    MountUtilsLog("Unmount " + mount_dir + ": success");
+    return true;
+  }
+  MountUtilsLog("Unmount MNT_DETACH " + mount_dir + " failed: " +
+    std::string(strerror(errno)));
+
+  if (umount2(mount_path, MNT_FORCE) == 0) {
+    MountUtilsLog("Unmount " + mount_dir + ": success");
+    return true;
+  }
+  MountUtilsLog("Unmount MNT_FORCE " + mount_dir + " failed: " +
+    std::string(strerror(errno)));
+
+  return false;
+}
 
-  // Use umount2() with the MNT_DETACH flag, which performs a lazy unmount;
-  // making the mount point unavailable for new accesses,
-  // and only actually unmounting when the mount point ceases to be busy
-  // TODO(jhermsmeier): See TODO above
-  // v8::Local<v8::Value> argv[1] = {
-  //   Nan::ErrnoException(errno, "umount2", NULL, mnt_p->mnt_dir)
-  // };
-  // v8::Local<v8::Object> ctx = Nan::GetCurrentContext()->Global();
-  // Nan::MakeCallback(ctx, callback, 1, argv);
-
-  size_t unmounts = 0;
+MOUNTUTILS_RESULT unmount_disk(const char *device_path) {
+  std::vector<std::string> mount_dirs = {};
+
+  // Stat the device to make sure it exists
+  struct stat stats;
+
+  if (stat(device_path, &stats) != 0) {
+    MountUtilsLog("Stat failed");
+    return MOUNTUTILS_ERROR_GENERAL;
+  } else if (S_ISDIR(stats.st_mode)) {
+    MountUtilsLog("Device is a directory");
+    return MOUNTUTILS_ERROR_INVALID_DRIVE;
+  }
+
+  // The kernel flags /proc/self/mounts with POLLPRI whenever the mount
+  // table changes, so there is no need to poll it on a timer
+  int mounts_fd = open("/proc/self/mounts", O_RDONLY | O_CLOEXEC);
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds(MOUNTUTILS_CONFIRM_TIMEOUT_MS);
+  bool unmounted_once = false;
   MOUNTUTILS_RESULT result_code = MOUNTUTILS_SUCCESS;
 
-  for (const std::string& mount_dir : mount_dirs) {
-    MountUtilsLog("Unmounting " + mount_dir + "...");
-
-    mount_path = mount_dir.c_str();
-
-    if (umount2(mount_path, MNT_EXPIRE) != 0) {
-      MountUtilsLog("Unmount MNT_EXPIRE " + mount_dir + ": EAGAIN");
-      if (umount2(mount_path, MNT_EXPIRE) != 0) {
-        MountUtilsLog("Unmount MNT_EXPIRE " + mount_dir + " failed: " +
-          std::string(strerror(errno)));
-      } else {
-        MountUtilsLog("Unmount " + mount_dir + ": success");
-        unmounts++;
-        continue;
-      }
-    } else {
-      MountUtilsLog("Unmount " + mount_dir + ": success");
-      unmounts++;
-      continue;
+  while (true) {
+    if (!get_mount_dirs(device_path, mount_dirs)) {
+      result_code = MOUNTUTILS_ERROR_GENERAL;
+      break;
+    }
+    if (mount_dirs.empty()) {
+      result_code = MOUNTUTILS_SUCCESS;
+      break;
     }
 
-    if (umount2(mount_path, MNT_DETACH) != 0) {
-      MountUtilsLog("Unmount MNT_DETACH " + mount_dir + " failed: " +
-        std::string(strerror(errno)));
-    } else {
-      MountUtilsLog("Unmount " + mount_dir + ": success");
-      unmounts++;
-      continue;
+    int remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+      deadline - std::chrono::steady_clock::now()).count();
+    if (unmounted_once && (mounts_fd == -1 || remaining <= 0)) {
+      MountUtilsLog("Device still has " + std::to_string(mount_dirs.size()) +
+        " mounts");
+      result_code = MOUNTUTILS_ERROR_GENERAL;
+      break;
+    }
+
+    // Partitions are unmounted at the same time. Each umount2() syncs its
+    // own file system, which can take a while after a write
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < mount_dirs.size(); i++) {
+      threads.emplace_back(unmount_dir, mount_dirs[i]);
+    }
+    unmount_dir(mount_dirs[0]);
+    for (std::thread &t : threads) {
+      t.join();
     }
 
-    if (umount2(mount_path, MNT_FORCE) != 0) {
-      MountUtilsLog("Unmount MNT_FORCE " + mount_dir + " failed: " +
-        std::string(strerror(errno)));
-    } else {
-      MountUtilsLog("Unmount " + mount_dir + ": success");
-      unmounts++;
+    if (!unmounted_once) {
+      unmounted_once = true;
       continue;
     }
+
+    // Still mounted after a second round: wait for the mount table to
+    // change, e.g. a lazy unmount finishing or an automounter stepping in
+    struct pollfd pfd = { mounts_fd, POLLPRI, 0 };
+    if (poll(&pfd, 1, remaining) == 0) {
+      deadline = std::chrono::steady_clock::now();
+    }
+  }
+
+  if (mounts_fd != -1) {
+    close(mounts_fd);
   }
 
-  return unmounts == mount_dirs.size() ?
-    MOUNTUTILS_SUCCESS : MOUNTUTILS_ERROR_GENERAL;
+  return result_code;
 }
 
 // FIXME: This is just a stub copy of `UnmountDisk()`,
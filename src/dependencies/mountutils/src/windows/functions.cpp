@@ -26,6 +26,8 @@
 #include <stdio.h>
 #include <cfgmgr32.h>
 #include <setupapi.h>
+#include <thread>
+#include <vector>
 #include "../mountutils.hpp"
 
 HANDLE CreateVolumeHandleFromDevicePath(LPCTSTR devicePath, DWORD flags) {
@@ -437,9 +439,48 @@ BOOL IsDriveEjectable(TCHAR driveLetter) {
   }
 }
 
+MOUNTUTILS_RESULT EjectDriveLetterWithRetries(TCHAR driveLetter) {
+  MOUNTUTILS_RESULT result = MOUNTUTILS_SUCCESS;
+  DWORD driveBit = 1 << (driveLetter - 'A');
+
+  // Retry ejecting 3 times, since I've seen that in some systems
+  // the filesystem is ejected, but the drive letter remains assigned,
+  // which gets fixed if you retry again.
+  for (size_t times = 0; times < 3; times++) {
+    if (times != 0) {
+      MountUtilsLog("Retrying");
+      Sleep(500);
+    }
+    MountUtilsLog("Ejecting drive letter");
+    result = EjectDriveLetter(driveLetter);
+
+    // Abort the loop if we couldn't open a handle on the drive letter
+    // after previous attempts worked, since this means the drive was
+    // completely ejected, and that we don't have to keep retrying.
+    if (times > 0 && result == MOUNTUTILS_ERROR_INVALID_DRIVE) {
+      MountUtilsLog("Drive letter has already been ejected");
+      return MOUNTUTILS_SUCCESS;
+    }
+
+    if (result != MOUNTUTILS_SUCCESS) {
+      MountUtilsLog("Couldn't eject drive letter");
+      return result;
+    }
+
+    // Only retry if the letter is in fact still assigned
+    if (!(GetLogicalDrives() & driveBit)) {
+      MountUtilsLog("Drive letter is gone");
+      return MOUNTUTILS_SUCCESS;
+    }
+  }
+
+  return result;
+}
+
 MOUNTUTILS_RESULT Eject(ULONG deviceNumber) {
   DWORD logicalDrivesMask = GetLogicalDrives();
   TCHAR currentDriveLetter = 'A';
+  std::vector<TCHAR> driveLetters;
 
   if (logicalDrivesMask == 0) {
     MountUtilsLog("Couldn't get logical drives");
@@ -470,32 +511,7 @@ MOUNTUTILS_RESULT Eject(ULONG deviceNumber) {
 
       if (currentDeviceNumber == deviceNumber) {
         MountUtilsLog("Drive letter device matches");
-        MOUNTUTILS_RESULT result;
-
-        // Retry ejecting 3 times, since I've seen that in some systems
-        // the filesystem is ejected, but the drive letter remains assigned,
-        // which gets fixed if you retry again.
-        for (size_t times = 0; times < 3; times++) {
-          if (times != 0) {
-            MountUtilsLog("Retrying");
-            Sleep(500);
-          }
-          MountUtilsLog("Ejecting drive letter");
-          result = EjectDriveLetter(currentDriveLetter);
-
-          // Abort the loop if we couldn't open a handle on the drive letter
-          // after previous attempts worked, since this means the drive was
-          // completely ejected, and that we don't have to keep retrying.
-          if (times > 0 && result == MOUNTUTILS_ERROR_INVALID_DRIVE) {
-            MountUtilsLog("Drive letter has already been ejected");
-            break;
-          }
-
-          if (result != MOUNTUTILS_SUCCESS) {
-            MountUtilsLog("Couldn't eject drive letter");
-            return result;
-          }
-        }
+        driveLetters.push_back(currentDriveLetter);
       }
 
       MountUtilsLog("Continuing with the next available letter");
@@ -505,6 +521,25 @@ MOUNTUTILS_RESULT Eject(ULONG deviceNumber) {
     logicalDrivesMask >>= 1;
   }
 
+  // The volumes of the device are locked, dismounted and ejected at the
+  // same time, as each of them can wait for a while to get its lock
+  std::vector<MOUNTUTILS_RESULT> results(driveLetters.size(), MOUNTUTILS_SUCCESS);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < driveLetters.size(); i++) {
+    threads.emplace_back([&results, &driveLetters, i]() {
+      results[i] = EjectDriveLetterWithRetries(driveLetters[i]);
+    });
+  }
+  for (std::thread &t : threads) {
+    t.join();
+  }
+
+  for (MOUNTUTILS_RESULT result : results) {
+    if (result != MOUNTUTILS_SUCCESS) {
+      return result;
+    }
+  }
+
   return MOUNTUTILS_SUCCESS;
 }
 
@@ -10,21 +10,56 @@
 #include <QIODevice>
 #include <QFile>
 #include <QByteArray>
+#include <QDeadlineTimer>
+#include <QFileInfo>
+#include <QDebug>
+#include <string.h>
 
 #define XMODEM_ACK  ((char)0x06)
 #define XMODEM_NACK ((char)0x15)
 #define XMODEM_CRC  'C'
+#define XMODEM_G    'G'
 #define XMODEM_SOH  ((char)0x01)
+#define XMODEM_STX  ((char)0x02)
 #define XMODEM_EOT  ((char)0x04)
-
-static char xmodem_sum(const QByteArray &ba){
+#define XMODEM_CAN  ((char)0x18)
+#define XMODEM_CPMEOF ((char)0x1A)
+
+//Header, 1 KB payload and CRC
+#define XMODEM_MAX_PACKET_SIZE (3 + 1024 + 2)
+#define XMODEM_MAX_RETRIES 10
+
+//Baud rate switch, an extension of the receivers on our boards. The sender
+//asks with XMODEM_BAUD, the rate (4 bytes, little endian) and a CRC. The
+//receiver ACKs at the old rate and switches, or NACKs. At the new rate the
+//sender sends XMODEM_BAUD_TEST, a test pattern and its CRC, which the
+//receiver ACKs if it arrived intact. The sender confirms with an ACK. Without
+//the confirmation within XMODEM_BAUD_TIMEOUT ms, both go back to the old
+//rate. Either way the receiver then starts over with its 'C'
+#define XMODEM_BAUD      'B'
+#define XMODEM_BAUD_TEST 'T'
+#define XMODEM_BAUD_TIMEOUT 1000
+#define XMODEM_BAUD_TEST_SIZE 1024
+
+//Rates tried, highest first. The USB-UART bridges of our boards do all of them
+static const uint32_t xmodem_baudrates[] = {4000000, 3000000, 2000000, 1500000, 1000000};
+
+static char xmodem_sum(const char *data, int len){
     char rv = 0;
-    for(char b : ba){
-        rv = rv + b;
+    for(int i = 0; i < len; i++){
+        rv = rv + data[i];
     }
     return rv;
 }
 
+static void xmodem_append_crc(QByteArray &data, int from){
+    uint16_t crc = crc_init();
+    crc = crc_update(crc, data.constData() + from, data.size() - from);
+    crc = crc_finalize(crc);
+    data.append((char)((crc >> 8) & 0xFF));
+    data.append((char)(crc & 0xFF));
+}
+
 Transfer::Transfer(
         QString serialPortName,
         qint32 baudrate,
@@ -36,6 +71,8 @@ Transfer::Transfer(
     this->filePath = filePath;
     this->serialPort = nullptr;
     this->usePkcsPadding = false;
+    this->protocol = Protocol::Xmodem;
+    this->packet = QByteArray(XMODEM_MAX_PACKET_SIZE, '\0');
 }
 
 bool Transfer::setSerialPortAndConfigure(QString serialPortName, uint32_t baudrate)
@@ -73,6 +110,14 @@ void Transfer::setPkcsPadding(bool enabled){
     this->usePkcsPadding = enabled;
 }
 
+void Transfer::setProtocol(Protocol protocol){
+    this->protocol = protocol;
+}
+
+void Transfer::setMaxBaudrate(uint32_t baudrate){
+    this->_maxBaudrate = baudrate;
+}
+
 void Transfer::setBaudrate(uint32_t baudrate){
     this->serialPort->setBaudRate(baudrate);
 }
@@ -90,9 +135,24 @@ void Transfer::launch(){
 }
 
 void Transfer::cancel(){
+    this->cancelRequested = true;
     emit transferFailed(tr("Transfer cancelled"));
 }
 
+//waitForReadyRead() in slices, so cancel() is noticed
+bool Transfer::waitForData(int msecs){
+    QDeadlineTimer deadline(msecs);
+    while(!this->cancelRequested){
+        if(this->serialPort->bytesAvailable() || this->serialPort->waitForReadyRead(qMin<qint64>(100, deadline.remainingTime()))){
+            return true;
+        }
+        if(deadline.hasExpired()){
+            break;
+        }
+    }
+    return false;
+}
+
 
 //The bulk of the work goes here
 void Transfer::run(){
@@ -177,55 +237,67 @@ void Transfer::run(){
     }
 
     //Initialize transfer status
+    const bool ymodem = (this->protocol == Protocol::YmodemG);
+    const qint64 file_size = in_file->size();
+    qint64 file_offset = 0;
     quint32 current_packet = 1;
     bool use_crc = true;
+    bool streaming = false;
 
     //Transfer loop
     bool transferComplete = false;
-    bool sendPkcsPacket = ((in_file->size() % 128) == 0) && this->usePkcsPadding;
-    bool pkcsPacketSent = false;
+    bool sendPkcsPacket = ((file_size % 128) == 0) && this->usePkcsPadding && !ymodem;
     do{
         //Wait for the first character from recipient
-        char status_char = '\0';
-        if(this->serialPort->waitForReadyRead(this->timeoutFirstRead)){
-            this->serialPort->read(&status_char, 1);
-            //Received a byte
-            if(status_char == XMODEM_CRC){
-                use_crc = true;
-                status_char = XMODEM_NACK;
-            }
-            else if(status_char == XMODEM_NACK){
-                use_crc = false;
-            }
-            else{
-                emit transferFailed(tr("Incorrect start of XMODEM transmission (0x") + QString::number(status_char,16) + ")");
-                this->cancelRequested = true;
-                continue; //<-- Will cleanup and return
+        if(!this->waitForStart(use_crc, streaming)){
+            continue; //<-- Will cleanup and return
+        }
+
+        //A receiver that can go faster starts over once the rate is agreed on
+        if(this->_maxBaudrate > this->_baudrate && use_crc){
+            this->negotiateBaudrate();
+            if(!this->waitForStart(use_crc, streaming)){
+                continue;
             }
         }
-        else{
-            //Timeout
-            emit transferFailed(tr("Timeout"));
-            this->cancelRequested = true;
-            continue; //<-- Will cleanup and return
+
+        //YMODEM batch: block 0 carries the file name and size, then
+        //the receiver asks for the data with another 'C' or 'G'
+        if(ymodem){
+            QByteArray header = QFileInfo(this->filePath).fileName().toUtf8();
+            header.append('\0');
+            header.append(QByteArray::number(file_size));
+            memset(this->packet.data() + 3, 0, 128);
+            memcpy(this->packet.data() + 3, header.constData(), qMin(header.size(), 128));
+            if(!this->sendPacket(this->buildPacket(XMODEM_SOH, 0, 128, use_crc), streaming)
+                || !this->waitForStart(use_crc, streaming)){
+                continue;
+            }
         }
 
         //The proper, real, main XMODEM loop
         while(!cancelRequested && !transferComplete){
-            QByteArray packet;
+            int packet_len;
+            qint64 next_offset = file_offset;
+            bool eot = false;
+            bool pkcs_packet = false;
 
-            if(!in_file->atEnd())
+            if(file_offset < file_size)
             {
-                //Packet header
-                packet.append(XMODEM_SOH);
-                packet.append(current_packet & 0xFF);
-                packet.append(255U - (current_packet & 0xFF));
-
-                //Payload
-                QByteArray payload = in_file->read(128);
-                if (payload.length() < 128){
-                    int padding = 128 - payload.length();
-                    char pad_byte = padding & 0xFF;
+                //1 KB packets while there is that much left, the tail in
+                //128 byte packets so padding stays below one of them
+                qint64 remaining = file_size - file_offset;
+                int payload_size = (this->protocol != Protocol::Xmodem && use_crc && remaining >= 1024) ? 1024 : 128;
+                int len = (int) qMin((qint64) payload_size, remaining);
+                char *payload = this->packet.data() + 3;
+
+                if(in_file->read(payload, len) != len){
+                    emit transferFailed(tr("Error reading file: ") + this->filePath);
+                    cancelRequested = true;
+                    continue;
+                }
+                if (len < payload_size){
+                    int padding = payload_size - len;
 
                     //Padding of half-full packets will be performed using the PKCS#7
                     //method of filling the pachet with the value fo the gap size.
@@ -233,95 +305,70 @@ void Transfer::run(){
                     //PKCS#7 flag is enabled (this->usePkcsPadding) an aditional 128 byte packet
                     //of the number 128 repeated all over it *must* be sent as to guarantee
                     //padding is always present.
-                    while(padding){
-                        payload.append((char)pad_byte);
-                        padding--;
-                    }
-                }
-                packet.append(payload);
-
-                //Checksum
-                if(use_crc){
-                    uint16_t packet_crc = crc_init();
-                    packet_crc = crc_update(packet_crc, payload.data(), payload.size());
-                    packet_crc = crc_finalize(packet_crc);
-
-                    //Add CRC, big endian.
-                    packet.append((packet_crc >> 8) & 0xFF);
-                    packet.append(packet_crc & 0xFF);
-                }
-                else{
-                    packet.append(xmodem_sum(packet));
+                    //YMODEM tells the size, its receivers expect CPMEOF.
+                    memset(payload + len, ymodem ? XMODEM_CPMEOF : (char)(padding & 0xFF), padding);
                 }
+                packet_len = this->buildPacket(payload_size == 1024 ? XMODEM_STX : XMODEM_SOH, current_packet, payload_size, use_crc);
+                next_offset = file_offset + len;
             }
             else if (sendPkcsPacket){
-                //Packet header
-                packet.append(XMODEM_SOH);
-                packet.append(current_packet & 0xFF);
-                packet.append(255U - (current_packet & 0xFF));
-                //Payload
-                const uint8_t pad_byte = 128U;
-                uint16_t cksum = 0; //Same for CRC and checksum
-                for(int i = 0; i<128; i++){
-                    packet.append(pad_byte);
-                    if(use_crc){
-                        cksum = crc_update(cksum, &pad_byte, 1);
-                    }
-                    else{
-                        cksum += pad_byte;
-                    }
-                }
-                //Checksum
-                if(use_crc){
-                    packet.append((cksum >> 8) & 0xFF);
-                    packet.append(cksum & 0xFF);
-                }
-                else{
-                    packet.append(cksum & 0xFF);
-                }
-
-                //Signal we sent the packet
-                pkcsPacketSent = true;
+                memset(this->packet.data() + 3, 128, 128);
+                packet_len = this->buildPacket(XMODEM_SOH, current_packet, 128, use_crc);
+                pkcs_packet = true;
             }
             else{
                 //Transfer complete!
-                packet.append(XMODEM_EOT);
-                packet.append(XMODEM_EOT);
-                packet.append(XMODEM_EOT);
-                transferComplete = true;
+                this->packet[0] = XMODEM_EOT;
+                this->packet[1] = XMODEM_EOT;
+                this->packet[2] = XMODEM_EOT;
+                //YMODEM receivers ack the first EOT, further ones would start a new file
+                packet_len = ymodem ? 1 : 3;
+                eot = true;
             }
-            this->serialPort->write(packet);
-            this->serialPort->waitForBytesWritten();
 
-            //Read receiver response
-            if(this->serialPort->waitForReadyRead(timeoutRead)){
-                this->serialPort->read(&status_char, 1);
-                if(status_char == XMODEM_ACK){
-                    current_packet++;
-
-                    //If we just sent the PKCS packet, set the sendPkcsPacket
-                    //flag to false so next "packet" is the end of transfer.
-                    if(pkcsPacketSent){
-                        sendPkcsPacket = false;
-                    }
-                }
-                else{
-                    //Seek only needed within file packets. PKCS padding needs
-                    //no call to seek()
-                    if(!pkcsPacketSent){
-                        in_file->seek((current_packet - 1) * 128);
-                    }
+            if(eot && !ymodem){
+                //Any answer ends an XMODEM transfer
+                char status_char = '\0';
+                this->serialPort->write(this->packet.constData(), packet_len);
+                this->serialPort->waitForBytesWritten();
+                if(!this->waitForData(timeoutRead)){
+                    emit transferFailed(tr("Status timeout"));
+                    cancelRequested = true;
+                    continue;
                 }
+                this->serialPort->read(&status_char, 1);
             }
-            else
-            {
-                emit transferFailed(tr("Status timeout"));
-                cancelRequested = true;
+            //Resend the same packet until acknowledged
+            else if(!this->sendPacket(packet_len, streaming && !eot)){
+                continue;
+            }
+
+            if(eot){
+                transferComplete = true;
+            }
+            else{
+                current_packet++;
+                //If we just sent the PKCS packet, set the sendPkcsPacket
+                //flag to false so next "packet" is the end of transfer.
+                if(pkcs_packet){
+                    sendPkcsPacket = false;
+                }
+                file_offset = next_offset;
             }
 
             //Update with transfer progress
-            emit updateProgress( ((current_packet - 1) * 128.0f) / ((float) in_file->size()) );
+            emit updateProgress(file_size ? (file_offset / (float) file_size) : 1.0f);
+        }
 
+        //End of the YMODEM batch: a block 0 without file name. The file is
+        //complete already, so receivers that do not ask for it are fine
+        char status_char = '\0';
+        if(ymodem && transferComplete && !cancelRequested
+            && this->waitForData(timeoutRead) && this->serialPort->read(&status_char, 1) == 1
+            && (status_char == XMODEM_CRC || status_char == XMODEM_G)){
+            memset(this->packet.data() + 3, 0, 128);
+            this->serialPort->write(this->packet.constData(), this->buildPacket(XMODEM_SOH, 0, 128, true));
+            this->serialPort->waitForBytesWritten();
         }
     }while(0); //Shameless goto bait
 
@@ -336,6 +383,180 @@ void Transfer::run(){
     }
 }
 
+//Reads the character the receiver starts with: 'C' for CRC, NACK for
+//checksums, 'G' for YMODEM-G streaming
+bool Transfer::waitForStart(bool &useCrc, bool &streaming){
+    char status_char = '\0';
+
+    if(!this->waitForData(this->timeoutFirstRead)){
+        if(!this->cancelRequested){
+            emit transferFailed(tr("Timeout"));
+        }
+        this->cancelRequested = true;
+        return false;
+    }
+
+    this->serialPort->read(&status_char, 1);
+    streaming = false;
+    if(status_char == XMODEM_CRC){
+        useCrc = true;
+    }
+    else if(status_char == XMODEM_G && this->protocol == Protocol::YmodemG){
+        useCrc = true;
+        streaming = true;
+    }
+    else if(status_char == XMODEM_NACK && this->protocol != Protocol::YmodemG){
+        useCrc = false;
+    }
+    else{
+        emit transferFailed(tr("Incorrect start of XMODEM transmission (0x") + QString::number(status_char,16) + ")");
+        this->cancelRequested = true;
+        return false;
+    }
+
+    return true;
+}
+
+//Completes the packet around the payload already in place. Returns its length
+int Transfer::buildPacket(char header, quint32 number, int payloadSize, bool useCrc){
+    char *p = this->packet.data();
+
+    p[0] = header;
+    p[1] = number & 0xFF;
+    p[2] = 255U - (number & 0xFF);
+
+    if(useCrc){
+        uint16_t packet_crc = crc_init();
+        packet_crc = crc_update(packet_crc, p + 3, payloadSize);
+        packet_crc = crc_finalize(packet_crc);
+
+        //Add CRC, big endian.
+        p[3 + payloadSize] = (packet_crc >> 8) & 0xFF;
+        p[4 + payloadSize] = packet_crc & 0xFF;
+        return payloadSize + 5;
+    }
+
+    p[3 + payloadSize] = xmodem_sum(p + 3, payloadSize);
+    return payloadSize + 4;
+}
+
+//Sends the first len bytes of the packet until the receiver acknowledges
+//them. When streaming there is no acknowledgement, the receiver can only cancel
+bool Transfer::sendPacket(int len, bool streaming){
+    for(int retry = 0; retry < XMODEM_MAX_RETRIES && !this->cancelRequested; retry++){
+        if(this->serialPort->write(this->packet.constData(), len) != len || !this->serialPort->waitForBytesWritten()){
+            emit transferFailed(tr("Error writing to serial port: ") + this->serialPort->errorString());
+            this->cancelRequested = true;
+            return false;
+        }
+
+        if(streaming){
+            if(this->serialPort->bytesAvailable() && this->serialPort->readAll().contains(XMODEM_CAN)){
+                emit transferFailed(tr("Transfer cancelled by receiver"));
+                this->cancelRequested = true;
+                return false;
+            }
+            return true;
+        }
+
+        char status_char = '\0';
+        if(!this->waitForData(timeoutRead)){
+            emit transferFailed(tr("Status timeout"));
+            this->cancelRequested = true;
+            return false;
+        }
+        this->serialPort->read(&status_char, 1);
+        if(status_char == XMODEM_ACK){
+            return true;
+        }
+        if(status_char == XMODEM_CAN){
+            emit transferFailed(tr("Transfer cancelled by receiver"));
+            this->cancelRequested = true;
+            return false;
+        }
+        //NACK or noise, the same packet goes again
+    }
+
+    if(!this->cancelRequested){
+        emit transferFailed(tr("Too many retries"));
+        this->cancelRequested = true;
+    }
+    return false;
+}
+
+//Reads the next answer of the receiver, skipping the 'C' it polls with
+bool Transfer::readReply(char &reply, int timeout){
+    QDeadlineTimer deadline(timeout);
+    while(!this->cancelRequested){
+        if(!this->waitForData(deadline.remainingTime())){
+            return false;
+        }
+        if(this->serialPort->getChar(&reply) && reply != XMODEM_CRC){
+            return true;
+        }
+    }
+    return false;
+}
+
+//Goes down the rates until the receiver confirms one. False if it stays at the current rate
+bool Transfer::negotiateBaudrate(){
+    for(uint32_t baudrate : xmodem_baudrates){
+        if(baudrate > this->_maxBaudrate || baudrate <= this->_baudrate){
+            continue;
+        }
+        if(this->switchBaudrate(baudrate)){
+            qDebug() << "XMODEM switched to" << baudrate << "baud";
+            return true;
+        }
+        if(this->cancelRequested){
+            break;
+        }
+    }
+
+    qDebug() << "XMODEM stays at" << this->_baudrate << "baud";
+    return false;
+}
+
+bool Transfer::switchBaudrate(uint32_t baudrate){
+    QByteArray request(1, XMODEM_BAUD);
+    for(int i = 0; i < 4; i++){
+        request.append((char)((baudrate >> (8 * i)) & 0xFF));
+    }
+    xmodem_append_crc(request, 1);
+
+    char reply = '\0';
+    this->serialPort->clear(QSerialPort::Input);
+    this->serialPort->write(request);
+    if(!this->serialPort->waitForBytesWritten() || !this->readReply(reply, XMODEM_BAUD_TIMEOUT) || reply != XMODEM_ACK){
+        return false;
+    }
+
+    //The receiver switches once its ACK is out. The pattern has all byte
+    //values and long runs of alternating bits, what goes wrong first
+    this->serialPort->setBaudRate(baudrate);
+    QThread::msleep(50);
+    QByteArray test(1, XMODEM_BAUD_TEST);
+    for(int i = 0; i < XMODEM_BAUD_TEST_SIZE; i++){
+        test.append((char)((i & 0x100) ? (i & 0xFF) : ((i & 1) ? 0xAA : 0x55)));
+    }
+    xmodem_append_crc(test, 1);
+    this->serialPort->clear(QSerialPort::Input);
+    this->serialPort->write(test);
+
+    if(this->serialPort->waitForBytesWritten() && this->readReply(reply, XMODEM_BAUD_TIMEOUT) && reply == XMODEM_ACK){
+        this->serialPort->putChar(XMODEM_ACK);
+        this->serialPort->waitForBytesWritten();
+        this->_baudrate = baudrate;
+        return true;
+    }
+
+    //CRC failure or no answer: the receiver goes back once it misses the confirmation
+    this->serialPort->setBaudRate(this->_baudrate);
+    QThread::msleep(XMODEM_BAUD_TIMEOUT);
+    this->serialPort->clear(QSerialPort::Input);
+    return false;
+}
+
 void Transfer::setFilePath(const QString &newFilePath)
 {
     filePath = newFilePath;
@@ -10,11 +10,18 @@
 #include <QObject>
 #include <QSerialPort>
 #include <QThread>
+#include <atomic>
 
 class Transfer : public QThread
 {
     Q_OBJECT
 public:
+    enum class Protocol {
+        Xmodem,     //128 byte packets
+        Xmodem1K,   //1 KB packets if the receiver asks for CRC
+        YmodemG,    //1 KB packets with a file header, streamed without acknowledgements if the receiver asks with 'G'
+    };
+
     explicit Transfer(
             QString serialPortName,
             qint32 baudrate,
@@ -28,9 +35,14 @@ public:
     void setBaudrate(uint32_t baudrate);
     void setPkcsPadding(bool enabled);
     void setDataBits(QSerialPort::DataBits bits);
+    void setProtocol(Protocol protocol);
+    //Highest baud rate to switch to once the receiver is ready, if it
+    //supports the switch. 0 to stay at the rate the port is opened with
+    void setMaxBaudrate(uint32_t baudrate);
 
     virtual ~Transfer();
     void launch();
+    //Stops the transfer within a tenth of a second. Safe to call from any thread
     void cancel();
 
     void setFilePath(const QString &newFilePath);
@@ -43,13 +55,25 @@ protected:
     static const quint32 timeoutRead      =  5000;
     static const quint32 timeoutFirstRead = 60000;
 
+    bool waitForStart(bool &useCrc, bool &streaming);
+    int buildPacket(char header, quint32 number, int payloadSize, bool useCrc);
+    bool sendPacket(int len, bool streaming);
+    bool readReply(char &reply, int timeout);
+    bool waitForData(int msecs);
+    bool negotiateBaudrate();
+    bool switchBaudrate(uint32_t baudrate);
+
 private:
     QSerialPort *serialPort{};
     QSerialPortInfo *serialPortInfo{};
     QString filePath{};
     bool usePkcsPadding{};
-    bool cancelRequested{};
+    Protocol protocol{};
+    //Preallocated for the largest packet, built in place
+    QByteArray packet{};
+    std::atomic<bool> cancelRequested{};
     uint32_t _baudrate{};
+    uint32_t _maxBaudrate{};
 
 signals:
     void updateProgress(float);
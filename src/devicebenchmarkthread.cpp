@@ -0,0 +1,271 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "devicebenchmarkthread.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <unistd.h>
+#include <fcntl.h>
+
+#ifdef Q_OS_LINUX
+#include "linux/iouring.h"
+#endif
+
+DeviceBenchmarkThread::DeviceBenchmarkThread(const QByteArray &dst, quint64 testSize, QObject *parent)
+    : DownloadThread("", dst, "", false, parent), _testSize(testSize & ~4095ULL), _bufSize(4*1024*1024)
+{
+    /* Random data, so the card cannot take shortcuts with zeroes or repeated patterns */
+    _buf = (char *) qMallocAligned(_bufSize, 4096);
+    QRandomGenerator rng(0x6e6d);
+    rng.fillRange((quint32 *) _buf, _bufSize / sizeof(quint32));
+}
+
+DeviceBenchmarkThread::~DeviceBenchmarkThread()
+{
+    wait();
+    qFreeAligned(_buf);
+}
+
+void DeviceBenchmarkThread::run()
+{
+    if (!_openAndPrepareDevice())
+        return;
+
+    const size_t blockSizes[] = { 16*1024, 64*1024, IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE, IMAGEWRITER_BLOCKSIZE, 4*1024*1024 };
+    size_t bestBlockSize = IMAGEWRITER_BLOCKSIZE;
+    unsigned bestDepth = 1;
+    double best = 0, mbps;
+
+    for (size_t blockSize : blockSizes)
+    {
+        emit preparationStatusUpdate(tr("measuring sequential writes of %1 KB").arg(blockSize / 1024));
+        if (!_sequentialWrite(blockSize, mbps))
+            return;
+        emit benchmarkResult({{"test", "write"}, {"blockSize", (qulonglong) blockSize}, {"MBps", mbps}});
+        /* Smaller blocks only win if clearly faster, as they cost more CPU per byte */
+        if (mbps > best * 1.05)
+        {
+            best = mbps;
+            bestBlockSize = blockSize;
+        }
+    }
+
+    emit preparationStatusUpdate(tr("measuring sequential reads"));
+    if (!_sequentialRead(IMAGEWRITER_BLOCKSIZE, mbps))
+        return;
+    emit benchmarkResult({{"test", "read"}, {"blockSize", IMAGEWRITER_BLOCKSIZE}, {"MBps", mbps}});
+
+    double iops;
+    emit preparationStatusUpdate(tr("measuring random 4 KB writes"));
+    if (!_randomWrite(IMAGEWRITER_BENCHMARK_RANDOM_WRITES, iops))
+        return;
+    emit benchmarkResult({{"test", "randomWrite"}, {"blockSize", 4096}, {"iops", iops}, {"MBps", iops * 4096 / 1000000}});
+
+    double minMs, avgMs, maxMs;
+    emit preparationStatusUpdate(tr("measuring fsync latency"));
+    if (!_fsyncLatency(IMAGEWRITER_BENCHMARK_FSYNCS, minMs, avgMs, maxMs))
+        return;
+    emit benchmarkResult({{"test", "fsync"}, {"minMs", minMs}, {"avgMs", avgMs}, {"maxMs", maxMs}});
+
+#ifdef Q_OS_LINUX
+    best = 0;
+    for (unsigned depth : {1, 4, 16})
+    {
+        emit preparationStatusUpdate(tr("measuring writes with queue depth %1").arg(depth));
+        if (!_queuedWrite(bestBlockSize, depth, mbps))
+        {
+            if (_cancelled)
+                return;
+            qDebug() << "io_uring not available. Skipping queue depth tests";
+            break;
+        }
+        emit benchmarkResult({{"test", "queuedWrite"}, {"blockSize", (qulonglong) bestBlockSize}, {"queueDepth", depth}, {"MBps", mbps}});
+        if (mbps > best * 1.05)
+        {
+            best = mbps;
+            bestDepth = depth;
+        }
+    }
+#endif
+
+    emit benchmarkResult({{"test", "recommendation"}, {"blockSize", (qulonglong) bestBlockSize}, {"queueDepth", bestDepth}});
+    _closeFiles();
+    emit success();
+}
+
+bool DeviceBenchmarkThread::_sync()
+{
+    if (!_file.flush())
+    {
+        _onDownloadError(tr("Error writing to storage (while flushing)"));
+        return false;
+    }
+#ifndef Q_OS_WIN
+    if (::fsync(_file.handle()) != 0)
+    {
+        _onDownloadError(tr("Error writing to storage (while fsync)"));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+/* So reads come from the device, not from memory */
+void DeviceBenchmarkThread::_dropCache()
+{
+#ifdef Q_OS_LINUX
+    if (!_directIO)
+        ::posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+bool DeviceBenchmarkThread::_sequentialWrite(size_t blockSize, double &mbps)
+{
+    QElapsedTimer t;
+
+    _file.seek(0);
+    t.start();
+    for (quint64 pos = 0; pos < _testSize && !_cancelled; pos += blockSize)
+    {
+        qint64 len = qMin((quint64) blockSize, _testSize - pos);
+        if (_file.write(_buf, len) != len)
+        {
+            _onWriteError();
+            return false;
+        }
+    }
+    if (_cancelled || !_sync())
+        return false;
+
+    mbps = _testSize / 1000.0 / qMax(t.elapsed(), (qint64) 1);
+    qDebug() << "Sequential write with" << blockSize << "byte blocks:" << mbps << "MB/s";
+
+    return true;
+}
+
+bool DeviceBenchmarkThread::_sequentialRead(size_t blockSize, double &mbps)
+{
+    QElapsedTimer t;
+
+    _dropCache();
+    _file.seek(0);
+    t.start();
+    for (quint64 pos = 0; pos < _testSize && !_cancelled; pos += blockSize)
+    {
+        qint64 len = qMin((quint64) blockSize, _testSize - pos);
+        if (_file.read(_buf, len) != len)
+        {
+            _onDownloadError(tr("Error reading from storage.<br>"
+                                "SD card may be broken."));
+            return false;
+        }
+    }
+    if (_cancelled)
+        return false;
+
+    mbps = _testSize / 1000.0 / qMax(t.elapsed(), (qint64) 1);
+    qDebug() << "Sequential read with" << blockSize << "byte blocks:" << mbps << "MB/s";
+
+    return true;
+}
+
+bool DeviceBenchmarkThread::_randomWrite(int count, double &iops)
+{
+    QRandomGenerator rng(0x4b);
+    QElapsedTimer t;
+    quint64 blocks = _testSize / 4096;
+
+    t.start();
+    for (int i = 0; i < count && !_cancelled; i++)
+    {
+        if (!_file.seek(rng.bounded(blocks) * 4096) || _file.write(_buf, 4096) != 4096)
+        {
+            _onWriteError();
+            return false;
+        }
+    }
+    if (_cancelled || !_sync())
+        return false;
+
+    iops = count * 1000.0 / qMax(t.elapsed(), (qint64) 1);
+    qDebug() << "Random 4 KB writes:" << iops << "IOPS";
+
+    return true;
+}
+
+bool DeviceBenchmarkThread::_fsyncLatency(int count, double &minMs, double &avgMs, double &maxMs)
+{
+    QElapsedTimer t;
+    double total = 0;
+
+    minMs = maxMs = 0;
+    for (int i = 0; i < count && !_cancelled; i++)
+    {
+        if (!_file.seek(0) || _file.write(_buf, 4096) != 4096)
+        {
+            _onWriteError();
+            return false;
+        }
+        t.start();
+        if (!_sync())
+            return false;
+
+        double ms = t.nsecsElapsed() / 1000000.0;
+        minMs = i ? qMin(minMs, ms) : ms;
+        maxMs = qMax(maxMs, ms);
+        total += ms;
+    }
+    if (_cancelled)
+        return false;
+
+    avgMs = total / count;
+    qDebug() << "fsync latency min/avg/max:" << minMs << avgMs << maxMs << "ms";
+
+    return true;
+}
+
+#ifdef Q_OS_LINUX
+/* Sequential write with several requests in flight. Returns false if io_uring is not available */
+bool DeviceBenchmarkThread::_queuedWrite(size_t blockSize, unsigned depth, double &mbps)
+{
+    IoUring ring;
+    QElapsedTimer t;
+    quint64 offset = 0, completed = 0;
+    int fd = _file.handle();
+
+    if (!ring.init(depth))
+        return false;
+
+    t.start();
+    while (completed < _testSize && !_cancelled)
+    {
+        while (offset < _testSize && ring.inFlight() < depth)
+        {
+            size_t len = qMin((quint64) blockSize, _testSize - offset);
+            if (!ring.queueWrite(fd, _buf, len, offset, offset))
+                break;
+            offset += len;
+        }
+
+        quint64 userData;
+        int res;
+        if (!ring.waitCompletion(&userData, &res) || res != (int) qMin((quint64) blockSize, _testSize - userData))
+        {
+            _onWriteError();
+            return false;
+        }
+        completed += res;
+    }
+    if (_cancelled || !_sync())
+        return false;
+
+    mbps = _testSize / 1000.0 / qMax(t.elapsed(), (qint64) 1);
+    qDebug() << "io_uring write with" << blockSize << "byte blocks at queue depth" << depth << ":" << mbps << "MB/s";
+
+    return true;
+}
+#endif
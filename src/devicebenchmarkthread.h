@@ -0,0 +1,54 @@
+#ifndef DEVICEBENCHMARKTHREAD_H
+#define DEVICEBENCHMARKTHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadthread.h"
+#include "config.h"
+#include <QVariantMap>
+
+/*
+ * Measures the write and read speed of a storage device
+ *
+ * Opens and prepares the device the same way as for writing an image,
+ * then runs sequential writes at several block sizes, a sequential
+ * read, random 4 KB writes, fsync latency and, on Linux, io_uring
+ * writes at several queue depths. Destroys all data on the device.
+ *
+ * Every result is emitted with benchmarkResult(), followed by a
+ * "recommendation" with the fastest block size and queue depth, and
+ * success().
+ */
+class DeviceBenchmarkThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    explicit DeviceBenchmarkThread(const QByteArray &dst, quint64 testSize = IMAGEWRITER_BENCHMARK_SIZE, QObject *parent = nullptr);
+    virtual ~DeviceBenchmarkThread();
+
+signals:
+    /* Map with "test" ("write", "read", "randomWrite", "fsync", "queuedWrite" or "recommendation")
+       and the results of it: blockSize, queueDepth, MBps, iops, minMs, avgMs, maxMs */
+    void benchmarkResult(QVariantMap result);
+
+protected:
+    quint64 _testSize;
+    char *_buf;
+    size_t _bufSize;
+
+    virtual void run();
+    bool _sequentialWrite(size_t blockSize, double &mbps);
+    bool _sequentialRead(size_t blockSize, double &mbps);
+    bool _randomWrite(int count, double &iops);
+    bool _fsyncLatency(int count, double &minMs, double &avgMs, double &maxMs);
+#ifdef Q_OS_LINUX
+    bool _queuedWrite(size_t blockSize, unsigned depth, double &mbps);
+#endif
+    bool _sync();
+    void _dropCache();
+};
+
+#endif // DEVICEBENCHMARKTHREAD_H
@@ -0,0 +1,375 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "devicecapturethread.h"
+#include "cachesidecar.h"
+#include "config.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+#include <QtEndian>
+#include <deque>
+#include <fcntl.h>
+#include <zstd.h>
+
+/* Footer of the zstd seekable format */
+#define ZSTD_SEEKABLE_MAGIC     0x8F92EAB1
+
+DeviceCaptureThread::DeviceCaptureThread(const QByteArray &src, const QString &output, QObject *parent)
+    : DownloadThread("", src, "", false, parent), _output(output), _imageSize(0), _level(-1)
+{
+    lzma_stream init = LZMA_STREAM_INIT;
+    _xz = init;
+
+    QString lower = output.toLower();
+    if (lower.endsWith(".zst"))
+        _format = FormatZstd;
+    else if (lower.endsWith(".xz"))
+        _format = FormatXz;
+    else
+        _format = FormatRaw;
+}
+
+DeviceCaptureThread::~DeviceCaptureThread()
+{
+    wait();
+    lzma_end(&_xz);
+}
+
+void DeviceCaptureThread::setImageSize(quint64 size)
+{
+    _imageSize = size;
+}
+
+void DeviceCaptureThread::setCompressionLevel(int level)
+{
+    _level = level;
+}
+
+void DeviceCaptureThread::run()
+{
+    if (!_openDeviceReadOnly())
+        return;
+
+    quint64 deviceSize = _blockDevice()->size();
+    if (!_imageSize)
+        _imageSize = deviceSize;
+    if (!_imageSize || (deviceSize && _imageSize > deviceSize))
+    {
+        _closeFiles();
+        DownloadThread::_onDownloadError(deviceSize ? tr("Storage device is smaller than the image size given.")
+                                                    : tr("Cannot tell the size of the storage device."));
+        return;
+    }
+    _lastDlTotal = _imageSize;
+
+    _out.setFileName(_output);
+    if (!_out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        _closeFiles();
+        DownloadThread::_onDownloadError(tr("Cannot create image file '%1'.").arg(_output));
+        return;
+    }
+    if (_format == FormatXz)
+    {
+        lzma_mt mt = {};
+        mt.threads = qMax(1, QThread::idealThreadCount());
+        mt.block_size = IMAGEWRITER_HASH_CHUNKSIZE;
+        mt.preset = _level < 0 ? IMAGEWRITER_CAPTURE_XZ_PRESET : _level;
+        mt.check = LZMA_CHECK_CRC64;
+        if (lzma_stream_encoder_mt(&_xz, &mt) != LZMA_OK)
+        {
+            _closeFiles();
+            _out.remove();
+            DownloadThread::_onDownloadError(tr("Error initializing xz compression"));
+            return;
+        }
+    }
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    emit preparationStatusUpdate(tr("reading drive"));
+
+    /* The device is read in order here, while the pool hashes and compresses
+       the chunks read before. Results are stored in order as well */
+    const int threads = qMax(1, QThread::idealThreadCount());
+    const Format format = _format;
+    const int level = _level < 0 ? IMAGEWRITER_CAPTURE_ZSTD_LEVEL : _level;
+    BlockDevice *device = _blockDevice();
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    std::deque<QFuture<Chunk>> pending;
+    quint64 readPos = 0, storePos = 0;
+    bool ok = true;
+    QElapsedTimer t;
+    t.start();
+
+    while (ok && !_cancelled && storePos < _imageSize)
+    {
+        if (readPos < _imageSize && pending.size() < (size_t) threads*2)
+        {
+            qint64 len = qMin((quint64) IMAGEWRITER_HASH_CHUNKSIZE, _imageSize-readPos);
+            QByteArray data(len, Qt::Uninitialized);
+            if (device->pread(data.data(), len, readPos) != len)
+            {
+                DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                    "SD card may be broken."));
+                ok = false;
+                break;
+            }
+            pending.push_back(QtConcurrent::run(&pool, &DeviceCaptureThread::_processChunk, data, format, level));
+            readPos += len;
+            continue;
+        }
+
+        Chunk chunk = pending.front().result();
+        pending.pop_front();
+        ok = _storeChunk(chunk, storePos);
+        storePos += chunk.data.size();
+        _lastDlNow = storePos;
+        _publishProgress();
+    }
+    for (QFuture<Chunk> &f : pending)
+        f.waitForFinished();
+
+    ok = ok && !_cancelled && _finishOutput();
+    _closeFiles();
+    _out.close();
+    if (!ok)
+    {
+        _out.remove();
+        return;
+    }
+
+    QByteArray sha256 = _writehash.result().toHex();
+    qDebug() << "Captured" << _imageSize << "bytes in" << t.elapsed() / 1000.0 << "seconds. SHA256:" << sha256;
+    _writeMetadata(sha256);
+
+    quint64 mapped = 0;
+    for (const BlockMap::Range &r : std::as_const(_ranges))
+        mapped += r.length;
+    QVariantMap result = {
+        {"output", _output},
+        {"imageSize", (qulonglong) _imageSize},
+        {"mappedBytes", (qulonglong) mapped},
+        {"outputBytes", (qulonglong) QFileInfo(_output).size()},
+        {"sha256", QString(sha256)},
+        {"seconds", t.elapsed() / 1000.0},
+        {"bmap", _output+".bmap"}
+    };
+    if (_format == FormatZstd)
+        result["chunkIndex"] = ChunkIndex::fileName(_output);
+    emit captureResult(result);
+    emit success();
+}
+
+/* Runs on the pool */
+DeviceCaptureThread::Chunk DeviceCaptureThread::_processChunk(QByteArray data, Format format, int level)
+{
+    Chunk chunk;
+    chunk.sha256 = ChunkedHash::hash(data.constData(), data.size());
+    if (format == FormatZstd)
+    {
+        /* A frame of its own, with the extracted size in its header */
+        chunk.frame.resize(ZSTD_compressBound(data.size()));
+        size_t n = ZSTD_compress(chunk.frame.data(), chunk.frame.size(), data.constData(), data.size(), level);
+        if (ZSTD_isError(n))
+            chunk.frame.clear();
+        else
+            chunk.frame.resize(n);
+    }
+    chunk.data = data;
+
+    return chunk;
+}
+
+bool DeviceCaptureThread::_storeChunk(const Chunk &chunk, quint64 offset)
+{
+    const char *buf = chunk.data.constData();
+    size_t len = chunk.data.size();
+
+    _writehash.addData(buf, len);
+    _leaves.append(chunk.sha256);
+    if (!_mapChunk(buf, len, offset))
+        return false;
+
+    if (_format == FormatZstd)
+    {
+        if (chunk.frame.isEmpty())
+        {
+            DownloadThread::_onDownloadError(tr("Error compressing image"));
+            return false;
+        }
+        ChunkIndex::Chunk c;
+        c.sha256 = chunk.sha256;
+        c.offset = offset;
+        c.size = len;
+        c.packOffset = _out.pos();
+        c.packSize = chunk.frame.size();
+        _index.chunks.append(c);
+        _frames.append(qMakePair((quint32) chunk.frame.size(), (quint32) len));
+
+        return _writeOutput(chunk.frame.constData(), chunk.frame.size());
+    }
+    else if (_format == FormatXz)
+    {
+        return _xzCode(buf, len, LZMA_RUN);
+    }
+
+    return true;
+}
+
+/* Adds the data runs of a chunk to the bmap ranges, and for raw output
+   writes them, leaving holes for the zeroes */
+bool DeviceCaptureThread::_mapChunk(const char *buf, size_t len, quint64 offset)
+{
+    const size_t blockSize = IMAGEWRITER_CAPTURE_BMAP_BLOCKSIZE;
+    size_t pos = 0;
+
+    while (pos < len)
+    {
+        size_t n = qMin(blockSize, len-pos);
+        bool zero = _isZeroBlock(buf+pos, n);
+        while (pos+n < len)
+        {
+            size_t next = qMin(blockSize, len-pos-n);
+            if (_isZeroBlock(buf+pos+n, next) != zero)
+                break;
+            n += next;
+        }
+
+        if (zero)
+        {
+            _closeRange();
+        }
+        else
+        {
+            if (!_rangeHash)
+            {
+                _rangeHash.reset(new AcceleratedCryptographicHash(QCryptographicHash::Sha256));
+                _ranges.append({offset+pos, 0, QByteArray()});
+            }
+            _rangeHash->addData(buf+pos, n);
+            _ranges.last().length += n;
+
+            if (_format == FormatRaw && (!_out.seek(offset+pos) || !_writeOutput(buf+pos, n)))
+                return false;
+        }
+        pos += n;
+    }
+
+    return true;
+}
+
+void DeviceCaptureThread::_closeRange()
+{
+    if (!_rangeHash)
+        return;
+
+    _ranges.last().sha256 = _rangeHash->result().toHex();
+    _rangeHash.reset();
+}
+
+bool DeviceCaptureThread::_writeOutput(const char *buf, size_t len)
+{
+    if (_out.write(buf, len) != (qint64) len)
+    {
+        DownloadThread::_onDownloadError(tr("Error writing image file"));
+        return false;
+    }
+    _bytesWritten += len;
+
+    return true;
+}
+
+bool DeviceCaptureThread::_xzCode(const char *buf, size_t len, lzma_action action)
+{
+    QByteArray out(IMAGEWRITER_BLOCKSIZE, Qt::Uninitialized);
+    lzma_ret ret;
+
+    _xz.next_in = (const uint8_t *) buf;
+    _xz.avail_in = len;
+    do
+    {
+        _xz.next_out = (uint8_t *) out.data();
+        _xz.avail_out = out.size();
+        ret = lzma_code(&_xz, action);
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+        {
+            qDebug() << "lzma_code() failed:" << ret;
+            DownloadThread::_onDownloadError(tr("Error compressing image"));
+            return false;
+        }
+
+        size_t n = out.size() - _xz.avail_out;
+        if (n && !_writeOutput(out.constData(), n))
+            return false;
+    } while (action == LZMA_FINISH ? ret != LZMA_STREAM_END : _xz.avail_in > 0);
+
+    return true;
+}
+
+bool DeviceCaptureThread::_finishOutput()
+{
+    _closeRange();
+
+    if (_format == FormatZstd)
+    {
+        /* Seek table in a skippable frame, as in zstd's contrib/seekable_format */
+        QByteArray table(8 + _frames.size()*8 + 9, Qt::Uninitialized);
+        char *p = table.data();
+        qToLittleEndian<quint32>(ZSTD_MAGIC_SKIPPABLE_START+0xE, p);
+        qToLittleEndian<quint32>(table.size()-8, p+4);
+        p += 8;
+        for (const auto &frame : std::as_const(_frames))
+        {
+            qToLittleEndian<quint32>(frame.first, p);
+            qToLittleEndian<quint32>(frame.second, p+4);
+            p += 8;
+        }
+        qToLittleEndian<quint32>(_frames.size(), p);
+        p[4] = 0;
+        qToLittleEndian<quint32>(ZSTD_SEEKABLE_MAGIC, p+5);
+
+        return _writeOutput(table.constData(), table.size());
+    }
+    else if (_format == FormatXz)
+    {
+        return _xzCode(nullptr, 0, LZMA_FINISH);
+    }
+    else if (!_out.resize(_imageSize))
+    {
+        DownloadThread::_onDownloadError(tr("Error writing image file"));
+        return false;
+    }
+
+    return true;
+}
+
+/* Written once the image is closed, as the sidecar records its size and time */
+void DeviceCaptureThread::_writeMetadata(const QByteArray &sha256)
+{
+    QFile bmap(_output+".bmap");
+    QByteArray xml = BlockMap::toXml(_imageSize, IMAGEWRITER_CAPTURE_BMAP_BLOCKSIZE, _ranges);
+    if (!bmap.open(QIODevice::WriteOnly | QIODevice::Truncate) || bmap.write(xml) != xml.size())
+        qDebug() << "Error writing bmap" << bmap.fileName();
+
+    if (_format == FormatZstd)
+    {
+        _index.imageHash = sha256;
+        _index.imageSize = _imageSize;
+        _index.packUrl = QFileInfo(_output).fileName();
+        _index.save(_output);
+    }
+
+    CacheSidecar sidecar;
+    sidecar.extractHash = sha256;
+    sidecar.chunkSize = IMAGEWRITER_HASH_CHUNKSIZE;
+    sidecar.chunks = _leaves;
+    sidecar.save(_output);
+}
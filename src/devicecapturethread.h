@@ -0,0 +1,87 @@
+#ifndef DEVICECAPTURETHREAD_H
+#define DEVICECAPTURETHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadthread.h"
+#include "bmap.h"
+#include "chunkindex.h"
+#include <QFile>
+#include <QVariantMap>
+#include <lzma.h>
+
+/*
+ * Reads a storage device into an image file, for capturing golden images
+ *
+ * The format follows the extension of the output file:
+ * - .zst: a zstd frame per IMAGEWRITER_HASH_CHUNKSIZE of the device, compressed
+ *   on all cores, with a seek table at the end. The frames are extracted in
+ *   parallel when writing, and a ChunkIndex (.chunks) is written alongside,
+ *   so the file also serves as chunk pack for delta downloads
+ * - .xz: compressed by the multi-threaded xz encoder, a block per chunk
+ * - anything else: uncompressed, with holes where the device has zeroes
+ *
+ * Every format gets a bmap (.bmap) leaving out all-zero blocks, and a cache
+ * sidecar with the chunk hashes, so verifying against the image needs no
+ * decompression. The device is opened read-only and not unmounted.
+ *
+ * Progress is reported as dlNow()/dlTotal(): bytes of the device read.
+ */
+class DeviceCaptureThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    explicit DeviceCaptureThread(const QByteArray &src, const QString &output, QObject *parent = nullptr);
+    virtual ~DeviceCaptureThread();
+
+    /* Bytes read from the start of the device. All of it if 0 */
+    void setImageSize(quint64 size);
+    /* zstd level or xz preset. -1 for the default */
+    void setCompressionLevel(int level);
+
+signals:
+    /* Map with "output", "imageSize", "mappedBytes", "outputBytes", "sha256" and "seconds",
+       and the file names of the "bmap" and the "chunkIndex" (.zst only) */
+    void captureResult(QVariantMap result);
+
+protected:
+    enum Format {
+        FormatRaw,
+        FormatZstd,
+        FormatXz
+    };
+    /* A chunk of the device, with what the workers made of it */
+    struct Chunk {
+        QByteArray data, sha256, frame;
+    };
+
+    QString _output;
+    Format _format;
+    quint64 _imageSize;
+    int _level;
+    QFile _out;
+    lzma_stream _xz;
+    /* bmap ranges found so far, and hash of the one still open */
+    QVector<BlockMap::Range> _ranges;
+    std::unique_ptr<AcceleratedCryptographicHash> _rangeHash;
+    /* Hashes of every chunk, for the sidecar */
+    QVector<QByteArray> _leaves;
+    /* zstd: compressed and extracted size of every frame, for the seek table */
+    QVector<QPair<quint32, quint32>> _frames;
+    ChunkIndex _index;
+
+    virtual void run() override;
+    static Chunk _processChunk(QByteArray data, Format format, int level);
+    bool _storeChunk(const Chunk &chunk, quint64 offset);
+    bool _mapChunk(const char *buf, size_t len, quint64 offset);
+    void _closeRange();
+    bool _writeOutput(const char *buf, size_t len);
+    bool _xzCode(const char *buf, size_t len, lzma_action action);
+    bool _finishOutput();
+    void _writeMetadata(const QByteArray &sha256);
+};
+
+#endif // DEVICECAPTURETHREAD_H
@@ -0,0 +1,138 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "deviceclonethread.h"
+#include "fanouttargetthread.h"
+#include "config.h"
+#include "pipelinetrace.h"
+#include "threadplacement.h"
+#include <QDebug>
+#include <thread>
+#include <fcntl.h>
+
+DeviceCloneThread::DeviceCloneThread(const QByteArray &src, QObject *parent)
+    : DownloadThread("", src, "", false, parent), _imageSize(0), _ring(IMAGEWRITER_RINGBUFFER_SIZE, IMAGEWRITER_BLOCKSIZE), _readFailed(false)
+{
+}
+
+DeviceCloneThread::~DeviceCloneThread()
+{
+    cancelDownload();
+    wait();
+}
+
+void DeviceCloneThread::cancelDownload()
+{
+    DownloadThread::cancelDownload();
+    _ring.cancel();
+}
+
+void DeviceCloneThread::setImageSize(quint64 size)
+{
+    _imageSize = size;
+}
+
+void DeviceCloneThread::run()
+{
+    for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+    {
+        if (target->device() == _filename)
+        {
+            DownloadThread::_onDownloadError(tr("Cannot clone a storage device onto itself."));
+            return;
+        }
+    }
+    if (_fanoutTargets.isEmpty())
+    {
+        DownloadThread::_onDownloadError(tr("No storage device to clone to."));
+        return;
+    }
+    if (!_openDeviceReadOnly())
+        return;
+
+    quint64 deviceSize = _blockDevice()->size();
+    if (!_imageSize)
+        _imageSize = deviceSize;
+    /* Devices are written whole sectors at a time */
+    if (_imageSize % 512)
+        _imageSize += 512 - _imageSize % 512;
+    if (!_imageSize || (deviceSize && _imageSize > deviceSize))
+    {
+        _closeFiles();
+        DownloadThread::_onDownloadError(deviceSize ? tr("Storage device is smaller than the image size given.")
+                                                    : tr("Cannot tell the size of the storage device."));
+        return;
+    }
+    _lastDlTotal = _imageSize;
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    _ring.setCapacity(qMax(_budget.ringBufferSize, (size_t) 2*IMAGEWRITER_CLONE_READ_SIZE));
+    qDebug() << "Cloning" << _imageSize << "bytes of" << _filename << "to" << _fanoutTargets.size() << "devices";
+    _timer.start();
+
+    std::thread reader(&DeviceCloneThread::_readSource, this);
+    const void *slab;
+    ssize_t n;
+
+    while ((n = _ring.read(&slab)) > 0)
+    {
+        /* Returns 0 once every target dropped out, they reported why themselves */
+        if (_writeFile((const char *) slab, n) != (size_t) n)
+        {
+            _ring.cancel();
+            reader.join();
+            _closeFiles();
+            DownloadThread::_onDownloadError(tr("Writing failed on all storage devices"));
+            return;
+        }
+        _lastDlNow += n;
+    }
+    reader.join();
+    _closeFiles();
+
+    if (_readFailed)
+    {
+        DownloadThread::cancelDownload();
+        DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                            "SD card may be broken."));
+        return;
+    }
+    if (_cancelled)
+        return;
+
+    qDebug() << "Source read in" << _timer.elapsed() / 1000.0 << "seconds";
+    _writeComplete();
+}
+
+/* Runs on a thread of its own, so reading the next piece overlaps with handing the last to the targets */
+void DeviceCloneThread::_readSource()
+{
+    ThreadPlacement::apply(ThreadPlacement::StageDownload);
+    BlockDevice *device = _blockDevice();
+    char *buf = (char *) qMallocAligned(IMAGEWRITER_CLONE_READ_SIZE, 4096);
+    quint64 pos = 0;
+
+    while (pos < _imageSize && !_cancelled)
+    {
+        size_t len = qMin((quint64) IMAGEWRITER_CLONE_READ_SIZE, _imageSize-pos);
+        TraceSpan span("readSource");
+        if (device->pread(buf, len, pos) != (qint64) len)
+        {
+            qDebug() << "Error reading" << _filename << "at offset" << pos;
+            _readFailed = true;
+            _ring.cancel();
+            break;
+        }
+        if (!_ring.write(buf, len))
+            break;
+        pos += len;
+    }
+    qFreeAligned(buf);
+
+    if (pos == _imageSize)
+        _ring.close();
+}
@@ -0,0 +1,45 @@
+#ifndef DEVICECLONETHREAD_H
+#define DEVICECLONETHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadthread.h"
+#include "ringbuffer.h"
+
+/*
+ * Copies a storage device to one or more others, without an image file in between
+ *
+ * The destinations are fan-out targets (see addFanoutTarget()), which write,
+ * verify and eject on their own, and drop out on their own if they fail.
+ * A reader thread reads the source device in IMAGEWRITER_CLONE_READ_SIZE
+ * pieces into a ring buffer, while this thread hands what was read before to
+ * the targets. As nothing needs decompressing, the slowest target sets the pace.
+ * All-zero blocks are skipped by targets that have sparse writing enabled.
+ *
+ * The source is opened read-only and not unmounted. Progress is reported as
+ * dlNow()/dlTotal(): bytes of the source read.
+ */
+class DeviceCloneThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    explicit DeviceCloneThread(const QByteArray &src, QObject *parent = nullptr);
+    virtual ~DeviceCloneThread();
+    virtual void cancelDownload() override;
+
+    /* Bytes copied from the start of the source. All of it if 0 */
+    void setImageSize(quint64 size);
+
+protected:
+    quint64 _imageSize;
+    RingBuffer _ring;
+    std::atomic<bool> _readFailed;
+
+    virtual void run() override;
+    void _readSource();
+};
+
+#endif // DEVICECLONETHREAD_H
@@ -4,28 +4,59 @@
  */
 
 #include "devicewrapper.h"
-#include "devicewrapperblockcacheentry.h"
 #include "devicewrapperstructs.h"
 #include "devicewrapperfatpartition.h"
 #include <QDebug>
+#include <algorithm>
+#include <string.h>
+#include <zlib.h>
 
-DeviceWrapper::DeviceWrapper(DeviceWrapperFile *file, QObject *parent)
-    : QObject(parent), _dirty(false), _file(file)
+/* Blocks per arena chunk */
+#define DEVICEWRAPPER_ARENA_BLOCKS  64
+
+/* Most blocks transferred with a single read or write */
+#define DEVICEWRAPPER_MAX_RUN       256
+
+/* Partitions are grown to end on a 1 MB boundary (in sectors) */
+#define DEVICEWRAPPER_PARTITION_ALIGN 2048
+
+/* Cached blocks are written out and dropped beyond this (32 MB),
+   so writing whole files through the cache does not exhaust memory */
+#define DEVICEWRAPPER_MAX_CACHED    8192
+
+DeviceWrapper::DeviceWrapper(BlockDevice *device, QObject *parent)
+    : QObject(parent), _dirty(false), _arenaUsed(0), _device(device)
 {
 
 }
 
 DeviceWrapper::~DeviceWrapper()
 {
-    sync();
+    try
+    {
+        sync();
+    }
+    catch (std::runtime_error &err)
+    {
+        qDebug() << "Error writing cached blocks:" << err.what();
+    }
+
+    for (char *chunk : std::as_const(_arena))
+        qFreeAligned(chunk);
 }
 
-void DeviceWrapper::_seekToBlock(quint64 blockNr)
+char *DeviceWrapper::_allocateBlock()
 {
-    if (!_file->seek(blockNr*4096))
+    if (_arenaUsed == _arena.size()*DEVICEWRAPPER_ARENA_BLOCKS)
     {
-        throw std::runtime_error("Error seeking device");
+        /* Windows requires buffers to be 4k aligned when reading/writing raw disk devices */
+        _arena.append((char *) qMallocAligned(DEVICEWRAPPER_ARENA_BLOCKS*4096, 4096));
     }
+
+    char *block = _arena.last() + (_arenaUsed % DEVICEWRAPPER_ARENA_BLOCKS)*4096;
+    _arenaUsed++;
+
+    return block;
 }
 
 void DeviceWrapper::sync()
@@ -33,44 +64,99 @@ void DeviceWrapper::sync()
     if (!_dirty)
         return;
 
-    const auto blockNrs = _blockcache.keys();
-    for (auto blockNr : blockNrs)
-    {
-        if (blockNr == 0)
-            continue; /* Save writing first block with MBR for last */
-
-        auto block = _blockcache.value(blockNr);
+    _writeDirtyBlocks(true);
+    _dirty = false;
+}
 
-        if (!block->dirty)
-            continue;
+void DeviceWrapper::_writeDirtyBlocks(bool includingFirstBlock)
+{
+    QVector<quint64> blockNrs;
+    for (auto it = _blockcache.cbegin(); it != _blockcache.cend(); ++it)
+    {
+        /* Save writing first block with MBR for last */
+        if (it.value().dirty && it.key() != 0)
+            blockNrs.append(it.key());
+    }
+    std::sort(blockNrs.begin(), blockNrs.end());
 
-        _seekToBlock(blockNr);
-        if (_file->write(block->block, 4096) != 4096)
+    /* Adjacent dirty blocks are written together */
+    QVector<const char *> run;
+    for (int i = 0; i < blockNrs.size(); )
+    {
+        quint64 first = blockNrs[i];
+        run.clear();
+        while (i < blockNrs.size() && blockNrs[i] == first+run.size() && run.size() < DEVICEWRAPPER_MAX_RUN)
         {
-            std::string errmsg = "Error writing to device: "+_file->errorString().toStdString();
-            throw std::runtime_error(errmsg);
+            run.append(_blockcache.value(blockNrs[i]).data);
+            i++;
         }
-        block->dirty = false;
+
+        _writeBlocks(first, run.constData(), run.size());
+        for (quint64 j = first; j < first+run.size(); j++)
+            _blockcache[j].dirty = false;
     }
 
-    if (_blockcache.contains(0))
+    auto mbr = _blockcache.find(0);
+    if (includingFirstBlock && mbr != _blockcache.end() && mbr.value().dirty)
     {
         /* Write first block with MBR */
-        auto block = _blockcache.value(0);
+        const char *data = mbr.value().data;
+        _writeBlocks(0, &data, 1);
+        mbr.value().dirty = false;
+    }
+}
 
-        if (block->dirty)
-        {
-            _seekToBlock(0);
-            if (_file->write(block->block, 4096) != 4096)
-            {
-                std::string errmsg = "Error writing MBR to device: "+_file->errorString().toStdString();
-                throw std::runtime_error(errmsg);
-            }
-            block->dirty = false;
-        }
+/* Writes out and drops all cached blocks, except the first one with the MBR, which still goes last */
+void DeviceWrapper::_trimBlockCache()
+{
+    if (_blockcache.size() <= DEVICEWRAPPER_MAX_CACHED)
+        return;
+
+    _writeDirtyBlocks(false);
+
+    auto mbr = _blockcache.constFind(0);
+    bool hasMbr = (mbr != _blockcache.cend());
+    CachedBlock first = hasMbr ? mbr.value() : CachedBlock{nullptr, false};
+    char saved[4096];
+    if (hasMbr)
+        memcpy(saved, first.data, sizeof(saved));
+
+    /* Arena chunks are reused from the start */
+    _blockcache.clear();
+    _arenaUsed = 0;
+    if (hasMbr)
+    {
+        first.data = _allocateBlock();
+        memcpy(first.data, saved, sizeof(saved));
+        _blockcache.insert(0, first);
     }
+    _dirty = hasMbr && first.dirty;
+}
 
-    _dirty = false;
+void DeviceWrapper::_readBlocks(quint64 blockNr, char * const *bufs, int count)
+{
+    QVector<BlockDevice::IoVec> iov(count);
+    for (int i = 0; i < count; i++)
+        iov[i] = {bufs[i], 4096};
+
+    if (!_device->readv(iov.constData(), count, blockNr*4096))
+    {
+        std::string errmsg = "Error reading from device: "+_device->errorString().toStdString();
+        throw std::runtime_error(errmsg);
+    }
+}
+
+void DeviceWrapper::_writeBlocks(quint64 blockNr, const char * const *bufs, int count)
+{
+    QVector<BlockDevice::IoVec> iov(count);
+    for (int i = 0; i < count; i++)
+        iov[i] = {const_cast<char *>(bufs[i]), 4096};
+
+    if (!_device->writev(iov.constData(), count, blockNr*4096))
+    {
+        std::string errmsg = (blockNr ? "Error writing to device: " : "Error writing MBR to device: ")+_device->errorString().toStdString();
+        throw std::runtime_error(errmsg);
+    }
 }
 
 void DeviceWrapper::_readIntoBlockCacheIfNeeded(quint64 offset, quint64 size)
@@ -79,23 +165,29 @@ void DeviceWrapper::_readIntoBlockCacheIfNeeded(quint64 offset, quint64 size)
         return;
 
     quint64 firstBlock = offset/4096;
-    quint64 lastBlock = (offset+size)/4096;
+    quint64 lastBlock = (offset+size-1)/4096;
+    QVector<char *> run;
 
-    for (auto i = firstBlock; i <= lastBlock; i++)
+    for (auto i = firstBlock; i <= lastBlock; )
     {
-        if (!_blockcache.contains(i))
+        if (_blockcache.contains(i))
         {
-            _seekToBlock(i);
-
-            auto cacheEntry = new DeviceWrapperBlockCacheEntry(this);
-            int bytesRead = _file->read(cacheEntry->block, 4096);
-            if (bytesRead != 4096)
-            {
-                std::string errmsg = "Error reading from device: "+_file->errorString().toStdString();
-                throw std::runtime_error(errmsg);
-            }
-            _blockcache.insert(i, cacheEntry);
+            i++;
+            continue;
         }
+
+        /* Read runs of missing blocks with a single read */
+        quint64 first = i;
+        run.clear();
+        while (i <= lastBlock && !_blockcache.contains(i) && run.size() < DEVICEWRAPPER_MAX_RUN)
+        {
+            run.append(_allocateBlock());
+            i++;
+        }
+
+        _readBlocks(first, run.constData(), run.size());
+        for (int j = 0; j < run.size(); j++)
+            _blockcache.insert(first+j, {run[j], false});
     }
 }
 
@@ -104,15 +196,16 @@ void DeviceWrapper::pread(char *buf, quint64 size, quint64 offset)
     if (!size)
         return;
 
+    _trimBlockCache();
     _readIntoBlockCacheIfNeeded(offset, size);
     quint64 firstBlock = offset / 4096;
     quint64 offsetInBlock = offset % 4096;
 
     for (auto i = firstBlock; size; i++)
     {
-        auto block = _blockcache.value(i);
+        const char *block = _blockcache.value(i).data;
         size_t bytesToCopyFromBlock = qMin(4096-offsetInBlock, size);
-        memcpy(buf, block->block + offsetInBlock, bytesToCopyFromBlock);
+        memcpy(buf, block + offsetInBlock, bytesToCopyFromBlock);
 
         buf  += bytesToCopyFromBlock;
         size -= bytesToCopyFromBlock;
@@ -125,28 +218,26 @@ void DeviceWrapper::pwrite(const char *buf, quint64 size, quint64 offset)
     if (!size)
         return;
 
+    _trimBlockCache();
     quint64 firstBlock = offset / 4096;
     quint64 offsetInBlock = offset % 4096;
 
-    if (offsetInBlock || size % 4096)
-    {
-        /* Need to read existing data from disk
-           as we will only be replacing a part of a block. */
-        _readIntoBlockCacheIfNeeded(offset, size);
-    }
+    /* Need to read existing data from disk for blocks
+       we will only be replacing a part of */
+    if (offsetInBlock)
+        _readIntoBlockCacheIfNeeded(offset, 1);
+    if ((offset+size) % 4096)
+        _readIntoBlockCacheIfNeeded(offset+size-1, 1);
 
     for (auto i = firstBlock; size; i++)
     {
-        auto block = _blockcache.value(i, NULL);
-        if (!block)
-        {
-            block = new DeviceWrapperBlockCacheEntry(this);
-            _blockcache.insert(i, block);
-        }
+        auto it = _blockcache.find(i);
+        if (it == _blockcache.end())
+            it = _blockcache.insert(i, {_allocateBlock(), false});
 
-        block->dirty = true;
+        it.value().dirty = true;
         size_t bytesToCopyFromBlock = qMin(4096-offsetInBlock, size);
-        memcpy(block->block + offsetInBlock, buf, bytesToCopyFromBlock);
+        memcpy(it.value().data + offsetInBlock, buf, bytesToCopyFromBlock);
 
         buf  += bytesToCopyFromBlock;
         size -= bytesToCopyFromBlock;
@@ -157,6 +248,14 @@ void DeviceWrapper::pwrite(const char *buf, quint64 size, quint64 offset)
 }
 
 DeviceWrapperFatPartition *DeviceWrapper::fatPartition(int nr)
+{
+    quint64 offset, size;
+    partitionExtent(nr, &offset, &size);
+
+    return new DeviceWrapperFatPartition(this, offset, size, this);
+}
+
+void DeviceWrapper::partitionExtent(int nr, quint64 *offset, quint64 *size)
 {
     if (nr > 4 || nr < 1)
         throw std::runtime_error("Only basic partitions 1-4 supported");
@@ -174,7 +273,9 @@ DeviceWrapperFatPartition *DeviceWrapper::fatPartition(int nr)
 
         pread((char *) &gptpart, sizeof(gptpart), gpt.PartitionEntryLBA*512 + gpt.SizeOfPartitionEntry*(nr-1));
 
-        return new DeviceWrapperFatPartition(this, gptpart.StartingLBA*512, (gptpart.EndingLBA-gptpart.StartingLBA+1)*512, this);
+        *offset = gptpart.StartingLBA*512;
+        *size = (gptpart.EndingLBA-gptpart.StartingLBA+1)*512;
+        return;
     }
 
     /* MBR table handling */
@@ -187,6 +288,148 @@ DeviceWrapperFatPartition *DeviceWrapper::fatPartition(int nr)
     if (!mbr.part[nr-1].starting_sector || !mbr.part[nr-1].nr_of_sectors)
         throw std::runtime_error("Partition does not exist");
 
-    return new DeviceWrapperFatPartition(this, mbr.part[nr-1].starting_sector*512, mbr.part[nr-1].nr_of_sectors*512, this);
+    *offset = (quint64) mbr.part[nr-1].starting_sector*512;
+    *size = (quint64) mbr.part[nr-1].nr_of_sectors*512;
+}
+
+
+bool DeviceWrapper::expandLastPartition(quint64 deviceSize)
+{
+    quint64 deviceSectors = deviceSize/512;
+    struct mbr_table mbr;
+
+    if (deviceSectors < 2*DEVICEWRAPPER_PARTITION_ALIGN)
+        return false;
+    pread((char *) &mbr, sizeof(mbr), 0);
+
+    if (mbr.signature[0] != 0x55 || mbr.signature[1] != 0xAA)
+    {
+        qDebug() << "No partition table to expand";
+        return false;
+    }
+
+    struct gpt_header gpt;
+    pread((char *) &gpt, sizeof(gpt), 512);
+
+    if (!strncmp("EFI PART", gpt.Signature, 8) && gpt.MyLBA == 1)
+        return _expandGpt(mbr, gpt, deviceSectors);
+
+    /* MBR: the primary partition that starts last. Logical partitions would need their EBR changed */
+    int last = -1;
+    for (int i = 0; i < 4; i++)
+    {
+        if (mbr.part[i].nr_of_sectors && (last == -1 || mbr.part[i].starting_sector > mbr.part[last].starting_sector))
+            last = i;
+    }
+    if (last == -1)
+        return false;
+
+    struct mbr_partition_entry &part = mbr.part[last];
+    if (part.id == 0x05 || part.id == 0x0F || part.id == 0x85 || part.id == 0xEE)
+    {
+        qDebug() << "Last partition is of type" << Qt::hex << (int) part.id << "Not expanding it";
+        return false;
+    }
+
+    /* MBR cannot address beyond 2 TB */
+    quint64 end = qMin(deviceSectors, (quint64) UINT32_MAX);
+    end -= end % DEVICEWRAPPER_PARTITION_ALIGN;
+    if (end <= (quint64) part.starting_sector+part.nr_of_sectors)
+        return false;
+
+    qDebug() << "Expanding MBR partition" << last+1 << "from" << part.nr_of_sectors << "to" << end-part.starting_sector << "sectors";
+    part.nr_of_sectors = end-part.starting_sector;
+    /* CHS cannot express it, mark it as LBA only */
+    part.end_hsc[0] = (char) 0xFE;
+    part.end_hsc[1] = (char) 0xFF;
+    part.end_hsc[2] = (char) 0xFF;
+    pwrite((char *) &mbr, sizeof(mbr), 0);
+
+    return true;
 }
 
+bool DeviceWrapper::_expandGpt(mbr_table &mbr, gpt_header &gpt, quint64 deviceSectors)
+{
+    quint64 entriesSize = (quint64) gpt.NumberOfPartitionEntries*gpt.SizeOfPartitionEntry;
+
+    if (gpt.HeaderSize < 92 || gpt.HeaderSize > sizeof(gpt) || gpt.SizeOfPartitionEntry < sizeof(gpt_partition)
+        || !entriesSize || entriesSize > 1024*1024)
+    {
+        qDebug() << "GPT header not understood. Not expanding";
+        return false;
+    }
+    /* The backup header goes in the last sector, which is read and written as part of a 4 KB block */
+    if ((deviceSectors*512) % 4096)
+    {
+        qDebug() << "Device size is not a multiple of 4 KB. Not expanding";
+        return false;
+    }
+
+    quint64 backupLBA = deviceSectors-1;
+    quint64 backupEntriesLBA = backupLBA - (entriesSize+511)/512;
+    quint64 lastUsableLBA = backupEntriesLBA-1;
+    quint64 end = lastUsableLBA+1;
+    end -= end % DEVICEWRAPPER_PARTITION_ALIGN;
+
+    QByteArray entries(entriesSize, 0);
+    pread(entries.data(), entriesSize, gpt.PartitionEntryLBA*512);
+
+    /* The partition that ends last */
+    struct gpt_partition *last = nullptr;
+    uint32_t lastNr = 0;
+    for (uint32_t i = 0; i < gpt.NumberOfPartitionEntries; i++)
+    {
+        struct gpt_partition *part = (struct gpt_partition *) (entries.data() + (quint64) i*gpt.SizeOfPartitionEntry);
+        static const unsigned char unused[16] = {0};
+
+        if (!memcmp(part->PartitionTypeGuid, unused, sizeof(unused)))
+            continue;
+        if (!last || part->EndingLBA > last->EndingLBA)
+        {
+            last = part;
+            lastNr = i+1;
+        }
+    }
+    if (!last || end <= last->EndingLBA+1)
+        return false;
+
+    qDebug() << "Expanding GPT partition" << lastNr << "from" << last->EndingLBA-last->StartingLBA+1
+             << "to" << end-last->StartingLBA << "sectors";
+    quint64 oldEndingLBA = last->EndingLBA;
+    last->EndingLBA = end-1;
+
+    /* The backup the image came with is now inside the partition */
+    quint64 oldBackupLBA = gpt.AlternateLBA;
+    if (oldBackupLBA > oldEndingLBA && oldBackupLBA < backupEntriesLBA)
+    {
+        char zeroes[512] = {0};
+        pwrite(zeroes, sizeof(zeroes), oldBackupLBA*512);
+    }
+
+    gpt.AlternateLBA = backupLBA;
+    gpt.LastUsableLBA = lastUsableLBA;
+    gpt.PartitionEntryArrayCRC32 = crc32(0, (const Bytef *) entries.constData(), entriesSize);
+    gpt.HeaderCRC32 = 0;
+    gpt.HeaderCRC32 = crc32(0, (const Bytef *) &gpt, gpt.HeaderSize);
+
+    struct gpt_header backup = gpt;
+    backup.MyLBA = backupLBA;
+    backup.AlternateLBA = 1;
+    backup.PartitionEntryLBA = backupEntriesLBA;
+    backup.HeaderCRC32 = 0;
+    backup.HeaderCRC32 = crc32(0, (const Bytef *) &backup, backup.HeaderSize);
+
+    pwrite(entries.constData(), entriesSize, gpt.PartitionEntryLBA*512);
+    pwrite(entries.constData(), entriesSize, backupEntriesLBA*512);
+    pwrite((char *) &backup, sizeof(backup), backupLBA*512);
+    pwrite((char *) &gpt, sizeof(gpt), 512);
+
+    /* Protective MBR covers the whole device, as far as it can */
+    if (mbr.part[0].id == 0xEE)
+    {
+        mbr.part[0].nr_of_sectors = qMin(deviceSectors-1, (quint64) UINT32_MAX);
+        pwrite((char *) &mbr, sizeof(mbr), 0);
+    }
+
+    return true;
+}
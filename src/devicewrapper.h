@@ -7,41 +7,53 @@
  */
 
 #include <QObject>
-#include <QMap>
-#include <QFile>
+#include <QHash>
+#include <QVector>
+#include "blockdevice.h"
 
-class DeviceWrapperBlockCacheEntry;
 class DeviceWrapperFatPartition;
-
-#ifdef Q_OS_WIN
-#include "windows/winfile.h"
-typedef WinFile DeviceWrapperFile;
-#elif defined(Q_OS_DARWIN)
-#include "mac/macfile.h"
-typedef MacFile DeviceWrapperFile;
-#else
-typedef QFile DeviceWrapperFile;
-#endif
-
+struct mbr_table;
+struct gpt_header;
 
 class DeviceWrapper : public QObject
 {
     Q_OBJECT
 public:
-    explicit DeviceWrapper(DeviceWrapperFile *file, QObject *parent = nullptr);
+    explicit DeviceWrapper(BlockDevice *device, QObject *parent = nullptr);
     virtual ~DeviceWrapper();
-    void sync();
-    void pwrite(const char *buf, quint64 size, quint64 offset);
-    void pread(char *buf, quint64 size, quint64 offset);
+    virtual void sync();
+    virtual void pwrite(const char *buf, quint64 size, quint64 offset);
+    virtual void pread(char *buf, quint64 size, quint64 offset);
     DeviceWrapperFatPartition *fatPartition(int nr);
+    /* Offset and size in bytes of a partition, from the GPT or MBR */
+    void partitionExtent(int nr, quint64 *offset, quint64 *size);
+    /* Grows the last partition to the end of a device of deviceSize bytes,
+       and moves the backup GPT there. Returns false if the table was left as it is */
+    bool expandLastPartition(quint64 deviceSize);
 
 protected:
-    bool _dirty;
-    QMap<quint64,DeviceWrapperBlockCacheEntry *> _blockcache;
-    DeviceWrapperFile *_file;
+    struct CachedBlock
+    {
+        char *data;
+        bool dirty;
+    };
 
+    bool _dirty;
+    /* 4096 byte blocks by block number. Their data lives in arena chunks,
+       so it stays put when the hash grows, and is aligned for raw devices */
+    QHash<quint64, CachedBlock> _blockcache;
+    QVector<char *> _arena;
+    int _arenaUsed;
+    BlockDevice *_device;
+
+    char *_allocateBlock();
+    void _writeDirtyBlocks(bool includingFirstBlock);
+    void _trimBlockCache();
+    bool _expandGpt(mbr_table &mbr, gpt_header &gpt, quint64 deviceSectors);
     void _readIntoBlockCacheIfNeeded(quint64 offset, quint64 size);
-    void _seekToBlock(quint64 blockNr);
+    /* Transfer count consecutive 4096 byte blocks from/to the device, starting at blockNr */
+    virtual void _readBlocks(quint64 blockNr, char * const *bufs, int count);
+    virtual void _writeBlocks(quint64 blockNr, const char * const *bufs, int count);
 
 signals:
 
@@ -1,22 +1,101 @@
 #include "devicewrapperfatpartition.h"
 #include "devicewrapperstructs.h"
 #include <QDebug>
+#include <QtEndian>
 
 /*
  * SPDX-License-Identifier: Apache-2.0
  * Copyright (C) 2022 Raspberry Pi Ltd
  */
 
+namespace {
+    /* How entries of each FAT type are stored, so the loops over all of the FAT
+       are specialized at compile time instead of checking the type per entry */
+    template <enum fatType T> struct FatEntry;
+
+    template <> struct FatEntry<FAT12>
+    {
+        static constexpr uint32_t mask = 0xFFF;
+        static uint32_t count(size_t bytes) { return bytes * 2 / 3; }
+        /* Two 12-bit entries in three bytes */
+        static uint32_t get(const uint8_t *fat, uint32_t i)
+        {
+            uint16_t value = qFromLittleEndian<uint16_t>(fat + i + i/2);
+            return (i & 1) ? (value >> 4) : (value & 0xFFF);
+        }
+    };
+
+    template <> struct FatEntry<FAT16>
+    {
+        static constexpr uint32_t mask = 0xFFFF;
+        static uint32_t count(size_t bytes) { return bytes / 2; }
+        static uint32_t get(const uint8_t *fat, uint32_t i) { return qFromLittleEndian<uint16_t>(fat + i*2); }
+    };
+
+    /* High 4 bits are reserved, and kept as they are */
+    template <> struct FatEntry<FAT32>
+    {
+        static constexpr uint32_t mask = 0x0FFFFFFF;
+        static uint32_t count(size_t bytes) { return bytes / 4; }
+        static uint32_t get(const uint8_t *fat, uint32_t i) { return qFromLittleEndian<uint32_t>(fat + i*4); }
+    };
+
+    template <> struct FatEntry<EXFAT>
+    {
+        static constexpr uint32_t mask = 0xFFFFFFFF;
+        static uint32_t count(size_t bytes) { return bytes / 4; }
+        static uint32_t get(const uint8_t *fat, uint32_t i) { return qFromLittleEndian<uint32_t>(fat + i*4); }
+    };
+
+    template <enum fatType T> void decodeFAT(const QByteArray &fat, uint32_t maxEntries, QVector<uint32_t> &result)
+    {
+        const uint8_t *f = (const uint8_t *) fat.constData();
+        uint32_t entries = qMin(maxEntries, FatEntry<T>::count(fat.size()));
+
+        result.resize(entries);
+        uint32_t *out = result.data();
+        for (uint32_t i = 0; i < entries; i++)
+            out[i] = FatEntry<T>::get(f, i);
+    }
+} // namespace anonymous
+
 DeviceWrapperFatPartition::DeviceWrapperFatPartition(DeviceWrapper *dw, quint64 partStart, quint64 partLen, QObject *parent)
-    : DeviceWrapperPartition(dw, partStart, partLen, parent)
+    : DeviceWrapperPartition(dw, partStart, partLen, parent), _allocCursor(2), _dirIndexed(false),
+      _fileRun(0), _fileRunPos(0), _filePos(0), _fileSize(0)
 {
     union fat_bpb bpb;
 
-    read((char *) &bpb, sizeof(bpb));
+    pread((char *) &bpb, sizeof(bpb), 0);
 
     if (bpb.fat16.Signature[0] != 0x55 || bpb.fat16.Signature[1] != 0xAA)
         throw std::runtime_error("Partition does not have a FAT file system");
 
+    if (!bpb.fat16.BPB_BytsPerSec)
+    {
+        /* exFAT. The BPB area is zeroes, it describes the volume with fields of its own */
+        if (memcmp(bpb.exfat.FileSystemName, "EXFAT   ", 8) != 0)
+            throw std::runtime_error("FAT file system: invalid bytes per sector");
+        if (bpb.exfat.BytesPerSectorShift < 9 || bpb.exfat.BytesPerSectorShift > 12
+                || bpb.exfat.BytesPerSectorShift + bpb.exfat.SectorsPerClusterShift > 25)
+            throw std::runtime_error("exFAT file system: invalid sector or cluster size");
+        if (bpb.exfat.NumberOfFats != 1)
+            throw std::runtime_error("exFAT file system with more than one FAT not supported");
+
+        _type = EXFAT;
+        _entryMask = FatEntry<EXFAT>::mask;
+        _bytesPerSector = 1 << bpb.exfat.BytesPerSectorShift;
+        _bytesPerCluster = _bytesPerSector << bpb.exfat.SectorsPerClusterShift;
+        _fatSize = bpb.exfat.FatLength;
+        _firstFatStartOffset = bpb.exfat.FatOffset * _bytesPerSector;
+        _fatStartOffset.append(_firstFatStartOffset);
+        _clusterOffset = bpb.exfat.ClusterHeapOffset * _bytesPerSector;
+        _clusterCount = bpb.exfat.ClusterCount;
+        _fat32_firstRootDirCluster = bpb.exfat.FirstClusterOfRootDirectory;
+        _fat16_rootDirSectors = _fat16_firstRootDirSector = 0;
+        _fat32_fsinfoSector = 0;
+        return;
+    }
+
     /* Determine FAT type as per p. 14 https://academy.cba.mit.edu/classes/networking_communications/SD/FAT.pdf */
     _bytesPerSector = bpb.fat16.BPB_BytsPerSec;
     uint32_t totalSectors, dataSectors, countOfClusters;
@@ -34,23 +113,27 @@ DeviceWrapperFatPartition::DeviceWrapperFatPartition(DeviceWrapper *dw, quint64
 
     dataSectors = totalSectors - (bpb.fat16.BPB_RsvdSecCnt + (bpb.fat16.BPB_NumFATs * _fatSize) + _fat16_rootDirSectors);
     countOfClusters = dataSectors / bpb.fat16.BPB_SecPerClus;
+    _clusterCount = countOfClusters;
     _bytesPerCluster = bpb.fat16.BPB_SecPerClus * _bytesPerSector;
     _fat16_firstRootDirSector = bpb.fat16.BPB_RsvdSecCnt + (bpb.fat16.BPB_NumFATs * bpb.fat16.BPB_FATSz16);
     _fat32_firstRootDirCluster = bpb.fat32.BPB_RootClus;
 
-    if (!_bytesPerSector)
-        _type = EXFAT;
-    else if (countOfClusters < 4085)
+    if (countOfClusters < 4085)
+    {
         _type = FAT12;
+        _entryMask = FatEntry<FAT12>::mask;
+    }
     else if (countOfClusters < 65525)
+    {
         _type = FAT16;
+        _entryMask = FatEntry<FAT16>::mask;
+    }
     else
+    {
         _type = FAT32;
+        _entryMask = FatEntry<FAT32>::mask;
+    }
 
-    if (_type == FAT12)
-        throw std::runtime_error("FAT12 file system not supported");
-    if (_type == EXFAT)
-        throw std::runtime_error("exFAT file system not supported");
     if (_bytesPerSector % 4)
         throw std::runtime_error("FAT file system: invalid bytes per sector");
 
@@ -60,7 +143,7 @@ DeviceWrapperFatPartition::DeviceWrapperFatPartition(DeviceWrapper *dw, quint64
         _fatStartOffset.append(_firstFatStartOffset + (i * _fatSize * _bytesPerSector));
     }
 
-    if (_type == FAT16)
+    if (_type != FAT32)
     {
         _fat32_fsinfoSector = 0;
         _clusterOffset = (_fat16_firstRootDirSector+_fat16_rootDirSectors) * _bytesPerSector;
@@ -72,48 +155,168 @@ DeviceWrapperFatPartition::DeviceWrapperFatPartition(DeviceWrapper *dw, quint64
     }
 }
 
-uint32_t DeviceWrapperFatPartition::allocateCluster()
+/* Reads the first FAT in one go. It is small enough to keep in memory */
+void DeviceWrapperFatPartition::loadFAT()
 {
-    char sector[_bytesPerSector];
-    int bytesPerEntry = (_type == FAT16 ? 2 : 4);
-    int entriesPerSector = _bytesPerSector/bytesPerEntry;
-    uint32_t cluster;
-    uint16_t *f16 = (uint16_t *) &sector;
-    uint32_t *f32 = (uint32_t *) &sector;
+    QByteArray fat(_fatSize * _bytesPerSector, 0);
+    pread(fat.data(), fat.size(), _firstFatStartOffset);
 
-    seek(_firstFatStartOffset);
+    switch (_type)
+    {
+    case FAT12:
+        decodeFAT<FAT12>(fat, _clusterCount+2, _fat);
+        break;
+    case FAT16:
+        decodeFAT<FAT16>(fat, _clusterCount+2, _fat);
+        break;
+    case FAT32:
+        decodeFAT<FAT32>(fat, _clusterCount+2, _fat);
+        break;
+    case EXFAT:
+        decodeFAT<EXFAT>(fat, _clusterCount+2, _fat);
+        break;
+    }
+}
 
-    for (int i = 0; i < _fatSize; i++)
+/* Builds the free cluster bitmap from the FAT */
+void DeviceWrapperFatPartition::loadFreeClusters()
+{
+    if (_type == EXFAT)
     {
-        read(sector, sizeof(sector));
+        /* exFAT has an allocation bitmap instead, bit set is cluster in use */
+        if (!_dirIndexed)
+            exfatIndexDir();
 
-        for (int j=0; j < entriesPerSector; j++)
+        QByteArray bitmap((_clusterCount+7)/8, 0);
+        readClusters(_exfatBitmapClusters, bitmap.data(), bitmap.size());
+
+        _freeClusters.resize(_clusterCount+2);
+        for (uint32_t i = 2; i < _clusterCount+2; i++)
         {
-            if (_type == FAT16)
-            {
-                if (f16[j] == 0)
-                {
-                    /* Found available FAT16 cluster, mark it used/EOF */
-                    cluster = j+i*entriesPerSector;
-                    setFAT16(cluster, 0xFFFF);
-                    return cluster;
-                }
-            }
-            else
-            {
-                if ( (f32[j] & 0x0FFFFFFF) == 0)
-                {
-                    /* Found available FAT32 cluster, mark it used/EOF */
-                    cluster = j+i*entriesPerSector;
-                    setFAT32(cluster, 0xFFFFFFF);
-                    updateFSinfo(-1, cluster);
-                    return cluster;
-                }
-            }
+            _freeClusters.setBit(i, !(bitmap[(i-2)/8] & (1 << ((i-2)%8))));
         }
+        return;
+    }
+
+    if (_fat.isEmpty())
+        loadFAT();
+
+    uint32_t entries = _fat.size();
+    const uint32_t *fat = _fat.constData();
+    _freeClusters.resize(entries);
+    for (uint32_t i = 2; i < entries; i++)
+    {
+        _freeClusters.setBit(i, (fat[i] & _entryMask) == 0);
     }
 
-    throw std::runtime_error("Out of disk space on FAT partition");
+    if (_fat32_fsinfoSector)
+    {
+        /* Start searching where the last writer of the file system left off */
+        struct FSInfo fsinfo;
+        pread((char *) &fsinfo, sizeof(fsinfo), _fat32_fsinfoSector * _bytesPerSector);
+        if (fsinfo.FSI_Nxt_Free >= 2 && fsinfo.FSI_Nxt_Free < entries)
+            _allocCursor = fsinfo.FSI_Nxt_Free;
+    }
+}
+
+/* Returns the first cluster of a run of count free clusters, or 0 if there is none */
+uint32_t DeviceWrapperFatPartition::findFreeClusters(uint32_t count)
+{
+    uint32_t entries = _freeClusters.size(), runStart = 0, runLength = 0;
+    uint32_t cluster = (_allocCursor < entries) ? _allocCursor : 2;
+    const uchar *bits = (const uchar *) _freeClusters.bits();
+
+    for (uint32_t i = 2; i < entries; i++, cluster++)
+    {
+        if (cluster == entries)
+        {
+            /* Wrap around. A run cannot continue past the end */
+            cluster = 2;
+            runLength = 0;
+        }
+
+        /* Clusters in use are passed over 64 at a time, a well filled file system has long stretches of them */
+        if (cluster % 64 == 0 && cluster+64 <= entries && i+64 <= entries
+                && !qFromLittleEndian<quint64>(bits + cluster/8))
+        {
+            runLength = 0;
+            i += 63;
+            cluster += 63;
+            continue;
+        }
+
+        if (!_freeClusters.testBit(cluster))
+        {
+            runLength = 0;
+            continue;
+        }
+        if (!runLength++)
+            runStart = cluster;
+        if (runLength == count)
+            return runStart;
+    }
+
+    return 0;
+}
+
+uint32_t DeviceWrapperFatPartition::allocateCluster()
+{
+    if (_freeClusters.isEmpty())
+        loadFreeClusters();
+
+    uint32_t cluster = findFreeClusters(1);
+    if (!cluster)
+        throw std::runtime_error("Out of disk space on FAT partition");
+
+    /* Mark it used/EOF */
+    setFAT(cluster, endOfChain());
+    _allocCursor = cluster+1;
+    updateFSinfo(-1, _allocCursor < (uint32_t) _freeClusters.size() ? _allocCursor : 2);
+
+    return cluster;
+}
+
+/* Allocates count clusters chained after previousCluster (if not 0).
+   Contiguous if there is room, so the file does not get fragmented */
+QList<uint32_t> DeviceWrapperFatPartition::allocateClusters(int count, uint32_t previousCluster)
+{
+    QList<uint32_t> clusters;
+
+    if (count <= 0)
+        return clusters;
+    if (_freeClusters.isEmpty())
+        loadFreeClusters();
+
+    uint32_t first = findFreeClusters(count);
+    if (!first)
+    {
+        /* No run that long. Take free clusters wherever they are */
+        for (int i = 0; i < count; i++)
+        {
+            previousCluster = allocateCluster(previousCluster);
+            clusters.append(previousCluster);
+        }
+
+        return clusters;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t cluster = first+i;
+        clusters.append(cluster);
+
+        if (i == count-1)
+            setFAT(cluster, endOfChain());
+        else
+            setFAT(cluster, cluster+1);
+    }
+    if (previousCluster)
+        setFAT(previousCluster, first);
+
+    _allocCursor = first+count;
+    updateFSinfo(-count, _allocCursor < (uint32_t) _freeClusters.size() ? _allocCursor : 2);
+
+    return clusters;
 }
 
 uint32_t DeviceWrapperFatPartition::allocateCluster(uint32_t previousCluster)
@@ -121,47 +324,80 @@ uint32_t DeviceWrapperFatPartition::allocateCluster(uint32_t previousCluster)
     uint32_t newCluster = allocateCluster();
 
     if (previousCluster)
+        setFAT(previousCluster, newCluster);
+
+    return newCluster;
+}
+
+void DeviceWrapperFatPartition::setFAT12(uint16_t cluster, uint16_t value)
+{
+    uint16_t entry;
+
+    if (cluster < _freeClusters.size())
+        _freeClusters.setBit(cluster, value == 0);
+    if (cluster < _fat.size())
+        _fat[cluster] = value & 0xFFF;
+
+    /* Modify all FATs (usually 2). Entries share a byte with their neighbour */
+    for (auto fatStart : std::as_const(_fatStartOffset))
     {
-        if (_type == FAT16)
-            setFAT16(previousCluster, newCluster);
+        pread((char *) &entry, 2, fatStart + cluster + cluster/2);
+        if (cluster & 1)
+            entry = (entry & 0x000F) | (value << 4);
         else
-            setFAT32(previousCluster, newCluster);
-    }
+            entry = (entry & 0xF000) | (value & 0xFFF);
 
-    return newCluster;
+        pwrite((char *) &entry, 2, fatStart + cluster + cluster/2);
+    }
 }
 
 void DeviceWrapperFatPartition::setFAT16(uint16_t cluster, uint16_t value)
 {
+    if (cluster < _freeClusters.size())
+        _freeClusters.setBit(cluster, value == 0);
+    if (cluster < _fat.size())
+        _fat[cluster] = value;
+
     /* Modify all FATs (usually 2) */
     for (auto fatStart : std::as_const(_fatStartOffset))
     {
-        seek(fatStart + cluster * 2);
-        write((char *) &value, 2);
+        pwrite((char *) &value, 2, fatStart + cluster * 2);
     }
 }
 
 void DeviceWrapperFatPartition::setFAT32(uint32_t cluster, uint32_t value)
 {
-    uint32_t prev_value, reserved_bits;
+    if (_fat.isEmpty())
+        loadFAT();
+    if (cluster >= (uint32_t) _fat.size())
+        throw std::runtime_error("FAT32: cluster number out of range");
+    if (cluster < (uint32_t) _freeClusters.size())
+        _freeClusters.setBit(cluster, (value & 0x0FFFFFFF) == 0);
 
-    /* Modify all FATs (usually 2) */
-    for (auto fatStart : std::as_const(_fatStartOffset))
+    if (_type == EXFAT)
+    {
+        /* All 32 bits are used. Allocation is tracked separately */
+        exfatSetAllocated(cluster, value != 0);
+    }
+    else
     {
         /* Spec (p. 16) mentions we must preserve high 4 bits of FAT32 FAT entry when modifiying */
-        seek(fatStart + cluster * 4);
-        read( (char *) &prev_value, 4);
-        reserved_bits = prev_value & 0xF0000000;
-        value |= reserved_bits;
+        value = (value & 0x0FFFFFFF) | (_fat[cluster] & 0xF0000000);
+    }
+    _fat[cluster] = value;
 
-        seek(fatStart + cluster * 4);
-        write((char *) &value, 4);
+    /* Modify all FATs (usually 2) */
+    for (auto fatStart : std::as_const(_fatStartOffset))
+    {
+        pwrite((char *) &value, 4, fatStart + cluster * 4);
     }
 }
 
 void DeviceWrapperFatPartition::setFAT(uint32_t cluster, uint32_t value)
 {
-    if (_type == FAT16)
+    if (_type == FAT12)
+        setFAT12(cluster, value);
+    else if (_type == FAT16)
         setFAT16(cluster, value);
     else
         setFAT32(cluster, value);
@@ -169,19 +405,27 @@ void DeviceWrapperFatPartition::setFAT(uint32_t cluster, uint32_t value)
 
 uint32_t DeviceWrapperFatPartition::getFAT(uint32_t cluster)
 {
-    if (_type == FAT16)
-    {
-        uint16_t result;
-        seek(_firstFatStartOffset + cluster * 2);
-        read((char *) &result, 2);
-        return result;
-    }
-    else
+    if (_fat.isEmpty())
+        loadFAT();
+    if (cluster >= (uint32_t) _fat.size())
+        throw std::runtime_error("Corrupt file system. Cluster number out of range");
+
+    return _fat[cluster] & _entryMask;
+}
+
+/* Value marking the last cluster of a chain */
+uint32_t DeviceWrapperFatPartition::endOfChain() const
+{
+    switch (_type)
     {
-        uint32_t result;
-        seek(_firstFatStartOffset + cluster * 4);
-        read((char *) &result, 4);
-        return result & 0x0FFFFFFF;
+    case FAT12:
+        return 0xFFF;
+    case FAT16:
+        return 0xFFFF;
+    case FAT32:
+        return 0xFFFFFFF;
+    default:
+        return 0xFFFFFFFF;
     }
 }
 
@@ -189,80 +433,99 @@ QList<uint32_t> DeviceWrapperFatPartition::getClusterChain(uint32_t firstCluster
 {
     QList<uint32_t> list;
     uint32_t cluster = firstCluster;
+    QBitArray visited;
+
+    if (_fat.isEmpty())
+        loadFAT();
+    visited.resize(_fat.size());
+    const uint32_t eoc = endOfChain() & ~7U;
 
     while (true)
     {
-        if ( (_type == FAT16 && cluster > 0xFFF7)
-             || (_type == FAT32 && cluster > 0xFFFFFF7))
+        if (cluster >= eoc)
         {
             /* Reached EOF */
             break;
         }
 
-        if (list.contains(cluster))
+        if (cluster < 2 || cluster >= (uint32_t) visited.size())
+            throw std::runtime_error("Corrupt file system. Cluster number out of range");
+        if (visited.testBit(cluster))
             throw std::runtime_error("Corrupt file system. Circular references in FAT table");
 
+        visited.setBit(cluster);
         list.append(cluster);
-        cluster = getFAT(cluster);
+        /* In range, visited is as large as the FAT */
+        cluster = _fat[cluster] & _entryMask;
     }
 
     return list;
 }
 
-void DeviceWrapperFatPartition::seekCluster(uint32_t cluster)
+QList<QPair<uint32_t, uint32_t> > DeviceWrapperFatPartition::getClusterRuns(const QList<uint32_t> &clusterList)
 {
-    seek(_clusterOffset + (cluster-2)*_bytesPerCluster);
+    QList<QPair<uint32_t, uint32_t> > runs;
+
+    for (uint32_t cluster : clusterList)
+    {
+        if (!runs.isEmpty() && runs.last().first + runs.last().second == cluster)
+            runs.last().second++;
+        else
+            runs.append(qMakePair(cluster, (uint32_t) 1));
+    }
+
+    return runs;
 }
 
-bool DeviceWrapperFatPartition::fileExists(const QString &filename)
+void DeviceWrapperFatPartition::seekCluster(uint32_t cluster)
 {
-    struct dir_entry entry;
-    return getDirEntry(filename, &entry);
+    seek(clusterPos(cluster));
 }
 
-QByteArray DeviceWrapperFatPartition::readFile(const QString &filename)
+quint64 DeviceWrapperFatPartition::clusterPos(uint32_t cluster) const
 {
-    struct dir_entry entry;
-
-    if (!getDirEntry(filename, &entry))
-        return QByteArray(); /* File not found */
+    return _clusterOffset + (quint64) (cluster-2)*_bytesPerCluster;
+}
 
-    uint32_t firstCluster = entry.DIR_FstClusLO;
-    if (_type == FAT32)
-        firstCluster |= (entry.DIR_FstClusHI << 16);
-    QList<uint32_t> clusterList = getClusterChain(firstCluster);
-    uint32_t len = entry.DIR_FileSize, pos = 0;
-    QByteArray result(len, 0);
+void DeviceWrapperFatPartition::readClusters(const QList<uint32_t> &clusterList, char *data, quint64 len)
+{
+    quint64 pos = 0;
 
-    for (uint32_t cluster : std::as_const(clusterList))
+    /* One read for every contiguous run of clusters */
+    for (const auto &run : getClusterRuns(clusterList))
     {
-        seekCluster(cluster);
-        read(result.data()+pos, qMin(_bytesPerCluster, len-pos));
-
-        pos += _bytesPerCluster;
         if (pos >= len)
             break;
-    }
 
-    return result;
+        pread(data+pos, qMin((quint64) run.second * _bytesPerCluster, len-pos), clusterPos(run.first));
+        pos += (quint64) run.second * _bytesPerCluster;
+    }
 }
 
-void DeviceWrapperFatPartition::writeFile(const QString &filename, const QByteArray &contents)
+void DeviceWrapperFatPartition::writeClusters(const QList<uint32_t> &clusterList, const QByteArray &contents)
 {
-    QList<uint32_t> clusterList;
-    uint32_t pos = 0;
-    uint32_t firstCluster;
-    int clustersNeeded = (contents.length() + _bytesPerCluster - 1) / _bytesPerCluster;
-    struct dir_entry entry;
+    quint64 pos = 0, len = contents.length();
 
-    getDirEntry(filename, &entry, true);
-    firstCluster = entry.DIR_FstClusLO;
-    if (_type == FAT32)
-        firstCluster |= (entry.DIR_FstClusHI << 16);
+    /* One write for every contiguous run of clusters */
+    for (const auto &run : getClusterRuns(clusterList))
+    {
+        if (pos >= len)
+            break;
 
-    if (firstCluster)
-        clusterList = getClusterChain(firstCluster);
+        pwrite(contents.data()+pos, qMin((quint64) run.second * _bytesPerCluster, len-pos), clusterPos(run.first));
+        pos += (quint64) run.second * _bytesPerCluster;
+    }
+
+    if (!clusterList.isEmpty() && len % _bytesPerCluster)
+    {
+        /* Zero out last cluster tip */
+        QByteArray zeroes(_bytesPerCluster - (len % _bytesPerCluster), 0);
+        pwrite(zeroes.data(), zeroes.length(), clusterPos(clusterList.last()) + len % _bytesPerCluster);
+    }
+}
 
+void DeviceWrapperFatPartition::resizeClusterChain(QList<uint32_t> &clusterList, int clustersNeeded)
+{
     if (clusterList.length() < clustersNeeded)
     {
         /* We need to allocate more clusters */
@@ -272,11 +535,7 @@ void DeviceWrapperFatPartition::writeFile(const QString &filename, const QByteAr
         if (!clusterList.isEmpty())
             lastCluster = clusterList.last();
 
-        for (int i = 0; i < extraClustersNeeded; i++)
-        {
-            lastCluster = allocateCluster(lastCluster);
-            clusterList.append(lastCluster);
-        }
+        clusterList.append(allocateClusters(extraClustersNeeded, lastCluster));
     }
     else if (clusterList.length() > clustersNeeded)
     {
@@ -291,8 +550,7 @@ void DeviceWrapperFatPartition::writeFile(const QString &filename, const QByteAr
 
             /* Zero out previous data in excess clusters,
                just in case someone wants to take a disk image later */
-            seekCluster(clusterToRemove);
-            write(zeroes.data(), zeroes.length());
+            pwrite(zeroes.data(), zeroes.length(), clusterPos(clusterToRemove));
 
             /* Mark cluster available again in FAT */
             setFAT(clusterToRemove, 0);
@@ -300,41 +558,78 @@ void DeviceWrapperFatPartition::writeFile(const QString &filename, const QByteAr
         updateFSinfo(clustersToRemove, clusterToRemove);
 
         if (!clusterList.isEmpty())
-        {
-            if (_type == FAT16)
-                setFAT16(clusterList.last(), 0xFFFF);
-            else
-                setFAT32(clusterList.last(), 0xFFFFFFF);
-        }
+            setFAT(clusterList.last(), endOfChain());
     }
+}
 
-    //qDebug() << "First cluster:" << firstCluster << "Clusters:" << clusterList;
+bool DeviceWrapperFatPartition::fileExists(const QString &filename)
+{
+    struct dir_entry entry;
 
-    /* Write file data */
-    for (uint32_t cluster : std::as_const(clusterList))
+    if (_type == EXFAT)
     {
-        seekCluster(cluster);
-        write(contents.data()+pos, qMin((qsizetype)_bytesPerCluster, (qsizetype)(contents.length()-pos)));
-
-        pos += _bytesPerCluster;
-        if (pos >= contents.length())
-            break;
+        if (!_dirIndexed)
+            exfatIndexDir();
+        return _dirIndex.contains(exfatUpcase(filename));
     }
 
-    if (clustersNeeded && contents.length() % _bytesPerCluster)
+    return getDirEntry(filename, &entry);
+}
+
+QByteArray DeviceWrapperFatPartition::readFile(const QString &filename)
+{
+    struct dir_entry entry;
+
+    if (_type == EXFAT)
+        return exfatReadFile(filename);
+
+    if (!getDirEntry(filename, &entry))
+        return QByteArray(); /* File not found */
+
+    uint32_t firstCluster = entry.DIR_FstClusLO;
+    if (_type == FAT32)
+        firstCluster |= (entry.DIR_FstClusHI << 16);
+    /* Empty files have no clusters */
+    if (!firstCluster)
+        return QByteArray();
+    QList<uint32_t> clusterList = getClusterChain(firstCluster);
+    QByteArray result(entry.DIR_FileSize, 0);
+
+    readClusters(clusterList, result.data(), result.size());
+
+    return result;
+}
+
+void DeviceWrapperFatPartition::writeFile(const QString &filename, const QByteArray &contents)
+{
+    QList<uint32_t> clusterList;
+    uint32_t firstCluster;
+    int clustersNeeded = (contents.length() + _bytesPerCluster - 1) / _bytesPerCluster;
+    struct dir_entry entry;
+
+    if (_type == EXFAT)
     {
-        /* Zero out last cluster tip */
-        uint32_t extraBytesAtEndOfCluster = _bytesPerCluster - (contents.length() % _bytesPerCluster);
-        if (extraBytesAtEndOfCluster)
-        {
-            QByteArray zeroes(extraBytesAtEndOfCluster, 0);
-            write(zeroes.data(), zeroes.length());
-        }
+        exfatWriteFile(filename, contents);
+        return;
     }
 
+    getDirEntry(filename, &entry, true);
+    firstCluster = entry.DIR_FstClusLO;
+    if (_type == FAT32)
+        firstCluster |= (entry.DIR_FstClusHI << 16);
+
+    if (firstCluster)
+        clusterList = getClusterChain(firstCluster);
+
+    resizeClusterChain(clusterList, clustersNeeded);
+
+    //qDebug() << "First cluster:" << firstCluster << "Clusters:" << clusterList;
+
+    writeClusters(clusterList, contents);
+
     /* Update directory entry */
     if (clusterList.isEmpty())
-        firstCluster = (_type == FAT16 ? 0xFFFF : 0xFFFFFFF);
+        firstCluster = endOfChain();
     else
         firstCluster = clusterList.first();
 
@@ -358,19 +653,22 @@ inline QByteArray _dirEntryToShortName(struct dir_entry *entry)
         return base+"."+ext;
 }
 
-bool DeviceWrapperFatPartition::getDirEntry(const QString &longFilename, struct dir_entry *entry, bool createIfNotExist)
+/* Scans the root directory once, so lookups do not have to */
+void DeviceWrapperFatPartition::indexDir()
 {
-    QString filenameRead, longFilenameLower = longFilename.toLower();
+    struct dir_entry entry;
+    QString filenameRead;
 
-    if (longFilename.isEmpty())
-        throw std::runtime_error("Filename cannot not be empty");
+    _dirIndex.clear();
+    _shortNameIndex.clear();
 
     openDir();
-    while (readDir(entry))
+    quint64 entryOffset = _offset;
+    while (readDir(&entry))
     {
-        if (entry->DIR_Attr & ATTR_LONG_NAME)
+        if (entry.DIR_Attr & ATTR_LONG_NAME)
         {
-            struct longfn_entry *l = (struct longfn_entry *) entry;
+            struct longfn_entry *l = (struct longfn_entry *) &entry;
             /* A part can have 13 UTF-16 characters */
             char lnamePartStr[26] = {0};
              /* Using memcpy() because it has no problems accessing unaligned struct members */
@@ -382,91 +680,69 @@ bool DeviceWrapperFatPartition::getDirEntry(const QString &longFilename, struct
         }
         else
         {
-            if (entry->DIR_Name[0] != 0xE5)
+            QByteArray shortName((char *) entry.DIR_Name, sizeof(entry.DIR_Name));
+            if (!_shortNameIndex.contains(shortName))
+                _shortNameIndex.insert(shortName, entryOffset);
+
+            if (entry.DIR_Name[0] != 0xE5)
             {
                 if (filenameRead.indexOf(QChar::Null))
                     filenameRead.truncate(filenameRead.indexOf(QChar::Null));
 
-                //qDebug() << "Long filename:" << filenameRead << "DIR_Name:" << QByteArray((char *) entry->DIR_Name, sizeof(entry->DIR_Name)) << "Short:" << _dirEntryToShortName(entry);
+                //qDebug() << "Long filename:" << filenameRead << "DIR_Name:" << shortName << "Short:" << _dirEntryToShortName(&entry);
 
-                if (filenameRead.toLower() == longFilenameLower || (filenameRead.isEmpty() && _dirEntryToShortName(entry) == longFilenameLower))
-                {
-                    return true;
-                }
+                /* First match wins, as with a linear search */
+                QString name = filenameRead.isEmpty() ? QString(_dirEntryToShortName(&entry)) : filenameRead.toLower();
+                if (!_dirIndex.contains(name))
+                    _dirIndex.insert(name, entryOffset);
             }
 
             filenameRead.clear();
         }
+
+        entryOffset = _offset;
     }
 
-    if (createIfNotExist)
-    {
-        QByteArray shortFilename;
-        uint8_t shortFileNameChecksum = 0;
-        struct longfn_entry longEntry;
+    /* readDir() left us at the end-of-directory marker */
+    _dirEndOffset = _offset;
+    _dirEndCluster = _fat32_currentRootDirCluster;
+    _dirEndClusters = _currentDirClusters;
+    _dirIndexed = true;
+}
 
-        if (longFilename.count(".") == 1)
-        {
-            QList<QByteArray> fnParts = longFilename.toLatin1().toUpper().split('.');
-            shortFilename = fnParts[0].leftJustified(8, ' ', true)+fnParts[1].leftJustified(3, ' ', true);
-        }
-        else
-        {
-            shortFilename = longFilename.toLatin1().leftJustified(11, ' ', true);
-        }
+void DeviceWrapperFatPartition::seekDirEnd()
+{
+    _offset = _dirEndOffset;
+    _fat32_currentRootDirCluster = _dirEndCluster;
+    _currentDirClusters = _dirEndClusters;
+}
 
-        /* Verify short file name has not been taken yet, and if not try inserting numbers into the name */
-        if (dirNameExists(shortFilename))
-        {
-            for (int i=0; i<100; i++)
-            {
-                shortFilename = shortFilename.left( (i < 10 ? 7 : 6) )+QByteArray::number(i)+shortFilename.right(3);
+bool DeviceWrapperFatPartition::getDirEntry(const QString &longFilename, struct dir_entry *entry, bool createIfNotExist)
+{
+    QString longFilenameLower = longFilename.toLower();
 
-                if (!dirNameExists(shortFilename))
-                {
-                    break;
-                }
-                else if (i == 99)
-                {
-                    throw std::runtime_error("Error finding available short filename");
-                }
-            }
-        }
+    if (longFilename.isEmpty())
+        throw std::runtime_error("Filename cannot not be empty");
 
-        for(int i = 0; i < shortFilename.length(); i++)
-        {
-            shortFileNameChecksum = ((shortFileNameChecksum & 1) ? 0x80 : 0) + (shortFileNameChecksum >> 1) + shortFilename[i];
-        }
+    if (!_dirIndexed)
+        indexDir();
 
-        QString longFilenameWithNull = longFilename + QChar::Null;
-        char *longFilenameStr = (char *) longFilenameWithNull.utf16();
-        int lenBytes = longFilenameWithNull.length() * 2;
-        int lfnFragments = (lenBytes + 25) / 26;
+    auto it = _dirIndex.constFind(longFilenameLower);
+    if (it != _dirIndex.cend())
+    {
+        pread((char *) entry, sizeof(*entry), it.value());
+        return true;
+    }
 
-        /* long file name directory entries are added in reverse order before the 8.3 entry */
-        for (int i = lfnFragments; i > 0; i--)
-        {
-            memset(&longEntry, 0xff, sizeof(longEntry));
-            longEntry.LDIR_Attr = ATTR_LONG_NAME;
-            longEntry.LDIR_Chksum = shortFileNameChecksum;
-            longEntry.LDIR_Ord = (i == lfnFragments) ? (LAST_LONG_ENTRY | i) : i;
-            longEntry.LDIR_FstClusLO = 0;
-            longEntry.LDIR_Type = 0;
-
-            size_t start = (i-1) * 26;
-            memcpy(longEntry.LDIR_Name1, longFilenameStr+start, qMin(lenBytes-start, sizeof(longEntry.LDIR_Name1)));
-            start += sizeof(longEntry.LDIR_Name1);
-            if (start < lenBytes)
-            {
-                memcpy(longEntry.LDIR_Name2, longFilenameStr+start, qMin(lenBytes-start, sizeof(longEntry.LDIR_Name2)));
-                start += sizeof(longEntry.LDIR_Name2);
-                if (start < lenBytes)
-                {
-                    memcpy(longEntry.LDIR_Name3, longFilenameStr+start, qMin(lenBytes-start, sizeof(longEntry.LDIR_Name3)));
-                }
-            }
+    if (createIfNotExist)
+    {
+        QByteArray shortFilename = makeShortFilename(longFilename, _shortNameIndex);
+        QByteArray longEntries = longFilenameEntries(longFilename, shortFilename);
 
-            writeDirEntryAtCurrentPos((struct dir_entry *) &longEntry);
+        seekDirEnd();
+        for (int i = 0; i < longEntries.size(); i += sizeof(struct longfn_entry))
+        {
+            writeDirEntryAtCurrentPos((struct dir_entry *) (longEntries.data()+i));
         }
 
         memset(entry, 0, sizeof(*entry));
@@ -476,60 +752,122 @@ bool DeviceWrapperFatPartition::getDirEntry(const QString &longFilename, struct
         entry->DIR_CrtTime = QTimeToFATtime( QTime::currentTime() );
 
         writeDirEntryAtCurrentPos(entry);
+        _dirIndex.insert(longFilenameLower, _shortNameIndex.value(shortFilename));
 
         /* Add an end-of-directory marker after our newly appended file */
         struct dir_entry endOfDir = {0};
+        _dirEndOffset = _offset;
+        _dirEndCluster = _fat32_currentRootDirCluster;
+        _dirEndClusters = _currentDirClusters;
         writeDirEntryAtCurrentPos(&endOfDir);
     }
 
     return false;
 }
 
-bool DeviceWrapperFatPartition::dirNameExists(const QByteArray dirname)
+QByteArray DeviceWrapperFatPartition::makeShortFilename(const QString &longFilename, const QHash<QByteArray, quint64> &taken)
 {
-    struct dir_entry entry;
+    QByteArray shortFilename;
 
-    openDir();
-    while (readDir(&entry))
+    if (longFilename.count(".") == 1)
+    {
+        QList<QByteArray> fnParts = longFilename.toLatin1().toUpper().split('.');
+        shortFilename = fnParts[0].leftJustified(8, ' ', true)+fnParts[1].leftJustified(3, ' ', true);
+    }
+    else
+    {
+        shortFilename = longFilename.toLatin1().leftJustified(11, ' ', true);
+    }
+
+    /* Verify short file name has not been taken yet, and if not try inserting numbers into the name */
+    if (taken.contains(shortFilename))
     {
-        if (!(entry.DIR_Attr & ATTR_LONG_NAME)
-                && dirname == QByteArray((char *) entry.DIR_Name, sizeof(entry.DIR_Name)))
+        for (int i=0; i<100; i++)
         {
-            return true;
+            shortFilename = shortFilename.left( (i < 10 ? 7 : 6) )+QByteArray::number(i)+shortFilename.right(3);
+
+            if (!taken.contains(shortFilename))
+            {
+                break;
+            }
+            else if (i == 99)
+            {
+                throw std::runtime_error("Error finding available short filename");
+            }
         }
     }
 
-    return false;
+    return shortFilename;
 }
 
-void DeviceWrapperFatPartition::updateDirEntry(struct dir_entry *dirEntry)
+/* Long file name entries that go before the 8.3 entry of shortFilename */
+QByteArray DeviceWrapperFatPartition::longFilenameEntries(const QString &longFilename, const QByteArray &shortFilename)
 {
-    struct dir_entry iterEntry;
+    uint8_t shortFileNameChecksum = 0;
+    struct longfn_entry longEntry;
+    QByteArray result;
 
-    openDir();
-    quint64 oldOffset = _offset;
+    for(int i = 0; i < shortFilename.length(); i++)
+    {
+        shortFileNameChecksum = ((shortFileNameChecksum & 1) ? 0x80 : 0) + (shortFileNameChecksum >> 1) + shortFilename[i];
+    }
 
-    while (readDir(&iterEntry))
+    QString longFilenameWithNull = longFilename + QChar::Null;
+    char *longFilenameStr = (char *) longFilenameWithNull.utf16();
+    int lenBytes = longFilenameWithNull.length() * 2;
+    int lfnFragments = (lenBytes + 25) / 26;
+
+    /* long file name directory entries are added in reverse order before the 8.3 entry */
+    for (int i = lfnFragments; i > 0; i--)
     {
-        /* Look for existing entry with same short filename */
-        if (!(iterEntry.DIR_Attr & ATTR_LONG_NAME)
-                && memcmp(dirEntry->DIR_Name, iterEntry.DIR_Name, sizeof(iterEntry.DIR_Name)) == 0)
+        memset(&longEntry, 0xff, sizeof(longEntry));
+        longEntry.LDIR_Attr = ATTR_LONG_NAME;
+        longEntry.LDIR_Chksum = shortFileNameChecksum;
+        longEntry.LDIR_Ord = (i == lfnFragments) ? (LAST_LONG_ENTRY | i) : i;
+        longEntry.LDIR_FstClusLO = 0;
+        longEntry.LDIR_Type = 0;
+
+        size_t start = (i-1) * 26;
+        memcpy(longEntry.LDIR_Name1, longFilenameStr+start, qMin(lenBytes-start, sizeof(longEntry.LDIR_Name1)));
+        start += sizeof(longEntry.LDIR_Name1);
+        if (start < lenBytes)
         {
-            /* seek() back and write out new entry */
-            _offset = oldOffset;
-            write((char *) dirEntry, sizeof(*dirEntry));
-            return;
+            memcpy(longEntry.LDIR_Name2, longFilenameStr+start, qMin(lenBytes-start, sizeof(longEntry.LDIR_Name2)));
+            start += sizeof(longEntry.LDIR_Name2);
+            if (start < lenBytes)
+            {
+                memcpy(longEntry.LDIR_Name3, longFilenameStr+start, qMin(lenBytes-start, sizeof(longEntry.LDIR_Name3)));
+            }
         }
 
-        oldOffset = _offset;
+        result.append((const char *) &longEntry, sizeof(longEntry));
     }
 
-    throw std::runtime_error("Error locating existing directory entry");
+    return result;
+}
+
+void DeviceWrapperFatPartition::updateDirEntry(struct dir_entry *dirEntry)
+{
+    if (!_dirIndexed)
+        indexDir();
+
+    /* Look for existing entry with same short filename */
+    auto it = _shortNameIndex.constFind(QByteArray((char *) dirEntry->DIR_Name, sizeof(dirEntry->DIR_Name)));
+    if (it == _shortNameIndex.cend())
+        throw std::runtime_error("Error locating existing directory entry");
+
+    pwrite((char *) dirEntry, sizeof(*dirEntry), it.value());
 }
 
 void DeviceWrapperFatPartition::writeDirEntryAtCurrentPos(struct dir_entry *dirEntry)
 {
     //qDebug() << "Write new entry" << QByteArray((char *) dirEntry->DIR_Name, 11);
+    if (dirEntry->DIR_Name[0] && !(dirEntry->DIR_Attr & ATTR_LONG_NAME))
+    {
+        QByteArray shortName((char *) dirEntry->DIR_Name, sizeof(dirEntry->DIR_Name));
+        if (!_shortNameIndex.contains(shortName))
+            _shortNameIndex.insert(shortName, _offset);
+    }
     write((char *) dirEntry, sizeof(*dirEntry));
 
     if (_type == FAT32)
@@ -566,7 +904,7 @@ void DeviceWrapperFatPartition::writeDirEntryAtCurrentPos(struct dir_entry *dirE
 void DeviceWrapperFatPartition::openDir()
 {
     /* Seek to start of root directory */
-    if (_type == FAT16)
+    if (_type != FAT32)
     {
         seek(_fat16_firstRootDirSector * _bytesPerSector);
     }
@@ -631,8 +969,7 @@ void DeviceWrapperFatPartition::updateFSinfo(int deltaClusters, uint32_t nextFre
     if (!_fat32_fsinfoSector)
         return;
 
-    seek(_fat32_fsinfoSector * _bytesPerSector);
-    read((char *) &fsinfo, sizeof(fsinfo));
+    pread((char *) &fsinfo, sizeof(fsinfo), _fat32_fsinfoSector * _bytesPerSector);
 
     if (fsinfo.FSI_LeadSig[0] != 0x52 || fsinfo.FSI_LeadSig[1] != 0x52
             || fsinfo.FSI_LeadSig[2] != 0x61 || fsinfo.FSI_LeadSig[3] != 0x41
@@ -654,8 +991,208 @@ void DeviceWrapperFatPartition::updateFSinfo(int deltaClusters, uint32_t nextFre
         fsinfo.FSI_Nxt_Free = nextFreeClusterHint;
     }
 
-    seek(_fat32_fsinfoSector * _bytesPerSector);
-    write((char *) &fsinfo, sizeof(fsinfo));
+    pwrite((char *) &fsinfo, sizeof(fsinfo), _fat32_fsinfoSector * _bytesPerSector);
+}
+
+inline QString _parentPath(const QString &path)
+{
+    int slash = path.lastIndexOf('/');
+
+    return (slash == -1) ? QString() : path.left(slash);
+}
+
+void DeviceWrapperFatPartition::addDirectory(const QString &path)
+{
+    QString dirPath = path;
+
+    if (_type == EXFAT)
+        throw std::runtime_error("Writing directories is not supported on exFAT");
+
+    while (dirPath.endsWith('/'))
+        dirPath.chop(1);
+    if (dirPath.isEmpty() || _tree.contains(dirPath))
+        return;
+
+    QString parent = _parentPath(dirPath);
+    if (!parent.isEmpty())
+        addDirectory(parent);
+
+    freeTreeEntry(parent, dirPath.mid(dirPath.lastIndexOf('/')+1));
+    _tree[parent].append({dirPath.mid(dirPath.lastIndexOf('/')+1), true, 0, 0});
+    _tree.insert(dirPath, QList<TreeEntry>());
+}
+
+/* Forget about an earlier file with the same name in the tree, so the last one wins */
+void DeviceWrapperFatPartition::freeTreeEntry(const QString &parent, const QString &name)
+{
+    QList<TreeEntry> &entries = _tree[parent];
+
+    for (int i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].isDirectory || entries[i].name.compare(name, Qt::CaseInsensitive))
+            continue;
+
+        if (entries[i].firstCluster)
+        {
+            QList<uint32_t> clusterList = getClusterChain(entries[i].firstCluster);
+            resizeClusterChain(clusterList, 0);
+        }
+        entries.removeAt(i);
+        break;
+    }
+}
+
+void DeviceWrapperFatPartition::beginFile(const QString &path, quint64 size)
+{
+    if (_type == EXFAT)
+        throw std::runtime_error("Writing directories is not supported on exFAT");
+    if (_filePos != _fileSize)
+        throw std::runtime_error("Previous file was not written completely");
+    if (size > 0xFFFFFFFF)
+        throw std::runtime_error("File too large for FAT file system");
+
+    QString parent = _parentPath(path);
+    QString name = path.mid(path.lastIndexOf('/')+1);
+    if (name.isEmpty())
+        throw std::runtime_error("Filename cannot not be empty");
+    if (!parent.isEmpty())
+        addDirectory(parent);
+    freeTreeEntry(parent, name);
+
+    QList<uint32_t> clusterList = allocateClusters((size + _bytesPerCluster - 1) / _bytesPerCluster, 0);
+    _fileRuns = getClusterRuns(clusterList);
+    _fileRun = 0;
+    _fileRunPos = _filePos = 0;
+    _fileSize = size;
+
+    _tree[parent].append({name, false, clusterList.isEmpty() ? 0 : clusterList.first(), size});
+}
+
+void DeviceWrapperFatPartition::writeFileData(const char *data, quint64 len)
+{
+    if (len > _fileSize - _filePos)
+        throw std::runtime_error("More file data than announced");
+
+    while (len)
+    {
+        const auto &run = _fileRuns[_fileRun];
+        quint64 runBytes = (quint64) run.second * _bytesPerCluster;
+        quint64 n = qMin(len, runBytes - _fileRunPos);
+
+        pwrite(data, n, _clusterOffset + (quint64) (run.first-2)*_bytesPerCluster + _fileRunPos);
+        data += n;
+        len -= n;
+        _filePos += n;
+        _fileRunPos += n;
+
+        if (_fileRunPos == runBytes)
+        {
+            _fileRun++;
+            _fileRunPos = 0;
+        }
+    }
+
+    if (_filePos == _fileSize && _fileRunPos)
+    {
+        /* Zero out last cluster tip */
+        QByteArray zeroes(_bytesPerCluster - (_fileRunPos % _bytesPerCluster), 0);
+        pwrite(zeroes.data(), zeroes.length(), clusterPos(_fileRuns[_fileRun].first) + _fileRunPos);
+    }
+}
+
+void DeviceWrapperFatPartition::initDirEntry(struct dir_entry *entry, const QByteArray &shortFilename, uint8_t attr, uint32_t firstCluster, uint32_t size)
+{
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->DIR_Name, shortFilename.data(), sizeof(entry->DIR_Name));
+    entry->DIR_Attr = attr;
+    entry->DIR_FstClusLO = (firstCluster & 0xFFFF);
+    entry->DIR_FstClusHI = (firstCluster >> 16);
+    entry->DIR_CrtDate = QDateToFATdate( QDate::currentDate() );
+    entry->DIR_CrtTime = QTimeToFATtime( QTime::currentTime() );
+    entry->DIR_WrtDate = entry->DIR_CrtDate;
+    entry->DIR_WrtTime = entry->DIR_CrtTime;
+    entry->DIR_LstAccDate = entry->DIR_CrtDate;
+    entry->DIR_FileSize = size;
+}
+
+void DeviceWrapperFatPartition::finishTree()
+{
+    QHash<QString, QList<uint32_t> > dirClusters;
+    struct dir_entry entry;
+
+    if (_filePos != _fileSize)
+        throw std::runtime_error("Last file was not written completely");
+
+    /* Subdirectories get their clusters first, as entries of their parent refer to them.
+       Room for ".", "..", the long and short name entries and the end-of-directory marker */
+    for (auto it = _tree.cbegin(); it != _tree.cend(); ++it)
+    {
+        if (it.key().isEmpty())
+            continue;
+
+        int entries = 3;
+        for (const TreeEntry &child : it.value())
+            entries += (child.name.length() + 13) / 13 + 1;
+        dirClusters.insert(it.key(), allocateClusters((entries * sizeof(entry) + _bytesPerCluster - 1) / _bytesPerCluster, 0));
+    }
+
+    for (auto it = _tree.cbegin(); it != _tree.cend(); ++it)
+    {
+        if (it.key().isEmpty())
+            continue;
+
+        QByteArray dir;
+        QHash<QByteArray, quint64> taken;
+        QString parent = _parentPath(it.key());
+
+        initDirEntry(&entry, ".          ", ATTR_DIRECTORY, dirClusters[it.key()].first(), 0);
+        dir.append((const char *) &entry, sizeof(entry));
+        /* The root directory is cluster 0 here, also on FAT32 */
+        initDirEntry(&entry, "..         ", ATTR_DIRECTORY, parent.isEmpty() ? 0 : dirClusters[parent].first(), 0);
+        dir.append((const char *) &entry, sizeof(entry));
+
+        for (const TreeEntry &child : it.value())
+        {
+            QString childPath = it.key()+"/"+child.name;
+            QByteArray shortFilename = makeShortFilename(child.name, taken);
+            taken.insert(shortFilename, dir.size());
+
+            dir.append(longFilenameEntries(child.name, shortFilename));
+            if (child.isDirectory)
+                initDirEntry(&entry, shortFilename, ATTR_DIRECTORY, dirClusters[childPath].first(), 0);
+            else
+                initDirEntry(&entry, shortFilename, ATTR_ARCHIVE, child.firstCluster, child.size);
+            dir.append((const char *) &entry, sizeof(entry));
+        }
+        dir.append(QByteArray(sizeof(entry), 0));
+
+        writeClusters(dirClusters[it.key()], dir);
+    }
+
+    /* Root directory entries are added to what is already there */
+    for (const TreeEntry &child : _tree.value(QString()))
+    {
+        if (getDirEntry(child.name, &entry, true))
+        {
+            uint32_t oldCluster = entry.DIR_FstClusLO;
+            if (_type == FAT32)
+                oldCluster |= (entry.DIR_FstClusHI << 16);
+            if (oldCluster >= 2 && oldCluster < _clusterCount+2)
+            {
+                QList<uint32_t> clusterList = getClusterChain(oldCluster);
+                resizeClusterChain(clusterList, 0);
+            }
+        }
+
+        QByteArray shortFilename((char *) entry.DIR_Name, sizeof(entry.DIR_Name));
+        if (child.isDirectory)
+            initDirEntry(&entry, shortFilename, ATTR_DIRECTORY, dirClusters[child.name].first(), 0);
+        else
+            initDirEntry(&entry, shortFilename, ATTR_ARCHIVE, child.firstCluster, child.size);
+        updateDirEntry(&entry);
+    }
+
+    _tree.clear();
 }
 
 uint16_t DeviceWrapperFatPartition::QTimeToFATtime(const QTime &time)
@@ -667,3 +1204,287 @@ uint16_t DeviceWrapperFatPartition::QDateToFATdate(const QDate &date)
 {
     return ((date.year() - 1980) << 9) | (date.month() << 5) | date.day();
 }
+
+/* Reads the root directory into memory, and finds the allocation bitmap, up-case table and files in it */
+void DeviceWrapperFatPartition::exfatIndexDir()
+{
+    _exfatDirClusters = getClusterChain(_fat32_firstRootDirCluster);
+    _exfatDir = QByteArray(_exfatDirClusters.size() * _bytesPerCluster, 0);
+    readClusters(_exfatDirClusters, _exfatDir.data(), _exfatDir.size());
+    _exfatBitmapClusters.clear();
+    _exfatUpcase.clear();
+    _dirIndex.clear();
+    _dirEndOffset = _exfatDir.size();
+
+    /* System entries first, as names cannot be compared without the up-case table */
+    for (int pos = 0; pos < _exfatDir.size(); pos += 32)
+    {
+        const struct exfat_alloc_entry *e = (const struct exfat_alloc_entry *) (_exfatDir.constData()+pos);
+
+        if (!e->EntryType)
+        {
+            _dirEndOffset = pos;
+            break;
+        }
+        else if (e->EntryType == EXFAT_ENTRY_BITMAP && _exfatBitmapClusters.isEmpty())
+        {
+            _exfatBitmapClusters = getClusterChain(e->FirstCluster);
+        }
+        else if (e->EntryType == EXFAT_ENTRY_UPCASE && _exfatUpcase.isEmpty())
+        {
+            QByteArray table(qMin((quint64) e->DataLength, (quint64) 65536*2), 0);
+            readClusters(getClusterChain(e->FirstCluster), table.data(), table.size());
+
+            /* Compressed: 0xFFFF is followed by a number of characters that map to themselves */
+            const uint16_t *t = (const uint16_t *) table.constData();
+            for (int i = 0; i < table.size()/2 && _exfatUpcase.size() < 65536; i++)
+            {
+                if (t[i] == 0xFFFF && i+1 < table.size()/2)
+                {
+                    for (int j = 0; j < t[i+1]; j++)
+                        _exfatUpcase.append((uint16_t) _exfatUpcase.size());
+                    i++;
+                }
+                else
+                {
+                    _exfatUpcase.append(t[i]);
+                }
+            }
+        }
+    }
+
+    if (_exfatBitmapClusters.isEmpty())
+        throw std::runtime_error("exFAT file system: allocation bitmap not found");
+    if (_exfatUpcase.isEmpty())
+        throw std::runtime_error("exFAT file system: up-case table not found");
+
+    for (quint64 pos = 0; pos < _dirEndOffset; pos += 32)
+    {
+        const struct exfat_file_entry *f = (const struct exfat_file_entry *) (_exfatDir.constData()+pos);
+        const struct exfat_stream_entry *s = (const struct exfat_stream_entry *) (f+1);
+
+        if (f->EntryType != EXFAT_ENTRY_FILE || f->SecondaryCount < 2
+                || pos + (f->SecondaryCount+1)*32 > _dirEndOffset || s->EntryType != EXFAT_ENTRY_STREAM)
+            continue;
+
+        QString name;
+        for (int i = 2; i <= f->SecondaryCount && name.length() < s->NameLength; i++)
+        {
+            const struct exfat_name_entry *n = (const struct exfat_name_entry *) (_exfatDir.constData()+pos+i*32);
+            if (n->EntryType != EXFAT_ENTRY_NAME)
+                break;
+            name += QString((const QChar *) n->FileName, 15);
+        }
+        name.truncate(s->NameLength);
+
+        /* First match wins, as with a linear search */
+        QString key = exfatUpcase(name);
+        if (!_dirIndex.contains(key))
+            _dirIndex.insert(key, pos);
+
+        pos += f->SecondaryCount*32;
+    }
+
+    _dirIndexed = true;
+}
+
+/* Writes part of the in-memory root directory back */
+void DeviceWrapperFatPartition::exfatWriteDir(quint64 offset, quint64 len)
+{
+    while (len)
+    {
+        quint64 n = qMin(len, _bytesPerCluster - offset % _bytesPerCluster);
+
+        pwrite(_exfatDir.constData()+offset, n, clusterPos(_exfatDirClusters.at(offset / _bytesPerCluster)) + offset % _bytesPerCluster);
+
+        offset += n;
+        len -= n;
+    }
+}
+
+QString DeviceWrapperFatPartition::exfatUpcase(const QString &name)
+{
+    QString result = name;
+
+    for (QChar &c : result)
+    {
+        if (c.unicode() < _exfatUpcase.size())
+            c = QChar(_exfatUpcase.at(c.unicode()));
+    }
+
+    return result;
+}
+
+uint16_t DeviceWrapperFatPartition::exfatNameHash(const QString &upcasedName)
+{
+    uint16_t hash = 0;
+
+    for (QChar c : upcasedName)
+    {
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c.unicode() & 0xFF);
+        hash = ((hash & 1) ? 0x8000 : 0) + (hash >> 1) + (c.unicode() >> 8);
+    }
+
+    return hash;
+}
+
+/* Checksum of a directory entry set, skipping the checksum field in the first entry */
+uint16_t DeviceWrapperFatPartition::exfatSetChecksum(const char *entries, int count)
+{
+    uint16_t checksum = 0;
+
+    for (int i = 0; i < count*32; i++)
+    {
+        if (i == 2 || i == 3)
+            continue;
+        checksum = ((checksum & 1) ? 0x8000 : 0) + (checksum >> 1) + (uint8_t) entries[i];
+    }
+
+    return checksum;
+}
+
+QList<uint32_t> DeviceWrapperFatPartition::exfatFileClusters(const struct exfat_stream_entry *stream)
+{
+    QList<uint32_t> list;
+
+    if (!stream->FirstCluster)
+        return list;
+
+    if (stream->GeneralSecondaryFlags & EXFAT_FLAG_NO_FAT_CHAIN)
+    {
+        /* Contiguous, the FAT entries are not used */
+        quint64 count = (stream->DataLength + _bytesPerCluster - 1) / _bytesPerCluster;
+
+        if (stream->FirstCluster < 2 || stream->FirstCluster + count > _clusterCount+2)
+            throw std::runtime_error("Corrupt file system. Cluster number out of range");
+        for (quint64 i = 0; i < count; i++)
+            list.append(stream->FirstCluster + i);
+
+        return list;
+    }
+
+    return getClusterChain(stream->FirstCluster);
+}
+
+void DeviceWrapperFatPartition::exfatSetAllocated(uint32_t cluster, bool allocated)
+{
+    uint8_t bits;
+
+    if (!_dirIndexed)
+        exfatIndexDir();
+
+    quint64 byteNr = (cluster-2) / 8;
+    if (cluster < 2 || byteNr / _bytesPerCluster >= (quint64) _exfatBitmapClusters.size())
+        throw std::runtime_error("exFAT: cluster number out of range");
+
+    quint64 offset = clusterPos(_exfatBitmapClusters.at(byteNr / _bytesPerCluster)) + byteNr % _bytesPerCluster;
+    pread((char *) &bits, 1, offset);
+
+    if (allocated)
+        bits |= 1 << ((cluster-2) % 8);
+    else
+        bits &= ~(1 << ((cluster-2) % 8));
+
+    pwrite((char *) &bits, 1, offset);
+}
+
+QByteArray DeviceWrapperFatPartition::exfatReadFile(const QString &filename)
+{
+    if (!_dirIndexed)
+        exfatIndexDir();
+
+    auto it = _dirIndex.constFind(exfatUpcase(filename));
+    if (it == _dirIndex.cend())
+        return QByteArray(); /* File not found */
+
+    const struct exfat_stream_entry *stream = (const struct exfat_stream_entry *) (_exfatDir.constData()+it.value()+32);
+    QByteArray result(stream->DataLength, 0);
+
+    /* Anything after ValidDataLength reads as zeroes */
+    readClusters(exfatFileClusters(stream), result.data(), qMin((quint64) stream->ValidDataLength, (quint64) stream->DataLength));
+
+    return result;
+}
+
+/* Appends an entry set for an empty file to the root directory. Returns its position */
+quint64 DeviceWrapperFatPartition::exfatCreateFile(const QString &filename)
+{
+    if (filename.isEmpty() || filename.length() > 255)
+        throw std::runtime_error("exFAT: invalid file name length");
+
+    int nameEntries = (filename.length() + 14) / 15;
+    int count = 2 + nameEntries;
+    QByteArray set(count*32, 0);
+    struct exfat_file_entry *f = (struct exfat_file_entry *) set.data();
+    struct exfat_stream_entry *s = (struct exfat_stream_entry *) (f+1);
+    uint32_t timestamp = (QDateToFATdate( QDate::currentDate() ) << 16) | QTimeToFATtime( QTime::currentTime() );
+
+    f->EntryType = EXFAT_ENTRY_FILE;
+    f->SecondaryCount = count-1;
+    f->FileAttributes = ATTR_ARCHIVE;
+    f->CreateTimestamp = f->LastModifiedTimestamp = f->LastAccessedTimestamp = timestamp;
+    s->EntryType = EXFAT_ENTRY_STREAM;
+    s->GeneralSecondaryFlags = EXFAT_FLAG_ALLOCATION_POSSIBLE;
+    s->NameLength = filename.length();
+    s->NameHash = exfatNameHash(exfatUpcase(filename));
+    for (int i = 0; i < nameEntries; i++)
+    {
+        struct exfat_name_entry *n = (struct exfat_name_entry *) (set.data()+(2+i)*32);
+        n->EntryType = EXFAT_ENTRY_NAME;
+        memcpy(n->FileName, filename.utf16()+i*15, qMin(15, (int) filename.length()-i*15) * 2);
+    }
+    f->SetChecksum = exfatSetChecksum(set.constData(), count);
+
+    /* Directory entry sets may span clusters. Grow the directory if the set does not fit */
+    while (_dirEndOffset + set.size() > (quint64) _exfatDir.size())
+    {
+        uint32_t cluster = allocateCluster(_exfatDirClusters.last());
+        QByteArray zeroes(_bytesPerCluster, 0);
+
+        pwrite(zeroes.data(), zeroes.length(), clusterPos(cluster));
+        _exfatDirClusters.append(cluster);
+        _exfatDir.append(zeroes);
+    }
+
+    quint64 offset = _dirEndOffset;
+    memcpy(_exfatDir.data()+offset, set.constData(), set.size());
+    exfatWriteDir(offset, set.size());
+    _dirEndOffset += set.size();
+    _dirIndex.insert(exfatUpcase(filename), offset);
+
+    return offset;
+}
+
+void DeviceWrapperFatPartition::exfatWriteFile(const QString &filename, const QByteArray &contents)
+{
+    if (!_dirIndexed)
+        exfatIndexDir();
+
+    auto it = _dirIndex.constFind(exfatUpcase(filename));
+    quint64 offset = (it != _dirIndex.cend()) ? it.value() : exfatCreateFile(filename);
+    QList<uint32_t> clusterList = exfatFileClusters((const struct exfat_stream_entry *) (_exfatDir.constData()+offset+32));
+
+    if (((const struct exfat_stream_entry *) (_exfatDir.constData()+offset+32))->GeneralSecondaryFlags & EXFAT_FLAG_NO_FAT_CHAIN)
+    {
+        /* Put the clusters of a contiguous file in the FAT, so it can grow and shrink the usual way */
+        for (int i = 0; i < clusterList.size(); i++)
+            setFAT(clusterList.at(i), (i+1 < clusterList.size()) ? clusterList.at(i+1) : endOfChain());
+    }
+
+    resizeClusterChain(clusterList, (contents.length() + _bytesPerCluster - 1) / _bytesPerCluster);
+    writeClusters(clusterList, contents);
+
+    /* Update the entry set */
+    struct exfat_file_entry *f = (struct exfat_file_entry *) (_exfatDir.data()+offset);
+    struct exfat_stream_entry *s = (struct exfat_stream_entry *) (f+1);
+    uint32_t timestamp = (QDateToFATdate( QDate::currentDate() ) << 16) | QTimeToFATtime( QTime::currentTime() );
+
+    s->GeneralSecondaryFlags = EXFAT_FLAG_ALLOCATION_POSSIBLE;
+    s->FirstCluster = clusterList.isEmpty() ? 0 : clusterList.first();
+    s->ValidDataLength = s->DataLength = contents.length();
+    f->LastModifiedTimestamp = f->LastAccessedTimestamp = timestamp;
+    f->LastModified10msIncrement = 0;
+    f->LastModifiedUtcOffset = f->LastAccessedUtcOffset = 0;
+    f->SetChecksum = exfatSetChecksum((const char *) f, f->SecondaryCount+1);
+    exfatWriteDir(offset, (f->SecondaryCount+1)*32);
+}
@@ -8,6 +8,11 @@
 
 #include "devicewrapperpartition.h"
 #include <QObject>
+#include <QBitArray>
+#include <QHash>
+#include <QMap>
+#include <QPair>
+#include <QVector>
 #include <QDate>
 #include <QTime>
 
@@ -24,31 +29,103 @@ public:
     void writeFile(const QString &filename, const QByteArray &contents);
     bool fileExists(const QString &filename);
 
+    /* Writing a whole directory tree, e.g. when extracting an archive to the
+       partition. File data is written (to contiguous clusters if possible) as
+       it comes in, the directories themselves by finishTree(). Paths are
+       relative to the root directory, with '/' as separator. Not on exFAT */
+    void addDirectory(const QString &path);
+    void beginFile(const QString &path, quint64 size);
+    void writeFileData(const char *data, quint64 len);
+    void finishTree();
+
 protected:
+    struct TreeEntry
+    {
+        QString name;
+        bool isDirectory;
+        uint32_t firstCluster;
+        quint64 size;
+    };
+
     enum fatType _type;
     uint32_t _firstFatStartOffset, _fatSize, _bytesPerCluster, _clusterOffset;
     uint32_t _fat16_rootDirSectors, _fat16_firstRootDirSector;
     uint32_t _fat32_firstRootDirCluster, _fat32_currentRootDirCluster;
+    /* Clusters are numbered 2 to _clusterCount+1. The first FAT is read into _fat
+       when first needed, and kept in sync by setFAT16()/setFAT32(). Free clusters are
+       tracked in _freeClusters once anything is allocated, searching on from _allocCursor */
+    uint32_t _clusterCount, _allocCursor;
+    /* Bits of an entry in _fat that are the cluster number, see FatEntry */
+    uint32_t _entryMask;
+    QVector<uint32_t> _fat;
+    QBitArray _freeClusters;
     uint16_t _bytesPerSector, _fat32_fsinfoSector;
     QList<uint32_t> _fatStartOffset;
     QList<uint32_t> _currentDirClusters;
+    /* Root directory index, built by the first lookup: lower case names (long
+       name, or short name if there is none) and raw 8.3 names to entry offset.
+       Also the position of the end-of-directory marker, to append entries */
+    bool _dirIndexed;
+    QHash<QString, quint64> _dirIndex;
+    QHash<QByteArray, quint64> _shortNameIndex;
+    quint64 _dirEndOffset;
+    uint32_t _dirEndCluster;
+    QList<uint32_t> _dirEndClusters;
+    /* exFAT keeps the root directory in memory, indexed by up-cased name
+       in _dirIndex. Clusters are allocated in the bitmap, not by the FAT */
+    QByteArray _exfatDir;
+    QList<uint32_t> _exfatDirClusters, _exfatBitmapClusters;
+    QVector<uint16_t> _exfatUpcase;
+    /* Tree being written by beginFile()/addDirectory(), by parent path ("" for the
+       root directory). And where the data of the current file goes */
+    QMap<QString, QList<TreeEntry> > _tree;
+    QList<QPair<uint32_t, uint32_t> > _fileRuns;
+    int _fileRun;
+    quint64 _fileRunPos, _filePos, _fileSize;
 
     QList<uint32_t> getClusterChain(uint32_t firstCluster);
+    uint32_t endOfChain() const;
+    void readClusters(const QList<uint32_t> &clusterList, char *data, quint64 len);
+    void writeClusters(const QList<uint32_t> &clusterList, const QByteArray &contents);
+    void resizeClusterChain(QList<uint32_t> &clusterList, int clustersNeeded);
+    /* Contiguous parts of a cluster chain, as first cluster and number of clusters */
+    QList<QPair<uint32_t, uint32_t> > getClusterRuns(const QList<uint32_t> &clusterList);
+    void loadFAT();
+    void setFAT12(uint16_t cluster, uint16_t value);
     void setFAT16(uint16_t cluster, uint16_t value);
     void setFAT32(uint32_t cluster, uint32_t value);
     void setFAT(uint32_t cluster, uint32_t value);
     uint32_t getFAT(uint32_t cluster);
     void seekCluster(uint32_t cluster);
+    quint64 clusterPos(uint32_t cluster) const;
     uint32_t allocateCluster();
     uint32_t allocateCluster(uint32_t previousCluster);
+    QList<uint32_t> allocateClusters(int count, uint32_t previousCluster);
+    void loadFreeClusters();
+    uint32_t findFreeClusters(uint32_t count);
     bool getDirEntry(const QString &longFilename, struct dir_entry *entry, bool createIfNotExist = false);
-    bool dirNameExists(const QByteArray dirname);
+    QByteArray makeShortFilename(const QString &longFilename, const QHash<QByteArray, quint64> &taken);
+    QByteArray longFilenameEntries(const QString &longFilename, const QByteArray &shortFilename);
+    void indexDir();
+    void seekDirEnd();
     void updateDirEntry(struct dir_entry *dirEntry);
     void writeDirEntryAtCurrentPos(struct dir_entry *dirEntry);
     void openDir();
     bool readDir(struct dir_entry *result);
     void updateFSinfo(int deltaClusters, uint32_t nextFreeClusterHint);
+    void initDirEntry(struct dir_entry *entry, const QByteArray &shortFilename, uint8_t attr, uint32_t firstCluster, uint32_t size);
+    void freeTreeEntry(const QString &parent, const QString &name);
     uint16_t QTimeToFATtime(const QTime &time);
+    void exfatIndexDir();
+    void exfatWriteDir(quint64 pos, quint64 len);
+    QString exfatUpcase(const QString &name);
+    uint16_t exfatNameHash(const QString &upcasedName);
+    uint16_t exfatSetChecksum(const char *entries, int count);
+    QList<uint32_t> exfatFileClusters(const struct exfat_stream_entry *stream);
+    void exfatSetAllocated(uint32_t cluster, bool allocated);
+    QByteArray exfatReadFile(const QString &filename);
+    void exfatWriteFile(const QString &filename, const QByteArray &contents);
+    quint64 exfatCreateFile(const QString &filename);
     uint16_t QDateToFATdate(const QDate &date);
 };
 
@@ -0,0 +1,140 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "devicewrappermapped.h"
+#include <QDebug>
+#include <stdexcept>
+#include <string.h>
+#ifndef Q_OS_WIN
+#include <sys/mman.h>
+#include <errno.h>
+#endif
+
+DeviceWrapperMapped::DeviceWrapperMapped(BlockDeviceFile *file, BlockDevice *device, QObject *parent)
+    : DeviceWrapper(device, parent), _file(file), _map(nullptr), _mapSize(0), _dirtyStart(0), _dirtyEnd(0)
+{
+#ifndef Q_OS_WIN
+    if (_mapFile(_file->size()))
+        qDebug() << "Customizing image file through a memory mapping of" << _mapSize << "bytes";
+#endif
+}
+
+DeviceWrapperMapped::~DeviceWrapperMapped()
+{
+    try
+    {
+        sync();
+    }
+    catch (std::runtime_error &err)
+    {
+        qDebug() << "Error syncing mapped image file:" << err.what();
+    }
+    _unmap();
+}
+
+bool DeviceWrapperMapped::_mapFile(quint64 size)
+{
+#ifdef Q_OS_WIN
+    /* WinFile cannot map. Block cache it is */
+    Q_UNUSED(size)
+    return false;
+#else
+    if (!size)
+        return false;
+
+    _map = _file->map(0, size);
+    if (!_map)
+    {
+        qDebug() << "Cannot map image file, using the block cache:" << _file->errorString();
+        return false;
+    }
+    _mapSize = size;
+
+    return true;
+#endif
+}
+
+void DeviceWrapperMapped::_unmap()
+{
+#ifndef Q_OS_WIN
+    if (_map)
+        _file->unmap(_map);
+#endif
+    _map = nullptr;
+    _mapSize = 0;
+}
+
+bool DeviceWrapperMapped::isMapped() const
+{
+    return _map != nullptr;
+}
+
+void DeviceWrapperMapped::sync()
+{
+    if (!_map)
+    {
+        DeviceWrapper::sync();
+        return;
+    }
+
+#ifndef Q_OS_WIN
+    if (_dirtyEnd > _dirtyStart)
+    {
+        /* msync() wants a page aligned start */
+        quint64 start = _dirtyStart & ~4095ULL;
+        if (::msync(_map+start, _dirtyEnd-start, MS_SYNC) == -1)
+            throw std::runtime_error(std::string("Error writing to image file: ")+strerror(errno));
+    }
+#endif
+    _dirtyStart = _dirtyEnd = 0;
+}
+
+void DeviceWrapperMapped::pread(char *buf, quint64 size, quint64 offset)
+{
+    if (!_map)
+    {
+        DeviceWrapper::pread(buf, size, offset);
+        return;
+    }
+
+    if (offset+size > _mapSize)
+        throw std::runtime_error("Error reading from device: past the end of the image file");
+    memcpy(buf, _map+offset, size);
+}
+
+void DeviceWrapperMapped::pwrite(const char *buf, quint64 size, quint64 offset)
+{
+    if (!_map)
+    {
+        DeviceWrapper::pwrite(buf, size, offset);
+        return;
+    }
+    if (!size)
+        return;
+
+#ifndef Q_OS_WIN
+    if (offset+size > _mapSize)
+    {
+        /* The mapping cannot reach past the end of the file. Grow both */
+        quint64 newSize = (offset+size+4095) & ~4095ULL;
+        sync();
+        _unmap();
+        if (!_file->resize(newSize) || !_mapFile(newSize))
+            throw std::runtime_error("Error writing to device: cannot grow image file: "+_file->errorString().toStdString());
+    }
+#endif
+
+    memcpy(_map+offset, buf, size);
+    if (_dirtyEnd == _dirtyStart)
+    {
+        _dirtyStart = offset;
+        _dirtyEnd = offset+size;
+    }
+    else
+    {
+        _dirtyStart = qMin(_dirtyStart, offset);
+        _dirtyEnd = qMax(_dirtyEnd, offset+size);
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef DEVICEWRAPPERMAPPED_H
+#define DEVICEWRAPPERMAPPED_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "devicewrapper.h"
+
+/*
+ * DeviceWrapper on an image file, through a memory mapping of it
+ *
+ * The block cache is there to turn the small reads and writes of the FAT
+ * code into whole-block device I/O. A regular file is in the page cache
+ * already, so this maps it and copies to and from the mapping instead.
+ * Only the pages of the partition table, FAT and directories that are
+ * touched are read in. Writes past the end grow the file.
+ *
+ * sync() flushes the changed range of the mapping. Where the file cannot
+ * be mapped (Windows, or no address space for it), it works like a
+ * DeviceWrapper on device.
+ */
+class DeviceWrapperMapped : public DeviceWrapper
+{
+    Q_OBJECT
+public:
+    /* file has to be open read-write, and stay open for the lifetime of this object */
+    explicit DeviceWrapperMapped(BlockDeviceFile *file, BlockDevice *device, QObject *parent = nullptr);
+    virtual ~DeviceWrapperMapped();
+
+    virtual void sync() override;
+    virtual void pwrite(const char *buf, quint64 size, quint64 offset) override;
+    virtual void pread(char *buf, quint64 size, quint64 offset) override;
+    bool isMapped() const;
+
+protected:
+    BlockDeviceFile *_file;
+    uchar *_map;
+    quint64 _mapSize;
+    /* Range written to since the last sync() */
+    quint64 _dirtyStart, _dirtyEnd;
+
+    bool _mapFile(quint64 size);
+    void _unmap();
+};
+
+#endif // DEVICEWRAPPERMAPPED_H
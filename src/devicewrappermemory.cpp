@@ -0,0 +1,157 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "devicewrappermemory.h"
+#include <iterator>
+#include <stdexcept>
+#include <string.h>
+
+DeviceWrapperMemory::DeviceWrapperMemory(const char *firstBlock, quint64 firstBlockSize, QObject *parent)
+    : DeviceWrapper(nullptr, parent), _firstBlock(firstBlock), _firstBlockSize(firstBlockSize), _capturedBytes(0)
+{
+}
+
+DeviceWrapperMemory::~DeviceWrapperMemory()
+{
+    /* Changes not synced are discarded. ~DeviceWrapper() cannot call our _writeBlocks() anymore */
+    _dirty = false;
+}
+
+void DeviceWrapperMemory::capture(const char *buf, quint64 len, quint64 offset)
+{
+    _data.insert(offset, QByteArray(buf, len));
+    _capturedBytes += len;
+}
+
+quint64 DeviceWrapperMemory::capturedBytes() const
+{
+    return _capturedBytes;
+}
+
+const QMap<quint64, QByteArray> &DeviceWrapperMemory::data() const
+{
+    return _data;
+}
+
+bool DeviceWrapperMemory::hasChanges() const
+{
+    return !_changes.isEmpty();
+}
+
+void DeviceWrapperMemory::revert()
+{
+    for (auto it = _changes.cbegin(); it != _changes.cend(); ++it)
+        _store(it.value().first.constData(), 4096, it.key()*4096);
+    _changes.clear();
+}
+
+void DeviceWrapperMemory::releaseData()
+{
+    _data.clear();
+}
+
+void DeviceWrapperMemory::_load(char *buf, quint64 len, quint64 offset) const
+{
+    while (len)
+    {
+        quint64 n;
+
+        if (offset < _firstBlockSize)
+        {
+            n = qMin(len, _firstBlockSize-offset);
+            memcpy(buf, _firstBlock+offset, n);
+        }
+        else
+        {
+            auto it = _data.upperBound(offset);
+            if (it != _data.cbegin() && std::prev(it).key() + std::prev(it).value().size() > offset)
+            {
+                --it;
+                quint64 pos = offset - it.key();
+                n = qMin(len, it.value().size() - pos);
+                memcpy(buf, it.value().constData() + pos, n);
+            }
+            else
+            {
+                /* Not captured, so zeroes */
+                n = (it == _data.cend()) ? len : qMin(len, it.key() - offset);
+                memset(buf, 0, n);
+            }
+        }
+
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+void DeviceWrapperMemory::_store(const char *buf, quint64 len, quint64 offset)
+{
+    while (len)
+    {
+        quint64 n;
+        auto it = _data.upperBound(offset);
+
+        if (it != _data.begin() && std::prev(it).key() + std::prev(it).value().size() > offset)
+        {
+            --it;
+            quint64 pos = offset - it.key();
+            n = qMin(len, it.value().size() - pos);
+            memcpy(it.value().data() + pos, buf, n);
+        }
+        else
+        {
+            /* Fill the gap up to the next captured range */
+            n = (it == _data.end()) ? len : qMin(len, it.key() - offset);
+            _data.insert(offset, QByteArray(buf, n));
+        }
+
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+void DeviceWrapperMemory::_readBlocks(quint64 blockNr, char * const *bufs, int count)
+{
+    for (int i = 0; i < count; i++)
+        _load(bufs[i], 4096, (blockNr+i)*4096);
+}
+
+void DeviceWrapperMemory::_writeBlocks(quint64 blockNr, const char * const *bufs, int count)
+{
+    /* The first block is written by the caller, after everything else */
+    if (blockNr*4096 < _firstBlockSize)
+        throw std::runtime_error("Customization would change the first block of the image");
+
+    for (int i = 0; i < count; i++)
+    {
+        quint64 nr = blockNr+i;
+        auto it = _changes.find(nr);
+        if (it == _changes.end())
+        {
+            QByteArray original(4096, 0);
+            _load(original.data(), 4096, nr*4096);
+            it = _changes.insert(nr, qMakePair(original, QByteArray()));
+        }
+        it.value().second = QByteArray(bufs[i], 4096);
+        _store(bufs[i], 4096, nr*4096);
+    }
+}
+
+bool DeviceWrapperMemory::restoreOriginal(char *buf, quint64 len, quint64 offset) const
+{
+    for (auto it = _changes.lowerBound(offset/4096); it != _changes.cend() && it.key()*4096 < offset+len; ++it)
+    {
+        quint64 start = qMax(offset, it.key()*4096), end = qMin(offset+len, it.key()*4096+4096);
+        quint64 posInBlock = start - it.key()*4096;
+
+        if (memcmp(buf+(start-offset), it.value().second.constData()+posInBlock, end-start))
+            return false;
+        memcpy(buf+(start-offset), it.value().first.constData()+posInBlock, end-start);
+    }
+
+    return true;
+}
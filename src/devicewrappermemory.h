@@ -0,0 +1,63 @@
+#ifndef DEVICEWRAPPERMEMORY_H
+#define DEVICEWRAPPERMEMORY_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "devicewrapper.h"
+#include <QByteArray>
+#include <QMap>
+#include <QPair>
+
+/*
+ * DeviceWrapper on image data held in memory instead of on a device
+ *
+ * Used to customize the boot partition while the image is being
+ * written: the data of the partition is captured as it streams past,
+ * and the first block (with the partition table) is kept by the
+ * caller. Anything that was not captured reads as zeroes.
+ *
+ * sync() applies changes to the captured data, and remembers the
+ * original contents of every changed block, so verification can
+ * compare the device against the image it was written from.
+ */
+class DeviceWrapperMemory : public DeviceWrapper
+{
+    Q_OBJECT
+public:
+    /* firstBlock has to stay valid for the lifetime of this object */
+    explicit DeviceWrapperMemory(const char *firstBlock, quint64 firstBlockSize, QObject *parent = nullptr);
+    virtual ~DeviceWrapperMemory();
+
+    /* Add data that is written to offset on the device */
+    void capture(const char *buf, quint64 len, quint64 offset);
+    quint64 capturedBytes() const;
+    /* Captured data, changes applied after sync(), by device offset */
+    const QMap<quint64, QByteArray> &data() const;
+    bool hasChanges() const;
+    /* Undo all changes synced so far */
+    void revert();
+    /* Free the captured data once written. Only keeps what restoreOriginal() needs */
+    void releaseData();
+
+    /* Checks the parts of buf (read from the device at offset) that were
+       changed against what was written, and puts the original data back.
+       Returns false if they do not match */
+    bool restoreOriginal(char *buf, quint64 len, quint64 offset) const;
+
+protected:
+    const char *_firstBlock;
+    quint64 _firstBlockSize, _capturedBytes;
+    QMap<quint64, QByteArray> _data;
+    /* Block number -> original and changed contents */
+    QMap<quint64, QPair<QByteArray, QByteArray> > _changes;
+
+    void _load(char *buf, quint64 len, quint64 offset) const;
+    void _store(const char *buf, quint64 len, quint64 offset);
+    virtual void _readBlocks(quint64 blockNr, char * const *bufs, int count);
+    virtual void _writeBlocks(quint64 blockNr, const char * const *bufs, int count);
+};
+
+#endif // DEVICEWRAPPERMEMORY_H
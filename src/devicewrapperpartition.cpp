@@ -19,13 +19,18 @@ DeviceWrapperPartition::~DeviceWrapperPartition()
 
 void DeviceWrapperPartition::read(char *data, qint64 size)
 {
-    if (_offset+size > _partEnd)
+    pread(data, size, _offset-_partStart);
+    _offset += size;
+}
+
+void DeviceWrapperPartition::pread(char *data, qint64 size, quint64 pos)
+{
+    if (pos+size > _partLen)
     {
         throw std::runtime_error("Error: trying to read beyond partition");
     }
 
-    _dw->pread(data, size, _offset);
-    _offset += size;
+    _dw->pread(data, size, _partStart+pos);
 }
 
 void DeviceWrapperPartition::seek(qint64 pos)
@@ -44,11 +49,16 @@ qint64 DeviceWrapperPartition::pos() const
 
 void DeviceWrapperPartition::write(const char *data, qint64 size)
 {
-    if (_offset+size > _partEnd)
+    pwrite(data, size, _offset-_partStart);
+    _offset += size;
+}
+
+void DeviceWrapperPartition::pwrite(const char *data, qint64 size, quint64 pos)
+{
+    if (pos+size > _partLen)
     {
         throw std::runtime_error("Error: trying to write beyond partition");
     }
 
-    _dw->pwrite(data, size, _offset);
-    _offset += size;
+    _dw->pwrite(data, size, _partStart+pos);
 }
@@ -20,6 +20,9 @@ public:
     void seek(qint64 pos);
     qint64 pos() const;
     void write(const char *data, qint64 size);
+    /* At pos within the partition, leaving the position alone */
+    void pread(char *data, qint64 size, quint64 pos);
+    void pwrite(const char *data, qint64 size, quint64 pos);
 
 protected:
     DeviceWrapper *_dw;
@@ -125,9 +125,38 @@ struct fat32_bpb {
     uint8_t  Signature[2]; /* 0x55aa */
 };
 
+/* exFAT
+ * https://learn.microsoft.com/en-us/windows/win32/fileio/exfat-specification
+ */
+
+struct exfat_bpb {
+    uint8_t  BS_jmpBoot[3];
+    char     FileSystemName[8]; /* "EXFAT   " */
+    uint8_t  MustBeZero[53];
+    uint64_t PartitionOffset;
+    uint64_t VolumeLength;
+    uint32_t FatOffset;
+    uint32_t FatLength;
+    uint32_t ClusterHeapOffset;
+    uint32_t ClusterCount;
+    uint32_t FirstClusterOfRootDirectory;
+    uint32_t VolumeSerialNumber;
+    uint16_t FileSystemRevision;
+    uint16_t VolumeFlags;
+    uint8_t  BytesPerSectorShift;
+    uint8_t  SectorsPerClusterShift;
+    uint8_t  NumberOfFats;
+    uint8_t  DriveSelect;
+    uint8_t  PercentInUse;
+    uint8_t  Reserved[7];
+    uint8_t  BootCode[390];
+    uint8_t  Signature[2]; /* 0x55aa */
+};
+
 union fat_bpb {
     struct fat16_bpb fat16;
     struct fat32_bpb fat32;
+    struct exfat_bpb exfat;
 };
 
 struct dir_entry {
@@ -166,6 +195,64 @@ struct longfn_entry {
 #define ATTR_ARCHIVE    0x20
 #define ATTR_LONG_NAME  (ATTR_READ_ONLY | ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID)
 
+/* exFAT directory entries. A file is a set of a file entry,
+   a stream extension entry and one or more file name entries */
+
+struct exfat_alloc_entry {
+    uint8_t  EntryType; /* Allocation bitmap or up-case table */
+    uint8_t  Flags;
+    uint8_t  Reserved1[2];
+    uint32_t TableChecksum; /* Up-case table only */
+    uint8_t  Reserved2[12];
+    uint32_t FirstCluster;
+    uint64_t DataLength;
+};
+
+struct exfat_file_entry {
+    uint8_t  EntryType;
+    uint8_t  SecondaryCount;
+    uint16_t SetChecksum;
+    uint16_t FileAttributes;
+    uint16_t Reserved1;
+    uint32_t CreateTimestamp;
+    uint32_t LastModifiedTimestamp;
+    uint32_t LastAccessedTimestamp;
+    uint8_t  Create10msIncrement;
+    uint8_t  LastModified10msIncrement;
+    uint8_t  CreateUtcOffset;
+    uint8_t  LastModifiedUtcOffset;
+    uint8_t  LastAccessedUtcOffset;
+    uint8_t  Reserved2[7];
+};
+
+struct exfat_stream_entry {
+    uint8_t  EntryType;
+    uint8_t  GeneralSecondaryFlags;
+    uint8_t  Reserved1;
+    uint8_t  NameLength;
+    uint16_t NameHash;
+    uint16_t Reserved2;
+    uint64_t ValidDataLength;
+    uint32_t Reserved3;
+    uint32_t FirstCluster;
+    uint64_t DataLength;
+};
+
+struct exfat_name_entry {
+    uint8_t  EntryType;
+    uint8_t  GeneralSecondaryFlags;
+    char     FileName[30]; /* 15 UTF-16 characters */
+};
+
+#define EXFAT_ENTRY_BITMAP  0x81
+#define EXFAT_ENTRY_UPCASE  0x82
+#define EXFAT_ENTRY_FILE    0x85
+#define EXFAT_ENTRY_STREAM  0xC0
+#define EXFAT_ENTRY_NAME    0xC1
+
+#define EXFAT_FLAG_ALLOCATION_POSSIBLE  0x01
+#define EXFAT_FLAG_NO_FAT_CHAIN         0x02
+
 struct FSInfo {
     uint8_t  FSI_LeadSig[4];  /* 0x52 0x52 0x61 0x41 */
     uint8_t  FSI_Reserved1[480];
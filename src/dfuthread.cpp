@@ -7,23 +7,21 @@
 #include "dfuwrapper.h"
 #include "config.h"
 #include "downloadextractthread.h"
+#include "bootfilecache.h"
+#include "ringbuffer.h"
+#include "pipelinetrace.h"
 #include <QFile>
 #include <QDebug>
 #include <QThread>
-#include <QCryptographicHash>
 #include <QCoreApplication>
 #include <QStandardPaths>
 #include <QDir>
 #include <QFileInfo>
-#include <QUrl>
-#include <QJsonDocument>
-#include <QJsonObject>
-#include <QJsonArray>
-
-#include <QEventLoop>
-#include <QNetworkAccessManager>
-#include <QNetworkRequest>
-#include <QNetworkReply>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string.h>
 
 DfuThread::DfuThread(const QByteArray &url, const QByteArray &localfilename,
                      const QByteArray &expectedHash, const QByteArray &tiboot3Hash,
@@ -33,21 +31,73 @@ DfuThread::DfuThread(const QByteArray &url, const QByteArray &localfilename,
     , _expectedTiboot3Hash(tiboot3Hash)
     , _expectedTisplHash(tisplHash)
     , _expectedUbootHash(ubootHash)
+    , _streamImage(false)
+    , _imageSize(0)
+    , _umsMode(false)
 {
     _suppressSuccessSignal = true;
     _ejectEnabled = false;
+    _boards.append(new Board);
 }
 
 DfuThread::~DfuThread()
 {
-    for (int i = 0; i < 3; i++)
-        if (!_bootloaderFiles[i].isEmpty())
-            QFile::remove(_bootloaderFiles[i]);
-
+    /* The sessions are used until run() returns */
+    wait();
+    qDeleteAll(_boards);
+    /* _bootloaderFiles stay in the cache for the next run */
     if (_tempImageFile) {
         _tempImageFile->remove();
         delete _tempImageFile;
     }
+    if (!_customizedCacheFile.isEmpty())
+        QFile::remove(_customizedCacheFile + ".part");
+}
+
+void DfuThread::setCustomizedImageCache(const QString &filename, const QByteArray &key)
+{
+    _customizedCacheFile = filename;
+    _customizedCacheKey = key;
+}
+
+void DfuThread::setCustomizedImage(const QString &filename)
+{
+    _customizedImage = filename;
+}
+
+void DfuThread::setBoardPaths(const QStringList &paths)
+{
+    qDeleteAll(_boards);
+    _boards.clear();
+    for (const QString &path : paths) {
+        Board *board = new Board;
+        board->path = path;
+        board->dfu.setDevicePath(path);
+        _boards.append(board);
+    }
+    if (_boards.isEmpty())
+        _boards.append(new Board);
+}
+
+void DfuThread::setImageSize(quint64 size)
+{
+    _imageSize = size;
+}
+
+void DfuThread::setUmsMode(bool enabled)
+{
+    _umsMode = enabled;
+}
+
+void DfuThread::cancelDownload()
+{
+    DownloadExtractThread::cancelDownload();
+
+    /* A board can otherwise keep the thread waiting for minutes, for it to
+       re-enumerate or to flush a chunk to the eMMC */
+    std::lock_guard<std::mutex> lock(_boardsMutex);
+    for (Board *board : std::as_const(_boards))
+        board->dfu.cancel();
 }
 
 bool DfuThread::isImage()
@@ -57,6 +107,23 @@ bool DfuThread::isImage()
 
 bool DfuThread::_openAndPrepareDevice()
 {
+    /* Nothing to open when streaming, the device is already taking the image */
+    if (_streamImage)
+        return true;
+
+    if (!_customizedCacheFile.isEmpty()) {
+        /* Written in the cache directory, so it only has to be renamed once customized */
+        _tempImagePath = _customizedCacheFile + ".part";
+        _filename = _tempImagePath.toLatin1();
+        _file.setFileName(_tempImagePath);
+        if (!_file.open(QIODevice::ReadWrite | QIODevice::Truncate | QIODevice::Unbuffered)) {
+            emit error(tr("Failed to open temporary file for DFU image"));
+            return false;
+        }
+
+        return true;
+    }
+
     _tempImageFile = new QTemporaryFile();
     _tempImageFile->setAutoRemove(false);
 
@@ -87,62 +154,188 @@ void DfuThread::run()
         return;
     }
 
-    emit dfuProgress(5, tr("Downloading image..."));
-    DownloadExtractThread::run();
-    waitForExtractThread();
-    if (!_successful) return;
-
-    if (!_geminit.isEmpty() || !_config.isEmpty() || !_cmdline.isEmpty() || !_firstrun.isEmpty() || !_cloudinit.isEmpty()) {
-        emit dfuProgress(35, tr("Customizing image..."));
-        if (_file.isOpen()) _file.close();
-        _file.setFileName(_tempImagePath);
-        if (!_file.open(QIODevice::ReadWrite | QIODevice::Unbuffered)) {
-            emit error(tr("Failed to reopen image for customization: %1").arg(_file.errorString()));
+    /* The image is written to the eMMC as a block device afterwards, see ImageWriter */
+    if (_umsMode) {
+        emit dfuProgress(5, tr("Sending bootloader files..."));
+        if (!fetchBootloaderFiles()
+            || !forEachBoard([this](Board *board) { return sendBootloaderFiles(board) && enterUms(board); }))
             return;
-        }
-        if (!_customizeImage()) return;
-        _file.close();
-    }
 
-    emit dfuProgress(38, tr("Fetching bootloader files..."));
-    if (!fetchBootloaderFiles()) return;
+        QStringList failed = failedBoards();
+        if (!failed.isEmpty())
+            qDebug() << "Not exporting the eMMC of" << failed;
+        emit dfuProgress(85, tr("Waiting for the eMMC to show up as USB storage..."));
+        emit umsStarted(_boards.size() - failed.size());
+        return;
+    }
 
-    emit dfuProgress(45, tr("Sending bootloader files..."));
-    if (!sendBootloaderFiles()) return;
+    /* Without a customized image cache entry to fill, nothing needs the image on disk */
+    _streamImage = _customizedImage.isEmpty() && _customizedCacheFile.isEmpty();
 
-    emit dfuProgress(77, tr("Waiting for device to enter DFU mode..."));
-    QThread::sleep(3);
+    /* The bootloader stages only need their three files and the board. Unless
+       the image is already there, they run on their own thread while the image
+       is downloaded and extracted, so the board waits in rawemmc mode once the
+       image is ready */
+    if (_streamImage) {
+        emit dfuProgress(5, tr("Downloading image and sending bootloader files..."));
+        if (!streamImageToRawemmc()) return;
+    } else {
+        if (!_customizedImage.isEmpty()) {
+            emit dfuProgress(35, tr("Using cached customized image..."));
+            _tempImagePath = _customizedImage;
+
+            emit dfuProgress(38, tr("Fetching bootloader files..."));
+            if (!fetchBootloaderFiles()
+                || !forEachBoard([this](Board *board) { return sendBootloaderFiles(board); }))
+                return;
+        } else {
+            /* The customization is done by _writeComplete() */
+            std::atomic<bool> booted(false);
+            std::thread bootloader([this, &booted]() {
+                booted = fetchBootloaderFiles()
+                    && forEachBoard([this](Board *board) { return sendBootloaderFiles(board); });
+                /* The image has nowhere to go */
+                if (!booted)
+                    cancelDownload();
+            });
+
+            emit dfuProgress(5, tr("Downloading image..."));
+            DownloadExtractThread::run();
+            waitForExtractThread();
+            if (!_successful || _cancelled)
+                cancelDownload();
+            bootloader.join();
+            if (!_successful || _cancelled || !booted) return;
+
+            if (!_customizedCacheFile.isEmpty()) {
+                delete _device;
+                _device = nullptr;
+                if (_file.isOpen()) _file.close();
+                QFile::remove(_customizedCacheFile);
+                if (QFile::rename(_tempImagePath, _customizedCacheFile)) {
+                    _tempImagePath = _customizedCacheFile;
+                    emit extractedCacheFileUpdated(_customizedCacheKey);
+                } else {
+                    qDebug() << "Error adding customized image to cache";
+                }
+            }
+        }
 
-    emit dfuProgress(80, tr("Sending image to device (this may take several minutes)..."));
-    if (!sendImageToRawemmc()) return;
+        if (!QFile::exists(_tempImagePath)) {
+            emit error(tr("Image not found: %1").arg(_tempImagePath));
+            return;
+        }
+        if (!forEachBoard([this](Board *board) { return sendImageToRawemmc(board); }))
+            return;
+    }
 
+    /* Not an enumeration wait: the board writes them after DFU_DETACH,
+       and nothing on the USB side tells when it is done */
     emit dfuProgress(95, tr("Writing boot binaries to eMMC (do not power off)..."));
     QThread::sleep(15);
 
+    QStringList failed = failedBoards();
+    if (!failed.isEmpty()) {
+        emit error(tr("Flashing failed on %1 of %2 boards:<br>%3")
+                   .arg(failed.size()).arg(_boards.size()).arg(failed.join("<br>")));
+        return;
+    }
+
     emit dfuProgress(100, tr("System image sent successfully!"));
     QThread::msleep(1000);
     emit success();
 }
 
-// Helper: create a DfuWrapper, find the device, transfer a file, clean up.
-bool DfuThread::runDfu(const QString &altSetting, const QString &filePath, bool resetAfter)
+bool DfuThread::forEachBoard(const std::function<bool(Board *board)> &step)
+{
+    std::vector<std::thread> threads;
+    for (Board *board : std::as_const(_boards)) {
+        if (boardOk(board))
+            threads.emplace_back([&step, board]() { step(board); });
+    }
+    for (std::thread &t : threads)
+        t.join();
+
+    if (_cancelled)
+        return false;
+    for (Board *board : std::as_const(_boards)) {
+        if (boardOk(board))
+            return true;
+    }
+    return false;
+}
+
+/* Overall progress is that of the board furthest behind */
+void DfuThread::boardProgress(Board *board, int percentage, const QString &statusMsg)
+{
+    int overall = percentage;
+    {
+        std::lock_guard<std::mutex> lock(_boardsMutex);
+        board->progress = percentage;
+        for (Board *b : std::as_const(_boards)) {
+            if (b->error.isEmpty())
+                overall = qMin(overall, b->progress);
+        }
+    }
+
+    if (_boards.size() > 1)
+        emit dfuProgress(overall, tr("Board %1: %2").arg(board->path, statusMsg));
+    else
+        emit dfuProgress(overall, statusMsg);
+}
+
+/* A single board fails the flash. Of several, only the last one to fail does */
+void DfuThread::boardFailed(Board *board, const QString &msg)
+{
+    {
+        std::lock_guard<std::mutex> lock(_boardsMutex);
+        board->error = msg;
+    }
+
+    if (_boards.size() == 1) {
+        emit error(msg);
+        return;
+    }
+
+    qDebug() << "DFU failed on board" << board->path << ":" << msg;
+    QStringList failed = failedBoards();
+    if (failed.size() == _boards.size())
+        emit error(tr("Flashing failed on all %1 boards:<br>%2").arg(_boards.size()).arg(failed.join("<br>")));
+}
+
+bool DfuThread::boardOk(Board *board)
+{
+    std::lock_guard<std::mutex> lock(_boardsMutex);
+    return board->error.isEmpty();
+}
+
+QStringList DfuThread::failedBoards()
 {
-    DfuWrapper *dfu = new DfuWrapper(nullptr);
+    std::lock_guard<std::mutex> lock(_boardsMutex);
+    QStringList failed;
+    for (Board *board : std::as_const(_boards)) {
+        if (!board->error.isEmpty())
+            failed.append(QString("%1: %2").arg(board->path, board->error));
+    }
+    return failed;
+}
 
-    bool ok = dfu->initialize()
-           && dfu->findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, altSetting)
-           && (resetAfter ? dfu->downloadFile(filePath, true)
-                          : dfu->downloadFileStreaming(filePath));
+// Helper: find the device with the alt setting in the board's session, transfer a file.
+bool DfuThread::runDfu(Board *board, const QString &altSetting, const QString &filePath)
+{
+    TraceSpan span("dfuTransfer");
+    DfuWrapper &dfu = board->dfu;
+    bool ok = dfu.initialize()
+           && dfu.findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, altSetting)
+           && dfu.downloadFile(filePath, true);
 
     if (!ok)
-        emit error(tr("DFU failed (alt: %1): %2").arg(altSetting, dfu->lastError()));
+        boardFailed(board, tr("DFU failed (alt: %1): %2").arg(altSetting, dfu.lastError()));
 
-    dfu->cleanup();
-    delete dfu;
     return ok;
 }
 
-bool DfuThread::sendBootloaderFiles()
+bool DfuThread::sendBootloaderFiles(Board *board)
 {
     const char *altSettings[] = {
         DfuWrapper::ALT_BOOTLOADER,
@@ -150,138 +343,227 @@ bool DfuThread::sendBootloaderFiles()
         DfuWrapper::ALT_UBOOT,
     };
 
+    boardProgress(board, 45, tr("Sending bootloader files..."));
     for (int i = 0; i < 3; i++) {
-        emit dfuProgress(45 + i * 10, tr("Sending %1...").arg(altSettings[i]));
-        if (!runDfu(altSettings[i], _bootloaderFiles[i], true))
+        /* Image download failed or was cancelled meanwhile */
+        if (_cancelled)
             return false;
-        emit dfuProgress(55 + i * 10, tr("%1 sent").arg(altSettings[i]));
 
-        if (i < 2) {
-            emit dfuProgress(55 + i * 10, tr("Waiting for device to reconnect..."));
-            QThread::sleep(2);
-        }
+        boardProgress(board, 45 + i * 10, tr("Sending %1...").arg(altSettings[i]));
+        if (!runDfu(board, altSettings[i], _bootloaderFiles[i]))
+            return false;
+        boardProgress(board, 55 + i * 10, tr("%1 sent").arg(altSettings[i]));
+
+        /* The next findDevice() waits for the device to come back with the next alt setting */
+        if (i < 2)
+            boardProgress(board, 55 + i * 10, tr("Waiting for device to reconnect..."));
     }
 
+    boardProgress(board, 77, tr("Waiting for device to enter DFU mode..."));
+
     return true;
 }
 
 bool DfuThread::fetchBootloaderFiles()
 {
-    QString listUrlStr = QString(BOOTIMG_URL).arg("t3-gem-o1").arg("list.json");
-    
-    emit dfuProgress(40, tr("Fetching bootloader list..."));
+    BootFileCache &cache = _bootFileCache;
 
-    QNetworkAccessManager manager;
-    QNetworkRequest request((QUrl(listUrlStr)));
-    request.setAttribute(QNetworkRequest::RedirectPolicyAttribute, QNetworkRequest::NoLessSafeRedirectPolicy);
-    
-    QNetworkReply *reply = manager.get(request);
-    QEventLoop loop;
-    connect(reply, &QNetworkReply::finished, &loop, &QEventLoop::quit);
-    loop.exec();
-
-    if (reply->error() == QNetworkReply::NoError) {
-        QByteArray jsonData = reply->readAll();
-        QJsonDocument doc = QJsonDocument::fromJson(jsonData);
-        QJsonObject root = doc.object();
-        QJsonArray filesArr = root["files"].toArray();
-        
-        for (int j = 0; j < filesArr.size(); ++j) {
-            QJsonObject fileObj = filesArr[j].toObject();
-            QString name = fileObj["name"].toString();
-            QByteArray hash = fileObj["sha256"].toString().toUtf8();
-            
-            if (name == "tiboot3.bin") _expectedTiboot3Hash = hash;
-            else if (name == "tispl.bin") _expectedTisplHash = hash;
-            else if (name == "u-boot.img") _expectedUbootHash = hash;
-        }
+    emit dfuProgress(40, tr("Fetching bootloader list..."));
+    QMap<QString, QByteArray> hashes = cache.hashes();
+    if (!hashes.isEmpty())
+    {
+        _expectedTiboot3Hash = hashes.value("tiboot3.bin", _expectedTiboot3Hash);
+        _expectedTisplHash = hashes.value("tispl.bin", _expectedTisplHash);
+        _expectedUbootHash = hashes.value("u-boot.img", _expectedUbootHash);
         qDebug() << "Updated bootloader hashes from list.json successfully.";
-    } else {
-        qDebug() << "Failed to fetch list.json from" << listUrlStr << ". Error:" << reply->errorString();
     }
-    reply->deleteLater();
 
     QStringList fileNames = {"tiboot3.bin", "tispl.bin", "u-boot.img"};
     QList<QByteArray> expectedHashes = {_expectedTiboot3Hash, _expectedTisplHash, _expectedUbootHash};
+    QList<BootFileCache::File> files;
+    for (int i = 0; i < 3; i++)
+        files.append({fileNames[i], fileNames[i], expectedHashes[i]});
 
-    QString cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation) + QDir::separator() + "bootloaders" + QDir::separator() + "t3-gem-o1";
-    QDir().mkpath(cacheDir);
+    if (!cache.fetch(files))
+    {
+        emit error(cache.errorString());
+        return false;
+    }
 
-    for (int i = 0; i < 3; i++) {
-        QString fileName = fileNames[i];
-        QByteArray expectedHash = expectedHashes[i];
-#ifdef Q_OS_WIN
-        QTemporaryFile tmp(QCoreApplication::applicationDirPath() + "/dfu_XXXXXX");
-#else
-        QTemporaryFile tmp;
-#endif
-        tmp.setAutoRemove(false);
-        if (!tmp.open()) {
-            emit error(tr("Failed to create temp file for %1").arg(fileName));
-            return false;
-        }
-        tmp.close();
-
-        QString localCachePath = cacheDir + QDir::separator() + fileName;
-        QFileInfo fi(localCachePath);
-
-        QString urlstr;
-        bool useCache = false;
-
-        if (fi.exists() && fi.size() > 0) {
-            if (!expectedHash.isEmpty()) {
-                QFile f(localCachePath);
-                if (f.open(QIODevice::ReadOnly)) {
-                    QCryptographicHash hash(QCryptographicHash::Sha256);
-                    if (hash.addData(&f)) {
-                        if (hash.result().toHex() == expectedHash) {
-                            useCache = true;
-                        } else {
-                            qDebug() << "Cache hash mismatch for" << fileName << "expected:" << expectedHash << "got:" << hash.result().toHex();
-                        }
-                    }
-                    f.close();
-                }
-            } else {
-                useCache = true;
+    for (int i = 0; i < 3; i++)
+    {
+        _bootloaderFiles[i] = cache.path(fileNames[i]);
+        qDebug() << "Ready" << fileNames[i] << "from" << _bootloaderFiles[i];
+    }
+
+    return true;
+}
+
+bool DfuThread::sendImageToRawemmc(Board *board)
+{
+    boardProgress(board, 80, tr("Sending image to device (this may take several minutes)..."));
+
+    QFile file(_tempImagePath);
+    if (!file.open(QIODevice::ReadOnly) || !file.size()) {
+        boardFailed(board, tr("Cannot read image: %1").arg(_tempImagePath));
+        return false;
+    }
+
+    QString error;
+    bool ok = sendImageToBoard(board, file.size(), [&file](char *buf, qint64 maxLen) {
+        return file.read(buf, maxLen);
+    }, error);
+
+    if (!ok && !_cancelled)
+        boardFailed(board, error);
+
+    return ok;
+}
+
+bool DfuThread::sendImageToBoard(Board *board, qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read, QString &error)
+{
+    DfuWrapper &dfu = board->dfu;
+    bool ok = dfu.initialize()
+           && dfu.findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, DfuWrapper::ALT_RAWEMMC)
+           && sendImage(board, size, read);
+
+    if (!ok)
+        error = tr("DFU failed (alt: %1): %2").arg(QString(DfuWrapper::ALT_RAWEMMC), dfu.lastError());
+
+    return ok;
+}
+
+/* The board has to offer the ums alt setting, which tells its U-Boot exports
+   the eMMC once DFU ends */
+bool DfuThread::enterUms(Board *board)
+{
+    boardProgress(board, 80, tr("Exporting eMMC as USB storage..."));
+
+    DfuWrapper &dfu = board->dfu;
+    bool ok = dfu.initialize()
+           && dfu.findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, DfuWrapper::ALT_UMS)
+           && dfu.detach();
+
+    if (!ok && !_cancelled)
+        boardFailed(board, tr("DFU failed (alt: %1): %2").arg(QString(DfuWrapper::ALT_UMS), dfu.lastError()));
+
+    return ok;
+}
+
+/* Sends the image over the rawemmc alt setting found. If the board's U-Boot
+   can expand sparse images, and the size is known, empty space is not sent */
+bool DfuThread::sendImage(Board *board, qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read)
+{
+    TraceSpan span("dfuTransfer");
+    DfuWrapper &dfu = board->dfu;
+
+    if (size > 0 && dfu.hasAltSetting(DfuWrapper::ALT_RAWEMMC_SPARSE)) {
+        qDebug() << "Board" << board->path << "takes sparse images";
+        return dfu.findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, DfuWrapper::ALT_RAWEMMC_SPARSE)
+            && dfu.downloadSparseStream(size, read);
+    }
+
+    /* A streamed image is sent up to its end, whatever size was announced */
+    return dfu.downloadStream(_streamImage ? 0 : size, read);
+}
+
+/* Downloads and extracts the image into a ring buffer, which the DFU
+   transfer engines read from once the bootloader stages are done.
+   Customization is done in-stream. With several boards, the stream is
+   copied into a ring per board, so the slowest board sets the pace */
+bool DfuThread::streamImageToRawemmc()
+{
+    RingBuffer stream(IMAGEWRITER_RINGBUFFER_SIZE, IMAGEWRITER_RINGBUFFER_SLABSIZE);
+    std::vector<std::unique_ptr<RingBuffer>> rings;
+    std::atomic<bool> imageFailed(false);
+    std::atomic<int> boardsLeft(_boards.size());
+
+    for (int i = 0; i < _boards.size(); i++)
+        rings.emplace_back(new RingBuffer(IMAGEWRITER_RINGBUFFER_SIZE, IMAGEWRITER_RINGBUFFER_SLABSIZE));
+
+    auto sendToBoard = [&](Board *board, RingBuffer *ring) {
+        const char *data = nullptr;
+        ssize_t avail = 0;
+        auto read = [&](char *buf, qint64 maxLen) -> qint64 {
+            if (!avail) {
+                const void *slab;
+                avail = ring->read(&slab);
+                if (avail <= 0)
+                    return avail;
+                data = (const char *) slab;
             }
+            qint64 n = qMin((qint64) avail, maxLen);
+            memcpy(buf, data, n);
+            data += n;
+            avail -= n;
+            return n;
+        };
+
+        /* The download fills the ring meanwhile */
+        bool sent = sendBootloaderFiles(board);
+        if (sent) {
+            boardProgress(board, 80, tr("Sending image to device (this may take several minutes)..."));
+            QString error;
+            sent = sendImageToBoard(board, _imageSize, read, error);
+            if (!sent && !imageFailed && !_cancelled)
+                boardFailed(board, error);
         }
 
-        if (useCache) {
-            urlstr = QUrl::fromLocalFile(localCachePath).toString(QUrl::FullyEncoded);
-        } else {
-            urlstr = QString(BOOTIMG_URL).arg("t3-gem-o1").arg(fileName);
-            if (fi.exists()) {
-                QFile::remove(localCachePath);
+        if (!sent) {
+            ring->cancel();
+            /* Stop the download, it has nowhere to go */
+            if (--boardsLeft == 0) {
+                cancelDownload();
+                stream.cancel();
             }
         }
+    };
 
-        DownloadThread dt(urlstr.toUtf8(), tmp.fileName().toUtf8(), expectedHash, true);
-        if (urlstr.startsWith("http")) {
-            dt.setCacheFile(localCachePath);
+    std::thread distributor([&]() {
+        if (!fetchBootloaderFiles()) {
+            cancelDownload();
+            stream.cancel();
+            return;
         }
 
-        dt.start();
-        dt.wait();
-
-        if (!dt.successfull()) {
-            emit error(tr("Failed to download bootloader file: %1").arg(fileName));
-            QFile::remove(localCachePath); // clean up failed cache
-            return false;
+        std::vector<std::thread> senders;
+        for (int i = 0; i < _boards.size(); i++)
+            senders.emplace_back(sendToBoard, _boards[i], rings[i].get());
+
+        /* A ring is cancelled once its board failed, and is left out from then on */
+        std::vector<bool> feeding(rings.size(), true);
+        const void *slab;
+        ssize_t len;
+        while ((len = stream.read(&slab)) > 0) {
+            for (size_t i = 0; i < rings.size(); i++) {
+                if (feeding[i] && !rings[i]->write((const char *) slab, len))
+                    feeding[i] = false;
+            }
+        }
+        for (const std::unique_ptr<RingBuffer> &ring : rings) {
+            if (len == 0)
+                ring->close();
+            else
+                ring->cancel();
         }
 
-        _bootloaderFiles[i] = tmp.fileName();
-        qDebug() << "Ready" << fileName << "from" << urlstr;
-    }
+        for (std::thread &t : senders)
+            t.join();
+    });
 
-    return true;
-}
+    setOutputStream(&stream);
+    DownloadExtractThread::run();
+    waitForExtractThread();
+    setOutputStream(nullptr);
 
-bool DfuThread::sendImageToRawemmc()
-{
-    if (!QFile::exists(_tempImagePath)) {
-        emit error(tr("Image not found: %1").arg(_tempImagePath));
-        return false;
+    if (_successful && !_cancelled) {
+        stream.close();
+    } else {
+        /* The devices must not finish an incomplete or corrupt image */
+        imageFailed = true;
+        stream.cancel();
     }
-    return runDfu(DfuWrapper::ALT_RAWEMMC, _tempImagePath, false);
+    distributor.join();
+
+    return !imageFailed && !_cancelled && boardsLeft > 0;
 }
@@ -7,7 +7,11 @@
 #define DFUTHREAD_H
 
 #include "downloadextractthread.h"
+#include "dfuwrapper.h"
+#include "bootfilecache.h"
 #include <QTemporaryFile>
+#include <functional>
+#include <mutex>
 
 class DfuThread : public DownloadExtractThread
 {
@@ -19,25 +23,82 @@ public:
 
     bool isImage() override;
 
+    /* Keep the customized image as filename, an entry of the extracted image cache.
+       extractedCacheFileUpdated(key) is emitted once it is complete */
+    void setCustomizedImageCache(const QString &filename, const QByteArray &key);
+    /* Send a customized image from the cache, instead of downloading and customizing it */
+    void setCustomizedImage(const QString &filename);
+    /* Flash the boards at these USB paths (see DfuWrapper::devicePaths()) at once,
+       from a single download. Without, the first board found is flashed */
+    void setBoardPaths(const QStringList &paths);
+    /* Size of the extracted image, 0 if not known. Needed to send it sparse while streaming */
+    void setImageSize(quint64 size);
+    /* Only boot the boards and have U-Boot export their eMMC as USB mass
+       storage, instead of sending them the image. umsStarted() is emitted
+       instead of success() */
+    void setUmsMode(bool enabled);
+    /* Also stops the boards waiting for or receiving data */
+    void cancelDownload() override;
+
 signals:
     void dfuProgress(int percentage, QString statusMsg);
+    /* The eMMC of this many boards is about to show up as a storage device */
+    void umsStarted(int boards);
 
 protected:
+    /* A board being flashed, with one DFU session for all its stages */
+    struct Board
+    {
+        QString path;
+        DfuWrapper dfu;
+        int progress = 0;
+        /* Set once the board failed. The others carry on */
+        QString error;
+    };
+
     void run() override;
     bool _openAndPrepareDevice() override;
 
+    /* Sends size bytes of image, pulled from read(), to a board that runs
+       U-Boot's DFU mode by now. On failure, error says why */
+    virtual bool sendImageToBoard(Board *board, qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read, QString &error);
+    bool sendImage(Board *board, qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read);
+    void boardProgress(Board *board, int percentage, const QString &statusMsg);
+
 private:
+    /* Outlives fetchBootloaderFiles(), so revalidating list.json does not hold up flashing */
+    BootFileCache _bootFileCache{"t3-gem-o1"};
     QString _bootloaderFiles[3];
     QByteArray _expectedTiboot3Hash;
     QByteArray _expectedTisplHash;
     QByteArray _expectedUbootHash;
     QTemporaryFile *_tempImageFile;
+
+    QList<Board *> _boards;
+    std::mutex _boardsMutex;
     QString _tempImagePath;
+    QString _customizedCacheFile;
+    QByteArray _customizedCacheKey;
+    QString _customizedImage;
+    /* The image goes from the write queue straight to the device, without a temporary file */
+    bool _streamImage;
+    quint64 _imageSize;
+    bool _umsMode;
 
-    bool runDfu(const QString &altSetting, const QString &filePath, bool resetAfter);
+    bool runDfu(Board *board, const QString &altSetting, const QString &filePath);
     bool fetchBootloaderFiles();
-    bool sendBootloaderFiles();
-    bool sendImageToRawemmc();
+    bool sendBootloaderFiles(Board *board);
+    bool sendImageToRawemmc(Board *board);
+    bool enterUms(Board *board);
+    bool streamImageToRawemmc();
+
+    /* Runs step on every board that has not failed, concurrently.
+       Returns false if none are left, or if cancelled */
+    bool forEachBoard(const std::function<bool(Board *board)> &step);
+    void boardFailed(Board *board, const QString &msg);
+    bool boardOk(Board *board);
+    /* "path: error" of every board that failed */
+    QStringList failedBoards();
 };
 
 #endif // DFUTHREAD_H
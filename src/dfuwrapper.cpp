@@ -4,9 +4,19 @@
  */
 
 #include "dfuwrapper.h"
+#include "sparseimage.h"
+#include "metrics.h"
+#include "pipelinetrace.h"
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QSettings>
 #include <QThread>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <string.h>
 #include <stdlib.h>
 
@@ -36,8 +46,369 @@ extern "C" {
     const char *match_serial_dfu = nullptr;
 }
 
+namespace {
+
+// U-Boot's rawemmc alt-setting can take minutes to flush its DFU buffer to eMMC
+constexpr unsigned int STREAM_TIMEOUT_MS = 300000;
+constexpr int STREAM_READ_BUFFER_SIZE = 1024 * 1024;
+// How long findDevice() waits for the device, and how often it probes anyway
+constexpr int FIND_DEVICE_TIMEOUT_MS = 15000;
+constexpr int REPROBE_INTERVAL_MS = 200;
+// Smallest transfer size tried when the device or the USB stack rejects larger ones
+constexpr int MIN_TRANSFER_SIZE = 512;
+
+// dfu-util keeps its match criteria and the probed device list in globals,
+// shared by all sessions. Probing is serialized, and each session takes the
+// list it probed. The dfu-util timeout is global as well: it stays raised
+// while any session is streaming
+std::mutex probeMutex;
+int streamingSessions = 0;
+
+// Counts arrivals of matching devices, reported on the event thread
+struct ArrivalWatch
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    int arrivals = 0;
+
+    // Returns once a device arrived, or after ms
+    void wait(int ms)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        int seen = arrivals;
+        cv.wait_for(lock, std::chrono::milliseconds(ms), [this, seen] { return arrivals != seen; });
+    }
+};
+
+int LIBUSB_CALL deviceArrived(libusb_context *, libusb_device *, libusb_hotplug_event, void *userData)
+{
+    ArrivalWatch *watch = static_cast<ArrivalWatch *>(userData);
+    {
+        std::lock_guard<std::mutex> lock(watch->mutex);
+        watch->arrivals++;
+    }
+    watch->cv.notify_all();
+    return 0;
+}
+
+const char *transferStatusName(int status)
+{
+    // Named like the libusb errors the synchronous calls return
+    switch (status) {
+    case LIBUSB_TRANSFER_TIMED_OUT: return "LIBUSB_ERROR_TIMEOUT";
+    case LIBUSB_TRANSFER_STALL:     return "LIBUSB_ERROR_PIPE";
+    case LIBUSB_TRANSFER_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+    case LIBUSB_TRANSFER_OVERFLOW:  return "LIBUSB_ERROR_OVERFLOW";
+    case LIBUSB_TRANSFER_CANCELLED: return "LIBUSB_ERROR_INTERRUPTED";
+    default:                        return "LIBUSB_ERROR_IO";
+    }
+}
+
+// Settings group of the alt setting, like dfu/0451-6165/rawemmc
+QString transferSizeGroup(const struct dfu_if *dif)
+{
+    return QString("dfu/%1-%2/%3")
+        .arg(dif->vendor, 4, 16, QChar('0'))
+        .arg(dif->product, 4, 16, QChar('0'))
+        .arg(dif->alt_name ? QString::fromUtf8(dif->alt_name) : QString::number(dif->altsetting));
+}
+
+// Reads the data on its own thread into two buffers, so one is filled
+// while the other goes out over USB
+class StreamPrefetcher
+{
+public:
+    // size 0 reads until read() returns 0
+    StreamPrefetcher(qint64 size, const std::function<qint64(char *, qint64)> &read)
+        : _read(read), _remaining(size > 0 ? size : -1)
+    {
+        for (Slot &slot : _slots)
+            slot.buf.resize(STREAM_READ_BUFFER_SIZE);
+        _thread = std::thread(&StreamPrefetcher::run, this);
+    }
+
+    ~StreamPrefetcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+        _cv.notify_all();
+        _thread.join();
+    }
+
+    // Waits for the next buffer. Returns its length, 0 at the end of the
+    // data or -1 if reading failed. Hand it back with release()
+    qint64 acquire(const char **data)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        Slot &slot = _slots[_consumer];
+        _cv.wait(lock, [&slot] { return slot.state != Slot::Empty; });
+        *data = slot.buf.constData();
+        return slot.state == Slot::Full ? slot.len : (slot.state == Slot::End ? 0 : -1);
+    }
+
+    void release()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _slots[_consumer].state = Slot::Empty;
+            _consumer ^= 1;
+        }
+        _cv.notify_all();
+    }
+
+private:
+    struct Slot {
+        enum State { Empty, Full, End, Failed } state = Empty;
+        QByteArray buf;
+        qint64 len = 0;
+    };
+
+    std::function<qint64(char *, qint64)> _read;
+    // -1 if not known
+    qint64 _remaining;
+    Slot _slots[2];
+    int _consumer = 0;
+    bool _stop = false;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::thread _thread;
+
+    // Fills buf completely, unless the data ends early. -1 on error
+    qint64 fill(char *buf, qint64 len)
+    {
+        qint64 got = 0;
+        while (got < len) {
+            qint64 n = _read(buf + got, len - got);
+            if (n < 0)
+                return -1;
+            if (n == 0)
+                break;
+            got += n;
+        }
+        return got;
+    }
+
+    void run()
+    {
+        for (int producer = 0; ; producer ^= 1) {
+            Slot &slot = _slots[producer];
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _cv.wait(lock, [this, &slot] { return _stop || slot.state == Slot::Empty; });
+                if (_stop)
+                    return;
+            }
+
+            qint64 want = _remaining < 0 ? slot.buf.size() : qMin(_remaining, (qint64)slot.buf.size());
+            qint64 len = want ? fill(slot.buf.data(), want) : 0;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                slot.len = len;
+                if (len > 0)
+                    slot.state = Slot::Full;
+                else if (len == 0 && (want == 0 || _remaining < 0))
+                    slot.state = Slot::End;
+                else
+                    slot.state = Slot::Failed;
+            }
+            _cv.notify_all();
+            if (len <= 0)
+                return;
+            if (_remaining >= 0)
+                _remaining -= len;
+        }
+    }
+};
+
+// Asynchronous DFU download. The completion callbacks run on the event
+// thread of the DfuWrapper and chain each DFU_DNLOAD straight to its DFU_GETSTATUS. When the
+// device is busy, the next poll is submitted at the time it asked for in
+// bwPollTimeout. Two DNLOAD transfers are used in turns, so the next chunk
+// can be put in place while the current one is in flight.
+class StreamTransfer
+{
+public:
+    StreamTransfer(libusb_device_handle *handle, uint16_t interface, int xferSize)
+        : _handle(handle), _interface(interface)
+    {
+        for (int i = 0; i < 2; i++) {
+            _dnloadBuf[i].resize(LIBUSB_CONTROL_SETUP_SIZE + xferSize);
+            _dnload[i] = libusb_alloc_transfer(0);
+        }
+        _statusBuf.resize(LIBUSB_CONTROL_SETUP_SIZE + 6);
+        _status = libusb_alloc_transfer(0);
+    }
+
+    ~StreamTransfer()
+    {
+        {
+            // Nothing may complete after the transfers are freed
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (_phase == Busy && _active) {
+                libusb_cancel_transfer(_active);
+                _cv.wait(lock, [this] { return _phase != Busy; });
+            }
+        }
+
+        for (int i = 0; i < 2; i++)
+            libusb_free_transfer(_dnload[i]);
+        libusb_free_transfer(_status);
+    }
+
+    bool isValid() const
+    {
+        return _dnload[0] && _dnload[1] && _status;
+    }
+
+    unsigned char *buffer(int i)
+    {
+        return (unsigned char *)_dnloadBuf[i].data() + LIBUSB_CONTROL_SETUP_SIZE;
+    }
+
+    // Sends len bytes from buffer(i). Completes in the background
+    bool submit(int i, int len, unsigned short transaction)
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        unsigned char *buf = (unsigned char *)_dnloadBuf[i].data();
+        libusb_fill_control_setup(buf,
+                                  LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                  DFU_DNLOAD, transaction, _interface, len);
+        libusb_fill_control_transfer(_dnload[i], _handle, buf, dnloadDone, this, STREAM_TIMEOUT_MS);
+        return submitLocked(_dnload[i], "Download error: %1");
+    }
+
+    // Fails the transfer in flight, and any submitted later
+    void cancel()
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _cancelled = true;
+        if (_phase == Busy && _active)
+            libusb_cancel_transfer(_active);
+        else if (_phase != Failed)
+            failLocked("Cancelled");
+    }
+
+    // Waits until the device is ready for the next chunk
+    bool waitReady(QString &error)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;) {
+            switch (_phase) {
+            case Ready:
+                return true;
+            case Failed:
+                error = _error;
+                return false;
+            case Busy:
+                _cv.wait(lock, [this] { return _phase != Busy; });
+                break;
+            case Waiting:
+                if (_cv.wait_until(lock, _pollAt) == std::cv_status::timeout)
+                    submitStatusLocked();
+                break;
+            }
+        }
+    }
+
+private:
+    enum Phase { Ready, Busy, Waiting, Failed };
+
+    libusb_device_handle *_handle;
+    uint16_t _interface;
+    QByteArray _dnloadBuf[2], _statusBuf;
+    libusb_transfer *_dnload[2], *_status;
+    libusb_transfer *_active = nullptr;
+
+    Phase _phase = Ready;
+    bool _cancelled = false;
+    QString _error;
+    std::chrono::steady_clock::time_point _pollAt;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+
+    void failLocked(const QString &error)
+    {
+        _error = error;
+        _phase = Failed;
+        _active = nullptr;
+        _cv.notify_all();
+    }
+
+    bool submitLocked(libusb_transfer *transfer, const char *errorFormat)
+    {
+        if (_cancelled) {
+            failLocked("Cancelled");
+            return false;
+        }
+        int ret = libusb_submit_transfer(transfer);
+        if (ret < 0) {
+            failLocked(QString(errorFormat).arg(libusb_error_name(ret)));
+            return false;
+        }
+        _active = transfer;
+        _phase = Busy;
+        return true;
+    }
+
+    void submitStatusLocked()
+    {
+        unsigned char *buf = (unsigned char *)_statusBuf.data();
+        libusb_fill_control_setup(buf,
+                                  LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+                                  DFU_GETSTATUS, 0, _interface, 6);
+        libusb_fill_control_transfer(_status, _handle, buf, statusDone, this, STREAM_TIMEOUT_MS);
+        submitLocked(_status, "Status poll error: %1");
+    }
+
+    static void LIBUSB_CALL dnloadDone(struct libusb_transfer *transfer)
+    {
+        StreamTransfer *self = static_cast<StreamTransfer *>(transfer->user_data);
+        std::lock_guard<std::mutex> lock(self->_mutex);
+
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+            self->failLocked(QString("Download error: %1").arg(transferStatusName(transfer->status)));
+        else
+            self->submitStatusLocked();
+    }
+
+    static void LIBUSB_CALL statusDone(struct libusb_transfer *transfer)
+    {
+        StreamTransfer *self = static_cast<StreamTransfer *>(transfer->user_data);
+        std::lock_guard<std::mutex> lock(self->_mutex);
+
+        if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != 6) {
+            self->failLocked(QString("Status poll error: %1").arg(
+                transfer->status == LIBUSB_TRANSFER_COMPLETED ? "LIBUSB_ERROR_IO" : transferStatusName(transfer->status)));
+            return;
+        }
+
+        const unsigned char *st = libusb_control_transfer_get_data(transfer);
+        unsigned char bStatus = st[0], bState = st[4];
+        unsigned int bwPollTimeout = st[1] | (st[2] << 8) | (st[3] << 16);
+
+        if (bState == DFU_STATE_dfuERROR || bStatus != DFU_STATUS_OK) {
+            self->failLocked(QString("DFU device error: state=%1 status=%2").arg(bState).arg(bStatus));
+        } else if (bState == DFU_STATE_dfuDNLOAD_IDLE) {
+            self->_phase = Ready;
+            self->_active = nullptr;
+            self->_cv.notify_all();
+        } else if (bwPollTimeout == 0) {
+            self->submitStatusLocked();
+        } else {
+            self->_pollAt = std::chrono::steady_clock::now() + std::chrono::milliseconds(bwPollTimeout);
+            self->_phase = Waiting;
+            self->_active = nullptr;
+            self->_cv.notify_all();
+        }
+    }
+};
+
+} // namespace
+
 DfuWrapper::DfuWrapper(QObject *parent)
-    : QObject(parent), usbContext(nullptr), dfuDevice(nullptr), initialized(false)
+    : QObject(parent), usbContext(nullptr), dfuDevice(nullptr), devices(nullptr), initialized(false), stopEvents(0)
 {}
 
 DfuWrapper::~DfuWrapper()
@@ -63,10 +434,104 @@ bool DfuWrapper::initialize()
         return false;
     }
 
+    // Completes asynchronous transfers and reports hotplug events, for as
+    // long as the session lasts
+    stopEvents = 0;
+    eventThread = std::thread([this]() {
+        while (!stopEvents) {
+            struct timeval tv = {0, 100000};
+            libusb_handle_events_timeout_completed(usbContext, &tv, &stopEvents);
+        }
+    });
+
     initialized = true;
     return true;
 }
 
+// Entry for the alt setting in the probed device list. On dev only, if given
+struct dfu_if *DfuWrapper::findAltSetting(struct libusb_device *dev, const QByteArray &altName)
+{
+    for (struct dfu_if *pdfu = devices; pdfu; pdfu = pdfu->next) {
+        if (dev && pdfu->dev != dev)
+            continue;
+        if (altName.isEmpty() || (pdfu->alt_name && altName == pdfu->alt_name))
+            return pdfu;
+    }
+    return nullptr;
+}
+
+bool DfuWrapper::hasAltSetting(const QString &altSettingName)
+{
+    return dfuDevice && findAltSetting(dfuDevice->dev, altSettingName.toUtf8());
+}
+
+void DfuWrapper::closeDevice()
+{
+    if (dfuDevice && dfuDevice->dev_handle) {
+        libusb_close(dfuDevice->dev_handle);
+        dfuDevice->dev_handle = nullptr;
+    }
+    dfuDevice = nullptr;
+}
+
+void DfuWrapper::releaseDevices()
+{
+    if (!devices)
+        return;
+
+    std::lock_guard<std::mutex> lock(probeMutex);
+    dfu_root = devices;
+    devices = nullptr;
+    disconnect_devices();
+}
+
+QStringList DfuWrapper::devicePaths(int vendorId, int productId)
+{
+    return deviceSpeeds(vendorId, productId).keys();
+}
+
+QMap<QString, int> DfuWrapper::deviceSpeeds(int vendorId, int productId)
+{
+    static const int speeds[] = {0, 1, 12, 480, 5000, 10000};
+    QMap<QString, int> paths;
+    struct libusb_context *ctx;
+    if (libusb_init(&ctx) < 0)
+        return paths;
+
+    libusb_device **list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    for (ssize_t i = 0; i < count; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) != 0
+            || desc.idVendor != vendorId || desc.idProduct != productId)
+            continue;
+        QString path = usbPath(list[i]);
+        if (path.isEmpty())
+            continue;
+        int speed = libusb_get_device_speed(list[i]);
+        paths.insert(path, speed >= 0 && speed < (int) (sizeof(speeds)/sizeof(speeds[0])) ? speeds[speed] : 0);
+    }
+    if (count >= 0)
+        libusb_free_device_list(list, 1);
+    libusb_exit(ctx);
+
+    return paths;
+}
+
+// Same format as dfu-util's get_path(), which match_path is compared with
+QString DfuWrapper::usbPath(struct libusb_device *dev)
+{
+    uint8_t ports[8];
+    int depth = libusb_get_port_numbers(dev, ports, sizeof(ports));
+    if (depth <= 0)
+        return QString();
+
+    QString path = QString("%1-%2").arg(libusb_get_bus_number(dev)).arg(ports[0]);
+    for (int j = 1; j < depth; j++)
+        path += QString(".%1").arg(ports[j]);
+    return path;
+}
+
 bool DfuWrapper::findDevice(int vendorId, int productId, const QString &altSettingName)
 {
     if (!initialized) {
@@ -74,32 +539,82 @@ bool DfuWrapper::findDevice(int vendorId, int productId, const QString &altSetti
         return false;
     }
 
-    match_vendor  = vendorId;
-    match_product = productId;
+    QByteArray altName = altSettingName.toUtf8();
 
-    _altNameBytes = altSettingName.toUtf8();
-    match_iface_alt_name = altSettingName.isEmpty() ? nullptr : _altNameBytes.constData();
+    // Still the same device: switch to the other alt setting on the open
+    // handle, with the descriptors parsed when the device was found
+    if (dfuDevice && dfuDevice->dev_handle
+        && dfuDevice->vendor == vendorId && dfuDevice->product == productId) {
+        struct dfu_if *alt = findAltSetting(dfuDevice->dev, altName);
+        int config;
+        if (alt && libusb_get_configuration(dfuDevice->dev_handle, &config) == 0) {
+            if (alt != dfuDevice) {
+                alt->dev_handle = dfuDevice->dev_handle;
+                dfuDevice->dev_handle = nullptr;
+                dfuDevice = alt;
+            }
+            emit statusMessage(QString("Using open DFU device with alt:%1").arg(altSettingName));
+            return true;
+        }
+    }
+    closeDevice();
+
+    // A device that is re-enumerating shows up as soon as it arrives,
+    // instead of at the next probe. Registered before the first probe,
+    // so an arrival in between is not missed
+    ArrivalWatch watch;
+    libusb_hotplug_callback_handle hotplug;
+    bool hotplugRegistered = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+        && libusb_hotplug_register_callback(usbContext, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_NO_FLAGS,
+                                            vendorId, productId, LIBUSB_HOTPLUG_MATCH_ANY,
+                                            deviceArrived, &watch, &hotplug) == LIBUSB_SUCCESS;
 
-    for (int attempt = 0; attempt < 15; attempt++) {
-        if (attempt > 0) {
-            qDebug() << "Retry" << attempt << "searching for DFU device...";
-            QThread::sleep(1);
+    QElapsedTimer timer;
+    timer.start();
+    for (;;) {
+        releaseDevices();
+        {
+            std::lock_guard<std::mutex> lock(probeMutex);
+            // Every alt setting is kept in the device list, so a later stage can switch to it
+            match_vendor  = vendorId;
+            match_product = productId;
+            match_iface_alt_name = nullptr;
+            match_path = devicePath.isEmpty() ? nullptr : devicePath.data();
+            probe_devices(usbContext);
+            devices = dfu_root;
+            dfu_root = nullptr;
+            match_path = nullptr;
         }
-        disconnect_devices();
-        probe_devices(usbContext);
-        if (dfu_root)
+        dfuDevice = findAltSetting(nullptr, altName);
+        if (dfuDevice || cancelled || timer.elapsed() >= FIND_DEVICE_TIMEOUT_MS)
             break;
+        // Probing again after a while covers a device that arrived before
+        // it could be probed, and platforms without hotplug
+        int ms = (int)qMin((qint64)REPROBE_INTERVAL_MS, FIND_DEVICE_TIMEOUT_MS - timer.elapsed());
+        Metrics::add(Metrics::DfuRetries);
+        if (hotplugRegistered)
+            watch.wait(ms);
+        else
+            QThread::msleep(ms);
     }
 
-    if (!dfu_root) {
-        setError(QString("No DFU device found (VID:0x%1 PID:0x%2 alt:%3) after 15 retries")
+    if (hotplugRegistered)
+        libusb_hotplug_deregister_callback(usbContext, hotplug);
+
+    if (!dfuDevice && cancelled) {
+        setError("Cancelled");
+        return false;
+    }
+    if (!dfuDevice) {
+        setError(QString("No DFU device found%5 (VID:0x%1 PID:0x%2 alt:%3) within %4 seconds")
                 .arg(vendorId, 4, 16, QChar('0'))
                 .arg(productId, 4, 16, QChar('0'))
-                .arg(altSettingName));
+                .arg(altSettingName)
+                .arg(FIND_DEVICE_TIMEOUT_MS / 1000)
+                .arg(devicePath.isEmpty() ? QString() : QString(" at %1").arg(QString(devicePath))));
         return false;
     }
-
-    dfuDevice = dfu_root;
+    qDebug() << "Found DFU device after" << timer.elapsed() << "ms";
 
     int ret = libusb_open(dfuDevice->dev, &dfuDevice->dev_handle);
     if (ret < 0) {
@@ -161,6 +676,12 @@ bool DfuWrapper::downloadFile(const QString &filePath, bool resetAfter)
         return false;
     }
 
+    // The bootloader files are small, and go out in one synchronous call
+    if (cancelled) {
+        setError("Cancelled");
+        return false;
+    }
+
     if (!claimInterface())
         return false;
 
@@ -213,98 +734,228 @@ bool DfuWrapper::downloadFile(const QString &filePath, bool resetAfter)
     return true;
 }
 
-bool DfuWrapper::downloadFileStreaming(const QString &filePath)
+bool DfuWrapper::detach()
 {
     if (!dfuDevice || !dfuDevice->dev_handle) {
         setError("No DFU device");
         return false;
     }
-
+    if (cancelled) {
+        setError("Cancelled");
+        return false;
+    }
     if (!claimInterface())
         return false;
 
+    // U-Boot leaves the dfu command on the reset that follows the detach.
+    // The device is gone by then, so errors are expected
+    emit statusMessage("Leaving DFU mode...");
+    dfu_detach(dfuDevice->dev_handle, dfuDevice->interface, 1000);
+    libusb_release_interface(dfuDevice->dev_handle, dfuDevice->interface);
+    libusb_reset_device(dfuDevice->dev_handle);
+    libusb_close(dfuDevice->dev_handle);
+    dfuDevice->dev_handle = nullptr;
+
+    return true;
+}
+
+bool DfuWrapper::downloadFileStreaming(const QString &filePath)
+{
     QFile file(filePath);
     if (!file.open(QIODevice::ReadOnly)) {
         setError(QString("Failed to open file: %1").arg(filePath));
-        libusb_release_interface(dfuDevice->dev_handle, dfuDevice->interface);
         return false;
     }
 
     qint64 fileSize = file.size();
     if (fileSize == 0) {
         setError("Image file is empty, cannot transfer");
-        libusb_release_interface(dfuDevice->dev_handle, dfuDevice->interface);
         return false;
     }
 
+    return downloadStream(fileSize, [&file](char *buf, qint64 maxLen) {
+        return file.read(buf, maxLen);
+    });
+}
+
+bool DfuWrapper::downloadSparseStream(qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read)
+{
+    if (size <= 0) {
+        setError("Sparse transfer needs the image size");
+        return false;
+    }
+
+    // Written in eMMC blocks of 4 KB
+    SparseImageEncoder encoder(size, 4096, read);
+    bool ok = downloadStream(0, [&encoder](char *buf, qint64 maxLen) {
+        return encoder.read(buf, maxLen);
+    });
+
+    if (ok)
+        qDebug() << "Sent" << size << "byte image as" << encoder.encodedBytes() << "byte sparse image";
+    else if (!encoder.errorString().isEmpty())
+        setError(encoder.errorString());
+    return ok;
+}
+
+bool DfuWrapper::downloadStream(qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read)
+{
+    if (!dfuDevice || !dfuDevice->dev_handle) {
+        setError("No DFU device");
+        return false;
+    }
+
+    if (!claimInterface())
+        return false;
+
     int xfer_size = getTransferSize();
-    if (xfer_size <= 0)
-        xfer_size = 4096;
+    if (transferSizeLimit() <= 4096)
+        qDebug() << "Device advertises a DFU transfer size of" << transferSizeLimit()
+                 << "bytes. U-Boot built with a larger DFU_USB_BUFSIZ transfers faster";
 
-    // U-Boot's rawemmc alt-setting can take minutes to flush its DFU buffer to eMMC
-    dfu_set_timeout(300000);
+    {
+        std::lock_guard<std::mutex> lock(probeMutex);
+        if (streamingSessions++ == 0)
+            dfu_set_timeout(STREAM_TIMEOUT_MS);
+    }
 
-    emit statusMessage(QString("Streaming %1 MB to device (this may take several minutes)...")
-                       .arg(fileSize / 1024 / 1024));
+    if (size > 0)
+        emit statusMessage(QString("Streaming %1 MB to device (this may take several minutes)...")
+                           .arg(size / 1024 / 1024));
+    else
+        emit statusMessage("Streaming image to device (this may take several minutes)...");
 
-    QByteArray buf(xfer_size, 0);
     unsigned short transaction = 0;
     qint64 bytesSent = 0;
     bool ok = true;
 
-    while (bytesSent < fileSize && ok) {
-        qint64 bytesRead = file.read(buf.data(), qMin((qint64)xfer_size, fileSize - bytesSent));
-        if (bytesRead <= 0) {
-            setError("File read error during streaming");
-            ok = false;
-            break;
-        }
+    {
+        StreamPrefetcher prefetcher(size, read);
+        std::unique_ptr<StreamTransfer> transfer;
+        const char *data = nullptr;
+        qint64 dataLen = 0, dataPos = 0;
+        bool endOfData = false;
+        // Data staged for a transfer size that did not work, sent again first
+        QByteArray resend;
 
-        int ret = dfu_download(dfuDevice->dev_handle, dfuDevice->interface,
-                               (unsigned short)bytesRead, transaction++,
-                               (unsigned char *)buf.data());
-        if (ret < 0) {
-            setError(QString("Download error: %1").arg(libusb_error_name(ret)));
-            ok = false;
-            break;
-        }
+        // Copies the next chunk into the buffer of transfer i.
+        // Chunks are full-sized up to the last one. -1 on read error
+        auto stage = [&](int i) -> int {
+            unsigned char *buf = transfer->buffer(i);
+            int len = qMin(xfer_size, (int)resend.size());
+            memcpy(buf, resend.constData(), len);
+            resend.remove(0, len);
+            while (len < xfer_size && !endOfData) {
+                if (dataPos == dataLen) {
+                    if (data)
+                        prefetcher.release();
+                    data = nullptr;
+                    dataLen = prefetcher.acquire(&data);
+                    dataPos = 0;
+                    if (dataLen < 0)
+                        return -1;
+                    if (dataLen == 0) {
+                        endOfData = true;
+                        break;
+                    }
+                }
+                int n = (int)qMin((qint64)(xfer_size - len), dataLen - dataPos);
+                memcpy(buf + len, data + dataPos, n);
+                len += n;
+                dataPos += n;
+            }
+            return len;
+        };
+
+        int staged[2] = {0, 0};
+        int cur = 0;
+        // Sets up the transfers for xfer_size and stages the first chunk
+        auto start = [&]() -> bool {
+            {
+                std::lock_guard<std::mutex> lock(cancelMutex);
+                transfer.reset(new StreamTransfer(dfuDevice->dev_handle, dfuDevice->interface, xfer_size));
+                StreamTransfer *t = transfer.get();
+                cancelTransfer = [t] { t->cancel(); };
+            }
+            if (cancelled)
+                transfer->cancel();
+            if (!transfer->isValid()) {
+                setError("Cannot allocate USB transfers");
+                return false;
+            }
+            transaction = 0;
+            cur = 0;
+            staged[0] = stage(0);
+            staged[1] = 0;
+            return true;
+        };
 
-        bytesSent += bytesRead;
+        // Whether the first chunk went through yet
+        bool probing = true;
+        ok = start();
+        while (ok && staged[cur] > 0) {
+            TraceSpan span("dfuBlock");
+            // Staging the next chunk overlaps with the transfer in flight
+            if (transfer->submit(cur, staged[cur], transaction++))
+                staged[cur ^ 1] = stage(cur ^ 1);
 
-        // Poll until device is ready for the next chunk
-        struct dfu_status dst;
-        do {
-            ret = dfu_get_status(dfuDevice, &dst);
-            if (ret < 0) {
-                setError(QString("Status poll error: %1").arg(libusb_error_name(ret)));
+            QString error;
+            if (!transfer->waitReady(error)) {
+                // The limit the device advertises can still be too large for
+                // it, or for the USB stack of the host. The first chunk finds
+                // out: start over with half the size, from the same data
+                if (probing && !cancelled && staged[cur ^ 1] >= 0 && xfer_size / 2 >= MIN_TRANSFER_SIZE) {
+                    QByteArray again((const char *)transfer->buffer(cur), staged[cur]);
+                    again.append((const char *)transfer->buffer(cur ^ 1), staged[cur ^ 1]);
+                    resend.prepend(again);
+                    {
+                        std::lock_guard<std::mutex> lock(cancelMutex);
+                        cancelTransfer = nullptr;
+                        transfer.reset();
+                    }
+                    if (abortDownload()) {
+                        qDebug() << "Transfer size" << xfer_size << "failed:" << error;
+                        xfer_size /= 2;
+                        ok = start();
+                        continue;
+                    }
+                }
+                setError(error);
                 ok = false;
                 break;
             }
-            if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE || dst.bState == DFU_STATE_dfuERROR)
-                break;
-            QThread::msleep(dst.bwPollTimeout > 0 ? dst.bwPollTimeout : 1);
-        } while (1);
 
-        if (!ok) break;
+            if (probing) {
+                probing = false;
+                rememberTransferSize(xfer_size);
+            }
+
+            bytesSent += staged[cur];
+            if ((bytesSent % (10LL * 1024 * 1024)) < staged[cur] || bytesSent == size) {
+                if (size > 0)
+                    emit statusMessage(QString("Transferred %1 / %2 MB...")
+                                       .arg(bytesSent / 1024 / 1024).arg(size / 1024 / 1024));
+                else
+                    emit statusMessage(QString("Transferred %1 MB...").arg(bytesSent / 1024 / 1024));
+            }
+            cur ^= 1;
+        }
 
-        if (dst.bStatus != DFU_STATUS_OK) {
-            setError(QString("DFU device error: state=%1 status=%2").arg(dst.bState).arg(dst.bStatus));
+        if (ok && staged[cur] < 0) {
+            setError("File read error during streaming");
             ok = false;
-            break;
         }
 
-        if ((bytesSent % (10LL * 1024 * 1024)) < xfer_size || bytesSent == fileSize)
-            emit statusMessage(QString("Transferred %1 / %2 MB...")
-                               .arg(bytesSent / 1024 / 1024).arg(fileSize / 1024 / 1024));
+        std::lock_guard<std::mutex> lock(cancelMutex);
+        cancelTransfer = nullptr;
+        transfer.reset();
     }
 
-    file.close();
-
     // Verify all bytes were actually sent before signalling end of transfer.
-    // If bytesSent < fileSize the loop exited early due to an error (ok == false).
-    if (ok && bytesSent != fileSize) {
+    // If bytesSent < size the loop exited early due to an error (ok == false).
+    if (ok && size > 0 && bytesSent != size) {
         setError(QString("Transfer incomplete: sent %1 of %2 bytes")
-                 .arg(bytesSent).arg(fileSize));
+                 .arg(bytesSent).arg(size));
         ok = false;
     }
 
@@ -348,6 +999,11 @@ bool DfuWrapper::downloadFileStreaming(const QString &filePath)
                 ok = false;
                 break;
             }
+            if (cancelled) {
+                setError("Cancelled");
+                ok = false;
+                break;
+            }
 
             unsigned int pollMs = finalStatus.bwPollTimeout > 0 ? finalStatus.bwPollTimeout : 100;
             QThread::msleep(pollMs);
@@ -361,19 +1017,25 @@ bool DfuWrapper::downloadFileStreaming(const QString &filePath)
         }
     }
 
-    dfu_set_timeout(5000);
+    {
+        std::lock_guard<std::mutex> lock(probeMutex);
+        if (--streamingSessions == 0)
+            dfu_set_timeout(5000);
+    }
     libusb_release_interface(dfuDevice->dev_handle, dfuDevice->interface);
     return ok;
 }
 
 void DfuWrapper::cleanup()
 {
-    if (dfuDevice && dfuDevice->dev_handle) {
-        libusb_close(dfuDevice->dev_handle);
-        dfuDevice->dev_handle = nullptr;
+    closeDevice();
+    releaseDevices();
+
+    if (eventThread.joinable()) {
+        stopEvents = 1;
+        libusb_interrupt_event_handler(usbContext);
+        eventThread.join();
     }
-    disconnect_devices();
-    dfuDevice = nullptr;
 
     if (usbContext) {
         libusb_exit(usbContext);
@@ -382,10 +1044,55 @@ void DfuWrapper::cleanup()
     initialized = false;
 }
 
-int DfuWrapper::getTransferSize()
+void DfuWrapper::cancel()
+{
+    cancelled = true;
+    std::lock_guard<std::mutex> lock(cancelMutex);
+    if (cancelTransfer)
+        cancelTransfer();
+}
+
+bool DfuWrapper::abortDownload()
+{
+    struct dfu_status status;
+    if (dfu_get_status(dfuDevice, &status) < 0)
+        return false;
+    if (status.bState == DFU_STATE_dfuERROR)
+        dfu_clear_status(dfuDevice->dev_handle, dfuDevice->interface);
+    return dfu_abort(dfuDevice->dev_handle, dfuDevice->interface) >= 0;
+}
+
+int DfuWrapper::transferSizeLimit()
 {
     if (!dfuDevice)
         return 0;
-    int size = dfuDevice->func_dfu.wTransferSize;
+    int size = libusb_le16_to_cpu(dfuDevice->func_dfu.wTransferSize);
     return size > 0 ? size : 1024;
 }
+
+int DfuWrapper::getTransferSize()
+{
+    int limit = transferSizeLimit();
+    if (!limit)
+        return 0;
+
+    QSettings settings;
+    settings.beginGroup(transferSizeGroup(dfuDevice));
+    int size = settings.value("transferSize").toInt();
+    if (settings.value("transferSizeLimit").toInt() == limit && size > 0 && size <= limit)
+        return size;
+    return limit;
+}
+
+void DfuWrapper::rememberTransferSize(int size)
+{
+    int limit = transferSizeLimit();
+    QSettings settings;
+    settings.beginGroup(transferSizeGroup(dfuDevice));
+    if (settings.value("transferSize").toInt() == size && settings.value("transferSizeLimit").toInt() == limit)
+        return;
+
+    qDebug() << "Using DFU transfer size" << size << "of" << limit << "for" << transferSizeGroup(dfuDevice);
+    settings.setValue("transferSize", size);
+    settings.setValue("transferSizeLimit", limit);
+}
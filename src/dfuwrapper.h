@@ -7,10 +7,17 @@
 #define DFUWRAPPER_H
 
 #include <QString>
+#include <QStringList>
+#include <QMap>
 #include <QObject>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
 
 struct dfu_if;
 struct libusb_context;
+struct libusb_device;
 
 class DfuWrapper : public QObject
 {
@@ -24,17 +31,57 @@ public:
     static constexpr const char* ALT_TISPL      = "tispl.bin";
     static constexpr const char* ALT_UBOOT      = "u-boot.img";
     static constexpr const char* ALT_RAWEMMC    = "rawemmc";
+    // Offered by U-Boot builds that expand Android sparse images onto the eMMC
+    static constexpr const char* ALT_RAWEMMC_SPARSE = "rawemmc-sparse";
+    // Offered by U-Boot builds that run "ums 0 mmc 0" once DFU ends, so the
+    // eMMC shows up as a USB mass storage device
+    static constexpr const char* ALT_UMS = "ums";
+    // Offered by U-Boot builds that run "fastboot usb 0" once DFU ends, so
+    // the image can go over USB bulk transfers (see FastbootWrapper)
+    static constexpr const char* ALT_FASTBOOT = "fastboot";
 
     explicit DfuWrapper(QObject *parent = nullptr);
     ~DfuWrapper();
 
+    // One session lasts from initialize() to cleanup(), for all stages of a flash
     bool initialize();
+    // Only use the device at this USB path (bus-port.port, as returned by
+    // devicePaths()), so several sessions can each flash their own board.
+    // Empty for the first device found
+    void setDevicePath(const QString &path) { devicePath = path.toLatin1(); }
+    // USB paths of the connected devices with this VID/PID
+    static QStringList devicePaths(int vendorId, int productId);
+    // Negotiated link speed in Mbit/s of the connected devices with this VID/PID,
+    // by USB path. 0 if libusb cannot tell
+    static QMap<QString, int> deviceSpeeds(int vendorId, int productId);
+    // USB path of the device, as devicePaths() returns it. Empty if libusb cannot tell
+    static QString usbPath(struct libusb_device *dev);
+    // Waits for the device with the alt setting. Switches alt settings on the
+    // open handle if the device has not re-enumerated since the last call
     bool findDevice(int vendorId, int productId, const QString &altSettingName);
+    // Whether the device found last also has this alt setting
+    bool hasAltSetting(const QString &altSettingName);
     bool downloadFile(const QString &filePath, bool resetAfter = true);
     bool downloadFileStreaming(const QString &filePath);
+    // Ends DFU on the device found, without sending anything. U-Boot goes on
+    // with whatever its environment runs after the dfu command
+    bool detach();
+    // Streams size bytes to the device, pulling them from read() while the
+    // transfer runs. read() puts up to maxLen bytes in buf and returns how
+    // many, 0 at the end of the data or -1 on error. size 0 sends
+    // everything up to the end of the data
+    bool downloadStream(qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read);
+    // Same, as an Android sparse image: runs of zeroes go over USB as fill
+    // chunks and are expanded by the device. The header needs the image
+    // size up front, so size has to be known. Data ending early is left
+    // out, data beyond size is an error
+    bool downloadSparseStream(qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read);
 
     QString lastError() const { return _lastError; }
     void cleanup();
+    // Makes the wait or transfer in progress, and every later one, fail
+    // soon. Safe to call from any thread
+    void cancel();
 
 signals:
     void statusMessage(QString message);
@@ -42,11 +89,28 @@ signals:
 private:
     struct libusb_context *usbContext;
     struct dfu_if *dfuDevice;
+    // Probed devices of this session, taken over from dfu-util's list
+    struct dfu_if *devices;
+    QByteArray devicePath;
     bool initialized;
     QString _lastError;
-    QByteArray _altNameBytes;
+    std::thread eventThread;
+    int stopEvents;
+    std::atomic<bool> cancelled{false};
+    // Cancels the streamed transfer in flight, if any
+    std::function<void()> cancelTransfer;
+    std::mutex cancelMutex;
 
+    struct dfu_if *findAltSetting(struct libusb_device *dev, const QByteArray &altName);
+    void closeDevice();
+    void releaseDevices();
+    // Transfer size for the alt setting: the one that worked in an earlier
+    // session if the device still advertises the same limit, else the limit
     int  getTransferSize();
+    int  transferSizeLimit();
+    void rememberTransferSize(int size);
+    // Returns the device to dfuIDLE after a failed download. False if it does not answer
+    bool abortDownload();
     void setError(const QString &msg);
     bool claimInterface();
 };
@@ -0,0 +1,265 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadcache.h"
+#include "cachesidecar.h"
+#include "chunkindex.h"
+#include "cachejournal.h"
+#include "config.h"
+#include "metadataindex.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStorageInfo>
+
+DownloadCache::DownloadCache()
+    : _budget(0)
+{
+}
+
+void DownloadCache::setDirectory(const QString &dir)
+{
+    _dir = dir;
+    _lastUsed.clear();
+    _validated.clear();
+    QDir().mkpath(_dir);
+    _importIndexFile();
+
+    MetadataIndex &index = MetadataIndex::instance();
+    MetadataIndex::Transaction gone;
+    const QList<QByteArray> entries = index.keys(_table());
+    for (const QByteArray &sha256 : entries)
+    {
+        QFileInfo fi(fileName(sha256));
+        if (!fi.exists() || !fi.size())
+        {
+            gone.remove(_table(), sha256);
+            continue;
+        }
+
+        QJsonObject record = index.value(_table(), sha256);
+        _lastUsed.insert(sha256, record.value("last_used").toString().toLongLong());
+        if (record.contains("validated"))
+            _validated.insert(sha256, record.value("validated").toString().toLongLong());
+    }
+    index.commit(gone);
+
+    _removeStrayFiles();
+}
+
+QString DownloadCache::directory() const
+{
+    return _dir;
+}
+
+void DownloadCache::setBudget(quint64 bytes)
+{
+    _budget = bytes;
+}
+
+QString DownloadCache::_table() const
+{
+    return "cache:"+QDir::cleanPath(_dir);
+}
+
+void DownloadCache::_saveEntry(const QByteArray &sha256)
+{
+    if (!_lastUsed.contains(sha256))
+    {
+        MetadataIndex::instance().remove(_table(), sha256);
+        return;
+    }
+
+    /* Timestamps are stored as strings, as JSON numbers are doubles */
+    QJsonObject record{{"last_used", QString::number(_lastUsed.value(sha256))}};
+    if (_validated.contains(sha256))
+        record["validated"] = QString::number(_validated.value(sha256));
+    MetadataIndex::instance().put(_table(), sha256, record);
+}
+
+void DownloadCache::_importIndexFile()
+{
+    QFile f(_dir+QDir::separator()+"index.json");
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+
+    QJsonObject index = QJsonDocument::fromJson(f.readAll()).object();
+    f.close();
+    QJsonObject entries = index.value("entries").toObject();
+    QJsonObject validated = index.value("validated").toObject();
+    MetadataIndex::Transaction t;
+    for (auto it = entries.constBegin(); it != entries.constEnd(); ++it)
+    {
+        QJsonObject record{{"last_used", it.value().toString()}};
+        if (validated.contains(it.key()))
+            record["validated"] = validated.value(it.key()).toString();
+        t.put(_table(), it.key().toLatin1(), record);
+    }
+
+    if (MetadataIndex::instance().commit(t))
+        f.remove();
+}
+
+void DownloadCache::_removeStrayFiles()
+{
+    QDir d(_dir);
+    const QStringList files = d.entryList(QStringList() << "*.cache" << "*.cache.sidecar" << "*.cache.journal" << "*.cache.chunks"
+                                                        << "*.cache.transcode" << "*.cache.transcode.sidecar", QDir::Files);
+
+    for (const QString &file : files)
+    {
+        QByteArray sha256 = file.section('.', 0, 0).toLatin1();
+        /* Recompressed files that were not swapped in before the process ended go as well */
+        bool transcode = file.contains(".transcode");
+        if (_lastUsed.contains(sha256) && !transcode)
+            continue;
+
+        /* Partial downloads that can still be resumed are kept, together with their journal */
+        bool resumable = CacheJournal::exists(fileName(sha256)) && QFile::exists(fileName(sha256));
+        if (resumable && !transcode && !file.endsWith(".sidecar") && !file.endsWith(".chunks"))
+            continue;
+
+        qDebug() << "Removing incomplete cache file" << file;
+        d.remove(file);
+    }
+}
+
+bool DownloadCache::contains(const QByteArray &sha256) const
+{
+    return !sha256.isEmpty() && _lastUsed.contains(sha256) && QFile::exists(fileName(sha256));
+}
+
+QString DownloadCache::fileName(const QByteArray &sha256) const
+{
+    return _dir+QDir::separator()+QString::fromLatin1(sha256)+".cache";
+}
+
+void DownloadCache::touch(const QByteArray &sha256)
+{
+    if (!_lastUsed.contains(sha256))
+        return;
+
+    _lastUsed[sha256] = QDateTime::currentMSecsSinceEpoch();
+    _saveEntry(sha256);
+}
+
+void DownloadCache::add(const QByteArray &sha256)
+{
+    /* Data was hashed on its way into the cache */
+    _lastUsed[sha256] = _validated[sha256] = QDateTime::currentMSecsSinceEpoch();
+    _saveEntry(sha256);
+}
+
+void DownloadCache::remove(const QByteArray &sha256)
+{
+    QFile::remove(fileName(sha256));
+    CacheSidecar::remove(fileName(sha256));
+    CacheJournal::remove(fileName(sha256));
+    ChunkIndex::remove(fileName(sha256));
+    _validated.remove(sha256);
+    if (_lastUsed.remove(sha256))
+        _saveEntry(sha256);
+}
+
+bool DownloadCache::import(const QString &filename, const QByteArray &sha256)
+{
+    QString target = fileName(sha256);
+    QFile::remove(target);
+    if (!QFile::rename(filename, target))
+        return false;
+
+    /* Sidecar stays valid, renaming keeps size and modification time */
+    QFile::remove(CacheSidecar::fileName(target));
+    QFile::rename(CacheSidecar::fileName(filename), CacheSidecar::fileName(target));
+    add(sha256);
+
+    return true;
+}
+
+bool DownloadCache::replace(const QString &filename, const QByteArray &sha256)
+{
+    if (!_lastUsed.contains(sha256))
+        return false;
+
+    QString target = fileName(sha256);
+    QFile::remove(target);
+    CacheSidecar::remove(target);
+    if (!QFile::rename(filename, target))
+    {
+        remove(sha256);
+        return false;
+    }
+    QFile::rename(CacheSidecar::fileName(filename), CacheSidecar::fileName(target));
+
+    return true;
+}
+
+QList<QByteArray> DownloadCache::entries() const
+{
+    return _lastUsed.keys();
+}
+
+void DownloadCache::setValidated(const QByteArray &sha256)
+{
+    if (!_lastUsed.contains(sha256))
+        return;
+
+    _validated[sha256] = QDateTime::currentMSecsSinceEpoch();
+    _saveEntry(sha256);
+}
+
+qint64 DownloadCache::lastValidated(const QByteArray &sha256) const
+{
+    return _validated.value(sha256, 0);
+}
+
+quint64 DownloadCache::size() const
+{
+    quint64 total = 0;
+    for (auto it = _lastUsed.constBegin(); it != _lastUsed.constEnd(); ++it)
+        total += QFileInfo(fileName(it.key())).size();
+
+    return total;
+}
+
+bool DownloadCache::reserve(quint64 size)
+{
+    if (_budget && size > _budget)
+        return false;
+
+    QStorageInfo si(_dir);
+    qint64 avail = si.bytesAvailable();
+    quint64 total = this->size();
+    qDebug() << "Download cache holds" << _lastUsed.size() << "entries," << total/1024/1024 << "MB."
+             << "Available disk space:" << avail/1024/1024/1024 << "GB";
+
+    if (avail + (qint64) total - (qint64) size < IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING)
+        return false;
+
+    while (avail - (qint64) size < IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING || (_budget && total + size > _budget))
+    {
+        if (_lastUsed.isEmpty())
+            return false;
+
+        QByteArray oldest = _lastUsed.firstKey();
+        for (auto it = _lastUsed.constBegin(); it != _lastUsed.constEnd(); ++it)
+        {
+            if (it.value() < _lastUsed.value(oldest))
+                oldest = it.key();
+        }
+
+        quint64 entrySize = QFileInfo(fileName(oldest)).size();
+        qDebug() << "Evicting least recently used cache entry" << oldest;
+        remove(oldest);
+        total -= qMin(total, entrySize);
+        avail += entrySize;
+    }
+
+    return true;
+}
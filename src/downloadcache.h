@@ -0,0 +1,77 @@
+#ifndef DOWNLOADCACHE_H
+#define DOWNLOADCACHE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QString>
+
+/*
+ * Content addressed cache of downloaded images
+ *
+ * Every entry is a file named after the SHA256 of the extracted image,
+ * plus its sidecar (see CacheSidecar). A table of the MetadataIndex, one
+ * per directory, records which entries are complete, when each one was
+ * last used and when its contents were last found to match its hash.
+ * Least recently used entries are evicted to stay within the size budget,
+ * and to keep IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING free on the disk.
+ */
+class DownloadCache
+{
+public:
+    DownloadCache();
+
+    /* Load the index of dir, creating it if needed.
+       Files that are not in the index are left-overs of interrupted downloads, and are removed */
+    void setDirectory(const QString &dir);
+    QString directory() const;
+    /* Maximum total size of all entries in bytes, 0 for no limit other than free disk space */
+    void setBudget(quint64 bytes);
+
+    bool contains(const QByteArray &sha256) const;
+    QString fileName(const QByteArray &sha256) const;
+    /* Mark entry as just used */
+    void touch(const QByteArray &sha256);
+    /* Entry has been written completely */
+    void add(const QByteArray &sha256);
+    void remove(const QByteArray &sha256);
+    /* Move an existing file into the cache */
+    bool import(const QString &filename, const QByteArray &sha256);
+    /* Swap the file of an entry, with its sidecar, for one holding the same image in another format.
+       When it was last used stays. If that fails the entry is gone */
+    bool replace(const QString &filename, const QByteArray &sha256);
+    /* Hashes of all entries */
+    QList<QByteArray> entries() const;
+    /* Contents of entry were found to match its hash just now. Adding an entry counts as that */
+    void setValidated(const QByteArray &sha256);
+    /* When that was as msecs since epoch, 0 if never */
+    qint64 lastValidated(const QByteArray &sha256) const;
+
+    /* Evict least recently used entries, until a new entry of 'size' bytes fits.
+       Returns false (without evicting anything) if it cannot fit even in an empty cache */
+    bool reserve(quint64 size);
+    /* Total size of all entries in bytes */
+    quint64 size() const;
+
+protected:
+    QString _dir;
+    quint64 _budget;
+    /* Entry hash -> last used as msecs since epoch */
+    QMap<QByteArray, qint64> _lastUsed;
+    /* Entry hash -> last validated as msecs since epoch */
+    QMap<QByteArray, qint64> _validated;
+
+    QString _table() const;
+    /* Record of the entry in the index, or its removal */
+    void _saveEntry(const QByteArray &sha256);
+    /* index.json of older versions */
+    void _importIndexFile();
+    void _removeStrayFiles();
+};
+
+#endif // DOWNLOADCACHE_H
@@ -0,0 +1,104 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadcoordinator.h"
+#include <chrono>
+
+std::mutex DownloadCoordinator::_mutex;
+QHash<QByteArray, std::weak_ptr<DownloadCoordinator::Transfer>> DownloadCoordinator::_transfers;
+
+std::shared_ptr<DownloadCoordinator::Transfer> DownloadCoordinator::begin(const QByteArray &sha256, const QString &fileName)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto running = _transfers.value(sha256).lock();
+    if (running && !running->isFinished())
+        return nullptr;
+
+    auto transfer = std::make_shared<Transfer>(sha256, fileName);
+    _transfers.insert(sha256, transfer);
+    return transfer;
+}
+
+std::shared_ptr<DownloadCoordinator::Transfer> DownloadCoordinator::find(const QByteArray &sha256)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto transfer = _transfers.value(sha256).lock();
+    if (transfer && transfer->isFinished())
+        return nullptr;
+
+    return transfer;
+}
+
+void DownloadCoordinator::_remove(const Transfer *transfer)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto it = _transfers.find(transfer->sha256());
+    if (it != _transfers.end() && (it->expired() || it->lock().get() == transfer))
+        _transfers.erase(it);
+}
+
+DownloadCoordinator::Transfer::Transfer(const QByteArray &sha256, const QString &fileName)
+    : _sha256(sha256), _fileName(fileName), _available(0), _finished(false), _complete(false)
+{
+}
+
+QByteArray DownloadCoordinator::Transfer::sha256() const
+{
+    return _sha256;
+}
+
+QString DownloadCoordinator::Transfer::fileName() const
+{
+    return _fileName;
+}
+
+void DownloadCoordinator::Transfer::setAvailable(quint64 bytes)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (bytes > _available)
+    {
+        _available = bytes;
+        _cv.notify_all();
+    }
+}
+
+void DownloadCoordinator::Transfer::finish(bool complete)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_finished)
+            return;
+        _finished = true;
+        _complete = complete;
+        _cv.notify_all();
+    }
+    DownloadCoordinator::_remove(this);
+}
+
+quint64 DownloadCoordinator::Transfer::wait(quint64 offset, const std::atomic<bool> &cancelled)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    /* Woken up now and then to see if the follower was cancelled */
+    while (_available <= offset && !_finished && !cancelled)
+        _cv.wait_for(lock, std::chrono::milliseconds(100));
+
+    return _available;
+}
+
+bool DownloadCoordinator::Transfer::isFinished() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _finished;
+}
+
+bool DownloadCoordinator::Transfer::isComplete() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _complete;
+}
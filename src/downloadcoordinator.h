@@ -0,0 +1,73 @@
+#ifndef DOWNLOADCOORDINATOR_H
+#define DOWNLOADCOORDINATOR_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+/*
+ * Process-wide single-flight of downloads into the download cache
+ *
+ * Jobs of the daemon and jobs file modes each have an ImageWriter of their
+ * own, so two of them writing the same image would both download it into
+ * the same cache file. Instead, the first thread to download an image into
+ * the cache owns the transfer, and tells how much of the file is on disk
+ * as it goes. Writes of the same image that start meanwhile follow the
+ * transfer: they read the growing cache file instead of downloading, and
+ * leave the cache to the owner. If the owner stops before the end, they
+ * download the rest themselves.
+ */
+class DownloadCoordinator
+{
+public:
+    class Transfer
+    {
+    public:
+        Transfer(const QByteArray &sha256, const QString &fileName);
+
+        QByteArray sha256() const;
+        QString fileName() const;
+
+        /* Owner: the first bytes of the file are on disk */
+        void setAvailable(quint64 bytes);
+        /* Owner: no more is coming. complete if the file has all of the download */
+        void finish(bool complete);
+
+        /* Wait until more than offset bytes are on disk, the transfer is finished
+           or cancelled is set. Returns the bytes on disk */
+        quint64 wait(quint64 offset, const std::atomic<bool> &cancelled);
+        bool isFinished() const;
+        bool isComplete() const;
+
+    protected:
+        QByteArray _sha256;
+        QString _fileName;
+        mutable std::mutex _mutex;
+        std::condition_variable _cv;
+        quint64 _available;
+        bool _finished, _complete;
+    };
+
+    /* Transfer of the download of sha256 into fileName for the caller to own.
+       Null if another thread is downloading it already */
+    static std::shared_ptr<Transfer> begin(const QByteArray &sha256, const QString &fileName);
+    /* Transfer of sha256 that is running, null if there is none */
+    static std::shared_ptr<Transfer> find(const QByteArray &sha256);
+
+protected:
+    static std::mutex _mutex;
+    static QHash<QByteArray, std::weak_ptr<Transfer>> _transfers;
+
+    static void _remove(const Transfer *transfer);
+};
+
+#endif // DOWNLOADCOORDINATOR_H
@@ -5,12 +5,26 @@
 
 #include "downloadextractthread.h"
 #include "config.h"
+#include "fanouttargetthread.h"
+#include "imageprobe.h"
+#include "pipelinememory.h"
+#include "pipelinetrace.h"
+#include "threadplacement.h"
 #include "dependencies/drivelist/src/drivelist.hpp"
 #include "dependencies/mountutils/src/mountutils.hpp"
 #include "imagewriter.h"
 #include <iostream>
 #include <archive.h>
 #include <archive_entry.h>
+#include <lzma.h>
+#include <zstd.h>
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef HAVE_QATZIP
+#include <qatzip.h>
+#endif
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string.h>
@@ -21,12 +35,24 @@
 #include <QTemporaryDir>
 #include <QDebug>
 #include <QSerialPort>
+#include <QThreadPool>
+#include <QtEndian>
+#include <memory>
+#include <map>
+#include <climits>
 #include "imagewriter.h"  // ImageWriter sınıfının tanımı burada olmalı
 
+#ifdef Q_OS_LINUX
+#include "devicewrapper.h"
+#include "devicewrapperfatpartition.h"
+#include "linux/iouring.h"
+#ifndef QT_NO_DBUS
+#include "linux/udisks2api.h"
+#endif
+#endif
 
-using namespace std;
 
-const int DownloadExtractThread::MAX_QUEUE_SIZE = 64;
+using namespace std;
 
 class _extractThreadClass : public QThread {
 public:
@@ -37,6 +63,7 @@ public:
 
     virtual void run()
     {
+        ThreadPlacement::apply(ThreadPlacement::StageExtract);
         if (_de->isImage())
             _de->extractImageRun();
         else
@@ -47,25 +74,41 @@ protected:
     DownloadExtractThread *_de;
 };
 
+class _writeThreadClass : public QThread {
+public:
+    _writeThreadClass(DownloadExtractThread *parent)
+        : QThread(parent), _de(parent)
+    {
+    }
+
+    virtual void run()
+    {
+        ThreadPlacement::apply(ThreadPlacement::StageWrite);
+        _de->_writeRun();
+    }
+
+protected:
+    DownloadExtractThread *_de;
+};
+
 DownloadExtractThread::DownloadExtractThread(const QByteArray &url, const QByteArray &localfilename, const QByteArray &expectedHash, QObject *parent)
-    : DownloadThread(url, localfilename, expectedHash, parent), _abufsize(IMAGEWRITER_BLOCKSIZE), _ethreadStarted(false),
-      _isImage(true), _inputHash(OSLIST_HASH_ALGORITHM), _activeBuf(0), _writeThreadStarted(false)
+    : DownloadThread(url, localfilename, expectedHash, isImageFile(localfilename), parent), _abufsize(IMAGEWRITER_BLOCKSIZE), _writeBlockSize(0), _writeQueueDepth(IMAGEWRITER_WRITE_QUEUE_DEPTH),
+      _writeQueueClosed(false), _writeError(false), _extractStallTime(0), _writeStallTime(0), _extractedBytes(0),
+      _queue(IMAGEWRITER_RINGBUFFER_SIZE, IMAGEWRITER_RINGBUFFER_SLABSIZE), _ethreadStarted(false),
+      _isImage(true), _userspaceExtraction(false), _peekData(nullptr), _peekLen(0), _inputHash(OSLIST_HASH_ALGORITHM)
 {
     _extractThread = new _extractThreadClass(this);
-    _abuf[0] = (char *) qMallocAligned(_abufsize, 4096);
-    _abuf[1] = (char *) qMallocAligned(_abufsize, 4096);
+    _writeThread = new _writeThreadClass(this);
 }
 
 DownloadExtractThread::~DownloadExtractThread()
 {
-    _cancelled = true;
-    _cancelExtract();
-    if (!_extractThread->wait(10000))
-    {
-        _extractThread->terminate();
-    }
-    qFreeAligned(_abuf[0]);
-    qFreeAligned(_abuf[1]);
+    /* Wakes up whatever the extract and write threads wait on */
+    DownloadExtractThread::cancelDownload();
+    _extractThread->wait();
+    _writeThread->wait();
+    for (char *buf : std::as_const(_abuf))
+        PipelineMemory::free(buf, _abufsize);
 }
 
 size_t DownloadExtractThread::_writeData(const char *buf, size_t len)
@@ -88,14 +131,15 @@ size_t DownloadExtractThread::_writeData(const char *buf, size_t len)
         _inputHash.addData(buf, len);
     }
 
-    _pushQueue(buf, len);
+    if (!_queue.write(buf, len))
+        return 0;
 
     return len;
 }
 
 void DownloadExtractThread::_onDownloadSuccess()
 {
-    _pushQueue("", 0);
+    _queue.close();
 }
 
 void DownloadExtractThread::_onDownloadError(const QString &msg)
@@ -106,11 +150,8 @@ void DownloadExtractThread::_onDownloadError(const QString &msg)
 
 void DownloadExtractThread::_cancelExtract()
 {
-    std::unique_lock<std::mutex> lock(_queueMutex);
-    _queue.clear();
-    _queue.push_back(QByteArray());
-    lock.unlock();
-    _cv.notify_all();
+    _queue.cancel();
+    _abortWrites();
 }
 
 void DownloadExtractThread::cancelDownload()
@@ -139,7 +180,99 @@ static inline void _checkResult(int r, struct archive *a)
 // libarchive thread
 void DownloadExtractThread::extractImageRun()
 {
+    /* Buffers are sized for the device, which may still be prepared */
+    if (!_waitForDevice())
+        return;
+
     struct archive *a = archive_read_new();
+
+    if (_abuf.isEmpty())
+    {
+        /* The device has been opened by now, so its optimal I/O size is known */
+        _abufsize = _blockSize();
+        int depth = qMax(2, _writeQueueDepth);
+        if (_budget.writeBufferBytes)
+            depth = qBound(2, (int) (_budget.writeBufferBytes / _abufsize), depth);
+        qDebug() << "Write block size:" << _abufsize << "buffers:" << depth;
+        for (int i = 0; i < depth; i++)
+            _abuf.append((char *) PipelineMemory::allocate(_abufsize));
+
+        /* Each queued block holds a copy of a buffer */
+        if (_budget.fanoutQueueBytes)
+        {
+            int fanoutDepth = qBound(2, (int) (_budget.fanoutQueueBytes / _abufsize), IMAGEWRITER_FANOUT_QUEUE_DEPTH);
+            for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+                target->setQueueDepth(fanoutDepth);
+        }
+    }
+    _freeBufs.assign(_abuf.cbegin(), _abuf.cend());
+    _writeThread->start();
+
+    try
+    {
+        bool ok;
+
+        _startPhase(PhaseDecompress);
+        _peekInput();
+        if (_isGzipStream())
+            ok = _extractGzip();
+        else if (_isXzStream())
+            ok = _extractXz();
+        else if (_isZstdStream())
+            ok = _extractZstd();
+#ifdef HAVE_LZ4
+        else if (_isLz4Stream())
+            ok = _extractLz4();
+#endif
+        else
+            ok = _extractArchive(a);
+
+        if (!ok)
+        {
+            /* Writer thread stopped because of an error or cancellation */
+            _writeThread->wait();
+            if (!_cancelled)
+            {
+                _onWriteError();
+            }
+            archive_read_free(a);
+            return;
+        }
+        _endPhase(PhaseDecompress, _extractedBytes);
+
+        if (!_finishWrites())
+        {
+            if (!_cancelled)
+            {
+                _onWriteError();
+            }
+            archive_read_free(a);
+            return;
+        }
+        _printQueueStats();
+        _writeComplete();
+    }
+    catch (exception &e)
+    {
+        _abortWrites();
+        _writeThread->wait();
+
+        if (!_cancelled)
+        {
+            // Fatal error. Data may be corrupt, so do not resume from it
+            _discardPartialCache = true;
+            DownloadThread::cancelDownload();
+            emit error(tr("Error extracting archive: %1").arg(e.what()));
+        }
+    }
+
+    archive_read_free(a);
+}
+
+/* Decompresses image with libarchive, queueing it for writing.
+   Returns false if the writer stopped. Throws on extraction errors */
+bool DownloadExtractThread::_extractArchive(struct archive *a)
+{
     struct archive_entry *entry;
     int r;
 
@@ -149,85 +282,1073 @@ void DownloadExtractThread::extractImageRun()
     archive_read_support_format_raw(a); // for .gz and such
     archive_read_open(a, this, NULL, &DownloadExtractThread::_archive_read, &DownloadExtractThread::_archive_close);
 
-    try
-    {
-        r = archive_read_next_header(a, &entry);
-        _checkResult(r, a);
+    r = archive_read_next_header(a, &entry);
+    _checkResult(r, a);
 
-        while (true)
+    while (true)
+    {
+        char *buf = _acquireWriteBuffer();
+        if (!buf)
+            return false;
+
+        /* libarchive returns whatever it has at hand. Only whole buffers are
+           queued, so every write but the last is aligned to the block size */
+        ssize_t size = 0, n;
+        do
         {
-            ssize_t size = archive_read_data(a, _abuf[_activeBuf], _abufsize);
-            if (size < 0)
+            TraceSpan span("archiveRead");
+            n = archive_read_data(a, buf+size, _abufsize-size);
+            if (n < 0)
                 throw runtime_error(archive_error_string(a));
-            if (size == 0)
-                break;
-            if (size % 512 != 0)
+            size += n;
+        } while (n > 0 && (size_t) size < _abufsize);
+        if (size == 0)
+        {
+            _releaseWriteBuffer(buf);
+            break;
+        }
+
+        _queueImageData(buf, size);
+    }
+
+    return true;
+}
+
+/* Reads the start of the input to detect its format.
+   It is handed to libarchive or the decoder first */
+void DownloadExtractThread::_peekInput()
+{
+    _peekLen = _on_read(nullptr, &_peekData);
+}
+
+bool DownloadExtractThread::_isGzipStream() const
+{
+    const unsigned char *p = (const unsigned char *) _peekData;
+
+    /* Magic, followed by compression method deflate */
+    return _peekLen >= 3 && p[0] == 0x1F && p[1] == 0x8B && p[2] == 8;
+}
+
+bool DownloadExtractThread::_isXzStream() const
+{
+    static const char xzMagic[] = {'\xFD', '7', 'z', 'X', 'Z', '\0'};
+
+    return _peekLen >= (ssize_t) sizeof(xzMagic) && memcmp(_peekData, xzMagic, sizeof(xzMagic)) == 0;
+}
+
+/* True for zstd images, including pzstd and seekable format ones
+   which start with a skippable frame */
+bool DownloadExtractThread::_isZstdStream() const
+{
+    if (_peekLen < 4)
+        return false;
+
+    quint32 magic = qFromLittleEndian<quint32>(_peekData);
+    return magic == ZSTD_MAGICNUMBER || (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START;
+}
+
+bool DownloadExtractThread::_isLz4Stream() const
+{
+    return ImageProbe::sniff(QByteArray::fromRawData((const char *) _peekData, qMax<ssize_t>(_peekLen, 0))) == ImageProbe::FormatLz4;
+}
+
+/* Decompresses .gz image with zlib, straight into the write buffers.
+   Returns false if the writer stopped. Throws on decompression errors */
+bool DownloadExtractThread::_extractGzip()
+{
+#ifdef HAVE_QATZIP
+    bool ok;
+    if (_extractGzipQat(ok))
+        return ok;
+#endif
+
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    /* 32: detect gzip header */
+    if (inflateInit2(&strm, 15+32) != Z_OK)
+        throw runtime_error("Error initializing gzip decoder");
+    /* zlib-ng reports a version like "1.3.0.zlib-ng" when built with ENABLE_ZLIB_NG */
+    qDebug() << "Decompressing gzip image with zlib" << zlibVersion();
+
+    strm.next_in = (Bytef *) _peekData;
+    strm.avail_in = _peekLen;
+    _peekLen = 0;
+    /* memberEnd: at the end of a gzip member. Another one may follow */
+    bool eof = false, memberEnd = false, trailing = false;
+    char *buf = nullptr;
+
+    while (true)
+    {
+        if (!buf)
+        {
+            buf = _acquireWriteBuffer();
+            if (!buf)
+            {
+                inflateEnd(&strm);
+                return false;
+            }
+            strm.next_out = (Bytef *) buf;
+            strm.avail_out = _abufsize;
+        }
+
+        if (!strm.avail_in && !eof)
+        {
+            const void *in;
+            ssize_t len = _on_read(nullptr, &in);
+            if (len < 0)
+            {
+                inflateEnd(&strm);
+                throw runtime_error("Error reading input");
+            }
+            eof = (len == 0);
+            strm.next_in = (Bytef *) in;
+            strm.avail_in = len;
+        }
+        if (memberEnd && strm.avail_in && (trailing || *strm.next_in != 0x1F))
+        {
+            /* Like gzip itself, ignore padding after the last member */
+            if (!trailing)
+                qDebug() << "Ignoring trailing data after end of gzip stream";
+            trailing = true;
+            strm.avail_in = 0;
+        }
+
+        bool done = eof && !strm.avail_in && memberEnd;
+        if (!done && (strm.avail_in || !memberEnd))
+        {
+            int ret;
+            {
+                TraceSpan span("decompress");
+                ret = inflate(&strm, Z_NO_FLUSH);
+            }
+            if (ret == Z_STREAM_END)
+            {
+                inflateReset(&strm);
+                memberEnd = true;
+            }
+            else if (ret == Z_OK)
             {
-                size_t paddingBytes = 512-(size % 512);
-                qDebug() << "Image is NOT a valid disk image, as its length is not a multiple of the sector size of 512 bytes long";
-                qDebug() << "Last write() would be" << size << "bytes, but padding to" << size + paddingBytes << "bytes";
-                memset(_abuf[_activeBuf]+size, 0, paddingBytes);
-                size += paddingBytes;
+                memberEnd = false;
             }
+            else if (ret != Z_BUF_ERROR || eof)
+            {
+                /* Z_BUF_ERROR means no progress possible without more input */
+                std::string msg = (ret == Z_BUF_ERROR) ? "Truncated gzip data"
+                                : (strm.msg ? std::string("Corrupt gzip data: ")+strm.msg : "Corrupt gzip data");
+                inflateEnd(&strm);
+                throw runtime_error(msg);
+            }
+            done = eof && !strm.avail_in && memberEnd;
+        }
+
+        if (!strm.avail_out || done)
+        {
+            size_t size = _abufsize - strm.avail_out;
+            if (size)
+                _queueImageData(buf, size);
+            else
+                _releaseWriteBuffer(buf);
+            buf = nullptr;
+        }
+        if (done)
+            break;
+    }
+    inflateEnd(&strm);
+
+    return true;
+}
+
+#ifdef HAVE_QATZIP
+/* Decompresses .gz image on an Intel QuickAssist device, straight into the write buffers.
+   Returns false, without having read any input, if there is no device to offload to.
+   Otherwise sets ok to false if the writer stopped. Throws on decompression errors */
+bool DownloadExtractThread::_extractGzipQat(bool &ok)
+{
+    QzSession_T sess;
+    memset(&sess, 0, sizeof(sess));
+    /* With software backup, QATzip inflates what the device cannot take itself (e.g. when
+       all its instances are busy) in software, rather than failing the write. But without
+       a device at all, zlib (or zlib-ng) is at least as fast */
+    int rc = qzInit(&sess, 1);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE)
+    {
+        qDebug() << "No QuickAssist device to inflate gzip image on (" << rc << "). Using zlib";
+        return false;
+    }
+
+    QzSessionParams_T params;
+    qzGetDefaults(&params);
+    params.direction = QZ_DIR_DECOMPRESS;
+    rc = qzSetupSession(&sess, &params);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE)
+    {
+        qDebug() << "Error setting up QuickAssist session (" << rc << "). Using zlib";
+        qzClose(&sess);
+        return false;
+    }
+    qDebug() << "Decompressing gzip image on QuickAssist";
+
+    QzStream_T strm;
+    memset(&strm, 0, sizeof(strm));
+    const unsigned char *in = (const unsigned char *) _peekData;
+    size_t inLen = _peekLen;
+    _peekLen = 0;
+    bool eof = false;
+    char *buf = nullptr;
+    size_t outLen = 0;
+
+    auto cleanup = [&]() {
+        qzEndStream(&sess, &strm);
+        qzTeardownSession(&sess);
+        qzClose(&sess);
+    };
+
+    while (true)
+    {
+        if (!buf)
+        {
+            buf = _acquireWriteBuffer();
+            if (!buf)
+            {
+                cleanup();
+                ok = false;
+                return true;
+            }
+            outLen = 0;
+        }
+
+        if (!inLen && !eof)
+        {
+            const void *data;
+            ssize_t len = _on_read(nullptr, &data);
+            if (len < 0)
+            {
+                cleanup();
+                throw runtime_error("Error reading input");
+            }
+            eof = (len == 0);
+            in = (const unsigned char *) data;
+            inLen = len;
+        }
+
+        /* QATzip reports back how much it took and produced in in_sz and out_sz.
+           Input it holds on to, and output that did not fit, are pending */
+        strm.in = (unsigned char *) in;
+        strm.in_sz = qMin(inLen, (size_t) UINT_MAX);
+        strm.out = (unsigned char *) buf + outLen;
+        strm.out_sz = _abufsize - outLen;
+        rc = qzDecompressStream(&sess, &strm, eof ? 1 : 0);
+        if (rc != QZ_OK && (rc != QZ_BUF_ERROR || eof))
+        {
+            cleanup();
+            throw runtime_error(rc == QZ_BUF_ERROR ? "Truncated gzip data"
+                                : "Corrupt gzip data (QuickAssist error "+std::to_string(rc)+")");
+        }
+        if (eof && !strm.in_sz && !strm.out_sz && (inLen || strm.pending_in || strm.pending_out))
+        {
+            cleanup();
+            throw runtime_error("Truncated gzip data");
+        }
+        in += strm.in_sz;
+        inLen -= strm.in_sz;
+        outLen += strm.out_sz;
+
+        bool done = eof && !inLen && !strm.pending_in && !strm.pending_out;
+        if (outLen == _abufsize || done)
+        {
+            if (outLen)
+                _queueImageData(buf, outLen);
+            else
+                _releaseWriteBuffer(buf);
+            buf = nullptr;
+        }
+        if (done)
+            break;
+    }
+    cleanup();
+
+    ok = true;
+    return true;
+}
+#endif
+
+/* Decompresses .xz image with the multi-threaded liblzma decoder.
+   Blocks are decoded in parallel, but output comes out in order.
+   Returns false if the writer stopped. Throws on decompression errors */
+bool DownloadExtractThread::_extractXz()
+{
+    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_mt mt;
+    memset(&mt, 0, sizeof(mt));
+    mt.flags = LZMA_CONCATENATED;
+    mt.threads = qBound(1u, lzma_cputhreads(), (uint32_t) qMin(IMAGEWRITER_XZ_MAX_THREADS, _budget.decompressThreads));
+    mt.timeout = 0;
+    /* Fall back to single-threaded decoding rather than using more than this */
+    mt.memlimit_threading = _budget.decompressMemory ? _budget.decompressMemory : lzma_physmem() / 4;
+    mt.memlimit_stop = UINT64_MAX;
+
+    if (lzma_stream_decoder_mt(&strm, &mt) != LZMA_OK)
+        throw runtime_error("Error initializing xz decoder");
+    qDebug() << "Decompressing xz image using up to" << mt.threads << "threads";
+
+    strm.next_in = (const uint8_t *) _peekData;
+    strm.avail_in = _peekLen;
+    _peekLen = 0;
+    lzma_action action = LZMA_RUN;
+    lzma_ret ret = LZMA_OK;
+    char *buf = nullptr;
+
+    while (ret != LZMA_STREAM_END)
+    {
+        if (!buf)
+        {
+            buf = _acquireWriteBuffer();
+            if (!buf)
+            {
+                lzma_end(&strm);
+                return false;
+            }
+            strm.next_out = (uint8_t *) buf;
+            strm.avail_out = _abufsize;
+        }
+
+        if (!strm.avail_in && action == LZMA_RUN)
+        {
+            const void *in;
+            ssize_t len = _on_read(nullptr, &in);
+            if (len < 0)
+            {
+                lzma_end(&strm);
+                throw runtime_error("Error reading input");
+            }
+            if (len == 0)
+                action = LZMA_FINISH;
+            strm.next_in = (const uint8_t *) in;
+            strm.avail_in = len;
+        }
+
+        {
+            TraceSpan span("decompress");
+            ret = lzma_code(&strm, action);
+        }
+        if (ret != LZMA_OK && ret != LZMA_STREAM_END)
+        {
+            lzma_end(&strm);
+            switch (ret)
+            {
+            case LZMA_MEM_ERROR:
+                throw runtime_error("Out of memory decompressing xz");
+            case LZMA_BUF_ERROR:
+                throw runtime_error("Truncated xz data");
+            default:
+                throw runtime_error("Corrupt xz data");
+            }
+        }
+
+        if (!strm.avail_out || ret == LZMA_STREAM_END)
+        {
+            size_t size = _abufsize - strm.avail_out;
+            if (size)
+                _queueImageData(buf, size);
+            else
+                _releaseWriteBuffer(buf);
+            buf = nullptr;
+        }
+    }
+    lzma_end(&strm);
 
-            if (_writeThreadStarted)
+    return true;
+}
+
+#ifdef HAVE_LZ4
+/* Decompresses .lz4 image, straight into the write buffers. LZ4 decodes
+   faster than the devices write, so one thread is enough.
+   Concatenated frames are decoded one after the other.
+   Returns false if the writer stopped. Throws on decompression errors */
+bool DownloadExtractThread::_extractLz4()
+{
+    LZ4F_dctx *dctx;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+        throw runtime_error("Error initializing lz4 decoder");
+    qDebug() << "Decompressing lz4 image with liblz4" << LZ4F_getVersion();
+
+    const char *in = (const char *) _peekData;
+    size_t inLen = _peekLen;
+    _peekLen = 0;
+    /* hint: 0 once a frame is complete. Another one may follow */
+    size_t hint = 1;
+    bool eof = false;
+    char *buf = nullptr;
+    size_t bufPos = 0;
+
+    while (true)
+    {
+        if (!buf)
+        {
+            buf = _acquireWriteBuffer();
+            if (!buf)
+            {
+                LZ4F_freeDecompressionContext(dctx);
+                return false;
+            }
+            bufPos = 0;
+        }
+
+        if (!inLen && !eof)
+        {
+            const void *data;
+            ssize_t len = _on_read(nullptr, &data);
+            if (len < 0)
+            {
+                LZ4F_freeDecompressionContext(dctx);
+                throw runtime_error("Error reading input");
+            }
+            eof = (len == 0);
+            in = (const char *) data;
+            inLen = len;
+        }
+
+        bool done = eof && !inLen;
+        if (done && hint)
+        {
+            LZ4F_freeDecompressionContext(dctx);
+            throw runtime_error("Truncated lz4 data");
+        }
+        if (inLen)
+        {
+            size_t srcSize = inLen, dstSize = _abufsize - bufPos;
+            {
+                TraceSpan span("decompress");
+                hint = LZ4F_decompress(dctx, buf+bufPos, &dstSize, in, &srcSize, nullptr);
+            }
+            if (LZ4F_isError(hint))
+            {
+                std::string msg = std::string("Corrupt lz4 data: ")+LZ4F_getErrorName(hint);
+                LZ4F_freeDecompressionContext(dctx);
+                throw runtime_error(msg);
+            }
+            in += srcSize;
+            inLen -= srcSize;
+            bufPos += dstSize;
+        }
+
+        if (bufPos == _abufsize || done)
+        {
+            if (bufPos)
+                _queueImageData(buf, bufPos);
+            else
+                _releaseWriteBuffer(buf);
+            buf = nullptr;
+        }
+        if (done)
+            break;
+    }
+    LZ4F_freeDecompressionContext(dctx);
+
+    return true;
+}
+#endif
+
+/* Result of decompressing a single zstd frame on the worker pool */
+struct _zstdFrame
+{
+    QByteArray data;
+    bool ok;
+};
+
+static _zstdFrame _decompressZstdFrame(const QByteArray &frame, size_t contentSize)
+{
+    _zstdFrame f;
+    f.data.resize(contentSize);
+    size_t n = ZSTD_decompress(f.data.data(), contentSize, frame.constData(), frame.size());
+    f.ok = !ZSTD_isError(n) && n == contentSize;
+
+    return f;
+}
+
+/* Decompresses .zst image. Images consisting of multiple frames (as
+   created by pzstd or in seekable format) have their frames decoded in
+   parallel on a worker pool, and written out in order.
+   Frames that are too large to buffer, or of unknown size, are decoded
+   as a stream in this thread.
+   Returns false if the writer stopped. Throws on decompression errors */
+bool DownloadExtractThread::_extractZstd()
+{
+    /* ZSTD_FRAMEHEADERSIZE_MAX, which is only available with static linking API */
+    const size_t frameHeaderSizeMax = 18;
+    const int threads = qBound(1, QThread::idealThreadCount(), qMin(IMAGEWRITER_ZSTD_MAX_THREADS, _budget.decompressThreads));
+    const size_t maxJobs = threads * 2;
+
+    QByteArray pending((const char *) _peekData, _peekLen);
+    qsizetype pos = 0;
+    bool eof = false;
+    char *buf = nullptr;
+    size_t fill = 0, parallelFrames = 0, streamedFrames = 0;
+    std::unique_ptr<ZSTD_DCtx, decltype(&ZSTD_freeDCtx)> dctx(ZSTD_createDCtx(), &ZSTD_freeDCtx);
+    std::deque<QFuture<_zstdFrame>> jobs;
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    _peekLen = 0;
+
+    auto available = [&]() {
+        return (size_t) (pending.size() - pos);
+    };
+    auto readMore = [&]() {
+        if (eof)
+            return false;
+
+        const void *in;
+        ssize_t len = _on_read(nullptr, &in);
+        if (len < 0)
+            throw runtime_error("Error reading input");
+        if (len == 0)
+        {
+            eof = true;
+            return false;
+        }
+        if (pos)
+        {
+            pending.remove(0, pos);
+            pos = 0;
+        }
+        pending.append((const char *) in, len);
+        return true;
+    };
+    auto need = [&](size_t len) {
+        while (available() < len && readMore()) { }
+        return available() >= len;
+    };
+    /* Copies decompressed data into write buffers, queueing them as they fill up */
+    auto output = [&](const char *data, size_t len) {
+        while (len)
+        {
+            if (!buf)
+            {
+                buf = _acquireWriteBuffer();
+                if (!buf)
+                    return false;
+                fill = 0;
+            }
+            size_t n = qMin(len, _abufsize-fill);
+            memcpy(buf+fill, data, n);
+            fill += n;
+            data += n;
+            len -= n;
+            if (fill == _abufsize)
+            {
+                _queueWrite(buf, fill);
+                buf = nullptr;
+            }
+        }
+        return true;
+    };
+    /* Writes out frames decoded on the pool, in order. Waits until no more
+       than maxPending are left, and takes any others that already finished */
+    auto drainJobs = [&](size_t maxPending) {
+        while (jobs.size() > maxPending || (!jobs.empty() && jobs.front().isFinished()))
+        {
+            _zstdFrame f = jobs.front().result();
+            jobs.pop_front();
+            if (!f.ok)
+                throw runtime_error("Corrupt zstd data");
+            if (!output(f.data.constData(), f.data.size()))
+                return false;
+        }
+        return true;
+    };
+
+    while (need(4))
+    {
+        quint32 magic = qFromLittleEndian<quint32>(pending.constData()+pos);
+
+        if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)
+        {
+            /* pzstd size hints and seek table of the seekable format. Nothing to decode */
+            if (!need(8))
+                throw runtime_error("Truncated zstd data");
+            size_t skip = 8 + qFromLittleEndian<quint32>(pending.constData()+pos+4);
+            if (!need(skip))
+                throw runtime_error("Truncated zstd data");
+            pos += skip;
+            continue;
+        }
+
+        need(frameHeaderSizeMax);
+        unsigned long long contentSize = ZSTD_getFrameContentSize(pending.constData()+pos, available());
+        if (contentSize == ZSTD_CONTENTSIZE_ERROR)
+            throw runtime_error("Corrupt zstd data");
+
+        size_t frameSize = 0;
+        if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize <= _budget.zstdMaxFrameOutput)
+        {
+            /* Buffer whole frame, so it can be decoded on the pool */
+            while (true)
+            {
+                size_t r = ZSTD_findFrameCompressedSize(pending.constData()+pos, available());
+                if (!ZSTD_isError(r))
+                {
+                    frameSize = r;
+                    break;
+                }
+                if (available() > _budget.zstdMaxFrameSize || !readMore())
+                    break;
+            }
+        }
+
+        if (frameSize)
+        {
+            if (!drainJobs(maxJobs-1))
+                return false;
+            QByteArray frame = pending.mid(pos, frameSize);
+            pos += frameSize;
+            jobs.push_back(QtConcurrent::run(&pool, _decompressZstdFrame, frame, (size_t) contentSize));
+            parallelFrames++;
+            continue;
+        }
+
+        /* Decode frame as a stream, straight into the write buffers */
+        if (!drainJobs(0))
+            return false;
+        ZSTD_DCtx_reset(dctx.get(), ZSTD_reset_session_only);
+        streamedFrames++;
+
+        size_t ret = 1;
+        while (ret)
+        {
+            if (!available() && !readMore())
+                throw runtime_error("Truncated zstd data");
+            if (!buf)
+            {
+                buf = _acquireWriteBuffer();
+                if (!buf)
+                    return false;
+                fill = 0;
+            }
+
+            ZSTD_inBuffer in = {pending.constData()+pos, available(), 0};
+            ZSTD_outBuffer out = {buf, _abufsize, fill};
+            {
+                TraceSpan span("decompress");
+                ret = ZSTD_decompressStream(dctx.get(), &out, &in);
+            }
+            if (ZSTD_isError(ret))
+                throw runtime_error(std::string("Corrupt zstd data: ")+ZSTD_getErrorName(ret));
+
+            pos += in.pos;
+            fill = out.pos;
+            if (fill == _abufsize)
+            {
+                _queueWrite(buf, fill);
+                buf = nullptr;
+            }
+        }
+    }
+    if (available())
+        throw runtime_error("Truncated zstd data");
+    if (!drainJobs(0))
+        return false;
+
+    if (buf && fill)
+        _queueImageData(buf, fill);
+    else if (buf)
+        _releaseWriteBuffer(buf);
+
+    qDebug() << "zstd frames decoded in parallel:" << parallelFrames << "streamed:" << streamedFrames;
+
+    return true;
+}
+
+/* Queues decompressed data for writing, padding it to a multiple of the sector size if needed */
+void DownloadExtractThread::_queueImageData(char *buf, size_t size)
+{
+    if (size % 512 != 0)
+    {
+        size_t paddingBytes = 512-(size % 512);
+        qDebug() << "Image is NOT a valid disk image, as its length is not a multiple of the sector size of 512 bytes long";
+        qDebug() << "Last write() would be" << size << "bytes, but padding to" << size + paddingBytes << "bytes";
+        memset(buf+size, 0, paddingBytes);
+        size += paddingBytes;
+    }
+
+    _queueWrite(buf, size);
+}
+
+/* Returns a buffer to decompress into, waiting for the writer if all are in use.
+   Returns nullptr if writing failed or was aborted */
+char *DownloadExtractThread::_acquireWriteBuffer()
+{
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+
+    if (_freeBufs.empty() && !_writeError && !_writeQueueClosed)
+    {
+        TraceSpan span("writeQueuePushWait");
+        QElapsedTimer t;
+        t.start();
+        _writeQueueCv.wait(lock, [this]{
+                return !_freeBufs.empty() || _writeError || _writeQueueClosed;
+        });
+        _extractStallTime += t.elapsed();
+    }
+
+    if (_writeError || _writeQueueClosed)
+        return nullptr;
+
+    char *buf = _freeBufs.front();
+    _freeBufs.pop_front();
+
+    return buf;
+}
+
+void DownloadExtractThread::_releaseWriteBuffer(char *buf)
+{
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+    _freeBufs.push_back(buf);
+    lock.unlock();
+    _writeQueueCv.notify_all();
+}
+
+void DownloadExtractThread::_queueWrite(char *buf, size_t len)
+{
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+    _writeQueue.push_back({buf, len});
+    lock.unlock();
+    _extractedBytes += len;
+    _writeQueueCv.notify_all();
+}
+
+/* Lets the writer thread drain the queue, and waits for it to finish.
+   Returns false on write error */
+bool DownloadExtractThread::_finishWrites()
+{
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+    _writeQueueClosed = true;
+    lock.unlock();
+    _writeQueueCv.notify_all();
+    _writeThread->wait();
+
+    return !_writeError;
+}
+
+/* Discards pending writes, and wakes up both the extract and write stage */
+void DownloadExtractThread::_abortWrites()
+{
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+    _writeQueueClosed = true;
+    _writeQueue.clear();
+    lock.unlock();
+    _writeQueueCv.notify_all();
+}
+
+// writer thread
+void DownloadExtractThread::_writeRun()
+{
+    _startPhase(PhaseWrite);
+
+#ifdef Q_OS_LINUX
+    /* Streaming output publishes progress per write, so it takes the regular writes.
+       An output stream has no file to submit writes for */
+    if (_ioUringEnabled && !_streamingOutput && !_outputStream && _writeRunIoUring())
+        return;
+#elif defined(Q_OS_WIN)
+    if (_file.isOverlapped() && !_streamingOutput && !_outputStream && _writeRunQueued())
+        return;
+#elif defined(Q_OS_DARWIN)
+    if (_ioUringEnabled && !_isNormalFile && !_streamingOutput && !_outputStream
+            && _file.startWriteQueue(_abuf.size()) && _writeRunQueued())
+        return;
+#endif
+
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+
+    while (true)
+    {
+        if (_writeQueue.empty() && !_writeQueueClosed)
+        {
+            TraceSpan span("writeQueuePopWait");
+            QElapsedTimer t;
+            t.start();
+            _writeQueueCv.wait(lock, [this]{
+                    return !_writeQueue.empty() || _writeQueueClosed;
+            });
+            _writeStallTime += t.elapsed();
+        }
+        if (_writeQueue.empty())
+            break;
+
+        WriteRequest req = _writeQueue.front();
+        _writeQueue.pop_front();
+        lock.unlock();
+
+        bool ok = (_writeFile(req.buf, req.len) == req.len);
+
+        lock.lock();
+        _freeBufs.push_back(req.buf);
+        if (!ok)
+        {
+            _writeError = true;
+            _writeQueue.clear();
+        }
+        _writeQueueCv.notify_all();
+        if (!ok)
+            break;
+    }
+}
+
+#ifdef Q_OS_LINUX
+/* Returns true if folder lives on a different device than parent directory */
+inline bool isMountPoint(const QString &folder)
+{
+    struct stat statFolder, statParent;
+    QFileInfo fi(folder);
+    QByteArray folderAscii = folder.toLatin1();
+    QByteArray parentDir   = fi.dir().path().toLatin1();
+
+    if ( ::stat(folderAscii.constData(), &statFolder) == -1
+         || ::stat(parentDir.constData(), &statParent) == -1)
+    {
+        return false;
+    }
+
+    return (statFolder.st_dev != statParent.st_dev);
+}
+#endif
+
+void DownloadExtractThread::_checkMultiFileHash()
+{
+    QByteArray computedHash = _inputHash.result().toHex();
+    qDebug() << "Hash of compressed multi-file zip:" << computedHash;
+    if (!_expectedHash.isEmpty() && _expectedHash != computedHash)
+    {
+        qDebug() << "Mismatch with expected hash:" << _expectedHash;
+        throw runtime_error("Download corrupt. SHA256 does not match");
+    }
+    if (_cacheEnabled && _expectedHash == computedHash)
+    {
+        if (_closeCacheFile())
+        {
+            CacheJournal::remove(_cachefile.fileName());
+            emit cacheFileUpdated(computedHash);
+        }
+        else
+        {
+            qDebug() << "Cache file is incomplete. Not keeping it";
+            _discardCacheFile();
+        }
+    }
+}
+
+QString DownloadExtractThread::_seekableInput() const
+{
+    return QString();
+}
+
+/* Zip archives that are on disk as a whole have their entries inflated on the
+   pool, each worker reading the archive with a reader of its own, and written
+   in order by this thread. Returns false if the input is not such an archive */
+bool DownloadExtractThread::_extractMultiFileInParallel(struct archive *ext, QStringList &filesExtracted, QStringList &dirExtracted)
+{
+    QString input = _seekableInput();
+    const int threads = qBound(1, QThread::idealThreadCount(), qMin(IMAGEWRITER_ZIP_MAX_THREADS, _budget.decompressThreads));
+    QFile f(input);
+
+    if (input.isEmpty() || threads < 2 || !f.open(QIODevice::ReadOnly) || f.read(4) != QByteArray("PK\x03\x04", 4))
+        return false;
+    f.close();
+
+    struct Entry
+    {
+        struct archive_entry *entry;
+        QByteArray data;
+        /* Counted in buffered */
+        quint64 reserved;
+    };
+    const quint64 maxBuffered = _budget.decompressMemory ? qMin(_budget.decompressMemory, (quint64) IMAGEWRITER_ZIP_MAX_BUFFERED) : IMAGEWRITER_ZIP_MAX_BUFFERED;
+    QByteArray filename = input.toLocal8Bit();
+    std::map<int, Entry> done;
+    std::mutex mutex;
+    std::condition_variable cv;
+    /* Entries are taken in order. lastEntry: number of entries, once a worker found the end */
+    int nextEntry = 0, nextWrite = 0, lastEntry = INT_MAX;
+    quint64 buffered = 0;
+    std::atomic<bool> stop(false);
+    QString workerError;
+
+    auto worker = [&]() {
+        struct archive *a = archive_read_new();
+        struct archive_entry *entry;
+        int current = -1;
+
+        archive_read_support_format_zip_seekable(a);
+        try
+        {
+            _checkResult(archive_read_open_filename(a, filename.constData(), IMAGEWRITER_BLOCKSIZE), a);
+            while (true)
             {
-                //if (_writeFile(_abuf, size) != (size_t) size)
-                if (!_writeFuture.result())
+                std::unique_lock<std::mutex> lock(mutex);
+                int idx = nextEntry++;
+                lock.unlock();
+
+                /* Skipping is cheap, the seekable reader uses the central directory */
+                while (current < idx)
                 {
-                    if (!_cancelled)
+                    if (current >= 0)
+                        _checkResult(archive_read_data_skip(a), a);
+                    int r = archive_read_next_header(a, &entry);
+                    if (r == ARCHIVE_EOF)
                     {
-                        _onWriteError();
+                        lock.lock();
+                        lastEntry = qMin(lastEntry, idx);
+                        cv.notify_all();
+                        archive_read_free(a);
+                        return;
                     }
-                    archive_read_free(a);
-                    return;
+                    _checkResult(r, a);
+                    current++;
                 }
-            }
 
-#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
-            _writeFuture = QtConcurrent::run(&DownloadThread::_writeFile, static_cast<DownloadThread *>(this), _abuf[_activeBuf], size);
-#else
-            _writeFuture = QtConcurrent::run(static_cast<DownloadThread *>(this), &DownloadThread::_writeFile, _abuf[_activeBuf], size);
-#endif
-            _activeBuf = _activeBuf ? 0 : 1;
-            _writeThreadStarted = true;
-        }
+                /* The entry written next always goes ahead, so the writer cannot wait for one that waits for memory */
+                quint64 size = archive_entry_size_is_set(entry) ? archive_entry_size(entry) : 0;
+                lock.lock();
+                cv.wait(lock, [&]() { return stop || idx == nextWrite || buffered + size <= maxBuffered; });
+                if (stop)
+                    break;
+                buffered += size;
+                lock.unlock();
+
+                Entry e = {archive_entry_clone(entry), QByteArray(), size};
+                if (archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0)
+                {
+                    const void *buff;
+                    size_t len;
+                    int64_t offset;
+                    int r;
+                    e.data.reserve(size);
+                    while ( (r = archive_read_data_block(a, &buff, &len, &offset)) != ARCHIVE_EOF && !_cancelled)
+                    {
+                        _checkResult(r, a);
+                        if ((quint64) e.data.size() < offset + len)
+                            e.data.append(QByteArray(offset + len - e.data.size(), 0));
+                        memcpy(e.data.data() + offset, buff, len);
+                    }
+                    if ((quint64) e.data.size() < size)
+                        e.data.append(QByteArray(size - e.data.size(), 0));
+                }
 
-        if (_writeThreadStarted)
-            _writeFuture.waitForFinished();
-        _writeComplete();
-    }
-    catch (exception &e)
-    {
-        if (!_cancelled)
+                lock.lock();
+                if ((quint64) e.data.size() > size)
+                {
+                    /* Size was not in the header */
+                    buffered += e.data.size() - size;
+                    e.reserved = e.data.size();
+                }
+                done[idx] = e;
+                cv.notify_all();
+                if (stop || _cancelled)
+                    break;
+            }
+        }
+        catch (exception &e)
         {
-            // Fatal error
-            DownloadThread::cancelDownload();
-            emit error(tr("Error extracting archive: %1").arg(e.what()));
+            std::lock_guard<std::mutex> lock(mutex);
+            if (workerError.isEmpty())
+                workerError = e.what();
+            stop = true;
+            cv.notify_all();
         }
-    }
+        archive_read_free(a);
+    };
+
+    /* Input hash covers the archive as a whole, read in order */
+    auto hashInput = [&]() {
+        QFile in(input);
+        QByteArray buf(IMAGEWRITER_BLOCKSIZE, 0);
+        qint64 len = 0;
+        if (!in.open(QIODevice::ReadOnly))
+            return false;
+        while (!stop && !_cancelled && (len = in.read(buf.data(), buf.size())) > 0)
+        {
+            _inputHash.addData(buf.constData(), len);
+            _lastDlNow += len;
+        }
+        return len == 0;
+    };
+
+    qDebug() << "Extracting zip entries with" << threads << "threads";
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads+1);
+    QList<QFuture<void>> workers;
+    for (int i = 0; i < threads; i++)
+        workers.append(QtConcurrent::run(&pool, worker));
+    QFuture<bool> hashed = QtConcurrent::run(&pool, hashInput);
+
+    auto finish = [&]() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+            cv.notify_all();
+        }
+        for (auto &w : workers)
+            w.waitForFinished();
+        hashed.waitForFinished();
+        for (auto &d : done)
+            archive_entry_free(d.second.entry);
+        done.clear();
+    };
 
-    archive_read_free(a);
-}
+    try
+    {
+        while (true)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return done.count(nextWrite) || nextWrite >= lastEntry || !workerError.isEmpty() || _cancelled; });
+            if (!workerError.isEmpty())
+                throw runtime_error(workerError.toStdString());
+            if (_cancelled)
+                throw runtime_error("Cancelled");
+            if (!done.count(nextWrite))
+                break;
+            Entry e = done[nextWrite];
+            done.erase(nextWrite);
+            lock.unlock();
+
+            int r = archive_write_header(ext, e.entry);
+            if (r < ARCHIVE_OK)
+                qDebug() << archive_error_string(ext);
+            else if (archive_entry_size(e.entry) > 0)
+            {
+                QString filename = QString::fromWCharArray(archive_entry_pathname_w(e.entry));
+                if (archive_entry_filetype(e.entry) == AE_IFDIR) // Empty directory
+                    dirExtracted.append(filename);
+                else
+                    filesExtracted.append(filename);
+
+                if (!e.data.isEmpty())
+                    _checkResult(archive_write_data_block(ext, e.data.constData(), e.data.size(), 0), ext);
+                _bytesWritten += e.data.size();
+                _publishProgress();
+            }
+            archive_entry_free(e.entry);
+            _checkResult(archive_write_finish_entry(ext), ext);
 
-#ifdef Q_OS_LINUX
-/* Returns true if folder lives on a different device than parent directory */
-inline bool isMountPoint(const QString &folder)
-{
-    struct stat statFolder, statParent;
-    QFileInfo fi(folder);
-    QByteArray folderAscii = folder.toLatin1();
-    QByteArray parentDir   = fi.dir().path().toLatin1();
+            lock.lock();
+            buffered -= e.reserved;
+            nextWrite++;
+            cv.notify_all();
+        }
 
-    if ( ::stat(folderAscii.constData(), &statFolder) == -1
-         || ::stat(parentDir.constData(), &statParent) == -1)
+        bool ok = hashed.result();
+        finish();
+        if (!ok)
+            throw runtime_error("Error reading archive");
+    }
+    catch (...)
     {
-        return false;
+        finish();
+        throw;
     }
 
-    return (statFolder.st_dev != statParent.st_dev);
+    return true;
 }
-#endif
 
 void DownloadExtractThread::extractMultiFileRun()
 {
@@ -235,6 +1356,11 @@ void DownloadExtractThread::extractMultiFileRun()
     QStringList filesExtracted, dirExtracted;
     QByteArray devlower = _filename.toLower();
 
+#ifdef Q_OS_LINUX
+    if (_userspaceExtraction && _extractMultiFileToFat())
+        return;
+#endif
+
     /* See if OS auto-mounted the device */
     for (int tries = 0; tries < 3; tries++)
     {
@@ -318,11 +1444,14 @@ void DownloadExtractThread::extractMultiFileRun()
     archive_read_support_filter_all(a);
     archive_read_support_format_all(a);
     archive_write_disk_set_options(ext, flags);
-    archive_read_open(a, this, NULL, &DownloadExtractThread::_archive_read, &DownloadExtractThread::_archive_close);
 
     try
     {
-        while ( (r = archive_read_next_header(a, &entry)) != ARCHIVE_EOF)
+        bool parallel = _extractMultiFileInParallel(ext, filesExtracted, dirExtracted);
+        if (!parallel)
+            archive_read_open(a, this, NULL, &DownloadExtractThread::_archive_read, &DownloadExtractThread::_archive_close);
+
+        while (!parallel && (r = archive_read_next_header(a, &entry)) != ARCHIVE_EOF)
         {
           _checkResult(r, a);
           r = archive_write_header(ext, entry);
@@ -346,23 +1475,13 @@ void DownloadExtractThread::extractMultiFileRun()
                   _checkResult(r, a);
                   _checkResult(archive_write_data_block(ext, buff, size, offset), ext);
                   _bytesWritten += size;
+                  _publishProgress();
               }
           }
           _checkResult(archive_write_finish_entry(ext), ext);
         }
 
-        QByteArray computedHash = _inputHash.result().toHex();
-        qDebug() << "Hash of compressed multi-file zip:" << computedHash;
-        if (!_expectedHash.isEmpty() && _expectedHash != computedHash)
-        {
-            qDebug() << "Mismatch with expected hash:" << _expectedHash;
-            throw runtime_error("Download corrupt. SHA256 does not match");
-        }
-        if (_cacheEnabled && _expectedHash == computedHash)
-        {
-            _cachefile.close();
-            emit cacheFileUpdated(computedHash);
-        }
+        _checkMultiFileHash();
 
         // Don't emit success here for DfuThread - it will emit after DFU transfer completes
         // Check if we're in DfuThread by checking if this is the actual type
@@ -374,7 +1493,7 @@ void DownloadExtractThread::extractMultiFileRun()
     catch (exception &e)
     {
         if (_cachefile.isOpen())
-            _cachefile.remove();
+            _discardCacheFile();
 
         qDebug() << "Deleting extracted files";
         for (const auto& filename : filesExtracted)
@@ -396,6 +1515,7 @@ void DownloadExtractThread::extractMultiFileRun()
         if (!_cancelled)
         {
             /* Fatal error */
+            _discardPartialCache = true;
             DownloadThread::cancelDownload();
             emit error(tr("Error extracting archive: %1").arg(e.what()));
         }
@@ -416,14 +1536,168 @@ void DownloadExtractThread::extractMultiFileRun()
     }
 #endif
 
-    eject_disk(_filename.constData());
+    _eject(_filename, false);
+}
+
+#ifdef Q_OS_LINUX
+/* Extracts into the FAT file system of the first partition ourselves, so it does
+   not have to be mounted. Returns false if the device cannot be opened */
+bool DownloadExtractThread::_extractMultiFileToFat()
+{
+    unmount_disk(_filename.constData());
+    _file.setFileName(_filename);
+
+    bool opened = _file.open(QIODevice::ReadWrite | QIODevice::Unbuffered);
+#ifndef QT_NO_DBUS
+    if (!opened)
+    {
+        UDisks2Api udisks;
+        int fd = udisks.authOpen(_filename);
+        if (fd != -1)
+            opened = _file.open(fd, QIODevice::ReadWrite | QIODevice::Unbuffered, QFileDevice::AutoCloseHandle);
+    }
+#endif
+    if (!opened)
+    {
+        qDebug() << "Cannot open" << _filename << "for userspace extraction. Mounting FAT partition instead";
+        return false;
+    }
+
+    struct archive *a = archive_read_new();
+    struct archive_entry *entry;
+    int r;
+
+    archive_read_support_filter_all(a);
+    archive_read_support_format_all(a);
+    archive_read_open(a, this, NULL, &DownloadExtractThread::_archive_read, &DownloadExtractThread::_archive_close);
+
+    try
+    {
+        std::unique_ptr<DeviceWrapper> dw(_newDeviceWrapper());
+        DeviceWrapperFatPartition *fat = dw->fatPartition(1);
+
+        while ( (r = archive_read_next_header(a, &entry)) != ARCHIVE_EOF)
+        {
+            _checkResult(r, a);
+            _extractEntryToFat(a, entry, fat);
+        }
+
+        /* Nothing refers to the file data until the directories are written */
+        _checkMultiFileHash();
+        fat->finishTree();
+        dw->sync();
+
+        if (!_suppressSuccessSignal) {
+            emit success();
+        }
+    }
+    catch (exception &e)
+    {
+        if (_cachefile.isOpen())
+            _discardCacheFile();
+
+        if (!_cancelled)
+        {
+            /* Fatal error */
+            _discardPartialCache = true;
+            DownloadThread::cancelDownload();
+            emit error(tr("Error extracting archive: %1").arg(e.what()));
+        }
+    }
+
+    archive_read_free(a);
+    _file.close();
+    _eject(_filename, false);
+
+    return true;
+}
+
+void DownloadExtractThread::_extractEntryToFat(struct archive *a, struct archive_entry *entry, DeviceWrapperFatPartition *fat)
+{
+    QString path = QString::fromWCharArray(archive_entry_pathname_w(entry));
+    const void *buff;
+    size_t size;
+    int64_t offset;
+    quint64 pos = 0;
+    int r;
+
+    while (path.startsWith("./"))
+        path.remove(0, 2);
+    while (path.endsWith('/'))
+        path.chop(1);
+    if (path.isEmpty() || path == ".")
+        return;
+    /* Same safety checks as ARCHIVE_EXTRACT_SECURE_NOABSOLUTEPATHS and ARCHIVE_EXTRACT_SECURE_NODOTDOT */
+    if (path.startsWith('/') || path.split('/').contains(".."))
+        throw runtime_error("Archive contains an absolute path or '..'");
+
+    if (archive_entry_filetype(entry) == AE_IFDIR)
+    {
+        fat->addDirectory(path);
+        return;
+    }
+    if (archive_entry_filetype(entry) != AE_IFREG)
+    {
+        qDebug() << "Skipping" << path << ": FAT only has regular files and directories";
+        return;
+    }
+
+    if (!archive_entry_size_is_set(entry))
+    {
+        /* Size only known at the end (zip with data descriptor), so collect it first */
+        QByteArray data;
+        while ( (r = archive_read_data_block(a, &buff, &size, &offset)) != ARCHIVE_EOF)
+        {
+            _checkResult(r, a);
+            if ((quint64) data.size() < offset + size)
+                data.append(QByteArray(offset + size - data.size(), 0));
+            memcpy(data.data() + offset, buff, size);
+            _bytesWritten += size;
+            _publishProgress();
+        }
+        fat->beginFile(path, data.size());
+        fat->writeFileData(data.constData(), data.size());
+        return;
+    }
+
+    quint64 len = archive_entry_size(entry);
+    QByteArray zeroes;
+    fat->beginFile(path, len);
+
+    while (true)
+    {
+        r = archive_read_data_block(a, &buff, &size, &offset);
+        if (r == ARCHIVE_EOF)
+            offset = len;
+        else
+            _checkResult(r, a);
+
+        if ((quint64) offset < pos)
+            throw runtime_error("Archive entry data out of order");
+        while (pos < (quint64) offset)
+        {
+            /* Hole in a sparse entry */
+            if (zeroes.isEmpty())
+                zeroes = QByteArray(IMAGEWRITER_BLOCKSIZE, 0);
+            quint64 n = qMin((quint64) zeroes.size(), offset - pos);
+            fat->writeFileData(zeroes.constData(), n);
+            pos += n;
+        }
+        if (r == ARCHIVE_EOF)
+            break;
+
+        fat->writeFileData((const char *) buff, size);
+        pos += size;
+        _bytesWritten += size;
+        _publishProgress();
+    }
 }
+#endif
 
 ssize_t DownloadExtractThread::_on_read(struct archive *, const void **buff)
 {
-    _buf = _popQueue();
-    *buff = _buf.data();
-    return _buf.size();
+    /* Slab stays valid until libarchive calls us again */
+    return _queue.read(buff);
 }
 
 int DownloadExtractThread::_on_close(struct archive *)
@@ -434,7 +1708,18 @@ int DownloadExtractThread::_on_close(struct archive *)
 // static callback functions that call object oriented equivalents
 ssize_t DownloadExtractThread::_archive_read(struct archive *a, void *client_data, const void **buff)
 {
-   return qobject_cast<DownloadExtractThread *>((QObject *) client_data)->_on_read(a, buff);
+   DownloadExtractThread *de = qobject_cast<DownloadExtractThread *>((QObject *) client_data);
+
+   if (de->_peekLen)
+   {
+       /* Data already read to detect the input format */
+       ssize_t len = de->_peekLen;
+       *buff = de->_peekData;
+       de->_peekLen = 0;
+       return len;
+   }
+
+   return de->_on_read(a, buff);
 }
 
 int DownloadExtractThread::_archive_close(struct archive *a, void *client_data)
@@ -452,40 +1737,423 @@ void DownloadExtractThread::enableMultipleFileExtraction()
     _isImage = false;
 }
 
-// Synchronized queue using monitor consumer/producer pattern
-QByteArray DownloadExtractThread::_popQueue()
+void DownloadExtractThread::setWriteQueueDepth(int depth)
 {
-    std::unique_lock<std::mutex> lock(_queueMutex);
+    _writeQueueDepth = depth;
+}
+
+void DownloadExtractThread::setWriteBlockSize(size_t size)
+{
+    _writeBlockSize = size;
+}
 
-    _cv.wait(lock, [this]{
-            return _queue.size() != 0;
-    });
+void DownloadExtractThread::setMemoryBudget(const MemoryBudget &budget)
+{
+    DownloadThread::setMemoryBudget(budget);
+    _queue.setCapacity(budget.ringBufferSize);
+}
+
+void DownloadExtractThread::setUserspaceExtraction(bool enabled)
+{
+    _userspaceExtraction = enabled;
+}
 
-    QByteArray result = _queue.front();
-    _queue.pop_front();
+size_t DownloadExtractThread::_blockSize() const
+{
+    size_t size = _writeBlockSize;
+
+    /* Devices that report a large optimal I/O size (e.g. RAID stripes, some USB bridges)
+       are written in whole multiples of it. SD cards and eMMC in whole erase blocks, so
+       cheap cards do not read, modify and write back an erase block for every write */
+    size_t unit = 0;
+    if (_eraseSize && _eraseSize <= IMAGEWRITER_MAX_BLOCKSIZE)
+        unit = _eraseSize;
+    else if (_optimalIOSize && _optimalIOSize <= IMAGEWRITER_MAX_BLOCKSIZE)
+        unit = _optimalIOSize;
+
+    if (!size)
+    {
+        size = IMAGEWRITER_BLOCKSIZE;
+        if (unit && size % unit)
+            size = (size / unit + 1) * unit;
+    }
 
-    if (_queue.size() == (MAX_QUEUE_SIZE-1))
+    /* Room for at least two buffers within the memory budget */
+    const size_t granularity = 64*1024;
+    if (_budget.writeBufferBytes && size > _budget.writeBufferBytes/2)
     {
-        lock.unlock();
-        _cv.notify_one();
+        size = qMax(granularity, _budget.writeBufferBytes/2 / granularity * granularity);
+        if (unit && size > unit)
+            size -= size % unit;
     }
 
-    return result;
+    return size;
+}
+
+quint64 DownloadExtractThread::extractStallTime() const
+{
+    return _extractStallTime;
+}
+
+quint64 DownloadExtractThread::writeStallTime() const
+{
+    return _writeStallTime;
 }
 
-void DownloadExtractThread::_pushQueue(const char *data, size_t len)
+#ifdef Q_OS_LINUX
+/* Writer thread using io_uring, keeping a write in flight for every buffer
+   of the pool. Blocks are hashed in order on the hash stage while they are
+   written, and their buffers reused once both are done.
+   Returns false if io_uring is not available */
+bool DownloadExtractThread::_writeRunIoUring()
 {
-    std::unique_lock<std::mutex> lock(_queueMutex);
+    IoUring ring;
+    const int depth = _abuf.size();
+
+    if (!ring.init(depth))
+    {
+        qDebug() << "io_uring not available. Using regular writes";
+        return false;
+    }
+
+    QVector<struct iovec> iov(depth);
+    QVector<size_t> lens(depth, 0);
+    /* Hash stage ticket of each buffer in flight */
+    QVector<quint64> hashed(depth, 0);
+    /* When each write was queued, for the write latency histogram */
+    QVector<qint64> queuedAt(depth, 0);
+    QElapsedTimer clock;
+    clock.start();
+    for (int i = 0; i < depth; i++)
+    {
+        iov[i].iov_base = _abuf[i];
+        iov[i].iov_len = _abufsize;
+    }
+    if (!ring.registerBuffers(iov.constData(), depth))
+        qDebug() << "Unable to register io_uring buffers. Continuing without";
+
+    int fd = _file.handle();
+    quint64 offset = _file.pos();
+    std::deque<WriteRequest> reqs;
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+
+    /* Waits for all writes in flight, returning their buffers to the pool */
+    auto drainRing = [&]() {
+        bool ok = true;
+        while (ring.inFlight() && ok)
+        {
+            quint64 done;
+            int res;
+            ok = ring.waitCompletion(&done, &res) && res == (int) lens[done];
+            _writeHealth.recordWrite(clock.nsecsElapsed() - queuedAt[done]);
+            _bytesWritten += qMax(res, 0);
+            _publishProgress();
+            _hashStage.waitFor(hashed[done]);
+            lock.lock();
+            _freeBufs.push_back(_abuf[done]);
+            _writeQueueCv.notify_all();
+            lock.unlock();
+        }
+        return ok;
+    };
+
+    while (true)
+    {
+        if (_writeQueue.empty() && !_writeQueueClosed && !ring.inFlight())
+        {
+            TraceSpan span("writeQueuePopWait");
+            QElapsedTimer t;
+            t.start();
+            _writeQueueCv.wait(lock, [this]{
+                    return !_writeQueue.empty() || _writeQueueClosed;
+            });
+            _writeStallTime += t.elapsed();
+        }
+        if (_writeQueue.empty() && !ring.inFlight())
+            break;
+
+        reqs.swap(_writeQueue);
+        lock.unlock();
+
+        bool ok = true;
+        while (!reqs.empty() && ok)
+        {
+            WriteRequest req = reqs.front();
+            reqs.pop_front();
+            int idx = _abuf.indexOf(req.buf);
+
+            if (_cancelled)
+            {
+                /* Discard */
+            }
+            else if (!_firstBlock || _capturing(offset, req.len) || (_directIO && req.len % _directIOAlignment))
+            {
+                /* First block and boot partition are held back by _writeFile(). Unaligned
+                   blocks cannot be written with O_DIRECT. Let the regular code path handle those */
+                ok = drainRing();
+                _file.seek(offset);
+                ok = ok && (_writeFile(req.buf, req.len) == req.len);
+                offset = _file.pos();
+            }
+            else if (_canSkipBlock(req.buf, req.len, offset))
+            {
+                /* Not mapped by bmap, or device already reads back as zeroes. No need to write */
+                _hashStage.waitFor(_submitHash(req.buf, req.len));
+                _bytesWritten += req.len;
+                _bytesSkipped += req.len;
+                offset += req.len;
+            }
+            else if (_zeroOutBlock(req.buf, req.len, offset))
+            {
+                /* Zeroed by the device itself, does not overlap anything in flight */
+                _hashStage.waitFor(_submitHash(req.buf, req.len));
+                _bytesWritten += req.len;
+                offset += req.len;
+            }
+            else
+            {
+                hashed[idx] = _submitHash(req.buf, req.len);
+                lens[idx] = req.len;
+                queuedAt[idx] = clock.nsecsElapsed();
+                ok = ring.queueWrite(fd, req.buf, req.len, offset, idx, idx);
+                offset += req.len;
+                if (ok)
+                    continue;
+                _hashStage.waitFor(hashed[idx]);
+            }
+
+            lock.lock();
+            _freeBufs.push_back(req.buf);
+            _writeQueueCv.notify_all();
+            lock.unlock();
+        }
+
+        if (ok && _overlappedVerify && offset - _lastCheckpoint >= IMAGEWRITER_VERIFY_CHECKPOINT)
+        {
+            /* Everything up to offset must have reached the device before syncing */
+            ok = drainRing();
+            _writeCheckpoint(offset);
+        }
+        if (ok && _journalCheckpointDue(offset))
+        {
+            ok = drainRing();
+            _writeJournalCheckpoint(offset);
+        }
 
-    _cv.wait(lock, [this]{
-            return _queue.size() != MAX_QUEUE_SIZE;
-    });
+        if (ok && ring.inFlight())
+        {
+            quint64 done;
+            int res;
+
+            ok = ring.waitCompletion(&done, &res);
+            if (ok)
+                _writeHealth.recordWrite(clock.nsecsElapsed() - queuedAt[done]);
+            if (ok && res != (int) lens[done])
+            {
+                qDebug() << "Write error:" << (res < 0 ? strerror(-res) : "short write") << "while writing len:" << lens[done];
+                ok = false;
+            }
+            _bytesWritten += qMax(res, 0);
+            _publishProgress();
+            _hashStage.waitFor(hashed[done]);
+
+            lock.lock();
+            _freeBufs.push_back(_abuf[done]);
+            _writeQueueCv.notify_all();
+            lock.unlock();
+        }
+
+        lock.lock();
+        if (!ok)
+        {
+            _writeError = true;
+            _writeQueue.clear();
+            _writeQueueCv.notify_all();
+            break;
+        }
+    }
+    lock.unlock();
+
+    /* Buffers may not be reused while the kernel can still read from them */
+    while (ring.inFlight())
+    {
+        quint64 done;
+        int res;
+        if (!ring.waitCompletion(&done, &res))
+            break;
+    }
+    _file.seek(offset);
 
-    _queue.emplace_back(data, len);
+    return true;
+}
+#elif defined(Q_OS_WIN) || defined(Q_OS_DARWIN)
+/* Like _writeRunIoUring(), with the writes queued on the completion port of the
+   overlapped handle on Windows, or to the writer threads of MacFile on macOS.
+   Every buffer of the pool can be in flight at the same time */
+bool DownloadExtractThread::_writeRunQueued()
+{
+    QVector<size_t> lens(_abuf.size(), 0);
+    QVector<quint64> hashed(_abuf.size(), 0);
+    QVector<qint64> queuedAt(_abuf.size(), 0);
+    QElapsedTimer clock;
+    clock.start();
+    quint64 offset = _file.pos();
+    std::deque<WriteRequest> reqs;
+    std::unique_lock<std::mutex> lock(_writeQueueMutex);
+
+    /* Waits for one write, returning its buffer to the pool */
+    auto completeWrite = [&]() {
+        quint64 done;
+        qint64 res;
+
+        if (!_file.waitCompletion(&done, &res))
+        {
+            qDebug() << "Error waiting for write:" << _file.errorString();
+            return false;
+        }
 
-    if (_queue.size() == 1)
+        _writeHealth.recordWrite(clock.nsecsElapsed() - queuedAt[done]);
+        bool ok = (res == (qint64) lens[done]);
+        if (!ok)
+            qDebug() << "Write error:" << (res < 0 ? _file.errorString() : "short write") << "while writing len:" << lens[done];
+        _bytesWritten += qMax(res, (qint64) 0);
+        _publishProgress();
+        _hashStage.waitFor(hashed[done]);
+
+        lock.lock();
+        _freeBufs.push_back(_abuf[done]);
+        _writeQueueCv.notify_all();
+        lock.unlock();
+        return ok;
+    };
+    auto drainWrites = [&]() {
+        bool ok = true;
+        while (_file.inFlight() && ok)
+            ok = completeWrite();
+        return ok;
+    };
+
+    while (true)
     {
+        if (_writeQueue.empty() && !_writeQueueClosed && !_file.inFlight())
+        {
+            TraceSpan span("writeQueuePopWait");
+            QElapsedTimer t;
+            t.start();
+            _writeQueueCv.wait(lock, [this]{
+                    return !_writeQueue.empty() || _writeQueueClosed;
+            });
+            _writeStallTime += t.elapsed();
+        }
+        if (_writeQueue.empty() && !_file.inFlight())
+            break;
+
+        reqs.swap(_writeQueue);
         lock.unlock();
-        _cv.notify_one();
+
+        bool ok = true;
+        while (!reqs.empty() && ok)
+        {
+            WriteRequest req = reqs.front();
+            reqs.pop_front();
+            int idx = _abuf.indexOf(req.buf);
+
+            if (_cancelled)
+            {
+                /* Discard */
+            }
+            else if (!_firstBlock || _capturing(offset, req.len) || req.len % _directIOAlignment)
+            {
+                /* First block and boot partition are held back by _writeFile(). Unaligned
+                   blocks cannot be written to the raw device. Let the regular code path handle those */
+                ok = drainWrites();
+                _file.seek(offset);
+                ok = ok && (_writeFile(req.buf, req.len) == req.len);
+                offset = _file.pos();
+            }
+            else if (_canSkipBlock(req.buf, req.len, offset))
+            {
+                /* Not mapped by bmap, or device already reads back as zeroes. No need to write */
+                _hashStage.waitFor(_submitHash(req.buf, req.len));
+                _bytesWritten += req.len;
+                _bytesSkipped += req.len;
+                offset += req.len;
+            }
+            else
+            {
+                hashed[idx] = _submitHash(req.buf, req.len);
+                lens[idx] = req.len;
+                queuedAt[idx] = clock.nsecsElapsed();
+                ok = _file.queueWrite(req.buf, req.len, offset, idx);
+                if (!ok)
+                    qDebug() << "Error queueing write:" << _file.errorString();
+                offset += req.len;
+                if (ok)
+                    continue;
+                _hashStage.waitFor(hashed[idx]);
+            }
+
+            lock.lock();
+            _freeBufs.push_back(req.buf);
+            _writeQueueCv.notify_all();
+            lock.unlock();
+        }
+
+        if (ok && _journalCheckpointDue(offset))
+        {
+            /* Everything up to offset must have reached the device before syncing */
+            ok = drainWrites();
+            _writeJournalCheckpoint(offset);
+        }
+
+        if (ok && _file.inFlight())
+            ok = completeWrite();
+
+        lock.lock();
+        if (!ok)
+        {
+            _writeError = true;
+            _writeQueue.clear();
+            _writeQueueCv.notify_all();
+            break;
+        }
     }
+    lock.unlock();
+
+    /* Buffers may not be reused while the device can still read from them */
+    drainWrites();
+    _file.seek(offset);
+
+    return true;
+}
+#endif
+
+size_t DownloadExtractThread::queueDepth() const
+{
+    return _queue.depth();
+}
+
+size_t DownloadExtractThread::queueCapacity() const
+{
+    return _queue.capacity();
+}
+
+quint64 DownloadExtractThread::queueProducerStalls() const
+{
+    return _queue.producerStalls();
+}
+
+quint64 DownloadExtractThread::queueConsumerStalls() const
+{
+    return _queue.consumerStalls();
+}
+
+void DownloadExtractThread::_printQueueStats()
+{
+    /* Download side waiting on a full ring means storage or decompression is the bottleneck,
+       extract side waiting on an empty ring means the network is */
+    qDebug() << "Download queue: waited" << _queue.producerStalls() << "times for" << _queue.producerStallTime() << "ms on storage/decompression,"
+             << _queue.consumerStalls() << "times for" << _queue.consumerStallTime() << "ms on network";
+    qDebug() << "Write queue (" << _abuf.size() << "buffers): extract stage waited" << _extractStallTime << "ms on writer,"
+             << "write stage waited" << _writeStallTime << "ms on extract";
 }
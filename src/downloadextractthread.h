@@ -7,12 +7,15 @@
  */
 
 #include "downloadthread.h"
+#include "ringbuffer.h"
 #include <deque>
 #include <condition_variable>
 #include <QtConcurrent/QtConcurrent>
 #include "dependencies/qtxmodem/transfer.h"
 
+class DeviceWrapperFatPartition;
 class _extractThreadClass;
+class _writeThreadClass;
 
 class DownloadExtractThread : public DownloadThread
 {
@@ -34,23 +37,109 @@ public:
     virtual void enableMultipleFileExtraction();
     void waitForExtractThread();
 
+    /*
+     * Set number of decompressed blocks that may be queued for writing
+     */
+    void setWriteQueueDepth(int depth);
+
+    /*
+     * Set size of the decompressed blocks written to the device.
+     * 0 (default) uses IMAGEWRITER_BLOCKSIZE, rounded up to a multiple
+     * of the optimal I/O size the device reports
+     */
+    void setWriteBlockSize(size_t size);
+
+    /*
+     * Extract multi-file archives straight into the FAT file system of
+     * the first partition, instead of mounting it and letting the
+     * operating system do it. Linux only. Falls back to mounting if the
+     * device cannot be opened
+     */
+    void setUserspaceExtraction(bool enabled);
+
+    virtual void setMemoryBudget(const MemoryBudget &budget);
+
+    /*
+     * Time (in ms) the extract stage spent waiting for a free buffer,
+     * and the write stage spent waiting for decompressed data
+     */
+    quint64 extractStallTime() const;
+    quint64 writeStallTime() const;
+
+    /* Statistics of the buffer between download and extraction */
+    virtual size_t queueDepth() const;
+    virtual size_t queueCapacity() const;
+    quint64 queueProducerStalls() const;
+    quint64 queueConsumerStalls() const;
+
 protected:
-    char *_abuf[2];
-    size_t _abufsize;
+    struct WriteRequest {
+        char *buf;
+        size_t len;
+    };
+
+    QVector<char *> _abuf;
+    size_t _abufsize, _writeBlockSize;
+    int _writeQueueDepth;
     _extractThreadClass *_extractThread;
-    std::deque<QByteArray> _queue;
-    static const int MAX_QUEUE_SIZE;
-    std::mutex _queueMutex;
-    std::condition_variable _cv;
-    bool _ethreadStarted, _isImage;
+    _writeThreadClass *_writeThread;
+    /* Decompressed blocks waiting to be written, and buffers available for decompression */
+    std::deque<WriteRequest> _writeQueue;
+    std::deque<char *> _freeBufs;
+    std::mutex _writeQueueMutex;
+    std::condition_variable _writeQueueCv;
+    bool _writeQueueClosed;
+    std::atomic<bool> _writeError;
+    std::atomic<quint64> _extractStallTime, _writeStallTime;
+    /* Decompressed bytes queued for writing */
+    quint64 _extractedBytes;
+    RingBuffer _queue;
+    bool _ethreadStarted, _isImage, _userspaceExtraction;
+    /* Input read ahead to detect the format, and not consumed yet */
+    const void *_peekData;
+    ssize_t _peekLen;
     AcceleratedCryptographicHash _inputHash;
-    int _activeBuf;
-    bool _writeThreadStarted;
-    QFuture<size_t> _writeFuture;
 
-    QByteArray _popQueue();
-    void _pushQueue(const char *data, size_t len);
     void _cancelExtract();
+    void _checkMultiFileHash();
+    /* Path of a local file holding all of the input, that can be read at random. Empty if it arrives as a stream */
+    virtual QString _seekableInput() const;
+    bool _extractMultiFileInParallel(struct archive *ext, QStringList &filesExtracted, QStringList &dirExtracted);
+#ifdef Q_OS_LINUX
+    bool _extractMultiFileToFat();
+    void _extractEntryToFat(struct archive *a, struct archive_entry *entry, DeviceWrapperFatPartition *fat);
+#endif
+    void _printQueueStats();
+    bool _extractArchive(struct archive *a);
+    void _peekInput();
+    bool _isGzipStream() const;
+    bool _isXzStream() const;
+    bool _isZstdStream() const;
+    bool _isLz4Stream() const;
+    bool _extractGzip();
+#ifdef HAVE_QATZIP
+    bool _extractGzipQat(bool &ok);
+#endif
+    bool _extractXz();
+    bool _extractZstd();
+#ifdef HAVE_LZ4
+    bool _extractLz4();
+#endif
+    void _queueImageData(char *buf, size_t size);
+    char *_acquireWriteBuffer();
+    void _releaseWriteBuffer(char *buf);
+    size_t _blockSize() const;
+    void _queueWrite(char *buf, size_t len);
+    bool _finishWrites();
+    void _abortWrites();
+    void _writeRun();
+#ifdef Q_OS_LINUX
+    bool _writeRunIoUring();
+#elif defined(Q_OS_WIN) || defined(Q_OS_DARWIN)
+    bool _writeRunQueued();
+#endif
+
+    friend class _writeThreadClass;
     virtual size_t _writeData(const char *buf, size_t len);
     virtual void _onDownloadSuccess();
     virtual void _onDownloadError(const QString &msg);
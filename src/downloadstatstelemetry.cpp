@@ -1,5 +1,6 @@
 #include "downloadstatstelemetry.h"
 #include "config.h"
+#include "curlshare.h"
 #include <QSettings>
 #include <QDebug>
 #include <QUrl>
@@ -7,24 +8,16 @@
 #include <QLocale>
 #include <QFile>
 #include <QRegularExpression>
+#include <chrono>
 
 /*
  * SPDX-License-Identifier: Apache-2.0
  * Copyright (C) 2020 Raspberry Pi Ltd
  */
 
-DownloadStatsTelemetry::DownloadStatsTelemetry(const QByteArray &url, const QByteArray &parentcategory, const QByteArray &osname, bool embedded, const QString &imagerLang, QObject *parent)
-    : QThread(parent), _url(TELEMETRY_URL)
+DownloadStatsTelemetry::DownloadStatsTelemetry(QObject *parent)
+    : QThread(parent), _c(nullptr), _url(TELEMETRY_URL), _stopping(false)
 {
-    QLocale locale;
-    _postfields = "url="+QUrl::toPercentEncoding(url)
-            +"&os="+QUrl::toPercentEncoding(parentcategory)
-            +"&image="+QUrl::toPercentEncoding(osname)
-            +"&imagerVersion=" IMAGER_VERSION_STR
-            +"&imagerOsType="+(embedded ? "embedded" : QUrl::toPercentEncoding(QSysInfo::productType()))
-            +"&imagerOsVersion="+QUrl::toPercentEncoding(QSysInfo::productVersion())
-            +"&imagerOsArch="+QUrl::toPercentEncoding(QSysInfo::currentCpuArchitecture())
-            +"&imagerLocale="+QUrl::toPercentEncoding(embedded ? imagerLang : locale.name());
 #ifdef Q_OS_LINUX
     QFile f("/proc/cpuinfo");
     f.open(f.ReadOnly);
@@ -36,36 +29,150 @@ DownloadStatsTelemetry::DownloadStatsTelemetry(const QByteArray &url, const QByt
         QRegularExpressionMatch m = rx.match(cpuinfo);
         if (m.hasMatch())
         {
-            _postfields += "&imagerPiRevision="+QUrl::toPercentEncoding(m.captured(1));
+            _piRevision = QUrl::toPercentEncoding(m.captured(1));
         }
     }
 #endif
 
     _useragent = "Mozilla/5.0 gem-imager/" IMAGER_VERSION_STR;
+
+    /* Left over from when we were offline last time */
+    QSettings settings;
+    _queue = settings.value("telemetry/queue").toStringList();
 }
 
-void DownloadStatsTelemetry::run()
+DownloadStatsTelemetry::~DownloadStatsTelemetry()
+{
+    stop();
+}
+
+void DownloadStatsTelemetry::add(const QByteArray &url, const QByteArray &parentcategory, const QByteArray &osname, bool embedded, const QString &imagerLang)
 {
     QSettings settings;
     if (!settings.value("telemetry", TELEMETRY_ENABLED_DEFAULT).toBool())
         return;
 
-    _c = curl_easy_init();
+    QLocale locale;
+    QByteArray postfields = "url="+QUrl::toPercentEncoding(url)
+            +"&os="+QUrl::toPercentEncoding(parentcategory)
+            +"&image="+QUrl::toPercentEncoding(osname)
+            +"&imagerVersion=" IMAGER_VERSION_STR
+            +"&imagerOsType="+(embedded ? "embedded" : QUrl::toPercentEncoding(QSysInfo::productType()))
+            +"&imagerOsVersion="+QUrl::toPercentEncoding(QSysInfo::productVersion())
+            +"&imagerOsArch="+QUrl::toPercentEncoding(QSysInfo::currentCpuArchitecture())
+            +"&imagerLocale="+QUrl::toPercentEncoding(embedded ? imagerLang : locale.name());
+    if (!_piRevision.isEmpty())
+        postfields += "&imagerPiRevision="+_piRevision;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queue.append(QString::fromLatin1(postfields));
+    while (_queue.size() > IMAGEWRITER_TELEMETRY_MAX_QUEUED)
+        _queue.removeFirst();
+    _saveQueue();
+    _cv.notify_all();
+}
+
+void DownloadStatsTelemetry::stop()
+{
+    if (!isRunning())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _cv.notify_all();
+    }
+    wait();
+}
+
+void DownloadStatsTelemetry::_saveQueue()
+{
+    QSettings settings;
+    if (_queue.isEmpty())
+        settings.remove("telemetry/queue");
+    else
+        settings.setValue("telemetry/queue", _queue);
+}
+
+void DownloadStatsTelemetry::run()
+{
+    using namespace std::chrono;
+    steady_clock::time_point idleSince = steady_clock::now(), retryAt;
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (!_stopping)
+    {
+        if (_queue.isEmpty())
+        {
+            /* Events are added as a download starts */
+            _cv.wait(lock);
+            idleSince = steady_clock::now();
+            continue;
+        }
+        if (CurlShare::bulkTransfers())
+            idleSince = steady_clock::now();
+
+        /* Downloads are not announced, so look every second */
+        steady_clock::time_point sendAt = qMax(idleSince + milliseconds(IMAGEWRITER_TELEMETRY_IDLE_DELAY), retryAt);
+        if (steady_clock::now() < sendAt)
+        {
+            _cv.wait_for(lock, seconds(1));
+            continue;
+        }
+
+        _c = curl_easy_init();
+        bool ok = _c != nullptr;
+        while (ok && !_queue.isEmpty() && !_stopping)
+        {
+            QByteArray postfields = _queue.first().toLatin1();
+            lock.unlock();
+            ok = _send(postfields);
+            lock.lock();
+            if (ok)
+            {
+                _queue.removeFirst();
+                _saveQueue();
+            }
+        }
+        if (_c)
+            curl_easy_cleanup(_c);
+        _c = nullptr;
+
+        if (!ok)
+        {
+            /* Offline, or a download started */
+            if (CurlShare::bulkTransfers())
+                idleSince = steady_clock::now();
+            else
+                retryAt = steady_clock::now() + milliseconds(IMAGEWRITER_TELEMETRY_RETRY_INTERVAL);
+        }
+    }
+}
+
+bool DownloadStatsTelemetry::_send(const QByteArray &postfields)
+{
+    curl_easy_reset(_c);
     curl_easy_setopt(_c, CURLOPT_NOSIGNAL, 1);
     curl_easy_setopt(_c, CURLOPT_WRITEFUNCTION, &DownloadStatsTelemetry::_curl_write_callback);
     curl_easy_setopt(_c, CURLOPT_HEADERFUNCTION, &DownloadStatsTelemetry::_curl_header_callback);
+    curl_easy_setopt(_c, CURLOPT_XFERINFOFUNCTION, &DownloadStatsTelemetry::_curl_xferinfo_callback);
+    curl_easy_setopt(_c, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(_c, CURLOPT_NOPROGRESS, 0);
     curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
-    curl_easy_setopt(_c, CURLOPT_POSTFIELDSIZE, _postfields.length());
-    curl_easy_setopt(_c, CURLOPT_POSTFIELDS, _postfields.constData());
+    curl_easy_setopt(_c, CURLOPT_POSTFIELDSIZE, postfields.length());
+    curl_easy_setopt(_c, CURLOPT_POSTFIELDS, postfields.constData());
     curl_easy_setopt(_c, CURLOPT_USERAGENT, _useragent.constData());
     curl_easy_setopt(_c, CURLOPT_CONNECTTIMEOUT, 10);
     curl_easy_setopt(_c, CURLOPT_LOW_SPEED_TIME, 10);
     curl_easy_setopt(_c, CURLOPT_LOW_SPEED_LIMIT, 10);
+    CurlShare::apply(_c);
 
     CURLcode ret = curl_easy_perform(_c);
-    curl_easy_cleanup(_c);
 
-    qDebug() << "Telemetry done. cURL status code =" << ret << "info sent =" << _postfields;
+    qDebug() << "Telemetry done. cURL status code =" << ret << "info sent =" << postfields;
+
+    /* Any answer of the server counts. Only network errors keep the event queued */
+    return ret == CURLE_OK;
 }
 
 /* /dev/null write handler */
@@ -81,3 +188,10 @@ size_t DownloadStatsTelemetry::_curl_header_callback( void *ptr, size_t size, si
     //qDebug() << "Received telemetry header:" << headerstr;
     return len;
 }
+
+/* Gives way to image downloads, and to quitting */
+int DownloadStatsTelemetry::_curl_xferinfo_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    DownloadStatsTelemetry *t = (DownloadStatsTelemetry *) userdata;
+    return (t->_stopping || CurlShare::bulkTransfers()) ? 1 : 0;
+}
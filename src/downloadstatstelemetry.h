@@ -8,20 +8,47 @@
 
 #include <QObject>
 #include <QThread>
+#include <QStringList>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <curl/curl.h>
 
+/*
+ * Queue of download statistics, sent from a single background thread
+ *
+ * Events are kept in the settings until they are sent, so they survive
+ * being offline and restarts. Sending only starts once no image has been
+ * downloading for IMAGEWRITER_TELEMETRY_IDLE_DELAY ms, and is aborted
+ * when a download starts, so it never competes with one. Everything that
+ * is queued goes out over the same connection.
+ */
 class DownloadStatsTelemetry : public QThread
 {
     Q_OBJECT
 public:
-    explicit DownloadStatsTelemetry(const QByteArray &url, const QByteArray &parentcategory, const QByteArray &osname, bool embedded, const QString &imagerLang, QObject *parent = nullptr);
+    explicit DownloadStatsTelemetry(QObject *parent = nullptr);
+    virtual ~DownloadStatsTelemetry();
+
+    /* Queue the download of url. Does nothing if telemetry is disabled */
+    void add(const QByteArray &url, const QByteArray &parentcategory, const QByteArray &osname, bool embedded, const QString &imagerLang);
+    /* Stop the thread. What is not sent yet stays queued for the next run */
+    void stop();
 
 protected:
     CURL *_c;
-    QByteArray _url, _useragent, _postfields;
+    QByteArray _url, _useragent, _piRevision;
+    QStringList _queue;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::atomic<bool> _stopping;
+
     virtual void run();
+    bool _send(const QByteArray &postfields);
+    void _saveQueue();
     static size_t _curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
     static size_t _curl_header_callback( void *ptr, size_t size, size_t nmemb, void *userdata);
+    static int _curl_xferinfo_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
 
 signals:
 
@@ -5,8 +5,19 @@
 
 #include "downloadthread.h"
 #include "config.h"
+#include "curlshare.h"
 #include "devicewrapper.h"
+#include "devicewrappermemory.h"
+#include "devicewrappermapped.h"
+#include "fanouttargetthread.h"
+#include "metrics.h"
+#include "peercache.h"
+#include "pipelinetrace.h"
 #include "devicewrapperfatpartition.h"
+#include "encodingselector.h"
+#include "ringbuffer.h"
+#include "sparseimage.h"
+#include "threadplacement.h"
 #include "dependencies/mountutils/src/mountutils.hpp"
 #include "dependencies/drivelist/src/drivelist.hpp"
 #include <fstream>
@@ -18,27 +29,70 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <regex>
+#include <limits>
+#include <memory>
+#include <algorithm>
 #include <QDebug>
+#include <QDir>
+#include <QFileInfo>
 #include <QProcess>
+#include <QRandomGenerator>
 #include <QSettings>
+#include <QtMath>
 #include <QtConcurrent/QtConcurrent>
+#include <QThreadPool>
 #include <QtNetwork/QNetworkProxy>
 
 #ifdef Q_OS_LINUX
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <linux/fs.h>
 #include "linux/udisks2api.h"
+#include "linux/iouring.h"
+#endif
+
+#ifdef Q_OS_WIN
+#include <winioctl.h>
+#endif
+
+#ifdef Q_OS_DARWIN
+#include <sys/ioctl.h>
+#include <sys/disk.h>
 #endif
 
 using namespace std;
 
 QByteArray DownloadThread::_proxy;
+DownloadTransport DownloadThread::_transport;
 int DownloadThread::_curlCount = 0;
 
+class _verifyThreadClass : public QThread {
+public:
+    _verifyThreadClass(DownloadThread *parent)
+        : QThread(parent), _dt(parent)
+    {
+    }
+
+    virtual void run()
+    {
+        ThreadPlacement::apply(ThreadPlacement::StageVerify);
+        _dt->_overlappedVerifyRun();
+    }
+
+protected:
+    DownloadThread *_dt;
+};
+
 DownloadThread::DownloadThread(const QByteArray &url, const QByteArray &localfilename, const QByteArray &expectedHash, bool isNormalFile, QObject *parent) :
-    QThread(parent), _startOffset(0), _lastDlTotal(0), _lastDlNow(0), _verifyTotal(0), _lastVerifyNow(0), _bytesWritten(0), _lastFailureOffset(0), _sectorsStart(-1), _url(url), _filename(localfilename), _expectedHash(expectedHash),
-    _firstBlock(nullptr), _cancelled(false), _successful(false), _verifyEnabled(false), _cacheEnabled(false), _lastModified(0), _serverTime(0),  _lastFailureTime(0),
-    _inputBufferSize(0), _file(NULL), _writehash(OSLIST_HASH_ALGORITHM), _verifyhash(OSLIST_HASH_ALGORITHM), _isNormalFile(isNormalFile)
+    QThread(parent), _startOffset(0), _lastDlTotal(0), _lastDlNow(0), _verifyTotal(0), _lastVerifyNow(0), _bytesWritten(0), _bytesSkipped(0), _lastFailureOffset(0), _sectorsStart(-1), _url(url), _filename(localfilename), _expectedHash(expectedHash),
+    _firstBlock(nullptr), _cancelled(false), _successful(false), _verifyEnabled(false), _cacheEnabled(false), _asyncEject(false), _contentEncoded(false), _decodedNow(0), _encodedNow(0), _encodingSaved(0), _lastModified(0), _serverTime(0),  _lastFailureTime(0),
+    _inputBufferSize(0), _downloadSegments(IMAGEWRITER_DOWNLOAD_SEGMENTS), _acceptRanges(false), _peerCache(false), _mirrorIndex(0), _mirrorFailovers(0), _multiSource(false), _isNormalFile(isNormalFile), _directIO(false), _ioUringEnabled(true), _sparseWrite(false), _discardZeroes(false), _chunkedVerify(false), _hasVerifiedInput(false), _hasVerifiedChunks(false), _mismatchOffset(0), _mismatchLength(0), _directIOAlignment(512), _optimalIOSize(0), _eraseSize(0), _zeroOut(false), _capacityProbe(false),
+    _inStreamCustomization(false), _customizedInStream(false), _customizationMismatch(false), _capture(nullptr), _captured(nullptr), _captureStart(0), _captureEnd(0), _expandRoot(false),
+    _streamingOutput(false), _streamableBytes(0), _streamHold(0), _outputStream(nullptr), _outputStreamPos(0), _fsMapEnabled(false), _discarded(false),
+    _overlappedVerify(false), _overlappedVerifyStarted(false), _overlappedVerifyStop(false), _overlappedVerifyError(false), _syncedUpTo(0), _overlappedVerifyNow(0), _lastCheckpoint(0), _writebackPos(0), _writebackDone(0), _file(NULL), _writehash(OSLIST_HASH_ALGORITHM), _verifyhash(OSLIST_HASH_ALGORITHM), _usedHash(OSLIST_HASH_ALGORITHM),
+    _cacheWritten(0), _journalWritten(0), _replayingCache(false), _discardPartialCache(false), _prefetched(false), _replayedAll(false), _resumeHeaders(nullptr), _notModified(false), _conditionalHeaders(nullptr), _extractedCacheEnabled(false),
+    _chunkhash(IMAGEWRITER_HASH_CHUNKSIZE), _currentPhase(-1), _nextProgressPublish(0), _progressPending(false),
+    _progressPhase(-1), _progressPhaseStartBytes(0), _progressPhaseStartFraction(0), _progressPhaseStartTime(0), _progressListener(nullptr)
 {
     if (!_curlCount)
         curl_global_init(CURL_GLOBAL_DEFAULT);
@@ -47,20 +101,49 @@ DownloadThread::DownloadThread(const QByteArray &url, const QByteArray &localfil
     QSettings settings;
     _ejectEnabled = settings.value("eject", true).toBool();
     _suppressSuccessSignal = false;
+    _verifyThread = new _verifyThreadClass(this);
+    _progressClock.start();
+    _budget = MemoryBudget::defaults();
+    _fanoutPool = nullptr;
+    _device = nullptr;
+    _copySourceFd = -1;
+    _copySourceOffset = 0;
+    _kernelCopy = true;
+    _imageCloned = false;
+    _imageReflinked = false;
+    _deltaWrite = false;
+    _resumeEnabled = true;
+    _writeJournalEnabled = false;
+    _resumeOffset = 0;
+    _deltaBuf = nullptr;
+    _deltaBufSize = 0;
+    _bytesUnchanged = 0;
 }
 
 DownloadThread::~DownloadThread()
 {
     _cancelled = true;
     wait();
+    _endCacheTransfer(false);
+    _stopOverlappedVerify();
+    delete _device;
     if (_file.isOpen())
         _file.close();
 
+    delete _capture;
+    delete _captured;
     if (_firstBlock)
         qFreeAligned(_firstBlock);
+    if (_deltaBuf)
+        qFreeAligned(_deltaBuf);
+    if (_fanoutPool)
+        _fanoutPool->release();
 
     if (!--_curlCount)
+    {
+        CurlShare::cleanup();
         curl_global_cleanup();
+    }
 }
 
 void DownloadThread::setProxy(const QByteArray &proxy)
@@ -73,6 +156,33 @@ QByteArray DownloadThread::proxy()
     return _proxy;
 }
 
+void DownloadThread::setTransport(const DownloadTransport &transport)
+{
+    _transport = transport;
+}
+
+DownloadTransport DownloadThread::transport()
+{
+    return _transport;
+}
+
+bool DownloadThread::isImageFile(const QByteArray &filename)
+{
+    if (filename.isEmpty() || filename == "uniflash")
+        return false;
+
+#ifdef Q_OS_WIN
+    if (filename.startsWith("\\\\.\\"))
+        return false;
+#else
+    if (filename.startsWith("/dev/"))
+        return false;
+#endif
+
+    QFileInfo fi(QString::fromLocal8Bit(filename));
+    return !fi.exists() || fi.isFile();
+}
+
 void DownloadThread::setUserAgent(const QByteArray &ua)
 {
     _useragent = ua;
@@ -81,7 +191,13 @@ void DownloadThread::setUserAgent(const QByteArray &ua)
 /* Curl write callback function, let it call the object oriented version */
 size_t DownloadThread::_curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-    return static_cast<DownloadThread *>(userdata)->_writeData(ptr, size * nmemb);
+    TraceSpan span("curlWrite");
+    DownloadThread *t = static_cast<DownloadThread *>(userdata);
+    t->_bandwidth.acquire(size * nmemb);
+    size_t written = t->_writeData(ptr, size * nmemb);
+    /* Content decoded by libcurl. Its own counters are of what came over the wire */
+    t->_decodedNow += written;
+    return written;
 }
 
 int DownloadThread::_curl_xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
@@ -98,6 +214,51 @@ size_t DownloadThread::_curl_header_callback( void *ptr, size_t size, size_t nme
     return len;
 }
 
+/* Data of a range request goes into the cache file at its offset */
+size_t DownloadThread::_curl_segment_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    TraceSpan span("curlWrite");
+    DownloadSegment *seg = static_cast<DownloadSegment *>(userdata);
+    DownloadThread *t = seg->thread;
+    size_t len = size * nmemb;
+    long code = 0;
+
+    if (t->_cancelled)
+        return 0;
+    t->_bandwidth.acquire(len);
+
+    /* Server has to send exactly the range asked for */
+    curl_easy_getinfo(seg->c, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 206 || seg->pos+len > seg->end)
+    {
+        seg->rangeError = true;
+        return 0;
+    }
+
+    if (!t->_cachefile.seek(seg->pos) || t->_cachefile.write(ptr, len) != (qint64) len)
+        return 0;
+    seg->pos += len;
+    t->_lastDlNow += len;
+    t->_publishProgress();
+
+    return len;
+}
+
+/* Called while a range request waits for data too, so a stalled connection still notices
+   cancelling. The write callback keeps the progress counters, as only it knows the offsets */
+int DownloadThread::_curl_segment_xferinfo_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    DownloadThread *t = static_cast<DownloadSegment *>(userdata)->thread;
+    t->_publishProgress();
+    return t->_cancelled;
+}
+
+/* Headers of range requests are not of interest, those of the whole file were checked before */
+size_t DownloadThread::_curl_segment_header_callback(void *, size_t size, size_t nmemb, void *)
+{
+    return size * nmemb;
+}
+
 QByteArray DownloadThread::_fileGetContentsTrimmed(const QString &filename)
 {
     QByteArray result;
@@ -114,6 +275,10 @@ QByteArray DownloadThread::_fileGetContentsTrimmed(const QString &filename)
 
 bool DownloadThread::_openAndPrepareDevice()
 {
+    /* Targets open their devices themselves */
+    if (!_fanoutTargets.isEmpty())
+        return true;
+
     if (_filename != "uniflash" && !_isNormalFile)
     {
         emit preparationStatusUpdate(tr("unmounting drive"));
@@ -139,6 +304,12 @@ bool DownloadThread::_openAndPrepareDevice()
     emit preparationStatusUpdate(tr("opening drive"));
 
     _file.setFileName(_filename);
+#ifdef Q_OS_WIN
+    /* FILE_FLAG_NO_BUFFERING can only be set when opening the handle */
+    _file.setUnbuffered(_directIO && !_isNormalFile);
+    /* So is FILE_FLAG_OVERLAPPED, for keeping several unbuffered writes in flight */
+    _file.setOverlapped(_ioUringEnabled && _directIO && !_isNormalFile);
+#endif
 
 #ifdef Q_OS_WIN
     qDebug() << "device" << _filename;
@@ -149,59 +320,43 @@ bool DownloadThread::_openAndPrepareDevice()
     if (std::regex_match(_filename.constData(), m, windriveregex))
     {
         _nr = QByteArray::fromStdString(m[1]);
-
-        if (!_nr.isEmpty()) {
-            qDebug() << "Removing partition table from Windows drive #" << _nr << "(" << _filename << ")";
-
-            QProcess proc;
-            proc.start("diskpart", QStringList());
-            proc.waitForStarted();
-            proc.write("select disk "+_nr+"\r\n"
-                            "clean\r\n"
-                            "rescan\r\n");
-            proc.closeWriteChannel();
-            proc.waitForFinished();
-
-            if (proc.exitCode())
-            {
-                emit error(tr("Error running diskpart: %1").arg(QString(proc.readAllStandardError())));
-                return false;
-            }
-        }
     }
 
+    /* Lock and dismount every volume of the drive. Nothing can write to them behind
+       our back then, and the partition table can be removed once the drive is open */
     auto l = Drivelist::ListStorageDevices();
     QByteArray devlower = _filename.toLower();
-    QByteArray driveLetter;
     for (auto i : l)
     {
-        if (QByteArray::fromStdString(i.device).toLower() == devlower)
+        if (QByteArray::fromStdString(i.device).toLower() != devlower)
+            continue;
+
+        if (i.mountpoints.empty())
+            qDebug() << "Device has no volumes. Nothing to lock.";
+
+        for (auto &mountpoint : i.mountpoints)
         {
-            if (i.mountpoints.size() == 1)
-            {
-                driveLetter = QByteArray::fromStdString(i.mountpoints.front());
-                if (driveLetter.endsWith("\\"))
-                    driveLetter.chop(1);
-            }
-            else if (i.mountpoints.size() > 1)
+            QByteArray driveLetter = QByteArray::fromStdString(mountpoint);
+            if (driveLetter.endsWith("\\"))
+                driveLetter.chop(1);
+
+            /* Writing underneath a volume that is still mounted would corrupt it */
+            WinFile *volume = new WinFile;
+            volume->setFileName("\\\\.\\"+driveLetter);
+            _volumeFiles.append(volume);
+            DWORD bytesReturned;
+            if (!volume->open(QIODevice::ReadWrite) || !volume->lockVolume()
+                    || !volume->ioControl(FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &bytesReturned))
             {
+                qDebug() << "Error locking or dismounting volume" << driveLetter << ":" << volume->errorString();
+                _closeVolumes();
                 emit error(tr("Error removing existing partitions"));
                 return false;
             }
-            else
-            {
-                qDebug() << "Device no longer has any volumes. Nothing to lock.";
-            }
+            qDebug() << "Dismounted volume" << driveLetter;
         }
     }
 
-    if (!driveLetter.isEmpty())
-    {
-        _volumeFile.setFileName("\\\\.\\"+driveLetter);
-        if (_volumeFile.open(QIODevice::ReadWrite))
-            _volumeFile.lockVolume();
-    }
-
 #endif
 
 #ifdef Q_OS_DARWIN
@@ -244,6 +399,49 @@ bool DownloadThread::_openAndPrepareDevice()
     }
 #endif
 
+    _zeroOut = _blockDevice()->capabilities() & BlockDevice::CanZeroOut;
+    if (_zeroOut)
+        qDebug() << "Device can zero out ranges itself. Zero runs in the image are handed to it";
+
+#ifndef Q_OS_WIN
+    if (_isNormalFile && !_deltaWrite && !_streamingOutput)
+    {
+        /* Starts out as a single hole, so zero blocks are skipped and the file ends up sparse */
+        if (::ftruncate(_file.handle(), 0) == 0)
+            _discardZeroes = true;
+        else
+            qDebug() << "Cannot truncate image file" << _filename << "- writing zeroes as well";
+    }
+#endif
+
+    _openWriteJournal();
+
+    /* Before anything else is written to it, so it can still be used for something else if it fails */
+    if (_capacityProbe && _filename != "uniflash" && !_isNormalFile && !_probeCapacity())
+        return false;
+
+#ifdef Q_OS_WIN
+    if (_filename != "uniflash" && !_isNormalFile)
+    {
+        STORAGE_PROPERTY_QUERY query = {};
+        STORAGE_ACCESS_ALIGNMENT_DESCRIPTOR alignment = {};
+        DWORD bytesReturned = 0;
+
+        query.PropertyId = StorageAccessAlignmentProperty;
+        query.QueryType = PropertyStandardQuery;
+        if (_file.ioControl(IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query),
+                            &alignment, sizeof(alignment), &bytesReturned)
+            && bytesReturned >= sizeof(alignment))
+        {
+            _optimalIOSize = alignment.BytesPerPhysicalSector;
+            qDebug() << "Device physical sector size:" << _optimalIOSize;
+        }
+    }
+
+    if (!_nr.isEmpty() && !_prepareWindowsDrive())
+        return false;
+#endif
+
 #ifdef Q_OS_LINUX
     /* Optional optimizations for Linux */
 
@@ -259,76 +457,45 @@ bool DownloadThread::_openAndPrepareDevice()
         if (!csd.isEmpty())
             qDebug() << "SD card CSD:" << csd;
 
-        QByteArray discardmax = _fileGetContentsTrimmed("/sys/block/"+devname+"/queue/discard_max_bytes");
+        _optimalIOSize = _fileGetContentsTrimmed("/sys/block/"+devname+"/queue/optimal_io_size").toULongLong();
+        if (_optimalIOSize)
+            qDebug() << "Device optimal I/O size:" << _optimalIOSize;
 
-        if (discardmax.isEmpty() || discardmax == "0")
-        {
-            qDebug() << "BLKDISCARD not supported";
-        }
-        else
-        {
-            /* DISCARD/TRIM the SD card */
-            uint64_t devsize, range[2];
-            int fd = _file.handle();
+        /* Only the mmc driver knows the allocation unit. Card readers on USB do not pass it on */
+        _eraseSize = _fileGetContentsTrimmed("/sys/block/"+devname+"/device/preferred_erase_size").toULongLong();
+        if (_eraseSize)
+            qDebug() << "Preferred erase size:" << _eraseSize;
 
-            if (::ioctl(fd, BLKGETSIZE64, &devsize) == -1) {
-                qDebug() << "Error getting device/sector size with BLKGETSIZE64 ioctl():" << strerror(errno);
-            }
-            else
-            {
-                qDebug() << "Try to perform TRIM/DISCARD on device";
-                range[0] = 0;
-                range[1] = devsize;
-                emit preparationStatusUpdate(tr("discarding existing data on drive"));
-                _timer.start();
-                if (::ioctl(fd, BLKDISCARD, &range) == -1)
-                {
-                    qDebug() << "BLKDISCARD failed.";
-                }
-                else
-                {
-                    qDebug() << "BLKDISCARD successful. Discarding took" << _timer.elapsed() / 1000 << "seconds";
-                }
-            }
-        }
+        QByteArray discardGranularity = _fileGetContentsTrimmed("/sys/block/"+devname+"/queue/discard_granularity");
+        if (!discardGranularity.isEmpty())
+            qDebug() << "Discard granularity:" << discardGranularity;
+
+        _queueTuning.apply(_filename);
+
+        if (_deltaWrite)
+            qDebug() << "Delta write. Keeping the contents of the drive";
+        else
+            _discardDrive();
     }
 #endif
 
 #ifndef Q_OS_WIN
-    if (_filename != "uniflash" && !_isNormalFile)
-    {
-        // Zero out MBR
-        qint64 knownsize = _file.size();
-        QByteArray emptyMB(1024*1024, 0);
-
-        emit preparationStatusUpdate(tr("zeroing out first and last MB of drive"));
-        qDebug() << "Zeroing out first and last MB of drive";
-        _timer.start();
+    if (_filename != "uniflash" && !_isNormalFile && !_zeroDriveEnds())
+        return false;
+#endif
 
-        if (!_file.write(emptyMB.data(), emptyMB.size()) || !_file.flush())
+    if (_directIO)
+    {
+        if (_filename == "uniflash" || _isNormalFile || !_setDirectIO(true))
         {
-            emit error(tr("Write error while zero'ing out MBR"));
-            return false;
+            qDebug() << "Direct I/O not available for" << _filename << "- using buffered I/O";
+            _directIO = false;
         }
-
-        // Zero out last part of card (may have GPT backup table)
-        if (knownsize > emptyMB.size())
+        else
         {
-            if (!_file.seek(knownsize-emptyMB.size())
-                || !_file.write(emptyMB.data(), emptyMB.size())
-                || !_file.flush()
-                || ::fsync(_file.handle()))
-            {
-                emit error(tr("Write error while trying to zero out last part of card.<br>"
-                              "Card could be advertising wrong capacity (possible counterfeit)."));
-                return false;
-            }
+            qDebug() << "Using direct I/O. Alignment:" << _directIOAlignment;
         }
-        emptyMB.clear();
-        qDebug() << "Done zeroing out start and end of drive. Took" << _timer.elapsed() / 1000 << "seconds";
     }
-    _file.seek(0);
-#endif
 
 #ifdef Q_OS_LINUX
     _sectorsStart = _sectorsWritten();
@@ -337,528 +504,3654 @@ bool DownloadThread::_openAndPrepareDevice()
     return true;
 }
 
-void DownloadThread::run()
+#ifdef Q_OS_WIN
+/*
+ * What diskpart "clean" did, with I/O controls on the open drive: removes the
+ * partition table, TRIMs the drive where supported and zeroes the first and
+ * last MB, where a GPT and its backup may be
+ */
+bool DownloadThread::_prepareWindowsDrive()
 {
-    if (isImage() && !_openAndPrepareDevice())
-    {
-        return;
-    }
-
-    qDebug() << "Image URL:" << _url;
-    if (_url.startsWith("file://") && _url.at(7) != '/')
+    DWORD bytesReturned = 0;
+
+    qDebug() << "Removing partition table from Windows drive #" << _nr << "(" << _filename << ")";
+    emit preparationStatusUpdate(tr("removing existing partitions"));
+    /* Not _timer, the download runs meanwhile */
+    QElapsedTimer t;
+    t.start();
+    if (!_file.ioControl(IOCTL_DISK_DELETE_DRIVE_LAYOUT, NULL, 0, NULL, 0, &bytesReturned))
     {
-        /* libcurl does not like UNC paths in the form of file://1.2.3.4/share */
-        _url.replace("file://", "file:////");
-        qDebug() << "Corrected UNC URL to:" << _url;
+        emit error(tr("Error removing existing partitions: %1").arg(_file.errorString()));
+        return false;
     }
 
-    char errorBuf[CURL_ERROR_SIZE] = {0};
-    _c = curl_easy_init();
-    curl_easy_setopt(_c, CURLOPT_NOSIGNAL, 1);
-    curl_easy_setopt(_c, CURLOPT_WRITEFUNCTION, &DownloadThread::_curl_write_callback);
-    curl_easy_setopt(_c, CURLOPT_WRITEDATA, this);
-    curl_easy_setopt(_c, CURLOPT_XFERINFOFUNCTION, &DownloadThread::_curl_xferinfo_callback);
-    curl_easy_setopt(_c, CURLOPT_PROGRESSDATA, this);
-    curl_easy_setopt(_c, CURLOPT_NOPROGRESS, 0);
-    curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
-    curl_easy_setopt(_c, CURLOPT_FOLLOWLOCATION, 1);
-    curl_easy_setopt(_c, CURLOPT_MAXREDIRS, 10);
-    curl_easy_setopt(_c, CURLOPT_ERRORBUFFER, errorBuf);
-    curl_easy_setopt(_c, CURLOPT_FAILONERROR, 1);
-    curl_easy_setopt(_c, CURLOPT_HEADERFUNCTION, &DownloadThread::_curl_header_callback);
-    curl_easy_setopt(_c, CURLOPT_HEADERDATA, this);
-    curl_easy_setopt(_c, CURLOPT_CONNECTTIMEOUT, 30);
-    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_TIME, 60);
-    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_LIMIT, 100);
-    if (_inputBufferSize)
-        curl_easy_setopt(_c, CURLOPT_BUFFERSIZE, _inputBufferSize);
-
-    if (!_useragent.isEmpty())
-        curl_easy_setopt(_c, CURLOPT_USERAGENT, _useragent.constData());
-
-    if (_proxy.isEmpty())
-    {
-#ifndef QT_NO_NETWORKPROXY
-        /* Ask OS for proxy information. */
-        QNetworkProxyQuery npq{QUrl{_url}};
-        QList<QNetworkProxy> proxyList = QNetworkProxyFactory::systemProxyForQuery(npq);
-        if (!proxyList.isEmpty())
-        {
-            QNetworkProxy proxy = proxyList.first();
-            if (proxy.type() != proxy.NoProxy)
-            {
-                QUrl proxyUrl;
+    _discardDrive();
+    if (!_zeroDriveEnds())
+        return false;
 
-                proxyUrl.setScheme(proxy.type() == proxy.Socks5Proxy ? "socks5h" : "http");
-                proxyUrl.setHost(proxy.hostName());
-                proxyUrl.setPort(proxy.port());
-                qDebug() << "Using proxy server:" << proxyUrl;
+    /* Let the partition manager know the drive is empty now */
+    _file.ioControl(IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &bytesReturned);
+    qDebug() << "Done removing partitions. Took" << t.elapsed() / 1000 << "seconds";
 
-                if (!proxy.user().isEmpty())
-                {
-                    proxyUrl.setUserName(proxy.user());
-                    proxyUrl.setPassword(proxy.password());
-                }
+    return true;
+}
 
-                _proxy = proxyUrl.toEncoded();
-            }
-        }
+void DownloadThread::_closeVolumes()
+{
+    qDeleteAll(_volumeFiles);
+    _volumeFiles.clear();
+}
 #endif
-    }
-
-    if (!_proxy.isEmpty())
-        curl_easy_setopt(_c, CURLOPT_PROXY, _proxy.constData());
 
-    emit preparationStatusUpdate(tr("starting download"));
-    _timer.start();
-    CURLcode ret = curl_easy_perform(_c);
+bool DownloadThread::_waitForDevice()
+{
+    if (!_devicePrepared.isValid())
+        return true;
 
-    /* Deal with badly configured HTTP servers that terminate the connection quickly
-       if connections stalls for some seconds while kernel commits buffers to slow SD card.
-       And also reconnect if we detect from our end that transfer stalled for more than one minute */
-    while (ret == CURLE_PARTIAL_FILE || ret == CURLE_OPERATION_TIMEDOUT
-           || (ret == CURLE_HTTP2_STREAM && _lastDlNow != _lastFailureOffset)
-           || (ret == CURLE_RECV_ERROR && _lastDlNow != _lastFailureOffset) )
+    if (!_devicePrepared.isFinished())
     {
-        time_t t = time(NULL);
-        qDebug() << "HTTP connection lost. Time:" << t;
-
-        /* If last failure happened less than 5 seconds ago, something else may
-           be wrong. Sleep some time to prevent hammering server */
-        if (t - _lastFailureTime < 5)
-        {
-            qDebug() << "Sleeping 5 seconds";
-            ::sleep(5);
-        }
-        _lastFailureTime = t;
+        TraceSpan span("waitForDevice");
+        qDebug() << "Waiting for the device to be prepared";
+        _devicePrepared.waitForFinished();
+    }
+    return _devicePrepared.result();
+}
 
-        _startOffset = _lastDlNow;
-        _lastFailureOffset = _lastDlNow;
-        curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, _startOffset);
+/* Created on first use, by then whichever subclass opens _file has done so */
+BlockDevice *DownloadThread::_blockDevice()
+{
+    if (!_device)
+        _device = BlockDevice::create(&_file);
+    return _device;
+}
 
-        ret = curl_easy_perform(_c);
-    }
+DeviceWrapper *DownloadThread::_newDeviceWrapper()
+{
+    if (_isNormalFile)
+        return new DeviceWrapperMapped(&_file, _blockDevice());
 
-    curl_easy_cleanup(_c);
+    return new DeviceWrapper(_blockDevice());
+}
 
-    switch (ret)
+/* Discards all of the drive. To find out if a sparse write can skip writing zeroes later on,
+   a test pattern is written in the middle of the drive first, and checked to read back as
+   zeroes after the discard. The device may not tell, Linux' discard_zeroes_data always says 0.
+   Unless the block reads back as zeroes, what it held before is put back */
+void DownloadThread::_discardDrive()
+{
+    if (_resumeOffset)
     {
-        case CURLE_OK:
-            _successful = true;
-            qDebug() << "Download done in" << _timer.elapsed() / 1000 << "seconds";
-            _onDownloadSuccess();
-            break;
-        case CURLE_WRITE_ERROR:
-            deleteDownloadedFile();
-            _onWriteError();
-            break;
-        case CURLE_ABORTED_BY_CALLBACK:
-            deleteDownloadedFile();
-            break;
-        default:
-            deleteDownloadedFile();
-            QString errorMsg;
-
-            if (!errorBuf[0])
-                /* No detailed error message text provided, use standard text for libcurl result code */
-                errorMsg += curl_easy_strerror(ret);
-            else
-                errorMsg += errorBuf;
+        qDebug() << "Resuming interrupted write. Keeping the contents of the drive";
+        return;
+    }
 
-            char *ipstr;
-            if (curl_easy_getinfo(_c, CURLINFO_PRIMARY_IP, &ipstr) == CURLE_OK && ipstr && ipstr[0])
-                errorMsg += QString(" - Server IP: ")+ipstr;
+    BlockDevice *device = _blockDevice();
+    quint64 devsize = device->size();
 
-            _onDownloadError(tr("Error downloading: %1").arg(errorMsg));
+    if (!(device->capabilities() & BlockDevice::CanDiscard) || !devsize)
+    {
+        qDebug() << "Discard not supported";
+        return;
     }
-}
-
-size_t DownloadThread::_writeData(const char *buf, size_t len)
-{
-    _writeCache(buf, len);
 
-    if (!_filename.isEmpty())
+    char *probeBuf = nullptr, *savedBuf = nullptr;
+    quint64 probeOffset = (devsize / 2) & ~4095ULL;
+    bool probe = _sparseWrite && devsize > 4*1024*1024;
+#ifdef Q_OS_WIN
+    /* Only unbuffered, a buffered read could come from the cache */
+    probe = probe && _file.isUnbuffered();
+#endif
+    if (probe)
     {
-        return _writeFile(buf, len);
+        probeBuf = (char *) qMallocAligned(4096, 4096);
+        savedBuf = (char *) qMallocAligned(4096, 4096);
+        probe = probeBuf && savedBuf && device->pread(savedBuf, 4096, probeOffset) == 4096;
     }
-    else
+    bool probeWritten = false;
+    if (probe)
     {
-        _buf.append(buf, len);
-        return len;
+        memset(probeBuf, 0xA5, 4096);
+        /* Even a failed write may have changed the block */
+        probeWritten = true;
+        probe = device->pwrite(probeBuf, 4096, probeOffset) == 4096 && device->flush();
     }
-}
-
-void DownloadThread::_writeCache(const char *buf, size_t len)
-{
-    if (!_cacheEnabled || _cancelled)
-        return;
 
-    if (_cachefile.write(buf, len) != len)
+    qDebug() << "Try to perform TRIM/DISCARD on device";
+    emit preparationStatusUpdate(tr("discarding existing data on drive"));
+    QElapsedTimer t;
+    t.start();
+    _startPhase(PhaseDiscard);
+    if (!device->discard(0, devsize))
     {
-        qDebug() << "Error writing to cache file. Disabling caching.";
-        _cacheEnabled = false;
-        _cachefile.remove();
+        qDebug() << "Discard failed:" << device->errorString();
+        _endPhase(PhaseDiscard, 0);
     }
+    else
+    {
+        qDebug() << "Discard successful. Discarding took" << t.elapsed() / 1000 << "seconds";
+        _endPhase(PhaseDiscard, devsize);
+        _discarded = true;
+
+        if (probe)
+        {
+#ifdef Q_OS_LINUX
+            posix_fadvise(_file.handle(), probeOffset, 4096, POSIX_FADV_DONTNEED);
+#endif
+            _discardZeroes = device->pread(probeBuf, 4096, probeOffset) == 4096 && _isZeroBlock(probeBuf, 4096);
+            qDebug() << "Discarded blocks read back as zeroes:" << _discardZeroes;
+        }
+    }
+
+    /* The test pattern must not stay on the drive */
+    if (probeWritten && !_discardZeroes
+            && (device->pwrite(savedBuf, 4096, probeOffset) != 4096 || !device->flush()))
+        qDebug() << "Error restoring the block the discard was tested on:" << device->errorString();
+
+    qFreeAligned(probeBuf);
+    qFreeAligned(savedBuf);
+}
+
+/* Counterfeit cards claim more capacity than they have. Writes beyond what they
+   have are dropped or wrap around onto the start, and that shows at verify, after
+   writing all of the image. Instead, write a block that names its own offset at
+   spread out offsets up to the last block first, read all of them back, and put
+   back what was there. Runs while the download gets going, and takes about a second.
+   Cards that wrap around ignore the high address lines, so they wrap at a power of
+   two. All offsets share their low order bits, like f3probe does, so every block
+   beyond where a card wraps lands on one that was written before it */
+bool DownloadThread::_probeCapacity()
+{
+    /* The blocks may hold what an interrupted write got to, and written over before they are put back */
+    if (_resumeOffset)
+        return true;
+
+    BlockDevice *device = _blockDevice();
+    const quint64 blockSize = 4096;
+    const quint64 minWrap = 1024*1024 / blockSize;
+    quint64 devBlocks = device->size() / blockSize;
+
+    if (devBlocks < 4*IMAGEWRITER_CAPACITY_PROBE_STRIDES)
+        return true;
+
+    /* Reads have to come from the device, not from what the cache kept of the writes */
+#ifdef Q_OS_WIN
+    bool uncached = _file.isUnbuffered();
+#else
+    bool uncached = _setDirectIO(true);
+#endif
+#ifndef Q_OS_LINUX
+    if (!uncached)
+    {
+        qDebug() << "Capacity probe needs uncached I/O. Skipping it";
+        return true;
+    }
+#endif
+
+    emit preparationStatusUpdate(tr("checking drive capacity"));
+    QElapsedTimer t;
+    t.start();
+
+    /* A random block in the first MB, that block plus each power of two from 1 MB up
+       to the stride, and plus each multiple of the stride, a power of two as well.
+       Wherever a card wraps, from 1 MB up, the blocks above it land on these. The
+       last block of the drive catches cards that drop writes beyond their capacity */
+    quint64 stride = qNextPowerOfTwo(devBlocks / IMAGEWRITER_CAPACITY_PROBE_STRIDES) / 2;
+    quint64 low = QRandomGenerator::global()->bounded(qMin(minWrap, stride));
+    QVector<quint64> offsets;
+    for (quint64 p = minWrap; p < stride; p *= 2)
+        offsets.append((low + p) * blockSize);
+    for (quint64 b = low; b < devBlocks; b += stride)
+        offsets.append(b * blockSize);
+    std::sort(offsets.begin(), offsets.end());
+    if (offsets.last() != (devBlocks-1) * blockSize)
+        offsets.append((devBlocks-1) * blockSize);
+
+    const quint64 count = offsets.size();
+    char *saved = (char *) qMallocAligned(count*blockSize, 4096);
+    char *probe = (char *) qMallocAligned(count*blockSize, 4096);
+    char *readBack = (char *) qMallocAligned(blockSize, 4096);
+    quint64 nonce = QRandomGenerator::global()->generate64();
+    quint64 badOffset = 0;
+    bool ioError = false, mismatch = false;
+
+    for (quint64 i = 0; i < count; i++)
+    {
+        quint64 *words = (quint64 *) (probe + i*blockSize);
+        quint64 x = nonce ^ offsets[i];
+        memcpy(words, "GEMPROBE", 8);
+        words[1] = nonce;
+        words[2] = offsets[i];
+        for (quint64 j = 3; j < blockSize/8; j++)
+        {
+            /* xorshift64 */
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            words[j] = x;
+        }
+    }
+
+    for (quint64 i = 0; i < count && !ioError; i++)
+    {
+        if (device->pread(saved + i*blockSize, blockSize, offsets[i]) != (qint64) blockSize)
+        {
+            ioError = true;
+            badOffset = offsets[i];
+        }
+    }
+    bool written = !ioError;
+    if (written)
+    {
+        /* Ascending, so a block that wraps around overwrites one that was written earlier */
+        for (quint64 i = 0; i < count && !ioError; i++)
+        {
+            if (device->pwrite(probe + i*blockSize, blockSize, offsets[i]) != (qint64) blockSize)
+            {
+                ioError = true;
+                badOffset = offsets[i];
+            }
+        }
+        ioError = ioError || !device->flush();
+    }
+    for (quint64 i = 0; i < count && !ioError && !mismatch; i++)
+    {
+#ifdef Q_OS_LINUX
+        if (!uncached)
+            posix_fadvise(_file.handle(), offsets[i], blockSize, POSIX_FADV_DONTNEED);
+#endif
+        if (device->pread(readBack, blockSize, offsets[i]) != (qint64) blockSize)
+        {
+            ioError = true;
+            badOffset = offsets[i];
+        }
+        else if (memcmp(readBack, probe + i*blockSize, blockSize))
+        {
+            mismatch = true;
+            badOffset = offsets[i];
+            if (!memcmp(readBack, "GEMPROBE", 8) && !memcmp(readBack+8, &nonce, 8))
+            {
+                quint64 aliased;
+                memcpy(&aliased, readBack+16, 8);
+                qDebug() << "Capacity probe: offset" << badOffset << "reads back the block written to" << aliased;
+            }
+            else
+            {
+                qDebug() << "Capacity probe: offset" << badOffset << "does not read back what was written to it";
+            }
+        }
+    }
+
+    /* In the same order, so blocks that wrap around end up as they were too */
+    if (written)
+    {
+        for (quint64 i = 0; i < count; i++)
+            device->pwrite(saved + i*blockSize, blockSize, offsets[i]);
+        device->flush();
+    }
+
+    qFreeAligned(readBack);
+    qFreeAligned(probe);
+    qFreeAligned(saved);
+#ifndef Q_OS_WIN
+    if (uncached)
+        _setDirectIO(false);
+#endif
+
+    if (ioError || mismatch)
+    {
+        qDebug() << "Capacity probe failed at offset" << badOffset << "of" << device->size() << device->errorString();
+        emit error(tr("The storage device does not keep data written at %1 GB of the %2 GB it reports.<br>"
+                      "It may be counterfeit, with less capacity than it claims, or broken.")
+                   .arg(badOffset / 1000000000.0, 0, 'f', 1).arg(device->size() / 1000000000.0, 0, 'f', 1));
+        return false;
+    }
+
+    qDebug() << "Capacity probe of" << count << "blocks passed. Took" << t.elapsed() << "ms";
+    return true;
+}
+
+/* Not needed if the discard left zeroes everywhere */
+bool DownloadThread::_zeroDriveEnds()
+{
+    /* The interrupted write zeroed them, and may have written past the first MB since */
+    if (_resumeOffset)
+        return true;
+
+    if (_discardZeroes)
+    {
+        qDebug() << "Discarded drive reads back as zeroes. No need to zero out first and last MB";
+        return true;
+    }
+
+    BlockDevice *device = _blockDevice();
+    quint64 devsize = device->size();
+    const qint64 zeroSize = 1024*1024;
+    char *buf = (char *) qMallocAligned(zeroSize, 4096);
+    if (!buf)
+        return false;
+    memset(buf, 0, zeroSize);
+
+    emit preparationStatusUpdate(tr("zeroing out first and last MB of drive"));
+    qDebug() << "Zeroing out first and last MB of drive";
+    QElapsedTimer t;
+    t.start();
+
+    if (device->pwrite(buf, zeroSize, 0) != zeroSize || !device->flush())
+    {
+        qDebug() << device->errorString();
+        qFreeAligned(buf);
+        emit error(tr("Write error while zero'ing out MBR"));
+        return false;
+    }
+
+    /* Last part of card may have GPT backup table */
+    if (devsize > (quint64) zeroSize
+            && (device->pwrite(buf, zeroSize, (devsize-zeroSize) & ~4095ULL) != zeroSize || !device->flush()))
+    {
+        qDebug() << device->errorString();
+        qFreeAligned(buf);
+        emit error(tr("Write error while trying to zero out last part of card.<br>"
+                      "Card could be advertising wrong capacity (possible counterfeit)."));
+        return false;
+    }
+
+    qFreeAligned(buf);
+    qDebug() << "Done zeroing out start and end of drive. Took" << t.elapsed() / 1000 << "seconds";
+
+    return true;
+}
+
+bool DownloadThread::_openDeviceReadOnly()
+{
+    emit preparationStatusUpdate(tr("opening drive"));
+    _file.setFileName(_filename);
+#ifdef Q_OS_WIN
+    _file.setUnbuffered(_directIO);
+#endif
+
+#ifdef Q_OS_DARWIN
+    _filename.replace("/dev/disk", "/dev/rdisk");
+    _file.setFileName(_filename);
+    auto authopenresult = _file.authOpen(_filename);
+    if (authopenresult == _file.authOpenCancelled)
+    {
+        DownloadThread::_onDownloadError(tr("Authentication cancelled"));
+        return false;
+    }
+    else if (authopenresult == _file.authOpenError)
+    {
+        DownloadThread::_onDownloadError(tr("Error running authopen to gain access to disk device '%1'").arg(QString(_filename)));
+        return false;
+    }
+#else
+    if (!_file.open(QIODevice::ReadOnly))
+    {
+#if defined(Q_OS_LINUX) && !defined(QT_NO_DBUS)
+        UDisks2Api udisks;
+        int fd = udisks.authOpen(_filename, "r");
+        if (fd != -1)
+        {
+            _file.open(fd, QIODevice::ReadOnly, QFileDevice::AutoCloseHandle);
+        }
+        else
+#endif
+        {
+            DownloadThread::_onDownloadError(tr("Cannot open storage device '%1'.").arg(QString(_filename)));
+            return false;
+        }
+    }
+#endif
+
+    if (_directIO && !_setDirectIO(true))
+    {
+        qDebug() << "Direct I/O not available for" << _filename << "- using buffered I/O";
+        _directIO = false;
+    }
+
+    return true;
+}
+
+/* Toggles bypassing the page cache on the already opened device */
+bool DownloadThread::_setDirectIO(bool enable)
+{
+#ifdef Q_OS_LINUX
+    int fd = _file.handle();
+    int flags = ::fcntl(fd, F_GETFL);
+    if (flags == -1)
+        return false;
+
+    if (enable)
+    {
+        int sectorSize = 0;
+        if (::ioctl(fd, BLKSSZGET, &sectorSize) == 0 && sectorSize > 0)
+            _directIOAlignment = sectorSize;
+        flags |= O_DIRECT;
+    }
+    else
+    {
+        flags &= ~O_DIRECT;
+    }
+
+    return ::fcntl(fd, F_SETFL, flags) == 0;
+#elif defined(Q_OS_WIN)
+    /* Determined at open time by WinFile */
+    return _file.isUnbuffered() == enable;
+#elif defined(Q_OS_DARWIN)
+    if (enable)
+    {
+        uint32_t blockSize = 0;
+        if (::ioctl(_file.handle(), DKIOCGETBLOCKSIZE, &blockSize) == 0 && blockSize > 0)
+            _directIOAlignment = blockSize;
+    }
+
+    return _file.setNoCache(enable);
+#else
+    Q_UNUSED(enable)
+    return false;
+#endif
+}
+
+void DownloadThread::run()
+{
+    ThreadPlacement::apply(ThreadPlacement::StageDownload);
+    CurlShare::BulkTransfer bulk;
+    BandwidthScheduler::Running bandwidth(_bandwidth);
+    if (isImage())
+    {
+        /* Unmounting, discarding and zeroing the ends of a large card takes seconds.
+           Connecting and buffering the first data happen meanwhile, writes wait for it */
+        _devicePrepared = QtConcurrent::run([this]() {
+            bool ok = _openAndPrepareDevice();
+            if (!ok)
+                cancelDownload();
+            return ok;
+        });
+    }
+    if (isImage() && !_bmapUrl.isEmpty())
+    {
+        _fetchBmap();
+    }
+
+    qDebug() << "Image URL:" << _url;
+    if (_url.startsWith("file://") && _url.at(7) != '/')
+    {
+        /* libcurl does not like UNC paths in the form of file://1.2.3.4/share */
+        _url.replace("file://", "file:////");
+        qDebug() << "Corrected UNC URL to:" << _url;
+    }
+
+    char errorBuf[CURL_ERROR_SIZE] = {0};
+    _c = curl_easy_init();
+    curl_easy_setopt(_c, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(_c, CURLOPT_WRITEFUNCTION, &DownloadThread::_curl_write_callback);
+    curl_easy_setopt(_c, CURLOPT_WRITEDATA, this);
+    curl_easy_setopt(_c, CURLOPT_XFERINFOFUNCTION, &DownloadThread::_curl_xferinfo_callback);
+    curl_easy_setopt(_c, CURLOPT_PROGRESSDATA, this);
+    curl_easy_setopt(_c, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
+    curl_easy_setopt(_c, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(_c, CURLOPT_MAXREDIRS, 10);
+    curl_easy_setopt(_c, CURLOPT_ERRORBUFFER, errorBuf);
+    curl_easy_setopt(_c, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(_c, CURLOPT_HEADERFUNCTION, &DownloadThread::_curl_header_callback);
+    curl_easy_setopt(_c, CURLOPT_HEADERDATA, this);
+    curl_easy_setopt(_c, CURLOPT_CONNECTTIMEOUT, 30);
+    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_TIME, 60);
+    curl_easy_setopt(_c, CURLOPT_LOW_SPEED_LIMIT, 100);
+    _transport.apply(_c);
+    CurlShare::apply(_c);
+    if (_inputBufferSize)
+        curl_easy_setopt(_c, CURLOPT_BUFFERSIZE, _inputBufferSize);
+
+    if (!_useragent.isEmpty())
+        curl_easy_setopt(_c, CURLOPT_USERAGENT, _useragent.constData());
+
+    if (_proxy.isEmpty())
+    {
+#ifndef QT_NO_NETWORKPROXY
+        /* Ask OS for proxy information. */
+        QNetworkProxyQuery npq{QUrl{_url}};
+        QList<QNetworkProxy> proxyList = QNetworkProxyFactory::systemProxyForQuery(npq);
+        if (!proxyList.isEmpty())
+        {
+            QNetworkProxy proxy = proxyList.first();
+            if (proxy.type() != proxy.NoProxy)
+            {
+                QUrl proxyUrl;
+
+                proxyUrl.setScheme(proxy.type() == proxy.Socks5Proxy ? "socks5h" : "http");
+                proxyUrl.setHost(proxy.hostName());
+                proxyUrl.setPort(proxy.port());
+                qDebug() << "Using proxy server:" << proxyUrl;
+
+                if (!proxy.user().isEmpty())
+                {
+                    proxyUrl.setUserName(proxy.user());
+                    proxyUrl.setPassword(proxy.password());
+                }
+
+                _proxy = proxyUrl.toEncoded();
+            }
+        }
+#endif
+    }
+
+    if (!_proxy.isEmpty())
+        curl_easy_setopt(_c, CURLOPT_PROXY, _proxy.constData());
+
+    if (isImage() && (_url.startsWith("http://") || _url.startsWith("https://")))
+        _selectMirror();
+
+    /* Another station on the LAN may have the image in its cache already */
+    if (_peerCache && isImage() && !_expectedHash.isEmpty() && (_url.startsWith("http://") || _url.startsWith("https://")))
+    {
+        QByteArray peerUrl = PeerCache::find(_expectedHash);
+        if (!peerUrl.isEmpty())
+        {
+            qDebug() << "Image is cached by a peer. Downloading from" << peerUrl << "instead of" << _url;
+            _originUrl = _url;
+            _url = peerUrl;
+
+            /* Peers are on the LAN, and only speak HTTP/1.1 */
+            curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
+            curl_easy_setopt(_c, CURLOPT_NOPROXY, "*");
+            curl_easy_setopt(_c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+        }
+    }
+
+    if (!_ifNoneMatch.isEmpty())
+    {
+        _conditionalHeaders = curl_slist_append(nullptr, QByteArray("If-None-Match: "+_ifNoneMatch).constData());
+        curl_easy_setopt(_c, CURLOPT_HTTPHEADER, _conditionalHeaders);
+    }
+
+    if (_cacheWritten && !_replayPartialCache())
+    {
+        curl_easy_cleanup(_c);
+        _devicePrepared.waitForFinished();
+        return;
+    }
+
+    emit preparationStatusUpdate(tr("starting download"));
+    _timer.start();
+    _startPhase(PhaseDownload);
+    if (_followedTransfer && !_followTransfer())
+    {
+        curl_easy_cleanup(_c);
+        _devicePrepared.waitForFinished();
+        return;
+    }
+    CURLcode ret = CURLE_OK;
+    /* Nothing left to download if the cache file has all of it */
+    while (!_replayedAll)
+    {
+        errorBuf[0] = 0;
+        curl_easy_setopt(_c, CURLOPT_ACCEPT_ENCODING, NULL);
+        bool segmented = _segmentedDownload(ret);
+        if (!segmented)
+        {
+            _setAcceptEncoding();
+            ret = curl_easy_perform(_c);
+        }
+
+        /* Deal with badly configured HTTP servers that terminate the connection quickly
+           if connections stalls for some seconds while kernel commits buffers to slow SD card.
+           And also reconnect if we detect from our end that transfer stalled for more than one minute.
+           Segmented downloads retry their pieces themselves */
+        while (!segmented && (ret == CURLE_PARTIAL_FILE || ret == CURLE_OPERATION_TIMEDOUT
+               || (ret == CURLE_HTTP2_STREAM && _lastDlNow != _lastFailureOffset)
+               || (ret == CURLE_RECV_ERROR && _lastDlNow != _lastFailureOffset)) )
+        {
+            time_t t = time(NULL);
+            qDebug() << "HTTP connection lost. Time:" << t;
+
+            /* If last failure happened less than 5 seconds ago, something else may
+               be wrong. Sleep some time to prevent hammering server */
+            if (t - _lastFailureTime < 5)
+            {
+                qDebug() << "Sleeping 5 seconds";
+                ::sleep(5);
+            }
+            _lastFailureTime = t;
+
+            /* Rather than the same slow or flaky server again */
+            if (_mirrors.size() > 1 && _originUrl.isEmpty())
+                _useMirror((_mirrorIndex+1) % _mirrors.size());
+
+            _startOffset = _lastDlNow;
+            _lastFailureOffset = _lastDlNow;
+            curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, _startOffset);
+            _setAcceptEncoding();
+
+            ret = curl_easy_perform(_c);
+        }
+
+        if (!_failOver(ret))
+            break;
+    }
+
+    _settleEncoding();
+    long httpCode = 0;
+    curl_easy_getinfo(_c, CURLINFO_RESPONSE_CODE, &httpCode);
+    curl_easy_cleanup(_c);
+    /* Whatever the outcome, the device is not touched while it is prepared.
+       If that failed, the error is out and the download was cancelled */
+    _devicePrepared.waitForFinished();
+    /* Followers have all there is now, or download the rest themselves */
+    _endCacheTransfer(ret == CURLE_OK && _cacheEnabled);
+    if (_resumeHeaders)
+    {
+        curl_slist_free_all(_resumeHeaders);
+        _resumeHeaders = nullptr;
+    }
+    if (_conditionalHeaders)
+    {
+        curl_slist_free_all(_conditionalHeaders);
+        _conditionalHeaders = nullptr;
+    }
+
+    if (ret == CURLE_OK && httpCode == 304 && !_ifNoneMatch.isEmpty())
+    {
+        /* The caller's copy is current */
+        qDebug() << "Not modified:" << _url;
+        _notModified = _successful = true;
+        _endPhase(PhaseDownload, 0);
+        _closeFiles();
+        emit success();
+        return;
+    }
+
+    switch (ret)
+    {
+        case CURLE_OK:
+            _successful = true;
+            qDebug() << "Download done in" << _timer.elapsed() / 1000 << "seconds";
+            if (_encodingSaved)
+                qDebug() << "Transfer compression saved" << _encodingSaved << "of" << _lastDlNow << "bytes";
+            /* What came over the link, so its rate is not overestimated */
+            _endPhase(PhaseDownload, _lastDlNow - _encodingSaved);
+            _onDownloadSuccess();
+            break;
+        case CURLE_WRITE_ERROR:
+            deleteDownloadedFile();
+            _onWriteError();
+            break;
+        case CURLE_ABORTED_BY_CALLBACK:
+            deleteDownloadedFile();
+            break;
+        default:
+            /* Server no longer has the file we resumed. Start from scratch next time */
+            if (ret == CURLE_RANGE_ERROR)
+                _discardPartialCache = true;
+            deleteDownloadedFile();
+            QString errorMsg;
+
+            if (!errorBuf[0])
+                /* No detailed error message text provided, use standard text for libcurl result code */
+                errorMsg += curl_easy_strerror(ret);
+            else
+                errorMsg += errorBuf;
+
+            char *ipstr;
+            if (curl_easy_getinfo(_c, CURLINFO_PRIMARY_IP, &ipstr) == CURLE_OK && ipstr && ipstr[0])
+                errorMsg += QString(" - Server IP: ")+ipstr;
+
+            _onDownloadError(tr("Error downloading: %1").arg(errorMsg));
+    }
+}
+
+/* Download over several connections with range requests, into the cache file.
+   Pieces are handed out lowest offset first, and fed to _writeData() in order as soon
+   as all data before them is there. Returns false if the server does not support this */
+bool DownloadThread::_segmentedDownload(CURLcode &ret)
+{
+    if (_downloadSegments < 2 || !_cacheEnabled || !(_url.startsWith("http://") || _url.startsWith("https://")))
+        return false;
+
+    /* Need to know the size, and that the server accepts range requests */
+    _acceptRanges = false;
+    curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+    curl_easy_setopt(_c, CURLOPT_NOBODY, 1L);
+    CURLcode headRet = curl_easy_perform(_c);
+    curl_easy_setopt(_c, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(_c, CURLOPT_HTTPGET, 1L);
+
+    curl_off_t length = -1;
+    if (headRet == CURLE_OK)
+        curl_easy_getinfo(_c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    if (!_acceptRanges || length <= _startOffset || (quint64) (length-_startOffset) < 2*IMAGEWRITER_SEGMENT_SIZE)
+    {
+        qDebug() << "Server does not accept range requests, or file is small. Downloading over a single connection";
+        curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, _startOffset);
+        return false;
+    }
+
+    qDebug() << "Downloading over" << _downloadSegments << "connections";
+    _lastDlTotal = length;
+    _lastDlNow = _startOffset;
+    /* Pieces are written to the file directly */
+    if (!_cacheWriter.stop())
+    {
+        qDebug() << "Error writing to cache file. Disabling caching.";
+        _cacheEnabled = false;
+        _discardCacheFile();
+        curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, _startOffset);
+        return false;
+    }
+    if (_cachefile.size() < length)
+        CacheWriter::preallocate(_cachefile, length);
+
+    /* Spread the pieces over the mirrors that are about as fast as this one */
+    QList<QByteArray> sources;
+    if (_multiSource && _originUrl.isEmpty())
+        sources = _mirrors.fastUrls();
+    if (sources.size() > 1)
+        qDebug() << "Downloading from" << sources.size() << "mirrors at once";
+
+    CURLM *m = curl_multi_init();
+    QVector<DownloadSegment> segs(_downloadSegments);
+    QMap<quint64, quint64> done;
+    quint64 next = _startOffset;
+    int active = 0;
+    ret = CURLE_OK;
+
+    auto startSegment = [&](DownloadSegment &seg) {
+        QByteArray range = QByteArray::number(seg.pos)+"-"+QByteArray::number(seg.end-1);
+        curl_easy_setopt(seg.c, CURLOPT_RANGE, range.constData());
+        seg.rangeError = false;
+        curl_multi_add_handle(m, seg.c);
+        active++;
+    };
+
+    for (int i = 0; i < segs.size(); i++)
+    {
+        DownloadSegment &seg = segs[i];
+        seg.thread = this;
+        seg.retries = 0;
+        seg.c = curl_easy_duphandle(_c);
+        seg.onMirror = sources.size() > 1 && sources[i % sources.size()] != _url;
+        if (seg.onMirror)
+            curl_easy_setopt(seg.c, CURLOPT_URL, sources[i % sources.size()].constData());
+        curl_easy_setopt(seg.c, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+        curl_easy_setopt(seg.c, CURLOPT_NOPROGRESS, 0L);
+        curl_easy_setopt(seg.c, CURLOPT_XFERINFOFUNCTION, &DownloadThread::_curl_segment_xferinfo_callback);
+        curl_easy_setopt(seg.c, CURLOPT_XFERINFODATA, &seg);
+        curl_easy_setopt(seg.c, CURLOPT_WRITEFUNCTION, &DownloadThread::_curl_segment_write_callback);
+        curl_easy_setopt(seg.c, CURLOPT_WRITEDATA, &seg);
+        curl_easy_setopt(seg.c, CURLOPT_HEADERFUNCTION, &DownloadThread::_curl_segment_header_callback);
+        curl_easy_setopt(seg.c, CURLOPT_HEADERDATA, &seg);
+        curl_easy_setopt(seg.c, CURLOPT_PRIVATE, &seg);
+
+        if (next < (quint64) length)
+        {
+            seg.start = seg.pos = next;
+            seg.end = next = qMin(next+IMAGEWRITER_SEGMENT_SIZE, (quint64) length);
+            startSegment(seg);
+        }
+    }
+
+    while (!_cancelled && ret == CURLE_OK && (active || !done.isEmpty()))
+    {
+        int running;
+        if (curl_multi_perform(m, &running) != CURLM_OK)
+        {
+            ret = CURLE_FAILED_INIT;
+            break;
+        }
+
+        CURLMsg *msg;
+        int left;
+        while (ret == CURLE_OK && (msg = curl_multi_info_read(m, &left)))
+        {
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+
+            DownloadSegment *seg;
+            CURLcode result = msg->data.result;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &seg);
+            curl_multi_remove_handle(m, seg->c);
+            active--;
+
+            if (seg->rangeError)
+                result = CURLE_RANGE_ERROR;
+            else if (result == CURLE_OK && seg->pos != seg->end)
+                result = CURLE_PARTIAL_FILE;
+
+            if (result == CURLE_OK)
+            {
+                done.insert(seg->start, seg->end);
+                seg->retries = 0;
+                if (next < (quint64) length)
+                {
+                    seg->start = seg->pos = next;
+                    seg->end = next = qMin(next+IMAGEWRITER_SEGMENT_SIZE, (quint64) length);
+                    startSegment(*seg);
+                }
+            }
+            else if (seg->onMirror && result != CURLE_WRITE_ERROR)
+            {
+                /* Leave the rest of this connection's pieces to the main server */
+                qDebug() << "Range request to mirror failed:" << curl_easy_strerror(result) << "Continuing from" << _url;
+                seg->onMirror = false;
+                seg->retries = 0;
+                curl_easy_setopt(seg->c, CURLOPT_URL, _url.constData());
+                startSegment(*seg);
+            }
+            else if (result != CURLE_RANGE_ERROR && result != CURLE_WRITE_ERROR && seg->retries < IMAGEWRITER_SEGMENT_RETRIES)
+            {
+                seg->retries++;
+                qDebug() << "Range request failed:" << curl_easy_strerror(result) << "Retrying from" << seg->pos;
+                startSegment(*seg);
+            }
+            else
+            {
+                ret = result;
+            }
+        }
+
+        if (ret == CURLE_OK && !_feedSegments(done))
+            ret = CURLE_WRITE_ERROR;
+        if (ret == CURLE_OK && active)
+            curl_multi_poll(m, NULL, 0, 1000, NULL);
+    }
+
+    if (_cancelled && ret == CURLE_OK)
+        ret = CURLE_ABORTED_BY_CALLBACK;
+
+    for (DownloadSegment &seg : segs)
+    {
+        curl_multi_remove_handle(m, seg.c);
+        curl_easy_cleanup(seg.c);
+    }
+    curl_multi_cleanup(m);
+
+    return true;
+}
+
+bool DownloadThread::_failOver(CURLcode ret)
+{
+    if (_cancelled || ret == CURLE_OK || ret == CURLE_ABORTED_BY_CALLBACK || ret == CURLE_WRITE_ERROR)
+        return false;
+
+    if (!_originUrl.isEmpty())
+    {
+        /* Peers have the same file, so the server can take over where the peer stopped */
+        qDebug() << "Download from peer failed:" << curl_easy_strerror(ret) << "Continuing from" << _originUrl << "at offset" << _lastDlNow;
+        _url = _originUrl;
+        _originUrl.clear();
+        curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
+        curl_easy_setopt(_c, CURLOPT_NOPROXY, nullptr);
+        curl_easy_setopt(_c, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_NONE);
+        _transport.apply(_c);
+    }
+    else if (_mirrorFailovers < _mirrors.size()-1)
+    {
+        _mirrorFailovers++;
+        qDebug() << "Download failed:" << curl_easy_strerror(ret) << "Continuing from the next mirror at offset" << _lastDlNow;
+        _useMirror((_mirrorIndex+1) % _mirrors.size());
+    }
+    else
+    {
+        return false;
+    }
+
+    _startOffset = _lastDlNow;
+    _lastFailureOffset = _lastDlNow;
+    curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, _startOffset);
+
+    return true;
+}
+
+/* Download from the fastest of the URL, its mirrors and those in the metalink file */
+void DownloadThread::_selectMirror()
+{
+    MirrorList mirrors;
+    mirrors.add(_url);
+    for (const QByteArray &url : std::as_const(_mirrorUrls))
+        mirrors.add(url);
+
+    if (!_metalinkUrl.isEmpty())
+    {
+        QByteArray xml;
+        emit preparationStatusUpdate(tr("downloading mirror list"));
+        qDebug() << "Metalink URL:" << _metalinkUrl;
+        if (_fetchSmallFile(_metalinkUrl, xml))
+            mirrors.parseMetalink(xml);
+    }
+    if (mirrors.size() < 2)
+        return;
+
+    emit preparationStatusUpdate(tr("finding fastest mirror"));
+    mirrors.probe(_c, _cancelled);
+    _mirrors = mirrors;
+    _mirrorIndex = _mirrorFailovers = 0;
+    _useMirror(0);
+}
+
+void DownloadThread::_useMirror(int index)
+{
+    _mirrorIndex = index;
+    _url = _mirrors.at(index).url;
+    curl_easy_setopt(_c, CURLOPT_URL, _url.constData());
+    qDebug() << "Downloading from mirror" << _url;
+}
+
+/* Pass pieces that follow on what was fed before to _writeData(), reading them back from the cache file */
+bool DownloadThread::_feedSegments(QMap<quint64, quint64> &done)
+{
+    if (done.isEmpty() || done.firstKey() != _cacheWritten)
+        return true;
+
+    char *buf = (char *) qMallocAligned(IMAGEWRITER_BLOCKSIZE, 4096);
+    bool ok = true;
+
+    _replayingCache = true;
+    while (ok && !done.isEmpty() && done.firstKey() == _cacheWritten && !_cancelled)
+    {
+        quint64 end = done.take(done.firstKey());
+        ok = _cachefile.seek(_cacheWritten);
+        while (ok && _cacheWritten < end && !_cancelled)
+        {
+            qint64 n = _cachefile.read(buf, qMin((quint64) IMAGEWRITER_BLOCKSIZE, end-_cacheWritten));
+            ok = n > 0 && _writeData(buf, n) == (size_t) n;
+            if (ok)
+                _cacheWritten += n;
+        }
+    }
+    _replayingCache = false;
+    qFreeAligned(buf);
+
+    /* Read back from the file, so it is there for followers as well */
+    if (ok && _cacheTransfer)
+        _cacheTransfer->setAvailable(_cacheWritten);
+    if (ok && _cacheWritten - _journalWritten >= IMAGEWRITER_CACHE_JOURNAL_INTERVAL)
+        _writeCacheJournal();
+
+    return ok || _cancelled;
+}
+
+size_t DownloadThread::_writeData(const char *buf, size_t len)
+{
+    _writeCache(buf, len);
+
+    if (!_filename.isEmpty())
+    {
+        return _writeFile(buf, len);
+    }
+    else
+    {
+        _buf.append(buf, len);
+        return len;
+    }
+}
+
+void DownloadThread::_writeCache(const char *buf, size_t len)
+{
+    if (!_cacheEnabled || _cancelled || _replayingCache)
+        return;
+
+    if (!_cacheWriter.isOpen())
+    {
+        /* Pieces of a segmented download may have moved the position */
+        _cachefile.seek(_cacheWritten);
+        _cacheWriter.open(&_cachefile);
+    }
+    if (!_cacheWriter.write(buf, len))
+    {
+        qDebug() << "Error writing to cache file. Disabling caching.";
+        _cacheEnabled = false;
+        _discardCacheFile();
+        return;
+    }
+
+    _cacheWritten += len;
+    if (_cacheWritten - _journalWritten >= IMAGEWRITER_CACHE_JOURNAL_INTERVAL)
+        _writeCacheJournal(false);
+}
+
+/* Record how much of the cache file is on disk. Returns false if the download cannot be resumed.
+   Unless wait is set, the cache writer saves the journal once it has written everything before */
+bool DownloadThread::_writeCacheJournal(bool wait)
+{
+    if (!_etag.isEmpty() || !_lastModifiedHeader.isEmpty())
+    {
+        _journal.etag = _etag;
+        _journal.lastModified = _lastModifiedHeader;
+    }
+    if (!_journal.hasValidator() || !_cacheWritten
+            || !(_url.startsWith("http://") || _url.startsWith("https://")))
+        return false;
+
+    _journal.offset = _cacheWritten;
+    if (!wait && _cacheWriter.isOpen())
+    {
+        _cacheWriter.writeJournal(_journal);
+        _journalWritten = _cacheWritten;
+        return true;
+    }
+    if (!_cacheWriter.flush())
+        return false;
+
+    /* Data has to be on disk before the journal says it is */
+    _cachefile.flush();
+#ifndef Q_OS_WIN
+    ::fsync(_cachefile.handle());
+#endif
+    if (!_journal.save(_cachefile.fileName()))
+        return false;
+    _journalWritten = _cacheWritten;
+
+    return true;
+}
+
+/* Returns false if not everything could be written */
+bool DownloadThread::_closeCacheFile()
+{
+    bool ok = _cacheWriter.stop();
+    _cachefile.close();
+
+    return ok;
+}
+
+void DownloadThread::_discardCacheFile()
+{
+    _cacheWriter.stop(true);
+    _endCacheTransfer(false);
+    _cachefile.remove();
+    CacheJournal::remove(_cachefile.fileName());
+}
+
+void DownloadThread::setCacheTransfer(std::shared_ptr<DownloadCoordinator::Transfer> transfer)
+{
+    _cacheTransfer = transfer;
+    _cacheWriter.setWrittenCallback([transfer](quint64 bytes) {
+        transfer->setAvailable(bytes);
+    });
+}
+
+void DownloadThread::followTransfer(std::shared_ptr<DownloadCoordinator::Transfer> transfer)
+{
+    _followedTransfer = transfer;
+}
+
+/* Tell followers no more is coming. With complete they have all of the download */
+void DownloadThread::_endCacheTransfer(bool complete)
+{
+    if (!_cacheTransfer)
+        return;
+
+    if (complete && _cacheWriter.flush())
+        _cacheTransfer->setAvailable(_cacheWritten);
+    else
+        complete = false;
+    _cacheTransfer->finish(complete);
+    _cacheTransfer.reset();
+}
+
+/* Feed what the owner of the transfer writes to the cache file as it grows.
+   If it stops before the end, let curl continue from where it got to */
+bool DownloadThread::_followTransfer()
+{
+    QFile f(_followedTransfer->fileName());
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Cannot open cache file of the transfer to follow. Downloading instead";
+        _followedTransfer.reset();
+        return true;
+    }
+
+    qDebug() << "Following the download of" << _url << "by another job";
+    emit preparationStatusUpdate(tr("waiting for the download of another job"));
+    /* Takes no bandwidth while it only reads the file */
+    _bandwidth.end();
+
+    char *buf = (char *) qMallocAligned(IMAGEWRITER_BLOCKSIZE, 4096);
+    quint64 pos = 0;
+    bool ok = true;
+    while (ok && !_cancelled)
+    {
+        /* Once finished, what is available does not change anymore */
+        bool finished = _followedTransfer->isFinished();
+        quint64 available = _followedTransfer->wait(pos, _cancelled);
+        while (ok && pos < available && !_cancelled)
+        {
+            qint64 n = f.read(buf, qMin((quint64) IMAGEWRITER_BLOCKSIZE, available-pos));
+            ok = n > 0 && _writeData(buf, n) == (size_t) n;
+            if (ok)
+            {
+                pos += n;
+                _lastDlNow = pos;
+            }
+        }
+        if (finished)
+            break;
+    }
+    qFreeAligned(buf);
+
+    if (_cancelled)
+        return false;
+    if (!ok)
+    {
+        deleteDownloadedFile();
+        _onDownloadError(tr("Error reading the download of another job from the cache"));
+        return false;
+    }
+
+    if (_followedTransfer->isComplete())
+    {
+        _replayedAll = true;
+    }
+    else
+    {
+        qDebug() << "Download followed stopped at" << pos << "bytes. Downloading the rest";
+        _bandwidth.begin();
+        _startOffset = pos;
+        curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) _startOffset);
+    }
+    _followedTransfer.reset();
+
+    return true;
+}
+
+/* Feed the part of the image downloaded by an earlier run from the cache file,
+   and let curl continue from there */
+bool DownloadThread::_replayPartialCache()
+{
+    /* Make sure the server still has the same file. What was prefetched by this process
+       is not checked, a different file fails the hash check at the end */
+    curl_easy_setopt(_c, CURLOPT_NOBODY, 1L);
+    CURLcode ret = curl_easy_perform(_c);
+    curl_easy_setopt(_c, CURLOPT_NOBODY, 0L);
+    curl_easy_setopt(_c, CURLOPT_HTTPGET, 1L);
+    curl_off_t length = -1;
+    if (ret == CURLE_OK)
+        curl_easy_getinfo(_c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+    if (!_prefetched && (ret != CURLE_OK || (_etag.isEmpty() && _lastModifiedHeader.isEmpty())
+            || _etag != _journal.etag || _lastModifiedHeader != _journal.lastModified))
+    {
+        qDebug() << "Image on server changed or cannot be checked. Not resuming download";
+        _cachefile.resize(0);
+        _cachefile.seek(0);
+        CacheJournal::remove(_cachefile.fileName());
+        _cacheWritten = _journalWritten = 0;
+        _lastDlTotal = 0;
+        return true;
+    }
+
+    qDebug() << "Resuming download from cache file at" << _cacheWritten << "bytes";
+    emit preparationStatusUpdate(tr("reading partial download"));
+    _timer.start();
+
+    char *buf = (char *) qMallocAligned(IMAGEWRITER_BLOCKSIZE, 4096);
+    quint64 pos = 0;
+    _cachefile.seek(0);
+    _replayingCache = true;
+    while (pos < _cacheWritten && !_cancelled)
+    {
+        qint64 n = _cachefile.read(buf, qMin((quint64) IMAGEWRITER_BLOCKSIZE, _cacheWritten-pos));
+        if (n <= 0 || _writeData(buf, n) != (size_t) n)
+            break;
+        pos += n;
+        _lastDlNow = pos;
+    }
+    _replayingCache = false;
+    qFreeAligned(buf);
+
+    if (pos != _cacheWritten)
+    {
+        if (!_cancelled)
+        {
+            _discardPartialCache = true;
+            deleteDownloadedFile();
+            _onDownloadError(tr("Error reading partial download from cache"));
+        }
+        return false;
+    }
+
+    _cachefile.seek(_cacheWritten);
+    if (_cacheTransfer)
+        _cacheTransfer->setAvailable(_cacheWritten);
+    _startOffset = _cacheWritten;
+    curl_easy_setopt(_c, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) _startOffset);
+    if (length >= 0 && (quint64) length == _cacheWritten)
+    {
+        qDebug() << "Cache file has all of the download already";
+        _replayedAll = true;
+    }
+
+    /* Have the server fail the request instead of sending a different file */
+    if (_journal.hasValidator())
+    {
+        QByteArray ifRange = "If-Range: "+(_journal.etag.isEmpty() ? _journal.lastModified : _journal.etag);
+        _resumeHeaders = curl_slist_append(_resumeHeaders, ifRange.constData());
+        curl_easy_setopt(_c, CURLOPT_HTTPHEADER, _resumeHeaders);
+    }
+
+    return true;
+}
+
+void DownloadThread::setExtractedCacheFile(const QString &filename)
+{
+    _extractedCacheFile.setFileName(filename);
+    if (_extractedCacheFile.open(QIODevice::WriteOnly))
+    {
+        _extractedCacheEnabled = true;
+    }
+    else
+    {
+        qDebug() << "Error opening extracted image cache file. Not caching extracted image";
+    }
+}
+
+/* All-zero regions are skipped, leaving holes in the sparse file */
+void DownloadThread::_writeExtractedCache(const char *buf, size_t len)
+{
+    if (!_extractedCacheEnabled || _cancelled)
+        return;
+
+    const size_t holeSize = 65536;
+    size_t pos = 0;
+    while (pos < len)
+    {
+        size_t n = qMin(holeSize, len-pos);
+        bool zero = _isZeroBlock(buf+pos, n);
+        /* One write or seek per run of data or zeroes */
+        while (pos+n < len)
+        {
+            size_t next = qMin(holeSize, len-pos-n);
+            if (_isZeroBlock(buf+pos+n, next) != zero)
+                break;
+            n += next;
+        }
+
+        bool ok = zero ? _extractedCacheFile.seek(_extractedCacheFile.pos()+n)
+                       : _extractedCacheFile.write(buf+pos, n) == (qint64) n;
+        if (!ok)
+        {
+            qDebug() << "Error writing to extracted image cache file. Disabling caching of extracted image.";
+            _extractedCacheEnabled = false;
+            _extractedCacheFile.remove();
+            return;
+        }
+        pos += n;
+    }
+}
+
+void DownloadThread::setCacheFile(const QString &filename, qint64 filesize, quint64 prefetched)
+{
+    _cachefile.setFileName(filename);
+
+    /* Partial download of the same URL left by an earlier run? */
+    CacheJournal journal;
+    bool isHttp = _url.startsWith("http://") || _url.startsWith("https://");
+    bool resume = journal.load(filename) && journal.url == _url && journal.hasValidator()
+            && journal.offset <= (quint64) QFileInfo(filename).size() && isHttp;
+    /* Or by a prefetch that just stopped, which may have got further than its journal says */
+    if (prefetched && isHttp && prefetched <= (quint64) QFileInfo(filename).size()
+            && (!resume || prefetched > journal.offset))
+    {
+        if (!resume)
+        {
+            journal = CacheJournal();
+            journal.url = _url;
+        }
+        journal.offset = prefetched;
+        resume = _prefetched = true;
+    }
+
+    /* Segmented downloads and resuming read back from the cache file */
+    if (_cachefile.open(resume ? QIODevice::ReadWrite : QIODevice::ReadWrite | QIODevice::Truncate))
+    {
+        _cacheEnabled = true;
+        if (resume)
+        {
+            _journal = journal;
+            _cacheWritten = _journalWritten = journal.offset;
+        }
+        else
+        {
+            CacheJournal::remove(filename);
+            _journal = CacheJournal();
+            _journal.url = _url;
+        }
+        if (filesize)
+        {
+            /* Pre-allocate space */
+            CacheWriter::preallocate(_cachefile, filesize);
+        }
+    }
+    else
+    {
+        qDebug() << "Error opening cache file for writing. Disabling caching.";
+    }
+}
+
+void DownloadThread::setVerifiedInput(const CacheSidecar &sidecar)
+{
+    _verifiedHash = QByteArray::fromHex(sidecar.extractHash);
+    _hasVerifiedInput = !_verifiedHash.isEmpty();
+    _hasVerifiedChunks = _hasVerifiedInput && sidecar.chunkSize == _chunkhash.chunkSize()
+            && sidecar.chunkAlgorithm == _chunkhash.algorithm() && !sidecar.chunks.isEmpty();
+    if (_hasVerifiedChunks)
+        _chunkhash.setLeaves(sidecar.chunks);
+}
+
+void DownloadThread::setVerifySource(const QString &filename)
+{
+    _verifySource = filename;
+}
+
+bool DownloadThread::_inputVerified() const
+{
+    /* Without a device verify nothing would catch a cache file that went bad
+       after it was written, so keep hashing the input in that case */
+    return _hasVerifiedInput && _verifyEnabled;
+}
+
+void DownloadThread::_writeCacheSidecar(const QString &cacheFile, const QByteArray &extractHash, quint64 imageSize)
+{
+    CacheSidecar sidecar;
+    sidecar.extractHash = extractHash;
+    sidecar.imageSize = imageSize;
+    if (_chunkedVerify)
+    {
+        _chunkhash.finalize();
+        sidecar.chunkSize = _chunkhash.chunkSize();
+        sidecar.chunkAlgorithm = _chunkhash.algorithm();
+        sidecar.chunks = _chunkhash.leaves();
+    }
+    sidecar.save(cacheFile);
+}
+
+void DownloadThread::_hashData(const char *buf, size_t len)
+{
+    TraceSpan span("hash");
+    /* Every block of the extracted image passes through here once, in order */
+    _writeExtractedCache(buf, len);
+
+    if (_inputVerified())
+    {
+        /* Whole image hash is known. Leaves may still be needed */
+        if (_chunkedVerify && !_hasVerifiedChunks)
+            _chunkhash.addData(buf, len);
+    }
+    else if (_chunkedVerify)
+    {
+        /* Leaves are hashed on another core, in parallel with the whole image hash */
+        quint64 leaves = _leafHashStage.submit([this, buf, len]() { _chunkhash.addData(buf, len); });
+        _writehash.addData(buf, len);
+        _leafHashStage.waitFor(leaves);
+    }
+    else
+    {
+        _writehash.addData(buf, len);
+    }
+}
+
+quint64 DownloadThread::_submitHash(const char *buf, size_t len)
+{
+    return _hashStage.submit([this, buf, len]() { _hashData(buf, len); });
+}
+
+size_t DownloadThread::_writeFile(const char *buf, size_t len)
+{
+    /* Only applies to this block, whatever path it takes */
+    int copySource = _copySourceFd;
+    _copySourceFd = -1;
+
+    if (_cancelled)
+        return len;
+    if (!_waitForDevice())
+        return 0;
+
+    TraceSpan span("writeFile");
+    _publishProgress();
+
+    if (!_fanoutTargets.isEmpty())
+    {
+        /* No device of our own, the targets write the data */
+        _hashData(buf, len);
+        _bytesWritten += len;
+        return _fanoutBlock(buf, len) ? len : 0;
+    }
+
+    if (!_phaseTimers[PhaseWrite].isValid())
+        _startPhase(PhaseWrite);
+
+    if (_outputStream)
+        return _streamOut(buf, len) ? len : 0;
+
+    bool fsUnused = false;
+    if (!_firstBlock)
+        _fsMapEnabled = _fsMapUsable();
+    if (_fsMapEnabled)
+    {
+        quint64 pos = _file.pos();
+        _fsMap.addData(buf, len, pos);
+        /* The boot partition may be customized in the stream, and is always written in full */
+        fsUnused = _firstBlock && !(_capture && pos+len > _captureStart && pos < _captureEnd) && _fsMap.isUnused(pos, len);
+        if (!fsUnused && _verifyEnabled)
+            _usedHash.addData(buf, len);
+    }
+
+    if (!_firstBlock)
+    {
+        _hashData(buf, len);
+        _firstBlock = (char *) qMallocAligned(len, 4096);
+        _firstBlockSize = len;
+        ::memcpy(_firstBlock, buf, len);
+        _startCapture();
+
+        if (_streamingOutput)
+        {
+            /* The reader needs it first. Written again at the end, which changes nothing */
+            if (_blockDevice()->pwrite(buf, len, 0) != (qint64) len || !_file.seek(len))
+                return 0;
+            _publishStreamable(len);
+            return len;
+        }
+
+        return _file.seek(len) ? len : 0;
+    }
+    if (_capture && _file.pos() >= _captureEnd && !_finishCapture(true))
+        return 0;
+    if (_capture && _file.pos()+len > _captureStart && !_isZeroBlock(buf, len))
+    {
+        /* Boot partition. Written once customized, see _finishCapture() */
+        quint64 pos = _file.pos();
+        _hashData(buf, len);
+        _capture->capture(buf, len, pos);
+        _bytesWritten += len;
+
+        if (_capture->capturedBytes() > _budget.instreamCustomizeMaxSize)
+        {
+            qDebug() << "Boot partition has too much data to keep in memory. Customizing after writing";
+            if (!_finishCapture(false))
+                return 0;
+        }
+
+        return _file.seek(pos+len) ? len : 0;
+    }
+    if (fsUnused)
+    {
+        /* Free space of a file system. Whatever the device has there will do */
+        quint64 pos = _file.pos();
+        _hashData(buf, len);
+        _bytesWritten += len;
+        _bytesSkipped += len;
+        if (!_fsSkipped.isEmpty() && _fsSkipped.last().second == pos)
+            _fsSkipped.last().second = pos+len;
+        else
+            _fsSkipped.append({pos, pos+len});
+
+        return _file.seek(pos+len) ? len : 0;
+    }
+    if (_canSkipBlock(buf, len, _file.pos()))
+    {
+        /* Not mapped by bmap, or device already reads back as zeroes. No need to write */
+        _hashData(buf, len);
+        _bytesWritten += len;
+        _bytesSkipped += len;
+        _publishStreamable(_file.pos()+len);
+
+        return _file.seek(_file.pos()+len) ? len : 0;
+    }
+    if (_zeroOutBlock(buf, len, _file.pos()))
+    {
+        /* Zeroed by the device itself */
+        _hashData(buf, len);
+        _bytesWritten += len;
+        _publishStreamable(_file.pos()+len);
+
+        return _file.seek(_file.pos()+len) ? len : 0;
+    }
+
+    quint64 hashed = _submitHash(buf, len);
+    quint64 pos = _file.pos();
+
+    /* Unaligned blocks with direct I/O are left to the BlockDevice backend */
+    qint64 written;
+    QElapsedTimer t;
+    t.start();
+    if (copySource != -1)
+        written = _copyFromSource(copySource, buf, len);
+    else
+        written = _blockDevice()->pwrite(buf, len, pos);
+    _writeHealth.recordWrite(t.nsecsElapsed());
+    if (written > 0 && !_file.seek(pos+written))
+        written = -1;
+    _bytesWritten += written;
+
+    if ((size_t) written != len)
+    {
+        qDebug() << "Write error:" << _blockDevice()->errorString() << "while writing len:" << len;
+    }
+
+    _hashStage.waitFor(hashed);
+    if ((size_t) written == len)
+    {
+        _writeCheckpoint(_file.pos());
+        _writeback(_file.pos());
+        if (_journalCheckpointDue(_file.pos()))
+            _writeJournalCheckpoint(_file.pos());
+        _publishStreamable(_file.pos());
+    }
+    return (written < 0) ? 0 : written;
+}
+
+/* Output stream: the image goes out in order. Only the boot partition is
+   held back, until it has been captured completely and customized */
+bool DownloadThread::_streamOut(const char *buf, size_t len)
+{
+    quint64 offset = _bytesWritten;
+
+    _hashData(buf, len);
+
+    if (!_firstBlock)
+    {
+        _firstBlock = (char *) qMallocAligned(len, 4096);
+        _firstBlockSize = len;
+        ::memcpy(_firstBlock, buf, len);
+        _startCapture();
+        if (!_capture && _customizationRequested())
+        {
+            DownloadThread::_onDownloadError(tr("This image cannot be customized while it is sent to the device"));
+            return false;
+        }
+    }
+    else if (_capture && offset >= _captureEnd)
+    {
+        if (!_finishCapture(true))
+            return false;
+        if (!_customizedInStream && _customizationRequested())
+        {
+            DownloadThread::_onDownloadError(tr("This image cannot be customized while it is sent to the device"));
+            return false;
+        }
+    }
+    _bytesWritten += len;
+
+    if (_capture && offset+len > _captureStart)
+    {
+        if (!_isZeroBlock(buf, len))
+            _capture->capture(buf, len, offset);
+        if (_capture->capturedBytes() > _budget.instreamCustomizeMaxSize)
+        {
+            DownloadThread::_onDownloadError(tr("Boot partition is too large to customize while the image is sent to the device"));
+            return false;
+        }
+        return true;
+    }
+
+    if (!_streamZeroes(offset) || !_outputStream->write(buf, len))
+        return false;
+    _outputStreamPos = offset+len;
+
+    return true;
+}
+
+/* Output stream: fills the gap up to upTo with zeroes */
+bool DownloadThread::_streamZeroes(quint64 upTo)
+{
+    if (_outputStreamPos >= upTo)
+        return true;
+
+    QByteArray zeroes(qMin(upTo-_outputStreamPos, (quint64) IMAGEWRITER_BLOCKSIZE), 0);
+    while (_outputStreamPos < upTo)
+    {
+        size_t n = qMin(upTo-_outputStreamPos, (quint64) zeroes.size());
+        if (!_outputStream->write(zeroes.constData(), n))
+            return false;
+        _outputStreamPos += n;
+    }
+
+    return true;
+}
+
+void DownloadThread::addFanoutTarget(FanoutTargetThread *target)
+{
+    _fanoutTargets.append(target);
+    target->_progressListener = this;
+    /* Nothing is written with our own file handle */
+    _ioUringEnabled = false;
+    _directIO = false;
+}
+
+/* Hand block to every device still writing. Returns false if none is left */
+bool DownloadThread::_fanoutBlock(const char *buf, size_t len)
+{
+    /* Blocks are as large as the extraction buffers, except for the last one */
+    if (!_fanoutPool)
+        _fanoutPool = new BufferPool(qMax(len, (size_t) IMAGEWRITER_BLOCKSIZE));
+    FanoutTargetThread::Block block = FanoutTargetThread::allocateBlock(_fanoutPool, buf, len);
+    quint64 offset = _bytesWritten - len;
+    /* A device falling behind can only be left behind if it can catch up from the extracted image */
+    int timeout = _extractedCacheEnabled ? IMAGEWRITER_FANOUT_SPILL_TIMEOUT : -1;
+    bool flushed = false;
+    bool any = false;
+
+    for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+    {
+        if (target->failed())
+            continue;
+
+        if (target->spilled())
+        {
+            if (!_extractedCacheEnabled || (!flushed && !_extractedCacheFile.flush()))
+            {
+                target->fail(tr("Error writing extracted image to cache, needed to continue writing to this device"));
+                continue;
+            }
+            flushed = true;
+            target->setAvailable(offset+len);
+            any = true;
+            continue;
+        }
+
+        switch (target->push(block, timeout))
+        {
+        case FanoutTargetThread::Queued:
+            any = true;
+            break;
+        case FanoutTargetThread::Lagging:
+            /* Block is already in the cache file, so the device can continue from there */
+            if (_extractedCacheFile.flush() && target->spill(_extractedCacheFile.fileName(), offset))
+            {
+                flushed = true;
+                target->setAvailable(offset+len);
+                any = true;
+            }
+            else if (target->push(block) == FanoutTargetThread::Queued)
+            {
+                any = true;
+            }
+            break;
+        case FanoutTargetThread::Dropped:
+            break;
+        }
+    }
+
+    return any;
+}
+
+/* Let the devices finish writing and verifying, and wait for them */
+void DownloadThread::_finishFanout()
+{
+    int succeeded = 0;
+
+    for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+        target->finish();
+    for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+    {
+        target->wait();
+        if (!target->failed())
+            succeeded++;
+    }
+    qDebug() << "Image written to" << succeeded << "of" << _fanoutTargets.size() << "devices";
+
+    if (!succeeded)
+    {
+        DownloadThread::_onDownloadError(tr("Writing failed on all storage devices"));
+        return;
+    }
+
+    if (!_suppressSuccessSignal)
+        emit success();
+}
+
+bool DownloadThread::_progress(curl_off_t dltotal, curl_off_t dlnow, curl_off_t /*ultotal*/, curl_off_t /*ulnow*/)
+{
+    if (_contentEncoded)
+    {
+        /* libcurl counts encoded bytes. Offsets are of the image, and the size
+           is only known from how well it compressed so far */
+        _encodedNow = dlnow;
+        if (dltotal && dlnow)
+            _lastDlTotal = _startOffset + (quint64) ((double) _decodedNow * dltotal / dlnow);
+        _lastDlNow = _startOffset + _decodedNow;
+    }
+    else
+    {
+        if (dltotal)
+            _lastDlTotal = _startOffset + dltotal;
+        _lastDlNow   = _startOffset + dlnow;
+    }
+    _publishProgress();
+
+    return !_cancelled;
+}
+
+void DownloadThread::_header(const string &header)
+{
+    /* Validators for resuming the download later. Remember them of the final response only */
+    QByteArray h = QByteArray(header.c_str()).trimmed();
+    if (h.startsWith("HTTP/"))
+    {
+        _etag.clear();
+        _lastModifiedHeader.clear();
+        _acceptRanges = false;
+        _settleEncoding();
+    }
+    else if (h.toLower().startsWith("content-encoding:"))
+    {
+        QByteArray encoding = h.mid(17).trimmed().toLower();
+        _contentEncoded = encoding == "gzip" || encoding == "x-gzip" || encoding == "zstd";
+    }
+    else if (h.toLower().startsWith("etag:"))
+    {
+        _etag = h.mid(5).trimmed();
+    }
+    else if (h.toLower().startsWith("last-modified:"))
+    {
+        _lastModifiedHeader = h.mid(14).trimmed();
+    }
+    else if (h.toLower().startsWith("accept-ranges:"))
+    {
+        _acceptRanges = h.mid(14).trimmed().toLower() == "bytes";
+    }
+
+    if (header.compare(0, 6, "Date: ") == 0)
+    {
+        _serverTime = curl_getdate(header.data()+6, NULL);
+    }
+    else if (header.compare(0, 15, "Last-Modified: ") == 0)
+    {
+        _lastModified = curl_getdate(header.data()+15, NULL);
+    }
+    qDebug() << "Received header:" << QByteArray(header.c_str()).trimmed();
+}
+
+/* Offer the server to compress images that are not compressed, libcurl decodes them.
+   Ranges of encoded content are not ranges of the image, so resuming goes without */
+void DownloadThread::_setAcceptEncoding()
+{
+    static const QByteArray encodings = DownloadTransport::contentEncodings();
+    QString format = EncodingSelector::format(QUrl(QString::fromLatin1(_url)));
+    bool offer = _transport.transferCompression && !encodings.isEmpty() && _startOffset == 0
+            && (_url.startsWith("http://") || _url.startsWith("https://"))
+            && (format.isEmpty() || format == "raw");
+
+    curl_easy_setopt(_c, CURLOPT_ACCEPT_ENCODING, offer ? encodings.constData() : NULL);
+}
+
+/* Done with a response. Remember how much less came over the wire than was decoded */
+void DownloadThread::_settleEncoding()
+{
+    if (_contentEncoded && _decodedNow > _encodedNow)
+        _encodingSaved += _decodedNow - _encodedNow;
+    _contentEncoded = false;
+    _decodedNow = _encodedNow = 0;
+}
+
+void DownloadThread::cancelDownload()
+{
+    _cancelled = true;
+    _bandwidth.cancel();
+    for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+        target->cancelDownload();
+    //deleteDownloadedFile();
+}
+
+QByteArray DownloadThread::data()
+{
+    return _buf;
+}
+
+bool DownloadThread::successfull()
+{
+    return _successful;
+}
+
+void DownloadThread::setIfNoneMatch(const QByteArray &etag)
+{
+    _ifNoneMatch = etag;
+}
+
+bool DownloadThread::notModified()
+{
+    return _notModified;
+}
+
+QByteArray DownloadThread::etag()
+{
+    return _etag;
+}
+
+time_t DownloadThread::lastModified()
+{
+    return _lastModified;
+}
+
+time_t DownloadThread::serverTime()
+{
+    return _serverTime;
+}
+
+void DownloadThread::deleteDownloadedFile()
+{
+    if (!_filename.isEmpty())
+    {
+        _file.close();
+        if (_cachefile.isOpen())
+        {
+            /* Keep what was downloaded if the download can be resumed later */
+            if (_cacheEnabled && !_discardPartialCache && _writeCacheJournal() && _closeCacheFile())
+            {
+                qDebug() << "Keeping partial download of" << _cacheWritten << "bytes in cache for resuming";
+            }
+            else
+            {
+                _discardCacheFile();
+            }
+        }
+        if (_extractedCacheFile.isOpen())
+            _extractedCacheFile.remove();
+#ifdef Q_OS_WIN
+        _closeVolumes();
+#endif
+
+        if (!_filename.startsWith("/dev/") && !_filename.startsWith("\\\\.\\"))
+        {
+            //_file.remove();
+        }
+    }
+}
+
+uint64_t DownloadThread::dlNow()
+{
+    return _lastDlNow;
+}
+
+uint64_t DownloadThread::dlTotal()
+{
+    return _lastDlTotal;
+}
+
+uint64_t DownloadThread::verifyNow()
+{
+    /* Progress of the slowest device still verifying */
+    if (!_fanoutTargets.isEmpty())
+    {
+        uint64_t now = 0;
+        bool first = true;
+        for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+        {
+            if (target->failed())
+                continue;
+            now = first ? target->verifyNow() : qMin(now, target->verifyNow());
+            first = false;
+        }
+        return now;
+    }
+
+    return _lastVerifyNow;
+}
+
+uint64_t DownloadThread::verifyTotal()
+{
+    if (!_fanoutTargets.isEmpty())
+    {
+        uint64_t total = 0;
+        for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+            total = qMax(total, target->verifyTotal());
+        return total;
+    }
+
+    return _verifyTotal;
+}
+
+size_t DownloadThread::queueDepth() const
+{
+    return 0;
+}
+
+size_t DownloadThread::queueCapacity() const
+{
+    return 0;
+}
+
+QString DownloadThread::phaseName(Phase phase)
+{
+    static const char *names[PhaseCount] = {
+        "discard", "download", "decompress", "write", "fsync", "verify", "customize", "eject"
+    };
+
+    return names[phase];
+}
+
+void DownloadThread::_startPhase(Phase phase)
+{
+    _phaseTimers[phase].start();
+    _currentPhase = phase;
+    _publishProgress(true);
+    emit phaseStarted(phaseName(phase));
+}
+
+void DownloadThread::_endPhase(Phase phase, quint64 bytes)
+{
+    qint64 msecs = _phaseTimers[phase].isValid() ? _phaseTimers[phase].elapsed() : 0;
+    _publishProgress(true);
+
+    /* With fan-out targets, the targets count what they write and verify */
+    if (phase == PhaseDownload)
+    {
+        Metrics::add(Metrics::BytesDownloaded, bytes);
+    }
+    else if (phase == PhaseWrite && _fanoutTargets.isEmpty())
+    {
+        Metrics::add(Metrics::BytesWritten, bytes);
+        if (msecs > 0)
+            Metrics::observeWriteSpeed(_filename, bytes * 1000.0 / msecs);
+    }
+    else if (phase == PhaseVerify && _fanoutTargets.isEmpty())
+    {
+        Metrics::add(Metrics::BytesVerified, bytes);
+    }
+    emit phaseFinished(phaseName(phase), bytes, msecs);
+}
+
+QVariantMap DownloadThread::writeHealth()
+{
+    QVariantMap r = _writeHealth.report();
+    r["device"] = _filename;
+    return r;
+}
+
+ProgressSnapshot DownloadThread::progress()
+{
+    _progressPending = false;
+    return _progressSnapshot.load();
+}
+
+/* Called from the hot paths of every stage, so returns right away unless
+   PROGRESS_UPDATE_INTERVAL has passed. force at phase changes */
+void DownloadThread::_publishProgress(bool force)
+{
+    qint64 now = _progressClock.elapsed();
+    if (!force && now < _nextProgressPublish.load(std::memory_order_relaxed))
+        return;
+
+    if (!_progressSnapshot.beginWrite())
+    {
+        if (!force)
+            return; /* Someone else is publishing */
+        while (!_progressSnapshot.beginWrite())
+            QThread::yieldCurrentThread();
+    }
+    _nextProgressPublish.store(now + PROGRESS_UPDATE_INTERVAL, std::memory_order_relaxed);
+
+    ProgressSnapshot p = _progressSnapshot.current();
+    p.phase = _currentPhase;
+    p.dlNow = dlNow();
+    p.dlTotal = dlTotal();
+    p.bytesWritten = bytesWritten();
+    p.verifyNow = verifyNow();
+    p.verifyTotal = verifyTotal();
+    p.generation++;
+
+    /* Writing and decompressing keep up with the download, so their fraction done is the download's */
+    quint64 bytes = 0;
+    double fraction = -1;
+    switch (p.phase)
+    {
+    case PhaseDownload:
+        bytes = p.dlNow;
+        break;
+    case PhaseDecompress:
+    case PhaseWrite:
+        bytes = p.bytesWritten;
+        break;
+    case PhaseVerify:
+        bytes = p.verifyNow;
+        if (p.verifyTotal)
+            fraction = (double) p.verifyNow / p.verifyTotal;
+        break;
+    default:
+        break;
+    }
+    if (p.phase == PhaseDownload || p.phase == PhaseDecompress || p.phase == PhaseWrite)
+    {
+        if (p.dlTotal)
+            fraction = (double) p.dlNow / p.dlTotal;
+    }
+
+    if (p.phase != _progressPhase)
+    {
+        _progressPhase = p.phase;
+        _progressPhaseStartBytes = bytes;
+        _progressPhaseStartFraction = fraction;
+        _progressPhaseStartTime = now;
+    }
+
+    qint64 elapsed = now - _progressPhaseStartTime;
+    p.bytesPerSecond = (elapsed > 0 && bytes > _progressPhaseStartBytes) ? (bytes - _progressPhaseStartBytes) * 1000 / elapsed : 0;
+    if (fraction >= 1)
+        p.etaMsecs = 0;
+    else if (fraction > _progressPhaseStartFraction && _progressPhaseStartFraction >= 0 && elapsed > 0)
+        p.etaMsecs = (qint64) (elapsed * (1 - fraction) / (fraction - _progressPhaseStartFraction));
+    else
+        p.etaMsecs = -1;
+
+    _progressSnapshot.endWrite(p);
+
+    if (p.phase == PhaseWrite && _fanoutTargets.isEmpty() && _writeHealth.sampleDue())
+        _writeHealth.addSample(_readDeviceStats(), p.bytesWritten);
+
+    if (PipelineTrace::enabled())
+    {
+        PipelineTrace::counter("downloaded", p.dlNow);
+        PipelineTrace::counter("written", p.bytesWritten);
+        PipelineTrace::counter("verified", p.verifyNow);
+    }
+
+    if (!_progressPending.exchange(true))
+        emit progressChanged();
+    if (_progressListener)
+        _progressListener->_publishProgress(force);
+}
+
+uint64_t DownloadThread::streamableBytes()
+{
+    return _streamableBytes;
+}
+
+uint64_t DownloadThread::bytesWritten()
+{
+    /* Progress of the slowest device still writing */
+    if (!_fanoutTargets.isEmpty())
+    {
+        uint64_t written = 0;
+        bool first = true;
+        for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+        {
+            if (target->failed())
+                continue;
+            written = first ? target->bytesWritten() : qMin(written, target->bytesWritten());
+            first = false;
+        }
+        return written;
+    }
+
+    if (_sectorsStart != -1)
+        return qMin((uint64_t) (_sectorsWritten()-_sectorsStart)*512 + _bytesSkipped, (uint64_t) _bytesWritten);
+    else
+        return _bytesWritten;
+}
+
+void DownloadThread::_onDownloadSuccess()
+{
+    _writeComplete();
+}
+
+void DownloadThread::_onDownloadError(const QString &msg)
+{
+    _cancelled = true;
+    for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+        target->cancelDownload();
+    emit error(msg);
+}
+
+void DownloadThread::_onWriteError()
+{
+#ifdef Q_OS_WIN
+    if (_file.errorCode() == ERROR_ACCESS_DENIED)
+    {
+        QString msg = tr("Access denied error while writing file to disk.");
+        QSettings registry("HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows Defender\\Windows Defender Exploit Guard\\Controlled Folder Access",
+                           QSettings::Registry64Format);
+        if (registry.value("EnableControlledFolderAccess").toInt() == 1)
+        {
+            msg += "<br>"+tr("Controlled Folder Access seems to be enabled. Please add both gem-imager.exe and fat32format.exe to the list of allowed apps and try again.");
+        }
+        _onDownloadError(msg);
+    }
+    else
+#endif
+    if (!_cancelled)
+        _onDownloadError(tr("Error writing file to disk"));
+}
+
+void DownloadThread::_closeFiles()
+{
+    delete _device;
+    _device = nullptr;
+    _file.close();
+    _queueTuning.restore();
+#ifdef Q_OS_WIN
+    _closeVolumes();
+#endif
+    if (_cachefile.isOpen())
+        _closeCacheFile();
+    /* Only still open if the image was not written completely */
+    if (_extractedCacheFile.isOpen())
+        _extractedCacheFile.remove();
+}
+
+void DownloadThread::_writeComplete()
+{
+    if (_deltaWrite)
+        qDebug() << "Delta write:" << _bytesUnchanged/1024/1024 << "MB of" << _bytesWritten/1024/1024 << "MB already on the device";
+
+    QByteArray computedHash;
+    if (_inputVerified() || _imageCloned)
+    {
+        computedHash = _verifiedHash.toHex();
+        qDebug() << "Hash of uncompressed image (from cache sidecar):" << computedHash;
+    }
+    else
+    {
+        computedHash = _writehash.result().toHex();
+        qDebug() << "Hash of uncompressed image:" << computedHash;
+    }
+    if (!_expectedHash.isEmpty() && _expectedHash != computedHash)
+    {
+        qDebug() << "Mismatch with expected hash:" << _expectedHash;
+        _removeWriteJournal();
+        if (_cachefile.isOpen())
+            _discardCacheFile();
+        if (_extractedCacheFile.isOpen())
+            _extractedCacheFile.remove();
+        DownloadThread::_onDownloadError(tr("Download corrupt. Hash does not match"));
+        _closeFiles();
+        return;
+    }
+    if (_cacheEnabled && _expectedHash == computedHash)
+    {
+        if (_closeCacheFile())
+        {
+            CacheJournal::remove(_cachefile.fileName());
+            _writeCacheSidecar(_cachefile.fileName(), computedHash);
+            emit cacheFileUpdated(computedHash);
+        }
+        else
+        {
+            qDebug() << "Cache file is incomplete. Not keeping it";
+            _discardCacheFile();
+        }
+    }
+    if (_extractedCacheEnabled && _expectedHash == computedHash)
+    {
+        /* A trailing zero run was only seeked over. Extend the file over it as a hole,
+           so it is exactly the image that was hashed */
+        quint64 imageSize = _extractedCacheFile.pos();
+        if (_extractedCacheFile.resize(imageSize))
+        {
+            _extractedCacheFile.close();
+            _writeCacheSidecar(_extractedCacheFile.fileName(), computedHash, imageSize);
+            emit extractedCacheFileUpdated(computedHash);
+        }
+        else
+        {
+            qDebug() << "Error setting the length of the extracted image cache file. Not keeping it";
+            _extractedCacheFile.remove();
+        }
+    }
+
+    if (!_fanoutTargets.isEmpty())
+    {
+        _finishFanout();
+        return;
+    }
+
+    if (_outputStream)
+    {
+        /* Image ended before the end of the boot partition */
+        if (_capture && !_finishCapture(true))
+        {
+            _onWriteError();
+            return;
+        }
+        if (!_customizedInStream && _customizationRequested())
+        {
+            DownloadThread::_onDownloadError(tr("This image cannot be customized while it is sent to the device"));
+            return;
+        }
+        _endPhase(PhaseWrite, _bytesWritten);
+        qDebug() << "Image sent in" << _timer.elapsed() / 1000 << "seconds";
+
+        if (!_suppressSuccessSignal)
+            emit success();
+        return;
+    }
+
+    /* Image ended before the end of the boot partition */
+    if (_capture && !_finishCapture(true))
+    {
+        _onWriteError();
+        _closeFiles();
+        return;
+    }
+
+#ifndef Q_OS_WIN
+    /* Zero blocks at the end were skipped, but the file still has to be as long as the image */
+    if (_isNormalFile && _discardZeroes && ::ftruncate(_file.handle(), _file.pos()) != 0)
+    {
+        DownloadThread::_onDownloadError(tr("Error writing to storage (while flushing)"));
+        _closeFiles();
+        return;
+    }
+#endif
+
+    if (_bmap.isEmpty() && !_bmapSkipped.isEmpty() && !_zeroBmapSkipped())
+    {
+        DownloadThread::_onDownloadError(tr("Error writing to storage"));
+        _closeFiles();
+        return;
+    }
+
+    _endPhase(PhaseWrite, _bytesWritten);
+    _startPhase(PhaseFsync);
+    {
+        TraceSpan span("fsync");
+        if (!_file.flush())
+        {
+            DownloadThread::_onDownloadError(tr("Error writing to storage (while flushing)"));
+            _closeFiles();
+            return;
+        }
+
+        if (!_blockDevice()->flush()) {
+            DownloadThread::_onDownloadError(tr("Error writing to storage (while fsync)"));
+            _closeFiles();
+            return;
+        }
+    }
+
+    qDebug() << "Write done in" << _timer.elapsed() / 1000 << "seconds";
+    _endPhase(PhaseFsync, _bytesWritten);
+
+    /* Verify. A reflinked image file has the very extents of the cache file the sidecar vouches for */
+    if (_verifyEnabled && !_imageReflinked)
+    {
+        _startPhase(PhaseVerify);
+        if (!_verify())
+        {
+            /* Resuming would keep what does not match */
+            if (!_cancelled)
+            {
+                Metrics::add(Metrics::VerifyFailures);
+                _removeWriteJournal();
+            }
+            _closeFiles();
+            return;
+        }
+        if (_customizationMismatch)
+        {
+            Metrics::add(Metrics::VerifyFailures);
+            DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
+            _closeFiles();
+            return;
+        }
+        _endPhase(PhaseVerify, _verifyTotal);
+    }
+
+    emit finalizing();
+
+    /* The deferred first block is written together with the customization,
+       and covered by the single flush and fsync below */
+    if (!_writeFirstBlockTail())
+    {
+        qFreeAligned(_firstBlock);
+        _firstBlock = nullptr;
+
+        DownloadThread::_onDownloadError(tr("Error writing first block (partition table)"));
+        _closeFiles();
+        return;
+    }
+
+    if (!_customizedInStream && (_customizationRequested() || _destination == "uniflash"))
+    {
+        _startPhase(PhaseCustomize);
+        TraceSpan span("customize");
+        if (!_customizeImage())
+        {
+            _closeFiles();
+            return;
+        }
+        _endPhase(PhaseCustomize, 0);
+    }
+
+    if (_firstBlock && _expandRoot && !_writeExpandedFirstBlock())
+    {
+        _closeFiles();
+        return;
+    }
+
+    if (_firstBlock)
+    {
+        qDebug() << "Writing first block (which we skipped at first)";
+        if (_blockDevice()->pwrite(_firstBlock, _firstBlockSize, 0) != (qint64) _firstBlockSize)
+        {
+            qFreeAligned(_firstBlock);
+            _firstBlock = nullptr;
+
+            DownloadThread::_onDownloadError(tr("Error writing first block (partition table)"));
+            return;
+        }
+        _bytesWritten += _firstBlockSize;
+        qFreeAligned(_firstBlock);
+        _firstBlock = nullptr;
+    }
+
+    if (!_file.flush())
+    {
+        DownloadThread::_onDownloadError(tr("Error writing to storage (while flushing)"));
+        _closeFiles();
+        return;
+    }
+
+    if (!_blockDevice()->flush()) {
+        DownloadThread::_onDownloadError(tr("Error writing to storage (while fsync)"));
+        _closeFiles();
+        return;
+    }
+
+    _removeWriteJournal();
+    _closeFiles();
+
+#ifdef Q_OS_DARWIN
+    QThread::sleep(1);
+    _filename.replace("/dev/rdisk", "/dev/disk");
+#endif
+
+    if (_ejectEnabled && !_isNormalFile)
+    {
+        _startPhase(PhaseEject);
+        _eject(_filename, true);
+        _endPhase(PhaseEject, 0);
+    }
+
+    if (!_suppressSuccessSignal) {
+        emit success();
+    }
+}
+
+/* Writes all of the deferred first block except its first 4 KB. Those hold
+   the MBR and GPT header, and are written last, once everything else is out */
+bool DownloadThread::_writeFirstBlockTail()
+{
+    if (!_firstBlock || _firstBlockSize <= 4096)
+        return true;
+
+    qint64 len = _firstBlockSize-4096;
+    if (_blockDevice()->pwrite(_firstBlock+4096, len, 4096) != len)
+        return false;
+
+    _bytesWritten += len;
+    _firstBlockSize = 4096;
+
+    return true;
+}
+
+bool DownloadThread::_verify()
+{
+    /* Image may have been padded to a multiple of the sector size while writing */
+    quint64 imageSize = _file.pos();
+    if (!_fsSkipped.isEmpty())
+    {
+        return _verifyWritten();
+    }
+    else if (_bmap.hasChecksums() && imageSize >= _bmap.imageSize() && imageSize - _bmap.imageSize() < 512)
+    {
+        return _verifyBmap();
+    }
+    else if (!_bmap.isEmpty())
+    {
+        qDebug() << "bmap cannot be used for verification. Verifying whole image";
+    }
+
+    if (!_verifySource.isEmpty() && !_overlappedVerifyStarted)
+    {
+        /* Unmapped once source goes out of scope. Its size may lack the padding to the sector size */
+        QFile source(_verifySource);
+        uchar *map = nullptr;
+        if (source.open(QIODevice::ReadOnly) && (quint64) source.size() <= imageSize && imageSize - source.size() < 512 && source.size())
+            map = source.map(0, source.size());
+        if (map)
+            return _verifyCompare(map, source.size());
+
+        qDebug() << "Cannot map" << _verifySource << "to compare with. Verifying by hash";
+    }
+
+#ifndef Q_OS_WIN
+    if (_chunkedVerify)
+    {
+        _chunkhash.finalize();
+        if ((quint64) _chunkhash.leaves().size() == (imageSize + _chunkhash.chunkSize() - 1) / _chunkhash.chunkSize())
+            return _verifyChunked();
+
+        qDebug() << "Chunked hash does not cover whole image. Verifying sequentially";
+    }
+#endif
+
+    char *verifyBuf = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
+    _lastVerifyNow = 0;
+    _verifyTotal = _file.pos();
+    QElapsedTimer t1;
+    t1.start();
+
+#ifdef Q_OS_LINUX
+    /* Make sure we are reading from the drive and not from cache.
+       Only advisory, unless direct I/O is enabled */
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    if (_overlappedVerifyStarted)
+    {
+        /* Everything is on the device now. Let the verify thread read back
+           what is left, and only read a possible unaligned tail ourselves */
+        std::unique_lock<std::mutex> lock(_checkpointMutex);
+        _syncedUpTo = _verifyTotal.load();
+        lock.unlock();
+        _stopOverlappedVerify();
+
+        if (_overlappedVerifyError)
+        {
+            qFreeAligned(verifyBuf);
+            DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                "SD card may be broken."));
+            return false;
+        }
+        _lastVerifyNow = _overlappedVerifyNow.load();
+        qDebug() << "Overlapped verify read back" << _lastVerifyNow << "bytes while writing";
+    }
+    else
+    {
+        if (_firstBlock)
+        {
+            _verifyhash.addData(_firstBlock, _firstBlockSize);
+            _lastVerifyNow += _firstBlockSize;
+        }
+
+#ifdef Q_OS_LINUX
+        if (_ioUringEnabled && _verifyEnabled && !_verifyIoUring())
+        {
+            qFreeAligned(verifyBuf);
+            return false;
+        }
+#endif
+    }
+
+#ifdef Q_OS_DARWIN
+    /* Read back what is on the medium, even when writing went through the cache */
+    _file.setNoCache(true);
+#endif
+
+    while (_verifyEnabled && _lastVerifyNow < _verifyTotal && !_cancelled)
+    {
+        qint64 lenToRead = qMin((qint64) IMAGEWRITER_VERIFY_BLOCKSIZE, (qint64) (_verifyTotal-_lastVerifyNow) );
+        qint64 lenRead;
+        {
+            TraceSpan span("verifyRead");
+            lenRead = _blockDevice()->pread(verifyBuf, lenToRead, _lastVerifyNow);
+        }
+        if (lenRead <= 0)
+        {
+            DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                "SD card may be broken."));
+            return false;
+        }
+
+        _restoreCustomized(verifyBuf, lenRead, _lastVerifyNow);
+        _verifyhash.addData(verifyBuf, lenRead);
+        _lastVerifyNow += lenRead;
+        _publishProgress();
+    }
+    qFreeAligned(verifyBuf);
+
+    qDebug() << "Verify hash:" << _verifyhash.result().toHex();
+    qDebug() << "Verify done in" << t1.elapsed() / 1000.0 << "seconds";
+
+    if (_verifyhash.result() == (_inputVerified() ? _verifiedHash : _writehash.result()) || !_verifyEnabled || _cancelled)
+    {
+        return true;
+    }
+    else
+    {
+        _mismatchOffset = 0;
+        _mismatchLength = _verifyTotal;
+        DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
+    }
+
+    return false;
 }
 
-void DownloadThread::setCacheFile(const QString &filename, qint64 filesize)
+/* Called by the writer with how far it got, for writes that go through the page cache.
+   Otherwise all of the image would be dirty in memory when it has been written,
+   and the final fsync would take as long as writing it out to a slow card.
+   Writeback of each IMAGEWRITER_WRITEBACK_WINDOW is started as soon as it is complete,
+   and the writer waits for the one before it, keeping the card busy */
+void DownloadThread::_writeback(quint64 pos)
 {
-    _cachefile.setFileName(filename);
-    if (_cachefile.open(QIODevice::WriteOnly))
+#ifdef Q_OS_LINUX
+    if (_directIO || pos < _writebackPos + IMAGEWRITER_WRITEBACK_WINDOW)
+        return;
+
+    int fd = _file.handle();
+    if (!_file.flush())
+        return;
+
+    TraceSpan span("writeback");
+    if (::sync_file_range(fd, _writebackPos, pos - _writebackPos, SYNC_FILE_RANGE_WRITE) != 0)
+        qDebug() << "sync_file_range() failed:" << strerror(errno);
+
+    if (_writebackPos > _writebackDone)
     {
-        _cacheEnabled = true;
-        if (filesize)
+        if (::sync_file_range(fd, _writebackDone, _writebackPos - _writebackDone,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) != 0)
+            qDebug() << "sync_file_range() failed:" << strerror(errno);
+        /* Written out, no need to keep it cached */
+        posix_fadvise(fd, _writebackDone, _writebackPos - _writebackDone, POSIX_FADV_DONTNEED);
+    }
+
+    _writebackDone = _writebackPos;
+    _writebackPos = pos;
+#else
+    Q_UNUSED(pos)
+#endif
+}
+
+/* Called by the writer with the amount of image data written so far.
+   Every IMAGEWRITER_VERIFY_CHECKPOINT bytes, syncs it to the device and lets
+   the verify thread read it back while writing continues */
+void DownloadThread::_writeCheckpoint(quint64 pos)
+{
+#ifdef Q_OS_LINUX
+    if (!_overlappedVerify || !_verifyEnabled || !_firstBlock || _bmap.hasChecksums() || _chunkedVerify || _fsMapEnabled
+            || _capture || pos - _lastCheckpoint < IMAGEWRITER_VERIFY_CHECKPOINT)
+        return;
+
+    if (!_file.flush() || ::fdatasync(_file.handle()) != 0)
+    {
+        qDebug() << "Error syncing at verify checkpoint. Trying again at next one";
+        return;
+    }
+    /* Make sure the verify thread reads from the device, and not from cache */
+    posix_fadvise(_file.handle(), _lastCheckpoint, pos-_lastCheckpoint, POSIX_FADV_DONTNEED);
+    _lastCheckpoint = pos;
+
+    std::unique_lock<std::mutex> lock(_checkpointMutex);
+    _syncedUpTo = pos;
+    lock.unlock();
+    _checkpointCv.notify_all();
+
+    if (!_overlappedVerifyStarted)
+    {
+        _overlappedVerifyStarted = true;
+        _verifyThread->start();
+    }
+#else
+    Q_UNUSED(pos)
+#endif
+}
+
+/* Looks for the journal of an interrupted write of this image to this drive.
+   Resumes it if the drive still has what the journal recorded, else removes it,
+   as whatever it describes is about to be overwritten */
+void DownloadThread::_openWriteJournal()
+{
+    _writeJournalEnabled = _resumeEnabled && !_expectedHash.isEmpty() && _fanoutTargets.isEmpty()
+            && !_outputStream && !_streamingOutput && !_isNormalFile && _filename != "uniflash";
+    if (!_writeJournalEnabled)
+        return;
+
+    QByteArray drive = _driveId();
+    quint64 driveSize = _blockDevice()->size();
+    WriteJournal journal;
+    if (journal.load(drive))
+    {
+        if (journal.image != _expectedHash || journal.driveSize != driveSize)
+        {
+            qDebug() << "Write journal of the drive is for another image. Starting over";
+        }
+        else if (_readTailHash(journal.offset) != journal.tailHash)
+        {
+            qDebug() << "Drive no longer has the data of the interrupted write. Starting over";
+        }
+        else
+        {
+            qDebug() << "Resuming interrupted write at" << journal.offset/1024/1024 << "MB";
+            emit preparationStatusUpdate(tr("resuming interrupted write"));
+            _resumeOffset = journal.offset;
+            _writeJournal = journal;
+            return;
+        }
+        WriteJournal::remove(drive);
+    }
+
+    _writeJournal = WriteJournal();
+    _writeJournal.drive = drive;
+    _writeJournal.driveSize = driveSize;
+    _writeJournal.image = _expectedHash;
+}
+
+bool DownloadThread::_journalCheckpointDue(quint64 pos) const
+{
+    return _writeJournalEnabled && pos >= _writeJournal.offset + IMAGEWRITER_WRITE_JOURNAL_INTERVAL;
+}
+
+/* Called by the writers with nothing in flight, once _journalCheckpointDue().
+   Syncs everything written so far to the drive, and records it */
+void DownloadThread::_writeJournalCheckpoint(quint64 pos)
+{
+    TraceSpan span("writeJournal");
+    if (!_file.flush() || !_blockDevice()->flush())
+    {
+        qDebug() << "Error syncing at write journal checkpoint. Trying again at next one";
+        return;
+    }
+
+    QByteArray tailHash = _readTailHash(pos);
+    if (tailHash.isEmpty())
+        return;
+
+    _writeJournal.offset = pos;
+    _writeJournal.tailHash = tailHash;
+    _writeJournal.save();
+}
+
+void DownloadThread::_removeWriteJournal()
+{
+    if (_writeJournalEnabled)
+        WriteJournal::remove(_writeJournal.drive);
+}
+
+/* Hash of the IMAGEWRITER_WRITE_JOURNAL_TAIL bytes before pos, as read from the drive.
+   Empty if they cannot be read */
+QByteArray DownloadThread::_readTailHash(quint64 pos)
+{
+    const size_t len = IMAGEWRITER_WRITE_JOURNAL_TAIL;
+    if (pos < len || pos % 4096)
+        return QByteArray();
+
+    char *buf = (char *) qMallocAligned(len, 4096);
+    if (!buf)
+        return QByteArray();
+
+#ifdef Q_OS_LINUX
+    /* From the drive, not from what the page cache still has */
+    posix_fadvise(_file.handle(), pos-len, len, POSIX_FADV_DONTNEED);
+#endif
+    QByteArray hash;
+    if (_blockDevice()->pread(buf, len, pos-len) == (qint64) len)
+        hash = ChunkedHash::hash(buf, len);
+    else
+        qDebug() << "Error reading back write journal checkpoint:" << _blockDevice()->errorString();
+    qFreeAligned(buf);
+
+    return hash;
+}
+
+/* Tells drives apart across runs, and across being plugged into another port.
+   The CID of an SD card in a reader that exposes it, else the name udev gives
+   the drive, which has the model and serial number. The device path elsewhere,
+   the tail hash and drive size catch a different drive at the same path */
+QByteArray DownloadThread::_driveId()
+{
+#ifdef Q_OS_LINUX
+    if (_filename.startsWith("/dev/"))
+    {
+        QByteArray cid = _fileGetContentsTrimmed("/sys/block/"+_filename.mid(5)+"/device/cid");
+        if (!cid.isEmpty())
+            return "cid:"+cid;
+
+        QString device = QFileInfo(_filename).canonicalFilePath();
+        QDir byId("/dev/disk/by-id");
+        const QFileInfoList links = byId.entryInfoList(QDir::System | QDir::NoDotAndDotDot, QDir::Name);
+        for (const QFileInfo &link : links)
+        {
+            if (!link.fileName().startsWith("wwn-") && link.canonicalFilePath() == device)
+                return "id:"+link.fileName().toLatin1();
+        }
+    }
+#endif
+    return _filename;
+}
+
+/* Called by the writer with the amount of image data written so far */
+void DownloadThread::_publishStreamable(quint64 pos)
+{
+    if (_streamingOutput && qMin(pos, _streamHold) > _streamableBytes)
+    {
+        _streamableBytes = qMin(pos, _streamHold);
+        emit streamableBytesChanged();
+    }
+}
+
+/* Verify thread. Hashes data the writer synced to the device, in order.
+   The first block has not been written yet, and is hashed from memory */
+void DownloadThread::_overlappedVerifyRun()
+{
+#ifdef Q_OS_LINUX
+    char *verifyBuf = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
+    BlockDevice *device = _blockDevice();
+    quint64 pos = _firstBlockSize;
+
+    _verifyhash.addData(_firstBlock, _firstBlockSize);
+    _overlappedVerifyNow = pos;
+
+    while (!_cancelled)
+    {
+        std::unique_lock<std::mutex> lock(_checkpointMutex);
+        _checkpointCv.wait(lock, [this, pos]{
+            return _syncedUpTo > pos || _overlappedVerifyStop;
+        });
+        quint64 end = _syncedUpTo;
+        lock.unlock();
+        if (end <= pos)
+            break;
+
+        while (pos < end && !_cancelled)
+        {
+            qint64 len = qMin((quint64) IMAGEWRITER_VERIFY_BLOCKSIZE, end-pos);
+            if (_directIO && len % _directIOAlignment)
+            {
+                /* Unaligned tail. Leave it to _verify() */
+                qFreeAligned(verifyBuf);
+                return;
+            }
+
+            bool readOk;
+            {
+                TraceSpan span("verifyRead");
+                readOk = (device->pread(verifyBuf, len, pos) == len);
+            }
+            if (!readOk)
+            {
+                _overlappedVerifyError = true;
+                qFreeAligned(verifyBuf);
+                return;
+            }
+            _restoreCustomized(verifyBuf, len, pos);
+            _verifyhash.addData(verifyBuf, len);
+            pos += len;
+            _overlappedVerifyNow = pos;
+        }
+    }
+    qFreeAligned(verifyBuf);
+#endif
+}
+
+/* Wakes up the verify thread, and waits for it to finish reading
+   whatever was synced to the device so far */
+void DownloadThread::_stopOverlappedVerify()
+{
+    std::unique_lock<std::mutex> lock(_checkpointMutex);
+    _overlappedVerifyStop = true;
+    lock.unlock();
+    _checkpointCv.notify_all();
+    _verifyThread->wait();
+}
+
+#ifndef Q_OS_WIN
+/* Verify every chunk against its leaf hash. Chunks are read with pread()
+   from several threads at once, and hashed independently of each other */
+bool DownloadThread::_verifyChunked()
+{
+    const QVector<QByteArray> &leaves = _chunkhash.leaves();
+    const quint64 chunkSize = _chunkhash.chunkSize();
+    const int threads = qBound(1, QThread::idealThreadCount(), _budget.verifyThreads);
+    BlockDevice *device = _blockDevice();
+    std::atomic<int> nextLeaf(0), failedLeaf(-1);
+    std::atomic<bool> readError(false);
+    _lastVerifyNow = 0;
+    _verifyTotal = _file.pos();
+    QElapsedTimer t1;
+    t1.start();
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    auto worker = [&]() {
+        char *buf = (char *) qMallocAligned(chunkSize, 4096);
+        int i;
+
+        while (_verifyEnabled && !_cancelled && !readError && failedLeaf == -1
+               && (i = nextLeaf++) < leaves.size())
+        {
+            quint64 offset = i * chunkSize;
+            quint64 len = qMin(chunkSize, (quint64) (_verifyTotal-offset));
+            quint64 memLen = 0;
+
+            if (_firstBlock && offset < _firstBlockSize)
+            {
+                /* First block has not been written yet */
+                memLen = qMin(len, (quint64) _firstBlockSize-offset);
+                ::memcpy(buf, _firstBlock+offset, memLen);
+            }
+            if (memLen < len)
+            {
+                if (device->pread(buf+memLen, len-memLen, offset+memLen) != (qint64) (len-memLen))
+                {
+                    readError = true;
+                    break;
+                }
+            }
+            _restoreCustomized(buf, len, offset);
+
+            if (_chunkhash.hashLeaf(buf, len) != leaves[i])
+            {
+                /* Chunks before i are all taken, and are finished by their workers.
+                   So the lowest one failing is the first difference on the device */
+                int failed = failedLeaf;
+                while ((failed == -1 || i < failed) && !failedLeaf.compare_exchange_weak(failed, i))
+                    ;
+                break;
+            }
+            _lastVerifyNow += len;
+            _publishProgress();
+        }
+        qFreeAligned(buf);
+    };
+
+    QThreadPool pool;
+    pool.setMaxThreadCount(threads);
+    QVector<QFuture<void>> futures;
+    for (int i = 0; i < threads; i++)
+        futures.append(QtConcurrent::run(&pool, worker));
+    for (QFuture<void> &f : futures)
+        f.waitForFinished();
+
+    qDebug() << "Chunked verify of" << leaves.size() << ChunkedHash::algorithmName(_chunkhash.algorithm()) << "chunks using" << threads << "threads done in" << t1.elapsed() / 1000.0 << "seconds";
+    qDebug() << "Chunked hash root:" << _chunkhash.rootHash().toHex();
+
+    if (readError)
+    {
+        DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                            "SD card may be broken."));
+        return false;
+    }
+    if (failedLeaf != -1)
+    {
+        quint64 offset = failedLeaf * chunkSize;
+        qDebug() << "Mismatch in chunk" << failedLeaf << "at offset" << offset;
+        _mismatchOffset = offset;
+        _mismatchLength = qMin(chunkSize, (quint64) (_verifyTotal-offset));
+        DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it (at %1 MB).").arg(offset / 1048576));
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+/* Compare what is read back with the local copy of the image, see setVerifySource() */
+bool DownloadThread::_verifyCompare(const uchar *source, quint64 sourceSize)
+{
+    char *verifyBuf = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
+    _lastVerifyNow = 0;
+    _verifyTotal = _file.pos();
+    QElapsedTimer t1;
+    t1.start();
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+#ifdef Q_OS_DARWIN
+    _file.setNoCache(true);
+#endif
+
+    auto matches = [source, sourceSize](const char *buf, quint64 len, quint64 offset) {
+        /* Past the end of the source is padding */
+        quint64 inSource = offset < sourceSize ? qMin(len, sourceSize-offset) : 0;
+        return ::memcmp(buf, source+offset, inSource) == 0 && _isZeroBlock(buf+inSource, len-inSource);
+    };
+
+    if (_firstBlock && !matches(_firstBlock, _firstBlockSize, 0))
+    {
+        /* Not written yet, and kept for last. Nothing on the device was compared */
+        qFreeAligned(verifyBuf);
+        _mismatchOffset = 0;
+        _mismatchLength = _firstBlockSize;
+        DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it (at %1 MB).").arg(0));
+        return false;
+    }
+    if (_firstBlock)
+        _lastVerifyNow += _firstBlockSize;
+
+    while (_verifyEnabled && _lastVerifyNow < _verifyTotal && !_cancelled)
+    {
+        quint64 offset = _lastVerifyNow;
+        qint64 lenToRead = qMin((qint64) IMAGEWRITER_VERIFY_BLOCKSIZE, (qint64) (_verifyTotal-offset));
+        qint64 lenRead;
+        {
+            TraceSpan span("verifyRead");
+            lenRead = _blockDevice()->pread(verifyBuf, lenToRead, offset);
+        }
+        if (lenRead <= 0)
+        {
+            qFreeAligned(verifyBuf);
+            DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                "SD card may be broken."));
+            return false;
+        }
+
+        _restoreCustomized(verifyBuf, lenRead, offset);
+        if (!matches(verifyBuf, lenRead, offset))
+        {
+            quint64 at = offset;
+            while (at < offset+lenRead && verifyBuf[at-offset] == (at < sourceSize ? (char) source[at] : 0))
+                at++;
+            qDebug() << "Device differs from" << _verifySource << "at offset" << at;
+            qFreeAligned(verifyBuf);
+            _mismatchOffset = offset;
+            _mismatchLength = lenRead;
+            DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it (at %1 MB).").arg(at / 1048576));
+            return false;
+        }
+        _lastVerifyNow += lenRead;
+        _publishProgress();
+    }
+    qFreeAligned(verifyBuf);
+
+    qDebug() << "Compare verify against" << _verifySource << "done in" << t1.elapsed() / 1000.0 << "seconds";
+    return true;
+}
+
+/* Verify only the ranges mapped by bmap, against the SHA256 of each range */
+bool DownloadThread::_verifyBmap()
+{
+    char *verifyBuf = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
+    _lastVerifyNow = 0;
+    _verifyTotal = _bmap.mappedBytes();
+    QElapsedTimer t1;
+    t1.start();
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+
+    for (const BlockMap::Range &r : _bmap.ranges())
+    {
+        AcceleratedCryptographicHash rangehash(QCryptographicHash::Sha256);
+        quint64 pos = r.offset, end = r.offset + r.length;
+
+        while (pos < end && !_cancelled)
+        {
+            qint64 len = qMin((quint64) IMAGEWRITER_VERIFY_BLOCKSIZE, end-pos);
+
+            if (_firstBlock && pos < _firstBlockSize)
+            {
+                /* First block has not been written yet */
+                len = qMin((quint64) len, (quint64) _firstBlockSize-pos);
+                rangehash.addData(_firstBlock+pos, len);
+            }
+            else
+            {
+                bool readOk;
+                {
+                    TraceSpan span("verifyRead");
+                    readOk = _blockDevice()->pread(verifyBuf, len, pos) == len;
+                }
+                if (!readOk)
+                {
+                    qFreeAligned(verifyBuf);
+                    DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                        "SD card may be broken."));
+                    return false;
+                }
+                _restoreCustomized(verifyBuf, len, pos);
+                rangehash.addData(verifyBuf, len);
+            }
+
+            pos += len;
+            _lastVerifyNow += len;
+            _publishProgress();
+        }
+        if (_cancelled)
+            break;
+
+        if (rangehash.result().toHex() != r.sha256)
+        {
+            qDebug() << "Verify failed for range at offset" << r.offset << "length" << r.length;
+            _mismatchOffset = r.offset;
+            _mismatchLength = r.length;
+            qFreeAligned(verifyBuf);
+            DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
+            return false;
+        }
+    }
+    qFreeAligned(verifyBuf);
+
+    qDebug() << "Verified" << _bmap.ranges().size() << "bmap ranges in" << t1.elapsed() / 1000.0 << "seconds";
+
+    return true;
+}
+
+/* Reads back all but the file system free space that was left out, against the hash of what was written */
+bool DownloadThread::_verifyWritten()
+{
+    char *verifyBuf = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
+    quint64 imageSize = _file.pos(), skipped = 0;
+    for (const auto &r : std::as_const(_fsSkipped))
+        skipped += r.second - r.first;
+    _lastVerifyNow = 0;
+    _verifyTotal = imageSize - skipped;
+    QElapsedTimer t1;
+    t1.start();
+
+#ifdef Q_OS_LINUX
+    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+#ifdef Q_OS_DARWIN
+    _file.setNoCache(true);
+#endif
+
+    quint64 pos = 0;
+    int nextSkipped = 0;
+    while (pos < imageSize && !_cancelled)
+    {
+        if (nextSkipped < _fsSkipped.size() && pos >= _fsSkipped[nextSkipped].first)
         {
-            /* Pre-allocate space */
-            _cachefile.resize(filesize);
+            pos = _fsSkipped[nextSkipped++].second;
+            continue;
         }
+        quint64 end = nextSkipped < _fsSkipped.size() ? _fsSkipped[nextSkipped].first : imageSize;
+        qint64 len = qMin((quint64) IMAGEWRITER_VERIFY_BLOCKSIZE, end-pos);
+
+        if (_firstBlock && pos < _firstBlockSize)
+        {
+            /* First block has not been written yet */
+            len = qMin((quint64) len, (quint64) _firstBlockSize-pos);
+            _verifyhash.addData(_firstBlock+pos, len);
+        }
+        else
+        {
+            bool readOk;
+            {
+                TraceSpan span("verifyRead");
+                readOk = _blockDevice()->pread(verifyBuf, len, pos) == len;
+            }
+            if (!readOk)
+            {
+                qFreeAligned(verifyBuf);
+                DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                                    "SD card may be broken."));
+                return false;
+            }
+            _restoreCustomized(verifyBuf, len, pos);
+            _verifyhash.addData(verifyBuf, len);
+        }
+
+        pos += len;
+        _lastVerifyNow += len;
+        _publishProgress();
     }
-    else
-    {
-        qDebug() << "Error opening cache file for writing. Disabling caching.";
-    }
+    qFreeAligned(verifyBuf);
+
+    qDebug() << "Verified" << _verifyTotal << "bytes in" << t1.elapsed() / 1000.0 << "seconds, leaving out"
+             << skipped << "bytes of file system free space that was not written";
+
+    if (_verifyhash.result() == _usedHash.result() || _cancelled)
+        return true;
+
+    _mismatchOffset = 0;
+    _mismatchLength = imageSize;
+    DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
+    return false;
 }
 
-void DownloadThread::_hashData(const char *buf, size_t len)
+static size_t _curl_small_file_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
-    _writehash.addData(buf, len);
+    QByteArray *data = (QByteArray *) userdata;
+    size_t len = size * nmemb;
+
+    /* bmap and metalink files are small. Refuse anything unreasonably large */
+    if (data->size() + len > IMAGEWRITER_BMAP_MAXSIZE)
+        return 0;
+    data->append(ptr, len);
+
+    return len;
 }
 
-size_t DownloadThread::_writeFile(const char *buf, size_t len)
+bool DownloadThread::_fetchSmallFile(const QByteArray &url, QByteArray &data)
 {
-    if (_cancelled)
-        return len;
+    char errorBuf[CURL_ERROR_SIZE] = {0};
+    CURL *c = curl_easy_init();
+
+    curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, &_curl_small_file_write_callback);
+    curl_easy_setopt(c, CURLOPT_WRITEDATA, &data);
+    curl_easy_setopt(c, CURLOPT_URL, url.constData());
+    curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(c, CURLOPT_MAXREDIRS, 10);
+    curl_easy_setopt(c, CURLOPT_ERRORBUFFER, errorBuf);
+    curl_easy_setopt(c, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, 30);
+    curl_easy_setopt(c, CURLOPT_TIMEOUT, 60);
+    _transport.apply(c);
+    CurlShare::apply(c);
+    if (!_useragent.isEmpty())
+        curl_easy_setopt(c, CURLOPT_USERAGENT, _useragent.constData());
+    if (!_proxy.isEmpty())
+        curl_easy_setopt(c, CURLOPT_PROXY, _proxy.constData());
 
-    if (!_firstBlock)
-    {
-        _writehash.addData(buf, len);
-        _firstBlock = (char *) qMallocAligned(len, 4096);
-        _firstBlockSize = len;
-        ::memcpy(_firstBlock, buf, len);
+    CURLcode ret = curl_easy_perform(c);
+    curl_easy_cleanup(c);
 
-        return _file.seek(len) ? len : 0;
+    if (ret != CURLE_OK)
+    {
+        qDebug() << "Error downloading" << url << ":" << (errorBuf[0] ? errorBuf : curl_easy_strerror(ret));
+        return false;
     }
-#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
-    QFuture<void> wh = QtConcurrent::run(&DownloadThread::_hashData, this, buf, len);
-#else
-    QFuture<void> wh = QtConcurrent::run(this, &DownloadThread::_hashData, buf, len);
-#endif
 
-    qint64 written = _file.write(buf, len);
-    _bytesWritten += written;
+    return true;
+}
 
-    if ((size_t) written != len)
+/* Download and parse bmap. It only allows us to skip work, so if anything
+   goes wrong the whole image is written and verified as usual */
+void DownloadThread::_fetchBmap()
+{
+    QByteArray xml;
+
+    emit preparationStatusUpdate(tr("downloading block map"));
+    qDebug() << "bmap URL:" << _bmapUrl;
+    if (!_fetchSmallFile(_bmapUrl, xml))
     {
-        qDebug() << "Write error:" << _file.errorString() << "while writing len:" << len;
+        qDebug() << "No bmap. Writing whole image";
+        return;
     }
 
-    wh.waitForFinished();
-    return (written < 0) ? 0 : written;
+    if (_bmap.parse(xml) && _verifyEnabled && !_bmap.hasChecksums())
+    {
+        /* Unmapped ranges would not match when verifying the whole image */
+        qDebug() << "bmap has no SHA256 checksums to verify against. Ignoring it";
+        _bmap.clear();
+    }
 }
 
-bool DownloadThread::_progress(curl_off_t dltotal, curl_off_t dlnow, curl_off_t /*ultotal*/, curl_off_t /*ulnow*/)
+#ifdef Q_OS_LINUX
+/* Verify with several reads in flight, hashing blocks in order as they complete.
+   Returns false on read error. Leaves what it cannot handle (io_uring not
+   supported by kernel, unaligned tail with direct I/O) to the regular code path */
+bool DownloadThread::_verifyIoUring()
 {
-    if (dltotal)
-        _lastDlTotal = _startOffset + dltotal;
-    _lastDlNow   = _startOffset + dlnow;
+    const int depth = IMAGEWRITER_IOURING_VERIFY_DEPTH;
+    IoUring ring;
 
-    return !_cancelled;
-}
+    if (!ring.init(depth))
+    {
+        qDebug() << "io_uring not available. Using regular reads to verify";
+        return true;
+    }
 
-void DownloadThread::_header(const string &header)
-{
-    if (header.compare(0, 6, "Date: ") == 0)
+    QVector<char *> bufs(depth);
+    QVector<struct iovec> iov(depth);
+    QVector<qint64> lens(depth, 0);
+    QVector<bool> done(depth, false);
+    for (int i = 0; i < depth; i++)
     {
-        _serverTime = curl_getdate(header.data()+6, NULL);
+        bufs[i] = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
+        iov[i].iov_base = bufs[i];
+        iov[i].iov_len = IMAGEWRITER_VERIFY_BLOCKSIZE;
     }
-    else if (header.compare(0, 15, "Last-Modified: ") == 0)
+    ring.registerBuffers(iov.constData(), depth);
+
+    int fd = _file.handle();
+    quint64 nextOffset = _lastVerifyNow;
+    int head = 0, next = 0;
+    bool ok = true;
+
+    auto queueNext = [&]() {
+        qint64 len = qMin((qint64) IMAGEWRITER_VERIFY_BLOCKSIZE, (qint64) (_verifyTotal-nextOffset));
+        if (len <= 0 || (_directIO && len % _directIOAlignment))
+            return false;
+        if (!ring.queueRead(fd, bufs[next], len, nextOffset, next, next))
+            return false;
+
+        lens[next] = len;
+        nextOffset += len;
+        next = (next+1) % depth;
+        return true;
+    };
+
+    for (int i = 0; i < depth && queueNext(); i++) { }
+
+    while (ring.inFlight() && !_cancelled)
     {
-        _lastModified = curl_getdate(header.data()+15, NULL);
+        quint64 slot;
+        int res;
+
+        if (!ring.waitCompletion(&slot, &res) || res != lens[slot])
+        {
+            qDebug() << "io_uring read failed:" << (res < 0 ? strerror(-res) : "short read");
+            ok = false;
+            break;
+        }
+
+        done[slot] = true;
+        while (done[head])
+        {
+            _restoreCustomized(bufs[head], lens[head], _lastVerifyNow);
+            _verifyhash.addData(bufs[head], lens[head]);
+            _lastVerifyNow += lens[head];
+            _publishProgress();
+            done[head] = false;
+            head = (head+1) % depth;
+            queueNext();
+        }
     }
-    qDebug() << "Received header:" << QByteArray(header.c_str()).trimmed();
+
+    /* Buffers may not be freed while the kernel can still write to them */
+    while (ring.inFlight())
+    {
+        quint64 slot;
+        int res;
+        if (!ring.waitCompletion(&slot, &res))
+            return false;
+    }
+    for (char *buf : std::as_const(bufs))
+        qFreeAligned(buf);
+
+    if (!ok)
+    {
+        DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
+                                            "SD card may be broken."));
+    }
+
+    return ok;
 }
+#endif
 
-void DownloadThread::cancelDownload()
+void DownloadThread::setVerifyEnabled(bool verify)
 {
-    _cancelled = true;
-    //deleteDownloadedFile();
+    _verifyEnabled = verify;
 }
 
-QByteArray DownloadThread::data()
+void DownloadThread::setDirectIOEnabled(bool directIO)
 {
-    return _buf;
+    _directIO = directIO;
 }
 
-bool DownloadThread::successfull()
+void DownloadThread::setIoUringEnabled(bool ioUring)
 {
-    return _successful;
+    _ioUringEnabled = ioUring;
 }
 
-time_t DownloadThread::lastModified()
+void DownloadThread::setSparseWriteEnabled(bool sparse)
 {
-    return _lastModified;
+    _sparseWrite = sparse;
 }
 
-time_t DownloadThread::serverTime()
+void DownloadThread::setAsyncEjectEnabled(bool async)
 {
-    return _serverTime;
+    _asyncEject = async;
 }
 
-void DownloadThread::deleteDownloadedFile()
+/* Ejects outlive the DownloadThread that started them */
+static QThreadPool &ejectPool()
 {
-    if (!_filename.isEmpty())
-    {
-        _file.close();
-        if (_cachefile.isOpen())
-            _cachefile.remove();
-#ifdef Q_OS_WIN
-        _volumeFile.close();
-#endif
+    static QThreadPool pool;
+    return pool;
+}
 
-        if (!_filename.startsWith("/dev/") && !_filename.startsWith("\\\\.\\"))
-        {
-            //_file.remove();
-        }
+void DownloadThread::waitForEjects()
+{
+    ejectPool().waitForDone();
+}
+
+void DownloadThread::_eject(const QByteArray &device, bool powerOff)
+{
+    if (!_asyncEject)
+    {
+        _ejectNow(device, powerOff);
+        return;
     }
+
+    /* Volumes can take seconds to flush and let go. Nothing else is waiting for that */
+    ejectPool().start([device, powerOff]() {
+        _ejectNow(device, powerOff);
+        qDebug() << "Ejected" << device;
+    });
 }
 
-uint64_t DownloadThread::dlNow()
+void DownloadThread::_ejectNow(const QByteArray &device, bool powerOff)
 {
-    return _lastDlNow;
+    eject_disk(device.constData());
+#ifdef Q_OS_LINUX
+#ifndef QT_NO_DBUS
+    /* mountutils only implemented unmount and not eject on Linux. Do so through udisks2 */
+    if (powerOff)
+    {
+        UDisks2Api udisks;
+        udisks.ejectDrive(device);
+    }
+#else
+    Q_UNUSED(powerOff)
+#endif
+#else
+    Q_UNUSED(powerOff)
+#endif
 }
 
-uint64_t DownloadThread::dlTotal()
+void DownloadThread::setDeltaWriteEnabled(bool delta)
 {
-    return _lastDlTotal;
+    _deltaWrite = delta;
 }
 
-uint64_t DownloadThread::verifyNow()
+void DownloadThread::setResumeEnabled(bool resume)
 {
-    return _lastVerifyNow;
+    _resumeEnabled = resume;
 }
 
-uint64_t DownloadThread::verifyTotal()
+void DownloadThread::setCapacityProbeEnabled(bool probe)
 {
-    return _verifyTotal;
+    _capacityProbe = probe;
 }
 
-uint64_t DownloadThread::bytesWritten()
+void DownloadThread::setOverlappedVerifyEnabled(bool overlapped)
 {
-    if (_sectorsStart != -1)
-        return qMin((uint64_t) (_sectorsWritten()-_sectorsStart)*512, (uint64_t) _bytesWritten);
-    else
-        return _bytesWritten;
+    _overlappedVerify = overlapped;
 }
 
-void DownloadThread::_onDownloadSuccess()
+void DownloadThread::setChunkedVerifyEnabled(bool chunked)
 {
-    _writeComplete();
+    _chunkedVerify = chunked;
 }
 
-void DownloadThread::_onDownloadError(const QString &msg)
+void DownloadThread::setChunkedVerifyAlgorithm(ChunkedHash::Algorithm algorithm)
 {
-    _cancelled = true;
-    emit error(msg);
+    _chunkhash.setAlgorithm(algorithm);
 }
 
-void DownloadThread::_onWriteError()
+void DownloadThread::setQueueTuning(bool enabled, quint64 blockSize, unsigned queueDepth)
 {
-#ifdef Q_OS_WIN
-    if (_file.errorCode() == ERROR_ACCESS_DENIED)
-    {
-        QString msg = tr("Access denied error while writing file to disk.");
-        QSettings registry("HKEY_LOCAL_MACHINE\\SOFTWARE\\Microsoft\\Windows Defender\\Windows Defender Exploit Guard\\Controlled Folder Access",
-                           QSettings::Registry64Format);
-        if (registry.value("EnableControlledFolderAccess").toInt() == 1)
-        {
-            msg += "<br>"+tr("Controlled Folder Access seems to be enabled. Please add both gem-imager.exe and fat32format.exe to the list of allowed apps and try again.");
-        }
-        _onDownloadError(msg);
-    }
-    else
-#endif
-    if (!_cancelled)
-        _onDownloadError(tr("Error writing file to disk"));
+    _queueTuning.setEnabled(enabled);
+    _queueTuning.setProfile(blockSize, queueDepth);
 }
 
-void DownloadThread::_closeFiles()
+void DownloadThread::setInStreamCustomizationEnabled(bool enabled)
 {
-    _file.close();
-#ifdef Q_OS_WIN
-    _volumeFile.close();
-#endif
-    if (_cachefile.isOpen())
-        _cachefile.close();
+    _inStreamCustomization = enabled;
 }
 
-void DownloadThread::_writeComplete()
+void DownloadThread::setExpandRootPartitionEnabled(bool enabled)
 {
-    QByteArray computedHash = _writehash.result().toHex();
-    qDebug() << "Hash of uncompressed image:" << computedHash;
-    if (!_expectedHash.isEmpty() && _expectedHash != computedHash)
-    {
-        qDebug() << "Mismatch with expected hash:" << _expectedHash;
-        if (_cachefile.isOpen())
-            _cachefile.remove();
-        DownloadThread::_onDownloadError(tr("Download corrupt. Hash does not match"));
-        _closeFiles();
-        return;
-    }
-    if (_cacheEnabled && _expectedHash == computedHash)
-    {
-        _cachefile.close();
-        emit cacheFileUpdated(computedHash);
-    }
+    _expandRoot = enabled;
+}
 
-    if (!_file.flush())
-    {
-        DownloadThread::_onDownloadError(tr("Error writing to storage (while flushing)"));
-        _closeFiles();
-        return;
-    }
+void DownloadThread::setStreamingOutputEnabled(bool streaming)
+{
+    _streamingOutput = streaming;
+}
 
-#ifndef Q_OS_WIN
-    if (::fsync(_file.handle()) != 0) {
-        DownloadThread::_onDownloadError(tr("Error writing to storage (while fsync)"));
-        _closeFiles();
-        return;
-    }
-#endif
+void DownloadThread::setOutputStream(RingBuffer *stream)
+{
+    _outputStream = stream;
+    _outputStreamPos = 0;
+}
 
-    qDebug() << "Write done in" << _timer.elapsed() / 1000 << "seconds";
+void DownloadThread::setBmapUrl(const QByteArray &url)
+{
+    _bmapUrl = url;
+}
 
-    /* Verify */
-    if (_verifyEnabled && !_verify())
-    {
-        _closeFiles();
-        return;
-    }
+/* Free space is only left out after a discard, so the old contents of the drive do not
+   linger in it, and not with anything that needs all of the image on the device. A resumed
+   write leaves out what it would have, whether the write it resumes did or not */
+bool DownloadThread::_fsMapUsable() const
+{
+    return _sparseWrite && (_discarded || _resumeOffset) && _bmap.isEmpty() && !_isNormalFile
+            && !_deltaWrite && !_streamingOutput;
+}
 
-    emit finalizing();
+bool DownloadThread::_canSkipBlock(const char *buf, size_t len, quint64 offset)
+{
+    /* Written by the interrupted write this one resumes */
+    if (offset + len <= _resumeOffset)
+        return true;
 
-    if (!_config.isEmpty() || !_cmdline.isEmpty() || !_firstrun.isEmpty() || !_cloudinit.isEmpty() || !_geminit.isEmpty() || _destination == "uniflash")
+    if (!_bmap.isEmpty() && !_bmap.isMapped(offset, len))
     {
-        if (!_customizeImage())
+        /* Unmapped ranges are holes in the image, so can only contain zeroes.
+           If not, the bmap does not belong to this image. Stop using it */
+        if (_isZeroBlock(buf, len))
         {
-            _closeFiles();
-            return;
+            if (!_bmapSkipped.isEmpty() && _bmapSkipped.last().second == offset)
+                _bmapSkipped.last().second = offset+len;
+            else
+                _bmapSkipped.append({offset, offset+len});
+            return true;
         }
+
+        qDebug() << "Data found in range not mapped by bmap at offset" << offset << ". Ignoring bmap";
+        _bmap.clear();
     }
 
-    if (_firstBlock)
+    if (_deltaWrite && _deviceHas(buf, len, offset))
     {
-        qDebug() << "Writing first block (which we skipped at first)";
-        _file.seek(0);
-        if (!_file.write(_firstBlock, _firstBlockSize) || !_file.flush())
-        {
-            qFreeAligned(_firstBlock);
-            _firstBlock = nullptr;
-
-            DownloadThread::_onDownloadError(tr("Error writing first block (partition table)"));
-            return;
-        }
-        _bytesWritten += _firstBlockSize;
-        qFreeAligned(_firstBlock);
-        _firstBlock = nullptr;
+        _bytesUnchanged += len;
+        return true;
     }
 
-    if (!_file.flush())
+    /* Image files are truncated when opened, and always written sparse */
+    return (_sparseWrite || _isNormalFile) && _discardZeroes && _isZeroBlock(buf, len);
+}
+
+/* Delta write: whether the device has the block at offset already. When reflashing
+   a slightly newer image, most blocks do, and reading them is much cheaper than
+   writing them on SD cards and eMMC, and does not wear the flash. The data is
+   at hand, so it is compared as is rather than by hash */
+bool DownloadThread::_deviceHas(const char *buf, size_t len, quint64 offset)
+{
+#ifdef Q_OS_WIN
+    /* No positional reads next to the overlapped writes */
+    Q_UNUSED(buf)
+    Q_UNUSED(len)
+    Q_UNUSED(offset)
+    return false;
+#else
+    if (offset % _directIOAlignment || len % _directIOAlignment)
+        return false;
+
+    if (_deltaBufSize < len)
     {
-        DownloadThread::_onDownloadError(tr("Error writing to storage (while flushing)"));
-        _closeFiles();
-        return;
+        if (_deltaBuf)
+            qFreeAligned(_deltaBuf);
+        _deltaBuf = (char *) qMallocAligned(len, 4096);
+        _deltaBufSize = _deltaBuf ? len : 0;
+        if (!_deltaBuf)
+            return false;
     }
 
-#ifndef Q_OS_WIN
-    if (::fsync(_file.handle()) != 0) {
-        DownloadThread::_onDownloadError(tr("Error writing to storage (while fsync)"));
-        _closeFiles();
-        return;
-    }
+    TraceSpan span("deltaRead");
+    return _blockDevice()->pread(_deltaBuf, len, offset) == (qint64) len && ::memcmp(_deltaBuf, buf, len) == 0;
 #endif
+}
 
-    _closeFiles();
-
-#ifdef Q_OS_DARWIN
-    QThread::sleep(1);
-    _filename.replace("/dev/rdisk", "/dev/disk");
+void DownloadThread::_setCopySource(int fd, quint64 offset)
+{
+#ifdef Q_OS_LINUX
+    /* With O_DIRECT, write() from the mapping of the source is already without a copy */
+    if (_kernelCopy && !_directIO && _fanoutTargets.isEmpty())
+    {
+        _copySourceFd = fd;
+        _copySourceOffset = offset;
+    }
+#else
+    Q_UNUSED(fd)
+    Q_UNUSED(offset)
 #endif
+}
 
-    if (_ejectEnabled)
-    {
-        eject_disk(_filename.constData());
+/* Writes len bytes at the current position from the copy source with sendfile(),
+   from page cache to page cache. copy_file_range() would be the obvious choice,
+   but does not accept block devices. Falls back to writing buf. Moving the position
+   past what was written is up to the caller */
+qint64 DownloadThread::_copyFromSource(int fd, const char *buf, size_t len)
+{
 #ifdef Q_OS_LINUX
-#ifndef QT_NO_DBUS
-        /* mountutils only implemented unmount and not eject on Linux. Do so through udisks2 */
-        UDisks2Api udisks;
-        udisks.ejectDrive(_filename);
-#endif
-#endif
+    qint64 pos = _file.pos();
+    off_t in = _copySourceOffset;
+    size_t done = 0;
+
+    if (::lseek(_file.handle(), pos, SEEK_SET) == pos)
+    {
+        while (done < len)
+        {
+            ssize_t n = ::sendfile(_file.handle(), fd, &in, len-done);
+            if (n > 0)
+                done += n;
+            else if (n == 0 || errno != EINTR)
+                break;
+        }
     }
 
-    if (!_suppressSuccessSignal) {
-        emit success();
+    if (!done && (errno == EINVAL || errno == ENOSYS))
+    {
+        qDebug() << "sendfile() to the device not supported. Writing from user space";
+        _kernelCopy = false;
+    }
+    else if (done < len)
+    {
+        qDebug() << "sendfile() failed after" << done << "bytes:" << strerror(errno);
     }
+
+    if (done == len)
+        return len;
+    qint64 rest = _blockDevice()->pwrite(buf+done, len-done, pos+done);
+    return rest < 0 ? -1 : (qint64) done + rest;
+#else
+    Q_UNUSED(fd)
+    return _blockDevice()->pwrite(buf, len, _file.pos());
+#endif
 }
 
-bool DownloadThread::_verify()
+/* Image file destination: makes it a copy of the len bytes of the image file fd without
+   reading the data. Shares the extents of fd if the file system can (FICLONE on btrfs, XFS
+   and bcachefs), copies the data ranges with copy_file_range() otherwise, which leaves the
+   holes alone and lets the file system copy on its own. Returns false with the file
+   empty again if neither works */
+bool DownloadThread::_cloneImageFile(int fd, quint64 len)
 {
-    char *verifyBuf = (char *) qMallocAligned(IMAGEWRITER_VERIFY_BLOCKSIZE, 4096);
-    _lastVerifyNow = 0;
-    _verifyTotal = _file.pos();
-    QElapsedTimer t1;
-    t1.start();
-
 #ifdef Q_OS_LINUX
-    /* Make sure we are reading from the drive and not from cache */
-    //fcntl(_file.handle(), F_SETFL, O_DIRECT | fcntl(_file.handle(), F_GETFL));
-    posix_fadvise(_file.handle(), 0, 0, POSIX_FADV_DONTNEED);
-#endif
+    int out = _file.handle();
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || (quint64) st.st_size != len || ::ftruncate(out, 0) != 0)
+        return false;
 
-    if (!_firstBlock)
+    if (::ioctl(out, FICLONE, fd) == 0)
     {
-        _file.seek(0);
+        qDebug() << "Image file shares its data with the extracted cache file (reflink)";
+        _imageReflinked = true;
     }
     else
     {
-        _verifyhash.addData(_firstBlock, _firstBlockSize);
-        _file.seek(_firstBlockSize);
-        _lastVerifyNow += _firstBlockSize;
-    }
-
-    while (_verifyEnabled && _lastVerifyNow < _verifyTotal && !_cancelled)
-    {
-        qint64 lenRead = _file.read(verifyBuf, qMin((qint64) IMAGEWRITER_VERIFY_BLOCKSIZE, (qint64) (_verifyTotal-_lastVerifyNow) ));
-        if (lenRead == -1)
+        qDebug() << "Cannot reflink image file:" << strerror(errno) << "- copying it with copy_file_range()";
+        off_t pos = 0;
+        while ((quint64) pos < len && !_cancelled)
         {
-            DownloadThread::_onDownloadError(tr("Error reading from storage.<br>"
-                                                "SD card may be broken."));
+            /* No more data is ENXIO. Without SEEK_DATA support, all of it is data */
+            off_t data = ::lseek(fd, pos, SEEK_DATA);
+            if (data == -1 && errno == ENXIO)
+                break;
+            off_t hole = data == -1 ? -1 : ::lseek(fd, data, SEEK_HOLE);
+            if (data == -1)
+                data = pos;
+            if (hole == -1)
+                hole = len;
+
+            off_t in = data, outPos = data;
+            while (in < hole && !_cancelled)
+            {
+                ssize_t n = ::copy_file_range(fd, &in, out, &outPos, qMin((off_t) IMAGEWRITER_CLONE_READ_SIZE, hole-in), 0);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                {
+                    qDebug() << "copy_file_range() failed at offset" << in << ":" << strerror(errno);
+                    (void) ::ftruncate(out, 0);
+                    return false;
+                }
+                _bytesWritten += n;
+                _publishProgress();
+            }
+            pos = hole;
+        }
+        if (_cancelled || ::ftruncate(out, len) != 0)
+        {
+            (void) ::ftruncate(out, 0);
             return false;
         }
-
-        _verifyhash.addData(verifyBuf, lenRead);
-        _lastVerifyNow += lenRead;
     }
-    qFreeAligned(verifyBuf);
 
-    qDebug() << "Verify hash:" << _verifyhash.result().toHex();
-    qDebug() << "Verify done in" << t1.elapsed() / 1000.0 << "seconds";
+    _bytesWritten = len;
+    _imageCloned = true;
+    return _file.seek(len);
+#else
+    Q_UNUSED(fd)
+    Q_UNUSED(len)
+    return false;
+#endif
+}
 
-    if (_verifyhash.result() == _writehash.result() || !_verifyEnabled || _cancelled)
+/* Zero runs of the image on devices that can write zeroes themselves (BLKZEROOUT on Linux),
+   or in files that can allocate zeroed ranges, instead of sending the data.
+   Returns false if the block has to be written as usual */
+bool DownloadThread::_zeroOutBlock(const char *buf, size_t len, quint64 offset)
+{
+    if (!_zeroOut || offset % 512 || len % 512 || !_isZeroBlock(buf, len))
+        return false;
+
+    if (!_blockDevice()->zeroOut(offset, len))
     {
-        return true;
+        qDebug() << _blockDevice()->errorString() << "- writing zeroes from now on";
+        _zeroOut = false;
+        return false;
     }
-    else
+    return true;
+}
+
+/* The bmap was dropped partway through, and the unmapped ranges skipped until then
+   still hold what the device had before. The image has zeroes there, and the whole
+   of it is verified now, so they are written after all */
+bool DownloadThread::_zeroBmapSkipped()
+{
+    BlockDevice *device = _blockDevice();
+    const size_t bufSize = IMAGEWRITER_BLOCKSIZE;
+    char *zeroes = nullptr;
+    bool ok = true;
+
+    qDebug() << "Zeroing" << _bmapSkipped.size() << "ranges skipped before the bmap was dropped";
+    for (const auto &r : std::as_const(_bmapSkipped))
     {
-        DownloadThread::_onDownloadError(tr("Verifying write failed. Contents of SD card is different from what was written to it."));
+        if ((device->capabilities() & BlockDevice::CanZeroOut) && device->zeroOut(r.first, r.second - r.first))
+            continue;
+
+        if (!zeroes)
+        {
+            zeroes = (char *) qMallocAligned(bufSize, 4096);
+            if (!zeroes)
+            {
+                ok = false;
+                break;
+            }
+            memset(zeroes, 0, bufSize);
+        }
+        for (quint64 pos = r.first; pos < r.second && ok && !_cancelled; pos += bufSize)
+        {
+            size_t len = qMin((quint64) bufSize, r.second - pos);
+            ok = device->pwrite(zeroes, len, pos) == (qint64) len;
+        }
+        if (!ok)
+        {
+            qDebug() << "Zeroing skipped range failed:" << device->errorString();
+            break;
+        }
     }
 
-    return false;
+    if (zeroes)
+        qFreeAligned(zeroes);
+    _bmapSkipped.clear();
+    return ok;
 }
 
-void DownloadThread::setVerifyEnabled(bool verify)
+/* Returns true if buffer only contains zeroes */
+bool DownloadThread::_isZeroBlock(const char *buf, size_t len)
 {
-    _verifyEnabled = verify;
+    return SparseImageEncoder::isZero(buf, len);
 }
 
 bool DownloadThread::isImage()
@@ -871,24 +4164,87 @@ void DownloadThread::setInputBufferSize(int len)
     _inputBufferSize = len;
 }
 
+void DownloadThread::setMemoryBudget(const MemoryBudget &budget)
+{
+    _budget = budget;
+}
+
+void DownloadThread::setDownloadSegments(int segments)
+{
+    _downloadSegments = segments;
+}
+
+void DownloadThread::setPeerCacheEnabled(bool enabled)
+{
+    _peerCache = enabled;
+}
+
+void DownloadThread::setMirrors(const QList<QByteArray> &urls, const QByteArray &metalinkUrl)
+{
+    _mirrorUrls = urls;
+    _metalinkUrl = metalinkUrl;
+}
+
+void DownloadThread::setMultiSourceEnabled(bool enabled)
+{
+    _multiSource = enabled;
+}
+
+void DownloadThread::setBandwidthPriority(BandwidthScheduler::Priority priority)
+{
+    _bandwidth.setPriority(priority);
+}
+
 qint64 DownloadThread::_sectorsWritten()
 {
+#ifdef Q_OS_LINUX
+    WriteHealth::DeviceStats stats = _readDeviceStats();
+    if (stats.valid)
+        return stats.sectorsWritten;
+#endif
+    return -1;
+}
+
+WriteHealth::DeviceStats DownloadThread::_readDeviceStats()
+{
+    WriteHealth::DeviceStats s = {};
+
 #ifdef Q_OS_LINUX
     if (!_filename.startsWith("/dev/"))
-        return -1;
+        return s;
 
     QFile f("/sys/class/block/"+_filename.mid(5)+"/stat");
     if (!f.open(f.ReadOnly))
-        return -1;
+        return s;
     QByteArray ioline = f.readAll().simplified();
     f.close();
 
+    /* Documentation/block/stat.rst */
     QList<QByteArray> stats = ioline.split(' ');
-
-    if (stats.count() >= 6)
-        return stats.at(6).toLongLong(); /* write sectors */
+    if (stats.count() >= 10)
+    {
+        s.writesCompleted = stats.at(4).toULongLong();
+        s.sectorsWritten = stats.at(6).toULongLong();
+        s.writeTicks = stats.at(7).toULongLong();
+        s.inFlight = stats.at(8).toULongLong();
+        s.ioTicks = stats.at(9).toULongLong();
+        s.valid = true;
+    }
+#elif defined(Q_OS_WIN)
+    /* Times are in 100 ns units. Busy time is the time since the counters started that was not idle */
+    DISK_PERFORMANCE perf;
+    DWORD bytesReturned;
+    if (_file.isOpen() && _file.ioControl(IOCTL_DISK_PERFORMANCE, NULL, 0, &perf, sizeof(perf), &bytesReturned))
+    {
+        s.writesCompleted = perf.WriteCount;
+        s.sectorsWritten = perf.BytesWritten.QuadPart / 512;
+        s.writeTicks = perf.WriteTime.QuadPart / 10000;
+        s.inFlight = perf.QueueDepth;
+        s.ioTicks = (perf.QueryTime.QuadPart - perf.IdleTime.QuadPart) / 10000;
+        s.valid = true;
+    }
 #endif
-    return -1;
+    return s;
 }
 
 void DownloadThread::setImageCustomization(const QByteArray &config, const QByteArray &cmdline, const QByteArray &firstrun, const QByteArray &cloudinit, const QByteArray &cloudInitNetwork, const QByteArray &geminit, const QByteArray &initFormat, const QByteArray &destination)
@@ -903,128 +4259,302 @@ void DownloadThread::setImageCustomization(const QByteArray &config, const QByte
     _destination = destination;
 }
 
+/* Changes the files on the boot partition. Throws std::runtime_error */
+void DownloadThread::_applyCustomization(DeviceWrapper &dw)
+{
+    /* Copies, as this may run again after writing if in-stream customization fails */
+    QByteArray initFormat = _initFormat, extraCmdline = _cmdline, cloudinit = _cloudinit;
+    DeviceWrapperFatPartition *fat = dw.fatPartition(1);
+
+    if (!_config.isEmpty())
+    {
+        auto configItems = _config.split('\n');
+        configItems.removeAll("");
+        QByteArray config = fat->readFile("config.txt");
+
+        for (const QByteArray& item : std::as_const(configItems))
+        {
+            if (config.contains("#"+item)) {
+                /* Uncomment existing line */
+                config.replace("#"+item, item);
+            } else if (config.contains("\n"+item)) {
+                /* config.txt already contains the line */
+            } else {
+                /* Append new line to config.txt */
+                if (config.right(1) != "\n")
+                    config += "\n"+item+"\n";
+                else
+                    config += item+"\n";
+            }
+        }
+
+        fat->writeFile("config.txt", config);
+    }
+
+    if (initFormat == "auto")
+    {
+        /* Do an attempt at auto-detecting what customization format a custom
+           image provided by the user supports */
+        QByteArray issue = fat->readFile("issue.txt");
+
+        if (fat->fileExists("user-data"))
+        {
+            /* If we have user-data file on FAT partition, then it must be cloudinit */
+            initFormat = "cloudinit";
+            qDebug() << "user-data found on FAT partition. Assuming cloudinit support";
+        }
+        else if (issue.contains("pi-gen"))
+        {
+            /* If issue.txt mentions pi-gen, and there is no user-data file assume
+             * it is a RPI OS flavor, and use the old systemd unit firstrun script stuff */
+            initFormat = "systemd";
+            qDebug() << "using firstrun script invoked by systemd customization method";
+        }
+        else
+        {
+            /* Fallback to writing cloudinit file, as it does not hurt having one
+             * Will just have no customization if OS does not support it */
+            initFormat = "cloudinit";
+            qDebug() << "Unknown what customization method image supports. Falling back to cloudinit";
+        }
+    }
+
+    if (!_firstrun.isEmpty() && initFormat == "systemd")
+    {
+        fat->writeFile("firstrun.sh", _firstrun);
+        extraCmdline += " systemd.run=/boot/firstrun.sh systemd.run_success_action=reboot systemd.unit=kernel-command-line.target";
+    }
+
+    if (!cloudinit.isEmpty() && initFormat == "cloudinit")
+    {
+        cloudinit = "#cloud-config\n"+cloudinit;
+        fat->writeFile("user-data", cloudinit);
+    }
+
+    if (!_cloudinitNetwork.isEmpty() && initFormat == "cloudinit")
+    {
+        fat->writeFile("network-config", _cloudinitNetwork);
+    }
+
+    if (!_geminit.isEmpty() && initFormat == "geminit")
+    {
+        fat->writeFile("config.ini", _geminit);
+    }
+    
+    // For uniflash mode, always modify uEnv.txt to use mmc0 (eMMC)
+    // This is needed regardless of whether geminit config was set
+    if(_destination == "uniflash"){
+        qDebug() << "Modifying uEnv.txt for" << _destination << "mode (mmc0/eMMC)";
+        QByteArray uenv = fat->readFile("uEnv.txt");
+        uenv.replace("mmcblk1", "mmcblk0");
+        uenv.replace("bootpart=1:1", "bootpart=0:1");
+        fat->writeFile("uEnv.txt", uenv);
+    }
+
+    if (!extraCmdline.isEmpty())
+    {
+        QByteArray cmdline = fat->readFile("cmdline.txt").trimmed();
+
+        cmdline += extraCmdline;
+
+        fat->writeFile("cmdline.txt", cmdline);
+    }
+}
+
 bool DownloadThread::_customizeImage()
 {
     emit preparationStatusUpdate(tr("Customizing image"));
 
     try
     {
-        DeviceWrapper dw(&_file);
+        std::unique_ptr<DeviceWrapper> dwp(_newDeviceWrapper());
+        DeviceWrapper &dw = *dwp;
         if (_firstBlock)
         {
             /* Outsource first block handling to DeviceWrapper.
                It will still not actually be written out yet,
                until we call sync(), and then it will
-               save the first 4k sector with MBR for last */
+               save the first 4k sector with MBR for last.
+               Only that sector is left by now, see _writeFirstBlockTail() */
             dw.pwrite(_firstBlock, _firstBlockSize, 0);
             _bytesWritten += _firstBlockSize;
             qFreeAligned(_firstBlock);
             _firstBlock = nullptr;
         }
-        DeviceWrapperFatPartition *fat = dw.fatPartition(1);
+        _applyCustomization(dw);
+        _expandRootPartition(dw);
+        dw.sync();
+    }
+    catch (std::runtime_error &err)
+    {
+        emit error(err.what());
+        return false;
+    }
 
-        if (!_config.isEmpty())
-        {
-            auto configItems = _config.split('\n');
-            configItems.removeAll("");
-            QByteArray config = fat->readFile("config.txt");
+    emit finalizing();
 
-            for (const QByteArray& item : std::as_const(configItems))
-            {
-                if (config.contains("#"+item)) {
-                    /* Uncomment existing line */
-                    config.replace("#"+item, item);
-                } else if (config.contains("\n"+item)) {
-                    /* config.txt already contains the line */
-                } else {
-                    /* Append new line to config.txt */
-                    if (config.right(1) != "\n")
-                        config += "\n"+item+"\n";
-                    else
-                        config += item+"\n";
-                }
-            }
+    return true;
+}
 
-            fat->writeFile("config.txt", config);
-        }
+/* Only a device has an end to grow to. A streamed uniflash image is read while it is written */
+void DownloadThread::_expandRootPartition(DeviceWrapper &dw)
+{
+    if (!_expandRoot || _isNormalFile || _streamingOutput)
+        return;
 
-        if (_initFormat == "auto")
-        {
-            /* Do an attempt at auto-detecting what customization format a custom
-               image provided by the user supports */
-            QByteArray issue = fat->readFile("issue.txt");
+    quint64 deviceSize = _blockDevice()->size();
+    if (deviceSize)
+        dw.expandLastPartition(deviceSize);
+}
 
-            if (fat->fileExists("user-data"))
-            {
-                /* If we have user-data file on FAT partition, then it must be cloudinit */
-                _initFormat = "cloudinit";
-                qDebug() << "user-data found on FAT partition. Assuming cloudinit support";
-            }
-            else if (issue.contains("pi-gen"))
-            {
-                /* If issue.txt mentions pi-gen, and there is no user-data file assume
-                 * it is a RPI OS flavor, and use the old systemd unit firstrun script stuff */
-                _initFormat = "systemd";
-                qDebug() << "using firstrun script invoked by systemd customization method";
-            }
-            else
-            {
-                /* Fallback to writing cloudinit file, as it does not hurt having one
-                 * Will just have no customization if OS does not support it */
-                _initFormat = "cloudinit";
-                qDebug() << "Unknown what customization method image supports. Falling back to cloudinit";
-            }
-        }
+/* Writes the first block through a DeviceWrapper, which keeps its 4 KB with
+   the MBR and GPT header for last, after the backup GPT at the end of the device */
+bool DownloadThread::_writeExpandedFirstBlock()
+{
+    try
+    {
+        DeviceWrapper dw(_blockDevice());
+        dw.pwrite(_firstBlock, _firstBlockSize, 0);
+        _bytesWritten += _firstBlockSize;
+        qFreeAligned(_firstBlock);
+        _firstBlock = nullptr;
+        _expandRootPartition(dw);
+        dw.sync();
+    }
+    catch (std::runtime_error &err)
+    {
+        emit error(err.what());
+        return false;
+    }
 
-        if (!_firstrun.isEmpty() && _initFormat == "systemd")
-        {
-            fat->writeFile("firstrun.sh", _firstrun);
-            _cmdline += " systemd.run=/boot/firstrun.sh systemd.run_success_action=reboot systemd.unit=kernel-command-line.target";
-        }
+    return true;
+}
+
+bool DownloadThread::_customizationRequested() const
+{
+    return !_config.isEmpty() || !_cmdline.isEmpty() || !_firstrun.isEmpty() || !_cloudinit.isEmpty() || !_geminit.isEmpty();
+}
+
+/* Called with the first block. Finds the boot partition, to capture it as it is written */
+void DownloadThread::_startCapture()
+{
+    /* uniflash images always have uEnv.txt changed. Until the boot partition
+       is customized, nothing from the start of it on is final */
+    bool customized = _customizationRequested() || _destination == "uniflash";
+    _streamHold = customized ? 0 : std::numeric_limits<quint64>::max();
+
+    if (_destination == "uniflash" ? !_streamingOutput : (!(_inStreamCustomization || _outputStream) || !customized))
+        return;
+#ifdef Q_OS_WIN
+    /* Unbuffered handles cannot write the unaligned captured data */
+    if (_directIO)
+        return;
+#endif
+
+    DeviceWrapperMemory *capture = new DeviceWrapperMemory(_firstBlock, _firstBlockSize);
+    quint64 offset = 0, size = 0;
+    try
+    {
+        capture->partitionExtent(1, &offset, &size);
+    }
+    catch (std::runtime_error &err)
+    {
+        qDebug() << "Not customizing in-stream:" << err.what();
+    }
+
+    if (offset < _firstBlockSize || !size)
+    {
+        qDebug() << "Boot partition not found after the first block. Customizing after writing";
+        delete capture;
+        return;
+    }
+
+    qDebug() << "Customizing boot partition at" << offset << "size" << size << "while writing";
+    _capture = capture;
+    _captureStart = offset;
+    _captureEnd = offset+size;
+    _streamHold = offset;
+}
+
+/* Customizes the captured boot partition and writes it out in one go.
+   Without customize, or if customizing fails, it is written as captured,
+   and _writeComplete() customizes it after writing instead */
+bool DownloadThread::_finishCapture(bool customize)
+{
+    DeviceWrapperMemory *capture = _capture;
+    bool ok = true;
 
-        if (!_cloudinit.isEmpty() && _initFormat == "cloudinit")
+    _capture = nullptr;
+    if (customize)
+    {
+        try
         {
-            _cloudinit = "#cloud-config\n"+_cloudinit;
-            fat->writeFile("user-data", _cloudinit);
+            _applyCustomization(*capture);
+            capture->sync();
+            _customizedInStream = true;
+            _streamHold = std::numeric_limits<quint64>::max();
         }
-
-        if (!_cloudinitNetwork.isEmpty() && _initFormat == "cloudinit")
+        catch (std::runtime_error &err)
         {
-            fat->writeFile("network-config", _cloudinitNetwork);
+            qDebug() << "Customizing while writing failed:" << err.what() << "- customizing after writing";
+            capture->revert();
         }
+    }
 
-        if (!_geminit.isEmpty() && _initFormat == "geminit")
+    const QMap<quint64, QByteArray> &data = capture->data();
+    if (_outputStream)
+    {
+        /* Sent in order, with zeroes where nothing was captured, up to the current position */
+        for (auto it = data.cbegin(); it != data.cend() && ok; ++it)
         {
-            fat->writeFile("config.ini", _geminit);
-        }
-        
-        // For uniflash mode, always modify uEnv.txt to use mmc0 (eMMC)
-        // This is needed regardless of whether geminit config was set
-        if(_destination == "uniflash"){
-            qDebug() << "Modifying uEnv.txt for" << _destination << "mode (mmc0/eMMC)";
-            QByteArray uenv = fat->readFile("uEnv.txt");
-            uenv.replace("mmcblk1", "mmcblk0");
-            uenv.replace("bootpart=1:1", "bootpart=0:1");
-            fat->writeFile("uEnv.txt", uenv);
+            ok = _streamZeroes(it.key()) && _outputStream->write(it.value().constData(), it.value().size());
+            _outputStreamPos = it.key() + it.value().size();
         }
-
-        if (!_cmdline.isEmpty())
+        ok = ok && _streamZeroes(_bytesWritten);
+    }
+    else
+    {
+        /* Captured data is not aligned for direct I/O, which the BlockDevice backend takes care of */
+        for (auto it = data.cbegin(); it != data.cend() && ok; ++it)
         {
-            QByteArray cmdline = fat->readFile("cmdline.txt").trimmed();
+            ok = _blockDevice()->pwrite(it.value().constData(), it.value().size(), it.key()) == it.value().size();
+        }
+    }
 
-            cmdline += _cmdline;
+    if (!ok)
+        qDebug() << "Write error:" << _blockDevice()->errorString() << "while writing boot partition";
+    qDebug() << "Wrote" << capture->capturedBytes() << "bytes of boot partition data" << (_customizedInStream ? "customized" : "as is");
 
-            fat->writeFile("cmdline.txt", cmdline);
-        }
-        dw.sync();
+    if (_customizedInStream && capture->hasChanges())
+    {
+        capture->releaseData();
+        _captured = capture;
     }
-    catch (std::runtime_error &err)
+    else
     {
-        emit error(err.what());
-        return false;
+        delete capture;
     }
 
-    emit finalizing();
+    return ok;
+}
 
-    return true;
+/* While capturing, everything from the start of the boot partition on
+   has to go through _writeFile() */
+bool DownloadThread::_capturing(quint64 offset, size_t len) const
+{
+    return _capture && offset+len > _captureStart;
+}
+
+/* Blocks changed by in-stream customization are checked against what was
+   written, and replaced by the original image data so the hashes match */
+void DownloadThread::_restoreCustomized(char *buf, quint64 len, quint64 offset)
+{
+    if (offset >= _captureEnd || offset+len <= _captureStart || !_captured)
+        return;
+
+    if (!_captured->restoreOriginal(buf, len, offset))
+    {
+        qDebug() << "Customized data on boot partition does not match at offset" << offset;
+        _customizationMismatch = true;
+    }
 }
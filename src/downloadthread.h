@@ -16,19 +16,39 @@
 #include <QThread>
 #include <QFile>
 #include <QElapsedTimer>
+#include <QFuture>
+#include <QMap>
 #include <fstream>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 #include <time.h>
 #include <curl/curl.h>
 #include "acceleratedcryptographichash.h"
+#include "bandwidthscheduler.h"
+#include "blockdevice.h"
+#include "bufferpool.h"
+#include "bmap.h"
+#include "filesystemblockmap.h"
+#include "chunkedhash.h"
+#include "cachesidecar.h"
+#include "cachejournal.h"
+#include "writejournal.h"
+#include "cachewriter.h"
+#include "hashstage.h"
+#include "downloadtransport.h"
+#include "downloadcoordinator.h"
+#include "memorybudget.h"
+#include "mirrorlist.h"
+#include "queuetuning.h"
+#include "progresssnapshot.h"
+#include "writehealth.h"
 
-#ifdef Q_OS_WIN
-#include "windows/winfile.h"
-#endif
-#ifdef Q_OS_DARWIN
-#include "mac/macfile.h"
-#endif
-
+class _verifyThreadClass;
+class FanoutTargetThread;
+class DeviceWrapper;
+class DeviceWrapperMemory;
+class RingBuffer;
 
 class DownloadThread : public QThread
 {
@@ -69,6 +89,24 @@ public:
      */
     static QByteArray proxy();
 
+    /*
+     * Set HTTP version, buffer and socket options.
+     * Used globally, for all connections
+     */
+    static void setTransport(const DownloadTransport &transport);
+
+    /*
+     * Returns transport options used
+     */
+    static DownloadTransport transport();
+
+    /*
+     * True if filename is an image file to write to rather than a storage device:
+     * an existing regular file, or a new file outside of /dev. Image files are
+     * written sparse, and not unmounted, zeroed at the ends or ejected
+     */
+    static bool isImageFile(const QByteArray &filename);
+
     /*
      * Set user-agent header string
      */
@@ -79,6 +117,18 @@ public:
      */
     bool successfull();
 
+    /*
+     * Only download if the file on the server no longer has this ETag.
+     * notModified() tells if it still had, nothing is written then
+     */
+    void setIfNoneMatch(const QByteArray &etag);
+    bool notModified();
+
+    /*
+     * ETag of the downloaded file, if the server sent one
+     */
+    QByteArray etag();
+
     /*
      * Returns the downloaded data if saved to memory buffer instead of file
      */
@@ -106,15 +156,207 @@ public:
     void setVerifyEnabled(bool verify);
 
     /*
-     * Enable disk cache
+     * Enable/disable direct I/O, bypassing the OS page cache while writing and verifying
+     */
+    void setDirectIOEnabled(bool directIO);
+
+    /*
+     * Enable/disable use of io_uring for writing and verifying on Linux,
+     * overlapped writes with direct I/O on Windows, or writer threads on macOS.
+     * Falls back to regular I/O if not supported by the kernel
+     */
+    void setIoUringEnabled(bool ioUring);
+
+    /*
+     * Enable/disable skipping writes of all-zero blocks.
+     * Only takes effect if the device is found to read back discarded blocks as zeroes.
+     * Images without bmap also have the free space of their ext and FAT file systems
+     * left out, if the device was discarded
+     */
+    void setSparseWriteEnabled(bool sparse);
+
+    /*
+     * Eject on a thread of its own, emitting success() without waiting for it,
+     * so a batch of writes can go on with the next one. See waitForEjects()
+     */
+    void setAsyncEjectEnabled(bool async);
+
+    /*
+     * Wait for asynchronous ejects that are still running
+     */
+    static void waitForEjects();
+
+    /*
+     * Enable/disable delta writes: each block is read from the device first,
+     * and only written if it differs. The device is not discarded then (Linux, macOS)
+     */
+    void setDeltaWriteEnabled(bool delta);
+
+    /*
+     * Enable/disable resuming an interrupted write: while writing to a drive,
+     * a WriteJournal records how far the image got. Writing the same image
+     * to the same drive again then leaves out what the drive already has.
+     * Only for images with an expected hash. Enabled by default
+     */
+    void setResumeEnabled(bool resume);
+
+    /*
+     * Enable/disable checking that the drive holds data all the way to the end
+     * before writing it, see _probeCapacity()
+     */
+    void setCapacityProbeEnabled(bool probe);
+
+    /*
+     * Enable/disable reading back and hashing written data while the rest
+     * of the image is still being written (Linux only)
+     */
+    void setOverlappedVerifyEnabled(bool overlapped);
+
+    /*
+     * Enable/disable keeping a hash per chunk of the image while writing,
+     * so verification can run on all cores and tell which region does not match.
+     * Takes precedence over overlapped verify. Not available on Windows
+     */
+    void setChunkedVerifyEnabled(bool chunked);
+
+    /* Hash per chunk used by chunked verify. SHA256 by default */
+    void setChunkedVerifyAlgorithm(ChunkedHash::Algorithm algorithm);
+
+    /*
+     * Enable/disable tuning the block queue of the device while it is written,
+     * see QueueTuning. blockSize and queueDepth are what the device is written with,
+     * 0 to go by what it reports (Linux)
      */
-    void setCacheFile(const QString &filename, qint64 filesize = 0);
+    void setQueueTuning(bool enabled, quint64 blockSize = 0, unsigned queueDepth = 0);
+
+    /*
+     * Enable/disable customizing the boot partition in memory while it is
+     * being written, instead of reading and rewriting it afterwards
+     */
+    void setInStreamCustomizationEnabled(bool enabled);
+
+    /*
+     * Enable/disable growing the last partition to the end of the device
+     * while writing the deferred first block, so the image does not have to
+     * do it on first boot. The filesystem in it is left to grow online
+     */
+    void setExpandRootPartitionEnabled(bool enabled);
+
+    /*
+     * Enable/disable writing for a reader that follows the output file while
+     * it is being written (uniflash over TFTP). The first block is written
+     * right away, the boot partition is customized in-stream, and
+     * streamableBytes() tells how much of the file is in its final form
+     */
+    void setStreamingOutputEnabled(bool streaming);
+
+    /*
+     * Send the extracted image into stream, in order, instead of writing it
+     * to a device (DFU). The boot partition is customized in-stream, and the
+     * image is not verified. The caller closes or cancels the stream once
+     * the thread is done. Call before starting
+     */
+    void setOutputStream(RingBuffer *stream);
+
+    /*
+     * Write to several devices at once. This thread then writes to no device
+     * itself, it hands the extracted image to the targets, which write, verify
+     * and report success or failure on their own. Call before starting
+     */
+    void addFanoutTarget(FanoutTargetThread *target);
+
+    /*
+     * Download over this many connections in parallel, each fetching a range of the file.
+     * Needs a cache file to put the ranges in. Uses a single connection if the server
+     * does not accept range requests
+     */
+    void setDownloadSegments(int segments);
+
+    /*
+     * Ask other stations on the LAN for the image before downloading it, see PeerCache.
+     * If one has it, it is downloaded from there. Should that fail, the download
+     * continues from the original URL where the peer left off
+     */
+    void setPeerCacheEnabled(bool enabled);
+
+    /*
+     * Other URLs the same file can be downloaded from, and a metalink file listing more.
+     * The fastest is picked before downloading starts, and the download continues
+     * from the next one if it fails
+     */
+    void setMirrors(const QList<QByteArray> &urls, const QByteArray &metalinkUrl = QByteArray());
+
+    /*
+     * Spread the pieces of a segmented download over all mirrors that are about
+     * as fast as the best one, instead of fetching them all from that one
+     */
+    void setMultiSourceEnabled(bool enabled);
+
+    /*
+     * Share of the download bandwidth this download gets while others run, see
+     * BandwidthScheduler. Normal unless set. Can be changed while downloading
+     */
+    void setBandwidthPriority(BandwidthScheduler::Priority priority);
+
+    /*
+     * Set URL of a bmap file describing which ranges of the image contain data.
+     * If set, only mapped ranges are written and verified
+     */
+    void setBmapUrl(const QByteArray &url);
+
+    /*
+     * Enable disk cache.
+     * If an earlier run left a partial download of the same URL there (see CacheJournal),
+     * the data present is used and the download resumes where it stopped.
+     * prefetched: bytes at the start of the file a PrefetchThread of this process downloaded.
+     * Those are used without checking the server still has the same file, the hash check
+     * at the end covers that
+     */
+    void setCacheFile(const QString &filename, qint64 filesize = 0, quint64 prefetched = 0);
+
+    /*
+     * The download into the cache file is the transfer other threads of this
+     * process may follow, see DownloadCoordinator. Call after setCacheFile()
+     */
+    void setCacheTransfer(std::shared_ptr<DownloadCoordinator::Transfer> transfer);
+
+    /*
+     * Read the image from the cache file another thread is downloading into,
+     * as it arrives, instead of downloading it. If that thread stops before
+     * the end, the rest is downloaded
+     */
+    void followTransfer(std::shared_ptr<DownloadCoordinator::Transfer> transfer);
+
+    /*
+     * Image is read from a cache file with a valid sidecar. The extracted image
+     * is not hashed again while writing, the device is verified against the
+     * hashes in the sidecar instead. Only has an effect if verification is enabled
+     */
+    void setVerifiedInput(const CacheSidecar &sidecar);
+
+    /*
+     * Local copy of the extracted image, such as the extracted image cache file or
+     * an uncompressed image file. The device is verified by comparing what is read
+     * back with it, which is cheaper than hashing and tells where they differ
+     */
+    void setVerifySource(const QString &filename);
+
+    /*
+     * Also keep a copy of the extracted image, written as sparse file.
+     * Writing that copy later needs no decompression
+     */
+    void setExtractedCacheFile(const QString &filename);
 
     /*
      * Set input buffer size
      */
     void setInputBufferSize(int len);
 
+    /*
+     * Size buffers and queues from budget instead of the defaults. Call before starting
+     */
+    virtual void setMemoryBudget(const MemoryBudget &budget);
+
     /*
      * Enable image customization
      */
@@ -128,6 +370,32 @@ public:
     uint64_t verifyNow();
     uint64_t verifyTotal();
     uint64_t bytesWritten();
+    /* The counters above as published last, consistent with each other.
+       Also enables the next progressChanged() */
+    ProgressSnapshot progress();
+    /* Write latencies and device statistics of the write as a WriteHealth report, with "device" */
+    QVariantMap writeHealth();
+    /* Bytes from the start of the output file that will not change anymore, with streaming output */
+    uint64_t streamableBytes();
+
+    /* Blocks waiting between download and extraction, for threads that have such a queue */
+    virtual size_t queueDepth() const;
+    virtual size_t queueCapacity() const;
+
+    /* Stages of a write, reported with phaseStarted() and phaseFinished() */
+    enum Phase
+    {
+        PhaseDiscard,
+        PhaseDownload,
+        PhaseDecompress,
+        PhaseWrite,
+        PhaseFsync,
+        PhaseVerify,
+        PhaseCustomize,
+        PhaseEject,
+        PhaseCount
+    };
+    static QString phaseName(Phase phase);
 
     virtual bool isImage();
     size_t _writeFile(const char *buf, size_t len);
@@ -136,9 +404,17 @@ signals:
     void success();
     void error(QString msg);
     void cacheFileUpdated(QByteArray sha256);
+    void extractedCacheFileUpdated(QByteArray sha256);
     void finalizing();
     void preparationStatusUpdate(QString msg);
     void updateNumProgress(QVariant pos);
+    /* Start and end of a Phase, by phaseName(). bytes is what the phase processed */
+    void phaseStarted(QString phase);
+    void phaseFinished(QString phase, quint64 bytes, qint64 msecs);
+    /* New progress() snapshot. Coalesced: not emitted again before progress() was called */
+    void progressChanged();
+    /* Streaming output: more of the file is final, see streamableBytes() */
+    void streamableBytesChanged();
 
 protected:
     virtual void run();
@@ -147,15 +423,99 @@ protected:
     virtual void _onWriteError();
 
     void _hashData(const char *buf, size_t len);
+    /* _hashData() on the hash stage, in order with the blocks before. buf must
+       stay around until _hashStage.waitFor() the returned ticket */
+    quint64 _submitHash(const char *buf, size_t len);
     void _writeComplete();
+    void _startPhase(Phase phase);
+    void _endPhase(Phase phase, quint64 bytes);
     bool _verify();
+    bool _writeFirstBlockTail();
     int _authopen(const QByteArray &filename);
     virtual bool _openAndPrepareDevice();
+    /* Opens the device for reading it only, without unmounting or changing anything on it */
+    bool _openDeviceReadOnly();
+    /* Waits for the device preparation run() started. False if it failed */
+    bool _waitForDevice();
     void _writeCache(const char *buf, size_t len);
+    void _writeCacheSidecar(const QString &cacheFile, const QByteArray &extractHash, quint64 imageSize = 0);
+    void _writeExtractedCache(const char *buf, size_t len);
+    bool _fanoutBlock(const char *buf, size_t len);
+    void _finishFanout();
+    bool _writeCacheJournal(bool wait = true);
+    bool _closeCacheFile();
+    void _discardCacheFile();
+    bool _replayPartialCache();
+    bool _followTransfer();
+    void _endCacheTransfer(bool complete);
+    bool _inputVerified() const;
     qint64 _sectorsWritten();
+    WriteHealth::DeviceStats _readDeviceStats();
     void _closeFiles();
+    /* Unmounts and ejects device, in the background if async eject is enabled.
+       powerOff also has udisks2 power the drive off on Linux */
+    void _eject(const QByteArray &device, bool powerOff);
+    static void _ejectNow(const QByteArray &device, bool powerOff);
     QByteArray _fileGetContentsTrimmed(const QString &filename);
     bool _customizeImage();
+    /* Grows the last partition in the table of the first block, see setExpandRootPartitionEnabled() */
+    void _expandRootPartition(DeviceWrapper &dw);
+    bool _writeExpandedFirstBlock();
+    void _applyCustomization(DeviceWrapper &dw);
+    bool _customizationRequested() const;
+    void _startCapture();
+    bool _finishCapture(bool customize);
+    bool _capturing(quint64 offset, size_t len) const;
+    void _restoreCustomized(char *buf, quint64 len, quint64 offset);
+    bool _setDirectIO(bool enable);
+    BlockDevice *_blockDevice();
+    /* For customizing what was written. Maps _file if it is an image file */
+    DeviceWrapper *_newDeviceWrapper();
+    /* Discard all of the drive, and find out if it reads back as zeroes then */
+    void _discardDrive();
+    /* Zero the first and last MB, where partition tables may be */
+    bool _zeroDriveEnds();
+    /* Check that blocks all over the drive keep what is written to them. False if not */
+    bool _probeCapacity();
+#ifdef Q_OS_WIN
+    bool _prepareWindowsDrive();
+    void _closeVolumes();
+#endif
+    bool _canSkipBlock(const char *buf, size_t len, quint64 offset);
+    bool _fsMapUsable() const;
+    bool _zeroOutBlock(const char *buf, size_t len, quint64 offset);
+    bool _zeroBmapSkipped();
+    bool _deviceHas(const char *buf, size_t len, quint64 offset);
+    /* The next _writeFile() has the same data as fd at offset, and may copy it from there in the kernel */
+    void _setCopySource(int fd, quint64 offset);
+    qint64 _copyFromSource(int fd, const char *buf, size_t len);
+    bool _cloneImageFile(int fd, quint64 len);
+    void _fetchBmap();
+    /* Download a file of at most IMAGEWRITER_BMAP_MAXSIZE into memory */
+    bool _fetchSmallFile(const QByteArray &url, QByteArray &data);
+    bool _verifyBmap();
+    bool _verifyWritten();
+    bool _verifyChunked();
+    bool _verifyCompare(const uchar *source, quint64 sourceSize);
+    void _writeCheckpoint(quint64 pos);
+    void _writeback(quint64 pos);
+    /* See WriteJournal. _openWriteJournal() runs while preparing the drive, before anything is written */
+    void _openWriteJournal();
+    bool _journalCheckpointDue(quint64 pos) const;
+    void _writeJournalCheckpoint(quint64 pos);
+    void _removeWriteJournal();
+    QByteArray _readTailHash(quint64 pos);
+    QByteArray _driveId();
+    void _publishStreamable(quint64 pos);
+    bool _streamOut(const char *buf, size_t len);
+    bool _streamZeroes(quint64 upTo);
+    void _overlappedVerifyRun();
+    void _stopOverlappedVerify();
+    friend class _verifyThreadClass;
+    static bool _isZeroBlock(const char *buf, size_t len);
+#ifdef Q_OS_LINUX
+    bool _verifyIoUring();
+#endif
 
     /*
      * libcurl callbacks
@@ -163,39 +523,196 @@ protected:
     virtual size_t _writeData(const char *buf, size_t len);
     bool _progress(curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
     void _header(const std::string &header);
+    void _setAcceptEncoding();
+    void _settleEncoding();
 
     static size_t _curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
     static int _curl_xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
     static size_t _curl_header_callback( void *ptr, size_t size, size_t nmemb, void *userdata);
 
+    /* One range request of a segmented download. pos is where the next data received goes */
+    struct DownloadSegment
+    {
+        DownloadThread *thread;
+        CURL *c;
+        quint64 start, pos, end;
+        int retries;
+        bool rangeError;
+        /* Fetching from a mirror other than _url, see setMultiSourceEnabled() */
+        bool onMirror;
+    };
+    static size_t _curl_segment_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    static size_t _curl_segment_header_callback(void *ptr, size_t size, size_t nmemb, void *userdata);
+    static int _curl_segment_xferinfo_callback(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+    bool _segmentedDownload(CURLcode &ret);
+    /* Switch from a peer or mirror that failed with ret to the original URL or the next mirror.
+       Returns false if there is nothing left to try */
+    bool _failOver(CURLcode ret);
+    void _selectMirror();
+    void _useMirror(int index);
+    bool _feedSegments(QMap<quint64, quint64> &done);
+
     CURL *_c;
     curl_off_t _startOffset;
-    std::atomic<std::uint64_t> _lastDlTotal, _lastDlNow, _verifyTotal, _lastVerifyNow, _bytesWritten;
+    std::atomic<std::uint64_t> _lastDlTotal, _lastDlNow, _verifyTotal, _lastVerifyNow, _bytesWritten, _bytesSkipped;
     std::uint64_t _lastFailureOffset;
     qint64 _sectorsStart;
-    QByteArray _url, _useragent, _buf, _filename, _lastError, _expectedHash, _config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat, _destination;
+    QByteArray _url, _bmapUrl, _useragent, _buf, _filename, _lastError, _expectedHash, _config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat, _destination;
     char *_firstBlock;
     size_t _firstBlockSize;
     static QByteArray _proxy;
+    static DownloadTransport _transport;
     static int _curlCount;
-    bool _cancelled, _successful, _verifyEnabled, _cacheEnabled, _ejectEnabled;
+    /* Set from other threads, checked by every stage that can wait */
+    std::atomic<bool> _cancelled;
+    bool _successful, _verifyEnabled, _cacheEnabled, _ejectEnabled, _asyncEject;
+    /* Response is compressed for the transfer. Decoded bytes of it, encoded bytes as libcurl
+       counts them, and what all responses saved on the wire so far */
+    bool _contentEncoded;
+    quint64 _decodedNow, _encodedNow, _encodingSaved;
     bool _suppressSuccessSignal;  // For subclasses that want to emit success themselves
     time_t _lastModified, _serverTime, _lastFailureTime;
     QElapsedTimer _timer;
-    int _inputBufferSize;
+    int _inputBufferSize, _downloadSegments;
+    bool _acceptRanges;
+    bool _peerCache;
+    /* URL the image is downloaded from if not from a peer. Empty if no peer is used */
+    QByteArray _originUrl;
+    QList<QByteArray> _mirrorUrls;
+    QByteArray _metalinkUrl;
+    /* Mirrors best first, after probing. Empty if there is only one URL */
+    MirrorList _mirrors;
+    int _mirrorIndex, _mirrorFailovers;
+    bool _multiSource;
     bool _isNormalFile{false};
+    bool _directIO, _ioUringEnabled, _sparseWrite, _discardZeroes, _chunkedVerify;
+    /* Hashes of the extracted image from the cache sidecar, see setVerifiedInput() */
+    bool _hasVerifiedInput, _hasVerifiedChunks;
+    QByteArray _verifiedHash;
+    QString _verifySource;
+    /* Region of the image the last failed verify found different on the device.
+       Whole image if only the hash of all of it was compared */
+    quint64 _mismatchOffset, _mismatchLength;
+    size_t _directIOAlignment;
+    /* Optimal I/O size (Linux) or physical sector size (Windows) reported by the device, 0 if unknown */
+    size_t _optimalIOSize;
+    /* Erase block size of SD cards and eMMC in a built-in reader (Linux), 0 if unknown */
+    size_t _eraseSize;
+    /* Zero runs of the image are handed to the device, see _zeroOutBlock() */
+    bool _zeroOut;
+    bool _capacityProbe;
+    /* Delta write: buffer blocks are read back into, and amount of data found on the device already */
+    bool _deltaWrite;
+    char *_deltaBuf;
+    size_t _deltaBufSize;
+    quint64 _bytesUnchanged;
+    /* Resumed write: the drive has the image up to _resumeOffset already */
+    bool _resumeEnabled, _writeJournalEnabled;
+    quint64 _resumeOffset;
+    WriteJournal _writeJournal;
+    /* See _setCopySource(). _kernelCopy is cleared if the kernel cannot copy to the device */
+    int _copySourceFd;
+    quint64 _copySourceOffset;
+    bool _kernelCopy;
+    /* Image file was copied from the verified extracted cache file in the kernel, and
+       shares its extents with it if _imageReflinked, see _cloneImageFile() */
+    bool _imageCloned, _imageReflinked;
+    /* In-stream customization: the boot partition is held in _capture while it is written,
+       and _captured keeps the changes made to it for verification */
+    bool _inStreamCustomization, _customizedInStream;
+    std::atomic<bool> _customizationMismatch;
+    DeviceWrapperMemory *_capture, *_captured;
+    quint64 _captureStart, _captureEnd;
+    bool _expandRoot;
+    /* Streaming output: the file is final up to _streamableBytes, but never
+       beyond _streamHold, where something may still be changed when writing completes */
+    bool _streamingOutput;
+    std::atomic<std::uint64_t> _streamableBytes;
+    quint64 _streamHold;
+    /* Output stream: everything up to _outputStreamPos has been sent */
+    RingBuffer *_outputStream;
+    quint64 _outputStreamPos;
+    BlockMap _bmap;
+    /* Unmapped ranges that were not written, as start and end. If the bmap
+       turns out not to match the image, they are zeroed after writing */
+    QVector<QPair<quint64, quint64>> _bmapSkipped;
+    /* Without bmap: free space of the file systems in the image. What of it was
+       not written is in _fsSkipped, as start and end, and _usedHash has the rest */
+    FilesystemBlockMap _fsMap;
+    bool _fsMapEnabled, _discarded;
+    QVector<QPair<quint64, quint64>> _fsSkipped;
+    /* Overlapped verify: the writer syncs data to the device every checkpoint,
+       and publishes how far it got in _syncedUpTo for the verify thread to read back */
+    bool _overlappedVerify, _overlappedVerifyStarted, _overlappedVerifyStop;
+    std::atomic<bool> _overlappedVerifyError;
+    std::atomic<std::uint64_t> _syncedUpTo, _overlappedVerifyNow;
+    std::uint64_t _lastCheckpoint;
+    /* Buffered writes: writeback started up to _writebackPos, and known done up to _writebackDone */
+    std::uint64_t _writebackPos, _writebackDone;
+    _verifyThreadClass *_verifyThread;
+    std::mutex _checkpointMutex;
+    std::condition_variable _checkpointCv;
 
+    BlockDeviceFile _file;
+    /* Positional I/O, discard and zero out on _file once it is open, see _blockDevice() */
+    BlockDevice *_device;
+    /* _openAndPrepareDevice() running alongside the start of the download */
+    QFuture<bool> _devicePrepared;
 #ifdef Q_OS_WIN
-    WinFile _file, _volumeFile;
+    /* Volumes of the drive, locked while writing */
+    QList<WinFile *> _volumeFiles;
     QByteArray _nr;
-#elif defined(Q_OS_DARWIN)
-    MacFile _file;
-#else
-    QFile _file;
 #endif
     QFile _cachefile;
+    /* Writes _cachefile, except for the pieces of segmented downloads */
+    CacheWriter _cacheWriter;
+    /* Resuming downloads across runs. _cacheWritten: bytes in the cache file,
+       _journalWritten: bytes recorded in the journal */
+    CacheJournal _journal;
+    quint64 _cacheWritten, _journalWritten;
+    bool _replayingCache, _discardPartialCache;
+    /* Cache file holds data of a PrefetchThread, and holds all of the file */
+    bool _prefetched, _replayedAll;
+    /* Single-flight with the other threads of this process wanting the same image */
+    std::shared_ptr<DownloadCoordinator::Transfer> _cacheTransfer, _followedTransfer;
+    QByteArray _etag, _lastModifiedHeader;
+    struct curl_slist *_resumeHeaders;
+    /* Conditional request */
+    QByteArray _ifNoneMatch;
+    bool _notModified;
+    struct curl_slist *_conditionalHeaders;
+    QFile _extractedCacheFile;
+    bool _extractedCacheEnabled;
+    QList<FanoutTargetThread *> _fanoutTargets;
+    /* Buffers of the blocks handed to the fan-out targets, recycled once every target has written them */
+    BufferPool *_fanoutPool;
+    /* Each phase is only timed by one thread at a time */
+    QElapsedTimer _phaseTimers[PhaseCount];
+    /* Progress snapshot, published at most every PROGRESS_UPDATE_INTERVAL ms by whichever
+       pipeline thread gets there first. The _progressPhase* members belong to the publisher
+       holding the write side of the lock */
+    SeqLock<ProgressSnapshot> _progressSnapshot;
+    std::atomic<int> _currentPhase;
+    std::atomic<qint64> _nextProgressPublish;
+    std::atomic<bool> _progressPending;
+    QElapsedTimer _progressClock;
+    int _progressPhase;
+    quint64 _progressPhaseStartBytes;
+    double _progressPhaseStartFraction;
+    qint64 _progressPhaseStartTime;
+    /* Thread a fan-out target contributes its progress to */
+    DownloadThread *_progressListener;
+    void _publishProgress(bool force = false);
+    WriteHealth _writeHealth;
+    QueueTuning _queueTuning;
+    MemoryBudget _budget;
 
-    AcceleratedCryptographicHash _writehash, _verifyhash;
+    AcceleratedCryptographicHash _writehash, _verifyhash, _usedHash;
+    ChunkedHash _chunkhash;
+    /* _hashData() runs on _hashStage while blocks are written, leaves of _chunkhash
+       on _leafHashStage in parallel with _writehash. Stopped before the hashes go away */
+    HashStage _leafHashStage, _hashStage;
+    BandwidthScheduler::Job _bandwidth;
 };
 
 #endif // DOWNLOADTHREAD_H
@@ -0,0 +1,132 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadtransport.h"
+#include <QByteArrayList>
+#include <QDebug>
+
+#ifdef Q_OS_WIN
+#include <winsock2.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+DownloadTransport::DownloadTransport()
+    : httpVersion(CURL_HTTP_VERSION_NONE), bufferSize(0), tcpNoDelay(true), keepAliveIdle(60), socketBufferSize(0), transferCompression(true)
+{
+}
+
+QByteArray DownloadTransport::contentEncodings()
+{
+    curl_version_info_data *info = curl_version_info(CURLVERSION_NOW);
+    QByteArrayList encodings;
+
+    /* zstd decodes several times faster than gzip, so ask for it first */
+    if (info->features & CURL_VERSION_ZSTD)
+        encodings.append("zstd");
+    if (info->features & CURL_VERSION_LIBZ)
+        encodings.append("gzip");
+
+    return encodings.join(", ");
+}
+
+bool DownloadTransport::setHttpVersion(const QString &version)
+{
+    if (version.isEmpty() || version == "auto")
+    {
+        httpVersion = CURL_HTTP_VERSION_NONE;
+    }
+    else if (version == "1.1")
+    {
+        httpVersion = CURL_HTTP_VERSION_1_1;
+    }
+    else if (version == "2")
+    {
+        httpVersion = CURL_HTTP_VERSION_2_0;
+    }
+    else if (version == "3")
+    {
+        if (curl_version_info(CURLVERSION_NOW)->features & CURL_VERSION_HTTP3)
+        {
+            /* Falls back to older versions if the server does not answer over QUIC */
+            httpVersion = CURL_HTTP_VERSION_3;
+        }
+        else
+        {
+            qDebug() << "libcurl built without HTTP/3 support. Using automatic HTTP version selection";
+            httpVersion = CURL_HTTP_VERSION_NONE;
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+QString DownloadTransport::httpVersionName() const
+{
+    switch (httpVersion)
+    {
+    case CURL_HTTP_VERSION_1_1:
+        return "1.1";
+    case CURL_HTTP_VERSION_2_0:
+        return "2";
+    case CURL_HTTP_VERSION_3:
+        return "3";
+    default:
+        return "auto";
+    }
+}
+
+void DownloadTransport::apply(CURL *c) const
+{
+    if (httpVersion != CURL_HTTP_VERSION_NONE)
+        curl_easy_setopt(c, CURLOPT_HTTP_VERSION, httpVersion);
+    if (bufferSize)
+        curl_easy_setopt(c, CURLOPT_BUFFERSIZE, bufferSize);
+    curl_easy_setopt(c, CURLOPT_TCP_NODELAY, tcpNoDelay ? 1L : 0L);
+    if (keepAliveIdle)
+    {
+        curl_easy_setopt(c, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(c, CURLOPT_TCP_KEEPIDLE, keepAliveIdle);
+        curl_easy_setopt(c, CURLOPT_TCP_KEEPINTVL, keepAliveIdle);
+    }
+    if (socketBufferSize || !congestionControl.isEmpty())
+    {
+        curl_easy_setopt(c, CURLOPT_SOCKOPTFUNCTION, &DownloadTransport::_curl_sockopt_callback);
+        curl_easy_setopt(c, CURLOPT_SOCKOPTDATA, this);
+    }
+}
+
+/* Called by libcurl for every socket it creates, before connecting.
+   Failures are not fatal, the OS defaults are used then */
+int DownloadTransport::_curl_sockopt_callback(void *clientp, curl_socket_t fd, curlsocktype purpose)
+{
+    const DownloadTransport *t = static_cast<const DownloadTransport *>(clientp);
+
+    if (purpose != CURLSOCKTYPE_IPCXN)
+        return CURL_SOCKOPT_OK;
+
+    if (t->socketBufferSize)
+    {
+        int size = t->socketBufferSize;
+        if (::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (const char *) &size, sizeof(size)) != 0)
+            qDebug() << "Unable to set socket receive buffer size to" << size;
+    }
+
+#ifdef TCP_CONGESTION
+    if (!t->congestionControl.isEmpty()
+            && ::setsockopt(fd, IPPROTO_TCP, TCP_CONGESTION, t->congestionControl.constData(), t->congestionControl.size()) != 0)
+    {
+        qDebug() << "Unable to use TCP congestion control algorithm" << t->congestionControl;
+    }
+#endif
+
+    return CURL_SOCKOPT_OK;
+}
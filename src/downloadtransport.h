@@ -0,0 +1,56 @@
+#ifndef DOWNLOADTRANSPORT_H
+#define DOWNLOADTRANSPORT_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+#include <curl/curl.h>
+
+/*
+ * Tuning of the HTTP transport used by DownloadThread
+ *
+ * Defaults leave everything to libcurl and the OS. Sites far away
+ * (high round trip time) may benefit from larger receive buffers and a
+ * congestion control algorithm like BBR, that does not need a full
+ * buffer to reach the link speed.
+ */
+class DownloadTransport
+{
+public:
+    DownloadTransport();
+
+    /* Set the options on a curl easy handle */
+    void apply(CURL *c) const;
+
+    /* "auto", "1.1", "2" or "3". Returns false if not recognized.
+       HTTP/3 falls back to automatic if this libcurl was built without it */
+    bool setHttpVersion(const QString &version);
+    QString httpVersionName() const;
+
+    /* CURL_HTTP_VERSION_* */
+    long httpVersion;
+    /* Size of libcurl's receive buffer in bytes, 0 for its default */
+    long bufferSize;
+    bool tcpNoDelay;
+    /* Idle time in seconds before TCP keepalive probes are sent, 0 to disable keepalive */
+    long keepAliveIdle;
+    /* SO_RCVBUF in bytes, 0 to let the OS tune it */
+    int socketBufferSize;
+    /* TCP congestion control algorithm, e.g. "bbr". Empty for the system default. Linux only */
+    QByteArray congestionControl;
+    /* Let servers compress uncompressed images on the way. Not set by apply(), DownloadThread
+       decides per transfer */
+    bool transferCompression;
+
+    /* Content encodings this libcurl can decode, for Accept-Encoding. Empty if none */
+    static QByteArray contentEncodings();
+
+protected:
+    static int _curl_sockopt_callback(void *clientp, curl_socket_t fd, curlsocktype purpose);
+};
+
+#endif // DOWNLOADTRANSPORT_H
@@ -0,0 +1,69 @@
+#ifndef DRIVECHANGENOTIFIER_H
+#define DRIVECHANGENOTIFIER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <condition_variable>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+/*
+ * Tells the drive list thread when storage devices appear, disappear or
+ * are mounted, so it lists them again only then. With Ports, tells the
+ * PortListWatcher when serial ports or network interfaces come and go
+ *
+ * The platform notifications (Configuration Manager on Windows, Disk
+ * Arbitration and IOKit on macOS) arrive on a thread of the system. They
+ * only set a flag the drive list thread waits for.
+ */
+class DriveChangeNotifier
+{
+public:
+    enum Devices
+    {
+        Storage,
+        Ports
+    };
+
+    DriveChangeNotifier(Devices devices = Storage) : _devices(devices), _changed(false) {}
+    ~DriveChangeNotifier();
+
+    /* Returns false if notifications are not available, the drives have to be polled then */
+    bool start();
+
+    /* Waits up to timeoutMs for a change. Returns true if there was one since the last call */
+    bool wait(int timeoutMs)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _cv.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this] { return _changed; });
+        bool changed = _changed;
+        _changed = false;
+        return changed;
+    }
+
+    /* Called by the platform notifications */
+    void notify()
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _changed = true;
+        }
+        _cv.notify_all();
+    }
+
+protected:
+    Devices _devices;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _changed;
+    /* Registrations with the system */
+    std::vector<void *> _handles;
+
+    void _stop();
+};
+
+#endif // DRIVECHANGENOTIFIER_H
@@ -4,19 +4,33 @@
  */
 
 #include "driveformatthread.h"
+#include "devicewrapperstructs.h"
 #include "dependencies/drivelist/src/drivelist.hpp"
 #include "dependencies/mountutils/src/mountutils.hpp"
+#include <memory>
 #include <regex>
+#include <stdexcept>
+#include <string.h>
 #include <QDebug>
+#include <QFile>
 #include <QProcess>
-#include <QTemporaryFile>
-#include <QCoreApplication>
+#include <QRandomGenerator>
 
 #ifdef Q_OS_LINUX
 #include "linux/udisks2api.h"
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
 #endif
 
+#ifdef Q_OS_WIN
+#include <winioctl.h>
+#endif
+
+/* Partition starts at 4 MB, so clusters are aligned to erase blocks */
+#define FORMAT_PARTITION_START  8192
+#define FORMAT_RESERVED_SECTORS 32
+
 DriveFormatThread::DriveFormatThread(const QByteArray &device, QObject *parent)
     : QThread(parent), _device(device)
 {
@@ -40,69 +54,53 @@ void DriveFormatThread::run()
 
         qDebug() << "Formatting Windows drive #" << nr << "(" << _device << ")";
 
+        /* Windows does not let us write over mounted volumes. Remove them first */
         QProcess proc;
-        QByteArray diskpartCmds =
-                "select disk "+nr+"\r\n"
-                "clean\r\n"
-                "create partition primary\r\n"
-                "select partition 1\r\n"
-                "set id=0e\r\n"
-                "assign\r\n";
         proc.start("diskpart", QStringList());
         proc.waitForStarted();
-        proc.write(diskpartCmds);
+        proc.write("select disk "+nr+"\r\n"
+                   "clean\r\n");
         proc.closeWriteChannel();
         proc.waitForFinished();
 
         QByteArray output = proc.readAllStandardError();
-        qDebug() << output;
         qDebug() << "Done running diskpart. Exit status code =" << proc.exitCode();
 
         if (proc.exitCode())
         {
             emit error(tr("Error partitioning: %1").arg(QString(output)));
+            return;
         }
-        else
+
+        WinFile f;
+        GET_LENGTH_INFORMATION lengthInfo;
+        DWORD bytesReturned;
+        f.setFileName(_device);
+        if (!f.open(QIODevice::ReadWrite))
         {
-            auto l = Drivelist::ListStorageDevices();
-            QByteArray devlower = _device.toLower();
-            for (auto i : l)
-            {
-                if (QByteArray::fromStdString(i.device).toLower() == devlower && i.mountpoints.size() == 1)
-                {
-                    QByteArray driveLetter = QByteArray::fromStdString(i.mountpoints.front());
-                    if (driveLetter.endsWith("\\"))
-                        driveLetter.chop(1);
-                    qDebug() << "Drive letter of device:" << driveLetter;
-
-                    QProcess f32format;
-                    QStringList args;
-                    args << "-y" << driveLetter;
-                    f32format.start(QCoreApplication::applicationDirPath()+"/fat32format.exe", args);
-                    if (!f32format.waitForStarted())
-                    {
-                        emit error(tr("Error starting fat32format"));
-                        return;
-                    }
-
-                    //f32format.write("y\r\n");
-                    f32format.closeWriteChannel();
-                    f32format.waitForFinished(120000);
-
-                    if (f32format.exitStatus() || f32format.exitCode())
-                    {
-                        emit error(tr("Error running fat32format: %1").arg(QString(f32format.readAll())));
-                    }
-                    else
-                    {
-                        emit success();
-                    }
-                    return;
-                }
-            }
-
-            emit error(tr("Error determining new drive letter"));
+            emit error(tr("Cannot open storage device '%1'.").arg(QString(_device)));
+            return;
         }
+        if (!DeviceIoControl(f.handle(), IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof(lengthInfo), &bytesReturned, NULL))
+        {
+            emit error(tr("Error determining size of storage device"));
+            return;
+        }
+
+        try
+        {
+            _formatFat32(&f, lengthInfo.Length.QuadPart);
+        }
+        catch (std::runtime_error &e)
+        {
+            emit error(tr("Error formatting: %1").arg(e.what()));
+            return;
+        }
+
+        /* Have Windows read the new partition table, and assign a drive letter */
+        DeviceIoControl(f.handle(), IOCTL_DISK_UPDATE_PROPERTIES, NULL, 0, NULL, 0, &bytesReturned, NULL);
+        f.close();
+        emit success();
     }
     else
     {
@@ -152,41 +150,47 @@ void DriveFormatThread::run()
     }
 
 
-    QProcess proc;
-    QByteArray partitionTable;
-    QStringList args;
     QByteArray fatpartition = _device;
-    partitionTable = "8192,,0E\n"
-            "0,0\n"
-            "0,0\n"
-            "0,0\n";
-    args << "-uS" << _device;
     if (isdigit(fatpartition.at(fatpartition.length()-1)))
         fatpartition += "p1";
     else
         fatpartition += "1";
 
     unmount_disk(_device);
-    proc.setProcessChannelMode(proc.MergedChannels);
-    proc.start("sfdisk", args);
-    if (!proc.waitForStarted())
+
+    QFile f(_device);
+    uint64_t devsize;
+    if (!f.open(QIODevice::ReadWrite))
     {
-        emit error(tr("Error starting sfdisk"));
+        emit error(tr("Cannot open storage device '%1'.").arg(QString(_device)));
+        return;
+    }
+    if (::ioctl(f.handle(), BLKGETSIZE64, &devsize) == -1)
+    {
+        emit error(tr("Error determining size of storage device"));
         return;
     }
-    proc.write(partitionTable);
-    proc.closeWriteChannel();
-    proc.waitForFinished();
-    QByteArray output = proc.readAll();
-    qDebug() << "sfdisk:" << output;
 
-    if (proc.exitCode())
+    try
     {
-        emit error(tr("Error partitioning: %1").arg(QString(output)));
+        _formatFat32(&f, devsize);
+    }
+    catch (std::runtime_error &e)
+    {
+        emit error(tr("Error formatting: %1").arg(e.what()));
         return;
     }
 
-    proc.execute("partprobe", QStringList() );
+    ::fsync(f.handle());
+    /* Have the kernel read the new partition table */
+    bool reread = (::ioctl(f.handle(), BLKRRPART) == 0);
+    if (!reread)
+        qDebug() << "BLKRRPART failed:" << strerror(errno) << "Running partprobe";
+    f.close();
+    if (!reread)
+        QProcess::execute("partprobe", QStringList());
+
+    /* udev creates the device node of the partition */
     for (int tries = 0; tries < 30; tries++)
     {
         if (QFile::exists(fatpartition))
@@ -200,28 +204,127 @@ void DriveFormatThread::run()
         return;
     }
 
-    args.clear();
-    args << fatpartition;
-    proc.start("mkfs.fat", args);
-    if (!proc.waitForStarted())
-    {
-        emit error(tr("Error starting mkfs.fat"));
-        return;
-    }
-
-    proc.waitForFinished();
-    output = proc.readAll();
-    qDebug() << "mkfs.fat:" << output;
-
-    if (proc.exitCode())
-    {
-        emit error(tr("Error running mkfs.fat: %1").arg(QString(output)));
-        return;
-    }
-
     emit success();
 
 #else
     emit error(tr("Formatting not implemented for this platform"));
 #endif
 }
+
+void DriveFormatThread::_formatFat32(BlockDeviceFile *file, quint64 deviceSize)
+{
+    /* MBR cannot address more than 2 TB */
+    quint64 sectors = qMin(deviceSize / 512, (quint64) 0xFFFFFFFF);
+    if (sectors <= FORMAT_PARTITION_START)
+        throw std::runtime_error("Storage device too small");
+
+    uint32_t partSectors = sectors - FORMAT_PARTITION_START;
+    uint32_t sectorsPerCluster, fatSectors, clusterCount;
+
+    /* Same cluster sizes as Windows uses: 4 KB up to 8 GB, up to 32 KB above 32 GB.
+       Smaller clusters if needed to get the minimum number of clusters of FAT32 */
+    if (partSectors <= 16777216)
+        sectorsPerCluster = 8;
+    else if (partSectors <= 33554432)
+        sectorsPerCluster = 16;
+    else if (partSectors <= 67108864)
+        sectorsPerCluster = 32;
+    else
+        sectorsPerCluster = 64;
+
+    while (true)
+    {
+        uint32_t tmp = (256 * sectorsPerCluster + 2) / 2;
+        fatSectors = (partSectors - FORMAT_RESERVED_SECTORS + tmp - 1) / tmp;
+        /* Data region aligned to the cluster size */
+        while ((FORMAT_RESERVED_SECTORS + 2 * fatSectors) % sectorsPerCluster)
+            fatSectors++;
+        clusterCount = (partSectors - FORMAT_RESERVED_SECTORS - 2 * fatSectors) / sectorsPerCluster;
+
+        if (clusterCount >= 65525 || sectorsPerCluster == 1)
+            break;
+        sectorsPerCluster /= 2;
+    }
+    if (clusterCount < 65525)
+        throw std::runtime_error("Storage device too small for FAT32");
+
+    qDebug() << "Formatting FAT32 with" << clusterCount << "clusters of" << sectorsPerCluster * 512 << "bytes";
+
+    std::unique_ptr<BlockDevice> device(BlockDevice::create(file));
+    DeviceWrapper dw(device.get());
+    quint64 partOffset = (quint64) FORMAT_PARTITION_START * 512;
+    quint64 rootOffset = partOffset + (quint64) (FORMAT_RESERVED_SECTORS + 2 * fatSectors) * 512;
+    quint64 zeroEnd = rootOffset + sectorsPerCluster * 512;
+    QByteArray zeroes(4*1024*1024, 0);
+
+    /* Old partition table (including primary GPT), reserved sectors, both FATs and the root directory */
+    for (quint64 pos = 0; pos < zeroEnd; pos += zeroes.size())
+        dw.pwrite(zeroes.constData(), qMin((quint64) zeroes.size(), zeroEnd - pos), pos);
+    /* Backup GPT at the end of the device */
+    if ((deviceSize & ~4095ULL) >= zeroEnd + 65536)
+        dw.pwrite(zeroes.constData(), 65536, (deviceSize & ~4095ULL) - 65536);
+
+    struct fat32_bpb bpb;
+    memset(&bpb, 0, sizeof(bpb));
+    bpb.BS_jmpBoot[0] = 0xEB;
+    bpb.BS_jmpBoot[1] = 0x58;
+    bpb.BS_jmpBoot[2] = 0x90;
+    memcpy(bpb.BS_OEMName, "MSWIN4.1", sizeof(bpb.BS_OEMName));
+    bpb.BPB_BytsPerSec = 512;
+    bpb.BPB_SecPerClus = sectorsPerCluster;
+    bpb.BPB_RsvdSecCnt = FORMAT_RESERVED_SECTORS;
+    bpb.BPB_NumFATs = 2;
+    bpb.BPB_Media = 0xF8;
+    bpb.BPB_SecPerTrk = 63;
+    bpb.BPB_NumHeads = 255;
+    bpb.BPB_HiddSec = FORMAT_PARTITION_START;
+    bpb.BPB_TotSec32 = partSectors;
+    bpb.BPB_FATSz32 = fatSectors;
+    bpb.BPB_RootClus = 2;
+    bpb.BPB_FSInfo = 1;
+    bpb.BPB_BkBootSec = 6;
+    bpb.BS_DrvNum = 0x80;
+    bpb.BS_BootSig = 0x29;
+    bpb.BS_VolID = QRandomGenerator::global()->generate();
+    memcpy(bpb.BS_VolLab, "NO NAME    ", sizeof(bpb.BS_VolLab));
+    memcpy(bpb.BS_FilSysType, "FAT32   ", sizeof(bpb.BS_FilSysType));
+    bpb.Signature[0] = 0x55;
+    bpb.Signature[1] = 0xAA;
+    dw.pwrite((char *) &bpb, sizeof(bpb), partOffset);
+    dw.pwrite((char *) &bpb, sizeof(bpb), partOffset + bpb.BPB_BkBootSec * 512);
+
+    /* The root directory takes the first cluster */
+    struct FSInfo fsinfo;
+    memset(&fsinfo, 0, sizeof(fsinfo));
+    memcpy(fsinfo.FSI_LeadSig, "RRaA", 4);
+    memcpy(fsinfo.FSI_StrucSig, "rrAa", 4);
+    fsinfo.FSI_Free_Count = clusterCount - 1;
+    fsinfo.FSI_Nxt_Free = 3;
+    fsinfo.FSI_TrailSig[2] = 0x55;
+    fsinfo.FSI_TrailSig[3] = 0xAA;
+    dw.pwrite((char *) &fsinfo, sizeof(fsinfo), partOffset + bpb.BPB_FSInfo * 512);
+    dw.pwrite((char *) &fsinfo, sizeof(fsinfo), partOffset + (bpb.BPB_BkBootSec + 1) * 512);
+
+    /* Media type, reserved and end of the root directory chain */
+    uint32_t firstEntries[3] = { 0x0FFFFFF8, 0x0FFFFFFF, 0x0FFFFFFF };
+    for (int i = 0; i < 2; i++)
+        dw.pwrite((char *) firstEntries, sizeof(firstEntries), partOffset + (quint64) (FORMAT_RESERVED_SECTORS + i * fatSectors) * 512);
+
+    struct mbr_table mbr;
+    uint32_t diskId = QRandomGenerator::global()->generate();
+    memset(&mbr, 0, sizeof(mbr));
+    memcpy(mbr.diskid, &diskId, sizeof(mbr.diskid));
+    /* LBA only, which the CHS fields say by being at their maximum */
+    mbr.part[0].begin_hsc[0] = mbr.part[0].end_hsc[0] = (char) 0xFE;
+    mbr.part[0].begin_hsc[1] = mbr.part[0].end_hsc[1] = (char) 0xFF;
+    mbr.part[0].begin_hsc[2] = mbr.part[0].end_hsc[2] = (char) 0xFF;
+    mbr.part[0].id = 0x0C; /* FAT32 LBA */
+    mbr.part[0].starting_sector = FORMAT_PARTITION_START;
+    mbr.part[0].nr_of_sectors = partSectors;
+    mbr.signature[0] = 0x55;
+    mbr.signature[1] = 0xAA;
+    /* DeviceWrapper writes the first block last */
+    dw.pwrite((char *) &mbr, sizeof(mbr), 0);
+
+    dw.sync();
+}
@@ -7,6 +7,7 @@
  */
 
 #include <QThread>
+#include "devicewrapper.h"
 
 class DriveFormatThread : public QThread
 {
@@ -22,6 +23,9 @@ signals:
 
 protected:
     QByteArray _device;
+
+    /* Writes an MBR with a single FAT32 partition and creates the file system, without external tools */
+    void _formatFat32(BlockDeviceFile *file, quint64 deviceSize);
 };
 
 #endif // DRIVEFORMATTHREAD_H
@@ -23,6 +23,10 @@ public:
     Q_PROPERTY(bool isScsi MEMBER _isScsi CONSTANT)
     Q_PROPERTY(bool isReadOnly MEMBER _isReadOnly CONSTANT)
     Q_PROPERTY(bool isSystem MEMBER _isSystem CONSTANT)
+    Q_PROPERTY(QString usbController MEMBER _usbController CONSTANT)
+    Q_PROPERTY(QString usbHub MEMBER _usbHub CONSTANT)
+    Q_PROPERTY(QString usbPort MEMBER _usbPort CONSTANT)
+    Q_PROPERTY(uint usbSpeed MEMBER _usbSpeed CONSTANT)
     Q_INVOKABLE int sizeInGb();
 
 signals:
@@ -30,6 +34,9 @@ signals:
 public slots:
 
 protected:
+    /* Reads the members directly for its roles */
+    friend class DriveListModel;
+
     QString _device;
     QString _description;
     QStringList _mountpoints;
@@ -38,6 +45,9 @@ protected:
     bool _isScsi;
     bool _isReadOnly;
     bool _isSystem;
+    /* Where a USB drive is plugged in, see Drivelist::DeviceDescriptor. Empty and 0 if not known */
+    QString _usbController, _usbHub, _usbPort;
+    uint _usbSpeed;
 };
 
 #endif // DRIVELISTITEM_H
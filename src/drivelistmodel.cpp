@@ -8,6 +8,7 @@
 #include "dependencies/drivelist/src/drivelist.hpp"
 #include <QSet>
 #include <QDebug>
+#include <algorithm>
 
 DriveListModel::DriveListModel(QObject *parent)
     : QAbstractListModel(parent)
@@ -20,7 +21,11 @@ DriveListModel::DriveListModel(QObject *parent)
         {isScsiRole, "isScsi"},
         {isReadOnlyRole, "isReadOnly"},
         {isSystemRole, "isSystem"},
-        {mountpointsRole, "mountpoints"}
+        {mountpointsRole, "mountpoints"},
+        {usbControllerRole, "usbController"},
+        {usbHubRole, "usbHub"},
+        {usbPortRole, "usbPort"},
+        {usbSpeedRole, "usbSpeed"}
     };
 
     // Enumerate drives in seperate thread, but process results in UI thread
@@ -43,17 +48,42 @@ QVariant DriveListModel::data(const QModelIndex &index, int role) const
     if (row < 0 || row >= _drivelist.count())
         return QVariant();
 
-    QByteArray propertyName = _rolenames.value(role);
-    if (propertyName.isEmpty())
+    const DriveListItem *item = _drivelist.at(row).item;
+    switch (role)
+    {
+    case deviceRole:
+        return item->_device;
+    case descriptionRole:
+        return item->_description;
+    case sizeRole:
+        return item->_size;
+    case isUsbRole:
+        return item->_isUsb;
+    case isScsiRole:
+        return item->_isScsi;
+    case isReadOnlyRole:
+        return item->_isReadOnly;
+    case isSystemRole:
+        return item->_isSystem;
+    case mountpointsRole:
+        return item->_mountpoints;
+    case usbControllerRole:
+        return item->_usbController;
+    case usbHubRole:
+        return item->_usbHub;
+    case usbPortRole:
+        return item->_usbPort;
+    case usbSpeedRole:
+        return item->_usbSpeed;
+    default:
         return QVariant();
-    else
-        return _drivelist.values().at(row)->property(propertyName);
+    }
 }
 
 void DriveListModel::processDriveList(std::vector<Drivelist::DeviceDescriptor> l)
 {
-    bool changes = false;
     QSet<QString> drivesInNewList;
+    QList<Drive> drivesAdded;
 
     for (auto &i: l)
     {
@@ -80,40 +110,53 @@ void DriveListModel::processDriveList(std::vector<Drivelist::DeviceDescriptor> l
         QString deviceNamePlusSize = QString::fromStdString(i.device)+":"+QString::number(i.size);
         if (i.isReadOnly)
             deviceNamePlusSize += "ro";
+        if (drivesInNewList.contains(deviceNamePlusSize))
+            continue;
         drivesInNewList.insert(deviceNamePlusSize);
 
-        if (!_drivelist.contains(deviceNamePlusSize))
+        if (_indexOf(deviceNamePlusSize) == -1)
         {
             // Found new drive
-            if (!changes)
-            {
-                beginResetModel();
-                changes = true;
-            }
-
-            _drivelist[deviceNamePlusSize] = new DriveListItem(QString::fromStdString(i.device), QString::fromStdString(i.description), i.size, i.isUSB, i.isSCSI, i.isReadOnly, i.isSystem, mountpoints, this);
+            DriveListItem *item = new DriveListItem(QString::fromStdString(i.device), QString::fromStdString(i.description), i.size, i.isUSB, i.isSCSI, i.isReadOnly, i.isSystem, mountpoints, this);
+            item->_usbController = QString::fromStdString(i.usbController);
+            item->_usbHub = QString::fromStdString(i.usbHub);
+            item->_usbPort = QString::fromStdString(i.usbPort);
+            item->_usbSpeed = i.usbSpeed;
+            drivesAdded.append({deviceNamePlusSize, item});
         }
     }
 
-    // Look for drives removed
-    QStringList drivesInOldList = _drivelist.keys();
-    for (auto &device: drivesInOldList)
+    // Remove drives that are gone first, so the rows of the others stay valid
+    for (int row = _drivelist.count()-1; row >= 0; row--)
     {
-        if (!drivesInNewList.contains(device))
+        if (!drivesInNewList.contains(_drivelist.at(row).key))
         {
-            if (!changes)
-            {
-                beginResetModel();
-                changes = true;
-            }
-
-            _drivelist.value(device)->deleteLater();
-            _drivelist.remove(device);
+            beginRemoveRows(QModelIndex(), row, row);
+            _drivelist.at(row).item->deleteLater();
+            _drivelist.removeAt(row);
+            endRemoveRows();
         }
     }
 
-    if (changes)
-        endResetModel();
+    for (auto &drive: drivesAdded)
+    {
+        auto it = std::lower_bound(_drivelist.begin(), _drivelist.end(), drive.key,
+                                   [](const Drive &d, const QString &key) { return d.key < key; });
+        int row = it - _drivelist.begin();
+
+        beginInsertRows(QModelIndex(), row, row);
+        _drivelist.insert(row, drive);
+        endInsertRows();
+    }
+}
+
+int DriveListModel::_indexOf(const QString &key) const
+{
+    auto it = std::lower_bound(_drivelist.cbegin(), _drivelist.cend(), key,
+                               [](const Drive &d, const QString &k) { return d.key < k; });
+    if (it == _drivelist.cend() || it->key != key)
+        return -1;
+    return it - _drivelist.cbegin();
 }
 
 void DriveListModel::startPolling()
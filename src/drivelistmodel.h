@@ -7,7 +7,7 @@
  */
 
 #include <QAbstractItemModel>
-#include <QMap>
+#include <QList>
 #include <QHash>
 #include "drivelistitem.h"
 #include "drivelistmodelpollthread.h"
@@ -24,16 +24,27 @@ public:
     void stopPolling();
 
     enum driveListRoles {
-        deviceRole = Qt::UserRole + 1, descriptionRole, sizeRole, isUsbRole, isScsiRole, isReadOnlyRole, isSystemRole, mountpointsRole
+        deviceRole = Qt::UserRole + 1, descriptionRole, sizeRole, isUsbRole, isScsiRole, isReadOnlyRole, isSystemRole, mountpointsRole,
+        usbControllerRole, usbHubRole, usbPortRole, usbSpeedRole
     };
 
 public slots:
     void processDriveList(std::vector<Drivelist::DeviceDescriptor> l);
 
 protected:
-    QMap<QString,DriveListItem *> _drivelist;
+    struct Drive
+    {
+        QString key;
+        DriveListItem *item;
+    };
+
+    /* Sorted by key (device name plus size), the position is the row */
+    QList<Drive> _drivelist;
     QHash<int, QByteArray> _rolenames;
     DriveListModelPollThread _thread;
+
+    /* Row of the drive, or -1 */
+    int _indexOf(const QString &key) const;
 };
 
 #endif // DRIVELISTMODEL_H
@@ -2,6 +2,12 @@
 #include <QElapsedTimer>
 #include <QDebug>
 
+#ifdef Q_OS_LINUX
+#include "linux/linuxdrivelist.h"
+#elif defined(Q_OS_WIN) || defined(Q_OS_DARWIN)
+#include "drivechangenotifier.h"
+#endif
+
 /*
  * SPDX-License-Identifier: Apache-2.0
  * Copyright (C) 2020 Raspberry Pi Ltd
@@ -36,6 +42,51 @@ void DriveListModelPollThread::run()
 {
     QElapsedTimer t1;
 
+#ifdef Q_OS_LINUX
+    /* Only sends a list when it changed */
+    Drivelist::StorageDeviceMonitor monitor;
+    if (monitor.open())
+    {
+        emit newDriveList( monitor.devices() );
+        while (!_terminate)
+        {
+            if (monitor.waitForChanges(500))
+                emit newDriveList( monitor.devices() );
+        }
+        return;
+    }
+    qDebug() << "Cannot monitor drives, polling them instead";
+#elif defined(Q_OS_WIN) || defined(Q_OS_DARWIN)
+    /* Only lists the drives again when the system reports a change */
+    DriveChangeNotifier notifier;
+    if (notifier.start())
+    {
+        QElapsedTimer sinceList;
+
+        emit newDriveList( Drivelist::ListStorageDevices() );
+        sinceList.start();
+        while (!_terminate)
+        {
+            bool changed = notifier.wait(500);
+#ifdef Q_OS_WIN
+            /* A card put into a reader that was empty brings no new device
+               interface, only the size of the disk changes */
+            changed = changed || sinceList.elapsed() > 5000;
+#endif
+            if (changed)
+            {
+                t1.start();
+                emit newDriveList( Drivelist::ListStorageDevices() );
+                if (t1.elapsed() > 1000)
+                    qDebug() << "Enumerating drives took a long time:" << t1.elapsed()/1000.0 << "seconds";
+                sinceList.start();
+            }
+        }
+        return;
+    }
+    qDebug() << "Cannot get drive notifications, polling drives instead";
+#endif
+
     while (!_terminate)
     {
         t1.start();
@@ -0,0 +1,268 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "encodingselector.h"
+#include "config.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QSettings>
+#include <functional>
+#include <limits>
+#include <lzma.h>
+#include <zstd.h>
+#include <zlib.h>
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
+/* Each decoder runs for at least this many ms, to get past timer resolution and warm up */
+#define ENCODINGSELECTOR_MIN_TIME  200
+
+int EncodingSelector::choose(const QList<Encoding> &encodings, quint64 extractLen)
+{
+    if (encodings.size() < 2)
+        return 0;
+
+    double link = linkRate(encodings.first().url);
+    int best = 0;
+    double bestTime = 0;
+
+    /* Encodings of which the decoder is not known are assumed to be as slow as the slowest known one */
+    double slowest = 0;
+    for (const Encoding &e : encodings)
+    {
+        double rate = decodeRate(format(e.url));
+        if (rate > 0 && (!slowest || rate < slowest))
+            slowest = rate;
+    }
+
+    for (int i = 0; i < encodings.size(); i++)
+    {
+        const Encoding &e = encodings[i];
+        double time;
+
+        if (!link || !e.downloadLen)
+        {
+            /* Nothing to go by but the size */
+            time = e.downloadLen ? e.downloadLen : std::numeric_limits<double>::max();
+        }
+        else
+        {
+            QString f = format(e.url);
+            double rate = (f == "raw") ? 0 : decodeRate(f);
+            if (!rate && f != "raw")
+                rate = slowest;
+            double downloadTime = e.downloadLen / link;
+            double decodeTime = (rate && extractLen) ? extractLen / rate : 0;
+            time = qMax(downloadTime, decodeTime);
+            qDebug() << "Encoding" << e.url.fileName() << "would take" << downloadTime << "s to download and" << decodeTime << "s to decode";
+        }
+
+        if (i == 0 || time < bestTime)
+        {
+            best = i;
+            bestTime = time;
+        }
+    }
+
+    return best;
+}
+
+QString EncodingSelector::format(const QUrl &url)
+{
+    QString name = url.fileName().toLower();
+
+    if (name.endsWith(".xz"))
+        return "xz";
+    if (name.endsWith(".gz"))
+        return "gz";
+    if (name.endsWith(".zst"))
+        return "zst";
+    if (name.endsWith(".lz4"))
+        return "lz4";
+    if (name.endsWith(".img") || name.endsWith(".raw") || name.endsWith(".iso"))
+        return "raw";
+
+    return QString();
+}
+
+double EncodingSelector::decodeRate(const QString &format)
+{
+    if (format.isEmpty() || format == "raw")
+        return 0;
+
+    QSettings settings;
+    QVariant rate = settings.value("encodings/decoderate/"+format);
+    if (rate.isValid())
+        return rate.toDouble();
+
+    benchmark({format});
+    return settings.value("encodings/decoderate/"+format).toDouble();
+}
+
+void EncodingSelector::benchmark(const QStringList &formats)
+{
+    QSettings settings;
+    QByteArray sample;
+
+    for (const QString &format : formats)
+    {
+        if (format.isEmpty() || format == "raw" || settings.contains("encodings/decoderate/"+format))
+            continue;
+
+        if (sample.isEmpty())
+            sample = _sample();
+        double rate = _timeDecoder(format, sample);
+        qDebug() << "Decoding" << format << "on this computer:" << rate / 1000000 << "MB/s";
+        /* Formats that cannot be decoded here are not tried again either */
+        settings.setValue("encodings/decoderate/"+format, rate);
+    }
+}
+
+/* Like a disk image: empty blocks, text, binaries and some data that does not compress */
+QByteArray EncodingSelector::_sample()
+{
+    static const char *words[] = {"usr", "lib", "share", "config", "linux", "firmware", "module", "\n", "=", "/", " ", "0x", "debian", "systemd", "true", "false"};
+    QByteArray sample(IMAGEWRITER_DECODE_BENCHMARK_SIZE, 0);
+    QRandomGenerator rng(1);
+
+    for (qsizetype pos = 0; pos+4096 <= sample.size(); pos += 4096)
+    {
+        char *block = sample.data()+pos;
+
+        switch ((pos / 4096) % 8)
+        {
+        case 0:
+        case 1:
+            break;
+        case 2:
+        case 3:
+        case 4:
+            for (int i = 0; i < 4096; )
+            {
+                const char *w = words[rng.bounded((int) (sizeof(words)/sizeof(words[0])))];
+                while (*w && i < 4096)
+                    block[i++] = *w++;
+            }
+            break;
+        case 5:
+            rng.fillRange((quint32 *) block, 4096/sizeof(quint32));
+            break;
+        default:
+            for (int i = 0; i < 4096; i += 4)
+                *(quint32 *) (block+i) = rng.bounded(256) << 8;
+        }
+    }
+
+    return sample;
+}
+
+double EncodingSelector::_timeDecoder(const QString &format, const QByteArray &sample)
+{
+    QByteArray compressed, decoded(sample.size(), Qt::Uninitialized);
+    std::function<bool()> decode;
+
+    if (format == "zst")
+    {
+        compressed.resize(ZSTD_compressBound(sample.size()));
+        size_t n = ZSTD_compress(compressed.data(), compressed.size(), sample.constData(), sample.size(), 3);
+        if (ZSTD_isError(n))
+            return 0;
+        compressed.resize(n);
+        decode = [&]() {
+            return ZSTD_decompress(decoded.data(), decoded.size(), compressed.constData(), compressed.size()) == (size_t) sample.size();
+        };
+    }
+    else if (format == "xz")
+    {
+        /* Decoding speed hardly depends on the preset, encoding speed does */
+        compressed.resize(lzma_stream_buffer_bound(sample.size()));
+        size_t outPos = 0;
+        if (lzma_easy_buffer_encode(1, LZMA_CHECK_CRC64, nullptr, (const uint8_t *) sample.constData(), sample.size(),
+                                    (uint8_t *) compressed.data(), &outPos, compressed.size()) != LZMA_OK)
+            return 0;
+        compressed.resize(outPos);
+        decode = [&]() {
+            uint64_t memlimit = UINT64_MAX;
+            size_t inPos = 0, decodedPos = 0;
+            return lzma_stream_buffer_decode(&memlimit, 0, nullptr, (const uint8_t *) compressed.constData(), &inPos, compressed.size(),
+                                             (uint8_t *) decoded.data(), &decodedPos, decoded.size()) == LZMA_OK;
+        };
+    }
+    else if (format == "gz")
+    {
+        /* zlib and gzip framing decode at the same speed */
+        uLongf len = compressBound(sample.size());
+        compressed.resize(len);
+        if (compress2((Bytef *) compressed.data(), &len, (const Bytef *) sample.constData(), sample.size(), 6) != Z_OK)
+            return 0;
+        compressed.resize(len);
+        decode = [&]() {
+            uLongf decodedLen = decoded.size();
+            return uncompress((Bytef *) decoded.data(), &decodedLen, (const Bytef *) compressed.constData(), compressed.size()) == Z_OK;
+        };
+    }
+#ifdef HAVE_LZ4
+    else if (format == "lz4")
+    {
+        compressed.resize(LZ4F_compressFrameBound(sample.size(), nullptr));
+        size_t n = LZ4F_compressFrame(compressed.data(), compressed.size(), sample.constData(), sample.size(), nullptr);
+        if (LZ4F_isError(n))
+            return 0;
+        compressed.resize(n);
+        decode = [&]() {
+            LZ4F_dctx *dctx;
+            if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+                return false;
+            size_t decodedLen = decoded.size(), inLen = compressed.size();
+            size_t r = LZ4F_decompress(dctx, decoded.data(), &decodedLen, compressed.constData(), &inLen, nullptr);
+            LZ4F_freeDecompressionContext(dctx);
+            return r == 0 && decodedLen == (size_t) sample.size();
+        };
+    }
+#endif
+    else
+    {
+        return 0;
+    }
+
+    QElapsedTimer t;
+    quint64 bytes = 0;
+    t.start();
+    do
+    {
+        if (!decode())
+        {
+            qDebug() << "Error decoding" << format << "sample";
+            return 0;
+        }
+        bytes += sample.size();
+    } while (t.elapsed() < ENCODINGSELECTOR_MIN_TIME);
+
+    return bytes * 1000.0 / t.elapsed();
+}
+
+double EncodingSelector::linkRate(const QUrl &url)
+{
+    if (url.host().isEmpty())
+        return 0;
+
+    return QSettings().value("encodings/linkrate/"+url.host()).toDouble();
+}
+
+void EncodingSelector::recordDownload(const QUrl &url, quint64 bytes, qint64 msecs)
+{
+    /* Short downloads say more about the round trip time than the link */
+    if (url.host().isEmpty() || msecs < 1000)
+        return;
+
+    QSettings settings;
+    double rate = bytes * 1000.0 / msecs;
+    double previous = settings.value("encodings/linkrate/"+url.host()).toDouble();
+    if (previous)
+        rate = IMAGEWRITER_LINK_RATE_WEIGHT * rate + (1-IMAGEWRITER_LINK_RATE_WEIGHT) * previous;
+    settings.setValue("encodings/linkrate/"+url.host(), rate);
+}
@@ -0,0 +1,56 @@
+#ifndef ENCODINGSELECTOR_H
+#define ENCODINGSELECTOR_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QList>
+#include <QString>
+#include <QStringList>
+#include <QUrl>
+
+/*
+ * Picks which of the encodings an image is published in to download
+ *
+ * OS list entries may list the same image compressed in several ways,
+ * e.g. a small .xz that is slow to decode and a larger .zst that is fast:
+ *
+ *   "encodings": [{"url": "<image URL>", "image_download_size": <bytes>}, ...]
+ *
+ * Downloading and decoding overlap, so a write takes about as long as the
+ * slower of the two. The download time comes from the link speed measured
+ * on earlier downloads from the same host, the decode time from timing the
+ * decoders of this computer on sample data. Both are remembered in the
+ * settings. Without a measured link speed the smallest download is taken.
+ */
+class EncodingSelector
+{
+public:
+    struct Encoding
+    {
+        QUrl url;
+        quint64 downloadLen;
+    };
+
+    /* Index of the encoding expected to be written the soonest. extractLen may be 0 if unknown */
+    static int choose(const QList<Encoding> &encodings, quint64 extractLen);
+
+    /* Time the decoders of formats that are not timed yet. Takes a second or so */
+    static void benchmark(const QStringList &formats);
+    /* Decoded bytes per second, 0 if the format is not known. Benchmarks it if needed */
+    static double decodeRate(const QString &format);
+    /* "xz", "gz", "zst", "lz4", "raw" or empty if not known, from the file name */
+    static QString format(const QUrl &url);
+
+    /* Bytes per second downloads from the host of url came in at, 0 if none was measured */
+    static double linkRate(const QUrl &url);
+    static void recordDownload(const QUrl &url, quint64 bytes, qint64 msecs);
+
+protected:
+    static double _timeDecoder(const QString &format, const QByteArray &sample);
+    static QByteArray _sample();
+};
+
+#endif // ENCODINGSELECTOR_H
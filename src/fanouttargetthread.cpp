@@ -0,0 +1,246 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "fanouttargetthread.h"
+#include "config.h"
+#include "threadplacement.h"
+#include <QDebug>
+#include <string.h>
+
+FanoutTargetThread::FanoutTargetThread(const QByteArray &dst, const QByteArray &expectedHash, QObject *parent)
+    : DownloadThread("", dst, expectedHash, isImageFile(dst), parent), _queueDepth(IMAGEWRITER_FANOUT_QUEUE_DEPTH), _finished(false), _failed(false),
+      _spilled(false), _spillBuf(nullptr), _spillPos(0), _available(0)
+{
+    /* Errors are emitted from several places, some not virtual. Catch them all here */
+    connect(this, &DownloadThread::error, this, [this]() {
+        std::lock_guard<std::mutex> lock(_blocksMutex);
+        _failed = true;
+        _blocksCv.notify_all();
+    }, Qt::DirectConnection);
+}
+
+FanoutTargetThread::~FanoutTargetThread()
+{
+    cancelDownload();
+    wait();
+    if (_spillBuf)
+        qFreeAligned(_spillBuf);
+}
+
+/* Aligned, so O_DIRECT can write it as is */
+FanoutTargetThread::Block FanoutTargetThread::allocateBlock(BufferPool *pool, const char *buf, size_t len)
+{
+    Block b;
+    b.data = pool->acquire(len);
+    b.len = len;
+    ::memcpy(b.data.get(), buf, len);
+
+    return b;
+}
+
+void FanoutTargetThread::cancelDownload()
+{
+    std::lock_guard<std::mutex> lock(_blocksMutex);
+    DownloadThread::cancelDownload();
+    _blocksCv.notify_all();
+}
+
+FanoutTargetThread::PushResult FanoutTargetThread::push(const Block &block, int timeoutMs)
+{
+    std::unique_lock<std::mutex> lock(_blocksMutex);
+    auto ready = [this]{
+        return _blocks.size() < _queueDepth || _failed || _cancelled;
+    };
+
+    if (timeoutMs < 0)
+        _blocksCv.wait(lock, ready);
+    else if (!_blocksCv.wait_for(lock, std::chrono::milliseconds(timeoutMs), ready))
+        return Lagging;
+
+    if (_failed || _cancelled)
+        return Dropped;
+
+    _blocks.push_back(block);
+    _blocksCv.notify_all();
+
+    return Queued;
+}
+
+bool FanoutTargetThread::spill(const QString &filename, quint64 offset)
+{
+    _spillFile.setFileName(filename);
+    if (!_spillFile.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Cannot open" << filename << "to continue writing" << _filename << "from it";
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(_blocksMutex);
+    _spillPos = _available = offset;
+    _spilled = true;
+    qDebug() << _filename << "falling behind. Continuing from" << filename << "at offset" << offset;
+
+    return true;
+}
+
+void FanoutTargetThread::setAvailable(quint64 bytes)
+{
+    std::lock_guard<std::mutex> lock(_blocksMutex);
+    _available = bytes;
+    _blocksCv.notify_all();
+}
+
+bool FanoutTargetThread::spilled() const
+{
+    return _spilled;
+}
+
+void FanoutTargetThread::fail(const QString &msg)
+{
+    _cancelled = true;
+    emit error(msg);
+}
+
+void FanoutTargetThread::finish()
+{
+    std::lock_guard<std::mutex> lock(_blocksMutex);
+    _finished = true;
+    _blocksCv.notify_all();
+}
+
+void FanoutTargetThread::setQueueDepth(int depth)
+{
+    _queueDepth = depth;
+}
+
+bool FanoutTargetThread::failed() const
+{
+    return _failed;
+}
+
+QByteArray FanoutTargetThread::device() const
+{
+    return _filename;
+}
+
+quint64 FanoutTargetThread::bytesPerSecond()
+{
+    qint64 elapsed = _timer.isValid() ? _timer.elapsed() : 0;
+    if (elapsed <= 0)
+        return 0;
+
+    return bytesWritten() * 1000 / elapsed;
+}
+
+void FanoutTargetThread::_reportProgress(bool force)
+{
+    if (!force && _progressTimer.isValid() && _progressTimer.elapsed() < IMAGEWRITER_FANOUT_PROGRESS_INTERVAL)
+        return;
+    _progressTimer.start();
+
+    QVariantMap progress;
+    progress["device"] = QString(_filename);
+    progress["bytesWritten"] = (qulonglong) bytesWritten();
+    progress["bytesPerSecond"] = (qulonglong) bytesPerSecond();
+    progress["spilled"] = (bool) _spilled;
+    emit updateNumProgress(progress);
+}
+
+/* Write the next len bytes from the spill file. Data past its end is a trailing hole of the sparse file */
+bool FanoutTargetThread::_writeSpilled(size_t len)
+{
+    if (!_spillBuf)
+        _spillBuf = (char *) qMallocAligned(IMAGEWRITER_BLOCKSIZE, 4096);
+    char *buf = _spillBuf;
+    qint64 n = 0;
+
+    if (!_spillFile.seek(_spillPos) || (n = _spillFile.read(buf, len)) < 0)
+    {
+        DownloadThread::_onDownloadError(tr("Error reading extracted image from cache"));
+        return false;
+    }
+    if ((size_t) n < len)
+        ::memset(buf+n, 0, len-n);
+
+    if (_writeFile(buf, len) != len)
+    {
+        _onWriteError();
+        return false;
+    }
+    _spillPos += len;
+
+    return true;
+}
+
+void FanoutTargetThread::run()
+{
+    ThreadPlacement::apply(ThreadPlacement::StageWrite);
+    if (!_openAndPrepareDevice())
+        return;
+    if (!_bmapUrl.isEmpty())
+        _fetchBmap();
+
+    _timer.start();
+    std::unique_lock<std::mutex> lock(_blocksMutex);
+
+    while (true)
+    {
+        _blocksCv.wait(lock, [this]{
+            return !_blocks.empty() || _finished || _cancelled || (_spilled && _spillPos < _available);
+        });
+        if (_cancelled)
+            break;
+
+        /* Blocks queued before spilling come first */
+        if (!_blocks.empty())
+        {
+            Block block = _blocks.front();
+            _blocks.pop_front();
+            _blocksCv.notify_all();
+            lock.unlock();
+
+            if (_writeFile(block.data.get(), block.len) != block.len)
+            {
+                _onWriteError();
+                _closeFiles();
+                return;
+            }
+        }
+        else if (_spilled && _spillPos < _available)
+        {
+            size_t len = qMin(_available - _spillPos, (quint64) IMAGEWRITER_BLOCKSIZE);
+            lock.unlock();
+
+            if (!_writeSpilled(len))
+            {
+                _closeFiles();
+                return;
+            }
+        }
+        else
+        {
+            break;
+        }
+
+        _reportProgress();
+        lock.lock();
+    }
+
+    bool complete = _finished && !_cancelled;
+    lock.unlock();
+    _spillFile.close();
+
+    if (complete)
+    {
+        qDebug() << "All data written to" << _filename << "at" << bytesPerSecond() / 1000000 << "MB/s";
+        _reportProgress(true);
+        _writeComplete();
+    }
+    else
+    {
+        _failed = true;
+        _closeFiles();
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef FANOUTTARGETTHREAD_H
+#define FANOUTTARGETTHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadthread.h"
+#include <QFile>
+#include <QVariantMap>
+#include <deque>
+#include <memory>
+
+/*
+ * One of several storage devices written with the same image at once
+ *
+ * A DownloadThread with fan-out targets downloads and extracts the image
+ * once, and hands every block to each target with push(). Each target has
+ * its own queue and writes, hashes, verifies, customizes and ejects its
+ * device on its own thread. A target that fails only drops out itself,
+ * the others carry on.
+ *
+ * A device that keeps its queue full for too long is spilled: it stops
+ * receiving blocks and reads the rest of the image from the extracted
+ * image cache file, at its own pace, so it does not hold back the
+ * decompressor and the faster devices.
+ */
+class FanoutTargetThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    /* Block of the extracted image, shared by all targets */
+    struct Block
+    {
+        PooledBuffer data;
+        size_t len;
+    };
+    static Block allocateBlock(BufferPool *pool, const char *buf, size_t len);
+
+    explicit FanoutTargetThread(const QByteArray &dst, const QByteArray &expectedHash = "", QObject *parent = nullptr);
+    virtual ~FanoutTargetThread();
+    virtual void cancelDownload();
+
+    enum PushResult
+    {
+        Queued,
+        /* Queue stayed full for longer than the timeout, block was not queued */
+        Lagging,
+        /* Target failed or was cancelled */
+        Dropped
+    };
+
+    /* Queue a block for writing. Blocks while the queue is full, for at most
+       timeoutMs if not negative */
+    PushResult push(const Block &block, int timeoutMs = -1);
+    /* Read everything from offset on from file instead of the queue.
+       The file is filled by the caller, who reports progress with setAvailable() */
+    bool spill(const QString &filename, quint64 offset);
+    void setAvailable(quint64 bytes);
+    bool spilled() const;
+    /* Stop with an error. Can be called from another thread */
+    void fail(const QString &msg);
+    /* All blocks are pushed. Completes the write, verify and customization */
+    void finish();
+    void setQueueDepth(int depth);
+
+    bool failed() const;
+    QByteArray device() const;
+    /* Average write speed in bytes per second */
+    quint64 bytesPerSecond();
+
+protected:
+    virtual void run();
+    bool _writeSpilled(size_t len);
+    /* Emits updateNumProgress() with a map of device, bytesWritten,
+       bytesPerSecond and spilled, at most every IMAGEWRITER_FANOUT_PROGRESS_INTERVAL ms */
+    void _reportProgress(bool force = false);
+
+    std::deque<Block> _blocks;
+    std::mutex _blocksMutex;
+    std::condition_variable _blocksCv;
+    size_t _queueDepth;
+    bool _finished;
+    std::atomic<bool> _failed, _spilled;
+    QFile _spillFile;
+    /* IMAGEWRITER_BLOCKSIZE, reused for every read from _spillFile */
+    char *_spillBuf;
+    quint64 _spillPos, _available;
+    QElapsedTimer _progressTimer;
+};
+
+#endif // FANOUTTARGETTHREAD_H
@@ -0,0 +1,87 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "fastbootthread.h"
+#include "fastbootwrapper.h"
+#include "config.h"
+#include "pipelinetrace.h"
+#include <QDebug>
+
+FastbootThread::FastbootThread(const QByteArray &url, const QByteArray &localfilename,
+                               const QByteArray &expectedHash, const QByteArray &tiboot3Hash,
+                               const QByteArray &tisplHash, const QByteArray &ubootHash, QObject *parent)
+    : DfuThread(url, localfilename, expectedHash, tiboot3Hash, tisplHash, ubootHash, parent)
+    , _partition(IMAGEWRITER_FASTBOOT_PARTITION)
+{
+}
+
+FastbootThread::~FastbootThread()
+{
+    /* The sessions are on the stack of run() */
+    wait();
+}
+
+void FastbootThread::setPartition(const QByteArray &partition)
+{
+    _partition = partition;
+}
+
+void FastbootThread::cancelDownload()
+{
+    DfuThread::cancelDownload();
+
+    std::lock_guard<std::mutex> lock(_sessionsMutex);
+    for (FastbootWrapper *fastboot : std::as_const(_sessions))
+        fastboot->cancel();
+}
+
+bool FastbootThread::sendImageToBoard(Board *board, qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read, QString &error)
+{
+    DfuWrapper &dfu = board->dfu;
+    if (!dfu.initialize()
+        || !dfu.findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, DfuWrapper::ALT_RAWEMMC)) {
+        error = tr("DFU failed (alt: %1): %2").arg(QString(DfuWrapper::ALT_RAWEMMC), dfu.lastError());
+        return false;
+    }
+
+    /* The sparse images cover the whole image, so its size has to be known */
+    if (size <= 0 || !dfu.hasAltSetting(DfuWrapper::ALT_FASTBOOT)) {
+        qDebug() << "Board" << board->path << (size <= 0 ? "image size not known" : "does not offer fastboot")
+                 << "- sending the image over DFU";
+        return DfuThread::sendImageToBoard(board, size, read, error);
+    }
+
+    if (!dfu.findDevice(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID, DfuWrapper::ALT_FASTBOOT)
+        || !dfu.detach()) {
+        error = tr("DFU failed (alt: %1): %2").arg(QString(DfuWrapper::ALT_FASTBOOT), dfu.lastError());
+        return false;
+    }
+
+    TraceSpan span("fastbootTransfer");
+    FastbootWrapper fastboot;
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+        _sessions.append(&fastboot);
+    }
+    if (_cancelled)
+        fastboot.cancel();
+
+    boardProgress(board, 82, tr("Waiting for device to enter fastboot mode..."));
+    bool ok = fastboot.open(board->path, IMAGEWRITER_FASTBOOT_ENUMERATE_TIMEOUT)
+           && fastboot.flashSparseStream(_partition, size, read, [this, board, size](qint64 bytes) {
+                  boardProgress(board, 82 + (int) (13 * bytes / size),
+                                tr("Flashing image over fastboot (%1 of %2 MB)...").arg(bytes / 1024 / 1024).arg(size / 1024 / 1024));
+              })
+           /* U-Boot goes on to write the boot binaries, as after DFU */
+           && fastboot.continueBoot();
+    if (!ok)
+        error = tr("Fastboot failed: %1").arg(fastboot.lastError());
+
+    {
+        std::lock_guard<std::mutex> lock(_sessionsMutex);
+        _sessions.removeOne(&fastboot);
+    }
+    return ok;
+}
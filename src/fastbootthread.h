@@ -0,0 +1,47 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#ifndef FASTBOOTTHREAD_H
+#define FASTBOOTTHREAD_H
+
+#include "dfuthread.h"
+#include <QList>
+#include <mutex>
+
+class FastbootWrapper;
+
+/*
+ * Flashes boards like DfuThread, but sends the image over fastboot
+ *
+ * The bootloader stages still go over DFU. Once U-Boot is up, it is asked
+ * to leave DFU for fastboot (the "fastboot" alt setting), and the image is
+ * sent as Android sparse images over USB bulk transfers, which is many
+ * times faster than DFU's control transfer per block, and leaves out empty
+ * space. Boards whose U-Boot does not offer fastboot, and images of which
+ * the size is not known up front, are sent over DFU as before.
+ */
+class FastbootThread : public DfuThread
+{
+    Q_OBJECT
+public:
+    explicit FastbootThread(const QByteArray &url, const QByteArray &localfilename,
+                            const QByteArray &expectedHash, const QByteArray &tiboot3Hash, const QByteArray &tisplHash, const QByteArray &ubootHash, QObject *parent = nullptr);
+    ~FastbootThread();
+
+    /* Partition as U-Boot's fastboot names it. Default is the whole eMMC */
+    void setPartition(const QByteArray &partition);
+    void cancelDownload() override;
+
+protected:
+    bool sendImageToBoard(Board *board, qint64 size, const std::function<qint64(char *buf, qint64 maxLen)> &read, QString &error) override;
+
+private:
+    QByteArray _partition;
+    /* Fastboot sessions in progress, to cancel them */
+    QList<FastbootWrapper *> _sessions;
+    std::mutex _sessionsMutex;
+};
+
+#endif // FASTBOOTTHREAD_H
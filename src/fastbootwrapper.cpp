@@ -0,0 +1,327 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "fastbootwrapper.h"
+#include "dfuwrapper.h"
+#include "sparseimage.h"
+#include "config.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QThread>
+#include <thread>
+
+extern "C" {
+#include <libusb.h>
+}
+
+namespace {
+
+constexpr int COMMAND_TIMEOUT_MS = 5000;
+// U-Boot writes a whole piece to the eMMC before it replies to flash
+constexpr int FLASH_TIMEOUT_MS = 300000;
+// Replies are read with this timeout, so cancelling does not wait for the full one
+constexpr int POLL_TIMEOUT_MS = 1000;
+constexpr int REPROBE_INTERVAL_MS = 200;
+// Data of a download goes out in bulk transfers of this size
+constexpr int BULK_TRANSFER_SIZE = 1024 * 1024;
+// Longest reply of the protocol, including its four character status
+constexpr int MAX_REPLY_SIZE = 256;
+
+} // namespace
+
+FastbootWrapper::FastbootWrapper()
+    : usbContext(nullptr), handle(nullptr), interfaceNumber(-1), endpointIn(0), endpointOut(0)
+{
+}
+
+FastbootWrapper::~FastbootWrapper()
+{
+    close();
+}
+
+void FastbootWrapper::setError(const QString &msg)
+{
+    _lastError = msg;
+    qDebug() << "FastbootWrapper error:" << msg;
+}
+
+bool FastbootWrapper::open(const QString &path, int timeoutMs)
+{
+    close();
+    int ret = libusb_init(&usbContext);
+    if (ret < 0) {
+        usbContext = nullptr;
+        setError(QString("Failed to initialize libusb: %1").arg(libusb_error_name(ret)));
+        return false;
+    }
+
+    // U-Boot only starts fastboot once the DFU session ended and the
+    // gadget came back, so this usually waits for a re-enumeration
+    QElapsedTimer timer;
+    timer.start();
+    while (!cancelled) {
+        libusb_device **list;
+        ssize_t count = libusb_get_device_list(usbContext, &list);
+        for (ssize_t i = 0; i < count && !handle; i++) {
+            if (path.isEmpty() || DfuWrapper::usbPath(list[i]) == path)
+                claim(list[i]);
+        }
+        if (count >= 0)
+            libusb_free_device_list(list, 1);
+
+        if (handle)
+            return true;
+        if (timer.elapsed() > timeoutMs) {
+            setError(path.isEmpty() ? QString("No fastboot device found")
+                                    : QString("No fastboot device found at %1").arg(path));
+            return false;
+        }
+        QThread::msleep(REPROBE_INTERVAL_MS);
+    }
+
+    setError("Cancelled");
+    return false;
+}
+
+bool FastbootWrapper::claim(struct libusb_device *dev)
+{
+    struct libusb_config_descriptor *config;
+    if (libusb_get_active_config_descriptor(dev, &config) != 0)
+        return false;
+
+    int number = -1;
+    unsigned char in = 0, out = 0;
+    for (int i = 0; i < config->bNumInterfaces && number < 0; i++) {
+        for (int a = 0; a < config->interface[i].num_altsetting; a++) {
+            const struct libusb_interface_descriptor *intf = &config->interface[i].altsetting[a];
+            if (intf->bInterfaceClass != FASTBOOT_CLASS || intf->bInterfaceSubClass != FASTBOOT_SUBCLASS
+                || intf->bInterfaceProtocol != FASTBOOT_PROTOCOL)
+                continue;
+
+            for (int e = 0; e < intf->bNumEndpoints; e++) {
+                const struct libusb_endpoint_descriptor *ep = &intf->endpoint[e];
+                if ((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+                    continue;
+                if (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+                    in = ep->bEndpointAddress;
+                else
+                    out = ep->bEndpointAddress;
+            }
+            if (in && out) {
+                number = intf->bInterfaceNumber;
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    if (number < 0)
+        return false;
+
+    struct libusb_device_handle *h;
+    int ret = libusb_open(dev, &h);
+    if (ret != 0) {
+        setError(QString("Cannot open fastboot device: %1").arg(libusb_error_name(ret)));
+        return false;
+    }
+    libusb_set_auto_detach_kernel_driver(h, 1);
+    ret = libusb_claim_interface(h, number);
+    if (ret != 0) {
+        setError(QString("Cannot claim fastboot interface: %1").arg(libusb_error_name(ret)));
+        libusb_close(h);
+        return false;
+    }
+
+    handle = h;
+    interfaceNumber = number;
+    endpointIn = in;
+    endpointOut = out;
+    qDebug() << "Fastboot device at" << DfuWrapper::usbPath(dev);
+    return true;
+}
+
+void FastbootWrapper::close()
+{
+    if (handle) {
+        libusb_release_interface(handle, interfaceNumber);
+        libusb_close(handle);
+        handle = nullptr;
+    }
+    if (usbContext) {
+        libusb_exit(usbContext);
+        usbContext = nullptr;
+    }
+}
+
+void FastbootWrapper::cancel()
+{
+    cancelled = true;
+}
+
+bool FastbootWrapper::command(const QByteArray &cmd, QByteArray *value, int timeoutMs)
+{
+    if (!handle) {
+        setError("No fastboot device");
+        return false;
+    }
+    if (cancelled) {
+        setError("Cancelled");
+        return false;
+    }
+
+    int sent = 0;
+    int ret = libusb_bulk_transfer(handle, endpointOut, (unsigned char *) cmd.constData(), cmd.size(), &sent, COMMAND_TIMEOUT_MS);
+    if (ret != 0 || sent != cmd.size()) {
+        setError(QString("Sending %1 failed: %2").arg(QString(cmd), libusb_error_name(ret)));
+        return false;
+    }
+
+    return readReply(cmd, value, timeoutMs);
+}
+
+// INFO replies are progress messages, the command goes on after them
+bool FastbootWrapper::readReply(const QByteArray &cmd, QByteArray *value, int timeoutMs)
+{
+    unsigned char reply[MAX_REPLY_SIZE];
+    QElapsedTimer timer;
+    timer.start();
+
+    while (!cancelled) {
+        int got = 0;
+        int ret = libusb_bulk_transfer(handle, endpointIn, reply, sizeof(reply), &got, POLL_TIMEOUT_MS);
+        if (ret == LIBUSB_ERROR_TIMEOUT) {
+            if (timer.elapsed() > timeoutMs) {
+                setError(QString("No reply to %1").arg(QString(cmd)));
+                return false;
+            }
+            continue;
+        }
+        if (ret != 0) {
+            setError(QString("Reading reply to %1 failed: %2").arg(QString(cmd), libusb_error_name(ret)));
+            return false;
+        }
+
+        QByteArray r((const char *) reply, got);
+        QByteArray status = r.left(4);
+        if (status == "INFO") {
+            qDebug() << "Fastboot:" << r.mid(4);
+        } else if (status == "OKAY" || status == "DATA") {
+            if (value)
+                *value = r.mid(4);
+            return true;
+        } else if (status == "FAIL") {
+            setError(QString("%1 failed: %2").arg(QString(cmd), QString(r.mid(4))));
+            return false;
+        } else {
+            setError(QString("Unexpected reply to %1: %2").arg(QString(cmd), QString(r)));
+            return false;
+        }
+    }
+
+    setError("Cancelled");
+    return false;
+}
+
+bool FastbootWrapper::getVar(const QByteArray &name, QByteArray &value)
+{
+    return command("getvar:" + name, &value, COMMAND_TIMEOUT_MS);
+}
+
+bool FastbootWrapper::bulkOut(const char *data, qint64 len)
+{
+    for (qint64 pos = 0; pos < len; ) {
+        if (cancelled) {
+            setError("Cancelled");
+            return false;
+        }
+
+        int n = (int) qMin((qint64) BULK_TRANSFER_SIZE, len - pos);
+        int sent = 0;
+        int ret = libusb_bulk_transfer(handle, endpointOut, (unsigned char *) data + pos, n, &sent, COMMAND_TIMEOUT_MS);
+        pos += sent;
+        if (ret != 0) {
+            setError(QString("Sending data failed: %1").arg(libusb_error_name(ret)));
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool FastbootWrapper::download(const QByteArray &data)
+{
+    QByteArray cmd = "download:" + QByteArray::number((qulonglong) data.size(), 16).rightJustified(8, '0');
+    QByteArray accepted;
+    if (!command(cmd, &accepted, COMMAND_TIMEOUT_MS))
+        return false;
+    if (accepted.toLongLong(nullptr, 16) != data.size()) {
+        setError(QString("Device accepts %1 bytes instead of %2").arg(QString(accepted)).arg(data.size()));
+        return false;
+    }
+
+    return bulkOut(data.constData(), data.size()) && readReply("download", nullptr, COMMAND_TIMEOUT_MS);
+}
+
+bool FastbootWrapper::flashSparseStream(const QByteArray &partition, qint64 size,
+                                        const std::function<qint64(char *buf, qint64 maxLen)> &read,
+                                        const std::function<void(qint64 bytes)> &progress)
+{
+    if (size <= 0) {
+        setError("Sparse transfer needs the image size");
+        return false;
+    }
+
+    // Given as 0x followed by hex digits by U-Boot
+    QByteArray value;
+    if (!getVar("max-download-size", value))
+        return false;
+    qint64 maxDownload = value.toLongLong(nullptr, 0);
+    if (maxDownload <= 0) {
+        setError(QString("Device has no usable download buffer: %1").arg(QString(value)));
+        return false;
+    }
+    qint64 pieceSize = qMin(maxDownload, (qint64) IMAGEWRITER_FASTBOOT_PIECE_SIZE);
+
+    // Written in eMMC blocks of 4 KB
+    SparseImageSplitter splitter(size, 4096, pieceSize, read);
+    QByteArray piece, next;
+    int pieces = 0;
+    int got = splitter.nextPiece(piece);
+    qint64 flashed = 0;
+
+    while (got > 0) {
+        if (!download(piece))
+            return false;
+
+        // Reading and encoding the next piece overlaps with the device writing this one
+        qint64 pieceEnd = splitter.inputBytes();
+        int nextGot = 0;
+        std::thread reader([&]() { nextGot = splitter.nextPiece(next); });
+        bool ok = command("flash:" + partition, nullptr, FLASH_TIMEOUT_MS);
+        reader.join();
+        if (!ok)
+            return false;
+
+        pieces++;
+        flashed = pieceEnd;
+        if (progress)
+            progress(flashed);
+        piece.swap(next);
+        got = nextGot;
+    }
+
+    if (got < 0) {
+        setError(splitter.errorString());
+        return false;
+    }
+
+    qDebug() << "Flashed" << size << "byte image to" << partition << "as" << pieces << "sparse images of"
+             << splitter.encodedBytes() << "bytes";
+    return true;
+}
+
+bool FastbootWrapper::continueBoot()
+{
+    return command("continue", nullptr, COMMAND_TIMEOUT_MS);
+}
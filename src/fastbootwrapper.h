@@ -0,0 +1,77 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#ifndef FASTBOOTWRAPPER_H
+#define FASTBOOTWRAPPER_H
+
+#include <QByteArray>
+#include <QString>
+#include <atomic>
+#include <functional>
+
+struct libusb_context;
+struct libusb_device;
+struct libusb_device_handle;
+
+// Talks the fastboot protocol to a U-Boot over USB bulk endpoints.
+//
+// Commands and replies go over the bulk endpoints of the fastboot
+// interface, and so does the data of a download, without the control
+// transfer and status poll per block of DFU. A download has to fit the
+// buffer of the device, larger images are flashed in pieces
+class FastbootWrapper
+{
+public:
+    // Interface class, subclass and protocol of a fastboot interface
+    static constexpr int FASTBOOT_CLASS    = 0xff;
+    static constexpr int FASTBOOT_SUBCLASS = 0x42;
+    static constexpr int FASTBOOT_PROTOCOL = 0x03;
+
+    FastbootWrapper();
+    ~FastbootWrapper();
+
+    // Waits up to timeoutMs for a device with a fastboot interface at the
+    // USB path (see DfuWrapper::devicePaths()), or for any if path is empty,
+    // and claims the interface
+    bool open(const QString &path, int timeoutMs);
+    void close();
+    // Value of a variable of the device, like "max-download-size"
+    bool getVar(const QByteArray &name, QByteArray &value);
+    // Flashes size bytes to the partition, pulling them from read() as
+    // DfuWrapper::downloadStream() does. They go as Android sparse images,
+    // as large as the device's download buffer allows, so runs of zeroes
+    // are not sent. The next piece is read while the device writes the
+    // last one. progress() is called with the bytes flashed so far
+    bool flashSparseStream(const QByteArray &partition, qint64 size,
+                           const std::function<qint64(char *buf, qint64 maxLen)> &read,
+                           const std::function<void(qint64 bytes)> &progress);
+    // Ends fastboot mode. U-Boot goes on with what comes after the fastboot command
+    bool continueBoot();
+
+    QString lastError() const { return _lastError; }
+    // Makes the wait or command in progress, and every later one, fail
+    // soon. Safe to call from any thread
+    void cancel();
+
+private:
+    struct libusb_context *usbContext;
+    struct libusb_device_handle *handle;
+    int interfaceNumber;
+    unsigned char endpointIn, endpointOut;
+    QString _lastError;
+    std::atomic<bool> cancelled{false};
+
+    // Opens dev and claims its fastboot interface, if it has one
+    bool claim(struct libusb_device *dev);
+    // Sends the command and waits up to timeoutMs for its final reply.
+    // value is what follows OKAY or DATA
+    bool command(const QByteArray &cmd, QByteArray *value, int timeoutMs);
+    bool readReply(const QByteArray &cmd, QByteArray *value, int timeoutMs);
+    bool download(const QByteArray &data);
+    bool bulkOut(const char *data, qint64 len);
+    void setError(const QString &msg);
+};
+
+#endif // FASTBOOTWRAPPER_H
@@ -0,0 +1,433 @@
+/*
+ * Benchmark of customizing the boot partition, on synthetic FAT images
+ *
+ * Usage: fatbenchmark [<runs> [<work directory>]]
+ *
+ * Generates FAT16 and FAT32 partitions of several sizes, half full, with
+ * the free clusters in one piece at the end or scattered as holes between
+ * the clusters of other files. On each, it does the reads and writes
+ * DownloadThread::_applyCustomization() does through DeviceWrapper:
+ * config.txt, issue.txt, firstrun.sh, user-data, network-config and
+ * cmdline.txt, followed by sync().
+ *
+ * Reported are the reads and writes that reach the block device and the
+ * amount of data they transfer, which is what costs on a card behind a
+ * USB reader, and the best time of the runs. The image is in the page
+ * cache, so the times are those of the FAT code more than of storage.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "blockdevice.h"
+#include "devicewrapper.h"
+#include "devicewrapperfatpartition.h"
+#include "devicewrapperstructs.h"
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QLoggingCategory>
+#include <QVector>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <string.h>
+
+/* Start of the partition, in 512 byte sectors */
+#define FATBENCHMARK_PARTITION_START  2048
+/* Files the used clusters belong to */
+#define FATBENCHMARK_FILLER_FILES     200
+
+struct Layout
+{
+    const char *name;
+    bool fat32;
+    quint64 megabytes;
+    int sectorsPerCluster;
+};
+
+static const Layout layouts[] = {
+    {"FAT16 64 MB", false, 64, 4},
+    {"FAT16 256 MB", false, 256, 16},
+    {"FAT32 512 MB", true, 512, 8},
+    {"FAT32 2 GB", true, 2048, 8}
+};
+
+/* Percentage of the free clusters that are holes between used ones */
+static const int fragmentations[] = {0, 50, 90};
+
+/* Counts the transfers DeviceWrapper makes */
+class CountingDeviceWrapper : public DeviceWrapper
+{
+public:
+    using DeviceWrapper::DeviceWrapper;
+
+    quint64 reads = 0, blocksRead = 0, writes = 0, blocksWritten = 0;
+
+protected:
+    virtual void _readBlocks(quint64 blockNr, char * const *bufs, int count)
+    {
+        reads++;
+        blocksRead += count;
+        DeviceWrapper::_readBlocks(blockNr, bufs, count);
+    }
+
+    virtual void _writeBlocks(quint64 blockNr, const char * const *bufs, int count)
+    {
+        writes++;
+        blocksWritten += count;
+        DeviceWrapper::_writeBlocks(blockNr, bufs, count);
+    }
+};
+
+struct Result
+{
+    quint64 reads = 0, blocksRead = 0, writes = 0, blocksWritten = 0;
+    qint64 openNsecs = 0, filesNsecs = 0, syncNsecs = 0;
+};
+
+/* line repeated up to size bytes */
+static QByteArray payload(const QByteArray &line, int size)
+{
+    QByteArray data;
+    while (data.size() < size)
+        data += line;
+    return data.left(size);
+}
+
+static const QByteArray config = payload("# Uncomment some or all of these to enable the optional hardware interfaces\n#dtparam=i2c_arm=on\ndtparam=audio=on\n", 1500);
+static const QByteArray cmdline = "console=serial0,115200 console=tty1 root=PARTUUID=4e639091-02 rootfstype=ext4 fsck.repair=yes rootwait\n";
+static const QByteArray issue = "Raspberry Pi reference 2024-07-04\nGenerated using pi-gen, https://github.com/RPi-Distro/pi-gen\n";
+static const QByteArray firstrun = payload("   /usr/lib/raspberrypi-sys-mods/imager_custom set_hostname gemstone\n", 6000);
+static const QByteArray userData = payload("#cloud-config\nhostname: gemstone\nmanage_etc_hosts: true\n", 3000);
+static const QByteArray networkConfig = payload("network:\n  version: 2\n  wifis:\n    renderer: networkd\n", 600);
+static const QByteArray extraConfig = "dtoverlay=vc4-kms-v3d\nenable_uart=1\n";
+static const QByteArray extraCmdline = " systemd.run=/boot/firstrun.sh systemd.run_success_action=reboot systemd.unit=kernel-command-line.target";
+
+static void setDirEntry(struct dir_entry *entry, const char *name, uint32_t firstCluster, uint32_t size)
+{
+    memset(entry, 0, sizeof(*entry));
+    memcpy(entry->DIR_Name, name, sizeof(entry->DIR_Name));
+    entry->DIR_Attr = ATTR_ARCHIVE;
+    entry->DIR_FstClusHI = firstCluster >> 16;
+    entry->DIR_FstClusLO = firstCluster & 0xFFFF;
+    entry->DIR_FileSize = size;
+}
+
+/* Writes an MBR with one partition, and a file system in it with the files customization looks at */
+static bool generateImage(const QString &filename, const Layout &layout, int fragmentation)
+{
+    const quint64 partStart = FATBENCHMARK_PARTITION_START * 512ULL;
+    const uint32_t partSectors = layout.megabytes * 2048;
+    const uint16_t reservedSectors = layout.fat32 ? 32 : 4;
+    const uint16_t rootEntries = layout.fat32 ? 0 : 512;
+    const uint32_t rootDirSectors = rootEntries * 32 / 512;
+    const uint32_t bytesPerCluster = layout.sectorsPerCluster * 512;
+    const uint32_t entrySize = layout.fat32 ? 4 : 2;
+    const uint32_t eoc = layout.fat32 ? 0x0FFFFFFF : 0xFFFF;
+
+    /* Sized for the clusters there would be without the FATs, which is a few more than there are */
+    const uint32_t fatSectors = (((partSectors - reservedSectors - rootDirSectors) / layout.sectorsPerCluster + 2) * entrySize + 511) / 512;
+    const uint32_t clusterCount = (partSectors - reservedSectors - 2*fatSectors - rootDirSectors) / layout.sectorsPerCluster;
+    const quint64 rootDirOffset = partStart + (reservedSectors + 2*fatSectors) * 512ULL;
+    const quint64 clusterOffset = rootDirOffset + rootDirSectors * 512ULL;
+
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadWrite | QIODevice::Truncate) || !f.resize(partStart + partSectors * 512ULL))
+        return false;
+
+    /* Half of the clusters are free. The holes are spread evenly over the used part, the rest is one piece after it */
+    QVector<uint32_t> fat(clusterCount+2, 0);
+    const uint32_t freeClusters = clusterCount / 2;
+    const uint32_t holes = (quint64) freeClusters * fragmentation / 100;
+    const uint32_t used = clusterCount - freeClusters, region = used + holes;
+    uint32_t nextIndex = 0, allocated = 0;
+
+    fat[0] = layout.fat32 ? 0x0FFFFFF8 : 0xFFF8;
+    fat[1] = eoc;
+
+    auto isHole = [&](uint32_t i) {
+        return holes && (quint64) (i+1) * holes / region != (quint64) i * holes / region;
+    };
+    /* Chain of count clusters of the used part. Returns its first cluster */
+    auto allocate = [&](uint32_t count) {
+        uint32_t first = 0, prev = 0;
+        while (count && nextIndex < region)
+        {
+            uint32_t i = nextIndex++;
+            if (isHole(i))
+                continue;
+
+            uint32_t cluster = i+2;
+            if (prev)
+                fat[prev] = cluster;
+            else
+                first = cluster;
+            fat[cluster] = eoc;
+            prev = cluster;
+            allocated++;
+            count--;
+        }
+        return first;
+    };
+    auto clustersFor = [&](quint64 size) {
+        return (uint32_t) qMax((size + bytesPerCluster - 1) / bytesPerCluster, (quint64) 1);
+    };
+    /* Following the chain, as it may have holes */
+    auto writeChain = [&](uint32_t cluster, const QByteArray &data) {
+        for (int pos = 0; pos < data.size(); pos += bytesPerCluster)
+        {
+            f.seek(clusterOffset + (quint64) (cluster-2) * bytesPerCluster);
+            f.write(data.constData()+pos, qMin((int) bytesPerCluster, (int) data.size()-pos));
+            cluster = fat[cluster];
+        }
+    };
+
+    const int fileCount = 3 + FATBENCHMARK_FILLER_FILES;
+    QByteArray dir((layout.fat32 ? clustersFor(fileCount * 32) * bytesPerCluster : rootEntries * 32), 0);
+    uint32_t rootCluster = layout.fat32 ? allocate(dir.size() / bytesPerCluster) : 0;
+    struct dir_entry *entries = (struct dir_entry *) dir.data();
+
+    const QByteArray *contents[] = {&config, &cmdline, &issue};
+    const char *names[] = {"CONFIG  TXT", "CMDLINE TXT", "ISSUE   TXT"};
+    for (int i = 0; i < 3; i++)
+    {
+        uint32_t first = allocate(clustersFor(contents[i]->size()));
+        writeChain(first, *contents[i]);
+        setDirEntry(&entries[i], names[i], first, contents[i]->size());
+    }
+
+    /* The filler files take the rest of the used part. Their data is left as zeroes */
+    for (int i = 0; i < FATBENCHMARK_FILLER_FILES; i++)
+    {
+        uint32_t count = (used - allocated) / (FATBENCHMARK_FILLER_FILES - i);
+        QByteArray name = QByteArray("FILL") + QByteArray::number(i).rightJustified(4, '0') + "BIN";
+        setDirEntry(&entries[3+i], name.constData(), allocate(count), count * bytesPerCluster);
+    }
+
+    if (layout.fat32)
+        writeChain(rootCluster, dir);
+    else
+    {
+        f.seek(rootDirOffset);
+        f.write(dir);
+    }
+
+    QByteArray fatData(fatSectors * 512, 0);
+    for (uint32_t i = 0; i < (uint32_t) fat.size(); i++)
+    {
+        if (layout.fat32)
+            ((uint32_t *) fatData.data())[i] = fat[i];
+        else
+            ((uint16_t *) fatData.data())[i] = fat[i];
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        f.seek(partStart + (reservedSectors + i*fatSectors) * 512ULL);
+        f.write(fatData);
+    }
+
+    union fat_bpb bpb;
+    memset(&bpb, 0, sizeof(bpb));
+    memcpy(bpb.fat16.BS_jmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb.fat16.BS_OEMName, "mkfs.fat", 8);
+    bpb.fat16.BPB_BytsPerSec = 512;
+    bpb.fat16.BPB_SecPerClus = layout.sectorsPerCluster;
+    bpb.fat16.BPB_RsvdSecCnt = reservedSectors;
+    bpb.fat16.BPB_NumFATs = 2;
+    bpb.fat16.BPB_RootEntCnt = rootEntries;
+    bpb.fat16.BPB_Media = 0xF8;
+    bpb.fat16.BPB_HiddSec = FATBENCHMARK_PARTITION_START;
+    bpb.fat16.BPB_TotSec32 = partSectors;
+    if (layout.fat32)
+    {
+        bpb.fat32.BPB_FATSz32 = fatSectors;
+        bpb.fat32.BPB_RootClus = rootCluster;
+        bpb.fat32.BPB_FSInfo = 1;
+        bpb.fat32.BPB_BkBootSec = 6;
+        bpb.fat32.BS_BootSig = 0x29;
+        memcpy(bpb.fat32.BS_FilSysType, "FAT32   ", 8);
+    }
+    else
+    {
+        bpb.fat16.BPB_FATSz16 = fatSectors;
+        bpb.fat16.BS_BootSig = 0x29;
+        memcpy(bpb.fat16.BS_FilSysType, "FAT16   ", 8);
+    }
+    bpb.fat16.Signature[0] = 0x55;
+    bpb.fat16.Signature[1] = 0xAA;
+    f.seek(partStart);
+    f.write((const char *) &bpb, sizeof(bpb));
+
+    if (layout.fat32)
+    {
+        /* FSInfo with the free count unknown, and the backup boot sector */
+        uint32_t fsinfo[128] = {0};
+        fsinfo[0] = 0x41615252;
+        fsinfo[121] = 0x61417272;
+        fsinfo[122] = 0xFFFFFFFF;
+        fsinfo[123] = 0xFFFFFFFF;
+        fsinfo[127] = 0xAA550000;
+        f.seek(partStart + 512);
+        f.write((const char *) fsinfo, sizeof(fsinfo));
+        f.seek(partStart + 6*512);
+        f.write((const char *) &bpb, sizeof(bpb));
+    }
+
+    struct mbr_table mbr;
+    memset(&mbr, 0, sizeof(mbr));
+    mbr.part[0].id = layout.fat32 ? 0x0C : 0x0E;
+    mbr.part[0].starting_sector = FATBENCHMARK_PARTITION_START;
+    mbr.part[0].nr_of_sectors = partSectors;
+    mbr.signature[0] = 0x55;
+    mbr.signature[1] = 0xAA;
+    f.seek(0);
+    f.write((const char *) &mbr, sizeof(mbr));
+
+    return f.error() == QFileDevice::NoError;
+}
+
+/* What DownloadThread::_applyCustomization() does, with every format's files written */
+static bool customize(const QString &filename, Result &result)
+{
+    BlockDeviceFile f;
+    f.setFileName(filename);
+    if (!f.open(QIODevice::ReadWrite))
+        return false;
+
+    BlockDevice *device = BlockDevice::create(&f);
+    QElapsedTimer t;
+    bool ok = true;
+
+    try
+    {
+        CountingDeviceWrapper dw(device);
+
+        t.start();
+        DeviceWrapperFatPartition *fat = dw.fatPartition(1);
+        result.openNsecs = t.nsecsElapsed();
+
+        t.restart();
+        fat->writeFile("config.txt", fat->readFile("config.txt") + extraConfig);
+        fat->readFile("issue.txt");
+        fat->fileExists("user-data");
+        fat->writeFile("firstrun.sh", firstrun);
+        fat->writeFile("user-data", userData);
+        fat->writeFile("network-config", networkConfig);
+        fat->writeFile("cmdline.txt", fat->readFile("cmdline.txt").trimmed() + extraCmdline);
+        result.filesNsecs = t.nsecsElapsed();
+
+        t.restart();
+        dw.sync();
+        result.syncNsecs = t.nsecsElapsed();
+
+        result.reads = dw.reads;
+        result.blocksRead = dw.blocksRead;
+        result.writes = dw.writes;
+        result.blocksWritten = dw.blocksWritten;
+    }
+    catch (std::runtime_error &err)
+    {
+        std::cerr << "Error customizing " << filename.toStdString() << ": " << err.what() << std::endl;
+        ok = false;
+    }
+
+    delete device;
+    return ok;
+}
+
+/* Reads the files back through a fresh DeviceWrapper */
+static bool verify(const QString &filename)
+{
+    BlockDeviceFile f;
+    f.setFileName(filename);
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+
+    BlockDevice *device = BlockDevice::create(&f);
+    bool ok;
+
+    try
+    {
+        DeviceWrapper dw(device);
+        DeviceWrapperFatPartition *fat = dw.fatPartition(1);
+
+        ok = fat->readFile("config.txt") == config + extraConfig
+                && fat->readFile("cmdline.txt") == cmdline.trimmed() + extraCmdline
+                && fat->readFile("firstrun.sh") == firstrun
+                && fat->readFile("user-data") == userData
+                && fat->readFile("network-config") == networkConfig;
+    }
+    catch (std::runtime_error &err)
+    {
+        std::cerr << "Error reading back " << filename.toStdString() << ": " << err.what() << std::endl;
+        ok = false;
+    }
+
+    delete device;
+    return ok;
+}
+
+static double msecs(qint64 nsecs)
+{
+    return nsecs / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    int runs = (argc > 1) ? atoi(argv[1]) : 5;
+    QDir work((argc > 2) ? argv[2] : QDir::temp().filePath("fatbenchmark"));
+    if (runs <= 0 || !work.mkpath("."))
+    {
+        std::cerr << "Usage: fatbenchmark [<runs> [<work directory>]]" << std::endl;
+        return 1;
+    }
+    QString image = work.filePath("fat.img");
+
+    /* The FAT code tells about every file it looks at */
+    QLoggingCategory::setFilterRules("*.debug=false");
+
+    std::cout << std::left << std::setw(16) << "layout" << std::right << std::setw(6) << "frag"
+              << std::setw(8) << "reads" << std::setw(10) << "KB read" << std::setw(8) << "writes" << std::setw(10) << "KB written"
+              << std::setw(10) << "open ms" << std::setw(10) << "files ms" << std::setw(10) << "sync ms" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+
+    for (const Layout &layout : layouts)
+    {
+        for (int fragmentation : fragmentations)
+        {
+            Result best;
+
+            for (int run = 0; run < runs; run++)
+            {
+                Result result;
+
+                if (!generateImage(image, layout, fragmentation))
+                {
+                    std::cerr << "Error writing " << image.toStdString() << std::endl;
+                    return 1;
+                }
+                if (!customize(image, result))
+                    return 1;
+                if (!verify(image))
+                {
+                    std::cerr << layout.name << ", " << fragmentation << "% fragmented: files read back differ" << std::endl;
+                    return 1;
+                }
+
+                if (!run || result.openNsecs + result.filesNsecs + result.syncNsecs < best.openNsecs + best.filesNsecs + best.syncNsecs)
+                    best = result;
+            }
+
+            std::cout << std::left << std::setw(16) << layout.name << std::right << std::setw(5) << fragmentation << "%"
+                      << std::setw(8) << best.reads << std::setw(10) << best.blocksRead * 4
+                      << std::setw(8) << best.writes << std::setw(10) << best.blocksWritten * 4
+                      << std::setw(10) << msecs(best.openNsecs) << std::setw(10) << msecs(best.filesNsecs)
+                      << std::setw(10) << msecs(best.syncNsecs) << std::endl;
+        }
+    }
+
+    QFile::remove(image);
+
+    return 0;
+}
@@ -0,0 +1,449 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "filesystemblockmap.h"
+#include "config.h"
+#include "devicewrapperstructs.h"
+#include <QDebug>
+#include <QtEndian>
+#include <string.h>
+
+/* Protective MBR, primary GPT header and 128 partition entries */
+#define PARTITION_TABLE_SIZE  (34*512)
+/* Boot sector, and ext superblock at 1024 */
+#define FS_HEADER_SIZE        2048
+/* Larger group descriptor tables and FATs are not collected */
+#define MAX_METADATA_SIZE     (64*1024*1024)
+
+/* ext4 on-disk format, see https://docs.kernel.org/filesystems/ext4/globals.html */
+#define EXT4_SUPER_MAGIC           0xEF53
+#define EXT4_COMPAT_SPARSE_SUPER2  0x200
+#define EXT4_RO_COMPAT_SPARSE_SUPER 0x1
+#define EXT4_RO_COMPAT_GDT_CSUM    0x10
+#define EXT4_RO_COMPAT_METADATA_CSUM 0x400
+#define EXT4_INCOMPAT_META_BG      0x10
+#define EXT4_INCOMPAT_64BIT        0x80
+#define EXT4_BG_BLOCK_UNINIT       0x2
+
+static inline quint16 le16(const uchar *p)
+{
+    return qFromLittleEndian<quint16>(p);
+}
+
+static inline quint32 le32(const uchar *p)
+{
+    return qFromLittleEndian<quint32>(p);
+}
+
+FilesystemBlockMap::FilesystemBlockMap()
+    : _unusedBytes(0)
+{
+    _want(PartitionTable, 0, PARTITION_TABLE_SIZE, -1);
+}
+
+void FilesystemBlockMap::clear()
+{
+    _regions.clear();
+    _filesystems.clear();
+    _unused.clear();
+    _unusedBytes = 0;
+    _want(PartitionTable, 0, PARTITION_TABLE_SIZE, -1);
+}
+
+void FilesystemBlockMap::_want(Kind kind, quint64 offset, quint64 length, int fs, quint32 group)
+{
+    Region r;
+    r.kind = kind;
+    r.offset = offset;
+    r.length = length;
+    r.fs = fs;
+    r.group = group;
+    _regions.insert(offset, r);
+}
+
+void FilesystemBlockMap::addData(const char *buf, size_t len, quint64 offset)
+{
+    const quint64 end = offset+len;
+    auto it = _regions.begin();
+
+    while (it != _regions.end() && it.key() < end)
+    {
+        Region &r = it.value();
+        quint64 have = r.offset + r.data.size();
+        if (have < offset)
+        {
+            /* Went past before it was known to be needed */
+            it = _regions.erase(it);
+            continue;
+        }
+
+        quint64 copyEnd = qMin(end, r.offset + r.length);
+        if (copyEnd > have)
+            r.data.append(buf + (have-offset), copyEnd-have);
+
+        if ((quint64) r.data.size() == r.length)
+        {
+            Region done = r;
+            _regions.erase(it);
+            /* May want more of this same block */
+            _process(done);
+            it = _regions.begin();
+            continue;
+        }
+        ++it;
+    }
+}
+
+bool FilesystemBlockMap::isUnused(quint64 offset, quint64 len) const
+{
+    auto it = _unused.upperBound(offset);
+    if (it == _unused.begin())
+        return false;
+    --it;
+
+    return it.value() >= offset+len;
+}
+
+quint64 FilesystemBlockMap::unusedBytes() const
+{
+    return _unusedBytes;
+}
+
+void FilesystemBlockMap::_process(const Region &r)
+{
+    switch (r.kind)
+    {
+    case PartitionTable:
+        _parsePartitionTable(r.data);
+        break;
+    case FsHeader:
+        _parseFsHeader(r);
+        break;
+    case Ext4Descriptors:
+        _parseExt4Descriptors(r);
+        break;
+    case Ext4Bitmap:
+        _parseExt4Bitmap(r);
+        break;
+    case FatTable:
+        _parseFatTable(r);
+        break;
+    }
+}
+
+void FilesystemBlockMap::_parsePartitionTable(const QByteArray &data)
+{
+    const mbr_table *mbr = (const mbr_table *) data.constData();
+    QVector<QPair<quint64, quint64>> partitions;
+
+    if (mbr->signature[0] == 0x55 && mbr->signature[1] == 0xAA)
+    {
+        if (mbr->part[0].id == 0xEE)
+        {
+            const gpt_header *gpt = (const gpt_header *) (data.constData()+512);
+            if (!memcmp(gpt->Signature, "EFI PART", 8) && gpt->SizeOfPartitionEntry >= sizeof(gpt_partition)
+                    && gpt->PartitionEntryLBA >= 2 && gpt->PartitionEntryLBA < PARTITION_TABLE_SIZE/512)
+            {
+                /* Entries beyond the standard 16 KB are left alone */
+                quint64 entriesOffset = gpt->PartitionEntryLBA*512;
+                quint32 count = qMin((quint64) gpt->NumberOfPartitionEntries, (data.size()-entriesOffset) / gpt->SizeOfPartitionEntry);
+                for (quint32 i = 0; i < count; i++)
+                {
+                    const gpt_partition *p = (const gpt_partition *) (data.constData() + entriesOffset + (quint64) i*gpt->SizeOfPartitionEntry);
+                    static const unsigned char unused[16] = {0};
+                    if (memcmp(p->PartitionTypeGuid, unused, 16) && p->StartingLBA && p->EndingLBA >= p->StartingLBA)
+                        partitions.append({p->StartingLBA*512, (p->EndingLBA-p->StartingLBA+1)*512});
+                }
+            }
+        }
+        else
+        {
+            for (const mbr_partition_entry &p : mbr->part)
+            {
+                /* Logical partitions in an extended partition are left alone */
+                if (p.id && p.id != 0x05 && p.id != 0x0F && p.id != 0x85 && p.starting_sector && p.nr_of_sectors)
+                    partitions.append({(quint64) p.starting_sector*512, (quint64) p.nr_of_sectors*512});
+            }
+        }
+    }
+
+    if (partitions.isEmpty())
+    {
+        /* May be a file system without partition table. Its header went past already */
+        FileSystem fs = {};
+        _filesystems.append(fs);
+        Region r;
+        r.kind = FsHeader;
+        r.offset = 0;
+        r.length = FS_HEADER_SIZE;
+        r.fs = _filesystems.size()-1;
+        r.group = 0;
+        r.data = data.left(FS_HEADER_SIZE);
+        _parseFsHeader(r);
+        return;
+    }
+
+    for (const auto &p : std::as_const(partitions))
+    {
+        FileSystem fs = {};
+        fs.start = p.first;
+        fs.length = p.second;
+        _filesystems.append(fs);
+        _want(FsHeader, fs.start, FS_HEADER_SIZE, _filesystems.size()-1);
+    }
+}
+
+void FilesystemBlockMap::_parseFsHeader(const Region &r)
+{
+    const uchar *data = (const uchar *) r.data.constData();
+    if (!_parseExt4(r.fs, data+1024))
+        _parseFat(r.fs, data);
+}
+
+bool FilesystemBlockMap::_parseExt4(int fsIndex, const uchar *sb)
+{
+    FileSystem &fs = _filesystems[fsIndex];
+
+    if (le16(sb+0x38) != EXT4_SUPER_MAGIC)
+        return false;
+
+    quint32 logBlockSize = le32(sb+0x18);
+    quint32 incompat = le32(sb+0x60);
+    if (logBlockSize > 6 || incompat & EXT4_INCOMPAT_META_BG)
+    {
+        qDebug() << "Not deriving block map of ext file system at" << fs.start << ": layout not supported";
+        return true;
+    }
+
+    fs.blockSize = 1024 << logBlockSize;
+    fs.firstDataBlock = le32(sb+0x14);
+    fs.blocksPerGroup = le32(sb+0x20);
+    fs.blocksCount = le32(sb+0x4);
+    fs.compat = le32(sb+0x5C);
+    fs.roCompat = le32(sb+0x64);
+    fs.reservedGdtBlocks = le16(sb+0xCE);
+    fs.backupGroups[0] = le32(sb+0x24C);
+    fs.backupGroups[1] = le32(sb+0x250);
+    /* Revision 0 has 128 byte inodes, and no s_inode_size */
+    quint64 inodeSize = le32(sb+0x4C) ? le16(sb+0x58) : 128;
+    fs.inodeTableBlocks = (le32(sb+0x28)*inodeSize + fs.blockSize-1) / fs.blockSize;
+    fs.descSize = 32;
+    if (incompat & EXT4_INCOMPAT_64BIT)
+    {
+        fs.blocksCount |= (quint64) le32(sb+0x150) << 32;
+        fs.descSize = le16(sb+0xFE);
+    }
+
+    /* A bitmap is one block, with a bit per block of its group */
+    if (fs.blocksPerGroup != fs.blockSize*8 || fs.descSize < 32 || fs.descSize > 1024 || (fs.descSize & (fs.descSize-1))
+            || fs.blocksCount <= fs.firstDataBlock || (fs.length && fs.blocksCount*fs.blockSize > fs.length))
+    {
+        qDebug() << "Not deriving block map of ext file system at" << fs.start << ": inconsistent superblock";
+        return true;
+    }
+
+    quint64 groups = (fs.blocksCount - fs.firstDataBlock + fs.blocksPerGroup - 1) / fs.blocksPerGroup;
+    if (groups*fs.descSize > MAX_METADATA_SIZE)
+        return true;
+
+    qDebug() << "ext file system at" << fs.start << "with" << groups << "block groups";
+    _want(Ext4Descriptors, fs.start + (fs.firstDataBlock+1)*fs.blockSize, groups*fs.descSize, fsIndex);
+    return true;
+}
+
+bool FilesystemBlockMap::_parseFat(int fsIndex, const uchar *bootSector)
+{
+    FileSystem &fs = _filesystems[fsIndex];
+    const fat32_bpb *bpb = (const fat32_bpb *) bootSector;
+
+    quint32 bps = bpb->BPB_BytsPerSec, spc = bpb->BPB_SecPerClus;
+    if (bpb->Signature[0] != 0x55 || bpb->Signature[1] != 0xAA || bps < 512 || bps > 4096 || (bps & (bps-1))
+            || !spc || (spc & (spc-1)) || !bpb->BPB_RsvdSecCnt || !bpb->BPB_NumFATs)
+        return false;
+
+    quint64 fatSectors = bpb->BPB_FATSz16 ? bpb->BPB_FATSz16 : bpb->BPB_FATSz32;
+    quint64 totalSectors = bpb->BPB_TotSec16 ? bpb->BPB_TotSec16 : bpb->BPB_TotSec32;
+    quint64 rootDirSectors = ((quint64) bpb->BPB_RootEntCnt*32 + bps-1) / bps;
+    quint64 dataSector = bpb->BPB_RsvdSecCnt + bpb->BPB_NumFATs*fatSectors + rootDirSectors;
+    if (!fatSectors || totalSectors <= dataSector || (fs.length && totalSectors*bps > fs.length))
+        return false;
+
+    fs.clusterCount = (totalSectors - dataSector) / spc;
+    /* FAT12 is only used for file systems too small to matter */
+    if (fs.clusterCount < 4085)
+        return false;
+
+    fs.fat32 = fs.clusterCount >= 65525;
+    fs.clusterSize = (quint64) spc*bps;
+    fs.dataStart = fs.start + dataSector*bps;
+    quint64 fatBytes = (fs.clusterCount+2) * (fs.fat32 ? 4 : 2);
+    if (fatBytes > fatSectors*bps || fatBytes > MAX_METADATA_SIZE)
+        return false;
+
+    qDebug() << (fs.fat32 ? "FAT32" : "FAT16") << "file system at" << fs.start << "with" << fs.clusterCount << "clusters";
+    _want(FatTable, fs.start + (quint64) bpb->BPB_RsvdSecCnt*bps, fatBytes, fsIndex);
+    return true;
+}
+
+/* Group 0 and 1 and powers of 3, 5 and 7 with sparse_super, two chosen ones with sparse_super2 */
+bool FilesystemBlockMap::_ext4HasSuperBackup(const FileSystem &fs, quint32 group) const
+{
+    if (group == 0)
+        return true;
+    if (fs.compat & EXT4_COMPAT_SPARSE_SUPER2)
+        return group == fs.backupGroups[0] || group == fs.backupGroups[1];
+    if (!(fs.roCompat & EXT4_RO_COMPAT_SPARSE_SUPER) || group == 1)
+        return true;
+
+    for (quint32 base : {3, 5, 7})
+    {
+        quint64 power = base;
+        while (power < group)
+            power *= base;
+        if (power == group)
+            return true;
+    }
+    return false;
+}
+
+void FilesystemBlockMap::_parseExt4Descriptors(const Region &r)
+{
+    const FileSystem &fs = _filesystems[r.fs];
+    const uchar *table = (const uchar *) r.data.constData();
+    quint32 groups = r.length / fs.descSize;
+    /* The flag is only trusted with group descriptor checksums, as the kernel does */
+    bool uninitValid = fs.roCompat & (EXT4_RO_COMPAT_GDT_CSUM | EXT4_RO_COMPAT_METADATA_CSUM);
+
+    /* Start and length of the bitmaps and inode tables of all groups. With flex_bg
+       they are packed together, not necessarily in the group they belong to */
+    QMap<quint64, quint64> metadata;
+    for (quint32 g = 0; g < groups; g++)
+    {
+        const uchar *desc = table + (quint64) g*fs.descSize;
+        bool hi = fs.descSize >= 64;
+        metadata.insert(le32(desc) | (hi ? (quint64) le32(desc+0x20) << 32 : 0), 1);
+        metadata.insert(le32(desc+0x4) | (hi ? (quint64) le32(desc+0x24) << 32 : 0), 1);
+        metadata.insert(le32(desc+0x8) | (hi ? (quint64) le32(desc+0x28) << 32 : 0), fs.inodeTableBlocks);
+    }
+    quint64 gdtBlocks = (r.length + fs.blockSize-1) / fs.blockSize;
+
+    for (quint32 g = 0; g < groups; g++)
+    {
+        const uchar *desc = table + (quint64) g*fs.descSize;
+
+        if (!uninitValid || !(le16(desc+0x12) & EXT4_BG_BLOCK_UNINIT))
+        {
+            quint64 bitmap = le32(desc);
+            if (fs.descSize >= 64)
+                bitmap |= (quint64) le32(desc+0x20) << 32;
+            if (bitmap && bitmap < fs.blocksCount)
+                _want(Ext4Bitmap, fs.start + bitmap*fs.blockSize, fs.blockSize, r.fs, g);
+            continue;
+        }
+
+        /* Bitmap was never written. Nothing in the group is in use but metadata */
+        quint64 first = fs.firstDataBlock + (quint64) g*fs.blocksPerGroup;
+        quint64 end = qMin(first + fs.blocksPerGroup, fs.blocksCount);
+        quint64 pos = first;
+        if (_ext4HasSuperBackup(fs, g))
+            pos += 1 + gdtBlocks + fs.reservedGdtBlocks;
+
+        auto it = metadata.upperBound(pos);
+        if (it != metadata.begin())
+            --it;
+        for (; it != metadata.end() && it.key() < end; ++it)
+        {
+            if (it.key() + it.value() <= pos)
+                continue;
+            if (it.key() > pos)
+                _addUnused(fs.start + pos*fs.blockSize, (it.key()-pos)*fs.blockSize);
+            pos = it.key() + it.value();
+        }
+        if (pos < end)
+            _addUnused(fs.start + pos*fs.blockSize, (end-pos)*fs.blockSize);
+    }
+}
+
+void FilesystemBlockMap::_parseExt4Bitmap(const Region &r)
+{
+    const FileSystem &fs = _filesystems[r.fs];
+    const uchar *bitmap = (const uchar *) r.data.constData();
+    quint64 first = fs.firstDataBlock + r.group*fs.blocksPerGroup;
+    quint64 blocks = qMin(fs.blocksPerGroup, fs.blocksCount - first);
+
+    quint64 runStart = 0;
+    bool inRun = false;
+    for (quint64 i = 0; i <= blocks; i++)
+    {
+        bool free = i < blocks && !(bitmap[i/8] & (1 << (i%8)));
+        if (free && !inRun)
+        {
+            runStart = i;
+            inRun = true;
+        }
+        else if (!free && inRun)
+        {
+            _addUnused(fs.start + (first+runStart)*fs.blockSize, (i-runStart)*fs.blockSize);
+            inRun = false;
+        }
+    }
+}
+
+void FilesystemBlockMap::_parseFatTable(const Region &r)
+{
+    const FileSystem &fs = _filesystems[r.fs];
+    const uchar *fat = (const uchar *) r.data.constData();
+
+    quint64 runStart = 0;
+    bool inRun = false;
+    for (quint64 c = 2; c <= fs.clusterCount+2; c++)
+    {
+        bool free = false;
+        if (c < fs.clusterCount+2)
+            free = fs.fat32 ? !(le32(fat+c*4) & 0x0FFFFFFF) : !le16(fat+c*2);
+
+        if (free && !inRun)
+        {
+            runStart = c;
+            inRun = true;
+        }
+        else if (!free && inRun)
+        {
+            _addUnused(fs.dataStart + (runStart-2)*fs.clusterSize, (c-runStart)*fs.clusterSize);
+            inRun = false;
+        }
+    }
+}
+
+void FilesystemBlockMap::_addUnused(quint64 offset, quint64 length)
+{
+    quint64 end = offset+length;
+
+    auto it = _unused.upperBound(offset);
+    if (it != _unused.begin())
+    {
+        auto prev = std::prev(it);
+        if (prev.value() >= offset)
+        {
+            offset = prev.key();
+            end = qMax(end, prev.value());
+            _unusedBytes -= prev.value() - prev.key();
+            it = _unused.erase(prev);
+        }
+    }
+    while (it != _unused.end() && it.key() <= end)
+    {
+        end = qMax(end, it.value());
+        _unusedBytes -= it.value() - it.key();
+        it = _unused.erase(it);
+    }
+
+    /* Runs too short to ever hold a whole write block are not worth keeping */
+    if (end-offset < IMAGEWRITER_FSMAP_MIN_RUN)
+        return;
+
+    _unused.insert(offset, end);
+    _unusedBytes += end-offset;
+}
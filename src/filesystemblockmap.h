@@ -0,0 +1,98 @@
+#ifndef FILESYSTEMBLOCKMAP_H
+#define FILESYSTEMBLOCKMAP_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QMap>
+#include <QVector>
+
+/*
+ * Free space of the file systems in an image, learned while it streams past
+ *
+ * For images without a bmap. Finds the partitions in the MBR or GPT, or
+ * takes the whole image as one file system if there is no partition table.
+ * Of ext2/3/4 file systems it reads the group descriptors, and then the
+ * block bitmap of every group, of FAT16 and FAT32 the first FAT. Blocks
+ * and clusters those mark free hold nothing the file system needs, even
+ * if they are not zero.
+ *
+ * The metadata comes before the blocks it describes in the image, so what
+ * is free is mostly known by the time it is written. Anything not known to
+ * be free yet, outside of file systems, or in file systems that are not
+ * understood, counts as used. Groups of which ext4 has not initialized the
+ * bitmap have no blocks in use but metadata, which the descriptors tell.
+ */
+class FilesystemBlockMap
+{
+public:
+    FilesystemBlockMap();
+
+    /* Feed the image in order, starting at offset 0 */
+    void addData(const char *buf, size_t len, quint64 offset);
+    /* True if all of [offset, offset+len) is known to be free, from the data fed so far */
+    bool isUnused(quint64 offset, quint64 len) const;
+    /* Total size of the free space known so far */
+    quint64 unusedBytes() const;
+    void clear();
+
+protected:
+    enum Kind
+    {
+        PartitionTable,
+        FsHeader,
+        Ext4Descriptors,
+        Ext4Bitmap,
+        FatTable
+    };
+
+    /* Part of the image that is needed, collected as it passes */
+    struct Region
+    {
+        Kind kind;
+        quint64 offset;
+        quint64 length;
+        /* Index into _filesystems, and ext4 group of a bitmap */
+        int fs;
+        quint32 group;
+        QByteArray data;
+    };
+
+    struct FileSystem
+    {
+        /* Partition. length 0 if it is the whole image, of unknown size */
+        quint64 start, length;
+        /* ext4, in blocks */
+        quint32 blockSize, descSize;
+        quint64 firstDataBlock, blocksPerGroup, blocksCount;
+        /* Size of the inode table of a group, and of what a superblock backup is followed by */
+        quint64 inodeTableBlocks, reservedGdtBlocks;
+        quint32 compat, roCompat, backupGroups[2];
+        /* FAT */
+        quint64 dataStart, clusterSize, clusterCount;
+        bool fat32;
+    };
+
+    QMultiMap<quint64, Region> _regions;
+    QVector<FileSystem> _filesystems;
+    /* Start -> end of free ranges, merged where they touch */
+    QMap<quint64, quint64> _unused;
+    quint64 _unusedBytes;
+
+    void _want(Kind kind, quint64 offset, quint64 length, int fs, quint32 group = 0);
+    void _process(const Region &r);
+    void _parsePartitionTable(const QByteArray &data);
+    void _parseFsHeader(const Region &r);
+    bool _parseExt4(int fs, const uchar *sb);
+    bool _parseFat(int fs, const uchar *bootSector);
+    void _parseExt4Descriptors(const Region &r);
+    bool _ext4HasSuperBackup(const FileSystem &fs, quint32 group) const;
+    void _parseExt4Bitmap(const Region &r);
+    void _parseFatTable(const Region &r);
+    void _addUnused(quint64 offset, quint64 length);
+};
+
+#endif // FILESYSTEMBLOCKMAP_H
@@ -0,0 +1,100 @@
+/*
+ * Micro-benchmark comparing the SHA256 backends
+ *
+ * Usage: hashbenchmark [<MB to hash> [<buffer size in KB>]]
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "acceleratedcryptographichash.h"
+#include "config.h"
+#include <QByteArray>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <iostream>
+#include <iomanip>
+
+static void report(const char *name, quint64 bytes, qint64 nsecs, const QByteArray &hash)
+{
+    std::cout << std::left << std::setw(36) << name
+              << std::right << std::setw(8) << std::fixed << std::setprecision(0)
+              << (bytes / 1048576.0) / (nsecs / 1e9) << " MB/s  "
+              << hash.toHex().left(16).constData() << std::endl;
+}
+
+static void benchAccelerated(const char *name, const QByteArray &buf, int iterations)
+{
+    AcceleratedCryptographicHash h(QCryptographicHash::Sha256);
+    QElapsedTimer t;
+    t.start();
+    for (int i = 0; i < iterations; i++)
+        h.addData(buf.constData(), buf.size());
+    QByteArray result = h.result();
+    report(name, (quint64) buf.size() * iterations, t.nsecsElapsed(), result);
+}
+
+static void benchMultiBuffer(const char *name, const QByteArray &buf, int iterations)
+{
+    AcceleratedCryptographicHash a(QCryptographicHash::Sha256), b(QCryptographicHash::Sha256);
+    AcceleratedCryptographicHash *hashes[2] = { &a, &b };
+    const char *data[2] = { buf.constData(), buf.constData() };
+    size_t lengths[2] = { (size_t) buf.size(), (size_t) buf.size() };
+    QElapsedTimer t;
+    t.start();
+    for (int i = 0; i < iterations; i++)
+        AcceleratedCryptographicHash::addData(hashes, data, lengths, 2);
+    QByteArray result = a.result();
+    if (b.result() != result)
+        std::cerr << "Multi-buffer hashes differ!" << std::endl;
+    report(name, (quint64) buf.size() * iterations * 2, t.nsecsElapsed(), result);
+}
+
+static void benchQt(const QByteArray &buf, int iterations)
+{
+    QCryptographicHash h(QCryptographicHash::Sha256);
+    QElapsedTimer t;
+    t.start();
+    for (int i = 0; i < iterations; i++)
+        h.addData(buf);
+    QByteArray result = h.result();
+    report("QCryptographicHash", (quint64) buf.size() * iterations, t.nsecsElapsed(), result);
+}
+
+int main(int argc, char *argv[])
+{
+    int megabytes = (argc > 1) ? atoi(argv[1]) : 1024;
+    int bufsize = (argc > 2) ? atoi(argv[2]) * 1024 : IMAGEWRITER_BLOCKSIZE;
+    if (megabytes <= 0 || bufsize <= 0)
+    {
+        std::cerr << "Usage: hashbenchmark [<MB to hash> [<buffer size in KB>]]" << std::endl;
+        return 1;
+    }
+
+    QByteArray buf(bufsize, 0);
+    for (int i = 0; i < bufsize; i++)
+        buf[i] = (char) (i * 7 + (i >> 8));
+    int iterations = qMax(1, (int) (((qint64) megabytes * 1048576) / bufsize));
+
+    std::cout << "Hashing " << megabytes << " MB in " << bufsize / 1024 << " KB buffers" << std::endl;
+
+    AcceleratedCryptographicHash::setNativeEnabled(false);
+    benchAccelerated("Crypto library", buf, iterations);
+    benchMultiBuffer("Crypto library, 2 streams", buf, iterations);
+
+    AcceleratedCryptographicHash::setNativeEnabled(true);
+    const char *native = AcceleratedCryptographicHash::nativeImplementation();
+    if (native)
+    {
+        benchAccelerated(native, buf, iterations);
+        benchMultiBuffer(QByteArray(native).append(", 2 streams").constData(), buf, iterations);
+    }
+    else
+    {
+        std::cout << "CPU has no SHA256 instructions, native backend not available" << std::endl;
+    }
+
+    benchQt(buf, iterations);
+
+    return 0;
+}
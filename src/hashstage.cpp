@@ -0,0 +1,79 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "hashstage.h"
+
+HashStage::HashStage(ThreadPlacement::Stage stage)
+    : _stage(stage), _submitted(0), _done(0), _stopping(false)
+{
+}
+
+HashStage::~HashStage()
+{
+    stop();
+}
+
+quint64 HashStage::submit(std::function<void()> job)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!isRunning())
+    {
+        _stopping = false;
+        start();
+    }
+    _jobs.push_back(std::move(job));
+    _cv.notify_all();
+
+    return ++_submitted;
+}
+
+void HashStage::waitFor(quint64 ticket)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this, ticket]() { return _done >= ticket; });
+}
+
+void HashStage::stop()
+{
+    if (!isRunning())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+        _cv.notify_all();
+    }
+    wait();
+}
+
+void HashStage::run()
+{
+    ThreadPlacement::apply(_stage);
+
+    std::deque<std::function<void()>> batch;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true)
+    {
+        _cv.wait(lock, [this]() { return !_jobs.empty() || _stopping; });
+        if (_jobs.empty())
+            break;
+
+        batch.swap(_jobs);
+        lock.unlock();
+
+        while (!batch.empty())
+        {
+            batch.front()();
+            batch.pop_front();
+
+            lock.lock();
+            _done++;
+            _cv.notify_all();
+            lock.unlock();
+        }
+
+        lock.lock();
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef HASHSTAGE_H
+#define HASHSTAGE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "threadplacement.h"
+#include <QThread>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+/*
+ * Thread that hashes the blocks of the image while they are being written
+ *
+ * Jobs run in the order they were submitted, whatever is queued is taken
+ * in one go. The thread is started by the first submit() and stays around
+ * until stop(), so blocks do not each go through the thread pool. The
+ * caller keeps its buffer until waitFor() returns for its ticket.
+ */
+class HashStage : public QThread
+{
+public:
+    HashStage(ThreadPlacement::Stage stage = ThreadPlacement::StageHash);
+    virtual ~HashStage();
+
+    /* Queue job. Returns the ticket to wait for */
+    quint64 submit(std::function<void()> job);
+    /* Wait until the job of ticket and everything submitted before it ran */
+    void waitFor(quint64 ticket);
+    /* Run what is queued and stop the thread */
+    void stop();
+
+protected:
+    virtual void run();
+
+    ThreadPlacement::Stage _stage;
+    std::deque<std::function<void()>> _jobs;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    quint64 _submitted, _done;
+    bool _stopping;
+};
+
+#endif // HASHSTAGE_H
@@ -0,0 +1,648 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "httpserver.h"
+#include "tftpserver.h"
+#include <QDebug>
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static char TAG[] = "[simphttp]";
+
+#ifdef _WIN32
+typedef int socklen_t;
+
+static void closeSocket(qintptr sock)
+{
+    closesocket((SOCKET)sock);
+}
+
+static bool setNonBlocking(qintptr sock)
+{
+    u_long enable = 1;
+    return ioctlsocket((SOCKET)sock, FIONBIO, &enable) == 0;
+}
+
+static bool wouldBlock()
+{
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+}
+#else
+static void closeSocket(qintptr sock)
+{
+    close((int)sock);
+}
+
+static bool setNonBlocking(qintptr sock)
+{
+    int flags = fcntl((int)sock, F_GETFL, 0);
+    return flags >= 0 && fcntl((int)sock, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static bool wouldBlock()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+#endif
+
+/* Value of header name in the request header, empty if it has none */
+static QByteArray headerValue(const QList<QByteArray> &lines, const QByteArray &name)
+{
+    for (const QByteArray &line : lines)
+    {
+        int colon = line.indexOf(':');
+        if (colon > 0 && line.left(colon).trimmed().compare(name, Qt::CaseInsensitive) == 0)
+        {
+            return line.mid(colon+1).trimmed();
+        }
+    }
+    return QByteArray();
+}
+
+/* Parses a single range of bytes=first-last, bytes=first- or bytes=-suffix
+   for a body of size bytes. Returns false if it cannot be satisfied */
+static bool parseRange(const QByteArray &range, qint64 size, qint64 *first, qint64 *last)
+{
+    if (!range.startsWith("bytes=") || range.contains(','))
+    {
+        return false;
+    }
+
+    QByteArray spec = range.mid(6).trimmed();
+    int dash = spec.indexOf('-');
+    if (dash < 0)
+    {
+        return false;
+    }
+
+    bool ok = true;
+    QByteArray from = spec.left(dash).trimmed(), to = spec.mid(dash+1).trimmed();
+    if (from.isEmpty())
+    {
+        qint64 suffix = to.toLongLong(&ok);
+        if (!ok || suffix <= 0 || size == 0)
+        {
+            return false;
+        }
+        *first = qMax((qint64)0, size - suffix);
+        *last = size - 1;
+        return true;
+    }
+
+    *first = from.toLongLong(&ok);
+    if (!ok || *first < 0 || *first >= size)
+    {
+        return false;
+    }
+    *last = size - 1;
+    if (!to.isEmpty())
+    {
+        *last = qMin(to.toLongLong(&ok), size - 1);
+        if (!ok || *last < *first)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+HttpServer::HttpServer(uint16_t port, QString target_dir)
+    : _port{port},
+    _path{target_dir}
+{
+}
+
+HttpServer::~HttpServer()
+{
+    stop();
+}
+
+int HttpServer::start()
+{
+    if (_listenSock >= 0)
+    {
+        qDebug() << TAG << "already started!";
+        return 0;
+    }
+
+#ifndef _WIN32
+    // a board that resets while it is sent a file must not take the process with it
+    signal(SIGPIPE, SIG_IGN);
+#endif
+
+    qintptr sock = (qintptr)socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0)
+    {
+        qDebug() << TAG << "socket creation failed" << strerror(errno);
+        return -1;
+    }
+
+    int enable = 1;
+    setsockopt((SOCKET)sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&enable), sizeof(enable));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(_port);
+
+    if (bind((SOCKET)sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen((SOCKET)sock, HTTP_MAX_CONNECTIONS) < 0
+        || !setNonBlocking(sock))
+    {
+        qDebug() << TAG << "binding to port" << _port << "failed" << strerror(errno);
+        closeSocket(sock);
+        return -1;
+    }
+
+    _listenSock = sock;
+    _buffer.resize(256 * 1024);
+    qDebug() << TAG << "Started on port" << _port << ", directory" << _path.absolutePath();
+    return 0;
+}
+
+void HttpServer::stop()
+{
+    if (_listenSock < 0)
+    {
+        return;
+    }
+
+    qDebug() << TAG << "Stopped";
+    cancelSessions();
+    closeSocket(_listenSock);
+    _listenSock = -1;
+}
+
+bool HttpServer::isStarted() const
+{
+    return _listenSock >= 0;
+}
+
+uint16_t HttpServer::port() const
+{
+    return _port;
+}
+
+int HttpServer::pollFds(struct pollfd *fds, int max)
+{
+    int count = 0;
+    if (_listenSock < 0)
+    {
+        return 0;
+    }
+
+    if (count < max && _connections.size() < HTTP_MAX_CONNECTIONS)
+    {
+        fds[count++] = {(SOCKET)_listenSock, POLLIN, 0};
+    }
+    for (const Connection &conn : _connections)
+    {
+        if (count == max)
+        {
+            break;
+        }
+        if (!conn.responding)
+        {
+            fds[count++] = {(SOCKET)conn.sock, POLLIN, 0};
+        }
+        else if (conn.headerSent < conn.header.size() || conn.offset < available(conn))
+        {
+            fds[count++] = {(SOCKET)conn.sock, POLLOUT, 0};
+        }
+        // else waiting for the writer of the growing file, see nextTimeout()
+    }
+    return count;
+}
+
+int HttpServer::nextTimeout()
+{
+    int timeout = HTTP_IDLE_TIMEOUT;
+    for (const Connection &conn : _connections)
+    {
+        if (conn.growing && conn.responding && conn.headerSent == conn.header.size())
+        {
+            // poll the growing file
+            timeout = qMin(timeout, 10);
+        }
+        else
+        {
+            timeout = qMin(timeout, (int)qMax((qint64)0, HTTP_IDLE_TIMEOUT - conn.idleSince.elapsed()));
+        }
+    }
+    return timeout;
+}
+
+void HttpServer::run()
+{
+    if (_listenSock < 0)
+    {
+        return;
+    }
+
+    accept();
+
+    for (auto it = _connections.begin(); it != _connections.end(); )
+    {
+        Connection &conn = *it;
+        bool keep = conn.responding ? sendResponse(conn) : readRequest(conn);
+
+        if (keep && conn.idleSince.elapsed() > (conn.growing ? HTTP_GROWING_FILE_TIMEOUT : HTTP_IDLE_TIMEOUT))
+        {
+            qDebug() << TAG << "Connection of" << conn.clientAddr.toString() << "timed out";
+            finish(conn, false);
+            keep = false;
+        }
+
+        if (keep)
+        {
+            ++it;
+        }
+        else
+        {
+            closeSocket(conn.sock);
+            it = _connections.erase(it);
+        }
+    }
+}
+
+void HttpServer::accept()
+{
+    while (_connections.size() < HTTP_MAX_CONNECTIONS)
+    {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        qintptr sock = (qintptr)::accept((SOCKET)_listenSock, (struct sockaddr*)&addr, &len);
+        if (sock < 0)
+        {
+            return;
+        }
+        if (!setNonBlocking(sock))
+        {
+            closeSocket(sock);
+            continue;
+        }
+
+        _connections.emplace_back();
+        Connection &conn = _connections.back();
+        conn.sock = sock;
+        conn.clientAddr = QHostAddress((struct sockaddr*)&addr);
+        conn.idleSince.start();
+    }
+}
+
+bool HttpServer::readRequest(Connection &conn)
+{
+    char buf[2048];
+    int n;
+    while ((n = recv((SOCKET)conn.sock, buf, sizeof(buf), 0)) > 0)
+    {
+        conn.request.append(buf, n);
+        conn.idleSince.start();
+        if (conn.request.size() > HTTP_MAX_REQUEST_SIZE)
+        {
+            respondError(conn, 431, "Request Header Fields Too Large");
+            return true;
+        }
+    }
+    if (n == 0 || (n < 0 && !wouldBlock()))
+    {
+        // closed before it asked for anything
+        return false;
+    }
+
+    int end = conn.request.indexOf("\r\n\r\n");
+    if (end < 0)
+    {
+        return true;
+    }
+
+    QList<QByteArray> lines = conn.request.left(end).split('\n');
+    QList<QByteArray> requestLine = lines.takeFirst().trimmed().split(' ');
+    if (requestLine.size() != 3 || !requestLine[2].startsWith("HTTP/1."))
+    {
+        respondError(conn, 400, "Bad Request");
+        return true;
+    }
+
+    respond(conn, requestLine[0], requestLine[1], headerValue(lines, "Range"));
+    return true;
+}
+
+void HttpServer::respond(Connection &conn, const QByteArray &method, const QByteArray &target, const QByteArray &range)
+{
+    if (method != "GET" && method != "HEAD")
+    {
+        respondError(conn, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return;
+    }
+
+    // only the files of the directory, no paths
+    QByteArray path = target;
+    if (path.contains('?'))
+    {
+        path.truncate(path.indexOf('?'));
+    }
+    QByteArray name = QByteArray::fromPercentEncoding(path);
+    if (name.startsWith('/'))
+    {
+        name.remove(0, 1);
+    }
+    if (name.isEmpty() || name.contains('/') || name.contains('\\') || name.startsWith('.'))
+    {
+        respondError(conn, 404, "Not Found");
+        return;
+    }
+
+    qint64 start = 0, size = 0;
+    qint64 growingSize = _growingFileSize;
+    if (name.startsWith("uniflash"))
+    {
+        // the sparse parts are a TFTP thing, HTTP sends the zeroes at line rate
+        QByteArray partNum = name.mid(strlen("uniflash"));
+        bool isPart = !partNum.isEmpty();
+        bool ok = true;
+        int part = isPart ? partNum.toInt(&ok) : 0;
+        if (!ok || part < 0)
+        {
+            respondError(conn, 404, "Not Found");
+            return;
+        }
+
+        conn.file.setFileName(_path.absoluteFilePath("uniflash"));
+        conn.growing = (growingSize > 0);
+        // read ahead of a growing file could pick up data that is not final yet
+        if (!conn.file.open(QIODeviceBase::ReadOnly | (conn.growing ? QIODeviceBase::Unbuffered : QIODeviceBase::NotOpen)))
+        {
+            respondError(conn, 404, "Not Found");
+            return;
+        }
+
+        qint64 fileSize = conn.growing ? growingSize : conn.file.size();
+        size = fileSize;
+        if (isPart)
+        {
+            qint64 partSize = TFTP::uniflashPartSize(fileSize, _partSize);
+            if (partSize == 0)
+            {
+                qDebug() << TAG << "image part size not multiples of 512 this cannot write to mmc";
+                respondError(conn, 500, "Internal Server Error");
+                return;
+            }
+            start = part * partSize;
+            size = qBound((qint64)0, fileSize - start, partSize);
+        }
+        conn.name = name;
+    }
+    else
+    {
+        conn.file.setFileName(_path.absoluteFilePath(QString::fromUtf8(name)));
+        if (!conn.file.open(QIODeviceBase::ReadOnly))
+        {
+            respondError(conn, 404, "Not Found");
+            return;
+        }
+        size = conn.file.size();
+        conn.name = name;
+    }
+
+    QByteArray header;
+    qint64 first = 0, last = size - 1;
+    conn.whole = range.isEmpty();
+    if (conn.whole)
+    {
+        header = "HTTP/1.1 200 OK\r\n";
+    }
+    else if (parseRange(range, size, &first, &last))
+    {
+        header = "HTTP/1.1 206 Partial Content\r\n"
+                 "Content-Range: bytes " + QByteArray::number(first) + "-" + QByteArray::number(last)
+                 + "/" + QByteArray::number(size) + "\r\n";
+        conn.whole = (first == 0 && last == size - 1);
+    }
+    else
+    {
+        conn.file.close();
+        respondError(conn, 416, "Range Not Satisfiable", "Content-Range: bytes */" + QByteArray::number(size) + "\r\n");
+        return;
+    }
+
+    conn.bodySize = last - first + 1;
+    conn.offset = start + first;
+    conn.end = conn.offset + conn.bodySize;
+    if (method == "HEAD")
+    {
+        conn.end = conn.offset;
+        conn.whole = false;
+    }
+    conn.header = header
+        + "Content-Type: application/octet-stream\r\n"
+          "Content-Length: " + QByteArray::number(conn.bodySize) + "\r\n"
+          "Accept-Ranges: bytes\r\n"
+          "Connection: close\r\n\r\n";
+    conn.headerSent = 0;
+    conn.responding = true;
+    conn.idleSince.start();
+
+#ifdef __linux__
+    if (!conn.growing)
+    {
+        // read this part into the page cache while the socket takes what was read before
+        posix_fadvise(conn.file.handle(), conn.offset, conn.end - conn.offset, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(conn.file.handle(), conn.offset, conn.end - conn.offset, POSIX_FADV_WILLNEED);
+    }
+#endif
+    qDebug() << TAG << method << conn.name << "bytes" << conn.offset << "-" << conn.end
+             << (conn.growing ? "(still being written)" : "") << "to" << conn.clientAddr.toString();
+}
+
+void HttpServer::respondError(Connection &conn, int status, const char *reason, const QByteArray &extraHeader)
+{
+    qDebug() << TAG << "Answering" << conn.clientAddr.toString() << "with" << status << reason;
+    conn.header = "HTTP/1.1 " + QByteArray::number(status) + " " + reason + "\r\n"
+        + extraHeader
+        + "Content-Length: 0\r\n"
+          "Connection: close\r\n\r\n";
+    conn.headerSent = 0;
+    conn.name.clear();
+    conn.offset = conn.end = 0;
+    conn.growing = false;
+    conn.responding = true;
+    conn.idleSince.start();
+}
+
+qint64 HttpServer::available(const Connection &conn)
+{
+    if (!conn.growing || _growingFileSize == 0)
+    {
+        return conn.end;
+    }
+
+    qint64 written = _growingFileWritten;
+    return written < 0 ? -1 : qMin(written, conn.end);
+}
+
+bool HttpServer::sendResponse(Connection &conn)
+{
+    while (conn.headerSent < conn.header.size())
+    {
+        int n = send((SOCKET)conn.sock, conn.header.constData() + conn.headerSent, conn.header.size() - conn.headerSent, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (wouldBlock())
+            {
+                return true;
+            }
+            finish(conn, false);
+            return false;
+        }
+        conn.headerSent += n;
+        conn.idleSince.start();
+    }
+
+    qint64 quantum = HTTP_SEND_QUANTUM;
+    while (conn.offset < conn.end && quantum > 0)
+    {
+        qint64 until = available(conn);
+        if (until < 0)
+        {
+            qDebug() << TAG << "Writing the image failed, dropping" << conn.name;
+            finish(conn, false);
+            return false;
+        }
+        if (until <= conn.offset)
+        {
+            // the rest is not written yet
+            return true;
+        }
+
+        qint64 len = qMin(until - conn.offset, quantum);
+        qint64 n;
+#ifdef __linux__
+        off_t pos = conn.offset;
+        n = sendfile((int)conn.sock, conn.file.handle(), &pos, len);
+#else
+        if (!conn.file.seek(conn.offset) || (len = conn.file.read(_buffer.data(), qMin(len, (qint64)_buffer.size()))) <= 0)
+        {
+            finish(conn, false);
+            return false;
+        }
+        n = send((SOCKET)conn.sock, _buffer.constData(), (int)len, MSG_NOSIGNAL);
+#endif
+        if (n < 0 && wouldBlock())
+        {
+            return true;
+        }
+        if (n <= 0)
+        {
+            qDebug() << TAG << "Sending" << conn.name << "to" << conn.clientAddr.toString() << "failed" << strerror(errno);
+            finish(conn, false);
+            return false;
+        }
+
+        conn.offset += n;
+        quantum -= n;
+        conn.idleSince.start();
+        if (_progressUpdateCallback != nullptr && conn.whole && conn.bodySize > 0)
+        {
+            _progressUpdateCallback(conn.name, 1.0f - (float)(conn.end - conn.offset) / conn.bodySize);
+        }
+    }
+
+    if (conn.offset < conn.end)
+    {
+        return true;
+    }
+
+    finish(conn, true);
+    return false;
+}
+
+void HttpServer::finish(Connection &conn, bool success)
+{
+    conn.file.close();
+    if (conn.name.isEmpty())
+    {
+        return;
+    }
+
+    // a range of a file is not the file sent, it is left to the client to tell
+    if (success && conn.whole)
+    {
+        qDebug() << TAG << "Sent file" << conn.name << "(" << conn.bodySize << "bytes ) to" << conn.clientAddr.toString();
+        if (_onReadSuccess != nullptr) _onReadSuccess(conn.name);
+    }
+    else if (!success)
+    {
+        if (_onReadFailure != nullptr) _onReadFailure(conn.name);
+    }
+    conn.name.clear();
+}
+
+void HttpServer::cancelSessions()
+{
+    for (Connection &conn : _connections)
+    {
+        if (conn.responding && !conn.name.isEmpty())
+        {
+            qDebug() << TAG << "Cancelling transfer of" << conn.name;
+        }
+        conn.file.close();
+        closeSocket(conn.sock);
+    }
+    _connections.clear();
+}
+
+void HttpServer::setTargetDirectory(const QString &dir)
+{
+    _path.setPath(dir);
+}
+
+void HttpServer::setSplitModeSize(qint64 newSplitModeSize)
+{
+    _partSize = qMax((qint64)0, newSplitModeSize);
+}
+
+void HttpServer::setGrowingFile(qint64 finalSize)
+{
+    _growingFileWritten = 0;
+    _growingFileSize = finalSize;
+}
+
+void HttpServer::setGrowingFileWritten(qint64 bytes)
+{
+    _growingFileWritten = bytes;
+}
+
+void HttpServer::setProgressUpdateCallback(std::function<void(QByteArray, float)> func)
+{
+    _progressUpdateCallback = func;
+}
+
+void HttpServer::setOnReadSuccess(const std::function<void (QByteArray)> &newOnReadSuccess)
+{
+    _onReadSuccess = newOnReadSuccess;
+}
+
+void HttpServer::setOnReadFailure(const std::function<void (QByteArray)> &newOnReadFailure)
+{
+    _onReadFailure = newOnReadFailure;
+}
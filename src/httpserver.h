@@ -0,0 +1,158 @@
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHostAddress>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <poll.h>
+#endif
+
+#define HTTP_DEFAULT_PORT (80)
+// connections served at once. U-Boot opens one per file
+#define HTTP_MAX_CONNECTIONS (16)
+// longest wait for the request of a new connection, and for a client that stopped reading
+#define HTTP_IDLE_TIMEOUT (10000)
+// longest wait for the writer of a growing uniflash image to get further
+#define HTTP_GROWING_FILE_TIMEOUT (60000)
+#define HTTP_MAX_REQUEST_SIZE (8192)
+// bytes sent to one connection per run(), so the others, DHCP and TFTP are not held up
+#define HTTP_SEND_QUANTUM (4 * 1024 * 1024)
+
+/*
+ * Serves the files of the TFTP server over HTTP/1.1, for boot loaders that
+ * can fetch over TCP (U-Boot's wget). The multi-GB uniflash image then goes at
+ * line rate with the kernel's congestion control, instead of TFTP's blocks
+ * that each wait for an ack. TFTP stays for the boot ROM stages.
+ *
+ * GET and HEAD with a single Range are supported. The image is split the
+ * same way as by TFTP: /uniflash<N> is part N, /uniflash all of it. Parts of
+ * a growing image are sent as far as setGrowingFileWritten() allows. Every
+ * response ends its connection.
+ *
+ * Non-blocking, driven by the caller's poll loop: pollFds() gives the sockets
+ * to wait for, run() serves whatever can be served now.
+ */
+class HttpServer
+{
+public:
+    HttpServer(uint16_t port = HTTP_DEFAULT_PORT, QString target_dir = ".");
+    ~HttpServer();
+
+    /**
+     * Starts listening. Returns 0 if the server is started successfully
+     */
+    int start();
+    void stop();
+    bool isStarted() const;
+    uint16_t port() const;
+
+    /**
+     * Fills fds with the sockets to poll, at most max of them. Returns how many
+     */
+    int pollFds(struct pollfd *fds, int max);
+
+    /**
+     * Accepts connections, reads requests and sends what the sockets take, without blocking
+     */
+    void run();
+
+    /**
+     * Milliseconds the caller can wait for the sockets, before run() has to
+     * be called again for a growing file or timeouts
+     */
+    int nextTimeout();
+
+    /**
+     * Closes the connections in progress. New ones are still accepted
+     */
+    void cancelSessions();
+
+    /**
+     * Directory files are served from. Transfers in progress keep their file
+     */
+    void setTargetDirectory(const QString &dir);
+
+    /**
+     * Size of the parts uniflash<N> the image is split into, see TFTP::setSplitModeSize()
+     */
+    void setSplitModeSize(qint64 newSplitModeSize);
+
+    /**
+     * See TFTP::setGrowingFile() and TFTP::setGrowingFileWritten()
+     */
+    void setGrowingFile(qint64 finalSize);
+    void setGrowingFileWritten(qint64 bytes);
+
+    // called with the name of the file being sent and the part of it done
+    void setProgressUpdateCallback(std::function<void(QByteArray, float)> func);
+    // called with the name of a file that was sent whole
+    void setOnReadSuccess(const std::function<void (QByteArray)> &newOnReadSuccess);
+    // called with the name of a file the client did not get all of
+    void setOnReadFailure(const std::function<void (QByteArray)> &newOnReadFailure);
+
+protected:
+    struct Connection
+    {
+        qintptr sock{-1};
+        QHostAddress clientAddr;
+        // request, until its header is complete
+        QByteArray request;
+        bool responding{false};
+        // status line and header, sent before the body
+        QByteArray header;
+        int headerSent{0};
+        QFile file;
+        // file name as reported, uniflash with the part number
+        QByteArray name;
+        // next byte of the file to send, and the end of the body
+        qint64 offset{0};
+        qint64 end{0};
+        qint64 bodySize{0};
+        // the whole file or part was asked for, not just a range of it
+        bool whole{false};
+        bool growing{false};
+        // since the connection got further
+        QElapsedTimer idleSince;
+    };
+
+    void accept();
+    // false when the connection is done with
+    bool readRequest(Connection &conn);
+    void respond(Connection &conn, const QByteArray &method, const QByteArray &target, const QByteArray &range);
+    void respondError(Connection &conn, int status, const char *reason, const QByteArray &extraHeader = QByteArray());
+    bool sendResponse(Connection &conn);
+    // how far the body of conn can be sent now. Negative if writing a growing file failed
+    qint64 available(const Connection &conn);
+    void finish(Connection &conn, bool success);
+
+private:
+    uint16_t _port;
+    qintptr _listenSock{-1};
+    std::list<Connection> _connections;
+    QDir _path;
+    // configured part size, 0 for a tenth of the image
+    qint64 _partSize{0};
+    std::atomic<qint64> _growingFileSize{0};
+    std::atomic<qint64> _growingFileWritten{0};
+    QByteArray _buffer;
+    std::function<void(QByteArray, float)> _progressUpdateCallback;
+    std::function<void(QByteArray)> _onReadSuccess;
+    std::function<void(QByteArray)> _onReadFailure;
+};
+
+#endif // HTTPSERVER_H
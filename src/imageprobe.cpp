@@ -0,0 +1,392 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "imageprobe.h"
+#include "config.h"
+#include "curlshare.h"
+#include "downloadthread.h"
+#include <QDebug>
+#include <QFile>
+#include <QtEndian>
+#include <lzma.h>
+#include <zstd.h>
+
+/* Footer of the zstd seekable format, and the highest ratio deflate can compress at */
+#define ZSTD_SEEKABLE_MAGIC     0x8F92EAB1
+#define ZSTD_SEEKABLE_FOOTER    9
+/* Magic number of an LZ4 frame, and the flag of its header telling a content size follows */
+#define LZ4_FRAME_MAGIC         0x184D2204
+#define LZ4_FLAG_CONTENT_SIZE   0x08
+#define DEFLATE_MAX_RATIO       1032
+
+ImageProbe::ImageProbe(const QUrl &url, QObject *parent)
+    : QThread(parent), _url(url), _c(nullptr), _cancelled(false)
+{
+}
+
+void ImageProbe::setUserAgent(const QByteArray &ua)
+{
+    _useragent = ua;
+}
+
+void ImageProbe::cancel()
+{
+    _cancelled = true;
+}
+
+ImageProbe::Result ImageProbe::probe(quint64 fileSize, const Reader &read, bool walkFrames)
+{
+    QByteArray head;
+
+    if (fileSize < 6 || !read(0, 6, head))
+        return Result();
+
+    switch (sniff(head))
+    {
+    case FormatXz:
+        return _probeXz(fileSize, read);
+    case FormatGzip:
+        return _probeGzip(fileSize, read);
+    case FormatZstd:
+        return _probeZstd(fileSize, read, walkFrames);
+    case FormatLz4:
+        return _probeLz4(fileSize, read, walkFrames);
+    default:
+        return Result();
+    }
+}
+
+ImageProbe::Format ImageProbe::sniff(const QByteArray &head)
+{
+    static const char xzMagic[] = {'\xFD', '7', 'z', 'X', 'Z', '\0'};
+    static const char sevenZipMagic[] = {'7', 'z', '\xBC', '\xAF', '\x27', '\x1C'};
+
+    if (head.size() < 6)
+        return FormatRaw;
+
+    const uchar *p = (const uchar *) head.constData();
+    quint32 magic = qFromLittleEndian<quint32>(p);
+    if (head.startsWith(QByteArray(xzMagic, sizeof(xzMagic))))
+        return FormatXz;
+    if (p[0] == 0x1F && p[1] == 0x8B && p[2] == 8)
+        return FormatGzip;
+    if (magic == ZSTD_MAGICNUMBER || (magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)
+        return FormatZstd;
+    if (magic == LZ4_FRAME_MAGIC)
+        return FormatLz4;
+    /* Local file header, or the end of central directory record of an empty zip */
+    if (p[0] == 'P' && p[1] == 'K' && ((p[2] == 3 && p[3] == 4) || (p[2] == 5 && p[3] == 6)))
+        return FormatZip;
+    if (head.startsWith(QByteArray(sevenZipMagic, sizeof(sevenZipMagic))))
+        return Format7z;
+    if (p[0] == 'B' && p[1] == 'Z' && p[2] == 'h' && p[3] >= '1' && p[3] <= '9')
+        return FormatBzip2;
+
+    return FormatRaw;
+}
+
+ImageProbe::Format ImageProbe::sniffFile(const QString &filename)
+{
+    QFile f(filename);
+    if (!f.open(f.ReadOnly))
+        return FormatRaw;
+
+    return sniff(f.read(6));
+}
+
+ImageProbe::Result ImageProbe::probeFile(const QString &filename)
+{
+    QFile f(filename);
+    if (!f.open(f.ReadOnly))
+        return Result();
+
+    return probe(f.size(), [&f](quint64 offset, quint64 len, QByteArray &data) {
+        if (!f.seek(offset))
+            return false;
+        data = f.read(len);
+        return (quint64) data.size() == len;
+    }, true);
+}
+
+ImageProbe::Result ImageProbe::_probeXz(quint64 fileSize, const Reader &read)
+{
+    Result result;
+    QByteArray footer, index;
+    lzma_stream_flags opts = { 0 };
+
+    if (fileSize < 2*LZMA_STREAM_HEADER_SIZE || !read(fileSize-LZMA_STREAM_HEADER_SIZE, LZMA_STREAM_HEADER_SIZE, footer))
+        return result;
+    if (lzma_stream_footer_decode(&opts, (const uint8_t *) footer.constData()) != LZMA_OK
+            || opts.backward_size > IMAGEWRITER_PROBE_MAX_INDEX || opts.backward_size > fileSize-2*LZMA_STREAM_HEADER_SIZE)
+    {
+        qDebug() << "Unable to parse footer of .xz file";
+        return result;
+    }
+    if (!read(fileSize-LZMA_STREAM_HEADER_SIZE-opts.backward_size, opts.backward_size, index))
+        return result;
+
+    lzma_index *idx = nullptr;
+    uint64_t memlimit = UINT64_MAX;
+    size_t pos = 0;
+    if (lzma_index_buffer_decode(&idx, &memlimit, NULL, (const uint8_t *) index.constData(), &pos, index.size()) == LZMA_OK)
+    {
+        /* Index only covers the last stream. Concatenated ones are larger */
+        result.size = lzma_index_uncompressed_size(idx);
+        result.exact = lzma_index_stream_size(idx) == fileSize;
+        lzma_index_end(idx, NULL);
+    }
+    else
+    {
+        qDebug() << "Unable to parse index of .xz file";
+    }
+
+    return result;
+}
+
+ImageProbe::Result ImageProbe::_probeGzip(quint64 fileSize, const Reader &read)
+{
+    Result result;
+    QByteArray trailer;
+
+    /* Header and trailer are 18 bytes */
+    if (fileSize < 18 || !read(fileSize-4, 4, trailer))
+        return result;
+
+    result.size = qFromLittleEndian<quint32>(trailer.constData());
+    result.exact = fileSize * DEFLATE_MAX_RATIO < result.size + (1ull << 32);
+
+    return result;
+}
+
+ImageProbe::Result ImageProbe::_probeZstd(quint64 fileSize, const Reader &read, bool walkFrames)
+{
+    Result result;
+    QByteArray buf;
+
+    /* Seekable format: skippable frame with a table of all frames at the end */
+    if (fileSize >= ZSTD_SEEKABLE_FOOTER+8 && read(fileSize-ZSTD_SEEKABLE_FOOTER, ZSTD_SEEKABLE_FOOTER, buf)
+            && qFromLittleEndian<quint32>(buf.constData()+5) == ZSTD_SEEKABLE_MAGIC)
+    {
+        quint64 frames = qFromLittleEndian<quint32>(buf.constData());
+        quint64 entrySize = (buf[4] & 0x80) ? 12 : 8;
+        quint64 tableSize = frames*entrySize + ZSTD_SEEKABLE_FOOTER;
+
+        if (tableSize <= IMAGEWRITER_PROBE_MAX_INDEX && tableSize+8 <= fileSize
+                && read(fileSize-tableSize-8, tableSize+8, buf)
+                && qFromLittleEndian<quint32>(buf.constData()) == ZSTD_MAGIC_SKIPPABLE_START+0xE
+                && qFromLittleEndian<quint32>(buf.constData()+4) == tableSize)
+        {
+            for (quint64 i = 0; i < frames; i++)
+                result.size += qFromLittleEndian<quint32>(buf.constData()+8+i*entrySize+4);
+            result.exact = true;
+            return result;
+        }
+    }
+
+    quint64 pos = 0;
+    while (pos < fileSize)
+    {
+        if (!read(pos, qMin<quint64>(ZSTD_FRAMEHEADERSIZE_MAX, fileSize-pos), buf) || buf.size() < 8)
+            return Result();
+
+        quint32 magic = qFromLittleEndian<quint32>(buf.constData());
+        if ((magic & ZSTD_MAGIC_SKIPPABLE_MASK) == ZSTD_MAGIC_SKIPPABLE_START)
+        {
+            /* pzstd size hints */
+            pos += 8 + qFromLittleEndian<quint32>(buf.constData()+4);
+            continue;
+        }
+
+        unsigned long long contentSize = ZSTD_getFrameContentSize(buf.constData(), buf.size());
+        if (contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize == ZSTD_CONTENTSIZE_UNKNOWN)
+            return Result();
+        result.size += contentSize;
+        if (!walkFrames)
+        {
+            /* There may be more frames after this one */
+            return result;
+        }
+
+        /* Frame header: magic, descriptor, window descriptor unless single segment, dictionary ID, content size */
+        static const int dictIdSizes[] = {0, 1, 2, 4}, contentSizeSizes[] = {0, 2, 4, 8};
+        uchar fhd = buf[4];
+        bool singleSegment = fhd & 0x20;
+        pos += 5 + (singleSegment ? 0 : 1) + dictIdSizes[fhd & 3] + qMax(contentSizeSizes[fhd >> 6], singleSegment ? 1 : 0);
+
+        /* Blocks: 3 byte header with last block flag, type and size. RLE blocks hold a single byte */
+        bool lastBlock = false;
+        while (!lastBlock)
+        {
+            if (!read(pos, 3, buf))
+                return Result();
+            quint32 header = (uchar) buf[0] | (uchar) buf[1] << 8 | (uchar) buf[2] << 16;
+            int type = (header >> 1) & 3;
+            if (type == 3)
+                return Result();
+            lastBlock = header & 1;
+            pos += 3 + (type == 1 ? 1 : header >> 3);
+        }
+        if (fhd & 4)
+            pos += 4;
+    }
+    result.exact = pos == fileSize;
+
+    return result.exact ? result : Result();
+}
+
+ImageProbe::Result ImageProbe::_probeLz4(quint64 fileSize, const Reader &read, bool walkFrames)
+{
+    Result result;
+    QByteArray buf;
+    quint64 pos = 0;
+
+    while (pos < fileSize)
+    {
+        /* Frame header: magic, FLG, BD, content size if flagged, dictionary ID if flagged, header checksum */
+        if (!read(pos, qMin<quint64>(19, fileSize-pos), buf) || buf.size() < 7
+                || qFromLittleEndian<quint32>(buf.constData()) != LZ4_FRAME_MAGIC)
+            return Result();
+
+        uchar flg = buf[4];
+        if ((flg >> 6) != 1 || !(flg & LZ4_FLAG_CONTENT_SIZE) || buf.size() < 14)
+            return Result();
+        result.size += qFromLittleEndian<quint64>(buf.constData()+6);
+        if (!walkFrames)
+            return result;
+
+        pos += 7 + 8 + ((flg & 1) ? 4 : 0);
+        /* Blocks: 4 byte size with the uncompressed flag in the highest bit, 0 ends the frame */
+        while (true)
+        {
+            if (!read(pos, 4, buf))
+                return Result();
+            quint32 blockSize = qFromLittleEndian<quint32>(buf.constData()) & 0x7FFFFFFF;
+            pos += 4;
+            if (!blockSize)
+                break;
+            pos += blockSize + ((flg & 0x10) ? 4 : 0);
+        }
+        if (flg & 4)
+            pos += 4;
+    }
+    result.exact = pos == fileSize;
+
+    return result.exact ? result : Result();
+}
+
+void ImageProbe::run()
+{
+    QByteArray head;
+    quint64 fileSize = 0;
+    Result result;
+
+    _c = curl_easy_init();
+    if (_c && _fetchRange(0, 6, head, &fileSize) && fileSize)
+    {
+        result = probe(fileSize, [this, &head](quint64 offset, quint64 len, QByteArray &data) {
+            if (offset == 0 && len <= (quint64) head.size())
+            {
+                data = head.left(len);
+                return true;
+            }
+            return _fetchRange(offset, len, data);
+        }, false);
+    }
+    if (_c)
+        curl_easy_cleanup(_c);
+    _c = nullptr;
+
+    if (result.size && !_cancelled)
+    {
+        qDebug() << "Uncompressed size of" << _url << (result.exact ? "is" : "is at least") << result.size;
+        emit probed(_url, result.size, result.exact);
+    }
+}
+
+bool ImageProbe::_fetchRange(quint64 offset, quint64 len, QByteArray &data, quint64 *total)
+{
+    char errorBuf[CURL_ERROR_SIZE] = {0};
+    QByteArray url = _url.toString(QUrl::FullyEncoded).toLatin1();
+    QByteArray range = QByteArray::number(offset) + "-" + QByteArray::number(offset+len-1);
+    QByteArray proxy = DownloadThread::proxy();
+    quint64 size = 0;
+    Transfer transfer = {&data, len};
+
+    data.clear();
+    curl_easy_reset(_c);
+    curl_easy_setopt(_c, CURLOPT_NOSIGNAL, 1);
+    curl_easy_setopt(_c, CURLOPT_WRITEFUNCTION, &ImageProbe::_curl_write_callback);
+    curl_easy_setopt(_c, CURLOPT_WRITEDATA, &transfer);
+    curl_easy_setopt(_c, CURLOPT_HEADERFUNCTION, &ImageProbe::_curl_header_callback);
+    curl_easy_setopt(_c, CURLOPT_HEADERDATA, &size);
+    curl_easy_setopt(_c, CURLOPT_XFERINFOFUNCTION, &ImageProbe::_curl_xferinfo_callback);
+    curl_easy_setopt(_c, CURLOPT_XFERINFODATA, this);
+    curl_easy_setopt(_c, CURLOPT_NOPROGRESS, 0);
+    curl_easy_setopt(_c, CURLOPT_URL, url.constData());
+    curl_easy_setopt(_c, CURLOPT_RANGE, range.constData());
+    curl_easy_setopt(_c, CURLOPT_FOLLOWLOCATION, 1);
+    curl_easy_setopt(_c, CURLOPT_MAXREDIRS, 10);
+    curl_easy_setopt(_c, CURLOPT_ERRORBUFFER, errorBuf);
+    curl_easy_setopt(_c, CURLOPT_FAILONERROR, 1);
+    curl_easy_setopt(_c, CURLOPT_CONNECTTIMEOUT, 30);
+    curl_easy_setopt(_c, CURLOPT_TIMEOUT, 60);
+    DownloadThread::transport().apply(_c);
+    CurlShare::apply(_c);
+    if (!_useragent.isEmpty())
+        curl_easy_setopt(_c, CURLOPT_USERAGENT, _useragent.constData());
+    if (!proxy.isEmpty())
+        curl_easy_setopt(_c, CURLOPT_PROXY, proxy.constData());
+
+    CURLcode ret = curl_easy_perform(_c);
+    if (ret != CURLE_OK)
+    {
+        if (!_cancelled)
+            qDebug() << "Error probing" << _url << ":" << (errorBuf[0] ? errorBuf : curl_easy_strerror(ret));
+        return false;
+    }
+
+    /* A server that ignores the range would send the whole image, which the write callback refuses */
+    long code = 0;
+    curl_easy_getinfo(_c, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 206 || (quint64) data.size() != len)
+        return false;
+    if (total)
+        *total = size;
+
+    return true;
+}
+
+size_t ImageProbe::_curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    Transfer *transfer = (Transfer *) userdata;
+    size_t len = size * nmemb;
+
+    if (transfer->out->size() + len > transfer->maxSize)
+        return 0;
+    transfer->out->append(ptr, len);
+
+    return len;
+}
+
+size_t ImageProbe::_curl_header_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    quint64 *total = (quint64 *) userdata;
+    size_t len = size * nmemb;
+    QByteArray header = QByteArray(ptr, len).trimmed();
+
+    if (header.toLower().startsWith("content-range:"))
+    {
+        int slash = header.lastIndexOf('/');
+        if (slash != -1)
+            *total = header.mid(slash+1).toULongLong();
+    }
+
+    return len;
+}
+
+int ImageProbe::_curl_xferinfo_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+{
+    return ((ImageProbe *) userdata)->_cancelled ? 1 : 0;
+}
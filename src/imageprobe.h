@@ -0,0 +1,105 @@
+#ifndef IMAGEPROBE_H
+#define IMAGEPROBE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QThread>
+#include <QUrl>
+#include <atomic>
+#include <functional>
+#include <curl/curl.h>
+
+/*
+ * Learns the uncompressed size of a compressed image from its metadata,
+ * without decompressing or downloading it
+ *
+ * - .xz: the index at the end of the file
+ * - .gz: the ISIZE field of the gzip trailer, which is the size modulo
+ *   4 GB. Only exact if no other size is possible at the highest ratio
+ *   deflate can reach
+ * - .zst: the seek table of the seekable format, or the frame content
+ *   size of every frame. Remote images only have their first frame
+ *   looked at, if they have no seek table
+ *
+ * - .lz4: the content size of every frame, if they have one. Remote
+ *   images only have their first frame looked at
+ *
+ * Remote images are probed with a few range requests, from a thread of
+ * its own. bzip2 and zip keep no such size, those probe as unknown.
+ *
+ * The format is told by the magic bytes at the start, not by the name.
+ */
+class ImageProbe : public QThread
+{
+    Q_OBJECT
+public:
+    enum Format
+    {
+        FormatRaw,
+        FormatZip,
+        Format7z,
+        FormatGzip,
+        FormatXz,
+        FormatBzip2,
+        FormatZstd,
+        FormatLz4
+    };
+
+    struct Result
+    {
+        /* Uncompressed size, 0 if unknown. If not exact, the image is at least this large */
+        quint64 size = 0;
+        bool exact = false;
+    };
+    /* Read len bytes at offset into data. Returns false if that is not possible */
+    using Reader = std::function<bool(quint64 offset, quint64 len, QByteArray &data)>;
+
+    /* Probe url in the background once started, emitting probed() */
+    ImageProbe(const QUrl &url, QObject *parent = nullptr);
+    void setUserAgent(const QByteArray &ua);
+    void cancel();
+
+    /* Probe the image of fileSize bytes that read gets data of. walkFrames lets
+       zstd images without seek table and lz4 images have the headers of all their frames read */
+    static Result probe(quint64 fileSize, const Reader &read, bool walkFrames);
+    static Result probeFile(const QString &filename);
+
+    /* Format of the image that starts with head. At least 6 bytes are needed to tell, fewer are raw */
+    static Format sniff(const QByteArray &head);
+    /* FormatRaw if the file cannot be read */
+    static Format sniffFile(const QString &filename);
+
+signals:
+    void probed(const QUrl &url, quint64 size, bool exact);
+
+protected:
+    struct Transfer
+    {
+        QByteArray *out;
+        quint64 maxSize;
+    };
+
+    virtual void run();
+
+    static Result _probeXz(quint64 fileSize, const Reader &read);
+    static Result _probeGzip(quint64 fileSize, const Reader &read);
+    static Result _probeZstd(quint64 fileSize, const Reader &read, bool walkFrames);
+    static Result _probeLz4(quint64 fileSize, const Reader &read, bool walkFrames);
+
+    /* Range request on _c. total is set to the size of the file if the server says */
+    bool _fetchRange(quint64 offset, quint64 len, QByteArray &data, quint64 *total = nullptr);
+
+    static size_t _curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    static size_t _curl_header_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    static int _curl_xferinfo_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t);
+
+    QUrl _url;
+    QByteArray _useragent;
+    CURL *_c;
+    std::atomic<bool> _cancelled;
+};
+
+#endif // IMAGEPROBE_H
@@ -0,0 +1,187 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "imagerjob.h"
+#include "imagewriter.h"
+#include <QFileInfo>
+#include <QUrl>
+
+/* Resources of a static library are only registered when asked to. Outside of any namespace */
+static void initResources()
+{
+    Q_INIT_RESOURCE(bootfiles);
+}
+
+ImagerJob::ImagerJob(QObject *parent)
+    : QObject(parent), _writer(nullptr), _running(false)
+{
+    static bool resourcesInitialized = (initResources(), true);
+    Q_UNUSED(resourcesInitialized)
+
+    _writer = new ImageWriter(this);
+    _writer->setVerifyEnabled(true);
+
+    connect(_writer, &ImageWriter::downloadProgress, this, [this](QVariant now, QVariant total) {
+        if (_onProgress)
+            _onProgress(PhaseWrite, now.toULongLong(), total.toULongLong());
+    });
+    connect(_writer, &ImageWriter::verifyProgress, this, [this](QVariant now, QVariant total) {
+        if (_onProgress)
+            _onProgress(PhaseVerify, now.toULongLong(), total.toULongLong());
+    });
+    connect(_writer, &ImageWriter::preparationStatusUpdate, this, [this](QVariant msg) {
+        if (_onStatus)
+            _onStatus(msg.toString());
+    });
+    connect(_writer, &ImageWriter::finalizing, this, [this]() {
+        if (_onStatus)
+            _onStatus(tr("Finalizing"));
+    });
+    connect(_writer, &ImageWriter::success, this, [this]() {
+        _finish(true);
+    });
+    connect(_writer, &ImageWriter::error, this, [this](QVariant msg) {
+        _finish(false, msg.toString());
+    });
+    connect(_writer, &ImageWriter::cancelled, this, [this]() {
+        _finish(false, tr("Cancelled"));
+    });
+}
+
+ImagerJob::~ImagerJob()
+{
+    /* Nothing to report to anymore. ~ImageWriter() stops the threads */
+    _writer->disconnect(this);
+}
+
+void ImagerJob::setSource(const QString &src, const QByteArray &sha256, const QString &bmap)
+{
+    _src = src;
+    _sha256 = sha256;
+    _bmap = bmap;
+}
+
+void ImagerJob::setMirrors(const QStringList &urls, const QString &metalink)
+{
+    _mirrors = urls;
+    _metalink = metalink;
+}
+
+void ImagerJob::addTarget(const QString &device, const QVariantMap &variables)
+{
+    _targets.append(device);
+    if (!variables.isEmpty())
+        _targetVariables.insert(device, variables);
+}
+
+void ImagerJob::setCustomization(const Customization &customization)
+{
+    _customization = customization;
+}
+
+void ImagerJob::setVerifyEnabled(bool verify)
+{
+    _writer->setVerifyEnabled(verify);
+}
+
+void ImagerJob::setProgressCallback(std::function<void(Phase, quint64, quint64)> callback)
+{
+    _onProgress = callback;
+}
+
+void ImagerJob::setStatusCallback(std::function<void(const QString &)> callback)
+{
+    _onStatus = callback;
+}
+
+void ImagerJob::setFinishedCallback(std::function<void(bool, const QString &)> callback)
+{
+    _onFinished = callback;
+}
+
+ImageWriter *ImagerJob::writer() const
+{
+    return _writer;
+}
+
+bool ImagerJob::isRunning() const
+{
+    return _running;
+}
+
+static bool isRemote(const QString &url)
+{
+    return url.startsWith("http:", Qt::CaseInsensitive) || url.startsWith("https:", Qt::CaseInsensitive);
+}
+
+void ImagerJob::start()
+{
+    if (_running)
+        return;
+    _running = true;
+
+    if (_targets.isEmpty())
+    {
+        _finish(false, tr("No storage device to write to"));
+        return;
+    }
+
+    QUrl bmapUrl;
+    if (isRemote(_bmap))
+        bmapUrl = QUrl(_bmap);
+    else if (!_bmap.isEmpty())
+        bmapUrl = QUrl::fromLocalFile(QFileInfo(_bmap).absoluteFilePath());
+
+    /* The format of the customization that was given. Remote images are always geminit, see ImageWriter::setSrc() */
+    QByteArray initFormat = "auto";
+    if (!_customization.geminit.isEmpty())
+        initFormat = "geminit";
+    else if (!_customization.cloudinit.isEmpty() || !_customization.cloudinitNetwork.isEmpty())
+        initFormat = "cloudinit";
+    else if (!_customization.firstrun.isEmpty())
+        initFormat = "systemd";
+
+    if (isRemote(_src))
+    {
+        _writer->setSrc(QUrl(_src), 0, 0, _sha256, false, "", "", initFormat, bmapUrl);
+        _writer->setMirrors(_mirrors, QUrl(_metalink));
+    }
+    else
+    {
+        QFileInfo fi(_src);
+        if (!fi.isFile())
+        {
+            _finish(false, tr("Source file %1 does not exist or is not a regular file").arg(_src));
+            return;
+        }
+        _writer->setSrc(QUrl::fromLocalFile(fi.absoluteFilePath()), fi.size(), 0, _sha256, false, "", "", initFormat, bmapUrl);
+    }
+
+    _writer->setImageCustomization(_customization.config, _customization.cmdline, _customization.firstrun,
+                                   _customization.cloudinit, _customization.cloudinitNetwork, _customization.geminit);
+    _writer->setDst(_targets.first());
+    for (int i = 1; i < _targets.size(); i++)
+        _writer->addDst(_targets[i]);
+    for (auto it = _targetVariables.cbegin(); it != _targetVariables.cend(); ++it)
+        _writer->setTargetVariables(it.key(), it.value());
+
+    _writer->startWrite();
+}
+
+void ImagerJob::cancel()
+{
+    if (_running)
+        _writer->cancelWrite();
+}
+
+void ImagerJob::_finish(bool success, const QString &msg)
+{
+    if (!_running)
+        return;
+    _running = false;
+
+    if (_onFinished)
+        _onFinished(success, msg);
+}
@@ -0,0 +1,96 @@
+#ifndef IMAGERJOB_H
+#define IMAGERJOB_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QVariantMap>
+#include <functional>
+
+class ImageWriter;
+
+/*
+ * Writing one image to one or more drives, for programs linking
+ * libgemimager instead of running gem-imager --cli
+ *
+ *   ImagerJob job;
+ *   job.setSource("https://example.com/image.img.xz", expectedSha256);
+ *   job.addTarget("/dev/sdb");
+ *   job.setFinishedCallback([](bool ok, const QString &msg) { ... });
+ *   job.start();
+ *
+ * Needs a QCoreApplication, and callbacks are called from its event loop,
+ * on the thread the job lives in. Any number of jobs can run at the same
+ * time. They share the process-wide download connections (CurlShare) and
+ * the image cache, so a second job of the same image writes from what the
+ * first one downloaded.
+ *
+ * Options not covered here are set on writer() before start().
+ */
+class ImagerJob : public QObject
+{
+    Q_OBJECT
+public:
+    enum Phase
+    {
+        PhaseWrite,
+        PhaseVerify
+    };
+
+    /* See ImageWriter::setImageCustomization() */
+    struct Customization
+    {
+        QByteArray config, cmdline, firstrun, cloudinit, cloudinitNetwork, geminit;
+    };
+
+    explicit ImagerJob(QObject *parent = nullptr);
+    virtual ~ImagerJob();
+
+    /* Image file or http(s) URL, with the SHA256 of the extracted image if known, and its bmap file or URL */
+    void setSource(const QString &src, const QByteArray &sha256 = QByteArray(), const QString &bmap = QString());
+    /* Other URLs of the image, and a metalink listing them */
+    void setMirrors(const QStringList &urls, const QString &metalink = QString());
+    /* Drive device to write to. Several are written at the same time, each with
+       its own values for the {{variables}} in the customization, see ImageWriter::setTargetVariables() */
+    void addTarget(const QString &device, const QVariantMap &variables = QVariantMap());
+    void setCustomization(const Customization &customization);
+    /* Enabled by default */
+    void setVerifyEnabled(bool verify);
+
+    void setProgressCallback(std::function<void(Phase phase, quint64 now, quint64 total)> callback);
+    /* Preparation and finalization steps, as shown to the user */
+    void setStatusCallback(std::function<void(const QString &msg)> callback);
+    /* Called once, with the error message if not successful */
+    void setFinishedCallback(std::function<void(bool success, const QString &msg)> callback);
+
+    /* The ImageWriter doing the work. Valid for the lifetime of the job */
+    ImageWriter *writer() const;
+
+    /* Problems with the job itself are reported through the finished callback as well */
+    void start();
+    void cancel();
+    bool isRunning() const;
+
+protected:
+    ImageWriter *_writer;
+    QString _src, _bmap, _metalink;
+    QStringList _mirrors, _targets;
+    QHash<QString, QVariantMap> _targetVariables;
+    QByteArray _sha256;
+    Customization _customization;
+    bool _running;
+    std::function<void(Phase, quint64, quint64)> _onProgress;
+    std::function<void(const QString &)> _onStatus;
+    std::function<void(bool, const QString &)> _onFinished;
+
+    void _finish(bool success, const QString &msg = QString());
+};
+
+#endif // IMAGERJOB_H
@@ -4,7 +4,17 @@
  */
 
  #include "downloadextractthread.h"
+ #include "fanouttargetthread.h"
+#include "deviceclonethread.h"
  #include "downloadthread.h"
+ #include "deltadownloadthread.h"
+#include "prefetchthread.h"
+#include "downloadcoordinator.h"
+#include "imageprobe.h"
+#include "threadplacement.h"
+#include "bandwidthscheduler.h"
+ #include "peercache.h"
+ #include "cachevolumes.h"
  #include "imagewriter.h"
  #include "drivelistitem.h"
  #include "dependencies/drivelist/src/drivelist.hpp"
@@ -12,11 +22,14 @@
  #include "dependencies/crypt/sha512crypt.h"
  #include "driveformatthread.h"
  #include "localfileextractthread.h"
- #include "downloadstatstelemetry.h"
  #include "simpdhcp.h"
  #include "wlancredentials.h"
  #include "writeinplacethread.h"
  #include "dfuthread.h"
+ #include "dfuwrapper.h"
+ #include "fastbootthread.h"
+ #include "verifyonlythread.h"
+ #include "metrics.h"
  #include <archive.h>
  #include <archive_entry.h>
  #include <lzma.h>
@@ -36,11 +49,16 @@
  #include <QHostAddress>
  #include <QNetworkAccessManager>
  #include <QNetworkReply>
+ #include <QCryptographicHash>
  #include <QDateTime>
  #include <QDebug>
  #include <QVersionNumber>
+ #include <QCborMap>
+ #include <QCborValue>
+ #include <QSaveFile>
+ #include <QElapsedTimer>
+ #include <QtConcurrent/QtConcurrent>
  #include <QtNetwork>
- #include <QSerialPortInfo>
  #ifndef QT_NO_WIDGETS
  #include <QFileDialog>
  #include <QApplication>
@@ -59,6 +77,10 @@
  #ifdef Q_OS_LINUX
  #include "linux/stpanalyzer.h"
  #include <unistd.h>
+ #include <errno.h>
+ #include <string.h>
+ #include <sys/resource.h>
+ #include <sys/syscall.h>
  #endif
  
  namespace {
@@ -67,11 +89,29 @@
  
  ImageWriter::ImageWriter(QObject *parent)
      : QObject(parent), _repo(QUrl(QString(OSLIST_URL))), _dlnow(0), _verifynow(0),
-       _engine(nullptr), _thread(nullptr), _verifyEnabled(false), _cachingEnabled(false),
-       _embeddedMode(false), _online(false), _customCacheFile(false), _trans(nullptr),
-       _networkManager(this)
- {
-     connect(&_polltimer, SIGNAL(timeout()), SLOT(pollProgress()));
+       _engine(nullptr), _renderThreadId(0), _renderThreadNice(0), _thread(nullptr), _verifyEnabled(false), _cachingEnabled(false),
+       _embeddedMode(false), _online(false), _customCacheFile(false), _extractedCaching(false), _peerCache(false), _multiSource(false), _ramStageBudget(0), _stagingInRam(false), _transcodeCache(false), _deltaThread(nullptr), _deltaAttempted(false),
+       _prefetchThread(nullptr), _prefetch(false), _writeAfterPrefetch(false), _precaching(false), _precacheComplete(false), _dfuUms(false), _dfuFastboot(false), _umsBoards(0), _imageProbe(nullptr), _extrLenAtLeast(0), _trans(nullptr),
+       _writeQueueDepth(IMAGEWRITER_WRITE_QUEUE_DEPTH), _downloadSegments(IMAGEWRITER_DOWNLOAD_SEGMENTS), _writeBlockSize(0), _memoryLimit(0), _directIO(false), _ioUring(true), _sparseWrite(false), _deltaWrite(false), _resume(true), _overlappedVerify(false), _chunkedVerify(false), _inStreamCustomization(false), _userspaceExtraction(false), _queueTuning(false), _expandRoot(false), _capacityProbe(true), _asyncEject(false), _chunkAlgorithm(ChunkedHash::Sha256), _networkManager(nullptr), _deviceFilterIsInclusive(false)
+ {
+     _osListSnapshotTimer.setSingleShot(true);
+     _osListSnapshotTimer.setInterval(1000);
+     connect(&_osListSnapshotTimer, &QTimer::timeout, this, &ImageWriter::_saveOSListSnapshot);
+     _prefetchTimer.setSingleShot(true);
+     _prefetchTimer.setInterval(IMAGEWRITER_PREFETCH_DELAY);
+     connect(&_prefetchTimer, &QTimer::timeout, this, &ImageWriter::_startPrefetch);
+     _umsTimer.setSingleShot(true);
+     _umsTimer.setInterval(IMAGEWRITER_UMS_ENUMERATE_TIMEOUT);
+     connect(&_umsTimer, &QTimer::timeout, this, &ImageWriter::onUmsDrivesChanged);
+     _progressTimer.setInterval(IMAGEWRITER_EMBEDDED_PROGRESS_INTERVAL);
+     connect(&_progressTimer, &QTimer::timeout, this, &ImageWriter::onProgressChanged);
+     _scrubTimer.setSingleShot(true);
+     _scrubTimer.setInterval(IMAGEWRITER_CACHE_SCRUB_IDLE_DELAY);
+     connect(&_scrubTimer, &QTimer::timeout, this, &ImageWriter::_startCacheScrub);
+     connect(&_cacheScrubber, &CacheScrubber::validated, this, &ImageWriter::onCacheEntryValidated);
+     connect(&_cacheScrubber, &CacheScrubber::corrupt, this, &ImageWriter::onCacheEntryCorrupt);
+     connect(&_scrubTimer, &QTimer::timeout, this, &ImageWriter::_startCacheTranscode);
+     connect(&_cacheTranscoder, &CacheTranscoder::transcoded, this, &ImageWriter::onCacheEntryTranscoded);
  
      QString platform;
      if (qobject_cast<QGuiApplication*>(QCoreApplication::instance()) )
@@ -87,6 +127,8 @@
      if (platform == "eglfs" || platform == "linuxfb")
      {
          _embeddedMode = true;
+         /* Boards with little RAM must not run out of it while writing */
+         _memoryLimit = lzma_physmem() / IMAGEWRITER_EMBEDDED_MEMORY_FRACTION;
          connect(&_networkchecktimer, SIGNAL(timeout()), SLOT(pollNetwork()));
          _networkchecktimer.start(100);
          changeKeyboard(detectPiKeyboard());
@@ -175,19 +217,82 @@
  
      _settings.beginGroup("caching");
      _cachingEnabled = !_embeddedMode && _settings.value("enabled", IMAGEWRITER_ENABLE_CACHE_DEFAULT).toBool();
-     _cachedFileHash = _settings.value("lastDownloadSHA256").toByteArray();
-     _cacheFileName = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"lastdownload.cache";
-     if (!_cachedFileHash.isEmpty())
+     /* With several roots, decompressed images go to the fastest volume and downloads to the largest */
+     QString cacheRoot = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+     QString hotRoot = cacheRoot, coldRoot = cacheRoot;
+     QStringList cacheRoots = _settings.value("roots").toStringList();
+     if (_cachingEnabled && cacheRoots.size() > 1)
      {
-         QFileInfo f(_cacheFileName);
-         if (!f.exists() || !f.isReadable() || !f.size())
+         CacheVolumes volumes;
+         volumes.setRoots(cacheRoots);
+         if (!volumes.volumes().isEmpty())
          {
-             _cachedFileHash.clear();
-             _settings.remove("lastDownloadSHA256");
-             _settings.sync();
+             hotRoot = volumes.fastest();
+             coldRoot = volumes.largest();
          }
      }
+     else if (cacheRoots.size() == 1)
+     {
+         hotRoot = coldRoot = cacheRoots.first();
+     }
+     _downloadCache.setDirectory(coldRoot+QDir::separator()+"images");
+     _downloadCache.setBudget(_settings.value("budget", IMAGEWRITER_CACHE_BUDGET_DEFAULT).toULongLong());
+     _extractedCaching = _cachingEnabled && _settings.value("extracted", IMAGEWRITER_CACHE_EXTRACTED_DEFAULT).toBool();
+     _extractedCache.setDirectory(hotRoot+QDir::separator()+"extracted");
+     _extractedCache.setBudget(_settings.value("extractedBudget", IMAGEWRITER_CACHE_BUDGET_DEFAULT).toULongLong());
+#ifdef Q_OS_LINUX
+     QString ramStageDir = _settings.value("ramStageDirectory", IMAGEWRITER_RAMSTAGE_DIRECTORY).toString();
+#else
+     /* No memory backed directory everywhere, a RAM disk has to be configured */
+     QString ramStageDir = _settings.value("ramStageDirectory").toString();
+#endif
+     if (_cachingEnabled && !ramStageDir.isEmpty())
+     {
+         _ramStage.setDirectory(ramStageDir+QDir::separator()+"gem-imager");
+         setRamStageBudget(_settings.value("ramStageBudget", IMAGEWRITER_RAMSTAGE_BUDGET_DEFAULT).toULongLong());
+     }
+     if (_cachingEnabled && _settings.value("peerCache", false).toBool())
+         setPeerCacheEnabled(true);
+     _prefetch = _settings.value("prefetch", IMAGEWRITER_PREFETCH_DEFAULT).toBool();
+     _transcodeCache = _cachingEnabled && _settings.value("transcode", IMAGEWRITER_CACHE_TRANSCODE_DEFAULT).toBool();
+ 
+     /* Move single cache file of older versions into the cache directory */
+     QByteArray lastDownloadHash = _settings.value("lastDownloadSHA256").toByteArray();
+     if (!lastDownloadHash.isEmpty())
+     {
+         QString lastDownloadFile = QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"lastdownload.cache";
+         QFileInfo f(lastDownloadFile);
+         if (f.exists() && f.isReadable() && f.size())
+             _downloadCache.import(lastDownloadFile, lastDownloadHash);
+         _settings.remove("lastDownloadSHA256");
+         _settings.sync();
+     }
+     _localImages.setIndexFile(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"localimages.json");
+     _localImages.setFolders(_settings.value("localImageFolders").toStringList());
      _settings.endGroup();
+     _scrubTimer.start();
+ 
+     /* Transport tuning for slow or far away download sites */
+     _settings.beginGroup("download");
+     DownloadTransport transport;
+     if (!transport.setHttpVersion(_settings.value("httpVersion", "auto").toString()))
+         qDebug() << "Unknown HTTP version in settings:" << _settings.value("httpVersion").toString();
+     transport.bufferSize = _settings.value("bufferSize", 0).toInt();
+     transport.tcpNoDelay = _settings.value("tcpNoDelay", true).toBool();
+     transport.keepAliveIdle = _settings.value("keepAliveIdle", 60).toInt();
+     transport.socketBufferSize = _settings.value("socketBufferSize", 0).toInt();
+     transport.congestionControl = _settings.value("congestionControl").toByteArray();
+     DownloadThread::setTransport(transport);
+     _downloadSegments = _settings.value("segments", IMAGEWRITER_DOWNLOAD_SEGMENTS).toInt();
+     _multiSource = _settings.value("multiSource", false).toBool();
+     /* KB/s all downloads together may use, 0 for no limit */
+     BandwidthScheduler::setLimit(_settings.value("maxRate", 0).toULongLong() * 1024);
+     _settings.endGroup();
+
+     /* Cores, nice levels and I/O classes of the write pipeline, see ThreadPlacement::parse() */
+     QString placementError;
+     if (!ThreadPlacement::parse(_settings.value("threadPlacement").toString(), &placementError))
+         qDebug() << "Ignoring thread placement in settings:" << placementError;
  
      QDir dir(":/i18n", "gem-imager_*.qm");
      const QStringList transFiles = dir.entryList();
@@ -215,13 +320,32 @@
          }
      }
      //_currentKeyboard = "us";
- 
-     // Centralised network manager, for fetching OS lists
-     connect(&_networkManager, SIGNAL(finished(QNetworkReply *)), this, SLOT(handleNetworkRequestFinished(QNetworkReply *)));
+
+     /* Sends what is queued, also from earlier runs, once no download is running */
+     _telemetry.start(QThread::LowestPriority);
+     connect(&_portWatcher, &PortListWatcher::portsChanged, this, &ImageWriter::portListChanged);
  }
  
  ImageWriter::~ImageWriter()
  {
+     /* The thread is our child, and may not be deleted while still running */
+     if (_thread && _thread->isRunning())
+     {
+         _thread->cancelDownload();
+         _thread->wait();
+     }
+     if (_prefetchThread)
+     {
+         _prefetchThread->cancelDownload();
+         _prefetchThread->wait();
+     }
+     /* Including those of images selected before, that are still finishing */
+     for (ImageProbe *probe : findChildren<ImageProbe *>())
+     {
+         probe->cancel();
+         probe->wait();
+     }
+ 
      if (_trans)
      {
          QCoreApplication::removeTranslator(_trans);
@@ -244,12 +368,19 @@
      _selEthPort = ethPort;
  }
  
- /* Set URL to download from */
- void ImageWriter::setSrc(const QUrl &url, quint64 downloadLen, quint64 extrLen, QByteArray expectedHash, bool multifilesinzip, QString parentcategory, QString osname, QByteArray initFormat)
+ /* Set URL to download from, and optionally of a bmap describing which parts of the image contain data */
+ void ImageWriter::setSrc(const QUrl &url, quint64 downloadLen, quint64 extrLen, QByteArray expectedHash, bool multifilesinzip, QString parentcategory, QString osname, QByteArray initFormat, const QUrl &bmapUrl)
  {
      _src = url;
+     _bmapUrl = bmapUrl;
+     _chunkIndexUrl.clear();
+     _mirrors.clear();
+     _metalinkUrl.clear();
+     _encodings.clear();
+     _pendingChunkIndex = ChunkIndex();
      _downloadLen = downloadLen;
      _extrLen = extrLen;
+     _extrLenAtLeast = 0;
      _expectedHash = expectedHash;
      _multipleFilesInZip = multifilesinzip;
      _parentCategory = parentcategory;
@@ -261,12 +392,45 @@
          QFileInfo fi(url.toLocalFile());
          _downloadLen = fi.size();
      }
+     LocalImageIndex::Entry local;
+     if (url.isLocalFile() && _expectedHash.isEmpty() && !multifilesinzip && _lookupLocalImage(url.toLocalFile(), &local))
+     {
+         /* Known image, so it can come from the extracted cache, and show exact progress */
+         qDebug() << "Local image is indexed. Extracted image" << local.extractSha256 << "size" << local.extractSize;
+         _expectedHash = local.extractSha256;
+         if (!_extrLen)
+             _extrLen = local.extractSize;
+         if (_bmapUrl.isEmpty() && !local.bmapUrl.isEmpty())
+             _bmapUrl = QUrl(local.bmapUrl);
+     }
      /* Remote URLs: always use geminit (JSON's init_format field is metadata, not imager behavior).
         Local files: use geminit as default if not explicitly set. */
      if (!url.isEmpty() && (!url.isLocalFile() || _initFormat.isEmpty()))
      {
          _initFormat = "geminit";
      }
+
+     if (_imageProbe)
+     {
+         _imageProbe->cancel();
+         _imageProbe = nullptr;
+     }
+     QString lowercaseurl = url.toString().toLower();
+     if (!_extrLen && !url.isLocalFile() && !multifilesinzip
+             && (lowercaseurl.endsWith(".xz") || lowercaseurl.endsWith(".gz") || lowercaseurl.endsWith(".zst") || lowercaseurl.endsWith(".lz4")))
+     {
+         /* Knowing the size early lets too small devices be refused, and progress be shown of the image */
+         _imageProbe = new ImageProbe(url, this);
+         _imageProbe->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
+         connect(_imageProbe, &ImageProbe::probed, this, &ImageWriter::onImageProbed);
+         connect(_imageProbe, &QThread::finished, _imageProbe, &QObject::deleteLater);
+         _imageProbe->start(QThread::LowPriority);
+     }
+
+     /* A different image is no longer worth downloading. Maybe this one is, if it stays selected */
+     if (_prefetchThread && _prefetchHash != _expectedHash)
+         _prefetchThread->cancelDownload();
+     _prefetchTimer.start();
  }
  
  /* Set device to write to */
@@ -274,6 +438,55 @@
  {
      _dst = device;
      _devLen = deviceSize;
+     _extraDsts.clear();
+     _targetVariables.clear();
+ }
+ 
+ /* Write the same image to another device at the same time */
+ void ImageWriter::addDst(const QString &device, quint64 deviceSize)
+ {
+     if (_dst.isEmpty())
+     {
+         setDst(device, deviceSize);
+         return;
+     }
+     if (device == _dst || _extraDsts.contains(device))
+         return;
+ 
+     _extraDsts.append(device);
+     /* Image has to fit on the smallest one */
+     if (deviceSize && (!_devLen || deviceSize < _devLen))
+         _devLen = deviceSize;
+ }
+ 
+ int ImageWriter::dstCount()
+ {
+     return _dst.isEmpty() ? 0 : _extraDsts.size() + 1;
+ }
+ 
+ QVariantList ImageWriter::writeHealth()
+ {
+     QVariantList reports;
+
+     if (!_fanoutTargets.isEmpty())
+     {
+         for (FanoutTargetThread *target : std::as_const(_fanoutTargets))
+             reports.append(target->writeHealth());
+     }
+     else if (_thread)
+     {
+         reports.append(_thread->writeHealth());
+     }
+
+     return reports;
+ }
+
+ double ImageWriter::queueOccupancy()
+ {
+     if (!_thread || !_thread->queueCapacity())
+         return 0;
+ 
+     return (double) _thread->queueDepth() / _thread->queueCapacity();
  }
  
  /* Returns true if src and dst are set */
@@ -290,12 +503,73 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
 }
 
 
+ void ImageWriter::setChunkIndexUrl(const QUrl &url)
+ {
+     _chunkIndexUrl = url;
+ }
+
+ void ImageWriter::setMirrors(const QStringList &urls, const QUrl &metalinkUrl)
+ {
+     _mirrors = urls;
+     _metalinkUrl = metalinkUrl;
+ }
+
+void ImageWriter::setEncodings(const QVariantList &encodings)
+{
+    _encodings.clear();
+    _encodings.append({_src, _downloadLen});
+    QStringList formats{EncodingSelector::format(_src)};
+
+    for (const QVariant &v : encodings)
+    {
+        QVariantMap m = v.toMap();
+        QUrl url(m["url"].toString());
+        if (url.isEmpty() || url == _src || !(url.scheme() == "http" || url.scheme() == "https"))
+            continue;
+
+        _encodings.append({url, m["image_download_size"].toULongLong()});
+        formats.append(EncodingSelector::format(url));
+    }
+
+    /* Decoders are timed once, while the user is still choosing a drive */
+    if (_encodings.size() > 1 && !_decodeBenchmark.isRunning())
+        _decodeBenchmark = QtConcurrent::run(&EncodingSelector::benchmark, formats);
+}
+
+void ImageWriter::_chooseEncoding()
+{
+    _decodeBenchmark.waitForFinished();
+    const EncodingSelector::Encoding &e = _encodings[EncodingSelector::choose(_encodings, _extrLen)];
+    if (e.url == _src)
+        return;
+
+    qDebug() << "Downloading" << e.url << "instead of" << _src;
+    _src = e.url;
+    _downloadLen = e.downloadLen;
+    /* Those are of the encoding in the OS list entry */
+    _mirrors.clear();
+    _metalinkUrl.clear();
+    _chunkIndexUrl.clear();
+}
+
  /* Start writing */
  void ImageWriter::startWrite()
  {
      if (!readyToWrite())
          return;
  
+     qDeleteAll(_fanoutTargets);
+     _fanoutTargets.clear();
+     _targetErrors.clear();
+ 
+     /* Scrubbing would compete with the write for the disk, transcoding for the CPU */
+     _scrubTimer.stop();
+     _cacheScrubber.cancel();
+     _cacheTranscoder.cancel();
+     _cacheScrubber.wait();
+     _cacheTranscoder.wait();
+     _unvalidatedEntry.clear();
+
      if (_src.toString() == "internal://format")
      {
          DriveFormatThread *dft = new DriveFormatThread(_dst.toLatin1(), this);
@@ -304,23 +578,47 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
          dft->start();
          return;
      }
+
+     /* The thread writing the image takes over the download where the prefetch got to */
+     _prefetchTimer.stop();
+     if (_prefetchThread)
+     {
+         _writeAfterPrefetch = true;
+         _prefetchThread->cancelDownload();
+         return;
+     }
+
+     /* The download cache is by the hash of the extracted image, so it does not matter which encoding is in there */
+     if (_encodings.size() > 1 && !isCached(_src, _expectedHash))
+         _chooseEncoding();
  
      QByteArray urlstr = _src.toString(_src.FullyEncoded).toLatin1();
      QString lowercaseurl = urlstr.toLower();
-     bool compressed = lowercaseurl.endsWith(".zip") || lowercaseurl.endsWith(".xz") || lowercaseurl.endsWith(".bz2") || lowercaseurl.endsWith(".gz") || lowercaseurl.endsWith(".7z") || lowercaseurl.endsWith(".zst") || lowercaseurl.endsWith(".cache");
+     /* Local files are told apart by their content, remote ones by their name until they arrive */
+     ImageProbe::Format localFormat = _src.isLocalFile() ? ImageProbe::sniffFile(_src.toLocalFile()) : ImageProbe::FormatRaw;
+     bool compressed = _src.isLocalFile() ? localFormat != ImageProbe::FormatRaw
+                                          : lowercaseurl.endsWith(".zip") || lowercaseurl.endsWith(".xz") || lowercaseurl.endsWith(".bz2") || lowercaseurl.endsWith(".gz") || lowercaseurl.endsWith(".7z") || lowercaseurl.endsWith(".zst") || lowercaseurl.endsWith(".lz4");
      if (!_extrLen && _src.isLocalFile())
      {
          if (!compressed)
              _extrLen = _downloadLen;
-         else if (lowercaseurl.endsWith(".zip"))
+         else if (localFormat == ImageProbe::FormatZip)
              _parseCompressedFile();
-         else if (lowercaseurl.endsWith(".xz"))
-             _parseXZFile();
+         else
+         {
+             ImageProbe::Result probed = ImageProbe::probeFile(_src.toLocalFile());
+             if (probed.exact)
+                 _extrLen = probed.size;
+             else
+                 _extrLenAtLeast = probed.size;
+             if (probed.size)
+                 qDebug() << "Probed compressed file. Uncompressed size" << (probed.exact ? "is" : "is at least") << probed.size;
+         }
      }
  
-     if (_devLen && _extrLen > _devLen)
+     if (_devLen && qMax(_extrLen, _extrLenAtLeast) > _devLen)
      {
-         emit error(tr("Storage capacity is not large enough.<br>Needs to be at least %1 GB.").arg(QString::number(_extrLen/1000000000.0, 'f', 1)));
+         emit error(tr("Storage capacity is not large enough.<br>Needs to be at least %1 GB.").arg(QString::number(qMax(_extrLen, _extrLenAtLeast)/1000000000.0, 'f', 1)));
          return;
      }
  
@@ -330,17 +628,48 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
          return;
      }
  
-     if (!_expectedHash.isEmpty() && _cachedFileHash == _expectedHash)
+     /* Decompressed copy of the image is preferred over the download, the one in memory over the one on disk */
+     bool fromRamStage = _ramStageBudget && !_multipleFilesInZip && !_expectedHash.isEmpty() && _ramStage.contains(_expectedHash);
+     bool fromExtractedCache = fromRamStage || (_extractedCaching && !_multipleFilesInZip && !_expectedHash.isEmpty() && _extractedCache.contains(_expectedHash));
+     bool fromCache = fromExtractedCache || isCached(_src, _expectedHash);
+     if (fromCache)
+         Metrics::add(Metrics::CacheHits);
+     else if (_cachingEnabled && !_expectedHash.isEmpty() && !_src.isLocalFile())
+         Metrics::add(Metrics::CacheMisses);
+     /* Another job of this process is downloading the image into the cache already. Read it
+        from there as it arrives, so the image is downloaded once, and leave the cache to that job */
+     std::shared_ptr<DownloadCoordinator::Transfer> followed;
+     if (!fromCache && _cachingEnabled && !_customCacheFile && !_expectedHash.isEmpty() && !_src.isLocalFile() && _dst != "uniflash")
+         followed = DownloadCoordinator::find(_expectedHash);
+     QString cacheFile;
+     if (fromRamStage)
+         cacheFile = _ramStage.fileName(_expectedHash);
+     else if (fromExtractedCache)
+         cacheFile = _extractedCache.fileName(_expectedHash);
+     else
+         cacheFile = _customCacheFile ? _cacheFileName : _downloadCache.fileName(_expectedHash);
+     if (fromCache)
      {
          // Use cached file
-         urlstr = QUrl::fromLocalFile(_cacheFileName).toString(_src.FullyEncoded).toLatin1();
+         urlstr = QUrl::fromLocalFile(cacheFile).toString(_src.FullyEncoded).toLatin1();
+         if (fromRamStage)
+             _ramStage.touch(_expectedHash);
+         else if (fromExtractedCache)
+             _extractedCache.touch(_expectedHash);
+         else if (!_customCacheFile)
+             _downloadCache.touch(_expectedHash);
+     }
+     else if (!followed && !_deltaAttempted && _startDeltaDownload())
+     {
+         /* Writing starts once the image is assembled in the extracted cache */
+         return;
      }
  
      auto findBoardName = [this, &urlstr]() -> QByteArray
      {
          QString board_name{};
  
-         for(auto item: _completeOsList["os_list"].toArray())
+         for(auto item: _resolvedOsList(_completeOsList["os_list"].toArray()))
          {
              auto obj = item.toObject();
              if(obj.contains("subitems"))
@@ -395,6 +724,45 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
          WriteInPlaceThread* th = new WriteInPlaceThread(urlstr, _dst.toLatin1(), _expectedHash, boardName, this);
          th->setPortNames(_selSerPort, _selEthPort);
          th->setSerPortbaudRate(UNIFLASH_BAUD_RATE);
+         th->setImageSize(_extrLen);
+
+         // part size, serial rate and MTU the board handles best, from its entry in the devices of the OS list
+         for(auto device: _completeOsList["imager"].toObject()["devices"].toArray())
+         {
+             auto deviceObj = device.toObject();
+             if(false == deviceObj["tags"].toArray().contains(QString(boardName)))
+             {
+                 continue;
+             }
+             if(deviceObj.contains("uniflash_part_size"))
+             {
+                 qint64 partSize = deviceObj["uniflash_part_size"].toInteger();
+                 qDebug() << "uniflash part size for" << boardName << ":" << partSize;
+                 if(partSize > 0 && partSize % 512 == 0)
+                 {
+                     th->setPartSize(partSize);
+                 }
+             }
+             if(deviceObj.contains("uniflash_mtu"))
+             {
+                 int mtu = deviceObj["uniflash_mtu"].toInt();
+                 qDebug() << "uniflash MTU for" << boardName << ":" << mtu;
+                 if(mtu > 0)
+                 {
+                     th->setLinkMtu(mtu);
+                 }
+             }
+             if(deviceObj.contains("uniflash_max_baud_rate"))
+             {
+                 qint64 baudRate = deviceObj["uniflash_max_baud_rate"].toInteger();
+                 qDebug() << "uniflash max baud rate for" << boardName << ":" << baudRate;
+                 if(baudRate > UNIFLASH_BAUD_RATE)
+                 {
+                     th->setMaxSerPortBaudRate(baudRate);
+                 }
+             }
+             break;
+         }
          _thread = th;
          QObject::connect(_thread, &DownloadThread::updateNumProgress, this, &ImageWriter::sendProgress);
      }
@@ -406,11 +774,11 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
      else
      {
          _thread = new DownloadExtractThread(urlstr, _dst.toLatin1(), _expectedHash, this);
+         if (!_mirrors.isEmpty() || !_metalinkUrl.isEmpty())
+             _thread->setMirrors(_encodedMirrors(), _metalinkUrl.toEncoded());
          if (_repo.toString() == OSLIST_URL)
          {
-             DownloadStatsTelemetry *tele = new DownloadStatsTelemetry(urlstr, _parentCategory.toLatin1(), _osName.toLatin1(), _embeddedMode, _currentLangcode, this);
-             connect(tele, SIGNAL(finished()), tele, SLOT(deleteLater()));
-             tele->start();
+             _telemetry.add(urlstr, _parentCategory.toLatin1(), _osName.toLatin1(), _embeddedMode, _currentLangcode);
          }
      }
  
@@ -418,48 +786,88 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
      connect(_thread, SIGNAL(error(QString)), SLOT(onError(QString)));
      connect(_thread, SIGNAL(finalizing()), SLOT(onFinalizing()));
      connect(_thread, SIGNAL(preparationStatusUpdate(QString)), SLOT(onPreparationStatusUpdate(QString)));
+     connect(_thread, &DownloadThread::phaseStarted, this, [this](QString phase) {
+         emit phaseStarted(phase);
+     });
+     connect(_thread, &DownloadThread::phaseFinished, this, [this](QString phase, quint64 bytes, qint64 msecs) {
+         if (phase == "download" && !_src.isLocalFile())
+             EncodingSelector::recordDownload(_src, bytes, msecs);
+         emit phaseFinished(phase, bytes, msecs);
+     });
      _thread->setVerifyEnabled(_verifyEnabled);
+     _thread->setDirectIOEnabled(_directIO);
+     _thread->setIoUringEnabled(_ioUring);
+     _thread->setSparseWriteEnabled(_sparseWrite);
+     _thread->setAsyncEjectEnabled(_asyncEject);
+     _thread->setDeltaWriteEnabled(_deltaWrite);
+     _thread->setResumeEnabled(_resume);
+     _thread->setCapacityProbeEnabled(_capacityProbe);
+     _thread->setOverlappedVerifyEnabled(_overlappedVerify);
+     _thread->setChunkedVerifyEnabled(_chunkedVerify);
+     _thread->setChunkedVerifyAlgorithm(_chunkAlgorithm);
+     /* Buffered writes are in flight a writeback window at a time, so the queue depth only counts with direct I/O */
+     _thread->setQueueTuning(_queueTuning, _writeBlockSize, _directIO ? _writeQueueDepth : 0);
+     _thread->setInStreamCustomizationEnabled(_inStreamCustomization);
+     _thread->setExpandRootPartitionEnabled(_expandRoot);
+     _thread->setDownloadSegments(_downloadSegments);
+     _thread->setPeerCacheEnabled(_peerCache && !fromCache);
+     if (followed)
+         _thread->followTransfer(followed);
+     _thread->setMultiSourceEnabled(_multiSource);
+     if (!_bmapUrl.isEmpty() && !_multipleFilesInZip)
+         _thread->setBmapUrl(_bmapUrl.toEncoded());
+     if (fromCache && !_multipleFilesInZip)
+     {
+         /* Extracted image was verified when the cache was written. Files of the extracted cache
+            that were not checked since IMAGEWRITER_CACHE_SCRUB_INTERVAL are hashed by the write again */
+         CacheSidecar sidecar;
+         if (fromExtractedCache && !fromRamStage
+                 && QDateTime::currentMSecsSinceEpoch() - _extractedCache.lastValidated(_expectedHash) >= IMAGEWRITER_CACHE_SCRUB_INTERVAL)
+             _unvalidatedEntry = _expectedHash;
+         else if (sidecar.load(cacheFile) && sidecar.extractHash == _expectedHash)
+             _thread->setVerifiedInput(sidecar);
+     }
+     /* The extracted image is at hand to compare the device with. Once the write found it to
+        match the hash (or its sidecar vouches for it), that is as good as comparing hashes */
+     QString verifySource;
+     if (fromExtractedCache && !_multipleFilesInZip)
+         verifySource = cacheFile;
+     else if (_src.isLocalFile() && localFormat == ImageProbe::FormatRaw)
+         verifySource = _src.toLocalFile();
+     _thread->setVerifySource(verifySource);
      _thread->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
-     _thread->setImageCustomization(_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat, _dst.toLatin1());
- 
-     if (!_expectedHash.isEmpty() && _cachedFileHash != _expectedHash && _cachingEnabled)
+     _setTargetCustomization(_thread, _dst, 1);
+     DownloadExtractThread *extractThread = qobject_cast<DownloadExtractThread *>(_thread);
+     if (extractThread)
      {
-         if (!_cachedFileHash.isEmpty())
-         {
-             if (_settings.isWritable() && QFile::remove(_cacheFileName))
-             {
-                 _settings.remove("caching/lastDownloadSHA256");
-                 _settings.sync();
-                 _cachedFileHash.clear();
-             }
-             else
-             {
-                 qDebug() << "Error removing old cache file. Disabling caching";
-                 _cachingEnabled = false;
-             }
-         }
- 
-         if (_cachingEnabled)
-         {
-             QStorageInfo si(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
-             qint64 avail = si.bytesAvailable();
-             qDebug() << "Available disk space for caching:" << avail/1024/1024/1024 << "GB";
+         extractThread->setWriteQueueDepth(_writeQueueDepth);
+         extractThread->setWriteBlockSize(_writeBlockSize);
+     }
+     bool fanout = !_extraDsts.isEmpty() && _dst != "uniflash" && !_multipleFilesInZip;
+     MemoryBudget budget = MemoryBudget::defaults();
+     if (_memoryLimit)
+     {
+         budget = MemoryBudget::fromLimit(_memoryLimit, fanout ? dstCount() : 1);
+         qDebug() << "Memory limit of the write pipeline:" << budget.limit / 1024 / 1024 << "MB";
+         _thread->setMemoryBudget(budget);
+     }
  
-             if (avail-_downloadLen < IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING)
-             {
-                 qDebug() << "Low disk space. Not caching files to disk.";
-             }
-             else
-             {
-                 _thread->setCacheFile(_cacheFileName, _downloadLen);
-                 connect(_thread, SIGNAL(cacheFileUpdated(QByteArray)), SLOT(onCacheFileUpdated(QByteArray)));
-             }
-         }
+     if (fanout)
+     {
+         /* Extract once, and let every device write, verify and customize on its own */
+         _startFanoutTargets(budget, true, verifySource);
      }
  
+     if (!fromCache && !followed)
+         _setupCaching();
+     /* Not worth it for images that are not compressed to begin with */
+     if (!fromExtractedCache && compressed && !followed)
+         _setupExtractedCaching();
+ 
      if (_multipleFilesInZip)
      {
          static_cast<DownloadExtractThread *>(_thread)->enableMultipleFileExtraction();
+         static_cast<DownloadExtractThread *>(_thread)->setUserspaceExtraction(_userspaceExtraction);
          DriveFormatThread *dft = new DriveFormatThread(_dst.toLatin1(), this);
          connect(dft, SIGNAL(success()), _thread, SLOT(start()));
          connect(dft, SIGNAL(error(QString)), SLOT(onError(QString)));
@@ -473,65 +881,619 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
      startProgressPolling();
  }
  
+/* Check the selected drives hold the selected image, without writing them */
+void ImageWriter::startVerify()
+{
+    if (!readyToWrite() || _dst == "uniflash" || _dst == "dfu")
+        return;
+
+    _targetErrors.clear();
+    VerifyOnlyThread *thread = new VerifyOnlyThread(_dst.toLatin1(), this);
+    for (const QString &device : std::as_const(_extraDsts))
+        thread->addDevice(device.toLatin1());
+
+    /* Extracted copy or download in the cache, if it is not a local file */
+    QString imageFile;
+    if (_src.isLocalFile())
+        imageFile = _src.toLocalFile();
+    else if (_ramStageBudget && !_expectedHash.isEmpty() && _ramStage.contains(_expectedHash))
+        imageFile = _ramStage.fileName(_expectedHash);
+    else if (_extractedCaching && !_expectedHash.isEmpty() && _extractedCache.contains(_expectedHash))
+        imageFile = _extractedCache.fileName(_expectedHash);
+    else if (isCached(_src, _expectedHash))
+        imageFile = _customCacheFile ? _cacheFileName : _downloadCache.fileName(_expectedHash);
+    if (!imageFile.isEmpty())
+        thread->setImageFile(imageFile);
+    thread->setExpectedHash(_expectedHash);
+    thread->setImageSize(_extrLen);
+    thread->setDirectIOEnabled(_directIO);
+    thread->setIoUringEnabled(_ioUring);
+    thread->setChunkedVerifyAlgorithm(_chunkAlgorithm);
+
+    _thread = thread;
+    connect(_thread, SIGNAL(success()), SLOT(onSuccess()));
+    connect(_thread, SIGNAL(error(QString)), SLOT(onError(QString)));
+    connect(_thread, SIGNAL(preparationStatusUpdate(QString)), SLOT(onPreparationStatusUpdate(QString)));
+    _thread->start();
+
+    startProgressPolling();
+}
+
+/* Copy the source drive to the selected drives, with every drive written and verified on its own */
+void ImageWriter::startClone(const QString &sourceDevice, quint64 sourceSize)
+{
+    if (_dst.isEmpty() || _dst == "uniflash" || _dst == "dfu")
+        return;
+    if (sourceDevice == _dst || _extraDsts.contains(sourceDevice))
+    {
+        emit error(tr("Cannot clone a storage device onto itself."));
+        return;
+    }
+    if (_devLen && sourceSize > _devLen)
+    {
+        emit error(tr("Storage capacity is not large enough.<br>Needs to be at least %1 GB.").arg(QString::number(sourceSize/1000000000.0, 'f', 1)));
+        return;
+    }
+
+    qDeleteAll(_fanoutTargets);
+    _fanoutTargets.clear();
+    _targetErrors.clear();
+    /* Progress is reported against the size of the source */
+    _extrLen = sourceSize;
+
+    DeviceCloneThread *thread = new DeviceCloneThread(sourceDevice.toLatin1(), this);
+    thread->setImageSize(sourceSize);
+    _thread = thread;
+    connect(_thread, SIGNAL(success()), SLOT(onSuccess()));
+    connect(_thread, SIGNAL(error(QString)), SLOT(onError(QString)));
+    connect(_thread, SIGNAL(finalizing()), SLOT(onFinalizing()));
+    connect(_thread, SIGNAL(preparationStatusUpdate(QString)), SLOT(onPreparationStatusUpdate(QString)));
+    _thread->setVerifyEnabled(_verifyEnabled);
+    MemoryBudget budget = _memoryLimit ? MemoryBudget::fromLimit(_memoryLimit, dstCount()) : MemoryBudget::defaults();
+    _thread->setMemoryBudget(budget);
+    _startFanoutTargets(budget, false);
+    _thread->start();
+
+    startProgressPolling();
+}
+
+/* A FanoutTargetThread for every selected drive, fed by _thread. Without fromImage
+   (cloning a drive) there is no expected hash, bmap or customization */
+void ImageWriter::_startFanoutTargets(const MemoryBudget &budget, bool fromImage, const QString &verifySource)
+{
+    QStringList devices = QStringList(_dst) + _extraDsts;
+    for (int i = 0; i < devices.size(); i++)
+    {
+        const QString &device = devices[i];
+        FanoutTargetThread *target = new FanoutTargetThread(device.toLatin1(), fromImage ? _expectedHash : QByteArray(), this);
+        connect(target, SIGNAL(error(QString)), SLOT(onTargetError(QString)));
+        connect(target, &DownloadThread::updateNumProgress, this, &ImageWriter::targetProgress);
+        target->setVerifyEnabled(_verifyEnabled);
+        target->setDirectIOEnabled(_directIO);
+        target->setIoUringEnabled(_ioUring);
+        target->setSparseWriteEnabled(_sparseWrite);
+        target->setDeltaWriteEnabled(_deltaWrite);
+        target->setResumeEnabled(_resume);
+        target->setCapacityProbeEnabled(_capacityProbe);
+        target->setOverlappedVerifyEnabled(_overlappedVerify);
+        target->setChunkedVerifyEnabled(_chunkedVerify);
+        target->setChunkedVerifyAlgorithm(_chunkAlgorithm);
+        target->setQueueTuning(_queueTuning, _writeBlockSize, _directIO ? _writeQueueDepth : 0);
+        target->setInStreamCustomizationEnabled(_inStreamCustomization);
+        target->setExpandRootPartitionEnabled(_expandRoot);
+        target->setMemoryBudget(budget);
+        target->setVerifySource(verifySource);
+        if (fromImage && !_bmapUrl.isEmpty())
+            target->setBmapUrl(_bmapUrl.toEncoded());
+        target->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
+        /* A device with customization of its own has the boot partition built in memory as it is written,
+           while the blocks around it are still shared. Not patched after writing, which takes a pass per device */
+        if (fromImage && _setTargetCustomization(target, device, i+1))
+            target->setInStreamCustomizationEnabled(true);
+        _thread->addFanoutTarget(target);
+        _fanoutTargets.append(target);
+        target->start();
+    }
+}
+
  void ImageWriter::onCacheFileUpdated(QByteArray sha256)
  {
-     if (!_customCacheFile)
-     {
-         _settings.setValue("caching/lastDownloadSHA256", sha256);
-         _settings.sync();
-     }
-     _cachedFileHash = sha256;
+     if (_customCacheFile)
+         _cachedFileHash = sha256;
+     else
+         _downloadCache.add(sha256);
      qDebug() << "Done writing cache file";
  }
  
- /* Cancel write */
- void ImageWriter::cancelWrite()
+ /* Let the thread write the download to the cache, if enabled and there is room */
+ void ImageWriter::_setupCaching()
  {
-     if (_thread)
+     if (_expectedHash.isEmpty() || !_cachingEnabled)
+         return;
+ 
+     QString cacheFile;
+     quint64 prefetched = 0;
+     std::shared_ptr<DownloadCoordinator::Transfer> transfer;
+ 
+     if (_customCacheFile)
      {
-         connect(_thread, SIGNAL(finished()), SLOT(onCancelled()));
-         _thread->cancelDownload();
-     }
+         if (!_cachedFileHash.isEmpty())
+         {
+             if (QFile::remove(_cacheFileName))
+             {
+                 CacheSidecar::remove(_cacheFileName);
+                 _cachedFileHash.clear();
+             }
+             else
+             {
+                 qDebug() << "Error removing old cache file. Disabling caching";
+                 _cachingEnabled = false;
+                 return;
+             }
+         }
  
-     if (!_thread || !_thread->isRunning())
+         QStorageInfo si(QFileInfo(_cacheFileName).absolutePath());
+         qint64 avail = si.bytesAvailable();
+         qDebug() << "Available disk space for caching:" << avail/1024/1024/1024 << "GB";
+ 
+         if (avail-_downloadLen < IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING)
+         {
+             qDebug() << "Low disk space. Not caching files to disk.";
+             return;
+         }
+         cacheFile = _cacheFileName;
+     }
+     else
      {
-         emit cancelled();
+         if (!_downloadCache.reserve(_downloadLen))
+         {
+             qDebug() << "Low disk space or image larger than cache budget. Not caching files to disk.";
+             return;
+         }
+         /* Other jobs of this process writing the image follow this download */
+         transfer = DownloadCoordinator::begin(_expectedHash, _downloadCache.fileName(_expectedHash));
+         if (!transfer)
+         {
+             qDebug() << "Image is being downloaded into the cache by another job. Not caching files to disk.";
+             return;
+         }
+         cacheFile = _downloadCache.fileName(_expectedHash);
+         prefetched = _prefetchedBytes.take(_expectedHash);
      }
+ 
+     _thread->setCacheFile(cacheFile, _downloadLen, prefetched);
+     if (transfer)
+         _thread->setCacheTransfer(transfer);
+     connect(_thread, SIGNAL(cacheFileUpdated(QByteArray)), SLOT(onCacheFileUpdated(QByteArray)));
  }
  
- void ImageWriter::onCancelled()
+ void ImageWriter::onExtractedCacheFileUpdated(QByteArray sha256)
  {
-     sender()->deleteLater();
-     if (sender() == _thread)
+     if (_stagingInRam)
      {
-         _thread = nullptr;
+         _stagingInRam = false;
+         _ramStage.add(sha256);
+         qDebug() << "Done staging extracted image in memory";
+         _copyRamStageToExtractedCache(sha256);
+         return;
      }
-     emit cancelled();
- }
- 
- /* Return true if url is in our local disk cache */
- bool ImageWriter::isCached(const QUrl &, const QByteArray &sha256)
- {
-     return !sha256.isEmpty() && _cachedFileHash == sha256;
+
+     _extractedCache.add(sha256);
+     if (_pendingChunkIndex.imageHash == sha256)
+     {
+         _pendingChunkIndex.save(_extractedCache.fileName(sha256));
+         _pendingChunkIndex = ChunkIndex();
+     }
+     qDebug() << "Done writing extracted image cache file";
  }
- 
- /* Utility function to return filename part from URL */
- QString ImageWriter::fileNameFromUrl(const QUrl &url)
+
+ /* Copy of an image staged in memory on disk, so it outlives a reboot and eviction from the RAM stage */
+ void ImageWriter::_copyRamStageToExtractedCache(const QByteArray &sha256)
  {
-     //return QFileInfo(url.toLocalFile()).fileName();
-     return url.fileName();
+     if (!_extractedCaching || _extractedCache.contains(sha256))
+         return;
+     QString src = _ramStage.fileName(sha256), dst = _extractedCache.fileName(sha256);
+     if (!_extractedCache.reserve(QFileInfo(src).size()))
+     {
+         qDebug() << "Low disk space or image larger than cache budget. Not copying staged image to disk.";
+         return;
+     }
+
+     /* Zero blocks are skipped, so holes stay holes */
+     auto copy = [src, dst]() -> bool {
+         QFile in(src), out(dst);
+         if (!in.open(QIODevice::ReadOnly) || !out.open(QIODevice::WriteOnly) || !out.resize(in.size()))
+             return false;
+
+         QByteArray buf(IMAGEWRITER_CACHE_WRITER_BUFFER, Qt::Uninitialized);
+         static const QByteArray zeroes(IMAGEWRITER_CACHE_WRITER_BUFFER, 0);
+         qint64 n;
+         while ((n = in.read(buf.data(), buf.size())) > 0)
+         {
+             bool zero = n == buf.size() && buf == zeroes;
+             if (zero ? !out.seek(out.pos()+n) : out.write(buf.constData(), n) != n)
+                 return false;
+         }
+         out.close();
+
+         CacheSidecar sidecar;
+         return n == 0 && (!sidecar.load(src) || sidecar.save(dst));
+     };
+
+     QFutureWatcher<bool> *watcher = new QFutureWatcher<bool>(this);
+     connect(watcher, &QFutureWatcher<bool>::finished, this, [this, watcher, sha256]() {
+         onRamStageCopied(sha256, watcher->result());
+         watcher->deleteLater();
+     });
+     watcher->setFuture(QtConcurrent::run(copy));
  }
- 
- QString ImageWriter::srcFileName()
+
+ void ImageWriter::onRamStageCopied(QByteArray sha256, bool ok)
  {
-     return _src.isEmpty() ? "" : _src.fileName();
+     if (ok)
+     {
+         _extractedCache.add(sha256);
+         qDebug() << "Copied staged image to extracted image cache";
+     }
+     else
+     {
+         qDebug() << "Error copying staged image to extracted image cache";
+         QFile::remove(_extractedCache.fileName(sha256));
+         CacheSidecar::remove(_extractedCache.fileName(sha256));
+     }
  }
- 
- /* Function to return OS list URL */
- QUrl ImageWriter::constantOsListUrl() const
+
+ /* Check the extracted images that were not checked for IMAGEWRITER_CACHE_SCRUB_INTERVAL, while nothing else uses the disk */
+ void ImageWriter::_startCacheScrub()
  {
-     return _repo;
- }
+     if (!_extractedCaching || _cacheScrubber.isRunning())
+         return;
+     if ((_thread && _thread->isRunning()) || _deltaThread || _prefetchThread || _writeAfterPrefetch)
+     {
+         _scrubTimer.start();
+         return;
+     }
+
+     QList<CacheScrubber::Entry> entries;
+     const qint64 now = QDateTime::currentMSecsSinceEpoch();
+     const QList<QByteArray> hashes = _extractedCache.entries();
+     for (const QByteArray &sha256 : hashes)
+     {
+         if (now - _extractedCache.lastValidated(sha256) >= IMAGEWRITER_CACHE_SCRUB_INTERVAL)
+             entries.append({sha256, _extractedCache.fileName(sha256)});
+     }
+     if (entries.isEmpty())
+         return;
+
+     qDebug() << "Scrubbing" << entries.size() << "extracted images in the cache";
+     _cacheScrubber.setEntries(entries);
+     _cacheScrubber.start(QThread::LowestPriority);
+ }
+
+ /* Give downloads that decode on a single core a format that decodes on all of them, while nothing else runs */
+ void ImageWriter::_startCacheTranscode()
+ {
+     if (!_transcodeCache || _cacheTranscoder.isRunning())
+         return;
+     if ((_thread && _thread->isRunning()) || _deltaThread || _prefetchThread || _writeAfterPrefetch)
+     {
+         _scrubTimer.start();
+         return;
+     }
+
+     QList<CacheTranscoder::Entry> entries;
+     const QList<QByteArray> hashes = _downloadCache.entries();
+     for (const QByteArray &sha256 : hashes)
+     {
+         QString file = _downloadCache.fileName(sha256);
+         if (!DownloadCoordinator::find(sha256) && CacheTranscoder::isCandidate(file))
+             entries.append({sha256, file});
+     }
+     if (entries.isEmpty())
+         return;
+
+     qDebug() << "Transcoding" << entries.size() << "cached downloads to zstd";
+     _cacheTranscoder.setEntries(entries);
+     _cacheTranscoder.start(QThread::LowestPriority);
+ }
+
+ void ImageWriter::onCacheEntryTranscoded(QByteArray sha256, QString fileName)
+ {
+     /* Finished just before a write started, which may be reading the entry. Done again when idle */
+     bool busy = (_thread && _thread->isRunning()) || _prefetchThread || DownloadCoordinator::find(sha256);
+     if (busy || !_downloadCache.contains(sha256) || !_downloadCache.replace(fileName, sha256))
+     {
+         QFile::remove(fileName);
+         CacheSidecar::remove(fileName);
+         return;
+     }
+
+     qDebug() << "Cache entry" << sha256 << "is seekable zstd now";
+ }
+
+ void ImageWriter::onCacheEntryValidated(QByteArray sha256)
+ {
+     _extractedCache.setValidated(sha256);
+ }
+
+ void ImageWriter::onCacheEntryCorrupt(QByteArray sha256)
+ {
+     /* Reported just before a write cancelled the scrubber. That write hashes it, unless it was validated */
+     if (_thread && _thread->isRunning() && sha256 == _expectedHash)
+         return;
+
+     qDebug() << "Evicting corrupt cache entry" << sha256;
+     _extractedCache.remove(sha256);
+ }
+ 
+ /* Let the thread keep a decompressed copy of the image as well, if enabled and there is room.
+    In memory if the image fits the RAM staging budget, on disk otherwise */
+ void ImageWriter::_setupExtractedCaching()
+ {
+     _stagingInRam = false;
+     if (_expectedHash.isEmpty() || _multipleFilesInZip || !_extrLen)
+         return;
+
+     if (_ramStageBudget && _ramStage.reserve(_extrLen))
+     {
+         qDebug() << "Staging extracted image in memory";
+         _stagingInRam = true;
+         _thread->setExtractedCacheFile(_ramStage.fileName(_expectedHash));
+         connect(_thread, SIGNAL(extractedCacheFileUpdated(QByteArray)), SLOT(onExtractedCacheFileUpdated(QByteArray)));
+         return;
+     }
+     if (!_extractedCaching)
+         return;
+ 
+     /* Reserves the full image size, even though holes take no space */
+     if (!_extractedCache.reserve(_extrLen))
+     {
+         qDebug() << "Low disk space or image larger than cache budget. Not caching extracted image.";
+         return;
+     }
+ 
+     _thread->setExtractedCacheFile(_extractedCache.fileName(_expectedHash));
+     connect(_thread, SIGNAL(extractedCacheFileUpdated(QByteArray)), SLOT(onExtractedCacheFileUpdated(QByteArray)));
+ }
+ 
+ /* Build the extracted image from chunks of other cached versions and the chunk pack, if there is enough to gain.
+    Returns false if the image is to be downloaded as usual */
+ bool ImageWriter::_startDeltaDownload()
+ {
+     if (_chunkIndexUrl.isEmpty() || !_extractedCaching || _multipleFilesInZip || _expectedHash.isEmpty() || _src.isLocalFile() || !_extrLen)
+         return false;
+
+     /* Only entries that came with an index can contribute chunks. Without any, the index
+        is still fetched, to be kept with the image for the next version */
+     QStringList sources;
+     const QList<QByteArray> entries = _extractedCache.entries();
+     for (const QByteArray &entry : entries)
+     {
+         QString file = _extractedCache.fileName(entry);
+         if (entry != _expectedHash && QFile::exists(ChunkIndex::fileName(file)))
+             sources.append(file);
+     }
+
+     if (!_extractedCache.reserve(_extrLen))
+     {
+         qDebug() << "Low disk space or image larger than cache budget. Not assembling image from chunks.";
+         return false;
+     }
+     /* Eviction may have removed some */
+     sources.removeIf([](const QString &file) { return !QFile::exists(file); });
+
+     qDebug() << "Assembling image from chunks of" << sources.size() << "cached images";
+     _deltaThread = new DeltaDownloadThread(_chunkIndexUrl.toEncoded(), _extractedCache.fileName(_expectedHash), _expectedHash, sources, this);
+     _deltaThread->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
+     connect(_deltaThread, SIGNAL(success()), SLOT(onDeltaDownloadSuccess()));
+     connect(_deltaThread, SIGNAL(failed(QString)), SLOT(onDeltaDownloadFailed(QString)));
+     connect(_deltaThread, SIGNAL(preparationStatusUpdate(QString)), SLOT(onPreparationStatusUpdate(QString)));
+     _deltaThread->start();
+
+     return true;
+ }
+
+ void ImageWriter::onDeltaDownloadSuccess()
+ {
+     /* Cancelling is handled by onCancelled() */
+     if (_deltaThread->isCancelled())
+         return;
+
+     _deltaThread->deleteLater();
+     _deltaThread = nullptr;
+     _extractedCache.add(_expectedHash);
+
+     _deltaAttempted = true;
+     startWrite();
+     _deltaAttempted = false;
+ }
+
+ void ImageWriter::onDeltaDownloadFailed(QString msg)
+ {
+     /* Cancelling is handled by onCancelled() */
+     if (_deltaThread->isCancelled())
+         return;
+
+     qDebug() << "Not assembling image from chunks:" << msg << "Downloading it in full.";
+     _pendingChunkIndex = _deltaThread->index();
+     _deltaThread->deleteLater();
+     _deltaThread = nullptr;
+
+     _deltaAttempted = true;
+     startWrite();
+     _deltaAttempted = false;
+ }
+
+ /* Download the selected image into the cache while the storage device and options are chosen */
+ void ImageWriter::_startPrefetch()
+ {
+     if (!_prefetch || !_cachingEnabled || _customCacheFile || _expectedHash.isEmpty()
+             || !(_src.scheme() == "http" || _src.scheme() == "https")
+             || (_thread && _thread->isRunning()) || _deltaThread || _writeAfterPrefetch)
+         return;
+     /* Assembled from chunks of other images instead */
+     if (!_chunkIndexUrl.isEmpty() && _extractedCaching)
+         return;
+     if (_downloadCache.contains(_expectedHash) || (_extractedCaching && _extractedCache.contains(_expectedHash))
+             || (_ramStageBudget && _ramStage.contains(_expectedHash)) || DownloadCoordinator::find(_expectedHash))
+         return;
+     if (_prefetchThread)
+     {
+         /* Previous image is still being stopped */
+         if (_prefetchHash != _expectedHash)
+             _prefetchTimer.start();
+         return;
+     }
+
+     if (!_downloadCache.reserve(_downloadLen))
+     {
+         qDebug() << "Low disk space or image larger than cache budget. Not prefetching.";
+         return;
+     }
+
+     qDebug() << "Prefetching" << _src << "into the download cache";
+     _startPrefetchThread(_src, _expectedHash, _downloadLen);
+ }
+
+ void ImageWriter::_startPrefetchThread(const QUrl &url, const QByteArray &sha256, quint64 downloadLen)
+ {
+     _prefetchHash = sha256;
+     _prefetchThread = new PrefetchThread(url.toString(url.FullyEncoded).toLatin1(), sha256, this);
+     _prefetchThread->setCacheFile(_downloadCache.fileName(sha256), downloadLen, _prefetchedBytes.take(sha256));
+     if (auto transfer = DownloadCoordinator::begin(sha256, _downloadCache.fileName(sha256)))
+         _prefetchThread->setCacheTransfer(transfer);
+     _prefetchThread->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
+     _prefetchThread->setDownloadSegments(_downloadSegments);
+     _prefetchThread->setPeerCacheEnabled(_peerCache);
+     _prefetchThread->setMultiSourceEnabled(_multiSource);
+     /* The mirrors are those of the selected image */
+     if (!_precaching && (!_mirrors.isEmpty() || !_metalinkUrl.isEmpty()))
+         _prefetchThread->setMirrors(_encodedMirrors(), _metalinkUrl.toEncoded());
+     connect(_prefetchThread, &DownloadThread::error, this, [](QString msg) {
+         qDebug() << "Prefetch stopped:" << msg;
+     });
+     connect(_prefetchThread, &DownloadThread::success, this, [this]() {
+         _precacheComplete = true;
+     });
+     connect(_prefetchThread, SIGNAL(finished()), SLOT(onPrefetchFinished()));
+     _precacheComplete = false;
+     _prefetchThread->start(QThread::LowPriority);
+ }
+
+ void ImageWriter::onPrefetchFinished()
+ {
+     quint64 bytes = _prefetchThread->prefetchedBytes();
+     if (bytes)
+         _prefetchedBytes.insert(_prefetchHash, bytes);
+     _prefetchThread->deleteLater();
+     _prefetchThread = nullptr;
+
+     if (_precaching)
+     {
+         _precaching = false;
+         emit precacheFinished(_prefetchHash, bytes, _precacheComplete);
+     }
+
+     if (_writeAfterPrefetch)
+     {
+         _writeAfterPrefetch = false;
+         startWrite();
+     }
+ }
+
+ QList<QByteArray> ImageWriter::_encodedMirrors() const
+ {
+     QList<QByteArray> mirrors;
+     for (const QString &mirror : std::as_const(_mirrors))
+         mirrors.append(QUrl(mirror).toEncoded());
+
+     return mirrors;
+ }
+
+ /* Cancel write */
+ void ImageWriter::cancelWrite()
+ {
+     if (_umsTimer.isActive())
+     {
+         /* The boards are booted, but were not written yet */
+         _umsTimer.stop();
+         disconnect(&_drivelist, &QAbstractItemModel::rowsInserted, this, &ImageWriter::onUmsDrivesChanged);
+         emit cancelled();
+         return;
+     }
+
+     if (_writeAfterPrefetch)
+     {
+         /* Writing had not started yet */
+         _writeAfterPrefetch = false;
+         emit cancelled();
+         return;
+     }
+
+     if (_deltaThread)
+     {
+         connect(_deltaThread, SIGNAL(finished()), SLOT(onCancelled()));
+         _deltaThread->cancel();
+         if (!_deltaThread->isRunning())
+             emit cancelled();
+         return;
+     }
+
+     if (_thread)
+     {
+         connect(_thread, SIGNAL(finished()), SLOT(onCancelled()));
+         _thread->cancelDownload();
+     }
+ 
+     if (!_thread || !_thread->isRunning())
+     {
+         emit cancelled();
+     }
+ }
+ 
+ void ImageWriter::onCancelled()
+ {
+     _scrubTimer.start();
+     sender()->deleteLater();
+     if (sender() == _thread)
+     {
+         _thread = nullptr;
+     }
+     else if (sender() == _deltaThread)
+     {
+         _deltaThread = nullptr;
+     }
+     emit cancelled();
+ }
+ 
+ /* Return true if url is in our local disk cache */
+ bool ImageWriter::isCached(const QUrl &, const QByteArray &sha256)
+ {
+     if (sha256.isEmpty())
+         return false;
+     if (_customCacheFile)
+         return _cachedFileHash == sha256;
+ 
+     return _downloadCache.contains(sha256);
+ }
+ 
+ /* Utility function to return filename part from URL */
+ QString ImageWriter::fileNameFromUrl(const QUrl &url)
+ {
+     //return QFileInfo(url.toLocalFile()).fileName();
+     return url.fileName();
+ }
+ 
+ QString ImageWriter::srcFileName()
+ {
+     return _src.isEmpty() ? "" : _src.fileName();
+ }
+ 
+ /* Function to return OS list URL */
+ QUrl ImageWriter::constantOsListUrl() const
+ {
+     return _repo;
+ }
  
  /* Function to return version */
  QString ImageWriter::constantVersion() const
@@ -551,7 +1513,7 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
  }
  
  namespace {
-     QJsonArray findAndInsertJsonResult(QJsonArray parent_list, QJsonArray incomingBody, QUrl referenceUrl, uint8_t count = 0) {
+     QJsonArray resolveSubLists(const QJsonArray &parent_list, const QHash<QString, QJsonArray> &subLists, uint8_t count = 0) {
          if (count > MAX_SUBITEMS_DEPTH) {
              qDebug() << "Aborting insertion of subitems, exceeded maximum configured limit of " << MAX_SUBITEMS_DEPTH << " levels.";
              return {};
@@ -564,10 +1526,11 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
  
              if (ositemObject.contains("subitems")) {
                  // Recurse!
-                 ositemObject["subitems"] = findAndInsertJsonResult(ositemObject["subitems"].toArray(), incomingBody, referenceUrl, count++);
+                 ositemObject["subitems"] = resolveSubLists(ositemObject["subitems"].toArray(), subLists, count + 1);
              } else if (ositemObject.contains("subitems_url")) {
-                 if ( !ositemObject["subitems_url"].toString().compare(referenceUrl.toString())) {
-                     ositemObject.insert("subitems", incomingBody);
+                 auto subList = subLists.constFind(ositemObject["subitems_url"].toString());
+                 if (subList != subLists.constEnd()) {
+                     ositemObject.insert("subitems", resolveSubLists(*subList, subLists, count + 1));
                      ositemObject.remove("subitems_url");
                  }
              }
@@ -578,7 +1541,8 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
          return returnArray;
      }
  
-     void findAndQueueUnresolvedSubitemsJson(QJsonArray incoming, QNetworkAccessManager &manager, uint8_t count = 0) {
+     // Sublists of the categories in a list itself, not of the categories in those
+     void findUnresolvedSubitemsUrls(const QJsonArray &incoming, QStringList &urls, uint8_t count = 0) {
          if (count > MAX_SUBITEMS_DEPTH) {
              qDebug() << "Aborting fetch of subitems JSON, exceeded maximum configured limit of " << MAX_SUBITEMS_DEPTH << " levels.";
              return;
@@ -587,23 +1551,212 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
          for (auto entry : incoming) {
              auto entryObject = entry.toObject();
              if (entryObject.contains("subitems")) {
-                 // No need to handle a return - this isn't processing a list, it's searching and queuing downloads.
-                 findAndQueueUnresolvedSubitemsJson(entryObject["subitems"].toArray(), manager, count++);
+                 findUnresolvedSubitemsUrls(entryObject["subitems"].toArray(), urls, count + 1);
              } else if (entryObject.contains("subitems_url")) {
-                 auto url = entryObject["subitems_url"].toString();
-                 auto request = QNetworkRequest(url);
-                 request.setAttribute(QNetworkRequest::RedirectPolicyAttribute,
-                         QNetworkRequest::NoLessSafeRedirectPolicy);
-                 manager.get(request);
+                 urls.append(entryObject["subitems_url"].toString());
              }
          }
      }
+ 
+     QJsonArray filterOsListWithHWTags(const QJsonArray &incoming_os_list, const QSet<QString> &hw_filter, const bool inclusive, uint8_t count = 0) {
+         if (count > MAX_SUBITEMS_DEPTH) {
+             qDebug() << "Aborting insertion of subitems, exceeded maximum configured limit of " << MAX_SUBITEMS_DEPTH << " levels.";
+             return {};
+         }
+ 
+         QJsonArray returnArray = {};
+ 
+         for (auto ositem : incoming_os_list) {
+             auto ositemObject = ositem.toObject();
+ 
+             if (ositemObject.contains("subitems")) {
+                 // Recurse!
+                 ositemObject["subitems"] = filterOsListWithHWTags(ositemObject["subitems"].toArray(), hw_filter, inclusive, count + 1);
+                 if (ositemObject["subitems"].toArray().count() > 0) {
+                     returnArray += ositemObject;
+                 }
+             } else if (ositemObject.contains("subitems_url")) {
+                 // Not fetched yet, so there is no telling whether anything in it matches
+                 returnArray.append(ositem);
+             } else {
+                 // Filter this one!
+                 if (ositemObject.contains("devices")) {
+                     auto keep = false;
+                     auto ositem_devices = ositemObject["devices"].toArray();
+ 
+                     for (auto compat_device : ositem_devices) {
+                         if (hw_filter.contains(compat_device.toString())) {
+                             keep = true;
+                             break;
+                         }
+                     }
+ 
+                     if (keep) {
+                         returnArray.append(ositem);
+                     }
+                 } else {
+                     // No devices tags, so work out if we're exclusive or inclusive filtering!
+                     if (inclusive) {
+                         returnArray.append(ositem);
+                     }
+                 }
+             }
+         }
+ 
+         return returnArray;
+     }
  } // namespace anonymous
  
+ QJsonArray ImageWriter::_resolvedOsList(const QJsonArray &list) const
+ {
+     if (_osSubLists.isEmpty())
+         return list;
+ 
+     return resolveSubLists(list, _osSubLists);
+ }
+ 
+ void ImageWriter::_requestOSSubList(const QString &url)
+ {
+     if (_osSubListsRequested.contains(url))
+         return;
+ 
+     _osSubListsRequested.insert(url);
+     auto request = QNetworkRequest(url);
+     request.setAttribute(QNetworkRequest::RedirectPolicyAttribute,
+             QNetworkRequest::NoLessSafeRedirectPolicy);
+     _setRevalidationHeaders(request, url);
+     // The requests all go out at once, QNetworkAccessManager runs up to six per host in parallel
+     _networkAccessManager()->get(request);
+ }
+
+ QNetworkAccessManager *ImageWriter::_networkAccessManager()
+ {
+     if (!_networkManager)
+     {
+         // Centralised network manager, for fetching OS lists
+         _networkManager = new QNetworkAccessManager(this);
+         connect(_networkManager, SIGNAL(finished(QNetworkReply *)), this, SLOT(handleNetworkRequestFinished(QNetworkReply *)));
+     }
+
+     return _networkManager;
+ }
+ 
+ void ImageWriter::_setRevalidationHeaders(QNetworkRequest &request, const QString &url)
+ {
+     // Only lists that are there from the snapshot can be answered with 304
+     if (url == constantOsListUrl().toString() ? _completeOsList.isEmpty() : !_osSubLists.contains(url))
+         return;
+ 
+     auto validators = _osListValidators.constFind(url);
+     if (validators == _osListValidators.constEnd())
+         return;
+ 
+     if (!validators->etag.isEmpty())
+         request.setRawHeader("If-None-Match", validators->etag);
+     if (!validators->lastModified.isEmpty())
+         request.setRawHeader("If-Modified-Since", validators->lastModified);
+ }
+ 
+ QString ImageWriter::_osListSnapshotFileName() const
+ {
+     return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"oslist.cbor";
+ }
+ 
+ /*
+  * The snapshot holds the lists as fetched, each with its validators:
+  * { "url": OS list URL, "lists": { URL: { "list", "etag", "lastModified" } } }
+  * The filtered views are built from it like from fetched lists
+  */
+ void ImageWriter::loadOSListSnapshot()
+ {
+     QFile f(_osListSnapshotFileName());
+     if (!f.open(QIODevice::ReadOnly))
+         return;
+ 
+     QElapsedTimer t;
+     t.start();
+     QCborMap snapshot = QCborValue::fromCbor(f.readAll()).toMap();
+     QString url = constantOsListUrl().toString();
+ 
+     // A list of another repository is no use
+     if (snapshot.value("url").toString() != url)
+         return;
+ 
+     QCborMap lists = snapshot.value("lists").toMap();
+     for (auto it = lists.constBegin(); it != lists.constEnd(); ++it)
+     {
+         QString listUrl = it.key().toString();
+         QCborMap entry = it.value().toMap();
+ 
+         if (listUrl == url)
+             _completeOsList = QJsonDocument(entry.value("list").toMap().toJsonObject());
+         else
+             _osSubLists.insert(listUrl, entry.value("list").toArray().toJsonArray());
+         _osListValidators.insert(listUrl, {entry.value("etag").toByteArray(), entry.value("lastModified").toByteArray()});
+     }
+ 
+     if (_completeOsList.isEmpty())
+     {
+         _osSubLists.clear();
+         _osListValidators.clear();
+         return;
+     }
+ 
+     qDebug() << "Loaded OS list snapshot with" << _osSubLists.count() << "sublists in" << t.elapsed() << "ms";
+ }
+ 
+ void ImageWriter::_saveOSListSnapshot()
+ {
+     if (_completeOsList.isEmpty())
+         return;
+ 
+     QString url = constantOsListUrl().toString();
+     auto listEntry = [this](const QCborValue &list, const QString &listUrl) {
+         auto validators = _osListValidators.value(listUrl);
+         QCborMap entry;
+         entry.insert(QStringLiteral("list"), list);
+         entry.insert(QStringLiteral("etag"), validators.etag);
+         entry.insert(QStringLiteral("lastModified"), validators.lastModified);
+         return entry;
+     };
+ 
+     // Only the sublists the current list still refers to
+     QCborMap lists;
+     lists.insert(url, listEntry(QCborValue::fromJsonValue(_completeOsList.object()), url));
+ 
+     QStringList urls;
+     findUnresolvedSubitemsUrls(_completeOsList["os_list"].toArray(), urls);
+     for (int i = 0; i < urls.count(); i++)
+     {
+         auto subList = _osSubLists.constFind(urls[i]);
+         if (subList == _osSubLists.constEnd() || lists.contains(urls[i]))
+             continue;
+ 
+         lists.insert(urls[i], listEntry(QCborValue::fromJsonValue(*subList), urls[i]));
+         findUnresolvedSubitemsUrls(*subList, urls);
+     }
+ 
+     QCborMap snapshot;
+     snapshot.insert(QStringLiteral("url"), url);
+     snapshot.insert(QStringLiteral("lists"), lists);
+ 
+     QDir().mkpath(QFileInfo(_osListSnapshotFileName()).path());
+     QSaveFile f(_osListSnapshotFileName());
+     if (!f.open(QIODevice::WriteOnly) || f.write(snapshot.toCborValue().toCbor()) == -1 || !f.commit())
+         qDebug() << "Error saving OS list snapshot";
+ }
+ 
+ bool ImageWriter::hasOSList()
+ {
+     return !_completeOsList.isEmpty();
+ }
  
  void ImageWriter::setHWFilterList(const QByteArray &json, const bool &inclusive) {
      QJsonDocument json_document = QJsonDocument::fromJson(json);
      _deviceFilter = json_document.array();
+     _deviceFilterTags.clear();
+     for (const auto &tag : std::as_const(_deviceFilter))
+         _deviceFilterTags.insert(tag.toString());
      _deviceFilterIsInclusive = inclusive;
  }
  
@@ -611,6 +1764,9 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
      // Defer deletion
      data->deleteLater();
  
+     auto requestUrl = data->request().url().toString();
+     bool isSubList = _osSubListsRequested.contains(requestUrl);
+ 
      if (data->error() == QNetworkReply::NoError) {
          auto httpStatusCode = data->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
  
@@ -618,25 +1774,50 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
              auto response_object = QJsonDocument::fromJson(data->readAll()).object();
  
              if (response_object.contains("os_list")) {
-                 // Step 1: Insert the items into the canonical JSON document.
-                 //         It doesn't matter that these may still contain subitems_url items
-                 //         As these will be fixed up as the subitems_url instances are blinked in
-                 if (_completeOsList.isEmpty()) {
-                     _completeOsList = QJsonDocument(response_object);
+                 auto os_list = response_object["os_list"].toArray();
+ 
+                 if (data->hasRawHeader("ETag") || data->hasRawHeader("Last-Modified"))
+                     _osListValidators.insert(requestUrl, {data->rawHeader("ETag"), data->rawHeader("Last-Modified")});
+                 else
+                     _osListValidators.remove(requestUrl);
+ 
+                 // The top level is shown right away. Sublists stay apart and are only put
+                 // in place when a view is built, so nothing already fetched is walked again.
+                 if (isSubList) {
+                     _osSubLists.insert(requestUrl, os_list);
                  } else {
-                     auto new_list = findAndInsertJsonResult(_completeOsList["os_list"].toArray(), response_object["os_list"].toArray(), data->request().url());
-                     auto imager_meta = _completeOsList["imager"].toObject();
-                     _completeOsList = QJsonDocument(QJsonObject({
-                         {"imager", imager_meta},
-                         {"os_list", new_list}
-                     }));
+                     _completeOsList = QJsonDocument(response_object);
+ 
+                     // Fetch what the categories of the top level hold, to tell which ones are
+                     // empty for a device. Deeper levels are fetched when they are opened.
+                     QStringList urls;
+                     findUnresolvedSubitemsUrls(os_list, urls);
+                     for (auto &url : urls)
+                         _requestOSSubList(url);
+                     // Deeper levels from the snapshot are revalidated as well
+                     for (auto &url : _osSubLists.keys())
+                         _requestOSSubList(url);
                  }
  
-                 findAndQueueUnresolvedSubitemsJson(response_object["os_list"].toArray(), _networkManager);
+                 _filteredOsListCache.clear();
+                 _osListSnapshotTimer.start();
                  emit osListPrepared();
+                 if (isSubList)
+                     emit osSubListPrepared(requestUrl);
+                 return;
              } else {
                  qDebug() << "Incorrectly formatted OS list at: " << data->url();
              }
+         } else if (httpStatusCode == 304) {
+             // Not modified since the snapshot, what is shown already is current
+             if (!isSubList) {
+                 QStringList urls;
+                 findUnresolvedSubitemsUrls(_completeOsList["os_list"].toArray(), urls);
+                 urls += _osSubLists.keys();
+                 for (auto &url : urls)
+                     _requestOSSubList(url);
+             }
+             return;
          } else if (httpStatusCode >= 300 && httpStatusCode < 400) {
              // We should _never_ enter this branch. All requests are set to follow redirections
              // at their call sites - so the only way you got here was a logic defect.
@@ -659,66 +1840,31 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
          // QT Error.
          qDebug() << "Unrecognised QT error: " << data->error() << ", explainer: " << data->errorString();
      }
- }
- 
- namespace {
-     QJsonArray filterOsListWithHWTags(QJsonArray incoming_os_list, QJsonArray hw_filter, const bool inclusive, uint8_t count = 0) {
-         if (count > MAX_SUBITEMS_DEPTH) {
-             qDebug() << "Aborting insertion of subitems, exceeded maximum configured limit of " << MAX_SUBITEMS_DEPTH << " levels.";
-             return {};
-         }
  
-         QJsonArray returnArray = {};
- 
-         for (auto ositem : incoming_os_list) {
-             auto ositemObject = ositem.toObject();
- 
-             if (ositemObject.contains("subitems")) {
-                 // Recurse!
-                 ositemObject["subitems"] = filterOsListWithHWTags(ositemObject["subitems"].toArray(), hw_filter, inclusive, count++);
-                 if (ositemObject["subitems"].toArray().count() > 0) {
-                     returnArray += ositemObject;
-                 }
-             } else {
-                 // Filter this one!
-                 if (ositemObject.contains("devices")) {
-                     auto keep = false;
-                     auto ositem_devices = ositemObject["devices"].toArray();
- 
-                     for (auto compat_device : ositem_devices) {
-                         if (hw_filter.contains(compat_device.toString())) {
-                             keep = true;
-                             break;
-                         }
-                     }
- 
-                     if (keep) {
-                         returnArray.append(ositem);
-                     }
-                 } else {
-                     // No devices tags, so work out if we're exclusive or inclusive filtering!
-                     if (inclusive) {
-                         returnArray.append(ositem);
-                     }
-                 }
-             }
-         }
+     // Opening the category again tries once more
+     if (isSubList)
+         _osSubListsRequested.remove(requestUrl);
+ }
  
-         return returnArray;
-     }
- } // namespace anonymous
+ QJsonObject ImageWriter::getFilteredOSlist() {
+     // QML asks for the list on every change of the device or the list, only build each view once
+     QByteArray cacheKey = QJsonDocument(_deviceFilter).toJson(QJsonDocument::Compact) + (_deviceFilterIsInclusive ? "+" : "-");
+     auto cached = _filteredOsListCache.constFind(cacheKey);
+     if (cached != _filteredOsListCache.constEnd())
+         return *cached;
  
- QByteArray ImageWriter::getFilteredOSlist() {
      QJsonArray reference_os_list_array = {};
      QJsonObject reference_imager_metadata = {};
      {
          if (!_completeOsList.isEmpty()) {
+             auto os_list = _resolvedOsList(_completeOsList.object()["os_list"].toArray());
+ 
              if (!_deviceFilter.isEmpty()) {
-                 reference_os_list_array = filterOsListWithHWTags(_completeOsList.object()["os_list"].toArray(), _deviceFilter, _deviceFilterIsInclusive);
+                 reference_os_list_array = filterOsListWithHWTags(os_list, _deviceFilterTags, _deviceFilterIsInclusive);
              } else {
                  // The device filter can be an empty array when a device filter has not been selected, or has explicitly been selected as
                  // "no filtering". In that case, avoid walking the tree and use the unfiltered list.
-                 reference_os_list_array = _completeOsList.object()["os_list"].toArray();
+                 reference_os_list_array = os_list;
              }
  
              reference_imager_metadata = _completeOsList.object()["imager"].toObject();
@@ -739,106 +1885,345 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
              {"url", ""},
          }));
  
-     return QJsonDocument(
-         QJsonObject({
-             {"imager", reference_imager_metadata},
-             {"os_list", reference_os_list_array},
-         }
-     )).toJson();
+     QJsonObject result({
+         {"imager", reference_imager_metadata},
+         {"os_list", reference_os_list_array},
+     });
+ 
+     _filteredOsListCache.insert(cacheKey, result);
+     return result;
+ }
+ 
+ void ImageWriter::fetchOSSubList(const QString &url) {
+     if (_osSubLists.contains(url))
+         emit osSubListPrepared(url);
+     else
+         _requestOSSubList(url);
+ }
+ 
+ QJsonArray ImageWriter::getFilteredOSSubList(const QString &url) {
+     auto os_list = _resolvedOsList(_osSubLists.value(url));
+     if (!_deviceFilter.isEmpty())
+         os_list = filterOsListWithHWTags(os_list, _deviceFilterTags, _deviceFilterIsInclusive);
+ 
+     return os_list;
  }
  
  void ImageWriter::beginOSListFetch() {
      QNetworkRequest request = QNetworkRequest(constantOsListUrl());
      request.setAttribute(QNetworkRequest::RedirectPolicyAttribute,
                           QNetworkRequest::NoLessSafeRedirectPolicy);
+     _setRevalidationHeaders(request, constantOsListUrl().toString());
      
-     // This will set up a chain of requests that culiminate in the eventual fetch and assembly of
-     // a complete cached OS list.
-    _networkManager.get(request);
+     // This fetches the top level list, which then queues the sublists of its categories.
+    _networkAccessManager()->get(request);
+ }
+ 
+ void ImageWriter::setCustomCacheFile(const QString &cacheFile, const QByteArray &sha256)
+ {
+     _cacheFileName = cacheFile;
+     _cachedFileHash = QFile::exists(cacheFile) ? sha256 : "";
+     _customCacheFile = true;
+     _cachingEnabled = true;
+ }
+ 
+ /* Start polling the list of available drives */
+ void ImageWriter::startDriveListPolling()
+ {
+     _drivelist.startPolling();
+ }
+ 
+ /* Stop polling the list of available drives */
+ void ImageWriter::stopDriveListPolling()
+ {
+     _drivelist.stopPolling();
+ }
+ 
+ DriveListModel *ImageWriter::getDriveList()
+ {
+     return &_drivelist;
+ }
+ 
+ /* The thread publishes progress snapshots itself, at most every PROGRESS_UPDATE_INTERVAL ms.
+    On embedded hosts the GUI competes with the pipeline for a few cores, so it is only
+    updated every IMAGEWRITER_EMBEDDED_PROGRESS_INTERVAL ms, and renders at a lower priority */
+ void ImageWriter::startProgressPolling()
+ {
+     _powersave.applyBlock(tr("Downloading and writing image"));
+     _dlnow = 0; _verifynow = 0;
+     if (_embeddedMode)
+     {
+         if (!_progressTimer.isActive())
+             _setRenderThreadLowPriority(true);
+         _progressTimer.start();
+     }
+     else if (_thread)
+     {
+         connect(_thread, &DownloadThread::progressChanged, this, &ImageWriter::onProgressChanged, Qt::UniqueConnection);
+     }
+ }
+ 
+ void ImageWriter::stopProgressPolling()
+ {
+     if (_thread)
+         disconnect(_thread, &DownloadThread::progressChanged, this, &ImageWriter::onProgressChanged);
+     if (_progressTimer.isActive())
+     {
+         _progressTimer.stop();
+         _setRenderThreadLowPriority(false);
+     }
+     onProgressChanged();
+     _powersave.removeBlock();
+ }
+
+void ImageWriter::registerRenderThread()
+{
+#ifdef Q_OS_LINUX
+    _renderThreadId = ::syscall(SYS_gettid);
+#endif
+}
+
+void ImageWriter::_setRenderThreadLowPriority(bool low)
+{
+#ifdef Q_OS_LINUX
+    /* Not the GUI thread: threads it starts meanwhile would inherit its nice level.
+       With linuxfb there is no render thread */
+    long tid = _renderThreadId;
+    if (!tid || tid == ::syscall(SYS_gettid))
+        return;
+
+    if (low)
+    {
+        errno = 0;
+        int nice = ::getpriority(PRIO_PROCESS, tid);
+        if (nice == -1 && errno)
+            return;
+        _renderThreadNice = nice;
+    }
+
+    /* Going back up needs CAP_SYS_NICE, which the kiosk running as root has */
+    int nice = low ? qMax(_renderThreadNice, IMAGEWRITER_EMBEDDED_RENDER_NICE) : _renderThreadNice;
+    if (::setpriority(PRIO_PROCESS, tid, nice) == -1)
+        qDebug() << "Cannot set nice level of render thread to" << nice << ":" << strerror(errno);
+#else
+    Q_UNUSED(low)
+#endif
+}
+ 
+ void ImageWriter::onProgressChanged()
+ {
+     if (!_thread)
+         return;
+ 
+     /* One snapshot, so the numbers all belong to the same moment */
+     ProgressSnapshot p = _thread->progress();
+     quint64 newDlNow, dlTotal;
+     if (_extrLen)
+     {
+         newDlNow = p.bytesWritten;
+         dlTotal = _extrLen;
+     }
+     else
+     {
+         newDlNow = p.dlNow;
+         dlTotal = p.dlTotal;
+     }
+ 
+     if (newDlNow != _dlnow)
+     {
+         _dlnow = newDlNow;
+         emit downloadProgress(newDlNow, dlTotal);
+     }
+ 
+     if (p.verifyNow != _verifynow)
+     {
+         _verifynow = p.verifyNow;
+         emit verifyProgress(p.verifyNow, p.verifyTotal);
+     }
+ 
+     if (p.phase >= 0 && p.phase < DownloadThread::PhaseCount)
+     {
+         emit progressChanged(QVariantMap {
+             {"phase", DownloadThread::phaseName((DownloadThread::Phase) p.phase)},
+             {"bytesPerSecond", p.bytesPerSecond},
+             {"eta", p.etaMsecs < 0 ? -1.0 : p.etaMsecs / 1000.0}
+         });
+     }
+ }
+ 
+ void ImageWriter::setVerifyEnabled(bool verify)
+ {
+     _verifyEnabled = verify;
+     if (_thread)
+         _thread->setVerifyEnabled(verify);
+ }
+ 
+ void ImageWriter::setExtractedCacheEnabled(bool extracted)
+ {
+     _extractedCaching = extracted && _cachingEnabled;
+ }
+
+ void ImageWriter::setRamStageBudget(quint64 bytes)
+ {
+     /* Without a memory backed directory there is nowhere to stage */
+     _ramStageBudget = _ramStage.directory().isEmpty() ? 0 : bytes;
+     _ramStage.setBudget(_ramStageBudget);
+ }
+ 
+ void ImageWriter::setDownloadSegments(int segments)
+ {
+     _downloadSegments = segments;
+ }
+ 
+ void ImageWriter::setMultiSourceEnabled(bool enabled)
+ {
+     _multiSource = enabled;
+ }
+
+ void ImageWriter::setPeerCacheEnabled(bool enabled)
+ {
+     /* Other stations may ask for images even if we cannot download from them */
+     if (enabled && !PeerCache::serve(_downloadCache.directory(), IMAGEWRITER_PEER_CACHE_PORT))
+         qDebug() << "Not serving the download cache to peers";
+     _peerCache = enabled;
+ }
+
+ void ImageWriter::setPrefetchEnabled(bool enabled)
+ {
+     _prefetch = enabled;
+     if (!enabled && _prefetchThread && !_precaching)
+         _prefetchThread->cancelDownload();
+ }
+
+ bool ImageWriter::precacheImage(const QUrl &url, const QByteArray &sha256, quint64 downloadLen)
+ {
+     if (!_cachingEnabled || sha256.isEmpty() || !(url.scheme() == "http" || url.scheme() == "https")
+             || _prefetchThread || (_thread && _thread->isRunning()) || _deltaThread || _writeAfterPrefetch)
+         return false;
+     if (_downloadCache.contains(sha256) || (_extractedCaching && _extractedCache.contains(sha256))
+             || DownloadCoordinator::find(sha256))
+         return false;
+     if (!_downloadCache.reserve(downloadLen))
+     {
+         qDebug() << "Low disk space or image larger than cache budget. Not precaching" << url;
+         return false;
+     }
+
+     qDebug() << "Precaching" << url << "into the download cache";
+     _precaching = true;
+     _startPrefetchThread(url, sha256, downloadLen);
+     return true;
+ }
+
+ void ImageWriter::cancelPrecache()
+ {
+     if (_precaching)
+         _prefetchThread->cancelDownload();
+ }
+
+ void ImageWriter::setWriteQueueDepth(int depth)
+ {
+     _writeQueueDepth = depth;
+ }
+ 
+ void ImageWriter::setWriteBlockSize(quint64 size)
+ {
+     _writeBlockSize = size;
+ }
+
+ void ImageWriter::setMemoryLimit(quint64 bytes)
+ {
+     _memoryLimit = bytes;
  }
  
- void ImageWriter::setCustomCacheFile(const QString &cacheFile, const QByteArray &sha256)
+ void ImageWriter::setDirectIOEnabled(bool directIO)
  {
-     _cacheFileName = cacheFile;
-     _cachedFileHash = QFile::exists(cacheFile) ? sha256 : "";
-     _customCacheFile = true;
-     _cachingEnabled = true;
+     _directIO = directIO;
  }
  
- /* Start polling the list of available drives */
- void ImageWriter::startDriveListPolling()
+ void ImageWriter::setIoUringEnabled(bool ioUring)
  {
-     _drivelist.startPolling();
+     _ioUring = ioUring;
  }
  
- /* Stop polling the list of available drives */
- void ImageWriter::stopDriveListPolling()
+ void ImageWriter::setSparseWriteEnabled(bool sparse)
  {
-     _drivelist.stopPolling();
+     _sparseWrite = sparse;
  }
- 
- DriveListModel *ImageWriter::getDriveList()
+
+ void ImageWriter::setAsyncEjectEnabled(bool async)
  {
-     return &_drivelist;
+     _asyncEject = async;
  }
  
- void ImageWriter::startProgressPolling()
+ void ImageWriter::setDeltaWriteEnabled(bool delta)
  {
-     _powersave.applyBlock(tr("Downloading and writing image"));
-     _dlnow = 0; _verifynow = 0;
-     _polltimer.start(PROGRESS_UPDATE_INTERVAL);
+     _deltaWrite = delta;
  }
  
- void ImageWriter::stopProgressPolling()
+ void ImageWriter::setResumeEnabled(bool resume)
  {
-     _polltimer.stop();
-     pollProgress();
-     _powersave.removeBlock();
+     _resume = resume;
  }
- 
- void ImageWriter::pollProgress()
+
+ void ImageWriter::setCapacityProbeEnabled(bool probe)
  {
-     if (!_thread)
-         return;
- 
-     quint64 newDlNow, dlTotal;
-     if (_extrLen)
-     {
-         newDlNow = _thread->bytesWritten();
-         dlTotal = _extrLen;
-     }
-     else
-     {
-         newDlNow = _thread->dlNow();
-         dlTotal = _thread->dlTotal();
-     }
- 
-     if (newDlNow != _dlnow)
-     {
-         _dlnow = newDlNow;
-         emit downloadProgress(newDlNow, dlTotal);
-     }
+     _capacityProbe = probe;
+ }
  
-     quint64 newVerifyNow = _thread->verifyNow();
+ void ImageWriter::setOverlappedVerifyEnabled(bool overlapped)
+ {
+     _overlappedVerify = overlapped;
+ }
  
-     if (newVerifyNow != _verifynow)
-     {
-         _verifynow = newVerifyNow;
-         quint64 verifyTotal = _thread->verifyTotal();
-         emit verifyProgress(newVerifyNow, verifyTotal);
-     }
+ void ImageWriter::setChunkedVerifyEnabled(bool chunked)
+ {
+     _chunkedVerify = chunked;
  }
+
+void ImageWriter::setChunkedVerifyAlgorithm(ChunkedHash::Algorithm algorithm)
+{
+    _chunkAlgorithm = algorithm;
+}
+
+void ImageWriter::setQueueTuningEnabled(bool enabled)
+{
+    _queueTuning = enabled;
+}
  
- void ImageWriter::setVerifyEnabled(bool verify)
+ void ImageWriter::setInStreamCustomizationEnabled(bool enabled)
  {
-     _verifyEnabled = verify;
-     if (_thread)
-         _thread->setVerifyEnabled(verify);
+     _inStreamCustomization = enabled;
+ }
+
+ void ImageWriter::setExpandRootPartitionEnabled(bool enabled)
+ {
+     _expandRoot = enabled;
+ }
+
+ void ImageWriter::setUserspaceExtractionEnabled(bool enabled)
+ {
+     _userspaceExtraction = enabled;
  }
  
  void ImageWriter::onSuccess()
  {
     stopProgressPolling();
+    _scrubTimer.start();
+
+    /* The write found the hash of the extracted image to match */
+    if (!_unvalidatedEntry.isEmpty())
+    {
+        _extractedCache.setValidated(_unvalidatedEntry);
+        _unvalidatedEntry.clear();
+    }
+
+    if (!_targetErrors.isEmpty())
+    {
+        /* Some devices were written, but not all */
+        onError(tr("Writing failed on %1 of %2 storage devices:<br>%3").arg(_targetErrors.size()).arg(_fanoutTargets.size()).arg(_targetErrors.join("<br>")));
+        return;
+    }
        
     emit success();
 
@@ -850,9 +2235,22 @@ void ImageWriter::setBootloaderHashes(const QByteArray &tiboot3Hash, const QByte
 #endif
 }
 
+void ImageWriter::onTargetError(QString msg)
+{
+    FanoutTargetThread *target = qobject_cast<FanoutTargetThread *>(sender());
+    if (!target)
+        return;
+
+    qDebug() << "Writing to" << target->device() << "failed:" << msg;
+    _targetErrors.append(QString("%1: %2").arg(QString(target->device()), msg));
+}
+
 void ImageWriter::onError(QString msg)
 {
     stopProgressPolling();
+    /* Stays unvalidated, for the scrubber to tell whether it was the cache file */
+    _unvalidatedEntry.clear();
+    _scrubTimer.start();
     emit error(msg);
 
 #ifndef QT_NO_WIDGETS
@@ -863,7 +2261,8 @@ void ImageWriter::onError(QString msg)
 
 void ImageWriter::onFinalizing()
  {
-     _polltimer.stop();
+     if (_thread)
+         disconnect(_thread, &DownloadThread::progressChanged, this, &ImageWriter::onProgressChanged);
      emit finalizing();
  }
  
@@ -877,6 +2276,90 @@ void ImageWriter::onFinalizing()
      emit dfuProgress(percentage, statusMsg);
  }
  
+QStringList ImageWriter::getDfuDeviceList()
+{
+    return DfuWrapper::devicePaths(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID);
+}
+
+QVariantMap ImageWriter::getDfuDeviceSpeeds()
+{
+    QVariantMap result;
+    const QMap<QString, int> speeds = DfuWrapper::deviceSpeeds(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID);
+    for (auto it = speeds.cbegin(); it != speeds.cend(); ++it)
+        result.insert(it.key(), it.value());
+
+    return result;
+}
+
+void ImageWriter::setDfuBoards(const QStringList &paths)
+{
+    _dfuBoards = paths;
+}
+
+void ImageWriter::setDfuUmsEnabled(bool enabled)
+{
+    _dfuUms = enabled;
+}
+
+void ImageWriter::setDfuFastbootEnabled(bool enabled)
+{
+    _dfuFastboot = enabled;
+}
+
+/* The drives there are now are not the boards */
+void ImageWriter::onUmsStarted(int boards)
+{
+    _umsBoards = boards;
+    _umsKnownDrives.clear();
+    for (int i = 0; i < _drivelist.rowCount(QModelIndex()); i++)
+        _umsKnownDrives.append(_drivelist.data(_drivelist.index(i), DriveListModel::deviceRole).toString());
+
+    connect(&_drivelist, &QAbstractItemModel::rowsInserted, this, &ImageWriter::onUmsDrivesChanged, Qt::UniqueConnection);
+    _umsTimer.start();
+}
+
+/* Once every board is there, or the wait timed out, they are written like
+   any other drives: the first as destination, the others as fan-out targets */
+void ImageWriter::onUmsDrivesChanged()
+{
+    QStringList devices;
+    QList<quint64> sizes;
+    for (int i = 0; i < _drivelist.rowCount(QModelIndex()); i++)
+    {
+        QModelIndex index = _drivelist.index(i);
+        QString device = _drivelist.data(index, DriveListModel::deviceRole).toString();
+        quint64 size = _drivelist.data(index, DriveListModel::sizeRole).toULongLong();
+        if (_umsKnownDrives.contains(device) || !size
+            || !_drivelist.data(index, DriveListModel::isUsbRole).toBool()
+            || _drivelist.data(index, DriveListModel::isReadOnlyRole).toBool()
+            || _drivelist.data(index, DriveListModel::isSystemRole).toBool())
+            continue;
+
+        devices.append(device);
+        sizes.append(size);
+    }
+
+    if (devices.size() < _umsBoards && _umsTimer.isActive())
+        return;
+
+    _umsTimer.stop();
+    disconnect(&_drivelist, &QAbstractItemModel::rowsInserted, this, &ImageWriter::onUmsDrivesChanged);
+    if (devices.isEmpty())
+    {
+        onError(tr("The eMMC of the board did not show up as USB storage.<br>"
+                   "Its U-Boot may not support USB mass storage mode."));
+        return;
+    }
+    if (devices.size() < _umsBoards)
+        qDebug() << "Only" << devices.size() << "of" << _umsBoards << "boards showed up as USB storage";
+
+    qDebug() << "Writing eMMC as USB storage:" << devices;
+    setDst(devices.first(), sizes.first());
+    for (int i = 1; i < devices.size(); i++)
+        addDst(devices[i], sizes[i]);
+    startWrite();
+}
+
 /* Start DFU operation */
 void ImageWriter::startDfu()
 {
@@ -927,7 +2410,11 @@ void ImageWriter::_startDfuThread()
 {
     QByteArray urlstr = _src.toString(_src.FullyEncoded).toLatin1();
 
-    DfuThread *dfuThread = new DfuThread(urlstr, _dst.toLatin1(), _expectedHash, _expectedTiboot3Hash, _expectedTisplHash, _expectedUbootHash, this);
+    DfuThread *dfuThread;
+    if (_dfuFastboot && !_dfuUms)
+        dfuThread = new FastbootThread(urlstr, _dst.toLatin1(), _expectedHash, _expectedTiboot3Hash, _expectedTisplHash, _expectedUbootHash, this);
+    else
+        dfuThread = new DfuThread(urlstr, _dst.toLatin1(), _expectedHash, _expectedTiboot3Hash, _expectedTisplHash, _expectedUbootHash, this);
     _thread = dfuThread;
 
     connect(_thread, SIGNAL(success()), SLOT(onSuccess()));
@@ -935,50 +2422,75 @@ void ImageWriter::_startDfuThread()
     connect(_thread, SIGNAL(preparationStatusUpdate(QString)), SLOT(onPreparationStatusUpdate(QString)));
     connect(_thread, SIGNAL(finalizing()), SLOT(onFinalizing()));
     connect(dfuThread, SIGNAL(dfuProgress(int, QString)), SLOT(onDfuProgress(int, QString)));
+    dfuThread->setBoardPaths(_dfuBoards);
+    /* Boards the ROM enumerated at full speed take many times longer */
+    const QMap<QString, int> speeds = DfuWrapper::deviceSpeeds(DfuWrapper::TI_VENDOR_ID, DfuWrapper::TI_PRODUCT_ID);
+    for (auto it = speeds.cbegin(); it != speeds.cend(); ++it)
+    {
+        qDebug() << "DFU board at" << it.key() << "connected at" << it.value() << "Mbit/s";
+        if (it.value() && it.value() < 480 && (_dfuBoards.isEmpty() || _dfuBoards.contains(it.key())))
+            qDebug() << "WARNING: DFU board at" << it.key() << "is not connected at USB 2 high speed";
+    }
+    dfuThread->setImageSize(_extrLen);
+
+    if (_dfuUms)
+    {
+        /* The image goes through startWrite() once the boards are drives */
+        _drivelist.startPolling();
+        dfuThread->setUmsMode(true);
+        connect(dfuThread, &DfuThread::umsStarted, this, &ImageWriter::onUmsStarted);
+        _thread->start();
+        startProgressPolling();
+        return;
+    }
 
     _thread->setVerifyEnabled(_verifyEnabled);
     _thread->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg(constantVersion()).toUtf8());
     _thread->setImageCustomization(_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat, _dst.toLatin1());
 
-    // Setup caching
-    if (!_expectedHash.isEmpty() && _cachedFileHash != _expectedHash && _cachingEnabled)
+    /* Customized images are kept in the extracted image cache, so flashing
+       the same image with the same settings again skips download and customization */
+    QByteArray customizationKey = _customizationKey();
+    if (!customizationKey.isEmpty() && _extractedCache.contains(customizationKey))
+    {
+        dfuThread->setCustomizedImage(_extractedCache.fileName(customizationKey));
+        _extractedCache.touch(customizationKey);
+    }
+    else
     {
-        if (!_cachedFileHash.isEmpty())
+        if (!customizationKey.isEmpty() && _extractedCache.reserve(qMax(_extrLen, _downloadLen)))
         {
-            if (_settings.isWritable() && QFile::remove(_cacheFileName))
-            {
-                _settings.remove("caching/lastDownloadSHA256");
-                _settings.sync();
-                _cachedFileHash.clear();
-            }
-            else
-            {
-                qDebug() << "Error removing old cache file. Disabling caching";
-                _cachingEnabled = false;
-            }
+            dfuThread->setCustomizedImageCache(_extractedCache.fileName(customizationKey), customizationKey);
+            connect(_thread, SIGNAL(extractedCacheFileUpdated(QByteArray)), SLOT(onExtractedCacheFileUpdated(QByteArray)));
         }
 
-        if (_cachingEnabled)
-        {
-            QStorageInfo si(QStandardPaths::writableLocation(QStandardPaths::CacheLocation));
-            qint64 avail = si.bytesAvailable();
-            qDebug() << "Available disk space for caching:" << avail/1024/1024/1024 << "GB";
-
-            if (avail-_downloadLen < IMAGEWRITER_MINIMAL_SPACE_FOR_CACHING)
-            {
-                qDebug() << "Low disk space. Not caching files to disk.";
-            }
-            else
-            {
-                _thread->setCacheFile(_cacheFileName, _downloadLen);
-                connect(_thread, SIGNAL(cacheFileUpdated(QByteArray)), SLOT(onCacheFileUpdated(QByteArray)));
-            }
-        }
+        // Setup caching
+        if (!isCached(_src, _expectedHash))
+            _setupCaching();
     }
 
     _thread->start();
     startProgressPolling();
 }
+
+/* Cache key of the image with the current customization settings.
+   Empty if the image cannot be identified */
+QByteArray ImageWriter::_customizationKey() const
+{
+    if (!_extractedCaching || _expectedHash.isEmpty())
+        return QByteArray();
+
+    QCryptographicHash hash(QCryptographicHash::Sha256);
+    hash.addData(_expectedHash);
+    for (const QByteArray &part : {_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat})
+    {
+        /* Length prefixed, so moving text from one to the next changes the key */
+        hash.addData(QByteArray::number(part.size()) + ":");
+        hash.addData(part);
+    }
+
+    return hash.result().toHex();
+}
  
  void ImageWriter::openFileDialog()
  {
@@ -992,7 +2504,7 @@ void ImageWriter::_startDfuThread()
  
      QFileDialog *fd = new QFileDialog(nullptr, tr("Select image"),
                                        path,
-                                       "Image files (*.img *.zip *.iso *.gz *.xz *.zst);;All files (*)");
+                                       "Image files (*.img *.zip *.iso *.gz *.xz *.zst *.lz4);;All files (*)");
      connect(fd, SIGNAL(fileSelected(QString)), SLOT(onFileSelected(QString)));
  
      if (_engine)
@@ -1065,45 +2577,16 @@ void ImageWriter::_startDfuThread()
      qDebug() << "Parsed .zip file containing" << numFiles << "files, uncompressed size:" << _extrLen;
  }
  
- void ImageWriter::_parseXZFile()
+ void ImageWriter::onImageProbed(const QUrl &url, quint64 size, bool exact)
  {
-     QFile f(_src.toLocalFile());
-     lzma_stream_flags opts = { 0 };
-     _extrLen = 0;
- 
-     if (f.size() > LZMA_STREAM_HEADER_SIZE && f.open(f.ReadOnly))
-     {
-         f.seek(f.size()-LZMA_STREAM_HEADER_SIZE);
-         QByteArray footer = f.read(LZMA_STREAM_HEADER_SIZE);
-         lzma_ret ret = lzma_stream_footer_decode(&opts, (const uint8_t *) footer.constData());
- 
-         if (ret == LZMA_OK && opts.backward_size < 1000000 && opts.backward_size < f.size()-LZMA_STREAM_HEADER_SIZE)
-         {
-             f.seek(f.size()-LZMA_STREAM_HEADER_SIZE-opts.backward_size);
-             QByteArray buf = f.read(opts.backward_size+LZMA_STREAM_HEADER_SIZE);
-             lzma_index *idx;
-             uint64_t memlimit = UINT64_MAX;
-             size_t pos = 0;
- 
-             ret = lzma_index_buffer_decode(&idx, &memlimit, NULL, (const uint8_t *) buf.constData(), &pos, buf.size());
-             if (ret == LZMA_OK)
-             {
-                 _extrLen = lzma_index_uncompressed_size(idx);
-                 qDebug() << "Parsed .xz file. Uncompressed size:" << _extrLen;
-             }
-             else
-             {
-                 qDebug() << "Unable to parse index of .xz file";
-             }
-             lzma_index_end(idx, NULL);
-         }
-         else
-         {
-             qDebug() << "Unable to parse footer of .xz file";
-         }
- 
-         f.close();
-     }
+     /* Sizes from the OS list and from a write that started already take precedence */
+     if (url != _src || _extrLen || (_thread && _thread->isRunning()))
+         return;
+
+     if (exact)
+         _extrLen = size;
+     else
+         _extrLenAtLeast = size;
  }
  
  bool ImageWriter::isOnline()
@@ -1221,13 +2704,13 @@ void ImageWriter::_startDfuThread()
      return devices > 0;
  }
  
- QByteArray ImageWriter::getUsbSourceOSlist()
+ QJsonArray ImageWriter::getUsbSourceOSlist()
  {
  #ifdef Q_OS_LINUX
      QJsonArray oslist;
      QDir dir("/media");
      const QStringList medialist = dir.entryList(QDir::Dirs | QDir::NoDotAndDotDot);
-     QStringList namefilters = {"*.img", "*.zip", "*.gz", "*.xz", "*.zst"};
+     QStringList namefilters = LocalImageIndex::nameFilters();
  
      for (const QString &devname : medialist)
      {
@@ -1245,16 +2728,68 @@ void ImageWriter::_startDfuThread()
                  {"release_date", ""},
                  {"image_download_size", fi.size()}
              };
+             LocalImageIndex::Entry local;
+             if (_lookupLocalImage(path, &local))
+             {
+                 f["extract_sha256"] = QString::fromLatin1(local.extractSha256);
+                 f["extract_size"] = (qint64) local.extractSize;
+                 if (!local.bmapUrl.isEmpty())
+                     f["bmap_url"] = local.bmapUrl;
+             }
              oslist.append(f);
          }
      }
+     /* Files not indexed yet are next time */
+     indexLocalImages();
  
-     return QJsonDocument(oslist).toJson();
+     return oslist;
  #else
-     return QByteArray();
+     return QJsonArray();
  #endif
  }
  
+ void ImageWriter::setLocalImageFolders(const QStringList &folders)
+ {
+     _settings.beginGroup("caching");
+     _settings.setValue("localImageFolders", folders);
+     _settings.endGroup();
+     _settings.sync();
+     _localImages.setFolders(folders);
+     indexLocalImages();
+ }
+
+ QStringList ImageWriter::localImageFolders()
+ {
+     return _localImages.folders();
+ }
+
+ void ImageWriter::indexLocalImages()
+ {
+     if (_localImages.isRunning())
+         return;
+
+     QStringList media;
+ #ifdef Q_OS_LINUX
+     /* Where mountUsbSourceMedia() mounts USB sticks */
+     QDir mediaDir("/media");
+     for (const QString &devname : mediaDir.entryList(QDir::Dirs | QDir::NoDotAndDotDot))
+         media.append("/media/"+devname);
+ #endif
+     _localImages.setMediaFolders(media);
+     if (media.isEmpty() && _localImages.folders().isEmpty())
+         return;
+
+     _localImages.start(QThread::LowestPriority);
+ }
+
+ bool ImageWriter::_lookupLocalImage(const QString &path, LocalImageIndex::Entry *entry)
+ {
+     if (!_completeOsList.isEmpty())
+         _localImages.matchOsList(_resolvedOsList(_completeOsList["os_list"].toArray()));
+
+     return _localImages.lookup(path, entry) && !entry->extractSha256.isEmpty();
+ }
+
  QString ImageWriter::_sshKeyDir()
  {
      return QDir::homePath()+"/.ssh";
@@ -1310,27 +2845,41 @@ void ImageWriter::_startDfuThread()
  
  void ImageWriter::generatePubKey()
  {
-     if (!hasPubKey() && !QFile::exists(_privKeyFileName()))
+     if (hasPubKey() || QFile::exists(_privKeyFileName()))
      {
-         QDir dir;
-         QProcess proc;
-         QString progName = _sshKeyGen();
-         QStringList args;
-         args << "-t" << "rsa" << "-f" << _privKeyFileName() << "-N" << "";
- 
-         if (!dir.exists(_sshKeyDir()))
-         {
-             qDebug() << "Creating" << _sshKeyDir();
-             dir.mkdir(_sshKeyDir());
-         }
- 
-         qDebug() << "Executing:" << progName << args;
-         proc.start(progName, args);
-         proc.waitForFinished();
-         qDebug() << proc.readAll();
+         emit pubKeyGenerated();
+         return;
+     }
+
+     QDir dir;
+     QProcess *proc = new QProcess(this);
+     QString progName = _sshKeyGen();
+     QStringList args;
+     args << "-t" << "rsa" << "-f" << _privKeyFileName() << "-N" << "";
+
+     if (!dir.exists(_sshKeyDir()))
+     {
+         qDebug() << "Creating" << _sshKeyDir();
+         dir.mkdir(_sshKeyDir());
      }
+
+     /* Key generation can take seconds on slow hosts, so the GUI does not wait for it */
+     connect(proc, &QProcess::finished, this, [this, proc]() {
+         qDebug() << proc->readAll();
+         proc->deleteLater();
+         emit pubKeyGenerated();
+     });
+     connect(proc, &QProcess::errorOccurred, this, [this, proc](QProcess::ProcessError error) {
+         if (error != QProcess::FailedToStart)
+             return;
+         qDebug() << "Error executing" << proc->program() << ":" << proc->errorString();
+         proc->deleteLater();
+         emit pubKeyGenerated();
+     });
+     qDebug() << "Executing:" << progName << args;
+     proc->start(progName, args);
  }
- 
+
  QString ImageWriter::getTimezone()
  {
      return QTimeZone::systemTimeZoneId();
@@ -1389,34 +2938,23 @@ void ImageWriter::_startDfuThread()
  
  QStringList ImageWriter::getSerialPortList()
  {
-     auto portInfoList = QSerialPortInfo::availablePorts();
-     QStringList list;
-     for(auto& portInfo: portInfoList)
-     {
-         if (!portInfo.description().isEmpty() && !portInfo.manufacturer().isEmpty() && !portInfo.serialNumber().isEmpty() && portInfo.productIdentifier() != 0)
-         {
-             list.push_back(portInfo.portName());
-         }
-     }
-     return list;
+     if (!_portWatcher.isRunning())
+         _portWatcher.start(QThread::LowPriority);
+     return _portWatcher.serialPorts();
  }
- 
+
  QStringList ImageWriter::getEthPortList()
  {
-     auto portInfoList = QNetworkInterface::allInterfaces();
-     QStringList list;
-     for(auto& portInfo: portInfoList)
-     {
-         if(!(portInfo.flags() & QNetworkInterface::IsLoopBack) &&
-             (portInfo.type() == QNetworkInterface::Ethernet))
-         {
-             list.append(portInfo.humanReadableName());
-         }
-     }
- 
-     return list;
+     if (!_portWatcher.isRunning())
+         _portWatcher.start(QThread::LowPriority);
+     return _portWatcher.ethernetPorts();
  }
- 
+
+ void ImageWriter::refreshPortList()
+ {
+     _portWatcher.refresh();
+ }
+
  QString ImageWriter::getSSID()
  {
      return WlanCredentials::instance()->getSSID();
@@ -1472,42 +3010,123 @@ void ImageWriter::_startDfuThread()
      qDebug() << "Cloudinit:" << cloudinit;
      qDebug() << "GemInit:" << geminit;
  }
+
+void ImageWriter::setTargetVariables(const QString &device, const QVariantMap &variables)
+{
+    _targetVariables.insert(device, variables);
+}
+
+/* Customization of one of the devices written, with its {{variables}} filled in.
+   Returns true if that made it differ from the customization of the others */
+bool ImageWriter::_setTargetCustomization(DownloadThread *thread, const QString &device, int index)
+{
+    QVariantMap variables = _targetVariables.value(device);
+    variables.insert("index", index);
+    variables.insert("device", device);
+    bool personalized = false;
+
+    auto fill = [&variables, &personalized](QByteArray text) {
+        for (auto it = variables.cbegin(); it != variables.cend() && text.contains("{{"); ++it)
+        {
+            QByteArray placeholder = "{{"+it.key().toUtf8()+"}}";
+            if (text.contains(placeholder))
+            {
+                text.replace(placeholder, it.value().toString().toUtf8());
+                personalized = true;
+            }
+        }
+        return text;
+    };
+
+    thread->setImageCustomization(fill(_config), fill(_cmdline), fill(_firstrun), fill(_cloudinit), fill(_cloudinitNetwork), fill(_geminit), _initFormat, device.toLatin1());
+    return personalized;
+}
  
+ namespace
+ {
+     QString sha512Crypt(const QByteArray &password)
+     {
+         QByteArray salt = "$6$";
+         QByteArray saltchars =
+             "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+             "abcdefghijklmnopqrstuvwxyz";
+         std::mt19937 gen(static_cast<unsigned>(QDateTime::currentMSecsSinceEpoch()));
+         std::uniform_int_distribution<> uid(0, saltchars.length()-1);
+
+         for (int i=0; i<16; i++)
+             salt += saltchars[uid(gen)];
+
+         return sha512_crypt(password.constData(), salt.constData());
+     }
+
+     QString sha256Crypt(const QByteArray &password)
+     {
+         QByteArray salt = "$5$";
+         QByteArray saltchars =
+           "./0123456789ABCDEFGHIJKLMNOPQRST"
+           "UVWXYZabcdefghijklmnopqrstuvwxyz";
+         std::mt19937 gen(static_cast<unsigned>(QDateTime::currentMSecsSinceEpoch()));
+         std::uniform_int_distribution<> uid(0, saltchars.length()-1);
+
+         for (int i=0; i<10; i++)
+             salt += saltchars[uid(gen)];
+
+         return sha256_crypt(password.constData(), salt.constData());
+     }
+
+     QString wpaPsk(const QByteArray &psk, const QByteArray &ssid)
+     {
+         return QPasswordDigestor::deriveKeyPbkdf2(QCryptographicHash::Sha1, psk, ssid, 4096, 32).toHex();
+     }
+ }
+
+ QFuture<QString> ImageWriter::_secret(const QByteArray &algorithm, const QByteArray &input, std::function<QString()> compute)
+ {
+     /* Keyed by a hash, the plain input is not kept */
+     QByteArray key = algorithm + ':' + QCryptographicHash::hash(input, QCryptographicHash::Sha256);
+     auto it = _secrets.constFind(key);
+     if (it != _secrets.constEnd())
+         return it.value();
+
+     QFuture<QString> secret = QtConcurrent::run(compute);
+     _secrets.insert(key, secret);
+     return secret;
+ }
+
+ void ImageWriter::prepareSecrets(const QByteArray &password, const QByteArray &psk, const QByteArray &ssid)
+ {
+     QList<QFuture<QString>> pending;
+
+     if (!password.isEmpty())
+     {
+         pending.append(_secret("sha256crypt", password, [password]() { return sha256Crypt(password); }));
+         pending.append(_secret("sha512crypt", password, [password]() { return sha512Crypt(password); }));
+     }
+     if (!psk.isEmpty())
+     {
+         pending.append(_secret("pbkdf2", psk + '\0' + ssid, [psk, ssid]() { return wpaPsk(psk, ssid); }));
+     }
+
+     QtFuture::whenAll(pending.begin(), pending.end()).then(this, [this](const QList<QFuture<QString>> &) {
+         emit secretsPrepared();
+     });
+ }
+
  QString ImageWriter::crypt6(const QByteArray &password)
  {
-     QByteArray salt = "$6$";
-     QByteArray saltchars =
-         "./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-         "abcdefghijklmnopqrstuvwxyz";
-     std::mt19937 gen(static_cast<unsigned>(QDateTime::currentMSecsSinceEpoch()));
-     std::uniform_int_distribution<> uid(0, saltchars.length()-1);
- 
-     for (int i=0; i<16; i++)
-         salt += saltchars[uid(gen)];
- 
-     return sha512_crypt(password.constData(), salt.constData());
+     return _secret("sha512crypt", password, [password]() { return sha512Crypt(password); }).result();
  }
- 
+
  QString ImageWriter::crypt(const QByteArray &password)
  {
-     QByteArray salt = "$5$";
-     QByteArray saltchars =
-       "./0123456789ABCDEFGHIJKLMNOPQRST"
-       "UVWXYZabcdefghijklmnopqrstuvwxyz";
-     std::mt19937 gen(static_cast<unsigned>(QDateTime::currentMSecsSinceEpoch()));
-     std::uniform_int_distribution<> uid(0, saltchars.length()-1);
- 
-     for (int i=0; i<10; i++)
-         salt += saltchars[uid(gen)];
- 
-     return sha256_crypt(password.constData(), salt.constData());
+     return _secret("sha256crypt", password, [password]() { return sha256Crypt(password); }).result();
  }
- 
+
  QString ImageWriter::pbkdf2(const QByteArray &psk, const QByteArray &ssid)
  {
-     return QPasswordDigestor::deriveKeyPbkdf2(QCryptographicHash::Sha1, psk, ssid, 4096, 32).toHex();
+     return _secret("pbkdf2", psk + '\0' + ssid, [psk, ssid]() { return wpaPsk(psk, ssid); }).result();
  }
- 
+
  unsigned char reverse_bits(unsigned char b) {
      b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
      b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
@@ -1662,6 +3281,7 @@ void ImageWriter::_startDfuThread()
      }
  
      // Regenerate the OS list, because it has some localised items
+     _filteredOsListCache.clear();
      emit osListPrepared();
  }
  
@@ -6,10 +6,16 @@
  * Copyright (C) 2020 Raspberry Pi Ltd
  */
 
+#include <atomic>
+#include <functional>
 #include <memory>
 
 #include <QJsonArray>
 #include <QJsonDocument>
+#include <QJsonObject>
+#include <QFuture>
+#include <QHash>
+#include <QSet>
 #include <QNetworkAccessManager>
 #include <QObject>
 #include <QTimer>
@@ -21,10 +27,24 @@
 #include "config.h"
 #include "powersaveblocker.h"
 #include "drivelistmodel.h"
+#include "downloadcache.h"
+#include "chunkindex.h"
+#include "chunkedhash.h"
+#include "encodingselector.h"
+#include "localimageindex.h"
+#include "cachescrubber.h"
+#include "cachetranscoder.h"
+#include "downloadstatstelemetry.h"
+#include "portlistwatcher.h"
 #include "dependencies/crypt/des.h"
 
 class QQmlApplicationEngine;
 class DownloadThread;
+class DeltaDownloadThread;
+class PrefetchThread;
+class ImageProbe;
+class FanoutTargetThread;
+struct MemoryBudget;
 class DfuThread;
 class QNetworkReply;
 class QTranslator;
@@ -32,6 +52,9 @@ class QTranslator;
 class ImageWriter : public QObject
 {
     Q_OBJECT
+    /* Listed on a thread of their own, empty until then. Reading one starts watching the ports */
+    Q_PROPERTY(QStringList serialPorts READ getSerialPortList NOTIFY portListChanged)
+    Q_PROPERTY(QStringList ethPorts READ getEthPortList NOTIFY portListChanged)
 public:
     explicit ImageWriter(QObject *parent = nullptr);
     virtual ~ImageWriter();
@@ -42,7 +65,19 @@ public:
     Q_INVOKABLE void setEthPort(const QString& ethPort);
 
     /* Set URL to download from, and if known download length and uncompressed length */
-    Q_INVOKABLE void setSrc(const QUrl &url, quint64 downloadLen = 0, quint64 extrLen = 0, QByteArray expectedHash = "", bool multifilesinzip = false, QString parentcategory = "", QString osname = "", QByteArray initFormat = "");
+    Q_INVOKABLE void setSrc(const QUrl &url, quint64 downloadLen = 0, quint64 extrLen = 0, QByteArray expectedHash = "", bool multifilesinzip = false, QString parentcategory = "", QString osname = "", QByteArray initFormat = "", const QUrl &bmapUrl = QUrl());
+
+    /* Chunk index of the image (chunk_index_url in os_list.json). With extracted caching enabled,
+       chunks other cached versions share with it are then taken from the cache instead of downloaded */
+    Q_INVOKABLE void setChunkIndexUrl(const QUrl &url);
+
+    /* Other URLs of the image (mirrors in os_list.json), and a metalink file listing more (metalink_url).
+       The fastest one is downloaded from, and the others are failed over to */
+    Q_INVOKABLE void setMirrors(const QStringList &urls, const QUrl &metalinkUrl = QUrl());
+
+    /* The image in other encodings (encodings in os_list.json: objects with url and image_download_size).
+       The one expected to be written the soonest is downloaded, see EncodingSelector */
+    Q_INVOKABLE void setEncodings(const QVariantList &encodings);
 
     /* Set bootloader hashes from os_list.json */
     Q_INVOKABLE void setBootloaderHashes(const QByteArray &tiboot3Hash, const QByteArray &tisplHash, const QByteArray &ubootHash);
@@ -50,6 +85,18 @@ public:
     /* Set device to write to */
     Q_INVOKABLE void setDst(const QString &device, quint64 deviceSize = 0);
 
+    /* Write the same image to another device at the same time */
+    Q_INVOKABLE void addDst(const QString &device, quint64 deviceSize = 0);
+
+    /* Number of devices to write to */
+    Q_INVOKABLE int dstCount();
+
+    /* Fill level (0 to 1) of the buffer between download and extraction of the write in progress */
+    Q_INVOKABLE double queueOccupancy();
+
+    /* Write latencies and device statistics of the last write, one report per device */
+    Q_INVOKABLE QVariantList writeHealth();
+
     /* Enable/disable verification */
     Q_INVOKABLE void setVerifyEnabled(bool verify);
 
@@ -59,14 +106,35 @@ public:
     /* Start writing */
     Q_INVOKABLE void startWrite();
 
+    /* Check that the destination drives hold the image, without writing to them */
+    Q_INVOKABLE void startVerify();
+
+    /* Copy a drive to the destination drives. Copies all of it if sourceSize is 0 */
+    Q_INVOKABLE void startClone(const QString &sourceDevice, quint64 sourceSize = 0);
+
     /* Start DFU operation */
     Q_INVOKABLE void startDfu();
 
+    /* USB paths of the boards connected in DFU mode */
+    Q_INVOKABLE QStringList getDfuDeviceList();
+
+    /* Link speed in Mbit/s of every DFU board, by USB path */
+    Q_INVOKABLE QVariantMap getDfuDeviceSpeeds();
+    /* Flash these boards at once. Empty for the first one found */
+    Q_INVOKABLE void setDfuBoards(const QStringList &paths);
+    /* Only send the bootloader over DFU, then write the eMMC of the boards as USB
+       mass storage (U-Boot ums) like any other drive */
+    Q_INVOKABLE void setDfuUmsEnabled(bool enabled);
+    /* Send the image over fastboot once the bootloader is up, if the boards' U-Boot offers it */
+    Q_INVOKABLE void setDfuFastbootEnabled(bool enabled);
+
     /* Cancel write */
     Q_INVOKABLE void cancelWrite();
 
     /* Return true if url is in our local disk cache */
     Q_INVOKABLE bool isCached(const QUrl &url, const QByteArray &sha256);
+    /* Downloads with a SHA256 go into the download cache */
+    bool cachingEnabled() const { return _cachingEnabled; }
 
     /* Start polling the list of available drives */
     Q_INVOKABLE void startDriveListPolling();
@@ -92,18 +160,108 @@ public:
     /* Set custom repository */
     Q_INVOKABLE void setCustomOsListUrl(const QUrl &url);
 
-    /* Get the cached OS list. This may be empty if network connectivity is not available. */
-    Q_INVOKABLE QByteArray getFilteredOSlist();
+    /* Get the cached OS list. This may be empty if network connectivity is not available.
+       Categories whose list has not been fetched yet still have their subitems_url.
+       QML gets it as a JavaScript object, there is no JSON text to parse */
+    Q_INVOKABLE QJsonObject getFilteredOSlist();
 
-    /** Begin the asynchronous fetch of the OS lists, and associated sublists. */
+    /** Begin the asynchronous fetch of the OS list, and the sublists of its categories. */
     Q_INVOKABLE void beginOSListFetch();
 
+    /** Load the OS list saved by the previous run, shown until the fetch revalidates it */
+    void loadOSListSnapshot();
+
+    /** Returns true if there is an OS list, fetched or from the snapshot */
+    Q_INVOKABLE bool hasOSList();
+
+    /** Fetch the sublist of a category that was opened, emits osSubListPrepared() when it is there */
+    Q_INVOKABLE void fetchOSSubList(const QString &url);
+
+    /** Get the fetched sublist of a category, filtered like getFilteredOSlist() */
+    Q_INVOKABLE QJsonArray getFilteredOSSubList(const QString &url);
+
     /** Set the HW filter, for a filtered view of the OS list */
     Q_INVOKABLE void setHWFilterList(const QByteArray &json, const bool &inclusive);
 
     /* Set custom cache file */
     void setCustomCacheFile(const QString &cacheFile, const QByteArray &sha256);
 
+    /* Enable/disable also caching the decompressed image, so writing it again needs no decompression */
+    void setExtractedCacheEnabled(bool extracted);
+
+    /* Keep decompressed images of up to this many bytes in total in memory, in front of the extracted cache. 0 to disable */
+    void setRamStageBudget(quint64 bytes);
+
+    /* Set number of parallel range requests used for downloading */
+    void setDownloadSegments(int segments);
+
+    /* Enable/disable downloading the pieces of a segmented download from several mirrors at once */
+    void setMultiSourceEnabled(bool enabled);
+
+    /* Enable/disable sharing the download cache with other stations on the LAN, and downloading from them, see PeerCache */
+    void setPeerCacheEnabled(bool enabled);
+
+    /* Enable/disable downloading the selected image into the cache before writing starts, see PrefetchThread */
+    void setPrefetchEnabled(bool enabled);
+
+    /* Download an image that is not selected into the cache the way the prefetch does, see CachePreseeder.
+       Returns false if it is cached already, does not fit or something else is downloading.
+       precacheFinished() is emitted once it stopped */
+    bool precacheImage(const QUrl &url, const QByteArray &sha256, quint64 downloadLen);
+    /* Stop it, keeping what is downloaded for resuming */
+    void cancelPrecache();
+
+    /* Set number of decompressed blocks that may be queued for writing */
+    void setWriteQueueDepth(int depth);
+
+    /* Set size of the blocks written to the device. 0 to follow the device's optimal I/O size */
+    void setWriteBlockSize(quint64 size);
+
+    /* Size all buffers and queues of the write pipeline to stay under this many bytes. 0 for no limit */
+    void setMemoryLimit(quint64 bytes);
+
+    /* Enable/disable bypassing the OS page cache when writing and verifying */
+    void setDirectIOEnabled(bool directIO);
+
+    /* Enable/disable use of io_uring where supported (Linux) */
+    void setIoUringEnabled(bool ioUring);
+
+    /* Enable/disable skipping all-zero blocks if the drive reads back as zeroes after discard */
+    void setSparseWriteEnabled(bool sparse);
+
+    /* Enable/disable emitting success() without waiting for the drive to be ejected */
+    void setAsyncEjectEnabled(bool async);
+
+    /* Enable/disable writing only the blocks that differ from what is on the drive (Linux, macOS) */
+    void setDeltaWriteEnabled(bool delta);
+
+    /* Enable/disable resuming an interrupted write of the same image to the same drive (default: enabled) */
+    void setResumeEnabled(bool resume);
+
+    /* Enable/disable checking that drives hold data up to the capacity they report before writing (default: enabled) */
+    void setCapacityProbeEnabled(bool probe);
+
+    /* Enable/disable reading back written data while the rest of the image is still being written (Linux) */
+    void setOverlappedVerifyEnabled(bool overlapped);
+
+    /* Enable/disable verifying per-chunk hashes on all cores, reporting which region does not match */
+    void setChunkedVerifyEnabled(bool chunked);
+
+    /* Hash per chunk used by chunked verify and verify-only jobs: SHA256 (default) or CRC32C */
+    void setChunkedVerifyAlgorithm(ChunkedHash::Algorithm algorithm);
+
+    /* Enable/disable tuning the block queue of the drives while they are written, and restoring it afterwards (Linux) */
+    void setQueueTuningEnabled(bool enabled);
+
+    /* Enable/disable customizing the boot partition while writing it, instead of afterwards */
+    void setInStreamCustomizationEnabled(bool enabled);
+
+    /* Enable/disable growing the last partition of the image to the end of the drive while writing */
+    void setExpandRootPartitionEnabled(bool enabled);
+
+    /* Enable/disable extracting multi-file archives to the FAT partition without mounting it (Linux) */
+    void setUserspaceExtractionEnabled(bool enabled);
+
     /* Utility function to open OS file dialog */
     Q_INVOKABLE void openFileDialog();
 
@@ -116,17 +274,27 @@ public:
     /* Returns true if run on embedded Linux platform */
     Q_INVOKABLE bool isEmbeddedMode();
 
+    /* Called from the Qt Quick render thread. In embedded mode it runs at a lower priority while writing */
+    void registerRenderThread();
+
     /* Mount any USB sticks that can contain source images under /media
        Returns true if at least one device was mounted */
     Q_INVOKABLE bool mountUsbSourceMedia();
 
-    /* Returns a json formatted list of the OS images found on USB stick */
-    Q_INVOKABLE QByteArray getUsbSourceOSlist();
+    /* Returns the list of the OS images found on USB stick */
+    Q_INVOKABLE QJsonArray getUsbSourceOSlist();
+
+    /* Folders with image files, indexed along with USB source media, see LocalImageIndex */
+    Q_INVOKABLE void setLocalImageFolders(const QStringList &folders);
+    Q_INVOKABLE QStringList localImageFolders();
+    /* Index new and changed image files in the background */
+    Q_INVOKABLE void indexLocalImages();
 
     /* Functions to collect information from computer running imager to make image customization easier */
     Q_INVOKABLE QString getDefaultPubKey();
     Q_INVOKABLE bool hasPubKey();
     Q_INVOKABLE bool hasSshKeyGen();
+    /* Runs ssh-keygen in the background, pubKeyGenerated() is emitted once it is done */
     Q_INVOKABLE void generatePubKey();
     Q_INVOKABLE QString getTimezone();
     Q_INVOKABLE QStringList getTimezoneList();
@@ -134,18 +302,28 @@ public:
     Q_INVOKABLE QStringList getKeymapLayoutList();
     Q_INVOKABLE QStringList getSerialPortList();
     Q_INVOKABLE QStringList getEthPortList();
+    /* List the ports again, for changes the system does not report */
+    Q_INVOKABLE void refreshPortList();
     Q_INVOKABLE QString getSSID();
     Q_INVOKABLE QString getPSK();
 
     Q_INVOKABLE bool getBoolSetting(const QString &key);
     Q_INVOKABLE void setSetting(const QString &key, const QVariant &value);
     Q_INVOKABLE void setImageCustomization(const QByteArray &config, const QByteArray &cmdline, const QByteArray &firstrun, const QByteArray &cloudinit, const QByteArray &cloudinitNetwork, const QByteArray &geminit);
+    /* Values that differ between the devices written at once, such as hostname or keys. {{name}} in the
+       customization is replaced by the value of name for the device, {{index}} (1 for the first device)
+       and {{device}} always are. Call after setDst() and addDst() */
+    Q_INVOKABLE void setTargetVariables(const QString &device, const QVariantMap &variables);
     Q_INVOKABLE void setSavedCustomizationSettings(const QVariantMap &map);
     Q_INVOKABLE QVariantMap getSavedCustomizationSettings();
     Q_INVOKABLE void clearSavedCustomizationSettings();
     Q_INVOKABLE bool hasSavedCustomizationSettings();
     Q_INVOKABLE bool imageSupportsCustomization();
 
+    /* Hash the user password and derive the WLAN PSK on the thread pool. secretsPrepared() is emitted
+       once all are done, crypt(), crypt6() and pbkdf2() then return right away. Empty arguments are skipped */
+    Q_INVOKABLE void prepareSecrets(const QByteArray &password, const QByteArray &psk, const QByteArray &ssid);
+    /* Results are remembered per input for the session, so repeated calls do not hash again */
     Q_INVOKABLE QString crypt(const QByteArray &password);
     Q_INVOKABLE QString crypt6(const QByteArray &password);
     Q_INVOKABLE QString pbkdf2(const QByteArray &psk, const QByteArray &ssid);
@@ -168,7 +346,14 @@ signals:
 
     void downloadProgress(QVariant dlnow, QVariant dltotal);
     void sendProgress(QVariant pos);
+    /* Map with device, bytesWritten, bytesPerSecond and spilled, when writing to several devices */
+    void targetProgress(QVariant progress);
+    /* Stages of the write, see DownloadThread::Phase */
+    void phaseStarted(QVariant phase);
+    void phaseFinished(QVariant phase, QVariant bytes, QVariant msecs);
     void verifyProgress(QVariant now, QVariant total);
+    /* Map with the phase, bytesPerSecond and eta (seconds, -1 if unknown) of the current phase */
+    void progressChanged(QVariant progress);
     void dfuProgress(QVariant percentage, QVariant statusMsg);
     void dfuAuthRequired();
     void error(QVariant msg);
@@ -179,13 +364,19 @@ signals:
     void networkOnline();
     void preparationStatusUpdate(QVariant msg);
     void osListPrepared();
+    void osSubListPrepared(QVariant url);
     void networkInfo(QVariant msg);
+    void portListChanged();
+    void secretsPrepared();
+    void pubKeyGenerated();
+    /* complete: downloaded to the end, not stopped or failed */
+    void precacheFinished(QByteArray sha256, quint64 bytes, bool complete);
 
 protected slots:
 
     void startProgressPolling();
     void stopProgressPolling();
-    void pollProgress();
+    void onProgressChanged();
     void pollNetwork();
     void syncTime();
     void onSuccess();
@@ -193,43 +384,159 @@ protected slots:
     void onFileSelected(QString filename);
     void onCancelled();
     void onCacheFileUpdated(QByteArray sha256);
+    void onExtractedCacheFileUpdated(QByteArray sha256);
+    void onRamStageCopied(QByteArray sha256, bool ok);
+    void onCacheEntryValidated(QByteArray sha256);
+    void onCacheEntryCorrupt(QByteArray sha256);
+    void onCacheEntryTranscoded(QByteArray sha256, QString fileName);
+    void onDeltaDownloadSuccess();
+    void onDeltaDownloadFailed(QString msg);
+    void onPrefetchFinished();
+    void onImageProbed(const QUrl &url, quint64 size, bool exact);
+    void onTargetError(QString msg);
     void onFinalizing();
     void onTimeSyncReply(QNetworkReply *reply);
     void onPreparationStatusUpdate(QString msg);
     void onDfuProgress(int percentage, QString statusMsg);
+    void onUmsStarted(int boards);
+    void onUmsDrivesChanged();
     void handleNetworkRequestFinished(QNetworkReply *data);
     void onSTPdetected();
 
 private:
-    // Recursively walk all the entries with subitems and, for any which
-    // refer to an external JSON list, fetch the list and put it in place.
-    void fillSubLists(QJsonArray &topLevel);
-    QNetworkAccessManager _networkManager;
+    /* Created by _networkAccessManager() on first use, not while the window is still coming up */
+    QNetworkAccessManager *_networkManager;
+    /* The OS list as fetched, the sublists are kept apart */
     QJsonDocument _completeOsList;
+    /* Lists fetched for subitems_url, by URL */
+    QHash<QString, QJsonArray> _osSubLists;
+    QSet<QString> _osSubListsRequested;
+    /* getFilteredOSlist() results, by device filter */
+    QHash<QByteArray, QJsonObject> _filteredOsListCache;
+    /* Response validators of the lists, sent back to revalidate them */
+    struct OsListValidators
+    {
+        QByteArray etag, lastModified;
+    };
+    QHash<QString, OsListValidators> _osListValidators;
+    /* Saves the lists a while after the last one arrived */
+    QTimer _osListSnapshotTimer;
     QJsonArray _deviceFilter;
+    /* Tags of _deviceFilter, to look up the devices of every OS list entry in */
+    QSet<QString> _deviceFilterTags;
     bool _deviceFilterIsInclusive;
 
+    /* The OS list with the fetched sublists in place */
+    QJsonArray _resolvedOsList(const QJsonArray &list) const;
+    /* Entry of the local image file, with what the OS list knows about it */
+    bool _lookupLocalImage(const QString &path, LocalImageIndex::Entry *entry);
+    void _requestOSSubList(const QString &url);
+    QNetworkAccessManager *_networkAccessManager();
+    void _setRevalidationHeaders(QNetworkRequest &request, const QString &url);
+    QString _osListSnapshotFileName() const;
+    void _saveOSListSnapshot();
+
+    /* crypt(), crypt6() and pbkdf2() results, done or in progress, by algorithm and hash of the input */
+    QHash<QByteArray, QFuture<QString>> _secrets;
+    QFuture<QString> _secret(const QByteArray &algorithm, const QByteArray &input, std::function<QString()> compute);
+
 protected:
-    QUrl _src, _repo;
+    QUrl _src, _repo, _bmapUrl, _chunkIndexUrl, _metalinkUrl;
+    QStringList _mirrors;
+    QList<EncodingSelector::Encoding> _encodings;
+    QFuture<void> _decodeBenchmark;
     QString _dst, _cacheFileName, _parentCategory, _osName, _currentLang, _currentLangcode, _currentKeyboard;
     QString _selSerPort, _selEthPort;
+    /* Devices written in addition to _dst */
+    QStringList _extraDsts, _targetErrors, _dfuBoards;
+    /* Device -> values of its {{variables}}, see setTargetVariables() */
+    QHash<QString, QVariantMap> _targetVariables;
     QString _imageTargetBoard;
     QByteArray _expectedHash, _expectedTiboot3Hash, _expectedTisplHash, _expectedUbootHash, _cachedFileHash, _cmdline, _config, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat;
     quint64 _downloadLen, _extrLen, _devLen, _dlnow, _verifynow;
     DriveListModel _drivelist;
     QQmlApplicationEngine *_engine;
-    QTimer _polltimer, _networkchecktimer;
+    QTimer _networkchecktimer;
+    /* Progress is polled at IMAGEWRITER_EMBEDDED_PROGRESS_INTERVAL instead in embedded mode */
+    QTimer _progressTimer;
+    /* Linux thread id of the render thread, 0 if rendering is done by the GUI thread, and its nice level before writing */
+    std::atomic<long> _renderThreadId;
+    int _renderThreadNice;
     PowerSaveBlocker _powersave;
     DownloadThread *_thread;
+    QList<FanoutTargetThread *> _fanoutTargets;
     bool _verifyEnabled, _multipleFilesInZip, _cachingEnabled, _embeddedMode, _online;
     QSettings _settings;
     QMap<QString,QString> _translations;
     bool _customCacheFile;
+    DownloadCache _downloadCache;
+    /* Second tier with decompressed images, keyed by extract hash as well */
+    DownloadCache _extractedCache;
+    bool _extractedCaching, _peerCache, _multiSource;
+    /* Tier in front of that one, in a memory backed directory. Images that fit the budget are decompressed into it,
+       and copied to the extracted cache behind it once complete */
+    DownloadCache _ramStage;
+    quint64 _ramStageBudget;
+    bool _stagingInRam;
+    /* Hashes extracted images that were not checked for a while, _scrubTimer after the last write.
+       _unvalidatedEntry: the write in progress reads that entry of the extracted cache, and hashes it */
+    CacheScrubber _cacheScrubber;
+    QTimer _scrubTimer;
+    QByteArray _unvalidatedEntry;
+    /* Recompresses xz, bzip2 and gzip downloads into seekable zstd, on the same idle timer */
+    CacheTranscoder _cacheTranscoder;
+    bool _transcodeCache;
+    /* Assembles the extracted image from chunks before writing, see setChunkIndexUrl() */
+    DeltaDownloadThread *_deltaThread;
+    bool _deltaAttempted;
+    /* Index the delta download got, stored with the extracted image once it is complete */
+    ChunkIndex _pendingChunkIndex;
+    /* Download of the selected image into the cache, started _prefetchTimer after selecting it.
+       _prefetchedBytes is how much of the cache file of each hash is on disk, for the next
+       thread using it. _writeAfterPrefetch: startWrite() is waiting for the prefetch to stop.
+       _precaching: the thread was started by precacheImage() instead, _precacheComplete: it got to the end */
+    PrefetchThread *_prefetchThread;
+    QByteArray _prefetchHash;
+    QHash<QByteArray, quint64> _prefetchedBytes;
+    QTimer _prefetchTimer;
+    bool _prefetch, _writeAfterPrefetch, _precaching, _precacheComplete;
+    /* DFU with UMS: boards still to show up as drives, and the drives there were before */
+    bool _dfuUms, _dfuFastboot;
+    int _umsBoards;
+    QStringList _umsKnownDrives;
+    QTimer _umsTimer;
+    /* Learns _extrLen of remote images the OS list has no size for. If the size it
+       found is not exact, _extrLenAtLeast is what the image needs at least */
+    ImageProbe *_imageProbe;
+    quint64 _extrLenAtLeast;
+    /* What is known of local image files, so they can be handled like OS list images */
+    LocalImageIndex _localImages;
+    DownloadStatsTelemetry _telemetry;
+    PortListWatcher _portWatcher;
     QTranslator *_trans;
+    int _writeQueueDepth, _downloadSegments;
+    quint64 _writeBlockSize, _memoryLimit;
+    bool _directIO, _ioUring, _sparseWrite, _deltaWrite, _resume, _overlappedVerify, _chunkedVerify, _inStreamCustomization, _userspaceExtraction, _queueTuning, _expandRoot, _capacityProbe, _asyncEject;
+    ChunkedHash::Algorithm _chunkAlgorithm;
 
     void _parseCompressedFile();
-    void _parseXZFile();
     void _startDfuThread();
+    QByteArray _customizationKey() const;
+    void _setupCaching();
+    bool _startDeltaDownload();
+    void _startPrefetch();
+    void _startPrefetchThread(const QUrl &url, const QByteArray &sha256, quint64 downloadLen);
+    QList<QByteArray> _encodedMirrors() const;
+    /* Lower the priority of the render thread while writing in embedded mode, and restore it */
+    void _setRenderThreadLowPriority(bool low);
+    /* Switch _src to the encoding of setEncodings() that is expected to be written the soonest */
+    void _chooseEncoding();
+    void _setupExtractedCaching();
+    void _copyRamStageToExtractedCache(const QByteArray &sha256);
+    void _startCacheScrub();
+    void _startCacheTranscode();
+    void _startFanoutTargets(const MemoryBudget &budget, bool fromImage, const QString &verifySource = QString());
+    bool _setTargetCustomization(DownloadThread *thread, const QString &device, int index);
     QString _pubKeyFileName();
     QString _privKeyFileName();
     QString _sshKeyDir();
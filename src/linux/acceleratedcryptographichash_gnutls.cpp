@@ -6,10 +6,12 @@
  */
 
 #include "acceleratedcryptographichash.h"
+#include "sha256native.h"
 #include "gnutls/crypto.h"
 
 struct AcceleratedCryptographicHash::impl {
     explicit impl(QCryptographicHash::Algorithm method)
+        : _finished(false)
     {
         if (method != QCryptographicHash::Sha256)
             throw std::runtime_error("Only sha256 implemented");
@@ -23,7 +25,7 @@ struct AcceleratedCryptographicHash::impl {
         gnutls_hash_deinit(_sha256, NULL);
     }
 
-    void addData(const char *data, int length)
+    void addData(const char *data, size_t length)
     {
         gnutls_hash(_sha256, data, length);
     }
@@ -35,26 +37,42 @@ struct AcceleratedCryptographicHash::impl {
 
     QByteArray result()
     {
-        unsigned char binhash[gnutls_hash_get_len(GNUTLS_DIG_SHA256)];
-        gnutls_hash_output(_sha256, binhash);
-        return QByteArray((char *) binhash, sizeof binhash);
+        /* gnutls_hash_output() resets the state, so remember the result */
+        if (!_finished)
+        {
+            unsigned char binhash[gnutls_hash_get_len(GNUTLS_DIG_SHA256)];
+            gnutls_hash_output(_sha256, binhash);
+            _result = QByteArray((char *) binhash, sizeof binhash);
+            _finished = true;
+        }
+        return _result;
     }
 
 private:
     gnutls_hash_hd_t _sha256;
+    QByteArray _result;
+    bool _finished;
 };
 
 AcceleratedCryptographicHash::AcceleratedCryptographicHash(QCryptographicHash::Algorithm method)
-    : p_Impl(std::make_unique<impl>(method)) {}
+{
+    if (method == QCryptographicHash::Sha256 && nativeImplementation())
+        p_Native = std::make_unique<Sha256Native>();
+    else
+        p_Impl = std::make_unique<impl>(method);
+}
 
 AcceleratedCryptographicHash::~AcceleratedCryptographicHash() = default;
 
-void AcceleratedCryptographicHash::addData(const char *data, int length) {
-    p_Impl->addData(data, length);
+void AcceleratedCryptographicHash::addData(const char *data, size_t length) {
+    if (p_Native)
+        p_Native->addData(data, length);
+    else
+        p_Impl->addData(data, length);
 }
 void AcceleratedCryptographicHash::addData(const QByteArray &data) {
-    p_Impl->addData(data);
+    addData(data.constData(), data.size());
 }
 QByteArray AcceleratedCryptographicHash::result() {
-    return p_Impl->result();
+    return p_Native ? p_Native->result() : p_Impl->result();
 }
@@ -0,0 +1,299 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "compositewriter.h"
+#include "loopdevice.h"
+#include "imagewriter.h"
+#include "blockdevice.h"
+#include "dependencies/mountutils/src/mountutils.hpp"
+#ifndef QT_NO_DBUS
+#include "udisks2api.h"
+#endif
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSettings>
+#include <QTimer>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+CompositeWriter::CompositeWriter(std::function<void(ImageWriter *)> configure, QObject *parent)
+    : QObject(parent), _configure(configure), _deviceSize(0), _current(-1), _eject(false), _writer(nullptr)
+{
+}
+
+CompositeWriter::~CompositeWriter()
+{
+    /* ImageWriter waits for its thread when deleted, the loop devices go after that */
+    delete _writer;
+    _loops.clear();
+}
+
+bool CompositeWriter::loadParts(const QString &filename, QString &errorMsg)
+{
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        errorMsg = tr("Cannot open %1").arg(filename);
+        return false;
+    }
+
+    QJsonParseError parseError;
+    QJsonDocument doc = QJsonDocument::fromJson(f.readAll(), &parseError);
+    if (!doc.isObject())
+    {
+        errorMsg = tr("Part list is not a JSON object: %1").arg(parseError.errorString());
+        return false;
+    }
+
+    const QJsonArray parts = doc.object()["parts"].toArray();
+    for (const auto &part : parts)
+    {
+        QJsonObject o = part.toObject();
+        Part p;
+        p.src = o["src"].toString();
+        p.offset = o["offset"].toInteger(-1);
+        p.size = o["size"].toInteger();
+        p.sha256 = o["sha256"].toString().toLatin1().toLower();
+        p.bmap = o["bmap"].toString();
+
+        if (p.src.isEmpty() || o["offset"].toInteger(-1) < 0 || o["size"].toInteger() < 0)
+        {
+            errorMsg = tr("Each part needs a src and an offset");
+            return false;
+        }
+        /* Loop devices have 512 byte sectors */
+        if (p.offset % 512 || p.size % 512)
+        {
+            errorMsg = tr("Offset and size of %1 are not a multiple of 512 bytes").arg(p.src);
+            return false;
+        }
+        if (!p.sha256.isEmpty() && p.sha256.length() != 64)
+        {
+            errorMsg = tr("sha256 of %1 is not a SHA256 hash").arg(p.src);
+            return false;
+        }
+        _parts.append(p);
+    }
+
+    if (_parts.isEmpty())
+    {
+        errorMsg = tr("Part list has no parts");
+        return false;
+    }
+
+    std::sort(_parts.begin(), _parts.end(), [](const Part &a, const Part &b) {
+        return a.offset < b.offset;
+    });
+    for (int i = 1; i < _parts.size(); i++)
+    {
+        const Part &prev = _parts[i-1];
+        if (_parts[i].offset == prev.offset || (prev.size && prev.offset + prev.size > _parts[i].offset))
+        {
+            errorMsg = tr("%1 overlaps %2").arg(prev.src, _parts[i].src);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool CompositeWriter::setDevices(const QStringList &devices, QString &errorMsg)
+{
+    _deviceSize = 0;
+
+    /* Ranges are the same on all drives, so they have to fit on the smallest */
+    for (const QString &device : devices)
+    {
+        BlockDeviceFile f(device);
+        if (!f.open(QIODevice::ReadOnly))
+        {
+            errorMsg = tr("Cannot open storage device '%1'.").arg(device);
+            return false;
+        }
+        BlockDevice *blockDevice = BlockDevice::create(&f);
+        quint64 size = blockDevice->size();
+        delete blockDevice;
+
+        if (!size)
+        {
+            errorMsg = tr("Cannot tell the size of %1").arg(device);
+            return false;
+        }
+        if (!_deviceSize || size < _deviceSize)
+            _deviceSize = size;
+    }
+
+    const Part &last = _parts.last();
+    if (last.offset + qMax(last.size, (quint64) 512) > _deviceSize)
+    {
+        errorMsg = tr("%1 does not fit on the drive").arg(last.src);
+        return false;
+    }
+
+    _devices = devices;
+    return true;
+}
+
+int CompositeWriter::partCount() const
+{
+    return _parts.size();
+}
+
+quint64 CompositeWriter::_rangeSize(int index) const
+{
+    const Part &part = _parts[index];
+    if (part.size)
+        return part.size;
+    if (index+1 < _parts.size())
+        return _parts[index+1].offset - part.offset;
+
+    return _deviceSize - part.offset;
+}
+
+void CompositeWriter::start()
+{
+    /* The parts are written to loop devices, which know nothing of what is mounted from the drive */
+    for (const QString &device : std::as_const(_devices))
+    {
+        qDebug() << "Unmounting:" << device;
+        unmount_disk(device.toLocal8Bit().constData());
+    }
+
+    /* Ejecting is done once for the drive at the end, not for each part. Set up by the configure callback */
+    _eject = QSettings().value("eject", true).toBool();
+    _current = -1;
+    _next();
+}
+
+void CompositeWriter::_next()
+{
+    _current++;
+    if (_current == _parts.size())
+    {
+        _finish(0);
+        return;
+    }
+
+    const Part &part = _parts[_current];
+    quint64 rangeSize = _rangeSize(_current);
+    /* The last part goes up to the end of each drive, if they differ in size */
+    quint64 sizeLimit = (part.size || _current+1 < _parts.size()) ? rangeSize : 0;
+    for (const QString &device : std::as_const(_devices))
+    {
+        auto loop = std::make_shared<LoopDevice>();
+        if (!loop->attach(device, part.offset, sizeLimit))
+        {
+            emit error(_current, loop->errorString());
+            _finish(1);
+            return;
+        }
+        _loops.append(loop);
+    }
+
+    _writer = new ImageWriter(this);
+    _configure(_writer);
+    /* Per part, all of these would act on the range as if it were a drive */
+    _writer->setSetting("eject", false);
+    _writer->setCapacityProbeEnabled(false);
+    _writer->setResumeEnabled(false);
+    _writer->setExpandRootPartitionEnabled(false);
+
+    QUrl bmapUrl;
+    if (part.bmap.startsWith("http:", Qt::CaseInsensitive) || part.bmap.startsWith("https:", Qt::CaseInsensitive))
+        bmapUrl = QUrl(part.bmap);
+    else if (!part.bmap.isEmpty())
+        bmapUrl = QUrl::fromLocalFile(QFileInfo(part.bmap).absoluteFilePath());
+
+    if (part.src.startsWith("http:", Qt::CaseInsensitive) || part.src.startsWith("https:", Qt::CaseInsensitive))
+    {
+        _writer->setSrc(QUrl(part.src), 0, 0, part.sha256, false, "", "", "", bmapUrl);
+    }
+    else
+    {
+        QFileInfo fi(part.src);
+        if (!fi.isFile())
+        {
+            _partDone(false, tr("Source file %1 does not exist or is not a regular file").arg(part.src));
+            return;
+        }
+        _writer->setSrc(QUrl::fromLocalFile(fi.absoluteFilePath()), fi.size(), 0, part.sha256, false, "", "", "", bmapUrl);
+    }
+
+    /* With the size of the range, so a part that does not fit in it is refused */
+    _writer->setDst(_loops.first()->device(), rangeSize);
+    for (int i = 1; i < _loops.size(); i++)
+        _writer->addDst(_loops[i]->device(), rangeSize);
+
+    connect(_writer, &ImageWriter::success, this, [this]() {
+        _partDone(true);
+    });
+    connect(_writer, &ImageWriter::error, this, [this](QVariant msg) {
+        _partDone(false, msg.toString());
+    });
+
+    qDebug() << "Writing part" << _current+1 << "of" << _parts.size() << ":" << part.src << "at offset" << part.offset;
+    emit partStarted(_current, part.src, _writer);
+    _writer->startWrite();
+}
+
+void CompositeWriter::_partDone(bool success, const QString &msg)
+{
+    if (_writer)
+    {
+        _writer->disconnect(this);
+        _writer->deleteLater();
+        _writer = nullptr;
+    }
+    /* Detached once the write thread has closed them */
+    _loops.clear();
+
+    if (!success)
+    {
+        emit error(_current, msg);
+        _finish(1);
+        return;
+    }
+
+    emit partFinished(_current);
+    /* Not from within the signal handler of the ImageWriter that just finished */
+    QTimer::singleShot(0, this, &CompositeWriter::_next);
+}
+
+void CompositeWriter::_finish(int exitCode)
+{
+    _loops.clear();
+    QSettings().setValue("eject", _eject);
+
+    for (const QString &device : std::as_const(_devices))
+    {
+        QFile f(device);
+        if (f.open(QIODevice::ReadOnly))
+        {
+            /* The partition table came in with one of the parts, the kernel still has the old one */
+            if (::ioctl(f.handle(), BLKRRPART) == -1)
+                qDebug() << "BLKRRPART failed on" << device << ":" << strerror(errno);
+            f.close();
+        }
+
+        if (exitCode == 0 && _eject)
+        {
+            eject_disk(device.toLocal8Bit().constData());
+#ifndef QT_NO_DBUS
+            UDisks2Api udisks;
+            udisks.ejectDrive(device);
+#endif
+        }
+    }
+
+    emit finished(exitCode);
+}
@@ -0,0 +1,90 @@
+#ifndef COMPOSITEWRITER_H
+#define COMPOSITEWRITER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QObject>
+#include <QList>
+#include <QStringList>
+#include <QUrl>
+#include <functional>
+#include <memory>
+
+class ImageWriter;
+class LoopDevice;
+
+/*
+ * Writes a drive assembled from several images at fixed offsets, e.g. a
+ * bootloader, a boot partition and a root filesystem that are built and
+ * published separately, without putting the combined image together first
+ *
+ * The parts are listed in a JSON file:
+ *
+ *   {"parts": [{"src": "<file or URL>", "offset": <bytes>, "size": <bytes>,
+ *               "sha256": "<hash of the extracted part>", "bmap": "<bmap file/URL>"}, ...]}
+ *
+ * Only src and offset are required. Each part is written by an ImageWriter
+ * of its own, set up by the configure callback like any other write, to a
+ * loop device mapping its range of the destination drives. So it is
+ * downloaded, decompressed (any format the normal write takes), cached,
+ * written and verified as if it were a whole image, and cannot write
+ * outside its range. The range ends at offset + size, or if size is not
+ * given at the next part or the end of the drive. Ranges of the drive no
+ * part covers are left untouched, but the part of a range past the end of
+ * the image is cleared like the rest of a drive is on a normal write.
+ *
+ * Parts are written one after another, in order of offset. The kernel is
+ * made to read the partition table again at the end.
+ */
+class CompositeWriter : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CompositeWriter(std::function<void(ImageWriter *)> configure, QObject *parent = nullptr);
+    virtual ~CompositeWriter();
+
+    /* Return false with errorMsg set if the parts cannot be read or do not fit */
+    bool loadParts(const QString &filename, QString &errorMsg);
+    bool setDevices(const QStringList &devices, QString &errorMsg);
+    int partCount() const;
+
+public slots:
+    void start();
+
+signals:
+    /* Connect to the progress signals of writer here. It is deleted after the part */
+    void partStarted(int index, QString src, ImageWriter *writer);
+    void partFinished(int index);
+    /* Failed writing part index. Parts after it are not written */
+    void error(int index, QString msg);
+    void finished(int exitCode);
+
+protected:
+    struct Part
+    {
+        QString src;
+        quint64 offset, size;
+        QByteArray sha256;
+        QString bmap;
+    };
+
+    std::function<void(ImageWriter *)> _configure;
+    QList<Part> _parts;
+    QStringList _devices;
+    quint64 _deviceSize;
+    int _current;
+    bool _eject;
+    ImageWriter *_writer;
+    QList<std::shared_ptr<LoopDevice>> _loops;
+
+    /* Length of the range of the drive part index is written to */
+    quint64 _rangeSize(int index) const;
+    void _next();
+    void _partDone(bool success, const QString &msg = QString());
+    void _finish(int exitCode);
+};
+
+#endif // COMPOSITEWRITER_H
@@ -0,0 +1,211 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "iouring.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+static inline int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) ::syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int sys_io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    return (int) ::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static inline int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nrArgs)
+{
+    return (int) ::syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+IoUring::IoUring()
+    : _fd(-1), _entries(0), _toSubmit(0), _inFlight(0), _buffersRegistered(false),
+      _sqRing(MAP_FAILED), _cqRing(MAP_FAILED), _sqRingSize(0), _cqRingSize(0), _sqesSize(0), _sqes((struct io_uring_sqe *) MAP_FAILED)
+{
+}
+
+IoUring::~IoUring()
+{
+    _cleanup();
+}
+
+void IoUring::_cleanup()
+{
+    if (_sqes != MAP_FAILED)
+        ::munmap(_sqes, _sqesSize);
+    if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+        ::munmap(_cqRing, _cqRingSize);
+    if (_sqRing != MAP_FAILED)
+        ::munmap(_sqRing, _sqRingSize);
+    if (_fd != -1)
+        ::close(_fd);
+
+    _sqes = (struct io_uring_sqe *) MAP_FAILED;
+    _sqRing = _cqRing = MAP_FAILED;
+    _fd = -1;
+    _buffersRegistered = false;
+}
+
+bool IoUring::init(unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    _fd = sys_io_uring_setup(entries, &p);
+    if (_fd < 0)
+    {
+        _fd = -1;
+        return false;
+    }
+
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        _sqRingSize = _cqRingSize = qMax(_sqRingSize, _cqRingSize);
+
+    _sqRing = ::mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED)
+    {
+        _cleanup();
+        return false;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        _cqRing = _sqRing;
+    }
+    else
+    {
+        _cqRing = ::mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if (_cqRing == MAP_FAILED)
+        {
+            _cleanup();
+            return false;
+        }
+    }
+
+    _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    _sqes = (struct io_uring_sqe *) ::mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (_sqes == MAP_FAILED)
+    {
+        _cleanup();
+        return false;
+    }
+
+    char *sq = (char *) _sqRing;
+    char *cq = (char *) _cqRing;
+    _sqHead  = (unsigned *) (sq + p.sq_off.head);
+    _sqTail  = (unsigned *) (sq + p.sq_off.tail);
+    _sqMask  = (unsigned *) (sq + p.sq_off.ring_mask);
+    _sqArray = (unsigned *) (sq + p.sq_off.array);
+    _cqHead  = (unsigned *) (cq + p.cq_off.head);
+    _cqTail  = (unsigned *) (cq + p.cq_off.tail);
+    _cqMask  = (unsigned *) (cq + p.cq_off.ring_mask);
+    _cqes    = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    _entries = p.sq_entries;
+
+    return true;
+}
+
+bool IoUring::isInitialized() const
+{
+    return _fd != -1;
+}
+
+bool IoUring::registerBuffers(const struct iovec *iov, unsigned count)
+{
+    if (_fd == -1)
+        return false;
+
+    _buffersRegistered = (sys_io_uring_register(_fd, IORING_REGISTER_BUFFERS, iov, count) == 0);
+    return _buffersRegistered;
+}
+
+bool IoUring::_queue(int opcode, int fd, const void *buf, size_t len, quint64 offset, quint64 userData, int bufIndex)
+{
+    if (_fd == -1)
+        return false;
+
+    unsigned tail = *_sqTail;
+    unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    if (tail - head >= _entries)
+        return false;
+
+    unsigned idx = tail & *_sqMask;
+    struct io_uring_sqe *sqe = &_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    if (bufIndex >= 0 && _buffersRegistered)
+    {
+        sqe->opcode = (opcode == IORING_OP_WRITE) ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = bufIndex;
+    }
+    else
+    {
+        sqe->opcode = opcode;
+    }
+    sqe->fd = fd;
+    sqe->addr = (quint64) (quintptr) buf;
+    sqe->len = (unsigned) len;
+    sqe->off = offset;
+    sqe->user_data = userData;
+
+    _sqArray[idx] = idx;
+    __atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+    _toSubmit++;
+    _inFlight++;
+
+    return true;
+}
+
+bool IoUring::queueWrite(int fd, const char *buf, size_t len, quint64 offset, quint64 userData, int bufIndex)
+{
+    return _queue(IORING_OP_WRITE, fd, buf, len, offset, userData, bufIndex);
+}
+
+bool IoUring::queueRead(int fd, char *buf, size_t len, quint64 offset, quint64 userData, int bufIndex)
+{
+    return _queue(IORING_OP_READ, fd, buf, len, offset, userData, bufIndex);
+}
+
+bool IoUring::waitCompletion(quint64 *userData, int *res)
+{
+    if (_fd == -1 || !_inFlight)
+        return false;
+
+    while (true)
+    {
+        unsigned head = *_cqHead;
+        if (head != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &_cqes[head & *_cqMask];
+            *userData = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(_cqHead, head + 1, __ATOMIC_RELEASE);
+            _inFlight--;
+            return true;
+        }
+
+        int ret = sys_io_uring_enter(_fd, _toSubmit, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return false;
+        }
+        _toSubmit -= qMin((unsigned) ret, _toSubmit);
+    }
+}
+
+unsigned IoUring::inFlight() const
+{
+    return _inFlight;
+}
@@ -0,0 +1,62 @@
+#ifndef IOURING_H
+#define IOURING_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <sys/uio.h>
+
+/*
+ * Minimal io_uring engine using the raw system calls, so no liburing is needed
+ *
+ * Used to keep several writes (or verify reads) to a block device in flight
+ * at the same time. init() fails on kernels without io_uring support
+ * (or where it is disabled by policy), in which case callers should fall back
+ * to regular read()/write()
+ */
+class IoUring
+{
+public:
+    IoUring();
+    ~IoUring();
+
+    /* Set up submission and completion queue. Returns false if unsupported */
+    bool init(unsigned entries);
+    bool isInitialized() const;
+
+    /* Register buffers for use with the fixed buffer variants.
+       bufIndex arguments refer to the order of the iovecs passed here */
+    bool registerBuffers(const struct iovec *iov, unsigned count);
+
+    /* Queue request. Use bufIndex -1 for buffers that are not registered.
+       Returns false if the submission queue is full */
+    bool queueWrite(int fd, const char *buf, size_t len, quint64 offset, quint64 userData, int bufIndex = -1);
+    bool queueRead(int fd, char *buf, size_t len, quint64 offset, quint64 userData, int bufIndex = -1);
+
+    /* Submit queued requests and wait for at least one completion.
+       res is bytes transferred or -errno. Returns false on io_uring failure */
+    bool waitCompletion(quint64 *userData, int *res);
+
+    /* Number of requests queued or submitted that did not complete yet */
+    unsigned inFlight() const;
+
+protected:
+    int _fd;
+    unsigned _entries, _toSubmit, _inFlight;
+    bool _buffersRegistered;
+
+    void *_sqRing, *_cqRing;
+    size_t _sqRingSize, _cqRingSize, _sqesSize;
+    struct io_uring_sqe *_sqes;
+    unsigned *_sqHead, *_sqTail, *_sqMask, *_sqArray;
+    unsigned *_cqHead, *_cqTail, *_cqMask;
+    struct io_uring_cqe *_cqes;
+
+    bool _queue(int opcode, int fd, const void *buf, size_t len, quint64 offset, quint64 userData, int bufIndex);
+    void _cleanup();
+};
+
+#endif // IOURING_H
@@ -0,0 +1,340 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "linkcontrol.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <linux/ethtool.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+/* Link state is checked again at least this often, in case the driver
+   does not send a message for every change */
+#define LINK_RECHECK_INTERVAL  250
+#define NETLINK_REPLY_TIMEOUT  1000
+
+LinkControl::LinkControl(const QByteArray &ifname)
+    : _ifname(ifname), _ifindex(0), _ioctlFd(-1), _rtFd(-1), _linkFd(-1), _seq(0)
+{
+}
+
+LinkControl::~LinkControl()
+{
+    if (_ioctlFd != -1)
+        ::close(_ioctlFd);
+    if (_rtFd != -1)
+        ::close(_rtFd);
+    if (_linkFd != -1)
+        ::close(_linkFd);
+}
+
+bool LinkControl::open()
+{
+    _ifindex = if_nametoindex(_ifname.constData());
+    if (!_ifindex)
+    {
+        qDebug() << "No such interface:" << _ifname;
+        return false;
+    }
+
+    _ioctlFd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    _rtFd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    _linkFd = ::socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+    if (_ioctlFd == -1 || _rtFd == -1 || _linkFd == -1)
+    {
+        qDebug() << "Error creating sockets:" << strerror(errno);
+        return false;
+    }
+
+    /* Requests and their acks go over _rtFd, link announcements arrive on _linkFd */
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = RTMGRP_LINK;
+    if (::bind(_linkFd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        qDebug() << "Error subscribing to link changes:" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool LinkControl::setUp(bool up)
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, _ifname.constData(), IFNAMSIZ-1);
+
+    if (::ioctl(_ioctlFd, SIOCGIFFLAGS, &ifr) == -1)
+    {
+        qDebug() << "SIOCGIFFLAGS failed:" << strerror(errno);
+        return false;
+    }
+    if (up)
+        ifr.ifr_flags |= IFF_UP;
+    else
+        ifr.ifr_flags &= ~IFF_UP;
+    if (::ioctl(_ioctlFd, SIOCSIFFLAGS, &ifr) == -1)
+    {
+        qDebug() << "Setting" << _ifname << (up ? "up" : "down") << "failed:" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool LinkControl::hasCarrier()
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, _ifname.constData(), IFNAMSIZ-1);
+
+    if (::ioctl(_ioctlFd, SIOCGIFFLAGS, &ifr) == -1)
+        return false;
+
+    return (ifr.ifr_flags & IFF_UP) && (ifr.ifr_flags & IFF_RUNNING);
+}
+
+int LinkControl::mtu()
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, _ifname.constData(), IFNAMSIZ-1);
+
+    if (::ioctl(_ioctlFd, SIOCGIFMTU, &ifr) == -1)
+        return 0;
+
+    return ifr.ifr_mtu;
+}
+
+bool LinkControl::setMtu(int mtu)
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, _ifname.constData(), IFNAMSIZ-1);
+    ifr.ifr_mtu = mtu;
+
+    if (::ioctl(_ioctlFd, SIOCSIFMTU, &ifr) == -1)
+    {
+        /* EINVAL if the adapter does not do frames this large */
+        qDebug() << "Setting MTU of" << _ifname << "to" << mtu << "failed:" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+bool LinkControl::_ethtool(void *cmd)
+{
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, _ifname.constData(), IFNAMSIZ-1);
+    ifr.ifr_data = (char *) cmd;
+
+    return ::ioctl(_ioctlFd, SIOCETHTOOL, &ifr) != -1;
+}
+
+/* The legacy ETHTOOL_GSET/SSET interface is still handled by all drivers
+   through the link ksettings compatibility code, and covers the
+   10/100/1000 Mbit modes we use */
+bool LinkControl::setLinkMode(int speed, bool fullDuplex, bool autoneg)
+{
+    struct ethtool_cmd ecmd;
+    memset(&ecmd, 0, sizeof(ecmd));
+    ecmd.cmd = ETHTOOL_GSET;
+    if (!_ethtool(&ecmd))
+    {
+        qDebug() << "ETHTOOL_GSET failed on" << _ifname << ":" << strerror(errno);
+        return false;
+    }
+
+    if (autoneg)
+    {
+        quint32 modes;
+
+        switch (speed)
+        {
+        case 0:
+            modes = ecmd.supported;
+            break;
+        case 10:
+            modes = fullDuplex ? ADVERTISED_10baseT_Full : ADVERTISED_10baseT_Half;
+            break;
+        case 100:
+            modes = fullDuplex ? ADVERTISED_100baseT_Full : ADVERTISED_100baseT_Half;
+            break;
+        case 1000:
+            modes = fullDuplex ? ADVERTISED_1000baseT_Full : ADVERTISED_1000baseT_Half;
+            break;
+        default:
+            qDebug() << "Unsupported link speed" << speed;
+            return false;
+        }
+
+        if (!(modes & ecmd.supported))
+        {
+            qDebug() << _ifname << "does not support" << speed << "Mbit/s";
+            return false;
+        }
+        ecmd.autoneg = AUTONEG_ENABLE;
+        ecmd.advertising = modes & ecmd.supported;
+    }
+    else
+    {
+        ecmd.autoneg = AUTONEG_DISABLE;
+        ethtool_cmd_speed_set(&ecmd, speed);
+        ecmd.duplex = fullDuplex ? DUPLEX_FULL : DUPLEX_HALF;
+    }
+
+    ecmd.cmd = ETHTOOL_SSET;
+    if (!_ethtool(&ecmd))
+    {
+        qDebug() << "ETHTOOL_SSET failed on" << _ifname << ":" << strerror(errno);
+        return false;
+    }
+
+    return true;
+}
+
+int LinkControl::speed()
+{
+    if (!hasCarrier())
+        return 0;
+
+    struct ethtool_cmd ecmd;
+    memset(&ecmd, 0, sizeof(ecmd));
+    ecmd.cmd = ETHTOOL_GSET;
+    if (!_ethtool(&ecmd))
+        return 0;
+
+    quint32 s = ethtool_cmd_speed(&ecmd);
+    if (s == (quint32) SPEED_UNKNOWN)
+        return 0;
+
+    return s;
+}
+
+bool LinkControl::_changeAddress(int type, int flags, quint32 ip, int prefixLen)
+{
+    struct {
+        struct nlmsghdr nh;
+        struct ifaddrmsg ifa;
+        char attrs[2 * RTA_SPACE(sizeof(quint32))];
+    } req;
+    memset(&req, 0, sizeof(req));
+
+    req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    req.nh.nlmsg_seq = ++_seq;
+    req.ifa.ifa_family = AF_INET;
+    req.ifa.ifa_prefixlen = prefixLen;
+    req.ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+    req.ifa.ifa_index = _ifindex;
+
+    quint32 be = htonl(ip);
+    for (unsigned short attrType : {IFA_LOCAL, IFA_ADDRESS})
+    {
+        struct rtattr *rta = (struct rtattr *) (((char *) &req) + NLMSG_ALIGN(req.nh.nlmsg_len));
+        rta->rta_type = attrType;
+        rta->rta_len = RTA_LENGTH(sizeof(be));
+        memcpy(RTA_DATA(rta), &be, sizeof(be));
+        req.nh.nlmsg_len = NLMSG_ALIGN(req.nh.nlmsg_len) + RTA_SPACE(sizeof(be));
+    }
+
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+    if (::sendto(_rtFd, &req, req.nh.nlmsg_len, 0, (struct sockaddr *) &kernel, sizeof(kernel)) == -1)
+    {
+        qDebug() << "Error sending rtnetlink request:" << strerror(errno);
+        return false;
+    }
+
+    char buf[4096];
+    while (true)
+    {
+        struct pollfd pfd = {_rtFd, POLLIN, 0};
+        if (::poll(&pfd, 1, NETLINK_REPLY_TIMEOUT) <= 0)
+        {
+            qDebug() << "No reply to rtnetlink request";
+            return false;
+        }
+
+        int len = ::recv(_rtFd, buf, sizeof(buf), 0);
+        if (len == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            qDebug() << "Error reading rtnetlink reply:" << strerror(errno);
+            return false;
+        }
+
+        for (struct nlmsghdr *nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, (unsigned) len); nh = NLMSG_NEXT(nh, len))
+        {
+            if (nh->nlmsg_seq != _seq || nh->nlmsg_type != NLMSG_ERROR)
+                continue;
+
+            int err = -((struct nlmsgerr *) NLMSG_DATA(nh))->error;
+            /* Already there, or already gone, is what we wanted */
+            if (err == 0 || (type == RTM_NEWADDR && err == EEXIST) || (type == RTM_DELADDR && err == EADDRNOTAVAIL))
+                return true;
+
+            qDebug() << "Changing address of" << _ifname << "failed:" << strerror(err);
+            return false;
+        }
+    }
+}
+
+bool LinkControl::addAddress(quint32 ip, int prefixLen)
+{
+    return _changeAddress(RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, ip, prefixLen);
+}
+
+bool LinkControl::removeAddress(quint32 ip, int prefixLen)
+{
+    return _changeAddress(RTM_DELADDR, 0, ip, prefixLen);
+}
+
+void LinkControl::_drainLinkEvents()
+{
+    char buf[4096];
+
+    while (::recv(_linkFd, buf, sizeof(buf), 0) > 0 || errno == EINTR)
+    {
+    }
+}
+
+bool LinkControl::waitForLink(int speed, int msecs)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    while (true)
+    {
+        /* Events only wake us up, the state itself is always queried,
+           so a missed or coalesced RTM_NEWLINK does no harm */
+        _drainLinkEvents();
+        if (hasCarrier() && (!speed || this->speed() == speed))
+            return true;
+
+        int remaining = msecs - timer.elapsed();
+        if (remaining <= 0)
+            return false;
+
+        struct pollfd pfd = {_linkFd, POLLIN, 0};
+        ::poll(&pfd, 1, qMin(remaining, LINK_RECHECK_INTERVAL));
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef LINKCONTROL_H
+#define LINKCONTROL_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <QByteArray>
+
+/*
+ * Configures an ethernet interface directly through the kernel, instead of
+ * running ethtool and ip: SIOCETHTOOL for speed/duplex/autonegotiation,
+ * SIOCSIFFLAGS for up/down, SIOCSIFMTU for the MTU and rtnetlink for the
+ * address.
+ *
+ * Needs CAP_NET_ADMIN, which simpbootp has as it is started through pkexec.
+ * Link changes are watched on an rtnetlink socket subscribed to RTMGRP_LINK,
+ * so waiting for the link to come back after a renegotiation takes as long
+ * as the renegotiation, not a fixed delay.
+ */
+class LinkControl
+{
+public:
+    LinkControl(const QByteArray &ifname);
+    ~LinkControl();
+
+    /* Returns false if the interface does not exist */
+    bool open();
+
+    bool setUp(bool up);
+    bool hasCarrier();
+
+    /* speed in Mbit/s. With autoneg only that speed and duplex is advertised,
+       speed 0 with autoneg advertises all modes the interface supports */
+    bool setLinkMode(int speed, bool fullDuplex, bool autoneg);
+
+    /* Negotiated speed in Mbit/s, 0 if there is no link */
+    int speed();
+
+    /* MTU in bytes, 0 if it cannot be read. Many drivers reset the link to change it */
+    int mtu();
+    bool setMtu(int mtu);
+
+    /* ip in host byte order */
+    bool addAddress(quint32 ip, int prefixLen);
+    bool removeAddress(quint32 ip, int prefixLen);
+
+    /* Waits until the link is up, at the given speed unless it is 0.
+       Returns false on timeout */
+    bool waitForLink(int speed, int msecs);
+
+protected:
+    QByteArray _ifname;
+    int _ifindex, _ioctlFd, _rtFd, _linkFd;
+    quint32 _seq;
+
+    bool _ethtool(void *cmd);
+    bool _changeAddress(int type, int flags, quint32 ip, int prefixLen);
+    void _drainLinkEvents();
+};
+
+#endif // LINKCONTROL_H
@@ -3,166 +3,510 @@
  * Copyright (C) 2020 Raspberry Pi Ltd
  */
 
-#include "../dependencies/drivelist/src/drivelist.hpp"
-#include <QProcess>
-#include <QJsonArray>
-#include <QJsonDocument>
-#include <QJsonObject>
+#include "linuxdrivelist.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QSet>
 #include <QDebug>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
 
 /*
  * Our third-party drivelist module does not provide a C++ implementation
  * for listing drives on Linux (only Javascript)
  * So roll our own for Linux using same function/data structure as the drivelist one
+ *
+ * The devices are read from sysfs, with the same properties lsblk would
+ * report for them. Labels come from the symlinks udev makes, mount points
+ * from the mount table.
  */
 
+/* Netlink multicast groups of uevents from the kernel, and of those udev is done with */
+#define UEVENT_GROUP_KERNEL 1
+#define UEVENT_GROUP_UDEV   2
+
 namespace Drivelist
 {
-    static void _walkStorageChildren(Drivelist::DeviceDescriptor &d, QStringList &labels, QJsonArray &ca)
+    static QString _readAttr(const QString &path)
+    {
+        QFile f(path);
+        if (!f.open(QIODevice::ReadOnly))
+            return QString();
+        return QString::fromUtf8(f.readAll()).trimmed();
+    }
+
+    /* udev escapes characters in link names as \xNN */
+    static QString _unescapeUdev(const QString &s)
+    {
+        QByteArray in = s.toUtf8(), out;
+        for (int i = 0; i < in.size(); i++)
+        {
+            bool ok = false;
+            if (in[i] == '\\' && i + 3 < in.size() && in[i+1] == 'x')
+            {
+                char c = (char) in.mid(i+2, 2).toInt(&ok, 16);
+                if (ok)
+                {
+                    out += c;
+                    i += 3;
+                }
+            }
+            if (!ok)
+                out += in[i];
+        }
+        return QString::fromUtf8(out);
+    }
+
+    /* The mount table escapes spaces and such as \NNN (octal) */
+    static QString _unescapeOctal(const QByteArray &in)
+    {
+        QByteArray out;
+        for (int i = 0; i < in.size(); i++)
+        {
+            bool ok = false;
+            if (in[i] == '\\' && i + 3 < in.size())
+            {
+                char c = (char) in.mid(i+1, 3).toInt(&ok, 8);
+                if (ok)
+                {
+                    out += c;
+                    i += 3;
+                }
+            }
+            if (!ok)
+                out += in[i];
+        }
+        return QString::fromUtf8(out);
+    }
+
+    /* Device node -> label */
+    static QHash<QString, QString> _readLabels()
+    {
+        QHash<QString, QString> labels;
+        const QFileInfoList links = QDir("/dev/disk/by-label").entryInfoList(QDir::AllEntries | QDir::System | QDir::NoDotAndDotDot);
+        for (const QFileInfo &link : links)
+        {
+            QString node = link.canonicalFilePath();
+            if (!node.isEmpty())
+                labels.insert(node, _unescapeUdev(link.fileName()));
+        }
+        return labels;
+    }
+
+    /* Device node -> mount points */
+    static QHash<QString, QStringList> _readMounts()
+    {
+        QHash<QString, QStringList> mounts;
+        QFile f("/proc/self/mountinfo");
+        if (!f.open(QIODevice::ReadOnly))
+            return mounts;
+
+        const QList<QByteArray> lines = f.readAll().split('\n');
+        for (const QByteArray &line : lines)
+        {
+            /* ID parent major:minor root mountpoint options [optional fields] - fstype source superoptions */
+            QList<QByteArray> fields = line.split(' ');
+            int sep = fields.indexOf("-");
+            if (sep < 5 || fields.size() < sep + 3)
+                continue;
+
+            QString source = _unescapeOctal(fields[sep+2]);
+            if (!source.startsWith("/dev/"))
+                continue;
+            QString node = QFileInfo(source).canonicalFilePath();
+            if (node.isEmpty())
+                node = source;
+            mounts[node].append(_unescapeOctal(fields[4]));
+        }
+        return mounts;
+    }
+
+    /* Subsystems from the block device up to the root of the device tree,
+       like lsblk reports them. E.g. "block:scsi:usb:pci" */
+    static QString _subsystems(const QString &sysPath)
+    {
+        QStringList list;
+        for (QString path = QFileInfo(sysPath).canonicalFilePath(); path.startsWith("/sys/devices/"); path = path.section('/', 0, -2))
+        {
+            QString name = QFileInfo(QFileInfo(path + "/subsystem").symLinkTarget()).fileName();
+            if (!name.isEmpty() && !list.contains(name))
+                list.append(name);
+        }
+        return list.join(":");
+    }
+
+    /* On a bus that reports the device can be unplugged, like lsblk's hotplug */
+    static bool _isHotplug(const QString &sysPath)
     {
-        for (auto j : ca)
+        for (QString path = QFileInfo(sysPath + "/device").canonicalFilePath(); path.startsWith("/sys/devices/"); path = path.section('/', 0, -2))
         {
-            QJsonObject child = j.toObject();
-            QString label = child["label"].toString();
-            QString mp = child["mountpoint"].toString();
+            if (_readAttr(path + "/removable") == "removable")
+                return true;
+        }
+        return false;
+    }
+
+    /* Where the USB device the disk is on is plugged in, and at what speed. With
+       /sys/devices/pci0000:00/0000:00:14.0/usb2/2-1/2-1.3 that is port 2-1.3 on hub 2-1
+       of controller 0000:00:14.0. A USB 3 hub shows up as two hubs, one per bus */
+    static void _describeUsbTopology(const QString &sysPath, Drivelist::DeviceDescriptor &d)
+    {
+        for (QString path = QFileInfo(sysPath + "/device").canonicalFilePath(); path.startsWith("/sys/devices/"); path = path.section('/', 0, -2))
+        {
+            /* Interfaces have neither */
+            QString busnum = _readAttr(path + "/busnum");
+            QString devpath = _readAttr(path + "/devpath");
+            if (busnum.isEmpty() || devpath.isEmpty())
+                continue;
+
+            d.usbPort = QFileInfo(path).fileName().toStdString();
+            d.usbSpeed = _readAttr(path + "/speed").toDouble();
+            int dot = devpath.lastIndexOf('.');
+            d.usbHub = (dot == -1 ? "usb" + busnum : busnum + "-" + devpath.left(dot)).toStdString();
+            for (; path.startsWith("/sys/devices/"); path = path.section('/', 0, -2))
+            {
+                if (QFileInfo(path).fileName() == "usb" + busnum)
+                {
+                    d.usbController = QFileInfo(path.section('/', 0, -2)).fileName().toStdString();
+                    break;
+                }
+            }
+            return;
+        }
+    }
+
+    static bool _hasSlaves(const QString &sysPath)
+    {
+        return !QDir(sysPath + "/slaves").isEmpty(QDir::AllEntries | QDir::System | QDir::NoDotAndDotDot);
+    }
+
+    /* Partitions, and the devices stacked on them (LUKS, LVM), in the order lsblk shows them */
+    static void _walkStorageChildren(Drivelist::DeviceDescriptor &d, QStringList &labels, const QString &sysPath,
+                                     const QHash<QString, QString> &labelOf, const QHash<QString, QStringList> &mounts)
+    {
+        QList<QPair<int, QString> > children;
+        const QStringList entries = QDir(sysPath).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+        for (const QString &entry : entries)
+        {
+            QString partition = _readAttr(sysPath + "/" + entry + "/partition");
+            if (!partition.isEmpty())
+                children.append(qMakePair(partition.toInt(), sysPath + "/" + entry));
+        }
+        std::sort(children.begin(), children.end());
+
+        const QFileInfoList holders = QDir(sysPath + "/holders").entryInfoList(QDir::AllEntries | QDir::System | QDir::NoDotAndDotDot, QDir::Name);
+        for (const QFileInfo &holder : holders)
+            children.append(qMakePair(0, holder.canonicalFilePath()));
+
+        for (const auto &child : std::as_const(children))
+        {
+            QString node = "/dev/" + QFileInfo(child.second).fileName();
+            QString label = labelOf.value(node);
             if (!label.isEmpty())
             {
                 labels.append(label);
             }
-            if (!mp.isEmpty())
+            for (const QString &mp : mounts.value(node))
             {
                 d.mountpoints.push_back(mp.toStdString());
                 d.mountpointLabels.push_back(label.toStdString());
             }
 
-            QJsonArray subca = child["children"].toArray();
-            if (subca.count())
+            _walkStorageChildren(d, labels, child.second, labelOf, mounts);
+        }
+    }
+
+    /* Returns false if name is not a disk that is listed */
+    static bool _describeStorageDevice(const QString &name, Drivelist::DeviceDescriptor &d,
+                                       const QHash<QString, QString> &labelOf, const QHash<QString, QStringList> &mounts)
+    {
+        QString sysPath = "/sys/block/" + name;
+        QString node = "/dev/" + name;
+
+        if (name.startsWith("loop") || name.startsWith("sr") || name.startsWith("ram") || name.startsWith("zram") || name.isEmpty())
+            return false;
+        /* Loop devices by major number, like lsblk --exclude 7 */
+        QString dev = _readAttr(sysPath + "/dev");
+        if (dev.isEmpty() || dev.section(':', 0, 0) == "7")
+            return false;
+        /* Stacked on other devices, shown as their children */
+        if (_hasSlaves(sysPath))
+            return false;
+
+        QString subsystems = _subsystems(sysPath);
+        d.device     = node.toStdString();
+        d.raw        = true;
+        d.isVirtual  = subsystems == "block";
+
+        // Hot fix for newer lsblk version on Arch based linux distributions.
+        // See issue #610
+        // Only tested with laptop's internal sd card reader.
+        if (!d.isVirtual && (subsystems.contains("mmc") || subsystems.contains("scsi:usb")) ) {
+            d.isVirtual = subsystems.contains("block"); //< lsblk will output something like "block:mmc:mmc_host:pci" for key "subsystems".
+        }
+
+        d.isReadOnly = _readAttr(sysPath + "/ro") == "1";
+        d.isRemovable= _readAttr(sysPath + "/removable") == "1" || _isHotplug(sysPath) || d.isVirtual;
+        /* In 512 byte sectors, whatever the block size */
+        d.size       = _readAttr(sysPath + "/size").toULongLong() * 512;
+        d.isSystem   = !d.isRemovable && !d.isVirtual;
+        d.isUSB      = subsystems.contains("usb");
+        d.isSCSI     = subsystems.contains("scsi") && !d.isUSB;
+        if (d.isUSB)
+            _describeUsbTopology(sysPath, d);
+        d.blockSize  = _readAttr(sysPath + "/queue/physical_block_size").toInt();
+        d.logicalBlockSize = _readAttr(sysPath + "/queue/logical_block_size").toInt();
+
+        /* SD cards have a name instead of a model */
+        QString model = _readAttr(sysPath + "/device/model");
+        if (model.isEmpty())
+            model = _readAttr(sysPath + "/device/name");
+        QString label = labelOf.value(node);
+        QStringList dp = {
+            label,
+            _readAttr(sysPath + "/device/vendor"),
+            model
+        };
+        if (node == "/dev/mmcblk0")
+        {
+            dp.removeAll("");
+            if (dp.empty())
+                dp.append(QObject::tr("Internal SD card reader"));
+        }
+
+        for (const QString &mp : mounts.value(node))
+        {
+            d.mountpoints.push_back(mp.toStdString());
+            d.mountpointLabels.push_back(label.toStdString());
+        }
+        QStringList labels;
+        _walkStorageChildren(d, labels, sysPath, labelOf, mounts);
+
+        if (labels.count()) {
+            dp.append("("+labels.join(", ")+")");
+        }
+        dp.removeAll("");
+        d.description = dp.join(" ").toStdString();
+
+        /* Mark internal NVMe drives as non-system if not mounted
+           anywhere else than under /media */
+        if (d.isSystem && subsystems.contains("nvme"))
+        {
+            bool isMounted = false;
+            for (const std::string& mp : d.mountpoints)
+            {
+                if (!QByteArray::fromStdString(mp).startsWith("/media/")) {
+                    isMounted = true;
+                    break;
+                }
+            }
+            if (!isMounted)
             {
-                _walkStorageChildren(d, labels, subca);
+                d.isSystem = false;
             }
         }
+
+        return true;
+    }
+
+    static std::map<QString, DeviceDescriptor> _listStorageDevices()
+    {
+        std::map<QString, DeviceDescriptor> devices;
+        QHash<QString, QString> labelOf = _readLabels();
+        QHash<QString, QStringList> mounts = _readMounts();
+
+        const QStringList names = QDir("/sys/block").entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+        for (const QString &name : names)
+        {
+            DeviceDescriptor d;
+            if (_describeStorageDevice(name, d, labelOf, mounts))
+                devices[name] = d;
+        }
+
+        return devices;
+    }
+
+    /* Only what the drive list shows and acts on */
+    static bool _sameDevice(const DeviceDescriptor &a, const DeviceDescriptor &b)
+    {
+        return a.device == b.device && a.description == b.description && a.size == b.size
+            && a.blockSize == b.blockSize && a.logicalBlockSize == b.logicalBlockSize
+            && a.mountpoints == b.mountpoints && a.mountpointLabels == b.mountpointLabels
+            && a.isReadOnly == b.isReadOnly && a.isSystem == b.isSystem && a.isVirtual == b.isVirtual
+            && a.isRemovable == b.isRemovable && a.isUSB == b.isUSB && a.isSCSI == b.isSCSI;
     }
 
     std::vector<Drivelist::DeviceDescriptor> ListStorageDevices()
     {
         std::vector<DeviceDescriptor> deviceList;
+        for (const auto &i : _listStorageDevices())
+            deviceList.push_back(i.second);
+        return deviceList;
+    }
 
-        QProcess p;
-        QStringList args = { 
-            "--bytes",
-            "--json",
-            "--paths",
-            "--tree",
-            "--output", "kname,type,subsystems,ro,rm,hotplug,size,phy-sec,log-sec,label,vendor,model,mountpoint",
-            "--exclude", "7",
-        };
-        p.start("lsblk", args);
-        p.waitForFinished(2000);
-        QByteArray output = p.readAll();
+    StorageDeviceMonitor::StorageDeviceMonitor()
+        : _uevents(-1), _mountinfo(-1)
+    {
+    }
+
+    StorageDeviceMonitor::~StorageDeviceMonitor()
+    {
+        if (_uevents != -1)
+            ::close(_uevents);
+        if (_mountinfo != -1)
+            ::close(_mountinfo);
+    }
 
-        if (p.exitStatus() != QProcess::NormalExit || p.exitCode() || output.isEmpty())
+    bool StorageDeviceMonitor::open()
+    {
+        _uevents = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+        if (_uevents == -1)
         {
-            qDebug() << "Error executing lsblk";
-            return deviceList;
+            qDebug() << "Cannot open uevent socket:" << strerror(errno);
+            return false;
         }
 
-        QJsonDocument d = QJsonDocument::fromJson(output);
-        const QJsonArray a = d.object()["blockdevices"].toArray();
-        for (const auto &i : a)
+        struct sockaddr_nl addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = UEVENT_GROUP_KERNEL | UEVENT_GROUP_UDEV;
+        if (::bind(_uevents, (struct sockaddr *) &addr, sizeof(addr)) == -1)
         {
-            DeviceDescriptor d;
-            QJsonObject bdev = i.toObject();
-            QString name = bdev["kname"].toString();
-            QString subsystems = bdev["subsystems"].toString();
-            if (name.startsWith("/dev/loop") || name.startsWith("/dev/sr") || name.startsWith("/dev/ram") || name.startsWith("/dev/zram") || name.isEmpty())
-                continue;
+            qDebug() << "Cannot listen for uevents:" << strerror(errno);
+            return false;
+        }
 
-            d.busType    = bdev["busType"].toString().toStdString();
-            d.device     = name.toStdString();
-            d.raw        = true;
-            d.isVirtual  = subsystems == "block";
+        /* Signals a change of the mount table with POLLPRI */
+        _mountinfo = ::open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+        if (_mountinfo == -1)
+        {
+            qDebug() << "Cannot watch the mount table:" << strerror(errno);
+            return false;
+        }
 
-            // Hot fix for newer lsblk version on Arch based linux distributions.
-            // See issue #610
-            // Only tested with laptop's internal sd card reader.
-            if (!d.isVirtual && (subsystems.contains("mmc") || subsystems.contains("scsi:usb")) ) {
-                d.isVirtual = subsystems.contains("block"); //< lsblk will output something like "block:mmc:mmc_host:pci" for key "subsystems".
-            }
+        /* Events meanwhile are queued, and applied by the next waitForChanges() */
+        _rescan();
+        return true;
+    }
 
-            if (bdev["ro"].isBool())
-            {
-                /* With some lsblk versions it is a bool in others a "0" or "1" string */
-                d.isReadOnly = bdev["ro"].toBool();
-                d.isRemovable= bdev["rm"].toBool() || bdev["hotplug"].toBool() || d.isVirtual;
-            }
-            else
+    bool StorageDeviceMonitor::waitForChanges(int timeoutMs)
+    {
+        struct pollfd fds[2] = {
+            { _uevents, POLLIN, 0 },
+            { _mountinfo, POLLPRI, 0 }
+        };
+        if (::poll(fds, 2, timeoutMs) <= 0)
+            return false;
+
+        bool changed = false;
+        if (fds[1].revents & (POLLPRI | POLLERR))
+        {
+            /* Any disk could have been mounted or unmounted */
+            changed = _rescan();
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            QSet<QString> disks;
+            char buf[8192];
+            ssize_t len;
+
+            while ((len = ::recv(_uevents, buf, sizeof(buf)-1, 0)) > 0)
             {
-                d.isReadOnly = bdev["ro"].toString() == "1";
-                d.isRemovable= bdev["rm"].toString() == "1" || bdev["hotplug"].toString() == "1" || d.isVirtual;
+                buf[len] = 0;
+                QString disk = _diskOfEvent(buf, len);
+                if (!disk.isEmpty())
+                    disks.insert(disk);
             }
-            if (bdev["size"].isString())
+
+            if (len == -1 && errno == ENOBUFS)
             {
-                d.size       = bdev["size"].toString().toULongLong();
+                /* Events were lost */
+                changed = _rescan() || changed;
             }
             else
             {
-                d.size       = bdev["size"].toDouble();
-            }
-            d.isSystem   = !d.isRemovable && !d.isVirtual;
-            d.isUSB      = subsystems.contains("usb");
-            d.isSCSI     = subsystems.contains("scsi") && !d.isUSB;
-            d.blockSize  = bdev["phy-sec"].toInt();
-            d.logicalBlockSize = bdev["log-sec"].toInt();
-
-            QStringList dp = {
-                bdev["label"].toString().trimmed(),
-                bdev["vendor"].toString().trimmed(),
-                bdev["model"].toString().trimmed()
-            };
-            if (name == "/dev/mmcblk0")
-            {
-                dp.removeAll("");
-                if (dp.empty())
-                    dp.append(QObject::tr("Internal SD card reader"));
+                for (const QString &disk : std::as_const(disks))
+                    changed = _update(disk) || changed;
             }
+        }
 
-            QString mp = bdev["mountpoint"].toString();
-            if (!mp.isEmpty())
-            {
-                d.mountpoints.push_back(mp.toStdString());
-                d.mountpointLabels.push_back(bdev["label"].toString().toStdString());
-            }
-            QStringList labels;
-            QJsonArray ca = bdev["children"].toArray();
-            _walkStorageChildren(d, labels, ca);
+        return changed;
+    }
 
-            if (labels.count()) {
-                dp.append("("+labels.join(", ")+")");
-            }
-            dp.removeAll("");
-            d.description = dp.join(" ").toStdString();
+    std::vector<DeviceDescriptor> StorageDeviceMonitor::devices() const
+    {
+        std::vector<DeviceDescriptor> deviceList;
+        for (const auto &i : _devices)
+            deviceList.push_back(i.second);
+        return deviceList;
+    }
 
-            /* Mark internal NVMe drives as non-system if not mounted
-               anywhere else than under /media */
-            if (d.isSystem && subsystems.contains("nvme"))
-            {
-                bool isMounted = false;
-                for (const std::string& mp : d.mountpoints)
-                {
-                    if (!QByteArray::fromStdString(mp).startsWith("/media/")) {
-                        isMounted = true;
-                        break;
-                    }
-                }
-                if (!isMounted)
-                {
-                    d.isSystem = false;
-                }
-            }
+    bool StorageDeviceMonitor::_rescan()
+    {
+        std::map<QString, DeviceDescriptor> devices = _listStorageDevices();
+        bool changed = devices.size() != _devices.size();
+
+        for (auto i = devices.cbegin(), j = _devices.cbegin(); !changed && i != devices.cend(); ++i, ++j)
+            changed = i->first != j->first || !_sameDevice(i->second, j->second);
+
+        if (changed)
+            _devices = devices;
+        return changed;
+    }
 
-            deviceList.push_back(d);
+    bool StorageDeviceMonitor::_update(const QString &disk)
+    {
+        /* A device stacked on others changes what they show */
+        if (_hasSlaves("/sys/block/" + disk))
+            return _rescan();
+
+        DeviceDescriptor d;
+        auto it = _devices.find(disk);
+        if (!_describeStorageDevice(disk, d, _readLabels(), _readMounts()))
+        {
+            if (it == _devices.end())
+                return false;
+            _devices.erase(it);
+            return true;
         }
 
-        return deviceList;
+        if (it != _devices.end() && _sameDevice(it->second, d))
+            return false;
+        _devices[disk] = d;
+        return true;
+    }
+
+    /* Kernel name of the disk a block device uevent is about, empty for other events.
+       Kernel and udev messages both carry the properties as KEY=value strings */
+    QString StorageDeviceMonitor::_diskOfEvent(const char *buf, int len)
+    {
+        QByteArray subsystem, devtype, devpath;
+        for (const char *p = buf; p < buf + len; p += strlen(p) + 1)
+        {
+            if (!strncmp(p, "SUBSYSTEM=", 10))
+                subsystem = p + 10;
+            else if (!strncmp(p, "DEVTYPE=", 8))
+                devtype = p + 8;
+            else if (!strncmp(p, "DEVPATH=", 8))
+                devpath = p + 8;
+        }
+        if (subsystem != "block" || devpath.isEmpty())
+            return QString();
+
+        QList<QByteArray> parts = devpath.split('/');
+        if (devtype == "partition" && parts.size() > 1)
+            return QString::fromUtf8(parts[parts.size()-2]);
+        return QString::fromUtf8(parts.last());
     }
 }
@@ -0,0 +1,50 @@
+#ifndef LINUXDRIVELIST_H
+#define LINUXDRIVELIST_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2020 Raspberry Pi Ltd
+ */
+
+#include "../dependencies/drivelist/src/drivelist.hpp"
+#include <QString>
+#include <map>
+
+namespace Drivelist
+{
+    /*
+     * Keeps the list of storage devices up to date, without polling
+     *
+     * Listens for block device uevents (from udev, or the kernel if udev
+     * does not run) and for changes of the mount table. Only a disk
+     * an event is about is read from sysfs again, a mount or unmount
+     * reads all of them, as any could be affected.
+     */
+    class StorageDeviceMonitor
+    {
+    public:
+        StorageDeviceMonitor();
+        ~StorageDeviceMonitor();
+
+        /* Starts listening and reads the current devices.
+           Returns false if events are not available, ListStorageDevices() has to be polled then */
+        bool open();
+
+        /* Waits up to timeoutMs for events and applies them.
+           Returns true if the list changed */
+        bool waitForChanges(int timeoutMs);
+
+        std::vector<DeviceDescriptor> devices() const;
+
+    protected:
+        int _uevents, _mountinfo;
+        /* By kernel name of the disk */
+        std::map<QString, DeviceDescriptor> _devices;
+
+        bool _rescan();
+        bool _update(const QString &disk);
+        QString _diskOfEvent(const char *buf, int len);
+    };
+}
+
+#endif // LINUXDRIVELIST_H
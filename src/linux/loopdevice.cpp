@@ -0,0 +1,145 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "loopdevice.h"
+#include <QDebug>
+#include <linux/loop.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+/* Another process may take the free loop device before we configure it */
+#define LOOPDEVICE_ATTACH_TRIES  5
+
+LoopDevice::LoopDevice()
+    : _fd(-1)
+{
+}
+
+LoopDevice::~LoopDevice()
+{
+    detach();
+}
+
+bool LoopDevice::attach(const QString &backing, quint64 offset, quint64 sizeLimit)
+{
+    detach();
+
+    int controlFd = ::open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+    if (controlFd == -1)
+    {
+        _error = QString("Cannot open /dev/loop-control: %1").arg(strerror(errno));
+        return false;
+    }
+    int backingFd = ::open(backing.toLocal8Bit().constData(), O_RDWR | O_CLOEXEC);
+    if (backingFd == -1)
+    {
+        _error = QString("Cannot open %1: %2").arg(backing, strerror(errno));
+        ::close(controlFd);
+        return false;
+    }
+
+    for (int tries = 0; tries < LOOPDEVICE_ATTACH_TRIES && _fd == -1; tries++)
+    {
+        int nr = ::ioctl(controlFd, LOOP_CTL_GET_FREE);
+        if (nr < 0)
+        {
+            _error = QString("No free loop device: %1").arg(strerror(errno));
+            break;
+        }
+
+        QString device = QString("/dev/loop%1").arg(nr);
+        int loopFd = ::open(device.toLatin1().constData(), O_RDWR | O_CLOEXEC);
+        if (loopFd == -1)
+        {
+            _error = QString("Cannot open %1: %2").arg(device, strerror(errno));
+            break;
+        }
+
+        if (_configure(loopFd, backingFd, offset, sizeLimit, backing.toLocal8Bit()))
+        {
+            _fd = loopFd;
+            _device = device;
+        }
+        else
+        {
+            bool busy = (errno == EBUSY);
+            _error = QString("Cannot set up %1: %2").arg(device, strerror(errno));
+            ::close(loopFd);
+            if (!busy)
+                break;
+        }
+    }
+
+    /* The loop device holds its own reference to the backing file */
+    ::close(backingFd);
+    ::close(controlFd);
+
+    if (_fd != -1)
+        qDebug() << "Mapped" << backing << "from" << offset << "size" << sizeLimit << "to" << _device;
+    return _fd != -1;
+}
+
+bool LoopDevice::_configure(int loopFd, int backingFd, quint64 offset, quint64 sizeLimit, const QByteArray &name)
+{
+    struct loop_info64 info;
+    memset(&info, 0, sizeof(info));
+    info.lo_offset = offset;
+    info.lo_sizelimit = sizeLimit;
+    info.lo_flags = LO_FLAGS_AUTOCLEAR | LO_FLAGS_DIRECT_IO;
+    strncpy((char *) info.lo_file_name, name.constData(), LO_NAME_SIZE-1);
+
+#ifdef LOOP_CONFIGURE
+    /* Linux 5.8 and later: all in one go, and without a window in which the device has the wrong size */
+    struct loop_config config;
+    memset(&config, 0, sizeof(config));
+    config.fd = backingFd;
+    config.info = info;
+    if (::ioctl(loopFd, LOOP_CONFIGURE, &config) == 0)
+        return true;
+    if (errno != EINVAL && errno != ENOTTY)
+        return false;
+#endif
+
+    if (::ioctl(loopFd, LOOP_SET_FD, backingFd) == -1)
+        return false;
+    if (::ioctl(loopFd, LOOP_SET_STATUS64, &info) == -1)
+    {
+        int e = errno;
+        ::ioctl(loopFd, LOOP_CLR_FD, 0);
+        errno = e;
+        return false;
+    }
+    /* The status does not set direct I/O. Buffered if the backing device cannot do it */
+    if (::ioctl(loopFd, LOOP_SET_DIRECT_IO, 1UL) == -1)
+        qDebug() << "No direct I/O on loop device:" << strerror(errno);
+
+    return true;
+}
+
+void LoopDevice::detach()
+{
+    if (_fd == -1)
+        return;
+
+    /* With autoclear set this only marks it for detaching, if someone still has it open */
+    if (::ioctl(_fd, LOOP_CLR_FD, 0) == -1 && errno != ENXIO)
+        qDebug() << "Error detaching" << _device << ":" << strerror(errno);
+    ::close(_fd);
+    _fd = -1;
+    _device.clear();
+}
+
+QString LoopDevice::device() const
+{
+    return _device;
+}
+
+QString LoopDevice::errorString() const
+{
+    return _error;
+}
@@ -0,0 +1,46 @@
+#ifndef LOOPDEVICE_H
+#define LOOPDEVICE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <QString>
+
+/*
+ * A free loop device mapping a range of another device or file
+ *
+ * Lets anything that writes a whole drive, starting at offset 0 and
+ * treating the end of the drive as the end, write a range of one instead.
+ * The loop device is set up without partition scanning, and with direct
+ * I/O where the kernel can, so data is not cached twice. It is detached
+ * when this object is deleted and the last user has closed it.
+ *
+ * Needs read-write access to /dev/loop-control and the loop devices, as
+ * writing to drives does anyway.
+ */
+class LoopDevice
+{
+public:
+    LoopDevice();
+    ~LoopDevice();
+
+    /* sizeLimit 0 maps up to the end of backing. Returns false with errorString() set on failure */
+    bool attach(const QString &backing, quint64 offset, quint64 sizeLimit);
+    void detach();
+
+    /* e.g. /dev/loop3, empty if not attached */
+    QString device() const;
+    QString errorString() const;
+
+protected:
+    int _fd;
+    QString _device, _error;
+
+    bool _configure(int loopFd, int backingFd, quint64 offset, quint64 sizeLimit, const QByteArray &name);
+};
+
+#endif // LOOPDEVICE_H
@@ -7,14 +7,78 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <QDBusInterface>
+#include <QDBusMetaType>
+#include <QDBusPendingCall>
 #include <QDBusReply>
 #include <QDBusUnixFileDescriptor>
 #include <QDebug>
-#include <QThread>
+#include <QElapsedTimer>
+#include <QEventLoop>
+#include <QTimer>
+
+#define UDISKS2_SERVICE     "org.freedesktop.UDisks2"
+#define UDISKS2_BLOCK       "org.freedesktop.UDisks2.Block"
+#define UDISKS2_FILESYSTEM  "org.freedesktop.UDisks2.Filesystem"
+
+/* Result of GetManagedObjects: properties by interface, by object */
+typedef QMap<QString, QVariantMap> UDisks2Interfaces;
+typedef QMap<QDBusObjectPath, UDisks2Interfaces> UDisks2ManagedObjects;
+Q_DECLARE_METATYPE(UDisks2Interfaces)
+Q_DECLARE_METATYPE(UDisks2ManagedObjects)
 
 UDisks2Api::UDisks2Api(QObject *parent)
-    : QObject(parent)
+    : QObject(parent), _changeCount(0), _loop(nullptr)
+{
+    qDBusRegisterMetaType<UDisks2Interfaces>();
+    qDBusRegisterMetaType<UDisks2ManagedObjects>();
+
+    /* Partitions and file systems coming up are waited for with these, not by sleeping */
+    QDBusConnection bus = QDBusConnection::systemBus();
+    bus.connect(UDISKS2_SERVICE, "/org/freedesktop/UDisks2", "org.freedesktop.DBus.ObjectManager", "InterfacesAdded",
+                this, SLOT(_onObjectChanged(QDBusMessage)));
+    bus.connect(UDISKS2_SERVICE, QString(), "org.freedesktop.DBus.Properties", "PropertiesChanged",
+                this, SLOT(_onObjectChanged(QDBusMessage)));
+}
+
+QDBusInterface *UDisks2Api::_interface(const QString &path, const QString &interface)
+{
+    QDBusInterface *&iface = _interfaces[path+" "+interface];
+    if (!iface)
+        iface = new QDBusInterface(UDISKS2_SERVICE, path, interface, QDBusConnection::systemBus(), this);
+
+    return iface;
+}
+
+void UDisks2Api::_onObjectChanged(const QDBusMessage &msg)
 {
+    QString path = msg.path();
+    if (msg.member() == "InterfacesAdded" && !msg.arguments().isEmpty())
+        path = msg.arguments().constFirst().value<QDBusObjectPath>().path();
+
+    if (_watchPath.isEmpty() || path != _watchPath)
+        return;
+
+    _changeCount++;
+    if (_loop)
+        _loop->quit();
+}
+
+/* Waits up to timeoutMs for a change of _watchPath after count since.
+   Changes that came in meanwhile are still queued, so none are missed */
+bool UDisks2Api::_waitForChange(quint64 since, int timeoutMs)
+{
+    QEventLoop loop;
+    QTimer timer;
+
+    timer.setSingleShot(true);
+    connect(&timer, &QTimer::timeout, &loop, &QEventLoop::quit);
+    timer.start(timeoutMs);
+    _loop = &loop;
+    if (_changeCount == since)
+        loop.exec();
+    _loop = nullptr;
+
+    return _changeCount != since;
 }
 
 int UDisks2Api::authOpen(const QString &device, const QString &mode)
@@ -23,20 +87,19 @@ int UDisks2Api::authOpen(const QString &device, const QString &mode)
     if (devpath.isEmpty())
         return -1;
 
-    QDBusInterface blockdevice("org.freedesktop.UDisks2", devpath,
-                               "org.freedesktop.UDisks2.Block", QDBusConnection::systemBus());
-    QString drive = blockdevice.property("Drive").value<QDBusObjectPath>().path();
+    QDBusInterface *blockdevice = _interface(devpath, UDISKS2_BLOCK);
+    QString drive = blockdevice->property("Drive").value<QDBusObjectPath>().path();
     if (!drive.isEmpty() && drive != "/")
     {
         _unmountDrive(drive);
     }
 
     // User may need to enter password in authentication dialog so set long timeout
-    blockdevice.setTimeout(3600 * 1000);
+    blockdevice->setTimeout(3600 * 1000);
     QVariantMap options = {{"flags", O_EXCL}};
-    QDBusReply<QDBusUnixFileDescriptor> dbusfd = blockdevice.call("OpenDevice", mode, options);
+    QDBusReply<QDBusUnixFileDescriptor> dbusfd = blockdevice->call("OpenDevice", mode, options);
 
-    if (!blockdevice.isValid() || !dbusfd.isValid() || !dbusfd.value().isValid())
+    if (!blockdevice->isValid() || !dbusfd.isValid() || !dbusfd.value().isValid())
         return -1;
 
     int fd = ::dup(dbusfd.value().fileDescriptor());
@@ -46,49 +109,61 @@ int UDisks2Api::authOpen(const QString &device, const QString &mode)
 
 QString UDisks2Api::_resolveDevice(const QString &device)
 {
-    QDBusInterface manager("org.freedesktop.UDisks2", "/org/freedesktop/UDisks2/Manager",
-                           "org.freedesktop.UDisks2.Manager", QDBusConnection::systemBus());
+    QDBusInterface *manager = _interface("/org/freedesktop/UDisks2/Manager", "org.freedesktop.UDisks2.Manager");
     QVariantMap devspec = {{"path", device}};
     QVariantMap options;
 
-    QDBusReply<QList<QDBusObjectPath>> list = manager.call("ResolveDevice", devspec, options);
+    QDBusReply<QList<QDBusObjectPath>> list = manager->call("ResolveDevice", devspec, options);
 
-    if (!manager.isValid() || !list.isValid() || list.value().isEmpty())
+    if (!manager->isValid() || !list.isValid() || list.value().isEmpty())
         return QString();
 
     return list.value().constFirst().path();
 }
 
-void UDisks2Api::_unmountDrive(const QString &driveDbusPath)
+/* Unmounts the file systems of a drive, or of the drive a block device is on.
+   One call gets all objects, and all unmounts are sent before waiting for them */
+void UDisks2Api::_unmountDrive(const QString &dbusPath)
 {
-    //qDebug() << "Drive:" << driveDbusPath;
+    //qDebug() << "Drive:" << dbusPath;
 
-    QDBusInterface manager("org.freedesktop.UDisks2", "/org/freedesktop/UDisks2/Manager",
-                           "org.freedesktop.UDisks2.Manager", QDBusConnection::systemBus());
-    QVariantMap options;
-    const QDBusReply<QList<QDBusObjectPath>> list = manager.call("GetBlockDevices", options);
+    QDBusMessage msg = QDBusMessage::createMethodCall(UDISKS2_SERVICE, "/org/freedesktop/UDisks2",
+                                                      "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+    const QDBusReply<UDisks2ManagedObjects> objects = QDBusConnection::systemBus().call(msg);
 
-    if (!manager.isValid() || !list.isValid())
+    if (!objects.isValid())
         return;
 
-    const auto listValue = list.value();
-    for (const auto& devpath : listValue)
+    const auto objectsValue = objects.value();
+    QString drivePath = dbusPath;
+    auto self = objectsValue.constFind(QDBusObjectPath(dbusPath));
+    if (self != objectsValue.constEnd() && self->contains(UDISKS2_BLOCK))
+        drivePath = self->value(UDISKS2_BLOCK).value("Drive").value<QDBusObjectPath>().path();
+
+    QList<QPair<QString, QDBusPendingCall>> unmounts;
+    for (auto it = objectsValue.constBegin(); it != objectsValue.constEnd(); ++it)
     {
-        QString devpathStr = devpath.path();
+        const UDisks2Interfaces &interfaces = it.value();
+        QString devpathStr = it.key().path();
 
-        QDBusInterface blockdevice("org.freedesktop.UDisks2", devpathStr,
-                                   "org.freedesktop.UDisks2.Block", QDBusConnection::systemBus());
-        QString driveOfDev = blockdevice.property("Drive").value<QDBusObjectPath>().path();
-        if (driveOfDev != driveDbusPath)
+        if (!interfaces.contains(UDISKS2_BLOCK) || !interfaces.contains(UDISKS2_FILESYSTEM))
+            continue;
+        if (devpathStr != dbusPath && interfaces.value(UDISKS2_BLOCK).value("Drive").value<QDBusObjectPath>().path() != drivePath)
+            continue;
+        if (qdbus_cast<QByteArrayList>(interfaces.value(UDISKS2_FILESYSTEM).value("MountPoints")).isEmpty())
             continue;
 
         //qDebug() << "Device:" << devpathStr << "belongs to same drive";
-        QDBusInterface filesystem("org.freedesktop.UDisks2", devpathStr,
-                                  "org.freedesktop.UDisks2.Filesystem", QDBusConnection::systemBus());
+        QDBusMessage unmount = QDBusMessage::createMethodCall(UDISKS2_SERVICE, devpathStr, UDISKS2_FILESYSTEM, "Unmount");
+        unmount << QVariantMap();
+        unmounts.append({devpathStr, QDBusConnection::systemBus().asyncCall(unmount)});
+    }
 
-        QDBusReply<void> reply = filesystem.call("Unmount", options);
-        if (reply.isValid())
-            qDebug() << "Unmounted" << devpathStr << "successfully";
+    for (auto &unmount : unmounts)
+    {
+        unmount.second.waitForFinished();
+        if (!unmount.second.isError())
+            qDebug() << "Unmounted" << unmount.first << "successfully";
     }
 }
 
@@ -98,10 +173,9 @@ bool UDisks2Api::formatDrive(const QString &device, bool mountAfterwards)
     if (devpath.isEmpty())
         return false;
 
-    QDBusInterface blockdevice("org.freedesktop.UDisks2", devpath,
-                               "org.freedesktop.UDisks2.Block", QDBusConnection::systemBus());
+    QDBusInterface *blockdevice = _interface(devpath, UDISKS2_BLOCK);
 
-    QString drive = blockdevice.property("Drive").value<QDBusObjectPath>().path();
+    QString drive = blockdevice->property("Drive").value<QDBusObjectPath>().path();
     if (!drive.isEmpty() && drive != "/")
     {
         _unmountDrive(drive);
@@ -109,7 +183,7 @@ bool UDisks2Api::formatDrive(const QString &device, bool mountAfterwards)
 
     qDebug() << "Repartitioning drive";
     QVariantMap options;
-    QDBusReply<void> reply = blockdevice.call("Format", "dos", options);
+    QDBusReply<void> reply = blockdevice->call("Format", "dos", options);
     if (!reply.isValid())
     {
         qDebug() << "Error repartitioning device:" << reply.error().message();
@@ -117,122 +191,120 @@ bool UDisks2Api::formatDrive(const QString &device, bool mountAfterwards)
     }
 
     QVariantMap partOptions, formatOptions;
-    QDBusInterface partitiontable("org.freedesktop.UDisks2", devpath,
-                               "org.freedesktop.UDisks2.PartitionTable", QDBusConnection::systemBus());
+    QDBusInterface *partitiontable = _interface(devpath, "org.freedesktop.UDisks2.PartitionTable");
 
     /* The all-in-one CreatePartitionAndFormat udisks2 method seems to not always
-       work properly. Do seperate actions with sleep in between instead */
+       work properly. Do seperate actions instead */
     qDebug() << "Adding partition";
-    QDBusReply<QDBusObjectPath> newpartition = partitiontable.call("CreatePartition", QVariant((qulonglong) 4*1024*1024), QVariant((qulonglong) 0), "0x0e", "", partOptions);
+    QDBusReply<QDBusObjectPath> newpartition = partitiontable->call("CreatePartition", QVariant((qulonglong) 4*1024*1024), QVariant((qulonglong) 0), "0x0e", "", partOptions);
     if (!newpartition.isValid())
     {
         qDebug() << "Error adding partition:" << newpartition.error().message();
         return false;
     }
-    qDebug() << "New partition:" << newpartition.value().path();
-    QThread::sleep(1);
-    if (!drive.isEmpty() && drive != "/")
-    {
-        /* Unmount one more time, as auto-mount may have tried to mount an old FAT filesystem again if it
-         * lives at the same sector in the new partition table as before */
-        _unmountDrive(drive);
-    }
+    QString partitionPath = newpartition.value().path();
+    qDebug() << "New partition:" << partitionPath;
+
     qDebug() << "Formatting drive as FAT32";
-    QDBusInterface newblockdevice("org.freedesktop.UDisks2", newpartition.value().path(),
-                                  "org.freedesktop.UDisks2.Block", QDBusConnection::systemBus());
-    newblockdevice.setTimeout(300 * 1000);
-    QDBusReply<void> fatformatreply = newblockdevice.call("Format", "vfat", formatOptions);
-    if (!fatformatreply.isValid())
+    QDBusInterface *newblockdevice = _interface(partitionPath, UDISKS2_BLOCK);
+    newblockdevice->setTimeout(300 * 1000);
+
+    for (int attempt = 0; ; attempt++)
     {
-        qDebug() << "Error from udisks2 while performing FAT32 format:" << fatformatreply.error().message();
-        return false;
+        if (!drive.isEmpty() && drive != "/")
+        {
+            /* Auto-mount may have mounted an old FAT filesystem again if it lives
+             * at the same sector in the new partition table as before */
+            _unmountDrive(drive);
+        }
+
+        _watchPath = partitionPath;
+        quint64 since = _changeCount;
+        QDBusReply<void> fatformatreply = newblockdevice->call("Format", "vfat", formatOptions);
+        if (fatformatreply.isValid())
+            break;
+
+        if (attempt == 1)
+        {
+            qDebug() << "Error from udisks2 while performing FAT32 format:" << fatformatreply.error().message();
+            _watchPath.clear();
+            return false;
+        }
+
+        /* Give auto-mount the chance to finish what it is doing to the partition */
+        qDebug() << "Formatting failed:" << fatformatreply.error().message() << "Retrying";
+        _waitForChange(since, 1000);
     }
+    _watchPath.clear();
 
     if (mountAfterwards)
     {
-        QDBusInterface filesystem("org.freedesktop.UDisks2", newpartition.value().path(),
-                                  "org.freedesktop.UDisks2.Filesystem", QDBusConnection::systemBus());
-        QVariantMap mountOptions;
-
-        for (int attempt = 0; attempt < 10; attempt++)
+        if (_mountFilesystem(partitionPath).isEmpty())
         {
-            qDebug() << "Mounting partition";
-            // User may need to enter password in authentication dialog if non-removable storage, so set long timeout
-            filesystem.setTimeout(3600 * 1000);
-            QDBusReply<QString> mp = filesystem.call("Mount", mountOptions);
-
-            if (mp.isValid())
-            {
-                qDebug() << "Mounted new file system at:" << mp;
-                return true;
-            }
-            else
-            {
-                /* Check if already auto-mounted */
-                auto mps = mountPoints(filesystem);
-                if (!mps.isEmpty())
-                {
-                    qDebug() << "Was already auto-mounted at:" << mps;
-                    return true;
-                }
-                else
-                {
-                    qDebug() << "Error mounting:" << mp.error().message();
-                }
-            }
-
-            QThread::sleep(1);
+            qDebug() << "Failed to mount new file system.";
+            return false;
         }
-
-        qDebug() << "Failed to mount new file system.";
-        return false;
     }
 
     return true;
 }
 
-QString UDisks2Api::mountDevice(const QString &device)
+/* Mounts the file system, waiting for it to show up if it does not exist yet.
+   Returns the mount point */
+QString UDisks2Api::_mountFilesystem(const QString &devpath)
 {
-    QString devpath = _resolveDevice(device);
-    if (devpath.isEmpty())
-        return QString();
-
-    QDBusInterface filesystem("org.freedesktop.UDisks2", devpath,
-                              "org.freedesktop.UDisks2.Filesystem", QDBusConnection::systemBus());
+    QDBusInterface *filesystem = _interface(devpath, UDISKS2_FILESYSTEM);
     QVariantMap mountOptions;
+    QElapsedTimer t;
+    QString mountpoint;
 
-    for (int attempt = 0; attempt < 10; attempt++)
+    t.start();
+    _watchPath = devpath;
+    for (int attempt = 0; attempt < 10 && t.elapsed() < 10000; attempt++)
     {
+        quint64 since = _changeCount;
+
         qDebug() << "Mounting partition";
         // User may need to enter password in authentication dialog if non-removable storage, so set long timeout
-        filesystem.setTimeout(3600 * 1000);
-        QDBusReply<QString> mp = filesystem.call("Mount", mountOptions);
+        filesystem->setTimeout(3600 * 1000);
+        QDBusReply<QString> mp = filesystem->call("Mount", mountOptions);
 
         if (mp.isValid())
         {
             qDebug() << "Mounted file system at:" << mp;
-            return mp;
+            mountpoint = mp;
+            break;
         }
-        else
+
+        /* Check if already auto-mounted */
+        auto mps = mountPoints(*filesystem);
+        if (!mps.isEmpty())
         {
-            /* Check if already auto-mounted */
-            auto mps = mountPoints(filesystem);
-            if (!mps.isEmpty())
-            {
-                qDebug() << "Was already auto-mounted at:" << mps;
-                return mps.first();
-            }
-            else
-            {
-                qDebug() << "Error mounting:" << mp.error().message();
-            }
+            qDebug() << "Was already auto-mounted at:" << mps;
+            mountpoint = mps.first();
+            break;
         }
 
-        QThread::sleep(1);
+        qDebug() << "Error mounting:" << mp.error().message();
+        /* Retried as soon as udisks2 reports the file system, or after a second */
+        _waitForChange(since, 1000);
     }
+    _watchPath.clear();
+
+    return mountpoint;
+}
+
+QString UDisks2Api::mountDevice(const QString &device)
+{
+    QString devpath = _resolveDevice(device);
+    if (devpath.isEmpty())
+        return QString();
+
+    QString mountpoint = _mountFilesystem(devpath);
+    if (mountpoint.isEmpty())
+        qDebug() << "Failed to mount file system.";
 
-    qDebug() << "Failed to mount file system.";
-    return QString();
+    return mountpoint;
 }
 
 void UDisks2Api::unmountDrive(const QString &device)
@@ -250,31 +322,29 @@ void UDisks2Api::ejectDrive(const QString &device)
     if (devpath.isEmpty())
         return;
 
-    QDBusInterface blockdevice("org.freedesktop.UDisks2", devpath,
-                               "org.freedesktop.UDisks2.Block", QDBusConnection::systemBus());
+    QDBusInterface *blockdevice = _interface(devpath, UDISKS2_BLOCK);
 
-    bool hintAuto = blockdevice.property("HintAuto").toBool();
+    bool hintAuto = blockdevice->property("HintAuto").toBool();
     if (hintAuto)
     {
         qDebug() << "Deactivating auto-mount for" << device;
-        blockdevice.setProperty("HintAuto", false);
+        blockdevice->setProperty("HintAuto", false);
     }
 
     /* Force kernel to rescan partitions now. Otherwise it may still be doing it
        while we are ejecting, resulting in read IO errors in dmesg */
     QVariantMap rescanOptions;
-    blockdevice.call("Rescan", rescanOptions);
+    blockdevice->call("Rescan", rescanOptions);
 
     _unmountDrive(devpath);
-    QString drivepath = blockdevice.property("Drive").value<QDBusObjectPath>().path();
+    QString drivepath = blockdevice->property("Drive").value<QDBusObjectPath>().path();
 
     if (!drivepath.isEmpty() && drivepath != "/")
     {
-        QDBusInterface drive("org.freedesktop.UDisks2", drivepath,
-                             "org.freedesktop.UDisks2.Drive", QDBusConnection::systemBus());
+        QDBusInterface *drive = _interface(drivepath, "org.freedesktop.UDisks2.Drive");
         QVariantMap ejectOptions;
-        qDebug() << "Ejecting drive: " << drive.property("Id").toString();
-        drive.call("Eject", ejectOptions);
+        qDebug() << "Ejecting drive: " << drive->property("Id").toString();
+        drive->call("Eject", ejectOptions);
     }
 }
 
@@ -284,9 +354,7 @@ QByteArrayList UDisks2Api::mountPoints(const QString &partitionDevice)
     if (devpath.isEmpty())
         return QByteArrayList();
 
-    QDBusInterface filesystem("org.freedesktop.UDisks2", devpath,
-                              "org.freedesktop.UDisks2.Filesystem", QDBusConnection::systemBus());
-    return mountPoints(filesystem);
+    return mountPoints(*_interface(devpath, UDISKS2_FILESYSTEM));
 }
 
 QByteArrayList UDisks2Api::mountPoints(const QDBusInterface &filesystem)
@@ -8,8 +8,11 @@
 
 #include <QObject>
 #include <QFile>
+#include <QHash>
+#include <QDBusMessage>
 
 class QDBusInterface;
+class QEventLoop;
 
 class UDisks2Api : public QObject
 {
@@ -25,12 +28,23 @@ public:
     QByteArrayList mountPoints(const QDBusInterface &filesystem);
 
 protected:
+    /* Proxies are kept, creating one costs an introspection round trip */
+    QHash<QString, QDBusInterface *> _interfaces;
+    /* Object whose changes _waitForChange() waits for, and how many there were */
+    QString _watchPath;
+    quint64 _changeCount;
+    QEventLoop *_loop;
+
+    QDBusInterface *_interface(const QString &path, const QString &interface);
     QString _resolveDevice(const QString &device);
-    void _unmountDrive(const QString &driveDbusPath);
+    void _unmountDrive(const QString &dbusPath);
+    QString _mountFilesystem(const QString &devpath);
+    bool _waitForChange(quint64 since, int timeoutMs);
 
 signals:
 
-public slots:
+protected slots:
+    void _onObjectChanged(const QDBusMessage &msg);
 };
 
 #endif // UDISKS2API_H
@@ -5,9 +5,17 @@
 
 #include "localfileextractthread.h"
 #include "config.h"
+#include "sharereader.h"
+#include "threadplacement.h"
+#include <archive.h>
+#include <QDebug>
+#include <string.h>
+#ifndef Q_OS_WIN
+#include <sys/mman.h>
+#endif
 
 LocalFileExtractThread::LocalFileExtractThread(const QByteArray &url, const QByteArray &dst, const QByteArray &expectedHash, QObject *parent)
-    : DownloadExtractThread(url, dst, expectedHash, parent)
+    : DownloadExtractThread(url, dst, expectedHash, parent), _useMmap(false), _map(nullptr), _mapOffset(0), _mapSize(0), _mapPos(0), _shareReader(nullptr)
 {
     _inputBuf = (char *) qMallocAligned(IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE, 4096);
 }
@@ -16,20 +24,27 @@ LocalFileExtractThread::~LocalFileExtractThread()
 {
     _cancelled = true;
     wait();
+    delete _shareReader;
     qFreeAligned(_inputBuf);
 }
 
 void LocalFileExtractThread::_cancelExtract()
 {
     _cancelled = true;
-    if (_inputfile.isOpen())
+    if (_shareReader)
+        _shareReader->cancel();
+    /* Closing would unmap memory the extract thread may still be reading from */
+    if (_inputfile.isOpen() && !_useMmap)
         _inputfile.close();
 }
 
 void LocalFileExtractThread::run()
 {
+    ThreadPlacement::apply(ThreadPlacement::StageDownload);
     if (isImage() && !_openAndPrepareDevice())
         return;
+    if (isImage() && !_bmapUrl.isEmpty())
+        _fetchBmap();
 
     emit preparationStatusUpdate(tr("opening image file"));
     _timer.start();
@@ -42,6 +57,25 @@ void LocalFileExtractThread::run()
     }
     _lastDlTotal = _inputfile.size();
 
+    if (ShareReader::isOnNetworkShare(_inputfile.fileName()))
+    {
+        /* Page faults on the mapping would wait a round trip each */
+        size_t chunkSize = qMin((qint64) IMAGEWRITER_SHARE_READ_SIZE, _budget.mmapWindowSize/2);
+        delete _shareReader;
+        _shareReader = new ShareReader(chunkSize, _budget.mmapWindowSize);
+        if (!_shareReader->open(_inputfile.fileName()))
+        {
+            delete _shareReader;
+            _shareReader = nullptr;
+        }
+    }
+    else
+    {
+        _useMmap = _mapWindow(0);
+        if (!_useMmap)
+            qDebug() << "Unable to memory map image file. Using regular reads";
+    }
+
     if(_filename == "uniflash")
     {
         // Download needed tiboot3.bin linux.appimage and u-boot.img
@@ -56,26 +90,190 @@ void LocalFileExtractThread::run()
         _closeFiles();
 }
 
+void LocalFileExtractThread::extractImageRun()
+{
+    /* Verified extracted cache to an image file. The data need not pass through here at all */
+    if (_isNormalFile && _hasVerifiedInput && _fanoutTargets.isEmpty() && _useMmap && _isUncompressedImage()
+            && _cloneImageFile(_inputfile.handle(), _inputfile.size()))
+    {
+        _lastDlNow = _inputfile.size();
+        _writeComplete();
+    }
+    else if (_useMmap && _isUncompressedImage())
+    {
+        _writeMappedImage();
+    }
+    else
+    {
+        DownloadExtractThread::extractImageRun();
+    }
+}
+
+/* Maps the window of the input file starting at offset, unmapping the previous one */
+bool LocalFileExtractThread::_mapWindow(qint64 offset)
+{
+    if (_map)
+    {
+        _inputfile.unmap(_map);
+        _map = nullptr;
+    }
+
+    _mapOffset = offset;
+    _mapPos = 0;
+    _mapSize = qMin(_budget.mmapWindowSize, _inputfile.size()-offset);
+    if (_mapSize <= 0)
+    {
+        _mapSize = 0;
+        return true;
+    }
+
+    _map = _inputfile.map(offset, _mapSize);
+    if (!_map)
+        return false;
+#ifndef Q_OS_WIN
+    ::madvise(_map, _mapSize, MADV_SEQUENTIAL);
+#endif
+
+    return true;
+}
+
+/* Let libarchive look at the start of the file, with the same formats and
+   filters extractImageRun() supports, to see if it is a raw uncompressed image */
+bool LocalFileExtractThread::_isUncompressedImage()
+{
+    struct archive *a = archive_read_new();
+    struct archive_entry *entry;
+    bool uncompressed = false;
+
+    archive_read_support_filter_all(a);
+    archive_read_support_format_zip(a);
+    archive_read_support_format_7zip(a);
+    archive_read_support_format_raw(a);
+
+    if (_mapSize && archive_read_open_memory(a, _map, _mapSize) == ARCHIVE_OK
+            && archive_read_next_header(a, &entry) == ARCHIVE_OK)
+    {
+        uncompressed = archive_format(a) == ARCHIVE_FORMAT_RAW
+                && archive_filter_count(a) == 1 && archive_filter_code(a, 0) == ARCHIVE_FILTER_NONE;
+    }
+    archive_read_free(a);
+
+    return uncompressed;
+}
+
+/* Writes uncompressed image straight from the memory mapping,
+   without copying it into write buffers first */
+void LocalFileExtractThread::_writeMappedImage()
+{
+    char *paddingBuf = nullptr;
+    const qint64 blockSize = _blockSize();
+    qDebug() << "Writing uncompressed image from memory mapping";
+
+    while (_mapSize && !_cancelled)
+    {
+        while (_mapPos < _mapSize && !_cancelled)
+        {
+            const char *buf = (const char *) _map+_mapPos;
+            size_t len = qMin(blockSize, _mapSize-_mapPos);
+            size_t writeLen = len;
+
+            if (len % 512 != 0)
+            {
+                /* Last block. Mapping cannot be padded, so copy it */
+                writeLen = len + 512-(len % 512);
+                qDebug() << "Image is NOT a valid disk image, as its length is not a multiple of the sector size of 512 bytes long";
+                qDebug() << "Last write() would be" << len << "bytes, but padding to" << writeLen << "bytes";
+                paddingBuf = (char *) qMallocAligned(writeLen, 4096);
+                memcpy(paddingBuf, buf, len);
+                memset(paddingBuf+len, 0, writeLen-len);
+                buf = paddingBuf;
+            }
+            else
+            {
+                /* Data the device gets written anyway can go without passing through user space.
+                   _writeFile() still hashes it from the mapping */
+                _setCopySource(_inputfile.handle(), _mapOffset+_mapPos);
+            }
+
+            if (_writeFile(buf, writeLen) != writeLen)
+            {
+                qFreeAligned(paddingBuf);
+                if (!_cancelled)
+                    _onWriteError();
+                return;
+            }
+            _mapPos += len;
+            _lastDlNow += len;
+        }
+
+        if (!_mapWindow(_mapOffset+_mapSize))
+        {
+            qFreeAligned(paddingBuf);
+            _onDownloadError(tr("Error reading image file"));
+            return;
+        }
+    }
+    qFreeAligned(paddingBuf);
+
+    if (!_cancelled)
+        _writeComplete();
+}
+
 ssize_t LocalFileExtractThread::_on_read(struct archive *, const void **buff)
 {
     if (_cancelled)
         return -1;
 
-    *buff = _inputBuf;
-    ssize_t len = _inputfile.read(_inputBuf, IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE);
+    if (_useMmap)
+    {
+        /* Hand out pointers into the mapping. A block is only valid until the
+           next call, which may unmap its window to map the next one. That is
+           all libarchive and the decoders rely on, anything kept longer is copied */
+        if (_mapPos == _mapSize && _mapSize && !_mapWindow(_mapOffset+_mapSize))
+            return -1;
+        if (!_mapSize)
+            return 0;
+
+        ssize_t len = qMin((qint64) IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE, _mapSize-_mapPos);
+        *buff = _map+_mapPos;
+        _mapPos += len;
+        _lastDlNow += len;
+        if (!_isImage)
+        {
+            _inputHash.addData((const char *) *buff, len);
+        }
+
+        return len;
+    }
+
+    ssize_t len;
+    if (_shareReader)
+    {
+        len = _shareReader->read(buff);
+    }
+    else
+    {
+        *buff = _inputBuf;
+        len = _inputfile.read(_inputBuf, IMAGEWRITER_UNCOMPRESSED_BLOCKSIZE);
+    }
 
     if (len > 0)
     {
         _lastDlNow += len;
         if (!_isImage)
         {
-            _inputHash.addData(_inputBuf, len);
+            _inputHash.addData((const char *) *buff, len);
         }
     }
 
     return len;
 }
 
+QString LocalFileExtractThread::_seekableInput() const
+{
+    return _inputfile.fileName();
+}
+
 int LocalFileExtractThread::_on_close(struct archive *)
 {
     _inputfile.close();
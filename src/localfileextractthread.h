@@ -9,6 +9,8 @@
 #include "downloadextractthread.h"
 #include <QFile>
 
+class ShareReader;
+
 class LocalFileExtractThread : public DownloadExtractThread
 {
     Q_OBJECT
@@ -19,10 +21,22 @@ public:
 protected:
     virtual void _cancelExtract();
     virtual void run();
+    virtual void extractImageRun();
     virtual ssize_t _on_read(struct archive *a, const void **buff);
     virtual int _on_close(struct archive *a);
+    virtual QString _seekableInput() const;
+    bool _mapWindow(qint64 offset);
+    bool _isUncompressedImage();
+    void _writeMappedImage();
+
     QFile _inputfile;
     char *_inputBuf;
+    /* Memory mapped input: current window of the file, and how much of it was consumed */
+    bool _useMmap;
+    uchar *_map;
+    qint64 _mapOffset, _mapSize, _mapPos;
+    /* Instead of the mapping, for image files on a network share */
+    ShareReader *_shareReader;
 };
 
 #endif // LOCALFILEEXTRACTTHREAD_H
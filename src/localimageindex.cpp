@@ -0,0 +1,301 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "localimageindex.h"
+#include "acceleratedcryptographichash.h"
+#include "imageprobe.h"
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QElapsedTimer>
+
+/* Read size while hashing */
+#define LOCALIMAGEINDEX_READ_SIZE  (1024*1024)
+
+LocalImageIndex::LocalImageIndex(QObject *parent)
+    : QThread(parent), _cancelled(false)
+{
+}
+
+LocalImageIndex::~LocalImageIndex()
+{
+    cancel();
+    wait();
+}
+
+void LocalImageIndex::setIndexFile(const QString &filename)
+{
+    QMutexLocker lock(&_mutex);
+    _indexFile = filename;
+    _load();
+}
+
+void LocalImageIndex::setFolders(const QStringList &folders)
+{
+    QMutexLocker lock(&_mutex);
+    _folders = folders;
+}
+
+QStringList LocalImageIndex::folders() const
+{
+    QMutexLocker lock(&_mutex);
+    return _folders;
+}
+
+void LocalImageIndex::setMediaFolders(const QStringList &folders)
+{
+    QMutexLocker lock(&_mutex);
+    _mediaFolders = folders;
+}
+
+QStringList LocalImageIndex::nameFilters()
+{
+    return {"*.img", "*.zip", "*.gz", "*.xz", "*.zst", "*.lz4"};
+}
+
+bool LocalImageIndex::lookup(const QString &path, Entry *entry) const
+{
+    QFileInfo fi(path);
+    QMutexLocker lock(&_mutex);
+    auto it = _entries.constFind(fi.absoluteFilePath());
+
+    if (it == _entries.constEnd() || it->fileSize != (quint64) fi.size()
+            || it->lastModified != fi.lastModified().toMSecsSinceEpoch())
+        return false;
+
+    *entry = it.value();
+    return true;
+}
+
+QList<LocalImageIndex::Entry> LocalImageIndex::entries() const
+{
+    QMutexLocker lock(&_mutex);
+    return _entries.values();
+}
+
+static void collectByHash(const QJsonArray &list, QHash<QByteArray, QJsonObject> &byDownloadHash, QHash<QByteArray, QJsonObject> &byExtractHash)
+{
+    for (const QJsonValue &item : list)
+    {
+        QJsonObject obj = item.toObject();
+
+        if (obj.contains("subitems"))
+            collectByHash(obj["subitems"].toArray(), byDownloadHash, byExtractHash);
+        if (obj.contains("image_download_sha256"))
+            byDownloadHash.insert(obj["image_download_sha256"].toString().toLatin1().toLower(), obj);
+        if (obj.contains("extract_sha256"))
+            byExtractHash.insert(obj["extract_sha256"].toString().toLatin1().toLower(), obj);
+    }
+}
+
+int LocalImageIndex::matchOsList(const QJsonArray &osList)
+{
+    QHash<QByteArray, QJsonObject> byDownloadHash, byExtractHash;
+    collectByHash(osList, byDownloadHash, byExtractHash);
+    if (byDownloadHash.isEmpty() && byExtractHash.isEmpty())
+        return 0;
+
+    QMutexLocker lock(&_mutex);
+    int changed = 0;
+
+    for (Entry &entry : _entries)
+    {
+        QJsonObject obj;
+
+        if (byDownloadHash.contains(entry.sha256))
+            obj = byDownloadHash.value(entry.sha256);
+        else if (entry.format == "img" && byExtractHash.contains(entry.sha256))
+            obj = byExtractHash.value(entry.sha256);
+        else
+            continue;
+
+        QByteArray extractSha256 = obj["extract_sha256"].toString().toLatin1().toLower();
+        quint64 extractSize = obj["extract_size"].toInteger();
+        QString bmapUrl = obj["bmap_url"].toString();
+        QString chunkIndexUrl = obj["chunk_index_url"].toString();
+
+        if (extractSha256.isEmpty() || (entry.extractSha256 == extractSha256 && entry.extractSize == extractSize
+                                        && entry.bmapUrl == bmapUrl && entry.chunkIndexUrl == chunkIndexUrl))
+            continue;
+
+        qDebug() << "Local image" << entry.path << "is" << obj["name"].toString() << "of the OS list";
+        entry.extractSha256 = extractSha256;
+        if (extractSize)
+            entry.extractSize = extractSize;
+        entry.bmapUrl = bmapUrl;
+        entry.chunkIndexUrl = chunkIndexUrl;
+        changed++;
+    }
+    if (changed)
+        _save();
+
+    return changed;
+}
+
+void LocalImageIndex::cancel()
+{
+    _cancelled = true;
+}
+
+void LocalImageIndex::run()
+{
+    _cancelled = false;
+    QStringList folders;
+    {
+        QMutexLocker lock(&_mutex);
+        folders = _folders + _mediaFolders;
+    }
+    QElapsedTimer t;
+    int hashed = 0;
+    t.start();
+
+    for (const QString &folder : std::as_const(folders))
+    {
+        QDir dir(folder);
+        const QFileInfoList files = dir.entryInfoList(nameFilters(), QDir::Files, QDir::Name);
+
+        for (const QFileInfo &fi : files)
+        {
+            if (_cancelled)
+                return;
+
+            Entry entry;
+            if (lookup(fi.absoluteFilePath(), &entry))
+                continue;
+
+            entry.path = fi.absoluteFilePath();
+            entry.fileSize = fi.size();
+            entry.lastModified = fi.lastModified().toMSecsSinceEpoch();
+            entry.format = fi.suffix().toLower().toLatin1();
+
+            if (!_hashFile(entry.path, entry.sha256))
+                continue;
+
+            if (entry.format == "img")
+            {
+                /* Nothing to extract */
+                entry.extractSha256 = entry.sha256;
+                entry.extractSize = entry.fileSize;
+            }
+            else if (entry.format != "zip")
+            {
+                ImageProbe::Result probed = ImageProbe::probeFile(entry.path);
+                if (probed.exact)
+                    entry.extractSize = probed.size;
+            }
+
+            {
+                QMutexLocker lock(&_mutex);
+                _entries.insert(entry.path, entry);
+                _save();
+            }
+            hashed++;
+            emit indexed(entry.path);
+        }
+    }
+
+    /* Forget files that are gone from folders that are still there. Media that is not plugged in keeps its entries */
+    QMutexLocker lock(&_mutex);
+    for (auto it = _entries.begin(); it != _entries.end(); )
+    {
+        QFileInfo fi(it.key());
+        if (QDir(fi.absolutePath()).exists() && !fi.exists())
+            it = _entries.erase(it);
+        else
+            ++it;
+    }
+    _save();
+
+    qDebug() << "Indexed" << hashed << "local images in" << t.elapsed() / 1000 << "seconds," << _entries.size() << "known";
+}
+
+bool LocalImageIndex::_hashFile(const QString &path, QByteArray &sha256)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Cannot open local image" << path << "for indexing:" << f.errorString();
+        return false;
+    }
+
+    AcceleratedCryptographicHash hash(QCryptographicHash::Sha256);
+    QByteArray buf(LOCALIMAGEINDEX_READ_SIZE, Qt::Uninitialized);
+    qint64 n;
+
+    while ((n = f.read(buf.data(), buf.size())) > 0)
+    {
+        if (_cancelled)
+            return false;
+        hash.addData(buf.constData(), n);
+    }
+    if (n < 0)
+    {
+        qDebug() << "Error reading local image" << path << ":" << f.errorString();
+        return false;
+    }
+
+    sha256 = hash.result().toHex();
+    return true;
+}
+
+void LocalImageIndex::_load()
+{
+    _entries.clear();
+
+    QFile f(_indexFile);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+
+    /* Sizes and timestamps are stored as strings, as JSON numbers are doubles */
+    const QJsonArray images = QJsonDocument::fromJson(f.readAll()).object().value("images").toArray();
+    for (const QJsonValue &value : images)
+    {
+        QJsonObject obj = value.toObject();
+        Entry entry;
+
+        entry.path = obj["path"].toString();
+        entry.fileSize = obj["size"].toString().toULongLong();
+        entry.lastModified = obj["mtime"].toString().toLongLong();
+        entry.format = obj["format"].toString().toLatin1();
+        entry.sha256 = obj["sha256"].toString().toLatin1();
+        entry.extractSha256 = obj["extract_sha256"].toString().toLatin1();
+        entry.extractSize = obj["extract_size"].toString().toULongLong();
+        entry.bmapUrl = obj["bmap_url"].toString();
+        entry.chunkIndexUrl = obj["chunk_index_url"].toString();
+        if (!entry.path.isEmpty() && entry.sha256.size() == 64)
+            _entries.insert(entry.path, entry);
+    }
+}
+
+void LocalImageIndex::_save() const
+{
+    if (_indexFile.isEmpty())
+        return;
+
+    QJsonArray images;
+    for (const Entry &entry : _entries)
+    {
+        images.append(QJsonObject{
+            {"path", entry.path},
+            {"size", QString::number(entry.fileSize)},
+            {"mtime", QString::number(entry.lastModified)},
+            {"format", QString::fromLatin1(entry.format)},
+            {"sha256", QString::fromLatin1(entry.sha256)},
+            {"extract_sha256", QString::fromLatin1(entry.extractSha256)},
+            {"extract_size", QString::number(entry.extractSize)},
+            {"bmap_url", entry.bmapUrl},
+            {"chunk_index_url", entry.chunkIndexUrl}
+        });
+    }
+
+    QDir().mkpath(QFileInfo(_indexFile).absolutePath());
+    QFile f(_indexFile);
+    if (!f.open(QIODevice::WriteOnly) || f.write(QJsonDocument(QJsonObject{{"images", images}}).toJson(QJsonDocument::Compact)) == -1)
+        qDebug() << "Error writing local image index" << f.fileName();
+}
@@ -0,0 +1,94 @@
+#ifndef LOCALIMAGEINDEX_H
+#define LOCALIMAGEINDEX_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QHash>
+#include <QJsonArray>
+#include <QList>
+#include <QMutex>
+#include <QStringList>
+#include <QThread>
+#include <atomic>
+
+/*
+ * Index of the image files in local folders and on USB source media
+ *
+ * A local image is otherwise just a file name: without the hash and size
+ * of the image in it, it cannot be found in the extracted cache, shows no
+ * exact progress and is decompressed again on every write.
+ *
+ * Once started, the thread looks at the image files in the folders, and
+ * hashes those that are new or changed since they were indexed. It
+ * records their format, size, uncompressed size if the metadata tells
+ * (see ImageProbe) and SHA256. The index is kept as JSON in the cache
+ * directory, so files are only hashed once.
+ *
+ * A raw image is its own extracted image. Compressed ones learn the hash
+ * and size of the image in them from the OS list entry with the same
+ * image_download_sha256, see matchOsList(), along with its bmap and
+ * chunk index.
+ */
+class LocalImageIndex : public QThread
+{
+    Q_OBJECT
+public:
+    struct Entry
+    {
+        QString path;
+        quint64 fileSize = 0;
+        qint64 lastModified = 0;
+        /* Extension, lower case: img, zip, gz, xz, zst or lz4 */
+        QByteArray format;
+        /* Hex SHA256 of the file */
+        QByteArray sha256;
+        /* Of the extracted image. Hash empty and size 0 if unknown */
+        QByteArray extractSha256;
+        quint64 extractSize = 0;
+        QString bmapUrl, chunkIndexUrl;
+    };
+
+    explicit LocalImageIndex(QObject *parent = nullptr);
+    virtual ~LocalImageIndex();
+
+    /* Load the index from filename, and save it there */
+    void setIndexFile(const QString &filename);
+    /* Folders whose image files (not those in subfolders) are indexed */
+    void setFolders(const QStringList &folders);
+    QStringList folders() const;
+    /* Folders of the removable media there is now, indexed along with folders() */
+    void setMediaFolders(const QStringList &folders);
+    /* Image file name patterns */
+    static QStringList nameFilters();
+
+    /* Entry of path, if it is indexed and the file has not changed since */
+    bool lookup(const QString &path, Entry *entry) const;
+    QList<Entry> entries() const;
+
+    /* Fill in what OS list entries know about indexed images. Returns the number of entries changed */
+    int matchOsList(const QJsonArray &osList);
+
+    void cancel();
+
+signals:
+    /* An image file was hashed */
+    void indexed(const QString &path);
+
+protected:
+    mutable QMutex _mutex;
+    QString _indexFile;
+    QStringList _folders, _mediaFolders;
+    QHash<QString, Entry> _entries;
+    std::atomic<bool> _cancelled;
+
+    virtual void run();
+    bool _hashFile(const QString &path, QByteArray &sha256);
+    void _load();
+    /* Called with _mutex held */
+    void _save() const;
+};
+
+#endif // LOCALIMAGEINDEX_H
@@ -0,0 +1,44 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "logging.h"
+#include <QDeadlineTimer>
+
+Q_LOGGING_CATEGORY(lcTftp, "gemimager.tftp")
+Q_LOGGING_CATEGORY(lcDhcp, "gemimager.dhcp")
+Q_LOGGING_CATEGORY(lcUniflash, "gemimager.uniflash")
+
+LogRateLimit::LogRateLimit(int perSecond)
+    : _perSecond(perSecond), _second(-1), _count(0), _suppressed(0)
+{
+}
+
+bool LogRateLimit::allow()
+{
+    /* Counting per second is approximate when several threads log at once, which is fine here */
+    qint64 second = QDeadlineTimer::current().deadline() / 1000;
+    if (_second.exchange(second) != second)
+        _count = 0;
+
+    if (++_count > _perSecond)
+    {
+        _suppressed++;
+        return false;
+    }
+    return true;
+}
+
+quint64 LogRateLimit::takeSuppressed()
+{
+    return _suppressed.exchange(0);
+}
+
+QDebug operator<<(QDebug dbg, LogRateLimit &limit)
+{
+    quint64 suppressed = limit.takeSuppressed();
+    if (suppressed)
+        dbg << "(" << suppressed << "similar messages suppressed )";
+    return dbg;
+}
@@ -0,0 +1,63 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "config.h"
+#include <QDebug>
+#include <QLoggingCategory>
+#include <atomic>
+
+/*
+ * Logging of the parts that handle every packet or block
+ *
+ * Their messages have categories, so they can be turned off at run time,
+ * e.g. QT_LOGGING_RULES="gemimager.tftp.debug=false".
+ *
+ * qCTrace() is for messages about every packet or block. They compile to
+ * nothing, arguments included, unless built with ENABLE_TRACE_LOGGING.
+ * Count such events instead, and log the totals once.
+ *
+ * qCDebugLimited() is for messages that repeat as often only when things
+ * go wrong, like duplicates and retries. Each place lets through at most
+ * IMAGEWRITER_LOG_RATE_LIMIT a second, and tells how many it held back.
+ */
+
+Q_DECLARE_LOGGING_CATEGORY(lcTftp)
+Q_DECLARE_LOGGING_CATEGORY(lcDhcp)
+Q_DECLARE_LOGGING_CATEGORY(lcUniflash)
+
+#ifdef IMAGEWRITER_TRACE_LOGGING
+#define qCTrace(category) qCDebug(category)
+#else
+#define qCTrace(category) while (false) qCDebug(category)
+#endif
+
+class LogRateLimit
+{
+public:
+    explicit LogRateLimit(int perSecond);
+    /* Whether a message may be logged now */
+    bool allow();
+    /* Messages held back since the last call */
+    quint64 takeSuppressed();
+
+protected:
+    const int _perSecond;
+    std::atomic<qint64> _second;
+    std::atomic<int> _count;
+    std::atomic<quint64> _suppressed;
+};
+
+/* Number of messages held back before this one, if any */
+QDebug operator<<(QDebug dbg, LogRateLimit &limit);
+
+#define qCDebugLimited(category) \
+    for (LogRateLimit *_logLimit = &[]() -> LogRateLimit & { static LogRateLimit limit(IMAGEWRITER_LOG_RATE_LIMIT); return limit; }(); \
+         _logLimit && category().isDebugEnabled() && _logLimit->allow(); _logLimit = nullptr) \
+        qCDebug(category) << *_logLimit
+
+#endif // LOGGING_H
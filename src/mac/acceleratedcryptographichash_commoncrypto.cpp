@@ -6,20 +6,30 @@
  */
 
 #include "acceleratedcryptographichash.h"
+#include "sha256native.h"
 
 #include <CommonCrypto/CommonDigest.h>
 
 struct AcceleratedCryptographicHash::impl {
-    explicit impl(QCryptographicHash::Algorithm algo) {
+    explicit impl(QCryptographicHash::Algorithm algo)
+        : _finished(false)
+    {
         if (algo != QCryptographicHash::Sha256)
             throw std::runtime_error("Only sha256 implemented");
 
         CC_SHA256_Init(&_sha256);
     }
 
-    void addData(const char *data, int length)
+    void addData(const char *data, size_t length)
     {
-        CC_SHA256_Update(&_sha256, data, length);
+        /* CC_LONG is 32-bit */
+        while (length)
+        {
+            CC_LONG n = (CC_LONG) qMin(length, (size_t) 0x40000000);
+            CC_SHA256_Update(&_sha256, data, n);
+            data += n;
+            length -= n;
+        }
     }
 
     void addData(const QByteArray &data)
@@ -28,26 +38,41 @@ struct AcceleratedCryptographicHash::impl {
     }
 
     QByteArray result() {
-        unsigned char binhash[CC_SHA256_DIGEST_LENGTH];
-        CC_SHA256_Final(binhash, &_sha256);
-        return QByteArray((char *) binhash, sizeof binhash);
+        if (!_finished)
+        {
+            unsigned char binhash[CC_SHA256_DIGEST_LENGTH];
+            CC_SHA256_Final(binhash, &_sha256);
+            _result = QByteArray((char *) binhash, sizeof binhash);
+            _finished = true;
+        }
+        return _result;
     }
 
 private:
     CC_SHA256_CTX _sha256;
+    QByteArray _result;
+    bool _finished;
 };
 
 AcceleratedCryptographicHash::AcceleratedCryptographicHash(QCryptographicHash::Algorithm method)
-    : p_Impl(std::make_unique<impl>(method)) {}
+{
+    if (method == QCryptographicHash::Sha256 && nativeImplementation())
+        p_Native = std::make_unique<Sha256Native>();
+    else
+        p_Impl = std::make_unique<impl>(method);
+}
 
 AcceleratedCryptographicHash::~AcceleratedCryptographicHash() = default;
 
-void AcceleratedCryptographicHash::addData(const char *data, int length) {
-    p_Impl->addData(data, length);
+void AcceleratedCryptographicHash::addData(const char *data, size_t length) {
+    if (p_Native)
+        p_Native->addData(data, length);
+    else
+        p_Impl->addData(data, length);
 }
 void AcceleratedCryptographicHash::addData(const QByteArray &data) {
-    p_Impl->addData(data);
+    addData(data.constData(), data.size());
 }
 QByteArray AcceleratedCryptographicHash::result() {
-    return p_Impl->result();
+    return p_Native ? p_Native->result() : p_Impl->result();
 }
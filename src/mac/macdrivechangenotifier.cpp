@@ -0,0 +1,125 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "../drivechangenotifier.h"
+#include <DiskArbitration/DiskArbitration.h>
+#include <IOKit/IOKitLib.h>
+#include <IOKit/serial/IOSerialKeys.h>
+#include <dispatch/dispatch.h>
+
+/* Disk Arbitration reports media as disks, so this covers cards put into a reader as well */
+static void _onDiskAppearedOrDisappeared(DADiskRef, void *context)
+{
+    static_cast<DriveChangeNotifier *>(context)->notify();
+}
+
+/* Mounts and unmounts */
+static void _onDiskDescriptionChanged(DADiskRef, CFArrayRef, void *context)
+{
+    static_cast<DriveChangeNotifier *>(context)->notify();
+}
+
+/* Serial ports and network interfaces. The iterator has to be drained to get the next notification */
+static void _onPortsChanged(void *context, io_iterator_t iterator)
+{
+    io_object_t service;
+    while ((service = IOIteratorNext(iterator)))
+        IOObjectRelease(service);
+    static_cast<DriveChangeNotifier *>(context)->notify();
+}
+
+static void _noop(void *)
+{
+}
+
+DriveChangeNotifier::~DriveChangeNotifier()
+{
+    _stop();
+}
+
+bool DriveChangeNotifier::start()
+{
+    if (_devices == Ports)
+    {
+        IONotificationPortRef port = IONotificationPortCreate(MACH_PORT_NULL);
+        if (!port)
+            return false;
+        dispatch_queue_t queue = dispatch_queue_create("org.t3gemstone.gem-imager.portchanges", DISPATCH_QUEUE_SERIAL);
+        IONotificationPortSetDispatchQueue(port, queue);
+        _handles.push_back((void *) port);
+        _handles.push_back((void *) queue);
+
+        const char *classes[] = { kIOSerialBSDServiceValue, "IONetworkInterface" };
+        const char *types[] = { kIOFirstMatchNotification, kIOTerminatedNotification };
+        for (const char *serviceClass : classes)
+        {
+            for (const char *type : types)
+            {
+                io_iterator_t iterator;
+                /* Consumes the matching dictionary */
+                if (IOServiceAddMatchingNotification(port, type, IOServiceMatching(serviceClass), _onPortsChanged, this, &iterator) != KERN_SUCCESS)
+                {
+                    _stop();
+                    return false;
+                }
+                /* Arms it. Reports a change, so the ports present are listed right away */
+                _onPortsChanged(this, iterator);
+                _handles.push_back((void *) (uintptr_t) iterator);
+            }
+        }
+        return true;
+    }
+
+    DASessionRef session = DASessionCreate(kCFAllocatorDefault);
+    if (!session)
+        return false;
+
+    DARegisterDiskAppearedCallback(session, NULL, _onDiskAppearedOrDisappeared, this);
+    DARegisterDiskDisappearedCallback(session, NULL, _onDiskAppearedOrDisappeared, this);
+    DARegisterDiskDescriptionChangedCallback(session, NULL, kDADiskDescriptionWatchVolumePath, _onDiskDescriptionChanged, this);
+
+    /* Callbacks run on a queue of their own, the drive list thread has no run loop */
+    dispatch_queue_t queue = dispatch_queue_create("org.t3gemstone.gem-imager.drivechanges", DISPATCH_QUEUE_SERIAL);
+    DASessionSetDispatchQueue(session, queue);
+
+    _handles.push_back((void *) session);
+    _handles.push_back((void *) queue);
+    return true;
+}
+
+void DriveChangeNotifier::_stop()
+{
+    if (_handles.empty())
+        return;
+
+    if (_devices == Ports)
+    {
+        IONotificationPortRef port = (IONotificationPortRef) _handles[0];
+        dispatch_queue_t queue = (dispatch_queue_t) _handles[1];
+
+        for (size_t i = 2; i < _handles.size(); i++)
+            IOObjectRelease((io_iterator_t) (uintptr_t) _handles[i]);
+        IONotificationPortSetDispatchQueue(port, NULL);
+        dispatch_sync_f(queue, NULL, _noop);
+
+        IONotificationPortDestroy(port);
+        dispatch_release(queue);
+        _handles.clear();
+        return;
+    }
+
+    DASessionRef session = (DASessionRef) _handles[0];
+    dispatch_queue_t queue = (dispatch_queue_t) _handles[1];
+
+    DASessionSetDispatchQueue(session, NULL);
+    DAUnregisterCallback(session, (void *) _onDiskAppearedOrDisappeared, this);
+    DAUnregisterCallback(session, (void *) _onDiskDescriptionChanged, this);
+    /* Lets callbacks already queued finish before this is gone */
+    dispatch_sync_f(queue, NULL, _noop);
+
+    CFRelease(session);
+    dispatch_release(queue);
+    _handles.clear();
+}
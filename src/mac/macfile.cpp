@@ -8,15 +8,28 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/socket.h>
+#include <string.h>
 #include <security/Authorization.h>
 #include <QDebug>
 
 MacFile::MacFile(QObject *parent)
-    : QFile(parent)
+    : QFile(parent), _inFlight(0), _stopWriters(false)
 {
 
 }
 
+MacFile::~MacFile()
+{
+    _stopWriteQueue();
+}
+
+void MacFile::close()
+{
+    /* Waits for the writes in flight, the descriptor goes away */
+    _stopWriteQueue();
+    QFile::close();
+}
+
 /* Prevent that Qt thinks /dev/rdisk does not permit seeks because it does not report size */
 bool MacFile::isSequential() const
 {
@@ -123,5 +136,136 @@ MacFile::authOpenResult MacFile::authOpen(const QByteArray &filename)
     }
     AuthorizationFree(authRef, 0);
 
-    return open(fd, QIODevice::ReadWrite | QIODevice::ExistingOnly | QIODevice::Unbuffered, QFileDevice::AutoCloseHandle) ? authOpenSuccess : authOpenError;
+    if (!open(fd, QIODevice::ReadWrite | QIODevice::ExistingOnly | QIODevice::Unbuffered, QFileDevice::AutoCloseHandle))
+        return authOpenError;
+
+    /* Writes and verify reads go to the medium, not the unified buffer cache */
+    if (!setNoCache(true))
+        qDebug() << "Unable to set F_NOCACHE:" << strerror(errno);
+
+    return authOpenSuccess;
+}
+
+bool MacFile::setNoCache(bool noCache)
+{
+    return ::fcntl(handle(), F_NOCACHE, noCache ? 1 : 0) != -1;
+}
+
+/*
+ * Writes are handed to a few threads doing pwrite(), so the device always
+ * has more than one request to work on. The threads only write, buffers and
+ * offsets are the caller's
+ */
+bool MacFile::startWriteQueue(int depth)
+{
+    if (!_writers.empty())
+        return true;
+    if (!isOpen() || depth < 1)
+        return false;
+
+    _stopWriters = false;
+    for (int i = 0; i < depth; i++)
+        _writers.emplace_back(&MacFile::_writerRun, this, handle());
+
+    return true;
+}
+
+bool MacFile::hasWriteQueue() const
+{
+    return !_writers.empty();
+}
+
+bool MacFile::queueWrite(const char *data, size_t len, qint64 offset, quint64 userData)
+{
+    if (_writers.empty())
+        return false;
+
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    _pending.push_back({data, len, offset, userData, 0, 0});
+    _inFlight++;
+    lock.unlock();
+    _queueCv.notify_one();
+
+    return true;
+}
+
+bool MacFile::waitCompletion(quint64 *userData, qint64 *res)
+{
+    std::unique_lock<std::mutex> lock(_queueMutex);
+
+    if (!_inFlight)
+        return false;
+
+    _doneCv.wait(lock, [this]{ return !_done.empty(); });
+    WriteRequest req = _done.front();
+    _done.pop_front();
+    _inFlight--;
+    lock.unlock();
+
+    *userData = req.userData;
+    *res = req.res;
+    if (req.res < 0)
+        setErrorString(QString::fromLocal8Bit(strerror(req.err)));
+
+    return true;
+}
+
+unsigned MacFile::inFlight() const
+{
+    std::lock_guard<std::mutex> lock(_queueMutex);
+    return _inFlight;
+}
+
+void MacFile::_writerRun(int fd)
+{
+    std::unique_lock<std::mutex> lock(_queueMutex);
+
+    while (true)
+    {
+        _queueCv.wait(lock, [this]{ return !_pending.empty() || _stopWriters; });
+        if (_pending.empty())
+            break;
+
+        WriteRequest req = _pending.front();
+        _pending.pop_front();
+        lock.unlock();
+
+        size_t done = 0;
+        while (done < req.len)
+        {
+            ssize_t n = ::pwrite(fd, req.data+done, req.len-done, req.offset+done);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                req.err = (n == -1) ? errno : EIO;
+                break;
+            }
+            done += n;
+        }
+        req.res = req.err ? -1 : (qint64) done;
+
+        lock.lock();
+        _done.push_back(req);
+        _doneCv.notify_all();
+    }
+}
+
+void MacFile::_stopWriteQueue()
+{
+    if (_writers.empty())
+        return;
+
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    /* Threads finish what is queued before they stop */
+    _stopWriters = true;
+    lock.unlock();
+    _queueCv.notify_all();
+
+    for (auto &t : _writers)
+        t.join();
+    _writers.clear();
+    _pending.clear();
+    _done.clear();
+    _inFlight = 0;
 }
@@ -7,6 +7,11 @@
  */
 
 #include <QFile>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 class MacFile : public QFile
 {
@@ -15,8 +20,47 @@ public:
     enum authOpenResult {authOpenCancelled, authOpenSuccess, authOpenError };
 
     MacFile(QObject *parent = nullptr);
+    virtual ~MacFile();
     virtual bool isSequential() const;
+    virtual void close();
     authOpenResult authOpen(const QByteArray &filename);
+
+    /* Bypass the unified buffer cache (F_NOCACHE) */
+    bool setNoCache(bool noCache);
+
+    /* Start threads for queued writes, depth of them can be in flight */
+    bool startWriteQueue(int depth);
+    bool hasWriteQueue() const;
+
+    /* Start writing at offset without waiting for it. The buffer must stay valid until
+       its completion is returned */
+    bool queueWrite(const char *data, size_t len, qint64 offset, quint64 userData);
+    /* Wait for a queued write to complete. res is bytes written or -1 on error, see errorString().
+       Returns false if there was nothing to wait for */
+    bool waitCompletion(quint64 *userData, qint64 *res);
+    /* Number of queued writes that did not complete yet */
+    unsigned inFlight() const;
+
+protected:
+    struct WriteRequest
+    {
+        const char *data;
+        size_t len;
+        qint64 offset;
+        quint64 userData;
+        qint64 res;
+        int err;
+    };
+
+    std::vector<std::thread> _writers;
+    mutable std::mutex _queueMutex;
+    std::condition_variable _queueCv, _doneCv;
+    std::deque<WriteRequest> _pending, _done;
+    unsigned _inFlight;
+    bool _stopWriters;
+
+    void _writerRun(int fd);
+    void _stopWriteQueue();
 };
 
 #endif // MACFILE_H
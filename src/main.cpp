@@ -9,11 +9,13 @@
 #include <QQmlContext>
 #include <QIcon>
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QTextStream>
 #include "imagewriter.h"
 #include "drivelistmodel.h"
 #include "networkaccessmanagerfactory.h"
 #include "cli.h"
+#include "osiconprovider.h"
 #include <QMessageLogContext>
 #include <QQuickWindow>
 #include <QTranslator>
@@ -22,10 +24,11 @@
 #include <QSettings>
 #include <QFont>
 #include <QFontDatabase>
+#include <QDir>
+#include <QStandardPaths>
 #ifdef QT_NO_WIDGETS
 #include <xf86drm.h>
 #include <xf86drmMode.h>
-#include <QDir>
 #endif
 #ifndef QT_NO_WIDGETS
 #include <QtWidgets/QApplication>
@@ -135,6 +138,14 @@ bool handleDri()
 
 int main(int argc, char *argv[])
 {
+    /* Time taken by each phase of starting up, reported with --debug once the window is drawn */
+    QElapsedTimer startupTimer;
+    startupTimer.start();
+    QList<QPair<QString, qint64>> startupPhases;
+    auto startupPhase = [&startupTimer, &startupPhases](const QString &phase) {
+        startupPhases.append({phase, startupTimer.elapsed()});
+    };
+
     for (int i = 1; i < argc; i++)
     {
         if (strcmp(argv[i], "--cli") == 0)
@@ -171,13 +182,11 @@ int main(int argc, char *argv[])
 
     /** QtQuick on QT5 exhibits spurious disk cache failures that cannot be
      * resolved by a user in a trivial manner (they have to delete the cache manually).
-     * 
-     * This flag can potentially noticeably increase the start time of the application, however
-     * between this and a hard-to-detect spurious failure affecting Linux, macOS and Windows,
-     * this trade is the one most likely to result in a good experience for the widest group
-     * of users.
+     *
+     * So no .qmlc files are read or written. The QML is compiled ahead of time into
+     * the executable instead (qt_add_qml_module), which cannot go stale, and is used.
      */
-    qputenv("QML_DISABLE_DISK_CACHE", "true");
+    qputenv("QML_DISK_CACHE", "aot");
 
 #if QT_VERSION > QT_VERSION_CHECK(6, 5, 0)
     // In version 6.5, Qt implemented Google Material Design 3,
@@ -214,7 +223,9 @@ int main(int argc, char *argv[])
     app.setOrganizationDomain("t3gemstone.org");
     app.setApplicationName("Gemstone Imager");
     app.setWindowIcon(QIcon(":/icons/gem-imager.ico"));
+    startupPhase("application");
     ImageWriter imageWriter;
+    startupPhase("image writer");
     NetworkAccessManagerFactory namf;
     QQmlApplicationEngine engine;
     QString customQm;
@@ -222,6 +233,7 @@ int main(int argc, char *argv[])
     /* Parse commandline arguments (if any) */
     QString customRepo;
     QUrl url;
+    bool debug = false;
     QStringList args = app.arguments();
     for (int i=1; i < args.size(); i++)
     {
@@ -288,6 +300,7 @@ int main(int argc, char *argv[])
         }
         else if (args[i] == "--debug")
         {
+            debug = true;
 #ifdef Q_OS_WIN
             /* Allocate console for debug messages on Windows */
             if (::AttachConsole(ATTACH_PARENT_PROCESS) || ::AllocConsole())
@@ -303,6 +316,7 @@ int main(int argc, char *argv[])
         {
             cerr << "gem-imager [--debug] [--version] [--repo <repository URL>] [--qm <custom qm translation file>] [--disable-telemetry] [<image file to write>]" << endl;
             cerr << "-OR- gem-imager --cli [--disable-verify] [--sha256 <expected hash>] [--debug] [--quiet] <image file to write> <destination drive device>" << endl;
+            cerr << "-OR- gem-imager --cli [--workers <n>] --daemon <socket name> | --jobs <JSON file>" << endl;
             return 0;
         }
         else if (args[i] == "--version")
@@ -362,18 +376,50 @@ int main(int argc, char *argv[])
             delete translator;
     }
 
+    startupPhase("arguments and translation");
+
     if (!url.isEmpty())
         imageWriter.setSrc(url);
     imageWriter.setEngine(&engine);
+    /* The list of the previous run is shown right away, the fetch brings it up to date */
+    imageWriter.loadOSListSnapshot();
+    startupPhase("OS list snapshot");
+    /* Local images are hashed in the background, to be written like those of the OS list */
+    imageWriter.indexLocalImages();
     engine.setNetworkAccessManagerFactory(&namf);
+    /* The engine takes ownership */
+    engine.addImageProvider("osicon", new OsIconProvider(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"icons"));
     engine.rootContext()->setContextProperty("imageWriter", &imageWriter);
     engine.rootContext()->setContextProperty("driveListModel", imageWriter.getDriveList());
     engine.load(QUrl(QStringLiteral("qrc:/main.qml")));
 
     if (engine.rootObjects().isEmpty())
         return -1;
+    startupPhase("QML");
 
     QObject *qmlwindow = engine.rootObjects().value(0);
+    QQuickWindow *quickwindow = qobject_cast<QQuickWindow *>(qmlwindow);
+    if (debug && quickwindow)
+    {
+        QObject::connect(quickwindow, &QQuickWindow::frameSwapped, &app, [&startupPhase, &startupPhases]() {
+            startupPhase("first frame");
+            qint64 last = 0;
+            for (const auto &phase : std::as_const(startupPhases))
+            {
+                qDebug() << "Startup:" << phase.first << "done after" << phase.second << "ms, took" << phase.second - last << "ms";
+                last = phase.second;
+            }
+        }, Qt::SingleShotConnection);
+    }
+
+    if (imageWriter.isEmbeddedMode() && quickwindow)
+    {
+        /* Runs on the render thread, if there is one */
+        QObject::connect(quickwindow, &QQuickWindow::beforeRendering, &imageWriter, [&imageWriter]() {
+            imageWriter.registerRenderThread();
+        }, static_cast<Qt::ConnectionType>(Qt::DirectConnection | Qt::SingleShotConnection));
+    }
+
     qmlwindow->connect(&imageWriter, SIGNAL(downloadProgress(QVariant,QVariant)), qmlwindow, SLOT(onDownloadProgress(QVariant,QVariant)));
     qmlwindow->connect(&imageWriter, SIGNAL(sendProgress(QVariant)), qmlwindow, SLOT(onSendingProgress(QVariant)));
     qmlwindow->connect(&imageWriter, SIGNAL(verifyProgress(QVariant,QVariant)), qmlwindow, SLOT(onVerifyProgress(QVariant,QVariant)));
@@ -387,7 +433,10 @@ int main(int argc, char *argv[])
     qmlwindow->connect(&imageWriter, SIGNAL(finalizing()), qmlwindow, SLOT(onFinalizing()));
     qmlwindow->connect(&imageWriter, SIGNAL(networkOnline()), qmlwindow, SLOT(fetchOSlist()));
     qmlwindow->connect(&imageWriter, SIGNAL(osListPrepared()), qmlwindow, SLOT(onOsListPrepared()));
+    qmlwindow->connect(&imageWriter, SIGNAL(osSubListPrepared(QVariant)), qmlwindow, SLOT(onOsSubListPrepared(QVariant)));
     qmlwindow->connect(&imageWriter, SIGNAL(networkInfo(QVariant)), qmlwindow, SLOT(onNetworkInfo(QVariant)));
+    qmlwindow->connect(&imageWriter, SIGNAL(secretsPrepared()), qmlwindow, SLOT(onSecretsPrepared()));
+    qmlwindow->connect(&imageWriter, SIGNAL(pubKeyGenerated()), qmlwindow, SLOT(onPubKeyGenerated()));
 
 #ifndef QT_NO_WIDGETS
     /* Set window position */
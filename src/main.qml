@@ -30,7 +30,7 @@ ApplicationWindow {
     onClosing: {
         if (progressBar.visible) {
             close.accepted = false
-            quitpopup.openPopup()
+            quitpopup.get().openPopup()
         }
     }
 
@@ -48,7 +48,7 @@ ApplicationWindow {
         sequences: ["Shift+Ctrl+X", "Shift+Meta+X"]
         context: Qt.ApplicationShortcut
         onActivated: {
-            optionspopup.openPopup()
+            optionspopup.get().openPopup()
         }
     }
 
@@ -248,6 +248,12 @@ ApplicationWindow {
                         Layout.fillWidth: true
                         visible: false
                         Material.background: "#d15d7d"
+                        /* The indeterminate animation keeps redrawing the window on kiosks, where the
+                           cores are needed for writing. The status text says what is going on */
+                        onIndeterminateChanged: {
+                            if (indeterminate && imageWriter.isEmbeddedMode())
+                                indeterminate = false
+                        }
                     }
                 }
 
@@ -282,6 +288,11 @@ ApplicationWindow {
                         text: qsTr("CANCEL VERIFY")
                         onClicked: {
                             enabled = false
+                            if (verifyOnly) {
+                                progressText.text = qsTr("Cancelling...")
+                                imageWriter.cancelWrite()
+                                return
+                            }
                             progressText.text = qsTr("Finalizing...")
                             imageWriter.setVerifyEnabled(false)
                         }
@@ -301,7 +312,7 @@ ApplicationWindow {
                         enabled: false
                         onClicked: {
                             // Open options popup for both DFU and normal modes
-                            optionspopup.openPopup()
+                            optionspopup.get().openPopup()
                             
                             // For non-DFU mode, check if ready to write
                             if (!isDfuMode && !imageWriter.readyToWrite()) {
@@ -309,6 +320,20 @@ ApplicationWindow {
                             }
                         }
                     }
+
+                    ImButton {
+                        id: verifybutton
+                        text: qsTr("Verify only")
+                        Layout.bottomMargin: 25
+                        Layout.minimumHeight: 40
+                        Layout.preferredWidth: 200
+                        Layout.alignment: Qt.AlignRight
+                        Accessible.ignored: ospopup.visible || dstpopup.visible || hwpopup.visible
+                        Accessible.description: qsTr("Select this button to check that the storage device holds the image, without writing to it")
+                        visible: writebutton.visible && !isDfuMode && !isUniflashMode && !imageWriter.isEmbeddedMode()
+                        enabled: writebutton.enabled
+                        onClicked: startVerifyOnly()
+                    }
                 }
 
                 Text {
@@ -692,7 +717,7 @@ ApplicationWindow {
         id: osmodel
 
         Component.onCompleted: {
-            if (imageWriter.isOnline()) {
+            if (imageWriter.isOnline() || imageWriter.hasOSList()) {
                 fetchOSlist();
             }
         }
@@ -756,7 +781,7 @@ ApplicationWindow {
                 spacing: 12
 
                 Image {
-                    source: typeof icon === "undefined" ? "" : icon
+                    source: typeof icon === "undefined" ? "" : osIconSource(icon)
                     Layout.preferredHeight: 64
                     Layout.preferredWidth: 64
                     sourceSize.width: 64
@@ -847,7 +872,7 @@ ApplicationWindow {
                 spacing: 12
 
                 Image {
-                    source: icon == "icons/ic_build_48px.svg" ? "icons/cat_misc_utility_images.png": icon
+                    source: icon == "icons/ic_build_48px.svg" ? "icons/cat_misc_utility_images.png": osIconSource(icon)
                     Layout.preferredHeight: 40
                     Layout.preferredWidth: 40
                     sourceSize.width: 40
@@ -1334,6 +1359,9 @@ ApplicationWindow {
                                 } else if (isSystem) {
                                     text += " [" + qsTr("SYSTEM") + "]";
                                 }
+                                if (usbSpeed > 0 && usbSpeed < 5000) {
+                                    txt += " " + qsTr("[USB 2 SPEED]");
+                                }
                                 return txt;
                             }
                         }
@@ -1364,8 +1392,13 @@ ApplicationWindow {
                     dstbgrect.mouseOver = false
                 }
 
-                onClicked: {
-                    selectDstItem(model)
+                onClicked: (mouse) => {
+                    /* Ctrl+click selects several cards to write at once */
+                    if ((mouse.modifiers & Qt.ControlModifier) && imageWriter.dstCount() > 0 && !isDfuMode && !isUniflashMode) {
+                        addDstItem(model)
+                    } else {
+                        selectDstItem(model)
+                    }
                 }
             }
         }
@@ -1373,141 +1406,176 @@ ApplicationWindow {
 
     property bool isDfuMode: false
     property bool isUniflashMode: false
+    /* Checking a drive against the image, without writing it */
+    property bool verifyOnly: false
+    /* The sublist of a category that was opened before it was fetched */
+    property string pendingOsSubListUrl: ""
 
-    MsgPopup {
+    ImPopupLoader {
         id: msgpopup
-        onOpened: {
-            forceActiveFocus()
+        sourceComponent: MsgPopup {
+            onOpened: {
+                forceActiveFocus()
+            }
         }
     }
 
-    MsgPopup {
+    ImPopupLoader {
         id: usbDfuBootmodePopup
-        title: qsTr("Boot Mode Switch")
-        text: qsTr("Configure the boot mode switches for DFU Boot as shown in the image.")
-        imageSource: "icons/usb-dfu-bootmode.svg"
+        sourceComponent: MsgPopup {
+            title: qsTr("Boot Mode Switch")
+            text: qsTr("Configure the boot mode switches for DFU Boot as shown in the image.")
+            imageSource: "icons/usb-dfu-bootmode.svg"
+        }
     }
 
-    MsgPopup {
+    ImPopupLoader {
         id: emmcBootmodePopup
-        title: qsTr("Boot Mode Switch")
-        text: qsTr("DFU programming completed successfully!<br><br>After powering off the card, set the boot mode switches to eMMC Boot as shown in the image. Upon restoring power, the system will boot automatically.")
-        imageSource: "icons/emmc-bootmode.svg"
+        sourceComponent: MsgPopup {
+            title: qsTr("Boot Mode Switch")
+            text: qsTr("DFU programming completed successfully!<br><br>After powering off the card, set the boot mode switches to eMMC Boot as shown in the image. Upon restoring power, the system will boot automatically.")
+            imageSource: "icons/emmc-bootmode.svg"
+        }
     }
 
-    MsgPopup {
+    ImPopupLoader {
         id: quitpopup
-        continueButton: false
-        yesButton: true
-        noButton: true
-        title: qsTr("Are you sure you want to quit?")
-        text: qsTr("Gemstone Imager is still busy.<br>Are you sure you want to quit?")
-        onYes: {
-            Qt.quit()
+        sourceComponent: MsgPopup {
+            continueButton: false
+            yesButton: true
+            noButton: true
+            title: qsTr("Are you sure you want to quit?")
+            text: qsTr("Gemstone Imager is still busy.<br>Are you sure you want to quit?")
+            onYes: {
+                Qt.quit()
+            }
         }
     }
 
-    MsgPopup {
+    ImPopupLoader {
         id: confirmwritepopup
-        continueButton: false
-        yesButton: true
-        noButton: true
-        title: qsTr("Warning")
-        modal: true
-        onYes: {
-            langbarRect.visible = false
-            writebutton.visible = false
-            writebutton.enabled = false
-            progressText.visible = true
-            progressBar.visible = true
-            progressBar.indeterminate = true
-            progressBar.Material.accent = "#ffffff"
-            osbutton.enabled = false
-            dstbutton.enabled = false
-            hwbutton.enabled = false
+        sourceComponent: MsgPopup {
+            continueButton: false
+            yesButton: true
+            noButton: true
+            title: qsTr("Warning")
+            modal: true
+            onYes: {
+                langbarRect.visible = false
+                writebutton.visible = false
+                writebutton.enabled = false
+                progressText.visible = true
+                progressBar.visible = true
+                progressBar.indeterminate = true
+                progressBar.Material.accent = "#ffffff"
+                osbutton.enabled = false
+                dstbutton.enabled = false
+                hwbutton.enabled = false
             
-            // Check if DFU mode is selected
-            if (isDfuMode) {
-                cancelwritebutton.enabled = false
-                cancelwritebutton.visible = false
-                cancelverifybutton.enabled = false
-                progressText.text = qsTr("Starting DFU operation...");
-                imageWriter.startDfu()
-            } else {
-                cancelwritebutton.enabled = true
-                cancelwritebutton.visible = true
-                cancelverifybutton.enabled = true
-                progressText.text = qsTr("Preparing to write...");
-                imageWriter.setVerifyEnabled(true)
-                imageWriter.startWrite()
+                // Check if DFU mode is selected
+                if (isDfuMode) {
+                    cancelwritebutton.enabled = false
+                    cancelwritebutton.visible = false
+                    cancelverifybutton.enabled = false
+                    progressText.text = qsTr("Starting DFU operation...");
+                    imageWriter.startDfu()
+                } else {
+                    cancelwritebutton.enabled = true
+                    cancelwritebutton.visible = true
+                    cancelverifybutton.enabled = true
+                    progressText.text = qsTr("Preparing to write...");
+                    imageWriter.setVerifyEnabled(true)
+                    imageWriter.startWrite()
+                }
             }
-        }
 
-        function askForConfirmation()
-        {
-            if (isDfuMode) {
-                text = qsTr("Image will be sent to device via DFU.<br>Are you sure you want to continue?")
-            } else {
-                text = qsTr("All existing data on '%1' will be erased.<br>Are you sure you want to continue?").arg(dstbutton.text)
+            function askForConfirmation()
+            {
+                if (isDfuMode) {
+                    text = qsTr("Image will be sent to device via DFU.<br>Are you sure you want to continue?")
+                } else {
+                    text = qsTr("All existing data on '%1' will be erased.<br>Are you sure you want to continue?").arg(dstbutton.text)
+                }
+                openPopup()
             }
-            openPopup()
-        }
 
-        onOpened: {
-            forceActiveFocus()
+            onOpened: {
+                forceActiveFocus()
+            }
         }
     }
 
-    MsgPopup {
+    ImPopupLoader {
         id: updatepopup
-        continueButton: false
-        yesButton: true
-        noButton: true
-        property url url
-        title: qsTr("Update available")
-        text: qsTr("There is a newer version of Imager available.<br>Would you like to visit the website to download it?")
-        onYes: {
-            Qt.openUrlExternally(url)
+        sourceComponent: MsgPopup {
+            continueButton: false
+            yesButton: true
+            noButton: true
+            property url url
+            title: qsTr("Update available")
+            text: qsTr("There is a newer version of Imager available.<br>Would you like to visit the website to download it?")
+            onYes: {
+                Qt.openUrlExternally(url)
+            }
         }
     }
 
-    OptionsPopup {
-        minimumWidth: 450
-        minimumHeight: 400
+    ImPopupLoader {
         id: optionspopup
-        onSaveSettingsSignal: {
-            imageWriter.setSavedCustomizationSettings(settings)
-            usesavedsettingspopup.hasSavedSettings = true
-            confirmwritepopup.askForConfirmation()
+        sourceComponent: OptionsPopup {
+            minimumWidth: 450
+            minimumHeight: 400
+            onSaveSettingsSignal: {
+                imageWriter.setSavedCustomizationSettings(settings)
+                usesavedsettingspopup.get().hasSavedSettings = true
+                confirmwritepopup.get().askForConfirmation()
+            }
         }
     }
 
-    UseSavedSettingsPopup {
+    ImPopupLoader {
         id: usesavedsettingspopup
-        onYes: {
-            optionspopup.initialize()
-            optionspopup.applySettings()
-            confirmwritepopup.askForConfirmation()
-        }
-        onNo: {
-            imageWriter.setImageCustomization("", "", "", "", "", "")
-            confirmwritepopup.askForConfirmation()
-        }
-        onNoClearSettings: {
-            hasSavedSettings = false
-            optionspopup.clearCustomizationFields()
-            imageWriter.clearSavedCustomizationSettings()
-            confirmwritepopup.askForConfirmation()
-        }
-        onEditSettings: {
-            optionspopup.openPopup()
-        }
-        onCloseSettings: {
-            optionspopup.close()
+        sourceComponent: UseSavedSettingsPopup {
+            onYes: {
+                optionspopup.get().initialize()
+                optionspopup.get().applySettings()
+                confirmwritepopup.get().askForConfirmation()
+            }
+            onNo: {
+                imageWriter.setImageCustomization("", "", "", "", "", "")
+                confirmwritepopup.get().askForConfirmation()
+            }
+            onNoClearSettings: {
+                hasSavedSettings = false
+                optionspopup.get().clearCustomizationFields()
+                imageWriter.clearSavedCustomizationSettings()
+                confirmwritepopup.get().askForConfirmation()
+            }
+            onEditSettings: {
+                optionspopup.get().openPopup()
+            }
+            onCloseSettings: {
+                optionspopup.get().close()
+            }
         }
     }
 
+    /* Icons from the network go through the icon cache, see OsIconProvider */
+    function osIconSource(icon) {
+        if (icon.startsWith("http://") || icon.startsWith("https://"))
+            return "image://osicon/" + encodeURIComponent(icon)
+        return icon
+    }
+
     /* Slots for signals imagewrite emits */
+    function onSecretsPrepared() {
+        optionspopup.get().onSecretsPrepared()
+    }
+
+    function onPubKeyGenerated() {
+        optionspopup.get().onPubKeyGenerated()
+    }
+
     function onDownloadProgress(now,total) {
         var newPos
         if (total) {
@@ -1560,7 +1628,29 @@ ApplicationWindow {
     }
 
     function onPreparationStatusUpdate(msg) {
-        progressText.text = qsTr("Preparing to write... (%1)").arg(msg)
+        if (verifyOnly)
+            progressText.text = qsTr("Preparing to verify... (%1)").arg(msg)
+        else
+            progressText.text = qsTr("Preparing to write... (%1)").arg(msg)
+    }
+
+    function startVerifyOnly() {
+        verifyOnly = true
+        langbarRect.visible = false
+        writebutton.visible = false
+        writebutton.enabled = false
+        progressText.visible = true
+        progressBar.visible = true
+        progressBar.indeterminate = true
+        progressBar.Material.accent = "#ffffff"
+        osbutton.enabled = false
+        dstbutton.enabled = false
+        hwbutton.enabled = false
+        cancelwritebutton.visible = false
+        cancelverifybutton.enabled = true
+        cancelverifybutton.visible = true
+        progressText.text = qsTr("Preparing to verify...")
+        imageWriter.startVerify()
     }
 
     function onDfuProgress(percentage, statusMsg) {
@@ -1579,6 +1669,24 @@ ApplicationWindow {
         fetchOSlist()
     }
 
+    function onOsSubListPrepared(url) {
+        if (url !== pendingOsSubListUrl)
+            return
+        pendingOsSubListUrl = ""
+
+        var m = osswipeview.itemAt(osswipeview.currentIndex).model
+        var subitems = imageWriter.getFilteredOSSubList(url)
+        for (var i in subitems)
+        {
+            var entry = subitems[i];
+            if ("subitems" in entry) {
+                entry["subitems_json"] = JSON.stringify(entry["subitems"])
+                delete entry["subitems"]
+            }
+            m.append(entry)
+        }
+    }
+
     function resetWriteButton() {
         progressText.visible = false
         progressBar.visible = false
@@ -1589,22 +1697,31 @@ ApplicationWindow {
         writebutton.enabled = imageWriter.readyToWrite()
         cancelwritebutton.visible = false
         cancelverifybutton.visible = false
+        verifyOnly = false
         // Do NOT reset isDfuMode/isUniflashMode here — those are tied to
         // destination selection and must survive error retries.
         // They are reset in selectDstItem(), selectDfu(), selectUniflash().
     }
 
     function onError(msg) {
-        msgpopup.title = qsTr("Error")
-        msgpopup.text = msg
-        msgpopup.openPopup()
+        msgpopup.get().title = qsTr("Error")
+        msgpopup.get().text = msg
+        msgpopup.get().openPopup()
         resetWriteButton()
     }
 
     function onSuccess() {
-        msgpopup.title = qsTr("Write Successful")
+        if (verifyOnly) {
+            msgpopup.get().title = qsTr("Verify Successful")
+            msgpopup.get().text = qsTr("<b>%1</b> holds <b>%2</b>").arg(dstbutton.text).arg(osbutton.text)
+            msgpopup.get().openPopup()
+            resetWriteButton()
+            return
+        }
+
+        msgpopup.get().title = qsTr("Write Successful")
         if (osbutton.text === qsTr("Erase"))
-            msgpopup.text = qsTr("<b>%1</b> has been erased<br><br>You can now remove the SD card from the reader").arg(dstbutton.text)
+            msgpopup.get().text = qsTr("<b>%1</b> has been erased<br><br>You can now remove the SD card from the reader").arg(dstbutton.text)
         else if (imageWriter.isEmbeddedMode()) {
             //msgpopup.text = qsTr("<b>%1</b> has been written to <b>%2</b>").arg(osbutton.text).arg(dstbutton.text)
             /* Just reboot to the installed OS */
@@ -1615,7 +1732,7 @@ ApplicationWindow {
             if(isDfuMode)
             {
                 resetWriteButton()
-                emmcBootmodePopup.openPopup()
+                emmcBootmodePopup.get().openPopup()
                 imageWriter.setDst("")
                 isDfuMode = false
                 isUniflashMode = false
@@ -1623,19 +1740,19 @@ ApplicationWindow {
             }
             else if(isUniflashMode)
             {
-                msgpopup.text = qsTr("<b>%1</b> has been written to <b>%2</b><br><br>The process is complete. You can connect to the board via the serial port.").arg(osbutton.text).arg(dstbutton.text)
+                msgpopup.get().text = qsTr("<b>%1</b> has been written to <b>%2</b><br><br>The process is complete. You can connect to the board via the serial port.").arg(osbutton.text).arg(dstbutton.text)
             }
             else
             {
-                msgpopup.text = qsTr("<b>%1</b> has been written to <b>%2</b><br><br>You can now remove the SD card from the reader").arg(osbutton.text).arg(dstbutton.text)
+                msgpopup.get().text = qsTr("<b>%1</b> has been written to <b>%2</b><br><br>You can now remove the SD card from the reader").arg(osbutton.text).arg(dstbutton.text)
             }
         }
         if (imageWriter.isEmbeddedMode()) {
-            msgpopup.continueButton = false
-            msgpopup.quitButton = true
+            msgpopup.get().continueButton = false
+            msgpopup.get().quitButton = true
         }
 
-        msgpopup.openPopup()
+        msgpopup.get().openPopup()
         imageWriter.setDst("")
         isDfuMode = false
         isUniflashMode = false
@@ -1830,8 +1947,7 @@ ApplicationWindow {
     }
 
     function fetchOSlist() {
-        var oslist_json = imageWriter.getFilteredOSlist();
-        var o = JSON.parse(oslist_json)
+        var o = imageWriter.getFilteredOSlist()
         var oslist_parsed = oslistFromJson(o)
         if (oslist_parsed === false)
             return
@@ -1860,8 +1976,8 @@ ApplicationWindow {
 
             if (imageWriter.getBoolSetting("check_version") && "latest_version" in imager && "url" in imager) {
                 if (!imageWriter.isEmbeddedMode() && imageWriter.isVersionNewer(imager["latest_version"])) {
-                    updatepopup.url = imager["url"]
-                    updatepopup.openPopup()
+                    updatepopup.get().url = imager["url"]
+                    updatepopup.get().openPopup()
                 }
             }
             if ("default_os" in imager) {
@@ -1937,8 +2053,7 @@ ApplicationWindow {
         imageWriter.setHWFilterList(hwmodel.tags, inclusive)
 
         /* Reload list */
-        var oslist_json = imageWriter.getFilteredOSlist();
-        var o = JSON.parse(oslist_json)
+        var o = imageWriter.getFilteredOSlist()
         var oslist_parsed = oslistFromJson(o)
         if (oslist_parsed === false)
             return
@@ -2019,15 +2134,19 @@ ApplicationWindow {
         } else if (typeof(d.subitems_url) == "string" && d.subitems_url !== "") {
             if (d.subitems_url === "internal://back")
             {
+                pendingOsSubListUrl = ""
                 osswipeview.decrementCurrentIndex()
                 ospopup.categorySelected = ""
             }
             else
             {
-                console.log("Failure: Backend should have pre-flattened the JSON!");
-
+                /* Not fetched yet, open the category and fill it in when it arrives */
+                newSublist()
                 osswipeview.itemAt(osswipeview.currentIndex+1).currentIndex = (selectFirstSubitem === true) ? 0 : -1
                 osswipeview.incrementCurrentIndex()
+                ospopup.categorySelected = d.name
+                pendingOsSubListUrl = d.subitems_url
+                imageWriter.fetchOSSubList(d.subitems_url)
             }
         } else if (d.url === "") {
             if (!imageWriter.isEmbeddedMode()) {
@@ -2037,7 +2156,7 @@ ApplicationWindow {
                 if (imageWriter.mountUsbSourceMedia()) {
                     var m = newSublist()
 
-                    var usboslist = JSON.parse(imageWriter.getUsbSourceOSlist())
+                    var usboslist = imageWriter.getUsbSourceOSlist()
                     for (var i in usboslist) {
                         m.append(usboslist[i])
                     }
@@ -2110,7 +2229,10 @@ ApplicationWindow {
 
             // DFU parameters are now handled through setSrc - URL contains all needed info
             imageWriter.setBootloaderHashes(typeof(d.tiboot3_sha256) != "undefined" ? d.tiboot3_sha256 : "", typeof(d.tispl_sha256) != "undefined" ? d.tispl_sha256 : "", typeof(d.uboot_sha256) != "undefined" ? d.uboot_sha256 : "")
-            imageWriter.setSrc(d.url, d.image_download_size, d.extract_size, typeof(d.extract_sha256) != "undefined" ? d.extract_sha256 : "", typeof(d.contains_multiple_files) != "undefined" ? d.contains_multiple_files : false, ospopup.categorySelected, d.name, typeof(d.init_format) != "undefined" ? d.init_format : "")
+            imageWriter.setSrc(d.url, d.image_download_size, d.extract_size, typeof(d.extract_sha256) != "undefined" ? d.extract_sha256 : "", typeof(d.contains_multiple_files) != "undefined" ? d.contains_multiple_files : false, ospopup.categorySelected, d.name, typeof(d.init_format) != "undefined" ? d.init_format : "", typeof(d.bmap_url) != "undefined" ? d.bmap_url : "")
+            imageWriter.setChunkIndexUrl(typeof(d.chunk_index_url) != "undefined" ? d.chunk_index_url : "")
+            imageWriter.setMirrors(typeof(d.mirrors) != "undefined" ? d.mirrors : [], typeof(d.metalink_url) != "undefined" ? d.metalink_url : "")
+            imageWriter.setEncodings(typeof(d.encodings) != "undefined" ? d.encodings : [])
             osbutton.text = d.name
             ospopup.close()
             osswipeview.decrementCurrentIndex()
@@ -2138,7 +2260,7 @@ ApplicationWindow {
         isUniflashMode = false
         dstbutton.text = qsTr("DFU Mode")
         writebutton.enabled = true
-        usbDfuBootmodePopup.openPopup()
+        usbDfuBootmodePopup.get().openPopup()
     }
 
     function startDfuOperation() {
@@ -2174,4 +2296,14 @@ ApplicationWindow {
             writebutton.enabled = true
         }
     }
+
+    function addDstItem(d) {
+        if (d.isReadOnly) {
+            onError(qsTr("SD card is write protected.<br>Push the lock switch on the left side of the card upwards, and try again."))
+            return
+        }
+
+        imageWriter.addDst(d.device, d.size)
+        dstbutton.text = qsTr("%1 storage devices").arg(imageWriter.dstCount())
+    }
 }
@@ -0,0 +1,61 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "memorybudget.h"
+#include "config.h"
+
+MemoryBudget MemoryBudget::defaults()
+{
+    MemoryBudget b;
+    b.limit = 0;
+    b.ringBufferSize = IMAGEWRITER_RINGBUFFER_SIZE;
+    b.writeBufferBytes = 0;
+    b.fanoutQueueBytes = 0;
+    b.decompressThreads = qMax(IMAGEWRITER_XZ_MAX_THREADS, IMAGEWRITER_ZSTD_MAX_THREADS);
+    b.decompressMemory = 0;
+    b.zstdMaxFrameSize = IMAGEWRITER_ZSTD_MAX_FRAMESIZE;
+    b.zstdMaxFrameOutput = IMAGEWRITER_ZSTD_MAX_FRAME_OUTPUT;
+    b.instreamCustomizeMaxSize = IMAGEWRITER_INSTREAM_CUSTOMIZE_MAXSIZE;
+    b.verifyThreads = IMAGEWRITER_VERIFY_THREADS;
+    b.mmapWindowSize = IMAGEWRITER_MMAP_WINDOWSIZE;
+    return b;
+}
+
+/* Of what is left after the reserve for the libraries:
+ *   1/16 download ring buffer      1/4 decompression
+ *   1/16 write buffers             1/4 in-stream customization
+ *   1/8  fan-out queue             1/8 chunked verify, or the mapped image window
+ * Verify runs after the write buffers are no longer used, which leaves some slack
+ */
+MemoryBudget MemoryBudget::fromLimit(quint64 limit, int devices)
+{
+    MemoryBudget b = defaults();
+    const quint64 mb = 1024*1024;
+
+    limit = qMax(limit, (quint64) IMAGEWRITER_MIN_MEMORY_LIMIT);
+    devices = qMax(devices, 1);
+    b.limit = limit;
+    quint64 pool = limit - limit/4;
+
+    b.ringBufferSize = qBound((quint64) 2*IMAGEWRITER_RINGBUFFER_SLABSIZE,
+                              pool/16 / IMAGEWRITER_RINGBUFFER_SLABSIZE * IMAGEWRITER_RINGBUFFER_SLABSIZE,
+                              (quint64) IMAGEWRITER_RINGBUFFER_SIZE);
+    b.writeBufferBytes = pool/16;
+    b.fanoutQueueBytes = pool/8;
+
+    /* Every zstd thread has up to two frames in flight, each buffered compressed and decompressed */
+    quint64 decompress = pool/4;
+    b.decompressMemory = decompress;
+    while (b.decompressThreads > 1 && decompress / (2*b.decompressThreads) < 8*mb)
+        b.decompressThreads--;
+    b.zstdMaxFrameOutput = qMin(b.zstdMaxFrameOutput, (size_t) (decompress / (2*b.decompressThreads) / 2));
+    b.zstdMaxFrameSize = qMin(b.zstdMaxFrameSize, b.zstdMaxFrameOutput);
+
+    b.instreamCustomizeMaxSize = qMin(b.instreamCustomizeMaxSize, pool/4);
+    b.verifyThreads = qBound(1, (int) (pool/8 / devices / IMAGEWRITER_HASH_CHUNKSIZE), b.verifyThreads);
+    b.mmapWindowSize = qBound((qint64) mb, (qint64) (pool/8 / mb * mb), b.mmapWindowSize);
+
+    return b;
+}
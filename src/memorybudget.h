@@ -0,0 +1,48 @@
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+
+/*
+ * Sizes of the buffers and queues of the write pipeline
+ *
+ * Without a limit these are the defaults from config.h. With one, every
+ * buffer the pipeline allocates is sized from it, so that all of them
+ * together, plus a quarter of the limit left for the decoders and libraries
+ * (zlib, liblzma, libzstd, libarchive and curl state), stay under it.
+ * Larger frames and partitions than fit are not buffered, but handled
+ * as a stream, so a smaller limit makes writing slower, not fail.
+ */
+struct MemoryBudget
+{
+    /* Bytes, 0 for no limit */
+    quint64 limit;
+    /* Ring buffer between download and extraction */
+    size_t ringBufferSize;
+    /* All write buffers of the extraction together, 0 for IMAGEWRITER_WRITE_QUEUE_DEPTH blocks */
+    size_t writeBufferBytes;
+    /* Blocks queued for the devices when writing to several, 0 for IMAGEWRITER_FANOUT_QUEUE_DEPTH blocks */
+    size_t fanoutQueueBytes;
+    /* Decompression threads, and memory the multi-threaded xz decoder may use, 0 for a quarter of RAM */
+    int decompressThreads;
+    quint64 decompressMemory;
+    /* Largest compressed and decompressed zstd frame that is decoded on the pool */
+    size_t zstdMaxFrameSize, zstdMaxFrameOutput;
+    /* Most boot partition data kept in memory to customize it while writing */
+    quint64 instreamCustomizeMaxSize;
+    /* Threads of the chunked verify of each device, with a chunk in memory each */
+    int verifyThreads;
+    /* Window of a local image file mapped at a time */
+    qint64 mmapWindowSize;
+
+    static MemoryBudget defaults();
+    /* For writing to this many devices at once. Limits under IMAGEWRITER_MIN_MEMORY_LIMIT are raised to it */
+    static MemoryBudget fromLimit(quint64 limit, int devices = 1);
+};
+
+#endif // MEMORYBUDGET_H
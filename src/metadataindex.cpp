@@ -0,0 +1,280 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "metadataindex.h"
+#include "config.h"
+#include "crc32c.h"
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QStandardPaths>
+#ifndef Q_OS_WIN
+#include <unistd.h>
+#endif
+
+void MetadataIndex::Transaction::put(const QString &table, const QByteArray &key, const QJsonObject &record)
+{
+    _ops.append(QJsonObject{
+        {"op", "put"},
+        {"table", table},
+        {"key", QString::fromUtf8(key)},
+        {"record", record}
+    });
+}
+
+void MetadataIndex::Transaction::remove(const QString &table, const QByteArray &key)
+{
+    _ops.append(QJsonObject{
+        {"op", "remove"},
+        {"table", table},
+        {"key", QString::fromUtf8(key)}
+    });
+}
+
+bool MetadataIndex::Transaction::isEmpty() const
+{
+    return _ops.isEmpty();
+}
+
+MetadataIndex::MetadataIndex(const QString &filename)
+    : _loggedRecords(0)
+{
+    QDir().mkpath(QFileInfo(filename).absolutePath());
+    _log.setFileName(filename);
+    _load();
+}
+
+MetadataIndex::~MetadataIndex()
+{
+    _log.close();
+}
+
+MetadataIndex &MetadataIndex::instance()
+{
+    static MetadataIndex index(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"metadata.log");
+    return index;
+}
+
+/* "<CRC-32C in hex> <JSON array of changes>\n" */
+QByteArray MetadataIndex::_line(const QJsonArray &ops)
+{
+    QByteArray json = QJsonDocument(ops).toJson(QJsonDocument::Compact);
+    Crc32c crc;
+    crc.addData(json.constData(), json.size());
+
+    return crc.result().toHex()+" "+json+"\n";
+}
+
+void MetadataIndex::_load()
+{
+    qint64 good = 0;
+
+    if (_log.open(QIODevice::ReadOnly))
+    {
+        const QByteArray data = _log.readAll();
+        _log.close();
+
+        while (good < data.size())
+        {
+            qsizetype end = data.indexOf('\n', good);
+            qsizetype space = data.indexOf(' ', good);
+            if (end == -1 || space == -1 || space > end)
+                break;
+
+            QByteArray json = data.mid(space+1, end-space-1);
+            Crc32c crc;
+            crc.addData(json.constData(), json.size());
+            QJsonDocument doc = QJsonDocument::fromJson(json);
+            if (crc.result().toHex() != data.mid(good, space-good) || !doc.isArray())
+                break;
+
+            _apply(doc.array());
+            _loggedRecords += doc.array().size();
+            good = end+1;
+        }
+
+        if (good < data.size())
+        {
+            qDebug() << "Dropping" << data.size()-good << "bytes of incomplete transactions at the end of" << _log.fileName();
+            _log.resize(good);
+        }
+    }
+
+    if (!_log.open(QIODevice::WriteOnly | QIODevice::Append))
+        qDebug() << "Cannot open metadata index" << _log.fileName() << ":" << _log.errorString();
+}
+
+void MetadataIndex::_apply(const QJsonArray &ops)
+{
+    for (const QJsonValue &v : ops)
+    {
+        QJsonObject op = v.toObject();
+        QString tableName = op.value("table").toString();
+        QByteArray key = op.value("key").toString().toUtf8();
+        Table &table = _tables[tableName];
+
+        auto it = table.find(key);
+        if (it != table.end())
+        {
+            _indexRecord(tableName, key, it.value(), false);
+            table.erase(it);
+        }
+        if (op.value("op").toString() == "put")
+        {
+            QJsonObject record = op.value("record").toObject();
+            table.insert(key, record);
+            _indexRecord(tableName, key, record, true);
+        }
+    }
+}
+
+void MetadataIndex::_indexRecord(const QString &table, const QByteArray &key, const QJsonObject &record, bool add)
+{
+    auto indexes = _indexes.find(table);
+    if (indexes == _indexes.end())
+        return;
+
+    for (auto it = indexes->begin(); it != indexes->end(); ++it)
+    {
+        QString value = record.value(it.key()).toString();
+        if (add)
+        {
+            (*it)[value].insert(key);
+        }
+        else
+        {
+            auto keys = it->find(value);
+            if (keys != it->end())
+            {
+                keys->remove(key);
+                if (keys->isEmpty())
+                    it->erase(keys);
+            }
+        }
+    }
+}
+
+bool MetadataIndex::contains(const QString &table, const QByteArray &key) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _tables.value(table).contains(key);
+}
+
+QJsonObject MetadataIndex::value(const QString &table, const QByteArray &key) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _tables.constFind(table);
+    return it == _tables.constEnd() ? QJsonObject() : it->value(key);
+}
+
+QList<QByteArray> MetadataIndex::keys(const QString &table) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _tables.value(table).keys();
+}
+
+QList<QByteArray> MetadataIndex::find(const QString &table, const QString &field, const QString &value)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    FieldIndexes &indexes = _indexes[table];
+
+    if (!indexes.contains(field))
+    {
+        auto &index = indexes[field];
+        const Table &records = _tables[table];
+        for (auto it = records.constBegin(); it != records.constEnd(); ++it)
+            index[it->value(field).toString()].insert(it.key());
+    }
+
+    return indexes[field].value(value).values();
+}
+
+bool MetadataIndex::commit(const Transaction &transaction)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (transaction._ops.isEmpty())
+        return true;
+    if (!_append(transaction._ops))
+        return false;
+
+    _apply(transaction._ops);
+    _loggedRecords += transaction._ops.size();
+
+    qint64 live = 0;
+    for (const Table &table : std::as_const(_tables))
+        live += table.size();
+    if (_loggedRecords > IMAGEWRITER_METADATA_COMPACT_MIN && _loggedRecords > live * IMAGEWRITER_METADATA_COMPACT_FACTOR)
+        _compact();
+
+    return true;
+}
+
+bool MetadataIndex::put(const QString &table, const QByteArray &key, const QJsonObject &record)
+{
+    Transaction t;
+    t.put(table, key, record);
+    return commit(t);
+}
+
+bool MetadataIndex::remove(const QString &table, const QByteArray &key)
+{
+    Transaction t;
+    t.remove(table, key);
+    return commit(t);
+}
+
+/* On disk before it is applied */
+bool MetadataIndex::_append(const QJsonArray &ops)
+{
+    if (!_log.isOpen())
+        return false;
+
+    const QByteArray line = _line(ops);
+    const qint64 size = _log.size();
+    bool ok = _log.write(line) == line.size() && _log.flush();
+#ifndef Q_OS_WIN
+    ok = ok && ::fsync(_log.handle()) == 0;
+#endif
+    if (!ok)
+    {
+        qDebug() << "Error writing metadata index" << _log.fileName() << ":" << _log.errorString();
+        /* Half a line would hide the transactions after it */
+        _log.resize(size);
+    }
+
+    return ok;
+}
+
+/* Replace the log with one transaction putting the live records */
+void MetadataIndex::_compact()
+{
+    QJsonArray ops;
+    for (auto table = _tables.constBegin(); table != _tables.constEnd(); ++table)
+    {
+        for (auto it = table->constBegin(); it != table->constEnd(); ++it)
+        {
+            ops.append(QJsonObject{
+                {"op", "put"},
+                {"table", table.key()},
+                {"key", QString::fromUtf8(it.key())},
+                {"record", it.value()}
+            });
+        }
+    }
+
+    /* Cannot be replaced while open on Windows */
+    _log.close();
+    QSaveFile f(_log.fileName());
+    const QByteArray line = _line(ops);
+    if (f.open(QIODevice::WriteOnly) && f.write(line) == line.size() && f.commit())
+        _loggedRecords = ops.size();
+    else
+        qDebug() << "Error compacting metadata index" << _log.fileName() << ":" << f.errorString();
+
+    if (!_log.open(QIODevice::WriteOnly | QIODevice::Append))
+        qDebug() << "Cannot open metadata index" << _log.fileName() << ":" << _log.errorString();
+}
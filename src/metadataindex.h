@@ -0,0 +1,93 @@
+#ifndef METADATAINDEX_H
+#define METADATAINDEX_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QList>
+#include <QSet>
+#include <QString>
+#include <mutex>
+
+/*
+ * Store of the metadata of the cache and of interrupted transfers: cache
+ * entries (see DownloadCache), download journals (CacheJournal) and write
+ * checkpoints (WriteJournal)
+ *
+ * Records are JSON objects in named tables, looked up by key in a hash
+ * table. find() looks them up by the value of a field, e.g. the URL, with
+ * an index that is built on first use and kept up to date after that.
+ *
+ * All of it is kept in memory. Changes go to disk as transactions appended
+ * to a log file, one line each, with a CRC-32C of the line. A transaction
+ * is synced to disk before it is applied, and one that was cut short by a
+ * crash or power loss fails its CRC and is dropped when the log is read,
+ * together with anything after it. Once the log holds much more than the
+ * records themselves, it is replaced atomically by a copy with only them.
+ *
+ * Shared by all threads. Processes do not see each other's changes until
+ * the log is read again.
+ */
+class MetadataIndex
+{
+public:
+    /* Changes that are applied together, or not at all */
+    class Transaction
+    {
+    public:
+        void put(const QString &table, const QByteArray &key, const QJsonObject &record);
+        void remove(const QString &table, const QByteArray &key);
+        bool isEmpty() const;
+
+    protected:
+        friend class MetadataIndex;
+        QJsonArray _ops;
+    };
+
+    explicit MetadataIndex(const QString &filename);
+    ~MetadataIndex();
+
+    /* Index in the cache location, read on first use */
+    static MetadataIndex &instance();
+
+    bool contains(const QString &table, const QByteArray &key) const;
+    /* Empty object if there is no such record */
+    QJsonObject value(const QString &table, const QByteArray &key) const;
+    QList<QByteArray> keys(const QString &table) const;
+    /* Keys of the records of table of which field is value */
+    QList<QByteArray> find(const QString &table, const QString &field, const QString &value);
+
+    /* Returns false, leaving the records as they were, if it cannot be written to disk */
+    bool commit(const Transaction &transaction);
+    /* Transactions of a single change */
+    bool put(const QString &table, const QByteArray &key, const QJsonObject &record);
+    bool remove(const QString &table, const QByteArray &key);
+
+protected:
+    typedef QHash<QByteArray, QJsonObject> Table;
+    /* Field -> value -> keys of the records with it */
+    typedef QHash<QString, QHash<QString, QSet<QByteArray>>> FieldIndexes;
+
+    QFile _log;
+    mutable std::mutex _mutex;
+    QHash<QString, Table> _tables;
+    QHash<QString, FieldIndexes> _indexes;
+    /* Records in the log, live or replaced since */
+    qint64 _loggedRecords;
+
+    void _load();
+    void _apply(const QJsonArray &ops);
+    void _indexRecord(const QString &table, const QByteArray &key, const QJsonObject &record, bool add);
+    bool _append(const QJsonArray &ops);
+    void _compact();
+    static QByteArray _line(const QJsonArray &ops);
+};
+
+#endif // METADATAINDEX_H
@@ -0,0 +1,114 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "metrics.h"
+#include <QMap>
+#include <atomic>
+#include <mutex>
+
+namespace {
+
+std::atomic<quint64> counters[Metrics::CounterCount];
+
+struct CounterInfo
+{
+    const char *name, *help;
+};
+
+const CounterInfo counterInfo[Metrics::CounterCount] = {
+    {"gemimager_downloaded_bytes", "Bytes of images downloaded"},
+    {"gemimager_written_bytes", "Bytes written to storage devices"},
+    {"gemimager_verified_bytes", "Bytes read back and verified"},
+    {"gemimager_verify_failures", "Writes that failed verification"},
+    {"gemimager_cache_hits", "Writes served from the image cache"},
+    {"gemimager_cache_misses", "Writes of cacheable images that had to be downloaded"},
+    {"gemimager_tftp_retransmits", "TFTP blocks sent again after no or a wrong acknowledgement"},
+    {"gemimager_dfu_retries", "Times a DFU device was probed for again"},
+    {"gemimager_jobs_succeeded", "Write jobs that succeeded"},
+    {"gemimager_jobs_failed", "Write jobs that failed"}
+};
+
+/* Upper bounds of the write speed histogram buckets, in MB/s */
+const double speedBuckets[] = {1, 2, 5, 10, 20, 50, 100, 200, 500};
+const int numSpeedBuckets = sizeof(speedBuckets) / sizeof(speedBuckets[0]);
+
+std::mutex speedMutex;
+quint64 speedCounts[numSpeedBuckets+1];
+quint64 speedCount;
+double speedSum;
+QMap<QString, double> deviceSpeeds;
+
+QByteArray number(double value)
+{
+    return QByteArray::number(value, 'g', 15);
+}
+
+/* Label values escape backslash, double quote and newline */
+QByteArray label(const QString &value)
+{
+    QByteArray v = value.toUtf8();
+    v.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+    return v;
+}
+
+}
+
+void Metrics::add(Counter counter, quint64 n)
+{
+    counters[counter].fetch_add(n, std::memory_order_relaxed);
+}
+
+quint64 Metrics::value(Counter counter)
+{
+    return counters[counter].load(std::memory_order_relaxed);
+}
+
+void Metrics::observeWriteSpeed(const QString &device, double bytesPerSecond)
+{
+    double mbps = bytesPerSecond / 1000000;
+    std::lock_guard<std::mutex> lock(speedMutex);
+
+    int bucket = 0;
+    while (bucket < numSpeedBuckets && mbps > speedBuckets[bucket])
+        bucket++;
+    speedCounts[bucket]++;
+    speedCount++;
+    speedSum += mbps;
+    deviceSpeeds[device] = mbps;
+}
+
+QByteArray Metrics::openMetrics()
+{
+    QByteArray out;
+
+    for (int i = 0; i < CounterCount; i++)
+    {
+        QByteArray name = counterInfo[i].name;
+        out += "# TYPE "+name+" counter\n";
+        out += "# HELP "+name+" "+counterInfo[i].help+"\n";
+        out += name+"_total "+QByteArray::number(value((Counter) i))+"\n";
+    }
+
+    std::lock_guard<std::mutex> lock(speedMutex);
+    out += "# TYPE gemimager_write_speed_mbps histogram\n"
+           "# HELP gemimager_write_speed_mbps Average write speed of each device written, in MB/s\n";
+    quint64 cumulative = 0;
+    for (int i = 0; i < numSpeedBuckets; i++)
+    {
+        cumulative += speedCounts[i];
+        out += "gemimager_write_speed_mbps_bucket{le=\""+number(speedBuckets[i])+"\"} "+QByteArray::number(cumulative)+"\n";
+    }
+    out += "gemimager_write_speed_mbps_bucket{le=\"+Inf\"} "+QByteArray::number(speedCount)+"\n";
+    out += "gemimager_write_speed_mbps_sum "+number(speedSum)+"\n";
+    out += "gemimager_write_speed_mbps_count "+QByteArray::number(speedCount)+"\n";
+
+    out += "# TYPE gemimager_device_write_speed_mbps gauge\n"
+           "# HELP gemimager_device_write_speed_mbps Average write speed of the last write to the device, in MB/s\n";
+    for (auto it = deviceSpeeds.cbegin(); it != deviceSpeeds.cend(); ++it)
+        out += "gemimager_device_write_speed_mbps{device=\""+label(it.key())+"\"} "+number(it.value())+"\n";
+
+    out += "# EOF\n";
+    return out;
+}
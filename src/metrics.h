@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+
+/*
+ * Process wide counters of all writes, for monitoring an imaging farm
+ *
+ * Any thread can add to them. The daemon mode serves them in the
+ * OpenMetrics text format, see openMetrics().
+ */
+class Metrics
+{
+public:
+    enum Counter
+    {
+        BytesDownloaded,
+        BytesWritten,
+        BytesVerified,
+        VerifyFailures,
+        /* Writes served from the download or extracted image cache, and those that were not */
+        CacheHits,
+        CacheMisses,
+        /* TFTP blocks simpbootp sent again because they were not acknowledged in time */
+        TftpRetransmits,
+        /* Times a DFU device was probed for again because it was not found yet */
+        DfuRetries,
+        JobsSucceeded,
+        JobsFailed,
+        CounterCount
+    };
+
+    static void add(Counter counter, quint64 n = 1);
+    static quint64 value(Counter counter);
+    /* Average write speed of a device over a whole write */
+    static void observeWriteSpeed(const QString &device, double bytesPerSecond);
+    static QByteArray openMetrics();
+};
+
+#endif // METRICS_H
@@ -0,0 +1,266 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "mirrorlist.h"
+#include "config.h"
+#include <QDebug>
+#include <QXmlStreamReader>
+#include <algorithm>
+
+namespace
+{
+    /* Probe request of one mirror */
+    struct Probe
+    {
+        CURL *c;
+        quint64 received, total;
+        CURLcode result;
+        bool done;
+    };
+}
+
+MirrorList::MirrorList()
+{
+}
+
+void MirrorList::add(const QByteArray &url)
+{
+    if (!(url.startsWith("http://") || url.startsWith("https://")))
+    {
+        qDebug() << "Ignoring mirror that is not http or https:" << url;
+        return;
+    }
+
+    for (const Mirror &m : std::as_const(_mirrors))
+    {
+        if (m.url == url)
+            return;
+    }
+
+    _mirrors.append({url, 0, 0, 0, false});
+}
+
+bool MirrorList::parseMetalink(const QByteArray &xml)
+{
+    QXmlStreamReader xr(xml);
+    /* Priority 1 is the most preferred. Version 3 uses a preference of 100 for that */
+    QVector<QPair<int, QByteArray>> urls;
+    bool isMetalink = false, inFile = false;
+
+    while (!xr.atEnd())
+    {
+        QXmlStreamReader::TokenType token = xr.readNext();
+        if (token == QXmlStreamReader::EndElement && xr.name() == QLatin1String("file"))
+        {
+            /* Only the first file is of interest */
+            break;
+        }
+        if (token != QXmlStreamReader::StartElement)
+            continue;
+
+        if (xr.name() == QLatin1String("metalink"))
+        {
+            isMetalink = true;
+        }
+        else if (xr.name() == QLatin1String("file"))
+        {
+            inFile = true;
+        }
+        else if (xr.name() == QLatin1String("url") && inFile)
+        {
+            QXmlStreamAttributes attrs = xr.attributes();
+            int priority = 999999;
+            if (attrs.hasAttribute("priority"))
+                priority = attrs.value("priority").toInt();
+            else if (attrs.hasAttribute("preference"))
+                priority = 101 - attrs.value("preference").toInt();
+
+            urls.append({priority, xr.readElementText().trimmed().toLatin1()});
+        }
+    }
+
+    if (!isMetalink || xr.hasError())
+    {
+        qDebug() << "Not a valid metalink file:" << xr.errorString();
+        return false;
+    }
+
+    std::stable_sort(urls.begin(), urls.end(), [](const QPair<int, QByteArray> &a, const QPair<int, QByteArray> &b) {
+        return a.first < b.first;
+    });
+    for (const auto &url : std::as_const(urls))
+        add(url.second);
+
+    return true;
+}
+
+void MirrorList::clear()
+{
+    _mirrors.clear();
+}
+
+int MirrorList::size() const
+{
+    return _mirrors.size();
+}
+
+bool MirrorList::isEmpty() const
+{
+    return _mirrors.isEmpty();
+}
+
+const MirrorList::Mirror &MirrorList::at(int i) const
+{
+    return _mirrors.at(i);
+}
+
+void MirrorList::probe(CURL *config, const std::atomic<bool> &cancelled)
+{
+    QVector<Probe> probes(_mirrors.size());
+    QByteArray range = "0-"+QByteArray::number(IMAGEWRITER_MIRROR_PROBE_SIZE-1);
+    CURLM *m = curl_multi_init();
+
+    for (int i = 0; i < _mirrors.size(); i++)
+    {
+        Probe &p = probes[i];
+        p = {curl_easy_duphandle(config), 0, 0, CURLE_OK, false};
+        curl_easy_setopt(p.c, CURLOPT_URL, _mirrors[i].url.constData());
+        curl_easy_setopt(p.c, CURLOPT_RESUME_FROM_LARGE, (curl_off_t) 0);
+        curl_easy_setopt(p.c, CURLOPT_RANGE, range.constData());
+        curl_easy_setopt(p.c, CURLOPT_NOBODY, 0L);
+        curl_easy_setopt(p.c, CURLOPT_HTTPGET, 1L);
+        curl_easy_setopt(p.c, CURLOPT_NOPROGRESS, 1L);
+        curl_easy_setopt(p.c, CURLOPT_ERRORBUFFER, nullptr);
+        curl_easy_setopt(p.c, CURLOPT_TIMEOUT_MS, (long) IMAGEWRITER_MIRROR_PROBE_TIMEOUT);
+        curl_easy_setopt(p.c, CURLOPT_WRITEFUNCTION, &MirrorList::_curl_probe_write_callback);
+        curl_easy_setopt(p.c, CURLOPT_WRITEDATA, &p);
+        curl_easy_setopt(p.c, CURLOPT_HEADERFUNCTION, &MirrorList::_curl_probe_header_callback);
+        curl_easy_setopt(p.c, CURLOPT_HEADERDATA, &p);
+        curl_easy_setopt(p.c, CURLOPT_PRIVATE, &p);
+        curl_multi_add_handle(m, p.c);
+    }
+
+    int running = probes.size();
+    while (running && !cancelled)
+    {
+        if (curl_multi_perform(m, &running) != CURLM_OK)
+            break;
+
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(m, &left)))
+        {
+            Probe *p;
+            if (msg->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &p);
+            p->result = msg->data.result;
+            p->done = true;
+        }
+
+        if (running)
+            curl_multi_poll(m, NULL, 0, 100, NULL);
+    }
+
+    QVector<Mirror> answered;
+    quint64 size = 0;
+    for (int i = 0; i < probes.size(); i++)
+    {
+        Probe &p = probes[i];
+        Mirror mirror = _mirrors[i];
+        long code = 0;
+        curl_off_t starttransfer = 0, speed = 0, length = -1;
+
+        curl_easy_getinfo(p.c, CURLINFO_RESPONSE_CODE, &code);
+        curl_easy_getinfo(p.c, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(p.c, CURLINFO_SPEED_DOWNLOAD_T, &speed);
+        curl_easy_getinfo(p.c, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        curl_multi_remove_handle(m, p.c);
+        curl_easy_cleanup(p.c);
+
+        /* Servers that ignore the range are cut off by the write callback once they sent enough */
+        bool complete = p.done && (p.result == CURLE_OK || (p.result == CURLE_WRITE_ERROR && p.received >= IMAGEWRITER_MIRROR_PROBE_SIZE));
+        mirror.acceptRanges = code == 206;
+        mirror.size = mirror.acceptRanges ? p.total : (length > 0 ? length : 0);
+        mirror.rtt = starttransfer / 1000000.0;
+        mirror.throughput = speed;
+        if (!complete || !mirror.size || !mirror.throughput)
+        {
+            qDebug() << "Mirror" << mirror.url << "did not answer probe:" << curl_easy_strerror(p.result) << "HTTP status code:" << code;
+            continue;
+        }
+        if (!size)
+            size = mirror.size;
+        if (mirror.size != size)
+        {
+            qDebug() << "Mirror" << mirror.url << "has a file of" << mirror.size << "bytes instead of" << size << ". Not using it";
+            continue;
+        }
+
+        qDebug() << "Mirror" << mirror.url << "time to first byte:" << qRound(mirror.rtt * 1000) << "ms, throughput:"
+                 << mirror.throughput / 1024 / 1024 << "MB/s" << (mirror.acceptRanges ? "" : "(no range requests)");
+        answered.append(mirror);
+    }
+    curl_multi_cleanup(m);
+
+    if (answered.isEmpty() || cancelled)
+        return;
+
+    std::stable_sort(answered.begin(), answered.end(), [](const Mirror &a, const Mirror &b) {
+        return _segmentTime(a) < _segmentTime(b);
+    });
+    _mirrors = answered;
+}
+
+QList<QByteArray> MirrorList::fastUrls() const
+{
+    QList<QByteArray> urls;
+    if (_mirrors.isEmpty() || !_mirrors.first().throughput)
+        return urls;
+
+    double best = _segmentTime(_mirrors.first());
+    for (const Mirror &m : _mirrors)
+    {
+        if (m.acceptRanges && m.throughput && _segmentTime(m) <= best * IMAGEWRITER_MIRROR_SPREAD)
+            urls.append(m.url);
+    }
+
+    return urls;
+}
+
+double MirrorList::_segmentTime(const Mirror &m)
+{
+    return m.rtt + (m.throughput ? IMAGEWRITER_SEGMENT_SIZE / m.throughput : 0);
+}
+
+size_t MirrorList::_curl_probe_write_callback(char *, size_t size, size_t nmemb, void *userdata)
+{
+    Probe *p = static_cast<Probe *>(userdata);
+    size_t len = size * nmemb;
+
+    p->received += len;
+    /* Enough to tell the throughput */
+    if (p->received > IMAGEWRITER_MIRROR_PROBE_SIZE)
+        return 0;
+
+    return len;
+}
+
+/* Total size of the file is in the Content-Range of the answer to the range request */
+size_t MirrorList::_curl_probe_header_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    Probe *p = static_cast<Probe *>(userdata);
+    size_t len = size * nmemb;
+    QByteArray header = QByteArray(ptr, len).trimmed();
+
+    if (header.toLower().startsWith("content-range:"))
+    {
+        int slash = header.lastIndexOf('/');
+        if (slash != -1)
+            p->total = header.mid(slash+1).toULongLong();
+    }
+
+    return len;
+}
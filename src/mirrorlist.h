@@ -0,0 +1,67 @@
+#ifndef MIRRORLIST_H
+#define MIRRORLIST_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QVector>
+#include <atomic>
+#include <curl/curl.h>
+
+/*
+ * URLs the same image can be downloaded from, as listed in the OS list
+ * (mirrors) or in a metalink file (metalink_url)
+ *
+ * probe() fetches the start of the file from all of them at once, and
+ * orders them by how long they would take for a segment of a download,
+ * from their round trip time and throughput.
+ */
+class MirrorList
+{
+public:
+    struct Mirror
+    {
+        QByteArray url;
+        /* Time to first byte and throughput measured by probe(), 0 if not probed */
+        double rtt, throughput;
+        quint64 size;
+        bool acceptRanges;
+    };
+
+    MirrorList();
+
+    /* Add url, unless it is in the list already. Only http and https URLs are taken */
+    void add(const QByteArray &url);
+    /* Add the http(s) URLs of a metalink file (RFC 5854, or version 3), by their priority.
+       Returns false if it is not one */
+    bool parseMetalink(const QByteArray &xml);
+    void clear();
+
+    int size() const;
+    bool isEmpty() const;
+    const Mirror &at(int i) const;
+
+    /* Probe every mirror at once, with the options of easy handle config. Stops early if cancelled
+       gets set. Mirrors that fail, or whose file is not as large as that of the first one that
+       answered, are dropped. Leaves the list as it was if none answers */
+    void probe(CURL *config, const std::atomic<bool> &cancelled);
+
+    /* URLs of the mirrors that accept range requests and are about as fast as the
+       best one, best first. Segments of a download can be spread over those */
+    QList<QByteArray> fastUrls() const;
+
+protected:
+    QVector<Mirror> _mirrors;
+
+    /* Seconds a segment of a download would take */
+    static double _segmentTime(const Mirror &m);
+
+    static size_t _curl_probe_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+    static size_t _curl_probe_header_callback(char *ptr, size_t size, size_t nmemb, void *userdata);
+};
+
+#endif // MIRRORLIST_H
@@ -0,0 +1,240 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "osiconprovider.h"
+#include "config.h"
+#include "curlshare.h"
+#include "downloadthread.h"
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QUrl>
+#include <atomic>
+#include <curl/curl.h>
+
+namespace
+{
+    /* Icon of a delegate. Runs on the pool of the provider, which deletes it only after finished() */
+    class OsIconResponse : public QQuickImageResponse, public QRunnable
+    {
+    public:
+        OsIconResponse(OsIconProvider *provider, const QString &url, const QSize &size)
+            : _provider(provider), _url(url), _size(size), _cancelled(false)
+        {
+            setAutoDelete(false);
+        }
+
+        virtual QQuickTextureFactory *textureFactory() const override
+        {
+            return QQuickTextureFactory::textureFactoryForImage(_image);
+        }
+
+        virtual QString errorString() const override
+        {
+            return _error;
+        }
+
+        virtual void cancel() override
+        {
+            _cancelled = true;
+        }
+
+        virtual void run() override
+        {
+            _image = _provider->cached(_url, _size, IMAGEWRITER_ICON_MAX_AGE);
+            if (_image.isNull() && !_cancelled)
+            {
+                QByteArray data;
+                if (_fetch(data))
+                    _image = _decode(data);
+                if (!_image.isNull())
+                    _provider->insert(_url, _size, _image);
+                else
+                    /* Offline, an old one is better than none */
+                    _image = _provider->cached(_url, _size, -1);
+            }
+            if (_image.isNull())
+                _error = QString("Cannot load icon %1").arg(_url);
+
+            emit finished();
+        }
+
+    protected:
+        OsIconProvider *_provider;
+        QString _url, _error;
+        QSize _size;
+        QImage _image;
+        std::atomic<bool> _cancelled;
+
+        bool _fetch(QByteArray &data)
+        {
+            char errorBuf[CURL_ERROR_SIZE] = {0};
+            QByteArray url = _url.toLatin1();
+            QByteArray proxy = DownloadThread::proxy();
+            CURL *c = curl_easy_init();
+            if (!c)
+                return false;
+
+            curl_easy_setopt(c, CURLOPT_NOSIGNAL, 1);
+            curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, &OsIconResponse::_curl_write_callback);
+            curl_easy_setopt(c, CURLOPT_WRITEDATA, &data);
+            curl_easy_setopt(c, CURLOPT_XFERINFOFUNCTION, &OsIconResponse::_curl_xferinfo_callback);
+            curl_easy_setopt(c, CURLOPT_XFERINFODATA, this);
+            curl_easy_setopt(c, CURLOPT_NOPROGRESS, 0);
+            curl_easy_setopt(c, CURLOPT_URL, url.constData());
+            curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1);
+            curl_easy_setopt(c, CURLOPT_MAXREDIRS, 10);
+            curl_easy_setopt(c, CURLOPT_ERRORBUFFER, errorBuf);
+            curl_easy_setopt(c, CURLOPT_FAILONERROR, 1);
+            curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, 30);
+            curl_easy_setopt(c, CURLOPT_TIMEOUT, 60);
+            DownloadThread::transport().apply(c);
+            CurlShare::apply(c);
+            if (!proxy.isEmpty())
+                curl_easy_setopt(c, CURLOPT_PROXY, proxy.constData());
+
+            CURLcode ret = curl_easy_perform(c);
+            curl_easy_cleanup(c);
+            if (ret != CURLE_OK)
+            {
+                if (!_cancelled)
+                    qDebug() << "Error downloading icon" << _url << ":" << (errorBuf[0] ? errorBuf : curl_easy_strerror(ret));
+                return false;
+            }
+
+            return true;
+        }
+
+        /* At the size asked for, keeping the aspect ratio. Only vector icons are scaled up */
+        QImage _decode(QByteArray &data)
+        {
+            QBuffer buffer(&data);
+            QImageReader reader(&buffer);
+            QSize original = reader.size();
+            QSize target = _size;
+
+            if (original.isValid() && !original.isEmpty() && (target.width() > 0 || target.height() > 0))
+            {
+                if (target.width() <= 0)
+                    target.setWidth(original.width() * target.height() / original.height());
+                else if (target.height() <= 0)
+                    target.setHeight(original.height() * target.width() / original.width());
+                else
+                    target = original.scaled(target, Qt::KeepAspectRatio);
+
+                if (reader.format() != "svg" && target.width() > original.width())
+                    target = original;
+                reader.setScaledSize(target);
+            }
+
+            QImage image = reader.read();
+            if (image.isNull())
+                qDebug() << "Cannot decode icon" << _url << ":" << reader.errorString();
+            return image;
+        }
+
+        static size_t _curl_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata)
+        {
+            QByteArray *data = (QByteArray *) userdata;
+            size_t len = size * nmemb;
+
+            if (data->size() + len > IMAGEWRITER_ICON_MAX_SIZE)
+                return 0;
+            data->append(ptr, len);
+
+            return len;
+        }
+
+        static int _curl_xferinfo_callback(void *userdata, curl_off_t, curl_off_t, curl_off_t, curl_off_t)
+        {
+            return ((OsIconResponse *) userdata)->_cancelled ? 1 : 0;
+        }
+    };
+}
+
+OsIconProvider::OsIconProvider(const QString &cacheDir)
+    : _dir(cacheDir), _memory(IMAGEWRITER_ICON_CACHE_MEMORY / 1024)
+{
+    _pool.setMaxThreadCount(IMAGEWRITER_ICON_THREADS);
+    QDir().mkpath(_dir);
+    _pool.start([this]() { _removeStale(); });
+}
+
+OsIconProvider::~OsIconProvider()
+{
+    _pool.waitForDone();
+}
+
+QQuickImageResponse *OsIconProvider::requestImageResponse(const QString &id, const QSize &requestedSize)
+{
+    OsIconResponse *response = new OsIconResponse(this, QUrl::fromPercentEncoding(id.toLatin1()), requestedSize);
+    _pool.start(response);
+    return response;
+}
+
+QString OsIconProvider::_key(const QString &url, const QSize &size) const
+{
+    return QString("%1@%2x%3").arg(url).arg(size.width()).arg(size.height());
+}
+
+QString OsIconProvider::_fileName(const QString &key) const
+{
+    return _dir + QDir::separator() + QCryptographicHash::hash(key.toUtf8(), QCryptographicHash::Sha1).toHex() + ".png";
+}
+
+QImage OsIconProvider::cached(const QString &url, const QSize &size, qint64 maxAgeSecs)
+{
+    QString key = _key(url, size);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (QImage *image = _memory.object(key))
+            return *image;
+    }
+
+    QFileInfo fi(_fileName(key));
+    if (!fi.exists() || (maxAgeSecs >= 0 && fi.lastModified().secsTo(QDateTime::currentDateTime()) > maxAgeSecs))
+        return QImage();
+
+    QImage image(fi.filePath());
+    if (!image.isNull())
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _memory.insert(key, new QImage(image), image.sizeInBytes() / 1024 + 1);
+    }
+
+    return image;
+}
+
+void OsIconProvider::insert(const QString &url, const QSize &size, const QImage &image)
+{
+    QString key = _key(url, size);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _memory.insert(key, new QImage(image), image.sizeInBytes() / 1024 + 1);
+    }
+
+    QSaveFile f(_fileName(key));
+    if (!f.open(QIODevice::WriteOnly) || !image.save(&f, "PNG") || !f.commit())
+        qDebug() << "Error saving icon" << url << "to the cache";
+}
+
+/* Icons of images no longer in the list would pile up otherwise */
+void OsIconProvider::_removeStale()
+{
+    const QFileInfoList files = QDir(_dir).entryInfoList({"*.png"}, QDir::Files);
+    QDateTime now = QDateTime::currentDateTime();
+
+    for (const QFileInfo &fi : files)
+    {
+        if (fi.lastModified().secsTo(now) > IMAGEWRITER_ICON_REMOVE_AGE)
+            QFile::remove(fi.filePath());
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef OSICONPROVIDER_H
+#define OSICONPROVIDER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QQuickAsyncImageProvider>
+#include <QCache>
+#include <QImage>
+#include <QThreadPool>
+#include <mutex>
+
+/*
+ * Icons of the OS list, as image://osicon/<percent encoded URL>
+ *
+ * Icons are downloaded on a pool of threads, several at once, and
+ * decoded there at the size the Image asks for (sourceSize). Decoded
+ * icons are kept in memory up to IMAGEWRITER_ICON_CACHE_MEMORY, least
+ * recently used ones going first. The scaled icons are also saved in
+ * the icons directory next to the OS list snapshot, so the list shows
+ * its icons right away on the next start, without network.
+ */
+class OsIconProvider : public QQuickAsyncImageProvider
+{
+public:
+    OsIconProvider(const QString &cacheDir);
+    virtual ~OsIconProvider();
+
+    virtual QQuickImageResponse *requestImageResponse(const QString &id, const QSize &requestedSize) override;
+
+    /* Scaled icon of url from memory or disk. Null if not cached or older than maxAgeSecs */
+    QImage cached(const QString &url, const QSize &size, qint64 maxAgeSecs);
+    /* Keep image in memory and on disk */
+    void insert(const QString &url, const QSize &size, const QImage &image);
+
+protected:
+    QString _dir;
+    std::mutex _mutex;
+    /* Cost in KB */
+    QCache<QString, QImage> _memory;
+    QThreadPool _pool;
+
+    QString _key(const QString &url, const QSize &size) const;
+    QString _fileName(const QString &key) const;
+    void _removeStale();
+};
+
+#endif // OSICONPROVIDER_H
@@ -0,0 +1,305 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "peercache.h"
+#include "cachesidecar.h"
+#include "config.h"
+#include <QDebug>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QNetworkDatagram>
+#include <QTcpSocket>
+#include <QThread>
+#include <QUrl>
+#include <memory>
+
+PeerCache *PeerCache::_instance = nullptr;
+QThread *PeerCache::_thread = nullptr;
+bool PeerCache::_serving = false;
+
+PeerCache::PeerCache(const QString &dir, quint16 port)
+    : _dir(dir), _port(port), _server(this), _discovery(this), _connections(0)
+{
+    connect(&_server, &QTcpServer::newConnection, this, &PeerCache::onNewConnection);
+    connect(&_discovery, &QUdpSocket::readyRead, this, &PeerCache::onDiscoveryDatagram);
+}
+
+bool PeerCache::serve(const QString &dir, quint16 port)
+{
+    if (_instance)
+        return _serving;
+
+    _thread = new QThread;
+    _thread->setObjectName("PeerCache");
+    _instance = new PeerCache(dir, port);
+    _instance->moveToThread(_thread);
+    _thread->start();
+    QMetaObject::invokeMethod(_instance, []() { _serving = _instance->_listen(); }, Qt::BlockingQueuedConnection);
+
+    return _serving;
+}
+
+bool PeerCache::_listen()
+{
+    if (!_server.listen(QHostAddress::Any, _port))
+    {
+        qDebug() << "Error listening for peer cache requests on port" << _port << ":" << _server.errorString();
+        return false;
+    }
+    if (!_discovery.bind(QHostAddress(QHostAddress::AnyIPv4), IMAGEWRITER_PEER_CACHE_PORT, QUdpSocket::ShareAddress | QUdpSocket::ReuseAddressHint)
+            || !_discovery.joinMulticastGroup(QHostAddress(IMAGEWRITER_PEER_CACHE_GROUP)))
+    {
+        qDebug() << "Error joining peer cache discovery group:" << _discovery.errorString();
+        _server.close();
+        return false;
+    }
+
+    qDebug() << "Serving download cache" << _dir << "to peers on port" << _server.serverPort();
+    return true;
+}
+
+QByteArray PeerCache::find(const QByteArray &sha256)
+{
+    QByteArray hash = sha256.toLower();
+    QUdpSocket socket;
+    if (!_validHash(hash) || !socket.bind(QHostAddress(QHostAddress::AnyIPv4), 0))
+        return QByteArray();
+
+    /* Peers on the same link only, and not ourselves */
+    socket.setSocketOption(QAbstractSocket::MulticastTtlOption, 1);
+    socket.setSocketOption(QAbstractSocket::MulticastLoopbackOption, 0);
+    if (socket.writeDatagram(_message("query", hash), QHostAddress(IMAGEWRITER_PEER_CACHE_GROUP), IMAGEWRITER_PEER_CACHE_PORT) == -1)
+    {
+        qDebug() << "Error sending peer cache query:" << socket.errorString();
+        return QByteArray();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    while (socket.hasPendingDatagrams() || socket.waitForReadyRead(qMax<qint64>(0, IMAGEWRITER_PEER_CACHE_TIMEOUT - timer.elapsed())))
+    {
+        while (socket.hasPendingDatagrams())
+        {
+            QNetworkDatagram datagram = socket.receiveDatagram(IMAGEWRITER_PEER_CACHE_MAX_MESSAGE);
+            QList<QByteArray> args = _parse(datagram.data(), "have");
+            if (args.size() != 2 || args[0] != hash)
+                continue;
+
+            quint16 port = args[1].toUShort();
+            if (!port)
+                continue;
+
+            QUrl url;
+            url.setScheme("http");
+            url.setHost(datagram.senderAddress().toString());
+            url.setPort(port);
+            url.setPath("/"+QString::fromLatin1(hash)+".cache");
+            return url.toEncoded();
+        }
+
+        if (timer.elapsed() >= IMAGEWRITER_PEER_CACHE_TIMEOUT)
+            break;
+    }
+
+    return QByteArray();
+}
+
+QByteArray PeerCache::_message(const QByteArray &type, const QByteArray &args)
+{
+    return "gem-imager-peer 1 "+type+" "+args;
+}
+
+QList<QByteArray> PeerCache::_parse(const QByteArray &message, const QByteArray &type)
+{
+    QList<QByteArray> args = message.trimmed().split(' ');
+    if (args.size() < 3 || args[0] != "gem-imager-peer" || args[1] != "1" || args[2] != type)
+        return QList<QByteArray>();
+
+    return args.mid(3);
+}
+
+bool PeerCache::_validHash(const QByteArray &sha256)
+{
+    if (sha256.size() != 64)
+        return false;
+    for (char c : sha256)
+    {
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f')))
+            return false;
+    }
+
+    return true;
+}
+
+QString PeerCache::_entry(const QByteArray &sha256) const
+{
+    if (!_validHash(sha256))
+        return QString();
+
+    /* Named like DownloadCache does. Files still being downloaded have no valid sidecar yet.
+       Transcoded ones are not the file the origin has, which a download that loses the peer continues with */
+    QString file = _dir+QDir::separator()+QString::fromLatin1(sha256)+".cache";
+    CacheSidecar sidecar;
+    if (!sidecar.load(file) || sidecar.extractHash != sha256 || sidecar.transcoded)
+        return QString();
+
+    return file;
+}
+
+void PeerCache::onDiscoveryDatagram()
+{
+    while (_discovery.hasPendingDatagrams())
+    {
+        QNetworkDatagram datagram = _discovery.receiveDatagram(IMAGEWRITER_PEER_CACHE_MAX_MESSAGE);
+        QList<QByteArray> args = _parse(datagram.data(), "query");
+        if (args.size() != 1)
+            continue;
+
+        if (!_entry(args[0]).isEmpty())
+        {
+            qDebug() << "Peer" << datagram.senderAddress().toString() << "asked for cached image" << args[0];
+            _discovery.writeDatagram(_message("have", args[0]+" "+QByteArray::number(_server.serverPort())), datagram.senderAddress(), datagram.senderPort());
+        }
+    }
+}
+
+/* Minimal HTTP/1.1: one GET or HEAD per connection, with an optional single range */
+void PeerCache::onNewConnection()
+{
+    while (_server.hasPendingConnections())
+    {
+        QTcpSocket *client = _server.nextPendingConnection();
+        if (_connections >= IMAGEWRITER_PEER_CACHE_MAX_CONNECTIONS)
+        {
+            client->abort();
+            client->deleteLater();
+            continue;
+        }
+
+        _connections++;
+        auto transfer = std::make_shared<Transfer>();
+        connect(client, &QTcpSocket::disconnected, this, [this, client]() {
+            _connections--;
+            client->deleteLater();
+        });
+        connect(client, &QTcpSocket::bytesWritten, this, [this, client, transfer]() {
+            _sendMore(client, transfer.get());
+        });
+        connect(client, &QTcpSocket::readyRead, this, [this, client, transfer]() {
+            if (transfer->answered)
+            {
+                client->readAll();
+                return;
+            }
+
+            int end = client->peek(IMAGEWRITER_PEER_CACHE_MAX_MESSAGE).indexOf("\r\n\r\n");
+            if (end == -1)
+            {
+                /* Do not buffer junk forever */
+                if (client->bytesAvailable() >= IMAGEWRITER_PEER_CACHE_MAX_MESSAGE)
+                    client->abort();
+                return;
+            }
+
+            transfer->answered = true;
+            _answer(client, transfer.get(), client->read(end+4));
+        });
+    }
+}
+
+void PeerCache::_answer(QTcpSocket *client, Transfer *transfer, const QByteArray &request)
+{
+    const QList<QByteArray> lines = request.trimmed().split('\n');
+    QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+    QByteArray status, headers;
+    quint64 start = 0, len = 0;
+
+    /* Path is /<sha256>.cache */
+    QByteArray path = requestLine.value(1);
+    QString file = path.startsWith('/') && path.endsWith(".cache") ? _entry(path.mid(1, path.size()-7)) : QString();
+    transfer->file.setFileName(file);
+
+    if (requestLine.size() < 3 || (requestLine[0] != "GET" && requestLine[0] != "HEAD"))
+    {
+        status = "405 Method Not Allowed";
+    }
+    else if (file.isEmpty() || !transfer->file.open(QIODevice::ReadOnly))
+    {
+        status = "404 Not Found";
+    }
+    else
+    {
+        quint64 size = transfer->file.size();
+        QByteArray range;
+        for (const QByteArray &line : lines)
+        {
+            if (line.toLower().startsWith("range:"))
+                range = line.mid(6).trimmed().toLower();
+        }
+
+        status = "200 OK";
+        len = size;
+        /* Single ranges only. Anything else gets the whole file, which HTTP allows */
+        if (range.startsWith("bytes=") && !range.contains(','))
+        {
+            QList<QByteArray> bounds = range.mid(6).split('-');
+            bool okStart = false, okEnd = false;
+            quint64 first = bounds.value(0).toULongLong(&okStart);
+            quint64 last = bounds.value(1).toULongLong(&okEnd);
+
+            if (bounds.size() == 2 && okStart)
+            {
+                if (!okEnd || last >= size)
+                    last = size-1;
+                if (first >= size || last < first)
+                {
+                    status = "416 Range Not Satisfiable";
+                    headers = "Content-Range: bytes */"+QByteArray::number(size)+"\r\n";
+                    len = 0;
+                }
+                else
+                {
+                    status = "206 Partial Content";
+                    headers = "Content-Range: bytes "+QByteArray::number(first)+"-"+QByteArray::number(last)+"/"+QByteArray::number(size)+"\r\n";
+                    start = first;
+                    len = last-first+1;
+                }
+            }
+        }
+        headers += "Accept-Ranges: bytes\r\nContent-Type: application/octet-stream\r\n";
+    }
+
+    client->write("HTTP/1.1 "+status+"\r\n"+headers+"Content-Length: "+QByteArray::number(len)+"\r\nConnection: close\r\n\r\n");
+    if (requestLine.value(0) == "GET" && len && transfer->file.seek(start))
+    {
+        qDebug() << "Serving" << len << "bytes of" << file << "to peer" << client->peerAddress().toString();
+        transfer->remaining = len;
+        _sendMore(client, transfer);
+    }
+    else
+    {
+        client->disconnectFromHost();
+    }
+}
+
+/* Keep a limited amount queued on the socket, refilled as it drains */
+void PeerCache::_sendMore(QTcpSocket *client, Transfer *transfer)
+{
+    while (transfer->remaining && client->bytesToWrite() < IMAGEWRITER_PEER_CACHE_SEND_BUFFER)
+    {
+        QByteArray buf = transfer->file.read(qMin<quint64>(transfer->remaining, IMAGEWRITER_PEER_CACHE_SEND_BUFFER));
+        if (buf.isEmpty())
+        {
+            qDebug() << "Error reading" << transfer->file.fileName() << "for peer";
+            client->abort();
+            return;
+        }
+
+        client->write(buf);
+        transfer->remaining -= buf.size();
+        if (!transfer->remaining)
+            client->disconnectFromHost();
+    }
+}
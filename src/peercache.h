@@ -0,0 +1,82 @@
+#ifndef PEERCACHE_H
+#define PEERCACHE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QFile>
+#include <QList>
+#include <QObject>
+#include <QString>
+#include <QTcpServer>
+#include <QUdpSocket>
+
+class QThread;
+class QTcpSocket;
+
+/*
+ * Shares the download cache with other imaging stations on the LAN
+ *
+ * Stations looking for an image send a query with its SHA256 to a
+ * multicast group. A station that has a complete entry for it (one with
+ * a valid sidecar, see CacheSidecar) answers with the port of its HTTP
+ * server, which serves cache files by hash as /<sha256>.cache, with
+ * range requests.
+ *
+ * Peers are not trusted: what is downloaded from them is checked against
+ * the expected hash like any other download.
+ */
+class PeerCache : public QObject
+{
+    Q_OBJECT
+public:
+    /* Serve the complete entries of the download cache in dir, in a thread of its own.
+       Once per process, later calls return whether the first one succeeded */
+    static bool serve(const QString &dir, quint16 port);
+
+    /* Ask the LAN who has the image, waiting for IMAGEWRITER_PEER_CACHE_TIMEOUT ms at most.
+       Returns the URL to download it from, empty if no peer has it */
+    static QByteArray find(const QByteArray &sha256);
+
+protected:
+    /* Response being sent on a connection */
+    struct Transfer
+    {
+        bool answered = false;
+        QFile file;
+        quint64 remaining = 0;
+    };
+
+    static PeerCache *_instance;
+    static QThread *_thread;
+    static bool _serving;
+
+    QString _dir;
+    quint16 _port;
+    QTcpServer _server;
+    QUdpSocket _discovery;
+    int _connections;
+
+    PeerCache(const QString &dir, quint16 port);
+    bool _listen();
+    /* Cache file of sha256 if it is complete, empty otherwise */
+    QString _entry(const QByteArray &sha256) const;
+    void _answer(QTcpSocket *client, Transfer *transfer, const QByteArray &request);
+    void _sendMore(QTcpSocket *client, Transfer *transfer);
+
+    /* Discovery messages are a line of text: gem-imager-peer 1 <type> <args...> */
+    static QByteArray _message(const QByteArray &type, const QByteArray &args);
+    /* Arguments of a message of this type, empty if it is something else */
+    static QList<QByteArray> _parse(const QByteArray &message, const QByteArray &type);
+    /* Lower case hex SHA256 */
+    static bool _validHash(const QByteArray &sha256);
+
+protected slots:
+    void onNewConnection();
+    void onDiscoveryDatagram();
+};
+
+#endif // PEERCACHE_H
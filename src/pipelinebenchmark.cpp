@@ -0,0 +1,382 @@
+/*
+ * Benchmark of the image writing pipeline, without network or storage device
+ *
+ * Usage: pipelinebenchmark [<MB of image data> [<sink file> [<work directory>]]]
+ *
+ * Generates a dense and a sparse image from a fixed seed, compresses
+ * them with xz, zstd, gzip and zip, and writes each through
+ * LocalFileExtractThread and DownloadExtractThread (fetching a file://
+ * URL) into the sink file. Use a file on tmpfs as sink, so the storage
+ * does not limit the results. Hashing, inflating and the download ring
+ * buffer are measured on their own as well, to compare the zlib backends
+ * (see ENABLE_ZLIB_NG). Built with ENABLE_QATZIP, inflating on the
+ * QuickAssist device is measured next to it, and the .gz pipelines use it.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "acceleratedcryptographichash.h"
+#include "config.h"
+#include "downloadextractthread.h"
+#include "localfileextractthread.h"
+#include "ringbuffer.h"
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QRandomGenerator>
+#include <QUrl>
+#include <archive.h>
+#include <archive_entry.h>
+#include <iostream>
+#include <iomanip>
+#include <string.h>
+#include <thread>
+#include <zlib.h>
+#ifdef HAVE_QATZIP
+#include <qatzip.h>
+#endif
+
+/* Writes to a plain file instead of a storage device */
+template <class T>
+class BenchmarkThread : public T
+{
+public:
+    BenchmarkThread(const QByteArray &url, const QByteArray &sink, const QByteArray &expectedHash)
+        : T(url, sink, expectedHash)
+    {
+        this->_ejectEnabled = false;
+        QObject::connect(this, &DownloadThread::error, [this](QString msg) {
+            errorMsg = msg;
+        });
+        QObject::connect(this, &DownloadThread::phaseFinished, [this](QString phase, quint64, qint64 msecs) {
+            phaseTimes[phase] = msecs;
+        });
+    }
+
+    QString errorMsg;
+    QMap<QString, qint64> phaseTimes;
+
+protected:
+    /* No unmounting, discarding or zeroing */
+    virtual bool _openAndPrepareDevice()
+    {
+        this->_file.setFileName(this->_filename);
+        return this->_file.open(QIODevice::ReadWrite | QIODevice::Truncate);
+    }
+};
+
+static double mbps(quint64 bytes, qint64 msecs)
+{
+    return bytes / 1000.0 / qMax(msecs, (qint64) 1);
+}
+
+/* 4 KB blocks of zeroes, random data and text-like data. sparse has mostly zeroes */
+static QByteArray generateImage(const QString &filename, quint64 size, bool sparse)
+{
+    QRandomGenerator rng(sparse ? 2 : 1);
+    AcceleratedCryptographicHash hash(OSLIST_HASH_ALGORITHM);
+    QByteArray buf(IMAGEWRITER_BLOCKSIZE, 0);
+    QFile f(filename);
+
+    if (!f.open(QIODevice::WriteOnly | QIODevice::Truncate))
+        return QByteArray();
+
+    for (quint64 pos = 0; pos < size; pos += buf.size())
+    {
+        for (int i = 0; i < buf.size(); i += 4096)
+        {
+            char *block = buf.data()+i;
+            int kind = rng.bounded(100);
+
+            if (kind < (sparse ? 90 : 20))
+            {
+                memset(block, 0, 4096);
+            }
+            else if (kind < (sparse ? 95 : 50))
+            {
+                rng.fillRange((quint32 *) block, 4096 / sizeof(quint32));
+            }
+            else
+            {
+                for (int j = 0; j < 4096; j++)
+                    block[j] = "etaoin shrdlu\n"[rng.bounded(14)];
+            }
+        }
+        f.write(buf);
+        hash.addData(buf.constData(), buf.size());
+    }
+
+    return hash.result().toHex();
+}
+
+static bool compressImage(const QString &src, const QString &dst, const QString &format)
+{
+    struct archive *a = archive_write_new();
+    QFile in(src);
+    bool ok = in.open(QIODevice::ReadOnly);
+
+    if (format == "zip")
+    {
+        archive_write_set_format_zip(a);
+    }
+    else
+    {
+        archive_write_set_format_raw(a);
+        if (format == "xz")
+        {
+            archive_write_add_filter_xz(a);
+            /* Decompression speed hardly depends on the level, generating the file does */
+            archive_write_set_filter_option(a, NULL, "compression-level", "1");
+        }
+        else if (format == "zst")
+        {
+            archive_write_add_filter_zstd(a);
+        }
+        else
+        {
+            archive_write_add_filter_gzip(a);
+        }
+    }
+
+    ok = ok && archive_write_open_filename(a, dst.toLocal8Bit().constData()) == ARCHIVE_OK;
+    if (ok)
+    {
+        struct archive_entry *entry = archive_entry_new();
+        archive_entry_set_pathname(entry, "image.img");
+        archive_entry_set_size(entry, in.size());
+        archive_entry_set_filetype(entry, AE_IFREG);
+        archive_entry_set_perm(entry, 0644);
+        ok = archive_write_header(a, entry) == ARCHIVE_OK;
+        archive_entry_free(entry);
+
+        QByteArray buf(IMAGEWRITER_BLOCKSIZE, 0);
+        qint64 len;
+        while (ok && (len = in.read(buf.data(), buf.size())) > 0)
+            ok = archive_write_data(a, buf.constData(), len) == len;
+        ok = archive_write_close(a) == ARCHIVE_OK && ok;
+    }
+    archive_write_free(a);
+
+    return ok;
+}
+
+template <class T>
+static void benchPipeline(const char *name, const QString &image, const QByteArray &hash, const QByteArray &sink, quint64 size)
+{
+    BenchmarkThread<T> thread(QUrl::fromLocalFile(image).toEncoded(), sink, hash);
+    QElapsedTimer t;
+
+    thread.setVerifyEnabled(false);
+    t.start();
+    thread.start();
+    thread.wait();
+    qint64 elapsed = t.elapsed();
+
+    std::cout << std::left << std::setw(36) << (QFileInfo(image).fileName() + " " + name).toStdString()
+              << std::right << std::fixed << std::setprecision(0);
+    if (!thread.errorMsg.isEmpty())
+    {
+        std::cout << "  failed: " << thread.errorMsg.toStdString() << std::endl;
+        return;
+    }
+    std::cout << std::setw(8) << mbps(size, elapsed) << " MB/s"
+              << std::setw(8) << thread.phaseTimes.value("decompress") << " ms decompress"
+              << std::setw(8) << thread.extractStallTime() << " ms extract stall"
+              << std::setw(8) << thread.writeStallTime() << " ms write stall"
+              << std::setw(8) << thread.queueProducerStalls() << "/" << thread.queueConsumerStalls() << " ring stalls"
+              << std::endl;
+}
+
+static void benchHash(const QString &image, quint64 size)
+{
+    AcceleratedCryptographicHash hash(OSLIST_HASH_ALGORITHM);
+    QFile f(image);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    const uchar *data = f.map(0, f.size());
+    if (!data)
+        return;
+
+    QElapsedTimer t;
+    t.start();
+    for (quint64 pos = 0; pos < size; pos += IMAGEWRITER_BLOCKSIZE)
+        hash.addData((const char *) data+pos, qMin((quint64) IMAGEWRITER_BLOCKSIZE, size-pos));
+    hash.result();
+    std::cout << std::left << std::setw(36) << "hash" << std::right << std::setw(8) << mbps(size, t.elapsed()) << " MB/s" << std::endl;
+}
+
+/* Inflating the .gz image in memory, as the gzip fast path of DownloadExtractThread does */
+static void benchInflate(const QString &image, quint64 size)
+{
+    QFile f(image);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    const uchar *data = f.map(0, f.size());
+    if (!data)
+        return;
+
+    QByteArray out(IMAGEWRITER_BLOCKSIZE, 0);
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 15+32) != Z_OK)
+        return;
+    strm.next_in = (Bytef *) data;
+    strm.avail_in = f.size();
+
+    QElapsedTimer t;
+    t.start();
+    int ret = Z_OK;
+    quint64 inflated = 0;
+    while (ret == Z_OK)
+    {
+        strm.next_out = (Bytef *) out.data();
+        strm.avail_out = out.size();
+        ret = inflate(&strm, Z_NO_FLUSH);
+        inflated += out.size() - strm.avail_out;
+    }
+    inflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || inflated != size)
+        std::cout << std::left << std::setw(36) << "inflate" << "  failed" << std::endl;
+    else
+        std::cout << std::left << std::setw(36) << "inflate" << std::right << std::setw(8) << mbps(size, t.elapsed()) << " MB/s" << std::endl;
+}
+
+#ifdef HAVE_QATZIP
+/* The same on the QuickAssist device, as the gzip fast path does when it finds one */
+static void benchInflateQat(const QString &image, quint64 size)
+{
+    QFile f(image);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    const uchar *data = f.map(0, f.size());
+    if (!data)
+        return;
+
+    QzSession_T sess;
+    memset(&sess, 0, sizeof(sess));
+    int rc = qzInit(&sess, 1);
+    if (rc != QZ_OK && rc != QZ_DUPLICATE)
+    {
+        std::cout << std::left << std::setw(36) << "inflate (QuickAssist)" << "  no device" << std::endl;
+        return;
+    }
+    QzSessionParams_T params;
+    qzGetDefaults(&params);
+    params.direction = QZ_DIR_DECOMPRESS;
+    qzSetupSession(&sess, &params);
+
+    QByteArray out(IMAGEWRITER_BLOCKSIZE, 0);
+    QzStream_T strm;
+    memset(&strm, 0, sizeof(strm));
+    const uchar *in = data;
+    quint64 inLen = f.size(), inflated = 0;
+
+    QElapsedTimer t;
+    t.start();
+    do
+    {
+        strm.in = (unsigned char *) in;
+        strm.in_sz = qMin(inLen, (quint64) UINT_MAX);
+        strm.out = (unsigned char *) out.data();
+        strm.out_sz = out.size();
+        rc = qzDecompressStream(&sess, &strm, 1);
+        in += strm.in_sz;
+        inLen -= strm.in_sz;
+        inflated += strm.out_sz;
+    } while (rc == QZ_OK && (strm.in_sz || strm.out_sz) && (inLen || strm.pending_in || strm.pending_out));
+    qzEndStream(&sess, &strm);
+    qzTeardownSession(&sess);
+    qzClose(&sess);
+
+    if (rc != QZ_OK || inflated != size)
+        std::cout << std::left << std::setw(36) << "inflate (QuickAssist)" << "  failed" << std::endl;
+    else
+        std::cout << std::left << std::setw(36) << "inflate (QuickAssist)" << std::right << std::setw(8) << mbps(size, t.elapsed()) << " MB/s" << std::endl;
+}
+#endif
+
+/* Producer and consumer on their own threads, as with curl and libarchive */
+static void benchRingBuffer(quint64 size)
+{
+    RingBuffer ring(IMAGEWRITER_RINGBUFFER_SIZE, IMAGEWRITER_RINGBUFFER_SLABSIZE);
+    QByteArray chunk(16384, 'x');
+    QElapsedTimer t;
+
+    t.start();
+    std::thread producer([&]() {
+        for (quint64 pos = 0; pos < size; pos += chunk.size())
+            ring.write(chunk.constData(), chunk.size());
+        ring.close();
+    });
+    const void *data;
+    quint64 received = 0;
+    ssize_t len;
+    while ((len = ring.read(&data)) > 0)
+        received += len;
+    producer.join();
+
+    std::cout << std::left << std::setw(36) << "ring buffer" << std::right << std::setw(8) << mbps(received, t.elapsed()) << " MB/s"
+              << std::setw(8) << ring.producerStalls() << "/" << ring.consumerStalls() << " stalls" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    int megabytes = (argc > 1) ? atoi(argv[1]) : 256;
+    QByteArray sink = (argc > 2) ? argv[2] : (QDir("/dev/shm").exists() ? "/dev/shm/pipelinebenchmark.img" : QDir::temp().filePath("pipelinebenchmark.img").toLocal8Bit());
+    QDir work((argc > 3) ? argv[3] : QDir::temp().filePath("pipelinebenchmark"));
+    if (megabytes <= 0 || !work.mkpath("."))
+    {
+        std::cerr << "Usage: pipelinebenchmark [<MB of image data> [<sink file> [<work directory>]]]" << std::endl;
+        return 1;
+    }
+    quint64 size = (quint64) megabytes * 1048576;
+
+    std::cout << "Writing " << megabytes << " MB images to " << sink.constData() << ", zlib " << zlibVersion() << std::endl;
+    benchRingBuffer(size * 4);
+
+    for (const char *kind : {"dense", "sparse"})
+    {
+        QString raw = work.filePath(QString("%1-%2.img").arg(kind).arg(megabytes));
+        QByteArray hash = generateImage(raw, size, QByteArray(kind) == "sparse");
+        if (hash.isEmpty())
+        {
+            std::cerr << "Error writing " << raw.toStdString() << std::endl;
+            return 1;
+        }
+        benchHash(raw, size);
+
+        QStringList images = {raw};
+        for (const QString &format : {"xz", "zst", "gz", "zip"})
+        {
+            QString compressed = (format == "zip") ? raw.left(raw.size()-4)+".zip" : raw+"."+format;
+            if (!compressImage(raw, compressed, format))
+            {
+                std::cerr << "Error compressing " << compressed.toStdString() << std::endl;
+                return 1;
+            }
+            images.append(compressed);
+            if (format == "gz")
+            {
+                benchInflate(compressed, size);
+#ifdef HAVE_QATZIP
+                benchInflateQat(compressed, size);
+#endif
+            }
+        }
+
+        for (const QString &image : std::as_const(images))
+        {
+            benchPipeline<LocalFileExtractThread>("local", image, hash, sink, size);
+            benchPipeline<DownloadExtractThread>("download", image, hash, sink, size);
+        }
+    }
+
+    QFile::remove(sink);
+
+    return 0;
+}
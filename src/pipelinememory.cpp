@@ -0,0 +1,237 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "pipelinememory.h"
+#include "pipelinetrace.h"
+#include "config.h"
+#include <QDebug>
+#ifdef Q_OS_LINUX
+#include <QHash>
+#include <QList>
+#include <mutex>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#endif
+
+std::atomic<int> PipelineMemory::_flags(0);
+
+namespace {
+
+std::atomic<quint64> hugeTotal(0), lockedTotal(0);
+
+#ifdef Q_OS_LINUX
+struct Allocation
+{
+    enum Kind { Malloc, Carved, Mapped } kind;
+    /* Length of the mapping for Mapped, rounded up to pages for Malloc */
+    size_t len;
+    bool huge, locked;
+};
+
+std::mutex mutex;
+QHash<void *, Allocation> allocations;
+/* Carved buffers not in use, by size */
+QHash<size_t, QList<void *>> freeLists;
+bool warnedHugetlb = false, warnedLock = false;
+
+size_t roundUp(size_t len, size_t to)
+{
+    return (len + to - 1) / to * to;
+}
+
+void traceCounters()
+{
+    PipelineTrace::counter("huge page memory", hugeTotal);
+    PipelineTrace::counter("locked memory", lockedTotal);
+}
+
+/* Mapping of len bytes, a multiple of the huge page size. huge is set if it is backed by huge pages,
+   or at least asked to be */
+char *mapHuge(size_t len, bool &huge)
+{
+    void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+        huge = true;
+        return (char *) p;
+    }
+    if (!warnedHugetlb)
+    {
+        qDebug() << "No hugetlbfs pages reserved (" << strerror(errno) << "). Asking for transparent huge pages instead";
+        warnedHugetlb = true;
+    }
+
+    /* Map a huge page more, to trim it to a huge page boundary */
+    size_t span = len + IMAGEWRITER_HUGEPAGE_SIZE;
+    p = mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+
+    char *start = (char *) p;
+    char *aligned = (char *) roundUp((quintptr) start, IMAGEWRITER_HUGEPAGE_SIZE);
+    if (aligned > start)
+        munmap(start, aligned - start);
+    if (start + span > aligned + len)
+        munmap(aligned + len, start + span - (aligned + len));
+
+    huge = (madvise(aligned, len, MADV_HUGEPAGE) == 0);
+    return aligned;
+}
+
+bool lock(void *buf, size_t len)
+{
+    if (mlock(buf, len) == 0)
+        return true;
+
+    if (!warnedLock)
+    {
+        qDebug() << "Cannot lock pipeline buffers in memory:" << strerror(errno) << "(raise RLIMIT_MEMLOCK)";
+        warnedLock = true;
+    }
+    return false;
+}
+#endif
+
+}
+
+void PipelineMemory::configure(int flags)
+{
+    _flags = flags;
+}
+
+int PipelineMemory::flags()
+{
+    return _flags;
+}
+
+void *PipelineMemory::allocate(size_t len)
+{
+    int flags = _flags;
+#ifdef Q_OS_LINUX
+    if (!flags)
+        return qMallocAligned(len, 4096);
+
+    std::lock_guard<std::mutex> guard(mutex);
+    const bool wantLock = flags & Lock;
+
+    if ((flags & HugePages) && len && len <= IMAGEWRITER_HUGEPAGE_SIZE
+            && IMAGEWRITER_HUGEPAGE_SIZE % len == 0 && len % 4096 == 0)
+    {
+        QList<void *> &freeList = freeLists[len];
+        if (freeList.isEmpty())
+        {
+            bool huge;
+            char *page = mapHuge(IMAGEWRITER_HUGEPAGE_SIZE, huge);
+            if (page)
+            {
+                bool locked = wantLock && lock(page, IMAGEWRITER_HUGEPAGE_SIZE);
+                for (size_t offset = 0; offset < IMAGEWRITER_HUGEPAGE_SIZE; offset += len)
+                {
+                    allocations.insert(page + offset, {Allocation::Carved, len, huge, locked});
+                    freeList.append(page + offset);
+                }
+                if (huge)
+                    hugeTotal += IMAGEWRITER_HUGEPAGE_SIZE;
+                if (locked)
+                    lockedTotal += IMAGEWRITER_HUGEPAGE_SIZE;
+                traceCounters();
+            }
+        }
+        if (!freeList.isEmpty())
+            return freeList.takeLast();
+    }
+    else if ((flags & HugePages) && len > IMAGEWRITER_HUGEPAGE_SIZE)
+    {
+        size_t mapLen = roundUp(len, IMAGEWRITER_HUGEPAGE_SIZE);
+        bool huge;
+        char *buf = mapHuge(mapLen, huge);
+        if (buf)
+        {
+            bool locked = wantLock && lock(buf, mapLen);
+            allocations.insert(buf, {Allocation::Mapped, mapLen, huge, locked});
+            if (huge)
+                hugeTotal += mapLen;
+            if (locked)
+                lockedTotal += mapLen;
+            traceCounters();
+            return buf;
+        }
+    }
+
+    /* Whole pages, so unlocking one buffer does not unlock part of another */
+    size_t pagesLen = roundUp(len, 4096);
+    void *buf = qMallocAligned(pagesLen, 4096);
+    if (buf && wantLock)
+    {
+        bool locked = lock(buf, pagesLen);
+        allocations.insert(buf, {Allocation::Malloc, pagesLen, false, locked});
+        if (locked)
+        {
+            lockedTotal += pagesLen;
+            traceCounters();
+        }
+    }
+    return buf;
+#else
+    Q_UNUSED(flags)
+    return qMallocAligned(len, 4096);
+#endif
+}
+
+void PipelineMemory::free(void *buf, size_t len)
+{
+    if (!buf)
+        return;
+#ifdef Q_OS_LINUX
+    std::lock_guard<std::mutex> guard(mutex);
+    auto it = allocations.find(buf);
+    if (it == allocations.end())
+    {
+        /* Allocated with no flags set */
+        qFreeAligned(buf);
+        return;
+    }
+
+    Allocation a = it.value();
+    if (a.kind == Allocation::Carved)
+    {
+        /* Stays mapped, and locked, for the next write */
+        freeLists[len].append(buf);
+        return;
+    }
+
+    allocations.erase(it);
+    if (a.huge)
+        hugeTotal -= a.len;
+    if (a.locked)
+        lockedTotal -= a.len;
+    if (a.kind == Allocation::Mapped)
+    {
+        munmap(buf, a.len);
+    }
+    else
+    {
+        if (a.locked)
+            munlock(buf, a.len);
+        qFreeAligned(buf);
+    }
+    if (a.huge || a.locked)
+        traceCounters();
+#else
+    Q_UNUSED(len)
+    qFreeAligned(buf);
+#endif
+}
+
+quint64 PipelineMemory::hugeBytes()
+{
+    return hugeTotal;
+}
+
+quint64 PipelineMemory::lockedBytes()
+{
+    return lockedTotal;
+}
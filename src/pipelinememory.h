@@ -0,0 +1,56 @@
+#ifndef PIPELINEMEMORY_H
+#define PIPELINEMEMORY_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <atomic>
+
+/*
+ * Allocator of the buffers data streams through: the download ring, the
+ * write buffers and the buffer pools
+ *
+ * By default these are plain 4k aligned allocations. With huge pages
+ * enabled, buffers that fit a 2 MB page a whole number of times are carved
+ * from 2 MB pages, so hashing and copying them takes a TLB entry per page
+ * instead of one per 4k. Pages come from the hugetlbfs pool if it has any
+ * reserved, and otherwise are transparent huge pages asked for with
+ * madvise(). Larger buffers are mapped as whole huge pages of their own.
+ * With locking enabled, the buffers are mlock()ed, so they are not paged
+ * out to swap in the middle of a write.
+ *
+ * Either falls back to what the system allows, e.g. without hugetlbfs
+ * pages, THP or enough RLIMIT_MEMLOCK. Carved buffers go back to a free
+ * list of their size when freed, and are reused by later writes. Huge and
+ * locked bytes are recorded as trace counters. Linux only, elsewhere the
+ * flags are ignored.
+ */
+class PipelineMemory
+{
+public:
+    enum Flag {
+        HugePages = 1,
+        Lock = 2
+    };
+
+    /* Applies to buffers allocated from then on. Call before the first write */
+    static void configure(int flags);
+    static int flags();
+
+    /* 4k aligned buffer of len bytes */
+    static void *allocate(size_t len);
+    /* len must be the one the buffer was allocated with */
+    static void free(void *buf, size_t len);
+
+    /* Bytes in huge pages and locked bytes, of buffers in use or free for reuse */
+    static quint64 hugeBytes();
+    static quint64 lockedBytes();
+
+protected:
+    static std::atomic<int> _flags;
+};
+
+#endif // PIPELINEMEMORY_H
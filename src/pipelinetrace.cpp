@@ -0,0 +1,272 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "pipelinetrace.h"
+#include <QCoreApplication>
+#include <QDebug>
+#include <QSaveFile>
+#include <QThread>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#if defined(Q_OS_WIN) && __has_include(<TraceLoggingProvider.h>)
+#define PIPELINETRACE_ETW
+#include <windows.h>
+#include <TraceLoggingProvider.h>
+#include <winmeta.h>
+#elif defined(Q_OS_DARWIN) && __has_include(<os/signpost.h>)
+#define PIPELINETRACE_SIGNPOST
+#include <os/signpost.h>
+#elif defined(Q_OS_LINUX) && __has_include(<sys/sdt.h>)
+#define PIPELINETRACE_USDT
+/* Probes with a semaphore, which the kernel counts up while a tracer is attached */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#endif
+
+std::atomic<bool> PipelineTrace::_enabled(false);
+
+#ifdef PIPELINETRACE_ETW
+/* GUID derived from the name as EventSource does, so "*GemImager.Pipeline" finds it as well */
+TRACELOGGING_DEFINE_PROVIDER(etwProvider, "GemImager.Pipeline",
+    (0xcb28b0ca, 0x5693, 0x5a9c, 0x02, 0xb6, 0x4f, 0xa2, 0xce, 0xf7, 0x4d, 0x55));
+#endif
+#ifdef PIPELINETRACE_USDT
+extern "C" {
+__extension__ unsigned short gemimager_span_begin_semaphore __attribute__((unused)) __attribute__((section(".probes")));
+__extension__ unsigned short gemimager_span_end_semaphore __attribute__((unused)) __attribute__((section(".probes")));
+}
+#endif
+
+namespace {
+
+struct Event
+{
+    const char *name;
+    qint64 start;
+    /* Duration of a span, -1 for a counter */
+    qint64 duration;
+    qint64 value;
+};
+
+/* Written by its own thread only. Buffers live until the process ends,
+   so the events of threads that are gone can still be exported */
+struct ThreadBuffer
+{
+    std::vector<Event> events;
+    std::atomic<quint64> count{0};
+    int tid;
+    QByteArray threadName;
+};
+
+std::mutex buffersMutex;
+std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+size_t eventsPerThread;
+std::chrono::steady_clock::time_point startTime;
+thread_local ThreadBuffer *threadBuffer = nullptr;
+
+ThreadBuffer *currentBuffer()
+{
+    if (!threadBuffer)
+    {
+        auto buffer = std::make_unique<ThreadBuffer>();
+        buffer->events.resize(eventsPerThread);
+
+        QThread *thread = QThread::currentThread();
+        if (QCoreApplication::instance() && thread == QCoreApplication::instance()->thread())
+            buffer->threadName = "main";
+        else if (!thread->objectName().isEmpty())
+            buffer->threadName = thread->objectName().toUtf8();
+        else
+            buffer->threadName = thread->metaObject()->className();
+
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffer->tid = (int) buffers.size() + 1;
+        threadBuffer = buffer.get();
+        buffers.push_back(std::move(buffer));
+    }
+
+    return threadBuffer;
+}
+
+void record(const Event &e)
+{
+    ThreadBuffer *buffer = currentBuffer();
+    quint64 n = buffer->count.load(std::memory_order_relaxed);
+    buffer->events[n & (buffer->events.size()-1)] = e;
+    buffer->count.store(n+1, std::memory_order_release);
+}
+
+#ifdef PIPELINETRACE_ETW
+/* For the lifetime of the process */
+struct EtwRegistration
+{
+    EtwRegistration()
+    {
+        TraceLoggingRegister(etwProvider);
+    }
+    ~EtwRegistration()
+    {
+        TraceLoggingUnregister(etwProvider);
+    }
+} etwRegistration;
+#endif
+
+#if defined(PIPELINETRACE_ETW) || defined(PIPELINETRACE_USDT)
+std::atomic<quint64> nextSpanId(1);
+#endif
+
+#ifdef PIPELINETRACE_SIGNPOST
+os_log_t signpostLog()
+{
+    static os_log_t log = os_log_create("com.gem-imager", "Pipeline");
+    return log;
+}
+#endif
+
+/* Chrome trace timestamps are in microseconds */
+QByteArray micros(qint64 ns)
+{
+    return QByteArray::number(ns / 1000.0, 'f', 3);
+}
+
+}
+
+void PipelineTrace::enable(size_t perThread)
+{
+    if (_enabled)
+        return;
+
+    size_t n = 1;
+    while (n < perThread)
+        n <<= 1;
+    eventsPerThread = n;
+    startTime = std::chrono::steady_clock::now();
+    _enabled.store(true, std::memory_order_release);
+}
+
+qint64 PipelineTrace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+void PipelineTrace::span(const char *name, qint64 start, qint64 end)
+{
+    if (enabled())
+        record({name, start, end - start, 0});
+}
+
+void PipelineTrace::counter(const char *name, qint64 value)
+{
+    if (enabled())
+        record({name, now(), -1, value});
+}
+
+bool PipelineTrace::nativeEnabled()
+{
+#if defined(PIPELINETRACE_ETW)
+    return TraceLoggingProviderEnabled(etwProvider, WINEVENT_LEVEL_VERBOSE, 0);
+#elif defined(PIPELINETRACE_SIGNPOST)
+    return os_signpost_enabled(signpostLog());
+#elif defined(PIPELINETRACE_USDT)
+    return *(volatile unsigned short *) &gemimager_span_begin_semaphore || *(volatile unsigned short *) &gemimager_span_end_semaphore;
+#else
+    return false;
+#endif
+}
+
+/* Begin and end events share an id, as spans of a thread can nest */
+quint64 PipelineTrace::nativeBegin(const char *name)
+{
+#if defined(PIPELINETRACE_ETW)
+    quint64 id = nextSpanId.fetch_add(1, std::memory_order_relaxed);
+    TraceLoggingWrite(etwProvider, "Span",
+                      TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                      TraceLoggingOpcode(WINEVENT_OPCODE_START),
+                      TraceLoggingString(name, "Name"),
+                      TraceLoggingUInt64(id, "Id"));
+    return id;
+#elif defined(PIPELINETRACE_SIGNPOST)
+    os_signpost_id_t id = os_signpost_id_generate(signpostLog());
+    os_signpost_interval_begin(signpostLog(), id, "Span", "%{public}s", name);
+    return id;
+#elif defined(PIPELINETRACE_USDT)
+    quint64 id = nextSpanId.fetch_add(1, std::memory_order_relaxed);
+    STAP_PROBE2(gemimager, span_begin, name, id);
+    return id;
+#else
+    Q_UNUSED(name)
+    return 1;
+#endif
+}
+
+void PipelineTrace::nativeEnd(const char *name, quint64 id, qint64 duration)
+{
+#if defined(PIPELINETRACE_ETW)
+    TraceLoggingWrite(etwProvider, "Span",
+                      TraceLoggingLevel(WINEVENT_LEVEL_VERBOSE),
+                      TraceLoggingOpcode(WINEVENT_OPCODE_STOP),
+                      TraceLoggingString(name, "Name"),
+                      TraceLoggingUInt64(id, "Id"),
+                      TraceLoggingInt64(duration, "DurationNs"));
+#elif defined(PIPELINETRACE_SIGNPOST)
+    Q_UNUSED(duration)
+    os_signpost_interval_end(signpostLog(), id, "Span", "%{public}s", name);
+#elif defined(PIPELINETRACE_USDT)
+    STAP_PROBE3(gemimager, span_end, name, id, duration);
+#else
+    Q_UNUSED(name)
+    Q_UNUSED(id)
+    Q_UNUSED(duration)
+#endif
+}
+
+bool PipelineTrace::writeChromeTrace(const QString &filename)
+{
+    QSaveFile f(filename);
+    if (!f.open(QIODevice::WriteOnly))
+    {
+        qDebug() << "Cannot write trace to" << filename << ":" << f.errorString();
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    QByteArray out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+
+    for (const auto &buffer : buffers)
+    {
+        const QByteArray tid = QByteArray::number(buffer->tid);
+        out += QByteArray(first ? "" : ",\n")+"{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":"+tid
+                +",\"args\":{\"name\":\""+buffer->threadName+"\"}}";
+        first = false;
+
+        /* Only the latest events if the ring went round */
+        quint64 count = buffer->count.load(std::memory_order_acquire);
+        quint64 size = buffer->events.size();
+        for (quint64 i = (count > size ? count - size : 0); i < count; i++)
+        {
+            const Event &e = buffer->events[i & (size-1)];
+            if (e.duration < 0)
+                out += ",\n{\"ph\":\"C\",\"name\":\""+QByteArray(e.name)+"\",\"pid\":1,\"tid\":"+tid
+                        +",\"ts\":"+micros(e.start)+",\"args\":{\"value\":"+QByteArray::number(e.value)+"}}";
+            else
+                out += ",\n{\"ph\":\"X\",\"name\":\""+QByteArray(e.name)+"\",\"pid\":1,\"tid\":"+tid
+                        +",\"ts\":"+micros(e.start)+",\"dur\":"+micros(e.duration)+"}";
+
+            if (out.size() > 1024*1024)
+            {
+                f.write(out);
+                out.clear();
+            }
+        }
+    }
+    out += "\n]}\n";
+    f.write(out);
+
+    return f.commit();
+}
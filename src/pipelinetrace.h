@@ -0,0 +1,92 @@
+#ifndef PIPELINETRACE_H
+#define PIPELINETRACE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <QString>
+#include <atomic>
+
+/*
+ * Tracing of where the time of a write goes
+ *
+ * Spans and counters of the pipeline stages are recorded into a ring of
+ * events per thread, so recording takes no locks. writeChromeTrace()
+ * exports them in the Chrome trace event format, which chrome://tracing
+ * and ui.perfetto.dev open.
+ *
+ * Spans also go to the tracer of the platform while one listens, for
+ * profiling in place without a trace file: ETW events of the provider
+ * GemImager.Pipeline (WPA, Windows Performance Recorder), os_signpost
+ * intervals of subsystem com.gem-imager (Instruments) and the USDT probes
+ * gemimager:span_begin and gemimager:span_end (bpftrace, perf). Each is
+ * built in when the SDK has its header, sys/sdt.h on Linux. Until enable()
+ * is called and with no tracer listening, a span costs a relaxed atomic
+ * load and the check for one.
+ *
+ * Names must be string literals, only the pointer is kept.
+ */
+class PipelineTrace
+{
+public:
+    /* Start recording. eventsPerThread is rounded up to a power of two */
+    static void enable(size_t eventsPerThread);
+    static bool enabled()
+    {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+    /* Nanoseconds since enable() */
+    static qint64 now();
+    static void span(const char *name, qint64 start, qint64 end);
+    static void counter(const char *name, qint64 value);
+    /* A platform tracer listens for spans. Reads a flag the tracer sets, no system call */
+    static bool nativeEnabled();
+    /* Returns the id nativeEnd() takes, never 0 */
+    static quint64 nativeBegin(const char *name);
+    static void nativeEnd(const char *name, quint64 id, qint64 duration);
+    /* Call after the threads that recorded have stopped */
+    static bool writeChromeTrace(const QString &filename);
+
+protected:
+    static std::atomic<bool> _enabled;
+};
+
+/* Records the time from construction to destruction as a span */
+class TraceSpan
+{
+public:
+    explicit TraceSpan(const char *name)
+        : _name(nullptr), _start(0), _nativeId(0)
+    {
+        bool native = PipelineTrace::nativeEnabled();
+        if (!native && !PipelineTrace::enabled())
+            return;
+
+        _name = name;
+        _start = PipelineTrace::now();
+        if (native)
+            _nativeId = PipelineTrace::nativeBegin(name);
+    }
+    ~TraceSpan()
+    {
+        if (!_name)
+            return;
+
+        qint64 end = PipelineTrace::now();
+        if (_nativeId)
+            PipelineTrace::nativeEnd(_name, _nativeId, end - _start);
+        PipelineTrace::span(_name, _start, end);
+    }
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+protected:
+    const char *_name;
+    qint64 _start;
+    quint64 _nativeId;
+};
+
+#endif // PIPELINETRACE_H
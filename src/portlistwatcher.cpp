@@ -0,0 +1,158 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "portlistwatcher.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QNetworkInterface>
+#include <QSerialPortInfo>
+
+#ifdef Q_OS_LINUX
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#elif defined(Q_OS_WIN) || defined(Q_OS_DARWIN)
+#include "drivechangenotifier.h"
+#endif
+
+PortListWatcher::PortListWatcher(QObject *parent)
+    : QThread(parent), _listed(false), _stopping(false), _refresh(false)
+{
+}
+
+PortListWatcher::~PortListWatcher()
+{
+    stop();
+}
+
+QStringList PortListWatcher::serialPorts() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _serialPorts;
+}
+
+QStringList PortListWatcher::ethernetPorts() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _ethernetPorts;
+}
+
+void PortListWatcher::refresh()
+{
+    _refresh = true;
+}
+
+void PortListWatcher::stop()
+{
+    _stopping = true;
+    wait();
+}
+
+void PortListWatcher::_list()
+{
+    QElapsedTimer t1;
+    t1.start();
+
+    QStringList serialPorts, ethernetPorts;
+    const auto serialPortInfos = QSerialPortInfo::availablePorts();
+    for (const auto &portInfo : serialPortInfos)
+    {
+        if (!portInfo.description().isEmpty() && !portInfo.manufacturer().isEmpty() && !portInfo.serialNumber().isEmpty() && portInfo.productIdentifier() != 0)
+            serialPorts.append(portInfo.portName());
+    }
+    const auto interfaces = QNetworkInterface::allInterfaces();
+    for (const auto &netInterface : interfaces)
+    {
+        if (!(netInterface.flags() & QNetworkInterface::IsLoopBack) && netInterface.type() == QNetworkInterface::Ethernet)
+            ethernetPorts.append(netInterface.humanReadableName());
+    }
+    if (t1.elapsed() > 1000)
+        qDebug() << "Enumerating ports took a long time:" << t1.elapsed()/1000.0 << "seconds";
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_listed && serialPorts == _serialPorts && ethernetPorts == _ethernetPorts)
+            return;
+        _listed = true;
+        _serialPorts = serialPorts;
+        _ethernetPorts = ethernetPorts;
+    }
+    emit portsChanged();
+}
+
+void PortListWatcher::run()
+{
+    _list();
+
+#ifdef Q_OS_LINUX
+    /* Kernel uevents of tty and net devices, the same source the drive list uses for disks */
+    int uevents = ::socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    /* Kernel (1) and udev (2) groups, like the drive list. The kernel may be quicker than
+       udev setting up the device, then its event comes in time to list it again */
+    addr.nl_groups = 1 | 2;
+    if (uevents != -1 && ::bind(uevents, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+    {
+        while (!_stopping)
+        {
+            struct pollfd fd = { uevents, POLLIN, 0 };
+            bool changed = _refresh.exchange(false);
+            if (::poll(&fd, 1, 500) > 0)
+            {
+                char buf[8192];
+                ssize_t len;
+                while ((len = ::recv(uevents, buf, sizeof(buf)-1, 0)) > 0)
+                {
+                    buf[len] = 0;
+                    for (const char *p = buf; p < buf + len; p += strlen(p) + 1)
+                    {
+                        if (!strcmp(p, "SUBSYSTEM=tty") || !strcmp(p, "SUBSYSTEM=net"))
+                            changed = true;
+                    }
+                }
+                /* Events were lost */
+                changed = changed || (len == -1 && errno == ENOBUFS);
+            }
+            if (changed)
+                _list();
+        }
+        ::close(uevents);
+        return;
+    }
+    qDebug() << "Cannot listen for uevents, polling ports instead:" << strerror(errno);
+    if (uevents != -1)
+        ::close(uevents);
+#elif defined(Q_OS_WIN) || defined(Q_OS_DARWIN)
+    DriveChangeNotifier notifier(DriveChangeNotifier::Ports);
+    if (notifier.start())
+    {
+        while (!_stopping)
+        {
+            bool changed = notifier.wait(500);
+            if (_refresh.exchange(false) || changed)
+                _list();
+        }
+        return;
+    }
+    qDebug() << "Cannot get port notifications, polling ports instead";
+#endif
+
+    QElapsedTimer sinceList;
+    sinceList.start();
+    while (!_stopping)
+    {
+        QThread::msleep(500);
+        if (_refresh.exchange(false) || sinceList.elapsed() > 3000)
+        {
+            _list();
+            sinceList.start();
+        }
+    }
+}
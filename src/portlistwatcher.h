@@ -0,0 +1,51 @@
+#ifndef PORTLISTWATCHER_H
+#define PORTLISTWATCHER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QThread>
+#include <QStringList>
+#include <atomic>
+#include <mutex>
+
+/*
+ * Serial ports and Ethernet interfaces, for the uniflash settings
+ *
+ * Enumerating serial ports can take hundreds of milliseconds on Windows,
+ * so it is done on this thread instead of the GUI thread. Ports are
+ * listed again when the system reports a serial port or network
+ * interface coming or going (uevents on Linux, DriveChangeNotifier on
+ * Windows and macOS), or every few seconds if it cannot.
+ */
+class PortListWatcher : public QThread
+{
+    Q_OBJECT
+public:
+    PortListWatcher(QObject *parent = nullptr);
+    virtual ~PortListWatcher();
+
+    /* As listed last. Empty until portsChanged() was emitted the first time */
+    QStringList serialPorts() const;
+    QStringList ethernetPorts() const;
+    /* List them again now */
+    void refresh();
+    void stop();
+
+signals:
+    void portsChanged();
+
+protected:
+    mutable std::mutex _mutex;
+    QStringList _serialPorts, _ethernetPorts;
+    bool _listed;
+    std::atomic<bool> _stopping, _refresh;
+
+    virtual void run() override;
+    /* Emits portsChanged() if the lists are different from before */
+    void _list();
+};
+
+#endif // PORTLISTWATCHER_H
@@ -0,0 +1,395 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "posixblockdevice.h"
+#include <QFile>
+#include <QVarLengthArray>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef Q_OS_LINUX
+#include <linux/fs.h>
+#include <sys/sysmacros.h>
+#endif
+#ifdef Q_OS_DARWIN
+#include <sys/disk.h>
+#endif
+
+#ifdef Q_OS_LINUX
+namespace
+{
+    quint64 sysfsValue(const QString &filename)
+    {
+        QFile f(filename);
+        if (!f.open(QIODevice::ReadOnly))
+            return 0;
+        return f.readAll().trimmed().toULongLong();
+    }
+}
+#endif
+
+PosixBlockDevice::PosixBlockDevice(int fd)
+    : _fd(fd)
+#ifdef Q_OS_LINUX
+    , _sectorSize(512)
+#endif
+{
+    struct stat st;
+    if (::fstat(fd, &st) != 0)
+        return;
+
+    if (S_ISREG(st.st_mode))
+    {
+#ifdef Q_OS_LINUX
+        _capabilities = IsRegularFile | CanDiscard | CanZeroOut;
+#elif defined(Q_OS_DARWIN)
+        _capabilities = IsRegularFile | CanDiscard;
+#else
+        _capabilities = IsRegularFile;
+#endif
+    }
+#ifdef Q_OS_LINUX
+    else if (S_ISBLK(st.st_mode))
+    {
+        /* Partitions have their queue in the directory of the disk */
+        QString dir = QString("/sys/dev/block/%1:%2/").arg(major(st.st_rdev)).arg(minor(st.st_rdev));
+        if (QFile::exists(dir+"partition"))
+            dir += "../";
+        int sectorSize = 0;
+        if (::ioctl(fd, BLKSSZGET, &sectorSize) == 0 && sectorSize > 0)
+            _sectorSize = sectorSize;
+        if (sysfsValue(dir+"queue/discard_max_bytes"))
+            _capabilities |= CanDiscard;
+        /* BLKZEROOUT would write the zeroes itself otherwise */
+        if (sysfsValue(dir+"queue/write_zeroes_max_bytes"))
+            _capabilities |= CanZeroOut;
+    }
+#endif
+}
+
+void PosixBlockDevice::_setError(const char *what)
+{
+    _error = QString("%1: %2").arg(what, strerror(errno));
+}
+
+void PosixBlockDevice::_unsupported(Capability capability)
+{
+    if (errno == EOPNOTSUPP || errno == ENOTTY || errno == ENOSYS)
+        _capabilities &= ~capability;
+}
+
+#ifdef Q_OS_LINUX
+bool PosixBlockDevice::_directUnaligned(quint64 bits)
+{
+    if (bits % _sectorSize == 0)
+        return false;
+
+    int flags = ::fcntl(_fd, F_GETFL);
+    return flags != -1 && (flags & O_DIRECT);
+}
+
+/* Reads the whole sectors the range is in, which keeps the read off the page cache */
+qint64 PosixBlockDevice::_preadBounced(char *buf, size_t len, quint64 offset)
+{
+    quint64 start = offset - offset % _sectorSize;
+    quint64 end = offset + len;
+    if (end % _sectorSize)
+        end += _sectorSize - end % _sectorSize;
+
+    char *bounce = (char *) qMallocAligned(end-start, qMax(_sectorSize, (size_t) 4096));
+    if (!bounce)
+    {
+        _error = "Out of memory";
+        return -1;
+    }
+    qint64 n = pread(bounce, end-start, start);
+    if (n > 0)
+    {
+        /* Short at the end of the device */
+        n = qBound((qint64) 0, n - (qint64) (offset-start), (qint64) len);
+        ::memcpy(buf, bounce + (offset-start), n);
+    }
+    qFreeAligned(bounce);
+
+    return n;
+}
+
+/* Only the buffer being unaligned is solved by copying it. Other than that O_DIRECT is
+   cleared for the write, the page cache then does the read-modify-write of the sectors */
+qint64 PosixBlockDevice::_pwriteUnaligned(const char *buf, size_t len, quint64 offset)
+{
+    qint64 n;
+    if ((len | offset) % _sectorSize == 0)
+    {
+        char *bounce = (char *) qMallocAligned(len, qMax(_sectorSize, (size_t) 4096));
+        if (!bounce)
+        {
+            _error = "Out of memory";
+            return -1;
+        }
+        ::memcpy(bounce, buf, len);
+        n = pwrite(bounce, len, offset);
+        qFreeAligned(bounce);
+    }
+    else
+    {
+        int flags = ::fcntl(_fd, F_GETFL);
+        if (flags == -1 || ::fcntl(_fd, F_SETFL, flags & ~O_DIRECT) == -1)
+        {
+            _setError("Error writing to device");
+            return -1;
+        }
+        n = pwrite(buf, len, offset);
+        ::fcntl(_fd, F_SETFL, flags);
+    }
+
+    return n;
+}
+#endif
+
+qint64 PosixBlockDevice::pread(char *buf, size_t len, quint64 offset)
+{
+#ifdef Q_OS_LINUX
+    if (_directUnaligned((quintptr) buf | len | offset))
+        return _preadBounced(buf, len, offset);
+#endif
+
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = ::pread(_fd, buf+done, len-done, offset+done);
+        if (n > 0)
+            done += n;
+        else if (n == 0)
+            break;
+        else if (errno != EINTR)
+        {
+            _setError("Error reading from device");
+            return -1;
+        }
+    }
+
+    return done;
+}
+
+qint64 PosixBlockDevice::pwrite(const char *buf, size_t len, quint64 offset)
+{
+#ifdef Q_OS_LINUX
+    if (_directUnaligned((quintptr) buf | len | offset))
+        return _pwriteUnaligned(buf, len, offset);
+#endif
+
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = ::pwrite(_fd, buf+done, len-done, offset+done);
+        if (n > 0)
+        {
+            done += n;
+        }
+        else if (n == 0 || errno != EINTR)
+        {
+            if (n == 0)
+                errno = ENOSPC;
+            _setError("Error writing to device");
+            return -1;
+        }
+    }
+
+    return done;
+}
+
+bool PosixBlockDevice::readv(const IoVec *iov, int count, quint64 offset)
+{
+    QVarLengthArray<struct iovec, 64> vec(count);
+    size_t len = 0;
+    quint64 bits = offset;
+    for (int i = 0; i < count; i++)
+    {
+        vec[i].iov_base = iov[i].data;
+        vec[i].iov_len = iov[i].len;
+        len += iov[i].len;
+        bits |= (quintptr) iov[i].data | iov[i].len;
+    }
+#ifdef Q_OS_LINUX
+    /* Through the bounce buffer of the base class, and the fallbacks above */
+    if (_directUnaligned(bits))
+        return BlockDevice::readv(iov, count, offset);
+#else
+    Q_UNUSED(bits)
+#endif
+
+    ssize_t n;
+    do
+    {
+        n = ::preadv(_fd, vec.constData(), count, offset);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != (ssize_t) len)
+    {
+        /* Short reads are not resumed, a device only has them at its end */
+        if (n != -1)
+            errno = EIO;
+        _setError("Error reading from device");
+        return false;
+    }
+
+    return true;
+}
+
+bool PosixBlockDevice::writev(const IoVec *iov, int count, quint64 offset)
+{
+    QVarLengthArray<struct iovec, 64> vec(count);
+    size_t len = 0;
+    quint64 bits = offset;
+    for (int i = 0; i < count; i++)
+    {
+        vec[i].iov_base = iov[i].data;
+        vec[i].iov_len = iov[i].len;
+        len += iov[i].len;
+        bits |= (quintptr) iov[i].data | iov[i].len;
+    }
+#ifdef Q_OS_LINUX
+    /* Through the bounce buffer of the base class, and the fallbacks above */
+    if (_directUnaligned(bits))
+        return BlockDevice::writev(iov, count, offset);
+#else
+    Q_UNUSED(bits)
+#endif
+
+    ssize_t n;
+    do
+    {
+        n = ::pwritev(_fd, vec.constData(), count, offset);
+    } while (n == -1 && errno == EINTR);
+
+    if (n != (ssize_t) len)
+    {
+        if (n != -1)
+            errno = ENOSPC;
+        _setError("Error writing to device");
+        return false;
+    }
+
+    return true;
+}
+
+bool PosixBlockDevice::discard(quint64 offset, quint64 len)
+{
+    int ret = -1;
+    errno = EOPNOTSUPP;
+
+#ifdef Q_OS_LINUX
+    if ((_capabilities & CanDiscard) && (_capabilities & IsRegularFile))
+    {
+        ret = ::fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+    }
+    else if (_capabilities & CanDiscard)
+    {
+        uint64_t range[2] = {offset, len};
+        ret = ::ioctl(_fd, BLKDISCARD, &range);
+    }
+#elif defined(Q_OS_DARWIN)
+    if (_capabilities & CanDiscard)
+    {
+        fpunchhole_t hole = {};
+        hole.fp_offset = offset;
+        hole.fp_length = len;
+        ret = ::fcntl(_fd, F_PUNCHHOLE, &hole);
+    }
+#else
+    Q_UNUSED(offset)
+    Q_UNUSED(len)
+#endif
+
+    if (ret == -1)
+    {
+        _setError("Error discarding");
+        _unsupported(CanDiscard);
+        return false;
+    }
+
+    return true;
+}
+
+bool PosixBlockDevice::zeroOut(quint64 offset, quint64 len)
+{
+    int ret = -1;
+    errno = EOPNOTSUPP;
+
+#ifdef Q_OS_LINUX
+    if ((_capabilities & CanZeroOut) && (_capabilities & IsRegularFile))
+    {
+        /* Without FALLOC_FL_KEEP_SIZE, zeroes at the end of the image make the file grow too */
+        ret = ::fallocate(_fd, FALLOC_FL_ZERO_RANGE, offset, len);
+    }
+    else if (_capabilities & CanZeroOut)
+    {
+        uint64_t range[2] = {offset, len};
+        ret = ::ioctl(_fd, BLKZEROOUT, &range);
+    }
+#else
+    Q_UNUSED(offset)
+    Q_UNUSED(len)
+#endif
+
+    if (ret == -1)
+    {
+        _setError("Error zeroing out");
+        _unsupported(CanZeroOut);
+        return false;
+    }
+
+    return true;
+}
+
+bool PosixBlockDevice::flush()
+{
+    if (::fsync(_fd) != 0)
+    {
+        _setError("Error syncing device");
+        return false;
+    }
+
+    return true;
+}
+
+quint64 PosixBlockDevice::size()
+{
+    struct stat st;
+    if (::fstat(_fd, &st) != 0)
+    {
+        _setError("Error getting size");
+        return 0;
+    }
+    if (S_ISREG(st.st_mode))
+        return st.st_size;
+
+#ifdef Q_OS_LINUX
+    uint64_t devsize = 0;
+    if (::ioctl(_fd, BLKGETSIZE64, &devsize) == -1)
+    {
+        _setError("Error getting device size");
+        return 0;
+    }
+    return devsize;
+#elif defined(Q_OS_DARWIN)
+    uint32_t blockSize = 0;
+    uint64_t blockCount = 0;
+    if (::ioctl(_fd, DKIOCGETBLOCKSIZE, &blockSize) == -1 || ::ioctl(_fd, DKIOCGETBLOCKCOUNT, &blockCount) == -1)
+    {
+        _setError("Error getting device size");
+        return 0;
+    }
+    return (quint64) blockSize * blockCount;
+#else
+    return 0;
+#endif
+}
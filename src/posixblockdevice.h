@@ -0,0 +1,54 @@
+#ifndef POSIXBLOCKDEVICE_H
+#define POSIXBLOCKDEVICE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "blockdevice.h"
+
+/*
+ * BlockDevice on a file descriptor, for Linux and macOS
+ *
+ * Linux: block devices discard with BLKDISCARD and zero out with
+ * BLKZEROOUT, if sysfs says the device supports it. Regular files punch
+ * holes and allocate zeroed ranges with fallocate(). With O_DIRECT set on
+ * the descriptor, transfers not aligned to the logical sector size are
+ * read through an aligned bounce buffer, and written either from one or,
+ * for unaligned lengths and offsets, through the page cache.
+ * macOS: regular files punch holes with F_PUNCHHOLE.
+ */
+class PosixBlockDevice : public BlockDevice
+{
+public:
+    PosixBlockDevice(int fd);
+
+    virtual qint64 pread(char *buf, size_t len, quint64 offset) override;
+    virtual qint64 pwrite(const char *buf, size_t len, quint64 offset) override;
+    virtual bool readv(const IoVec *iov, int count, quint64 offset) override;
+    virtual bool writev(const IoVec *iov, int count, quint64 offset) override;
+    virtual bool discard(quint64 offset, quint64 len) override;
+    virtual bool zeroOut(quint64 offset, quint64 len) override;
+    virtual bool flush() override;
+    virtual quint64 size() override;
+
+protected:
+    int _fd;
+#ifdef Q_OS_LINUX
+    size_t _sectorSize;
+#endif
+
+    void _setError(const char *what);
+    /* Clears capability if errno says it is not supported */
+    void _unsupported(Capability capability);
+#ifdef Q_OS_LINUX
+    /* True if O_DIRECT is set and bits, the buffer addresses, lengths and offset of a
+       transfer or'ed together, are not a multiple of the sector size */
+    bool _directUnaligned(quint64 bits);
+    qint64 _preadBounced(char *buf, size_t len, quint64 offset);
+    qint64 _pwriteUnaligned(const char *buf, size_t len, quint64 offset);
+#endif
+};
+
+#endif // POSIXBLOCKDEVICE_H
@@ -0,0 +1,68 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "prefetchthread.h"
+#include <QDebug>
+
+PrefetchThread::PrefetchThread(const QByteArray &url, const QByteArray &expectedHash, QObject *parent)
+    : DownloadThread(url, "", expectedHash, false, parent)
+{
+    /* Only a guess of what will be written. Whatever is written now goes first */
+    setBandwidthPriority(BandwidthScheduler::PriorityBackground);
+}
+
+void PrefetchThread::run()
+{
+    DownloadThread::run();
+
+    if (!_cachefile.isOpen())
+    {
+        /* Never opened, or discarded already */
+        _cacheWritten = 0;
+        return;
+    }
+
+    /* Keep what is there, cancelled or not. A journal lets later runs resume it as well */
+    if (!_discardPartialCache)
+        _writeCacheJournal();
+    if (_discardPartialCache || !_closeCacheFile())
+    {
+        _discardCacheFile();
+        _cacheWritten = 0;
+        return;
+    }
+    qDebug() << "Prefetched" << _cacheWritten << "bytes of" << _url;
+}
+
+quint64 PrefetchThread::prefetchedBytes() const
+{
+    return _cacheWritten;
+}
+
+/* Nothing to open, the download only goes into the cache */
+bool PrefetchThread::_openAndPrepareDevice()
+{
+    return true;
+}
+
+size_t PrefetchThread::_writeData(const char *buf, size_t len)
+{
+    _writeCache(buf, len);
+
+    /* No point downloading any further if the cache file cannot be written */
+    return _cacheEnabled ? len : 0;
+}
+
+/* The hash is of the extracted image, it is checked by the thread writing it */
+void PrefetchThread::_onDownloadSuccess()
+{
+    emit success();
+}
+
+void PrefetchThread::_onWriteError()
+{
+    if (!_cancelled)
+        _onDownloadError(tr("Error writing to download cache"));
+}
@@ -0,0 +1,39 @@
+#ifndef PREFETCHTHREAD_H
+#define PREFETCHTHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadthread.h"
+
+/*
+ * Downloads the selected image into the download cache while the user is
+ * still choosing the storage device and customization options
+ *
+ * Nothing is extracted or written to a device, the data only goes into the
+ * cache file. When writing starts the prefetch is stopped, and the thread
+ * writing the image is handed the cache file with prefetchedBytes() (see
+ * DownloadThread::setCacheFile()). It replays that part from disk and
+ * downloads the rest. Mirrors, peers, segmented downloads and resuming
+ * work like they do when writing.
+ */
+class PrefetchThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    explicit PrefetchThread(const QByteArray &url, const QByteArray &expectedHash, QObject *parent = nullptr);
+
+    /* Bytes at the start of the cache file that are on disk, once the thread finished */
+    quint64 prefetchedBytes() const;
+
+protected:
+    virtual void run();
+    virtual bool _openAndPrepareDevice();
+    virtual size_t _writeData(const char *buf, size_t len);
+    virtual void _onDownloadSuccess();
+    virtual void _onWriteError();
+};
+
+#endif // PREFETCHTHREAD_H
@@ -1,17 +1,37 @@
 #include "priviligedprocess.h"
+#include "metrics.h"
 #include <qlocalsocket.h>
 #include <QStandardPaths>
 #include <filesystem>
 #include <QDir>
 #include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QThread>
+#include <mutex>
 
-PriviligedProcess::PriviligedProcess(QObject* parent)
-    : _proc{parent}
+namespace
 {
-    QObject::connect(&_server, &QLocalServer::newConnection, [this]()
+    std::mutex sessionMutex;
+    PriviligedProcess* sessionProc{nullptr};
+    bool sessionBusy{false};
+
+    QByteArray fileHash(const QString& path)
     {
-        onNewConnection();
-    });
+        QFile f(path);
+        QCryptographicHash hash(QCryptographicHash::Sha256);
+        if(false == f.open(QIODevice::ReadOnly) || false == hash.addData(&f))
+        {
+            return QByteArray();
+        }
+        return hash.result().toHex();
+    }
+}
+
+PriviligedProcess::PriviligedProcess(QObject* parent)
+    : QObject{parent}, _proc{this}
+{
 }
 
 PriviligedProcess::~PriviligedProcess()
@@ -79,11 +99,18 @@ bool PriviligedProcess::startCommunicationChannel(QByteArray channelName)
     return true;
 }
 
-bool PriviligedProcess::waitForCommunicationChannelReady()
+bool PriviligedProcess::waitForCommunicationChannelReady(int msecs)
 {
+    // helper kept from an earlier job
+    if(isConnected() && false == _server.hasPendingConnections())
+    {
+        processFrames();
+        return true;
+    }
+
     if(false == _server.hasPendingConnections())
     {
-        if(false == _server.waitForNewConnection(10000))
+        if(false == _server.waitForNewConnection(msecs))
         {
             return false;
         }
@@ -91,15 +118,23 @@ bool PriviligedProcess::waitForCommunicationChannelReady()
 
     if(_peer != nullptr)
     {
+        _peer->disconnect(this);
         _peer->close();
         delete _peer;
     }
 
+    _readBuf.clear();
+    _sentFiles.clear();
+    _replies.clear();
     _peer = _server.nextPendingConnection();
+    QObject::connect(_peer, &QLocalSocket::readyRead, this, &PriviligedProcess::processFrames);
+    QObject::connect(_peer, &QLocalSocket::disconnected, this, &PriviligedProcess::disconnected);
+    // simpbootp may have reported files before the connection was taken
+    processFrames();
     return true;
 }
 
-bool PriviligedProcess::sendMessage(QByteArray msg, int msecs)
+bool PriviligedProcess::sendCommand(SimpbootpIpc::Message cmd, const QByteArray& payload, int msecs)
 {
     if(_peer == nullptr)
     {
@@ -107,51 +142,265 @@ bool PriviligedProcess::sendMessage(QByteArray msg, int msecs)
         return false;
     }
 
-    msg.append('\n');
-
-    if(msg.size() != _peer->write(msg) && _peer->waitForBytesWritten(msecs))
+    QByteArray msg = SimpbootpIpc::frame(cmd, payload);
+    if(msg.size() != _peer->write(msg) || (_peer->bytesToWrite() > 0 && false == _peer->waitForBytesWritten(msecs)))
     {
         qDebug() << "send failed: " << _peer->errorString();
         return false;
     }
 
-    QByteArray recvBuf = recvMessage();
+    return true;
+}
 
-    if(recvBuf.size() != 0 && recvBuf == "ok")
+bool PriviligedProcess::request(SimpbootpIpc::Message cmd, const QByteArray& payload, int msecs)
+{
+    _replies.remove(cmd);
+    if(false == sendCommand(cmd, payload, msecs))
     {
-        return true;
+        return false;
     }
 
-    return false;
+    QElapsedTimer timer;
+    timer.start();
+    while(false == _replies.contains(cmd))
+    {
+        int remaining = msecs - timer.elapsed();
+        if(remaining <= 0 || _peer->state() != QLocalSocket::ConnectedState || false == _peer->waitForReadyRead(remaining))
+        {
+            qDebug() << "no reply to command" << cmd;
+            return false;
+        }
+        processFrames();
+    }
+
+    return _replies.take(cmd);
 }
 
-QByteArray PriviligedProcess::getValue(QByteArray key, int msecs)
+bool PriviligedProcess::waitForFileSent(const QByteArray& name, int msecs)
 {
-    if(false == sendMessage(key)) return "";
-    return recvMessage(msecs);
+    if(_peer == nullptr)
+    {
+        return false;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    processFrames();
+    while(false == _sentFiles.contains(name))
+    {
+        int remaining = msecs - timer.elapsed();
+        if(remaining <= 0 || _peer->state() != QLocalSocket::ConnectedState || false == _peer->waitForReadyRead(remaining))
+        {
+            return false;
+        }
+        processFrames();
+    }
+
+    return true;
 }
 
-bool PriviligedProcess::checkValue(QByteArray key, QByteArray expected, int msecs)
+bool PriviligedProcess::startJob(const QString& directory, int msecs)
 {
-    return getValue(key,msecs) == expected;
+    processFrames();
+    _sentFiles.clear();
+    return request(SimpbootpIpc::StartJob, directory.toUtf8(), msecs);
 }
 
-QByteArray PriviligedProcess::recvMessage(int msec)
+bool PriviligedProcess::isConnected()
 {
-    if(_peer == nullptr)
+    return _peer != nullptr && _peer->state() == QLocalSocket::ConnectedState;
+}
+
+void PriviligedProcess::quit()
+{
+    if(false == sendCommand(SimpbootpIpc::Quit)) qDebug() << "send quit failed!";
+    if(false == waitForFinished(3000))
+    {
+        kill();
+        waitForFinished(1000);
+    }
+}
+
+PriviligedProcess* PriviligedProcess::acquireSession(const QStringList& args, const QByteArray& channelName)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex);
+
+    if(sessionProc != nullptr && false == sessionBusy)
+    {
+        // released helpers belong to no thread, so can be pulled to this one
+        sessionProc->moveToThread(QThread::currentThread());
+        if(sessionProc->_args == args && sessionProc->_channelName == channelName && sessionProc->isConnected())
+        {
+            qDebug() << "reusing simpbootp of the session";
+            sessionBusy = true;
+            return sessionProc;
+        }
+
+        qDebug() << "simpbootp of the session is gone or was started for another interface, starting a new one";
+        sessionProc->quit();
+        delete sessionProc;
+        sessionProc = nullptr;
+    }
+    else if(sessionProc != nullptr)
+    {
+        qDebug() << "simpbootp is in use by another job";
+        return nullptr;
+    }
+
+    static bool shutdownRegistered{false};
+    if(false == shutdownRegistered)
+    {
+        qAddPostRoutine(PriviligedProcess::shutdownSession);
+        shutdownRegistered = true;
+    }
+
+    PriviligedProcess* proc = new PriviligedProcess;
+    if(false == proc->startCommunicationChannel(channelName))
+    {
+        delete proc;
+        return nullptr;
+    }
+    QStringList procArgs = args;
+    proc->setArguments(procArgs);
+    proc->start();
+
+    sessionProc = proc;
+    sessionBusy = true;
+    return proc;
+}
+
+void PriviligedProcess::releaseSession(PriviligedProcess* proc)
+{
+    std::lock_guard<std::mutex> lock(sessionMutex);
+
+    if(proc != sessionProc)
     {
-        return QByteArray{0, Qt::Initialization::Uninitialized};
+        delete proc;
+        return;
     }
 
-    if(false == _peer->bytesAvailable() && false == _peer->waitForReadyRead(msec))
+    sessionBusy = false;
+    if(false == proc->isConnected())
     {
-        return QByteArray{0, Qt::Initialization::Uninitialized};
+        // never connected, or simpbootp quit. Not worth keeping
+        proc->quit();
+        delete proc;
+        sessionProc = nullptr;
+        return;
     }
 
-    return _peer->readLine().trimmed();
+    proc->moveToThread(nullptr);
 }
 
-void PriviligedProcess::onNewConnection()
+void PriviligedProcess::shutdownSession()
 {
+    std::lock_guard<std::mutex> lock(sessionMutex);
+
+    if(sessionProc == nullptr || sessionBusy)
+    {
+        return;
+    }
+
+    sessionProc->moveToThread(QThread::currentThread());
+    sessionProc->quit();
+    delete sessionProc;
+    sessionProc = nullptr;
+}
+
+QString PriviligedProcess::relocatedAppDir(const QString& appDir)
+{
+    QByteArray hash = fileHash(appDir + "/usr/bin/simpbootp");
+    if(hash.isEmpty())
+    {
+        qDebug() << "simpbootp not found in" << appDir;
+        return QString();
+    }
+
+    QDir tempDir(QStandardPaths::writableLocation(QStandardPaths::TempLocation));
+    QString name = "GemImagerRelocated-" + QString::fromLatin1(hash.left(16));
+    QString dir = tempDir.filePath(name);
+    if(fileHash(dir + "/usr/bin/simpbootp") == hash)
+    {
+        return dir;
+    }
 
+    // copied under another name first, so an interrupted copy is never taken for a complete one
+    QString partial = dir + ".partial";
+    QDir(partial).removeRecursively();
+    QDir(dir).removeRecursively();
+    if(QProcess::execute("cp", QStringList() << "-a" << appDir << partial) != 0 || false == tempDir.rename(partial, dir))
+    {
+        qDebug() << "copying" << appDir << "failed";
+        QDir(partial).removeRecursively();
+        return QString();
+    }
+
+    // copies of other versions
+    const QStringList stale = tempDir.entryList(QStringList() << "GemImagerRelocated*", QDir::Dirs | QDir::NoDotAndDotDot);
+    for(const QString& entry : stale)
+    {
+        if(entry != name)
+        {
+            QDir(tempDir.filePath(entry)).removeRecursively();
+        }
+    }
+
+    return dir;
+}
+
+void PriviligedProcess::processFrames()
+{
+    if(_peer == nullptr)
+    {
+        return;
+    }
+
+    _readBuf += _peer->readAll();
+
+    SimpbootpIpc::Message type;
+    QByteArray payload;
+    int res;
+    while((res = SimpbootpIpc::takeFrame(_readBuf, type, payload)) > 0)
+    {
+        switch(type)
+        {
+        case SimpbootpIpc::Reply:
+            if(payload.size() >= 2)
+            {
+                _replies.insert((quint8)payload[0], payload[1] != 0);
+            }
+            break;
+        case SimpbootpIpc::FileSent:
+            _sentFiles.insert(payload);
+            emit fileSent(payload);
+            break;
+        case SimpbootpIpc::TransferFailed:
+            emit transferFailed(payload);
+            break;
+        case SimpbootpIpc::Progress:
+            emit progressChanged(payload.mid(sizeof(quint64)), SimpbootpIpc::toNumber(payload) / 1000000.0f);
+            break;
+        case SimpbootpIpc::Retransmits:
+            Metrics::add(Metrics::TftpRetransmits, SimpbootpIpc::toNumber(payload));
+            break;
+        case SimpbootpIpc::FileReceived:
+        {
+            int end = payload.indexOf('\0');
+            if(end > 0)
+            {
+                emit fileReceived(payload.left(end), payload.mid(end + 1));
+            }
+            break;
+        }
+        default:
+            qDebug() << "unknown message from simpbootp:" << type;
+        }
+    }
+
+    if(res < 0)
+    {
+        qDebug() << "corrupt data from simpbootp, closing channel";
+        _readBuf.clear();
+        _peer->abort();
+    }
 }
@@ -1,11 +1,14 @@
 #ifndef PRIVILIGEDPROCESS_H
 #define PRIVILIGEDPROCESS_H
 
+#include "simpbootpipc.h"
 #include <qlocalserver.h>
 #include <qstringlist.h>
 #include <qprocess.h>
+#include <qhash.h>
+#include <qset.h>
 
-class PriviligedProcess: QObject
+class PriviligedProcess: public QObject
 {
     Q_OBJECT
 public:
@@ -19,21 +22,55 @@ public:
     QProcess::ExitStatus exitStatus();
     void kill();
     bool startCommunicationChannel(QByteArray channelName);
-    bool waitForCommunicationChannelReady();
-    bool sendMessage(QByteArray msg, int msecs = 1000);
-    QByteArray getValue(QByteArray key, int msecs = 1000);
-    bool checkValue(QByteArray key, QByteArray expected, int msecs = 1000);
-    QByteArray recvMessage(int msec = 1000);
+    bool waitForCommunicationChannelReady(int msecs = 10000);
+    // sends a command that is not answered
+    bool sendCommand(SimpbootpIpc::Message cmd, const QByteArray& payload = QByteArray(), int msecs = 1000);
+    // sends a command and waits for its reply. Events arriving meanwhile are emitted
+    bool request(SimpbootpIpc::Message cmd, const QByteArray& payload = QByteArray(), int msecs = 1000);
+    // true if simpbootp reported name as sent since the channel is up, or does so within msecs
+    bool waitForFileSent(const QByteArray& name, int msecs);
+    // tells a simpbootp kept from an earlier job to serve the next board from directory,
+    // and forgets the files sent to the last one
+    bool startJob(const QString& directory, int msecs = 30000);
+    bool isConnected();
 
-public slots:
-    void onNewConnection();
+    // simpbootp is started once, and kept for the next jobs of the session, so there is only
+    // one password prompt. Returns the helper started with the same args and channel before if it
+    // is still connected, or starts a new one. The helper is moved to the calling thread
+    static PriviligedProcess* acquireSession(const QStringList& args, const QByteArray& channelName);
+    // hands the helper back after a job, to keep it running. On the thread that acquired it
+    static void releaseSession(PriviligedProcess* proc);
+    // stops the helper of the session
+    static void shutdownSession();
+
+    // AppImages are only mounted for the user, so root cannot run simpbootp from there.
+    // The AppDir is copied out once, and the copy reused as long as its simpbootp has the
+    // same SHA256 as the one in the AppImage. Empty if copying failed
+    static QString relocatedAppDir(const QString& appDir);
+
+signals:
+    void fileSent(QByteArray name);
+    void transferFailed(QByteArray name);
+    // a file the board put, see UNIFLASH_HASH_SUFFIX
+    void fileReceived(QByteArray name, QByteArray contents);
+    void progressChanged(QByteArray name, float progress); //Values [0.0 1.0]
+    void disconnected();
+
+private slots:
+    void processFrames();
 
 private:
+    void quit();
+
     QStringList _args;
     QProcess _proc;
     QByteArray _channelName;
     QLocalServer _server{this};
     QLocalSocket* _peer{nullptr};
+    QByteArray _readBuf;
+    QSet<QByteArray> _sentFiles;
+    // replies not waited for yet, by command
+    QHash<quint8, bool> _replies;
 };
 
 #endif // PRIVILIGEDPROCESS_H
@@ -0,0 +1,127 @@
+#ifndef PROGRESSSNAPSHOT_H
+#define PROGRESSSNAPSHOT_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <atomic>
+#include <cstring>
+#include <type_traits>
+
+/*
+ * Progress of a write, as one consistent set of counters
+ *
+ * Published by the threads of the pipeline, read by the GUI and the CLI.
+ * Reading the counters one by one could mix values from before and after
+ * a phase change, reading a snapshot cannot.
+ */
+struct ProgressSnapshot
+{
+    /* DownloadThread::Phase started last, -1 before the first */
+    qint64 phase;
+    quint64 dlNow, dlTotal;
+    quint64 bytesWritten;
+    quint64 verifyNow, verifyTotal;
+    /* Average speed of the current phase */
+    quint64 bytesPerSecond;
+    /* Estimated time left in the current phase, -1 if unknown */
+    qint64 etaMsecs;
+    /* Number of times published */
+    quint64 generation;
+};
+
+/*
+ * Sequence lock for a small, trivially copyable struct
+ *
+ * Writers never block readers and readers never block writers. A reader
+ * retries if a write happened while it was copying. Writers exclude each
+ * other: tryStore() gives up if another write is in progress, store() waits.
+ * The data is kept in relaxed atomics so that concurrent copies are not data races.
+ */
+template<typename T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock needs a trivially copyable type");
+    static_assert(sizeof(T) % sizeof(quint64) == 0, "SeqLock needs a size that is a multiple of 8 bytes");
+
+public:
+    SeqLock() : _seq(0)
+    {
+        for (auto &word : _data)
+            word.store(0, std::memory_order_relaxed);
+    }
+
+    /* Odd sequence marks a write in progress */
+    bool beginWrite()
+    {
+        quint64 seq = _seq.load(std::memory_order_relaxed);
+        if ((seq & 1) || !_seq.compare_exchange_strong(seq, seq+1, std::memory_order_acquire))
+            return false;
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    void endWrite(const T &value)
+    {
+        quint64 words[Words];
+        std::memcpy(words, &value, sizeof(T));
+        for (size_t i = 0; i < Words; i++)
+            _data[i].store(words[i], std::memory_order_relaxed);
+        _seq.fetch_add(1, std::memory_order_release);
+    }
+
+    /* Value stored last, for the writer between beginWrite() and endWrite() */
+    T current() const
+    {
+        quint64 words[Words];
+        for (size_t i = 0; i < Words; i++)
+            words[i] = _data[i].load(std::memory_order_relaxed);
+
+        T value;
+        std::memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+    bool tryStore(const T &value)
+    {
+        if (!beginWrite())
+            return false;
+        endWrite(value);
+        return true;
+    }
+
+    void store(const T &value)
+    {
+        while (!beginWrite())
+            std::atomic_thread_fence(std::memory_order_acquire);
+        endWrite(value);
+    }
+
+    T load() const
+    {
+        quint64 words[Words];
+        quint64 before, after;
+        do
+        {
+            before = _seq.load(std::memory_order_acquire);
+            for (size_t i = 0; i < Words; i++)
+                words[i] = _data[i].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = _seq.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        T value;
+        std::memcpy(&value, words, sizeof(T));
+        return value;
+    }
+
+protected:
+    static constexpr size_t Words = sizeof(T) / sizeof(quint64);
+    std::atomic<quint64> _seq;
+    std::atomic<quint64> _data[Words];
+};
+
+#endif // PROGRESSSNAPSHOT_H
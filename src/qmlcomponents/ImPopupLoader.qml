@@ -0,0 +1,18 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+import QtQuick 2.9
+
+/* Popup that is only created when first used, so it does not slow down start up.
+   Covers the window, which popups centre themselves in */
+Loader {
+    anchors.fill: parent
+    active: false
+
+    function get() {
+        active = true
+        return item
+    }
+}
@@ -0,0 +1,153 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "queuetuning.h"
+#include "config.h"
+#include <QDebug>
+#include <QFile>
+#include <QRegularExpression>
+
+#ifdef Q_OS_LINUX
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#endif
+
+QueueTuning::QueueTuning()
+    : _enabled(false), _blockSize(0), _queueDepth(0)
+{
+}
+
+QueueTuning::~QueueTuning()
+{
+    restore();
+}
+
+void QueueTuning::setEnabled(bool enabled)
+{
+    _enabled = enabled;
+}
+
+bool QueueTuning::isEnabled() const
+{
+    return _enabled;
+}
+
+void QueueTuning::setProfile(quint64 blockSize, unsigned queueDepth)
+{
+    _blockSize = blockSize;
+    _queueDepth = queueDepth;
+}
+
+void QueueTuning::apply(const QByteArray &device)
+{
+    if (!_enabled || !_changed.isEmpty())
+        return;
+
+#ifdef Q_OS_LINUX
+    struct stat st;
+    if (::stat(device.constData(), &st) != 0 || !S_ISBLK(st.st_mode))
+        return;
+
+    /* Partitions have their queue in the directory of the disk */
+    _dir = QString("/sys/dev/block/%1:%2/").arg(major(st.st_rdev)).arg(minor(st.st_rdev));
+    if (QFile::exists(_dir+"partition"))
+        _dir += "../";
+    _dir += "queue/";
+    if (!QFile::exists(_dir))
+        return;
+
+    /* A single sequential writer gains nothing from reordering */
+    QByteArray scheduler = _read("scheduler");
+    QRegularExpressionMatch current = QRegularExpression("\\[(\\S+)\\]").match(QString::fromLatin1(scheduler));
+    if (current.hasMatch() && current.captured(1) != "none" && scheduler.split(' ').contains("none"))
+    {
+        QByteArray old = current.captured(1).toLatin1();
+        if (_write("scheduler", "none"))
+        {
+            qDebug() << "Block queue scheduler:" << old << "-> none";
+            _changed.append(qMakePair(QString("scheduler"), old));
+        }
+    }
+
+    /* Requests as large as the blocks written, so they are not split up */
+    quint64 blockSize = _blockSize;
+    if (!blockSize)
+        blockSize = qMax((quint64) IMAGEWRITER_BLOCKSIZE, _read("optimal_io_size").toULongLong());
+    quint64 maxHwKb = _read("max_hw_sectors_kb").toULongLong();
+    if (maxHwKb)
+        _raise("max_sectors_kb", qMin(maxHwKb, blockSize/1024));
+
+    /* Enough requests for the blocks in flight, or with buffered writes for a writeback window */
+    quint64 requestSize = _read("max_sectors_kb").toULongLong() * 1024;
+    if (requestSize)
+    {
+        quint64 inFlight = _queueDepth ? _queueDepth*blockSize : IMAGEWRITER_WRITEBACK_WINDOW;
+        _raise("nr_requests", (inFlight + requestSize - 1) / requestSize);
+    }
+
+    _raise("read_ahead_kb", IMAGEWRITER_QUEUE_READ_AHEAD_KB);
+
+    /* Throttling writeback keeps the system disk responsive to readers. Nobody else
+       reads the device being written */
+    QByteArray wbt = _read("wbt_lat_usec");
+    if (!wbt.isEmpty() && wbt != "0")
+        _change("wbt_lat_usec", "0");
+#else
+    Q_UNUSED(device)
+#endif
+}
+
+void QueueTuning::restore()
+{
+    /* In reverse, as switching the scheduler resets nr_requests */
+    while (!_changed.isEmpty())
+    {
+        QPair<QString, QByteArray> setting = _changed.takeLast();
+        if (_write(setting.first, setting.second))
+            qDebug() << "Block queue" << setting.first << "restored to" << setting.second;
+        else
+            qDebug() << "Error restoring block queue" << setting.first << "to" << setting.second;
+    }
+}
+
+QByteArray QueueTuning::_read(const QString &name) const
+{
+    QFile f(_dir+name);
+    if (!f.open(QIODevice::ReadOnly))
+        return QByteArray();
+
+    return f.readAll().trimmed();
+}
+
+bool QueueTuning::_write(const QString &name, const QByteArray &value)
+{
+    QFile f(_dir+name);
+
+    return f.open(QIODevice::WriteOnly) && f.write(value) == value.size() && f.flush();
+}
+
+void QueueTuning::_change(const QString &name, const QByteArray &value)
+{
+    QByteArray old = _read(name);
+    if (old.isEmpty() || old == value)
+        return;
+
+    if (_write(name, value))
+    {
+        qDebug() << "Block queue" << name << ":" << old << "->" << value;
+        _changed.append(qMakePair(name, old));
+    }
+    else
+    {
+        qDebug() << "Cannot set block queue" << name << "to" << value << "- leaving it at" << old;
+    }
+}
+
+void QueueTuning::_raise(const QString &name, quint64 value)
+{
+    QByteArray old = _read(name);
+    if (!old.isEmpty() && old.toULongLong() < value)
+        _change(name, QByteArray::number(value));
+}
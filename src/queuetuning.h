@@ -0,0 +1,61 @@
+#ifndef QUEUETUNING_H
+#define QUEUETUNING_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QString>
+
+/*
+ * Block queue settings of the device being written, for the duration of a job (Linux)
+ *
+ * Distributions tune the queues for the system disk, which suits USB card
+ * readers poorly: an I/O scheduler reordering a single sequential stream,
+ * small requests, a short request queue and writeback throttling of the
+ * page cache. apply() switches the queue in /sys/block/<disk>/queue to no
+ * scheduler, requests as large as the blocks written (up to what the
+ * hardware takes), enough requests to keep those in flight, a larger
+ * read-ahead for verifying and no writeback throttling. Settings are only
+ * ever raised, and every change is logged. restore() puts back what was
+ * changed, and is also called on destruction.
+ *
+ * Setting the queue needs root. If a value cannot be written it is left
+ * alone. Does nothing on other platforms.
+ */
+class QueueTuning
+{
+public:
+    QueueTuning();
+    ~QueueTuning();
+
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+    /* Block size and number of blocks in flight the device is written with, e.g. from a
+       benchmark. 0 to go by what the device reports */
+    void setProfile(quint64 blockSize, unsigned queueDepth);
+
+    /* Tune the queue of the disk that device (e.g. /dev/sdb) is on, if enabled */
+    void apply(const QByteArray &device);
+    void restore();
+
+protected:
+    bool _enabled;
+    quint64 _blockSize;
+    unsigned _queueDepth;
+    /* queue directory in sysfs, and the files changed with their old value, in order */
+    QString _dir;
+    QList<QPair<QString, QByteArray>> _changed;
+
+    QByteArray _read(const QString &name) const;
+    bool _write(const QString &name, const QByteArray &value);
+    /* Write value, remembering the old one to restore */
+    void _change(const QString &name, const QByteArray &value);
+    void _raise(const QString &name, quint64 value);
+};
+
+#endif // QUEUETUNING_H
@@ -0,0 +1,211 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "ringbuffer.h"
+#include "pipelinememory.h"
+#include "pipelinetrace.h"
+#include <QElapsedTimer>
+#include <string.h>
+
+RingBuffer::RingBuffer(size_t capacity, size_t slabSize)
+    : _slabs(nullptr), _numSlabs(0), _slabSize(slabSize), _head(0), _tail(0), _depth(0), _eof(false), _cancelled(false), _fill(0), _holdingSlab(false),
+      _parked(0), _producerStalls(0), _producerStallTime(0), _consumerStalls(0), _consumerStallTime(0)
+{
+    setCapacity(capacity);
+}
+
+RingBuffer::~RingBuffer()
+{
+    for (size_t i = 0; i < _numSlabs; i++)
+        PipelineMemory::free(_slabs[i].data, _slabSize);
+    delete[] _slabs;
+}
+
+void RingBuffer::setCapacity(size_t capacity)
+{
+    size_t numSlabs = qMax<size_t>(2, capacity / _slabSize);
+    if (numSlabs == _numSlabs)
+        return;
+
+    for (size_t i = 0; i < _numSlabs; i++)
+        PipelineMemory::free(_slabs[i].data, _slabSize);
+    delete[] _slabs;
+
+    _numSlabs = numSlabs;
+    _slabs = new Slab[_numSlabs];
+    for (size_t i = 0; i < _numSlabs; i++)
+    {
+        _slabs[i].data = (char *) PipelineMemory::allocate(_slabSize);
+        _slabs[i].len = 0;
+    }
+    reset();
+}
+
+template<typename Pred> void RingBuffer::_park(Pred pred)
+{
+    std::unique_lock<std::mutex> lock(_parkMutex);
+    _parked++;
+    _parkCv.wait(lock, pred);
+    _parked--;
+}
+
+void RingBuffer::_wakeup()
+{
+    /* _parked is incremented before the waiting side re-checks its condition
+       under the lock, so if we see zero here it will see our update */
+    if (_parked.load())
+    {
+        std::lock_guard<std::mutex> lock(_parkMutex);
+        _parkCv.notify_all();
+    }
+}
+
+void RingBuffer::_publish()
+{
+    _slabs[_head.load(std::memory_order_relaxed) % _numSlabs].len = _fill;
+    _depth += _fill;
+    _fill = 0;
+    _head++;
+    _wakeup();
+}
+
+bool RingBuffer::write(const char *data, size_t len)
+{
+    while (len)
+    {
+        size_t head = _head.load(std::memory_order_relaxed);
+
+        if (head - _tail.load() == _numSlabs)
+        {
+            TraceSpan span("queuePushWait");
+            QElapsedTimer t;
+            t.start();
+            _park([this, head]{
+                return head - _tail.load() != _numSlabs || _cancelled.load();
+            });
+            _producerStalls++;
+            _producerStallTime += t.elapsed();
+        }
+        if (_cancelled)
+            return false;
+
+        size_t n = qMin(len, _slabSize - _fill);
+        memcpy(_slabs[head % _numSlabs].data + _fill, data, n);
+        _fill += n;
+        data += n;
+        len -= n;
+
+        if (_fill == _slabSize)
+            _publish();
+    }
+
+    return !_cancelled;
+}
+
+bool RingBuffer::flush()
+{
+    if (_cancelled)
+        return false;
+    if (_fill)
+        _publish();
+
+    return true;
+}
+
+void RingBuffer::close()
+{
+    flush();
+    _eof = true;
+    _wakeup();
+}
+
+ssize_t RingBuffer::read(const void **data)
+{
+    if (_holdingSlab)
+    {
+        _depth -= _slabs[_tail.load(std::memory_order_relaxed) % _numSlabs].len;
+        _holdingSlab = false;
+        _tail++;
+        _wakeup();
+    }
+
+    size_t tail = _tail.load(std::memory_order_relaxed);
+
+    if (_head.load() == tail && !_eof && !_cancelled)
+    {
+        TraceSpan span("queuePopWait");
+        QElapsedTimer t;
+        t.start();
+        _park([this, tail]{
+            return _head.load() != tail || _eof.load() || _cancelled.load();
+        });
+        _consumerStalls++;
+        _consumerStallTime += t.elapsed();
+    }
+
+    if (_cancelled)
+        return -1;
+    if (_head.load() == tail)
+        return 0; /* End-of-stream */
+
+    const Slab &s = _slabs[tail % _numSlabs];
+    *data = s.data;
+    _holdingSlab = true;
+
+    return s.len;
+}
+
+void RingBuffer::cancel()
+{
+    _cancelled = true;
+    std::lock_guard<std::mutex> lock(_parkMutex);
+    _parkCv.notify_all();
+}
+
+void RingBuffer::reset()
+{
+    _head = 0;
+    _tail = 0;
+    _depth = 0;
+    _fill = 0;
+    _holdingSlab = false;
+    _eof = false;
+    _cancelled = false;
+}
+
+size_t RingBuffer::capacity() const
+{
+    return _numSlabs * _slabSize;
+}
+
+size_t RingBuffer::slabSize() const
+{
+    return _slabSize;
+}
+
+size_t RingBuffer::depth() const
+{
+    return _depth;
+}
+
+quint64 RingBuffer::producerStalls() const
+{
+    return _producerStalls;
+}
+
+quint64 RingBuffer::producerStallTime() const
+{
+    return _producerStallTime;
+}
+
+quint64 RingBuffer::consumerStalls() const
+{
+    return _consumerStalls;
+}
+
+quint64 RingBuffer::consumerStallTime() const
+{
+    return _consumerStallTime;
+}
@@ -0,0 +1,92 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <sys/types.h>
+
+/*
+ * Single-producer/single-consumer ring of preallocated, 4k aligned slabs
+ *
+ * The producer (curl callback) copies incoming data straight into the slab
+ * it owns and publishes it once full. The consumer (libarchive read callback)
+ * gets a pointer into the slab itself, which stays valid until the next read().
+ * Head and tail are atomics, so the fast path takes no locks. A mutex and
+ * condition variable are only used to park a side that has to wait because
+ * the ring is full or empty.
+ */
+class RingBuffer
+{
+public:
+    RingBuffer(size_t capacity, size_t slabSize);
+    ~RingBuffer();
+
+    /* Producer side. write() blocks while the ring is full.
+     * Returns false if the ring was cancelled */
+    bool write(const char *data, size_t len);
+    /* Publish partially filled slab (if any) */
+    bool flush();
+    /* Publish remaining data and signal end-of-stream */
+    void close();
+
+    /* Consumer side. Releases the slab returned by the previous call and
+     * blocks until the next one is available.
+     * Returns number of bytes, 0 on end-of-stream or -1 if cancelled */
+    ssize_t read(const void **data);
+
+    /* Wake up both sides. Pending and future calls fail */
+    void cancel();
+    /* Prepare for reuse after cancel() or close() */
+    void reset();
+    /* Reallocate the slabs for a new capacity. Only while neither side is using the ring */
+    void setCapacity(size_t capacity);
+
+    size_t capacity() const;
+    size_t slabSize() const;
+    /* Number of bytes published but not consumed yet */
+    size_t depth() const;
+    /* Number of times and total time (in ms) producer waited on a full ring
+     * (writer/decompressor is the bottleneck) */
+    quint64 producerStalls() const;
+    quint64 producerStallTime() const;
+    /* Number of times and total time (in ms) consumer waited on an empty ring
+     * (network is the bottleneck) */
+    quint64 consumerStalls() const;
+    quint64 consumerStallTime() const;
+
+protected:
+    struct Slab {
+        char *data;
+        size_t len;
+    };
+
+    Slab *_slabs;
+    size_t _numSlabs, _slabSize;
+    /* _head: slabs published by producer, _tail: slabs released by consumer */
+    std::atomic<size_t> _head, _tail;
+    std::atomic<size_t> _depth;
+    std::atomic<bool> _eof, _cancelled;
+    /* Only touched by the producer */
+    size_t _fill;
+    /* Only touched by the consumer */
+    bool _holdingSlab;
+
+    std::mutex _parkMutex;
+    std::condition_variable _parkCv;
+    std::atomic<int> _parked;
+
+    std::atomic<quint64> _producerStalls, _producerStallTime, _consumerStalls, _consumerStallTime;
+
+    void _publish();
+    void _wakeup();
+    template<typename Pred> void _park(Pred pred);
+};
+
+#endif // RINGBUFFER_H
@@ -0,0 +1,400 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "sha256native.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SHA256NATIVE_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define TARGET_NATIVE
+#else
+#include <cpuid.h>
+#define TARGET_NATIVE __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define SHA256NATIVE_ARM
+#include <arm_neon.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO) || (defined(_MSC_VER) && !defined(__clang__))
+#define TARGET_NATIVE
+#elif defined(__clang__)
+#define TARGET_NATIVE __attribute__((target("sha2")))
+#else
+#define TARGET_NATIVE __attribute__((target("+crypto")))
+#endif
+#endif
+
+#if defined(__GNUC__)
+#define UNROLL_ROUNDS _Pragma("GCC unroll 16")
+#else
+#define UNROLL_ROUNDS
+#endif
+
+alignas(16) static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t initialState[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/*
+ * Compress 'blocks' consecutive 64 byte blocks for each of N independent streams.
+ * All lanes are advanced in the same loop, so the rounds of one stream
+ * execute while the other one waits for the result of its previous round.
+ */
+#if defined(SHA256NATIVE_X86)
+
+template<int N> TARGET_NATIVE static void compress(uint32_t *const *state, const uint8_t *const *data, size_t blocks)
+{
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0[N], state1[N];
+    const uint8_t *ptr[N];
+
+    for (int l = 0; l < N; l++)
+    {
+        /* Hardware wants the state as ABEF and CDGH */
+        __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[l][0]), 0xB1);
+        state1[l] = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[l][4]), 0x1B);
+        state0[l] = _mm_alignr_epi8(tmp, state1[l], 8);
+        state1[l] = _mm_blend_epi16(state1[l], tmp, 0xF0);
+        ptr[l] = data[l];
+    }
+
+    while (blocks--)
+    {
+        __m128i abefSave[N], cdghSave[N], msg[N][4];
+
+        for (int l = 0; l < N; l++)
+        {
+            abefSave[l] = state0[l];
+            cdghSave[l] = state1[l];
+            for (int j = 0; j < 4; j++)
+                msg[l][j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (ptr[l] + 16*j)), mask);
+        }
+
+        UNROLL_ROUNDS
+        for (int i = 0; i < 16; i++)
+        {
+            const __m128i k = _mm_load_si128((const __m128i *) &K[4*i]);
+
+            for (int l = 0; l < N; l++)
+            {
+                __m128i *w = msg[l];
+                if (i >= 4)
+                {
+                    w[i&3] = _mm_sha256msg2_epu32(
+                                _mm_add_epi32(_mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]), _mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4)),
+                                w[(i+3)&3]);
+                }
+                __m128i wk = _mm_add_epi32(w[i&3], k);
+                state1[l] = _mm_sha256rnds2_epu32(state1[l], state0[l], wk);
+                state0[l] = _mm_sha256rnds2_epu32(state0[l], state1[l], _mm_shuffle_epi32(wk, 0x0E));
+            }
+        }
+
+        for (int l = 0; l < N; l++)
+        {
+            state0[l] = _mm_add_epi32(state0[l], abefSave[l]);
+            state1[l] = _mm_add_epi32(state1[l], cdghSave[l]);
+            ptr[l] += 64;
+        }
+    }
+
+    for (int l = 0; l < N; l++)
+    {
+        __m128i tmp = _mm_shuffle_epi32(state0[l], 0x1B);
+        state1[l] = _mm_shuffle_epi32(state1[l], 0xB1);
+        _mm_storeu_si128((__m128i *) &state[l][0], _mm_blend_epi16(tmp, state1[l], 0xF0));
+        _mm_storeu_si128((__m128i *) &state[l][4], _mm_alignr_epi8(state1[l], tmp, 8));
+    }
+}
+
+static bool detectSupport()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+        return false;
+    __cpuid(regs, 1);
+    bool sse = (regs[2] & (1 << 9)) && (regs[2] & (1 << 19));
+    __cpuidex(regs, 7, 0);
+    return sse && (regs[1] & (1 << 29));
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return false;
+    bool sse = (ecx & bit_SSSE3) && (ecx & bit_SSE4_1);
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return false;
+    return sse && (ebx & bit_SHA);
+#endif
+}
+
+static const char *implementationName = "SHA-NI";
+
+#elif defined(SHA256NATIVE_ARM)
+
+template<int N> TARGET_NATIVE static void compress(uint32_t *const *state, const uint8_t *const *data, size_t blocks)
+{
+    uint32x4_t abcd[N], efgh[N];
+    const uint8_t *ptr[N];
+
+    for (int l = 0; l < N; l++)
+    {
+        abcd[l] = vld1q_u32(&state[l][0]);
+        efgh[l] = vld1q_u32(&state[l][4]);
+        ptr[l] = data[l];
+    }
+
+    while (blocks--)
+    {
+        uint32x4_t abcdSave[N], efghSave[N], msg[N][4];
+
+        for (int l = 0; l < N; l++)
+        {
+            abcdSave[l] = abcd[l];
+            efghSave[l] = efgh[l];
+            for (int j = 0; j < 4; j++)
+                msg[l][j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(ptr[l] + 16*j)));
+        }
+
+        UNROLL_ROUNDS
+        for (int i = 0; i < 16; i++)
+        {
+            const uint32x4_t k = vld1q_u32(&K[4*i]);
+
+            for (int l = 0; l < N; l++)
+            {
+                uint32x4_t *w = msg[l];
+                if (i >= 4)
+                    w[i&3] = vsha256su1q_u32(vsha256su0q_u32(w[i&3], w[(i+1)&3]), w[(i+2)&3], w[(i+3)&3]);
+
+                uint32x4_t wk = vaddq_u32(w[i&3], k);
+                uint32x4_t prev = abcd[l];
+                abcd[l] = vsha256hq_u32(abcd[l], efgh[l], wk);
+                efgh[l] = vsha256h2q_u32(efgh[l], prev, wk);
+            }
+        }
+
+        for (int l = 0; l < N; l++)
+        {
+            abcd[l] = vaddq_u32(abcd[l], abcdSave[l]);
+            efgh[l] = vaddq_u32(efgh[l], efghSave[l]);
+            ptr[l] += 64;
+        }
+    }
+
+    for (int l = 0; l < N; l++)
+    {
+        vst1q_u32(&state[l][0], abcd[l]);
+        vst1q_u32(&state[l][4], efgh[l]);
+    }
+}
+
+static bool detectSupport()
+{
+#if defined(__APPLE__)
+    /* Every Apple arm64 CPU has the crypto extensions */
+    return true;
+#elif defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(_WIN32)
+    return IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE);
+#else
+    return false;
+#endif
+}
+
+static const char *implementationName = "ARMv8 CE";
+
+#else
+
+/* No native implementation for this architecture. isSupported() returns false,
+   so compress() is never called */
+template<int N> static void compress(uint32_t *const *, const uint8_t *const *, size_t)
+{
+}
+
+static bool detectSupport()
+{
+    return false;
+}
+
+static const char *implementationName = nullptr;
+
+#endif
+
+static inline void compressBlocks(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    compress<1>(&state, &data, blocks);
+}
+
+Sha256Native::Sha256Native()
+    : _fill(0), _total(0), _finished(false)
+{
+    memcpy(_state, initialState, sizeof(_state));
+}
+
+bool Sha256Native::isSupported()
+{
+    static const bool supported = detectSupport();
+    return supported;
+}
+
+const char *Sha256Native::implementation()
+{
+    return isSupported() ? implementationName : nullptr;
+}
+
+size_t Sha256Native::_fillBuffer(const char *data, size_t len)
+{
+    if (!_fill)
+        return 0;
+
+    size_t n = qMin(len, sizeof(_buf)-_fill);
+    memcpy(_buf + _fill, data, n);
+    _fill += n;
+    _total += n;
+
+    if (_fill == sizeof(_buf))
+    {
+        compressBlocks(_state, _buf, 1);
+        _fill = 0;
+    }
+
+    return n;
+}
+
+void Sha256Native::_addTail(const char *data, size_t len)
+{
+    /* Only called with less than a block left and an empty _buf */
+    memcpy(_buf, data, len);
+    _fill = len;
+    _total += len;
+}
+
+void Sha256Native::addData(const char *data, size_t len)
+{
+    if (_finished)
+        return;
+
+    size_t n = _fillBuffer(data, len);
+    data += n;
+    len -= n;
+
+    size_t blocks = len / 64;
+    if (blocks)
+    {
+        compressBlocks(_state, (const uint8_t *) data, blocks);
+        data += blocks * 64;
+        len -= blocks * 64;
+        _total += blocks * 64;
+    }
+
+    if (len)
+        _addTail(data, len);
+}
+
+void Sha256Native::addData(Sha256Native *const *hashes, const char *const *data, const size_t *lengths, size_t count)
+{
+    const size_t maxStreams = 8;
+
+    /* Process in groups, so we can keep the per stream bookkeeping on the stack */
+    while (count > maxStreams)
+    {
+        addData(hashes, data, lengths, maxStreams);
+        hashes += maxStreams;
+        data += maxStreams;
+        lengths += maxStreams;
+        count -= maxStreams;
+    }
+
+    const char *ptr[maxStreams];
+    size_t len[maxStreams];
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ptr[i] = data[i];
+        len[i] = hashes[i]->_finished ? 0 : lengths[i];
+        size_t n = hashes[i]->_fillBuffer(ptr[i], len[i]);
+        ptr[i] += n;
+        len[i] -= n;
+    }
+
+    /* Full blocks that two streams have in common are done interleaved */
+    for (size_t i = 0; i+1 < count; i += 2)
+    {
+        size_t blocks = qMin(len[i], len[i+1]) / 64;
+        if (!blocks)
+            continue;
+
+        uint32_t *states[2] = { hashes[i]->_state, hashes[i+1]->_state };
+        const uint8_t *blockData[2] = { (const uint8_t *) ptr[i], (const uint8_t *) ptr[i+1] };
+        compress<2>(states, blockData, blocks);
+
+        for (size_t j = i; j < i+2; j++)
+        {
+            ptr[j] += blocks * 64;
+            len[j] -= blocks * 64;
+            hashes[j]->_total += blocks * 64;
+        }
+    }
+
+    /* Whatever is left */
+    for (size_t i = 0; i < count; i++)
+    {
+        if (len[i])
+            hashes[i]->addData(ptr[i], len[i]);
+    }
+}
+
+QByteArray Sha256Native::result()
+{
+    if (_finished)
+        return _result;
+
+    uint64_t bits = _total * 8;
+    _buf[_fill++] = 0x80;
+    if (_fill > 56)
+    {
+        memset(_buf + _fill, 0, sizeof(_buf)-_fill);
+        compressBlocks(_state, _buf, 1);
+        _fill = 0;
+    }
+    memset(_buf + _fill, 0, 56-_fill);
+    for (int i = 0; i < 8; i++)
+        _buf[56+i] = (uint8_t) (bits >> (56-8*i));
+    compressBlocks(_state, _buf, 1);
+
+    _result.resize(32);
+    for (int i = 0; i < 8; i++)
+    {
+        _result[4*i]   = (char) (_state[i] >> 24);
+        _result[4*i+1] = (char) (_state[i] >> 16);
+        _result[4*i+2] = (char) (_state[i] >> 8);
+        _result[4*i+3] = (char) _state[i];
+    }
+    _finished = true;
+
+    return _result;
+}
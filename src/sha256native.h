@@ -0,0 +1,51 @@
+#ifndef SHA256NATIVE_H
+#define SHA256NATIVE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * SHA256 using the CPU's own instructions: SHA-NI on x86 and
+ * the ARMv8 cryptography extensions on arm64
+ *
+ * Support is detected at runtime. Only use this class if isSupported()
+ * returns true, AcceleratedCryptographicHash falls back to the platform
+ * library otherwise.
+ */
+class Sha256Native
+{
+public:
+    Sha256Native();
+
+    static bool isSupported();
+    /* Name of the instruction set used, or nullptr if not supported */
+    static const char *implementation();
+
+    void addData(const char *data, size_t len);
+    QByteArray result();
+
+    /* Add data to several independent hashes in one call.
+     * Blocks of two streams are processed interleaved, which keeps the
+     * SHA units busy while each stream waits on its previous round */
+    static void addData(Sha256Native *const *hashes, const char *const *data, const size_t *lengths, size_t count);
+
+protected:
+    uint32_t _state[8];
+    uint8_t _buf[64];
+    size_t _fill;
+    uint64_t _total;
+    bool _finished;
+    QByteArray _result;
+
+    /* Top up partially filled _buf. Returns number of bytes consumed */
+    size_t _fillBuffer(const char *data, size_t len);
+    void _addTail(const char *data, size_t len);
+};
+
+#endif // SHA256NATIVE_H
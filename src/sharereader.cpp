@@ -0,0 +1,152 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "sharereader.h"
+#include "config.h"
+#include "pipelinememory.h"
+#include <QDebug>
+#include <QFile>
+#include <QFileInfo>
+#include <QStorageInfo>
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+ShareReader::ShareReader(size_t chunkSize, size_t bufferBytes)
+    : _chunkSize(chunkSize), _fileSize(0), _nextRead(0), _nextReturned(0), _cancelled(false)
+{
+    /* One buffer is held by the caller, at least one more is read into meanwhile */
+    int count = qMax((size_t) 2, bufferBytes / chunkSize);
+    _buffers.resize(count);
+    for (Buffer &b : _buffers)
+    {
+        b.data = (char *) PipelineMemory::allocate(_chunkSize);
+        b.chunk = -1;
+        b.len = 0;
+        b.ready = false;
+    }
+}
+
+ShareReader::~ShareReader()
+{
+    _stop();
+    for (Buffer &b : _buffers)
+        PipelineMemory::free(b.data, _chunkSize);
+}
+
+bool ShareReader::open(const QString &filename)
+{
+    _stop();
+    QFile f(filename);
+    if (!f.open(QIODevice::ReadOnly))
+        return false;
+
+    _filename = filename;
+    _fileSize = f.size();
+    _nextRead = _nextReturned = 0;
+    _cancelled = false;
+    for (Buffer &b : _buffers)
+        b.ready = false;
+
+    int threads = qMin(IMAGEWRITER_SHARE_READS_IN_FLIGHT, (int) _buffers.size()-1);
+    qDebug() << "Reading image from network share with" << threads << "reads of" << _chunkSize/1024 << "KB in flight";
+    for (int i = 0; i < threads; i++)
+        _threads.emplace_back(&ShareReader::_readerThread, this);
+
+    return true;
+}
+
+void ShareReader::_readerThread()
+{
+    QFile f(_filename);
+    bool opened = f.open(QIODevice::ReadOnly | QIODevice::Unbuffered);
+    const qint64 count = _buffers.size();
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true)
+    {
+        /* The buffer of the next chunk is free once the caller gave back the chunk before in it */
+        _cv.wait(lock, [this, count] {
+            return _cancelled || _nextRead * (qint64) _chunkSize >= _fileSize || _nextRead < _nextReturned + count - 1;
+        });
+        if (_cancelled || _nextRead * (qint64) _chunkSize >= _fileSize)
+            return;
+
+        qint64 chunk = _nextRead++;
+        Buffer &b = _buffers[chunk % count];
+        b.ready = false;
+        lock.unlock();
+
+        qint64 offset = chunk * _chunkSize;
+        qint64 len = qMin((qint64) _chunkSize, _fileSize - offset);
+        ssize_t got = -1;
+        if (opened && f.seek(offset) && f.read(b.data, len) == len)
+            got = len;
+
+        lock.lock();
+        b.chunk = chunk;
+        b.len = got;
+        b.ready = true;
+        _cv.notify_all();
+    }
+}
+
+ssize_t ShareReader::read(const void **data)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    qint64 chunk = _nextReturned;
+    if (_cancelled)
+        return -1;
+    if (chunk * (qint64) _chunkSize >= _fileSize)
+        return 0;
+
+    /* Gives back the chunk returned by the previous call */
+    _nextReturned++;
+    _cv.notify_all();
+
+    Buffer &b = _buffers[chunk % _buffers.size()];
+    _cv.wait(lock, [this, &b, chunk] {
+        return _cancelled || (b.ready && b.chunk == chunk);
+    });
+    if (_cancelled || b.len < 0)
+        return -1;
+
+    *data = b.data;
+    return b.len;
+}
+
+void ShareReader::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _cancelled = true;
+    }
+    _cv.notify_all();
+}
+
+void ShareReader::_stop()
+{
+    cancel();
+    for (std::thread &t : _threads)
+        t.join();
+    _threads.clear();
+}
+
+bool ShareReader::isOnNetworkShare(const QString &filename)
+{
+#ifdef Q_OS_WIN
+    /* UNC path, or a drive letter mapped to a share */
+    if (filename.startsWith("//") || filename.startsWith("\\\\"))
+        return true;
+    QString root = QFileInfo(filename).absoluteFilePath().left(3);
+    return GetDriveTypeW((LPCWSTR) root.utf16()) == DRIVE_REMOTE;
+#else
+    static const QList<QByteArray> networkTypes = {
+        "nfs", "nfs4", "cifs", "smb3", "smbfs", "afpfs", "webdav", "9p", "ceph", "fuse.sshfs"
+    };
+    QStorageInfo storage(QFileInfo(filename).absolutePath());
+    return storage.isValid() && networkTypes.contains(storage.fileSystemType().toLower());
+#endif
+}
@@ -0,0 +1,69 @@
+#ifndef SHAREREADER_H
+#define SHAREREADER_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QString>
+#include <QVector>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/types.h>
+
+/*
+ * Sequential reader of an image file on a network share (SMB, NFS)
+ *
+ * Reading a share one block at a time, or through a memory mapping with
+ * the kernel's read-ahead, waits a round trip for every block, so a share
+ * with some latency is read far below its throughput. Instead, a few
+ * threads keep several large positioned reads in flight, each into a
+ * buffer of its own, and read() hands out the buffers in file order.
+ */
+class ShareReader
+{
+public:
+    /* bufferBytes is the memory of all buffers together */
+    ShareReader(size_t chunkSize, size_t bufferBytes);
+    ~ShareReader();
+
+    /* Returns false if the file cannot be opened */
+    bool open(const QString &filename);
+    /* Next chunk of the file, valid until the next call.
+       Returns number of bytes, 0 at the end of the file or -1 on error or if cancelled */
+    ssize_t read(const void **data);
+    void cancel();
+
+    /* If the file is on a network file system */
+    static bool isOnNetworkShare(const QString &filename);
+
+protected:
+    struct Buffer
+    {
+        char *data;
+        /* Chunk in the buffer once ready, and its length, -1 if the read failed */
+        qint64 chunk;
+        ssize_t len;
+        bool ready;
+    };
+
+    QString _filename;
+    size_t _chunkSize;
+    qint64 _fileSize;
+    QVector<Buffer> _buffers;
+    std::vector<std::thread> _threads;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    /* Next chunk to read, and next chunk read() returns. Chunks before that are given back */
+    qint64 _nextRead, _nextReturned;
+    std::atomic<bool> _cancelled;
+
+    void _readerThread();
+    void _stop();
+};
+
+#endif // SHAREREADER_H
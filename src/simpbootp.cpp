@@ -1,9 +1,11 @@
-#include <QtConcurrent/qtconcurrentrun.h>
 #include <qlocalserver.h>
 #include <qlocalsocket.h>
 #include <qthread.h>
 #include <tftpserver.h>
+#include <httpserver.h>
+#include <simpbootpipc.h>
 #include <simpdhcp.h>
+#include "logging.h"
 #include <cstring>
 #include <qcoreapplication.h>
 #include <qnetworkdatagram.h>
@@ -11,7 +13,17 @@
 #include <qprocess.h>
 #include <qcommandlineparser.h>
 #include <qtimer.h>
+#include <qelapsedtimer.h>
 #include <qudpsocket.h>
+#include <qhostaddress.h>
+#include <qmap.h>
+
+#if defined(Q_OS_UNIX)
+#include <poll.h>
+#endif
+#if defined(Q_OS_LINUX)
+#include "linux/linkcontrol.h"
+#endif
 
 #if defined(Q_OS_UNIX)
 #define DEFAULT_IFACE "eno1"
@@ -25,8 +37,34 @@
 #define DEFAULT_SERVER_IP "10.42.0.11"
 #define DEFAULT_CLI_IP "10.42.0.12"
 #define DEFAULT_BOOTFILE "tiboot3.bin"
+// boot stages the ROM and the SBL fetch over TFTP, besides the boot file
+#define PRELOAD_FILES "*.tiimage"
 #define DEFAULT_SERVER_NAME ""
 #define TFTP_DEFAULT_PORT (69)
+#define DEFAULT_POOL_SIZE (8)
+#define IPC_POLL_INTERVAL (10)
+#define PROGRESS_PUSH_INTERVAL (100)
+#define LINK_UP_TIMEOUT (8000)
+// IPv4 minimum, and the most jumbo frames go up to
+#define MIN_MTU (576)
+#define MAX_MTU (9216)
+
+#if defined(Q_OS_UNIX)
+static int pollSockets(struct pollfd *fds, int count, int timeout)
+{
+    return poll(fds, count, timeout);
+}
+#elif defined(Q_OS_WIN)
+static int pollSockets(struct pollfd *fds, int count, int timeout)
+{
+    int res = WSAPoll(fds, count, timeout);
+    if(res == SOCKET_ERROR && WSAGetLastError() == WSAEINTR)
+    {
+        errno = EINTR;
+    }
+    return res;
+}
+#endif
 
 char const* optTypeToStr(OpType type)
 {
@@ -207,6 +245,7 @@ size_t generateBootReply(
     QString& bootFileName,
     QString& serverIp,
     QString& serverName,
+    QString& bootUrl,
     DhcpPacket& reply
     )
 {
@@ -271,6 +310,16 @@ size_t generateBootReply(
     std::memcpy(reply.options + indeks, serverIp.toUtf8().data(), serverIpStrSize);
     indeks += serverIpStrSize;
 
+    // where the HTTP server is, for boot scripts that fetch the image with wget
+    if(false == bootUrl.isEmpty())
+    {
+        QByteArray url = bootUrl.toUtf8();
+        reply.options[indeks++] = static_cast<uint8_t>(OptionType::URL);
+        reply.options[indeks++] = (uint8_t)url.size();
+        std::memcpy(reply.options + indeks, url.constData(), url.size());
+        indeks += url.size();
+    }
+
     // End option
     reply.options[indeks] = static_cast<uint8_t>(OptionType::END);
 
@@ -315,6 +364,103 @@ bool isDHCPProcessSuccessfull(QString targetIp)
     return false;
 }
 
+#if defined(Q_OS_LINUX)
+bool setInterfaceSettings(const QString &interface, const QString ipAddr, const QString &speed, const QString &duplex)
+{
+    LinkControl link(interface.toLocal8Bit());
+    if(false == link.open())
+    {
+        return false;
+    }
+
+    // only worth waiting for if a board is connected, the next one may not be plugged in yet
+    bool hadLink = link.hasCarrier();
+    qDebug() << "[link]" << interface << speed << duplex << "autoneg off," << ipAddr << "/24";
+
+    if(false == link.setUp(false))
+    {
+        return false;
+    }
+    // not all adapters let the speed be forced, the board still links up at whatever they negotiate
+    if(false == link.setLinkMode(speed.toInt(), duplex == "full", false))
+    {
+        qDebug() << "[link] keeping the current link mode of" << interface;
+    }
+    if(false == link.addAddress(QHostAddress(ipAddr).toIPv4Address(), 24) || false == link.setUp(true))
+    {
+        return false;
+    }
+
+    if(hadLink && false == link.waitForLink(speed.toInt(), LINK_UP_TIMEOUT))
+    {
+        qDebug() << "[link] no link at" << speed << "MBit/s yet";
+    }
+    return true;
+}
+
+bool changeSpeedTo1000MBit(const QString &interface)
+{
+    LinkControl link(interface.toLocal8Bit());
+    if(false == link.open() || false == link.setLinkMode(1000, true, true))
+    {
+        return false;
+    }
+
+    // answered once the board is reachable at the new speed, instead of after a fixed delay
+    if(false == link.waitForLink(1000, LINK_UP_TIMEOUT))
+    {
+        qDebug() << "[link] no link at 1000 MBit/s after" << LINK_UP_TIMEOUT << "ms";
+        return false;
+    }
+    return true;
+}
+
+// previous is set to the MTU there was before, unless it already holds one
+bool setInterfaceMtu(const QString &interface, int mtu, int *previous)
+{
+    LinkControl link(interface.toLocal8Bit());
+    if(false == link.open())
+    {
+        return false;
+    }
+
+    int current = link.mtu();
+    if(current == mtu)
+    {
+        return true;
+    }
+
+    bool hadLink = link.hasCarrier();
+    qDebug() << "[link]" << interface << "MTU" << current << "->" << mtu;
+    if(false == link.setMtu(mtu))
+    {
+        return false;
+    }
+    if(previous != nullptr && *previous == 0)
+    {
+        *previous = current;
+    }
+
+    // many drivers renegotiate the link for it
+    if(hadLink && false == link.waitForLink(0, LINK_UP_TIMEOUT))
+    {
+        qDebug() << "[link] no link after changing the MTU yet";
+    }
+    return true;
+}
+
+void revertInterfaceSettings(const QString &interface, const QString &ipAddr)
+{
+    LinkControl link(interface.toLocal8Bit());
+    if(false == link.open())
+    {
+        return;
+    }
+
+    link.setLinkMode(0, true, true);
+    link.removeAddress(QHostAddress(ipAddr).toIPv4Address(), 24);
+}
+#else
 bool setInterfaceSettings(const QString &interface, const QString ipAddr, const QString &speed, const QString &duplex)
 {
 #if defined(Q_OS_UNIX)
@@ -394,6 +540,13 @@ bool changeSpeedTo1000MBit(const QString &interface)
     return false;
 }
 
+bool setInterfaceMtu(const QString &interface, int mtu, int *previous)
+{
+    Q_UNUSED(previous);
+    qDebug() << "Setting the MTU of" << interface << "to" << mtu << "is not supported on this platform";
+    return false;
+}
+
 void revertInterfaceSettings(const QString &interface, const QString &ipAddr)
 {
 #if defined(Q_OS_UNIX)
@@ -430,6 +583,7 @@ void revertInterfaceSettings(const QString &interface, const QString &ipAddr)
     ipProcess.waitForFinished();
     return;
 }
+#endif
 
 void cleanSocket(int socket)
 {
@@ -446,9 +600,34 @@ void cleanSocket(int socket)
     }
 }
 
-int dhcpServerRun(int sock, QString& offeredIp, QString& bootFile, QString& serverIp, QString& serverName)
+// Addresses offered to the boards, by hardware address. Each one gets its own, from the first offered ip on
+struct DhcpPool
+{
+    quint32 firstIp;
+    int size;
+    QMap<QByteArray, quint32> leases;
+
+    QString addressFor(const DhcpPacket &request)
+    {
+        QByteArray hwAddr((const char *)request.chaddr, qMin((int)request.hlen, (int)sizeof(request.chaddr)));
+        auto it = leases.find(hwAddr);
+        if(it == leases.end())
+        {
+            if(leases.size() >= size)
+            {
+                qDebug() << "[simpdhcp] address pool exhausted, not answering" << hwAddr.toHex(':');
+                return QString();
+            }
+            it = leases.insert(hwAddr, firstIp + leases.size());
+            qDebug() << "[simpdhcp]" << hwAddr.toHex(':') << "gets" << QHostAddress(it.value()).toString();
+        }
+        return QHostAddress(it.value()).toString();
+    }
+};
+
+// Answers one request, called when the socket is readable
+int dhcpServerRun(int sock, DhcpPool& pool, QString& bootFile, QString& serverIp, QString& serverName, QString& bootUrl)
 {
-    // Receive a packet
     char buffer[4096];
     struct sockaddr_in source;
     socklen_t addr_len = sizeof(source);
@@ -456,17 +635,18 @@ int dhcpServerRun(int sock, QString& offeredIp, QString& bootFile, QString& serv
     // Receive a packet
     int bytes_received = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr *)&source, &addr_len);
     if (bytes_received < 0) {
-        // qDebug() << "[simpdhcp] No packet received";
         return -DHCP_RECV_TIMEOUT;
     }
-    else
-    {
-        qDebug() << "[simpdhcp] Packet received";
-    }
+    qCTrace(lcDhcp) << "[simpdhcp] Packet received";
 
     DhcpPacket dpacket = parseDhcpPacket(buffer, bytes_received);
+    QString offeredIp = pool.addressFor(dpacket);
+    if(offeredIp.isEmpty())
+    {
+        return -NO_DATAGRAM;
+    }
     DhcpPacket reply{};
-    auto reply_size = generateBootReply(dpacket, offeredIp, bootFile, serverIp, serverName, reply);
+    auto reply_size = generateBootReply(dpacket, offeredIp, bootFile, serverIp, serverName, bootUrl, reply);
 
     source.sin_addr.s_addr = htonl(INADDR_BROADCAST); // Change to your target IP
 
@@ -483,7 +663,7 @@ int dhcpServerRun(int sock, QString& offeredIp, QString& bootFile, QString& serv
 ReturnCodes doWork(
     QString& interface, QString& speed, QString& duplex,
     QString& serverIp, QString& offeredIp, QString& bootFile,
-    QString& serverName, TFTP& tftpServer
+    QString& serverName, int poolSize, int mtu, TFTP& tftpServer, HttpServer& httpServer
 )
 {
     quint16 senderPort;
@@ -497,14 +677,27 @@ ReturnCodes doWork(
         return IFACE_SETUP_FAILED;
     }
 
+    // MTU the interface had before simpbootp changed it, 0 if it did not
+    int originalMtu{0};
     QScopeGuard guard {
-        [serverIp, interface, sock]()
+        [serverIp, interface, sock, &originalMtu]()
         {
+            if(originalMtu != 0)
+            {
+                setInterfaceMtu(interface, originalMtu, nullptr);
+            }
             revertInterfaceSettings(interface, serverIp);
             cleanSocket(sock);
         }
     };
 
+    // TFTP blocks are negotiated up to what the MTU of the interface allows
+    if(mtu > 0 && false == setInterfaceMtu(interface, mtu, &originalMtu))
+    {
+        qDebug() << "keeping the MTU of" << interface;
+        mtu = 0;
+    }
+
     if(false == initSocket())
     {
         qDebug() << "initSocket() failed!";
@@ -567,195 +760,310 @@ ReturnCodes doWork(
         return SOCKET_OPT_BINDTODEV_FAILED;
     }
 #endif
-    int dhcpStatus;
-    int tftpStatus;
-
     bool ipcEnabled{true};
-    bool notifyNextDHCP{false};
-    bool notifyNextFileSend{false};
     bool programShouldClose{false};
-    bool fileSendNotificationReady{false};
-    float currentProgress{0.0f};
+    QElapsedTimer lastProgress;
+
+    // DHCP, TFTP, HTTP and the IPC channel are all handled by the loop below, on this thread
+    QLocalSocket mainProc;
+    QByteArray ipcBuf;
 
-    tftpServer.setProgressUpdateCallback([&currentProgress](float progress) -> void
+    auto sendMsg = [&mainProc, &ipcEnabled](SimpbootpIpc::Message type, const QByteArray& payload = QByteArray(), int msecs = 100) -> bool
     {
-        currentProgress = progress;
-    });
+        if(false == ipcEnabled)
+        {
+            return false;
+        }
+
+        QByteArray msg = SimpbootpIpc::frame(type, payload);
+        if(msg.size() == mainProc.write(msg) && mainProc.waitForBytesWritten(msecs))
+        {
+            return true;
+        }
 
-    tftpServer.setOnReadSuccess([&](QByteArray filename)
+        return false;
+    };
+
+    auto sendReply = [&sendMsg](SimpbootpIpc::Message cmd, bool ok) -> bool
+    {
+        QByteArray payload(2, 0);
+        payload[0] = (char)cmd;
+        payload[1] = ok ? 1 : 0;
+        return sendMsg(SimpbootpIpc::Reply, payload);
+    };
+
+    // progress of the file being sent is pushed at most every PROGRESS_PUSH_INTERVAL ms, and when it is done
+    auto onProgress = [&sendMsg, &lastProgress](QByteArray filename, float progress) -> void
+    {
+        if(progress < 1.0f && lastProgress.isValid() && lastProgress.elapsed() < PROGRESS_PUSH_INTERVAL)
+        {
+            return;
+        }
+
+        lastProgress.start();
+        sendMsg(SimpbootpIpc::Progress, SimpbootpIpc::number((quint64)(progress * 1000000)) + filename);
+    };
+
+    auto onReadSuccess = [&sendMsg](QByteArray filename)
     {
-        fileSendNotificationReady = true;
         qDebug() << "file sent: " << filename;
-    });
+        sendMsg(SimpbootpIpc::FileSent, filename);
+    };
 
-    auto ipcProc = QtConcurrent::run([&]()
+    auto onReadFailure = [&sendMsg](QByteArray filename)
     {
-        QLocalSocket mainProc;
+        qDebug() << "sending file failed: " << filename;
+        sendMsg(SimpbootpIpc::TransferFailed, filename);
+    };
 
-        auto sendMsg = [&mainProc](QByteArray msg, int msecs = 100) -> bool
-        {
-            msg.append('\n');
-            if(msg.size() == mainProc.write(msg) && mainProc.waitForBytesWritten(msecs))
-            {
-                return true;
-            }
+    // gem-imager sees the same events whether the board fetches a file over TFTP or HTTP
+    tftpServer.setProgressUpdateCallback(onProgress);
+    tftpServer.setOnReadSuccess(onReadSuccess);
+    tftpServer.setOnReadFailure(onReadFailure);
+    httpServer.setProgressUpdateCallback(onProgress);
+    httpServer.setOnReadSuccess(onReadSuccess);
+    httpServer.setOnReadFailure(onReadFailure);
 
-            return false;
-        };
+    tftpServer.setOnRetransmit([&sendMsg](int blocks)
+    {
+        sendMsg(SimpbootpIpc::Retransmits, SimpbootpIpc::number(blocks));
+    });
 
-        auto recvMsg = [&mainProc, sendMsg](int msecs = 100) -> QByteArray
-        {
-            if(false == mainProc.bytesAvailable() && false == mainProc.waitForReadyRead(msecs))
-            {
-                return QByteArray{0, Qt::Initialization::Uninitialized};
-            }
+    // hashes of what the board wrote, checked by gem-imager
+    tftpServer.setOnWriteSuccess([&sendMsg](QByteArray filename, QByteArray contents)
+    {
+        qDebug() << "file received: " << filename << contents.size() << "bytes";
+        sendMsg(SimpbootpIpc::FileReceived, filename + '\0' + contents);
+    });
 
-            QByteArray readBuf = mainProc.readLine().trimmed();
-            if(readBuf.size() != 0)
-            {
-                sendMsg("ok", msecs);
-            }
-            return readBuf;
-        };
+    DhcpPool pool{QHostAddress(offeredIp).toIPv4Address(), qMax(1, poolSize), {}};
+    // U-Boot fetches from serverip on port 80 by default, the URL option is for scripts that want it spelled out
+    QString bootUrl;
+    if(httpServer.isStarted())
+    {
+        bootUrl = QString("http://%1:%2/").arg(serverIp).arg(httpServer.port());
+    }
+    // SetSpeed and SetMtu of the last job are undone when the next one starts
+    bool speedChanged{false};
+    bool mtuChanged{false};
 
-        mainProc.connectToServer("SimpbootpCommChannel");
-        if(false == mainProc.waitForConnected(2000))
+    auto handleMsg = [&](SimpbootpIpc::Message type, const QByteArray& payload)
+    {
+        switch(type)
         {
-            qDebug() << "Connection to the main proc failed!" << mainProc.errorString();
-            qDebug() << "IPC disabled";
-            ipcEnabled = false;
-        }
+        case SimpbootpIpc::Quit:
+            qDebug() << "[ipc] quit";
+            programShouldClose = true;
+            break;
 
-        while(ipcEnabled)
+        case SimpbootpIpc::SetSpeed:
         {
-            if(fileSendNotificationReady && notifyNextFileSend)
+            quint64 speed = SimpbootpIpc::toNumber(payload);
+            bool ok = (speed == 1000) ? changeSpeedTo1000MBit(interface)
+                                      : setInterfaceSettings(interface, serverIp, QString::number(speed), "full");
+            if(false == ok)
             {
-                auto filename = tftpServer.getLastFileName();
-                qDebug() << "sending notification for file: " << filename;
-                sendMsg(filename);
-                fileSendNotificationReady = false;
-                notifyNextFileSend = false;
+                qDebug() << "[ipc] set interface speed to" << speed << "MB failed!";
             }
             else
             {
-                fileSendNotificationReady = false;
+                qDebug() << "[ipc] Speed" << speed << "MB";
             }
+            speedChanged = true;
+            sendReply(type, ok);
+            break;
+        }
 
-            if(mainProc.state() != QLocalSocket::ConnectedState)
+        case SimpbootpIpc::SetBlockSize:
+        {
+            int blockSize = (int)SimpbootpIpc::toNumber(payload);
+            bool ok = (blockSize >= 8 && blockSize <= TFTP_MAX_BLOCK_SIZE);
+            if(ok)
             {
-                qDebug() << "[simpbootp] server closed exiting...";
-                programShouldClose = true;
-                break;
+                qDebug() << "[ipc] TFTP Blocksize" << blockSize;
+                tftpServer.setTftpBlockSize(blockSize);
             }
+            sendReply(type, ok);
+            break;
+        }
 
-            if(mainProc.bytesAvailable() > 0 || true == mainProc.waitForReadyRead(1000))
+        case SimpbootpIpc::SetMtu:
+        {
+            int newMtu = (int)SimpbootpIpc::toNumber(payload);
+            bool ok = (newMtu >= MIN_MTU && newMtu <= MAX_MTU) && setInterfaceMtu(interface, newMtu, &originalMtu);
+            if(ok)
             {
-                QByteArray readBuf = recvMsg();
-
-                if(readBuf == "quit")
-                {
-                    qDebug() << "[ipc] quit";
-                    programShouldClose = true;
-                    break;
-                }
+                qDebug() << "[ipc] MTU" << newMtu;
+                mtuChanged = true;
+            }
+            sendReply(type, ok);
+            break;
+        }
 
-                if(readBuf == "1000MB")
-                {
-                    if(false == changeSpeedTo1000MBit(interface))
-                    {
-                        qDebug() << "[ipc] set interface speed to 1000MB failed!";
-                        sendMsg("nok");
-                    }
-                    else
-                    {
-                        qDebug() << "[ipc] Speed 1000MB";
-                        sendMsg("ok");
-                    }
-                    continue;
-                }
+        case SimpbootpIpc::SetPartSize:
+        {
+            qint64 size = (qint64)SimpbootpIpc::toNumber(payload);
+            qDebug() << "[ipc] uniflash part size" << size;
+            tftpServer.setSplitModeSize(size);
+            httpServer.setSplitModeSize(size);
+            sendReply(type, true);
+            break;
+        }
 
-                if(readBuf == "100MB")
-                {
-                    if(false == setInterfaceSettings(interface, serverIp, "100", "full"))
-                    {
-                        qDebug() << "[ipc] set interface speed to 100MB failed!";
-                        sendMsg("nok");
-                    }
-                    else
-                    {
-                        qDebug() << "[ipc] Speed 100MB";
-                        sendMsg("ok");
-                    }
-                    continue;
-                }
+        // uniflash image served while gem-imager is still writing it
+        case SimpbootpIpc::ImageStream:
+        {
+            qint64 size = (qint64)SimpbootpIpc::toNumber(payload);
+            qDebug() << "[ipc] image is streamed, final size" << size;
+            tftpServer.setGrowingFile(size);
+            httpServer.setGrowingFile(size);
+            sendReply(type, size > 0);
+            break;
+        }
 
-                if(readBuf == "isSblUartReady")
+        case SimpbootpIpc::ImageWritten:
+            tftpServer.setGrowingFileWritten((qint64)SimpbootpIpc::toNumber(payload));
+            httpServer.setGrowingFileWritten((qint64)SimpbootpIpc::toNumber(payload));
+            break;
+
+        case SimpbootpIpc::ImageComplete:
+            qDebug() << "[ipc] image complete";
+            tftpServer.setGrowingFile(0);
+            httpServer.setGrowingFile(0);
+            break;
+
+        case SimpbootpIpc::ImageFailed:
+            qDebug() << "[ipc] writing image failed";
+            tftpServer.setGrowingFileWritten(-1);
+            httpServer.setGrowingFileWritten(-1);
+            break;
+
+        case SimpbootpIpc::CancelJob:
+            qDebug() << "[ipc] job cancelled";
+            tftpServer.cancelSessions();
+            tftpServer.setGrowingFile(0);
+            httpServer.cancelSessions();
+            httpServer.setGrowingFile(0);
+            break;
+
+        // gem-imager keeps this process for the next boards of the session
+        case SimpbootpIpc::StartJob:
+        {
+            QString dir = QString::fromUtf8(payload);
+            bool ok = QDir{dir}.exists();
+            if(ok)
+            {
+                qDebug() << "[ipc] new job, serving" << dir;
+                QDir::setCurrent(dir);
+                tftpServer.setTargetDirectory(dir);
+                tftpServer.setSplitModeSize(0);
+                tftpServer.setGrowingFile(0);
+                httpServer.setTargetDirectory(dir);
+                httpServer.setSplitModeSize(0);
+                httpServer.setGrowingFile(0);
+                pool.leases.clear();
+                if(speedChanged)
                 {
-                    if(tftpServer.isTiboot3BinSent())
-                    {
-                        qDebug() << "[ipc] SblUartReady!";
-                        sendMsg("ok");
-                    }
-                    else
-                    {
-                        sendMsg("nok");
-                    }
-                    continue;
+                    ok = setInterfaceSettings(interface, serverIp, speed, duplex);
+                    speedChanged = false;
                 }
-
-                if(readBuf == "tftpBlokSize1468")
+                if(mtuChanged && originalMtu != 0)
                 {
-                    qDebug() << "[ipc] TFTP Blocksize 1468";
-                    tftpServer.setTftpBlockSize(1468);
-                    sendMsg("ok");
-                    continue;
+                    ok = setInterfaceMtu(interface, mtu > 0 ? mtu : originalMtu, nullptr) && ok;
+                    mtuChanged = false;
                 }
+            }
+            sendReply(type, ok);
+            break;
+        }
 
-                if(readBuf == "notifyDHCP")
-                {
-                    notifyNextDHCP = true;
-                    continue;
-                }
+        default:
+            qDebug() << "[ipc] unknown command" << type;
+        }
+    };
 
-                if(readBuf == "notifyFileSend")
-                {
-                    notifyNextFileSend = true;
-                    tftpServer.setError(false);
-                    continue;
-                }
+    mainProc.connectToServer("SimpbootpCommChannel");
+    if(false == mainProc.waitForConnected(2000))
+    {
+        qDebug() << "Connection to the main proc failed!" << mainProc.errorString();
+        qDebug() << "IPC disabled";
+        ipcEnabled = false;
+    }
 
-                if(readBuf == "getFileSendProgress")
-                {
-                    auto str = QString::asprintf("%f", currentProgress);
-                    sendMsg(str.toUtf8());
-                    continue;
-                }
+    qDebug() << "Main loop started!";
+    while(!programShouldClose)
+    {
+        struct pollfd fds[3 + 1 + HTTP_MAX_CONNECTIONS];
+        int count = 0;
+        fds[count++] = {(SOCKET)sock, POLLIN, 0};
+        fds[count++] = {(SOCKET)tftpServer.socketDescriptor(), POLLIN, 0};
+        count += httpServer.pollFds(fds + count, 1 + HTTP_MAX_CONNECTIONS);
+
+        // wake up for the next resend or timeout of a transfer
+        int timeout = qMin(tftpServer.nextTimeout(), httpServer.nextTimeout());
+#if defined(Q_OS_UNIX)
+        if(ipcEnabled)
+        {
+            fds[count++] = {(SOCKET)mainProc.socketDescriptor(), POLLIN, 0};
+        }
+#elif defined(Q_OS_WIN)
+        // the local socket is a named pipe, which cannot be polled with the sockets
+        if(ipcEnabled)
+        {
+            timeout = qMin(timeout, IPC_POLL_INTERVAL);
+        }
+#endif
 
-                if(readBuf == "isFileTransferOk")
-                {
-                    if(tftpServer.hasError())
-                    {
-                        sendMsg("nok");
-                    }
-                    else
-                    {
-                        sendMsg("ok");
-                    }
-                    continue;
-                }
+        if(pollSockets(fds, count, timeout) < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
             }
+            qDebug() << "poll() failed!" << strerror(errno);
+            break;
         }
-    });
 
-    qDebug() << "Main loop started!";
-    while(!programShouldClose)
-    {
-        tftpStatus = tftpServer.run();
-        dhcpStatus = dhcpServerRun(sock, offeredIp, bootFile, serverIp, serverName);
+        if(fds[0].revents & POLLIN)
+        {
+            dhcpServerRun(sock, pool, bootFile, serverIp, serverName, bootUrl);
+        }
+
+        // acks that arrived, and resends that are due
+        tftpServer.run(false);
+        httpServer.run();
+
+        if(false == ipcEnabled)
+        {
+            continue;
+        }
+
+        mainProc.waitForReadyRead(0);
+        ipcBuf += mainProc.readAll();
+
+        SimpbootpIpc::Message type;
+        QByteArray payload;
+        int res = 0;
+        while(!programShouldClose && (res = SimpbootpIpc::takeFrame(ipcBuf, type, payload)) > 0)
+        {
+            handleMsg(type, payload);
+        }
+
+        if(res < 0)
+        {
+            qDebug() << "[ipc] corrupt data from the main proc, exiting...";
+            programShouldClose = true;
+        }
+
+        if(!programShouldClose && mainProc.state() != QLocalSocket::ConnectedState)
+        {
+            qDebug() << "[simpbootp] server closed exiting...";
+            programShouldClose = true;
+        }
     }
 
     tftpServer.stop();
-    ipcProc.waitForFinished();
+    httpServer.stop();
 
     return SUCCESS;
 }
@@ -781,6 +1089,9 @@ int main(int argc, char* argv[])
         {{"oi", "offered-ip"},
             QCoreApplication::translate("main", "Client ip (served pc) address (Ex: 10.42.0.2)."),
             QCoreApplication::translate("main", "offered-ip")},
+        {{"ps", "pool-size"},
+            QCoreApplication::translate("main", "Number of boards served at once. Each gets an address from offered-ip on."),
+            QCoreApplication::translate("main", "count")},
         {{"sn", "server-name"},
             QCoreApplication::translate("main", "Server name"),
             QCoreApplication::translate("main", "server-name")},
@@ -790,9 +1101,18 @@ int main(int argc, char* argv[])
         {{"b", "blocksize"},
             QCoreApplication::translate("main", "TFTP block size"),
             QCoreApplication::translate("main", "blocksize")},
+        {{"m", "mtu"},
+            QCoreApplication::translate("main", "Interface MTU to set, e.g. 9000 for jumbo frames on a direct link. Boards get TFTP blocks up to what it allows."),
+            QCoreApplication::translate("main", "bytes")},
         {{"p", "port"},
             QCoreApplication::translate("main", "TFTP port."),
             QCoreApplication::translate("main", "port")},
+        {{"mc", "multicast"},
+            QCoreApplication::translate("main", "Send a file requested by several boards once, to multicast groups from <group> on (RFC 2090). Ex: 239.255.42.1"),
+            QCoreApplication::translate("main", "group")},
+        {{"hp", "http-port"},
+            QCoreApplication::translate("main", "Port of the HTTP server for the uniflash image, 0 to serve it over TFTP only."),
+            QCoreApplication::translate("main", "port")},
         {{"t", "target-directory"},
             QCoreApplication::translate("main", "Copy all source files into <directory>."),
             QCoreApplication::translate("main", "directory")},
@@ -812,8 +1132,11 @@ int main(int argc, char* argv[])
     QString bootFile { DEFAULT_BOOTFILE };
     QString serverName { DEFAULT_SERVER_NAME };
 
+    int poolSize = DEFAULT_POOL_SIZE;
     uint16_t port = TFTP_DEFAULT_PORT;
+    uint16_t httpPort = HTTP_DEFAULT_PORT;
     int32_t tftpBlocksize = TFTP_DEFAULT_BLOCK_SIZE;
+    int mtu = 0;
     QString targetDirectory = app.applicationDirPath();
 
     if(parser.isSet("port"))
@@ -827,6 +1150,20 @@ int main(int argc, char* argv[])
         }
     }
 
+    if(parser.isSet("http-port"))
+    {
+        bool ok = false;
+        int value = parser.value("http-port").toInt(&ok);
+        if(!ok || value < 0 || value > std::numeric_limits<uint16_t>::max())
+        {
+            qDebug() << "HTTP port is not valid (" << parser.value("http-port") << ") using default port" << httpPort;
+        }
+        else
+        {
+            httpPort = value;
+        }
+    }
+
     if(parser.isSet("blocksize"))
     {
         bool ok = false;
@@ -838,6 +1175,17 @@ int main(int argc, char* argv[])
         }
     }
 
+    if(parser.isSet("mtu"))
+    {
+        bool ok = false;
+        mtu = parser.value("mtu").toInt(&ok);
+        if(!ok || mtu < MIN_MTU || mtu > MAX_MTU)
+        {
+            mtu = 0;
+            qDebug() << "MTU is not valid (" << parser.value("mtu") << ") keeping the MTU of the interface";
+        }
+    }
+
     if(parser.isSet("target-directory"))
     {
         targetDirectory = parser.value("target-directory");
@@ -858,11 +1206,31 @@ int main(int argc, char* argv[])
         qDebug() << "[simptftp]" << "server init failed!";
     }
 
+    // the boot ROM only speaks TFTP, U-Boot can take the image over HTTP
+    HttpServer httpServer{httpPort, targetDirectory};
+    if (httpPort != 0 && 0 > httpServer.start())
+    {
+        qDebug() << "[simphttp]" << "server init failed, the image is served over TFTP only";
+    }
+
     if(parser.isSet("interface"))
     {
         interface = parser.value("interface");
     }
 
+    if(parser.isSet("multicast"))
+    {
+        QHostAddress group{parser.value("multicast")};
+        if(group.protocol() == QAbstractSocket::IPv4Protocol && group.isMulticast())
+        {
+            tftpServer.setMulticast(group, interface);
+        }
+        else
+        {
+            qDebug() << "Multicast group is not valid (" << parser.value("multicast") << ") sending to every board on its own";
+        }
+    }
+
     if(parser.isSet("speed"))
     {
         speed = parser.value("speed");
@@ -883,6 +1251,17 @@ int main(int argc, char* argv[])
         offeredIp = parser.value("offered-ip");
     }
 
+    if(parser.isSet("pool-size"))
+    {
+        bool ok = false;
+        poolSize = parser.value("pool-size").toInt(&ok);
+        if(!ok || poolSize < 1)
+        {
+            poolSize = DEFAULT_POOL_SIZE;
+            qDebug() << "Pool size is not valid (" << parser.value("pool-size") << ") using default pool size" << poolSize;
+        }
+    }
+
     if(parser.isSet("server-name"))
     {
         serverName = parser.value("server-name");
@@ -893,10 +1272,13 @@ int main(int argc, char* argv[])
         bootFile = parser.value("bootfile");
     }
 
+    // the ROM times out quickly, so the first blocks should not wait for the disk
+    tftpServer.setPreloadFiles({bootFile, PRELOAD_FILES});
+
     QTimer::singleShot(0, &app,
-        [&interface, &speed, &duplex, &serverIp, &offeredIp, &bootFile, &serverName, &tftpServer]()
+        [&interface, &speed, &duplex, &serverIp, &offeredIp, &bootFile, &serverName, poolSize, mtu, &tftpServer, &httpServer]()
         {
-            QCoreApplication::exit(doWork(interface, speed, duplex, serverIp, offeredIp, bootFile, serverName, tftpServer));
+            QCoreApplication::exit(doWork(interface, speed, duplex, serverIp, offeredIp, bootFile, serverName, poolSize, mtu, tftpServer, httpServer));
         }
     );
 
@@ -0,0 +1,90 @@
+#ifndef SIMPBOOTPIPC_H
+#define SIMPBOOTPIPC_H
+
+#include <qbytearray.h>
+#include <qendian.h>
+
+/*
+ * Messages between gem-imager and simpbootp over the local socket
+ *
+ * A frame is a type byte and the length of the payload (32 bit little
+ * endian), followed by the payload. Numbers in payloads are 64 bit
+ * little endian.
+ *
+ * gem-imager sends commands. Those it has to know the outcome of are
+ * answered with a Reply, the others are not acknowledged. simpbootp
+ * pushes events as they happen.
+ */
+namespace SimpbootpIpc
+{
+    enum Message: quint8
+    {
+        // gem-imager -> simpbootp
+        Quit           = 1,
+        SetSpeed       = 2,  // interface speed in Mbit/s, 100 or 1000. Replied
+        SetBlockSize   = 3,  // TFTP block size. Replied
+        SetPartSize    = 4,  // size of the uniflash parts, 0 for a tenth of the image. Replied
+        ImageStream    = 5,  // final size of the image that is still being written. Replied
+        ImageWritten   = 6,  // bytes from the start of the image that can be served
+        ImageComplete  = 7,
+        ImageFailed    = 8,
+        StartJob       = 9,  // directory with the files of the next board. Resets the settings of the last one. Replied
+        CancelJob      = 10, // ends the transfers in progress, the board gets an error
+        SetMtu         = 11, // MTU of the interface in bytes, e.g. 9000 for jumbo frames. Replied
+
+        // simpbootp -> gem-imager
+        Reply          = 64, // command byte, and 1 if it succeeded
+        FileSent       = 65, // name of the file
+        TransferFailed = 66, // name of the file
+        Progress       = 67, // millionths of the file sent, and its name
+        Retransmits    = 68, // number of TFTP blocks sent again
+        FileReceived   = 69, // name of a file the board put over TFTP, a zero byte and its contents
+    };
+
+    static const int HeaderSize = 5;
+    // room for the largest file the board can put, see TFTP_MAX_UPLOAD_SIZE
+    static const quint32 MaxPayloadSize = 36864;
+
+    inline QByteArray frame(Message type, const QByteArray &payload = QByteArray())
+    {
+        QByteArray buf(HeaderSize, Qt::Uninitialized);
+        buf[0] = (char) type;
+        qToLittleEndian<quint32>(payload.size(), buf.data()+1);
+        return buf + payload;
+    }
+
+    inline QByteArray number(quint64 value)
+    {
+        QByteArray buf(sizeof(value), Qt::Uninitialized);
+        qToLittleEndian<quint64>(value, buf.data());
+        return buf;
+    }
+
+    inline quint64 toNumber(const QByteArray &payload, int pos = 0)
+    {
+        if (payload.size() < pos + (int) sizeof(quint64))
+            return 0;
+        return qFromLittleEndian<quint64>(payload.constData()+pos);
+    }
+
+    /* Takes the first frame off buf.
+       Returns 1 if there was one, 0 if more data is needed, -1 if buf is garbage */
+    inline int takeFrame(QByteArray &buf, Message &type, QByteArray &payload)
+    {
+        if (buf.size() < HeaderSize)
+            return 0;
+
+        quint32 len = qFromLittleEndian<quint32>(buf.constData()+1);
+        if (len > MaxPayloadSize)
+            return -1;
+        if ((quint32) buf.size() < HeaderSize + len)
+            return 0;
+
+        type = (Message) (quint8) buf[0];
+        payload = buf.mid(HeaderSize, len);
+        buf.remove(0, HeaderSize + len);
+        return 1;
+    }
+}
+
+#endif // SIMPBOOTPIPC_H
@@ -60,6 +60,7 @@ enum class OptionType : uint8_t {
     PARAMETER_REQUEST_LIST = 55,
     DHCP_OPTION_OVERLOAD = 52,
     TFTP_SERVER_NAME = 66,
+    URL = 114,
     END = 255
 };
 
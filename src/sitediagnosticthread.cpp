@@ -0,0 +1,98 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "sitediagnosticthread.h"
+#include "config.h"
+#include "ringbuffer.h"
+#include <QDebug>
+#include <thread>
+
+SiteDiagnosticThread::SiteDiagnosticThread(const QByteArray &url, const QByteArray &expectedHash, QObject *parent)
+    : DownloadExtractThread(url, "", expectedHash, parent)
+{
+    _ejectEnabled = false;
+    _suppressSuccessSignal = true;
+
+    connect(this, &DownloadThread::phaseFinished, this, [this](QString phase, quint64 bytes, qint64 msecs) {
+        std::lock_guard<std::mutex> lock(_phaseMutex);
+        _phaseMsecs[phase] = msecs;
+        _phaseBytes[phase] = bytes;
+    }, Qt::DirectConnection);
+}
+
+SiteDiagnosticThread::~SiteDiagnosticThread()
+{
+}
+
+bool SiteDiagnosticThread::isImage()
+{
+    return true;
+}
+
+/* There is no device */
+bool SiteDiagnosticThread::_openAndPrepareDevice()
+{
+    return true;
+}
+
+void SiteDiagnosticThread::run()
+{
+    RingBuffer sink(IMAGEWRITER_RINGBUFFER_SIZE, IMAGEWRITER_RINGBUFFER_SLABSIZE);
+    std::thread reader([&sink]() {
+        const void *slab;
+        while (sink.read(&slab) > 0)
+        {
+        }
+    });
+
+    setOutputStream(&sink);
+    DownloadExtractThread::run();
+    waitForExtractThread();
+    setOutputStream(nullptr);
+
+    bool ok = _successful && !_cancelled;
+    if (ok)
+        sink.close();
+    else
+        sink.cancel();
+    reader.join();
+    if (!ok)
+        return;
+
+    quint64 imageBytes;
+    {
+        std::lock_guard<std::mutex> lock(_phaseMutex);
+        imageBytes = _phaseBytes.value(phaseName(PhaseDecompress));
+    }
+    _emitStage("download", PhaseDownload, _queue.producerStallTime(), imageBytes);
+    _emitStage("decompress", PhaseDecompress, _queue.consumerStallTime() + _extractStallTime, imageBytes);
+    /* The writer hashes, and hands the data to the sink, which takes next to no time */
+    _emitStage("hash", PhaseWrite, _writeStallTime, imageBytes);
+    emit success();
+}
+
+void SiteDiagnosticThread::_emitStage(const QString &stage, Phase phase, quint64 stallMsecs, quint64 imageBytes)
+{
+    qint64 msecs;
+    quint64 bytes;
+    {
+        std::lock_guard<std::mutex> lock(_phaseMutex);
+        msecs = _phaseMsecs.value(phaseName(phase));
+        bytes = _phaseBytes.value(phaseName(phase));
+    }
+
+    /* Waits are timed on their own, so they can add up to a little more than the phase */
+    qint64 busy = qMax((qint64) 1, msecs - (qint64) stallMsecs);
+    qDebug() << "Diagnostic:" << stage << bytes << "bytes in" << msecs << "ms, waited" << stallMsecs << "ms on other stages";
+
+    emit stageResult({
+        {"stage", stage},
+        {"bytes", (qulonglong) bytes},
+        {"seconds", msecs / 1000.0},
+        {"busySeconds", busy / 1000.0},
+        {"MBps", bytes / 1000.0 / busy},
+        {"imageMBps", imageBytes / 1000.0 / busy}
+    });
+}
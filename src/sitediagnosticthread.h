@@ -0,0 +1,56 @@
+#ifndef SITEDIAGNOSTICTHREAD_H
+#define SITEDIAGNOSTICTHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadextractthread.h"
+#include <QHash>
+#include <QVariantMap>
+#include <mutex>
+
+/*
+ * Measures how fast a site can download, decompress and hash an image
+ *
+ * Runs the regular pipeline, with the proxy and transport settings in
+ * effect, but sends the extracted image into a stream that is read into
+ * nothing instead of writing it to a device. Nothing is cached.
+ *
+ * Each stage waits on the stages before and after it part of the time:
+ * the download on a full download queue, decompression on an empty
+ * download queue or a full write queue, the writer on an empty write
+ * queue. Leaving the waiting out gives the rate the stage could keep up
+ * on its own. All rates are also given in bytes of the extracted image,
+ * so they compare with each other and with the write speed of a card.
+ *
+ * Emits stageResult() for "download", "decompress" and "hash", and then
+ * success().
+ */
+class SiteDiagnosticThread : public DownloadExtractThread
+{
+    Q_OBJECT
+public:
+    explicit SiteDiagnosticThread(const QByteArray &url, const QByteArray &expectedHash = "", QObject *parent = nullptr);
+    virtual ~SiteDiagnosticThread();
+
+    virtual bool isImage();
+
+signals:
+    /* Map with "stage", bytes the stage processed, seconds it ran, busySeconds
+       it did not wait on other stages, MBps over busySeconds and imageMBps,
+       the same in bytes of the extracted image */
+    void stageResult(QVariantMap result);
+
+protected:
+    std::mutex _phaseMutex;
+    QHash<QString, qint64> _phaseMsecs;
+    QHash<QString, quint64> _phaseBytes;
+
+    virtual void run();
+    virtual bool _openAndPrepareDevice();
+    void _emitStage(const QString &stage, Phase phase, quint64 stallMsecs, quint64 imageBytes);
+};
+
+#endif // SITEDIAGNOSTICTHREAD_H
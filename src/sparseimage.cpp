@@ -0,0 +1,361 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "sparseimage.h"
+#include <QtEndian>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Android sparse image format, version 1.0 */
+#define SPARSE_MAGIC             0xed26ff3a
+#define SPARSE_HEADER_SIZE       28
+#define SPARSE_CHUNK_HEADER_SIZE 12
+#define SPARSE_CHUNK_RAW         0xcac1
+#define SPARSE_CHUNK_FILL        0xcac2
+#define SPARSE_CHUNK_DONT_CARE   0xcac3
+
+SparseImageEncoder::SparseImageEncoder(qint64 size, int blockSize, const std::function<qint64(char *, qint64)> &read)
+    : _read(read), _size((size + blockSize - 1) / blockSize * blockSize), _pos(0), _encoded(0), _blockSize(blockSize),
+      _headerLen(SPARSE_HEADER_SIZE), _headerPos(0), _dataLen(0), _dataPos(0), _ended(false)
+{
+    _data = (char *) qMallocAligned(SegmentSize, 4096);
+
+    char *h = _header;
+    qToLittleEndian<quint32>(SPARSE_MAGIC, h);
+    qToLittleEndian<quint16>(1, h+4);
+    qToLittleEndian<quint16>(0, h+6);
+    qToLittleEndian<quint16>(SPARSE_HEADER_SIZE, h+8);
+    qToLittleEndian<quint16>(SPARSE_CHUNK_HEADER_SIZE, h+10);
+    qToLittleEndian<quint32>(blockSize, h+12);
+    qToLittleEndian<quint32>(_size / blockSize, h+16);
+    qToLittleEndian<quint32>((_size + SegmentSize - 1) / SegmentSize, h+20);
+    /* No checksum */
+    qToLittleEndian<quint32>(0, h+24);
+    _encoded = _headerLen;
+}
+
+SparseImageEncoder::~SparseImageEncoder()
+{
+    qFreeAligned(_data);
+}
+
+qint64 SparseImageEncoder::read(char *buf, qint64 maxLen)
+{
+    qint64 n = 0;
+
+    while (_headerPos == _headerLen && _dataPos == _dataLen)
+    {
+        if (_pos == _size)
+            return _checkEnd();
+        if (!_nextChunk())
+            return -1;
+    }
+
+    if (_headerPos < _headerLen)
+    {
+        n = qMin(maxLen, (qint64) (_headerLen - _headerPos));
+        memcpy(buf, _header+_headerPos, n);
+        _headerPos += n;
+    }
+    else
+    {
+        n = qMin(maxLen, _dataLen - _dataPos);
+        memcpy(buf, _data+_dataPos, n);
+        _dataPos += n;
+    }
+
+    return n;
+}
+
+qint64 SparseImageEncoder::inputBytes() const
+{
+    return _pos;
+}
+
+qint64 SparseImageEncoder::encodedBytes() const
+{
+    return _encoded;
+}
+
+QString SparseImageEncoder::errorString() const
+{
+    return _error;
+}
+
+void SparseImageEncoder::_chunkHeader(quint16 type, qint64 len, int dataLen)
+{
+    qToLittleEndian<quint16>(type, _header);
+    qToLittleEndian<quint16>(0, _header+2);
+    qToLittleEndian<quint32>(len / _blockSize, _header+4);
+    qToLittleEndian<quint32>(SPARSE_CHUNK_HEADER_SIZE + dataLen, _header+8);
+    _headerLen = SPARSE_CHUNK_HEADER_SIZE;
+    _headerPos = 0;
+}
+
+bool SparseImageEncoder::_nextChunk()
+{
+    qint64 len = qMin((qint64) SegmentSize, _size - _pos);
+    qint64 got = 0;
+
+    while (!_ended && got < len)
+    {
+        qint64 n = _read(_data+got, len-got);
+        if (n < 0)
+        {
+            _error = QString("Error reading the image");
+            return false;
+        }
+        if (n == 0)
+            _ended = true;
+        got += n;
+    }
+    memset(_data+got, 0, len-got);
+
+    _dataPos = 0;
+    if (!got)
+    {
+        /* Past the end of the data */
+        _chunkHeader(SPARSE_CHUNK_DONT_CARE, len, 0);
+        _dataLen = 0;
+    }
+    else if (isZero(_data, len))
+    {
+        _chunkHeader(SPARSE_CHUNK_FILL, len, 4);
+        qToLittleEndian<quint32>(0, _header+SPARSE_CHUNK_HEADER_SIZE);
+        _headerLen += 4;
+        _dataLen = 0;
+    }
+    else
+    {
+        _chunkHeader(SPARSE_CHUNK_RAW, len, len);
+        _dataLen = len;
+    }
+
+    _pos += len;
+    _encoded += _headerLen + _dataLen;
+    return true;
+}
+
+/* The header announced _size bytes, there must not be more */
+qint64 SparseImageEncoder::_checkEnd()
+{
+    if (_ended)
+        return 0;
+
+    char c;
+    qint64 n = _read(&c, 1);
+    if (n > 0)
+        _error = QString("Image is larger than the %1 bytes announced").arg(_size);
+    else if (n < 0)
+        _error = QString("Error reading the image");
+    else
+        _ended = true;
+
+    return n ? -1 : 0;
+}
+
+SparseImageSplitter::SparseImageSplitter(qint64 size, int blockSize, qint64 maxPieceSize, const std::function<qint64(char *, qint64)> &read)
+    : _read(read), _size((size + blockSize - 1) / blockSize * blockSize), _pos(0), _encoded(0),
+      _maxPieceSize(qMax(maxPieceSize, (qint64) SparseImageEncoder::SegmentSize + SPARSE_HEADER_SIZE + 3*SPARSE_CHUNK_HEADER_SIZE)),
+      _blockSize(blockSize), _pendingLen(0), _pendingZero(false), _ended(false), _lastChunk(-1)
+{
+    _data = (char *) qMallocAligned(SparseImageEncoder::SegmentSize, 4096);
+}
+
+SparseImageSplitter::~SparseImageSplitter()
+{
+    qFreeAligned(_data);
+}
+
+int SparseImageSplitter::nextPiece(QByteArray &piece)
+{
+    if (_pos == _size && !_pendingLen)
+    {
+        if (_ended)
+            return 0;
+
+        /* The pieces covered _size bytes, there must not be more */
+        char c;
+        qint64 n = _read(&c, 1);
+        if (n > 0)
+            _error = QString("Image is larger than the %1 bytes announced").arg(_size);
+        else if (n < 0)
+            _error = QString("Error reading the image");
+        _ended = true;
+        return n ? -1 : 0;
+    }
+
+    char h[SPARSE_HEADER_SIZE];
+    qToLittleEndian<quint32>(SPARSE_MAGIC, h);
+    qToLittleEndian<quint16>(1, h+4);
+    qToLittleEndian<quint16>(0, h+6);
+    qToLittleEndian<quint16>(SPARSE_HEADER_SIZE, h+8);
+    qToLittleEndian<quint16>(SPARSE_CHUNK_HEADER_SIZE, h+10);
+    qToLittleEndian<quint32>(_blockSize, h+12);
+    qToLittleEndian<quint32>(_size / _blockSize, h+16);
+    /* Number of chunks, filled in at the end */
+    qToLittleEndian<quint32>(0, h+20);
+    qToLittleEndian<quint32>(0, h+24);
+    piece.clear();
+    piece.append(h, SPARSE_HEADER_SIZE);
+    _lastChunk = -1;
+
+    if (_pos)
+        _appendChunk(piece, SPARSE_CHUNK_DONT_CARE, _pos, nullptr);
+
+    bool hasData = false;
+    while (_pos < _size)
+    {
+        if (!_pendingLen && !_readSegment())
+            return -1;
+
+        if (!_pendingLen)
+        {
+            /* Data ended early, the rest is left as it is */
+            if (!hasData)
+            {
+                _pos = _size;
+                return nextPiece(piece);
+            }
+            _appendChunk(piece, SPARSE_CHUNK_DONT_CARE, _size - _pos, nullptr);
+            _pos = _size;
+            break;
+        }
+
+        /* Room for the segment, and for skipping the rest of the image */
+        qint64 cost = SPARSE_CHUNK_HEADER_SIZE + (_pendingZero ? 4 : _pendingLen);
+        if (hasData && piece.size() + cost + SPARSE_CHUNK_HEADER_SIZE > _maxPieceSize)
+            break;
+
+        if (_pendingZero)
+            _appendChunk(piece, SPARSE_CHUNK_FILL, _pendingLen, nullptr);
+        else
+            _appendChunk(piece, SPARSE_CHUNK_RAW, _pendingLen, _data);
+        _pos += _pendingLen;
+        _pendingLen = 0;
+        hasData = true;
+    }
+
+    if (_pos < _size)
+        _appendChunk(piece, SPARSE_CHUNK_DONT_CARE, _size - _pos, nullptr);
+
+    _encoded += piece.size();
+    return 1;
+}
+
+qint64 SparseImageSplitter::inputBytes() const
+{
+    return _pos;
+}
+
+qint64 SparseImageSplitter::encodedBytes() const
+{
+    return _encoded;
+}
+
+QString SparseImageSplitter::errorString() const
+{
+    return _error;
+}
+
+/* Reads the segment at _pos. _pendingLen stays 0 if the data ended before it */
+bool SparseImageSplitter::_readSegment()
+{
+    qint64 len = qMin((qint64) SparseImageEncoder::SegmentSize, _size - _pos);
+    qint64 got = 0;
+
+    while (!_ended && got < len)
+    {
+        qint64 n = _read(_data+got, len-got);
+        if (n < 0)
+        {
+            _error = QString("Error reading the image");
+            return false;
+        }
+        if (n == 0)
+            _ended = true;
+        got += n;
+    }
+    if (!got)
+        return true;
+
+    memset(_data+got, 0, len-got);
+    _pendingLen = len;
+    _pendingZero = SparseImageEncoder::isZero(_data, len);
+    return true;
+}
+
+/* Extends the last chunk of the piece if it is of the same type */
+void SparseImageSplitter::_appendChunk(QByteArray &piece, quint16 type, qint64 len, const char *data)
+{
+    if (_lastChunk >= 0 && qFromLittleEndian<quint16>(piece.constData()+_lastChunk) == type)
+    {
+        char *c = piece.data()+_lastChunk;
+        qToLittleEndian<quint32>(qFromLittleEndian<quint32>(c+4) + len / _blockSize, c+4);
+        if (type == SPARSE_CHUNK_RAW)
+        {
+            qToLittleEndian<quint32>(qFromLittleEndian<quint32>(c+8) + len, c+8);
+            piece.append(data, len);
+        }
+        return;
+    }
+
+    int dataLen = type == SPARSE_CHUNK_RAW ? len : (type == SPARSE_CHUNK_FILL ? 4 : 0);
+    char c[SPARSE_CHUNK_HEADER_SIZE+4];
+    qToLittleEndian<quint16>(type, c);
+    qToLittleEndian<quint16>(0, c+2);
+    qToLittleEndian<quint32>(len / _blockSize, c+4);
+    qToLittleEndian<quint32>(SPARSE_CHUNK_HEADER_SIZE + dataLen, c+8);
+    /* Fill value of zero */
+    qToLittleEndian<quint32>(0, c+SPARSE_CHUNK_HEADER_SIZE);
+
+    _lastChunk = piece.size();
+    piece.append(c, SPARSE_CHUNK_HEADER_SIZE + (type == SPARSE_CHUNK_FILL ? 4 : 0));
+    if (type == SPARSE_CHUNK_RAW)
+        piece.append(data, len);
+
+    char *h = piece.data();
+    qToLittleEndian<quint32>(qFromLittleEndian<quint32>(h+20) + 1, h+20);
+}
+
+bool SparseImageEncoder::isZero(const char *buf, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    if (((quintptr) buf % 16) == 0)
+    {
+        for (; i + 64 <= len; i += 64)
+        {
+            __m128i v = _mm_or_si128(_mm_or_si128(_mm_load_si128((const __m128i *) (buf+i)), _mm_load_si128((const __m128i *) (buf+i+16))),
+                                     _mm_or_si128(_mm_load_si128((const __m128i *) (buf+i+32)), _mm_load_si128((const __m128i *) (buf+i+48))));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+                return false;
+        }
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 64 <= len; i += 64)
+    {
+        uint8x16_t v = vorrq_u8(vorrq_u8(vld1q_u8((const uint8_t *) (buf+i)), vld1q_u8((const uint8_t *) (buf+i+16))),
+                                vorrq_u8(vld1q_u8((const uint8_t *) (buf+i+32)), vld1q_u8((const uint8_t *) (buf+i+48))));
+        uint64x2_t v64 = vreinterpretq_u64_u8(v);
+        if (vgetq_lane_u64(v64, 0) | vgetq_lane_u64(v64, 1))
+            return false;
+    }
+#endif
+
+    for (; i < len; i++)
+    {
+        if (buf[i])
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,108 @@
+#ifndef SPARSEIMAGE_H
+#define SPARSEIMAGE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+#include <QtGlobal>
+#include <functional>
+#include <sys/types.h>
+
+/*
+ * Encodes an image as an Android sparse image while it is read, for boards
+ * whose loader expands those: runs of zeroes are sent as fill chunks
+ * instead of the zeroes themselves.
+ *
+ * The header has to give the number of chunks before any data is read.
+ * So every segment of the image becomes exactly one chunk: a fill chunk
+ * if it is all zeroes, a raw one otherwise. Segments after the data ended
+ * early are skipped with don't care chunks.
+ */
+class SparseImageEncoder
+{
+public:
+    /* Each chunk covers this much of the image, the last one less */
+    static constexpr int SegmentSize = 256 * 1024;
+
+    /* size is that of the image, read() returns up to maxLen bytes of it,
+     * 0 at the end or -1 on error. blockSize is the unit the board writes
+     * in. The image is padded with zeroes to a multiple of it */
+    SparseImageEncoder(qint64 size, int blockSize, const std::function<qint64(char *buf, qint64 maxLen)> &read);
+    ~SparseImageEncoder();
+
+    /* Up to maxLen bytes of the sparse image.
+     * Returns 0 at its end, -1 if reading failed or the image is larger than size */
+    qint64 read(char *buf, qint64 maxLen);
+
+    /* Bytes of the image read and encoded so far */
+    qint64 inputBytes() const;
+    /* Bytes of the sparse image produced so far */
+    qint64 encodedBytes() const;
+    QString errorString() const;
+
+    /* Returns true if buffer only contains zeroes */
+    static bool isZero(const char *buf, size_t len);
+
+protected:
+    std::function<qint64(char *, qint64)> _read;
+    qint64 _size, _pos, _encoded;
+    int _blockSize;
+    /* Chunk being sent: header, then data */
+    char _header[32];
+    int _headerLen, _headerPos;
+    char *_data;
+    qint64 _dataLen, _dataPos;
+    bool _ended;
+    QString _error;
+
+    void _chunkHeader(quint16 type, qint64 len, int dataLen);
+    bool _nextChunk();
+    qint64 _checkEnd();
+};
+
+/*
+ * Encodes an image as a series of Android sparse images of limited size,
+ * for loaders that take one buffer at a time, like fastboot.
+ *
+ * Every piece describes the whole image: don't care chunks skip what the
+ * pieces before and after it hold, so they can be flashed one after the
+ * other. Unlike with SparseImageEncoder, a piece is complete before it is
+ * sent, so neighbouring segments of zeroes or of data share a chunk.
+ */
+class SparseImageSplitter
+{
+public:
+    /* As SparseImageEncoder. No piece is larger than maxPieceSize, which
+     * has to fit at least one segment */
+    SparseImageSplitter(qint64 size, int blockSize, qint64 maxPieceSize, const std::function<qint64(char *buf, qint64 maxLen)> &read);
+    ~SparseImageSplitter();
+
+    /* Encodes the next piece into piece. Returns 1 if there was one, 0 at the
+     * end, -1 if reading failed or the image is larger than size */
+    int nextPiece(QByteArray &piece);
+
+    qint64 inputBytes() const;
+    qint64 encodedBytes() const;
+    QString errorString() const;
+
+protected:
+    std::function<qint64(char *, qint64)> _read;
+    qint64 _size, _pos, _encoded, _maxPieceSize;
+    int _blockSize;
+    /* Segment read that did not fit in the last piece */
+    char *_data;
+    qint64 _pendingLen;
+    bool _pendingZero, _ended;
+    /* Offset of the last chunk header in the piece being encoded, -1 if none */
+    qsizetype _lastChunk;
+    QString _error;
+
+    bool _readSegment();
+    void _appendChunk(QByteArray &piece, quint16 type, qint64 len, const char *data);
+};
+
+#endif // SPARSEIMAGE_H
@@ -0,0 +1,147 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "stationmode.h"
+#include "clidaemon.h"
+#include <QDebug>
+#include <QJsonObject>
+
+StationMode::StationMode(CliDaemon *daemon, const QString &src, const QByteArray &sha256, QObject *parent)
+    : QObject(parent), _daemon(daemon), _src(src), _sha256(sha256), _minSize(0), _maxSize(0),
+      _verify(true), _firstList(true)
+{
+    connect(&_thread, &DriveListModelPollThread::newDriveList, this, &StationMode::onNewDriveList);
+    connect(_daemon, &CliDaemon::jobFinished, this, &StationMode::onJobFinished);
+}
+
+StationMode::~StationMode()
+{
+    _thread.stop();
+    _thread.wait();
+}
+
+void StationMode::setSizeRange(quint64 minSize, quint64 maxSize)
+{
+    _minSize = minSize;
+    _maxSize = maxSize;
+}
+
+bool StationMode::setMatch(const QString &pattern)
+{
+    _match = QRegularExpression(pattern, QRegularExpression::CaseInsensitiveOption);
+    return _match.isValid();
+}
+
+void StationMode::setVerifyEnabled(bool verify)
+{
+    _verify = verify;
+}
+
+void StationMode::start()
+{
+    _daemon->setKeepRunning(true);
+    _daemon->start();
+    _thread.start();
+}
+
+QString StationMode::_mismatch(const Drivelist::DeviceDescriptor &drive) const
+{
+    /* Never on its own, whatever --enable-writing-system-drives says */
+    if (drive.isSystem || drive.isVirtual)
+        return tr("system drive");
+    if (drive.isReadOnly)
+        return tr("read-only");
+    if (_minSize && drive.size < _minSize)
+        return tr("smaller than the minimum size");
+    if (_maxSize && drive.size > _maxSize)
+        return tr("larger than the maximum size");
+    if (!_match.pattern().isEmpty() && !_match.match(QString::fromStdString(drive.description)).hasMatch())
+        return tr("description does not match");
+
+    return QString();
+}
+
+void StationMode::onNewDriveList(std::vector<Drivelist::DeviceDescriptor> list)
+{
+    _present.clear();
+
+    for (const auto &drive : list)
+    {
+        /* Empty card readers */
+        if (!drive.size)
+            continue;
+
+        QString device = QString::fromStdString(drive.device);
+        _present.insert(device);
+        if (_slots.contains(device))
+            continue;
+
+        Slot slot;
+        slot.name = drive.usbPort.empty() ? device : QString::fromStdString(drive.usbPort);
+        QString reason = _firstList ? tr("present at start") : _mismatch(drive);
+        if (!reason.isEmpty())
+        {
+            slot.state = Ignored;
+            _slots.insert(device, slot);
+            _daemon->sendEvent("ignored", slot.name, {{"dst", device}, {"reason", reason}});
+            continue;
+        }
+
+        QString msg;
+        QJsonObject spec{
+            {"id", slot.name},
+            {"src", _src},
+            {"dst", device},
+            {"verify", _verify}
+        };
+        if (!_sha256.isEmpty())
+            spec["sha256"] = QString::fromLatin1(_sha256);
+
+        _daemon->sendEvent("inserted", slot.name, {{"dst", device}, {"description", QString::fromStdString(drive.description)},
+                                                   {"size", (qint64) drive.size}});
+        /* Before adding the job, which may fail right away */
+        slot.state = Writing;
+        _slots.insert(device, slot);
+        if (!_daemon->addJob(spec, msg))
+        {
+            qDebug() << "Cannot write" << device << ":" << msg;
+            _slots[device].state = Done;
+        }
+    }
+    _firstList = false;
+
+    for (auto it = _slots.begin(); it != _slots.end(); )
+    {
+        /* A card taken out while written fails its job, the slot is free once that is reported */
+        if (_present.contains(it.key()) || it->state == Writing)
+        {
+            ++it;
+            continue;
+        }
+        _daemon->sendEvent("removed", it->name, {{"dst", it.key()}});
+        it = _slots.erase(it);
+    }
+}
+
+void StationMode::onJobFinished(const QString &id)
+{
+    for (auto it = _slots.begin(); it != _slots.end(); ++it)
+    {
+        if (it->state != Writing || it->name != id)
+            continue;
+
+        if (_present.contains(it.key()))
+        {
+            /* Stays taken until the card is out, so the same card is not written again */
+            it->state = Done;
+        }
+        else
+        {
+            _daemon->sendEvent("removed", it->name, {{"dst", it.key()}});
+            _slots.erase(it);
+        }
+        break;
+    }
+}
@@ -0,0 +1,84 @@
+#ifndef STATIONMODE_H
+#define STATIONMODE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QObject>
+#include <QHash>
+#include <QRegularExpression>
+#include <QSet>
+#include <QString>
+#include <vector>
+#include "drivelistmodelpollthread.h"
+
+class CliDaemon;
+
+/*
+ * Unattended writing station: every card put in is written with the same image
+ *
+ * Watches the drive list (udev on Linux, system notifications elsewhere,
+ * see DriveListModelPollThread), and queues a CliDaemon job for every
+ * removable drive that appears and matches the size range and the pattern
+ * on its description (vendor and model). The job id is the slot: the USB
+ * port the reader is on, or the device if that is not known, so the events
+ * of a job tell which card is done. With the image's sha256 given, every
+ * card after the first is written from the RAM stage or the extracted
+ * cache, if enabled. Written cards are ejected as usual, and the slot is
+ * free again once its card is taken out.
+ *
+ * Drives that are in when the station starts are left alone, so a drive
+ * that happens to match is not overwritten by starting it.
+ */
+class StationMode : public QObject
+{
+    Q_OBJECT
+public:
+    StationMode(CliDaemon *daemon, const QString &src, const QByteArray &sha256, QObject *parent = nullptr);
+    virtual ~StationMode();
+
+    /* Bytes, 0 for no limit */
+    void setSizeRange(quint64 minSize, quint64 maxSize);
+    /* Case-insensitive, anywhere in the description. Returns false if the pattern is invalid */
+    bool setMatch(const QString &pattern);
+    void setVerifyEnabled(bool verify);
+
+public slots:
+    void start();
+
+protected:
+    enum SlotState
+    {
+        Ignored,
+        Writing,
+        Done
+    };
+    struct Slot
+    {
+        QString name;
+        SlotState state;
+    };
+
+    CliDaemon *_daemon;
+    DriveListModelPollThread _thread;
+    QString _src;
+    QByteArray _sha256;
+    quint64 _minSize, _maxSize;
+    QRegularExpression _match;
+    bool _verify, _firstList;
+    /* By device */
+    QHash<QString, Slot> _slots;
+    /* Devices in the last drive list */
+    QSet<QString> _present;
+
+    /* Empty if the drive is not to be written, the reason otherwise */
+    QString _mismatch(const Drivelist::DeviceDescriptor &drive) const;
+
+protected slots:
+    void onNewDriveList(std::vector<Drivelist::DeviceDescriptor> list);
+    void onJobFinished(const QString &id);
+};
+
+#endif // STATIONMODE_H
@@ -0,0 +1,481 @@
+/*
+ * Benchmark of the TFTP server of simpbootp, without a board
+ *
+ * Usage: tftpbenchmark [--client ti|uboot] [--clients <n>] [--size <MB>]
+ *                      [--blksize <bytes>] [--windowsize <blocks>]
+ *                      [--loss <percent>] [--reorder <percent>]
+ *                      [--latency <ms>] [--jitter <ms>] [--timeout <ms>]
+ *                      [--port <port>] [--seed <n>]
+ *
+ * Serves a random file from a temporary directory on the loopback
+ * interface and fetches it with emulated clients: the TI ROM bootloader
+ * (512 byte blocks in lock-step, no options, no ack of the last block)
+ * or U-Boot (blksize and windowsize options, acks per window, RFC 7440).
+ * Loss, reordering and latency are applied by the clients to the
+ * packets they receive and send, in both directions.
+ *
+ * Reports goodput, blocks the server sent again, duplicate blocks the
+ * clients received and timeouts, and the latency of each block: the time
+ * from sending the ack that makes room for it to receiving it.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "tftpserver.h"
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QRandomGenerator>
+#include <QTemporaryDir>
+#include <QUdpSocket>
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <thread>
+
+/* Client gives up after this many timeouts without getting further */
+#define BENCHMARK_MAX_TIMEOUTS 10
+
+struct Settings
+{
+    bool tiMode = false;
+    int blockSize = 1468;
+    int windowSize = 16;
+    double loss = 0, reorder = 0;
+    qint64 latencyUsec = 0, jitterUsec = 0;
+    int timeoutMsec = 1000;
+    quint16 port = 6969;
+};
+
+struct ClientResult
+{
+    bool ok = false;
+    QString error;
+    quint64 bytes = 0;
+    qint64 usecs = 0;
+    int duplicates = 0;
+    int timeouts = 0;
+    QVector<qint64> latencyUsec;
+};
+
+/*
+ * Packets on their way, in both directions. Each one is dropped, or
+ * delivered after the latency with some jitter. Reordered ones are held
+ * back for another latency plus a millisecond, so later packets overtake them
+ */
+class LossyLink
+{
+public:
+    LossyLink(const Settings &settings, quint32 seed)
+        : _s(settings), _rng(seed)
+    {
+    }
+
+    void add(qint64 now, const QByteArray &packet, bool outgoing)
+    {
+        if (_rng.bounded(100.0) < _s.loss)
+            return;
+
+        qint64 delay = _s.latencyUsec;
+        if (_s.jitterUsec)
+            delay += _rng.bounded(_s.jitterUsec);
+        if (_rng.bounded(100.0) < _s.reorder)
+            delay += _s.latencyUsec + 1000;
+        _queue.insert({now + delay, {packet, outgoing}});
+    }
+
+    /* Next packet due at now, false if there is none */
+    bool take(qint64 now, QByteArray *packet, bool *outgoing)
+    {
+        if (_queue.empty() || _queue.begin()->first > now)
+            return false;
+
+        *packet = _queue.begin()->second.first;
+        *outgoing = _queue.begin()->second.second;
+        _queue.erase(_queue.begin());
+        return true;
+    }
+
+    /* Microseconds until the next packet is due, -1 if there is none */
+    qint64 nextDue(qint64 now) const
+    {
+        return _queue.empty() ? -1 : qMax((qint64) 0, _queue.begin()->first - now);
+    }
+
+private:
+    const Settings &_s;
+    QRandomGenerator _rng;
+    std::multimap<qint64, std::pair<QByteArray, bool>> _queue;
+};
+
+class Client
+{
+public:
+    Client(const Settings &settings, const QByteArray &filename, quint32 seed)
+        : _s(settings), _filename(filename), _link(settings, seed)
+    {
+    }
+
+    ClientResult run()
+    {
+        if (!_socket.bind(QHostAddress::LocalHost, 0))
+        {
+            _result.error = _socket.errorString();
+            return _result;
+        }
+
+        _clock.start();
+        _sendRequest();
+        qint64 lastProgress = _now();
+
+        while (!_done)
+        {
+            QByteArray packet;
+            bool outgoing;
+            while (!_done && _link.take(_now(), &packet, &outgoing))
+            {
+                if (outgoing)
+                {
+                    _socket.writeDatagram(packet, QHostAddress::LocalHost, _serverPort);
+                }
+                else
+                {
+                    quint64 before = _nextBlock;
+                    _receive(packet);
+                    if (_nextBlock != before || _done)
+                        lastProgress = _now();
+                }
+            }
+            if (_done)
+                break;
+
+            if (_now() - lastProgress > _s.timeoutMsec * 1000)
+            {
+                if (++_result.timeouts > BENCHMARK_MAX_TIMEOUTS)
+                {
+                    _result.error = "server stopped answering";
+                    break;
+                }
+                /* Like the clients do: request again, or repeat the last ack */
+                if (_nextBlock == 1 && !_optionsAcked)
+                    _sendRequest();
+                else
+                    _sendAck(_nextBlock-1);
+                lastProgress = _now();
+            }
+
+            qint64 wait = _s.timeoutMsec * 1000 - (_now() - lastProgress);
+            qint64 due = _link.nextDue(_now());
+            if (due >= 0)
+                wait = qMin(wait, due);
+            if (_socket.hasPendingDatagrams() || _socket.waitForReadyRead((int) ((wait + 999) / 1000)))
+            {
+                while (_socket.hasPendingDatagrams())
+                {
+                    QByteArray data(_socket.pendingDatagramSize(), 0);
+                    QHostAddress from;
+                    quint16 fromPort;
+                    _socket.readDatagram(data.data(), data.size(), &from, &fromPort);
+                    _link.add(_now(), data, false);
+                }
+            }
+        }
+
+        _result.usecs = _now();
+        return _result;
+    }
+
+protected:
+    const Settings &_s;
+    QByteArray _filename;
+    LossyLink _link;
+    QUdpSocket _socket;
+    QElapsedTimer _clock;
+    quint16 _serverPort{_s.port};
+    int _blockSize{TFTP_DEFAULT_BLOCK_SIZE};
+    int _windowSize{1};
+    bool _optionsAcked{false};
+    /* Next block expected, counting on where the 16 bit number wraps */
+    quint64 _nextBlock{1};
+    quint64 _lastAcked{0};
+    quint64 _gapAckedAt{0};
+    bool _done{false};
+    /* When the ack was sent that made room for a block */
+    QHash<quint64, qint64> _requestedAt;
+    ClientResult _result;
+
+    qint64 _now()
+    {
+        return _clock.nsecsElapsed() / 1000;
+    }
+
+    void _send(const QByteArray &packet)
+    {
+        _link.add(_now(), packet, true);
+    }
+
+    void _sendRequest()
+    {
+        QByteArray rrq(2, 0);
+        *(uint16_t *) rrq.data() = htons(TFTP::TFTP_CMD_RRQ);
+        rrq += _filename + '\0' + "octet" + '\0';
+        if (!_s.tiMode)
+        {
+            rrq += QByteArray("blksize") + '\0' + QByteArray::number(_s.blockSize) + '\0';
+            rrq += QByteArray("windowsize") + '\0' + QByteArray::number(_s.windowSize) + '\0';
+            rrq += QByteArray("tsize") + '\0' + "0" + '\0';
+        }
+        _markRequested(1);
+        _send(rrq);
+    }
+
+    void _sendAck(quint64 block)
+    {
+        QByteArray ack(4, 0);
+        *(uint16_t *) ack.data() = htons(TFTP::TFTP_CMD_ACK);
+        *(uint16_t *) (ack.data()+2) = htons((uint16_t) block);
+        _lastAcked = block;
+        _markRequested(block+1);
+        _send(ack);
+    }
+
+    /* The ack for the block before first lets the server send a window from first on */
+    void _markRequested(quint64 first)
+    {
+        for (quint64 b = first; b < first + _windowSize; b++)
+        {
+            if (!_requestedAt.contains(b))
+                _requestedAt.insert(b, _now());
+        }
+    }
+
+    void _receive(const QByteArray &packet)
+    {
+        if (packet.size() < 4)
+            return;
+
+        uint16_t opcode = ntohs(*(const uint16_t *) packet.constData());
+        if (opcode == TFTP::TFTP_CMD_ERROR)
+        {
+            _result.error = "server error: " + QString::fromLatin1(packet.constData()+4);
+            _done = true;
+        }
+        else if (opcode == TFTP::TFTP_CMD_OACK)
+        {
+            _onOptions(packet.mid(2));
+        }
+        else if (opcode == TFTP::TFTP_CMD_DATA)
+        {
+            _onData(ntohs(*(const uint16_t *) (packet.constData()+2)), packet.size()-4);
+        }
+    }
+
+    void _onOptions(const QByteArray &options)
+    {
+        if (_optionsAcked)
+        {
+            /* Our ack of the options got lost */
+            _sendAck(0);
+            return;
+        }
+
+        QList<QByteArray> fields = options.split('\0');
+        for (int i = 0; i+1 < fields.size(); i += 2)
+        {
+            if (fields[i] == "blksize")
+                _blockSize = fields[i+1].toInt();
+            else if (fields[i] == "windowsize")
+                _windowSize = fields[i+1].toInt();
+        }
+        _optionsAcked = true;
+        /* Blocks are requested by the ack of the options, not by the request */
+        _requestedAt.clear();
+        _sendAck(0);
+    }
+
+    void _onData(uint16_t num, int len)
+    {
+        if (num != (uint16_t) _nextBlock)
+        {
+            /* Older than expected is a duplicate. Newer means one got lost,
+               acking the last one in order has the server resend from there */
+            if ((uint16_t) (_nextBlock - num) < 0x8000)
+                _result.duplicates++;
+            else if (!_s.tiMode && _gapAckedAt != _nextBlock)
+            {
+                _gapAckedAt = _nextBlock;
+                _sendAck(_nextBlock-1);
+            }
+            return;
+        }
+
+        qint64 requested = _requestedAt.take(_nextBlock);
+        _result.latencyUsec.append(_now() - requested);
+        _result.bytes += len;
+        _nextBlock++;
+
+        if (len < _blockSize)
+        {
+            /* The TI ROM bootloader does not ack the last block */
+            if (!_s.tiMode)
+                _sendAck(_nextBlock-1);
+            _result.ok = true;
+            _done = true;
+            return;
+        }
+
+        if (_nextBlock-1 - _lastAcked >= (quint64) _windowSize)
+            _sendAck(_nextBlock-1);
+    }
+};
+
+static QString percentiles(QVector<qint64> v)
+{
+    if (v.isEmpty())
+        return "-";
+
+    std::sort(v.begin(), v.end());
+    auto at = [&v](double p) { return QString::number(v[qMin((int) (p * v.size()), v.size()-1)] / 1000.0, 'f', 2); };
+    return QString("p50 %1 ms, p99 %2 ms, max %3 ms").arg(at(0.5), at(0.99), at(1.0));
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOptions({
+        {"client", "Client to emulate: ti (ROM bootloader) or uboot", "client", "uboot"},
+        {"clients", "Number of clients fetching the file at the same time", "n", "1"},
+        {"size", "Size of the file in MB", "MB", "32"},
+        {"blksize", "Block size U-Boot asks for", "bytes", "1468"},
+        {"windowsize", "Window size U-Boot asks for", "blocks", "16"},
+        {"loss", "Packets lost in each direction", "percent", "0"},
+        {"reorder", "Packets delivered late, after the ones sent after them", "percent", "0"},
+        {"latency", "One way delay of each packet", "ms", "0"},
+        {"jitter", "Random delay added to the latency", "ms", "0"},
+        {"timeout", "Milliseconds clients wait before repeating their last ack", "ms", "1000"},
+        {"port", "Port the server listens on", "port", "6969"},
+        {"seed", "Seed of the file contents and of the packets lost", "n", "1"},
+    });
+    parser.process(app);
+
+    Settings s;
+    s.tiMode = parser.value("client") == "ti";
+    s.blockSize = parser.value("blksize").toInt();
+    s.windowSize = parser.value("windowsize").toInt();
+    s.loss = parser.value("loss").toDouble();
+    s.reorder = parser.value("reorder").toDouble();
+    s.latencyUsec = parser.value("latency").toDouble() * 1000;
+    s.jitterUsec = parser.value("jitter").toDouble() * 1000;
+    s.timeoutMsec = parser.value("timeout").toInt();
+    s.port = parser.value("port").toUShort();
+    int clients = parser.value("clients").toInt();
+    int megabytes = parser.value("size").toInt();
+    quint32 seed = parser.value("seed").toUInt();
+
+    if ((!s.tiMode && parser.value("client") != "uboot") || clients < 1 || clients > TFTP_MAX_SESSIONS || megabytes <= 0
+        || s.blockSize < 8 || s.windowSize < 1 || s.timeoutMsec <= 0 || !s.port)
+    {
+        parser.showHelp(1);
+    }
+
+    QTemporaryDir dir;
+    QFile f(dir.filePath("benchmark.bin"));
+    if (!dir.isValid() || !f.open(QIODevice::WriteOnly))
+    {
+        std::cerr << "Error creating file to serve" << std::endl;
+        return 1;
+    }
+    QRandomGenerator rng(seed);
+    QByteArray buf(1048576, 0);
+    for (int i = 0; i < megabytes; i++)
+    {
+        rng.fillRange((quint32 *) buf.data(), buf.size() / sizeof(quint32));
+        f.write(buf);
+    }
+    f.close();
+
+    std::atomic<int> retransmits{0};
+    std::atomic<bool> started{false}, stop{false};
+    int startResult = 0;
+    TFTP::Stats serverStats;
+    std::thread server([&]() {
+        TFTP tftp(s.port, TFTP_DEFAULT_BLOCK_SIZE, dir.path());
+        tftp.setTIMode(s.tiMode);
+        tftp.setCommandWaitTimeout(100);
+        tftp.setOnRetransmit([&retransmits](int blocks) { retransmits += blocks; });
+        startResult = tftp.start();
+        started = true;
+        while (startResult == 0 && !stop)
+            tftp.run(true);
+        tftp.stop();
+        serverStats = tftp.stats();
+    });
+    while (!started)
+        std::this_thread::yield();
+    if (startResult != 0)
+    {
+        server.join();
+        std::cerr << "Error starting TFTP server on port " << s.port << std::endl;
+        return 1;
+    }
+
+    std::vector<ClientResult> results(clients);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < clients; i++)
+    {
+        threads.emplace_back([&, i]() {
+            Client client(s, "benchmark.bin", seed + i);
+            results[i] = client.run();
+        });
+    }
+    for (std::thread &t : threads)
+        t.join();
+    stop = true;
+    server.join();
+
+    std::cout << (s.tiMode ? "TI ROM" : "U-Boot") << " client";
+    if (!s.tiMode)
+        std::cout << ", blksize " << s.blockSize << ", windowsize " << s.windowSize;
+    std::cout << ", " << megabytes << " MB, loss " << s.loss << "%, reorder " << s.reorder << "%, latency "
+              << s.latencyUsec / 1000.0 << " ms, jitter " << s.jitterUsec / 1000.0 << " ms" << std::endl;
+
+    bool ok = true;
+    quint64 bytes = 0;
+    qint64 usecs = 0;
+    int duplicates = 0, timeouts = 0;
+    QVector<qint64> latency;
+    for (int i = 0; i < clients; i++)
+    {
+        const ClientResult &r = results[i];
+        std::cout << "client " << std::setw(2) << i << std::fixed << std::setprecision(2);
+        if (!r.ok)
+        {
+            std::cout << "  failed after " << r.bytes << " bytes: " << r.error.toStdString() << std::endl;
+            ok = false;
+            continue;
+        }
+        std::cout << std::setw(10) << r.bytes / (double) qMax(r.usecs, (qint64) 1) << " MB/s"
+                  << std::setw(8) << r.duplicates << " duplicates" << std::setw(6) << r.timeouts << " timeouts  "
+                  << percentiles(r.latencyUsec).toStdString() << std::endl;
+        bytes += r.bytes;
+        usecs = qMax(usecs, r.usecs);
+        duplicates += r.duplicates;
+        timeouts += r.timeouts;
+        latency += r.latencyUsec;
+    }
+
+    std::cout << "total    " << std::setw(10) << bytes / (double) qMax(usecs, (qint64) 1) << " MB/s"
+              << std::setw(8) << duplicates << " duplicates" << std::setw(6) << timeouts << " timeouts  "
+              << percentiles(latency).toStdString() << std::endl;
+    std::cout << "server retransmitted " << retransmits << " blocks, received " << serverStats.acksReceived << " acks, "
+              << serverStats.staleAcks << " stale, " << serverStats.ackTimeouts << " ack timeouts" << std::endl;
+
+    return ok ? 0 : 1;
+}
@@ -24,11 +24,57 @@
 
 #include <qlogging.h>
 #include <QUdpSocket>
+#include <QNetworkInterface>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <vector>
+
+#ifdef __linux__
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#endif
 #include <qthread.h>
 #include <tftpserver.h>
+#include "config.h"
+#include "logging.h"
+#include "pipelinetrace.h"
 
 static char TAG[] = "[simptftp]";
 
+static quint64 transferId(const QHostAddress &addr, uint16_t port)
+{
+    return ((quint64)addr.toIPv4Address() << 16) | port;
+}
+
+// value of the multicast option: address, port, and 1 for the master client
+static QByteArray multicastOption(const QHostAddress &addr, uint16_t port, bool master)
+{
+    return addr.toString().toLatin1() + ',' + QByteArray::number(port) + ',' + (master ? '1' : '0');
+}
+
+// largest block that fits in a packet on the interface the client is on
+static int maxBlockSizeFor(const QHostAddress &addr)
+{
+    const auto interfaces = QNetworkInterface::allInterfaces();
+    for (const QNetworkInterface &iface : interfaces)
+    {
+        const auto entries = iface.addressEntries();
+        for (const QNetworkAddressEntry &entry : entries)
+        {
+            if (entry.ip().protocol() == addr.protocol() && addr.isInSubnet(entry.ip(), entry.prefixLength())
+                && iface.maximumTransmissionUnit() > 0)
+            {
+                // IPv4 and UDP headers, TFTP opcode and block number
+                return qMin(iface.maximumTransmissionUnit() - 32, TFTP_MAX_BLOCK_SIZE);
+            }
+        }
+    }
+    return 1468;
+}
+
 TFTP::TFTP(uint16_t port, int tftp_block_size, QString target_dir)
     : _port{ port },
     _tftpBlockSize{tftp_block_size},
@@ -41,351 +87,892 @@ TFTP::~TFTP()
 {
 }
 
-int TFTP::processWrite()
+// growing file: whether it has data up to end. failed is set if writing it failed
+bool TFTP::growingFileHas(qint64 end, bool *failed)
 {
-    int result = -1;
-    int totalSize = 0;
-    int nextBlockNum = 1;
-    while (1)
+    qint64 size = _growingFileSize;
+    if(size == 0)
     {
-        if(false == _socket->waitForReadyRead(2000))
+        // complete
+        return true;
+    }
+
+    qint64 written = _growingFileWritten;
+    *failed = (written < 0);
+    return written >= qMin(end, size);
+}
+
+/**
+ * Reads new blocks into the window, as long as it has room and the data is there.
+ * Returns how many were added, negative on error
+ */
+int TFTP::fillWindow(Session &session)
+{
+    int added = 0;
+    while (!session.eof && session.window.size() < session.windowSize)
+    {
+        DataBlock block{session.nextBlockNum, nullptr, 0, QByteArray()};
+
+        // a part of a splitted file ends with a short block, like a file.
+        // A sparse part ends where its encoding does
+        int len = (session.splittedFileMode && !session.sparse) ? (int)qMin((qint64)session.blockSize, session.transferSize - session.totalRead) : session.blockSize;
+        qint64 offset = session.transferOffset + session.totalRead;
+        if (session.growing)
         {
-            return -1;
+            // the encoder reads ahead, so a sparse part waits until all of it is written
+            qint64 end = session.sparse ? session.transferOffset + session.transferSize : offset + len;
+            bool failed = false;
+            if (false == growingFileHas(end, &failed))
+            {
+                if (failed)
+                {
+                    qCDebug(lcTftp) << TAG << "writing the image failed";
+                    return -1;
+                }
+                // comes back once the writer got further
+                qint64 written = _growingFileWritten;
+                if (!session.waitingSince.isValid() || written != session.waitingWritten)
+                {
+                    session.waitingSince.start();
+                    session.waitingWritten = written;
+                }
+                else if (session.waitingSince.elapsed() > TFTP_GROWING_FILE_TIMEOUT)
+                {
+                    qCDebug(lcTftp) << TAG << "timeout waiting for the image to reach" << end << "bytes, has" << written;
+                    return -1;
+                }
+                break;
+            }
+            session.waitingSince.invalidate();
         }
 
-        if (_socket->hasPendingDatagrams())
+        if (!session.packets.isEmpty())
         {
-            _readSize = _socket->readDatagram((char*)_buffer, _tftpDataSize, &_clientAddr, &_clientPort);
-            qDebug() << TAG << "Received packet from" << _clientAddr.toString() << ":" << _clientPort;
-            qDebug() << TAG << "Data:" << _buffer; // Print the data in hex format
+            // built with the header already, shared rather than copied
+            block.packet = session.packets.at(session.totalRead / session.blockSize);
+            block.size = block.packet.size() - 4;
+        }
+        else if (session.map && !session.sparse)
+        {
+            // data is sent straight from the mapping
+            block.data = session.map->data + offset;
+            block.size = (int)qBound((qint64)0, session.map->size - offset, (qint64)len);
         }
         else
         {
-            qDebug() << TAG << "No datagram inside received packat!!!";
-            return -1;
+            block.packet = QByteArray(session.blockSize + 4, 0);
+            *(uint16_t*)(block.packet.data()) = htons(TFTP_CMD_DATA);
+            *(uint16_t*)(block.packet.data() + 2) = htons(session.nextBlockNum);
+            if (len > 0)
+            {
+                block.size = session.sparse ? readSparse(session, (uint8_t*)block.packet.data() + 4, len)
+                                            : onReadData(session, (uint8_t*)block.packet.data() + 4, len);
+                if (block.size < 0)
+                {
+                    return -1;
+                }
+            }
+            block.packet.truncate(block.size + 4);
         }
 
-        if (_readSize < 0)
+        session.totalRead += block.size;
+        session.eof = (block.size < session.blockSize);
+        session.nextBlockNum++;
+        session.window.append(block);
+        added++;
+    }
+    return added;
+}
+
+/**
+ * Fills buffer with the next len bytes of the sparse image, less only at its end.
+ * Returns negative on error
+ */
+int TFTP::readSparse(Session &session, uint8_t *buffer, int len)
+{
+    int got = 0;
+    while (got < len)
+    {
+        qint64 n = session.sparse->read((char*)buffer + got, len - got);
+        if (n < 0)
         {
-            qDebug(TAG, "error on receive");
-            break;
+            qCDebug(lcTftp) << TAG << "encoding sparse image failed:" << session.sparse->errorString();
+            return -1;
         }
-
-        uint16_t code = ntohs(*(uint16_t*)(&_buffer[0]));
-        if ( code != TFTP_CMD_DATA )
+        if (n == 0)
         {
-            qDebug() << TAG << "not data packet received: [" << code << "]";
-            qDebug() << TAG << _buffer << _readSize;
-            if ( ( code == TFTP_CMD_WRQ ) && ( nextBlockNum == 1 ) )
-            {
-                // some clients repeat request several times
-                sendAck(0);
-                continue;
-            }
-            result = 1; // repeat
             break;
         }
-        uint16_t blockNum = ntohs(*(uint16_t*)(&_buffer[2]));
-        int dataSize = _readSize - 4;
-        sendAck(blockNum);
-        if ( blockNum < nextBlockNum )
+        got += n;
+    }
+    return got;
+}
+
+/**
+ * Tops up the window and sends all of it again, or just the new blocks.
+ * Returns negative if the transfer failed
+ */
+int TFTP::sendWindow(Session &session, bool resend)
+{
+    int firstNew = session.window.size();
+    if (fillWindow(session) < 0)
+    {
+        qCDebug(lcTftp) << TAG << "Failed to read data from file";
+        sendError(session, ERR_ILLEGAL_OPERATION, "failed to read file");
+        return -ERR_ILLEGAL_OPERATION;
+    }
+
+    int from = resend ? 0 : firstNew;
+    if (from < session.window.size())
+    {
+        if (!sendBlocks(session, from))
         {
-            // Maybe this is dup, ignore it
-            qDebug() << TAG << "dup packet received: [" << blockNum << "], expected [" << nextBlockNum << "]";
+            return -1;
         }
-        else
+        session.lastSent.start();
+        if (resend && firstNew > 0)
         {
-            nextBlockNum++;
-            totalSize += dataSize;
-            onWriteData(&_buffer[4], dataSize);
-            qDebug() << TAG << "Block size: " <<  dataSize;
+            // an ack could be for either copy, so it tells nothing about the round trip time
+            session.timing = false;
+            if (_onRetransmit != nullptr) _onRetransmit(firstNew);
         }
-        if (_readSize < _tftpDataSize)
+        else if (!session.timing)
         {
-            qDebug() << TAG << "file received: (" << totalSize << " bytes)";
-            result = 0;
-            break;
+            session.timing = true;
+            session.timedBlockNum = session.window.last().num;
+            session.timedSince.start();
         }
     }
-    return result;
+    return 0;
 }
 
-int TFTP::processRead()
+void TFTP::onAck(Session &session, uint16_t blockNum)
 {
-    int result = -ERR_NOT_DEFINED;
-    int blockNum = 1;
-    int totalSize = 0;
-    int count = 0;
-    qDebug() << "process read loop started";
-
-    for(;;)
+    if (isListening(session))
     {
-        *(uint16_t*)(&_buffer[0]) = htons(TFTP_CMD_DATA);
-        *(uint16_t*)(&_buffer[2]) = htons(blockNum);
+        // only the master client of a group acks
+        return;
+    }
 
-        if(_splittedFileMode && ((totalSize + _tftpBlockSize) > _splitModeSize))
+    if (!session.oack.isEmpty())
+    {
+        // client acks the options with block 0. The master client of a multicast
+        // group acks the last block it has in order, as it may have listened before
+        if (blockNum != 0 && !session.group)
         {
-            _splittedFileMode = false;
-            _readSize = 0;
+            _stats.staleAcks++;
+            qCDebugLimited(lcTftp) << TAG << "received ack not in order";
+            return;
         }
-        else
+        if (session.retries == 0)
+        {
+            updateRtt(session, session.lastSent.nsecsElapsed() / 1000);
+        }
+        session.oack.clear();
+        session.retries = 0;
+        session.waitedMilliSec = 0;
+        if (session.group)
         {
-            _readSize = onReadData( &_buffer[4], _tftpBlockSize );
-            if (_readSize < 0)
+            seekBlock(session, blockNum);
+            if (session.eof)
             {
-                qDebug(TAG, "Failed to read data from file");
-                sendError(ERR_ILLEGAL_OPERATION, "failed to read file");
-                result = -ERR_ILLEGAL_OPERATION;
-                break;
+                // got all of it while listening
+                finishSession(session, true);
+                return;
             }
         }
+        qCDebug(lcTftp) << TAG << "sending file: " << session.name << "block size" << session.blockSize << "window size" << session.windowSize
+                        << (session.group ? "to " + session.group->addr.toString() : QString());
+        if (sendWindow(session, false) < 0)
+        {
+            finishSession(session, false);
+        }
+        return;
+    }
 
+    // block numbers wrap around
+    uint16_t acked = blockNum - session.firstBlockNum + 1;
+    if (acked > session.window.size())
+    {
+        // old or duplicate ack
+        _stats.staleAcks++;
+        qCDebugLimited(lcTftp) << TAG << "received ack not in order";
+        return;
+    }
+    if (acked == 0)
+    {
+        // client did not get the first block of the window. Resent at once, unless this is
+        // just another copy of the ack for the window that was resent less than a round trip ago
+        if (session.srttUsec > 0 && session.lastSent.nsecsElapsed() / 1000 < session.srttUsec)
+        {
+            return;
+        }
+        // each resend restarts the timeout, so these count against the retries as a timeout
+        // would. Otherwise a client stuck on the same ack would keep the transfer going forever
+        session.waitedMilliSec += session.lastSent.elapsed();
+        if (++session.retries >= TFTP_MAX_RETRIES && session.waitedMilliSec >= TFTP_GIVE_UP_TIMEOUT)
+        {
+            qCDebug(lcTftp) << TAG << "client keeps acking the same block, giving up on" << session.name;
+            finishSession(session, false);
+            return;
+        }
+        if (sendWindow(session, true) < 0)
+        {
+            finishSession(session, false);
+        }
+        return;
+    }
 
-        // qDebug() << TAG <<  "Sending data to " << _clientAddr.toString().data() <<
-        //         ", blockNumber=" << blockNum << ", size=" << dataSize;
+    if (session.timing && (uint16_t)(session.timedBlockNum - session.firstBlockNum) < acked)
+    {
+        updateRtt(session, session.timedSince.nsecsElapsed() / 1000);
+        session.timing = false;
+    }
 
-        for(int r=0; r<3; r++)
+    session.retries = 0;
+    session.waitedMilliSec = 0;
+    for (int i = 0; i < acked; i++)
+    {
+        session.totalSize += session.window.takeFirst().size;
+    }
+    session.firstBlockNum += acked;
+
+    // update progress, by the part of the file a sparse image covers so far
+    qint64 done = session.sparse ? session.sparse->inputBytes() : session.totalSize;
+    _progress = (float)(session.transferOffset + qMin(done, session.transferSize)) / (float)session.fileSize;
+    if (_progressUpdateCallback != nullptr) _progressUpdateCallback(session.name, _progress);
+
+    if (session.eof && session.window.isEmpty())
+    {
+        finishSession(session, true);
+        return;
+    }
+
+    // ack for less than we sent: the client lost the next block, so the rest goes again (RFC 7440)
+    if (sendWindow(session, !session.window.isEmpty()) < 0)
+    {
+        finishSession(session, false);
+    }
+}
+
+// upload: blocks are acked one by one, the client sends the next one once it has the ack
+void TFTP::onData(Session &session, uint16_t blockNum, uint8_t *data, int len)
+{
+    _stats.dataReceived++;
+    if (blockNum != session.nextBlockNum)
+    {
+        // the ack of the last block got lost
+        _stats.duplicatesReceived++;
+        qCDebugLimited(lcTftp) << TAG << "dup packet received: [" << blockNum << "], expected [" << session.nextBlockNum << "]";
+        if (blockNum == (uint16_t)(session.nextBlockNum - 1))
         {
-            auto sendSize = _readSize + 4;
-            auto writeSize = _socket->writeDatagram((char*)_buffer, sendSize, _clientAddr, _clientPort);
-            if(-1 == writeSize || writeSize != sendSize)
+            sendUploadReply(session);
+        }
+        return;
+    }
+
+    session.oack.clear();
+    session.nextBlockNum++;
+    session.retries = 0;
+    session.waitedMilliSec = 0;
+    if (onWriteData(session, data, len) < 0)
+    {
+        sendError(session, ERR_NO_SPACE, "file too large");
+        finishSession(session, false);
+        return;
+    }
+    session.totalSize += len;
+    sendUploadReply(session);
+
+    if (len < session.blockSize)
+    {
+        finishSession(session, true);
+    }
+}
+
+void TFTP::sendUploadReply(Session &session)
+{
+    if (!session.oack.isEmpty())
+    {
+        QByteArray packet(2, 0);
+        *(uint16_t *)(packet.data()) = htons(TFTP_CMD_OACK);
+        packet += session.oack;
+        _socket->writeDatagram(packet, session.clientAddr, session.clientPort);
+    }
+    else
+    {
+        sendAck(session, session.nextBlockNum - 1);
+    }
+    session.lastSent.start();
+}
+
+// Jacobson/Karels estimator as in RFC 6298, with the timeout kept within what boards on a direct link need
+void TFTP::updateRtt(Session &session, qint64 usec)
+{
+    if (session.srttUsec < 0)
+    {
+        session.srttUsec = usec;
+        session.rttvarUsec = usec / 2;
+    }
+    else
+    {
+        session.rttvarUsec = (3 * session.rttvarUsec + qAbs(session.srttUsec - usec)) / 4;
+        session.srttUsec = (7 * session.srttUsec + usec) / 8;
+    }
+
+    if (!session.fixedTimeout)
+    {
+        qint64 rto = (session.srttUsec + 4 * session.rttvarUsec) / 1000;
+        session.ackTimeoutMilliSec = (int)qBound((qint64)TFTP_MIN_ACK_TIMEOUT, rto, (qint64)TFTP_MAX_ACK_TIMEOUT);
+    }
+}
+
+bool TFTP::backOff(Session &session)
+{
+    session.waitedMilliSec += session.ackTimeoutMilliSec;
+    if (!session.fixedTimeout)
+    {
+        session.ackTimeoutMilliSec = qMin(2 * session.ackTimeoutMilliSec, TFTP_MAX_ACK_TIMEOUT);
+    }
+    return ++session.retries < TFTP_MAX_RETRIES || session.waitedMilliSec < TFTP_GIVE_UP_TIMEOUT;
+}
+
+// resends what was not acked in time, and gives up on clients that stopped answering
+void TFTP::onTimeouts()
+{
+    const QList<std::shared_ptr<Session>> sessions = _sessions.values();
+    for (const std::shared_ptr<Session> &ptr : sessions)
+    {
+        Session &session = *ptr;
+
+        if (isListening(session))
+        {
+            continue;
+        }
+
+        if (session.upload)
+        {
+            // the client did not get the last ack, or stopped sending
+            if (session.lastSent.elapsed() < session.ackTimeoutMilliSec)
             {
-                qDebug() << TAG << "_splittedFileMode: " << _splittedFileMode;
-                qDebug() << TAG << "_tftpBlokSize: " << _tftpBlockSize;
-                qDebug() << TAG << "_splitModeSize: " << _splitModeSize;
-                qDebug() << TAG << "totalSize: " << totalSize;
-                qDebug() << TAG << "sendSize: " << sendSize;
-                qDebug() << TAG << "Extended block size request reject failed! Expected " << _readSize + 4 << "got " << writeSize;
-                result = -1;
-                break;
+                continue;
             }
+            if (!backOff(session))
+            {
+                qCDebug(lcTftp) << TAG << "No data, giving up on receiving" << session.name;
+                finishSession(session, false);
+                continue;
+            }
+            sendUploadReply(session);
+            continue;
+        }
 
-            if (waitForAck(blockNum) == 0)
+        if (session.window.isEmpty() && session.oack.isEmpty())
+        {
+            // waiting for a growing file
+            if (sendWindow(session, false) < 0)
             {
-                result = 0;
-                break;
+                finishSession(session, false);
             }
+            continue;
+        }
 
-            qDebug() << TAG << "No ack/wrong ack, retrying";
-            result = -1;
+        if (session.lastSent.elapsed() < session.ackTimeoutMilliSec)
+        {
+            continue;
+        }
 
-            // TI ROM Bootloader do not send last ack ignore it
-            if(writeSize < _tftpBlockSize && _tftpTIMode)
+        if (!session.oack.isEmpty())
+        {
+            if (!backOff(session))
             {
-                qDebug() << "TI Mode skipping last ack!";
-                result = 0;
-                break;
+                qCDebug(lcTftp) << TAG << "client did not acknowledge options";
+                _hasError = true;
+                finishSession(session, false);
+                continue;
             }
+            QByteArray packet(2, 0);
+            *(uint16_t *)(packet.data()) = htons(TFTP_CMD_OACK);
+            packet += session.oack;
+            _socket->writeDatagram(packet, session.clientAddr, session.clientPort);
+            session.lastSent.start();
+            continue;
         }
-        if ( result < 0 )
+
+        // TI ROM Bootloader do not send last ack ignore it. It does not know windowsize
+        if (_tftpTIMode && session.windowSize == 1 && session.eof && session.window.size() == 1)
         {
-            break;
+            qCDebug(lcTftp) << "TI Mode skipping last ack!";
+            onAck(session, session.firstBlockNum);
+            continue;
         }
 
-        _progressUpdateCallback(_progress);
-        totalSize += _readSize;
+        if (!backOff(session))
+        {
+            qCDebug(lcTftp) << TAG << "No ack/wrong ack, giving up";
+            finishSession(session, false);
+            continue;
+        }
 
-        // update progress
-        if(_splittedFileMode)
+        _stats.ackTimeouts++;
+        qCDebugLimited(lcTftp) << TAG << "No ack/wrong ack, retrying after" << session.ackTimeoutMilliSec << "ms";
+        if (sendWindow(session, true) < 0)
         {
-            _progress = (float)((float)(_splitModeSize * _seekPartPos) + (float)totalSize) / (float)_curFile.size();
+            finishSession(session, false);
         }
-        else
+    }
+}
+
+void TFTP::finishSession(Session &session, bool success)
+{
+    if (session.upload)
+    {
+        onClose(session);
+        std::shared_ptr<Session> keep = _sessions.take(transferId(session.clientAddr, session.clientPort));
+        if (success)
+        {
+            qCDebug(lcTftp) << TAG << "file received: (" << session.totalSize << " bytes)" << session.nextBlockNum - 1 << "blocks from"
+                            << session.clientAddr.toString() << "," << _stats.duplicatesReceived << "duplicates since start";
+            if (_onWriteSuccess != nullptr) _onWriteSuccess(session.name, session.uploadData);
+        }
+        return;
+    }
+
+    if (success)
+    {
+        _lastFileName = session.name;
+        qCDebug(lcTftp) << TAG << "Sent file " << _lastFileName << "(" << session.totalSize << " bytes ) to" << session.clientAddr.toString()
+                        << "rtt" << session.srttUsec << "us timeout" << session.ackTimeoutMilliSec << "ms,"
+                        << _stats.staleAcks << "stale acks and" << _stats.ackTimeouts << "ack timeouts since start";
+        if(_lastFileName == "tiboot3.bin")
         {
-            _progress = (float)totalSize / (float)_curFile.size();
+            _tiboot3Sent = true;
         }
+    }
+
+    onClose(session);
+    std::shared_ptr<Session> keep = _sessions.take(transferId(session.clientAddr, session.clientPort));
+    leaveGroup(session);
+    if (success && _onReadSuccess != nullptr) _onReadSuccess(_lastFileName);
+    if (!success && _onReadFailure != nullptr) _onReadFailure(session.name);
+}
 
+int TFTP::nextTimeout()
+{
+    qint64 timeout = _tftpCommandWaitTimeoutMilliSec;
+    for (const std::shared_ptr<Session> &session : std::as_const(_sessions))
+    {
+        if (isListening(*session))
+        {
+            continue;
+        }
+        if (session->window.isEmpty() && session->oack.isEmpty() && !session->upload)
+        {
+            // poll the growing file
+            timeout = qMin(timeout, (qint64)10);
+        }
+        else
+        {
+            timeout = qMin(timeout, qMax((qint64)0, session->ackTimeoutMilliSec - session->lastSent.elapsed()));
+        }
+    }
+    return (int)timeout;
+}
 
-        if (_readSize < _tftpBlockSize)
+bool TFTP::sendBlocks(const Session &session, int from)
+{
+    TraceSpan span("tftpSend");
+    const QList<DataBlock> &blocks = session.window;
+    // the master client of a group acks the blocks, they go to all of it
+    const QHostAddress &to = session.group ? session.group->addr : session.clientAddr;
+    uint16_t toPort = session.group ? session.group->port : session.clientPort;
+#ifdef __linux__
+    if (session.map || !session.packets.isEmpty())
+    {
+        // whole window with one system call, headers and data gathered from separate buffers
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(toPort);
+        addr.sin_addr.s_addr = htonl(to.toIPv4Address());
+
+        int count = blocks.size() - from;
+        std::vector<uint16_t> headers(count * 2);
+        std::vector<struct iovec> iov(count * 2);
+        std::vector<struct mmsghdr> msgs(count);
+        for (int i = 0; i < count; i++)
         {
-            _lastFileName = QByteArray::fromStdString(std::filesystem::path( _curFile.fileName().toStdString()).filename().string());
-            if(_lastFileName == "uniflash")
+            const DataBlock &block = blocks[from + i];
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(addr);
+            msgs[i].msg_hdr.msg_iov = &iov[i*2];
+            if (block.data == nullptr)
             {
-                _lastFileName.append(std::to_string(_seekPartPos));
-                qDebug() << "_lastFileName: " << _lastFileName;
+                // packet built with its header, preloaded or sparse
+                iov[i*2].iov_base = (void *)block.packet.constData();
+                iov[i*2].iov_len = block.packet.size();
+                msgs[i].msg_hdr.msg_iovlen = 1;
+                continue;
             }
+            headers[i*2] = htons(TFTP_CMD_DATA);
+            headers[i*2+1] = htons(block.num);
+            iov[i*2].iov_base = &headers[i*2];
+            iov[i*2].iov_len = 4;
+            iov[i*2+1].iov_base = (void *)block.data;
+            iov[i*2+1].iov_len = block.size;
+            msgs[i].msg_hdr.msg_iovlen = 2;
+        }
 
-            qDebug() << TAG << "Sent file " << _lastFileName << "(" << totalSize << " bytes )";
-            if(_lastFileName == "tiboot3.bin")
+        int fd = _socket->socketDescriptor();
+        int sent = 0;
+        while (sent < count)
+        {
+            int r = ::sendmmsg(fd, msgs.data() + sent, count - sent, 0);
+            if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                // send buffer full, QUdpSocket is non-blocking
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                ::poll(&pfd, 1, 100);
+                continue;
+            }
+            if (r < 0 && errno == EINTR)
             {
-                _tiboot3Sent = true;
+                continue;
+            }
+            if (r < 0)
+            {
+                qCDebug(lcTftp) << TAG << "sendmmsg failed:" << strerror(errno);
+                return false;
             }
+            sent += r;
+        }
+        return true;
+    }
+#endif
 
-            totalSize = 0;
-            result = 0;
-            break;
+    for (int i = from; i < blocks.size(); i++)
+    {
+        const QByteArray &packet = blocks[i].packet;
+        auto writeSize = _socket->writeDatagram(packet, to, toPort);
+        if(-1 == writeSize || writeSize != packet.size())
+        {
+            qCDebug(lcTftp) << TAG << "splittedFileMode: " << session.splittedFileMode;
+            qCDebug(lcTftp) << TAG << "blockSize: " << session.blockSize;
+            qCDebug(lcTftp) << TAG << "sendSize: " << packet.size();
+            qCDebug(lcTftp) << TAG << "Extended block size request reject failed! Expected " << packet.size() << "got " << writeSize;
+            return false;
         }
-        blockNum++;
     }
-    if (result >= 0 && _onReadSuccess != nullptr) _onReadSuccess(_lastFileName);
-    return result;
+    return true;
 }
 
-void TFTP::sendAck(uint16_t blockNum)
+void TFTP::sendAck(const Session &session, uint16_t blockNum)
 {
     uint8_t data[4];
 
     *(uint16_t*)(&data[0]) = htons(TFTP_CMD_ACK);
     *(uint16_t*)(&data[2]) = htons(blockNum);
-    qDebug() << TAG <<  "ack to " << _clientAddr.toString().data() << ", blockNumber=" << blockNum;
+    qCTrace(lcTftp) << TAG <<  "ack to " << session.clientAddr.toString() << ", blockNumber=" << blockNum;
+    _stats.acksSent++;
 
     auto sendSize = sizeof(data);
-    auto writeSize = _socket->writeDatagram((char*)data, sendSize, _clientAddr, _clientPort);
+    auto writeSize = _socket->writeDatagram((char*)data, sendSize, session.clientAddr, session.clientPort);
     if(-1 == writeSize || writeSize != sendSize)
     {
-        qDebug() << TAG << "Extended block size request reject failed! Expected " << sendSize << "got " << writeSize;
+        qCDebug(lcTftp) << TAG << "Extended block size request reject failed! Expected " << sendSize << "got " << writeSize;
     }
 }
 
 void TFTP::sendError(uint16_t code, const char *message)
+{
+    Session session;
+    session.clientAddr = _clientAddr;
+    session.clientPort = _clientPort;
+    sendError(session, code, message);
+}
+
+void TFTP::sendError(const Session &session, uint16_t code, const char *message)
 {
     *(uint16_t *)(&_buffer[0]) = htons(TFTP_CMD_ERROR);
     *(uint16_t *)(&_buffer[2]) = htons(code);
     strcpy((char *)(&_buffer[4]), message);
     auto sendSize = 4 + strlen(message) + 1;
-    auto writeSize = _socket->writeDatagram((char*)_buffer, sendSize, _clientAddr, _clientPort);
+    auto writeSize = _socket->writeDatagram((char*)_buffer, sendSize, session.clientAddr, session.clientPort);
     if(-1 == writeSize || writeSize != sendSize)
     {
-        qDebug() << TAG << "Extended block size request reject failed! Expected " << sendSize + 4 << "got " << writeSize;
+        qCDebug(lcTftp) << TAG << "Extended block size request reject failed! Expected " << sendSize + 4 << "got " << writeSize;
     }
 
     if(false == _socket->waitForBytesWritten())
     {
-        qDebug() << TAG << "Extended block size request reject failed!";
+        qCDebug(lcTftp) << TAG << "Extended block size request reject failed!";
     }
 }
 
-int TFTP::waitForAck(uint16_t blockNum)
+char *TFTP::requestString(uint8_t *&ptr)
 {
-    uint8_t data[4];
-    qint64 readSize = 0;
-
-    // qDebug() << TAG << "waiting for ack";
+    // run() put a NUL at the end, a string that is cut off stops there
+    uint8_t *end = _buffer + _readSize;
+    char *string = (char *)ptr;
+    ptr = qMin(ptr + strnlen(string, end - ptr) + 1, end);
+    return string;
+}
 
-    if(false == _socket->waitForReadyRead(2000))
+int TFTP::parseWrq(Session &session)
+{
+    uint8_t *ptr = _buffer + 2;
+    uint8_t *end = _buffer + _readSize;
+    char *filename = requestString(ptr);
+    requestString(ptr); // mode
+    if ( onWrite(session, filename) < 0)
     {
-        return -ERR_PROC_TIMEOUT;
+        qCDebug(lcTftp) << TAG << "failed to open file " <<  filename << " for writing";
+        sendError(session, ERR_ACCESS_VIOLATION, "cannot open file");
+        return -ERR_ACCESS_VIOLATION;
     }
 
-    if (_socket->hasPendingDatagrams())
+    // uploads are small, they stay at the default block size. Asked for another one, the client is told so
+    bool blksize = false;
+    while (ptr < end)
     {
-        readSize = _socket->readDatagram((char*)data, sizeof(data), &_clientAddr, &_clientPort);
-        // qDebug() << TAG << "Received packet from" << _clientAddr.toString() << ":" << _clientPort;
-        // qDebug() << TAG << "Data:" << data; // Print the data in hex format
-    }
-    else
-    {
-        qDebug() << TAG << "No datagram inside received packat!!!";
-        return -ERR_NOT_DEFINED;
+        char *name = requestString(ptr);
+        if (ptr >= end)
+        {
+            break;
+        }
+        requestString(ptr); // value
+        blksize = blksize || !qstricmp(name, "blksize");
     }
-
-    uint16_t cmd = ntohs(*(uint16_t *)(&data[0]));
-    if (readSize != sizeof(data) || (cmd != TFTP_CMD_ACK))
+    if (blksize)
     {
-        qDebug() << TAG << "received wrong ack packet: " << cmd;
-        sendError(ERR_NOT_DEFINED, "incorrect ack");
-        return -ERR_NOT_DEFINED;
+        qCDebug(lcTftp) << TAG << "Extended block size is requested. rejecting";
+        session.oack = QByteArray("blksize") + '\0' + QByteArray::number(session.blockSize) + '\0';
     }
 
-    if (ntohs(*(uint16_t *)(&data[2])) != blockNum)
-    {
-        qDebug() << TAG << "received ack not in order";
-        return 1;
-    }
+    qCDebug(lcTftp) << TAG << "receiving file: " << filename;
+    sendUploadReply(session);
     return 0;
 }
 
-int TFTP::parseWrq()
+int TFTP::parseRrq(Session &session)
 {
-    uint8_t *ptr = (uint8_t*)(_buffer + 2);
-    char *filename = (char *)ptr;
-    ptr += strlen(filename) + 1;
-    char *mode = (char *)ptr;
-    ptr += strlen(mode) + 1;
-    if ( onWrite(filename) < 0)
+    uint8_t *ptr = _buffer + 2;
+    uint8_t *end = _buffer + _readSize;
+    char *filename = requestString(ptr);
+    requestString(ptr); // mode
+    if ( onRead(session, filename) < 0)
     {
-        qDebug() << TAG << "failed to open file " <<  filename << " for writing";
-        sendError(ERR_ACCESS_VIOLATION, "cannot open file");
-        return -ERR_ACCESS_VIOLATION;
+        qCDebug(lcTftp) << TAG << "failed to open file " << filename << "for reading";
+        sendError(session, ERR_FILE_NOT_FOUND, "cannot open file");
+        _hasError = true;
+        return -ERR_FILE_NOT_FOUND;
     }
-    if ( (ptr - _buffer < _readSize) && !strcmp((char *)ptr, "blksize") )
+
+    // options (RFC 2347) follow as name and value pairs
+    session.blockSize = _tftpBlockSize;
+    bool multicast = false;
+    while (ptr < end)
     {
-        uint8_t data[] = { 0, 6, 'b', 'l', 'k', 's', 'i', 'z', 'e', 0, '5', '1', '2', 0 };
-        if(-1 == _socket->writeDatagram((char*)data, sizeof(data), _clientAddr, _clientPort))
+        char *name = requestString(ptr);
+        if (ptr >= end)
         {
-            qDebug() << TAG << "Extended block size request reject failed!";
-            return -1;
+            break;
+        }
+        char *value = requestString(ptr);
+
+        if (!qstricmp(name, "blksize") && atoi(value) >= 8)
+        {
+            // RFC 2348
+            session.blockSize = qMin(atoi(value), maxBlockSizeFor(session.clientAddr));
+            session.oack += QByteArray("blksize") + '\0' + QByteArray::number(session.blockSize) + '\0';
+        }
+        else if (!qstricmp(name, "tsize") && session.sparse)
+        {
+            // only known once the part is encoded, RFC 2349 lets the server leave it out
+            qCDebug(lcTftp) << TAG << "no transfer size for a sparse image";
+        }
+        else if (!qstricmp(name, "tsize"))
+        {
+            // RFC 2349
+            session.oack += QByteArray("tsize") + '\0' + QByteArray::number(session.transferSize) + '\0';
+        }
+        else if (!qstricmp(name, "timeout") && atoi(value) >= 1 && atoi(value) <= 255)
+        {
+            // RFC 2349, has to be accepted as is
+            session.ackTimeoutMilliSec = atoi(value) * 1000;
+            session.fixedTimeout = true;
+            session.oack += QByteArray("timeout") + '\0' + QByteArray::number(atoi(value)) + '\0';
         }
+        else if (!qstricmp(name, "windowsize"))
+        {
+            session.windowSize = qBound(1, atoi(value), _maxWindowSize);
+            session.oack += QByteArray("windowsize") + '\0' + QByteArray::number(session.windowSize) + '\0';
+        }
+        else if (!qstricmp(name, "multicast"))
+        {
+            // RFC 2090, answered once the block size is known
+            multicast = true;
+        }
+        else
+        {
+            qCDebug(lcTftp) << TAG << "ignoring option" << name << value;
+        }
+    }
 
-        qDebug() << TAG << "Extended block size is requested. rejecting";
+    if (session.preload)
+    {
+        QVector<QByteArray> &packets = session.preload->packets[session.blockSize];
+        if (packets.isEmpty())
+        {
+            packets = buildPackets(session.preload->data, session.blockSize);
+        }
+        session.packets = packets;
     }
-    else
+
+    // a window of jumbo frames is more than the default socket buffer holds
+    growSendBuffer(2 * session.windowSize * (session.blockSize + 32));
+
+    if (multicast && joinGroup(session))
     {
-        sendAck(0);
+        session.oack += QByteArray("multicast") + '\0' + multicastOption(session.group->addr, session.group->port, session.master) + '\0';
     }
-    qDebug() << TAG << "receiving file: " << filename;
-    return 0;
+
+    if (!session.oack.isEmpty())
+    {
+        // the client acks the options with block 0, data follows then
+        QByteArray packet(2, 0);
+        *(uint16_t *)(packet.data()) = htons(TFTP_CMD_OACK);
+        packet += session.oack;
+        auto writeSize = _socket->writeDatagram(packet, session.clientAddr, session.clientPort);
+        if(-1 == writeSize || writeSize != packet.size())
+        {
+            qCDebug(lcTftp) << TAG << "Sending option acknowledgement failed!";
+            return -1;
+        }
+        session.lastSent.start();
+        if (isListening(session))
+        {
+            // does not ack the options, it waits for its turn as master
+            session.oack.clear();
+            qCDebug(lcTftp) << TAG << session.clientAddr.toString() << "listens for" << session.name << "on" << session.group->addr.toString();
+        }
+        return 0;
+    }
+
+    qCDebug(lcTftp) << TAG << "sending file: " << filename << "block size" << session.blockSize << "window size" << session.windowSize;
+    return sendWindow(session, false);
 }
 
-int TFTP::parseRrq()
+
+// never shrinks it, other sessions may have windows that large in flight
+void TFTP::growSendBuffer(int bytes)
 {
-    uint8_t *ptr = _buffer + 2;
-    char *filename = (char *)ptr;
-    ptr += strlen(filename) + 1;
-    char *mode = (char *)ptr;
-    ptr += strlen(mode) + 1;
-    if ( onRead(filename) < 0)
-    {
-        qDebug() << TAG << "failed to open file " << filename << "for reading";
-        sendError(ERR_FILE_NOT_FOUND, "cannot open file");
-        _hasError = true;
-        return -ERR_FILE_NOT_FOUND;
+    if (bytes <= _sendBufferSize)
+    {
+        return;
     }
-    qDebug() << TAG << "sending file: " << filename;
-    return 0;
-}
+    _sendBufferSize = bytes;
 
+#ifdef __linux__
+    // SO_SNDBUF is capped at net.core.wmem_max, simpbootp is privileged enough to go past it
+    if (0 == setsockopt(_socket->socketDescriptor(), SOL_SOCKET, SO_SNDBUFFORCE, &bytes, sizeof(bytes)))
+    {
+        return;
+    }
+#endif
+    _socket->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, bytes);
+}
 
 int TFTP::parseRq()
 {
     int result = ERR_ILLEGAL_OPERATION;
-    for(;;)
+    uint16_t cmd = ntohs(*(uint16_t*)(&_buffer[0])); /* parse command */
+
+    // packets of a transfer in progress go to its session
+    quint64 tid = transferId(_clientAddr, _clientPort);
+    auto it = _sessions.find(tid);
+    if (it != _sessions.end())
     {
-        qDebug() << TAG << _buffer << _readSize;
-        uint16_t cmd = ntohs(*(uint16_t*)(&_buffer[0])); /* parse command */
+        std::shared_ptr<Session> session = it.value();
         switch (cmd)
         {
-            case TFTP_CMD_WRQ:
-                result = parseWrq();
-                if (result == 0)
+            case TFTP_CMD_ACK:
+                if (_readSize >= 4 && !session->upload)
                 {
-                    result = processWrite();
-                    onClose();
-                }
-                else
-                {
-                    result = 0; // it is ok since parsing is not network issue
+                    _stats.acksReceived++;
+                    onAck(*session, ntohs(*(uint16_t *)(&_buffer[2])));
                 }
                 break;
-            case TFTP_CMD_RRQ:
-                result = parseRrq();
-                if (result == 0)
+            case TFTP_CMD_DATA:
+                if (session->upload && _readSize >= 4)
                 {
-                    result = processRead();
-                    onClose();
+                    onData(*session, ntohs(*(uint16_t *)(&_buffer[2])), &_buffer[4], _readSize - 4);
+                    break;
                 }
-                else
+                qCDebug(lcTftp) << TAG << "received data for a read transfer";
+                sendError(*session, ERR_ILLEGAL_OPERATION, "unexpected data");
+                finishSession(*session, false);
+                break;
+            case TFTP_CMD_WRQ:
+                // some clients repeat request several times
+                if (session->upload && session->nextBlockNum == 1)
                 {
-                    result = 0; // it is ok since parsing is not network issue
+                    sendUploadReply(*session);
                 }
                 break;
+            case TFTP_CMD_RRQ:
+                // some clients repeat request several times
+                qCDebug(lcTftp) << TAG << "repeated request of a transfer in progress, ignoring";
+                break;
+            case TFTP_CMD_ERROR:
+                qCDebug(lcTftp) << TAG << "client aborted the transfer of" << session->name;
+                finishSession(*session, false);
+                break;
             default:
-                qDebug() << TAG << "unknown command " << cmd;
+                qCDebug(lcTftp) << TAG << "received wrong ack packet: " << cmd;
+                sendError(*session, ERR_NOT_DEFINED, "incorrect ack");
+                finishSession(*session, false);
         }
-        if (result <= 0)
+        return 0;
+    }
+
+    qCTrace(lcTftp) << TAG << QByteArray((const char *)_buffer, _readSize).toHex() << _readSize;
+    switch (cmd)
+    {
+        case TFTP_CMD_WRQ:
+        case TFTP_CMD_RRQ:
         {
+            if (_sessions.size() >= TFTP_MAX_SESSIONS)
+            {
+                qCDebug(lcTftp) << TAG << "too many transfers, rejecting request of" << _clientAddr.toString();
+                sendError(ERR_NOT_DEFINED, "server busy");
+                return 0;
+            }
+
+            std::shared_ptr<Session> session = std::make_shared<Session>();
+            session->clientAddr = _clientAddr;
+            session->clientPort = _clientPort;
+            session->upload = (cmd == TFTP_CMD_WRQ);
+            _sessions.insert(tid, session);
+            if ((session->upload ? parseWrq(*session) : parseRrq(*session)) < 0)
+            {
+                finishSession(*session, false);
+            }
+            result = 0; // it is ok since parsing is not network issue
             break;
         }
+        case TFTP_CMD_ACK:
+            // TI ROM bootloader acks the last block late, after the transfer is over
+            qCDebug(lcTftp) << TAG << "ack of no transfer in progress from" << _clientAddr.toString() << ":" << _clientPort;
+            result = 0;
+            break;
+        case TFTP_CMD_DATA:
+            // the last block of an upload again, its ack got lost after the transfer was over
+            qCDebug(lcTftp) << TAG << "data of no transfer in progress from" << _clientAddr.toString() << ":" << _clientPort;
+            result = 0;
+            break;
+        default:
+            qCDebug(lcTftp) << TAG << "unknown command " << cmd;
     }
     return result;
 }
@@ -394,28 +981,34 @@ int TFTP::start()
 {
     if (_socket.get() != nullptr)
     {
-        qDebug() << TAG << "already started!";
+        qCDebug(lcTftp) << TAG << "already started!";
         return 0;
     }
     _socket.reset(new QUdpSocket);
+    _sendBufferSize = 0;
 
     if(_buffer != nullptr)
     {
         delete[] _buffer;
     }
-    _buffer = new uint8_t[_tftpDataSize];
+    // one byte more than the largest datagram, for the NUL that ends a request
+    _buffer = new uint8_t[_tftpDataSize + 1];
 
     if (false == _socket->bind(QHostAddress::AnyIPv4, _port, QUdpSocket::ReuseAddressHint))
     {
-        qDebug() << TAG << "binding error";
+        qCDebug(lcTftp) << TAG << "binding error";
         return -ERR_PORT_BIND_FAILED;
     }
 
     _socket->flush();
+    if (!_multicastAddr.isNull())
+    {
+        setMulticast(_multicastAddr, _multicastInterface);
+    }
 
-    qDebug() << TAG <<  "Started on port " << _port
-             << ", blocksize " << _tftpBlockSize
-             << ", directory " << _path.absolutePath();
+    qCDebug(lcTftp) << TAG <<  "Started on port " << _port
+                    << ", blocksize " << _tftpBlockSize
+                    << ", directory " << _path.absolutePath();
     return 0;
 }
 
@@ -424,36 +1017,49 @@ int TFTP::run(bool waitFor)
     if(_quit)
         return 0;
 
-    if(false == _socket->waitForReadyRead(_tftpCommandWaitTimeoutMilliSec))
-    {
-        // qDebug() << "[simptftp] No packet received";
-        return -ERR_RECV_TIMEOUT;
-    }
-    else
+    int result = -ERR_RECV_TIMEOUT;
+    if(_socket->hasPendingDatagrams() || (waitFor && true == _socket->waitForReadyRead(nextTimeout())))
     {
-        qDebug() << "[simptftp] Packet received";
+        // everything that arrived, acks and data of all sessions
+        while (_socket->hasPendingDatagrams())
+        {
+            _readSize = _socket->readDatagram((char*)_buffer, _tftpDataSize, &_clientAddr, &_clientPort);
+            if (_readSize < 2 || _readSize > (uint32_t)_tftpDataSize)
+            {
+                qCDebugLimited(lcTftp) << TAG << "No datagram inside received packat!!!";
+                continue;
+            }
+            // strings of a full size request would run off the end otherwise
+            _buffer[_readSize] = 0;
+            result = parseRq();
+        }
     }
 
-    if (_socket->hasPendingDatagrams())
-    {
-        _readSize = _socket->readDatagram((char*)_buffer, _tftpDataSize, &_clientAddr, &_clientPort);
-        qDebug() << TAG << "Received packet from" << _clientAddr.toString() << ":" << _clientPort;
-        qDebug() << TAG << "Data:" << _buffer; // Print the data in hex format
-    }
-    else
-    {
-        qDebug() << TAG << "No datagram inside received packat!!!";
-        return -1;
-    }
+    onTimeouts();
+    return result;
+}
+
+qintptr TFTP::socketDescriptor()
+{
+    return _socket.get() != nullptr ? _socket->socketDescriptor() : -1;
+}
 
-    return parseRq();
+bool TFTP::hasSessions()
+{
+    return !_sessions.isEmpty();
 }
 
 void TFTP::stop()
 {
     if (_socket.get() != nullptr)
     {
-        qDebug() << TAG << "Stopped";
+        qCDebug(lcTftp) << TAG << "Stopped";
+        for (const std::shared_ptr<Session> &session : std::as_const(_sessions))
+        {
+            onClose(*session);
+        }
+        _sessions.clear();
+        _groups.clear();
         _socket.reset(nullptr);
         if(_buffer != nullptr)
         {
@@ -484,86 +1090,300 @@ void TFTP::setTIMode(bool mode)
     _tftpTIMode = mode;
 }
 
-int TFTP::onRead(const char *file)
+int TFTP::onRead(Session &session, const char *file)
 {
-    if(_curFile.isOpen())
-    {
-        _curFile.close();
-    }
-
-    _curFile.setFileName(_path.absoluteFilePath(file));
+    QFile &curFile = session.file;
+    curFile.setFileName(_path.absoluteFilePath(file));
+    session.name = QByteArray::fromStdString(std::filesystem::path(curFile.fileName().toStdString()).filename().string());
 
-    if(_curFile.fileName().contains("uniflash"))
+    if(curFile.fileName().contains("uniflash"))
     {
-        qDebug() << "[simptftp] file mode is uniflash!";
+        qCDebug(lcTftp) << "[simptftp] file mode is uniflash!";
         // file that needs to be splitted 1Gib parts
-        QString filename{ _curFile.fileName().toUtf8() };
+        QString filename{ curFile.fileName().toUtf8() };
         size_t offset = filename.indexOf("uniflash");
-        _curFile.setFileName(_path.absoluteFilePath("uniflash"));
+        curFile.setFileName(_path.absoluteFilePath("uniflash"));
 
         if(offset != -1)
         {
             offset += strlen("uniflash");
-            _seekPartPos = std::stoi(filename.mid(offset).toStdString());
-            qDebug() << "opening: " << _curFile.fileName();
-            if(false == _curFile.open(QIODeviceBase::ReadOnly))
+            session.seekPartPos = std::stoi(filename.mid(offset).toStdString());
+            session.name = QByteArray("uniflash") + QByteArray::number(session.seekPartPos);
+            bool sparse = filename.endsWith(TFTP_SPARSE_SUFFIX);
+            qCDebug(lcTftp) << "opening: " << curFile.fileName();
+            // read ahead of a growing file could pick up data that is not final yet
+            qint64 growingSize = _growingFileSize;
+            QIODeviceBase::OpenMode mode = QIODeviceBase::ReadOnly;
+            if(growingSize > 0)
             {
-                qDebug() << "file open failed: " << _curFile.errorString();
+                mode |= QIODeviceBase::Unbuffered;
+            }
+            if(false == curFile.open(mode))
+            {
+                qCDebug(lcTftp) << "file open failed: " << curFile.errorString();
                 return -ERR_FILE_NOT_FOUND;
             }
 
-            _splitModeSize = _curFile.size() / 10;
-            qDebug() << TAG << "current file is now: " << _curFile.fileName()
-                     << "with offset: " << _seekPartPos
-                     << "filesize: " << _curFile.size()
-                     << "partsize: " << _splitModeSize;
+            session.growing = (growingSize > 0);
+            session.fileSize = session.growing ? growingSize : curFile.size();
+            qint64 splitModeSize = uniflashPartSize(session.fileSize, _partSize);
+            qCDebug(lcTftp) << TAG << "current file is now: " << curFile.fileName()
+                            << "with offset: " << session.seekPartPos
+                            << "filesize: " << session.fileSize << (session.growing ? "(still being written)" : "")
+                            << "partsize: " << splitModeSize;
 
-            if(_splitModeSize % 512 != 0)
+            if(splitModeSize == 0)
             {
-                qDebug() << "image part size not multiples of 512 this cannot write to mmc";
+                qCDebug(lcTftp) << "image part size not multiples of 512 this cannot write to mmc";
                 return -ERR_ILLEGAL_OPERATION;
             }
 
-            qsizetype seekPos = _seekPartPos * _splitModeSize;
-            if(false == _curFile.seek(seekPos))
+            qsizetype seekPos = session.seekPartPos * splitModeSize;
+            if(false == curFile.seek(seekPos))
             {
-                qDebug() << "set file offset failed!";
+                qCDebug(lcTftp) << "set file offset failed!";
+            }
+            session.transferOffset = seekPos;
+            session.transferSize = qBound((qint64)0, session.fileSize - seekPos, splitModeSize);
+            if(false == session.growing)
+            {
+                // a mapping only covers what the file had when it was made
+                mapFile(session);
+#ifdef __linux__
+                // read this part and the next into the page cache while the board writes to mmc
+                posix_fadvise(curFile.handle(), seekPos, 2 * splitModeSize, POSIX_FADV_WILLNEED);
+#endif
+            }
+
+            if(sparse)
+            {
+                // the part as a sparse image, so runs of zeroes are not sent
+                Session *s = &session;
+                session.sparse = std::make_unique<SparseImageEncoder>(session.transferSize, TFTP_SPARSE_BLOCK_SIZE,
+                    [s](char *buf, qint64 maxLen) -> qint64 {
+                        qint64 n = qMin(maxLen, s->transferSize - s->sparseInput);
+                        if (n <= 0)
+                        {
+                            return 0;
+                        }
+                        if (s->map)
+                        {
+                            memcpy(buf, s->map->data + s->transferOffset + s->sparseInput, n);
+                        }
+                        else
+                        {
+                            n = s->file.read(buf, n);
+                        }
+                        if (n > 0)
+                        {
+                            s->sparseInput += n;
+                        }
+                        return n;
+                    });
+                qCDebug(lcTftp) << TAG << "sending" << session.name << "as sparse image";
             }
 
-            _splittedFileMode = true;
+            session.splittedFileMode = true;
             return 0;
         }
     }
 
-    if(false == _curFile.open(QIODeviceBase::ReadOnly))
+    // served from memory, as long as the file did not change since
+    std::shared_ptr<PreloadedFile> preload = _preloaded.value(curFile.fileName());
+    QFileInfo info(curFile.fileName());
+    if (!preload || preload->data.size() != info.size() || preload->modified != info.lastModified())
+    {
+        preload = preloadFile(curFile.fileName());
+    }
+    if (preload)
+    {
+        session.preload = preload;
+        session.transferOffset = 0;
+        session.fileSize = preload->data.size();
+        session.transferSize = session.fileSize;
+        qCDebug(lcTftp) << TAG << "current file is now: " << file << "for" << session.clientAddr.toString() << "(preloaded)";
+        return 0;
+    }
+
+    if(false == curFile.open(QIODeviceBase::ReadOnly))
     {
         return -ERR_FILE_NOT_FOUND;
     }
+    session.transferOffset = 0;
+    session.fileSize = curFile.size();
+    session.transferSize = session.fileSize;
+    mapFile(session);
 
+    qCDebug(lcTftp) << TAG << "current file is now: " << file << "for" << session.clientAddr.toString();
+    return 0;
+}
 
-    qDebug() << TAG << "current file is now: " << file;
+// boards booting at the same time share one mapping of each file
+void TFTP::mapFile(Session &session)
+{
+#ifdef __linux__
+    QString path = session.file.fileName();
+    std::shared_ptr<MappedFile> map = _maps.value(path).lock();
+    if (map && map->size != session.file.size())
+    {
+        // file was replaced since
+        map.reset();
+    }
+
+    if (!map && session.file.size() > 0)
+    {
+        map = std::make_shared<MappedFile>();
+        map->file.setFileName(path);
+        if (map->file.open(QIODeviceBase::ReadOnly))
+        {
+            map->size = map->file.size();
+            map->data = map->file.map(0, map->size);
+        }
+        if (map->data == nullptr)
+        {
+            qCDebug(lcTftp) << TAG << "mapping file failed, reading it instead:" << map->file.errorString();
+            return;
+        }
+        _maps.insert(path, map);
+    }
+    session.map = map;
+#else
+    Q_UNUSED(session)
+#endif
+}
+
+std::shared_ptr<TFTP::PreloadedFile> TFTP::preloadFile(const QString &path)
+{
+    _preloaded.remove(path);
+    QFileInfo info(path);
+    if (!QDir::match(_preloadPatterns, info.fileName()) || info.size() > TFTP_PRELOAD_MAX_SIZE)
+    {
+        return nullptr;
+    }
+
+    QFile f(path);
+    if (!f.open(QIODeviceBase::ReadOnly))
+    {
+        return nullptr;
+    }
+    auto preload = std::make_shared<PreloadedFile>();
+    preload->modified = info.lastModified();
+    preload->data = f.readAll();
+    if (preload->data.size() != info.size())
+    {
+        qCDebug(lcTftp) << TAG << "preloading" << path << "failed:" << f.errorString();
+        return nullptr;
+    }
+
+    // clients mostly take the configured size, ROMs the default one
+    preload->packets.insert(_tftpBlockSize, buildPackets(preload->data, _tftpBlockSize));
+    preload->packets.insert(TFTP_DEFAULT_BLOCK_SIZE, buildPackets(preload->data, TFTP_DEFAULT_BLOCK_SIZE));
+    _preloaded.insert(path, preload);
+    qCDebug(lcTftp) << TAG << "preloaded" << info.fileName() << preload->data.size() << "bytes";
+    return preload;
+}
+
+void TFTP::preloadFiles()
+{
+    _preloaded.clear();
+    if (_preloadPatterns.isEmpty())
+    {
+        return;
+    }
+
+    const QStringList names = _path.entryList(_preloadPatterns, QDir::Files);
+    for (const QString &name : names)
+    {
+        preloadFile(_path.absoluteFilePath(name));
+    }
+}
+
+// a transfer ends with a short block, empty if the size is a multiple of the block size
+QVector<QByteArray> TFTP::buildPackets(const QByteArray &data, int blockSize)
+{
+    QVector<QByteArray> packets;
+    qint64 blocks = (qint64)data.size() / blockSize + 1;
+    packets.reserve(blocks);
+    for (qint64 i = 0; i < blocks; i++)
+    {
+        int len = (int)qMin((qint64)blockSize, (qint64)data.size() - i * blockSize);
+        QByteArray packet(len + 4, Qt::Uninitialized);
+        *(uint16_t*)(packet.data()) = htons(TFTP_CMD_DATA);
+        *(uint16_t*)(packet.data() + 2) = htons((uint16_t)(i + 1));
+        memcpy(packet.data() + 4, data.constData() + i * blockSize, len);
+        packets.append(packet);
+    }
+    return packets;
+}
+
+int TFTP::onWrite(Session &session, const char *file)
+{
+    qCDebug(lcTftp) << "onWrite(): " << file;
+
+    // hashes of a uniflash part the board wrote, nothing else is taken
+    QByteArray name{file};
+    bool isPart{false};
+    if(name.startsWith("uniflash") && name.endsWith(UNIFLASH_HASH_SUFFIX))
+    {
+        name.mid(strlen("uniflash"), name.size() - strlen("uniflash") - strlen(UNIFLASH_HASH_SUFFIX)).toUInt(&isPart);
+    }
+    if(false == isPart)
+    {
+        return -ERR_ACCESS_VIOLATION;
+    }
+
+    session.name = name;
     return 0;
 }
 
-int TFTP::onWrite(const char *file)
+int TFTP::onReadData(Session &session, uint8_t *buffer, int len)
 {
-    qDebug() << "onWrite(): " << file;
-    return -ERR_NOT_IMPLEMENTED;
+    return session.file.read((char*)buffer, len);
 }
 
-int TFTP::onReadData(uint8_t *buffer, int len)
+void TFTP::setGrowingFile(qint64 finalSize)
 {
-    return _curFile.read((char*)buffer, len);
+    _growingFileWritten = 0;
+    _growingFileSize = finalSize;
 }
 
-int TFTP::onWriteData(uint8_t *buffer, int len)
+void TFTP::setGrowingFileWritten(qint64 bytes)
 {
-    return -ERR_NOT_IMPLEMENTED;
+    _growingFileWritten = bytes;
 }
 
-void TFTP::onClose()
+int TFTP::onWriteData(Session &session, uint8_t *buffer, int len)
 {
-    _curFile.close();
+    if(session.uploadData.size() + len > TFTP_MAX_UPLOAD_SIZE)
+    {
+        // too large to be what is expected
+        return -ERR_NO_SPACE;
+    }
+
+    session.uploadData.append((const char *)buffer, len);
+    return len;
+}
+
+void TFTP::cancelSessions()
+{
+    for (const std::shared_ptr<Session> &session : std::as_const(_sessions))
+    {
+        qCDebug(lcTftp) << TAG << "Cancelling transfer of" << session->name;
+        sendError(*session, ERR_NOT_DEFINED, "transfer cancelled");
+        onClose(*session);
+        session->group.reset();
+    }
+    _sessions.clear();
+    _groups.clear();
+}
+
+void TFTP::onClose(Session &session)
+{
+    // the mapping goes with the last session using it
+    session.map.reset();
+    session.preload.reset();
+    session.packets.clear();
+    session.file.close();
     return;
 }
 
@@ -572,6 +1392,26 @@ void TFTP::setOnReadSuccess(const std::function<void (QByteArray)> &newOnReadSuc
     _onReadSuccess = newOnReadSuccess;
 }
 
+void TFTP::setOnReadFailure(const std::function<void (QByteArray)> &newOnReadFailure)
+{
+    _onReadFailure = newOnReadFailure;
+}
+
+const TFTP::Stats &TFTP::stats() const
+{
+    return _stats;
+}
+
+void TFTP::setOnRetransmit(const std::function<void (int)> &newOnRetransmit)
+{
+    _onRetransmit = newOnRetransmit;
+}
+
+void TFTP::setOnWriteSuccess(const std::function<void (QByteArray, QByteArray)> &newOnWriteSuccess)
+{
+    _onWriteSuccess = newOnWriteSuccess;
+}
+
 bool TFTP::hasError()
 {
     bool res = _hasError;
@@ -596,7 +1436,7 @@ float TFTP::getProgress()
     return _progress;
 }
 
-void TFTP::setProgressUpdateCallback(std::function<void(float)> func)
+void TFTP::setProgressUpdateCallback(std::function<void(QByteArray, float)> func)
 {
     _progressUpdateCallback = func;
 }
@@ -610,9 +1450,170 @@ void TFTP::setTftpBlockSize(int newTftpBlockSize)
 {
     _tftpBlockSize = newTftpBlockSize;
     _tftpDataSize = _tftpBlockSize + 4;
+
+    // requests are read into the buffer with the new size
+    if(_buffer != nullptr)
+    {
+        delete[] _buffer;
+        _buffer = new uint8_t[_tftpDataSize + 1];
+    }
+}
+
+void TFTP::setMaxWindowSize(int newMaxWindowSize)
+{
+    _maxWindowSize = qMax(1, newMaxWindowSize);
+}
+
+void TFTP::setTargetDirectory(const QString &dir)
+{
+    _path.setPath(dir);
+    preloadFiles();
+}
+
+void TFTP::setPreloadFiles(const QStringList &patterns)
+{
+    _preloadPatterns = patterns;
+    preloadFiles();
+}
+
+void TFTP::setSplitModeSize(qint64 newSplitModeSize)
+{
+    _partSize = qMax((qint64)0, newSplitModeSize);
+}
+
+void TFTP::setMulticast(const QHostAddress &firstGroup, const QString &interfaceName)
+{
+    _multicastAddr = firstGroup;
+    _multicastInterface = interfaceName;
+    if (_socket.get() == nullptr || firstGroup.isNull())
+    {
+        return;
+    }
+
+    // the boards are on the link of the interface, the groups go no further
+    _socket->setSocketOption(QAbstractSocket::MulticastTtlOption, 1);
+    _socket->setSocketOption(QAbstractSocket::MulticastLoopbackOption, 0);
+    QNetworkInterface iface = QNetworkInterface::interfaceFromName(interfaceName);
+    if (iface.isValid())
+    {
+        _socket->setMulticastInterface(iface);
+    }
+    qCDebug(lcTftp) << TAG << "multicast groups from" << firstGroup.toString() << "on" << (iface.isValid() ? interfaceName : QString("the default interface"));
+}
+
+bool TFTP::joinGroup(Session &session)
+{
+    // a new master says where it is by block number, which must not wrap around
+    if (_multicastAddr.isNull() || session.sparse || session.transferSize / session.blockSize >= 65535)
+    {
+        qCDebug(lcTftp) << TAG << "sending" << session.name << "to" << session.clientAddr.toString() << "without multicast";
+        return false;
+    }
+
+    // all clients of a group get the same blocks
+    QByteArray key = session.name + '/' + QByteArray::number(session.blockSize);
+    std::shared_ptr<MulticastGroup> &group = _groups[key];
+    if (!group)
+    {
+        // lowest address no other group has
+        quint32 addr = _multicastAddr.toIPv4Address();
+        for (bool used = true; used; )
+        {
+            used = false;
+            for (const std::shared_ptr<MulticastGroup> &other : std::as_const(_groups))
+            {
+                if (other && other->addr.toIPv4Address() == addr)
+                {
+                    used = true;
+                    addr++;
+                    break;
+                }
+            }
+        }
+        group = std::make_shared<MulticastGroup>();
+        group->addr = QHostAddress(addr);
+        group->key = key;
+        qCDebug(lcTftp) << TAG << "sending" << session.name << "to multicast group" << group->addr.toString();
+    }
+
+    session.group = group;
+    session.master = !group->hasMaster;
+    if (session.master)
+    {
+        group->hasMaster = true;
+    }
+    else
+    {
+        group->waiting.append(transferId(session.clientAddr, session.clientPort));
+    }
+    return true;
+}
+
+void TFTP::leaveGroup(Session &session)
+{
+    std::shared_ptr<MulticastGroup> group = std::move(session.group);
+    if (!group)
+    {
+        return;
+    }
+
+    group->waiting.removeAll(transferId(session.clientAddr, session.clientPort));
+    if (session.master)
+    {
+        group->hasMaster = false;
+        promoteMaster(*group);
+    }
+    if (!group->hasMaster && group->waiting.isEmpty())
+    {
+        _groups.remove(group->key);
+    }
+}
+
+void TFTP::promoteMaster(MulticastGroup &group)
+{
+    while (!group.waiting.isEmpty())
+    {
+        std::shared_ptr<Session> next = _sessions.value(group.waiting.takeFirst());
+        if (!next)
+        {
+            continue;
+        }
+
+        // acks the last block it has in order, the rest is sent again from there
+        next->master = true;
+        next->retries = 0;
+        next->waitedMilliSec = 0;
+        next->oack = QByteArray("multicast") + '\0' + multicastOption(group.addr, group.port, true) + '\0';
+        QByteArray packet(2, 0);
+        *(uint16_t *)(packet.data()) = htons(TFTP_CMD_OACK);
+        packet += next->oack;
+        _socket->writeDatagram(packet, next->clientAddr, next->clientPort);
+        next->lastSent.start();
+        group.hasMaster = true;
+        qCDebug(lcTftp) << TAG << next->clientAddr.toString() << "is now master client of" << group.addr.toString();
+        return;
+    }
+}
+
+void TFTP::seekBlock(Session &session, uint16_t lastBlock)
+{
+    // a transfer ends with a short block, empty if the size is a multiple of the block size
+    qint64 blocks = session.transferSize / session.blockSize + 1;
+    session.window.clear();
+    session.timing = false;
+    session.eof = (lastBlock >= blocks);
+    session.totalRead = qMin((qint64)lastBlock * session.blockSize, session.transferSize);
+    session.totalSize = session.totalRead;
+    session.firstBlockNum = lastBlock + 1;
+    session.nextBlockNum = lastBlock + 1;
+    if (!session.map && session.packets.isEmpty())
+    {
+        session.file.seek(session.transferOffset + session.totalRead);
+    }
 }
 
-void TFTP::setSplitModeSize(uint32_t newSplitModeSize)
+qint64 TFTP::uniflashPartSize(qint64 fileSize, qint64 partSize)
 {
-    _splitModeSize = newSplitModeSize;
+    qint64 size = (partSize > 0) ? partSize : fileSize / 10;
+    return (size % 512 == 0) ? size : 0;
 }
@@ -44,12 +44,41 @@ typedef int SOCKET;
 #endif
 
 #include "downloadthread.h"
+#include "sparseimage.h"
 #include <qdir.h>
 #include <qudpsocket.h>
 #define TFTP_DEFAULT_PORT (69)
 #define TFTP_DEFAULT_BLOCK_SIZE (512)
+#define TFTP_MAX_WINDOW_SIZE (64)
+#define TFTP_MAX_BLOCK_SIZE (65464)
+#define TFTP_DEFAULT_ACK_TIMEOUT (2000)
+// bounds of the retransmission timeout estimated from the round trip time
+#define TFTP_MIN_ACK_TIMEOUT (200)
+#define TFTP_MAX_ACK_TIMEOUT TFTP_DEFAULT_ACK_TIMEOUT
+// a transfer is given up after this many resends, once it waited this long for an ack
+#define TFTP_MAX_RETRIES (3)
+#define TFTP_GIVE_UP_TIMEOUT (3 * TFTP_DEFAULT_ACK_TIMEOUT)
+// transfers served at once, one per board
+#define TFTP_MAX_SESSIONS (64)
+// port of the multicast groups (RFC 2090)
+#define TFTP_MULTICAST_PORT (1758)
+// longest wait for the writer of a growing uniflash image to get further
+#define TFTP_GROWING_FILE_TIMEOUT (60000)
+// suffix of uniflash<N> for the part as an Android sparse image, written by the board in 512 byte blocks
+#define TFTP_SPARSE_SUFFIX ".sparse"
+#define TFTP_SPARSE_BLOCK_SIZE (512)
+// largest file a client can put
+#define TFTP_MAX_UPLOAD_SIZE (32768)
+// largest file kept in memory by setPreloadFiles()
+#define TFTP_PRELOAD_MAX_SIZE (8 * 1024 * 1024)
 
 #include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QVector>
 
 class TFTP
 {
@@ -61,6 +90,7 @@ public:
         TFTP_CMD_DATA  = 3,
         TFTP_CMD_ACK   = 4,
         TFTP_CMD_ERROR = 5,
+        TFTP_CMD_OACK  = 6,
     };
 
     enum errorCode
@@ -91,15 +121,34 @@ public:
 
     /**
      * Listens for incoming requests. Can be executed in blocking and non-blocking mode
-     * @param waitFor true if blocking mode is required, false if non-blocking mode is required
+     * @param waitFor true if blocking mode is required, false if non-blocking mode is required.
+     *        Non-blocking only handles the packets that already arrived and the timeouts that are due
      */
     int run(bool waitFor = true);
 
+    /**
+     * Socket requests and acks arrive on, for callers that wait for it
+     * themselves and call run(false) when it is readable
+     */
+    qintptr socketDescriptor();
+
+    /**
+     * Milliseconds the caller can wait for the socket, before run()
+     * has to be called again for resends and timeouts
+     */
+    int nextTimeout();
+
     /**
      * Stops server
      */
     void stop();
 
+    /**
+     * Ends the transfers in progress with an error to their clients.
+     * The server keeps running for new requests
+     */
+    void cancelSessions();
+
     void setSingleRunFilename(QString filename);
 
     bool isClosedSuccessfully();
@@ -108,101 +157,338 @@ public:
 
     void setTIMode(bool mode);
 
-    void setSplitModeSize(uint32_t newSplitModeSize);
+    /**
+     * Size of the parts uniflash<N> the image is split into, a multiple of 512.
+     * 0 for a tenth of the image
+     */
+    void setSplitModeSize(qint64 newSplitModeSize);
+
+    /**
+     * Size of the uniflash parts of a file of fileSize bytes, with partSize as
+     * set by setSplitModeSize(). 0 if it is no multiple of 512
+     */
+    static qint64 uniflashPartSize(qint64 fileSize, qint64 partSize);
 
     void setTftpBlockSize(int newTftpBlockSize);
 
+    /**
+     * Directory files are served from. Transfers in progress keep their file
+     */
+    void setTargetDirectory(const QString &dir);
+
+    /**
+     * Files of the target directory matching the wildcard patterns are read
+     * into memory now, when the directory changes and when they are first
+     * requested after they changed on disk. Their blocks are sent from DATA
+     * packets built in advance, so a boot ROM with tight timeouts does not
+     * wait for the disk. Only files up to TFTP_PRELOAD_MAX_SIZE
+     */
+    void setPreloadFiles(const QStringList &patterns);
+
+    /**
+     * Largest number of blocks sent before waiting for an ack, if the client
+     * asks for it with the windowsize option (RFC 7440)
+     */
+    void setMaxWindowSize(int newMaxWindowSize);
+
+    /**
+     * Clients asking for the multicast option (RFC 2090) that request the same
+     * file get it over one multicast group, so the link carries one copy for
+     * all of them. Every file gets its own group, from firstGroup on, sent from
+     * the interface named. A null address turns it off
+     */
+    void setMulticast(const QHostAddress &firstGroup, const QString &interfaceName = QString());
+
+    /**
+     * The uniflash image is still being written. It is split as a file of
+     * finalSize bytes, and parts are sent as far as setGrowingFileWritten()
+     * allows, waiting for the rest. 0 when the image is complete.
+     * Both can be called from another thread
+     */
+    void setGrowingFile(qint64 finalSize);
+
+    /**
+     * Bytes from the start of the growing file that can be sent,
+     * negative if writing it failed
+     */
+    void setGrowingFileWritten(qint64 bytes);
+
     bool isTiboot3BinSent();
 
+    /**
+     * True while files are being sent, so the caller should come back to run() soon
+     */
+    bool hasSessions();
+
     float getProgress();
 
-    void setProgressUpdateCallback(std::function<void(float)> func);
+    // called with the name of the file being sent and the part of it done
+    void setProgressUpdateCallback(std::function<void(QByteArray, float)> func);
 
     QByteArray getLastFileName();
 
     void setOnReadSuccess(const std::function<void (QByteArray)> &newOnReadSuccess);
 
+    // called with the name of a file that could not be sent
+    void setOnReadFailure(const std::function<void (QByteArray)> &newOnReadFailure);
+
+    // called with the number of blocks sent again because they were not acknowledged
+    void setOnRetransmit(const std::function<void (int)> &newOnRetransmit);
+
+    // called with the name and contents of a file a client put. Only the hashes of uniflash parts are accepted, see UNIFLASH_HASH_SUFFIX
+    void setOnWriteSuccess(const std::function<void (QByteArray, QByteArray)> &newOnWriteSuccess);
+
     bool hasError();
 
     void setError(bool error);
 
+    // packets since the server started, counted rather than logged one by one
+    struct Stats
+    {
+        quint64 dataReceived{0};
+        quint64 duplicatesReceived{0};
+        quint64 acksSent{0};
+        quint64 acksReceived{0};
+        // acks of blocks already acked, or not sent yet
+        quint64 staleAcks{0};
+        quint64 ackTimeouts{0};
+    };
+
+    const Stats &stats() const;
+
 protected:
-    void sendAck(uint16_t blockNum);
+    struct DataBlock
+    {
+        uint16_t num;
+        // in the mapped file, or in packet with the header in front
+        const uchar *data;
+        int size;
+        QByteArray packet;
+    };
+
+    /**
+     * Clients receiving a file over a multicast group. The master client acks
+     * the blocks, the others only listen. When the master is done, the next
+     * one becomes master and acks the last block it has in order, so the
+     * blocks it missed are sent again (RFC 2090)
+     */
+    struct MulticastGroup
+    {
+        QHostAddress addr;
+        uint16_t port{TFTP_MULTICAST_PORT};
+        QByteArray key;
+        // transfer ids of the sessions waiting, in the order they joined
+        QList<quint64> waiting;
+        bool hasMaster{false};
+    };
+
+    // file kept in memory, see setPreloadFiles()
+    struct PreloadedFile
+    {
+        QByteArray data;
+        QDateTime modified;
+        // DATA packets of the whole file by block size, each built on first use
+        QHash<int, QVector<QByteArray>> packets;
+    };
+
+    // read-only mapping of a file, shared by all sessions sending it
+    struct MappedFile
+    {
+        QFile file;
+        const uchar *data{nullptr};
+        qint64 size{0};
+    };
+
+    /**
+     * One transfer, keyed by the transfer id (address and port) of the client.
+     * Packets from anywhere else never reach it
+     */
+    struct Session
+    {
+        QHostAddress clientAddr;
+        uint16_t clientPort{0};
+        QFile file;
+        std::shared_ptr<MappedFile> map;
+        // preloaded file, and its packets for the negotiated block size
+        std::shared_ptr<PreloadedFile> preload;
+        QVector<QByteArray> packets;
+        // file name as reported, uniflash with the part number
+        QByteArray name;
+        // negotiated for this transfer
+        int blockSize{TFTP_DEFAULT_BLOCK_SIZE};
+        int windowSize{1};
+        // retransmission timeout, from the round trip time unless the client set it with the timeout option
+        int ackTimeoutMilliSec{TFTP_DEFAULT_ACK_TIMEOUT};
+        bool fixedTimeout{false};
+        // part of the file that is sent, set by onRead()
+        qint64 transferOffset{0};
+        qint64 transferSize{0};
+        // size the file is split and reported by, its final size if it is growing
+        qint64 fileSize{0};
+        bool splittedFileMode{false};
+        bool growing{false};
+        // part sent as a sparse image, encoded from the file as it is sent
+        std::unique_ptr<SparseImageEncoder> sparse;
+        qint64 sparseInput{0};
+        int seekPartPos{0};
+        // options sent, until the client acks them with block 0
+        QByteArray oack;
+        // blocks sent and not acked yet
+        QList<DataBlock> window;
+        uint16_t firstBlockNum{1}; // oldest block not acked yet
+        uint16_t nextBlockNum{1};
+        qint64 totalRead{0};
+        qint64 totalSize{0};
+        bool eof{false};
+        int retries{0};
+        qint64 waitedMilliSec{0}; // for acks, since the last one that got the transfer further
+        QElapsedTimer lastSent;
+        // round trip time estimate (RFC 6298), -1 until measured
+        qint64 srttUsec{-1};
+        qint64 rttvarUsec{0};
+        // block the round trip time is measured with. Only blocks sent once are timed (Karn)
+        bool timing{false};
+        uint16_t timedBlockNum{0};
+        QElapsedTimer timedSince;
+        // growing file: since when the writer did not get further, and how far it was
+        QElapsedTimer waitingSince;
+        qint64 waitingWritten{0};
+        // multicast: the group the blocks go to, and whether this client acks them
+        std::shared_ptr<MulticastGroup> group;
+        bool master{false};
+        // write transfer: the client sends the blocks from nextBlockNum on, and the file is kept in memory
+        bool upload{false};
+        QByteArray uploadData;
+    };
+
+    void sendAck(const Session &session, uint16_t blockNum);
+    // upload: sends the options or the ack of the last block received again
+    void sendUploadReply(Session &session);
     void sendError(uint16_t code, const char *message);
-    int waitForAck(uint16_t blockNum);
+    void sendError(const Session &session, uint16_t code, const char *message);
+
+    /**
+     * Sends blocks from index from on. With sendmmsg() if the file is mapped
+     * or preloaded, otherwise one datagram at a time with QUdpSocket
+     */
+    bool sendBlocks(const Session &session, int from);
+    void mapFile(Session &session);
+    // loads path into _preloaded if it matches the patterns. Null if it does not or cannot be read
+    std::shared_ptr<PreloadedFile> preloadFile(const QString &path);
+    void preloadFiles();
+    static QVector<QByteArray> buildPackets(const QByteArray &data, int blockSize);
+    bool growingFileHas(qint64 end, bool *failed);
+    int readSparse(Session &session, uint8_t *buffer, int len);
+    int fillWindow(Session &session);
+    int sendWindow(Session &session, bool resend);
+    void onAck(Session &session, uint16_t blockNum);
+    void onData(Session &session, uint16_t blockNum, uint8_t *data, int len);
+    // adds the session to the group of its file, false if it cannot take multicast
+    bool joinGroup(Session &session);
+    void leaveGroup(Session &session);
+    // makes the next client of the group that is still there its master
+    void promoteMaster(MulticastGroup &group);
+    // multicast: goes on after lastBlock, the last block the new master has in order
+    void seekBlock(Session &session, uint16_t lastBlock);
+    // clients of a group that wait for their turn, they do not ack anything
+    static bool isListening(const Session &session) { return session.group && !session.master; }
+    void updateRtt(Session &session, qint64 usec);
+    // doubles the retransmission timeout. Returns false if the transfer should be given up
+    bool backOff(Session &session);
+    void onTimeouts();
+    void finishSession(Session &session, bool success);
 
     /**
      * This method is called, when new read request is received.
      * Override this method and add implementation for your system.
+     * @param session transfer the file is read for
      * @param file name of the file requested
      * @return return 0 if file can be read, otherwise return -1
      */
-    virtual int onRead(const char *file);
+    virtual int onRead(Session &session, const char *file);
 
     /**
      * This method is called, when new write request is received.
      * Override this method and add implementation for your system.
+     * @param session transfer the file is received by
      * @param file name of the file requested
      * @return return 0 if file can be written, otherwise return -1
      */
-    virtual int onWrite(const char *file);
+    virtual int onWrite(Session &session, const char *file);
 
     /**
      * This method is called, when new data are required to be read from file for sending.
      * Override this method and add implementation for your system.
+     * @param session transfer the data is read for
      * @param buffer buffer to fill with data from file
      * @param len maximum length of buffer
      * @return return number of bytes read to buffer
      * @important if length of read data is less than len argument value, it is considered
      *            as end of file
      */
-    virtual int onReadData(uint8_t *buffer, int len);
+    virtual int onReadData(Session &session, uint8_t *buffer, int len);
 
     /**
      * This method is called, when new data arrived for writing to file.
      * Override this method and add implementation for your system.
+     * @param session transfer the data is received by
      * @param buffer buffer with received data
      * @param len length of received data
      * @return return number of bytes written
      */
-    virtual int onWriteData(uint8_t *buffer, int len);
+    virtual int onWriteData(Session &session, uint8_t *buffer, int len);
 
     /**
      * This method is called, when transfer operation is complete.
      * Override this method and add implementation for your system.
      */
-    virtual void onClose();
+    virtual void onClose(Session &session);
 
 private:
     uint16_t _port;
     std::unique_ptr<QUdpSocket> _socket{};
+    // sender of the last request
     QHostAddress _clientAddr;
     uint16_t _clientPort;
     uint8_t* _buffer{nullptr};
     uint32_t _readSize{0};
-    QFile _curFile;
+    QHash<quint64, std::shared_ptr<Session>> _sessions;
+    QHash<QString, std::weak_ptr<MappedFile>> _maps;
+    QStringList _preloadPatterns;
+    QHash<QString, std::shared_ptr<PreloadedFile>> _preloaded;
+    QHash<QByteArray, std::shared_ptr<MulticastGroup>> _groups;
+    QHostAddress _multicastAddr;
+    QString _multicastInterface;
     QDir _path;
     bool _quit{false};
     QString _singleRunFilename{""};
     int _tftpBlockSize;
     int _tftpDataSize;
-    uint32_t _splitModeSize{0x40000000}; // 1GiB
-    // uint32_t _splitModeSize{10485760}; // 10MB
+    // SO_SNDBUF set on the socket, 0 for the system default
+    int _sendBufferSize{0};
+    int _maxWindowSize{TFTP_MAX_WINDOW_SIZE};
+    // configured part size, 0 for a tenth of the image
+    qint64 _partSize{0};
+    std::atomic<qint64> _growingFileSize{0};
+    std::atomic<qint64> _growingFileWritten{0};
     uint32_t _tftpCommandWaitTimeoutMilliSec{30000};
     bool _tftpTIMode{false};
-    bool _splittedFileMode{false};
     bool _tiboot3Sent{false};
     float _progress{0.0f};
-    int _seekPartPos{0};
     bool _hasError{false};
+    Stats _stats;
     QByteArray _lastFileName;
-    std::function<void(float)> _progressUpdateCallback;
+    std::function<void(QByteArray, float)> _progressUpdateCallback;
     std::function<void(QByteArray)> _onReadSuccess;
-
-    int processWrite();
-    int processRead();
-    int parseWrq();
-    int parseRrq();
+    std::function<void(QByteArray)> _onReadFailure;
+    std::function<void(int)> _onRetransmit;
+    std::function<void(QByteArray, QByteArray)> _onWriteSuccess;
+
+    // next string of the request at ptr, up to its NUL or the end of the datagram
+    char *requestString(uint8_t *&ptr);
+    int parseWrq(Session &session);
+    int parseRrq(Session &session);
     int parseRq();
+    void growSendBuffer(int bytes);
 };
 
@@ -0,0 +1,219 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "threadplacement.h"
+#include <QDebug>
+#include <QStringList>
+#include <mutex>
+#include <string.h>
+#include <errno.h>
+
+#ifdef Q_OS_LINUX
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#ifdef Q_OS_DARWIN
+#include <sys/resource.h>
+#endif
+#ifdef Q_OS_WIN
+#include <windows.h>
+#endif
+
+namespace
+{
+    std::mutex policyMutex;
+
+    ThreadPlacement::Policy *policies()
+    {
+        static ThreadPlacement::Policy p[ThreadPlacement::StageCount];
+        static bool initialized = false;
+        if (!initialized)
+        {
+            /* Writing the image to the device comes first */
+            p[ThreadPlacement::StageCache].ioClass = ThreadPlacement::IoIdle;
+            initialized = true;
+        }
+
+        return p;
+    }
+
+    bool parseCpus(const QString &value, QList<int> &cpus)
+    {
+        const QStringList parts = value.split(',');
+        for (const QString &part : parts)
+        {
+            QStringList range = part.split('-');
+            bool okFirst = false, okLast = false;
+            int first = range.value(0).toInt(&okFirst);
+            int last = range.size() == 2 ? range[1].toInt(&okLast) : first;
+            if (range.size() > 2 || !okFirst || (range.size() == 2 && !okLast) || first < 0 || last < first || last > 1023)
+                return false;
+            for (int cpu = first; cpu <= last; cpu++)
+                cpus.append(cpu);
+        }
+
+        return !cpus.isEmpty();
+    }
+
+    bool parseIo(const QString &value, ThreadPlacement::Policy &policy)
+    {
+        if (value == "idle")
+        {
+            policy.ioClass = ThreadPlacement::IoIdle;
+            return true;
+        }
+
+        QStringList parts = value.split('/');
+        if (parts[0] == "rt")
+            policy.ioClass = ThreadPlacement::IoRealtime;
+        else if (parts[0] == "be")
+            policy.ioClass = ThreadPlacement::IoBestEffort;
+        else
+            return false;
+
+        bool ok = true;
+        if (parts.size() == 2)
+            policy.ioLevel = parts[1].toInt(&ok);
+
+        return ok && parts.size() <= 2 && policy.ioLevel >= 0 && policy.ioLevel <= 7;
+    }
+}
+
+void ThreadPlacement::setPolicy(Stage stage, const Policy &policy)
+{
+    std::lock_guard<std::mutex> lock(policyMutex);
+    policies()[stage] = policy;
+}
+
+ThreadPlacement::Policy ThreadPlacement::policy(Stage stage)
+{
+    std::lock_guard<std::mutex> lock(policyMutex);
+    return policies()[stage];
+}
+
+QString ThreadPlacement::stageName(Stage stage)
+{
+    static const char *names[StageCount] = {"download", "extract", "write", "verify", "hash", "cache"};
+    return names[stage];
+}
+
+bool ThreadPlacement::parse(const QString &spec, QString *error)
+{
+    QList<QPair<Stage, Policy>> parsed;
+    const QStringList entries = spec.split(';', Qt::SkipEmptyParts);
+
+    for (const QString &entry : entries)
+    {
+        QStringList fields = entry.trimmed().split(':');
+        int stage = 0;
+        while (stage < StageCount && stageName((Stage) stage) != fields[0])
+            stage++;
+        if (stage == StageCount)
+        {
+            if (error)
+                *error = QString("Unknown pipeline stage '%1'").arg(fields[0]);
+            return false;
+        }
+
+        Policy p;
+        for (int i = 1; i < fields.size(); i++)
+        {
+            QString key = fields[i].section('=', 0, 0), value = fields[i].section('=', 1);
+            bool ok = false;
+            if (key == "cpus")
+            {
+                ok = parseCpus(value, p.cpus);
+            }
+            else if (key == "nice")
+            {
+                p.nice = value.toInt(&ok);
+                p.hasNice = ok = ok && p.nice >= -20 && p.nice <= 19;
+            }
+            else if (key == "io")
+            {
+                ok = parseIo(value, p);
+            }
+
+            if (!ok)
+            {
+                if (error)
+                    *error = QString("Invalid setting '%1' for pipeline stage %2").arg(fields[i], fields[0]);
+                return false;
+            }
+        }
+        parsed.append({(Stage) stage, p});
+    }
+
+    for (const auto &stagePolicy : std::as_const(parsed))
+        setPolicy(stagePolicy.first, stagePolicy.second);
+
+    return true;
+}
+
+void ThreadPlacement::apply(Stage stage)
+{
+    Policy p = policy(stage);
+    QString name = stageName(stage);
+
+#ifdef Q_OS_LINUX
+    if (!p.cpus.isEmpty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : std::as_const(p.cpus))
+            CPU_SET(cpu, &set);
+        if (::sched_setaffinity(0, sizeof(set), &set) == -1)
+            qDebug() << "Cannot pin" << name << "thread to cores" << p.cpus << ":" << strerror(errno);
+    }
+    /* Nice values are per thread on Linux */
+    if (p.hasNice && ::setpriority(PRIO_PROCESS, ::syscall(SYS_gettid), p.nice) == -1)
+        qDebug() << "Cannot set nice level of" << name << "thread to" << p.nice << ":" << strerror(errno);
+    if (p.ioClass != IoUnchanged)
+    {
+        /* ioprio_set(IOPRIO_WHO_PROCESS, 0, ...) applies to the calling thread. glibc has no wrapper */
+        const int whoProcess = 1, classShift = 13;
+        int ioprio = (int) p.ioClass << classShift | (p.ioClass == IoIdle ? 0 : p.ioLevel);
+        if (::syscall(SYS_ioprio_set, whoProcess, 0, ioprio) == -1)
+            qDebug() << "Cannot set I/O priority of" << name << "thread:" << strerror(errno);
+    }
+#elif defined(Q_OS_DARWIN)
+    if (p.ioClass != IoUnchanged)
+    {
+        int policy = p.ioClass == IoIdle ? IOPOL_THROTTLE : (p.ioClass == IoRealtime ? IOPOL_IMPORTANT : IOPOL_DEFAULT);
+        if (::setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, policy) == -1)
+            qDebug() << "Cannot set I/O priority of" << name << "thread:" << strerror(errno);
+    }
+#elif defined(Q_OS_WIN)
+    if (!p.cpus.isEmpty())
+    {
+        DWORD_PTR mask = 0;
+        for (int cpu : std::as_const(p.cpus))
+        {
+            if (cpu < (int) sizeof(mask) * 8)
+                mask |= (DWORD_PTR) 1 << cpu;
+        }
+        if (!mask || !::SetThreadAffinityMask(::GetCurrentThread(), mask))
+            qDebug() << "Cannot pin" << name << "thread to cores" << p.cpus << ":" << ::GetLastError();
+    }
+    if (p.hasNice)
+    {
+        int priority = THREAD_PRIORITY_NORMAL;
+        if (p.nice <= -10)
+            priority = THREAD_PRIORITY_HIGHEST;
+        else if (p.nice < 0)
+            priority = THREAD_PRIORITY_ABOVE_NORMAL;
+        else if (p.nice >= 10)
+            priority = THREAD_PRIORITY_LOWEST;
+        else if (p.nice > 0)
+            priority = THREAD_PRIORITY_BELOW_NORMAL;
+        ::SetThreadPriority(::GetCurrentThread(), priority);
+    }
+    /* Lowers CPU priority as well */
+    if (p.ioClass == IoIdle && !::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN))
+        qDebug() << "Cannot set I/O priority of" << name << "thread:" << ::GetLastError();
+#endif
+}
@@ -0,0 +1,75 @@
+#ifndef THREADPLACEMENT_H
+#define THREADPLACEMENT_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QList>
+#include <QString>
+
+/*
+ * CPU cores, nice level and I/O class of the threads of each stage of
+ * the write pipeline
+ *
+ * Every pipeline thread calls apply() with its stage when it starts.
+ * By default nothing is changed, except that the cache writer only gets
+ * the disk when nobody else wants it. On small boards with few cores,
+ * keeping the stages on cores of their own stops them from competing
+ * with each other and the GUI.
+ *
+ * Core pinning and nice levels are applied on Linux and Windows, I/O
+ * classes on Linux, with idle mapped to background or throttled I/O on
+ * Windows and macOS.
+ */
+class ThreadPlacement
+{
+public:
+    enum Stage
+    {
+        /* Receiving the download, or reading the local image file */
+        StageDownload,
+        StageExtract,
+        StageWrite,
+        /* Reading back written data while writing continues, with overlapped verify */
+        StageVerify,
+        /* Hashing the extracted image while it is written, see HashStage */
+        StageHash,
+        StageCache,
+        StageCount
+    };
+
+    /* Numbered like the Linux IOPRIO_CLASS_* */
+    enum IoClass
+    {
+        IoUnchanged,
+        IoRealtime,
+        IoBestEffort,
+        IoIdle
+    };
+
+    struct Policy
+    {
+        /* Cores the thread may run on, empty for any */
+        QList<int> cpus;
+        bool hasNice = false;
+        int nice = 0;
+        IoClass ioClass = IoUnchanged;
+        /* Priority within realtime and best effort, 0 (highest) to 7 */
+        int ioLevel = 4;
+    };
+
+    static void setPolicy(Stage stage, const Policy &policy);
+    static Policy policy(Stage stage);
+    /* Apply the policy of stage to the calling thread */
+    static void apply(Stage stage);
+
+    /* Set the policies of the stages in spec, like "write:cpus=2,3:nice=-5:io=rt/4;extract:cpus=1".
+       Fields are cpus (numbers and ranges like 0-3), nice (-20 to 19) and io (idle, be/<level>
+       or rt/<level>). On errors nothing is changed, false is returned and error says why */
+    static bool parse(const QString &spec, QString *error = nullptr);
+    static QString stageName(Stage stage);
+};
+
+#endif // THREADPLACEMENT_H
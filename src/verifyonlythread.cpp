@@ -0,0 +1,262 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "verifyonlythread.h"
+#include "acceleratedcryptographichash.h"
+#include "cachesidecar.h"
+#include "config.h"
+#include "imageprobe.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <QFile>
+
+VerifyOnlyThread::VerifyOnlyThread(const QByteArray &dst, QObject *parent)
+    : DownloadThread("", dst, "", false, parent), _imageSize(0), _worker(false)
+{
+    _verifyEnabled = true;
+}
+
+VerifyOnlyThread::~VerifyOnlyThread()
+{
+    wait();
+}
+
+void VerifyOnlyThread::addDevice(const QByteArray &dst)
+{
+    _extraDevices.append(dst);
+}
+
+void VerifyOnlyThread::setImageFile(const QString &filename)
+{
+    _imageFile = filename;
+}
+
+void VerifyOnlyThread::setExpectedHash(const QByteArray &sha256)
+{
+    _verifiedHash = QByteArray::fromHex(sha256);
+    _hasVerifiedInput = !_verifiedHash.isEmpty();
+}
+
+void VerifyOnlyThread::setImageSize(quint64 size)
+{
+    _imageSize = size;
+}
+
+void VerifyOnlyThread::cancelDownload()
+{
+    DownloadThread::cancelDownload();
+
+    std::lock_guard<std::mutex> lock(_workersMutex);
+    for (VerifyOnlyThread *worker : std::as_const(_workers))
+        worker->cancelDownload();
+}
+
+void VerifyOnlyThread::run()
+{
+    if (_worker)
+    {
+        _verifyDevice();
+        return;
+    }
+    if (!_prepareExpected())
+        return;
+
+    /* Every drive is read by a thread of its own, with the hashes worked out above */
+    QList<QByteArray> devices = QList<QByteArray>({_filename}) + _extraDevices;
+    {
+        std::lock_guard<std::mutex> lock(_workersMutex);
+        for (const QByteArray &device : std::as_const(devices))
+        {
+            VerifyOnlyThread *worker = new VerifyOnlyThread(device);
+            worker->_worker = true;
+            worker->_imageSize = _imageSize;
+            worker->_verifiedHash = _verifiedHash;
+            worker->_hasVerifiedInput = _hasVerifiedInput;
+            worker->_hasVerifiedChunks = _hasVerifiedChunks;
+            worker->_chunkhash.setAlgorithm(_chunkhash.algorithm());
+            if (_hasVerifiedChunks)
+                worker->_chunkhash.setLeaves(_chunkhash.leaves());
+            worker->_directIO = _directIO;
+            worker->_ioUringEnabled = _ioUringEnabled;
+            worker->_budget = _budget;
+            /* A failing drive must not stop the others, so only remember why */
+            connect(worker, &DownloadThread::error, worker, [worker](QString msg) {
+                worker->_failure = msg;
+            }, Qt::DirectConnection);
+            connect(worker, &VerifyOnlyThread::verifyResult, this, &VerifyOnlyThread::verifyResult, Qt::DirectConnection);
+            _workers.append(worker);
+            worker->start();
+        }
+    }
+
+    /* Progress is that of all drives together */
+    _startPhase(PhaseVerify);
+    bool running = true;
+    while (running)
+    {
+        running = false;
+        quint64 now = 0, total = 0;
+        for (VerifyOnlyThread *worker : std::as_const(_workers))
+        {
+            if (!worker->wait((unsigned long) (PROGRESS_UPDATE_INTERVAL / _workers.size() + 1)))
+                running = true;
+            now += worker->verifyNow();
+            total += worker->verifyTotal();
+        }
+        _lastVerifyNow = now;
+        _verifyTotal = total;
+        _publishProgress();
+    }
+    _endPhase(PhaseVerify, _lastVerifyNow);
+
+    QStringList failures;
+    for (VerifyOnlyThread *worker : std::as_const(_workers))
+    {
+        if (!worker->_failure.isEmpty())
+            failures.append(QString("%1: %2").arg(QString(worker->_filename), worker->_failure));
+    }
+    {
+        std::lock_guard<std::mutex> lock(_workersMutex);
+        qDeleteAll(_workers);
+        _workers.clear();
+    }
+
+    if (_cancelled)
+        return;
+    if (!failures.isEmpty())
+    {
+        emit error(tr("Verifying failed on %1 of %2 storage devices:<br>%3").arg(failures.size()).arg(devices.size()).arg(failures.join("<br>")));
+        return;
+    }
+    emit success();
+}
+
+/* Works out the size and hashes of the extracted image from what was given */
+bool VerifyOnlyThread::_prepareExpected()
+{
+    if (!_imageFile.isEmpty())
+    {
+        ImageProbe::Result probe = ImageProbe::probeFile(_imageFile);
+        if (probe.size)
+        {
+            /* Compressed. Extracting it just to hash it would take as long as writing */
+            if (!_imageSize && probe.exact)
+                _imageSize = probe.size;
+
+            CacheSidecar sidecar;
+            if (sidecar.load(_imageFile) && (_verifiedHash.isEmpty() || sidecar.extractHash == _verifiedHash.toHex()))
+                setVerifiedInput(sidecar);
+            if (_verifiedHash.isEmpty())
+            {
+                emit error(tr("Verifying against a compressed image needs the SHA256 of the extracted image."));
+                return false;
+            }
+        }
+        else if (!_hashImageFile())
+        {
+            return false;
+        }
+    }
+
+    if (_verifiedHash.isEmpty())
+    {
+        emit error(tr("Nothing to verify against. An image file or the SHA256 of the image is needed."));
+        return false;
+    }
+    if (!_imageSize)
+    {
+        emit error(tr("Size of the extracted image is not known."));
+        return false;
+    }
+
+    return true;
+}
+
+bool VerifyOnlyThread::_hashImageFile()
+{
+    QFile f(_imageFile);
+    if (!f.open(QIODevice::ReadOnly))
+    {
+        emit error(tr("Error opening image file"));
+        return false;
+    }
+
+    emit preparationStatusUpdate(tr("hashing image"));
+    AcceleratedCryptographicHash hash(QCryptographicHash::Sha256);
+    QByteArray buf(IMAGEWRITER_HASH_CHUNKSIZE, Qt::Uninitialized);
+    QElapsedTimer t;
+    t.start();
+    _chunkhash.reset();
+
+    qint64 len;
+    while (!_cancelled && (len = f.read(buf.data(), buf.size())) > 0)
+    {
+        hash.addData(buf.constData(), len);
+        _chunkhash.addData(buf.constData(), len);
+    }
+    if (len < 0)
+    {
+        emit error(tr("Error reading image file"));
+        return false;
+    }
+    if (_cancelled)
+        return false;
+
+    _chunkhash.finalize();
+    QByteArray sha256 = hash.result();
+    if (_hasVerifiedInput && sha256 != _verifiedHash)
+    {
+        emit error(tr("SHA256 of the image file does not match the expected hash"));
+        return false;
+    }
+    _verifiedHash = sha256;
+    _hasVerifiedInput = _hasVerifiedChunks = true;
+    _imageSize = f.size();
+    qDebug() << "Hashed" << _imageSize << "bytes of image in" << t.elapsed() / 1000.0 << "seconds:" << sha256.toHex();
+
+    return true;
+}
+
+bool VerifyOnlyThread::_verifyDevice()
+{
+    QVariantMap result = {{"device", QString(_filename)}};
+
+    bool ok = _openDeviceReadOnly();
+    if (ok)
+    {
+        quint64 driveSize = _blockDevice()->size();
+        if (driveSize && driveSize < _imageSize)
+        {
+            _failure = tr("Storage device is smaller than the image.");
+            ok = false;
+        }
+    }
+    if (ok)
+    {
+        /* _verify() reads the drive up to the position written to */
+        _file.seek(_imageSize);
+        _chunkedVerify = _hasVerifiedChunks;
+        ok = _verify() && _failure.isEmpty();
+    }
+    _closeFiles();
+
+    if (_cancelled && _failure.isEmpty())
+        return true;
+
+    result["passed"] = ok;
+    if (!ok && _mismatchLength)
+    {
+        result["mismatchOffset"] = (qulonglong) _mismatchOffset;
+        result["mismatchLength"] = (qulonglong) _mismatchLength;
+        qDebug() << _filename << "differs from the image at offset" << _mismatchOffset << "length" << _mismatchLength;
+    }
+    else if (!ok)
+    {
+        result["error"] = _failure;
+    }
+    emit verifyResult(result);
+
+    return ok;
+}
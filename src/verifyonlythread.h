@@ -0,0 +1,69 @@
+#ifndef VERIFYONLYTHREAD_H
+#define VERIFYONLYTHREAD_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "downloadthread.h"
+#include <QList>
+#include <QVariantMap>
+#include <mutex>
+
+/*
+ * Checks that drives written earlier still hold an image, without writing them
+ *
+ * The expected contents are given as one of:
+ * - an uncompressed image file, which is hashed first
+ * - a compressed image file of a known extracted size, with the SHA256 of the
+ *   extracted image (setExpectedHash()) or a cache sidecar next to it
+ * - the SHA256 and size of the extracted image only
+ *
+ * The drives are opened read-only and read with the same engine as the verify
+ * after writing. If chunk hashes are available (image file, sidecar) chunks are
+ * verified on all cores, and a mismatch is located to the chunk.
+ *
+ * Every drive gets a verifyResult(). Then success() if all of them passed,
+ * error() otherwise.
+ */
+class VerifyOnlyThread : public DownloadThread
+{
+    Q_OBJECT
+public:
+    explicit VerifyOnlyThread(const QByteArray &dst, QObject *parent = nullptr);
+    virtual ~VerifyOnlyThread();
+
+    /* Another drive to verify against the same image, at the same time */
+    void addDevice(const QByteArray &dst);
+    void setImageFile(const QString &filename);
+    /* Hex encoded SHA256 of the extracted image */
+    void setExpectedHash(const QByteArray &sha256);
+    /* Size of the extracted image. Only needed if it cannot be told from the image file */
+    void setImageSize(quint64 size);
+    virtual void cancelDownload() override;
+
+signals:
+    /* Map with "device" and "passed". If not passed, "mismatchOffset" and "mismatchLength"
+       of the first region found different, or "error" if the drive could not be read */
+    void verifyResult(QVariantMap result);
+
+protected:
+    QString _imageFile;
+    quint64 _imageSize;
+    QList<QByteArray> _extraDevices;
+    /* Threads reading the drives, one per drive. A worker verifies the drive
+       it was created for only, and records why it failed in _failure */
+    QList<VerifyOnlyThread *> _workers;
+    std::mutex _workersMutex;
+    bool _worker;
+    QString _failure;
+
+    virtual void run() override;
+    bool _prepareExpected();
+    bool _hashImageFile();
+    /* Verifies this thread's drive and emits its verifyResult(). False if it failed */
+    bool _verifyDevice();
+};
+
+#endif // VERIFYONLYTHREAD_H
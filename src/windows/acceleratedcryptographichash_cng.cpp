@@ -8,6 +8,7 @@
 #include <QDebug>
 
 #include "acceleratedcryptographichash.h"
+#include "sha256native.h"
 
 #include <windows.h>
 #include <bcrypt.h>
@@ -121,18 +122,24 @@ struct AcceleratedCryptographicHash::impl {
         } 
     }
 
-    void addData(const char *data, int length)
+    void addData(const char *data, size_t length)
     {
-        //hash some data
-        if(!NT_SUCCESS(status = BCryptHashData(
-                                            hHash,
-                                            (PBYTE)data,
-                                            length,
-                                            0)))
+        //hash some data, in pieces that fit in a ULONG
+        while (length)
         {
-            qDebug() << "BCryptHashData returned Error " << status;
-            cleanup();
-            return;
+            ULONG n = (ULONG) qMin(length, (size_t) 0x40000000);
+            if(!NT_SUCCESS(status = BCryptHashData(
+                                                hHash,
+                                                (PBYTE)data,
+                                                n,
+                                                0)))
+            {
+                qDebug() << "BCryptHashData returned Error " << status;
+                cleanup();
+                return;
+            }
+            data += n;
+            length -= n;
         }
     }
 
@@ -182,16 +189,24 @@ private:
 };
 
 AcceleratedCryptographicHash::AcceleratedCryptographicHash(QCryptographicHash::Algorithm method)
-    : p_Impl(std::make_unique<impl>(method)) {}
+{
+    if (method == QCryptographicHash::Sha256 && nativeImplementation())
+        p_Native = std::make_unique<Sha256Native>();
+    else
+        p_Impl = std::make_unique<impl>(method);
+}
 
 AcceleratedCryptographicHash::~AcceleratedCryptographicHash() = default;
 
-void AcceleratedCryptographicHash::addData(const char *data, int length) {
-    p_Impl->addData(data, length);
+void AcceleratedCryptographicHash::addData(const char *data, size_t length) {
+    if (p_Native)
+        p_Native->addData(data, length);
+    else
+        p_Impl->addData(data, length);
 }
 void AcceleratedCryptographicHash::addData(const QByteArray &data) {
-    p_Impl->addData(data);
+    addData(data.constData(), data.size());
 }
 QByteArray AcceleratedCryptographicHash::result() {
-    return p_Impl->result();
+    return p_Native ? p_Native->result() : p_Impl->result();
 }
\ No newline at end of file
@@ -0,0 +1,99 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "winblockdevice.h"
+#include <winioctl.h>
+#include <stddef.h>
+
+WinBlockDevice::WinBlockDevice(WinFile *file)
+    : _file(file), _size(0)
+{
+    GET_LENGTH_INFORMATION lengthInfo = {};
+    DWORD bytesReturned = 0;
+
+    if (_file->ioControl(IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &lengthInfo, sizeof(lengthInfo), &bytesReturned))
+    {
+        _size = lengthInfo.Length.QuadPart;
+
+        STORAGE_PROPERTY_QUERY query = {};
+        DEVICE_TRIM_DESCRIPTOR trim = {};
+        query.PropertyId = StorageDeviceTrimProperty;
+        query.QueryType = PropertyStandardQuery;
+        if (_file->ioControl(IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &trim, sizeof(trim), &bytesReturned)
+                && bytesReturned >= sizeof(trim) && trim.TrimEnabled)
+            _capabilities |= CanDiscard;
+    }
+    else
+    {
+        _capabilities |= IsRegularFile;
+    }
+}
+
+qint64 WinBlockDevice::pread(char *buf, size_t len, quint64 offset)
+{
+    qint64 n = _file->readAt(buf, len, offset);
+    if (n == -1)
+        _error = _file->errorString();
+    return n;
+}
+
+qint64 WinBlockDevice::pwrite(const char *buf, size_t len, quint64 offset)
+{
+    qint64 n = _file->writeAt(buf, len, offset);
+    if (n == -1)
+        _error = _file->errorString();
+    return n;
+}
+
+bool WinBlockDevice::discard(quint64 offset, quint64 len)
+{
+    struct
+    {
+        DEVICE_MANAGE_DATA_SET_ATTRIBUTES dsm;
+        DEVICE_DATA_SET_RANGE range;
+    } request = {};
+    DWORD bytesReturned = 0;
+
+    if (!(_capabilities & CanDiscard))
+        return BlockDevice::discard(offset, len);
+
+    request.dsm.Size = sizeof(request.dsm);
+    request.dsm.Action = DeviceDsmAction_Trim;
+    if (!offset && len >= _size)
+    {
+        request.dsm.Flags = DEVICE_DSM_FLAG_ENTIRE_DATA_SET_RANGE;
+    }
+    else
+    {
+        request.dsm.DataSetRangesOffset = offsetof(decltype(request), range);
+        request.dsm.DataSetRangesLength = sizeof(request.range);
+        request.range.StartingOffset = offset;
+        request.range.LengthInBytes = len;
+    }
+
+    if (!_file->ioControl(IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &request, sizeof(request), NULL, 0, &bytesReturned))
+    {
+        _error = _file->errorString();
+        return false;
+    }
+
+    return true;
+}
+
+bool WinBlockDevice::flush()
+{
+    return _file->flush();
+}
+
+quint64 WinBlockDevice::size()
+{
+    LARGE_INTEGER fileSize;
+
+    /* Files grow while they are written */
+    if (_capabilities & IsRegularFile)
+        return GetFileSizeEx(_file->handle(), &fileSize) ? fileSize.QuadPart : 0;
+
+    return _size;
+}
@@ -0,0 +1,34 @@
+#ifndef WINBLOCKDEVICE_H
+#define WINBLOCKDEVICE_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "blockdevice.h"
+
+/*
+ * BlockDevice on a WinFile
+ *
+ * Drives that report TRIM support discard with
+ * IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES. Nothing is zeroed out by the
+ * device itself.
+ */
+class WinBlockDevice : public BlockDevice
+{
+public:
+    WinBlockDevice(WinFile *file);
+
+    virtual qint64 pread(char *buf, size_t len, quint64 offset) override;
+    virtual qint64 pwrite(const char *buf, size_t len, quint64 offset) override;
+    virtual bool discard(quint64 offset, quint64 len) override;
+    virtual bool flush() override;
+    virtual quint64 size() override;
+
+protected:
+    WinFile *_file;
+    quint64 _size;
+};
+
+#endif // WINBLOCKDEVICE_H
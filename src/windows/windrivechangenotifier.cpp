@@ -0,0 +1,65 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "../drivechangenotifier.h"
+#include <QDebug>
+#include <windows.h>
+#include <initguid.h>
+#include <winioctl.h>
+#include <ntddser.h>
+#include <ndisguid.h>
+#include <cfgmgr32.h>
+
+/* Disks come and go with their device interface, partitions and mounts with their volumes' */
+static DWORD CALLBACK _onDeviceInterfaceChange(HCMNOTIFICATION, PVOID context, CM_NOTIFY_ACTION action, PCM_NOTIFY_EVENT_DATA, DWORD)
+{
+    if (action == CM_NOTIFY_ACTION_DEVICEINTERFACEARRIVAL || action == CM_NOTIFY_ACTION_DEVICEINTERFACEREMOVAL)
+        static_cast<DriveChangeNotifier *>(context)->notify();
+
+    return ERROR_SUCCESS;
+}
+
+DriveChangeNotifier::~DriveChangeNotifier()
+{
+    _stop();
+}
+
+bool DriveChangeNotifier::start()
+{
+    const GUID *storageInterfaces[] = { &GUID_DEVINTERFACE_DISK, &GUID_DEVINTERFACE_VOLUME };
+    const GUID *portInterfaces[] = { &GUID_DEVINTERFACE_COMPORT, &GUID_DEVINTERFACE_NET };
+    const GUID **interfaces = _devices == Ports ? portInterfaces : storageInterfaces;
+
+    for (int i = 0; i < 2; i++)
+    {
+        const GUID *guid = interfaces[i];
+        CM_NOTIFY_FILTER filter;
+        HCMNOTIFICATION handle;
+
+        ZeroMemory(&filter, sizeof(filter));
+        filter.cbSize = sizeof(filter);
+        filter.FilterType = CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+        filter.u.DeviceInterface.ClassGuid = *guid;
+
+        CONFIGRET ret = CM_Register_Notification(&filter, this, _onDeviceInterfaceChange, &handle);
+        if (ret != CR_SUCCESS)
+        {
+            qDebug() << "Cannot register for device notifications:" << ret;
+            _stop();
+            return false;
+        }
+        _handles.push_back(handle);
+    }
+
+    return true;
+}
+
+void DriveChangeNotifier::_stop()
+{
+    /* Waits for callbacks in progress */
+    for (void *handle : _handles)
+        CM_Unregister_Notification((HCMNOTIFICATION) handle);
+    _handles.clear();
+}
@@ -7,8 +7,32 @@
 #include <QDebug>
 #include <QThread>
 
+/* Queued write, the completion port hands back its OVERLAPPED */
+struct WinFileRequest
+{
+    OVERLAPPED ov;
+    quint64 userData;
+    DWORD len;
+};
+
+/* Event a thread waits on for its own requests, so several threads can
+   have requests in flight on the same handle */
+namespace
+{
+    struct ThreadEvent
+    {
+        HANDLE h = CreateEvent(NULL, TRUE, FALSE, NULL);
+        ~ThreadEvent()
+        {
+            if (h)
+                CloseHandle(h);
+        }
+    };
+}
+
 WinFile::WinFile(QObject *parent)
-    : QObject(parent), _locked(false), _h(INVALID_HANDLE_VALUE), _lasterrorcode(0)
+    : QObject(parent), _locked(false), _unbuffered(false), _overlapped(false), _h(INVALID_HANDLE_VALUE), _port(NULL),
+      _lasterrorcode(0), _pos(0), _inFlight(0)
 {
 
 }
@@ -29,6 +53,12 @@ bool WinFile::open(QIODevice::OpenMode mode)
     std::wstring n = _name.toStdWString();
     DWORD dwordCreationDisposition {};
     DWORD dwordAccessMode {};
+    DWORD dwordFlags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN;
+
+    if (_unbuffered)
+        dwordFlags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH;
+    if (_overlapped)
+        dwordFlags |= FILE_FLAG_OVERLAPPED;
 
     if (mode == (QIODevice::ReadWrite | QIODevice::Unbuffered))
     {
@@ -48,7 +78,7 @@ bool WinFile::open(QIODevice::OpenMode mode)
 
     for (int attempt = 0; attempt < 20; attempt++)
     {
-        _h = CreateFileW(n.c_str(), dwordAccessMode, FILE_SHARE_READ, NULL, dwordCreationDisposition, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        _h = CreateFileW(n.c_str(), dwordAccessMode, FILE_SHARE_READ, NULL, dwordCreationDisposition, dwordFlags, NULL);
         if (_h != INVALID_HANDLE_VALUE)
             break;
 
@@ -58,7 +88,7 @@ bool WinFile::open(QIODevice::OpenMode mode)
 
     // Try with FILE_SHARE_WRITE
     if (_h == INVALID_HANDLE_VALUE)
-        _h = CreateFileW(n.c_str(), dwordAccessMode, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        _h = CreateFileW(n.c_str(), dwordAccessMode, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, dwordFlags & ~FILE_FLAG_SEQUENTIAL_SCAN, NULL);
 
     if (_h == INVALID_HANDLE_VALUE)
     {
@@ -68,6 +98,19 @@ bool WinFile::open(QIODevice::OpenMode mode)
         return false;
     }
 
+    _pos = 0;
+    if (_overlapped)
+    {
+        _port = CreateIoCompletionPort(_h, NULL, 0, 0);
+        if (!_port)
+        {
+            _setLastError();
+            qDebug() << "Error setting up overlapped I/O:" << _lasterror;
+            close();
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -81,8 +124,22 @@ void WinFile::close()
         unlockVolume();
     }
 
+    /* Buffers of queued writes may not be freed before they completed */
+    while (_inFlight)
+    {
+        quint64 userData;
+        qint64 res;
+        if (!waitCompletion(&userData, &res))
+            break;
+    }
+
     CloseHandle(_h);
     _h = INVALID_HANDLE_VALUE;
+    if (_port)
+    {
+        CloseHandle(_port);
+        _port = NULL;
+    }
 }
 
 bool WinFile::isOpen()
@@ -92,64 +149,163 @@ bool WinFile::isOpen()
 
 qint64 WinFile::write(const char *data, qint64 maxSize)
 {
-    DWORD bytesWritten;
-
     if (maxSize % 512)
         qDebug() << "write: NOT SECTOR ALIGNED";
 
-    if (!WriteFile(_h, data, maxSize, &bytesWritten, NULL))
-    {
-        _lasterrorcode = GetLastError();
-        _lasterror = qt_error_string();
-        return -1;
-    }
+    qint64 bytesWritten = writeAt(data, maxSize, _pos);
+    if (bytesWritten > 0)
+        _pos += bytesWritten;
 
     return bytesWritten;
 }
 
 qint64 WinFile::read(char *data, qint64 maxSize)
 {
+    qint64 bytesRead = readAt(data, maxSize, _pos);
+    if (bytesRead > 0)
+        _pos += bytesRead;
+
+    return bytesRead;
+}
+
+qint64 WinFile::writeAt(const char *data, qint64 maxSize, qint64 offset)
+{
+    OVERLAPPED ov;
+    DWORD bytesWritten;
+
+    _prepareRequest(&ov, offset);
+    if (!_waitForRequest(&ov, WriteFile(_h, data, maxSize, NULL, &ov), &bytesWritten))
+        return -1;
+
+    return bytesWritten;
+}
+
+qint64 WinFile::readAt(char *data, qint64 maxSize, qint64 offset)
+{
+    OVERLAPPED ov;
     DWORD bytesRead;
 
-    if (!ReadFile(_h, data, maxSize, &bytesRead, NULL))
+    _prepareRequest(&ov, offset);
+    if (!_waitForRequest(&ov, ReadFile(_h, data, maxSize, NULL, &ov), &bytesRead))
+        return _lasterrorcode == ERROR_HANDLE_EOF ? 0 : -1;
+
+    return bytesRead;
+}
+
+/* Request the caller waits for itself. Every request carries its offset, synchronous
+   handles included, so the file pointer never matters. The low bit of the event
+   keeps its completion off the port, where only queued writes are expected */
+void WinFile::_prepareRequest(OVERLAPPED *ov, qint64 offset)
+{
+    static thread_local ThreadEvent event;
+
+    ZeroMemory(ov, sizeof(*ov));
+    ov->Offset = (DWORD) offset;
+    ov->OffsetHigh = (DWORD) (offset >> 32);
+    if (_overlapped)
+        ov->hEvent = (HANDLE) ((ULONG_PTR) event.h | 1);
+}
+
+bool WinFile::_waitForRequest(OVERLAPPED *ov, BOOL started, DWORD *bytes)
+{
+    if ((!started && GetLastError() != ERROR_IO_PENDING) || !GetOverlappedResult(_h, ov, bytes, TRUE))
     {
-        _lasterrorcode = GetLastError();
-        _lasterror = qt_error_string();
-        return -1;
+        _setLastError();
+        return false;
     }
 
-    return bytesRead;
+    return true;
 }
 
-bool WinFile::seek(qint64 pos)
+bool WinFile::queueWrite(const char *data, DWORD len, qint64 offset, quint64 userData)
 {
-    LARGE_INTEGER current;
-    LARGE_INTEGER offset;
-    offset.QuadPart = pos;
-    if (!SetFilePointerEx(_h, offset, &current, FILE_BEGIN))
+    WinFileRequest *req = new WinFileRequest();
+    req->ov.Offset = (DWORD) offset;
+    req->ov.OffsetHigh = (DWORD) (offset >> 32);
+    req->userData = userData;
+    req->len = len;
+
+    /* Completes on the port, also when it completed right away */
+    if (!WriteFile(_h, data, len, NULL, &req->ov) && GetLastError() != ERROR_IO_PENDING)
     {
-        _lasterrorcode = GetLastError();
-        _lasterror = qt_error_string();
-        qDebug() << "Error seeking:" << _lasterror;
+        _setLastError();
+        delete req;
         return false;
     }
+    _inFlight++;
 
     return true;
 }
 
-qint64 WinFile::pos()
+bool WinFile::waitCompletion(quint64 *userData, qint64 *res)
 {
-    LARGE_INTEGER current;
-    LARGE_INTEGER offset;
-    offset.QuadPart = 0;
-    if (!SetFilePointerEx(_h, offset, &current, FILE_CURRENT))
+    DWORD bytes = 0;
+    ULONG_PTR key;
+    OVERLAPPED *ov = NULL;
+
+    if (!_inFlight)
+        return false;
+
+    BOOL ok = GetQueuedCompletionStatus(_port, &bytes, &key, &ov, INFINITE);
+    if (!ov)
     {
-        _lasterrorcode = GetLastError();
-        _lasterror = qt_error_string();
-        return 0;
+        /* The port itself failed, nothing was dequeued */
+        _setLastError();
+        return false;
+    }
+    _inFlight--;
+
+    WinFileRequest *req = reinterpret_cast<WinFileRequest *>(ov);
+    *userData = req->userData;
+    *res = bytes;
+    if (!ok)
+    {
+        _setLastError();
+        *res = -1;
     }
+    delete req;
 
-    return qint64(current.QuadPart);
+    return true;
+}
+
+unsigned WinFile::inFlight() const
+{
+    return _inFlight;
+}
+
+bool WinFile::ioControl(DWORD code, void *in, DWORD inSize, void *out, DWORD outSize, DWORD *bytesReturned)
+{
+    if (_overlapped)
+    {
+        OVERLAPPED ov;
+        _prepareRequest(&ov, 0);
+        return _waitForRequest(&ov, DeviceIoControl(_h, code, in, inSize, out, outSize, NULL, &ov), bytesReturned);
+    }
+
+    if (!DeviceIoControl(_h, code, in, inSize, out, outSize, bytesReturned, NULL))
+    {
+        _setLastError();
+        return false;
+    }
+
+    return true;
+}
+
+void WinFile::_setLastError()
+{
+    _lasterrorcode = GetLastError();
+    _lasterror = qt_error_string(_lasterrorcode);
+}
+
+bool WinFile::seek(qint64 pos)
+{
+    _pos = pos;
+    return true;
+}
+
+qint64 WinFile::pos()
+{
+    return _pos;
 }
 
 HANDLE WinFile::handle()
@@ -182,12 +338,12 @@ bool WinFile::flush()
 bool WinFile::lockVolume()
 {
     DWORD bytesRet;
-    DeviceIoControl(_h, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &bytesRet, NULL);
+    ioControl(FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &bytesRet);
     for (int attempt = 0; attempt < 20; attempt++)
     {
         qDebug() << "Locking volume" << _name;
 
-        if (DeviceIoControl(_h, FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytesRet, NULL))
+        if (ioControl(FSCTL_LOCK_VOLUME, NULL, 0, NULL, 0, &bytesRet))
         {
             _locked = true;
             qDebug() << "Locked volume";
@@ -208,7 +364,7 @@ bool WinFile::unlockVolume()
         return true;
 
     DWORD bytesRet;
-    if (DeviceIoControl(_h, FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &bytesRet, NULL))
+    if (ioControl(FSCTL_UNLOCK_VOLUME, NULL, 0, NULL, 0, &bytesRet))
     {
         _locked = false;
         qDebug() << "Unlocked volume";
@@ -220,3 +376,23 @@ bool WinFile::unlockVolume()
         return false;
     }
 }
+
+void WinFile::setUnbuffered(bool unbuffered)
+{
+    _unbuffered = unbuffered;
+}
+
+bool WinFile::isUnbuffered() const
+{
+    return _unbuffered;
+}
+
+void WinFile::setOverlapped(bool overlapped)
+{
+    _overlapped = overlapped;
+}
+
+bool WinFile::isOverlapped() const
+{
+    return _overlapped;
+}
@@ -22,6 +22,9 @@ public:
     bool isOpen();
     qint64 write(const char *data, qint64 maxSize);
     qint64 read(char *data, qint64 maxSize);
+    /* At offset, leaving the position alone. Safe to call from several threads at once */
+    qint64 writeAt(const char *data, qint64 maxSize, qint64 offset);
+    qint64 readAt(char *data, qint64 maxSize, qint64 offset);
     HANDLE handle();
     QString errorString() const;
     int errorCode() const;
@@ -30,12 +33,37 @@ public:
     qint64 pos();
     bool lockVolume();
     bool unlockVolume();
+    /* Open with FILE_FLAG_NO_BUFFERING. Requires sector aligned buffers, lengths and offsets */
+    void setUnbuffered(bool unbuffered);
+    bool isUnbuffered() const;
+    /* Open with FILE_FLAG_OVERLAPPED and an I/O completion port, for queueWrite().
+       The other calls keep working, they wait for their own request */
+    void setOverlapped(bool overlapped);
+    bool isOverlapped() const;
+    /* DeviceIoControl() that also works on an overlapped handle */
+    bool ioControl(DWORD code, void *in, DWORD inSize, void *out, DWORD outSize, DWORD *bytesReturned);
+
+    /* Start writing at offset without waiting for it. The buffer must stay valid until
+       its completion is returned. Only for overlapped handles */
+    bool queueWrite(const char *data, DWORD len, qint64 offset, quint64 userData);
+    /* Wait for a queued write to complete. res is bytes written or -1 on error, see errorString().
+       Returns false if there was nothing to wait for */
+    bool waitCompletion(quint64 *userData, qint64 *res);
+    /* Number of queued writes that did not complete yet */
+    unsigned inFlight() const;
 
 protected:
-    bool _locked;
+    bool _locked, _unbuffered, _overlapped;
     QString _name, _lasterror;
-    HANDLE _h;
+    HANDLE _h, _port;
     int _lasterrorcode;
+    /* Position for read() and write(). The file pointer of the handle is not used */
+    qint64 _pos;
+    unsigned _inFlight;
+
+    void _prepareRequest(OVERLAPPED *ov, qint64 offset);
+    bool _waitForRequest(OVERLAPPED *ov, BOOL started, DWORD *bytes);
+    void _setLastError();
 };
 
 #endif // WINFILE_H
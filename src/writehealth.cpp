@@ -0,0 +1,154 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "writehealth.h"
+#include "config.h"
+#include <QVariantList>
+#include <algorithm>
+
+WriteHealth::WriteHealth()
+{
+    reset();
+}
+
+void WriteHealth::reset()
+{
+    for (auto &b : _buckets)
+        b = 0;
+    _maxNsecs = 0;
+    _totalNsecs = 0;
+    _writes = 0;
+    std::lock_guard<std::mutex> lock(_samplesMutex);
+    _samples.clear();
+    _timer.start();
+    _nextSample = 0;
+}
+
+qint64 WriteHealth::_bucketLimit(int bucket)
+{
+    return (qint64) 64000 << bucket;
+}
+
+void WriteHealth::recordWrite(qint64 nsecs)
+{
+    int bucket = 0;
+    while (bucket < NumBuckets-1 && nsecs >= _bucketLimit(bucket))
+        bucket++;
+    _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    _totalNsecs.fetch_add(nsecs, std::memory_order_relaxed);
+    _writes.fetch_add(1, std::memory_order_relaxed);
+
+    quint64 max = _maxNsecs.load(std::memory_order_relaxed);
+    while ((quint64) nsecs > max && !_maxNsecs.compare_exchange_weak(max, nsecs, std::memory_order_relaxed))
+        ;
+}
+
+bool WriteHealth::sampleDue() const
+{
+    return _timer.elapsed() >= _nextSample.load(std::memory_order_relaxed);
+}
+
+void WriteHealth::addSample(const DeviceStats &stats, quint64 bytesWritten)
+{
+    std::lock_guard<std::mutex> lock(_samplesMutex);
+    qint64 now = _timer.elapsed();
+    if (now < _nextSample)
+        return;
+    _nextSample = now + IMAGEWRITER_HEALTH_SAMPLE_INTERVAL;
+    _samples.append({now, bytesWritten, stats});
+}
+
+/* Upper limit of the bucket the p'th write falls in */
+qint64 WriteHealth::_percentile(double p)
+{
+    quint64 total = _writes, seen = 0;
+    for (int i = 0; i < NumBuckets; i++)
+    {
+        seen += _buckets[i];
+        if (seen && seen >= total * p)
+            return i == NumBuckets-1 ? (qint64) _maxNsecs : _bucketLimit(i);
+    }
+    return 0;
+}
+
+QVariantMap WriteHealth::report()
+{
+    QVariantMap r;
+    QVariantList histogram;
+    for (int i = 0; i < NumBuckets; i++)
+    {
+        if (!_buckets[i])
+            continue;
+        histogram.append(QVariantMap {
+            {"upToUs", i == NumBuckets-1 ? -1 : _bucketLimit(i) / 1000},
+            {"writes", (quint64) _buckets[i]}
+        });
+    }
+
+    quint64 writes = _writes;
+    quint64 stalls = 0;
+    for (int i = 0; i < NumBuckets; i++)
+    {
+        if (_bucketLimit(i) > (qint64) IMAGEWRITER_HEALTH_STALL_MS * 1000000)
+            stalls += _buckets[i];
+    }
+    r["writes"] = writes;
+    r["latencyHistogram"] = histogram;
+    r["averageLatencyMs"] = writes ? _totalNsecs / 1000000.0 / writes : 0.0;
+    r["p50LatencyMs"] = _percentile(0.5) / 1000000.0;
+    r["p99LatencyMs"] = _percentile(0.99) / 1000000.0;
+    r["maxLatencyMs"] = _maxNsecs / 1000000.0;
+    r["stalls"] = stalls;
+
+    QStringList reasons;
+    if (stalls >= IMAGEWRITER_HEALTH_MAX_STALLS)
+        reasons.append(QString("%1 writes took longer than %2 ms").arg(stalls).arg(IMAGEWRITER_HEALTH_STALL_MS));
+
+    std::lock_guard<std::mutex> lock(_samplesMutex);
+    if (_samples.size() >= 2)
+    {
+        const Sample &first = _samples.constFirst(), &last = _samples.constLast();
+        qint64 msecs = last.msecs - first.msecs;
+        r["sampleSeconds"] = msecs / 1000.0;
+
+        if (first.stats.valid && last.stats.valid && msecs > 0)
+        {
+            quint64 maxInFlight = 0;
+            for (const Sample &s : _samples)
+                maxInFlight = qMax(maxInFlight, s.stats.inFlight);
+            r["maxInFlight"] = maxInFlight;
+            r["deviceUtilization"] = qMin(1.0, (double) (last.stats.ioTicks - first.stats.ioTicks) / msecs);
+            quint64 deviceWrites = last.stats.writesCompleted - first.stats.writesCompleted;
+            if (deviceWrites)
+                r["deviceAverageWriteMs"] = (double) (last.stats.writeTicks - first.stats.writeTicks) / deviceWrites;
+        }
+
+        /* Speed of every sample interval. A card that keeps writing much slower
+           after a while has run out of real storage or of its fast cache */
+        QVector<double> speeds;
+        for (int i = 1; i < _samples.size(); i++)
+        {
+            qint64 dt = _samples[i].msecs - _samples[i-1].msecs;
+            if (dt > 0 && _samples[i].bytesWritten >= _samples[i-1].bytesWritten)
+                speeds.append((_samples[i].bytesWritten - _samples[i-1].bytesWritten) / 1000.0 / dt);
+        }
+        if (speeds.size() >= 8)
+        {
+            int quarter = speeds.size() / 4;
+            QVector<double> head(speeds.cbegin(), speeds.cbegin()+quarter), tail(speeds.cend()-quarter, speeds.cend());
+            std::sort(head.begin(), head.end());
+            std::sort(tail.begin(), tail.end());
+            double headMedian = head[quarter/2], tailMedian = tail[quarter/2];
+            r["startMBps"] = headMedian;
+            r["endMBps"] = tailMedian;
+            if (tailMedian * IMAGEWRITER_HEALTH_SLOWDOWN_FACTOR < headMedian)
+                reasons.append(QString("write speed dropped from %1 to %2 MB/s").arg(headMedian, 0, 'f', 1).arg(tailMedian, 0, 'f', 1));
+        }
+    }
+
+    r["suspicious"] = !reasons.isEmpty();
+    r["reasons"] = reasons;
+    return r;
+}
@@ -0,0 +1,72 @@
+#ifndef WRITEHEALTH_H
+#define WRITEHEALTH_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QtGlobal>
+#include <QElapsedTimer>
+#include <QVariantMap>
+#include <QVector>
+#include <atomic>
+#include <mutex>
+
+/*
+ * Write latency and I/O statistics of one storage device during a write
+ *
+ * Counterfeit and failing cards tend to write at full speed at first,
+ * and then stall for hundreds of milliseconds or seconds on some writes,
+ * or slow down for good from a certain point on. The time each write took
+ * is counted in power of two buckets, and the I/O statistics of the device
+ * are sampled every IMAGEWRITER_HEALTH_SAMPLE_INTERVAL ms. report() sums
+ * it up, and flags the card as suspicious if it showed either.
+ *
+ * With several writes in flight, the time of a write is from its submission
+ * to its completion, so it includes the time it was queued in the device.
+ */
+class WriteHealth
+{
+public:
+    /* Statistics of the block device, as far as the platform has them */
+    struct DeviceStats
+    {
+        bool valid;
+        quint64 writesCompleted, sectorsWritten;
+        /* Requests in flight, ms the device was busy and ms writes spent in it */
+        quint64 inFlight, ioTicks, writeTicks;
+    };
+
+    WriteHealth();
+    void reset();
+    /* Any thread */
+    void recordWrite(qint64 nsecs);
+    /* True once IMAGEWRITER_HEALTH_SAMPLE_INTERVAL ms have passed since the last sample */
+    bool sampleDue() const;
+    void addSample(const DeviceStats &stats, quint64 bytesWritten);
+    /* Histogram, percentiles, device utilization, and "suspicious" with the "reasons" */
+    QVariantMap report();
+
+protected:
+    /* Bucket i counts writes that took less than 64 us << i, the last one the rest */
+    static const int NumBuckets = 18;
+    std::atomic<quint64> _buckets[NumBuckets];
+    std::atomic<quint64> _maxNsecs, _totalNsecs, _writes;
+
+    struct Sample
+    {
+        qint64 msecs;
+        quint64 bytesWritten;
+        DeviceStats stats;
+    };
+    std::mutex _samplesMutex;
+    QVector<Sample> _samples;
+    QElapsedTimer _timer;
+    std::atomic<qint64> _nextSample;
+
+    static qint64 _bucketLimit(int bucket);
+    qint64 _percentile(double p);
+};
+
+#endif // WRITEHEALTH_H
@@ -1,6 +1,10 @@
 #include "writeinplacethread.h"
 #include "archive.h"
 #include "config.h"
+#include "bootfilecache.h"
+#include "chunkedhash.h"
+#include "logging.h"
+#include <QSet>
 
 WriteInPlaceThread::WriteInPlaceThread(
     const QByteArray &url,
@@ -15,28 +19,27 @@ WriteInPlaceThread::WriteInPlaceThread(
 
 void WriteInPlaceThread::run()
 {
-    QScopedPointer<PriviligedProcess> bootpProc{};
-    auto cacheDir = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    PriviligedProcess* bootpProc{nullptr};
+    QString bootDir;
 
-    auto startSimpBootp = [this, &bootpProc, &cacheDir]()
+    // simpbootp is kept running between jobs, see PriviligedProcess::acquireSession()
+    auto startSimpBootp = [this, &bootpProc, &bootDir]() -> bool
     {
-        bootpProc.reset(new PriviligedProcess);
-        if(false == bootpProc->startCommunicationChannel("SimpbootpCommChannel"))
-        {
-            emit error(tr("Error comm start with simpbootp server"));
-            return;
-        }
-
+        QStringList args;
 #if defined(Q_OS_UNIX)
         QString simpbootpBinaryPath;
         char* appimagedir = getenv("APPIMAGE");
         if(appimagedir)
         {
-            QString bupPath = QStandardPaths::writableLocation(QStandardPaths::TempLocation) + QDir::separator() + "GemImagerRelocated";
             // Beacause how appimage works we have to copy APPDIR to different directory for root user access
-            QProcess::execute("cp", QStringList() << "-r" << getenv("APPDIR") << bupPath);
+            QString bupPath = PriviligedProcess::relocatedAppDir(getenv("APPDIR"));
+            if(bupPath.isEmpty())
+            {
+                emit error("Simpbootp binary not found. Probably package corrupted!");
+                return false;
+            }
             simpbootpBinaryPath = bupPath + "/usr/bin/simpbootp";
-            qDebug() << "binarypath: " << simpbootpBinaryPath;
+            qCDebug(lcUniflash) << "binarypath: " << simpbootpBinaryPath;
         }
         else if(QFile::exists("./simpbootp"))
         {
@@ -44,24 +47,37 @@ void WriteInPlaceThread::run()
         }
         else
         {
-            qDebug() << "simpbootp bulunamadi";
+            qCDebug(lcUniflash) << "simpbootp bulunamadi";
             emit error("Simpbootp binary not found. Probably package corrupted!");
-            return;
+            return false;
         }
 
-        bootpProc->setArguments(
-            QStringList() << simpbootpBinaryPath
-            << "--interface" << _selEthPort
-            << "--single-run" << "tiboot3.bin"
-            << "--target-directory" << cacheDir
-        );
+        args << simpbootpBinaryPath
+             << "--interface" << _selEthPort
+             << "--single-run" << "tiboot3.bin"
+             << "--target-directory" << bootDir;
 #elif defined(Q_OS_WIN)
     QString simpbootCommand = QString("powershell.exe -WindowStyle Hidden -ArgumentList \"-ExecutionPolicy Bypass \
-                            -Command `\"./simpbootp.exe --interface Ethernet  --target-directory %1 --single-run tiboot3.bin`\"\" -Verb RunAs").arg(cacheDir);
+                            -Command `\"./simpbootp.exe --interface Ethernet  --target-directory %1 --single-run tiboot3.bin`\"\" -Verb RunAs").arg(bootDir);
 
-    bootpProc->setArguments(QStringList() << simpbootCommand);
+    args << simpbootCommand;
 #endif
-        bootpProc->start();
+        bootpProc = PriviligedProcess::acquireSession(args, "SimpbootpCommChannel");
+        if(bootpProc == nullptr)
+        {
+            emit error(tr("Error comm start with simpbootp server"));
+            return false;
+        }
+
+        // one kept from an earlier job still has the settings of that one
+        if(bootpProc->isConnected() && false == bootpProc->startJob(bootDir))
+        {
+            PriviligedProcess::releaseSession(bootpProc);
+            bootpProc = nullptr;
+            emit error(tr("Error connecting Simpbootp server"));
+            return false;
+        }
+        return true;
     };
 
     if(_boardName.isEmpty())
@@ -70,146 +86,211 @@ void WriteInPlaceThread::run()
         return;
     }
 
-    // Downlaod boot files
+    // Boot files are kept across runs, and only downloaded if they changed
     emit preparationStatusUpdate("Downloading boot files");
 
-    QString fileUrl{BOOTIMG_URL};
-    QVector<DownloadThread*> dlThreads{};
-    QByteArray tiboot3Path = (cacheDir + QDir::separator() + "tiboot3.bin").toUtf8();
-    QByteArray emmcBootPath = (cacheDir + QDir::separator() + "texas_am67_sbl_emmcboot.release.hs_fs.tiimage").toUtf8();
-    QByteArray linuxAppimagePath = (cacheDir + QDir::separator() + "linux.appimage.hs_fs").toUtf8();
-    QByteArray ubootImgPath = (cacheDir + QDir::separator() + "u-boot.img").toUtf8();
-    QByteArray imageFilePath = (cacheDir + QDir::separator() + _filename).toUtf8();
-
-    dlThreads.reserve(3);
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "texas_am67_sbl_gemboot.release.hs_fs.tiimage").toUtf8(), tiboot3Path , 0, true));
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "texas_am67_sbl_emmcboot.release.hs_fs.tiimage").toUtf8(), emmcBootPath, 0, true));
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "linux.appimage.hs_fs").toUtf8(), linuxAppimagePath, 0, true));
-    dlThreads.append(new DownloadThread(fileUrl.arg(_boardName, "u-boot.img").toUtf8(), ubootImgPath, 0, true));
-
-    QObject::connect(dlThreads.last(), &DownloadThread::preparationStatusUpdate, this, &WriteInPlaceThread::preparationStatusUpdate);
-    QObject::connect(dlThreads.last(), &DownloadThread::updateNumProgress, this, &WriteInPlaceThread::updateNumProgress);
-
-    for(auto& thread: dlThreads)
-    {
-        thread->start();
-    }
-
-    auto deleteBootFiles = QScopeGuard{[tiboot3Path, emmcBootPath, linuxAppimagePath, ubootImgPath]()
-        {
-            QFile::remove(tiboot3Path);
-            QFile::remove(emmcBootPath);
-            QFile::remove(linuxAppimagePath);
-            QFile::remove(ubootImgPath);
-        }
+    BootFileCache bootFiles(_boardName, "uniflash");
+    QMap<QString, QByteArray> hashes = bootFiles.hashes();
+    QList<BootFileCache::File> files{
+        {"texas_am67_sbl_gemboot.release.hs_fs.tiimage", "tiboot3.bin", {}},
+        {"texas_am67_sbl_emmcboot.release.hs_fs.tiimage", "texas_am67_sbl_emmcboot.release.hs_fs.tiimage", {}},
+        {"linux.appimage.hs_fs", "linux.appimage.hs_fs", {}},
+        {"u-boot.img", "u-boot.img", {}},
     };
-
-    for(auto& thread: dlThreads)
-    {
-        if(false == thread->wait(10000))
-        {
-            emit error("Timeout while downloading boot files!");
-            for(auto& killthread: dlThreads)
-            {
-                killthread->terminate();
-                killthread->deleteLater();
-            }
-            return;
-        }
-    }
-
-    dlThreads.last()->disconnect();
-
-    for(auto& thread: dlThreads)
+    for(auto& file: files)
     {
-        thread->deleteLater();
+        file.sha256 = hashes.value(file.remoteName);
     }
 
-    startSimpBootp();
+    // simpbootp serves the boot files and the image from the cache directory
+    bootDir = bootFiles.directory();
+    QByteArray linuxAppimagePath = bootFiles.path("linux.appimage.hs_fs").toUtf8();
+    QByteArray ubootImgPath = bootFiles.path("u-boot.img").toUtf8();
+    QByteArray imageFilePath = bootFiles.path(_filename).toUtf8();
 
-    if(!QFile::exists(tiboot3Path) || !QFile::exists(linuxAppimagePath) || !QFile::exists(ubootImgPath))
-    {
-        emit error("Failed downloading boot files!");
-        return;
-    }
+    // The boot files, the helper and the image are all fetched and started at once, and each step
+    // below only waits for what it uses: the ROM stage for tiboot3.bin and the helper, the SBL for
+    // the XMODEM files, and only U-Boot, which fetches the image, for the image
+    bootFiles.startFetch(files);
 
     DownloadExtractThread* th{ new DownloadExtractThread(_url, imageFilePath, _expectedHash) };
     bool isDownExtrSuccess{true};
 
-    auto cleanup = QScopeGuard{[th, &bootpProc, imageFilePath]()
+    auto cleanup = QScopeGuard{[this, th, &bootpProc, imageFilePath]()
     {
-        if(false == bootpProc->sendMessage("quit")) qDebug() << "send quit failed!";
-        if(false == bootpProc->waitForFinished(3000))
+        if (bootpProc)
         {
-            bootpProc->kill();
-            bootpProc->waitForFinished(1000);
+            // the board gets an error instead of waiting for the rest of the image
+            if (_cancelled && bootpProc->isConnected())
+            {
+                bootpProc->sendCommand(SimpbootpIpc::CancelJob);
+            }
+
+            // stays up for the next board, unless it is no longer connected
+            PriviligedProcess::releaseSession(bootpProc);
         }
 
         if (th)
         {
-            th->terminate();
+            th->cancelDownload();
+            th->wait();
             th->deleteLater();
         }
         QFile::remove(imageFilePath);
     }};
 
-    QEventLoop loop;
-    emit preparationStatusUpdate("Downloading image");
+    QEventLoop loop, extractLoop;
     QObject::connect(th, &DownloadExtractThread::updateNumProgress, this, [this](QVariant pos)
     {
-        qDebug() << "updateNumProgress()" << pos;
+        qCTrace(lcUniflash) << "updateNumProgress()" << pos;
         emit this->updateNumProgress(pos);
     });
 
     QObject::connect(th, &DownloadExtractThread::preparationStatusUpdate, this, [this](QString msg)
     {
-        qDebug() << "preparationStatusUpdate()" << msg;
+        qCDebug(lcUniflash) << "preparationStatusUpdate()" << msg;
         emit this->preparationStatusUpdate(msg);
     });
 
-    QObject::connect(th, &DownloadExtractThread::success, &loop, &QEventLoop::quit);
-    QObject::connect(th, &DownloadExtractThread::error, &loop, [&loop, &isDownExtrSuccess](QString err_msg)
+    bool isDownExtrDone{false};
+    // the image is announced to simpbootp, which is then told how far it can read it
+    bool imageStreamed{false};
+    QObject::connect(th, &DownloadExtractThread::success, &extractLoop, [&extractLoop, &isDownExtrDone, &imageStreamed, &bootpProc]()
     {
-        qDebug() << "Download extract failed: " << err_msg;
+        isDownExtrDone = true;
+        if(imageStreamed)
+        {
+            bootpProc->sendCommand(SimpbootpIpc::ImageComplete);
+        }
+        extractLoop.quit();
+    });
+    QObject::connect(th, &DownloadExtractThread::error, &extractLoop, [&loop, &extractLoop, &isDownExtrSuccess, &isDownExtrDone](QString err_msg)
+    {
+        qCDebug(lcUniflash) << "Download extract failed: " << err_msg;
         isDownExtrSuccess = false;
+        isDownExtrDone = true;
+        extractLoop.quit();
         loop.quit();
     });
+    QObject::connect(this, &WriteInPlaceThread::cancelRequested, &extractLoop, &QEventLoop::quit);
+
+    // with the final size known up front, simpbootp can serve the image while it is still written
+    bool streaming{_imageSize > 0};
+    quint64 streamedBytes{0};
+    QObject::connect(th, &DownloadThread::streamableBytesChanged, &loop, [th, &imageStreamed, &isDownExtrDone, &streamedBytes, &bootpProc]()
+    {
+        // queued, so only the latest value is sent
+        quint64 bytes = th->streamableBytes();
+        if(imageStreamed && false == isDownExtrDone && bytes > streamedBytes)
+        {
+            streamedBytes = bytes;
+            bootpProc->sendCommand(SimpbootpIpc::ImageWritten, SimpbootpIpc::number(bytes));
+        }
+    });
 
     th->setVerifyEnabled(_verifyEnabled);
     th->setUserAgent(QString("Mozilla/5.0 gem-imager/%1").arg("1.0").toUtf8());
     th->setImageCustomization(_config, _cmdline, _firstrun, _cloudinit, _cloudinitNetwork, _geminit, _initFormat, _destination);
-
+    th->setStreamingOutputEnabled(streaming);
     th->start();
-    loop.exec();
 
-    if(!isDownExtrSuccess)
+    // simpbootp serves tiboot3.bin to the ROM as soon as it is up
+    if(false == bootFiles.waitFor("tiboot3.bin"))
+    {
+        qCDebug(lcUniflash) << bootFiles.errorString();
+        emit error("Failed downloading boot files!");
+        return;
+    }
+
+    if(false == startSimpBootp())
     {
-        emit error(tr("Download extract failed!"));
         return;
     }
 
     emit preparationStatusUpdate("The board is awaiting to boot");
 
-    if(false == bootpProc->waitForCommunicationChannelReady())
+    // waits in slices, so that a cancel is not held up by the board
+    QElapsedTimer waited;
+    waited.start();
+    bool channelReady{false};
+    while(false == _cancelled && waited.elapsed() < 10000
+          && false == (channelReady = bootpProc->waitForCommunicationChannelReady(100)))
+    {
+    }
+
+    if(_cancelled)
+    {
+        emit error(tr("Process cancelled by user. Please power cycle the board before retrying!"));
+        return;
+    }
+
+    if(false == channelReady)
     {
         emit error(tr("Error connecting Simpbootp server"));
         return;
     }
 
-    if(false == bootpProc->checkValue("isSblUartReady", "ok"))
+    if(_partSize > 0 && false == bootpProc->request(SimpbootpIpc::SetPartSize, SimpbootpIpc::number(_partSize)))
     {
-        if(false == bootpProc->sendMessage("notifyFileSend")) qDebug() << "notify set send failed!";
-        auto resp = bootpProc->recvMessage(10000);
+        emit error(tr("Error connecting Simpbootp server"));
+        return;
+    }
 
-        if(resp != "tiboot3.bin")
+    // the link takes a moment to come back after the change. Not every NIC does jumbo frames, they are only faster
+    if(_linkMtu > 0 && false == bootpProc->request(SimpbootpIpc::SetMtu, SimpbootpIpc::number(_linkMtu), 10000))
+    {
+        qCDebug(lcUniflash) << "MTU" << _linkMtu << "not set, staying at the current one";
+    }
+
+    if(streaming)
+    {
+        imageStreamed = bootpProc->request(SimpbootpIpc::ImageStream, SimpbootpIpc::number(_imageSize));
+        if(imageStreamed && isDownExtrDone)
         {
-            qDebug() << "SBL Uart is not ready but no reason to exit here. filename: " << resp;
+            bootpProc->sendCommand(SimpbootpIpc::ImageComplete);
+        }
+        else if(imageStreamed)
+        {
+            bootpProc->sendCommand(SimpbootpIpc::ImageWritten, SimpbootpIpc::number(th->streamableBytes()));
+        }
+        else
+        {
+            qCDebug(lcUniflash) << "image stream announcement failed! serving it once downloaded";
         }
     }
 
+    waited.restart();
+    bool sblStarted{false};
+    while(false == _cancelled && waited.elapsed() < 10000 && bootpProc->isConnected()
+          && false == (sblStarted = bootpProc->waitForFileSent("tiboot3.bin", 100)))
+    {
+    }
+
+    if(false == sblStarted && false == _cancelled)
+    {
+        qCDebug(lcUniflash) << "SBL Uart is not ready but no reason to exit here";
+    }
+
+    // the transfer thread notices the cancel within a tenth of a second
+    auto stopTransfer = [](Transfer* transfer)
+    {
+        transfer->disconnect();
+        transfer->cancel();
+        transfer->wait();
+        transfer->deleteLater();
+    };
+
+    if(false == bootFiles.waitFor("linux.appimage.hs_fs"))
+    {
+        qCDebug(lcUniflash) << bootFiles.errorString();
+        emit error("Failed downloading boot files!");
+        return;
+    }
+
     Transfer* transferInstance{ new Transfer(_selSerPort, _serPortbaudRate, _filename) };
-    if(false == transferInstance->setSerialPortAndConfigure(_selSerPort, UNIFLASH_BAUD_RATE))
+    if(false == transferInstance->setSerialPortAndConfigure(_selSerPort, _serPortbaudRate))
     {
+        stopTransfer(transferInstance);
         emit error(tr("Error starting communication with board"));
         return;
     }
@@ -217,64 +298,161 @@ void WriteInPlaceThread::run()
     sendFileViaXModem(transferInstance, linuxAppimagePath);
     if(false == waitForSendFileViaXModemCompleted(transferInstance))
     {
+        stopTransfer(transferInstance);
         emit error(tr("Error sending file with XMODEM: ") + tr(_lastErrorString.toUtf8()));
         return;
     }
 
-    transferInstance->terminate();
-    transferInstance->wait(1000);
-    transferInstance->deleteLater();
+    stopTransfer(transferInstance);
+
+    if(false == bootFiles.waitFor("u-boot.img") || false == bootFiles.waitFor("texas_am67_sbl_emmcboot.release.hs_fs.tiimage"))
+    {
+        qCDebug(lcUniflash) << bootFiles.errorString();
+        emit error("Failed downloading boot files!");
+        return;
+    }
+
+    // U-Boot fetches the image right after it starts, so it has to be complete, unless simpbootp streams it
+    if(false == imageStreamed && false == isDownExtrDone && false == _cancelled)
+    {
+        emit preparationStatusUpdate("Downloading image");
+        extractLoop.exec();
+    }
+
+    if(!isDownExtrSuccess)
+    {
+        emit error(tr("Download extract failed!"));
+        return;
+    }
+
+    if(_cancelled)
+    {
+        emit error(tr("Process cancelled by user. Please power cycle the board before retrying!"));
+        return;
+    }
 
     transferInstance =  new Transfer(_selSerPort, _serPortbaudRate, _filename);
-    if(false == transferInstance->setSerialPortAndConfigure(_selSerPort, UNIFLASH_BAUD_RATE))
+    if(false == transferInstance->setSerialPortAndConfigure(_selSerPort, _serPortbaudRate))
     {
+        stopTransfer(transferInstance);
         emit error(tr("Error starting communication with board"));
         return;
     }
 
-    bootpProc->sendMessage("1000MB");
+    if(false == bootpProc->request(SimpbootpIpc::SetSpeed, SimpbootpIpc::number(1000), 10000)) qCDebug(lcUniflash) << "set speed 1000MB failed!";
 
     sendFileViaXModem(transferInstance, ubootImgPath);
     if(false == waitForSendFileViaXModemCompleted(transferInstance))
     {
+        stopTransfer(transferInstance);
         emit error(tr("Error sending file with XMODEM: ") + tr(_lastErrorString.toUtf8()));
         return;
     }
 
-    transferInstance->terminate();
-    transferInstance->wait(1000);
-    transferInstance->deleteLater();
+    stopTransfer(transferInstance);
 
-    QTimer progressTimer;
     bool imageSendFailed{false};
 
-    progressTimer.setInterval(1000);
-    progressTimer.callOnTimeout([this, &progressTimer, &bootpProc, &loop, &imageSendFailed](){
-        auto status_str = bootpProc->getValue("isFileTransferOk");
-        if(status_str == "nok")
+    // simpbootp reports progress of the parts uniflash<N> as the board fetches them
+    QObject::connect(bootpProc, &PriviligedProcess::progressChanged, &loop, [this, &loop](QByteArray name, float progress)
+    {
+        if(false == name.startsWith("uniflash"))
         {
-            imageSendFailed = true;
-            loop.quit();
+            return;
         }
 
-        auto progress_str = bootpProc->getValue("getFileSendProgress");
-        float progress = progress_str.toFloat();
         updateNumProgress(progress);
-
         if(progress >= 1.0)
         {
             loop.quit();
         }
+    });
+    QObject::connect(bootpProc, &PriviligedProcess::transferFailed, &loop, [&loop, &imageSendFailed](QByteArray name)
+    {
+        if(name.startsWith("uniflash"))
+        {
+            imageSendFailed = true;
+            loop.quit();
+        }
+    });
+    QObject::connect(bootpProc, &PriviligedProcess::disconnected, &loop, [&loop, &imageSendFailed]()
+    {
+        qCDebug(lcUniflash) << "simpbootp closed the connection";
+        imageSendFailed = true;
+        loop.quit();
+    });
+    QObject::connect(this, &WriteInPlaceThread::cancelRequested, &loop, &QEventLoop::quit);
+
+    // boards that check what they wrote put the hashes of every part after writing it, see UNIFLASH_HASH_SUFFIX.
+    // A mismatch stops the transfer
+    QSet<int> partsSent, partsVerified;
+    QString verifyError;
+    QEventLoop verifyLoop;
+    QObject::connect(bootpProc, &PriviligedProcess::fileSent, &loop, [&partsSent](QByteArray name)
+    {
+        bool isPart{false};
+        int part = name.mid(strlen("uniflash")).toInt(&isPart);
+        if(name.startsWith("uniflash") && isPart)
+        {
+            partsSent.insert(part);
+        }
+    });
+    QObject::connect(bootpProc, &PriviligedProcess::fileReceived, &loop, [&](QByteArray name, QByteArray contents)
+    {
+        if(false == _verifyEnabled || false == verifyError.isEmpty())
+        {
+            return;
+        }
 
-        if(_cancelled)
+        int part = name.mid(strlen("uniflash"), name.size() - strlen("uniflash") - strlen(UNIFLASH_HASH_SUFFIX)).toInt();
+        verifyError = verifyPart(imageFilePath, part, contents);
+        if(false == verifyError.isEmpty())
         {
             loop.quit();
+            verifyLoop.quit();
+            return;
+        }
+
+        qCDebug(lcUniflash) << "board verified part" << part;
+        partsVerified.insert(part);
+        if(partsVerified.contains(partsSent))
+        {
+            verifyLoop.quit();
         }
     });
 
-    progressTimer.start();
+    // from here on progress is that of the board receiving the image
+    QObject::disconnect(th, &DownloadExtractThread::updateNumProgress, this, nullptr);
     emit updateNumProgress(QVariant{0.0});
-    loop.exec();
+    if(isDownExtrSuccess && false == _cancelled)
+    {
+        loop.exec();
+    }
+
+    if(!isDownExtrSuccess)
+    {
+        if(imageStreamed) bootpProc->sendCommand(SimpbootpIpc::ImageFailed);
+        emit error(tr("Download extract failed!"));
+        return;
+    }
+
+    if(false == isDownExtrDone && false == _cancelled && false == imageSendFailed && verifyError.isEmpty())
+    {
+        // board has it all, the extractor may still be verifying
+        extractLoop.exec();
+        if(!isDownExtrSuccess)
+        {
+            emit error(tr("Download extract failed!"));
+            return;
+        }
+    }
+
+    if(false == verifyError.isEmpty())
+    {
+        bootpProc->sendCommand(SimpbootpIpc::CancelJob);
+        emit error(verifyError);
+        return;
+    }
 
     if(imageSendFailed)
     {
@@ -288,14 +466,111 @@ void WriteInPlaceThread::run()
         return;
     }
 
+    if(_verifyEnabled && partsVerified.isEmpty())
+    {
+        qCDebug(lcUniflash) << "the board did not put hashes of what it wrote, image is not verified";
+    }
+    else if(_verifyEnabled && false == partsVerified.contains(partsSent))
+    {
+        // the board checks a part after writing it, the hashes of the last ones are still to come
+        emit preparationStatusUpdate(tr("Waiting for the board to verify the image"));
+        QTimer::singleShot(UNIFLASH_VERIFY_TIMEOUT, &verifyLoop, &QEventLoop::quit);
+        QObject::connect(this, &WriteInPlaceThread::cancelRequested, &verifyLoop, &QEventLoop::quit);
+        QObject::connect(bootpProc, &PriviligedProcess::disconnected, &verifyLoop, &QEventLoop::quit);
+        verifyLoop.exec();
+
+        if(false == verifyError.isEmpty())
+        {
+            emit error(verifyError);
+            return;
+        }
+        if(_cancelled)
+        {
+            emit error(tr("Process cancelled by user. Please power cycle the board before retrying!"));
+            return;
+        }
+        if(false == partsVerified.contains(partsSent))
+        {
+            emit error(tr("The board did not report the hashes of all parts of the image it wrote"));
+            return;
+        }
+    }
+
     emit success();
 }
 
+QString WriteInPlaceThread::verifyPart(const QString& imagePath, int part, const QByteArray& hashes)
+{
+    QFile f(imagePath);
+    if(false == f.open(QIODevice::ReadOnly))
+    {
+        return tr("Error opening the image to verify the board: %1").arg(f.errorString());
+    }
+
+    // split the way simpbootp does, by the final size of an image that is still being written
+    qint64 imageSize = (_imageSize > 0) ? (qint64)_imageSize : f.size();
+    qint64 partSize = (_partSize > 0) ? (qint64)_partSize : imageSize / 10;
+    qint64 offset = part * partSize;
+    qint64 len = qBound((qint64)0, imageSize - offset, partSize);
+    int chunks = (len + UNIFLASH_HASH_CHUNK_SIZE - 1) / UNIFLASH_HASH_CHUNK_SIZE;
+    int leafSize = ChunkedHash::leafSize(ChunkedHash::Sha256);
+
+    if(len <= 0 || hashes.size() != chunks * leafSize)
+    {
+        return tr("The board reported %1 bytes of hashes for part %2 of the image, instead of %3")
+            .arg(hashes.size()).arg(part).arg(chunks * leafSize);
+    }
+
+    QByteArray buf(UNIFLASH_HASH_CHUNK_SIZE, Qt::Uninitialized);
+    f.seek(offset);
+    for(int i = 0; i < chunks; i++)
+    {
+        qint64 n = qMin(len - (qint64)i * UNIFLASH_HASH_CHUNK_SIZE, (qint64)UNIFLASH_HASH_CHUNK_SIZE);
+        if(f.read(buf.data(), n) != n)
+        {
+            return tr("Error reading the image to verify the board: %1").arg(f.errorString());
+        }
+        if(ChunkedHash::hash(buf.constData(), n) != hashes.mid(i * leafSize, leafSize))
+        {
+            return tr("Verifying write failed. Contents of the board's eMMC at offset %1 differ from the image")
+                .arg(offset + (qint64)i * UNIFLASH_HASH_CHUNK_SIZE);
+        }
+    }
+
+    return QString();
+}
+
+void WriteInPlaceThread::cancelDownload()
+{
+    DownloadExtractThread::cancelDownload();
+    emit cancelRequested();
+}
+
+void WriteInPlaceThread::setImageSize(quint64 size)
+{
+    _imageSize = size;
+}
+
+void WriteInPlaceThread::setPartSize(quint64 size)
+{
+    _partSize = size;
+}
+
+void WriteInPlaceThread::setLinkMtu(int mtu)
+{
+    _linkMtu = mtu;
+}
+
 void WriteInPlaceThread::setSerPortbaudRate(uint32_t newSerPortbaudRate)
 {
     _serPortbaudRate = newSerPortbaudRate;
 }
 
+void WriteInPlaceThread::setMaxSerPortBaudRate(uint32_t baudRate)
+{
+    _maxSerPortBaudRate = baudRate;
+}
+
 void WriteInPlaceThread::setPortNames(QString selectedSerialPort, QString selectedEthernetPort)
 {
     _selSerPort = selectedSerialPort;
@@ -310,7 +585,7 @@ bool WriteInPlaceThread::waitForSendFileViaXModemCompleted(Transfer* transferIns
     timer.setInterval(timeout);
     timer.callOnTimeout([&loop, &result]()
     {
-        qDebug() << "waitForSendFileViaXModemCompleted timeout";
+        qCDebug(lcUniflash) << "waitForSendFileViaXModemCompleted timeout";
         result = false;
         loop.quit();
     });
@@ -318,10 +593,21 @@ bool WriteInPlaceThread::waitForSendFileViaXModemCompleted(Transfer* transferIns
     QObject::connect(transferInstance, &Transfer::transferCompleted, &loop, &QEventLoop::quit);
     QObject::connect(transferInstance, &Transfer::transferFailed, &loop, [&loop, &result](QString err)
     {
-        qDebug() << err;
+        qCDebug(lcUniflash) << err;
         result = false;
         loop.quit();
     });
+    QObject::connect(this, &WriteInPlaceThread::cancelRequested, &loop, [this, &loop, &result]()
+    {
+        _lastErrorString = "Cancelled";
+        result = false;
+        loop.quit();
+    });
+    if(_cancelled)
+    {
+        _lastErrorString = "Cancelled";
+        return false;
+    }
     timer.start();
     loop.exec();
     timer.stop();
@@ -331,6 +617,9 @@ bool WriteInPlaceThread::waitForSendFileViaXModemCompleted(Transfer* transferIns
 
 void WriteInPlaceThread::sendFileViaXModem(Transfer* transferInstance, const QString& filePath){
     transferInstance->setPkcsPadding(true);
+    // the SBL takes 1 KB packets, an eighth of the round trips of plain XMODEM
+    transferInstance->setProtocol(Transfer::Protocol::Xmodem1K);
+    transferInstance->setMaxBaudrate(_maxSerPortBaudRate);
     transferInstance->setFilePath(filePath);
     _isSendFileViaXModemCompleted = false;
 
@@ -21,7 +21,17 @@ public:
     ~WriteInPlaceThread();
     void setPortNames(QString selectedSerialPort, QString selectedEthernetPort);
     void setSerPortbaudRate(uint32_t newSerPortbaudRate);
+    // highest rate the board can switch the serial port to after the SBL handshake, 0 to keep the one set above
+    void setMaxSerPortBaudRate(uint32_t baudRate);
+    // extracted size of the image. If known, the board is served the image while it downloads
+    void setImageSize(quint64 size);
+    // size of the parts the board fetches the image in, 0 for a tenth of the image
+    void setPartSize(quint64 size);
+    // MTU for the Ethernet port, 0 to leave it. Jumbo frames let TFTP send larger blocks
+    void setLinkMtu(int mtu);
     void run() override;
+    // also stops waiting for the board
+    void cancelDownload() override;
     bool waitForSendFileViaXModemCompleted(Transfer* transferInstance, uint32_t timeout = 50000);
     void sendFileViaXModem(Transfer* transfer, const QString& filePath);
 
@@ -29,11 +39,21 @@ private:
     _extractServeThreadClass *_extractThread;
     QString _selSerPort, _selEthPort;
     uint32_t _serPortbaudRate{UNIFLASH_BAUD_RATE};
+    uint32_t _maxSerPortBaudRate{0};
+    quint64 _imageSize{0};
+    quint64 _partSize{0};
+    int _linkMtu{0};
     bool _isSendFileViaXModemCompleted{false};
     bool _isSendFileViaXModemCompletedSuccessfull{false};
     QByteArray _boardName;
     QString _lastErrorString;
 
+    // checks the hashes the board put for a part against the image. Returns what does not match, empty if all does
+    QString verifyPart(const QString& imagePath, int part, const QByteArray& hashes);
+
+signals:
+    void cancelRequested();
+
 private slots:
     void updateProgress(float progress); //Values [0.0 1.0]
     void onTransferCompleted();
@@ -0,0 +1,75 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include "writejournal.h"
+#include "metadataindex.h"
+#include <QCryptographicHash>
+#include <QDebug>
+#include <QDir>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QStandardPaths>
+
+#define WRITEJOURNAL_TABLE  "writejournal"
+
+WriteJournal::WriteJournal()
+    : driveSize(0), offset(0)
+{
+}
+
+QString WriteJournal::fileName(const QByteArray &drive)
+{
+    /* Drive names can contain anything, such as the slashes of device paths */
+    return QStandardPaths::writableLocation(QStandardPaths::CacheLocation)+QDir::separator()+"writejournal-"
+            +QCryptographicHash::hash(drive, QCryptographicHash::Sha256).toHex().left(16)+".json";
+}
+
+bool WriteJournal::load(const QByteArray &drive)
+{
+    QJsonObject obj = MetadataIndex::instance().value(WRITEJOURNAL_TABLE, drive);
+    QFile f(fileName(drive));
+    if (obj.isEmpty() && f.open(QIODevice::ReadOnly))
+    {
+        /* Moved into the index by the next checkpoint */
+        obj = QJsonDocument::fromJson(f.readAll()).object();
+        f.close();
+    }
+    this->drive = obj.value("drive").toString().toLatin1();
+    driveSize = obj.value("drive_size").toString().toULongLong();
+    image = obj.value("image").toString().toLatin1();
+    offset = obj.value("offset").toString().toULongLong();
+    tailHash = QByteArray::fromHex(obj.value("tail_hash").toString().toLatin1());
+
+    return this->drive == drive && offset && !tailHash.isEmpty();
+}
+
+bool WriteJournal::save() const
+{
+    /* 64-bit values are stored as strings, as JSON numbers are doubles */
+    QJsonObject obj;
+    obj["drive"] = QString::fromLatin1(drive);
+    obj["drive_size"] = QString::number(driveSize);
+    obj["image"] = QString::fromLatin1(image);
+    obj["offset"] = QString::number(offset);
+    obj["tail_hash"] = QString::fromLatin1(tailHash.toHex());
+
+    /* A crash leaves either the old or the new checkpoint */
+    if (!MetadataIndex::instance().put(WRITEJOURNAL_TABLE, drive, obj))
+    {
+        qDebug() << "Error writing write journal of" << drive;
+        return false;
+    }
+    QFile::remove(fileName(drive));
+
+    return true;
+}
+
+void WriteJournal::remove(const QByteArray &drive)
+{
+    if (MetadataIndex::instance().contains(WRITEJOURNAL_TABLE, drive))
+        MetadataIndex::instance().remove(WRITEJOURNAL_TABLE, drive);
+    QFile::remove(fileName(drive));
+}
@@ -0,0 +1,46 @@
+#ifndef WRITEJOURNAL_H
+#define WRITEJOURNAL_H
+
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ * Copyright (C) 2024 Raspberry Pi Ltd
+ */
+
+#include <QByteArray>
+#include <QString>
+
+/*
+ * Progress record of an image being written to a drive
+ *
+ * Kept in the MetadataIndex while writing, by drive. Each checkpoint
+ * is taken once the data before it has been synced to the drive, so a write
+ * that was interrupted (card reader reset, drive pulled, crash) can continue
+ * there when the same image is written to the same drive again, instead of
+ * starting over. The hash of the data just before the checkpoint, read back
+ * from the drive, tells that it still has what was written.
+ */
+class WriteJournal
+{
+public:
+    WriteJournal();
+
+    /* Journal file in the cache directory, of older versions.
+       drive: what identifies the drive, see DownloadThread::_driveId() */
+    static QString fileName(const QByteArray &drive);
+
+    bool load(const QByteArray &drive);
+    bool save() const;
+    static void remove(const QByteArray &drive);
+
+    QByteArray drive;
+    quint64 driveSize;
+    /* SHA256 of the extracted image */
+    QByteArray image;
+    /* Bytes at the start of the image that are on the drive. The first
+       block is not, it is always written last */
+    quint64 offset;
+    /* ChunkedHash::hash() of the IMAGEWRITER_WRITE_JOURNAL_TAIL bytes before offset */
+    QByteArray tailHash;
+};
+
+#endif // WRITEJOURNAL_H
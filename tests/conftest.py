@@ -1,5 +1,7 @@
 import pytest
 import json
+import os
+import shutil
 import urllib.request
 
 os_list_files = []
@@ -23,6 +25,47 @@ def pytest_addoption(parser):
         default="",
         help="(Loop) device if you want to perform actual image write tests"
     )
+    parser.addoption(
+        "--perf",
+        action="store_true",
+        help="Run the write performance tests on loop and NBD devices (requires root)"
+    )
+    parser.addoption(
+        "--loop-tests",
+        action="store_true",
+        help="Run the tests that write to loop and device-mapper devices they set up themselves (requires root)"
+    )
+    parser.addoption(
+        "--perf-image-size",
+        action="store",
+        type=int,
+        default=256,
+        help="Size in MB of the reference images written by the performance tests"
+    )
+    parser.addoption(
+        "--perf-nbd-latency",
+        action="store",
+        default="2ms",
+        help="Write latency nbdkit adds to every request of the NBD device, to imitate cheap SD cards"
+    )
+    parser.addoption(
+        "--perf-baseline",
+        action="store",
+        default="perf_baseline.json",
+        help="File with the MB/s and phase times performance tests are compared against"
+    )
+    parser.addoption(
+        "--perf-tolerance",
+        action="store",
+        type=float,
+        default=0.2,
+        help="How much slower than the baseline a performance test may be, as a fraction"
+    )
+    parser.addoption(
+        "--update-perf-baseline",
+        action="store_true",
+        help="Store the results of the performance tests as the new baseline instead of comparing"
+    )
 
 def parse_json_entries(j):
     global total_download_size, largest_extract_size
@@ -72,6 +115,9 @@ def parse_os_list(url):
         print("Error processing '{}': {}".format(url, repr(err) ))
 
 def pytest_configure(config):
+    if config.getoption("--perf") or config.getoption("--loop-tests"):
+        # Performance and loop device tests use images of their own
+        return
     parse_os_list(config.getoption("--repo"))
     print("Found {} os_list.json files {} OS images {} icons {} website URLs".format( 
         len(os_list_files), len(item_json), len(icon_urls), len(website_urls) ) )
@@ -88,3 +134,16 @@ def pytest_generate_tests(metafunc):
         metafunc.parametrize("websiteurl", website_urls)
     if "imageitem" in metafunc.fixturenames:
         metafunc.parametrize("imageitem", item_json)
+
+
+@pytest.fixture(scope="session")
+def loop_tests(request):
+    if not request.config.getoption("--loop-tests"):
+        pytest.skip("--loop-tests not specified. Skipping loop device tests")
+    if os.geteuid() != 0:
+        pytest.skip("Loop device tests need root to set up loop and device-mapper devices")
+    for tool in ["gem-imager", "losetup"]:
+        if not shutil.which(tool):
+            pytest.skip("{} not found in PATH".format(tool))
+
+    return request.config
@@ -0,0 +1,122 @@
+import pytest
+import hashlib
+import json
+import os
+import shutil
+import subprocess
+
+MB = 1024 * 1024
+
+# What the fake cards claim, and what they have
+CLAIMED_MB = 512
+REAL_MB = 64
+
+
+def shell(cmd):
+    return subprocess.run(cmd, check=True, capture_output=True, text=True).stdout.strip()
+
+
+def run_write(image, device):
+    """Runs a CLI write with --json-progress. Returns the error messages"""
+    proc = subprocess.run(["gem-imager", "--cli", "--json-progress", "--disable-eject", "--disable-verify",
+                           "--enable-writing-system-drives", image, device], capture_output=True, text=True)
+    events = [json.loads(line) for line in proc.stdout.splitlines() if line.startswith("{")]
+    errors = [e["message"] for e in events if e["event"] == "error"]
+    if proc.returncode != 0 and not errors:
+        errors.append(proc.stderr[-2000:])
+
+    return errors
+
+
+def device_sha256(device, size_mb):
+    sha256 = hashlib.sha256()
+    fd = os.open(device, os.O_RDONLY)
+    try:
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+        for _ in range(size_mb):
+            sha256.update(os.read(fd, MB))
+    finally:
+        os.close(fd)
+
+    return sha256.hexdigest()
+
+
+@pytest.fixture(scope="session")
+def image(loop_tests, tmp_path_factory):
+    if not shutil.which("dmsetup"):
+        pytest.skip("dmsetup not found in PATH")
+    path = str(tmp_path_factory.mktemp("capacity") / "image.img")
+    with open(path, "wb") as f:
+        f.write(os.urandom(4 * MB))
+
+    return path
+
+
+@pytest.fixture
+def backing_device(loop_tests, tmp_path):
+    """Loop device of the size the fake cards really have, filled with random data"""
+    backing = str(tmp_path / "loopfile")
+    with open(backing, "wb") as f:
+        for _ in range(REAL_MB):
+            f.write(os.urandom(MB))
+
+    device = shell(["losetup", "--find", "--show", backing])
+    yield device
+
+    subprocess.run(["losetup", "--detach", device])
+
+
+def make_fake(name, table):
+    shell(["dmsetup", "create", name, "--table", "\n".join(table)])
+    return "/dev/mapper/" + name
+
+
+@pytest.fixture
+def wrapping_device(backing_device):
+    """Claims CLAIMED_MB, and wraps around onto the start every REAL_MB, like a card that ignores the high address lines"""
+    sectors = REAL_MB * MB // 512
+    device = make_fake("gem-imager-wrapping", ["{} {} linear {} 0".format(i * sectors, sectors, backing_device)
+                                               for i in range(CLAIMED_MB // REAL_MB)])
+    yield device
+
+    subprocess.run(["dmsetup", "remove", device])
+
+
+@pytest.fixture
+def dropping_device(backing_device):
+    """Claims CLAIMED_MB, and drops writes beyond REAL_MB, reading back zeroes there"""
+    sectors = REAL_MB * MB // 512
+    device = make_fake("gem-imager-dropping", ["0 {} linear {} 0".format(sectors, backing_device),
+                                               "{} {} zero".format(sectors, CLAIMED_MB * MB // 512 - sectors)])
+    yield device
+
+    subprocess.run(["dmsetup", "remove", device])
+
+
+def test_capacity_probe_catches_wrapping_card(image, backing_device, wrapping_device):
+    before = device_sha256(backing_device, REAL_MB)
+
+    errors = run_write(image, wrapping_device)
+    assert any("counterfeit" in e for e in errors), errors
+    # Nothing but the probe was written, and it put back what was there
+    assert device_sha256(backing_device, REAL_MB) == before
+
+
+def test_capacity_probe_catches_dropping_card(image, backing_device, dropping_device):
+    before = device_sha256(backing_device, REAL_MB)
+
+    errors = run_write(image, dropping_device)
+    assert any("counterfeit" in e for e in errors), errors
+    assert device_sha256(backing_device, REAL_MB) == before
+
+
+def test_capacity_probe_passes_real_card(image, tmp_path):
+    backing = str(tmp_path / "loopfile")
+    with open(backing, "wb") as f:
+        f.truncate(CLAIMED_MB * MB)
+    device = shell(["losetup", "--find", "--show", backing])
+
+    try:
+        assert run_write(image, device) == []
+    finally:
+        subprocess.run(["losetup", "--detach", device])
@@ -0,0 +1,314 @@
+import pytest
+import hashlib
+import json
+import os
+import random
+import shutil
+import subprocess
+import time
+import zipfile
+
+MB = 1024 * 1024
+SECTOR = 512
+
+# mkfs command and MBR partition type of each boot partition file system
+BOOT_FILESYSTEMS = {
+    "fat12": (["mkfs.fat", "-F", "12"], "1", 8),
+    "fat16": (["mkfs.fat", "-F", "16"], "e", 32),
+    "fat32": (["mkfs.fat", "-F", "32", "-s", "1"], "c", 64),
+    "exfat": (["mkfs.exfat"], "7", 32),
+}
+
+CMDLINE = "console=serial0,115200 console=tty1 root=/dev/mmcblk0p2 rootwait"
+
+FSCK = {
+    "vfat": ["fsck.fat", "-n"],
+    "exfat": ["fsck.exfat", "-n"],
+    "ext4": ["e2fsck", "-f", "-n"],
+}
+
+
+def shell(cmd, **kwargs):
+    return subprocess.run(cmd, check=True, capture_output=True, text=True, **kwargs).stdout.strip()
+
+
+def need(*tools):
+    for tool in tools:
+        if not shutil.which(tool):
+            pytest.skip("{} not found in PATH".format(tool))
+
+
+def run_write(args):
+    """Runs a CLI write with --json-progress, and fails the test if it does not succeed"""
+    proc = subprocess.run(["gem-imager", "--cli", "--json-progress", "--disable-eject",
+                           "--enable-writing-system-drives"] + args, capture_output=True, text=True)
+    events = [json.loads(line) for line in proc.stdout.splitlines() if line.startswith("{")]
+    errors = [e["message"] for e in events if e["event"] == "error"]
+    if proc.returncode != 0 or errors:
+        pytest.fail("Write failed with exit code {}: {} {}".format(proc.returncode, errors, proc.stderr[-2000:]), False)
+
+
+def fsck(partition, fstype):
+    proc = subprocess.run(FSCK[fstype] + [partition], capture_output=True, text=True)
+    assert proc.returncode == 0, "{} of {} found errors: {}".format(FSCK[fstype][0], partition, proc.stdout[-2000:])
+
+
+def partitions(device):
+    return json.loads(shell(["sfdisk", "--json", device]))["partitiontable"]
+
+
+def sha256_of(path, size=None):
+    sha256 = hashlib.sha256()
+    with open(path, "rb") as f:
+        left = size if size is not None else os.path.getsize(path)
+        while left:
+            block = f.read(min(left, MB))
+            sha256.update(block)
+            left -= len(block)
+
+    return sha256.hexdigest()
+
+
+def read_files(directory):
+    """Hash of each file by name. FAT names are compared without case"""
+    return {name.lower(): sha256_of(os.path.join(directory, name)) for name in sorted(os.listdir(directory))
+            if os.path.isfile(os.path.join(directory, name))}
+
+
+class LoopDevice:
+    """Loop device with partition scanning, on a file of its own or an existing one"""
+
+    def __init__(self, backing, size_mb=None):
+        if size_mb is not None:
+            with open(backing, "wb") as f:
+                f.truncate(size_mb * MB)
+        self.device = shell(["losetup", "--find", "--show", "--partscan", backing])
+
+    def partition(self, nr):
+        node = "{}p{}".format(self.device, nr)
+        for _ in range(50):
+            if os.path.exists(node):
+                return node
+            time.sleep(0.1)
+        pytest.fail("{} did not show up".format(node), False)
+
+    def reread(self):
+        """After the image is written over it, the kernel has to pick up its partition table"""
+        shell(["blockdev", "--flushbufs", "--rereadpt", self.device])
+
+    def detach(self):
+        subprocess.run(["losetup", "--detach", self.device])
+
+
+class Mount:
+    def __init__(self, partition, path, readonly=False):
+        self.path = str(path)
+        os.makedirs(self.path, exist_ok=True)
+        proc = subprocess.run(["mount"] + (["-o", "ro"] if readonly else []) + [partition, self.path],
+                              capture_output=True, text=True)
+        if proc.returncode != 0:
+            pytest.skip("Cannot mount {}: {}".format(partition, proc.stderr.strip()))
+
+    def __enter__(self):
+        return self.path
+
+    def __exit__(self, *args):
+        shell(["umount", self.path])
+
+
+def make_image(path, label, layout, size_mb):
+    """Partitions an image file with sfdisk. layout is a list of (size in MB or None for the rest, type)"""
+    with open(path, "wb") as f:
+        f.truncate(size_mb * MB)
+
+    script = "label: {}\n".format(label)
+    for size, parttype in layout:
+        script += "size={}MiB, type={}\n".format(size, parttype) if size else "type={}\n".format(parttype)
+    shell(["sfdisk", "--quiet", path], input=script)
+
+
+def fill_fragmented(directory, rnd):
+    """Files of all sizes, with every other one removed again, so free space is in gaps"""
+    files = []
+    for i in range(64):
+        name = os.path.join(directory, "FILL{:03d}.BIN".format(i))
+        with open(name, "wb") as f:
+            f.write(rnd.randbytes(rnd.choice([100, 4096, 5000, 70000])))
+        files.append(name)
+    for name in files[::2]:
+        os.remove(name)
+
+
+def write_junk_and_remove(directory, size_mb, rnd):
+    """Leaves random data behind in the free space of the file system"""
+    name = os.path.join(directory, "junk")
+    with open(name, "wb") as f:
+        for _ in range(size_mb):
+            f.write(rnd.randbytes(MB))
+    shell(["sync"])
+    os.remove(name)
+
+
+@pytest.fixture
+def target(loop_tests, tmp_path):
+    """Drive the images are written to"""
+    need("sfdisk", "blockdev")
+    loop = LoopDevice(str(tmp_path / "target"), 256)
+    yield loop
+
+    loop.detach()
+
+
+@pytest.mark.parametrize("cmdline", [CMDLINE, ""], ids=["cmdline", "empty-cmdline"])
+@pytest.mark.parametrize("instream", [False, True], ids=["after", "instream"])
+@pytest.mark.parametrize("fs", list(BOOT_FILESYSTEMS))
+def test_customize_boot_partition(target, tmp_path, fs, instream, cmdline):
+    """Writes firstrun.sh and changes cmdline.txt through DeviceWrapperFatPartition, on a boot
+       partition with fragmented free space. An empty cmdline.txt has no clusters at all"""
+    mkfs, parttype, size_mb = BOOT_FILESYSTEMS[fs]
+    fstype = "exfat" if fs == "exfat" else "vfat"
+    need("sfdisk", mkfs[0], FSCK[fstype][0])
+    rnd = random.Random(fs)
+
+    image = str(tmp_path / "image.img")
+    make_image(image, "dos", [(size_mb, parttype)], size_mb + 8)
+    loop = LoopDevice(image)
+    try:
+        shell(mkfs + [loop.partition(1)])
+        with Mount(loop.partition(1), tmp_path / "boot") as boot:
+            with open(os.path.join(boot, "cmdline.txt"), "w") as f:
+                f.write(cmdline + "\n" if cmdline else "")
+            with open(os.path.join(boot, "config.txt"), "w") as f:
+                f.write("dtparam=audio=on\n")
+            fill_fragmented(boot, rnd)
+            expected = read_files(boot)
+    finally:
+        loop.detach()
+
+    # Several clusters long, so it needs more than one of the gaps
+    script = str(tmp_path / "firstrun.sh")
+    with open(script, "w") as f:
+        f.write("#!/bin/bash\n" + "".join("# line {} of the first run script\n".format(i) for i in range(4000)))
+
+    run_write((["--instream-customize"] if instream else []) + ["--first-run-script", script, image, target.device])
+    target.reread()
+
+    fsck(target.partition(1), fstype)
+    with Mount(target.partition(1), tmp_path / "written", readonly=True) as boot:
+        written = read_files(boot)
+        with open(os.path.join(boot, "cmdline.txt")) as f:
+            written_cmdline = f.read()
+
+    assert written.pop("firstrun.sh") == sha256_of(script)
+    assert "systemd.run=/boot/firstrun.sh" in written_cmdline
+    assert written_cmdline.strip().startswith(cmdline)
+    del written["cmdline.txt"], expected["cmdline.txt"]
+    assert written == expected
+
+
+@pytest.mark.parametrize("userspace", [False, True], ids=["mounted", "userspace"])
+def test_format_and_extract_multiple_files(target, tmp_path, userspace):
+    """A zip of several files has the drive formatted as FAT32 by DriveFormatThread, and extracted onto it"""
+    need("sfdisk", "fsck.fat")
+    rnd = random.Random(37)
+
+    files = {"kernel.img": rnd.randbytes(6 * MB), "bootcode.bin": rnd.randbytes(52000),
+             "config.txt": b"arm_64bit=1\n", "empty.dat": bytes(MB)}
+    archive = str(tmp_path / "files.zip")
+    with zipfile.ZipFile(archive, "w", zipfile.ZIP_DEFLATED) as z:
+        for name, data in files.items():
+            z.writestr(name, data)
+
+    run_write((["--userspace-extract"] if userspace else []) + [archive, target.device])
+    target.reread()
+
+    table = partitions(target.device)
+    assert table["label"] == "dos"
+    assert len(table["partitions"]) == 1
+    assert table["partitions"][0]["start"] == 4 * MB // SECTOR
+    assert table["partitions"][0]["type"] == "c"
+
+    fsck(target.partition(1), "vfat")
+    with Mount(target.partition(1), tmp_path / "written", readonly=True) as boot:
+        assert read_files(boot) == {name: hashlib.sha256(data).hexdigest() for name, data in files.items()}
+
+
+def test_sparse_write_leaves_out_free_space(target, tmp_path):
+    """With --sparse-write and no bmap, FilesystemBlockMap finds the free space of the FAT and ext4
+       partitions, which then is not written. The file systems must come out intact all the same"""
+    need("sfdisk", "mkfs.fat", "fsck.fat", "mke2fs", "e2fsck")
+    rnd = random.Random(143)
+
+    image = str(tmp_path / "image.img")
+    make_image(image, "dos", [(64, "c"), (None, "83")], 192)
+    loop = LoopDevice(image)
+    expected = {}
+    try:
+        shell(["mkfs.fat", "-F", "32", "-s", "1", loop.partition(1)])
+        shell(["mke2fs", "-q", "-t", "ext4", loop.partition(2)])
+        for nr in [1, 2]:
+            with Mount(loop.partition(nr), tmp_path / "p{}".format(nr)) as mountpoint:
+                write_junk_and_remove(mountpoint, 24, rnd)
+                for i in range(8):
+                    with open(os.path.join(mountpoint, "file{}".format(i)), "wb") as f:
+                        f.write(rnd.randbytes(rnd.randrange(1, 3 * MB)))
+                expected[nr] = read_files(mountpoint)
+    finally:
+        loop.detach()
+
+    run_write(["--sparse-write", "--sha256", sha256_of(image), image, target.device])
+    target.reread()
+
+    # The junk in the free space was left out
+    assert sha256_of(target.device, os.path.getsize(image)) != sha256_of(image)
+
+    fsck(target.partition(1), "vfat")
+    fsck(target.partition(2), "ext4")
+    for nr in [1, 2]:
+        with Mount(target.partition(nr), tmp_path / "written{}".format(nr), readonly=True) as mountpoint:
+            assert read_files(mountpoint) == expected[nr]
+
+
+@pytest.mark.parametrize("label", ["dos", "gpt"])
+def test_expand_root(target, tmp_path, label):
+    """--expand-root grows the last partition to the end of the drive, and moves the backup GPT there"""
+    need("sfdisk", "mkfs.fat", "fsck.fat", "mke2fs", "e2fsck", "resize2fs")
+
+    image = str(tmp_path / "image.img")
+    if label == "dos":
+        make_image(image, label, [(32, "e"), (None, "83")], 96)
+    else:
+        make_image(image, label, [(32, "U"), (None, "L")], 96)
+    loop = LoopDevice(image)
+    try:
+        shell(["mkfs.fat", "-F", "16", loop.partition(1)])
+        shell(["mke2fs", "-q", "-t", "ext4", loop.partition(2)])
+        with Mount(loop.partition(2), tmp_path / "root") as root:
+            with open(os.path.join(root, "data"), "wb") as f:
+                f.write(random.Random(114).randbytes(8 * MB))
+            expected = read_files(root)
+    finally:
+        loop.detach()
+
+    run_write(["--expand-root", image, target.device])
+    target.reread()
+
+    # sfdisk checks the backup GPT header and its entries at the end of the drive too
+    shell(["sfdisk", "--verify", target.device])
+    table = partitions(target.device)
+    device_sectors = 256 * MB // SECTOR
+    last = table["partitions"][-1]
+    if label == "gpt":
+        # Backup entries and header take the last 33 sectors
+        assert table["lastlba"] == device_sectors - 34
+        assert last["start"] + last["size"] == (device_sectors - 33) // 2048 * 2048
+    else:
+        assert last["start"] + last["size"] == device_sectors
+
+    fsck(target.partition(1), "vfat")
+    fsck(target.partition(2), "ext4")
+    # The file system is not grown, but it can be in the grown partition
+    shell(["resize2fs", target.partition(2)])
+    fsck(target.partition(2), "ext4")
+    with Mount(target.partition(2), tmp_path / "written", readonly=True) as root:
+        assert read_files(root) == expected
@@ -0,0 +1,240 @@
+import pytest
+import bz2
+import glob
+import gzip
+import hashlib
+import http.server
+import json
+import lzma
+import os
+import random
+import shutil
+import subprocess
+import threading
+import time
+import zipfile
+from functools import partial
+
+# Formats of the reference images. zst needs the zstd tool
+FORMATS = ["img", "gz", "xz", "bz2", "zst", "zip"]
+
+# Where the image comes from: local file, downloaded over HTTP into the cache, or from the cache
+SOURCES = ["local", "download", "cached"]
+
+results = {}
+
+
+def shell(cmd):
+    subprocess.run(cmd, check=True, capture_output=True)
+
+
+def make_reference_image(path, size_mb):
+    """Mix of incompressible data, zero runs and repeating text, like an OS image"""
+    rnd = random.Random(size_mb)
+    text = b"".join(b"/usr/lib/python3/dist-packages/module%d.py\n" % i for i in range(1000))
+    sha256 = hashlib.sha256()
+
+    with open(path, "wb") as f:
+        for mb in range(size_mb):
+            kind = mb % 4
+            if kind == 0:
+                block = rnd.randbytes(1024 * 1024)
+            elif kind == 1:
+                block = bytes(1024 * 1024)
+            else:
+                block = (text * (1024 * 1024 // len(text) + 1))[:1024 * 1024]
+            f.write(block)
+            sha256.update(block)
+
+    return sha256.hexdigest()
+
+
+def compress(src, fmt):
+    if fmt == "img":
+        return src
+
+    dst = src[:-len(".img")] + "." + fmt
+    if os.path.exists(dst):
+        return dst
+
+    if fmt == "zst":
+        if not shutil.which("zstd"):
+            pytest.skip("zstd not installed")
+        shell(["zstd", "-q", "-T0", "-o", dst, src])
+    elif fmt == "zip":
+        with zipfile.ZipFile(dst, "w", zipfile.ZIP_DEFLATED) as z:
+            z.write(src, os.path.basename(src))
+    else:
+        opener = {"gz": gzip.open, "xz": lzma.open, "bz2": bz2.open}[fmt]
+        with open(src, "rb") as fin, opener(dst, "wb") as fout:
+            shutil.copyfileobj(fin, fout, 1024 * 1024)
+
+    return dst
+
+
+def drop_from_page_cache(path):
+    fd = os.open(path, os.O_RDONLY)
+    try:
+        os.posix_fadvise(fd, 0, 0, os.POSIX_FADV_DONTNEED)
+    finally:
+        os.close(fd)
+
+
+def run_write(args):
+    """Runs a CLI write with --json-progress. Returns total seconds and seconds per phase"""
+    proc = subprocess.run(["gem-imager", "--cli", "--json-progress", "--disable-eject",
+                           "--enable-writing-system-drives"] + args, capture_output=True, text=True)
+    events = [json.loads(line) for line in proc.stdout.splitlines() if line.startswith("{")]
+    errors = [e["message"] for e in events if e["event"] == "error"]
+    if proc.returncode != 0 or errors:
+        pytest.fail("Write failed with exit code {}: {} {}".format(proc.returncode, errors, proc.stderr[-2000:]), False)
+
+    phases = {}
+    for e in events:
+        if e["event"] == "phaseEnd":
+            phases[e["phase"]] = phases.get(e["phase"], 0) + e["seconds"]
+
+    return events[-1]["time"], phases
+
+
+@pytest.fixture(scope="session")
+def perf(request):
+    if not request.config.getoption("--perf"):
+        pytest.skip("--perf not specified. Skipping performance tests")
+    if os.geteuid() != 0:
+        pytest.skip("Performance tests need root to set up loop and NBD devices")
+    if not shutil.which("gem-imager"):
+        pytest.skip("gem-imager not found in PATH")
+
+    return request.config
+
+
+@pytest.fixture(scope="session")
+def workdir(perf, tmp_path_factory):
+    return tmp_path_factory.mktemp("perf")
+
+
+@pytest.fixture(scope="session")
+def reference_image(perf, workdir):
+    path = str(workdir / "reference.img")
+    sha256 = make_reference_image(path, perf.getoption("--perf-image-size"))
+
+    return path, sha256
+
+
+@pytest.fixture(scope="session")
+def http_url(workdir):
+    """Serves the work directory over HTTP, for the download and cache code paths"""
+    handler = partial(http.server.SimpleHTTPRequestHandler, directory=str(workdir))
+    handler.log_message = lambda *args: None
+    server = http.server.ThreadingHTTPServer(("127.0.0.1", 0), handler)
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+
+    yield "http://127.0.0.1:{}/".format(server.server_port)
+
+    server.shutdown()
+
+
+@pytest.fixture(scope="session")
+def loop_device(perf, workdir):
+    backing = str(workdir / "loopfile")
+    with open(backing, "wb") as f:
+        f.truncate((perf.getoption("--perf-image-size") + 64) * 1024 * 1024)
+
+    device = subprocess.run(["losetup", "--find", "--show", backing], check=True, capture_output=True, text=True).stdout.strip()
+    yield device
+
+    subprocess.run(["losetup", "--detach", device])
+
+
+@pytest.fixture(scope="session")
+def nbd_device(perf, workdir):
+    """Memory backed NBD device with latency added to every write, like a cheap SD card"""
+    if not shutil.which("nbdkit") or not shutil.which("nbd-client"):
+        pytest.skip("nbdkit and nbd-client are needed for NBD tests")
+    subprocess.run(["modprobe", "nbd"], capture_output=True)
+
+    free = [d for d in sorted(glob.glob("/sys/block/nbd*")) if open(d + "/size").read().strip() == "0"]
+    if not free:
+        pytest.skip("No free NBD device")
+    device = "/dev/" + os.path.basename(free[0])
+
+    socket = str(workdir / "nbd.sock")
+    pidfile = str(workdir / "nbdkit.pid")
+    size = "{}M".format(perf.getoption("--perf-image-size") + 64)
+    latency = perf.getoption("--perf-nbd-latency")
+    shell(["nbdkit", "-P", pidfile, "-U", socket, "--filter=delay", "memory", "size=" + size, "wdelay=" + latency])
+    shell(["nbd-client", "-unix", socket, device])
+
+    yield device
+
+    subprocess.run(["nbd-client", "-d", device], capture_output=True)
+    with open(pidfile) as f:
+        os.kill(int(f.read()), 15)
+
+
+@pytest.fixture(scope="session")
+def baseline(perf):
+    path = perf.getoption("--perf-baseline")
+    stored = {}
+    if os.path.exists(path):
+        with open(path) as f:
+            stored = json.load(f)
+
+    yield stored
+
+    if perf.getoption("--update-perf-baseline") and results:
+        stored.update(results)
+        with open(path, "w") as f:
+            json.dump(stored, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+
+@pytest.mark.parametrize("verify", [True, False], ids=["verify", "noverify"])
+@pytest.mark.parametrize("source", SOURCES)
+@pytest.mark.parametrize("fmt", FORMATS)
+@pytest.mark.parametrize("devicetype", ["loop", "nbd"])
+def test_write_performance(request, perf, baseline, reference_image, http_url, devicetype, fmt, source, verify):
+    device = request.getfixturevalue(devicetype + "_device")
+    src, sha256 = reference_image
+    image = compress(src, fmt)
+    imagesize = os.path.getsize(src)
+    cachefile = "{}.{}.cache".format(src, fmt)
+
+    args = [] if verify else ["--disable-verify"]
+    if source == "local":
+        target = image
+    else:
+        target = http_url + os.path.basename(image)
+        args += ["--sha256", sha256, "--cache-file", cachefile]
+        if source == "download" and os.path.exists(cachefile):
+            os.remove(cachefile)
+        elif source == "cached" and not os.path.exists(cachefile):
+            # Fill the cache first, untimed
+            run_write(args + ["--disable-verify", target, device])
+
+    drop_from_page_cache(image)
+    if os.path.exists(cachefile):
+        drop_from_page_cache(cachefile)
+
+    seconds, phases = run_write(args + [target, device])
+    result = {"MBps": round(imagesize / 1000000 / seconds, 1), "phases": {p: round(s, 2) for p, s in phases.items()}}
+    key = "{}-{}-{}-{}".format(devicetype, fmt, source, "verify" if verify else "noverify")
+    results[key] = result
+    print("{}: {} MB/s, phases {}".format(key, result["MBps"], result["phases"]))
+
+    if perf.getoption("--update-perf-baseline"):
+        return
+    if key not in baseline:
+        pytest.skip("No baseline for {}. Record one with --update-perf-baseline".format(key))
+
+    tolerance = perf.getoption("--perf-tolerance")
+    expected = baseline[key]
+    assert result["MBps"] >= expected["MBps"] * (1 - tolerance), \
+        "{}: {} MB/s, baseline {} MB/s".format(key, result["MBps"], expected["MBps"])
+    for phase, budget in expected["phases"].items():
+        # Short phases are dominated by noise. Allow half a second on top
+        took = phases.get(phase, 0)
+        assert took <= budget * (1 + tolerance) + 0.5, \
+            "{}: {} phase took {:.2f} seconds, baseline {:.2f}".format(key, phase, took, budget)